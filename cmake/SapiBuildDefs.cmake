@@ -18,15 +18,31 @@
 # NAMESPACE is the C++ namespace the generated code is placed in. Can be empty.
 # SOURCES is a list of files that should be embedded. If a source names a
 #   target the target binary is embedded instead.
+# INCBIN makes the assembler include the files, instead of compiling them as
+#   string literals. Much faster to build for large files, needs a
+#   GNU-compatible assembler.
+# COMPRESS compresses the files, EmbedFile decompresses them into memory when
+#   they are first used. Cannot be combined with INCBIN.
 macro(sapi_cc_embed_data)
-  cmake_parse_arguments(_sapi_embed "" "NAME;NAMESPACE" "SOURCES" ${ARGN})
+  cmake_parse_arguments(_sapi_embed "INCBIN;COMPRESS" "NAME;NAMESPACE"
+                        "SOURCES" ${ARGN})
+  set(_sapi_embed_in)
   foreach(src IN LISTS _sapi_embed_SOURCES)
     if(TARGET "${src}")
       list(APPEND _sapi_embed_in "${CMAKE_CURRENT_BINARY_DIR}/${src}")
     else()
-      list(APPEND _sapi_embed_in "${src}")
+      # Absolute, as the assembler runs in a different directory.
+      get_filename_component(_sapi_embed_src "${src}" ABSOLUTE)
+      list(APPEND _sapi_embed_in "${_sapi_embed_src}")
     endif()
   endforeach()
+  set(_sapi_embed_opts)
+  if(_sapi_embed_INCBIN)
+    list(APPEND _sapi_embed_opts "--incbin")
+  endif()
+  if(_sapi_embed_COMPRESS)
+    list(APPEND _sapi_embed_opts "--compress")
+  endif()
   file(RELATIVE_PATH _sapi_embed_pkg
                      "${PROJECT_BINARY_DIR}"
                      "${CMAKE_CURRENT_BINARY_DIR}")
@@ -34,7 +50,8 @@ macro(sapi_cc_embed_data)
     OUTPUT "${_sapi_embed_NAME}.h"
            "${_sapi_embed_NAME}.cc"
     WORKING_DIRECTORY "${CMAKE_CURRENT_SOURCE_DIR}"
-    COMMAND filewrapper "${_sapi_embed_pkg}"
+    COMMAND filewrapper ${_sapi_embed_opts}
+                        "${_sapi_embed_pkg}"
                         "${_sapi_embed_NAME}"
                         "${_sapi_embed_NAMESPACE}"
                         "${CMAKE_CURRENT_BINARY_DIR}/${_sapi_embed_NAME}.h"
@@ -78,9 +95,25 @@ endmacro()
 #   LIBRARY_NAME into.
 # HEADER If set, does not generate an interface header, but uses the one
 #   specified.
+# PGO_GENERATE Builds LIBRARY and the sandboxed binary instrumented for
+#   profile-guided optimization. The sandboxee writes its profile to the given
+#   directory at exit, if the host runs with --sapi_profile_dir set to the same
+#   directory.
+# PGO_USE Builds LIBRARY and the sandboxed binary with the given profile (the
+#   PGO_GENERATE directory for GCC, the merged .profdata file for Clang) and
+#   link-time optimization.
+# HEAP_PROFILING Links the sandboxed binary with the heap profiler, see
+#   Sandbox::GetHeapProfile(), and builds LIBRARY with frame pointers for its
+#   stack traces.
+#
+# A PGO build takes two configure runs: one with PGO_GENERATE, after which a
+# representative workload (e.g. a benchmark) runs through the sandbox, and one
+# with PGO_USE. Both options modify the compile options of LIBRARY, so it should
+# not be linked into host code as well.
 function(add_sapi_library)
-  set(_sapi_opts NOEMBED)
-  set(_sapi_one_value HEADER LIBRARY LIBRARY_NAME NAMESPACE)
+  set(_sapi_opts NOEMBED HEAP_PROFILING)
+  set(_sapi_one_value HEADER LIBRARY LIBRARY_NAME NAMESPACE PGO_GENERATE
+                      PGO_USE)
   set(_sapi_multi_value SOURCES FUNCTIONS INPUTS)
   cmake_parse_arguments(_sapi
                         "${_sapi_opts}"
@@ -90,6 +123,8 @@ function(add_sapi_library)
   set(_sapi_NAME "${ARGV0}")
 
   set(_sapi_gen_header "${_sapi_NAME}.sapi.h")
+  # Native dispatch table of the sandboxee, see sandboxed_api/native_call.h
+  set(_sapi_gen_thunks "${_sapi_NAME}.sapi_thunks.cc")
   foreach(func IN LISTS _sapi_FUNCTIONS)
     list(APPEND _sapi_exported_funcs "-Wl,--export-dynamic-symbol,${func}")
   endforeach()
@@ -103,22 +138,52 @@ function(add_sapi_library)
   set(_sapi_force_cxx_linkage
     "${CMAKE_CURRENT_BINARY_DIR}/${_sapi_bin}_force_cxx_linkage.cc")
   file(WRITE "${_sapi_force_cxx_linkage}" "")
-  add_executable("${_sapi_bin}" "${_sapi_force_cxx_linkage}")
+  add_executable("${_sapi_bin}" "${_sapi_force_cxx_linkage}"
+                                "${_sapi_gen_thunks}")
   # TODO(cblichmann): Use target_link_options on CMake >= 3.13
   target_link_libraries("${_sapi_bin}" PRIVATE
     -fuse-ld=gold
     "${_sapi_LIBRARY}"
     sapi::client
+    sapi::native_call
     ${CMAKE_DL_LIBS}
     -Wl,-E
     ${_sapi_exported_funcs}
   )
 
+  if(_sapi_PGO_GENERATE AND _sapi_PGO_USE)
+    message(FATAL_ERROR "PGO_GENERATE and PGO_USE are mutually exclusive")
+  endif()
+  if(_sapi_PGO_GENERATE)
+    get_filename_component(_sapi_pgo_dir "${_sapi_PGO_GENERATE}" ABSOLUTE)
+    set(_sapi_pgo_opts "-fprofile-generate=${_sapi_pgo_dir}")
+  elseif(_sapi_PGO_USE)
+    get_filename_component(_sapi_pgo_profile "${_sapi_PGO_USE}" ABSOLUTE)
+    set(_sapi_pgo_opts "-fprofile-use=${_sapi_pgo_profile}")
+    if(CMAKE_CXX_COMPILER_ID STREQUAL "GNU")
+      # Counters of multi-threaded sandboxees may be slightly inconsistent
+      list(APPEND _sapi_pgo_opts -fprofile-correction)
+    endif()
+    set_target_properties("${_sapi_LIBRARY}" "${_sapi_bin}" PROPERTIES
+      INTERPROCEDURAL_OPTIMIZATION ON
+    )
+  endif()
+  if(_sapi_pgo_opts)
+    target_compile_options("${_sapi_LIBRARY}" PRIVATE ${_sapi_pgo_opts})
+    target_link_libraries("${_sapi_bin}" PRIVATE ${_sapi_pgo_opts})
+  endif()
+
+  if(_sapi_HEAP_PROFILING)
+    target_compile_options("${_sapi_LIBRARY}" PRIVATE -fno-omit-frame-pointer)
+    target_link_libraries("${_sapi_bin}" PRIVATE sapi::heap_profiler_malloc)
+  endif()
+
   if(NOT _sapi_NOEMBED)
     set(_sapi_embed "${_sapi_NAME}_embed")
     sapi_cc_embed_data(NAME "${_sapi_embed}"
       NAMESPACE "${_sapi_NAMESPACE}"
       SOURCES "${_sapi_bin}"
+      INCBIN
     )
   endif()
 
@@ -134,11 +199,12 @@ function(add_sapi_library)
     set(_sapi_embed_name "${_sapi_NAME}")
   endif()
   add_custom_command(
-    OUTPUT "${_sapi_gen_header}"
+    OUTPUT "${_sapi_gen_header}" "${_sapi_gen_thunks}"
     COMMAND "${Python3_EXECUTABLE}" -B
             "${SAPI_SOURCE_DIR}/sandboxed_api/tools/generator2/sapi_generator.py"
             "--sapi_name=${_sapi_LIBRARY_NAME}"
             "--sapi_out=${_sapi_gen_header}"
+            "--sapi_thunks_out=${_sapi_gen_thunks}"
             "--sapi_embed_dir=${_sapi_embed_dir}"
             "--sapi_embed_name=${_sapi_embed_name}"
             "--sapi_functions=${_sapi_funcs}"
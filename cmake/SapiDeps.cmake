@@ -67,9 +67,7 @@ endif()
 
 find_package(Libcap REQUIRED)
 find_package(Libffi REQUIRED)
-if(SAPI_ENABLE_EXAMPLES)
-  find_package(ZLIB REQUIRED)
-endif()
+find_package(ZLIB REQUIRED)
 
 if(CMAKE_VERSION VERSION_LESS "3.12")
   # Work around FindPythonInterp sometimes not preferring Python 3.
@@ -0,0 +1,67 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Annotations for the declarations of sandboxed library functions. The SAPI
+// generator uses them to pick the synchronization of pointer arguments, see
+// the Pointable overloads of the generated API functions:
+//
+//   int compress(SAPI_OUT uint8_t* dest, SAPI_INOUT size_t* dest_len,
+//                const uint8_t* source, size_t source_len);
+//
+// Pointers to const are treated as SAPI_IN already. Arrays of structs taken as
+// a pointer followed by their number get an overload taking an absl::Span of
+// the structs, which are copied in a single transfer, see sapi::v::RecordArray:
+//
+//   struct point { double x; double y; const char* label; };
+//   struct point_columns { const double* x; const double* y; };
+//
+//   int draw(SAPI_RECORDS const struct point* points, size_t npoints);
+//   double sum(SAPI_COLUMNS(struct point) const struct point_columns* columns,
+//              size_t npoints);
+//
+// The annotations expand to
+// nothing when not compiling with Clang, so the header can be included from C
+// and C++ library headers.
+
+#ifndef SANDBOXED_API_ANNOTATIONS_H_
+#define SANDBOXED_API_ANNOTATIONS_H_
+
+#if defined(__clang__)
+// Only read by the function, copied to the sandboxee before the call.
+#define SAPI_IN __attribute__((annotate("sapi_in")))
+// Only written by the function, copied back from the sandboxee after the call.
+#define SAPI_OUT __attribute__((annotate("sapi_out")))
+// Read and written by the function, copied in both directions.
+#define SAPI_INOUT __attribute__((annotate("sapi_inout")))
+// Array of structs, the next argument is their number. 'const char*' fields
+// are passed as strings, other pointer fields need SAPI_COUNTED_BY.
+#define SAPI_RECORDS __attribute__((annotate("sapi_records")))
+// Struct of arrays: the argument points to a struct holding a pointer per
+// column, named after the fields of 'record' they hold. The next argument is
+// the number of records.
+#define SAPI_COLUMNS(record) __attribute__((annotate("sapi_columns=" #record)))
+// On a pointer field of a struct: it points to the number of elements in the
+// field 'count' of the same struct.
+#define SAPI_COUNTED_BY(count) \
+  __attribute__((annotate("sapi_counted_by=" #count)))
+#else
+#define SAPI_IN
+#define SAPI_OUT
+#define SAPI_INOUT
+#define SAPI_RECORDS
+#define SAPI_COLUMNS(record)
+#define SAPI_COUNTED_BY(count)
+#endif
+
+#endif  // SANDBOXED_API_ANNOTATIONS_H_
@@ -28,6 +28,10 @@ def _sapi_cc_embed_data_impl(ctx):
             cc_file_artifact = output
 
     args = ctx.actions.args()
+    if ctx.attr.incbin:
+        args.add("--incbin")
+    if ctx.attr.compress:
+        args.add("--compress")
     args.add(ctx.label.package)
     args.add(ctx.attr.ident)
     args.add(ctx.attr.namespace if ctx.attr.namespace else "")
@@ -55,6 +59,8 @@ _sapi_cc_embed_data = rule(
         ),
         "namespace": attr.string(),
         "ident": attr.string(),
+        "incbin": attr.bool(),
+        "compress": attr.bool(),
         "_filewrapper": attr.label(
             executable = True,
             cfg = "host",
@@ -65,21 +71,37 @@ _sapi_cc_embed_data = rule(
     },
 )
 
-def sapi_cc_embed_data(name, srcs = [], namespace = "", **kwargs):
+def sapi_cc_embed_data(
+        name,
+        srcs = [],
+        namespace = "",
+        incbin = False,
+        compress = False,
+        **kwargs):
     """Embeds arbitrary binary data in cc_*() rules.
 
     Args:
       name: Name for this rule.
       srcs: A list of files to be embedded.
       namespace: C++ namespace to wrap the generated types in.
+      incbin: Whether the assembler includes the files, instead of compiling
+        them as string literals. Much faster to build for large files, needs
+        a GNU-compatible assembler.
+      compress: Whether to compress the files. EmbedFile decompresses them
+        into memory when they are first used. Smaller binaries for large
+        files, cannot be combined with incbin.
       **kwargs: extra arguments like testonly, visibility, etc.
     """
+    if incbin and compress:
+        fail("incbin and compress cannot be combined")
     embed_rule = "_%s_sapi" % name
     _sapi_cc_embed_data(
         name = embed_rule,
         srcs = srcs,
         namespace = namespace,
         ident = name,
+        incbin = incbin,
+        compress = compress,
         outs = [
             "%s.h" % name,
             "%s.cc" % name,
@@ -89,6 +111,8 @@ def sapi_cc_embed_data(name, srcs = [], namespace = "", **kwargs):
         name = name,
         hdrs = [":%s.h" % name],
         srcs = [":%s.cc" % name],
+        # Read by the assembler.
+        textual_hdrs = srcs if incbin else [],
         deps = [
             "@com_google_absl//absl/base:core_headers",
             "@com_google_absl//absl/strings",
@@ -18,6 +18,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <utility>
 #include <vector>
@@ -26,6 +27,7 @@
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_replace.h"
+#include "sandboxed_api/file_toc_compression.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/raw_logging.h"
@@ -123,6 +125,8 @@ struct FileToc {
   // Not actually used/computed by sapi_cc_embed_data(), this is for
   // compatibility with legacy code.
   unsigned char md5digest[16];
+  // Size of 'data' with --compress, 0 otherwise.
+  size_t compressed_size;
 };
 
 #endif  // SANDBOXED_API_FILE_TOC_H_
@@ -167,17 +171,37 @@ constexpr const char kCcDataBeginFmt[] =
 constexpr const char kCcDataEndFmt[] =
     R"(", %d};
 )";
+// With --incbin, the assembler includes the input files instead. The data is
+// page-aligned in a section of its own, so that it does not share pages with
+// other data and can be copied into a file by the kernel, see EmbedFile.
+constexpr const char kCcIncbinFmt[] =
+    R"fmt(asm(R"asm(
+  .pushsection .rodata.%1$s, "a", @progbits
+  .balign 4096
+  .globl %1$s
+  .hidden %1$s
+%1$s:
+  .incbin "%2$s"
+  .byte 0
+  .popsection
+)asm");
+extern "C" const char %1$s[];
+constexpr absl::string_view %3$s = {%1$s, %4$d};
+)fmt";
 constexpr const char kCcFileTocDefsBegin[] =
     R"(
 constexpr FileToc kToc[] = {
 )";
 constexpr const char kCcFileTocDefsEntryFmt[] =
-    R"(    {"%1$s", %2$s.data(), %2$s.size(), {}},
+    R"(    {"%1$s", %2$s.data(), %2$s.size(), {}, 0},
+)";
+constexpr const char kCcFileTocDefsCompressedEntryFmt[] =
+    R"(    {"%1$s", %2$s.data(), %3$d, {}, %2$s.size()},
 )";
 constexpr const char kCcFileTocDefsEndFmt[] =
     R"(
     // Terminate array
-    {nullptr, nullptr, 0, {}},
+    {nullptr, nullptr, 0, {}, 0},
 };
 
 const FileToc* %1$s_create() {
@@ -193,13 +217,58 @@ constexpr const char kCcNamespaceEndFmt[] =
 }  // namespace %s
 )";
 
+// Returns a C identifier made from 'name'.
+std::string ToIdentifier(std::string name) {
+  std::replace_if(
+      name.begin(), name.end(), [](char c) { return !absl::ascii_isalnum(c); },
+      '_');
+  return name;
+}
+
+// Reads all of a file.
+std::string ReadFile(const char* filename) {
+  File in(filename, "rb");
+  std::string contents;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in.get())) > 0) {
+    contents.append(buf, n);
+  }
+  in.Check();
+  return contents;
+}
+
+// Writes 'data' as a C string literal named 'ident'.
+void FWriteDataLiteral(const std::string& ident, const std::string& data,
+                       FILE* out) {
+  absl::FPrintF(out, kCcDataBeginFmt, ident);
+  for (char c : data) {
+    FWriteCEscapedC(static_cast<unsigned char>(c), out);
+  }
+  absl::FPrintF(out, kCcDataEndFmt, data.size());
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 7) {
+  const char* program = argv[0];
+  bool incbin = false;
+  bool compress = false;
+  for (; argc > 1; --argc, ++argv) {
+    if (strcmp(argv[1], "--incbin") == 0) {
+      incbin = true;
+    } else if (strcmp(argv[1], "--compress") == 0) {
+      compress = true;
+    } else {
+      break;
+    }
+  }
+  // Compressed data is always written as string literals.
+  if (argc < 7 || (incbin && compress)) {
     // We're not aiming for human usability here, as this tool is always run as
     // part of the build.
     absl::FPrintF(stderr,
-                  "%s PACKAGE NAME NAMESPACE OUTPUT_H OUTPUT_CC INPUT...\n",
-                  argv[0]);
+                  "%s [--incbin|--compress] PACKAGE NAME NAMESPACE OUTPUT_H "
+                  "OUTPUT_CC INPUT...\n",
+                  program);
     return EXIT_FAILURE;
   }
   char** arg = &argv[1];
@@ -217,10 +286,8 @@ int main(int argc, char* argv[]) {
   {  // Write header file first.
     File out_h(*arg++, "wb");
     --argc;
-    std::string header_guard = absl::StrFormat("%s_%s_H_", package, toc_ident);
-    std::replace_if(
-        header_guard.begin(), header_guard.end(),
-        [](char c) { return !absl::ascii_isalnum(c); }, '_');
+    std::string header_guard =
+        ToIdentifier(absl::StrFormat("%s_%s_H_", package, toc_ident));
     absl::FPrintF(out_h.get(), kHFileHeaderFmt, package, toc_ident,
                   header_guard);
     if (have_ns) {
@@ -248,33 +315,59 @@ int main(int argc, char* argv[]) {
     absl::FPrintF(out_cc.get(), kCcNamespaceBeginFmt, ns);
   }
 
-  std::vector<std::pair<std::string, std::string>> toc_entries;
+  struct TocEntry {
+    std::string basename;
+    std::string ident;
+    // Uncompressed size with --compress.
+    size_t size;
+  };
+  std::vector<TocEntry> toc_entries;
   while (argc > 1) {
     const char* in_filename = *arg++;
     --argc;
-    File in(in_filename, "rb");
 
     std::string basename = sandbox2::file_util::fileops::Basename(in_filename);
-    std::string ident = absl::StrCat("k", basename);
-    std::replace_if(
-        ident.begin(), ident.end(),
-        [](char c) { return !absl::ascii_isalnum(c); }, '_');
-    absl::FPrintF(out_cc.get(), kCcDataBeginFmt, ident);
-    // Remember identifiers, they are needed in the kToc array.
-    toc_entries.emplace_back(std::move(basename), std::move(ident));
-
-    int c;
-    while ((c = fgetc(in.get())) != EOF) {
-      FWriteCEscapedC(c, out_cc.get());
+    std::string ident = ToIdentifier(absl::StrCat("k", basename));
+    if (compress) {
+      const std::string contents = ReadFile(in_filename);
+      FWriteDataLiteral(ident, sapi::CompressFileTocData(contents),
+                        out_cc.get());
+      toc_entries.push_back(
+          {std::move(basename), std::move(ident), contents.size()});
+      continue;
     }
-    in.Check();
-
-    absl::FPrintF(out_cc.get(), kCcDataEndFmt, ftell(in.get()));
+    File in(in_filename, "rb");
+    if (incbin) {
+      SAPI_RAW_PCHECK(fseek(in.get(), 0, SEEK_END) == 0, "Seek on %s",
+                      in_filename);
+      // The symbol is visible to the linker, so it has to be unique.
+      const std::string symbol =
+          ToIdentifier(absl::StrCat("sapi_embed_", package_name, "_", ident));
+      absl::FPrintF(out_cc.get(), kCcIncbinFmt, symbol,
+                    absl::StrReplaceAll(in_filename,
+                                        {{"\\", "\\\\"}, {"\"", "\\\""}}),
+                    ident, ftell(in.get()));
+    } else {
+      absl::FPrintF(out_cc.get(), kCcDataBeginFmt, ident);
+      int c;
+      while ((c = fgetc(in.get())) != EOF) {
+        FWriteCEscapedC(c, out_cc.get());
+      }
+      in.Check();
+      absl::FPrintF(out_cc.get(), kCcDataEndFmt, ftell(in.get()));
+    }
+    // Remember identifiers, they are needed in the kToc array.
+    toc_entries.push_back({std::move(basename), std::move(ident), 0});
   }
   absl::FPrintF(out_cc.get(), kCcFileTocDefsBegin);
   for (const auto& entry : toc_entries) {
-    absl::FPrintF(out_cc.get(), kCcFileTocDefsEntryFmt, entry.first,
-                  entry.second);
+    if (compress) {
+      absl::FPrintF(out_cc.get(), kCcFileTocDefsCompressedEntryFmt,
+                    entry.basename, entry.ident, entry.size);
+    } else {
+      absl::FPrintF(out_cc.get(), kCcFileTocDefsEntryFmt, entry.basename,
+                    entry.ident);
+    }
   }
   absl::FPrintF(out_cc.get(), kCcFileTocDefsEndFmt, toc_ident);
 
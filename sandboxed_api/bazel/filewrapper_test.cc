@@ -12,26 +12,69 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
 #include <cstdint>
+#include <string>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
 #include "absl/strings/string_view.h"
 #include "sandboxed_api/bazel/filewrapper_embedded.h"
+#include "sandboxed_api/bazel/filewrapper_embedded_compressed.h"
+#include "sandboxed_api/bazel/filewrapper_embedded_incbin.h"
+#include "sandboxed_api/embed_file.h"
+#include "sandboxed_api/file_toc_compression.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/sandbox2/util/temp_file.h"
 #include "sandboxed_api/util/status_matchers.h"
 
 using ::sandbox2::GetTestSourcePath;
 using ::sapi::IsOk;
 using ::testing::Eq;
+using ::testing::Gt;
 using ::testing::IsNull;
+using ::testing::Ne;
+using ::testing::Not;
 using ::testing::StrEq;
 
 namespace sapi {
 namespace {
 
+// Returns data which does not compress to nothing, spanning several chunks of
+// 'chunk_size' bytes and a partial one.
+std::string MakeChunkedData(size_t chunk_size) {
+  std::string data(5 * chunk_size + chunk_size / 3, '\0');
+  uint32_t state = 1;
+  for (char& c : data) {
+    state = state * 1103515245 + 12345;
+    c = static_cast<char>(state >> 24);
+  }
+  return data;
+}
+
+// Returns the contents of the file 'fd'.
+std::string ReadFd(int fd) {
+  std::string contents;
+  char buffer[4096];
+  for (off_t offset = 0;;) {
+    ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+    if (n <= 0) {
+      break;
+    }
+    contents.append(buffer, n);
+    offset += n;
+  }
+  return contents;
+}
+
 TEST(FilewrapperTest, BasicFunctionality) {
   const FileToc* toc = filewrapper_embedded_create();
 
@@ -49,5 +92,162 @@ TEST(FilewrapperTest, BasicFunctionality) {
   EXPECT_THAT(toc->name, IsNull());
 }
 
+TEST(FilewrapperTest, Incbin) {
+  const FileToc* toc = filewrapper_embedded_incbin_create();
+
+  EXPECT_THAT(toc->name, StrEq("filewrapper_embedded.bin"));
+  EXPECT_THAT(toc->size, Eq(256));
+  EXPECT_THAT(reinterpret_cast<uintptr_t>(toc->data) % 4096, Eq(0));
+
+  std::string contents;
+  ASSERT_THAT(sandbox2::file::GetContents(
+                  GetTestSourcePath("bazel/testdata/filewrapper_embedded.bin"),
+                  &contents, sandbox2::file::Defaults()),
+              IsOk());
+  EXPECT_THAT(std::string(toc->data, toc->size), StrEq(contents));
+
+  ++toc;
+  EXPECT_THAT(toc->name, IsNull());
+}
+
+TEST(FilewrapperTest, Compress) {
+  const FileToc* toc = filewrapper_embedded_compressed_create();
+
+  EXPECT_THAT(toc->name, StrEq("filewrapper_embedded.bin"));
+  EXPECT_THAT(toc->size, Eq(256));
+  EXPECT_THAT(toc->compressed_size, Gt(0u));
+
+  std::string contents;
+  ASSERT_THAT(sandbox2::file::GetContents(
+                  GetTestSourcePath("bazel/testdata/filewrapper_embedded.bin"),
+                  &contents, sandbox2::file::Defaults()),
+              IsOk());
+  std::string decompressed(toc->size, '\0');
+  ASSERT_THAT(DecompressFileTocData(
+                  absl::string_view(toc->data, toc->compressed_size),
+                  &decompressed[0], decompressed.size(), /*max_threads=*/1),
+              IsOk());
+  EXPECT_THAT(decompressed, StrEq(contents));
+
+  ++toc;
+  EXPECT_THAT(toc->name, IsNull());
+}
+
+TEST(FilewrapperTest, DecompressesChunksInParallel) {
+  constexpr size_t kChunkSize = 4096;
+  const std::string data = MakeChunkedData(kChunkSize);
+  const std::string compressed = CompressFileTocData(data, kChunkSize);
+  for (int max_threads : {1, 3, 16}) {
+    std::string decompressed(data.size(), '\0');
+    ASSERT_THAT(DecompressFileTocData(compressed, &decompressed[0],
+                                      decompressed.size(), max_threads),
+                IsOk());
+    EXPECT_THAT(decompressed, Eq(data));
+
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        bool same, MatchesFileTocData(compressed, data.data(), data.size(),
+                                      max_threads));
+    EXPECT_TRUE(same);
+    // A difference in any chunk, here the partial last one, is found.
+    std::string modified = data;
+    modified.back() ^= 1;
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        same, MatchesFileTocData(compressed, modified.data(), modified.size(),
+                                 max_threads));
+    EXPECT_FALSE(same);
+  }
+
+  std::string too_small(data.size() - 1, '\0');
+  EXPECT_THAT(DecompressFileTocData(compressed, &too_small[0],
+                                    too_small.size(), /*max_threads=*/2),
+              Not(IsOk()));
+}
+
+TEST(FilewrapperTest, CreatesFilesForCompressedTocs) {
+  std::string contents;
+  ASSERT_THAT(sandbox2::file::GetContents(
+                  GetTestSourcePath("bazel/testdata/filewrapper_embedded.bin"),
+                  &contents, sandbox2::file::Defaults()),
+              IsOk());
+  EmbedFile embed_file;
+  int fd = embed_file.GetFdForFileToc(filewrapper_embedded_compressed_create());
+  ASSERT_THAT(fd, Ne(-1));
+  EXPECT_THAT(ReadFd(fd), Eq(contents));
+
+  // Several chunks, decompressed by several threads right into the file.
+  const std::string data = MakeChunkedData(4096);
+  const std::string compressed = CompressFileTocData(data, 4096);
+  const FileToc toc = {"chunked.bin", compressed.data(), data.size(), {},
+                       compressed.size()};
+  fd = embed_file.GetFdForFileToc(&toc);
+  ASSERT_THAT(fd, Ne(-1));
+  EXPECT_THAT(ReadFd(fd), Eq(data));
+  // The file cannot be written to.
+  EXPECT_THAT(pwrite(fd, "x", 1, 0), Eq(-1));
+}
+
+// Returns the inode of the file 'fd'.
+ino_t GetInode(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 ? st.st_ino : 0;
+}
+
+TEST(FilewrapperTest, SharesFilesThroughCacheDir) {
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::string dir,
+      sandbox2::CreateTempDir(
+          sandbox2::file::JoinPath(sandbox2::GetTestTempPath(), "cache_")));
+  struct statvfs vfs;
+  ASSERT_THAT(statvfs(dir.c_str(), &vfs), Eq(0));
+  if ((vfs.f_flag & ST_NOEXEC) != 0) {
+    // The cache directory would not be used.
+    return;
+  }
+
+  for (const FileToc* toc : {filewrapper_embedded_create(),
+                             filewrapper_embedded_compressed_create()}) {
+    SCOPED_TRACE(toc->compressed_size > 0 ? "compressed" : "uncompressed");
+    // Two EmbedFile objects stand in for two processes sharing the directory.
+    EmbedFile first;
+    first.SetSharedCacheDir(dir);
+    const int first_fd = first.GetFdForFileToc(toc);
+    ASSERT_THAT(first_fd, Ne(-1));
+    EmbedFile second;
+    second.SetSharedCacheDir(dir);
+    const int second_fd = second.GetFdForFileToc(toc);
+    ASSERT_THAT(second_fd, Ne(-1));
+    EXPECT_THAT(GetInode(second_fd), Eq(GetInode(first_fd)));
+    EXPECT_THAT(ReadFd(second_fd), Eq(ReadFd(first_fd)));
+
+    std::vector<std::string> entries;
+    std::string error;
+    ASSERT_TRUE(
+        sandbox2::file_util::fileops::ListDirectoryEntries(dir, &entries,
+                                                           &error))
+        << error;
+    ASSERT_THAT(entries.size(), Eq(1));
+    const std::string path = sandbox2::file::JoinPath(dir, entries[0]);
+
+    // A file with the same name but other contents is not used.
+    const std::string contents = ReadFd(first_fd);
+    std::string modified = contents;
+    modified[0] ^= 1;
+    ASSERT_THAT(chmod(path.c_str(), 0700), Eq(0));
+    ASSERT_THAT(sandbox2::file::SetContents(path, modified,
+                                            sandbox2::file::Defaults()),
+                IsOk());
+    ASSERT_THAT(chmod(path.c_str(), 0500), Eq(0));
+    EmbedFile third;
+    third.SetSharedCacheDir(dir);
+    const int third_fd = third.GetFdForFileToc(toc);
+    ASSERT_THAT(third_fd, Ne(-1));
+    EXPECT_THAT(GetInode(third_fd), Ne(GetInode(first_fd)));
+    EXPECT_THAT(ReadFd(third_fd), Eq(contents));
+
+    ASSERT_THAT(unlink(path.c_str()), Eq(0));
+  }
+  rmdir(dir.c_str());
+}
+
 }  // namespace
 }  // namespace sapi
@@ -45,6 +45,10 @@ def sapi_interface_impl(ctx):
     args = []
     append_arg(args, "--sapi_name", ctx.attr.lib_name)
     append_arg(args, "--sapi_out", ctx.outputs.out.path)
+    outputs = [ctx.outputs.out]
+    if ctx.outputs.thunks_out:
+        append_arg(args, "--sapi_thunks_out", ctx.outputs.thunks_out.path)
+        outputs.append(ctx.outputs.thunks_out)
     append_arg(args, "--sapi_embed_dir", ctx.attr.embed_dir)
     append_arg(args, "--sapi_embed_name", ctx.attr.embed_name)
     append_arg(args, "--sapi_functions", ",".join(ctx.attr.functions))
@@ -109,7 +113,7 @@ def sapi_interface_impl(ctx):
                     "").format(ctx.outputs.out.short_path, len(input_files_paths))
     ctx.actions.run(
         inputs = input_files,
-        outputs = [ctx.outputs.out],
+        outputs = outputs,
         arguments = args,
         progress_message = progress_msg,
         executable = ctx.executable._sapi_generator,
@@ -120,6 +124,7 @@ sapi_interface = rule(
     implementation = sapi_interface_impl,
     attrs = {
         "out": attr.output(mandatory = True),
+        "thunks_out": attr.output(),
         "embed_dir": attr.string(),
         "embed_name": attr.string(),
         "functions": attr.string_list(allow_empty = True, default = []),
@@ -153,9 +158,22 @@ def sapi_library(
         header = "",
         input_files = [],
         deps = [],
+        heap_profiling = False,
         tags = [],
         visibility = None):
-    """BUILD rule providing implementation of a Sandboxed API library."""
+    """BUILD rule providing implementation of a Sandboxed API library.
+
+    With heap_profiling set, the sandboxee samples its allocations on request,
+    see Sandbox::GetHeapProfile(). Sampled stacks need frame pointers, so also
+    build with --copt=-fno-omit-frame-pointer.
+
+    For profile-guided optimization of the sandboxee, build with
+    --fdo_instrument=<dir>, run a representative workload with the host
+    flag --sapi_profile_dir=<dir> so that the policy allows writing the
+    profile, then rebuild with --fdo_optimize=<profile> and
+    --features=thin_lto. The CMake equivalent are the PGO_GENERATE and PGO_USE
+    options of add_sapi_library().
+    """
 
     common = {
         "tags": tags,
@@ -165,6 +183,9 @@ def sapi_library(
 
     generated_header = name + ".sapi.h"
 
+    # Native dispatch table of the sandboxee, see sandboxed_api/native_call.h.
+    generated_thunks = name + ".sapi_thunks.cc"
+
     # Reference (pull into the archive) required functions only. If the functions'
     # array is empty, pull in the whole archive (may not compile with MSAN).
     exported_funcs = ["-Wl,--export-dynamic-symbol," + s for s in functions]
@@ -202,6 +223,7 @@ def sapi_library(
 
     native.cc_binary(
         name = name + ".bin",
+        srcs = [generated_thunks],
         linkopts = [
             # The sandboxing client must have access to all
             "-Wl,-E",  # symbols used in the sandboxed library, so these
@@ -209,7 +231,10 @@ def sapi_library(
         deps = [
             ":" + name + ".lib",
             "@com_google_sandboxed_api//sandboxed_api:client",
-        ],
+            "@com_google_sandboxed_api//sandboxed_api:native_call",
+        ] + ([
+            "@com_google_sandboxed_api//sandboxed_api:heap_profiler_malloc",
+        ] if heap_profiling else []),
         **common
     )
 
@@ -231,6 +256,7 @@ def sapi_library(
             srcs = [name + ".bin"],
             name = name + "_embed",
             namespace = namespace,
+            incbin = True,
             **common
         )
         embed_dir = get_embed_dir()
@@ -242,6 +268,7 @@ def sapi_library(
         functions = functions,
         input_files = input_files,
         out = generated_header,
+        thunks_out = generated_thunks,
         embed_name = embed_name,
         embed_dir = embed_dir,
         namespace = namespace,
@@ -103,6 +103,24 @@ def sapi_deps():
         urls = ["https://github.com/libffi/libffi/releases/download/v3.3-rc0/libffi-3.3-rc0.tar.gz"],
     )
 
+    # zlib, compresses embedded files
+    if "net_zlib" not in native.existing_rules():
+        http_archive(
+            name = "net_zlib",
+            build_file = "@com_google_sandboxed_api//sandboxed_api:bazel/external/zlib.BUILD",
+            patch_args = ["-p1"],
+            # This is a patch that removes the "OF" macro that is used in zlib
+            # function definitions. It is necessary, because libclang, the
+            # library used by the interface generator to parse C/C++ files
+            # contains a bug that manifests itself with macros like this.
+            # We are investigating better ways to avoid this issue. For most
+            # "normal" C and C++ headers, parsing just works.
+            patches = ["@com_google_sandboxed_api//sandboxed_api:bazel/external/zlib.patch"],
+            sha256 = "c3e5e9fdd5004dcb542feda5ee4f0ff0744628baf8ed2dd5d66f8ca1197cb1a1",
+            strip_prefix = "zlib-1.2.11",
+            urls = ["https://www.zlib.net/zlib-1.2.11.tar.gz"],
+        )
+
     # libunwind
     autotools_repository(
         name = "org_gnu_libunwind",
@@ -0,0 +1,247 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the memory footprint of many concurrent sandboxes: starts up to
+// --sandboxes stringop sandboxes, doubling their number, and after each step
+// reports
+//  - the host process: RSS, PSS and threads (monitors, Comms buffers and
+//    Executor state),
+//  - all of its descendants, i.e. the forkservers and sandboxees: PSS and USS
+//    from /proc/<pid>/smaps_rollup,
+// and the marginal cost of a sandbox since the previous step.
+//
+// Run with:
+//   bazel run -c opt //sandboxed_api/benchmarks:memory_footprint -- \
+//     --sandboxes=2000
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/examples/stringop/lib/stringop-sapi.sapi.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+ABSL_FLAG(int32_t, sandboxes, 1000, "Maximum number of concurrent sandboxes.");
+ABSL_FLAG(bool, call, true,
+          "Make one call into each sandbox, so that its sandboxee is in the "
+          "steady state of a used sandbox.");
+
+namespace sapi {
+namespace {
+
+namespace file = ::sandbox2::file;
+namespace file_util = ::sandbox2::file_util;
+
+// Memory usage in KiB, as reported by the kernel.
+struct MemoryUsage {
+  int64_t rss = 0;
+  int64_t pss = 0;
+  // Unique set size, the private pages.
+  int64_t uss = 0;
+
+  MemoryUsage& operator+=(const MemoryUsage& other) {
+    rss += other.rss;
+    pss += other.pss;
+    uss += other.uss;
+    return *this;
+  }
+};
+
+struct Sample {
+  int64_t sandboxes = 0;
+  MemoryUsage host;
+  int64_t host_threads = 0;
+  MemoryUsage children;
+  int64_t num_children = 0;
+};
+
+// Returns the value in KiB of the 'name:' line in /proc/<pid>/status or
+// smaps_rollup like contents, 0 if there is none.
+int64_t GetField(absl::string_view contents, absl::string_view name) {
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    if (!absl::ConsumePrefix(&line, name) || !absl::ConsumePrefix(&line, ":")) {
+      continue;
+    }
+    std::vector<absl::string_view> words =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    int64_t value;
+    if (!words.empty() && absl::SimpleAtoi(words[0], &value)) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+sapi::Status ReadMemoryUsage(const std::string& proc_dir,
+                             MemoryUsage* usage) {
+  std::string contents;
+  SAPI_RETURN_IF_ERROR(file::GetContents(
+      file::JoinPath(proc_dir, "smaps_rollup"), &contents, file::Defaults()));
+  usage->rss = GetField(contents, "Rss");
+  usage->pss = GetField(contents, "Pss");
+  usage->uss =
+      GetField(contents, "Private_Clean") + GetField(contents, "Private_Dirty");
+  return sapi::OkStatus();
+}
+
+// Returns the parent of every process, by PID.
+sapi::Status ReadParents(absl::flat_hash_map<pid_t, pid_t>* parents) {
+  std::vector<std::string> entries;
+  std::string error;
+  if (!file_util::fileops::ListDirectoryEntries("/proc", &entries, &error)) {
+    return sapi::InternalError(error);
+  }
+  for (const std::string& entry : entries) {
+    pid_t pid;
+    std::string stat;
+    if (!absl::SimpleAtoi(entry, &pid) ||
+        !file::GetContents(file::JoinPath("/proc", entry, "stat"), &stat,
+                           file::Defaults())
+             .ok()) {
+      // Not a process, or it exited meanwhile.
+      continue;
+    }
+    // The command may contain spaces, the fields after it do not:
+    // "pid (comm) state ppid ...".
+    absl::string_view rest(stat);
+    const size_t comm_end = rest.rfind(')');
+    if (comm_end == absl::string_view::npos) {
+      continue;
+    }
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(rest.substr(comm_end + 1), ' ', absl::SkipEmpty());
+    pid_t ppid;
+    if (fields.size() > 1 && absl::SimpleAtoi(fields[1], &ppid)) {
+      (*parents)[pid] = ppid;
+    }
+  }
+  return sapi::OkStatus();
+}
+
+sapi::StatusOr<Sample> TakeSample(int64_t sandboxes) {
+  Sample sample;
+  sample.sandboxes = sandboxes;
+  SAPI_RETURN_IF_ERROR(ReadMemoryUsage("/proc/self", &sample.host));
+  std::string proc_status;
+  SAPI_RETURN_IF_ERROR(
+      file::GetContents("/proc/self/status", &proc_status, file::Defaults()));
+  sample.host_threads = GetField(proc_status, "Threads");
+
+  absl::flat_hash_map<pid_t, pid_t> parents;
+  SAPI_RETURN_IF_ERROR(ReadParents(&parents));
+  const pid_t self = getpid();
+  for (const auto& entry : parents) {
+    // Walks up to init, or to this process for its descendants.
+    pid_t ancestor = entry.second;
+    while (ancestor > 1 && ancestor != self) {
+      auto it = parents.find(ancestor);
+      ancestor = it != parents.end() ? it->second : 0;
+    }
+    MemoryUsage usage;
+    if (ancestor != self ||
+        !ReadMemoryUsage(absl::StrCat("/proc/", entry.first), &usage).ok()) {
+      continue;
+    }
+    sample.children += usage;
+    ++sample.num_children;
+  }
+  return sample;
+}
+
+void PrintSample(const Sample& sample, const Sample& previous) {
+  const double added = sample.sandboxes - previous.sandboxes;
+  printf("%9" PRId64 " %10" PRId64 " %10" PRId64 " %8" PRId64 " %9" PRId64
+         " %10" PRId64 " %10" PRId64,
+         sample.sandboxes, sample.host.rss, sample.host.pss,
+         sample.host_threads, sample.num_children, sample.children.pss,
+         sample.children.uss);
+  if (added > 0) {
+    printf(" %10.1f %8.2f %10.1f %10.1f",
+           (sample.host.pss - previous.host.pss) / added,
+           (sample.host_threads - previous.host_threads) / added,
+           (sample.children.pss - previous.children.pss) / added,
+           (sample.children.uss - previous.children.uss) / added);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+sapi::Status Run(int64_t max_sandboxes, bool call) {
+  printf("# Memory in KiB, the last four columns per added sandbox.\n");
+  printf("%9s %10s %10s %8s %9s %10s %10s %10s %8s %10s %10s\n", "sandboxes",
+         "host_rss", "host_pss", "threads", "children", "child_pss",
+         "child_uss", "+host_pss", "+threads", "+child_pss", "+child_uss");
+  SAPI_ASSIGN_OR_RETURN(Sample previous, TakeSample(0));
+  PrintSample(previous, previous);
+
+  std::vector<std::unique_ptr<StringopSandbox>> sandboxes;
+  int64_t next_sample = 1;
+  while (static_cast<int64_t>(sandboxes.size()) < max_sandboxes) {
+    auto sandbox = absl::make_unique<StringopSandbox>();
+    SAPI_RETURN_IF_ERROR(sandbox->Init());
+    if (call) {
+      StringopApi api(sandbox.get());
+      SAPI_RETURN_IF_ERROR(api.nop());
+    }
+    sandboxes.push_back(std::move(sandbox));
+
+    const int64_t num_sandboxes = sandboxes.size();
+    if (num_sandboxes == next_sample || num_sandboxes == max_sandboxes) {
+      SAPI_ASSIGN_OR_RETURN(Sample sample, TakeSample(num_sandboxes));
+      PrintSample(sample, previous);
+      previous = sample;
+      next_sample *= 2;
+    }
+  }
+  return sapi::OkStatus();
+}
+
+}  // namespace
+}  // namespace sapi
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  sapi::Status status = sapi::Run(absl::GetFlag(FLAGS_sandboxes),
+                                  absl::GetFlag(FLAGS_call));
+  if (!status.ok()) {
+    LOG(ERROR) << "Memory footprint run failed: " << status;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the SAPI call path: function calls, memory transfers and
+// management, protobuf and file descriptor passing, and sandbox startup.
+//
+// Run with: bazel run -c opt //sandboxed_api/benchmarks:sapi_benchmark
+
+#include <fcntl.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/utility/utility.h"
+#include "sandboxed_api/examples/stringop/lib/stringop-sapi.sapi.h"
+#include "sandboxed_api/examples/stringop/lib/stringop_params.pb.h"
+#include "sandboxed_api/examples/sum/lib/sum-sapi.sapi.h"
+#include "sandboxed_api/sandbox.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sapi {
+namespace {
+
+constexpr int64_t kMinTransferSize = 16;
+constexpr int64_t kMaxTransferSize = 256 << 20;
+
+// Initializes 'sandbox', marks the benchmark as failed if that fails.
+bool InitOrSkip(Sandbox* sandbox, benchmark::State& state) {
+  sapi::Status status = sandbox->Init();
+  if (!status.ok()) {
+    state.SkipWithError(status.ToString().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Marks the benchmark as failed if 'status' is an error. Returns whether to
+// continue.
+bool OkOrSkip(const sapi::Status& status, benchmark::State& state) {
+  if (!status.ok()) {
+    state.SkipWithError(status.ToString().c_str());
+    return false;
+  }
+  return true;
+}
+
+template <size_t... I>
+sapi::Status CallNopArgs(Sandbox* sandbox, v::Long* args,
+                         absl::index_sequence<I...>) {
+  v::Void ret;
+  return sandbox->Call("nop_args", &ret, &args[I]...);
+}
+
+// Calls a function taking 'NumArgs' scalar arguments.
+template <size_t NumArgs>
+void BenchmarkCallArgs(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  v::Long args[FuncCall::kArgsMax];
+  for (auto _ : state) {
+    if (!OkOrSkip(CallNopArgs(&sandbox, args,
+                              absl::make_index_sequence<NumArgs>()),
+                  state)) {
+      break;
+    }
+  }
+}
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 0);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 1);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 2);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 3);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 4);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 5);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 6);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 7);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 8);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 9);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 10);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 11);
+BENCHMARK_TEMPLATE(BenchmarkCallArgs, 12);
+
+// Copies state.range(0) bytes into the sandboxee.
+void BenchmarkTransferToSandboxee(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  std::vector<uint8_t> data(state.range(0), 1);
+  v::Array<uint8_t> arr(data.data(), data.size());
+  if (!OkOrSkip(sandbox.Allocate(&arr, /*automatic_free=*/true), state)) {
+    return;
+  }
+  for (auto _ : state) {
+    if (!OkOrSkip(sandbox.TransferToSandboxee(&arr), state)) {
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BenchmarkTransferToSandboxee)
+    ->RangeMultiplier(16)
+    ->Range(kMinTransferSize, kMaxTransferSize);
+
+// Copies state.range(0) bytes out of the sandboxee.
+void BenchmarkTransferFromSandboxee(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  std::vector<uint8_t> data(state.range(0), 1);
+  v::Array<uint8_t> arr(data.data(), data.size());
+  if (!OkOrSkip(sandbox.Allocate(&arr, /*automatic_free=*/true), state) ||
+      !OkOrSkip(sandbox.TransferToSandboxee(&arr), state)) {
+    return;
+  }
+  for (auto _ : state) {
+    if (!OkOrSkip(sandbox.TransferFromSandboxee(&arr), state)) {
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BenchmarkTransferFromSandboxee)
+    ->RangeMultiplier(16)
+    ->Range(kMinTransferSize, kMaxTransferSize);
+
+// Allocates and frees state.range(0) bytes in the sandboxee.
+void BenchmarkAllocateFree(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  // Only the size matters, the local buffer is never transferred.
+  v::Array<uint8_t> arr(state.range(0));
+  for (auto _ : state) {
+    if (!OkOrSkip(sandbox.Allocate(&arr), state) ||
+        !OkOrSkip(sandbox.Free(&arr), state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkAllocateFree)
+    ->RangeMultiplier(16)
+    ->Range(kMinTransferSize, 16 << 20);
+
+// Passes a protobuf to the sandboxee and reads it back.
+void BenchmarkProtoRoundTrip(benchmark::State& state) {
+  StringopSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  StringopApi api(&sandbox);
+  stringop::StringReverse proto;
+  proto.set_input(std::string(state.range(0), 'a'));
+  for (auto _ : state) {
+    v::Proto<stringop::StringReverse> pp(proto);
+    sapi::StatusOr<int> result = api.pb_reverse_string(pp.PtrBoth());
+    if (!OkOrSkip(result.status(), state) ||
+        !OkOrSkip(pp.GetMessage().status(), state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkProtoRoundTrip)->Range(16, 64 << 10);
+
+// Passes a file descriptor to the sandboxee and closes it there.
+void BenchmarkFdPassing(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  for (auto _ : state) {
+    v::Fd fd(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    if (!OkOrSkip(sandbox.TransferToSandboxee(&fd), state) ||
+        !OkOrSkip(fd.CloseRemoteFd(sandbox.GetRpcChannel()), state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkFdPassing);
+
+// Starts a sandbox, including the library forkserver, from scratch.
+void BenchmarkInit(benchmark::State& state) {
+  for (auto _ : state) {
+    SumSandbox sandbox;
+    if (!InitOrSkip(&sandbox, state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkInit);
+
+// Restarts a sandbox, forking the sandboxee from the running forkserver.
+// state.range(0) selects whether the sandboxee may exit gracefully.
+void BenchmarkRestart(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  for (auto _ : state) {
+    if (!OkOrSkip(sandbox.Restart(state.range(0) != 0), state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkRestart)->Arg(0)->Arg(1);
+
+// Like BenchmarkRestart, but reuses the policy of the previous sandboxee.
+void BenchmarkReset(benchmark::State& state) {
+  SumSandbox sandbox;
+  if (!InitOrSkip(&sandbox, state)) {
+    return;
+  }
+  for (auto _ : state) {
+    if (!OkOrSkip(sandbox.Reset(state.range(0) != 0), state)) {
+      break;
+    }
+  }
+}
+BENCHMARK(BenchmarkReset)->Arg(0)->Arg(1);
+
+}  // namespace
+}  // namespace sapi
+
+BENCHMARK_MAIN();
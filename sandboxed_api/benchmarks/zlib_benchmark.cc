@@ -0,0 +1,360 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the bulk-data path: streams a corpus through zlib in the
+// sandboxee, in chunks as zpipe does, and through the native zlib as the
+// baseline. Sweeps the chunk size and how the chunks get into and out of the
+// sandboxee. Reports the throughput, and the average time per chunk as
+// us_per_chunk.
+//
+// Run with: bazel run -c opt //sandboxed_api/benchmarks:zlib_benchmark
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <glog/logging.h>
+#include "benchmark/benchmark.h"
+#include "absl/base/macros.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/benchmarks/zlib_native.h"
+#include "sandboxed_api/examples/zlib/zlib-sapi.sapi.h"
+#include "sandboxed_api/sandbox.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+#include "sandboxed_api/var_shared_array.h"
+#include "sandboxed_api/vars.h"
+
+// zlib.h cannot be included together with the generated header, see
+// examples/zlib/main_zlib.cc.
+#define Z_NO_FLUSH 0
+#define Z_FINISH 4
+#define Z_OK 0
+#define Z_STREAM_END 1
+#define Z_NEED_DICT 2
+#define Z_STREAM_ERROR (-2)
+#define Z_DATA_ERROR (-3)
+#define Z_MEM_ERROR (-4)
+#define Z_DEFAULT_COMPRESSION (-1)
+
+namespace sapi {
+namespace {
+
+constexpr char kZlibVersion[] = "1.2.11";
+constexpr size_t kCorpusSize = 8 << 20;
+constexpr int64_t kMinChunkSize = 4 << 10;
+constexpr int64_t kMaxChunkSize = 1 << 20;
+
+// How the chunks are passed between the host and the sandboxee.
+enum Transfer : int64_t {
+  // Copied with process_vm_writev()/process_vm_readv() around every call.
+  kCopy = 0,
+  // Kept in a SharedArray, i.e. a sandbox2::Buffer mapped by both sides.
+  kShared = 1,
+};
+
+// Returns a compressible corpus of text-like lines, the same on every run.
+const std::string& GetCorpus() {
+  static const std::string* corpus = [] {
+    static constexpr const char* kWords[] = {
+        "sandbox", "policy",  "syscall", "buffer", "comms",  "the",
+        "a",       "of",      "memory",  "call",   "return", "status",
+        "stack",   "process", "file",    "map",    "to",     "and"};
+    auto* text = new std::string();
+    text->reserve(kCorpusSize);
+    uint32_t state = 1;
+    while (text->size() < kCorpusSize) {
+      state = state * 1103515245 + 12345;
+      text->append(kWords[(state >> 16) % ABSL_ARRAYSIZE(kWords)]);
+      text->push_back((state >> 8) % 12 == 0 ? '\n' : ' ');
+    }
+    text->resize(kCorpusSize);
+    return text;
+  }();
+  return *corpus;
+}
+
+// Returns the corpus compressed by the native zlib.
+const std::string& GetCompressedCorpus() {
+  static const std::string* compressed = [] {
+    auto* data = new std::string();
+    CHECK(NativeDeflate(GetCorpus(), kMaxChunkSize, data));
+    return data;
+  }();
+  return *compressed;
+}
+
+// Marks the benchmark as failed if 'status' is an error. Returns whether to
+// continue.
+bool OkOrSkip(const sapi::Status& status, benchmark::State& state) {
+  if (!status.ok()) {
+    state.SkipWithError(status.ToString().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Reports the throughput and the average time per input chunk.
+void ReportThroughput(benchmark::State& state, size_t bytes, int64_t chunks,
+                      absl::Duration elapsed) {
+  state.SetBytesProcessed(state.iterations() * bytes);
+  if (chunks > 0) {
+    state.counters["us_per_chunk"] =
+        absl::ToDoubleMicroseconds(elapsed) / chunks;
+  }
+}
+
+// Lets kShared buffers be mapped into the sandboxee.
+class SharedBuffersZlibSandbox : public zlib::ZlibSandbox {
+ protected:
+  bool UseSharedBuffers() const override { return true; }
+};
+
+// Streams data through zlib in a sandboxee, using input and output buffers of
+// one chunk each.
+class SandboxedZlib {
+ public:
+  sapi::Status Init(Transfer transfer, size_t chunk_size) {
+    chunk_size_ = chunk_size;
+    SAPI_RETURN_IF_ERROR(sandbox_.Init());
+    SAPI_ASSIGN_OR_RETURN(in_, CreateBuffer(transfer, chunk_size));
+    SAPI_ASSIGN_OR_RETURN(out_, CreateBuffer(transfer, chunk_size));
+    SAPI_RETURN_IF_ERROR(sandbox_.Allocate(in_.get(), true));
+    return sandbox_.Allocate(out_.get(), true);
+  }
+
+  sapi::Status Deflate(absl::string_view input, std::string* output) {
+    v::Struct<zlib::z_stream> strm;
+    v::Array<const char> version(kZlibVersion, ABSL_ARRAYSIZE(kZlibVersion));
+    SAPI_ASSIGN_OR_RETURN(
+        int ret,
+        api_.deflateInit_(strm.PtrBoth(), Z_DEFAULT_COMPRESSION,
+                          version.PtrBefore(), sizeof(zlib::z_stream)));
+    if (ret != Z_OK) {
+      return sapi::InternalError("deflateInit_() failed");
+    }
+    size_t pos = 0;
+    int flush;
+    do {
+      const size_t n = std::min(chunk_size_, input.size() - pos);
+      SAPI_RETURN_IF_ERROR(PutChunk(input.substr(pos, n)));
+      pos += n;
+      flush = pos == input.size() ? Z_FINISH : Z_NO_FLUSH;
+      strm.mutable_data()->next_in =
+          reinterpret_cast<unsigned char*>(in_->GetRemote());
+      strm.mutable_data()->avail_in = n;
+      do {
+        strm.mutable_data()->next_out =
+            reinterpret_cast<unsigned char*>(out_->GetRemote());
+        strm.mutable_data()->avail_out = chunk_size_;
+        SAPI_ASSIGN_OR_RETURN(ret, api_.deflate(strm.PtrBoth(), flush));
+        if (ret == Z_STREAM_ERROR) {
+          return sapi::InternalError("deflate() failed");
+        }
+        SAPI_RETURN_IF_ERROR(
+            GetChunk(chunk_size_ - strm.data().avail_out, output));
+      } while (strm.data().avail_out == 0);
+    } while (flush != Z_FINISH);
+    return api_.deflateEnd(strm.PtrBoth()).status();
+  }
+
+  sapi::Status Inflate(absl::string_view input, std::string* output) {
+    v::Struct<zlib::z_stream> strm;
+    v::Array<const char> version(kZlibVersion, ABSL_ARRAYSIZE(kZlibVersion));
+    SAPI_ASSIGN_OR_RETURN(int ret,
+                          api_.inflateInit_(strm.PtrBoth(), version.PtrBefore(),
+                                            sizeof(zlib::z_stream)));
+    if (ret != Z_OK) {
+      return sapi::InternalError("inflateInit_() failed");
+    }
+    size_t pos = 0;
+    while (ret != Z_STREAM_END && pos < input.size()) {
+      const size_t n = std::min(chunk_size_, input.size() - pos);
+      SAPI_RETURN_IF_ERROR(PutChunk(input.substr(pos, n)));
+      pos += n;
+      strm.mutable_data()->next_in =
+          reinterpret_cast<unsigned char*>(in_->GetRemote());
+      strm.mutable_data()->avail_in = n;
+      do {
+        strm.mutable_data()->next_out =
+            reinterpret_cast<unsigned char*>(out_->GetRemote());
+        strm.mutable_data()->avail_out = chunk_size_;
+        SAPI_ASSIGN_OR_RETURN(ret, api_.inflate(strm.PtrBoth(), Z_NO_FLUSH));
+        if (ret == Z_STREAM_ERROR || ret == Z_NEED_DICT ||
+            ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+          return sapi::InternalError("inflate() failed");
+        }
+        SAPI_RETURN_IF_ERROR(
+            GetChunk(chunk_size_ - strm.data().avail_out, output));
+      } while (strm.data().avail_out == 0);
+    }
+    SAPI_RETURN_IF_ERROR(api_.inflateEnd(strm.PtrBoth()).status());
+    if (ret != Z_STREAM_END) {
+      return sapi::DataLossError("Compressed stream is truncated");
+    }
+    return sapi::OkStatus();
+  }
+
+  // Number of input chunks processed so far.
+  int64_t chunks() const { return chunks_; }
+
+ private:
+  static sapi::StatusOr<std::unique_ptr<v::Var>> CreateBuffer(
+      Transfer transfer, size_t size) {
+    if (transfer == kShared) {
+      SAPI_ASSIGN_OR_RETURN(std::unique_ptr<v::SharedArray<uint8_t>> array,
+                            v::SharedArray<uint8_t>::Create(size));
+      return std::unique_ptr<v::Var>(std::move(array));
+    }
+    return std::unique_ptr<v::Var>(absl::make_unique<v::Array<uint8_t>>(size));
+  }
+
+  // Copies the next input chunk into the sandboxee.
+  sapi::Status PutChunk(absl::string_view chunk) {
+    memcpy(in_->GetLocal(), chunk.data(), chunk.size());
+    ++chunks_;
+    return sandbox_.TransferToSandboxee(in_.get());
+  }
+
+  // Appends the first 'size' bytes of the output buffer to 'output'.
+  sapi::Status GetChunk(size_t size, std::string* output) {
+    SAPI_RETURN_IF_ERROR(sandbox_.TransferFromSandboxee(out_.get()));
+    output->append(static_cast<const char*>(out_->GetLocal()), size);
+    return sapi::OkStatus();
+  }
+
+  SharedBuffersZlibSandbox sandbox_;
+  zlib::ZlibApi api_{&sandbox_};
+  size_t chunk_size_ = 0;
+  std::unique_ptr<v::Var> in_;
+  std::unique_ptr<v::Var> out_;
+  int64_t chunks_ = 0;
+};
+
+// Sweeps the chunk size for every transfer mode.
+void SandboxedArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"chunk", "transfer"});
+  for (int64_t transfer : {kCopy, kShared}) {
+    for (int64_t chunk = kMinChunkSize; chunk <= kMaxChunkSize; chunk *= 4) {
+      b->Args({chunk, transfer});
+    }
+  }
+}
+
+// Number of input chunks of 'chunk_size' bytes in 'bytes'.
+int64_t NumChunks(size_t bytes, size_t chunk_size) {
+  return (bytes + chunk_size - 1) / chunk_size;
+}
+
+void NativeArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"chunk"});
+  for (int64_t chunk = kMinChunkSize; chunk <= kMaxChunkSize; chunk *= 4) {
+    b->Arg(chunk);
+  }
+}
+
+void BenchmarkSandboxedDeflate(benchmark::State& state) {
+  const std::string& corpus = GetCorpus();
+  SandboxedZlib zlib;
+  if (!OkOrSkip(zlib.Init(static_cast<Transfer>(state.range(1)),
+                          state.range(0)),
+                state)) {
+    return;
+  }
+  std::string compressed;
+  const absl::Time start = absl::Now();
+  for (auto _ : state) {
+    compressed.clear();
+    if (!OkOrSkip(zlib.Deflate(corpus, &compressed), state)) {
+      break;
+    }
+  }
+  ReportThroughput(state, corpus.size(), zlib.chunks(), absl::Now() - start);
+}
+BENCHMARK(BenchmarkSandboxedDeflate)->Apply(SandboxedArgs);
+
+void BenchmarkSandboxedInflate(benchmark::State& state) {
+  const std::string& compressed = GetCompressedCorpus();
+  SandboxedZlib zlib;
+  if (!OkOrSkip(zlib.Init(static_cast<Transfer>(state.range(1)),
+                          state.range(0)),
+                state)) {
+    return;
+  }
+  std::string decompressed;
+  const absl::Time start = absl::Now();
+  for (auto _ : state) {
+    decompressed.clear();
+    if (!OkOrSkip(zlib.Inflate(compressed, &decompressed), state)) {
+      break;
+    }
+  }
+  if (decompressed != GetCorpus()) {
+    state.SkipWithError("Decompressed data differs from the corpus");
+    return;
+  }
+  // The throughput is measured in uncompressed bytes.
+  ReportThroughput(state, decompressed.size(), zlib.chunks(),
+                   absl::Now() - start);
+}
+BENCHMARK(BenchmarkSandboxedInflate)->Apply(SandboxedArgs);
+
+void BenchmarkNativeDeflate(benchmark::State& state) {
+  const std::string& corpus = GetCorpus();
+  const size_t chunk_size = state.range(0);
+  std::string compressed;
+  const absl::Time start = absl::Now();
+  for (auto _ : state) {
+    compressed.clear();
+    if (!NativeDeflate(corpus, chunk_size, &compressed)) {
+      state.SkipWithError("deflate() failed");
+      break;
+    }
+  }
+  ReportThroughput(state, corpus.size(),
+                   state.iterations() * NumChunks(corpus.size(), chunk_size),
+                   absl::Now() - start);
+}
+BENCHMARK(BenchmarkNativeDeflate)->Apply(NativeArgs);
+
+void BenchmarkNativeInflate(benchmark::State& state) {
+  const std::string& compressed = GetCompressedCorpus();
+  const size_t chunk_size = state.range(0);
+  std::string decompressed;
+  const absl::Time start = absl::Now();
+  for (auto _ : state) {
+    decompressed.clear();
+    if (!NativeInflate(compressed, chunk_size, &decompressed)) {
+      state.SkipWithError("inflate() failed");
+      break;
+    }
+  }
+  ReportThroughput(
+      state, GetCorpus().size(),
+      state.iterations() * NumChunks(compressed.size(), chunk_size),
+      absl::Now() - start);
+}
+BENCHMARK(BenchmarkNativeInflate)->Apply(NativeArgs);
+
+}  // namespace
+}  // namespace sapi
+
+BENCHMARK_MAIN();
@@ -0,0 +1,89 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/benchmarks/zlib_native.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace sapi {
+
+bool NativeDeflate(absl::string_view input, size_t chunk_size,
+                   std::string* output) {
+  z_stream strm{};
+  if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    return false;
+  }
+  std::vector<unsigned char> in(chunk_size);
+  std::vector<unsigned char> out(chunk_size);
+  size_t pos = 0;
+  int flush;
+  do {
+    const size_t n = std::min(chunk_size, input.size() - pos);
+    std::copy(input.begin() + pos, input.begin() + pos + n, in.begin());
+    pos += n;
+    flush = pos == input.size() ? Z_FINISH : Z_NO_FLUSH;
+    strm.next_in = in.data();
+    strm.avail_in = n;
+    do {
+      strm.next_out = out.data();
+      strm.avail_out = chunk_size;
+      if (deflate(&strm, flush) == Z_STREAM_ERROR) {
+        deflateEnd(&strm);
+        return false;
+      }
+      output->append(reinterpret_cast<const char*>(out.data()),
+                     chunk_size - strm.avail_out);
+    } while (strm.avail_out == 0);
+  } while (flush != Z_FINISH);
+  deflateEnd(&strm);
+  return true;
+}
+
+bool NativeInflate(absl::string_view input, size_t chunk_size,
+                   std::string* output) {
+  z_stream strm{};
+  if (inflateInit(&strm) != Z_OK) {
+    return false;
+  }
+  std::vector<unsigned char> in(chunk_size);
+  std::vector<unsigned char> out(chunk_size);
+  size_t pos = 0;
+  int ret = Z_OK;
+  while (ret != Z_STREAM_END && pos < input.size()) {
+    const size_t n = std::min(chunk_size, input.size() - pos);
+    std::copy(input.begin() + pos, input.begin() + pos + n, in.begin());
+    pos += n;
+    strm.next_in = in.data();
+    strm.avail_in = n;
+    do {
+      strm.next_out = out.data();
+      strm.avail_out = chunk_size;
+      ret = inflate(&strm, Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR || ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+          ret == Z_MEM_ERROR) {
+        inflateEnd(&strm);
+        return false;
+      }
+      output->append(reinterpret_cast<const char*>(out.data()),
+                     chunk_size - strm.avail_out);
+    } while (strm.avail_out == 0);
+  }
+  inflateEnd(&strm);
+  return ret == Z_STREAM_END;
+}
+
+}  // namespace sapi
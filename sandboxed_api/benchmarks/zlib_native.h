@@ -0,0 +1,41 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Streaming compression with the native zlib, the baseline of the sandboxed
+// zlib benchmarks. Kept apart from them, as zlib.h clashes with the
+// declarations in the generated SAPI header.
+
+#ifndef SANDBOXED_API_BENCHMARKS_ZLIB_NATIVE_H_
+#define SANDBOXED_API_BENCHMARKS_ZLIB_NATIVE_H_
+
+#include <cstddef>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace sapi {
+
+// Compresses 'input' the same way the sandboxed benchmark does: in chunks of
+// 'chunk_size' bytes, with an output buffer of the same size. Appends the
+// result to 'output'. Returns false if zlib failed.
+bool NativeDeflate(absl::string_view input, size_t chunk_size,
+                   std::string* output);
+
+// Decompresses 'input' in chunks of 'chunk_size' bytes, see NativeDeflate().
+bool NativeInflate(absl::string_view input, size_t chunk_size,
+                   std::string* output);
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_BENCHMARKS_ZLIB_NATIVE_H_
@@ -27,6 +27,62 @@ struct ReallocRequest {
   uint64_t size;
 };
 
+// Request to operate on sandboxee memory in place, sent with kMsgMemset,
+// kMsgMemcpy and kMsgMemcmp. kMsgMemset fills 'size' bytes at 'dst' with
+// copies of the first 'pattern_size' bytes of 'pattern', kMsgMemcpy moves
+// 'size' bytes from 'src' to 'dst' and kMsgMemcmp compares them.
+struct MemoryRequest {
+  uint64_t dst;
+  uint64_t src;
+  uint64_t size;
+  uint64_t pattern;
+  uint64_t pattern_size;
+};
+
+// Region of sandboxee memory transferred with kMsgWriteMemory and
+// kMsgReadMemory. Both requests start with a uint64_t count of regions followed
+// by the regions. kMsgWriteMemory then carries their contents, which the reply
+// to kMsgReadMemory consists of.
+struct MemoryRegion {
+  uint64_t addr;
+  uint64_t size;
+};
+
+// A kMsgCallInline request carries small pointed-to variables along with a
+// call: a CallInlineHeader, the regions and their contents in the
+// kMsgWriteMemory encoding, then the call in the encoding of 'tag'
+// (kMsgCall or kMsgCallCompact). The sandboxee writes the contents into place
+// before it makes the call.
+struct CallInlineHeader {
+  uint32_t tag;
+  uint32_t reserved;
+};
+
+// A kMsgCallPlan request is a CallPlanHeader followed by 'num_calls' FuncCall,
+// 'num_links' CallPlanLink and 'num_stops' CallPlanStop entries. The calls
+// run in order, the reply holds a FuncRet for each call that ran.
+struct CallPlanHeader {
+  uint64_t num_calls;
+  uint64_t num_links;
+  uint64_t num_stops;
+};
+
+// Before call 'call' runs, its argument 'arg' is replaced by the integer
+// return value of the earlier call 'source'.
+struct CallPlanLink {
+  uint32_t call;
+  uint32_t arg;
+  uint32_t source;
+  uint32_t reserved;
+};
+
+// The plan stops after call 'call' if its return value, in the width of the
+// return type, equals 'value'.
+struct CallPlanStop {
+  uint64_t call;
+  uint64_t value;
+};
+
 // Types of TAGs used with Comms channel.
 // Call:
 constexpr uint32_t kMsgCall = 0x101;
@@ -38,11 +94,57 @@ constexpr uint32_t kMsgSendFd = 0x106;
 constexpr uint32_t kMsgRecvFd = 0x107;
 constexpr uint32_t kMsgClose = 0x108;
 constexpr uint32_t kMsgReallocate = 0x109;
+constexpr uint32_t kMsgCallBatch = 0x10A;
+constexpr uint32_t kMsgSharedMemory = 0x10B;
+constexpr uint32_t kMsgCallCompact = 0x10C;
+constexpr uint32_t kMsgMapBuffer = 0x10D;
+constexpr uint32_t kMsgAddChannel = 0x10E;
+constexpr uint32_t kMsgAllocateBatch = 0x10F;
+constexpr uint32_t kMsgFreeBatch = 0x110;
+constexpr uint32_t kMsgSendFds = 0x111;
+constexpr uint32_t kMsgSymbolBatch = 0x112;
+constexpr uint32_t kMsgMapBuffers = 0x113;
+constexpr uint32_t kMsgHostCallChannel = 0x114;
+// Not answered, see RPCChannel::SetTraceContext().
+constexpr uint32_t kMsgTraceContext = 0x115;
+constexpr uint32_t kMsgMemset = 0x116;
+constexpr uint32_t kMsgMemcpy = 0x117;
+constexpr uint32_t kMsgMemcmp = 0x118;
+constexpr uint32_t kMsgPrefault = 0x119;
+constexpr uint32_t kMsgWriteMemory = 0x11A;
+constexpr uint32_t kMsgReadMemory = 0x11B;
+constexpr uint32_t kMsgCallPlan = 0x11C;
+// Start and end a request region, see RPCChannel::BeginRegion().
+constexpr uint32_t kMsgRegionBegin = 0x11D;
+constexpr uint32_t kMsgRegionEnd = 0x11E;
+constexpr uint32_t kMsgCallInline = 0x11F;
+// Heap profiling, see RPCChannel::SetHeapSampling().
+constexpr uint32_t kMsgHeapSampling = 0x120;
+constexpr uint32_t kMsgHeapProfile = 0x121;
+// See RPCChannel::EnableMemoryMerging().
+constexpr uint32_t kMsgMergePages = 0x122;
+// See RPCChannel::MapLazy().
+constexpr uint32_t kMsgMapLazy = 0x123;
+// See RPCChannel::BeginCheckpoint().
+constexpr uint32_t kMsgCheckpoint = 0x124;
+constexpr uint32_t kMsgRollback = 0x125;
+// See RPCChannel::EnableArena().
+constexpr uint32_t kMsgArena = 0x126;
 // Return:
 constexpr uint32_t kMsgReturn = 0x201;
+// Reply to kMsgHostCall, errors are sent as a sapi::StatusProto instead.
+constexpr uint32_t kMsgHostReturn = 0x202;
+// Sandboxee to host, over the host callback channel:
+constexpr uint32_t kMsgHostCall = 0x301;
 
 }  // namespace comms
 
+// A single argument of a function call.
+union FuncArg {
+  uintptr_t arg_int;
+  long double arg_float;
+};
+
 struct FuncCall {
   // Used with HandleCallMsg:
   enum {
@@ -50,8 +152,14 @@ struct FuncCall {
     kArgsMax = 12,
   };
 
+  // Identifies asynchronous requests, echoed back in FuncRet. Zero for
+  // synchronous requests.
+  uint64_t request_id;
   // Function to be called.
   char func[kFuncNameMax];
+  // Address of the function as returned by kMsgSymbol. Used instead of 'func'
+  // if non-zero.
+  uint64_t handle;
   // Return type.
   v::Type ret_type;
   // Size of the return value (in bytes).
@@ -63,10 +171,7 @@ struct FuncCall {
   // Size (in bytes) of input arguments.
   size_t arg_size[kArgsMax];
   // Arguments to the call.
-  union {
-    uintptr_t arg_int;
-    long double arg_float;
-  } args[kArgsMax];
+  FuncArg args[kArgsMax];
   // Auxiliary type:
   //  For pointers: type of the data it points to,
   //  For others: unspecified.
@@ -75,7 +180,41 @@ struct FuncCall {
   size_t aux_size[kArgsMax];
 };
 
+// Compact encoding of a FuncCall as sent with kMsgCallCompact: the header is
+// followed by 'argc' FuncCallCompactArg entries. The function is identified
+// by its handle, so neither the name nor unused argument slots are sent.
+struct FuncCallCompact {
+  uint64_t request_id;
+  uint64_t handle;
+  v::Type ret_type;
+  uint32_t argc;
+  uint64_t ret_size;
+};
+
+struct FuncCallCompactArg {
+  v::Type type;
+  v::Type aux_type;
+  uint64_t size;
+  uint64_t aux_size;
+  FuncArg value;
+};
+
+// Request to map a shared buffer, sent with kMsgMapBuffer. The file
+// descriptor of the buffer follows the request.
+struct MapBufferRequest {
+  uint64_t size;
+  // Offset of the mapped window in the file.
+  uint64_t offset;
+  // Address of a mapping of the same size which the window replaces in
+  // place, zero for a new mapping.
+  uint64_t addr;
+  // Protection of the mapping, PROT_READ optionally with PROT_WRITE.
+  int32_t prot;
+};
+
 struct FuncRet {
+  // Copied from FuncCall::request_id.
+  uint64_t request_id;
   // Return type:
   v::Type ret_type;
   // Return value.
@@ -85,6 +224,8 @@ struct FuncRet {
   };
   // Status of the operation: success/failure.
   bool success;
+  // Time the sandboxee spent executing the function, in nanoseconds.
+  uint64_t exec_time_ns;
 };
 
 }  // namespace sapi
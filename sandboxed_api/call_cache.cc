@@ -0,0 +1,154 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/call_cache.h"
+
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/var_ptr.h"
+#include "sandboxed_api/var_type.h"
+
+namespace sapi {
+
+constexpr size_t CallCache::kMaxPointedBytes;
+
+namespace {
+
+// Appends the raw bytes of 'value' to 'key'.
+template <typename T>
+void AppendBytes(const T& value, std::string* key) {
+  key->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+}  // namespace
+
+void CallCache::Configure(const std::vector<std::string>& funcs,
+                          size_t capacity) {
+  absl::MutexLock lock(&mutex_);
+  funcs_.clear();
+  if (capacity > 0) {
+    funcs_.insert(funcs.begin(), funcs.end());
+  }
+  capacity_ = capacity;
+  entries_.clear();
+  index_.clear();
+}
+
+bool CallCache::MakeKey(const std::string& func, v::Callable* ret,
+                        std::initializer_list<v::Callable*> args,
+                        std::string* key) const {
+  if (ret->GetType() == v::Type::kFd || !IsEnabled(func)) {
+    return false;
+  }
+  key->assign(func);
+  key->push_back('\0');
+  for (auto* arg : args) {
+    const v::Type type = arg->GetType();
+    if (type == v::Type::kFd) {
+      // The descriptor number says nothing about what it refers to.
+      return false;
+    }
+    AppendBytes(type, key);
+    if (type != v::Type::kPointer) {
+      AppendBytes(arg->GetSize(), key);
+      key->append(static_cast<const char*>(arg->GetDataPtr()), arg->GetSize());
+      continue;
+    }
+    // Cast is safe, since type is v::Type::kPointer
+    auto* p = static_cast<v::Ptr*>(arg);
+    // Pointers synchronized after the call are outputs, which a cache hit
+    // would leave untouched. Without synchronization, the sandboxee may see
+    // contents other than the local ones.
+    if (p->GetSyncType() != v::Pointable::SYNC_BEFORE) {
+      return false;
+    }
+    const v::Var* var = p->GetPointedVar();
+    if (var->GetLocal() == nullptr || var->GetSize() > kMaxPointedBytes) {
+      return false;
+    }
+    absl::string_view contents(static_cast<const char*>(var->GetLocal()),
+                               var->GetSize());
+    AppendBytes(contents.size(), key);
+    key->append(contents.data(), contents.size());
+  }
+  return true;
+}
+
+bool CallCache::MakeScalarKey(const CallSignature& sig, const FuncArg* args,
+                              std::string* key) const {
+  if (!IsEnabled(sig.name)) {
+    return false;
+  }
+  key->assign(sig.name);
+  key->push_back('\0');
+  for (size_t i = 0; i < sig.argc; ++i) {
+    if (sig.arg_type[i] == v::Type::kPointer) {
+      return false;
+    }
+    // The same bytes as v::Reg<T>::GetDataPtr(), see MarshalScalar().
+    AppendBytes(sig.arg_type[i], key);
+    AppendBytes(sig.arg_size[i], key);
+    key->append(reinterpret_cast<const char*>(&args[i]), sig.arg_size[i]);
+  }
+  return true;
+}
+
+bool CallCache::Lookup(const std::string& key, FuncRet* ret) {
+  absl::MutexLock lock(&mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  *ret = it->second->second;
+  return true;
+}
+
+void CallCache::Insert(const std::string& key, const FuncRet& ret) {
+  absl::MutexLock lock(&mutex_);
+  if (capacity_ == 0) {
+    return;
+  }
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    // Another thread made the same call concurrently.
+    it->second->second = ret;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  if (entries_.size() >= capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  entries_.emplace_front(key, ret);
+  index_[key] = entries_.begin();
+}
+
+bool CallCache::IsEnabled(const std::string& func) const {
+  absl::MutexLock lock(&mutex_);
+  return funcs_.contains(func);
+}
+
+uint64_t CallCache::hits() const {
+  absl::MutexLock lock(&mutex_);
+  return hits_;
+}
+
+uint64_t CallCache::misses() const {
+  absl::MutexLock lock(&mutex_);
+  return misses_;
+}
+
+}  // namespace sapi
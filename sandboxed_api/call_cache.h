@@ -0,0 +1,95 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host-side cache of the results of pure functions, see
+// sapi::Sandbox::GetCachedFunctions().
+
+#ifndef SANDBOXED_API_CALL_CACHE_H_
+#define SANDBOXED_API_CALL_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/call.h"
+#include "sandboxed_api/call_signature.h"
+#include "sandboxed_api/var_reg.h"
+
+namespace sapi {
+
+// Thread-safe LRU cache of function results, keyed by the function name and
+// the contents of its arguments. Only the functions it is configured with are
+// cached.
+class CallCache {
+ public:
+  // Pointed-to buffers are part of the key verbatim, so that no two calls
+  // share a result unless their arguments are equal. Calls with larger ones
+  // are not cached.
+  static constexpr size_t kMaxPointedBytes = 256;
+
+  // Enables caching of 'funcs' with room for 'capacity' results in total, and
+  // discards all cached results. An empty list or a zero capacity disables
+  // the cache.
+  void Configure(const std::vector<std::string>& funcs, size_t capacity);
+
+  // Returns the key of a call to 'func', or false if the call cannot be
+  // cached: 'func' is not enabled, or an argument or the return value is a
+  // file descriptor or a pointer which is not only synchronized before the
+  // call, or which points to more than kMaxPointedBytes.
+  bool MakeKey(const std::string& func, v::Callable* ret,
+               std::initializer_list<v::Callable*> args,
+               std::string* key) const;
+
+  // Same for a call made with Sandbox::CallScalar(). Raw pointers into the
+  // sandboxee cannot be cached.
+  bool MakeScalarKey(const CallSignature& sig, const FuncArg* args,
+                     std::string* key) const;
+
+  // Returns the cached result for 'key' and marks it as most recently used.
+  bool Lookup(const std::string& key, FuncRet* ret);
+
+  // Stores the result for 'key', evicting the least recently used result if
+  // the cache is full.
+  void Insert(const std::string& key, const FuncRet& ret);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  using Entry = std::pair<std::string, FuncRet>;
+
+  bool IsEnabled(const std::string& func) const;
+
+  mutable absl::Mutex mutex_;
+  absl::flat_hash_set<std::string> funcs_ GUARDED_BY(mutex_);
+  size_t capacity_ GUARDED_BY(mutex_) = 0;
+  // Most recently used first.
+  std::list<Entry> entries_ GUARDED_BY(mutex_);
+  absl::flat_hash_map<std::string, std::list<Entry>::iterator> index_
+      GUARDED_BY(mutex_);
+  uint64_t hits_ GUARDED_BY(mutex_) = 0;
+  uint64_t misses_ GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_CALL_CACHE_H_
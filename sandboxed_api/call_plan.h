@@ -0,0 +1,94 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sapi::CallPlan class describes a sequence of dependent calls, which
+// Sandbox::RunPlan() executes in a single round-trip.
+
+#ifndef SANDBOXED_API_CALL_PLAN_H_
+#define SANDBOXED_API_CALL_PLAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sandboxed_api/call.h"
+#include "sandboxed_api/var_reg.h"
+
+namespace sapi {
+
+// A plan of calls whose arguments may refer to the return values of earlier
+// calls of the same plan, such as a handle returned by an open() function.
+// The sandboxee makes the calls in order and stops at the first failing call
+// or at the first call returning one of its stop values. Pointers are
+// synchronized before the first and after the last call, as with
+// Sandbox::CallBatch().
+//
+// Example:
+//   v::RemotePtr handle_placeholder(nullptr);
+//   v::GenericPtr handle, none;
+//   v::Int ok;
+//   CallPlan plan;
+//   size_t open = plan.AddCall("lib_open", &handle, {path.PtrBefore()});
+//   plan.StopIfEquals(open, 0);
+//   size_t process = plan.AddCall("lib_process", &ok,
+//                                 {&handle_placeholder, buf.PtrBefore()});
+//   plan.UseResult(process, 0, open);
+//   SAPI_ASSIGN_OR_RETURN(size_t num_run, sandbox->RunPlan(plan));
+class CallPlan {
+ public:
+  struct Call {
+    std::string func;
+    v::Callable* ret;
+    std::vector<v::Callable*> args;
+  };
+
+  // Appends a call and returns its index in the plan.
+  size_t AddCall(std::string func, v::Callable* ret,
+                 std::vector<v::Callable*> args) {
+    calls_.push_back({std::move(func), ret, std::move(args)});
+    return calls_.size() - 1;
+  }
+
+  // Passes the return value of the earlier call 'source' as argument 'arg' of
+  // call 'call'. Both have to be integers or pointers. The argument given to
+  // AddCall() only determines the type, pointers should be v::RemotePtr so
+  // that nothing is synchronized for them.
+  CallPlan& UseResult(size_t call, size_t arg, size_t source) {
+    links_.push_back({static_cast<uint32_t>(call), static_cast<uint32_t>(arg),
+                      static_cast<uint32_t>(source), 0});
+    return *this;
+  }
+
+  // Stops the plan after call 'call' if it returned 'value', e.g. a null
+  // handle or -1. The values are compared in the width of the return type.
+  CallPlan& StopIfEquals(size_t call, uint64_t value) {
+    stops_.push_back({call, value});
+    return *this;
+  }
+
+  const std::vector<Call>& calls() const { return calls_; }
+  const std::vector<comms::CallPlanLink>& links() const { return links_; }
+  const std::vector<comms::CallPlanStop>& stops() const { return stops_; }
+
+ private:
+  std::vector<Call> calls_;
+  std::vector<comms::CallPlanLink> links_;
+  std::vector<comms::CallPlanStop> stops_;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_CALL_PLAN_H_
@@ -0,0 +1,99 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compile-time descriptions of functions taking only scalar arguments, as used
+// by the typed stubs emitted by the code generator. See
+// sapi::Sandbox::CallScalar(). Also the per-API table of function names which
+// lets the other stubs identify functions by index.
+
+#ifndef SANDBOXED_API_CALL_SIGNATURE_H_
+#define SANDBOXED_API_CALL_SIGNATURE_H_
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+#include "sandboxed_api/call.h"
+#include "sandboxed_api/var_type.h"
+
+namespace sapi {
+
+// Name, return type and argument types of a function. Instances are created
+// with MakeCallSignature() and must have static storage duration, as their
+// address identifies the function in the per-channel handle cache.
+struct CallSignature {
+  const char* name;
+  v::Type ret_type;
+  size_t ret_size;
+  size_t argc;
+  v::Type arg_type[FuncCall::kArgsMax];
+  size_t arg_size[FuncCall::kArgsMax];
+};
+
+// Names of the functions of a generated API, which identifies them by their
+// index. Must have static storage duration, like a CallSignature, as its
+// address keys the function handles resolved for it.
+struct FunctionTable {
+  const char* const* names;
+  size_t size;
+};
+
+namespace internal {
+
+// Maps a scalar C++ type to its v::Type.
+template <typename T>
+constexpr v::Type ScalarType() {
+  static_assert(std::is_void<T>::value || std::is_arithmetic<T>::value ||
+                    std::is_enum<T>::value || std::is_pointer<T>::value,
+                "Only scalar types can be passed to CallScalar()");
+  return std::is_void<T>::value
+             ? v::Type::kVoid
+             : std::is_floating_point<T>::value
+                   ? v::Type::kFloat
+                   : std::is_pointer<T>::value ? v::Type::kPointer
+                                               : v::Type::kInt;
+}
+
+template <typename T>
+struct ScalarSize : std::integral_constant<size_t, sizeof(T)> {};
+template <>
+struct ScalarSize<void> : std::integral_constant<size_t, 0> {};
+
+// Stores 'value' in an argument slot, the same way v::Reg<T> does.
+template <typename T>
+FuncArg MarshalScalar(T value) {
+  FuncArg arg{};
+  memcpy(&arg, &value, sizeof(value));
+  return arg;
+}
+
+}  // namespace internal
+
+// Returns the signature of a function named 'name' with return type R and
+// argument types Args.
+template <typename R, typename... Args>
+constexpr CallSignature MakeCallSignature(const char* name) {
+  static_assert(sizeof...(Args) <= FuncCall::kArgsMax,
+                "Too many arguments for a call into the sandboxee");
+  return {name,
+          internal::ScalarType<R>(),
+          internal::ScalarSize<R>::value,
+          sizeof...(Args),
+          {internal::ScalarType<Args>()...},
+          {sizeof(Args)...}};
+}
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_CALL_SIGNATURE_H_
@@ -0,0 +1,73 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/call_stats.h"
+
+#include <algorithm>
+
+namespace sapi {
+
+constexpr int LatencyHistogram::kNumBuckets;
+
+void LatencyHistogram::Add(absl::Duration d) {
+  ++count_;
+  total_ += d;
+  max_ = std::max(max_, d);
+  int bucket = 0;
+  int64_t us = absl::ToInt64Microseconds(d);
+  while (us > 0 && bucket < kNumBuckets - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  ++buckets_[bucket];
+}
+
+void CallStatsCollector::Record(const std::string& func,
+                                const CallSample& sample) {
+  absl::MutexLock lock(&mutex_);
+  CallStats& stats = stats_[func];
+  ++stats.calls;
+  if (!sample.ok) {
+    ++stats.errors;
+  }
+  stats.marshal.Add(sample.marshal);
+  stats.ipc.Add(sample.ipc);
+  stats.execution.Add(sample.execution);
+  stats.unmarshal.Add(sample.unmarshal);
+  stats.bytes_to_sandboxee += sample.bytes_to_sandboxee;
+  stats.bytes_from_sandboxee += sample.bytes_from_sandboxee;
+  stats.bytes_inlined += sample.bytes_inlined;
+  stats.counters += sample.counters;
+  if (exporter_) {
+    exporter_->Export(func, sample);
+  }
+}
+
+CallStatsMap CallStatsCollector::GetSnapshot() const {
+  absl::MutexLock lock(&mutex_);
+  return stats_;
+}
+
+void CallStatsCollector::Clear() {
+  absl::MutexLock lock(&mutex_);
+  stats_.clear();
+}
+
+void CallStatsCollector::SetExporter(
+    std::unique_ptr<CallStatsExporter> exporter) {
+  absl::MutexLock lock(&mutex_);
+  exporter_ = std::move(exporter);
+}
+
+}  // namespace sapi
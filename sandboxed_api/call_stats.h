@@ -0,0 +1,128 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-function statistics of calls into the sandboxee, see
+// sapi::Sandbox::CollectStats().
+
+#ifndef SANDBOXED_API_CALL_STATS_H_
+#define SANDBOXED_API_CALL_STATS_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/perf_counters.h"
+
+namespace sapi {
+
+// Histogram of durations with power-of-two buckets: bucket 0 counts durations
+// below 1us, bucket i durations in [2^(i-1)us, 2^i us). The last bucket also
+// counts all longer durations.
+class LatencyHistogram {
+ public:
+  static constexpr int kNumBuckets = 32;
+
+  void Add(absl::Duration d);
+
+  uint64_t count() const { return count_; }
+  absl::Duration total() const { return total_; }
+  absl::Duration max() const { return max_; }
+  const std::array<uint64_t, kNumBuckets>& buckets() const { return buckets_; }
+
+ private:
+  uint64_t count_ = 0;
+  absl::Duration total_;
+  absl::Duration max_;
+  std::array<uint64_t, kNumBuckets> buckets_{};
+};
+
+// A single call, split into its phases.
+struct CallSample {
+  bool ok = false;
+  // Preparing the arguments and copying memory to the sandboxee.
+  absl::Duration marshal;
+  // Round-trip to the sandboxee, without the execution of the function.
+  absl::Duration ipc;
+  // Execution of the function, as measured by the sandboxee.
+  absl::Duration execution;
+  // Storing the result and copying memory back from the sandboxee.
+  absl::Duration unmarshal;
+  // Memory synchronized in each direction.
+  uint64_t bytes_to_sandboxee = 0;
+  uint64_t bytes_from_sandboxee = 0;
+  // Part of bytes_to_sandboxee sent inside the call request, see
+  // Sandbox::GetInlineTransferThreshold().
+  uint64_t bytes_inlined = 0;
+  // Counted on the sandboxee's threads during the call, all zero unless
+  // Sandbox::CollectPerfCounters() returns true.
+  PerfCounterValues counters;
+};
+
+// Aggregated statistics of all calls to a function.
+struct CallStats {
+  uint64_t calls = 0;
+  uint64_t errors = 0;
+  LatencyHistogram marshal;
+  LatencyHistogram ipc;
+  LatencyHistogram execution;
+  LatencyHistogram unmarshal;
+  uint64_t bytes_to_sandboxee = 0;
+  uint64_t bytes_from_sandboxee = 0;
+  uint64_t bytes_inlined = 0;
+  // Sum over all calls.
+  PerfCounterValues counters;
+};
+
+// Statistics of a sandbox, by function name.
+using CallStatsMap = absl::flat_hash_map<std::string, CallStats>;
+
+// Receives every recorded call, e.g. to forward it to a monitoring system.
+// Export() is called on the thread that made the call, with the collector's
+// lock held. It should return quickly and must not call into the sandbox.
+class CallStatsExporter {
+ public:
+  virtual ~CallStatsExporter() = default;
+
+  virtual void Export(const std::string& func, const CallSample& sample) = 0;
+};
+
+// Thread-safe collection of call statistics.
+class CallStatsCollector {
+ public:
+  // Adds a call to the statistics of 'func' and passes it to the exporter.
+  void Record(const std::string& func, const CallSample& sample);
+
+  // Returns a copy of the statistics collected so far.
+  CallStatsMap GetSnapshot() const;
+
+  // Discards all statistics collected so far.
+  void Clear();
+
+  // Sets the exporter receiving all subsequent calls, nullptr to remove it.
+  void SetExporter(std::unique_ptr<CallStatsExporter> exporter);
+
+ private:
+  mutable absl::Mutex mutex_;
+  CallStatsMap stats_ GUARDED_BY(mutex_);
+  std::unique_ptr<CallStatsExporter> exporter_ GUARDED_BY(mutex_);
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_CALL_STATS_H_
@@ -15,23 +15,48 @@
 #include "sandboxed_api/sandbox2/client.h"
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <linux/userfaultfd.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 #include <iterator>
 #include <list>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <vector>
 
 #include <glog/logging.h>
+#include "google/protobuf/arena.h"
 #include "google/protobuf/descriptor.h"
 #include "google/protobuf/message.h"
 #include "sandboxed_api/util/flag.h"
+#include "absl/base/attributes.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
 #include "sandboxed_api/call.h"
+#include "sandboxed_api/heap_profiler.h"
+#include "sandboxed_api/host_callback.h"
 #include "sandboxed_api/lenval_core.h"
-#include "sandboxed_api/proto_arg.pb.h"
+#include "sandboxed_api/native_call.h"
+#include "sandboxed_api/proto_helper.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkingclient.h"
+#include "sandboxed_api/shared_memory_transport.h"
+#include "sandboxed_api/tracing.h"
 #include "sandboxed_api/vars.h"
 
 #ifdef MEMORY_SANITIZER
@@ -41,9 +66,31 @@
 #include <ffi.h>
 #include <ffitarget.h>
 
+ABSL_FLAG(string, sapi_template_init, "",
+          "Function run once in the forkserver before any sandboxee is "
+          "spawned (warm template)");
+ABSL_FLAG(bool, sapi_huge_page_text, false,
+          "Remap the code onto transparent huge pages in the forkserver");
+
+// Profile runtimes of binaries built for profile-guided optimization, only
+// linked in when instrumented.
+extern "C" void __gcov_dump() ABSL_ATTRIBUTE_WEAK;
+extern "C" int __llvm_profile_write_file() ABSL_ATTRIBUTE_WEAK;
+
 namespace sapi {
 namespace {
 
+// exit_group() skips the atexit() handlers which write the profile of an
+// instrumented sandboxee, write it explicitly.
+void WriteProfile() {
+  if (&__gcov_dump != nullptr) {
+    __gcov_dump();
+  }
+  if (&__llvm_profile_write_file != nullptr) {
+    __llvm_profile_write_file();
+  }
+}
+
 // Guess the FFI type on the basis of data size and float/non-float/bool.
 ffi_type* GetFFIType(size_t size, v::Type type) {
   switch (type) {
@@ -94,10 +141,6 @@ class FunctionCallPreparer {
   explicit FunctionCallPreparer(const FuncCall& call) {
     CHECK(call.argc <= FuncCall::kArgsMax)
         << "Number of arguments of a sandbox call exceeds limits.";
-    for (int i = 0; i < call.argc; ++i) {
-      arg_types_[i] = GetFFIType(call.arg_size[i], call.arg_type[i]);
-    }
-    ret_type_ = GetFFIType(call.ret_size, call.ret_type);
     for (int i = 0; i < call.argc; ++i) {
       if (call.arg_type[i] == v::Type::kPointer &&
           call.aux_type[i] == v::Type::kProto) {
@@ -121,47 +164,48 @@ class FunctionCallPreparer {
       LenValStruct* lvs = idx_proto.first;
       // There is no way to figure out whether the protobuf structure has
       // changed or not, so we always serialize the protobuf again and replace
-      // the LenValStruct content.
-      std::vector<uint8_t> serialized = SerializeProto(*proto).ValueOrDie();
-      // Reallocate the LV memory to match its length.
-      if (lvs->size != serialized.size()) {
-        void* newdata = realloc(lvs->data, serialized.size());
+      // the LenValStruct content. The message is serialized in place, after
+      // growing the LV memory if it is too small.
+      const size_t size = GetSerializedProtoSize(*proto);
+      if (size > lvs->capacity) {
+        void* newdata = realloc(lvs->data, size);
         if (!newdata) {
-          LOG(FATAL) << "Failed to reallocate protobuf buffer (size="
-                     << serialized.size() << ")";
+          LOG(FATAL) << "Failed to reallocate protobuf buffer (size=" << size
+                     << ")";
         }
-        lvs->size = serialized.size();
         lvs->data = newdata;
+        lvs->capacity = size;
       }
-      memcpy(lvs->data, serialized.data(), serialized.size());
-
-      delete proto;
+      lvs->size = size;
+      SerializeProtoToArray(*proto, static_cast<uint8_t*>(lvs->data));
     }
+    // The messages are owned by arena_.
   }
 
-  ffi_type* ret_type() const { return ret_type_; }
-  ffi_type** arg_types() const { return const_cast<ffi_type**>(arg_types_); }
   void** arg_values() const { return const_cast<void**>(arg_values_); }
 
  private:
   // Deserializes the protobuf argument.
   google::protobuf::Message** GetDeserializedProto(LenValStruct* src) {
-    ProtoArg proto_arg;
-    if (!proto_arg.ParseFromArray(src->data, src->size)) {
-      LOG(FATAL) << "Unable to parse ProtoArg.";
+    absl::string_view name;
+    absl::string_view payload;
+    if (!SplitSerializedProto(static_cast<const uint8_t*>(src->data),
+                              src->size, &name, &payload)) {
+      LOG(FATAL) << "Unable to parse protobuf argument.";
     }
+    const std::string full_name(name);
     const google::protobuf::Descriptor* desc =
         google::protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(
-            proto_arg.full_name());
+            full_name);
     LOG_IF(FATAL, desc == nullptr) << "Unable to find the descriptor for '"
-                                   << proto_arg.full_name() << "'" << desc;
+                                   << full_name << "'" << desc;
     google::protobuf::Message* deserialized_proto =
-        google::protobuf::MessageFactory::generated_factory()->GetPrototype(desc)->New();
+        google::protobuf::MessageFactory::generated_factory()->GetPrototype(desc)->New(
+            &arena_);
     LOG_IF(FATAL, deserialized_proto == nullptr)
-        << "Unable to create deserialized proto for " << proto_arg.full_name();
-    if (!deserialized_proto->ParseFromString(proto_arg.protobuf_data())) {
-      LOG(FATAL) << "Unable to deserialized proto for "
-                 << proto_arg.full_name();
+        << "Unable to create deserialized proto for " << full_name;
+    if (!deserialized_proto->ParseFromArray(payload.data(), payload.size())) {
+      LOG(FATAL) << "Unable to deserialized proto for " << full_name;
     }
     protos_to_be_destroyed_.push_back({src, deserialized_proto});
     return &protos_to_be_destroyed_.back().second;
@@ -171,11 +215,157 @@ class FunctionCallPreparer {
   // Contains pairs of lenval message pointer -> deserialized message
   // so that we can serialize the argument again after the function call.
   std::list<std::pair<LenValStruct*, google::protobuf::Message*>> protos_to_be_destroyed_;
-  ffi_type* ret_type_;
-  ffi_type* arg_types_[FuncCall::kArgsMax];
+  // Owns the deserialized messages, so that they are freed all at once.
+  google::protobuf::Arena arena_;
   const void* arg_values_[FuncCall::kArgsMax];
 };
 
+// A resolved function together with its generated thunk, or its prepared
+// libffi call interface if there is none. The ffi_cif refers to arg_types, so
+// instances must not be moved once prepared.
+struct PreparedCall {
+  void* func;
+  NativeThunk thunk = nullptr;
+  ffi_cif cif;
+  ffi_type* arg_types[FuncCall::kArgsMax];
+};
+
+// Returns the handle of the main program, which is used for all symbol
+// lookups. The handle is obtained only once per sandboxee.
+void* GetProgramHandle() {
+  static void* handle = dlopen(nullptr, RTLD_NOW);
+  return handle;
+}
+
+// Builds the key under which a prepared call is cached: the function name
+// followed by the raw bytes of the return and argument types and sizes. Calls
+// to the same function with a different signature get separate entries.
+std::string GetPreparedCallKey(const FuncCall& call) {
+  std::string key;
+  const auto append = [&key](const void* data, size_t size) {
+    key.append(reinterpret_cast<const char*>(data), size);
+  };
+  if (call.handle != 0) {
+    // Function names never start with a NUL byte.
+    key.push_back('\0');
+    append(&call.handle, sizeof(call.handle));
+  } else {
+    key.assign(call.func, strnlen(call.func, FuncCall::kFuncNameMax));
+    key.push_back('\0');
+  }
+  append(&call.ret_type, sizeof(call.ret_type));
+  append(&call.ret_size, sizeof(call.ret_size));
+  append(&call.argc, sizeof(call.argc));
+  append(call.arg_type, sizeof(call.arg_type[0]) * call.argc);
+  append(call.arg_size, sizeof(call.arg_size[0]) * call.argc);
+  return key;
+}
+
+// Returns the generated thunk for calls of 'func', see native_call.h. Calls
+// by handle are matched by the name of the symbol at that address.
+NativeThunk FindThunk(const FuncCall& call, void* func) {
+  absl::string_view name(call.func, strnlen(call.func, FuncCall::kFuncNameMax));
+  Dl_info info;
+  if (call.handle != 0) {
+    if (dladdr(func, &info) == 0 || info.dli_sname == nullptr ||
+        info.dli_saddr != func) {
+      return nullptr;
+    }
+    name = info.dli_sname;
+  }
+  const NativeThunkEntry* entry = FindNativeThunk(name);
+  return entry != nullptr && entry->argc == call.argc ? entry->thunk : nullptr;
+}
+
+// Protobuf arguments are deserialized around the call by a
+// FunctionCallPreparer, which only the libffi path uses.
+bool HasProtoArgs(const FuncCall& call) {
+  for (size_t i = 0; i < call.argc; ++i) {
+    if (call.arg_type[i] == v::Type::kPointer &&
+        call.aux_type[i] == v::Type::kProto) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Shared memory transport used for requests once the host enabled it. Each
+// thread serves its own channel, see HandleAddChannelMsg().
+std::unique_ptr<SharedMemoryTransport>& GetSharedMemoryTransport() {
+  static thread_local std::unique_ptr<SharedMemoryTransport> transport;
+  return transport;
+}
+
+// Guards the state shared by all threads serving requests: the shared buffer
+// mappings and the prepared call cache.
+absl::Mutex* GetStateMutex() {
+  static auto* mutex = new absl::Mutex();
+  return mutex;
+}
+
+// Shared buffers mapped on behalf of the host, by address. Freeing such an
+// address unmaps the buffer.
+absl::flat_hash_map<uintptr_t, size_t>& GetSharedBufferMappings() {
+  static auto* mappings = new absl::flat_hash_map<uintptr_t, size_t>();
+  return *mappings;
+}
+
+// Address space reserved for request regions by the first kMsgRegionBegin.
+// While a region is active, allocations are carved out of it by a bump
+// allocator. The reservation is never unmapped, so that frees of region
+// memory arriving after the end of the region can still be recognized.
+struct RequestRegion {
+  static constexpr size_t kNoAllocation = static_cast<size_t>(-1);
+
+  uintptr_t base = 0;
+  size_t size = 0;
+  size_t used = 0;
+  // Offset of the most recent allocation, which can grow in place.
+  size_t last = kNoAllocation;
+  // Offsets of the allocations of the active region, in increasing order.
+  std::vector<size_t> allocations;
+  bool active = false;
+
+  bool Contains(uintptr_t ptr) const {
+    return size != 0 && ptr >= base && ptr - base < size;
+  }
+};
+
+constexpr size_t RequestRegion::kNoAllocation;
+
+// Guarded by GetStateMutex().
+RequestRegion& GetRequestRegion() {
+  static auto* region = new RequestRegion();
+  return *region;
+}
+
+// The block the host carves its arena allocations from, see
+// RPCChannel::EnableArena(). They are interior pointers of the block, so they
+// are never passed to realloc() or free().
+struct ArenaBlock {
+  uintptr_t base = 0;
+  size_t size = 0;
+
+  bool Contains(uintptr_t ptr) const {
+    return size != 0 && ptr >= base && ptr - base < size;
+  }
+};
+
+// Guarded by GetStateMutex().
+ArenaBlock& GetArenaBlock() {
+  static auto* arena = new ArenaBlock();
+  return *arena;
+}
+
+// Cache of prepared calls. Entries are never removed, so pointers to them stay
+// valid without holding the lock.
+absl::flat_hash_map<std::string, std::unique_ptr<PreparedCall>>&
+GetPreparedCallCache() {
+  static auto* cache =
+      new absl::flat_hash_map<std::string, std::unique_ptr<PreparedCall>>();
+  return *cache;
+}
+
 }  // namespace
 
 namespace client {
@@ -188,51 +378,237 @@ enum class Error : uintptr_t {
   kCall,
 };
 
+// Resolves the function to be called and finds its thunk or prepares its call
+// interface. Results are cached, so only the first call of a function with a
+// given signature pays for dlsym() and ffi_prep_cif().
+const PreparedCall* GetPreparedCall(const FuncCall& call, Error* error) {
+  CHECK(call.argc <= FuncCall::kArgsMax)
+      << "Number of arguments of a sandbox call exceeds limits.";
+  absl::MutexLock lock(GetStateMutex());
+  auto& cache = GetPreparedCallCache();
+  std::string key = GetPreparedCallKey(call);
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second.get();
+  }
+
+  void* handle = GetProgramHandle();
+  if (handle == nullptr) {
+    LOG(ERROR) << "dlopen(nullptr, RTLD_NOW)";
+    *error = Error::kDlOpen;
+    return nullptr;
+  }
+
+  auto prepared = absl::make_unique<PreparedCall>();
+  prepared->func = call.handle != 0 ? reinterpret_cast<void*>(call.handle)
+                                    : dlsym(handle, call.func);
+  if (prepared->func == nullptr) {
+    LOG(ERROR) << "Function '" << call.func << "' not found";
+    *error = Error::kDlSym;
+    return nullptr;
+  }
+  prepared->thunk = FindThunk(call, prepared->func);
+  for (int i = 0; i < call.argc; ++i) {
+    prepared->arg_types[i] = GetFFIType(call.arg_size[i], call.arg_type[i]);
+  }
+  if (ffi_prep_cif(&prepared->cif, FFI_DEFAULT_ABI, call.argc,
+                   GetFFIType(call.ret_size, call.ret_type),
+                   prepared->arg_types) != FFI_OK) {
+    *error = Error::kCall;
+    return nullptr;
+  }
+
+  const PreparedCall* result = prepared.get();
+  cache.emplace(std::move(key), std::move(prepared));
+  return result;
+}
+
+// Expands a kMsgCallCompact request into a FuncCall.
+FuncCall DecodeCompactCall(const std::vector<uint8_t>& bytes) {
+  FuncCallCompact hdr;
+  CHECK_GE(bytes.size(), sizeof(hdr));
+  memcpy(&hdr, bytes.data(), sizeof(hdr));
+  CHECK_LE(hdr.argc, FuncCall::kArgsMax)
+      << "Number of arguments of a sandbox call exceeds limits.";
+  CHECK_EQ(bytes.size(), sizeof(hdr) + hdr.argc * sizeof(FuncCallCompactArg));
+
+  FuncCall call{};
+  call.request_id = hdr.request_id;
+  call.handle = hdr.handle;
+  call.ret_type = hdr.ret_type;
+  call.ret_size = hdr.ret_size;
+  call.argc = hdr.argc;
+  const uint8_t* pos = bytes.data() + sizeof(hdr);
+  for (size_t i = 0; i < call.argc; ++i) {
+    FuncCallCompactArg arg;
+    memcpy(&arg, pos, sizeof(arg));
+    pos += sizeof(arg);
+    call.arg_type[i] = arg.type;
+    call.aux_type[i] = arg.aux_type;
+    call.arg_size[i] = arg.size;
+    call.aux_size[i] = arg.aux_size;
+    if (arg.type == v::Type::kFloat) {
+      call.args[i].arg_float = arg.value.arg_float;
+    } else {
+      call.args[i].arg_int = arg.value.arg_int;
+    }
+  }
+  return call;
+}
+
 // Handles requests to make function calls.
 void HandleCallMsg(const FuncCall& call, FuncRet* ret) {
   VLOG(1) << "HandleMsgCall, func: '" << call.func
           << "', # of args: " << call.argc;
 
+  ret->request_id = call.request_id;
   ret->ret_type = call.ret_type;
 
-  void* handle = dlopen(nullptr, RTLD_NOW);
-  if (handle == nullptr) {
-    LOG(ERROR) << "dlopen(nullptr, RTLD_NOW)";
+  Error error = Error::kUnset;
+  const PreparedCall* prepared = GetPreparedCall(call, &error);
+  if (prepared == nullptr) {
     ret->success = false;
-    ret->int_val = static_cast<uintptr_t>(Error::kDlOpen);
+    ret->int_val = static_cast<uintptr_t>(error);
     return;
   }
 
-  auto f = dlsym(handle, call.func);
-  if (f == nullptr) {
-    LOG(ERROR) << "Function '" << call.func << "' not found";
-    ret->success = false;
-    ret->int_val = static_cast<uintptr_t>(Error::kDlSym);
-    return;
-  }
-  FunctionCallPreparer arg_prep(call);
-  ffi_cif cif;
-  if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, call.argc, arg_prep.ret_type(),
-                   arg_prep.arg_types()) != FFI_OK) {
-    ret->success = false;
-    ret->int_val = static_cast<uintptr_t>(Error::kCall);
+  if (prepared->thunk != nullptr && !HasProtoArgs(call)) {
+    const int64_t start_ns = absl::GetCurrentTimeNanos();
+    prepared->thunk(prepared->func, call, ret);
+    ret->exec_time_ns = absl::GetCurrentTimeNanos() - start_ns;
+    ret->success = true;
     return;
   }
 
+  FunctionCallPreparer arg_prep(call);
+  // ffi_call() does not modify the call interface, the const_cast is only
+  // needed because of its C signature.
+  ffi_cif* cif = const_cast<ffi_cif*>(&prepared->cif);
+  const int64_t start_ns = absl::GetCurrentTimeNanos();
   if (ret->ret_type == v::Type::kFloat) {
-    ffi_call(&cif, FFI_FN(f), &ret->float_val, arg_prep.arg_values());
+    ffi_call(cif, FFI_FN(prepared->func), &ret->float_val,
+             arg_prep.arg_values());
   } else {
-    ffi_call(&cif, FFI_FN(f), &ret->int_val, arg_prep.arg_values());
+    ffi_call(cif, FFI_FN(prepared->func), &ret->int_val,
+             arg_prep.arg_values());
   }
+  ret->exec_time_ns = absl::GetCurrentTimeNanos() - start_ns;
 
   ret->success = true;
 }
 
+// Handles requests to make several function calls in a row. The calls are
+// executed in order, execution stops at the first failing call. Results for
+// calls that were not executed are left unset.
+void HandleCallBatchMsg(const std::vector<uint8_t>& bytes,
+                        std::vector<FuncRet>* rets) {
+  CHECK_EQ(bytes.size() % sizeof(FuncCall), 0);
+  const size_t num_calls = bytes.size() / sizeof(FuncCall);
+  VLOG(1) << "HandleCallBatchMsg, # of calls: " << num_calls;
+
+  FuncRet unset{};
+  unset.ret_type = v::Type::kVoid;
+  unset.int_val = static_cast<uintptr_t>(Error::kUnset);
+  unset.success = false;
+  rets->assign(num_calls, unset);
+
+  for (size_t i = 0; i < num_calls; ++i) {
+    FuncCall call;
+    memcpy(&call, &bytes[i * sizeof(FuncCall)], sizeof(FuncCall));
+    HandleCallMsg(call, &(*rets)[i]);
+    if (!(*rets)[i].success) {
+      break;
+    }
+  }
+}
+
+// Handles requests to run a plan of dependent calls, see comms::CallPlanHeader.
+// Stops at the first failing call and at the first call whose return value
+// matches one of its stop values. Only the results of the calls that ran are
+// returned.
+void HandleCallPlanMsg(const std::vector<uint8_t>& bytes,
+                       std::vector<FuncRet>* rets) {
+  comms::CallPlanHeader header;
+  CHECK_GE(bytes.size(), sizeof(header));
+  memcpy(&header, bytes.data(), sizeof(header));
+  CHECK_EQ(bytes.size(), sizeof(header) + header.num_calls * sizeof(FuncCall) +
+                             header.num_links * sizeof(comms::CallPlanLink) +
+                             header.num_stops * sizeof(comms::CallPlanStop));
+  VLOG(1) << "HandleCallPlanMsg, # of calls: " << header.num_calls;
+  const uint8_t* pos = bytes.data() + sizeof(header);
+  std::vector<FuncCall> calls(header.num_calls);
+  memcpy(calls.data(), pos, header.num_calls * sizeof(FuncCall));
+  pos += header.num_calls * sizeof(FuncCall);
+  std::vector<comms::CallPlanLink> links(header.num_links);
+  memcpy(links.data(), pos, header.num_links * sizeof(comms::CallPlanLink));
+  pos += header.num_links * sizeof(comms::CallPlanLink);
+  std::vector<comms::CallPlanStop> stops(header.num_stops);
+  memcpy(stops.data(), pos, header.num_stops * sizeof(comms::CallPlanStop));
+
+  rets->clear();
+  rets->reserve(calls.size());
+  for (size_t i = 0; i < calls.size(); ++i) {
+    FuncCall& call = calls[i];
+    for (const comms::CallPlanLink& link : links) {
+      if (link.call == i) {
+        CHECK_LT(link.source, i);
+        CHECK_LT(link.arg, call.argc);
+        call.args[link.arg].arg_int = (*rets)[link.source].int_val;
+      }
+    }
+    rets->emplace_back();
+    FuncRet& ret = rets->back();
+    HandleCallMsg(call, &ret);
+    if (!ret.success) {
+      return;
+    }
+    const uint64_t mask = call.ret_size >= sizeof(uint64_t)
+                              ? ~uint64_t{0}
+                              : (uint64_t{1} << (8 * call.ret_size)) - 1;
+    for (const comms::CallPlanStop& stop : stops) {
+      if (stop.call == i &&
+          (static_cast<uint64_t>(ret.int_val) & mask) == (stop.value & mask)) {
+        VLOG(1) << "Call plan stopped after call " << i;
+        return;
+      }
+    }
+  }
+}
+
+// Allocates 'size' bytes from the active request region, or returns 0 if there
+// is none or it is exhausted.
+uintptr_t AllocateFromRegion(size_t size) {
+  absl::MutexLock lock(GetStateMutex());
+  RequestRegion& region = GetRequestRegion();
+  if (!region.active) {
+    return 0;
+  }
+  const size_t offset =
+      (region.used + alignof(std::max_align_t) - 1) &
+      ~(alignof(std::max_align_t) - 1);
+  if (offset > region.size || size > region.size - offset) {
+    VLOG(1) << "Request region exhausted, allocating " << size
+            << " bytes with malloc()";
+    return 0;
+  }
+  region.last = offset;
+  region.used = offset + size;
+  region.allocations.push_back(offset);
+  return region.base + offset;
+}
+
 // Handles requests to allocate memory inside the sandboxee.
 void HandleAllocMsg(const uintptr_t size, FuncRet* ret) {
   VLOG(1) << "HandleAllocMsg: size=" << size;
 
   ret->ret_type = v::Type::kPointer;
+  ret->int_val = AllocateFromRegion(static_cast<size_t>(size));
+  if (ret->int_val != 0) {
+    // Fresh pages of the anonymous mapping read as zero, which also keeps the
+    // memory sanitizer happy.
+    ret->success = true;
+    return;
+  }
 #ifdef MEMORY_SANITIZER
   // Memory is copied to the pointer using an API that the memory sanitizer
   // is blind to (process_vm_writev). Initialize the memory here so that
@@ -245,15 +621,81 @@ void HandleAllocMsg(const uintptr_t size, FuncRet* ret) {
   ret->success = true;
 }
 
+// Handles requests to allocate several regions at once, one uint64_t size per
+// region. Failed allocations are returned as null pointers.
+void HandleAllocBatchMsg(const std::vector<uint8_t>& bytes,
+                         std::vector<FuncRet>* rets) {
+  CHECK_EQ(bytes.size() % sizeof(uint64_t), 0);
+  const size_t num_allocs = bytes.size() / sizeof(uint64_t);
+  VLOG(1) << "HandleAllocBatchMsg, # of allocations: " << num_allocs;
+
+  rets->resize(num_allocs);
+  for (size_t i = 0; i < num_allocs; ++i) {
+    uint64_t size;
+    memcpy(&size, &bytes[i * sizeof(uint64_t)], sizeof(uint64_t));
+    (*rets)[i] = FuncRet{};
+    HandleAllocMsg(static_cast<uintptr_t>(size), &(*rets)[i]);
+  }
+}
+
 // Like HandleAllocMsg(), but handles requests to reallocate memory.
 void HandleReallocMsg(uintptr_t ptr, uintptr_t size, FuncRet* ret) {
   VLOG(1) << "HandleReallocMsg(" << absl::StrCat(absl::Hex(ptr)) << ", " << size
           << ")";
+  ret->ret_type = v::Type::kPointer;
+  bool in_region = false;
+  bool in_arena = false;
+  size_t copy = 0;
+  {
+    absl::MutexLock lock(GetStateMutex());
+    RequestRegion& region = GetRequestRegion();
+    const ArenaBlock& arena = GetArenaBlock();
+    in_region = region.Contains(ptr);
+    in_arena = !in_region && arena.Contains(ptr);
+    if (in_arena) {
+      // Arena blocks are moved out of the arena. Their size is not known
+      // either, but the arena is mapped up to its end.
+      copy = std::min<size_t>(size, arena.base + arena.size - ptr);
+    }
+    if (in_region) {
+      const size_t offset = ptr - region.base;
+      auto next = std::upper_bound(region.allocations.begin(),
+                                   region.allocations.end(), offset);
+      if (!region.active || next == region.allocations.begin() ||
+          *std::prev(next) != offset) {
+        // Memory of an ended region, its contents are gone.
+        LOG(ERROR) << "Reallocation of " << absl::StrCat(absl::Hex(ptr))
+                   << ", which is no allocation of the active request region";
+        ret->int_val = 0;
+        ret->success = false;
+        return;
+      }
+      // Grows or shrinks the most recent allocation in place.
+      if (offset == region.last && size <= region.size - offset) {
+        region.used = offset + size;
+        ret->int_val = ptr;
+        ret->success = true;
+        return;
+      }
+      // The size of the allocation is not known, but it ends before the next
+      // one starts.
+      copy = std::min<size_t>(
+          size, (next != region.allocations.end() ? *next : region.used) -
+                    offset);
+    }
+  }
+  if (in_region || in_arena) {
+    HandleAllocMsg(size, ret);
+    if (ret->int_val != 0) {
+      memcpy(reinterpret_cast<void*>(ret->int_val),
+             reinterpret_cast<const void*>(ptr), copy);
+    }
+    return;
+  }
 #ifdef MEMORY_SANITIZER
   const size_t orig_size =
       __sanitizer_get_allocated_size(reinterpret_cast<const void*>(ptr));
 #endif
-  ret->ret_type = v::Type::kPointer;
   ret->int_val = reinterpret_cast<uintptr_t>(
       realloc(const_cast<void*>(reinterpret_cast<const void*>(ptr)), size));
   ret->success = true;
@@ -273,7 +715,161 @@ void HandleReallocMsg(uintptr_t ptr, uintptr_t size, FuncRet* ret) {
 void HandleFreeMsg(uintptr_t ptr, FuncRet* ret) {
   VLOG(1) << "HandleFreeMsg: free(0x" << absl::StrCat(absl::Hex(ptr)) << ")";
 
-  free(const_cast<void*>(reinterpret_cast<const void*>(ptr)));
+  absl::MutexLock lock(GetStateMutex());
+  auto& mappings = GetSharedBufferMappings();
+  auto it = mappings.find(ptr);
+  if (it != mappings.end()) {
+    munmap(reinterpret_cast<void*>(ptr), it->second);
+    mappings.erase(it);
+  } else if (!GetRequestRegion().Contains(ptr) &&
+             !GetArenaBlock().Contains(ptr)) {
+    // Region and arena memory are released together with their block.
+    free(const_cast<void*>(reinterpret_cast<const void*>(ptr)));
+  }
+  ret->ret_type = v::Type::kVoid;
+  ret->success = true;
+  ret->int_val = 0ULL;
+}
+
+// Handles requests to allocate the block of the host's arena.
+void HandleArenaMsg(uintptr_t size, FuncRet* ret) {
+  VLOG(1) << "HandleArenaMsg: size=" << size;
+  ret->ret_type = v::Type::kPointer;
+  ret->int_val = 0;
+  absl::MutexLock lock(GetStateMutex());
+  ArenaBlock& arena = GetArenaBlock();
+  if (arena.size != 0) {
+    LOG(ERROR) << "Arena already allocated";
+    ret->success = false;
+    return;
+  }
+  void* block = malloc(size);
+  if (block != nullptr) {
+    arena.base = reinterpret_cast<uintptr_t>(block);
+    arena.size = size;
+  }
+  ret->int_val = reinterpret_cast<uintptr_t>(block);
+  ret->success = true;
+}
+
+// Handles requests to operate on memory in place, see comms::MemoryRequest.
+void HandleMemoryMsg(uint32_t tag, const comms::MemoryRequest& req,
+                     FuncRet* ret) {
+  VLOG(1) << "HandleMemoryMsg(0x" << absl::StrCat(absl::Hex(tag)) << ", 0x"
+          << absl::StrCat(absl::Hex(req.dst)) << ", 0x"
+          << absl::StrCat(absl::Hex(req.src)) << ", " << req.size << ")";
+  auto* dst = reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(req.dst));
+  const auto* src =
+      reinterpret_cast<const uint8_t*>(static_cast<uintptr_t>(req.src));
+  const size_t size = req.size;
+  ret->ret_type = v::Type::kInt;
+  ret->int_val = 0;
+  ret->success = true;
+  switch (tag) {
+    case comms::kMsgMemset: {
+      const size_t pattern_size = req.pattern_size;
+      if (pattern_size == 0 || pattern_size > sizeof(req.pattern) ||
+          size % pattern_size != 0) {
+        ret->success = false;
+        return;
+      }
+      if (pattern_size == 1) {
+        memset(dst, static_cast<uint8_t>(req.pattern), size);
+        return;
+      }
+      if (size == 0) {
+        return;
+      }
+      // Double the filled prefix until the whole region is covered.
+      memcpy(dst, &req.pattern, pattern_size);
+      size_t filled = pattern_size;
+      while (filled < size) {
+        const size_t chunk = std::min(filled, size - filled);
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+      }
+      return;
+    }
+    case comms::kMsgMemcpy:
+      memmove(dst, src, size);
+      return;
+    case comms::kMsgMemcmp:
+      ret->int_val = memcmp(dst, src, size);
+      return;
+  }
+}
+
+// Returns the regions of a kMsgWriteMemory or kMsgReadMemory request starting
+// at 'bytes' and sets 'contents' to the offset of the bytes following them.
+std::vector<comms::MemoryRegion> ParseMemoryRegions(const uint8_t* bytes,
+                                                    size_t size,
+                                                    size_t* contents) {
+  uint64_t num_regions;
+  CHECK_GE(size, sizeof(num_regions));
+  memcpy(&num_regions, bytes, sizeof(num_regions));
+  CHECK_LE(num_regions,
+           (size - sizeof(num_regions)) / sizeof(comms::MemoryRegion));
+  std::vector<comms::MemoryRegion> regions(num_regions);
+  memcpy(regions.data(), bytes + sizeof(num_regions),
+         num_regions * sizeof(comms::MemoryRegion));
+  *contents = sizeof(num_regions) + num_regions * sizeof(comms::MemoryRegion);
+  return regions;
+}
+
+// Writes the regions of a kMsgWriteMemory encoding starting at 'bytes' into
+// place and sets 'end' to the offset following their contents. Returns false
+// if the contents are truncated.
+bool WriteMemoryRegions(const uint8_t* bytes, size_t size, size_t* end) {
+  size_t pos;
+  std::vector<comms::MemoryRegion> regions =
+      ParseMemoryRegions(bytes, size, &pos);
+  for (const comms::MemoryRegion& region : regions) {
+    if (region.size > size - pos) {
+      return false;
+    }
+    memcpy(reinterpret_cast<void*>(static_cast<uintptr_t>(region.addr)),
+           bytes + pos, region.size);
+    pos += region.size;
+  }
+  *end = pos;
+  return true;
+}
+
+// Handles writes of memory sent over the Comms channel, for hosts which cannot
+// use process_vm_writev(), see comms::MemoryRegion.
+void HandleWriteMemoryMsg(const std::vector<uint8_t>& bytes, FuncRet* ret) {
+  size_t unused;
+  ret->ret_type = v::Type::kVoid;
+  ret->int_val = 0;
+  ret->success = WriteMemoryRegions(bytes.data(), bytes.size(), &unused);
+}
+
+// Handles reads of memory over the Comms channel, the contents of the regions
+// are the reply.
+void HandleReadMemoryMsg(const std::vector<uint8_t>& bytes,
+                         std::vector<uint8_t>* contents) {
+  size_t unused;
+  std::vector<comms::MemoryRegion> regions =
+      ParseMemoryRegions(bytes.data(), bytes.size(), &unused);
+  for (const comms::MemoryRegion& region : regions) {
+    const auto* data = reinterpret_cast<const uint8_t*>(
+        static_cast<uintptr_t>(region.addr));
+    contents->insert(contents->end(), data, data + region.size);
+  }
+}
+
+// Handles requests to free several regions at once, one uint64_t address per
+// region.
+void HandleFreeBatchMsg(const std::vector<uint8_t>& bytes, FuncRet* ret) {
+  CHECK_EQ(bytes.size() % sizeof(uint64_t), 0);
+  const size_t num_frees = bytes.size() / sizeof(uint64_t);
+  VLOG(1) << "HandleFreeBatchMsg, # of frees: " << num_frees;
+
+  for (size_t i = 0; i < num_frees; ++i) {
+    uint64_t addr;
+    memcpy(&addr, &bytes[i * sizeof(uint64_t)], sizeof(uint64_t));
+    HandleFreeMsg(static_cast<uintptr_t>(addr), ret);
+  }
   ret->ret_type = v::Type::kVoid;
   ret->success = true;
   ret->int_val = 0ULL;
@@ -283,7 +879,7 @@ void HandleFreeMsg(uintptr_t ptr, FuncRet* ret) {
 void HandleSymbolMsg(const char* symname, FuncRet* ret) {
   ret->ret_type = v::Type::kPointer;
 
-  void* handle = dlopen(nullptr, RTLD_NOW);
+  void* handle = GetProgramHandle();
   if (handle == nullptr) {
     ret->success = false;
     ret->int_val = static_cast<uintptr_t>(Error::kDlOpen);
@@ -294,6 +890,20 @@ void HandleSymbolMsg(const char* symname, FuncRet* ret) {
   ret->success = true;
 }
 
+// Handles requests to find several symbols, given as consecutive NUL-terminated
+// names.
+void HandleSymbolBatchMsg(const std::vector<uint8_t>& bytes,
+                          std::vector<FuncRet>* rets) {
+  CHECK(bytes.empty() || bytes.back() == '\0');
+  const char* names = reinterpret_cast<const char*>(bytes.data());
+  for (size_t pos = 0; pos < bytes.size(); pos += strlen(names + pos) + 1) {
+    FuncRet ret{};
+    HandleSymbolMsg(names + pos, &ret);
+    rets->push_back(ret);
+  }
+  VLOG(1) << "HandleSymbolBatchMsg, # of symbols: " << rets->size();
+}
+
 // Handles requests to receive a file descriptor from sandboxer.
 void HandleSendFd(sandbox2::Comms* comms, FuncRet* ret) {
   ret->ret_type = v::Type::kInt;
@@ -308,6 +918,33 @@ void HandleSendFd(sandbox2::Comms* comms, FuncRet* ret) {
   ret->success = true;
 }
 
+// Handles requests to receive several file descriptors from sandboxer, one
+// result per file descriptor.
+void HandleSendFds(sandbox2::Comms* comms, uint64_t num_fds,
+                   std::vector<FuncRet>* rets) {
+  FuncRet failed{};
+  failed.ret_type = v::Type::kInt;
+  failed.int_val = static_cast<uintptr_t>(-1);
+  failed.success = false;
+  rets->assign(num_fds, failed);
+
+  std::vector<int> fds;
+  if (!comms->RecvFDs(&fds)) {
+    return;
+  }
+  if (fds.size() != num_fds) {
+    LOG(ERROR) << "Expected " << num_fds << " fds, got " << fds.size();
+    for (int fd : fds) {
+      close(fd);
+    }
+    return;
+  }
+  for (size_t i = 0; i < num_fds; ++i) {
+    (*rets)[i].int_val = fds[i];
+    (*rets)[i].success = true;
+  }
+}
+
 // Handles requests to send a file descriptor back to sandboxer.
 void HandleRecvFd(sandbox2::Comms* comms, int fd_to_transfer, FuncRet* ret) {
   ret->ret_type = v::Type::kVoid;
@@ -329,6 +966,373 @@ void HandleCloseFd(sandbox2::Comms* comms, int fd_to_close, FuncRet* ret) {
   ret->success = true;
 }
 
+// Handles requests to switch to a shared memory transport. The reply to this
+// request is still sent over the Comms channel.
+void HandleSharedMemoryMsg(sandbox2::Comms* comms, FuncRet* ret) {
+  ret->ret_type = v::Type::kVoid;
+  int fd = -1;
+  if (!comms->RecvFD(&fd)) {
+    ret->success = false;
+    return;
+  }
+  auto transport_or = SharedMemoryTransport::CreateFromFd(fd);
+  if (!transport_or.ok()) {
+    LOG(ERROR) << "Cannot map shared memory region: " << transport_or.status();
+    close(fd);
+    ret->success = false;
+    return;
+  }
+  GetSharedMemoryTransport() = std::move(transport_or).ValueOrDie();
+  ret->success = true;
+}
+
+// Handles requests to map a shared buffer, whose file descriptor follows the
+// request.
+// Maps 'size' bytes of the shared buffer 'fd' with protection 'prot' and closes
+// 'fd'.
+void MapBuffer(int fd, uint64_t size, int prot, FuncRet* ret,
+               uint64_t offset = 0, uintptr_t replaced = 0) {
+  ret->ret_type = v::Type::kPointer;
+  ret->int_val = 0;
+  if (prot != PROT_READ && prot != (PROT_READ | PROT_WRITE)) {
+    LOG(ERROR) << "Unsupported protection for a shared buffer: " << prot;
+    close(fd);
+    ret->success = false;
+    return;
+  }
+  absl::MutexLock lock(GetStateMutex());
+  auto& mappings = GetSharedBufferMappings();
+  int flags = MAP_SHARED;
+  if (replaced != 0) {
+    // Only windows mapped before can be replaced, with ones of the same size.
+    auto it = mappings.find(replaced);
+    if (it == mappings.end() || it->second != size) {
+      LOG(ERROR) << "No shared buffer of size " << size << " at 0x"
+                 << absl::StrCat(absl::Hex(replaced));
+      close(fd);
+      ret->success = false;
+      return;
+    }
+    flags |= MAP_FIXED;
+  }
+  void* addr = mmap(reinterpret_cast<void*>(replaced), size, prot, flags, fd,
+                    offset);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "mmap(size: " << size << ", offset: " << offset << ")";
+    if (replaced != 0) {
+      // A failed MAP_FIXED mapping may have removed the old one.
+      mappings.erase(replaced);
+    }
+    ret->success = false;
+    return;
+  }
+  if (offset != 0 || replaced != 0) {
+    // A window of a larger file, read it ahead.
+    madvise(addr, size, MADV_WILLNEED);
+  }
+  mappings[reinterpret_cast<uintptr_t>(addr)] = size;
+  ret->int_val = reinterpret_cast<uintptr_t>(addr);
+  ret->success = true;
+}
+
+void HandleMapBufferMsg(sandbox2::Comms* comms,
+                        const MapBufferRequest& request, FuncRet* ret) {
+  int fd = -1;
+  if (!comms->RecvFD(&fd)) {
+    ret->ret_type = v::Type::kPointer;
+    ret->int_val = 0;
+    ret->success = false;
+    return;
+  }
+  MapBuffer(fd, request.size, request.prot, ret, request.offset,
+            static_cast<uintptr_t>(request.addr));
+}
+
+// Handles requests to map several shared buffers, whose sizes are in 'bytes'
+// and whose file descriptors follow the request.
+void HandleMapBuffersMsg(sandbox2::Comms* comms,
+                         const std::vector<uint8_t>& bytes,
+                         std::vector<FuncRet>* rets) {
+  CHECK_EQ(bytes.size() % sizeof(uint64_t), 0);
+  const size_t num_buffers = bytes.size() / sizeof(uint64_t);
+  VLOG(1) << "HandleMapBuffersMsg, # of buffers: " << num_buffers;
+
+  FuncRet failed{};
+  failed.ret_type = v::Type::kPointer;
+  failed.int_val = 0;
+  failed.success = false;
+  rets->assign(num_buffers, failed);
+
+  std::vector<int> fds;
+  if (!comms->RecvFDs(&fds)) {
+    return;
+  }
+  if (fds.size() != num_buffers) {
+    LOG(ERROR) << "Expected " << num_buffers << " fds, got " << fds.size();
+    for (int fd : fds) {
+      close(fd);
+    }
+    return;
+  }
+  for (size_t i = 0; i < num_buffers; ++i) {
+    uint64_t size;
+    memcpy(&size, &bytes[i * sizeof(uint64_t)], sizeof(uint64_t));
+    MapBuffer(fds[i], size, PROT_READ | PROT_WRITE, &(*rets)[i]);
+  }
+}
+
+// Handles requests to map 'size' bytes of memory whose pages the host provides
+// as they are first touched, see RPCChannel::MapLazy(). The first result is
+// the address of the mapping, the second the userfaultfd the range is
+// registered with, which the host then fetches with kMsgRecvFd.
+void HandleMapLazyMsg(uint64_t size, std::vector<FuncRet>* rets) {
+  FuncRet failed{};
+  failed.ret_type = v::Type::kPointer;
+  failed.int_val = 0;
+  failed.success = false;
+  rets->assign(2, failed);
+  (*rets)[1].ret_type = v::Type::kInt;
+
+  // Faults in the kernel, e.g. in read() into the range, are not reported
+  // with UFFD_USER_MODE_ONLY. The host only provides inputs, so reading them
+  // from user mode is enough, and unprivileged sandboxees need the flag.
+  int uffd = syscall(__NR_userfaultfd,
+                     O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  if (uffd == -1 && errno == EINVAL) {
+    // Before Linux 5.11.
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  }
+  if (uffd == -1) {
+    PLOG(ERROR) << "userfaultfd()";
+    return;
+  }
+  struct uffdio_api api = {};
+  api.api = UFFD_API;
+  if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+    PLOG(ERROR) << "ioctl(UFFDIO_API)";
+    close(uffd);
+    return;
+  }
+  void* addr = mmap(nullptr, size, PROT_READ,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "mmap(size: " << size << ")";
+    close(uffd);
+    return;
+  }
+  struct uffdio_register reg = {};
+  reg.range.start = reinterpret_cast<uintptr_t>(addr);
+  reg.range.len = (size + getpagesize() - 1) & ~(getpagesize() - 1ULL);
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+    PLOG(ERROR) << "ioctl(UFFDIO_REGISTER)";
+    munmap(addr, size);
+    close(uffd);
+    return;
+  }
+  {
+    // Freed like a shared buffer.
+    absl::MutexLock lock(GetStateMutex());
+    GetSharedBufferMappings()[reinterpret_cast<uintptr_t>(addr)] = size;
+  }
+  (*rets)[0].int_val = reinterpret_cast<uintptr_t>(addr);
+  (*rets)[0].success = true;
+  (*rets)[1].int_val = uffd;
+  (*rets)[1].success = true;
+}
+
+void ServeRequest(sandbox2::Comms* comms);
+
+// Handles requests to set up the channel for calls back into the host, whose
+// file descriptor follows the request.
+void HandleHostCallChannelMsg(sandbox2::Comms* comms, FuncRet* ret) {
+  ret->ret_type = v::Type::kVoid;
+  int fd = -1;
+  if (!comms->RecvFD(&fd)) {
+    ret->success = false;
+    return;
+  }
+  internal::SetHostCallChannel(fd);
+  ret->success = true;
+}
+
+// Reads one byte of each page of the read-only segments of a loaded object,
+// after advising the kernel to read them ahead. Counts the pages in '*data'.
+int PrefaultObject(struct dl_phdr_info* info, size_t size, void* data) {
+  static const uintptr_t page_size = getauxval(AT_PAGESZ);
+  auto* pages = static_cast<uint64_t*>(data);
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_R) ||
+        (phdr.p_flags & PF_W)) {
+      continue;
+    }
+    const uintptr_t start =
+        (info->dlpi_addr + phdr.p_vaddr) & ~(page_size - 1);
+    const uintptr_t end = info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz;
+    madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+    for (uintptr_t page = start; page < end; page += page_size) {
+      static_cast<void>(*reinterpret_cast<volatile const char*>(page));
+      ++*pages;
+    }
+  }
+  return 0;
+}
+
+// Handles requests to start a request region of up to 'capacity' bytes. The
+// address space is reserved by the first request, later ones must not ask for
+// more.
+void HandleRegionBeginMsg(uint64_t capacity, FuncRet* ret) {
+  VLOG(1) << "HandleRegionBeginMsg: capacity=" << capacity;
+  ret->ret_type = v::Type::kVoid;
+  ret->success = false;
+  absl::MutexLock lock(GetStateMutex());
+  RequestRegion& region = GetRequestRegion();
+  if (region.active) {
+    LOG(ERROR) << "A request region is already active";
+    return;
+  }
+  if (region.size == 0) {
+    void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      PLOG(ERROR) << "mmap(" << capacity << ")";
+      return;
+    }
+    region.base = reinterpret_cast<uintptr_t>(base);
+    region.size = capacity;
+  } else if (capacity > region.size) {
+    LOG(ERROR) << "Request region of " << capacity
+               << " bytes exceeds the reservation of " << region.size;
+    return;
+  }
+  region.used = 0;
+  region.last = RequestRegion::kNoAllocation;
+  region.allocations.clear();
+  region.active = true;
+  ret->success = true;
+}
+
+// Handles requests to end the active request region. All its pages are given
+// back to the kernel at once, the reply holds the number of bytes released.
+void HandleRegionEndMsg(FuncRet* ret) {
+  ret->ret_type = v::Type::kInt;
+  absl::MutexLock lock(GetStateMutex());
+  RequestRegion& region = GetRequestRegion();
+  if (!region.active) {
+    LOG(ERROR) << "No request region is active";
+    ret->success = false;
+    return;
+  }
+  const size_t page_size = getpagesize();
+  const size_t used = (region.used + page_size - 1) & ~(page_size - 1);
+  if (used != 0 &&
+      madvise(reinterpret_cast<void*>(region.base), used, MADV_DONTNEED) ==
+          -1) {
+    PLOG(ERROR) << "madvise(MADV_DONTNEED)";
+  }
+  VLOG(1) << "HandleRegionEndMsg: released " << used << " bytes";
+  region.used = 0;
+  region.last = RequestRegion::kNoAllocation;
+  region.allocations.clear();
+  region.active = false;
+  ret->int_val = used;
+  ret->success = true;
+}
+
+// Handles requests to change the sampling distance of the heap profiler.
+void HandleHeapSamplingMsg(uint64_t sample_bytes, FuncRet* ret) {
+  ret->ret_type = v::Type::kVoid;
+  ret->int_val = 0;
+  ret->success = heap_profiler::IsAvailable();
+  if (ret->success) {
+    heap_profiler::SetSampleBytes(sample_bytes);
+  }
+}
+
+// Handles requests to pre-fault the code and read-only data of all loaded
+// objects, so that the first calls do not page them in one fault at a time.
+void HandlePrefaultMsg(FuncRet* ret) {
+  uint64_t pages = 0;
+  dl_iterate_phdr(PrefaultObject, &pages);
+  VLOG(1) << "HandlePrefaultMsg: " << pages << " page(s)";
+  ret->ret_type = v::Type::kInt;
+  ret->int_val = pages;
+  ret->success = true;
+}
+
+// Handles requests to merge the pages of the sandboxee with identical pages of
+// other processes, see Sandbox::MergeIdenticalPages().
+// The host lists the mappings, as /proc is not mounted in the sandbox.
+void HandleMergePagesMsg(const std::vector<uint8_t>& bytes, FuncRet* ret) {
+  ret->ret_type = v::Type::kVoid;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  uint64_t range[2];
+  for (size_t pos = 0; pos + sizeof(range) <= bytes.size();
+       pos += sizeof(range)) {
+    memcpy(range, bytes.data() + pos, sizeof(range));
+    ranges.emplace_back(range[0], range[1]);
+  }
+  sapi::Status status = sandbox2::Client::EnableMemoryMerging(ranges);
+  if (!status.ok()) {
+    LOG(ERROR) << "Could not enable memory merging: " << status;
+  }
+  ret->success = status.ok();
+}
+
+// Whether this process is the child forked for a checkpoint, see
+// RPCChannel::BeginCheckpoint().
+bool g_checkpoint_child = false;
+
+// Waits until the child forked for a checkpoint, 'pid', is gone and stores the
+// reply to the request it left unanswered in 'ret': kMsgRollback if the child
+// exited for it, the request it was serving if it died.
+void AwaitCheckpointChild(pid_t pid, FuncRet* ret) {
+  int status;
+  if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1) {
+    PLOG(FATAL) << "waitpid() for the checkpoint child " << pid;
+  }
+  ret->ret_type = v::Type::kVoid;
+  ret->success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!ret->success) {
+    LOG(ERROR) << "Checkpoint child " << pid << " died, status: " << status;
+    ret->int_val = static_cast<uintptr_t>(Error::kCall);
+  }
+}
+
+// Handles requests to add 'num_channels' channels, whose file descriptors
+// follow the request. Each channel is served by a thread of its own.
+void HandleAddChannelMsg(sandbox2::Comms* comms, uint64_t num_channels,
+                         FuncRet* ret) {
+  ret->ret_type = v::Type::kVoid;
+  std::vector<int> fds;
+  if (!comms->RecvFDs(&fds)) {
+    ret->success = false;
+    return;
+  }
+  if (fds.size() != num_channels) {
+    LOG(ERROR) << "Expected " << num_channels << " fds, got " << fds.size();
+    for (int fd : fds) {
+      close(fd);
+    }
+    ret->success = false;
+    return;
+  }
+  for (int fd : fds) {
+    // Never deleted, the thread serves the channel for the sandboxee's
+    // lifetime.
+    auto* channel = new sandbox2::Comms(fd);
+    std::thread([channel] {
+      while (true) {
+        ServeRequest(channel);
+      }
+    }).detach();
+  }
+  ret->success = true;
+}
+
 template <typename T>
 static T BytesAs(const std::vector<uint8_t>& bytes) {
   static_assert(std::is_trivial<T>(),
@@ -339,11 +1343,46 @@ static T BytesAs(const std::vector<uint8_t>& bytes) {
   return rv;
 }
 
+// Handles calls which carry the memory of small variables, see
+// comms::CallInlineHeader.
+static void HandleCallInlineMsg(const std::vector<uint8_t>& bytes,
+                                FuncRet* ret) {
+  comms::CallInlineHeader hdr;
+  CHECK_GE(bytes.size(), sizeof(hdr));
+  memcpy(&hdr, bytes.data(), sizeof(hdr));
+  CHECK(hdr.tag == comms::kMsgCall || hdr.tag == comms::kMsgCallCompact)
+      << "Unknown call encoding of an inline call: " << hdr.tag;
+  size_t end;
+  CHECK(WriteMemoryRegions(bytes.data() + sizeof(hdr),
+                           bytes.size() - sizeof(hdr), &end))
+      << "Truncated memory of an inline call";
+  const std::vector<uint8_t> call(bytes.begin() + sizeof(hdr) + end,
+                                  bytes.end());
+  HandleCallMsg(hdr.tag == comms::kMsgCall ? BytesAs<FuncCall>(call)
+                                           : DecodeCompactCall(call),
+                ret);
+}
+
 void ServeRequest(sandbox2::Comms* comms) {
   uint32_t tag;
-  std::vector<uint8_t> bytes;
+  // Reused for all requests served by this thread, unless a large request
+  // left it with an oversized allocation.
+  constexpr size_t kMaxRetainedRequestSize = 1 << 20;
+  static thread_local std::vector<uint8_t> bytes;
+  if (bytes.capacity() > kMaxRetainedRequestSize) {
+    std::vector<uint8_t>().swap(bytes);
+  }
 
-  CHECK(comms->RecvTLV(&tag, &bytes));
+  // Replies take the same path as the request they answer.
+  SharedMemoryTransport* transport = GetSharedMemoryTransport().get();
+  const auto send_reply = [comms, transport](const void* data, size_t size) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(data);
+    return transport ? transport->SendReply(comms::kMsgReturn, size, bytes)
+                     : comms->SendTLV(comms::kMsgReturn, size, bytes);
+  };
+
+  CHECK(transport ? transport->RecvRequest(&tag, &bytes)
+                  : comms->RecvTLV(&tag, &bytes));
 
   FuncRet ret{};
   ret.ret_type = v::Type::kVoid;
@@ -355,10 +1394,42 @@ void ServeRequest(sandbox2::Comms* comms) {
       VLOG(1) << "Client::kMsgCall";
       HandleCallMsg(BytesAs<FuncCall>(bytes), &ret);
       break;
+    case comms::kMsgCallCompact:
+      VLOG(1) << "Client::kMsgCallCompact";
+      HandleCallMsg(DecodeCompactCall(bytes), &ret);
+      break;
+    case comms::kMsgCallInline:
+      VLOG(1) << "Client::kMsgCallInline";
+      HandleCallInlineMsg(bytes, &ret);
+      break;
+    case comms::kMsgCallBatch:
+      VLOG(1) << "Client::kMsgCallBatch";
+      {
+        std::vector<FuncRet> rets;
+        HandleCallBatchMsg(bytes, &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
+    case comms::kMsgCallPlan:
+      VLOG(1) << "Client::kMsgCallPlan";
+      {
+        std::vector<FuncRet> rets;
+        HandleCallPlanMsg(bytes, &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
     case comms::kMsgAllocate:
       VLOG(1) << "Client::kMsgAllocate";
       HandleAllocMsg(BytesAs<uintptr_t>(bytes), &ret);
       break;
+    case comms::kMsgAllocateBatch:
+      VLOG(1) << "Client::kMsgAllocateBatch";
+      {
+        std::vector<FuncRet> rets;
+        HandleAllocBatchMsg(bytes, &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
     case comms::kMsgReallocate:
       VLOG(1) << "Client::kMsgReallocate";
       {
@@ -367,10 +1438,35 @@ void ServeRequest(sandbox2::Comms* comms) {
                          static_cast<uintptr_t>(req.size), &ret);
       }
       break;
+    case comms::kMsgMemset:
+    case comms::kMsgMemcpy:
+    case comms::kMsgMemcmp:
+      HandleMemoryMsg(tag, BytesAs<comms::MemoryRequest>(bytes), &ret);
+      break;
+    case comms::kMsgWriteMemory:
+      VLOG(1) << "Client::kMsgWriteMemory";
+      HandleWriteMemoryMsg(bytes, &ret);
+      break;
+    case comms::kMsgReadMemory:
+      VLOG(1) << "Client::kMsgReadMemory";
+      {
+        std::vector<uint8_t> contents;
+        HandleReadMemoryMsg(bytes, &contents);
+        CHECK(send_reply(contents.data(), contents.size()));
+      }
+      return;
     case comms::kMsgFree:
       VLOG(1) << "Client::kMsgFree";
       HandleFreeMsg(BytesAs<uintptr_t>(bytes), &ret);
       break;
+    case comms::kMsgFreeBatch:
+      VLOG(1) << "Client::kMsgFreeBatch";
+      HandleFreeBatchMsg(bytes, &ret);
+      if (!transport) {
+        // Not answered over the Comms channel, see RPCChannel::FreeDeferred().
+        return;
+      }
+      break;
     case comms::kMsgSymbol:
       CHECK_EQ(bytes.size(),
                1 + std::distance(bytes.begin(),
@@ -378,14 +1474,31 @@ void ServeRequest(sandbox2::Comms* comms) {
       VLOG(1) << "Received Client::kMsgSymbol message";
       HandleSymbolMsg(reinterpret_cast<const char*>(bytes.data()), &ret);
       break;
+    case comms::kMsgSymbolBatch:
+      VLOG(1) << "Received Client::kMsgSymbolBatch message";
+      {
+        std::vector<FuncRet> rets;
+        HandleSymbolBatchMsg(bytes, &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
     case comms::kMsgExit:
       VLOG(1) << "Received Client::kMsgExit message";
+      WriteProfile();
       syscall(__NR_exit_group, 0UL);
       break;
     case comms::kMsgSendFd:
       VLOG(1) << "Received Client::kMsgSendFd message";
       HandleSendFd(comms, &ret);
       break;
+    case comms::kMsgSendFds:
+      VLOG(1) << "Received Client::kMsgSendFds message";
+      {
+        std::vector<FuncRet> rets;
+        HandleSendFds(comms, BytesAs<uint64_t>(bytes), &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
     case comms::kMsgRecvFd:
       VLOG(1) << "Received Client::kMsgRecvFd message";
       HandleRecvFd(comms, BytesAs<int>(bytes), &ret);
@@ -394,6 +1507,106 @@ void ServeRequest(sandbox2::Comms* comms) {
       VLOG(1) << "Received Client::kMsgClose message";
       HandleCloseFd(comms, BytesAs<int>(bytes), &ret);
       break;
+    case comms::kMsgMapBuffer:
+      VLOG(1) << "Received Client::kMsgMapBuffer message";
+      HandleMapBufferMsg(comms, BytesAs<MapBufferRequest>(bytes), &ret);
+      break;
+    case comms::kMsgMapBuffers:
+      VLOG(1) << "Received Client::kMsgMapBuffers message";
+      {
+        std::vector<FuncRet> rets;
+        HandleMapBuffersMsg(comms, bytes, &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
+    case comms::kMsgSharedMemory:
+      VLOG(1) << "Received Client::kMsgSharedMemory message";
+      HandleSharedMemoryMsg(comms, &ret);
+      break;
+    case comms::kMsgAddChannel:
+      VLOG(1) << "Received Client::kMsgAddChannel message";
+      HandleAddChannelMsg(comms, BytesAs<uint64_t>(bytes), &ret);
+      break;
+    case comms::kMsgHostCallChannel:
+      VLOG(1) << "Received Client::kMsgHostCallChannel message";
+      HandleHostCallChannelMsg(comms, &ret);
+      break;
+    case comms::kMsgHeapSampling:
+      VLOG(1) << "Received Client::kMsgHeapSampling message";
+      HandleHeapSamplingMsg(BytesAs<uint64_t>(bytes), &ret);
+      break;
+    case comms::kMsgHeapProfile:
+      VLOG(1) << "Received Client::kMsgHeapProfile message";
+      {
+        const std::string profile = heap_profiler::GetProfile();
+        CHECK(send_reply(profile.data(), profile.size()));
+      }
+      return;
+    case comms::kMsgPrefault:
+      VLOG(1) << "Received Client::kMsgPrefault message";
+      HandlePrefaultMsg(&ret);
+      break;
+    case comms::kMsgMergePages:
+      VLOG(1) << "Received Client::kMsgMergePages message";
+      HandleMergePagesMsg(bytes, &ret);
+      break;
+    case comms::kMsgMapLazy:
+      VLOG(1) << "Received Client::kMsgMapLazy message";
+      {
+        std::vector<FuncRet> rets;
+        HandleMapLazyMsg(BytesAs<uint64_t>(bytes), &rets);
+        CHECK(send_reply(rets.data(), sizeof(FuncRet) * rets.size()));
+      }
+      return;
+    case comms::kMsgCheckpoint:
+      VLOG(1) << "Received Client::kMsgCheckpoint message";
+      {
+        const pid_t pid = fork();
+        if (pid == 0) {
+          // The child serves the requests from here on, the parent answers
+          // this one.
+          g_checkpoint_child = true;
+          return;
+        }
+        ret.ret_type = v::Type::kInt;
+        if (pid == -1) {
+          PLOG(ERROR) << "fork() for a checkpoint";
+          break;
+        }
+        ret.int_val = pid;
+        ret.success = true;
+        CHECK(send_reply(&ret, sizeof(ret)));
+        AwaitCheckpointChild(pid, &ret);
+      }
+      break;
+    case comms::kMsgRollback:
+      VLOG(1) << "Received Client::kMsgRollback message";
+      if (g_checkpoint_child) {
+        // Answered by the parent, once this process is gone.
+        syscall(__NR_exit_group, 0UL);
+      }
+      // Nothing to roll back, the child died already.
+      ret.success = true;
+      break;
+    case comms::kMsgRegionBegin:
+      VLOG(1) << "Received Client::kMsgRegionBegin message";
+      HandleRegionBeginMsg(BytesAs<uint64_t>(bytes), &ret);
+      break;
+    case comms::kMsgRegionEnd:
+      VLOG(1) << "Received Client::kMsgRegionEnd message";
+      HandleRegionEndMsg(&ret);
+      break;
+    case comms::kMsgArena:
+      VLOG(1) << "Received Client::kMsgArena message";
+      HandleArenaMsg(BytesAs<uint64_t>(bytes), &ret);
+      break;
+    case comms::kMsgTraceContext:
+      VLOG(1) << "Received Client::kMsgTraceContext message";
+      SetSandboxeeTraceContext(
+          std::string(reinterpret_cast<const char*>(bytes.data()),
+                      bytes.size()));
+      // Not answered, see RPCChannel::SetTraceContext().
+      return;
     default:
       LOG(FATAL) << "Received unknown tag: " << tag;
       break;  // Not reached
@@ -408,8 +1621,19 @@ void ServeRequest(sandbox2::Comms* comms) {
             << "), Success: " << (ret.success ? "Yes" : "No");
   }
 
-  CHECK(comms->SendTLV(comms::kMsgReturn, sizeof(ret),
-                       reinterpret_cast<uint8_t*>(&ret)));
+  CHECK(send_reply(&ret, sizeof(ret)));
+}
+
+// Runs the one-time initialization of a warm template in the forkserver, see
+// sapi::Sandbox::GetTemplateInitFunction().
+void RunTemplateInit(const std::string& name) {
+  void* handle = GetProgramHandle();
+  CHECK(handle != nullptr) << "dlopen(nullptr, RTLD_NOW)";
+  auto* init = reinterpret_cast<void (*)()>(dlsym(handle, name.c_str()));
+  CHECK(init != nullptr) << "Template init function '" << name
+                         << "' not found";
+  VLOG(1) << "Running template init function '" << name << "'";
+  init();
 }
 
 }  // namespace client
@@ -428,6 +1652,22 @@ extern "C" ABSL_ATTRIBUTE_WEAK int main(int argc, char** argv) {
   sandbox2::Comms comms{sandbox2::Comms::kSandbox2ClientCommsFD};
   sandbox2::ForkingClient s2client{&comms};
 
+  const std::string& template_init = absl::GetFlag(FLAGS_sapi_template_init);
+  if (!template_init.empty()) {
+    sapi::client::RunTemplateInit(template_init);
+  }
+  if (absl::GetFlag(FLAGS_sapi_huge_page_text)) {
+    // Only the code, the other preparations are options of the Sandbox.
+    sandbox2::ForkingClient::ZygoteOptions options;
+    options.trim_heap = false;
+    options.prefault_read_only = false;
+    options.huge_page_text = true;
+    sapi::Status status = s2client.PrepareZygote(options);
+    if (!status.ok()) {
+      LOG(WARNING) << "Could not prepare the forkserver: " << status;
+    }
+  }
+
   // Forkserver loop.
   while (true) {
     pid_t pid = s2client.WaitAndFork();
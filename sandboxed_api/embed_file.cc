@@ -15,16 +15,32 @@
 #include "sandboxed_api/embed_file.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <thread>  // NOLINT(build/c++11)
+
 #include <glog/logging.h>
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_replace.h"
 #include "absl/strings/string_view.h"
+#include "sandboxed_api/file_toc_compression.h"
 #include "sandboxed_api/sandbox2/util.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/maps_parser.h"
+#include "sandboxed_api/sandbox2/util/path.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/raw_logging.h"
 #include "sandboxed_api/util/canonical_errors.h"
@@ -34,6 +50,170 @@ namespace file_util = ::sandbox2::file_util;
 
 namespace sapi {
 
+namespace {
+
+// Usually defined in linux/memfd.h and linux/fcntl.h. Defined here to avoid
+// a dependency on UAPI headers.
+constexpr uint32_t kMfdAllowSealing = 0x0002U;
+#ifndef F_ADD_SEALS
+constexpr int F_ADD_SEALS = 1024 + 9;
+constexpr int F_SEAL_SEAL = 0x0001;
+constexpr int F_SEAL_SHRINK = 0x0002;
+constexpr int F_SEAL_GROW = 0x0004;
+constexpr int F_SEAL_WRITE = 0x0008;
+#endif
+
+constexpr mode_t kReadExecMode =
+    S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+// Maximum number of threads decompressing a FileToc.
+constexpr int kMaxDecompressionThreads = 8;
+
+bool IsCompressed(const FileToc* toc) { return toc->compressed_size > 0; }
+
+// Returns the number of threads decompressing a FileToc.
+int GetDecompressionThreads() {
+  return std::max<int>(std::min<int>(std::thread::hardware_concurrency(),
+                                     kMaxDecompressionThreads),
+                       1);
+}
+
+// Returns the hash of the uncompressed contents of 'toc', which names shared
+// files. Collisions are harmless, as the contents of a shared file are
+// compared before it is used.
+uint64_t GetContentsHash(const FileToc* toc) {
+  if (IsCompressed(toc)) {
+    auto hash_or = GetCompressedFileTocHash(
+        absl::string_view(toc->data, toc->compressed_size));
+    // Corrupt data is detected when it is decompressed.
+    return hash_or.ok() ? hash_or.ValueOrDie() : 0;
+  }
+  return HashFileTocContents(toc->data, toc->size);
+}
+
+// Writes the contents of 'toc' to the empty file 'fd', decompressing them
+// right into its pages if they are compressed.
+bool WriteContents(const FileToc* toc, int fd) {
+  if (!IsCompressed(toc)) {
+    return file_util::fileops::WriteToFD(fd, toc->data, toc->size);
+  }
+  if (toc->size == 0) {
+    return true;
+  }
+  if (ftruncate(fd, toc->size) == -1) {
+    return false;
+  }
+  void* contents =
+      mmap(nullptr, toc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (contents == MAP_FAILED) {
+    return false;
+  }
+  sapi::Status status = DecompressFileTocData(
+      absl::string_view(toc->data, toc->compressed_size),
+      static_cast<char*>(contents), toc->size, GetDecompressionThreads());
+  munmap(contents, toc->size);
+  if (!status.ok()) {
+    SAPI_RAW_LOG(ERROR, "Couldn't decompress '%s': %s", toc->name,
+                 status.message());
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+// Returns whether 'fd' is a file with the contents of 'toc' which cannot be
+// modified by other users. Compressed FileTocs are compared chunk by chunk
+// while decompressing them, which needs no more than a chunk of memory per
+// thread.
+bool IsSharedFileForFileToc(int fd, const FileToc* toc) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() ||
+      (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0 ||
+      static_cast<size_t>(st.st_size) != toc->size) {
+    return false;
+  }
+  if (toc->size == 0) {
+    return true;
+  }
+  void* contents = mmap(nullptr, toc->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (contents == MAP_FAILED) {
+    return false;
+  }
+  bool same;
+  if (IsCompressed(toc)) {
+    auto same_or = MatchesFileTocData(
+        absl::string_view(toc->data, toc->compressed_size),
+        static_cast<const char*>(contents), toc->size,
+        GetDecompressionThreads());
+    if (!same_or.ok()) {
+      SAPI_RAW_LOG(ERROR, "Couldn't decompress '%s': %s", toc->name,
+                   same_or.status().message());
+    }
+    same = same_or.ok() && same_or.ValueOrDie();
+  } else {
+    same = memcmp(contents, toc->data, toc->size) == 0;
+  }
+  munmap(contents, toc->size);
+  return same;
+}
+
+// Copies the contents of 'toc' to 'fd' from the file they are mapped from,
+// e.g. the binary itself. The kernel copies them from the page cache, so that
+// they do not have to be faulted in first. Returns false if they are not in
+// a read-only file mapping, in which case 'fd' is left unchanged.
+bool CopyFromMappedFile(const FileToc* toc, int fd) {
+  std::string maps;
+  if (!sandbox2::file::GetContents("/proc/self/maps", &maps,
+                                   sandbox2::file::Defaults())
+           .ok()) {
+    return false;
+  }
+  auto entries_or = sandbox2::ParseProcMaps(maps);
+  if (!entries_or.ok()) {
+    return false;
+  }
+  const uint64_t start = reinterpret_cast<uintptr_t>(toc->data);
+  const uint64_t end = start + toc->size;
+  for (const auto& entry : entries_or.ValueOrDie()) {
+    if (start < entry.start || end > entry.end) {
+      continue;
+    }
+    // Private writable mappings may differ from the file.
+    if (entry.is_writable || entry.inode == 0 || entry.path.empty() ||
+        entry.path[0] != '/') {
+      return false;
+    }
+    int src_fd = open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src_fd == -1) {
+      return false;
+    }
+    // The file could have been replaced since it was mapped.
+    struct stat st;
+    bool copied = fstat(src_fd, &st) == 0 && st.st_ino == entry.inode &&
+                  static_cast<int>(major(st.st_dev)) == entry.major &&
+                  static_cast<int>(minor(st.st_dev)) == entry.minor;
+    off_t offset = entry.pgoff + (start - entry.start);
+    size_t remaining = toc->size;
+    while (copied && remaining > 0) {
+      ssize_t n = sendfile(fd, src_fd, &offset, remaining);
+      if (n <= 0) {
+        copied = false;
+        break;
+      }
+      remaining -= n;
+    }
+    close(src_fd);
+    if (!copied && (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1)) {
+      SAPI_RAW_PLOG(ERROR, "Couldn't reset FD=%d", fd);
+    }
+    return copied;
+  }
+  return false;
+}
+
+}  // namespace
+
 EmbedFile* EmbedFile::GetEmbedFileSingleton() {
   static auto* embed_file_instance = new EmbedFile{};
   return embed_file_instance;
@@ -42,13 +222,16 @@ EmbedFile* EmbedFile::GetEmbedFileSingleton() {
 int EmbedFile::CreateFdForFileToc(const FileToc* toc) {
   // Create a memfd/temp file and write contents of the SAPI library to it.
   int embed_fd = -1;
-  if (!sandbox2::util::CreateMemFd(&embed_fd, toc->name)) {
+  if (!sandbox2::util::CreateMemFd(&embed_fd, toc->name, kMfdAllowSealing)) {
     SAPI_RAW_LOG(ERROR, "Couldn't create a temporary file for TOC name '%s'",
                  toc->name);
     return -1;
   }
 
-  if (!file_util::fileops::WriteToFD(embed_fd, toc->data, toc->size)) {
+  // Compressed contents are not in the mapped file as they are.
+  if (!IsCompressed(toc) && CopyFromMappedFile(toc, embed_fd)) {
+    SAPI_RAW_VLOG(3, "Copied '%s' from its mapped file", toc->name);
+  } else if (!WriteContents(toc, embed_fd)) {
     SAPI_RAW_PLOG(ERROR, "Couldn't write SAPI embed file '%s' to memfd file",
                   toc->name);
     close(embed_fd);
@@ -63,9 +246,92 @@ int EmbedFile::CreateFdForFileToc(const FileToc* toc) {
     return -1;
   }
 
+  // Seal the contents, so that they cannot be changed through other
+  // references to the file either.
+  if (fcntl(embed_fd, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == -1) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't seal FD=%d", embed_fd);
+    close(embed_fd);
+    return -1;
+  }
+
+  return embed_fd;
+}
+
+int EmbedFile::OpenSharedFdForFileToc(const std::string& dir,
+                                      const FileToc* toc) {
+  // Files on noexec mounts could be opened, but not executed.
+  struct statvfs vfs;
+  if (statvfs(dir.c_str(), &vfs) == -1) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't access shared embed file directory '%s'",
+                  dir.c_str());
+    return -1;
+  }
+  if ((vfs.f_flag & ST_NOEXEC) != 0) {
+    SAPI_RAW_LOG(ERROR, "Shared embed file directory '%s' is mounted noexec",
+                 dir.c_str());
+    return -1;
+  }
+
+  const std::string path = sandbox2::file::JoinPath(
+      dir, absl::StrCat(absl::StrReplaceAll(toc->name, {{"/", "_"}}), "-",
+                        toc->size, "-",
+                        absl::Hex(GetContentsHash(toc), absl::kZeroPad16)));
+  int embed_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (embed_fd != -1) {
+    if (!IsSharedFileForFileToc(embed_fd, toc)) {
+      SAPI_RAW_LOG(WARNING, "Ignoring mismatching shared embed file '%s'",
+                   path.c_str());
+      close(embed_fd);
+      return -1;
+    }
+    SAPI_RAW_VLOG(1, "Reusing shared embed file '%s'", path.c_str());
+    return embed_fd;
+  }
+  if (errno != ENOENT) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't open shared embed file '%s'", path.c_str());
+    return -1;
+  }
+
+  // Write to a temporary file first, so that other processes never see a
+  // partially written one.
+  std::string tmp_path = absl::StrCat(path, ".XXXXXX");
+  int tmp_fd = mkostemp(&tmp_path[0], O_CLOEXEC);
+  if (tmp_fd == -1) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't create a temporary file in '%s'",
+                  dir.c_str());
+    return -1;
+  }
+  const bool written =
+      WriteContents(toc, tmp_fd) && fchmod(tmp_fd, kReadExecMode) == 0;
+  close(tmp_fd);
+  if (!written) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't write shared embed file '%s'",
+                  tmp_path.c_str());
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  // Reopened read-only, a file still open for writing could not be executed.
+  embed_fd = open(tmp_path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (embed_fd == -1) {
+    SAPI_RAW_PLOG(ERROR, "Couldn't reopen '%s'", tmp_path.c_str());
+  } else if (link(tmp_path.c_str(), path.c_str()) == -1 && errno != EEXIST) {
+    // Another process winning the race is fine, the contents are the same.
+    SAPI_RAW_PLOG(WARNING, "Couldn't publish shared embed file '%s'",
+                  path.c_str());
+  }
+  unlink(tmp_path.c_str());
+  if (embed_fd != -1) {
+    SAPI_RAW_VLOG(1, "Created shared embed file '%s'", path.c_str());
+  }
   return embed_fd;
 }
 
+void EmbedFile::SetSharedCacheDir(absl::string_view dir) {
+  absl::MutexLock lock{&file_tocs_mutex_};
+  shared_cache_dir_ = std::string(dir);
+}
+
 int EmbedFile::GetFdForFileToc(const FileToc* toc) {
   // Access to file_tocs_ must be guarded.
   absl::MutexLock lock{&file_tocs_mutex_};
@@ -80,7 +346,13 @@ int EmbedFile::GetFdForFileToc(const FileToc* toc) {
     return entry->second;
   }
 
-  int embed_fd = CreateFdForFileToc(toc);
+  int embed_fd = -1;
+  if (!shared_cache_dir_.empty()) {
+    embed_fd = OpenSharedFdForFileToc(shared_cache_dir_, toc);
+  }
+  if (embed_fd == -1) {
+    embed_fd = CreateFdForFileToc(toc);
+  }
   if (embed_fd == -1) {
     SAPI_RAW_LOG(ERROR, "Cannot create a file for FileTOC: '%s'", toc->name);
     return -1;
@@ -15,10 +15,12 @@
 #ifndef SANDBOXED_API_EMBED_FILE_H_
 #define SANDBOXED_API_EMBED_FILE_H_
 
+#include <string>
 #include <vector>
 
 #include "sandboxed_api/file_toc.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 
 namespace sapi {
@@ -41,14 +43,31 @@ class EmbedFile {
   // Returns a duplicated file-descriptor for a given FileToc.
   int GetDupFdForFileToc(const FileToc* toc);
 
+  // Shares the files created for FileTocs with other processes through 'dir',
+  // which should be on a tmpfs not mounted noexec, e.g. a directory under
+  // /dev/shm only writable by the current user. Files are named after the
+  // name, size and a hash of the contents of a FileToc, and are only reused if
+  // they are owned by the current user, read-only and have the same contents.
+  // Compressed contents are compared while decompressing them, so the file
+  // saves memory but not the decompression. Otherwise, or if 'dir' is empty
+  // (the default), each process uses a sealed memfd of its own. Only affects
+  // FileTocs not opened yet.
+  void SetSharedCacheDir(absl::string_view dir);
+
  private:
   // Creates an executable file for a given FileToc, and return its
   // file-descriptors (-1 in case of errors).
   static int CreateFdForFileToc(const FileToc* toc);
 
+  // Opens the file for a given FileToc in 'dir', creating it if it does not
+  // exist yet. Returns -1 if there is no usable file.
+  static int OpenSharedFdForFileToc(const std::string& dir,
+                                    const FileToc* toc);
+
   // List of File TOCs and corresponding file-descriptors.
   absl::flat_hash_map<const FileToc*, int> file_tocs_
       GUARDED_BY(file_tocs_mutex_);
+  std::string shared_cache_dir_ GUARDED_BY(file_tocs_mutex_);
   absl::Mutex file_tocs_mutex_;
 };
 
@@ -15,6 +15,7 @@
 #include <sys/ptrace.h>
 
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #include "sandboxed_api/examples/stringop/lib/stringop_params.pb.h"
@@ -40,7 +41,8 @@ extern "C" int pb_duplicate_string(stringop::StringDuplication* pb) {
   return 0;
 }
 
-// Examples on raw data - both allocate and replace the data pointer.
+// Examples on raw data - reverse_string() allocates and replaces the data
+// pointer, duplicate_string() only does so if the buffer is too small.
 extern "C" int reverse_string(sapi::LenValStruct* input) {
   char* new_buf = static_cast<char*>(malloc(input->size));
   const char* src_buf = static_cast<const char*>(input->data);
@@ -57,6 +59,13 @@ extern "C" int reverse_string(sapi::LenValStruct* input) {
 }
 
 extern "C" int duplicate_string(sapi::LenValStruct* input) {
+  if (input->capacity >= 2 * input->size) {
+    char* buf = static_cast<char*>(input->data);
+    memcpy(buf + input->size, buf, input->size);
+    input->size = 2 * input->size;
+    return 1;
+  }
+
   char* new_buf = static_cast<char*>(malloc(2 * input->size));
   const char* src_buf = static_cast<const char*>(input->data);
 
@@ -71,6 +80,21 @@ extern "C" int duplicate_string(sapi::LenValStruct* input) {
   // Update structure.
   input->size = 2 * input->size;
   input->data = new_buf;
+  input->capacity = input->size;
+  return 1;
+}
+
+// Shrinks the data like code which does not know about the capacity.
+extern "C" int truncate_string(sapi::LenValStruct* input, size_t size) {
+  if (size > input->size) {
+    return 0;
+  }
+  void* new_buf = realloc(input->data, size);
+  if (new_buf == nullptr && size != 0) {
+    return 0;
+  }
+  input->data = new_buf;
+  input->size = size;
   return 1;
 }
 
@@ -20,6 +20,13 @@
 
 int sumsymbol = 5;
 
+// Set by sum_template_init(), which the forkserver runs for warm templates.
+int sum_template_value = 0;
+
+extern void sum_template_init(void) {
+  sum_template_value = 42;
+}
+
 typedef struct sum_params_s {
   int a;
   int b;
@@ -34,6 +41,11 @@ extern int sum(int a, int b) {
   return a + b;
 }
 
+// Ignores its arguments. Benchmarks call it with 0 to 12 arguments to measure
+// the call overhead per argument. The caller cleans up the arguments, so this
+// works with any number of them.
+extern void nop_args() {}
+
 extern void sums(sum_params* params) {
   params->ret =  params->a + params->b;
 }
@@ -92,6 +104,15 @@ extern int read_int(int fd) {
   return ret;
 }
 
+extern int write_ints(int fd, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (write(fd, &i, sizeof(i)) != sizeof(i)) {
+      return -1;
+    }
+  }
+  return count;
+}
+
 extern void sleep_for_sec(int sec) {
   sleep(sec);
 }
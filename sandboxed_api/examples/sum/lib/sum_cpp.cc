@@ -12,10 +12,30 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 #include <glog/logging.h>
 #include "sandboxed_api/examples/sum/lib/sum_params.pb.h"
+#include "sandboxed_api/host_callback.h"
 
 extern "C" int sumproto(const sumsapi::SumParamsProto* params) {
   LOG(INFO) << "Param is " << params->DebugString();
   return params->a() + params->b() + params->c();
 }
+
+// Has the host add 'a' and 'b', through the host callback 1.
+extern "C" int sumhost(int a, int b) {
+  const int args[] = {a, b};
+  std::vector<uint8_t> response;
+  sapi::Status status = sapi::CallHost(
+      1, {reinterpret_cast<const uint8_t*>(args), sizeof(args)}, &response);
+  int sum;
+  if (!status.ok() || response.size() != sizeof(sum)) {
+    LOG(ERROR) << "Host callback failed: " << status;
+    return -1;
+  }
+  memcpy(&sum, response.data(), sizeof(sum));
+  return sum;
+}
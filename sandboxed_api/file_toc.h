@@ -27,6 +27,9 @@ struct FileToc {
   const char* data;
   size_t size;
   unsigned char md5digest[16];  // Not used, kept for compatibility
+  // Size of 'data' if it is compressed, see file_toc_compression.h. 'size' is
+  // the uncompressed size then. 0 if 'data' is not compressed.
+  size_t compressed_size;
 };
 
 #endif  // SANDBOXED_API_FILE_TOC_H_
@@ -0,0 +1,235 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/file_toc_compression.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sapi {
+namespace {
+
+constexpr char kMagic[4] = {'S', 'Z', 'C', '1'};
+
+struct Header {
+  char magic[4];
+  uint32_t chunk_size;
+  uint64_t size;
+  uint64_t contents_hash;
+  uint32_t num_chunks;
+  uint32_t reserved;
+};
+
+// A compressed chunk and where it goes in the output.
+struct Chunk {
+  const char* data;
+  uint32_t compressed_size;
+  size_t offset;
+  size_t size;
+};
+
+sapi::StatusOr<Header> ParseHeader(absl::string_view compressed) {
+  Header header;
+  if (compressed.size() < sizeof(header)) {
+    return sapi::InvalidArgumentError("Compressed data too short");
+  }
+  memcpy(&header, compressed.data(), sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return sapi::InvalidArgumentError("Not compressed FileToc data");
+  }
+  return header;
+}
+
+// Decompresses 'chunk' into 'out', which has room for chunk.size bytes.
+sapi::Status DecompressChunk(const Chunk& chunk, char* out) {
+  uLongf size = chunk.size;
+  int rc = uncompress(reinterpret_cast<Bytef*>(out), &size,
+                      reinterpret_cast<const Bytef*>(chunk.data),
+                      chunk.compressed_size);
+  if (rc != Z_OK || size != chunk.size) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Corrupt chunk at offset ", chunk.offset, ": ", rc));
+  }
+  return sapi::OkStatus();
+}
+
+// Returns the chunks of 'compressed', whose uncompressed size has to be
+// 'size'. Also returns the chunk size in 'chunk_size'.
+sapi::StatusOr<std::vector<Chunk>> ParseChunks(absl::string_view compressed,
+                                               size_t size,
+                                               size_t* chunk_size) {
+  SAPI_ASSIGN_OR_RETURN(Header header, ParseHeader(compressed));
+  if (header.size != size || header.chunk_size == 0 ||
+      header.num_chunks !=
+          (header.size + header.chunk_size - 1) / header.chunk_size) {
+    return sapi::InvalidArgumentError("Mismatching compressed FileToc header");
+  }
+  size_t pos = sizeof(header);
+  if (compressed.size() - pos < header.num_chunks * sizeof(uint32_t)) {
+    return sapi::InvalidArgumentError("Compressed data too short");
+  }
+  std::vector<uint32_t> sizes(header.num_chunks);
+  memcpy(sizes.data(), compressed.data() + pos,
+         sizes.size() * sizeof(sizes[0]));
+  pos += sizes.size() * sizeof(sizes[0]);
+
+  std::vector<Chunk> chunks;
+  chunks.reserve(header.num_chunks);
+  for (uint32_t i = 0; i < header.num_chunks; ++i) {
+    if (compressed.size() - pos < sizes[i]) {
+      return sapi::InvalidArgumentError("Compressed data too short");
+    }
+    const size_t offset = static_cast<size_t>(i) * header.chunk_size;
+    chunks.push_back({compressed.data() + pos, sizes[i], offset,
+                      std::min<size_t>(header.chunk_size, size - offset)});
+    pos += sizes[i];
+  }
+  *chunk_size = header.chunk_size;
+  return chunks;
+}
+
+// Calls 'fn(chunk, thread_index)' for each of 'chunks' from up to
+// 'max_threads' threads, including the calling one. Returns the error of the
+// first failing chunk.
+template <typename Fn>
+sapi::Status ForEachChunk(const std::vector<Chunk>& chunks, int max_threads,
+                          const Fn& fn) {
+  // Threads take the next chunk until all are done.
+  std::atomic<size_t> next{0};
+  std::vector<sapi::Status> statuses(chunks.size());
+  auto run = [&](size_t thread_index) {
+    for (size_t i; (i = next++) < chunks.size();) {
+      statuses[i] = fn(chunks[i], thread_index);
+    }
+  };
+  const size_t num_threads =
+      std::min<size_t>(std::max(max_threads, 1), chunks.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(run, i);
+  }
+  run(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& chunk_status : statuses) {
+    SAPI_RETURN_IF_ERROR(chunk_status);
+  }
+  return sapi::OkStatus();
+}
+
+}  // namespace
+
+uint64_t HashFileTocContents(const char* data, size_t size) {
+  constexpr uint64_t kPrime = 0x100000001b3ULL;
+  uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * kPrime;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * kPrime;
+  }
+  return hash;
+}
+
+std::string CompressFileTocData(absl::string_view data, size_t chunk_size) {
+  Header header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.chunk_size = chunk_size;
+  header.size = data.size();
+  header.contents_hash = HashFileTocContents(data.data(), data.size());
+  header.num_chunks = (data.size() + chunk_size - 1) / chunk_size;
+
+  std::vector<uint32_t> sizes;
+  std::string chunks;
+  std::string buffer(compressBound(chunk_size), '\0');
+  for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+    const size_t size = std::min(chunk_size, data.size() - offset);
+    uLongf compressed_size = buffer.size();
+    // Only fails if the buffer is too small, which compressBound() rules out.
+    compress2(reinterpret_cast<Bytef*>(&buffer[0]), &compressed_size,
+              reinterpret_cast<const Bytef*>(data.data() + offset), size,
+              Z_BEST_COMPRESSION);
+    sizes.push_back(compressed_size);
+    chunks.append(buffer.data(), compressed_size);
+  }
+
+  std::string compressed(reinterpret_cast<const char*>(&header),
+                         sizeof(header));
+  compressed.append(reinterpret_cast<const char*>(sizes.data()),
+                    sizes.size() * sizeof(sizes[0]));
+  compressed.append(chunks);
+  return compressed;
+}
+
+sapi::StatusOr<uint64_t> GetCompressedFileTocHash(
+    absl::string_view compressed) {
+  SAPI_ASSIGN_OR_RETURN(Header header, ParseHeader(compressed));
+  return header.contents_hash;
+}
+
+sapi::Status DecompressFileTocData(absl::string_view compressed, char* out,
+                                   size_t size, int max_threads) {
+  size_t chunk_size;
+  SAPI_ASSIGN_OR_RETURN(std::vector<Chunk> chunks,
+                        ParseChunks(compressed, size, &chunk_size));
+  return ForEachChunk(chunks, max_threads,
+                      [out](const Chunk& chunk, size_t /*thread_index*/) {
+                        return DecompressChunk(chunk, out + chunk.offset);
+                      });
+}
+
+sapi::StatusOr<bool> MatchesFileTocData(absl::string_view compressed,
+                                        const char* contents, size_t size,
+                                        int max_threads) {
+  size_t chunk_size;
+  SAPI_ASSIGN_OR_RETURN(std::vector<Chunk> chunks,
+                        ParseChunks(compressed, size, &chunk_size));
+  // Each thread decompresses into a buffer of its own.
+  const size_t num_buffers =
+      std::min<size_t>(std::max(max_threads, 1), chunks.size());
+  std::vector<std::string> buffers(num_buffers, std::string(chunk_size, '\0'));
+  std::atomic<bool> same{true};
+  SAPI_RETURN_IF_ERROR(ForEachChunk(
+      chunks, max_threads,
+      [contents, &buffers, &same](const Chunk& chunk,
+                                  size_t thread_index) -> sapi::Status {
+        if (!same) {
+          return sapi::OkStatus();
+        }
+        char* buffer = &buffers[thread_index][0];
+        SAPI_RETURN_IF_ERROR(DecompressChunk(chunk, buffer));
+        if (memcmp(buffer, contents + chunk.offset, chunk.size) != 0) {
+          same = false;
+        }
+        return sapi::OkStatus();
+      }));
+  return same.load();
+}
+
+}  // namespace sapi
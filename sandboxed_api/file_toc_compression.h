@@ -0,0 +1,67 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compression of the data of FileTocs, see sapi_cc_embed_data(compress).
+//
+// The data is split into chunks which are deflated independently of each
+// other, so that they can be inflated in parallel. Compressed data starts with
+// a header holding the chunk size, the uncompressed size and a hash of the
+// uncompressed contents, followed by the compressed size of every chunk and
+// the chunks themselves. Integers are in the byte order of the host, as the
+// data is written and read by the same build.
+
+#ifndef SANDBOXED_API_FILE_TOC_COMPRESSION_H_
+#define SANDBOXED_API_FILE_TOC_COMPRESSION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+
+// Uncompressed size of the chunks.
+constexpr size_t kFileTocChunkSize = 1 << 20;
+
+// Hashes the contents of a FileToc. Has to be the same in all processes and in
+// the build, so absl::Hash cannot be used.
+uint64_t HashFileTocContents(const char* data, size_t size);
+
+// Compresses 'data' in chunks of 'chunk_size' bytes.
+std::string CompressFileTocData(absl::string_view data,
+                                size_t chunk_size = kFileTocChunkSize);
+
+// Returns the hash of the uncompressed contents recorded in 'compressed', see
+// HashFileTocContents().
+sapi::StatusOr<uint64_t> GetCompressedFileTocHash(absl::string_view compressed);
+
+// Decompresses 'compressed' into 'out', which has to be exactly as large as
+// the uncompressed data. Chunks are decompressed by up to 'max_threads'
+// threads.
+sapi::Status DecompressFileTocData(absl::string_view compressed, char* out,
+                                   size_t size, int max_threads);
+
+// Returns whether the 'size' bytes at 'contents' are the uncompressed data of
+// 'compressed'. Chunk by chunk, by up to 'max_threads' threads, so that only
+// one chunk per thread is decompressed at a time.
+sapi::StatusOr<bool> MatchesFileTocData(absl::string_view compressed,
+                                        const char* contents, size_t size,
+                                        int max_threads);
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_FILE_TOC_COMPRESSION_H_
@@ -0,0 +1,307 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "sandboxed_api/heap_profiler.h"
+
+#include <link.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/debugging/stacktrace.h"
+#include "absl/strings/str_cat.h"
+
+namespace sapi {
+namespace heap_profiler {
+namespace internal {
+
+bool malloc_hooked = false;
+
+}  // namespace internal
+
+namespace {
+
+constexpr int kMaxDepth = 32;
+// Capacity of the table of live samples, a power of two. It is kept at most
+// three quarters full, further samples are dropped.
+constexpr size_t kMaxSamples = 4096;
+
+struct Sample {
+  uintptr_t ptr;
+  uint64_t size;
+  int depth;
+  void* stack[kMaxDepth];
+};
+
+// Open-addressing hash table of the live samples, by address. Empty slots have
+// a 'ptr' of 0. Guarded by table_lock, which is a spin lock as the hooks run
+// inside malloc() and must not allocate.
+Sample table[kMaxSamples];
+std::atomic_flag table_lock = ATOMIC_FLAG_INIT;
+std::atomic<size_t> num_live{0};
+std::atomic<uint64_t> sample_bytes{0};
+
+struct ThreadState {
+  bool initialized;
+  // Set while the thread records a sample or builds the profile, so that
+  // their own allocations are not sampled.
+  bool busy;
+  int64_t bytes_left;
+  uint64_t rng;
+  // The sample taken out by BeginReallocation(), if 'reallocating' is set.
+  bool reallocating;
+  Sample reallocated;
+};
+thread_local ThreadState thread_state;
+
+class TableLock {
+ public:
+  TableLock() {
+    while (table_lock.test_and_set(std::memory_order_acquire)) {
+    }
+  }
+  ~TableLock() { table_lock.clear(std::memory_order_release); }
+};
+
+size_t Slot(uintptr_t ptr) {
+  // Allocations are at least 16-byte aligned.
+  return ((ptr >> 4) * 0x9E3779B97F4A7C15ull >> 32) & (kMaxSamples - 1);
+}
+
+void Insert(const Sample& sample) {
+  if (num_live.load(std::memory_order_relaxed) >= kMaxSamples / 4 * 3) {
+    return;
+  }
+  size_t i = Slot(sample.ptr);
+  while (table[i].ptr != 0 && table[i].ptr != sample.ptr) {
+    i = (i + 1) & (kMaxSamples - 1);
+  }
+  if (table[i].ptr == 0) {
+    num_live.fetch_add(1, std::memory_order_relaxed);
+  }
+  table[i] = sample;
+}
+
+// Removes the sample of 'ptr' and stores it in 'erased', if not null. Returns
+// whether there was one.
+bool Erase(uintptr_t ptr, Sample* erased = nullptr) {
+  size_t i = Slot(ptr);
+  while (table[i].ptr != ptr) {
+    if (table[i].ptr == 0) {
+      return false;
+    }
+    i = (i + 1) & (kMaxSamples - 1);
+  }
+  if (erased) {
+    *erased = table[i];
+  }
+  // Moves back the entries which would no longer be found after the hole.
+  for (size_t j = (i + 1) & (kMaxSamples - 1); table[j].ptr != 0;
+       j = (j + 1) & (kMaxSamples - 1)) {
+    const size_t home = Slot(table[j].ptr);
+    const bool reachable =
+        i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!reachable) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].ptr = 0;
+  num_live.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+// Returns the number of bytes until the next sample, exponentially
+// distributed with a mean of 'mean'.
+int64_t NextSampleDistance(ThreadState* state, uint64_t mean) {
+  state->rng ^= state->rng << 13;
+  state->rng ^= state->rng >> 7;
+  state->rng ^= state->rng << 17;
+  const double u = ((state->rng >> 11) + 1) * (1.0 / (1ull << 53));
+  return static_cast<int64_t>(-std::log(u) * mean);
+}
+
+// Appends the loaded segments in the format of /proc/self/maps, which pprof
+// needs to symbolize the stacks. Does not depend on /proc being mounted.
+void AppendMappings(std::string* out) {
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t, void* data) {
+        auto* out = static_cast<std::string*>(data);
+        const char* name = info->dlpi_name;
+        if (name[0] == '\0') {
+          name = program_invocation_name;
+        }
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+          const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+          if (phdr.p_type != PT_LOAD) {
+            continue;
+          }
+          constexpr uintptr_t kPageMask = 4096 - 1;
+          const uintptr_t start =
+              (info->dlpi_addr + phdr.p_vaddr) & ~kPageMask;
+          const uintptr_t end =
+              (info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz + kPageMask) &
+              ~kPageMask;
+          absl::StrAppend(out, absl::Hex(start, absl::kZeroPad8), "-",
+                          absl::Hex(end, absl::kZeroPad8), " ",
+                          (phdr.p_flags & PF_R) ? "r" : "-",
+                          (phdr.p_flags & PF_W) ? "w" : "-",
+                          (phdr.p_flags & PF_X) ? "x" : "-", "p ",
+                          absl::Hex(phdr.p_offset & ~kPageMask,
+                                    absl::kZeroPad8),
+                          " 00:00 0 ", name, "\n");
+        }
+        return 0;
+      },
+      out);
+}
+
+}  // namespace
+
+bool IsAvailable() { return internal::malloc_hooked; }
+
+void SetSampleBytes(uint64_t bytes) {
+  sample_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+std::string GetProfile() {
+  ThreadState& state = thread_state;
+  const bool was_busy = state.busy;
+  state.busy = true;
+
+  std::vector<Sample> samples;
+  samples.reserve(kMaxSamples);
+  {
+    TableLock lock;
+    for (const Sample& sample : table) {
+      if (sample.ptr != 0) {
+        samples.push_back(sample);
+      }
+    }
+  }
+  // Number and bytes of the live samples, by stack.
+  std::map<std::vector<void*>, std::pair<uint64_t, uint64_t>> stacks;
+  uint64_t total_count = 0;
+  uint64_t total_bytes = 0;
+  for (const Sample& sample : samples) {
+    auto& entry = stacks[std::vector<void*>(sample.stack,
+                                            sample.stack + sample.depth)];
+    ++entry.first;
+    entry.second += sample.size;
+    ++total_count;
+    total_bytes += sample.size;
+  }
+
+  // Only live allocations are tracked, so they stand in for the allocated
+  // space as well.
+  std::string profile = absl::StrCat(
+      "heap profile: ", total_count, ": ", total_bytes, " [", total_count,
+      ": ", total_bytes, "] @ heap_v2/",
+      sample_bytes.load(std::memory_order_relaxed), "\n");
+  for (const auto& stack : stacks) {
+    absl::StrAppend(&profile, stack.second.first, ": ", stack.second.second,
+                    " [", stack.second.first, ": ", stack.second.second,
+                    "] @");
+    for (void* pc : stack.first) {
+      absl::StrAppend(&profile, " 0x",
+                      absl::Hex(reinterpret_cast<uintptr_t>(pc)));
+    }
+    absl::StrAppend(&profile, "\n");
+  }
+  absl::StrAppend(&profile, "\nMAPPED_LIBRARIES:\n");
+  AppendMappings(&profile);
+
+  state.busy = was_busy;
+  return profile;
+}
+
+namespace internal {
+
+void RecordAllocation(void* ptr, size_t size) {
+  const uint64_t mean = sample_bytes.load(std::memory_order_relaxed);
+  if (mean == 0 || ptr == nullptr) {
+    return;
+  }
+  ThreadState& state = thread_state;
+  if (state.busy) {
+    return;
+  }
+  if (!state.initialized) {
+    state.initialized = true;
+    state.rng = reinterpret_cast<uintptr_t>(&state) | 1;
+    state.bytes_left = NextSampleDistance(&state, mean);
+  }
+  state.bytes_left -= size;
+  if (state.bytes_left > 0) {
+    return;
+  }
+  state.busy = true;
+  state.bytes_left = NextSampleDistance(&state, mean);
+  Sample sample;
+  sample.ptr = reinterpret_cast<uintptr_t>(ptr);
+  sample.size = size;
+  // Skips the hook which called this function, the stack of this function is
+  // never part of it.
+  sample.depth = absl::GetStackTrace(sample.stack, kMaxDepth, 1);
+  {
+    TableLock lock;
+    Insert(sample);
+  }
+  state.busy = false;
+}
+
+void RecordFree(void* ptr) {
+  if (ptr == nullptr || num_live.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  TableLock lock;
+  Erase(reinterpret_cast<uintptr_t>(ptr));
+}
+
+void BeginReallocation(void* old_ptr) {
+  ThreadState& state = thread_state;
+  state.reallocating = false;
+  if (old_ptr == nullptr || num_live.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  TableLock lock;
+  state.reallocating =
+      Erase(reinterpret_cast<uintptr_t>(old_ptr), &state.reallocated);
+}
+
+void EndReallocation(void* old_ptr, void* ptr, size_t size) {
+  ThreadState& state = thread_state;
+  if (ptr == nullptr && size != 0) {
+    // 'old_ptr' is still allocated, and keeps its sample.
+    if (state.reallocating) {
+      TableLock lock;
+      Insert(state.reallocated);
+    }
+  } else {
+    RecordAllocation(ptr, size);
+  }
+  state.reallocating = false;
+}
+
+}  // namespace internal
+
+}  // namespace heap_profiler
+}  // namespace sapi
@@ -0,0 +1,70 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Allocation sampling in the sandboxee, for heap profiles of the sandboxed
+// library, see sapi::Sandbox::StartHeapProfiling().
+//
+// Allocations are sampled on average once every 'sample_bytes' allocated
+// bytes. The stacks of sampled allocations which were not freed yet make up
+// the profile, in the legacy text format understood by pprof. The malloc()
+// family is only hooked if the sandboxee links the heap_profiler_malloc
+// library (sapi_library(heap_profiling = True) or the HEAP_PROFILING option of
+// add_sapi_library()). Without it no allocation is ever recorded. Stacks are
+// unwound with frame pointers, frames of code built without them are cut off.
+
+#ifndef SANDBOXED_API_HEAP_PROFILER_H_
+#define SANDBOXED_API_HEAP_PROFILER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sapi {
+namespace heap_profiler {
+
+// Default average distance between two samples, as in tcmalloc.
+constexpr uint64_t kDefaultSampleBytes = 512 << 10;
+
+// Returns whether the malloc() family is hooked.
+bool IsAvailable();
+
+// Starts sampling, or changes the sampling distance of a running profile.
+// Allocations sampled before remain in the profile. 0 stops sampling.
+void SetSampleBytes(uint64_t sample_bytes);
+
+// Returns the profile of the sampled live allocations.
+std::string GetProfile();
+
+namespace internal {
+
+// Set by the malloc() hooks, see IsAvailable().
+extern bool malloc_hooked;
+
+// Called by the malloc() hooks. Both are cheap while sampling is off and no
+// sampled allocation is live.
+void RecordAllocation(void* ptr, size_t size);
+void RecordFree(void* ptr);
+
+// Called by the realloc() hook before and after reallocating 'old_ptr' to
+// 'ptr'. The sample of 'old_ptr' is taken out before, as other threads may get
+// the address once it is freed, and put back if the reallocation failed.
+void BeginReallocation(void* old_ptr);
+void EndReallocation(void* old_ptr, void* ptr, size_t size);
+
+}  // namespace internal
+
+}  // namespace heap_profiler
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_HEAP_PROFILER_H_
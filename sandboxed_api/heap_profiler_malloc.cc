@@ -0,0 +1,100 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Hooks the malloc() family for the heap profiler, see heap_profiler.h. The
+// allocations themselves are left to glibc.
+
+#include <errno.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "sandboxed_api/heap_profiler.h"
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+}  // extern "C"
+
+namespace {
+
+using ::sapi::heap_profiler::internal::BeginReallocation;
+using ::sapi::heap_profiler::internal::EndReallocation;
+using ::sapi::heap_profiler::internal::RecordAllocation;
+using ::sapi::heap_profiler::internal::RecordFree;
+
+struct MarkHooked {
+  MarkHooked() { ::sapi::heap_profiler::internal::malloc_hooked = true; }
+} mark_hooked;
+
+}  // namespace
+
+extern "C" {
+
+void* malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  RecordAllocation(ptr, size);
+  return ptr;
+}
+
+void* calloc(size_t num, size_t size) {
+  void* ptr = __libc_calloc(num, size);
+  RecordAllocation(ptr, num * size);
+  return ptr;
+}
+
+void* realloc(void* old_ptr, size_t size) {
+  BeginReallocation(old_ptr);
+  void* ptr = __libc_realloc(old_ptr, size);
+  EndReallocation(old_ptr, ptr, size);
+  return ptr;
+}
+
+void free(void* ptr) {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  RecordAllocation(ptr, size);
+  return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+void* valloc(size_t size) { return memalign(getpagesize(), size); }
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* ptr = memalign(alignment, size);
+  if (ptr == nullptr) {
+    return ENOMEM;
+  }
+  *result = ptr;
+  return 0;
+}
+
+}  // extern "C"
@@ -0,0 +1,143 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/heap_profiler.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/attributes.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+
+namespace sapi {
+namespace heap_profiler {
+namespace {
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+using ::testing::Not;
+using ::testing::NotNull;
+
+// Sizes no other allocation of the test has, so that their profile line is
+// told apart by its byte count.
+constexpr size_t kBlockSize = 12345;
+constexpr int kNumBlocks = 7;
+
+// Allocates 'count' blocks from a single call site.
+ABSL_ATTRIBUTE_NOINLINE void AllocateBlocks(int count, void** blocks) {
+  for (int i = 0; i < count; ++i) {
+    blocks[i] = malloc(kBlockSize);
+  }
+}
+
+// Returns the stack of the first line of 'profile' whose samples add up to
+// 'count' allocations of 'bytes', empty if there is none.
+std::vector<uintptr_t> FindStack(const std::string& profile, uint64_t count,
+                                 uint64_t bytes) {
+  const std::string prefix =
+      absl::StrCat(count, ": ", bytes, " [", count, ": ", bytes, "] @");
+  for (absl::string_view line : absl::StrSplit(profile, '\n')) {
+    if (!absl::ConsumePrefix(&line, prefix)) {
+      continue;
+    }
+    std::vector<uintptr_t> stack;
+    for (absl::string_view pc : absl::StrSplit(line, ' ', absl::SkipEmpty())) {
+      stack.push_back(strtoull(std::string(pc).c_str(), nullptr, 16));
+    }
+    return stack;
+  }
+  return {};
+}
+
+// Returns whether the innermost frame of 'stack' is in AllocateBlocks().
+bool HasAllocationSite(const std::vector<uintptr_t>& stack) {
+  const uintptr_t start = reinterpret_cast<uintptr_t>(&AllocateBlocks);
+  // The function is far smaller than that, and its caller far away enough.
+  return !stack.empty() && stack[0] > start && stack[0] - start < 256;
+}
+
+class HeapProfilerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(IsAvailable());
+    // Samples every allocation of at least a few bytes.
+    SetSampleBytes(1);
+  }
+  void TearDown() override { SetSampleBytes(0); }
+};
+
+TEST_F(HeapProfilerTest, ReportsLiveAllocationsBySite) {
+  void* blocks[kNumBlocks];
+  AllocateBlocks(kNumBlocks, blocks);
+
+  std::string profile = GetProfile();
+  EXPECT_THAT(profile, HasSubstr("@ heap_v2/1\n"));
+  EXPECT_THAT(profile, HasSubstr("\nMAPPED_LIBRARIES:\n"));
+  std::vector<uintptr_t> stack =
+      FindStack(profile, kNumBlocks, kNumBlocks * kBlockSize);
+  ASSERT_THAT(stack, Not(IsEmpty())) << profile;
+  EXPECT_TRUE(HasAllocationSite(stack)) << profile;
+
+  // Freed allocations leave the profile.
+  for (int i = 0; i < 3; ++i) {
+    free(blocks[i]);
+  }
+  profile = GetProfile();
+  EXPECT_THAT(FindStack(profile, kNumBlocks, kNumBlocks * kBlockSize),
+              IsEmpty());
+  EXPECT_THAT(FindStack(profile, kNumBlocks - 3, (kNumBlocks - 3) * kBlockSize),
+              Not(IsEmpty()))
+      << profile;
+  for (int i = 3; i < kNumBlocks; ++i) {
+    free(blocks[i]);
+  }
+  EXPECT_THAT(
+      FindStack(GetProfile(), kNumBlocks - 3, (kNumBlocks - 3) * kBlockSize),
+      IsEmpty());
+}
+
+TEST_F(HeapProfilerTest, KeepsSamplesOfFailedReallocations) {
+  void* blocks[kNumBlocks];
+  AllocateBlocks(kNumBlocks, blocks);
+  for (int i = 1; i < kNumBlocks; ++i) {
+    free(blocks[i]);
+  }
+  void* block = blocks[0];
+  ASSERT_THAT(block, NotNull());
+  // Too large for any address space, 'block' stays allocated.
+  volatile size_t huge_size = SIZE_MAX / 2;
+  ASSERT_THAT(realloc(block, huge_size), Eq(nullptr));
+
+  std::vector<uintptr_t> stack = FindStack(GetProfile(), 1, kBlockSize);
+  EXPECT_TRUE(HasAllocationSite(stack));
+
+  // A successful reallocation moves the sample to the new size and site.
+  block = realloc(block, 2 * kBlockSize);
+  ASSERT_THAT(block, NotNull());
+  const std::string profile = GetProfile();
+  EXPECT_THAT(FindStack(profile, 1, kBlockSize), IsEmpty());
+  EXPECT_THAT(FindStack(profile, 1, 2 * kBlockSize), Not(IsEmpty()));
+  free(block);
+}
+
+}  // namespace
+}  // namespace heap_profiler
+}  // namespace sapi
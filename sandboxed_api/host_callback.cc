@@ -0,0 +1,84 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/host_callback.h"
+
+#include <sys/uio.h>
+
+#include <memory>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/call.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.pb.h"
+
+namespace sapi {
+namespace {
+
+struct HostCallChannel {
+  absl::Mutex mutex;
+  std::unique_ptr<sandbox2::Comms> comms GUARDED_BY(mutex);
+};
+
+HostCallChannel& GetHostCallChannel() {
+  static auto* channel = new HostCallChannel();
+  return *channel;
+}
+
+}  // namespace
+
+sapi::Status CallHost(uint32_t id, absl::Span<const uint8_t> request,
+                      std::vector<uint8_t>* response) {
+  HostCallChannel& channel = GetHostCallChannel();
+  absl::MutexLock lock(&channel.mutex);
+  if (!channel.comms) {
+    return sapi::FailedPreconditionError("No host callbacks registered");
+  }
+  // The request is the callback id followed by its argument.
+  iovec fragments[] = {
+      {&id, sizeof(id)},
+      {const_cast<uint8_t*>(request.data()), request.size()},
+  };
+  if (!channel.comms->SendTLVv(comms::kMsgHostCall, fragments, 2)) {
+    return sapi::UnavailableError("Sending the host callback failed");
+  }
+  uint32_t tag;
+  if (!channel.comms->RecvTLV(&tag, response)) {
+    return sapi::UnavailableError("Receiving the host callback reply failed");
+  }
+  if (tag == comms::kMsgHostReturn) {
+    return sapi::OkStatus();
+  }
+  StatusProto proto;
+  if (tag != sandbox2::Comms::kTagProto2 ||
+      !proto.ParseFromArray(response->data(), response->size())) {
+    return sapi::UnavailableError("Malformed host callback reply");
+  }
+  response->clear();
+  return MakeStatusFromProto(proto);
+}
+
+namespace internal {
+
+void SetHostCallChannel(int fd) {
+  HostCallChannel& channel = GetHostCallChannel();
+  absl::MutexLock lock(&channel.mutex);
+  channel.comms = absl::make_unique<sandbox2::Comms>(fd);
+}
+
+}  // namespace internal
+}  // namespace sapi
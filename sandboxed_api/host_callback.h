@@ -0,0 +1,58 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Calls from the sandboxed library back into the host, for libraries which
+// need callbacks, e.g. I/O hooks or progress reporting. The host registers the
+// callbacks with sapi::Sandbox::RegisterHostCallback() and runs them on a
+// dedicated thread, concurrently with the call which is still outstanding.
+//
+// Example, in the sandboxed library:
+//   void ReportProgress(int percent) {
+//     std::vector<uint8_t> response;
+//     sapi::CallHost(kProgressCallback,
+//                    {reinterpret_cast<const uint8_t*>(&percent),
+//                     sizeof(percent)},
+//                    &response)
+//         .IgnoreError();
+//   }
+
+#ifndef SANDBOXED_API_HOST_CALLBACK_H_
+#define SANDBOXED_API_HOST_CALLBACK_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sapi {
+
+// Calls the host callback registered under 'id' with 'request' and blocks
+// until it returned, its response is stored in 'response'. Returns the status
+// of the callback, or FAILED_PRECONDITION if the host registered no callbacks.
+// Can be used from any thread, concurrent callbacks are run one after the
+// other.
+sapi::Status CallHost(uint32_t id, absl::Span<const uint8_t> request,
+                      std::vector<uint8_t>* response);
+
+namespace internal {
+
+// Takes ownership of the sandboxee's end of the host callback channel, see
+// comms::kMsgHostCallChannel.
+void SetHostCallChannel(int fd);
+
+}  // namespace internal
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_HOST_CALLBACK_H_
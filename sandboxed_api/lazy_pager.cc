@@ -0,0 +1,169 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/lazy_pager.h"
+
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "sandboxed_api/util/canonical_errors.h"
+
+namespace sapi {
+
+constexpr size_t LazyPager::kDefaultReadAheadPages;
+
+sapi::StatusOr<std::unique_ptr<LazyPager>> LazyPager::Create(
+    int uffd, uintptr_t remote, const void* data, size_t size,
+    size_t read_ahead_pages) {
+  if (uffd < 0) {
+    return sapi::InvalidArgumentError("Invalid userfaultfd");
+  }
+  if (remote % getpagesize() != 0 || size == 0) {
+    close(uffd);
+    return sapi::InvalidArgumentError("Lazy range not page-aligned or empty");
+  }
+  int stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd == -1) {
+    close(uffd);
+    return sapi::InternalError("Could not create eventfd");
+  }
+  return absl::WrapUnique(
+      new LazyPager(uffd, stop_fd, remote, static_cast<const char*>(data),
+                    size, std::max<size_t>(read_ahead_pages, 1)));
+}
+
+LazyPager::LazyPager(int uffd, int stop_fd, uintptr_t remote,
+                     const char* data, size_t size, size_t read_ahead_pages)
+    : uffd_(uffd),
+      stop_fd_(stop_fd),
+      remote_(remote),
+      data_(data),
+      size_(size),
+      page_size_(getpagesize()),
+      read_ahead_pages_(read_ahead_pages),
+      bounce_storage_(new char[2 * page_size_]) {
+  mapped_size_ = (size_ + page_size_ - 1) & ~(page_size_ - 1);
+  const uintptr_t storage = reinterpret_cast<uintptr_t>(bounce_storage_.get());
+  bounce_ = reinterpret_cast<char*>((storage + page_size_ - 1) &
+                                    ~(page_size_ - 1));
+  thread_ = std::thread(&LazyPager::Run, this);
+}
+
+LazyPager::~LazyPager() {
+  uint64_t value = 1;
+  if (TEMP_FAILURE_RETRY(write(stop_fd_, &value, sizeof(value))) !=
+      sizeof(value)) {
+    PLOG(ERROR) << "Could not stop the lazy pager";
+  }
+  thread_.join();
+  close(stop_fd_);
+  close(uffd_);
+}
+
+void LazyPager::Run() {
+  pollfd pfds[] = {{uffd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  for (;;) {
+    if (TEMP_FAILURE_RETRY(poll(pfds, 2, -1)) == -1) {
+      PLOG(ERROR) << "poll() on userfaultfd";
+      return;
+    }
+    if (pfds[1].revents != 0) {
+      return;
+    }
+    if ((pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+      VLOG(1) << "userfaultfd closed, lazy pager done";
+      return;
+    }
+    uffd_msg msg;
+    ssize_t len = TEMP_FAILURE_RETRY(read(uffd_, &msg, sizeof(msg)));
+    if (len == -1 && errno == EAGAIN) {
+      // Already resolved by a concurrent wake-up.
+      continue;
+    }
+    if (len != sizeof(msg)) {
+      PLOG(ERROR) << "read() from userfaultfd";
+      return;
+    }
+    if (msg.event == UFFD_EVENT_PAGEFAULT) {
+      ServeFault(msg.arg.pagefault.address);
+    }
+  }
+}
+
+void LazyPager::ServeFault(uintptr_t address) {
+  const uintptr_t page = address & ~(page_size_ - 1);
+  if (page < remote_ || page - remote_ >= mapped_size_) {
+    LOG(WARNING) << "Page fault outside of the lazy range: " << address;
+    return;
+  }
+  const size_t offset = page - remote_;
+  const size_t len =
+      std::min(read_ahead_pages_ * page_size_, mapped_size_ - offset);
+  if (!CopyPages(offset, len)) {
+    // The page is there already, e.g. copied by the read-ahead of an earlier
+    // fault which raced with this one. Only the thread is left to wake.
+    uffdio_range range = {page, page_size_};
+    if (ioctl(uffd_, UFFDIO_WAKE, &range) == -1 && errno != ENOENT) {
+      PLOG(WARNING) << "ioctl(UFFDIO_WAKE)";
+    }
+  }
+}
+
+bool LazyPager::CopyPages(size_t offset, size_t len) {
+  const size_t start = offset;
+  while (len > 0) {
+    uffdio_copy copy = {};
+    copy.dst = remote_ + offset;
+    if (offset + page_size_ <= size_) {
+      // Whole pages straight from the data, UFFDIO_COPY does not need an
+      // aligned source.
+      copy.src = reinterpret_cast<uintptr_t>(data_ + offset);
+      copy.len = std::min(len, (size_ - offset) & ~(page_size_ - 1));
+    } else {
+      // The partial page at the end, the rest reads as zeros.
+      memcpy(bounce_, data_ + offset, size_ - offset);
+      memset(bounce_ + (size_ - offset), 0, page_size_ - (size_ - offset));
+      copy.src = reinterpret_cast<uintptr_t>(bounce_);
+      copy.len = page_size_;
+    }
+    const bool ok = ioctl(uffd_, UFFDIO_COPY, &copy) == 0;
+    const size_t copied =
+        ok ? copy.len : static_cast<size_t>(std::max<int64_t>(copy.copy, 0));
+    pages_copied_.fetch_add(copied / page_size_, std::memory_order_relaxed);
+    offset += copied;
+    len -= copied;
+    if (ok || errno == EAGAIN) {
+      continue;
+    }
+    if (errno != EEXIST) {
+      // ENOENT and ESRCH if the range or the sandboxee is gone.
+      PLOG_IF(WARNING, errno != ENOENT && errno != ESRCH)
+          << "ioctl(UFFDIO_COPY)";
+    }
+    // Stop the read-ahead at the first page which is there already.
+    break;
+  }
+  return offset > start;
+}
+
+}  // namespace sapi
@@ -0,0 +1,92 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sapi::LazyPager class provides the pages of a memory range of the
+// sandboxee from a host-side buffer, as the sandboxee first touches them. The
+// range is registered with a userfaultfd by the sandboxee, see
+// RPCChannel::MapLazy(). A host thread reads the page faults from it and
+// resolves each one by copying the faulting page and the pages after it
+// (read-ahead) with UFFDIO_COPY, so only the parts of a large input which are
+// actually read are ever copied.
+
+#ifndef SANDBOXED_API_LAZY_PAGER_H_
+#define SANDBOXED_API_LAZY_PAGER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+
+class LazyPager {
+ public:
+  // Number of pages copied per fault, including the faulting one.
+  static constexpr size_t kDefaultReadAheadPages = 16;
+
+  LazyPager(const LazyPager&) = delete;
+  LazyPager& operator=(const LazyPager&) = delete;
+
+  // Serves the faults of the 'size' bytes at 'remote' in the sandboxee from
+  // 'data', which must stay valid until the pager is destroyed. Takes
+  // ownership of 'uffd'.
+  static sapi::StatusOr<std::unique_ptr<LazyPager>> Create(
+      int uffd, uintptr_t remote, const void* data, size_t size,
+      size_t read_ahead_pages = kDefaultReadAheadPages);
+
+  // Stops serving faults. Once the userfaultfd is closed, pages which were
+  // not copied read as zeros, so the range should be unmapped first.
+  ~LazyPager();
+
+  // Number of pages copied into the sandboxee so far.
+  uint64_t pages_copied() const {
+    return pages_copied_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  LazyPager(int uffd, int stop_fd, uintptr_t remote, const char* data,
+            size_t size, size_t read_ahead_pages);
+
+  // Main loop of the thread serving the faults.
+  void Run();
+  // Resolves a fault at 'address'.
+  void ServeFault(uintptr_t address);
+  // Copies the 'len' bytes at 'offset', whole pages, into the sandboxee.
+  // Returns whether at least the first page was copied.
+  bool CopyPages(size_t offset, size_t len);
+
+  int uffd_;
+  // Readable once the pager is to stop.
+  int stop_fd_;
+  uintptr_t remote_;
+  const char* data_;
+  size_t size_;
+  // 'size_' rounded up to whole pages.
+  size_t mapped_size_;
+  size_t page_size_;
+  size_t read_ahead_pages_;
+  // Page-aligned copy of the data of a fault, for data which is not aligned
+  // or the partial page at its end.
+  std::unique_ptr<char[]> bounce_storage_;
+  char* bounce_;
+  std::atomic<uint64_t> pages_copied_{0};
+  std::thread thread_;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_LAZY_PAGER_H_
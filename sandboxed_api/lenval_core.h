@@ -22,12 +22,19 @@
 namespace sapi {
 
 struct LenValStruct {
-  LenValStruct(uint64_t size, void* data) : size(size), data(data) {}
+  LenValStruct(uint64_t size, void* data)
+      : size(size), data(data), capacity(size) {}
 
   LenValStruct() : LenValStruct(0, nullptr) {}
 
   uint64_t size;
   void* data;
+  // Size of the buffer at 'data', at least 'size'. Code in the sandboxee may
+  // write up to 'capacity' bytes in place before updating 'size', and has to
+  // update it when it replaces or reallocates the buffer in place. If 'data'
+  // or 'size' change while 'capacity' stays the same, the host takes the new
+  // size as the capacity, as realloc() may have shrunk the buffer in place.
+  uint64_t capacity;
 };
 
 }  // namespace sapi
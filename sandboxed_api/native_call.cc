@@ -0,0 +1,48 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/native_call.h"
+
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+
+namespace sapi {
+namespace {
+
+// Thunks by function name. Only written during static initialization, so
+// lookups need no lock.
+absl::flat_hash_map<std::string, const NativeThunkEntry*>& GetNativeThunks() {
+  static auto* thunks =
+      new absl::flat_hash_map<std::string, const NativeThunkEntry*>();
+  return *thunks;
+}
+
+}  // namespace
+
+NativeThunkRegistration::NativeThunkRegistration(
+    const NativeThunkEntry* entries, size_t count) {
+  auto& thunks = GetNativeThunks();
+  for (size_t i = 0; i < count; ++i) {
+    thunks.emplace(entries[i].name, &entries[i]);
+  }
+}
+
+const NativeThunkEntry* FindNativeThunk(absl::string_view name) {
+  const auto& thunks = GetNativeThunks();
+  auto it = thunks.find(name);
+  return it != thunks.end() ? it->second : nullptr;
+}
+
+}  // namespace sapi
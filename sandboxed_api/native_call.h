@@ -0,0 +1,127 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Native dispatch of function calls in the sandboxee. The code generator emits
+// a table of thunks for the functions of a library whose prototypes it knows,
+// which the sandboxee registers at start-up. A thunk unpacks the arguments of
+// a FuncCall as the prototype declares them and calls the function through a
+// pointer of its exact type, so these calls need neither libffi nor any
+// per-argument preparation. Functions without a thunk are still called with
+// libffi.
+
+#ifndef SANDBOXED_API_NATIVE_CALL_H_
+#define SANDBOXED_API_NATIVE_CALL_H_
+
+#include <cstddef>
+#include <cstring>
+
+#include "absl/strings/string_view.h"
+#include "absl/utility/utility.h"
+#include "sandboxed_api/call.h"
+
+namespace sapi {
+
+// Calls 'func' with the arguments of 'call' and stores its result in 'ret'.
+using NativeThunk = void (*)(void* func, const FuncCall& call, FuncRet* ret);
+
+struct NativeThunkEntry {
+  const char* name;
+  // Number of arguments of the function, calls with a different number are
+  // left to libffi.
+  size_t argc;
+  NativeThunk thunk;
+};
+
+// Adds the 'count' thunks at 'entries', which must have static storage
+// duration, to the sandboxee's dispatch table. Meant to be instantiated at
+// namespace scope by the generated code, so that the table is complete before
+// the first call.
+class NativeThunkRegistration {
+ public:
+  NativeThunkRegistration(const NativeThunkEntry* entries, size_t count);
+};
+
+// Returns the thunk registered for the function 'name', nullptr if there is
+// none.
+const NativeThunkEntry* FindNativeThunk(absl::string_view name);
+
+namespace internal {
+
+// Arguments and return values are transferred as the bytes of the value at the
+// start of their slot, see Sandbox::Call().
+template <typename T>
+T GetNativeArg(const FuncCall& call, size_t i) {
+  T value;
+  memcpy(&value, &call.args[i], sizeof(value));
+  return value;
+}
+
+template <typename F>
+struct NativeThunkImpl;
+
+template <typename R, typename... Args>
+struct NativeThunkImpl<R(Args...)> {
+  static void Call(void* func, const FuncCall& call, FuncRet* ret) {
+    Invoke(reinterpret_cast<R (*)(Args...)>(func), call, ret,
+           absl::index_sequence_for<Args...>());
+  }
+
+  template <size_t... I>
+  static void Invoke(R (*func)(Args...), const FuncCall& call, FuncRet* ret,
+                     absl::index_sequence<I...>) {
+    R value = func(GetNativeArg<Args>(call, I)...);
+    ret->float_val = 0;
+    memcpy(&ret->float_val, &value, sizeof(value));
+  }
+};
+
+template <typename... Args>
+struct NativeThunkImpl<void(Args...)> {
+  static void Call(void* func, const FuncCall& call, FuncRet* ret) {
+    Invoke(reinterpret_cast<void (*)(Args...)>(func), call, ret,
+           absl::index_sequence_for<Args...>());
+  }
+
+  template <size_t... I>
+  static void Invoke(void (*func)(Args...), const FuncCall& call, FuncRet* ret,
+                     absl::index_sequence<I...>) {
+    func(GetNativeArg<Args>(call, I)...);
+    ret->float_val = 0;
+  }
+};
+
+template <typename F>
+struct FunctionArity;
+
+template <typename R, typename... Args>
+struct FunctionArity<R(Args...)> {
+  static constexpr size_t value = sizeof...(Args);
+};
+
+template <typename R, typename... Args>
+constexpr size_t FunctionArity<R(Args...)>::value;
+
+}  // namespace internal
+
+// Returns the entry of the dispatch table for the function 'name' of type F,
+// with pointers of any type passed as void*.
+template <typename F>
+constexpr NativeThunkEntry MakeNativeThunk(const char* name) {
+  return {name, internal::FunctionArity<F>::value,
+          &internal::NativeThunkImpl<F>::Call};
+}
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_NATIVE_CALL_H_
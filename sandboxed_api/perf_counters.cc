@@ -0,0 +1,176 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/perf_counters.h"
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+
+namespace sapi {
+namespace {
+
+struct Event {
+  uint32_t type;
+  uint64_t config;
+  uint64_t PerfCounterValues::*field;
+};
+
+// The leader of each group is a software event, which is always available.
+// A group led by one can still take hardware events.
+const Event kEvents[] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+     &PerfCounterValues::context_switches},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,
+     &PerfCounterValues::page_faults},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &PerfCounterValues::cycles},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+     &PerfCounterValues::instructions},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+     &PerfCounterValues::cache_misses},
+};
+
+constexpr size_t kNumEvents = sizeof(kEvents) / sizeof(kEvents[0]);
+
+int PerfEventOpen(const Event& event, pid_t tid, int group_fd,
+                  bool count_kernel) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = count_kernel ? 0 : 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, tid, /*cpu=*/-1, group_fd,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+// Returns the threads of 'pid'.
+std::vector<pid_t> GetThreads(pid_t pid) {
+  std::vector<pid_t> tids;
+  DIR* dir = opendir(absl::StrCat("/proc/", pid, "/task").c_str());
+  if (dir == nullptr) {
+    return tids;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    pid_t tid;
+    if (absl::SimpleAtoi(entry->d_name, &tid)) {
+      tids.push_back(tid);
+    }
+  }
+  closedir(dir);
+  return tids;
+}
+
+}  // namespace
+
+PerfCounterValues& PerfCounterValues::operator+=(
+    const PerfCounterValues& other) {
+  for (const Event& event : kEvents) {
+    this->*event.field += other.*event.field;
+  }
+  return *this;
+}
+
+PerfCounterValues& PerfCounterValues::operator-=(
+    const PerfCounterValues& other) {
+  for (const Event& event : kEvents) {
+    this->*event.field -= other.*event.field;
+  }
+  return *this;
+}
+
+PerfCounterValues& PerfCounterValues::operator/=(uint64_t n) {
+  for (const Event& event : kEvents) {
+    this->*event.field /= n;
+  }
+  return *this;
+}
+
+PerfCounterValues operator-(PerfCounterValues a, const PerfCounterValues& b) {
+  return a -= b;
+}
+
+sapi::StatusOr<std::unique_ptr<PerfCounters>> PerfCounters::Open(pid_t pid) {
+  std::unique_ptr<PerfCounters> counters = absl::WrapUnique(new PerfCounters());
+  for (pid_t tid : GetThreads(pid)) {
+    Group group;
+    group.leader = PerfEventOpen(kEvents[0], tid, -1, counters->counts_kernel_);
+    if (group.leader == -1 && (errno == EACCES || errno == EPERM) &&
+        counters->counts_kernel_) {
+      counters->counts_kernel_ = false;
+      group.leader = PerfEventOpen(kEvents[0], tid, -1, false);
+    }
+    if (group.leader == -1) {
+      PLOG(WARNING) << "perf_event_open() for thread " << tid;
+      continue;
+    }
+    group.fds.push_back(group.leader);
+    group.fields.push_back(kEvents[0].field);
+    for (size_t i = 1; i < kNumEvents; ++i) {
+      int fd = PerfEventOpen(kEvents[i], tid, group.leader,
+                             counters->counts_kernel_);
+      if (fd == -1) {
+        VLOG(1) << "Counter " << i << " not available: " << strerror(errno);
+        continue;
+      }
+      group.fds.push_back(fd);
+      group.fields.push_back(kEvents[i].field);
+    }
+    counters->groups_.push_back(std::move(group));
+  }
+  if (counters->groups_.empty()) {
+    return sapi::FailedPreconditionError(
+        absl::StrCat("Could not open performance counters of pid ", pid));
+  }
+  return std::move(counters);
+}
+
+PerfCounters::~PerfCounters() {
+  for (const Group& group : groups_) {
+    for (int fd : group.fds) {
+      close(fd);
+    }
+  }
+}
+
+PerfCounterValues PerfCounters::Read() const {
+  PerfCounterValues values;
+  // The number of counters, followed by their values.
+  uint64_t buf[1 + kNumEvents];
+  for (const Group& group : groups_) {
+    const ssize_t want = (1 + group.fields.size()) * sizeof(buf[0]);
+    if (read(group.leader, buf, sizeof(buf)) != want ||
+        buf[0] != group.fields.size()) {
+      continue;
+    }
+    for (size_t i = 0; i < group.fields.size(); ++i) {
+      values.*group.fields[i] += buf[1 + i];
+    }
+  }
+  return values;
+}
+
+}  // namespace sapi
@@ -0,0 +1,83 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Performance counters of the threads of a sandboxee, opened by the host with
+// perf_event_open(), see sapi::Sandbox::CollectPerfCounters().
+
+#ifndef SANDBOXED_API_PERF_COUNTERS_H_
+#define SANDBOXED_API_PERF_COUNTERS_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+
+struct PerfCounterValues {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t cache_misses = 0;
+  uint64_t context_switches = 0;
+  uint64_t page_faults = 0;
+
+  PerfCounterValues& operator+=(const PerfCounterValues& other);
+  PerfCounterValues& operator-=(const PerfCounterValues& other);
+  // Divides all values, e.g. to split a batch among its calls.
+  PerfCounterValues& operator/=(uint64_t n);
+};
+
+PerfCounterValues operator-(PerfCounterValues a, const PerfCounterValues& b);
+
+class PerfCounters {
+ public:
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Opens the counters on all threads 'pid' has at the time, threads started
+  // later are not counted. Counters the CPU does not provide (e.g. hardware
+  // counters in a VM) stay zero. Only user space is counted if the kernel
+  // does not allow counting kernel events, see perf_event_paranoid. Fails if
+  // no counters can be opened at all.
+  static sapi::StatusOr<std::unique_ptr<PerfCounters>> Open(pid_t pid);
+
+  ~PerfCounters();
+
+  // Returns the sum of the counters of all threads since Open().
+  PerfCounterValues Read() const;
+
+  // Whether kernel events are counted as well.
+  bool counts_kernel() const { return counts_kernel_; }
+
+ private:
+  // The counters of a thread, read at once through the group leader.
+  struct Group {
+    int leader;
+    std::vector<int> fds;
+    // Value of each counter in the order of the group.
+    std::vector<uint64_t PerfCounterValues::*> fields;
+  };
+
+  PerfCounters() = default;
+
+  std::vector<Group> groups_;
+  bool counts_kernel_ = true;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_PERF_COUNTERS_H_
@@ -18,48 +18,92 @@
 #define SANDBOXED_API_PROTO_HELPER_H_
 
 #include <cinttypes>
+#include <cstring>
+#include <string>
 #include <type_traits>
 #include <vector>
 
-#include "sandboxed_api/proto_arg.pb.h"
+#include "google/protobuf/message.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "sandboxed_api/util/canonical_errors.h"
 #include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
 #include "sandboxed_api/util/statusor.h"
 
 namespace sapi {
 
+// Protobuf arguments are passed as the fully qualified name of their message
+// type, terminated by a NUL byte, directly followed by the serialized message.
+// This way the message is encoded and parsed only once on each side.
+
+// Returns the size of 'proto' in the argument format. Has to be called right
+// before SerializeProtoToArray(), which relies on the sizes cached by it.
+inline size_t GetSerializedProtoSize(const google::protobuf::Message& proto) {
+  return proto.GetDescriptor()->full_name().size() + 1 + proto.ByteSizeLong();
+}
+
+// Writes 'proto' in the argument format to 'data', which must have room for
+// GetSerializedProtoSize() bytes.
+inline void SerializeProtoToArray(const google::protobuf::Message& proto,
+                                  uint8_t* data) {
+  const std::string& name = proto.GetDescriptor()->full_name();
+  memcpy(data, name.data(), name.size());
+  data[name.size()] = '\0';
+  proto.SerializeWithCachedSizesToArray(data + name.size() + 1);
+}
+
+// Splits a protobuf argument into the name of its message type and the
+// serialized message. Returns false if there is no type name.
+inline bool SplitSerializedProto(const uint8_t* data, size_t len,
+                                 absl::string_view* name,
+                                 absl::string_view* payload) {
+  const void* end = len > 0 ? memchr(data, '\0', len) : nullptr;
+  if (end == nullptr) {
+    return false;
+  }
+  const size_t name_len = static_cast<const uint8_t*>(end) - data;
+  *name = absl::string_view(reinterpret_cast<const char*>(data), name_len);
+  *payload = absl::string_view(reinterpret_cast<const char*>(end) + 1,
+                               len - name_len - 1);
+  return true;
+}
+
 template <typename T>
 sapi::StatusOr<std::vector<uint8_t>> SerializeProto(const T& proto) {
   static_assert(std::is_base_of<google::protobuf::Message, T>::value,
                 "Template argument must be a proto message");
-  // Wrap protobuf in a envelope so that we know the name of the protobuf
-  // structure when deserializing in the sandboxee.
-  ProtoArg proto_arg;
-  proto_arg.set_protobuf_data(proto.SerializeAsString());
-  proto_arg.set_full_name(proto.GetDescriptor()->full_name());
+  std::vector<uint8_t> serialized_proto(GetSerializedProtoSize(proto));
+  SerializeProtoToArray(proto, serialized_proto.data());
+  return serialized_proto;
+}
 
-  std::vector<uint8_t> serialized_proto(proto_arg.ByteSizeLong());
-  if (!proto_arg.SerializeToArray(serialized_proto.data(),
-                                  serialized_proto.size())) {
-    return sapi::InternalError("Unable to serialize proto to array");
+// Parses a protobuf argument into 'proto', which must be of the same message
+// type. Reuses the memory already held by 'proto'.
+inline sapi::Status DeserializeProto(const char* data, size_t len,
+                                     google::protobuf::Message* proto) {
+  absl::string_view name;
+  absl::string_view payload;
+  if (!SplitSerializedProto(reinterpret_cast<const uint8_t*>(data), len, &name,
+                            &payload)) {
+    return sapi::InternalError("Unable to parse proto from array");
   }
-  return serialized_proto;
+  if (name != proto->GetDescriptor()->full_name()) {
+    return sapi::InternalError(
+        absl::StrCat("Unexpected proto type '", name, "'"));
+  }
+  if (!proto->ParseFromArray(payload.data(), payload.size())) {
+    return sapi::InternalError("Unable to parse proto from array");
+  }
+  return sapi::OkStatus();
 }
 
 template <typename T>
 sapi::StatusOr<T> DeserializeProto(const char* data, size_t len) {
   static_assert(std::is_base_of<google::protobuf::Message, T>::value,
                 "Template argument must be a proto message");
-  ProtoArg envelope;
-  if (!envelope.ParseFromArray(data, len)) {
-    return sapi::InternalError("Unable to parse proto from array");
-  }
-
-  auto pb_data = envelope.protobuf_data();
   T result;
-  if (!result.ParseFromArray(pb_data.data(), pb_data.size())) {
-    return sapi::InternalError("Unable to parse proto from envelope data");
-  }
+  SAPI_RETURN_IF_ERROR(DeserializeProto(data, len, &result));
   return result;
 }
 
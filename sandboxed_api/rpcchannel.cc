@@ -14,34 +14,439 @@
 
 #include "sandboxed_api/rpcchannel.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
 #include <glog/logging.h>
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/metrics.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/canonical_errors.h"
 #include "sandboxed_api/util/status_macros.h"
 
 namespace sapi {
 
+namespace {
+
+// Alignment of arena allocations, matches what malloc() guarantees.
+constexpr size_t kArenaAlignment = alignof(std::max_align_t);
+
+// Start of a call whose latency is recorded, absl::InfinitePast() if metrics
+// are disabled.
+absl::Time CallLatencyStart() {
+  return sandbox2::metrics::GetExporter() ? absl::Now() : absl::InfinitePast();
+}
+
+void RecordCallLatency(absl::string_view func, absl::Time start) {
+  if (start != absl::InfinitePast()) {
+    sandbox2::metrics::RecordDuration(
+        absl::StrCat(sandbox2::metrics::kCallLatencyPrefix, func),
+        absl::Now() - start);
+  }
+}
+
+// Encodes the header of a kMsgWriteMemory or kMsgReadMemory request, see
+// comms::MemoryRegion. Returns the total size of the regions.
+uint64_t EncodeMemoryRegions(const iovec* local, const iovec* remote,
+                             size_t count, std::vector<uint8_t>* request) {
+  uint64_t num_regions = count;
+  request->resize(sizeof(num_regions) + count * sizeof(comms::MemoryRegion));
+  memcpy(request->data(), &num_regions, sizeof(num_regions));
+  auto* regions = reinterpret_cast<comms::MemoryRegion*>(request->data() +
+                                                         sizeof(num_regions));
+  uint64_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    CHECK_EQ(local[i].iov_len, remote[i].iov_len);
+    regions[i].addr = reinterpret_cast<uint64_t>(remote[i].iov_base);
+    regions[i].size = remote[i].iov_len;
+    total += remote[i].iov_len;
+  }
+  return total;
+}
+
+}  // namespace
+
+constexpr size_t RPCChannel::kMaxDeferredFrees;
+constexpr size_t RPCChannel::kNoArenaAllocation;
+constexpr uint64_t RPCChannel::kCurrentArenaGeneration;
+
 sapi::Status RPCChannel::Call(const FuncCall& call, uint32_t tag, FuncRet* ret,
                               v::Type exp_type) {
   absl::MutexLock lock(&mutex_);
-  if (!comms_->SendTLV(tag, sizeof(call),
-                       reinterpret_cast<const uint8_t*>(&call))) {
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  const absl::Time start = CallLatencyStart();
+  if (!SendCall(call, tag, /*lookup=*/true)) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
   SAPI_ASSIGN_OR_RETURN(auto fret, Return(exp_type));
+  RecordCallLatency(call.func, start);
+  *ret = fret;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::CallInline(const FuncCall& call, const iovec* local,
+                                    const iovec* remote, size_t count,
+                                    FuncRet* ret, v::Type exp_type) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  const absl::Time start = CallLatencyStart();
+  const uint64_t total =
+      EncodeMemoryRegions(local, remote, count, &inline_memory_);
+  size_t pos = inline_memory_.size();
+  inline_memory_.resize(pos + total);
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(inline_memory_.data() + pos, local[i].iov_base, local[i].iov_len);
+    pos += local[i].iov_len;
+  }
+  const bool sent = SendCall(call, comms::kMsgCall, /*lookup=*/true);
+  inline_memory_.clear();
+  if (!sent) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(exp_type));
+  RecordCallLatency(call.func, start);
+  *ret = fret;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::CallScalar(const CallSignature& sig,
+                                    const FuncArg* args, FuncRet* ret) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  const absl::Time start = CallLatencyStart();
+  auto it = signature_handles_.find(&sig);
+  if (it == signature_handles_.end()) {
+    // Failed lookups are remembered as well, see SendCall().
+    uint64_t handle = 0;
+    auto addr_or = LookupSymbol(sig.name);
+    if (addr_or.ok()) {
+      handle = reinterpret_cast<uint64_t>(addr_or.ValueOrDie());
+    }
+    it = signature_handles_.emplace(&sig, handle).first;
+  }
+
+  bool sent;
+  if (it->second == 0) {
+    FuncCall call{};
+    strncpy(call.func, sig.name, FuncCall::kFuncNameMax - 1);
+    call.ret_type = sig.ret_type;
+    call.ret_size = sig.ret_size;
+    call.argc = sig.argc;
+    for (size_t i = 0; i < sig.argc; ++i) {
+      call.arg_type[i] = sig.arg_type[i];
+      call.arg_size[i] = sig.arg_size[i];
+      call.args[i] = args[i];
+    }
+    sent = SendRequest(comms::kMsgCall, sizeof(call),
+                       reinterpret_cast<const uint8_t*>(&call));
+  } else {
+    uint8_t buf[sizeof(FuncCallCompact) +
+                FuncCall::kArgsMax * sizeof(FuncCallCompactArg)];
+    FuncCallCompact hdr{};
+    hdr.handle = it->second;
+    hdr.ret_type = sig.ret_type;
+    hdr.argc = sig.argc;
+    hdr.ret_size = sig.ret_size;
+    memcpy(buf, &hdr, sizeof(hdr));
+    uint8_t* pos = buf + sizeof(hdr);
+    for (size_t i = 0; i < sig.argc; ++i) {
+      FuncCallCompactArg arg{};
+      arg.type = sig.arg_type[i];
+      arg.size = sig.arg_size[i];
+      arg.value = args[i];
+      memcpy(pos, &arg, sizeof(arg));
+      pos += sizeof(arg);
+    }
+    sent = SendRequest(comms::kMsgCallCompact, pos - buf, buf);
+  }
+  if (!sent) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(sig.ret_type));
+  RecordCallLatency(sig.name, start);
   *ret = fret;
   return sapi::OkStatus();
 }
 
+std::future<sapi::StatusOr<FuncRet>> RPCChannel::CallAsync(
+    const FuncCall& call, uint32_t tag, v::Type exp_type) {
+  if (tag != comms::kMsgCall) {
+    std::promise<sapi::StatusOr<FuncRet>> failed;
+    failed.set_value(
+        sapi::InvalidArgumentError("Only kMsgCall requests can be async"));
+    return failed.get_future();
+  }
+  uint64_t request_id;
+  {
+    absl::MutexLock lock(&mutex_);
+    request_id = next_request_id_++;
+    FuncCall async_call = call;
+    async_call.request_id = request_id;
+    // Looking up a handle would interleave with the in-flight replies.
+    if (!SendCall(async_call, tag, /*lookup=*/false)) {
+      std::promise<sapi::StatusOr<FuncRet>> failed;
+      failed.set_value(sapi::UnavailableError("Sending TLV value failed"));
+      return failed.get_future();
+    }
+    ++num_in_flight_;
+  }
+  // The result is received lazily by whichever thread waits on the future.
+  return std::async(std::launch::deferred, [this, request_id, exp_type] {
+    return AwaitAsyncCall(request_id, exp_type);
+  });
+}
+
+sapi::Status RPCChannel::CallAsync(const FuncCall& call, uint32_t tag,
+                                   v::Type exp_type, CallDone done) {
+  if (tag != comms::kMsgCall) {
+    return sapi::InvalidArgumentError("Only kMsgCall requests can be async");
+  }
+  absl::MutexLock lock(&mutex_);
+  if (shared_memory_) {
+    return sapi::FailedPreconditionError(
+        "Asynchronous calls with callbacks need the Comms transport");
+  }
+  const uint64_t request_id = next_request_id_++;
+  FuncCall async_call = call;
+  async_call.request_id = request_id;
+  if (!SendCall(async_call, tag, /*lookup=*/false)) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  ++num_in_flight_;
+  callbacks_.emplace(request_id, std::make_pair(exp_type, std::move(done)));
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::ProcessReplies() {
+  struct Ready {
+    uint64_t request_id;
+    CallDone done;
+    sapi::StatusOr<FuncRet> ret;
+  };
+  std::vector<Ready> ready;
+  sapi::Status channel_status;
+  {
+    absl::MutexLock lock(&mutex_);
+    if (shared_memory_) {
+      return sapi::FailedPreconditionError(
+          "Replies can only be polled with the Comms transport");
+    }
+    while (num_in_flight_ > 0) {
+      uint32_t tag;
+      bool received;
+      if (!comms_->TryRecvTLV(&tag, &reply_buffer_, &received)) {
+        channel_status = sapi::UnavailableError("Receiving TLV value failed");
+        break;
+      }
+      if (!received) {
+        break;
+      }
+      auto ret_or =
+          ParseReturn(tag, reply_buffer_.size(), reply_buffer_.data());
+      if (!ret_or.ok()) {
+        channel_status = ret_or.status();
+        break;
+      }
+      channel_status = StoreAsyncResult(ret_or.ValueOrDie());
+      if (!channel_status.ok()) {
+        break;
+      }
+    }
+    if (!channel_status.ok()) {
+      // The channel is unusable, there is nothing left to wait for.
+      num_in_flight_ = 0;
+    }
+    for (auto it = callbacks_.begin(); it != callbacks_.end();) {
+      auto completed = completed_.find(it->first);
+      if (completed != completed_.end()) {
+        sapi::Status ret_status =
+            CheckReturn(completed->second, it->second.first);
+        ready.push_back({it->first, std::move(it->second.second),
+                         ret_status.ok()
+                             ? sapi::StatusOr<FuncRet>(completed->second)
+                             : sapi::StatusOr<FuncRet>(ret_status)});
+        completed_.erase(completed);
+      } else if (!channel_status.ok()) {
+        ready.push_back(
+            {it->first, std::move(it->second.second), channel_status});
+      } else {
+        ++it;
+        continue;
+      }
+      callbacks_.erase(it++);
+    }
+  }
+  // Callbacks run in the order in which the calls were made.
+  std::sort(ready.begin(), ready.end(), [](const Ready& a, const Ready& b) {
+    return a.request_id < b.request_id;
+  });
+  for (Ready& r : ready) {
+    r.done(std::move(r.ret));
+  }
+  return channel_status;
+}
+
+bool RPCChannel::SendCall(const FuncCall& call, uint32_t tag, bool lookup) {
+  if (tag != comms::kMsgCall) {
+    return SendCallRequest(tag, sizeof(call),
+                           reinterpret_cast<const uint8_t*>(&call));
+  }
+
+  uint64_t handle = call.handle;
+  if (handle == 0) {
+    const std::string name(call.func,
+                           strnlen(call.func, FuncCall::kFuncNameMax));
+    auto it = func_handles_.find(name);
+    if (it == func_handles_.end()) {
+      if (!lookup) {
+        return SendCallRequest(tag, sizeof(call),
+                               reinterpret_cast<const uint8_t*>(&call));
+      }
+      // Failed lookups are remembered as well, the full encoding then lets
+      // the sandboxee report the error.
+      auto addr_or = LookupSymbol(name.c_str());
+      if (addr_or.ok()) {
+        handle = reinterpret_cast<uint64_t>(addr_or.ValueOrDie());
+      }
+      it = func_handles_.emplace(name, handle).first;
+    }
+    handle = it->second;
+  }
+  if (handle == 0) {
+    return SendCallRequest(tag, sizeof(call),
+                           reinterpret_cast<const uint8_t*>(&call));
+  }
+
+  uint8_t buf[sizeof(FuncCallCompact) +
+              FuncCall::kArgsMax * sizeof(FuncCallCompactArg)];
+  FuncCallCompact hdr{};
+  hdr.request_id = call.request_id;
+  hdr.handle = handle;
+  hdr.ret_type = call.ret_type;
+  hdr.argc = call.argc;
+  hdr.ret_size = call.ret_size;
+  memcpy(buf, &hdr, sizeof(hdr));
+  uint8_t* pos = buf + sizeof(hdr);
+  for (size_t i = 0; i < call.argc; ++i) {
+    FuncCallCompactArg arg{};
+    arg.type = call.arg_type[i];
+    arg.aux_type = call.aux_type[i];
+    arg.size = call.arg_size[i];
+    arg.aux_size = call.aux_size[i];
+    if (arg.type == v::Type::kFloat) {
+      arg.value.arg_float = call.args[i].arg_float;
+    } else {
+      arg.value.arg_int = call.args[i].arg_int;
+    }
+    memcpy(pos, &arg, sizeof(arg));
+    pos += sizeof(arg);
+  }
+  return SendCallRequest(comms::kMsgCallCompact, pos - buf, buf);
+}
+
+bool RPCChannel::SendCallRequest(uint32_t tag, uint64_t length,
+                                 const uint8_t* bytes) {
+  if (inline_memory_.empty()) {
+    return SendRequest(tag, length, bytes);
+  }
+  comms::CallInlineHeader hdr{};
+  hdr.tag = tag;
+  std::vector<uint8_t> request(sizeof(hdr));
+  memcpy(request.data(), &hdr, sizeof(hdr));
+  request.insert(request.end(), inline_memory_.begin(), inline_memory_.end());
+  request.insert(request.end(), bytes, bytes + length);
+  inline_memory_.clear();
+  return SendRequest(comms::kMsgCallInline, request.size(), request.data());
+}
+
+sapi::StatusOr<FuncRet> RPCChannel::AwaitAsyncCall(uint64_t request_id,
+                                                   v::Type exp_type) {
+  absl::MutexLock lock(&mutex_);
+  while (true) {
+    auto it = completed_.find(request_id);
+    if (it != completed_.end()) {
+      FuncRet ret = it->second;
+      completed_.erase(it);
+      SAPI_RETURN_IF_ERROR(CheckReturn(ret, exp_type));
+      return ret;
+    }
+    if (num_in_flight_ == 0) {
+      return sapi::InternalError(
+          absl::StrCat("No result for request ", request_id));
+    }
+    auto ret_or = RecvReturn();
+    if (!ret_or.ok()) {
+      // The channel is unusable, there is nothing left to wait for.
+      num_in_flight_ = 0;
+      return ret_or.status();
+    }
+    SAPI_RETURN_IF_ERROR(StoreAsyncResult(ret_or.ValueOrDie()));
+  }
+}
+
+sapi::Status RPCChannel::StoreAsyncResult(const FuncRet& ret) {
+  --num_in_flight_;
+  if (ret.request_id == 0) {
+    // Not the reply to an asynchronous call, the replies are out of step with
+    // the requests.
+    num_in_flight_ = 0;
+    return sapi::InternalError(
+        "Received a reply without a request id to an asynchronous call");
+  }
+  completed_[ret.request_id] = ret;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::DrainAsyncCalls() {
+  while (num_in_flight_ > 0) {
+    auto ret_or = RecvReturn();
+    if (!ret_or.ok()) {
+      // The channel is unusable, there is nothing left to wait for.
+      num_in_flight_ = 0;
+      return ret_or.status();
+    }
+    SAPI_RETURN_IF_ERROR(StoreAsyncResult(ret_or.ValueOrDie()));
+  }
+  return sapi::OkStatus();
+}
+
 sapi::StatusOr<FuncRet> RPCChannel::Return(v::Type exp_type) {
+  SAPI_ASSIGN_OR_RETURN(FuncRet ret, RecvReturn());
+  SAPI_RETURN_IF_ERROR(CheckReturn(ret, exp_type));
+  return ret;
+}
+
+sapi::StatusOr<FuncRet> RPCChannel::RecvReturn() {
   uint32_t tag;
+  if (shared_memory_) {
+    std::vector<uint8_t>& value = reply_buffer_;
+    if (!RecvReply(&tag, &value)) {
+      return sapi::UnavailableError("Receiving TLV value failed");
+    }
+    return ParseReturn(tag, value.size(), value.data());
+  }
   uint64_t len;
   FuncRet ret;
   if (!comms_->RecvTLV(&tag, &len, &ret, sizeof(ret))) {
     return sapi::UnavailableError("Receiving TLV value failed");
   }
+  return ParseReturn(tag, len, &ret);
+}
+
+sapi::StatusOr<FuncRet> RPCChannel::ParseReturn(uint32_t tag, uint64_t len,
+                                                const void* value) {
   if (tag != comms::kMsgReturn) {
     LOG(ERROR) << "tag != comms::kMsgReturn (" << absl::StrCat(absl::Hex(tag))
                << " != " << absl::StrCat(absl::Hex(comms::kMsgReturn)) << ")";
@@ -52,6 +457,69 @@ sapi::StatusOr<FuncRet> RPCChannel::Return(v::Type exp_type) {
                << " != " << sizeof(FuncRet) << ")";
     return sapi::UnavailableError("Received TLV has incorrect length");
   }
+  FuncRet ret;
+  memcpy(&ret, value, sizeof(ret));
+  return ret;
+}
+
+bool RPCChannel::SendRequest(uint32_t tag, uint64_t length,
+                             const uint8_t* bytes) {
+  if (shared_memory_) {
+    return shared_memory_->SendRequest(tag, length, bytes);
+  }
+  // Deferred frees are not answered, so they can precede any request.
+  if (!deferred_frees_.empty() && !SendDeferredFrees().ok()) {
+    return false;
+  }
+  // Same for the trace context.
+  if (trace_context_ != sent_trace_context_) {
+    if (!comms_->SendTLV(
+            comms::kMsgTraceContext, trace_context_.size(),
+            reinterpret_cast<const uint8_t*>(trace_context_.data()))) {
+      return false;
+    }
+    sent_trace_context_ = trace_context_;
+  }
+  return comms_->SendTLV(tag, length, bytes);
+}
+
+void RPCChannel::SetTraceContext(std::string context) {
+  absl::MutexLock lock(&mutex_);
+  trace_context_ = std::move(context);
+}
+
+bool RPCChannel::RecvReply(uint32_t* tag, std::vector<uint8_t>* value) {
+  if (shared_memory_) {
+    return shared_memory_->RecvReply(comms_, tag, value);
+  }
+  return comms_->RecvTLV(tag, value);
+}
+
+sapi::Status RPCChannel::EnableSharedMemoryTransport(
+    size_t size, absl::Duration spin_duration, int numa_node) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (shared_memory_) {
+    return sapi::OkStatus();
+  }
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<SharedMemoryTransport> transport,
+                        SharedMemoryTransport::Create(size, spin_duration,
+                                                      numa_node));
+  bool unused = true;
+  if (!comms_->SendTLV(comms::kMsgSharedMemory, sizeof(unused),
+                       reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  if (!comms_->SendFD(transport->fd())) {
+    return sapi::UnavailableError("Sending FD failed");
+  }
+  // The reply still arrives over the Comms channel.
+  SAPI_RETURN_IF_ERROR(Return(v::Type::kVoid).status());
+  shared_memory_ = std::move(transport);
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::CheckReturn(const FuncRet& ret, v::Type exp_type) {
   if (ret.ret_type != exp_type) {
     LOG(ERROR) << "FuncRet->type != exp_type (" << ret.ret_type
                << " != " << exp_type << ")";
@@ -61,31 +529,193 @@ sapi::StatusOr<FuncRet> RPCChannel::Return(v::Type exp_type) {
     LOG(ERROR) << "FuncRet->success == false";
     return sapi::UnavailableError("Function call failed");
   }
-  return ret;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::RecvReturns(size_t num_rets,
+                                     std::vector<FuncRet>* rets) {
+  uint32_t tag;
+  std::vector<uint8_t>& value = reply_buffer_;
+  if (!RecvReply(&tag, &value)) {
+    return sapi::UnavailableError("Receiving TLV value failed");
+  }
+  if (tag != comms::kMsgReturn) {
+    LOG(ERROR) << "tag != comms::kMsgReturn (" << absl::StrCat(absl::Hex(tag))
+               << " != " << absl::StrCat(absl::Hex(comms::kMsgReturn)) << ")";
+    return sapi::UnavailableError("Received TLV has incorrect tag");
+  }
+  if (value.size() != sizeof(FuncRet) * num_rets) {
+    LOG(ERROR) << "len != sizeof(FuncRet) * " << num_rets << " ("
+               << value.size() << " != " << sizeof(FuncRet) * num_rets
+               << ")";
+    return sapi::UnavailableError("Received TLV has incorrect length");
+  }
+
+  rets->resize(num_rets);
+  memcpy(rets->data(), value.data(), value.size());
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::CallBatch(const std::vector<FuncCall>& calls,
+                                   std::vector<FuncRet>* rets) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgCallBatch, sizeof(FuncCall) * calls.size(),
+                   reinterpret_cast<const uint8_t*>(calls.data()))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+
+  SAPI_RETURN_IF_ERROR(RecvReturns(calls.size(), rets));
+  for (size_t i = 0; i < calls.size(); ++i) {
+    sapi::Status status = CheckReturn((*rets)[i], calls[i].ret_type);
+    if (!status.ok()) {
+      // Leave the results of the calls that succeeded.
+      rets->resize(i);
+      return status;
+    }
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::CallPlan(
+    const std::vector<FuncCall>& calls,
+    const std::vector<comms::CallPlanLink>& links,
+    const std::vector<comms::CallPlanStop>& stops,
+    std::vector<FuncRet>* rets) {
+  comms::CallPlanHeader header;
+  header.num_calls = calls.size();
+  header.num_links = links.size();
+  header.num_stops = stops.size();
+  std::vector<uint8_t> request(sizeof(header) +
+                               calls.size() * sizeof(FuncCall) +
+                               links.size() * sizeof(comms::CallPlanLink) +
+                               stops.size() * sizeof(comms::CallPlanStop));
+  uint8_t* pos = request.data();
+  memcpy(pos, &header, sizeof(header));
+  pos += sizeof(header);
+  memcpy(pos, calls.data(), calls.size() * sizeof(FuncCall));
+  pos += calls.size() * sizeof(FuncCall);
+  memcpy(pos, links.data(), links.size() * sizeof(comms::CallPlanLink));
+  pos += links.size() * sizeof(comms::CallPlanLink);
+  memcpy(pos, stops.data(), stops.size() * sizeof(comms::CallPlanStop));
+
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgCallPlan, request.size(), request.data())) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  uint32_t tag;
+  std::vector<uint8_t>& value = reply_buffer_;
+  if (!RecvReply(&tag, &value)) {
+    return sapi::UnavailableError("Receiving TLV value failed");
+  }
+  if (tag != comms::kMsgReturn) {
+    LOG(ERROR) << "tag != comms::kMsgReturn (" << absl::StrCat(absl::Hex(tag))
+               << " != " << absl::StrCat(absl::Hex(comms::kMsgReturn)) << ")";
+    return sapi::UnavailableError("Received TLV has incorrect tag");
+  }
+  const size_t num_rets = value.size() / sizeof(FuncRet);
+  if (value.size() % sizeof(FuncRet) != 0 || num_rets > calls.size()) {
+    return sapi::UnavailableError("Received TLV has incorrect length");
+  }
+  rets->resize(num_rets);
+  memcpy(rets->data(), value.data(), value.size());
+  for (size_t i = 0; i < num_rets; ++i) {
+    sapi::Status status = CheckReturn((*rets)[i], calls[i].ret_type);
+    if (!status.ok()) {
+      // Leave the results of the calls that succeeded.
+      rets->resize(i);
+      return status;
+    }
+  }
+  return sapi::OkStatus();
 }
 
-sapi::Status RPCChannel::Allocate(size_t size, void** addr) {
+sapi::Status RPCChannel::Allocate(size_t size, void** addr,
+                                  uint64_t* arena_generation) {
   absl::MutexLock lock(&mutex_);
+  if (arena_generation != nullptr) {
+    *arena_generation = arena_generation_;
+  }
+  if (arena_size_ != 0) {
+    const size_t offset = (arena_used_ + kArenaAlignment - 1) &
+                          ~(kArenaAlignment - 1);
+    if (offset <= arena_size_ && size <= arena_size_ - offset) {
+      arena_last_ = offset;
+      arena_used_ = offset + size;
+      *addr = reinterpret_cast<void*>(arena_base_ + offset);
+      return sapi::OkStatus();
+    }
+    VLOG(1) << "Arena exhausted, allocating " << size << " bytes remotely";
+  }
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
   uint64_t sz = size;
-  if (!comms_->SendTLV(comms::kMsgAllocate, sizeof(sz),
-                       reinterpret_cast<uint8_t*>(&sz))) {
+  if (!SendRequest(comms::kMsgAllocate, sizeof(sz),
+                   reinterpret_cast<uint8_t*>(&sz))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
 
   SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kPointer));
   *addr = reinterpret_cast<void*>(fret.int_val);
+  NoteAllocation(fret.int_val);
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::AllocateBatch(const std::vector<size_t>& sizes,
+                                       std::vector<void*>* addrs) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  std::vector<uint64_t> szs(sizes.begin(), sizes.end());
+  if (!SendRequest(comms::kMsgAllocateBatch, sizeof(uint64_t) * szs.size(),
+                   reinterpret_cast<const uint8_t*>(szs.data()))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+
+  std::vector<FuncRet> rets;
+  SAPI_RETURN_IF_ERROR(RecvReturns(sizes.size(), &rets));
+  addrs->resize(sizes.size());
+  bool all_allocated = true;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    (*addrs)[i] = reinterpret_cast<void*>(rets[i].int_val);
+    if ((*addrs)[i] == nullptr && sizes[i] != 0) {
+      all_allocated = false;
+    }
+    NoteAllocation(rets[i].int_val);
+  }
+  if (!all_allocated) {
+    return sapi::ResourceExhaustedError("Allocation failed in the sandboxee");
+  }
   return sapi::OkStatus();
 }
 
 sapi::Status RPCChannel::Reallocate(void* old_addr, size_t size,
-                                    void** new_addr) {
+                                    void** new_addr,
+                                    uint64_t arena_generation) {
   absl::MutexLock lock(&mutex_);
+  if (InArena(old_addr)) {
+    if (arena_generation != kCurrentArenaGeneration &&
+        arena_generation != arena_generation_) {
+      // The memory may already belong to a newer allocation.
+      *new_addr = nullptr;
+      return sapi::FailedPreconditionError(
+          "Arena memory was released by ResetArena()");
+    }
+    const size_t offset = reinterpret_cast<uintptr_t>(old_addr) - arena_base_;
+    if (offset == arena_last_ && size <= arena_size_ - offset) {
+      arena_used_ = offset + size;
+      *new_addr = old_addr;
+      return sapi::OkStatus();
+    }
+    // Any other arena allocation is copied into a new block by the
+    // sandboxee, the old one stays part of the arena.
+  }
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
   comms::ReallocRequest req;
   req.old_addr = reinterpret_cast<uint64_t>(old_addr);
   req.size = size;
 
-  if (!comms_->SendTLV(comms::kMsgReallocate, sizeof(comms::ReallocRequest),
-                       reinterpret_cast<uint8_t*>(&req))) {
+  if (!SendRequest(comms::kMsgReallocate, sizeof(comms::ReallocRequest),
+                   reinterpret_cast<uint8_t*>(&req))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
 
@@ -99,14 +729,135 @@ sapi::Status RPCChannel::Reallocate(void* old_addr, size_t size,
   auto fret = std::move(fret_or).ValueOrDie();
 
   *new_addr = reinterpret_cast<void*>(fret.int_val);
+  if (fret.int_val != req.old_addr) {
+    NoteFree(req.old_addr);
+    NoteAllocation(fret.int_val);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::SendMemoryRequest(uint32_t tag,
+                                           const comms::MemoryRequest& request,
+                                           FuncRet* ret) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(tag, sizeof(request),
+                   reinterpret_cast<const uint8_t*>(&request))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(*ret, Return(v::Type::kInt));
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::Memset(void* addr, int value, size_t size) {
+  return Fill(addr, static_cast<uint8_t>(value), 1, size);
+}
+
+sapi::Status RPCChannel::Fill(void* addr, uint64_t pattern,
+                              size_t pattern_size, size_t size) {
+  if (pattern_size == 0 || pattern_size > sizeof(pattern) ||
+      size % pattern_size != 0) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Invalid fill pattern size: ", pattern_size));
+  }
+  comms::MemoryRequest request{};
+  request.dst = reinterpret_cast<uint64_t>(addr);
+  request.size = size;
+  request.pattern = pattern;
+  request.pattern_size = pattern_size;
+  FuncRet ret;
+  return SendMemoryRequest(comms::kMsgMemset, request, &ret);
+}
+
+sapi::Status RPCChannel::Memcpy(void* dst, const void* src, size_t size) {
+  comms::MemoryRequest request{};
+  request.dst = reinterpret_cast<uint64_t>(dst);
+  request.src = reinterpret_cast<uint64_t>(src);
+  request.size = size;
+  FuncRet ret;
+  return SendMemoryRequest(comms::kMsgMemcpy, request, &ret);
+}
+
+sapi::Status RPCChannel::Memcmp(const void* a, const void* b, size_t size,
+                                int* result) {
+  comms::MemoryRequest request{};
+  request.dst = reinterpret_cast<uint64_t>(a);
+  request.src = reinterpret_cast<uint64_t>(b);
+  request.size = size;
+  FuncRet ret;
+  SAPI_RETURN_IF_ERROR(SendMemoryRequest(comms::kMsgMemcmp, request, &ret));
+  *result = static_cast<int>(ret.int_val);
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::WriteMemory(const iovec* local, const iovec* remote,
+                                     size_t count) {
+  std::vector<uint8_t> request;
+  const uint64_t total = EncodeMemoryRegions(local, remote, count, &request);
+  size_t pos = request.size();
+  request.resize(pos + total);
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(request.data() + pos, local[i].iov_base, local[i].iov_len);
+    pos += local[i].iov_len;
+  }
+
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgWriteMemory, request.size(), request.data())) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kVoid));
+  if (!fret.success) {
+    return sapi::UnavailableError("WriteMemory() failed on the remote side");
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::ReadMemory(const iovec* local, const iovec* remote,
+                                    size_t count) {
+  std::vector<uint8_t> request;
+  const uint64_t total = EncodeMemoryRegions(local, remote, count, &request);
+
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgReadMemory, request.size(), request.data())) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  uint32_t tag;
+  std::vector<uint8_t>& value = reply_buffer_;
+  if (!RecvReply(&tag, &value)) {
+    return sapi::UnavailableError("Receiving TLV value failed");
+  }
+  if (tag != comms::kMsgReturn) {
+    LOG(ERROR) << "tag != comms::kMsgReturn (" << absl::StrCat(absl::Hex(tag))
+               << " != " << absl::StrCat(absl::Hex(comms::kMsgReturn)) << ")";
+    return sapi::UnavailableError("Received TLV has incorrect tag");
+  }
+  if (value.size() != total) {
+    LOG(ERROR) << "len != " << total << " (" << value.size() << ")";
+    return sapi::UnavailableError("Received TLV has incorrect length");
+  }
+  size_t pos = 0;
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(local[i].iov_base, value.data() + pos, local[i].iov_len);
+    pos += local[i].iov_len;
+  }
   return sapi::OkStatus();
 }
 
-sapi::Status RPCChannel::Free(void* addr) {
+sapi::Status RPCChannel::Free(void* addr, uint64_t arena_generation) {
   absl::MutexLock lock(&mutex_);
+  if (InArena(addr)) {
+    FreeInArena(addr, arena_generation);
+    return sapi::OkStatus();
+  }
   uint64_t remote = reinterpret_cast<uint64_t>(addr);
-  if (!comms_->SendTLV(comms::kMsgFree, sizeof(remote),
-                       reinterpret_cast<uint8_t*>(&remote))) {
+  if (!NoteFree(remote)) {
+    return sapi::OkStatus();
+  }
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgFree, sizeof(remote),
+                   reinterpret_cast<uint8_t*>(&remote))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
 
@@ -117,30 +868,580 @@ sapi::Status RPCChannel::Free(void* addr) {
   return sapi::OkStatus();
 }
 
-sapi::Status RPCChannel::Symbol(const char* symname, void** addr) {
+sapi::Status RPCChannel::FreeDeferred(void* addr,
+                                      uint64_t arena_generation) {
+  absl::MutexLock lock(&mutex_);
+  if (InArena(addr)) {
+    FreeInArena(addr, arena_generation);
+    return sapi::OkStatus();
+  }
+  const uint64_t remote = reinterpret_cast<uint64_t>(addr);
+  if (!NoteFree(remote)) {
+    return sapi::OkStatus();
+  }
+  deferred_frees_.push_back(remote);
+  if (deferred_frees_.size() < kMaxDeferredFrees) {
+    return sapi::OkStatus();
+  }
+  return SendDeferredFrees();
+}
+
+sapi::Status RPCChannel::FlushFrees() {
+  absl::MutexLock lock(&mutex_);
+  return SendDeferredFrees();
+}
+
+sapi::Status RPCChannel::SendDeferredFrees() {
+  if (deferred_frees_.empty()) {
+    return sapi::OkStatus();
+  }
+  std::vector<uint64_t> addrs;
+  addrs.swap(deferred_frees_);
+  const uint64_t length = sizeof(uint64_t) * addrs.size();
+  const auto* bytes = reinterpret_cast<const uint8_t*>(addrs.data());
+  if (!shared_memory_) {
+    if (!comms_->SendTLV(comms::kMsgFreeBatch, length, bytes)) {
+      return sapi::UnavailableError("Sending TLV value failed");
+    }
+    return sapi::OkStatus();
+  }
+
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!shared_memory_->SendRequest(comms::kMsgFreeBatch, length, bytes)) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kVoid));
+  if (!fret.success) {
+    return sapi::UnavailableError("Free() failed on the remote side");
+  }
+  return sapi::OkStatus();
+}
+
+void RPCChannel::NoteAllocation(uint64_t addr) {
+  if (addr == 0) {
+    return;
+  }
+  // The address is in use again, whatever a checkpoint left behind there.
+  discarded_allocations_.erase(addr);
+  if (in_checkpoint_) {
+    checkpoint_allocations_.insert(addr);
+  }
+}
+
+bool RPCChannel::NoteFree(uint64_t addr) {
+  if (addr == 0) {
+    return true;
+  }
+  if (in_checkpoint_) {
+    if (checkpoint_allocations_.erase(addr) == 0) {
+      // Allocated before the checkpoint, the parent still holds it.
+      parent_frees_.push_back(addr);
+      for (auto it = parent_shared_buffers_.begin();
+           it != parent_shared_buffers_.end();) {
+        if (reinterpret_cast<uint64_t>(it->second) == addr) {
+          parent_shared_buffers_.erase(it++);
+        } else {
+          ++it;
+        }
+      }
+    }
+    return true;
+  }
+  return discarded_allocations_.erase(addr) == 0;
+}
+
+sapi::Status RPCChannel::BeginCheckpoint(pid_t* pid) {
+  absl::MutexLock lock(&mutex_);
+  if (in_checkpoint_) {
+    return sapi::FailedPreconditionError("A checkpoint is already active");
+  }
+  if (shared_memory_) {
+    return sapi::FailedPreconditionError(
+        "Checkpoints are not available with the shared memory transport");
+  }
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  // Frees queued so far are for the parent.
+  SAPI_RETURN_IF_ERROR(SendDeferredFrees());
+  bool unused = true;
+  if (!SendRequest(comms::kMsgCheckpoint, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kInt));
+  *pid = fret.int_val;
+  in_checkpoint_ = true;
+  parent_shared_buffers_ = shared_buffers_;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::EndCheckpoint() {
+  absl::MutexLock lock(&mutex_);
+  if (!in_checkpoint_) {
+    return sapi::FailedPreconditionError("No checkpoint is active");
+  }
+  // Results and frees still go to the child, if it is alive.
+  sapi::Status status = DrainAsyncCalls();
+  if (status.ok()) {
+    status = SendDeferredFrees();
+  }
+  if (!status.ok()) {
+    VLOG(1) << "Ending a checkpoint whose child failed: " << status;
+    deferred_frees_.clear();
+  }
+  in_checkpoint_ = false;
+  if (!checkpoint_allocations_.empty()) {
+    VLOG(1) << checkpoint_allocations_.size()
+            << " allocation(s) discarded with the checkpoint";
+    discarded_allocations_.insert(checkpoint_allocations_.begin(),
+                                  checkpoint_allocations_.end());
+    checkpoint_allocations_.clear();
+  }
+  shared_buffers_.swap(parent_shared_buffers_);
+  parent_shared_buffers_.clear();
+  // Sent along with the next request to the parent.
+  deferred_frees_.swap(parent_frees_);
+  parent_frees_.clear();
+
+  // Answered by the parent once the child is gone.
+  bool unused = true;
+  if (!SendRequest(comms::kMsgRollback, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_RETURN_IF_ERROR(Return(v::Type::kVoid).status());
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::MapSharedBuffer(int local_fd, size_t size, int prot,
+                                         void** addr) {
+  *addr = nullptr;
+  return MapSharedBufferWindow(local_fd, /*offset=*/0, size, prot, addr);
+}
+
+sapi::Status RPCChannel::MapSharedBufferWindow(int local_fd, uint64_t offset,
+                                               size_t size, int prot,
+                                               void** addr) {
+  // Read-only mappings get a read-only descriptor, so that the sandboxee can
+  // neither map the buffer writable itself nor mprotect() the mapping.
+  const std::string path = absl::StrCat("/proc/self/fd/", local_fd);
+  sandbox2::file_util::fileops::FDCloser read_only_fd(
+      prot == PROT_READ ? open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1);
+  if (prot == PROT_READ) {
+    if (read_only_fd.get() == -1) {
+      return sapi::InternalError(absl::StrCat(
+          "open(", path, ", O_RDONLY) failed: ", sandbox2::StrError(errno)));
+    }
+    local_fd = read_only_fd.get();
+  }
+
   absl::MutexLock lock(&mutex_);
-  if (!comms_->SendTLV(comms::kMsgSymbol, strlen(symname) + 1,
-                       reinterpret_cast<const uint8_t*>(symname))) {
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  MapBufferRequest request{};
+  request.size = size;
+  request.offset = offset;
+  request.addr = reinterpret_cast<uint64_t>(*addr);
+  request.prot = prot;
+  if (!SendRequest(comms::kMsgMapBuffer, sizeof(request),
+                   reinterpret_cast<uint8_t*>(&request))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
+  if (!comms_->SendFD(local_fd)) {
+    return sapi::UnavailableError("Sending FD failed");
+  }
 
   SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kPointer));
   *addr = reinterpret_cast<void*>(fret.int_val);
+  NoteAllocation(fret.int_val);
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::MapLazy(size_t size, void** addr, int* uffd) {
+  *addr = nullptr;
+  int remote_fd;
+  {
+    absl::MutexLock lock(&mutex_);
+    SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+    uint64_t request = size;
+    if (!SendRequest(comms::kMsgMapLazy, sizeof(request),
+                     reinterpret_cast<uint8_t*>(&request))) {
+      return sapi::UnavailableError("Sending TLV value failed");
+    }
+    std::vector<FuncRet> rets;
+    SAPI_RETURN_IF_ERROR(RecvReturns(2, &rets));
+    if (!rets[0].success || !rets[1].success) {
+      return sapi::UnavailableError("MapLazy() failed on the remote side");
+    }
+    *addr = reinterpret_cast<void*>(rets[0].int_val);
+    remote_fd = rets[1].int_val;
+    NoteAllocation(rets[0].int_val);
+  }
+  sapi::Status status = RecvFD(remote_fd, uffd);
+  // The sandboxee does not need its copy, the registration stays with the
+  // host's.
+  sapi::Status close_status = Close(remote_fd);
+  if (status.ok() && !close_status.ok()) {
+    close(*uffd);
+    status = close_status;
+  }
+  if (!status.ok()) {
+    Free(*addr).IgnoreError();
+    *addr = nullptr;
+  }
+  return status;
+}
+
+sapi::Status RPCChannel::ShareBuffers(
+    const std::vector<const sandbox2::Buffer*>& buffers) {
+  if (buffers.empty()) {
+    return sapi::OkStatus();
+  }
+  std::vector<uint64_t> sizes;
+  std::vector<int> fds;
+  std::vector<FileId> ids;
+  for (const sandbox2::Buffer* buffer : buffers) {
+    struct stat st;
+    if (fstat(buffer->fd(), &st) == -1) {
+      return sapi::InternalError(
+          absl::StrCat("fstat() failed: ", sandbox2::StrError(errno)));
+    }
+    sizes.push_back(buffer->size());
+    fds.push_back(buffer->fd());
+    ids.push_back({st.st_dev, st.st_ino});
+  }
+
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgMapBuffers, sizeof(uint64_t) * sizes.size(),
+                   reinterpret_cast<const uint8_t*>(sizes.data()))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  if (!comms_->SendFDs(fds)) {
+    return sapi::UnavailableError("Sending FDs failed");
+  }
+
+  std::vector<FuncRet> rets;
+  SAPI_RETURN_IF_ERROR(RecvReturns(buffers.size(), &rets));
+  bool all_mapped = true;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    if (!rets[i].success) {
+      all_mapped = false;
+      continue;
+    }
+    shared_buffers_[ids[i]] = reinterpret_cast<void*>(rets[i].int_val);
+    NoteAllocation(rets[i].int_val);
+  }
+  if (!all_mapped) {
+    return sapi::UnavailableError("Mapping buffers failed in the sandboxee");
+  }
+  return sapi::OkStatus();
+}
+
+void* RPCChannel::GetSharedBufferAddress(int local_fd) {
+  struct stat st;
+  if (fstat(local_fd, &st) == -1) {
+    return nullptr;
+  }
+  absl::MutexLock lock(&mutex_);
+  auto it = shared_buffers_.find(FileId(st.st_dev, st.st_ino));
+  return it != shared_buffers_.end() ? it->second : nullptr;
+}
+
+sapi::Status RPCChannel::AddChannels(const std::vector<int>& local_fds) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  uint64_t num_channels = local_fds.size();
+  if (!SendRequest(comms::kMsgAddChannel, sizeof(num_channels),
+                   reinterpret_cast<uint8_t*>(&num_channels))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  if (!comms_->SendFDs(local_fds)) {
+    return sapi::UnavailableError("Sending FDs failed");
+  }
+
+  SAPI_RETURN_IF_ERROR(Return(v::Type::kVoid).status());
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::SetHostCallChannel(int local_fd) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  bool unused = true;
+  if (!SendRequest(comms::kMsgHostCallChannel, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  if (!comms_->SendFD(local_fd)) {
+    return sapi::UnavailableError("Sending FD failed");
+  }
+
+  SAPI_RETURN_IF_ERROR(Return(v::Type::kVoid).status());
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::Prefault(uint64_t* pages) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  bool unused = true;
+  if (!SendRequest(comms::kMsgPrefault, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kInt));
+  *pages = fret.int_val;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::EnableMemoryMerging(
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+  std::vector<uint64_t> request;
+  request.reserve(2 * ranges.size());
+  for (const auto& range : ranges) {
+    request.push_back(range.first);
+    request.push_back(range.second);
+  }
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgMergePages, sizeof(uint64_t) * request.size(),
+                   reinterpret_cast<const uint8_t*>(request.data()))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kVoid));
+  if (!fret.success) {
+    return sapi::UnavailableError(
+        "Enabling memory merging failed on the remote side");
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::BeginRegion(size_t capacity) {
+  if (capacity == 0) {
+    return sapi::InvalidArgumentError("Region capacity must not be zero");
+  }
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  uint64_t value = capacity;
+  if (!SendRequest(comms::kMsgRegionBegin, sizeof(value),
+                   reinterpret_cast<uint8_t*>(&value))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kVoid));
+  if (!fret.success) {
+    return sapi::FailedPreconditionError(
+        "Starting the region failed on the remote side");
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::SetHeapSampling(uint64_t sample_bytes) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgHeapSampling, sizeof(sample_bytes),
+                   reinterpret_cast<uint8_t*>(&sample_bytes))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kVoid));
+  if (!fret.success) {
+    return sapi::FailedPreconditionError(
+        "The sandboxee was built without heap profiling");
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::GetHeapProfile(std::string* profile) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  bool unused = true;
+  if (!SendRequest(comms::kMsgHeapProfile, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  uint32_t tag;
+  std::vector<uint8_t>& value = reply_buffer_;
+  if (!RecvReply(&tag, &value)) {
+    return sapi::UnavailableError("Receiving TLV value failed");
+  }
+  if (tag != comms::kMsgReturn) {
+    LOG(ERROR) << "tag != comms::kMsgReturn (" << absl::StrCat(absl::Hex(tag))
+               << " != " << absl::StrCat(absl::Hex(comms::kMsgReturn)) << ")";
+    return sapi::UnavailableError("Received TLV has incorrect tag");
+  }
+  profile->assign(value.begin(), value.end());
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::EndRegion(uint64_t* released) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  bool unused = true;
+  if (!SendRequest(comms::kMsgRegionEnd, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kInt));
+  if (!fret.success) {
+    return sapi::FailedPreconditionError("No region is active");
+  }
+  *released = fret.int_val;
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::EnableArena(size_t size) {
+  {
+    absl::MutexLock lock(&mutex_);
+    if (arena_size_ != 0) {
+      return sapi::FailedPreconditionError("Arena already enabled");
+    }
+  }
+  if (size == 0) {
+    return sapi::InvalidArgumentError("Arena size must not be zero");
+  }
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  // Not a plain allocation: the sandboxee has to know the block so that it
+  // never passes the arena allocations to realloc() or free().
+  uint64_t value = size;
+  if (!SendRequest(comms::kMsgArena, sizeof(value),
+                   reinterpret_cast<uint8_t*>(&value))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kPointer));
+  if (fret.int_val == 0) {
+    return sapi::UnavailableError("Allocating the arena failed");
+  }
+  arena_base_ = fret.int_val;
+  arena_size_ = size;
+  arena_used_ = 0;
+  arena_last_ = kNoArenaAllocation;
+  return sapi::OkStatus();
+}
+
+void RPCChannel::ResetArena() {
+  absl::MutexLock lock(&mutex_);
+  arena_used_ = 0;
+  arena_last_ = kNoArenaAllocation;
+  ++arena_generation_;
+}
+
+void RPCChannel::FreeInArena(void* addr, uint64_t arena_generation) {
+  if (arena_generation != kCurrentArenaGeneration &&
+      arena_generation != arena_generation_) {
+    // Already released by ResetArena().
+    return;
+  }
+  // Only the most recent allocation can be given back, everything else is
+  // released together with the whole arena.
+  const size_t offset = reinterpret_cast<uintptr_t>(addr) - arena_base_;
+  if (offset == arena_last_) {
+    arena_used_ = offset;
+    arena_last_ = kNoArenaAllocation;
+  }
+}
+
+bool RPCChannel::InArena(void* addr) const {
+  const uintptr_t ptr = reinterpret_cast<uintptr_t>(addr);
+  return arena_size_ != 0 && ptr >= arena_base_ &&
+         ptr - arena_base_ < arena_size_;
+}
+
+sapi::Status RPCChannel::Symbol(const char* symname, void** addr) {
+  absl::MutexLock lock(&mutex_);
+  auto it = func_handles_.find(absl::string_view(symname));
+  if (it != func_handles_.end() && it->second != 0) {
+    *addr = reinterpret_cast<void*>(it->second);
+    return sapi::OkStatus();
+  }
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  SAPI_ASSIGN_OR_RETURN(*addr, LookupSymbol(symname));
+  if (*addr != nullptr) {
+    func_handles_[symname] = reinterpret_cast<uint64_t>(*addr);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::ResolveSymbols(
+    const std::vector<std::string>& symnames) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  std::vector<const char*> names;
+  names.reserve(symnames.size());
+  for (const auto& symname : symnames) {
+    names.push_back(symname.c_str());
+  }
+  std::vector<uint64_t> addrs;
+  SAPI_RETURN_IF_ERROR(LookupSymbols(names.data(), names.size(), &addrs));
+  for (size_t i = 0; i < symnames.size(); ++i) {
+    func_handles_[symnames[i]] = addrs[i];
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::GetFunctionHandle(const FunctionTable& table,
+                                           size_t index, uint64_t* handle) {
+  if (index >= table.size) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Function index out of range: ", index));
+  }
+  absl::MutexLock lock(&mutex_);
+  auto it = table_handles_.find(&table);
+  if (it == table_handles_.end()) {
+    SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+    std::vector<uint64_t> addrs;
+    SAPI_RETURN_IF_ERROR(LookupSymbols(table.names, table.size, &addrs));
+    it = table_handles_.emplace(&table, std::move(addrs)).first;
+  }
+  *handle = it->second[index];
+  return sapi::OkStatus();
+}
+
+sapi::Status RPCChannel::LookupSymbols(const char* const* symnames,
+                                       size_t count,
+                                       std::vector<uint64_t>* addrs) {
+  // The names are sent NUL-terminated, one after the other.
+  std::string names;
+  for (size_t i = 0; i < count; ++i) {
+    names.append(symnames[i], strlen(symnames[i]) + 1);
+  }
+  if (!SendRequest(comms::kMsgSymbolBatch, names.size(),
+                   reinterpret_cast<const uint8_t*>(names.data()))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+
+  std::vector<FuncRet> rets;
+  SAPI_RETURN_IF_ERROR(RecvReturns(count, &rets));
+  addrs->clear();
+  addrs->reserve(count);
+  for (const FuncRet& ret : rets) {
+    SAPI_RETURN_IF_ERROR(CheckReturn(ret, v::Type::kPointer));
+    addrs->push_back(ret.int_val);
+  }
   return sapi::OkStatus();
 }
 
+sapi::StatusOr<void*> RPCChannel::LookupSymbol(const char* symname) {
+  if (!SendRequest(comms::kMsgSymbol, strlen(symname) + 1,
+                   reinterpret_cast<const uint8_t*>(symname))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+
+  SAPI_ASSIGN_OR_RETURN(auto fret, Return(v::Type::kPointer));
+  return reinterpret_cast<void*>(fret.int_val);
+}
+
 sapi::Status RPCChannel::Exit() {
   absl::MutexLock lock(&mutex_);
   if (comms_->IsTerminated()) {
     VLOG(2) << "Comms channel already terminated";
     return sapi::OkStatus();
   }
+  // Results of outstanding asynchronous calls do not matter anymore, but they
+  // have to be received before the exit sequence.
+  DrainAsyncCalls().IgnoreError();
 
   // Try the RPC exit sequence. But, the only thing that matters as a success
   // indicator is whether the Comms channel had been closed
   bool unused = true;
-  comms_->SendTLV(comms::kMsgExit, sizeof(unused),
-                  reinterpret_cast<uint8_t*>(&unused));
+  SendRequest(comms::kMsgExit, sizeof(unused),
+              reinterpret_cast<uint8_t*>(&unused));
   comms_->RecvBool(&unused);
 
   if (!comms_->IsTerminated()) {
@@ -155,9 +1456,10 @@ sapi::Status RPCChannel::Exit() {
 
 sapi::Status RPCChannel::SendFD(int local_fd, int* remote_fd) {
   absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
   bool unused = true;
-  if (!comms_->SendTLV(comms::kMsgSendFd, sizeof(unused),
-                       reinterpret_cast<uint8_t*>(&unused))) {
+  if (!SendRequest(comms::kMsgSendFd, sizeof(unused),
+                   reinterpret_cast<uint8_t*>(&unused))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
   if (!comms_->SendFD(local_fd)) {
@@ -172,10 +1474,36 @@ sapi::Status RPCChannel::SendFD(int local_fd, int* remote_fd) {
   return sapi::OkStatus();
 }
 
+sapi::Status RPCChannel::SendFDs(const std::vector<int>& local_fds,
+                                 std::vector<int>* remote_fds) {
+  absl::MutexLock lock(&mutex_);
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  uint64_t num_fds = local_fds.size();
+  if (!SendRequest(comms::kMsgSendFds, sizeof(num_fds),
+                   reinterpret_cast<uint8_t*>(&num_fds))) {
+    return sapi::UnavailableError("Sending TLV value failed");
+  }
+  if (!comms_->SendFDs(local_fds)) {
+    return sapi::UnavailableError("Sending FDs failed");
+  }
+
+  std::vector<FuncRet> rets;
+  SAPI_RETURN_IF_ERROR(RecvReturns(local_fds.size(), &rets));
+  remote_fds->clear();
+  for (const FuncRet& ret : rets) {
+    if (!ret.success) {
+      return sapi::UnavailableError("SendFDs failed on the remote side");
+    }
+    remote_fds->push_back(ret.int_val);
+  }
+  return sapi::OkStatus();
+}
+
 sapi::Status RPCChannel::RecvFD(int remote_fd, int* local_fd) {
   absl::MutexLock lock(&mutex_);
-  if (!comms_->SendTLV(comms::kMsgRecvFd, sizeof(remote_fd),
-                       reinterpret_cast<uint8_t*>(&remote_fd))) {
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgRecvFd, sizeof(remote_fd),
+                   reinterpret_cast<uint8_t*>(&remote_fd))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
 
@@ -192,8 +1520,9 @@ sapi::Status RPCChannel::RecvFD(int remote_fd, int* local_fd) {
 
 sapi::Status RPCChannel::Close(int remote_fd) {
   absl::MutexLock lock(&mutex_);
-  if (!comms_->SendTLV(comms::kMsgClose, sizeof(remote_fd),
-                       reinterpret_cast<uint8_t*>(&remote_fd))) {
+  SAPI_RETURN_IF_ERROR(DrainAsyncCalls());
+  if (!SendRequest(comms::kMsgClose, sizeof(remote_fd),
+                   reinterpret_cast<uint8_t*>(&remote_fd))) {
     return sapi::UnavailableError("Sending TLV value failed");
   }
 
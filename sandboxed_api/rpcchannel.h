@@ -15,11 +15,28 @@
 #ifndef SANDBOXED_API_RPCCHANNEL_H_
 #define SANDBOXED_API_RPCCHANNEL_H_
 
+#include <sys/mman.h>
+#include <sys/uio.h>
+
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/call.h"
+#include "sandboxed_api/call_signature.h"
+#include "sandboxed_api/sandbox2/buffer.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/shared_memory_transport.h"
 #include "sandboxed_api/var_type.h"
 #include "sandboxed_api/util/status.h"
 #include "sandboxed_api/util/statusor.h"
@@ -32,42 +49,440 @@ class RPCChannel {
  public:
   explicit RPCChannel(sandbox2::Comms* comms) : comms_(comms) {}
 
-  // Calls a function.
+  // Calls a function. kMsgCall requests are sent in the compact encoding,
+  // the function's handle is looked up on its first call.
   sapi::Status Call(const FuncCall& call, uint32_t tag, FuncRet* ret,
                     v::Type exp_type);
 
-  // Allocates memory.
-  sapi::Status Allocate(size_t size, void** addr);
+  // Same as above for kMsgCall requests, the sandboxee first copies the
+  // 'count' local regions to the remote ones. Saves a separate transfer for
+  // small variables, see comms::CallInlineHeader.
+  sapi::Status CallInline(const FuncCall& call, const iovec* local,
+                          const iovec* remote, size_t count, FuncRet* ret,
+                          v::Type exp_type);
+
+  // Calls a function without waiting for its result. Several calls can be in
+  // flight at the same time, the sandboxee executes them in the order in which
+  // they were sent. Every returned future must eventually be waited on, its
+  // result is kept until then. 'tag' has to be kMsgCall, only the replies to
+  // calls echo the request id by which the results are told apart.
+  std::future<sapi::StatusOr<FuncRet>> CallAsync(const FuncCall& call,
+                                                 uint32_t tag,
+                                                 v::Type exp_type);
+
+  // Result callback of an asynchronous call, see below.
+  using CallDone = std::function<void(sapi::StatusOr<FuncRet>)>;
+
+  // Calls a function without waiting for its result, for event loops driving
+  // many channels from one thread. 'done' runs from ProcessReplies() once the
+  // result arrived. Not available with the shared memory transport.
+  sapi::Status CallAsync(const FuncCall& call, uint32_t tag, v::Type exp_type,
+                         CallDone done);
+
+  // Returns a file descriptor which becomes readable when replies arrive, to be
+  // registered with epoll() or a similar event loop.
+  int GetReadinessFd() const { return comms_->GetConnectionFD(); }
+
+  // Receives all replies which arrived so far without blocking, and runs the
+  // callbacks of the calls they complete in call order, outside of the
+  // channel's lock.
+  // Results which were received by a blocking request on this channel in the
+  // meantime are delivered as well. If the channel failed, all pending
+  // callbacks run with the error, which is also returned.
+  sapi::Status ProcessReplies();
+
+  // Calls the function described by 'sig' with the scalar arguments 'args'.
+  // The request is encoded straight from 'sig', whose address also keys the
+  // cached function handle, so neither a FuncCall nor the name is copied.
+  sapi::Status CallScalar(const CallSignature& sig, const FuncArg* args,
+                          FuncRet* ret);
+
+  // Calls several functions in a single round-trip. The calls are executed in
+  // order and execution stops at the first failing call. On success, 'rets'
+  // holds one result per call. Fails if a call failed, 'rets' then holds the
+  // results of the calls before it, like for CallPlan().
+  sapi::Status CallBatch(const std::vector<FuncCall>& calls,
+                         std::vector<FuncRet>* rets);
+
+  // Runs the calls of a plan in a single round-trip, see
+  // comms::CallPlanHeader. 'rets' receives the results of the calls that ran,
+  // fewer than 'calls' if a stop value matched. Fails if a call failed, 'rets'
+  // then holds the results of the calls before it.
+  sapi::Status CallPlan(const std::vector<FuncCall>& calls,
+                        const std::vector<comms::CallPlanLink>& links,
+                        const std::vector<comms::CallPlanStop>& stops,
+                        std::vector<FuncRet>* rets);
+
+  // Passed as the arena generation of memory whose generation is not known,
+  // it is taken to be from the current one.
+  static constexpr uint64_t kCurrentArenaGeneration =
+      static_cast<uint64_t>(-1);
+
+  // Allocates memory. Served from the arena without a round-trip if one is
+  // enabled and has enough space left. 'arena_generation', if not null, is set
+  // to the generation of the arena the memory belongs to, to be passed to
+  // Reallocate() and Free().
+  sapi::Status Allocate(size_t size, void** addr,
+                        uint64_t* arena_generation = nullptr);
+
+  // Allocates one region per entry of 'sizes' in a single round-trip. Never
+  // served from the arena, so the regions can be reallocated and freed by the
+  // sandboxee. Fails if any allocation failed, in which case 'addrs' holds
+  // nullptr for the failed regions and the others have to be freed.
+  sapi::Status AllocateBatch(const std::vector<size_t>& sizes,
+                             std::vector<void*>* addrs);
+
+  // Reallocates memory. Arena memory is resized in place while it is the most
+  // recent arena allocation and fits, otherwise it is copied to a new block
+  // outside of the arena. Fails for arena memory from an earlier
+  // 'arena_generation', which was released by ResetArena().
+  sapi::Status Reallocate(
+      void* old_addr, size_t size, void** new_addr,
+      uint64_t arena_generation = kCurrentArenaGeneration);
+
+  // Operate on memory in the sandboxee in place, each in a single round-trip
+  // without transferring its contents.
+  // Sets 'size' bytes at 'addr' to 'value', like memset().
+  sapi::Status Memset(void* addr, int value, size_t size);
+  // Fills 'size' bytes at 'addr' with copies of the 'pattern_size' lowest
+  // addressed bytes of 'pattern', at most eight. 'size' must be a multiple of
+  // 'pattern_size'.
+  sapi::Status Fill(void* addr, uint64_t pattern, size_t pattern_size,
+                    size_t size);
+  // Copies 'size' bytes from 'src' to 'dst', which may overlap.
+  sapi::Status Memcpy(void* dst, const void* src, size_t size);
+  // Compares 'size' bytes at 'a' and 'b', stores the result of memcmp() in
+  // 'result'.
+  sapi::Status Memcmp(const void* a, const void* b, size_t size, int* result);
+
+  // Copy 'count' regions from the host to the sandboxee or back over the
+  // channel, instead of with process_vm_writev() and process_vm_readv(). Each
+  // local region must be as large as the remote one. Meant for sandboxees that
+  // do not run on this host, see Sandbox::TransferMemoryOverComms().
+  sapi::Status WriteMemory(const iovec* local, const iovec* remote,
+                           size_t count);
+  sapi::Status ReadMemory(const iovec* local, const iovec* remote,
+                          size_t count);
+
+  // Frees memory. Arena memory is only given back if it is the most recent
+  // arena allocation, otherwise it is released by ResetArena(). Frees of arena
+  // memory from an earlier 'arena_generation' do nothing.
+  sapi::Status Free(void* addr,
+                    uint64_t arena_generation = kCurrentArenaGeneration);
+
+  // Queues 'addr' to be freed later. Queued frees are sent along with the next
+  // request, without a round-trip of their own. They are also sent once
+  // kMaxDeferredFrees of them are queued and on FlushFrees().
+  sapi::Status FreeDeferred(
+      void* addr, uint64_t arena_generation = kCurrentArenaGeneration);
 
-  // Reallocates memory.
-  sapi::Status Reallocate(void* old_addr, size_t size, void** new_addr);
+  // Sends all queued frees, see FreeDeferred().
+  sapi::Status FlushFrees();
 
-  // Frees memory.
-  sapi::Status Free(void* addr);
+  // Maps 'size' bytes of the shared buffer backing 'local_fd' into the
+  // sandboxee. The mapping is removed again by Free(). Like the other requests
+  // to map shared buffers, this needs Sandbox::UseSharedBuffers().
+  sapi::Status MapSharedBuffer(int local_fd, size_t size, void** addr) {
+    return MapSharedBuffer(local_fd, size, PROT_READ | PROT_WRITE, addr);
+  }
+  // Same as above, with the protection 'prot' of the mapping, either PROT_READ
+  // or PROT_READ | PROT_WRITE.
+  sapi::Status MapSharedBuffer(int local_fd, size_t size, int prot,
+                               void** addr);
 
-  // Returns address of a symbol.
+  // Maps the window of 'size' bytes at 'offset', a multiple of the page size,
+  // of the file backing 'local_fd' into the sandboxee, and asks it to read the
+  // window ahead. If '*addr' is not nullptr, it must be a window of the same
+  // size mapped before, which is replaced in place. This way the sandboxee
+  // slides its mapping over a file too large to map at once, together with
+  // sandbox2::Buffer::MoveWindow() on the host. The window is removed again
+  // by Free(). Windows at an offset or replaced in place need
+  // Sandbox::MapBufferWindows().
+  sapi::Status MapSharedBufferWindow(int local_fd, uint64_t offset,
+                                     size_t size, int prot, void** addr);
+
+  // Maps 'size' bytes of read-only memory into the sandboxee whose pages are
+  // provided by the host when the sandboxee first touches them, see
+  // sapi::LazyPager. Stores the userfaultfd the range is registered with in
+  // 'uffd', to be served by the host. The mapping is removed again by Free().
+  // The sandboxee needs sandbox2::PolicyBuilder::AllowUserfaultfd().
+  sapi::Status MapLazy(size_t size, void** addr, int* uffd);
+
+  // Maps the whole of 'buffers' into the sandboxee in a single round-trip.
+  // The mappings stay until the sandboxee exits, variables backed by one of
+  // these buffers are then mapped without any round-trip, see
+  // GetSharedBufferAddress(). Meant for the buffers of a sandbox2::BufferPool.
+  sapi::Status ShareBuffers(
+      const std::vector<const sandbox2::Buffer*>& buffers);
+
+  // Returns the address in the sandboxee of the buffer backing 'local_fd' if
+  // it was mapped by ShareBuffers(), nullptr otherwise.
+  void* GetSharedBufferAddress(int local_fd);
+
+  // Passes one end of new Comms channels, 'local_fds', to the sandboxee in a
+  // single round-trip. A new thread in the sandboxee serves requests from each
+  // channel, independently of the requests on this one.
+  sapi::Status AddChannels(const std::vector<int>& local_fds);
+
+  // Passes one end of a new Comms channel, 'local_fd', to the sandboxee, over
+  // which it calls back into the host, see sapi::CallHost().
+  sapi::Status SetHostCallChannel(int local_fd);
+
+  // Makes the sandboxee fault in the code and read-only data of all loaded
+  // objects, see Sandbox::PrefaultLibraryPages(). Stores the number of pages
+  // in 'pages'.
+  sapi::Status Prefault(uint64_t* pages);
+
+  // Makes the kernel merge the sandboxee's pages with identical pages of
+  // other processes, see sandbox2::Client::EnableMemoryMerging(). 'ranges'
+  // are the start and end addresses of the mappings of the sandboxee to mark
+  // if it may not enable merging for the whole process.
+  sapi::Status EnableMemoryMerging(
+      const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+  // Makes the sandboxee serve all subsequent Allocate() and Reallocate()
+  // requests from a region of up to 'capacity' bytes with a bump allocator,
+  // until EndRegion(). Allocations which do not fit fall back to malloc().
+  // Freeing region memory is a no-op. The address space is reserved by the
+  // first call, later ones must not ask for a larger capacity.
+  sapi::Status BeginRegion(size_t capacity);
+
+  // Gives all pages of the region back to the kernel at once, with
+  // MADV_DONTNEED, and stores their size in 'released'. Variables still
+  // backed by region memory must not be used afterwards.
+  sapi::Status EndRegion(uint64_t* released);
+
+  // Makes the sandboxee sample an allocation every 'sample_bytes' allocated
+  // bytes on average, 0 stops sampling. Fails if the sandboxee was built
+  // without heap profiling, see heap_profiler.h.
+  sapi::Status SetHeapSampling(uint64_t sample_bytes);
+
+  // Stores the heap profile of the sampled live allocations in 'profile'.
+  sapi::Status GetHeapProfile(std::string* profile);
+
+  // Allocates a single region of 'size' bytes in the sandboxee, from which
+  // subsequent Allocate() calls are served locally by a bump allocator.
+  sapi::Status EnableArena(size_t size);
+
+  // Releases all arena allocations at once, without any round-trip, and starts
+  // a new arena generation. Variables still backed by arena memory must not be
+  // used afterwards, freeing them does nothing.
+  void ResetArena();
+
+  // Returns address of a symbol. Addresses are cached, as they do not change
+  // during the lifetime of the sandboxee.
   sapi::Status Symbol(const char* symname, void** addr);
 
+  // Looks up several symbols in a single round-trip and caches them for
+  // Symbol() and for calls. Symbols which are not found are cached as well.
+  sapi::Status ResolveSymbols(const std::vector<std::string>& symnames);
+
+  // Gets the handle of the function at 'index' in 'table', zero if the
+  // sandboxee has no such function. All functions of the table are looked up
+  // in a single round-trip on first use. Calls with FuncCall::handle set are
+  // sent without a lookup by name.
+  sapi::Status GetFunctionHandle(const FunctionTable& table, size_t index,
+                                 uint64_t* handle);
+
   // Makes the remote part exit.
   sapi::Status Exit();
 
   // Transfers fd to sandboxee.
   sapi::Status SendFD(int local_fd, int* remote_fd);
 
+  // Transfers several fds to sandboxee in a single round-trip.
+  sapi::Status SendFDs(const std::vector<int>& local_fds,
+                       std::vector<int>* remote_fds);
+
   // Retrieves fd from sandboxee.
   sapi::Status RecvFD(int remote_fd, int* local_fd);
 
   // Closes fd in sandboxee.
   sapi::Status Close(int remote_fd);
 
+  // Makes the sandboxee fork a child, which serves all subsequent requests
+  // while its parent waits, until EndCheckpoint() discards the child and the
+  // parent takes over again in the state it had at this point. Stores the PID
+  // of the child in the sandboxee's PID namespace in 'pid'.
+  // Memory allocated or mapped (e.g. by MapSharedBuffer()) during the
+  // checkpoint goes with it, freeing it later is a no-op, and memory
+  // allocated before and freed during the checkpoint is freed in the parent
+  // once the checkpoint ends. Any other state, e.g. file descriptors, is
+  // discarded as well and must not be used after EndCheckpoint(). Not
+  // available with the shared memory transport, and requests on other
+  // channels still go to the parent.
+  sapi::Status BeginCheckpoint(pid_t* pid);
+
+  // Discards the child forked by BeginCheckpoint(). Also succeeds if the child
+  // died, e.g. because it crashed, in which case the request it was serving
+  // failed.
+  sapi::Status EndCheckpoint();
+
+  // Switches all subsequent requests to a memory region shared with the
+  // sandboxee. Requests and replies larger than the region will fail. File
+  // descriptors are still passed over the Comms channel. Both sides spin for
+  // up to 'spin_duration' waiting for a message before they sleep. The region
+  // is allocated on 'numa_node', see sandbox2::Buffer::Options::numa_node.
+  sapi::Status EnableSharedMemoryTransport(
+      size_t size = SharedMemoryTransport::kDefaultSize,
+      absl::Duration spin_duration = absl::ZeroDuration(),
+      int numa_node = sandbox2::Buffer::kAnyNumaNode);
+
+  // Propagates the trace context 'context' to the sandboxee, see
+  // sapi::GetSandboxeeTraceContext(). It is sent along with the next request
+  // if it changed, without a round-trip of its own. Not propagated over the
+  // shared memory transport.
+  void SetTraceContext(std::string context);
+
   sandbox2::Comms* comms() const { return comms_; }
 
  private:
+  // Sends a request and receives a reply, either over the Comms channel or
+  // through the shared memory region if one is enabled.
+  bool SendRequest(uint32_t tag, uint64_t length, const uint8_t* bytes)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool RecvReply(uint32_t* tag, std::vector<uint8_t>* value)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Sends a function call. Uses the compact encoding for kMsgCall requests if
+  // a handle for the function is known. If 'lookup' is true, a missing handle
+  // is looked up first, which requires that no call is in flight.
+  bool SendCall(const FuncCall& call, uint32_t tag, bool lookup)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Sends an encoded call, wrapped in a kMsgCallInline request if
+  // inline_memory_ is set.
+  bool SendCallRequest(uint32_t tag, uint64_t length, const uint8_t* bytes)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Sends the frees queued by FreeDeferred(). Over the Comms channel they are
+  // not answered, over the shared memory transport this is a round-trip.
+  sapi::Status SendDeferredFrees() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Sends a comms::MemoryRequest and receives its result.
+  sapi::Status SendMemoryRequest(uint32_t tag,
+                                 const comms::MemoryRequest& request,
+                                 FuncRet* ret);
+
+  // Returns the address of a symbol in the sandboxee.
+  sapi::StatusOr<void*> LookupSymbol(const char* symname)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Looks up 'count' symbols in a single round-trip. Stores their addresses
+  // in 'addrs', zero for the ones which were not found.
+  sapi::Status LookupSymbols(const char* const* symnames, size_t count,
+                             std::vector<uint64_t>* addrs)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   // Receives the result after a call.
-  sapi::StatusOr<FuncRet> Return(v::Type exp_type);
+  sapi::StatusOr<FuncRet> Return(v::Type exp_type)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Receives a reply holding 'num_rets' results, without checking them.
+  sapi::Status RecvReturns(size_t num_rets, std::vector<FuncRet>* rets)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Receives the next FuncRet from the channel, without checking its type.
+  sapi::StatusOr<FuncRet> RecvReturn() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Extracts a single FuncRet from a reply.
+  static sapi::StatusOr<FuncRet> ParseReturn(uint32_t tag, uint64_t len,
+                                             const void* value);
+
+  // Checks a single result received from the sandboxee.
+  static sapi::Status CheckReturn(const FuncRet& ret, v::Type exp_type);
+
+  // Receives the results of all in-flight asynchronous calls, so that the next
+  // message on the channel belongs to a subsequent synchronous request.
+  sapi::Status DrainAsyncCalls() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Waits for the result of an asynchronous call.
+  sapi::StatusOr<FuncRet> AwaitAsyncCall(uint64_t request_id,
+                                         v::Type exp_type);
+
+  // Keeps the received result of an asynchronous call for its caller. Fails,
+  // and gives up on the calls still in flight, if the result carries no
+  // request id.
+  sapi::Status StoreAsyncResult(const FuncRet& ret)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Gives an arena allocation back, see Free().
+  void FreeInArena(void* addr, uint64_t arena_generation)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Returns true if 'addr' points into the arena.
+  bool InArena(void* addr) const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Records memory allocated or mapped by the sandboxee at 'addr', see
+  // BeginCheckpoint().
+  void NoteAllocation(uint64_t addr) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Records that the memory at 'addr' is freed. Returns false if it went with
+  // a checkpoint and must not be freed.
+  bool NoteFree(uint64_t addr) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
   sandbox2::Comms* comms_;  // Owned by sandbox2;
   absl::Mutex mutex_;
+
+  // Bookkeeping for asynchronous calls. Request IDs start at 1, ID 0 is used
+  // by synchronous requests.
+  uint64_t next_request_id_ GUARDED_BY(mutex_) = 1;
+  size_t num_in_flight_ GUARDED_BY(mutex_) = 0;
+  absl::flat_hash_map<uint64_t, FuncRet> completed_ GUARDED_BY(mutex_);
+  // Callbacks of asynchronous calls, with their expected return type.
+  absl::flat_hash_map<uint64_t, std::pair<v::Type, CallDone>> callbacks_
+      GUARDED_BY(mutex_);
+
+  // Optional shared memory transport, see EnableSharedMemoryTransport().
+  std::unique_ptr<SharedMemoryTransport> shared_memory_ GUARDED_BY(mutex_);
+
+  // Receives variable-sized replies, kept to reuse its allocation.
+  std::vector<uint8_t> reply_buffer_ GUARDED_BY(mutex_);
+  // Memory sent along with the next call, see CallInline().
+  std::vector<uint8_t> inline_memory_ GUARDED_BY(mutex_);
+
+  // Handles of called functions and addresses of symbols, zero if the lookup
+  // failed.
+  absl::flat_hash_map<std::string, uint64_t> func_handles_ GUARDED_BY(mutex_);
+  absl::flat_hash_map<const CallSignature*, uint64_t> signature_handles_
+      GUARDED_BY(mutex_);
+  // Handles of the functions of each FunctionTable, by index.
+  absl::flat_hash_map<const FunctionTable*, std::vector<uint64_t>>
+      table_handles_ GUARDED_BY(mutex_);
+
+  // Addresses queued by FreeDeferred().
+  static constexpr size_t kMaxDeferredFrees = 256;
+  std::vector<uint64_t> deferred_frees_ GUARDED_BY(mutex_);
+
+  // Trace context set by SetTraceContext() and the one last sent.
+  std::string trace_context_ GUARDED_BY(mutex_);
+  std::string sent_trace_context_ GUARDED_BY(mutex_);
+
+  // Addresses of the buffers mapped by ShareBuffers(), keyed by the device and
+  // inode of their file, which stay unique while the buffer exists.
+  using FileId = std::pair<uint64_t, uint64_t>;
+  absl::flat_hash_map<FileId, void*> shared_buffers_ GUARDED_BY(mutex_);
+
+  // Optional arena in the sandboxee, see EnableArena(). 'arena_last_' is the
+  // offset of the most recent allocation, or kNoArenaAllocation.
+  // 'arena_generation_' counts the calls to ResetArena(), so that allocations
+  // from before one are never taken for newer ones at the same offset.
+  static constexpr size_t kNoArenaAllocation = static_cast<size_t>(-1);
+  uintptr_t arena_base_ GUARDED_BY(mutex_) = 0;
+  size_t arena_size_ GUARDED_BY(mutex_) = 0;
+  size_t arena_used_ GUARDED_BY(mutex_) = 0;
+  size_t arena_last_ GUARDED_BY(mutex_) = kNoArenaAllocation;
+  uint64_t arena_generation_ GUARDED_BY(mutex_) = 0;
+
+  // See BeginCheckpoint(). Memory allocated during the checkpoint, memory
+  // allocated before it whose free is sent to the parent once it ends, and
+  // the shared buffers mapped before it.
+  bool in_checkpoint_ GUARDED_BY(mutex_) = false;
+  absl::flat_hash_set<uint64_t> checkpoint_allocations_ GUARDED_BY(mutex_);
+  std::vector<uint64_t> parent_frees_ GUARDED_BY(mutex_);
+  absl::flat_hash_map<FileId, void*> parent_shared_buffers_ GUARDED_BY(mutex_);
+  // Memory which went with a checkpoint while still allocated.
+  absl::flat_hash_set<uint64_t> discarded_allocations_ GUARDED_BY(mutex_);
 };
 
 }  // namespace sapi
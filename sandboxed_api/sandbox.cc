@@ -14,20 +14,32 @@
 
 #include "sandboxed_api/sandbox.h"
 
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <climits>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <typeinfo>
 
 #include <glog/logging.h>
 #include "absl/base/casts.h"
 #include "absl/base/macros.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "sandboxed_api/embed_file.h"
 #include "sandboxed_api/rpcchannel.h"
@@ -37,19 +49,98 @@
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/maps_parser.h"
 #include "sandboxed_api/sandbox2/util/path.h"
 #include "sandboxed_api/sandbox2/util/runfiles.h"
+#include "sandboxed_api/tracing.h"
 #include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/flag.h"
 #include "sandboxed_api/util/status_macros.h"
 
+ABSL_FLAG(string, sapi_profile_dir, "",
+          "Directory sandboxees instrumented for profile-guided optimization "
+          "write their profiles to, see add_sapi_library(PGO_GENERATE)");
+
 namespace file = ::sandbox2::file;
 
 namespace sapi {
+namespace {
+
+// Bytes of variables sent inside a single call request at most, see
+// Sandbox::GetInlineTransferThreshold().
+constexpr uint64_t kMaxInlineTransferSize = 4096;
+
+// Worker channel the current thread released last, see AcquireCallChannel().
+struct BoundChannel {
+  const Sandbox* sandbox = nullptr;
+  RPCChannel* channel = nullptr;
+};
+thread_local BoundChannel bound_channel;
+
+// A library forkserver, shared by all sandboxes starting the same library with
+// the same arguments and environment.
+struct LibraryForkServer {
+  std::unique_ptr<sandbox2::Executor> executor;
+  std::unique_ptr<sandbox2::ForkClient> client;
+};
+
+// The running library forkservers, by library, arguments and environment.
+// Entries expire when the last sandbox using the forkserver is gone.
+struct ForkServerRegistry {
+  absl::Mutex mutex;
+  absl::flat_hash_map<std::string, std::weak_ptr<LibraryForkServer>> servers
+      GUARDED_BY(mutex);
+};
+
+ForkServerRegistry* GetForkServerRegistry() {
+  static auto* registry = new ForkServerRegistry();
+  return registry;
+}
+
+// Starts a span for an operation of 'sandbox', nullptr if tracing is disabled.
+std::unique_ptr<TraceSpan> StartSandboxSpan(absl::string_view name,
+                                            const Sandbox* sandbox) {
+  std::unique_ptr<TraceSpan> span = StartTraceSpan(name);
+  if (span) {
+    span->SetAttribute(kTraceSandbox, absl::StrFormat("%p", sandbox));
+    span->SetAttribute(kTracePid, sandbox->GetPid());
+  }
+  return span;
+}
+
+}  // namespace
+
+// Innermost ScopedCallDeadline of the thread.
+static thread_local const ScopedCallDeadline* current_call_deadline = nullptr;
+
+ScopedCallDeadline::ScopedCallDeadline(const Sandbox* sandbox,
+                                       absl::Time deadline)
+    : sandbox_(sandbox),
+      deadline_(deadline),
+      previous_(current_call_deadline) {
+  current_call_deadline = this;
+}
+
+ScopedCallDeadline::~ScopedCallDeadline() {
+  current_call_deadline = previous_;
+}
+
+absl::Time ScopedCallDeadline::Get(const Sandbox* sandbox) {
+  absl::Time deadline = absl::InfiniteFuture();
+  for (const ScopedCallDeadline* scope = current_call_deadline;
+       scope != nullptr; scope = scope->previous_) {
+    if (scope->sandbox_ == sandbox) {
+      deadline = std::min(deadline, scope->deadline_);
+    }
+  }
+  return deadline;
+}
 
 Sandbox::~Sandbox() {
   Terminate();
-  // The forkserver will die automatically when the executor goes out of scope
-  // and closes the comms object.
+  StopHostCallbacks();
+  // The forkserver will die automatically when the executor of the last
+  // sandbox sharing it goes out of scope and closes the comms object.
 }
 
 // A generic policy which should work with majority of typical libraries, which
@@ -91,6 +182,12 @@ void InitDefaultPolicyBuilder(sandbox2::PolicyBuilder* builder) {
       })
       .AddFile("/etc/localtime")
       .AddTmpfs("/tmp", 1ULL << 30 /* 1GiB tmpfs (max size) */);
+  // Sandboxees instrumented for profile-guided optimization write their
+  // profiles at exit.
+  const std::string& profile_dir = absl::GetFlag(FLAGS_sapi_profile_dir);
+  if (!profile_dir.empty()) {
+    builder->AllowProfileOutput(profile_dir);
+  }
 #if defined(ADDRESS_SANITIZER) || defined(MEMORY_SANITIZER) || \
     defined(THREAD_SANITIZER)
   LOG(WARNING) << "Allowing additional calls to support the LLVM "
@@ -100,12 +197,33 @@ void InitDefaultPolicyBuilder(sandbox2::PolicyBuilder* builder) {
 }
 
 void Sandbox::Terminate(bool attempt_graceful_exit) {
+  if (broker_comms_) {
+    // The broker ends the sandboxee once the connection is closed.
+    if (attempt_graceful_exit && IsActive()) {
+      rpc_channel_->FlushFrees().IgnoreError();
+    }
+    rpc_channel_.reset();
+    comms_ = nullptr;
+    brokered_comms_.reset();
+    broker_comms_.reset();
+    return;
+  }
   if (!IsActive()) {
     return;
   }
+  if (host_call_thread_.joinable() &&
+      host_call_thread_.get_id() == std::this_thread::get_id()) {
+    // Called from a host callback, whose call holds the RPC channel. Neither
+    // a graceful exit nor waiting for the callback thread can finish here, so
+    // just kill the sandboxee. The outstanding call then fails, and its
+    // result is collected by the next Terminate() or Init().
+    s2_->Kill();
+    return;
+  }
 
   if (attempt_graceful_exit) {
     // Gracefully ask it to exit (with 1 second limit) first, then kill it.
+    rpc_channel_->FlushFrees().IgnoreError();
     Exit();
   } else {
     // Kill it straight away
@@ -113,6 +231,7 @@ void Sandbox::Terminate(bool attempt_graceful_exit) {
   }
 
   const auto& result = AwaitResult();
+  StopHostCallbacks();
   if (result.final_status() == sandbox2::Result::OK &&
       result.reason_code() == 0) {
     VLOG(2) << "Sandbox2 finished with: " << result.ToString();
@@ -121,23 +240,134 @@ void Sandbox::Terminate(bool attempt_graceful_exit) {
   }
 }
 
+// Allows the sandboxee to map buffers shared with the host, for the shared
+// memory transport, for v::SharedArray and for MapBuffer(), which may map them
+// read-only, see Sandbox::UseSharedBuffers(). Only the exact protections and
+// flags of these mappings are allowed. Read-only buffers come with a read-only
+// descriptor, so the kernel refuses to map them writable or to mprotect()
+// them.
+static void AllowSharedBuffers(sandbox2::PolicyBuilder* builder) {
+  builder->AddPolicyOnMmap([](bpf_labels& labels) -> std::vector<sock_filter> {
+    return {
+        ARG_32(2),  // prot
+        JEQ32(PROT_READ, JUMP(&labels, mmap_shared_flags)),
+        JNE32(PROT_READ | PROT_WRITE, JUMP(&labels, mmap_shared_end)),
+        LABEL(&labels, mmap_shared_flags),
+        ARG_32(3),  // flags
+        JEQ32(MAP_SHARED, ALLOW),
+        LABEL(&labels, mmap_shared_end),
+    };
+  });
+}
+
+// Allows the sandboxee to replace the windows it maps of large buffers in
+// place and to read them ahead, see Sandbox::MapBufferWindows().
+static void AllowBufferWindows(sandbox2::PolicyBuilder* builder) {
+  builder->AddPolicyOnMmap([](bpf_labels& labels) -> std::vector<sock_filter> {
+    return {
+        ARG_32(2),  // prot
+        JEQ32(PROT_READ, JUMP(&labels, mmap_window_flags)),
+        JNE32(PROT_READ | PROT_WRITE, JUMP(&labels, mmap_window_end)),
+        LABEL(&labels, mmap_window_flags),
+        ARG_32(3),  // flags
+        JEQ32(MAP_SHARED | MAP_FIXED, ALLOW),
+        LABEL(&labels, mmap_window_end),
+    };
+  });
+}
+
+// Allows the sandboxee to start the worker threads serving calls, see
+// Sandbox::GetNumWorkerThreads().
+static void AllowWorkerThreads(sandbox2::PolicyBuilder* builder) {
+  // The flags pthread_create() passes, any other combination might start a
+  // process or share less than a thread does.
+  constexpr uint32_t kThreadCloneFlags =
+      CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |
+      CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+  (*builder)
+      .AllowSyscalls({
+          __NR_set_robust_list,
+          __NR_mprotect,
+          __NR_sched_yield,
+      })
+      // Exiting threads release their stacks.
+      .AddPolicyOnSyscall(__NR_madvise, {
+                                            ARG_32(2),  // advice
+                                            JEQ32(MADV_DONTNEED, ALLOW),
+                                        })
+      // Only threads, no new processes.
+      .AddPolicyOnSyscall(__NR_clone, {
+                                          ARG_32(0),  // flags
+                                          JEQ32(kThreadCloneFlags, ALLOW),
+                                      })
+      // Thread stacks.
+      .AddPolicyOnMmap([](bpf_labels& labels) -> std::vector<sock_filter> {
+        return {
+            ARG_32(2),  // prot
+            JNE32(PROT_READ | PROT_WRITE, JUMP(&labels, mmap_stack_end)),
+            ARG_32(3),  // flags
+            JEQ32(MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, ALLOW),
+            LABEL(&labels, mmap_stack_end),
+        };
+      });
+  // Make the C library fall back to clone() and skip the optional rseq
+  // registration of new threads.
+#ifdef __NR_clone3
+  builder->BlockSyscallWithErrno(__NR_clone3, ENOSYS);
+#endif
+#ifdef __NR_rseq
+  builder->BlockSyscallWithErrno(__NR_rseq, ENOSYS);
+#endif
+}
+
 static std::string PathToSAPILib(const std::string& lib_path) {
   return file::IsAbsolutePath(lib_path)
              ? lib_path
              : sandbox2::GetDataDependencyFilePath(lib_path);
 }
 
-sapi::Status Sandbox::Init() {
-  // It's already initialized
-  if (IsActive()) {
-    return sapi::OkStatus();
+sapi::Status Sandbox::AcquireForkServer() {
+  // If FileToc was specified, it will be used over any paths to the SAPI
+  // library.
+  std::string lib_path;
+  std::string key;
+  if (embed_lib_toc_) {
+    lib_path = embed_lib_toc_->name;
+    key = absl::StrFormat("toc:%p", embed_lib_toc_);
+  } else {
+    lib_path = PathToSAPILib(GetLibPath());
+    if (lib_path.empty()) {
+      LOG(ERROR) << "SAPI library path is empty";
+      return sapi::FailedPreconditionError("No SAPI library path given");
+    }
+    key = absl::StrCat("path:", lib_path);
   }
 
-  // Initialize the forkserver if it is not already running.
-  if (!fork_client_) {
-    // If FileToc was specified, it will be used over any paths to the SAPI
-    // library.
-    std::string lib_path;
+  std::vector<std::string> args{lib_path};
+  // Additional arguments, if needed.
+  GetArgs(&args);
+  const std::string template_init = GetTemplateInitFunction();
+  if (!template_init.empty()) {
+    args.push_back(absl::StrCat("--sapi_template_init=", template_init));
+  }
+  if (RemapTextOnHugePages()) {
+    args.push_back("--sapi_huge_page_text");
+  }
+  std::vector<std::string> envs{};
+  // Additional envvars, if needed.
+  GetEnvs(&envs);
+  if (BindSymbolsAtStartup()) {
+    envs.push_back("LD_BIND_NOW=1");
+  }
+  const absl::string_view separator("\0", 1);
+  absl::StrAppend(&key, separator, absl::StrJoin(args, separator), separator,
+                  separator, absl::StrJoin(envs, separator));
+
+  ForkServerRegistry* registry = GetForkServerRegistry();
+  absl::MutexLock lock(&registry->mutex);
+  std::weak_ptr<LibraryForkServer>& entry = registry->servers[key];
+  std::shared_ptr<LibraryForkServer> server = entry.lock();
+  if (!server || server->executor->ipc()->comms()->IsTerminated()) {
     int embed_lib_fd = -1;
     if (embed_lib_toc_) {
       embed_lib_fd = EmbedFile::GetEmbedFileSingleton()->GetDupFdForFileToc(
@@ -147,38 +377,94 @@ sapi::Status Sandbox::Init() {
                     << embed_lib_toc_->name << "'";
         return sapi::UnavailableError("Could not create executable FD");
       }
-      lib_path = embed_lib_toc_->name;
-    } else {
-      lib_path = PathToSAPILib(GetLibPath());
-      if (lib_path.empty()) {
-        LOG(ERROR) << "SAPI library path is empty";
-        return sapi::FailedPreconditionError("No SAPI library path given");
-      }
     }
-
-    std::vector<std::string> args{lib_path};
-    // Additional arguments, if needed.
-    GetArgs(&args);
-    std::vector<std::string> envs{};
-    // Additional envvars, if needed.
-    GetEnvs(&envs);
-
-    forkserver_executor_ =
+    server = std::make_shared<LibraryForkServer>();
+    server->executor =
         (embed_lib_fd >= 0)
             ? absl::make_unique<sandbox2::Executor>(embed_lib_fd, args, envs)
             : absl::make_unique<sandbox2::Executor>(lib_path, args, envs);
-
-    fork_client_ = forkserver_executor_->StartForkServer();
-
-    if (!fork_client_) {
+    server->client = server->executor->StartForkServer();
+    if (!server->client) {
       LOG(ERROR) << "Could not start forkserver";
       return sapi::UnavailableError("Could not start the forkserver");
     }
+    entry = server;
+  }
+  // Both point into the shared LibraryForkServer, which lives as long as
+  // either of them.
+  fork_client_ =
+      std::shared_ptr<sandbox2::ForkClient>(server, server->client.get());
+  forkserver_executor_ =
+      std::shared_ptr<sandbox2::Executor>(server, server->executor.get());
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::Start(bool reuse_policy) {
+  // It's already initialized
+  if (IsActive()) {
+    return sapi::OkStatus();
   }
 
+  std::unique_ptr<TraceSpan> span = StartTraceSpan("sapi.Init");
+  if (span) {
+    span->SetAttribute(kTraceSandbox, absl::StrFormat("%p", this));
+    span->SetAttribute("sapi.reuse_policy", reuse_policy ? 1 : 0);
+  }
+  init_times_ = InitTimes();
+  absl::Time phase_start = absl::Now();
+  // Returns the time since the previous call, or since the start.
+  auto next_phase = [&phase_start] {
+    absl::Time now = absl::Now();
+    absl::Duration duration = now - phase_start;
+    phase_start = now;
+    return duration;
+  };
+
+  // Drop the forkserver if it died, a new one is started below.
+  if (forkserver_executor_ &&
+      forkserver_executor_->ipc()->comms()->IsTerminated()) {
+    LOG(WARNING) << "The library forkserver exited, starting a new one";
+    fork_client_.reset();
+    forkserver_executor_.reset();
+  }
+  // Initialize the forkserver if it is not already running.
+  if (!fork_client_) {
+    SAPI_RETURN_IF_ERROR(AcquireForkServer());
+  }
+  init_times_.forkserver = next_phase();
+
+  if (!reuse_policy || !policy_) {
     sandbox2::PolicyBuilder policy_builder;
     InitDefaultPolicyBuilder(&policy_builder);
-  auto s2p = ModifyPolicy(&policy_builder);
+    if (GetNumWorkerThreads() > 0) {
+      AllowWorkerThreads(&policy_builder);
+    }
+    if (UseSharedBuffers() || UseSharedMemoryTransport() ||
+        MapBufferWindows()) {
+      AllowSharedBuffers(&policy_builder);
+    }
+    if (MapBufferWindows()) {
+      AllowBufferWindows(&policy_builder);
+    }
+    if (MapBufferWindows() || PrefaultLibraryPages()) {
+      // Read-ahead of buffer windows and of the library's pages.
+      policy_builder.AddPolicyOnSyscall(__NR_madvise,
+                                        {
+                                            ARG_32(2),  // advice
+                                            JEQ32(MADV_WILLNEED, ALLOW),
+                                        });
+    }
+    if (MergeIdenticalPages()) {
+      policy_builder.AllowMemoryMerging();
+    }
+    if (UseLazyPaging()) {
+      policy_builder.AllowUserfaultfd();
+    }
+    if (UseRequestCheckpoints()) {
+      policy_builder.AllowFork().AllowWait();
+    }
+    policy_ = ModifyPolicy(&policy_builder);
+  }
 
   // Spawn new process from the forkserver.
   auto executor = absl::make_unique<sandbox2::Executor>(fork_client_.get());
@@ -197,24 +483,361 @@ sapi::Status Sandbox::Init() {
 
   // Modify the executor, e.g. by setting custom limits and IPC.
   ModifyExecutor(executor.get());
+  {
+    absl::MutexLock lock(&deadlines_mutex_);
+    const absl::Duration limit = executor->limits()->wall_time_limit();
+    wall_time_deadline_ = limit == absl::ZeroDuration()
+                              ? absl::InfiniteFuture()
+                              : absl::Now() + limit;
+  }
 
-  s2_ = absl::make_unique<sandbox2::Sandbox2>(std::move(executor),
-                                              std::move(s2p));
-  auto res = s2_->RunAsync();
+  s2_ = absl::make_unique<sandbox2::Sandbox2>(std::move(executor), policy_);
+  init_times_.policy = next_phase();
+  bool res;
+  if (!done_callback_) {
+    res = s2_->RunAsync();
+  } else if (!completion_executor_) {
+    res = s2_->RunAsync(done_callback_);
+  } else {
+    res = s2_->RunAsync(done_callback_, completion_executor_);
+  }
+  init_times_.sandboxee = next_phase();
+  init_times_.sandboxee_phases = s2_->GetStartupTimes();
 
   comms_ = s2_->comms();
   pid_ = s2_->GetPid();
+  request_parent_pid_ = -1;
+  if (span) {
+    span->SetAttribute(kTracePid, pid_);
+  }
 
   rpc_channel_ = absl::make_unique<RPCChannel>(comms_);
+  {
+    // Mappings do not survive a restart.
+    absl::MutexLock lock(&mapped_buffers_mutex_);
+    mapped_buffers_.clear();
+  }
 
   if (!res) {
     Terminate();
     return sapi::UnavailableError("Could not start the sandbox");
   }
+  sapi::Status status = SetUpSandboxee(next_phase);
+  if (!status.ok()) {
+    // IsActive() must not report a sandbox which is only half initialized.
+    Terminate(/*attempt_graceful_exit=*/false);
+    return status;
+  }
+  VLOG(1) << "Sandbox initialized in "
+          << init_times_.forkserver + init_times_.policy +
+                 init_times_.sandboxee + init_times_.channels +
+                 init_times_.warm_up
+          << " (forkserver: " << init_times_.forkserver
+          << ", policy: " << init_times_.policy
+          << ", sandboxee: " << init_times_.sandboxee
+          << ", channels: " << init_times_.channels
+          << ", warm-up: " << init_times_.warm_up << ")";
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::SetUpSandboxee(
+    const std::function<absl::Duration()>& next_phase) {
+  if (UseSharedMemoryTransport()) {
+    SAPI_RETURN_IF_ERROR(rpc_channel_->EnableSharedMemoryTransport(
+        SharedMemoryTransport::kDefaultSize, GetSharedMemorySpinDuration(),
+        GetNumaNode()));
+  }
+  if (GetArenaSize() != 0) {
+    SAPI_RETURN_IF_ERROR(rpc_channel_->EnableArena(GetArenaSize()));
+  }
+  SAPI_RETURN_IF_ERROR(StartWorkerThreads(GetNumWorkerThreads()));
+  SAPI_RETURN_IF_ERROR(StartHostCallbacks());
+  const std::vector<std::string> symbols = GetPreloadedSymbols();
+  if (!symbols.empty()) {
+    SAPI_RETURN_IF_ERROR(rpc_channel_->ResolveSymbols(symbols));
+    for (const auto& channel : worker_channels_) {
+      SAPI_RETURN_IF_ERROR(channel->ResolveSymbols(symbols));
+    }
+  }
+  transfer_over_comms_ = TransferMemoryOverComms();
+  track_dirty_pages_ = TrackDirtyPages() && !transfer_over_comms_;
+  if (track_dirty_pages_ && !worker_channels_.empty()) {
+    // Soft-dirty bits are per process, concurrent calls would reset each
+    // other's.
+    LOG(WARNING) << "Dirty page tracking is not supported with worker threads";
+    track_dirty_pages_ = false;
+  }
+  init_times_.channels = next_phase();
+
+  if (PrefaultLibraryPages()) {
+    uint64_t pages;
+    SAPI_RETURN_IF_ERROR(rpc_channel_->Prefault(&pages));
+    VLOG(1) << "Pre-faulted " << pages << " page(s)";
+  }
+  inline_threshold_ = GetInlineTransferThreshold();
+  // Warm-up calls are not part of the statistics.
+  collect_stats_ = false;
+  SAPI_RETURN_IF_ERROR(WarmUp());
+  collect_stats_ = CollectStats();
+  perf_counters_.reset();
+  if (collect_stats_ && CollectPerfCounters()) {
+    // Opened once the worker threads run, a restart opens them anew.
+    sapi::StatusOr<std::unique_ptr<PerfCounters>> counters =
+        PerfCounters::Open(pid_);
+    if (counters.ok()) {
+      perf_counters_ = std::move(counters).ValueOrDie();
+      LOG_IF(WARNING, !perf_counters_->counts_kernel())
+          << "Performance counters only count user space";
+    } else {
+      LOG(WARNING) << "Performance counters not available: "
+                   << counters.status();
+    }
+  }
+  call_cache_.Configure(GetCachedFunctions(), GetCallCacheSize());
+  if (MergeIdenticalPages()) {
+    // Only saves memory, the sandboxee works without.
+    sapi::Status status = EnableMemoryMerging();
+    if (!status.ok()) {
+      LOG(WARNING) << "Could not enable memory merging: " << status;
+    }
+  }
+  init_times_.warm_up = next_phase();
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::InitMany(absl::Span<Sandbox* const> sandboxes) {
+  if (sandboxes.empty()) {
+    return sapi::OkStatus();
+  }
+  Sandbox* first = sandboxes[0];
+  // The others run the first one's library under its policy.
+  for (const Sandbox* sandbox : sandboxes) {
+    if (typeid(*sandbox) != typeid(*first)) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Sandboxes of different types: ", typeid(*first).name(),
+                       " and ", typeid(*sandbox).name()));
+    }
+    if (sandbox->embed_lib_toc_ != first->embed_lib_toc_) {
+      return sapi::InvalidArgumentError(
+          "Sandboxes with different embedded libraries");
+    }
+  }
+  SAPI_RETURN_IF_ERROR(first->Init());
+
+  std::vector<sapi::Status> results(sandboxes.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < sandboxes.size(); ++i) {
+    Sandbox* sandbox = sandboxes[i];
+    if (sandbox->IsActive()) {
+      continue;
+    }
+    sandbox->fork_client_ = first->fork_client_;
+    sandbox->forkserver_executor_ = first->forkserver_executor_;
+    sandbox->policy_ = first->policy_;
+    sapi::Status* result = &results[i];
+    threads.emplace_back([sandbox, result] {
+      *result = sandbox->Start(/*reuse_policy=*/true);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& result : results) {
+    SAPI_RETURN_IF_ERROR(result);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::StartWorkerThreads(int num_threads) {
+  {
+    absl::MutexLock lock(&channels_mutex_);
+    idle_channels_.clear();
+  }
+  worker_channels_.clear();
+  worker_comms_.clear();
+  if (num_threads <= 0) {
+    return sapi::OkStatus();
+  }
+  // The sandboxee receives its own copies of the remote ends.
+  std::vector<sandbox2::file_util::fileops::FDCloser> remote_fds;
+  std::vector<int> fds;
+  for (int i = 0; i < num_threads; ++i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+      PLOG(ERROR) << "socketpair()";
+      return sapi::UnavailableError("Could not create a worker channel");
+    }
+    remote_fds.emplace_back(sv[1]);
+    fds.push_back(sv[1]);
+    worker_comms_.push_back(absl::make_unique<sandbox2::Comms>(sv[0]));
+    worker_channels_.push_back(
+        absl::make_unique<RPCChannel>(worker_comms_.back().get()));
+  }
+  SAPI_RETURN_IF_ERROR(rpc_channel_->AddChannels(fds));
+  absl::MutexLock lock(&channels_mutex_);
+  for (const auto& channel : worker_channels_) {
+    idle_channels_.push_back(channel.get());
+  }
+  return sapi::OkStatus();
+}
+
+void Sandbox::RegisterHostCallback(uint32_t id, HostCallback callback) {
+  absl::MutexLock lock(&host_callbacks_mutex_);
+  host_callbacks_[id] = std::move(callback);
+}
+
+sapi::Status Sandbox::StartHostCallbacks() {
+  // From a previous sandboxee which exited on its own.
+  StopHostCallbacks();
+  {
+    absl::MutexLock lock(&host_callbacks_mutex_);
+    if (host_callbacks_.empty()) {
+      return sapi::OkStatus();
+    }
+  }
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    PLOG(ERROR) << "socketpair()";
+    return sapi::UnavailableError("Could not create the host callback channel");
+  }
+  // The sandboxee receives its own copy of the remote end.
+  sandbox2::file_util::fileops::FDCloser remote_fd(sv[1]);
+  host_call_comms_ = absl::make_unique<sandbox2::Comms>(sv[0]);
+  SAPI_RETURN_IF_ERROR(rpc_channel_->SetHostCallChannel(remote_fd.get()));
+  sandbox2::Comms* comms = host_call_comms_.get();
+  host_call_thread_ = std::thread([this, comms] { ServeHostCallbacks(comms); });
   return sapi::OkStatus();
 }
 
-bool Sandbox::IsActive() const { return s2_ && !s2_->IsTerminated(); }
+void Sandbox::StopHostCallbacks() {
+  if (host_call_thread_.joinable()) {
+    host_call_thread_.join();
+  }
+  host_call_comms_.reset();
+}
+
+void Sandbox::ServeHostCallbacks(sandbox2::Comms* comms) {
+  uint32_t tag;
+  std::vector<uint8_t> request;
+  std::vector<uint8_t> response;
+  // Ends once the sandboxee exited and its end of the channel is closed.
+  while (comms->RecvTLV(&tag, &request)) {
+    sapi::Status status;
+    uint32_t id;
+    response.clear();
+    if (tag != comms::kMsgHostCall || request.size() < sizeof(id)) {
+      status = sapi::InvalidArgumentError("Malformed host callback request");
+    } else {
+      memcpy(&id, request.data(), sizeof(id));
+      HostCallback callback;
+      {
+        absl::MutexLock lock(&host_callbacks_mutex_);
+        auto it = host_callbacks_.find(id);
+        if (it != host_callbacks_.end()) {
+          callback = it->second;
+        }
+      }
+      if (callback) {
+        status =
+            callback(absl::MakeConstSpan(request).subspan(sizeof(id)),
+                     &response);
+      } else {
+        status = sapi::NotFoundError(
+            absl::StrCat("No host callback registered under ", id));
+      }
+    }
+    const bool sent =
+        status.ok() ? comms->SendTLV(comms::kMsgHostReturn, response.size(),
+                                     response.data())
+                    : comms->SendStatus(status);
+    if (!sent) {
+      break;
+    }
+  }
+}
+
+RPCChannel* Sandbox::AcquireCallChannel() {
+  if (worker_channels_.empty()) {
+    return GetRpcChannel();
+  }
+  absl::MutexLock lock(&channels_mutex_);
+  channels_mutex_.Await(absl::Condition(
+      +[](std::vector<RPCChannel*>* idle) { return !idle->empty(); },
+      &idle_channels_));
+  // Prefer the channel this thread used last, so that a host thread keeps
+  // talking to the same sandboxee thread while calls do not overlap.
+  auto it = idle_channels_.end() - 1;
+  if (bound_channel.sandbox == this) {
+    auto bound = std::find(idle_channels_.begin(), idle_channels_.end(),
+                           bound_channel.channel);
+    if (bound != idle_channels_.end()) {
+      it = bound;
+    }
+  }
+  RPCChannel* channel = *it;
+  idle_channels_.erase(it);
+  return channel;
+}
+
+void Sandbox::ReleaseCallChannel(RPCChannel* channel) {
+  if (channel == GetRpcChannel()) {
+    return;
+  }
+  bound_channel.sandbox = this;
+  bound_channel.channel = channel;
+  absl::MutexLock lock(&channels_mutex_);
+  idle_channels_.push_back(channel);
+}
+
+bool Sandbox::IsActive() const {
+  if (broker_comms_) {
+    return !brokered_comms_->IsTerminated();
+  }
+  return s2_ && !s2_->IsTerminated();
+}
+
+sapi::Status Sandbox::InitFromBroker(const std::string& socket_name,
+                                     const std::string& pool) {
+  Terminate();
+  auto broker = absl::make_unique<sandbox2::Comms>(socket_name);
+  if (!broker->Connect()) {
+    return sapi::UnavailableError(
+        absl::StrCat("Could not connect to the sandbox broker ", socket_name));
+  }
+  sapi::Status broker_status;
+  if (!broker->SendString(pool) || !broker->RecvStatus(&broker_status)) {
+    return sapi::UnavailableError(
+        "Could not request a sandbox from the broker");
+  }
+  SAPI_RETURN_IF_ERROR(broker_status);
+  int32_t pid;
+  int fd;
+  if (!broker->RecvInt32(&pid) || !broker->RecvFD(&fd)) {
+    return sapi::UnavailableError(
+        "Could not receive a sandbox from the broker");
+  }
+
+  broker_comms_ = std::move(broker);
+  brokered_comms_ = absl::make_unique<sandbox2::Comms>(fd);
+  comms_ = brokered_comms_.get();
+  pid_ = pid;
+  request_parent_pid_ = -1;
+  rpc_channel_ = absl::make_unique<RPCChannel>(comms_);
+  {
+    absl::MutexLock lock(&mapped_buffers_mutex_);
+    mapped_buffers_.clear();
+  }
+  // Drops the channels of a previous sandboxee.
+  SAPI_RETURN_IF_ERROR(StartWorkerThreads(0));
+  StopHostCallbacks();
+  // The sandboxee is not a child of this process, and may not be reachable
+  // with process_vm_readv() at all.
+  transfer_over_comms_ = true;
+  track_dirty_pages_ = false;
+  inline_threshold_ = GetInlineTransferThreshold();
+  result_ = sandbox2::Result();
+  return sapi::OkStatus();
+}
 
 sapi::Status Sandbox::Allocate(v::Var* var, bool automatic_free) {
   if (!IsActive()) {
@@ -230,10 +853,38 @@ sapi::Status Sandbox::Free(v::Var* var) {
   return var->Free(GetRpcChannel());
 }
 
-sapi::Status Sandbox::SynchronizePtrBefore(v::Callable* ptr) {
+sapi::Status Sandbox::FlushFrees() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  return rpc_channel_->FlushFrees();
+}
+
+void Sandbox::ResetArena() {
+  if (IsActive()) {
+    rpc_channel_->ResetArena();
+  }
+}
+
+sapi::Status Sandbox::BeginRegion(size_t capacity) {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
   }
+  return rpc_channel_->BeginRegion(capacity);
+}
+
+sapi::Status Sandbox::EndRegion() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  uint64_t released;
+  SAPI_RETURN_IF_ERROR(rpc_channel_->EndRegion(&released));
+  VLOG(1) << "Released " << released << " bytes of region memory";
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::PreparePtrBefore(v::Callable* ptr,
+                                       std::vector<v::Var*>* vars) {
   if (ptr->GetType() != v::Type::kPointer) {
     return sapi::OkStatus();
   }
@@ -259,13 +910,12 @@ sapi::Status Sandbox::SynchronizePtrBefore(v::Callable* ptr) {
   VLOG(3) << "Synchronization (TO), ptr " << p << ", Type: " << p->GetSyncType()
           << " for var: " << p->GetPointedVar()->ToString();
 
-  return p->GetPointedVar()->TransferToSandboxee(GetRpcChannel(), GetPid());
+  vars->push_back(p->GetPointedVar());
+  return sapi::OkStatus();
 }
 
-sapi::Status Sandbox::SynchronizePtrAfter(v::Callable* ptr) const {
-  if (!IsActive()) {
-    return sapi::UnavailableError("Sandbox not active");
-  }
+sapi::Status Sandbox::PreparePtrAfter(v::Callable* ptr,
+                                      std::vector<v::Var*>* vars) const {
   if (ptr->GetType() != v::Type::kPointer) {
     return sapi::OkStatus();
   }
@@ -287,68 +937,316 @@ sapi::Status Sandbox::SynchronizePtrAfter(v::Callable* ptr) const {
         p->ToString()));
   }
 
-  return p->GetPointedVar()->TransferFromSandboxee(GetRpcChannel(), GetPid());
+  vars->push_back(p->GetPointedVar());
+  return sapi::OkStatus();
 }
 
-sapi::Status Sandbox::Call(const std::string& func, v::Callable* ret,
-                           std::initializer_list<v::Callable*> args) {
+// Returns the total length of 'regions'.
+static uint64_t RegionsSize(const std::vector<iovec>& regions) {
+  uint64_t size = 0;
+  for (const iovec& region : regions) {
+    size += region.iov_len;
+  }
+  return size;
+}
+
+sapi::Status Sandbox::TransferVarsToSandboxee(const std::vector<v::Var*>& vars,
+                                              uint64_t* bytes,
+                                              InlineRegions* inlined) const {
+  std::vector<iovec> local;
+  std::vector<iovec> remote;
+  for (v::Var* var : vars) {
+    if (IsInMappedBuffer(var)) {
+      continue;
+    }
+    const size_t first = local.size();
+    if (!var->GetRegionsToSandboxee(&local, &remote)) {
+      SAPI_RETURN_IF_ERROR(
+          var->TransferToSandboxee(GetRpcChannel(), GetTransferPid()));
+      if (bytes) {
+        *bytes += var->GetSize();
+      }
+      continue;
+    }
+    if (!inlined) {
+      continue;
+    }
+    uint64_t size = 0;
+    for (size_t i = first; i < local.size(); ++i) {
+      size += local[i].iov_len;
+    }
+    if (size <= inline_threshold_ &&
+        inlined->size + size <= kMaxInlineTransferSize) {
+      inlined->local.insert(inlined->local.end(), local.begin() + first,
+                            local.end());
+      inlined->remote.insert(inlined->remote.end(), remote.begin() + first,
+                             remote.end());
+      inlined->size += size;
+      local.resize(first);
+      remote.resize(first);
+      if (bytes) {
+        *bytes += size;
+      }
+    }
+  }
+  SAPI_RETURN_IF_ERROR(TransferRegions(/*to_sandboxee=*/true, local, remote));
+  if (bytes) {
+    *bytes += RegionsSize(local);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::TransferVarsFromSandboxee(
+    const std::vector<v::Var*>& vars, uint64_t* bytes) const {
+  std::vector<iovec> local;
+  std::vector<iovec> remote;
+  for (v::Var* var : vars) {
+    if (IsInMappedBuffer(var)) {
+      continue;
+    }
+    if (!var->GetRegionsFromSandboxee(&local, &remote)) {
+      SAPI_RETURN_IF_ERROR(
+          var->TransferFromSandboxee(GetRpcChannel(), GetTransferPid()));
+      if (bytes) {
+        *bytes += var->GetSize();
+      }
+    }
+  }
+  if (track_dirty_pages_) {
+    FilterDirtyRegions(&local, &remote);
+  }
+  SAPI_RETURN_IF_ERROR(TransferRegions(/*to_sandboxee=*/false, local, remote));
+  if (bytes) {
+    *bytes += RegionsSize(local);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::TransferRegions(bool to_sandboxee,
+                                      const std::vector<iovec>& local,
+                                      const std::vector<iovec>& remote) const {
+  if (transfer_over_comms_) {
+    if (local.empty()) {
+      return sapi::OkStatus();
+    }
+    return to_sandboxee ? rpc_channel_->WriteMemory(local.data(),
+                                                    remote.data(), local.size())
+                        : rpc_channel_->ReadMemory(local.data(), remote.data(),
+                                                   local.size());
+  }
+  const char* syscall_name =
+      to_sandboxee ? "process_vm_writev" : "process_vm_readv";
+  // Neither syscall accepts more than IOV_MAX regions at once.
+  for (size_t offset = 0; offset < local.size(); offset += IOV_MAX) {
+    const size_t count = std::min<size_t>(local.size() - offset, IOV_MAX);
+    size_t total = 0;
+    for (size_t i = offset; i < offset + count; ++i) {
+      total += local[i].iov_len;
+    }
+    const ssize_t ret =
+        to_sandboxee ? process_vm_writev(GetPid(), &local[offset], count,
+                                         &remote[offset], count, 0)
+                     : process_vm_readv(GetPid(), &local[offset], count,
+                                        &remote[offset], count, 0);
+    if (ret == -1) {
+      PLOG(WARNING) << syscall_name << "(pid: " << GetPid()
+                    << " regions: " << count << " size: " << total << ")";
+      return sapi::UnavailableError(absl::StrCat(syscall_name, " failed"));
+    }
+    if (ret != total) {
+      LOG(WARNING) << syscall_name << "(pid: " << GetPid()
+                   << " regions: " << count << " size: " << total << ")"
+                   << " transferred " << ret << " bytes";
+      return sapi::UnavailableError(
+          absl::StrCat(syscall_name, ": partial success"));
+    }
+  }
+  return sapi::OkStatus();
+}
+
+void Sandbox::ClearDirtyPages() {
+  sandbox2::file_util::fileops::FDCloser clear_refs(
+      open(absl::StrCat("/proc/", GetPid(), "/clear_refs").c_str(),
+           O_WRONLY | O_CLOEXEC));
+  // "4" clears the soft-dirty bits, see the kernel's soft-dirty.txt.
+  if (clear_refs.get() == -1 ||
+      TEMP_FAILURE_RETRY(write(clear_refs.get(), "4", 1)) != 1) {
+    PLOG(WARNING) << "Cannot clear soft-dirty bits of pid " << GetPid()
+                  << ", disabling dirty page tracking";
+    track_dirty_pages_ = false;
+  }
+}
+
+void Sandbox::FilterDirtyRegions(std::vector<iovec>* local,
+                                 std::vector<iovec>* remote) const {
+  if (local->empty()) {
+    return;
+  }
+  sandbox2::file_util::fileops::FDCloser pagemap(
+      open(absl::StrCat("/proc/", GetPid(), "/pagemap").c_str(),
+           O_RDONLY | O_CLOEXEC));
+  if (pagemap.get() == -1) {
+    PLOG(WARNING) << "Cannot open pagemap of pid " << GetPid();
+    return;
+  }
+
+  // Bit 55 of a pagemap entry is the soft-dirty bit.
+  constexpr uint64_t kSoftDirty = 1ULL << 55;
+  const uintptr_t page_size = getpagesize();
+  std::vector<iovec> dirty_local;
+  std::vector<iovec> dirty_remote;
+  std::vector<uint64_t> entries;
+  for (size_t i = 0; i < local->size(); ++i) {
+    const uintptr_t start = reinterpret_cast<uintptr_t>((*remote)[i].iov_base);
+    const size_t len = (*remote)[i].iov_len;
+    if (len == 0) {
+      continue;
+    }
+    const uintptr_t first_page = start / page_size;
+    entries.resize((start + len - 1) / page_size - first_page + 1);
+    const ssize_t size = entries.size() * sizeof(entries[0]);
+    if (TEMP_FAILURE_RETRY(pread(pagemap.get(), entries.data(), size,
+                                 first_page * sizeof(entries[0]))) != size) {
+      dirty_local.push_back((*local)[i]);
+      dirty_remote.push_back((*remote)[i]);
+      continue;
+    }
+    // Copy runs of consecutive dirty pages, clipped to the region.
+    for (size_t p = 0; p < entries.size();) {
+      if ((entries[p] & kSoftDirty) == 0) {
+        ++p;
+        continue;
+      }
+      size_t q = p + 1;
+      while (q < entries.size() && (entries[q] & kSoftDirty) != 0) {
+        ++q;
+      }
+      const uintptr_t range_start =
+          std::max(start, (first_page + p) * page_size);
+      const uintptr_t range_end =
+          std::min(start + len, (first_page + q) * page_size);
+      const size_t offset = range_start - start;
+      dirty_local.push_back(
+          {static_cast<uint8_t*>((*local)[i].iov_base) + offset,
+           range_end - range_start});
+      dirty_remote.push_back(
+          {reinterpret_cast<void*>(range_start), range_end - range_start});
+      p = q;
+    }
+  }
+  VLOG(3) << "Dirty page tracking reduced " << local->size() << " region(s) to "
+          << dirty_local.size();
+  local->swap(dirty_local);
+  remote->swap(dirty_remote);
+}
+
+sapi::Status Sandbox::SynchronizePtrBefore(v::Callable* ptr) {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
   }
-  // Send data.
-  FuncCall rfcall{};
-  rfcall.argc = args.size();
-  absl::SNPrintF(rfcall.func, ABSL_ARRAYSIZE(rfcall.func), "%s", func);
+  std::unique_ptr<TraceSpan> span =
+      StartSandboxSpan("sapi.SynchronizePtrBefore", this);
+  std::vector<v::Var*> vars;
+  SAPI_RETURN_IF_ERROR(PreparePtrBefore(ptr, &vars));
+  uint64_t bytes = 0;
+  SAPI_RETURN_IF_ERROR(TransferVarsToSandboxee(vars, &bytes));
+  if (span) {
+    span->SetAttribute(kTraceBytesToSandboxee, bytes);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::SynchronizePtrAfter(v::Callable* ptr) const {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  std::unique_ptr<TraceSpan> span =
+      StartSandboxSpan("sapi.SynchronizePtrAfter", this);
+  std::vector<v::Var*> vars;
+  SAPI_RETURN_IF_ERROR(PreparePtrAfter(ptr, &vars));
+  uint64_t bytes = 0;
+  SAPI_RETURN_IF_ERROR(TransferVarsFromSandboxee(vars, &bytes));
+  if (span) {
+    span->SetAttribute(kTraceBytesFromSandboxee, bytes);
+  }
+  return sapi::OkStatus();
+}
+
+template <typename Container>
+sapi::Status Sandbox::PrepareCall(absl::string_view func, v::Callable* ret,
+                                  const Container& args, FuncCall* rfcall,
+                                  std::vector<v::Var*>* sync_before) {
+  if (args.size() > FuncCall::kArgsMax) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Too many arguments for '", func, "': ", args.size()));
+  }
+  rfcall->argc = args.size();
 
   VLOG(1) << "CALL ENTRY: '" << func << "' with " << args.size()
           << " argument(s)";
 
+  // Pass all file descriptors which are not in the sandboxee yet together.
+  std::vector<v::Fd*> fds;
+  for (auto* arg : args) {
+    if (arg->GetType() == v::Type::kFd) {
+      // Cast is safe, since type is v::Type::kFd
+      auto* fd = static_cast<v::Fd*>(arg);
+      if (fd->GetRemoteFd() < 0 &&
+          std::find(fds.begin(), fds.end(), fd) == fds.end()) {
+        fds.push_back(fd);
+      }
+    }
+  }
+  if (fds.size() == 1) {
+    SAPI_RETURN_IF_ERROR(TransferToSandboxee(fds[0]));
+  } else if (!fds.empty()) {
+    SAPI_RETURN_IF_ERROR(TransferToSandboxee(fds));
+  }
+
   // Copy all arguments into rfcall.
   int i = 0;
   for (auto* arg : args) {
-    rfcall.arg_size[i] = arg->GetSize();
-    rfcall.arg_type[i] = arg->GetType();
+    rfcall->arg_size[i] = arg->GetSize();
+    rfcall->arg_type[i] = arg->GetType();
 
     // For pointers, set the auxiliary type and size.
-    if (rfcall.arg_type[i] == v::Type::kPointer) {
+    if (rfcall->arg_type[i] == v::Type::kPointer) {
       // Cast is safe, since type is v::Type::kPointer
       auto* p = static_cast<v::Ptr*>(arg);
-      rfcall.aux_type[i] = p->GetPointedVar()->GetType();
-      rfcall.aux_size[i] = p->GetPointedVar()->GetSize();
+      rfcall->aux_type[i] = p->GetPointedVar()->GetType();
+      rfcall->aux_size[i] = p->GetPointedVar()->GetSize();
     }
 
-    // Synchronize all pointers before the call if it's needed.
-    SAPI_RETURN_IF_ERROR(SynchronizePtrBefore(arg));
+    // Allocate all pointers, and collect the ones which need to be
+    // synchronized before the call.
+    SAPI_RETURN_IF_ERROR(PreparePtrBefore(arg, sync_before));
 
     if (arg->GetType() == v::Type::kFloat) {
-      arg->GetDataFromPtr(&rfcall.args[i].arg_float,
-                          sizeof(rfcall.args[0].arg_float));
+      arg->GetDataFromPtr(&rfcall->args[i].arg_float,
+                          sizeof(rfcall->args[0].arg_float));
     } else {
-      arg->GetDataFromPtr(&rfcall.args[i].arg_int,
-                          sizeof(rfcall.args[0].arg_int));
+      arg->GetDataFromPtr(&rfcall->args[i].arg_int,
+                          sizeof(rfcall->args[0].arg_int));
     }
 
-    if (rfcall.arg_type[i] == v::Type::kFd) {
+    if (rfcall->arg_type[i] == v::Type::kFd) {
       // Cast is safe, since type is v::Type::kFd
-      auto* fd = static_cast<v::Fd*>(arg);
-      if (fd->GetRemoteFd() < 0) {
-        SAPI_RETURN_IF_ERROR(TransferToSandboxee(fd));
-      }
-      rfcall.args[i].arg_int = fd->GetRemoteFd();
+      rfcall->args[i].arg_int = static_cast<v::Fd*>(arg)->GetRemoteFd();
     }
 
     VLOG(1) << "CALL ARG: (" << i << "), Type: " << arg->GetTypeString()
             << ", Size: " << arg->GetSize() << ", Val: " << arg->ToString();
     ++i;
   }
-  rfcall.ret_type = ret->GetType();
-  rfcall.ret_size = ret->GetSize();
-
-  // Call & receive data.
-  FuncRet fret;
-  SAPI_RETURN_IF_ERROR(
-      GetRpcChannel()->Call(rfcall, comms::kMsgCall, &fret, rfcall.ret_type));
+  rfcall->ret_type = ret->GetType();
+  rfcall->ret_size = ret->GetSize();
+  return sapi::OkStatus();
+}
 
+template <typename Container>
+sapi::Status Sandbox::FinishCall(const FuncRet& fret, v::Callable* ret,
+                                 const Container& args,
+                                 std::vector<v::Var*>* sync_after) {
   if (fret.ret_type == v::Type::kFloat) {
     ret->SetDataFromPtr(&fret.float_val, sizeof(fret.float_val));
   } else {
@@ -359,9 +1257,9 @@ sapi::Status Sandbox::Call(const std::string& func, v::Callable* ret,
     SAPI_RETURN_IF_ERROR(TransferFromSandboxee(reinterpret_cast<v::Fd*>(ret)));
   }
 
-  // Synchronize all pointers after the call if it's needed.
+  // Collect all pointers which need to be synchronized after the call.
   for (auto* arg : args) {
-    SAPI_RETURN_IF_ERROR(SynchronizePtrAfter(arg));
+    SAPI_RETURN_IF_ERROR(PreparePtrAfter(arg, sync_after));
   }
 
   VLOG(1) << "CALL EXIT: Type: " << ret->GetTypeString()
@@ -370,6 +1268,453 @@ sapi::Status Sandbox::Call(const std::string& func, v::Callable* ret,
   return sapi::OkStatus();
 }
 
+sapi::Status Sandbox::Call(const std::string& func, v::Callable* ret,
+                           std::initializer_list<v::Callable*> args) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!collect_stats_) {
+    return CallInternal(func, /*table=*/nullptr, /*index=*/0, ret, args,
+                        /*sample=*/nullptr);
+  }
+  CallSample sample;
+  const PerfCounterValues counters = ReadPerfCounters();
+  sapi::Status status =
+      CallInternal(func, /*table=*/nullptr, /*index=*/0, ret, args, &sample);
+  sample.counters = ReadPerfCounters() - counters;
+  sample.ok = status.ok();
+  stats_.Record(func, sample);
+  return status;
+}
+
+sapi::Status Sandbox::Call(const FunctionTable& table, size_t index,
+                           v::Callable* ret,
+                           std::initializer_list<v::Callable*> args) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (index >= table.size) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Function index out of range: ", index));
+  }
+  if (!collect_stats_) {
+    return CallInternal(table.names[index], &table, index, ret, args,
+                        /*sample=*/nullptr);
+  }
+  CallSample sample;
+  const PerfCounterValues counters = ReadPerfCounters();
+  sapi::Status status =
+      CallInternal(table.names[index], &table, index, ret, args, &sample);
+  sample.counters = ReadPerfCounters() - counters;
+  sample.ok = status.ok();
+  stats_.Record(table.names[index], sample);
+  return status;
+}
+
+sapi::Status Sandbox::CallScalarInternal(const CallSignature& sig,
+                                         const FuncArg* args, FuncRet* ret) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  std::string cache_key;
+  const bool cacheable = call_cache_.MakeScalarKey(sig, args, &cache_key);
+  if (cacheable && call_cache_.Lookup(cache_key, ret)) {
+    if (collect_stats_) {
+      CallSample sample;
+      sample.ok = true;
+      stats_.Record(sig.name, sample);
+    }
+    return sapi::OkStatus();
+  }
+  const absl::Time start = collect_stats_ ? absl::Now() : absl::InfinitePast();
+  const PerfCounterValues counters =
+      collect_stats_ ? ReadPerfCounters() : PerfCounterValues();
+  const absl::Time deadline = ScopedCallDeadline::Get(this);
+  SAPI_RETURN_IF_ERROR(BeginCallDeadline(deadline));
+  RPCChannel* channel = AcquireCallChannel();
+  sapi::Status call_status = channel->CallScalar(sig, args, ret);
+  ReleaseCallChannel(channel);
+  call_status = EndCallDeadline(deadline, std::move(call_status));
+  if (cacheable && call_status.ok()) {
+    call_cache_.Insert(cache_key, *ret);
+  }
+  if (collect_stats_) {
+    // There is nothing to marshal or to synchronize.
+    CallSample sample;
+    sample.ok = call_status.ok();
+    if (sample.ok) {
+      sample.execution = absl::Nanoseconds(ret->exec_time_ns);
+    }
+    sample.ipc =
+        std::max(absl::Now() - start - sample.execution, absl::ZeroDuration());
+    sample.counters = ReadPerfCounters() - counters;
+    stats_.Record(sig.name, sample);
+  }
+  return call_status;
+}
+
+// Builds the request of a call with scalar arguments only.
+static FuncCall MakeScalarFuncCall(const CallSignature& sig,
+                                   const FuncArg* args) {
+  FuncCall call{};
+  strncpy(call.func, sig.name, FuncCall::kFuncNameMax - 1);
+  call.ret_type = sig.ret_type;
+  call.ret_size = sig.ret_size;
+  call.argc = sig.argc;
+  for (size_t i = 0; i < sig.argc; ++i) {
+    call.arg_type[i] = sig.arg_type[i];
+    call.arg_size[i] = sig.arg_size[i];
+    call.args[i] = args[i];
+  }
+  return call;
+}
+
+std::future<sapi::StatusOr<FuncRet>> Sandbox::CallScalarAsyncInternal(
+    const CallSignature& sig, const FuncArg* args) {
+  if (!IsActive()) {
+    std::promise<sapi::StatusOr<FuncRet>> failed;
+    failed.set_value(sapi::UnavailableError("Sandbox not active"));
+    return failed.get_future();
+  }
+  // Always on the main channel, so that the calls stay in order.
+  return GetRpcChannel()->CallAsync(MakeScalarFuncCall(sig, args),
+                                    comms::kMsgCall, sig.ret_type);
+}
+
+sapi::Status Sandbox::CallScalarWithCallbackInternal(
+    const CallSignature& sig, const FuncArg* args, RPCChannel::CallDone done) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  return GetRpcChannel()->CallAsync(MakeScalarFuncCall(sig, args),
+                                    comms::kMsgCall, sig.ret_type,
+                                    std::move(done));
+}
+
+int Sandbox::GetReadinessFd() const {
+  return IsActive() ? rpc_channel_->GetReadinessFd() : -1;
+}
+
+sapi::Status Sandbox::ProcessReplies() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  return rpc_channel_->ProcessReplies();
+}
+
+sapi::Status Sandbox::CallInternal(const std::string& func,
+                                   const FunctionTable* table, size_t index,
+                                   v::Callable* ret,
+                                   std::initializer_list<v::Callable*> args,
+                                   CallSample* sample) {
+  std::unique_ptr<TraceSpan> span = StartSandboxSpan("sapi.Call", this);
+  CallSample span_sample;
+  if (span) {
+    span->SetAttribute(kTraceFunction, func);
+    // The span reports the synchronized bytes.
+    if (!sample) {
+      sample = &span_sample;
+    }
+  }
+  absl::Time start = sample ? absl::Now() : absl::InfinitePast();
+  // Records the time since the end of the previous phase in 'phase'.
+  const auto end_phase = [sample, &start](absl::Duration* phase) {
+    if (sample) {
+      const absl::Time now = absl::Now();
+      *phase = now - start;
+      start = now;
+    }
+  };
+
+  std::string cache_key;
+  const bool cacheable = call_cache_.MakeKey(func, ret, args, &cache_key);
+  if (cacheable) {
+    FuncRet cached;
+    if (call_cache_.Lookup(cache_key, &cached)) {
+      VLOG(1) << "CALL CACHED: '" << func << "'";
+      if (cached.ret_type == v::Type::kFloat) {
+        ret->SetDataFromPtr(&cached.float_val, sizeof(cached.float_val));
+      } else {
+        ret->SetDataFromPtr(&cached.int_val, sizeof(cached.int_val));
+      }
+      return sapi::OkStatus();
+    }
+  }
+
+  // Send data.
+  FuncCall rfcall{};
+  std::vector<v::Var*> sync_vars;
+  SAPI_RETURN_IF_ERROR(PrepareCall(func, ret, args, &rfcall, &sync_vars));
+  InlineRegions inlined;
+  SAPI_RETURN_IF_ERROR(TransferVarsToSandboxee(
+      sync_vars, sample ? &sample->bytes_to_sandboxee : nullptr,
+      inline_threshold_ > 0 ? &inlined : nullptr));
+  if (sample) {
+    sample->bytes_inlined = inlined.size;
+  }
+  if (track_dirty_pages_) {
+    ClearDirtyPages();
+  }
+  end_phase(sample ? &sample->marshal : nullptr);
+
+  // Call & receive data.
+  const absl::Time deadline = ScopedCallDeadline::Get(this);
+  SAPI_RETURN_IF_ERROR(BeginCallDeadline(deadline));
+  FuncRet fret;
+  RPCChannel* channel = AcquireCallChannel();
+  channel->SetTraceContext(span ? span->GetContext() : std::string());
+  sapi::Status call_status;
+  if (table) {
+    call_status = channel->GetFunctionHandle(*table, index, &rfcall.handle);
+  }
+  if (call_status.ok()) {
+    if (rfcall.handle == 0) {
+      // Looked up by name, or reported as missing by the sandboxee.
+      absl::SNPrintF(rfcall.func, ABSL_ARRAYSIZE(rfcall.func), "%s", func);
+    }
+    call_status =
+        inlined.local.empty()
+            ? channel->Call(rfcall, comms::kMsgCall, &fret, rfcall.ret_type)
+            : channel->CallInline(rfcall, inlined.local.data(),
+                                  inlined.remote.data(), inlined.local.size(),
+                                  &fret, rfcall.ret_type);
+  }
+  ReleaseCallChannel(channel);
+  call_status = EndCallDeadline(deadline, std::move(call_status));
+  end_phase(sample ? &sample->ipc : nullptr);
+  SAPI_RETURN_IF_ERROR(call_status);
+  if (sample) {
+    sample->execution = absl::Nanoseconds(fret.exec_time_ns);
+    sample->ipc =
+        std::max(sample->ipc - sample->execution, absl::ZeroDuration());
+  }
+
+  sync_vars.clear();
+  SAPI_RETURN_IF_ERROR(FinishCall(fret, ret, args, &sync_vars));
+  SAPI_RETURN_IF_ERROR(TransferVarsFromSandboxee(
+      sync_vars, sample ? &sample->bytes_from_sandboxee : nullptr));
+  end_phase(sample ? &sample->unmarshal : nullptr);
+  if (cacheable) {
+    call_cache_.Insert(cache_key, fret);
+  }
+  if (span) {
+    span->SetAttribute(kTraceBytesToSandboxee, sample->bytes_to_sandboxee);
+    span->SetAttribute(kTraceBytesFromSandboxee, sample->bytes_from_sandboxee);
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::BeginCallDeadline(absl::Time deadline) {
+  if (deadline == absl::InfiniteFuture()) {
+    return sapi::OkStatus();
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "The broker sets the limits of brokered sandboxes");
+  }
+  if (absl::Now() >= deadline) {
+    return sapi::DeadlineExceededError("Call deadline passed before the call");
+  }
+  absl::MutexLock lock(&deadlines_mutex_);
+  call_deadlines_.insert(deadline);
+  UpdateWallTimeLimit();
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::EndCallDeadline(absl::Time deadline,
+                                      sapi::Status status) {
+  if (deadline == absl::InfiniteFuture()) {
+    return status;
+  }
+  {
+    absl::MutexLock lock(&deadlines_mutex_);
+    call_deadlines_.erase(call_deadlines_.find(deadline));
+    UpdateWallTimeLimit();
+  }
+  if (status.ok() || absl::Now() < deadline) {
+    return status;
+  }
+  // The monitor killed the sandboxee, or is about to.
+  s2_->Kill();
+  return sapi::DeadlineExceededError(
+      absl::StrCat("Call did not return before its deadline, the sandboxee "
+                   "was killed: ",
+                   status.message()));
+}
+
+void Sandbox::UpdateWallTimeLimit() const {
+  absl::Time deadline = wall_time_deadline_;
+  if (!call_deadlines_.empty()) {
+    deadline = std::min(deadline, *call_deadlines_.begin());
+  }
+  if (deadline == absl::InfiniteFuture()) {
+    s2_->SetWallTimeLimit(absl::ZeroDuration());
+    return;
+  }
+  // Zero would disarm the limit.
+  s2_->SetWallTimeLimit(
+      std::max(deadline - absl::Now(), absl::Milliseconds(1)));
+}
+
+sapi::Status Sandbox::CallBatch(const std::vector<BatchedCall>& calls) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (calls.empty()) {
+    return sapi::OkStatus();
+  }
+  if (!collect_stats_) {
+    return CallBatchInternal(calls, /*sample=*/nullptr, /*exec_times=*/nullptr);
+  }
+  CallSample batch;
+  std::vector<absl::Duration> exec_times(calls.size());
+  const PerfCounterValues counters = ReadPerfCounters();
+  sapi::Status status = CallBatchInternal(calls, &batch, &exec_times);
+  // The calls share all phases but their execution, and their counters.
+  const int64_t n = calls.size();
+  PerfCounterValues counters_per_call = ReadPerfCounters() - counters;
+  counters_per_call /= n;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    CallSample sample;
+    sample.ok = status.ok();
+    sample.marshal = batch.marshal / n;
+    sample.ipc = batch.ipc / n;
+    sample.execution = exec_times[i];
+    sample.unmarshal = batch.unmarshal / n;
+    sample.bytes_to_sandboxee = batch.bytes_to_sandboxee / n;
+    sample.bytes_from_sandboxee = batch.bytes_from_sandboxee / n;
+    sample.counters = counters_per_call;
+    stats_.Record(calls[i].func, sample);
+  }
+  return status;
+}
+
+sapi::StatusOr<size_t> Sandbox::RunPlan(const CallPlan& plan) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  const std::vector<CallPlan::Call>& calls = plan.calls();
+  if (calls.empty()) {
+    return 0;
+  }
+
+  std::vector<FuncCall> rfcalls(calls.size());
+  std::vector<v::Var*> sync_vars;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    rfcalls[i] = FuncCall{};
+    SAPI_RETURN_IF_ERROR(PrepareCall(calls[i].func, calls[i].ret,
+                                     calls[i].args, &rfcalls[i], &sync_vars));
+    absl::SNPrintF(rfcalls[i].func, ABSL_ARRAYSIZE(rfcalls[i].func), "%s",
+                   calls[i].func);
+  }
+  const auto is_integral = [](v::Type type) {
+    return type == v::Type::kInt || type == v::Type::kPointer;
+  };
+  for (const comms::CallPlanLink& link : plan.links()) {
+    if (link.call >= calls.size() || link.source >= link.call ||
+        link.arg >= rfcalls[link.call].argc) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Invalid link to argument ", link.arg, " of call ",
+                       link.call, " from call ", link.source));
+    }
+    if (!is_integral(rfcalls[link.source].ret_type) ||
+        !is_integral(rfcalls[link.call].arg_type[link.arg])) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Only integers and pointers can be passed from call ",
+                       link.source, " to call ", link.call));
+    }
+  }
+  for (const comms::CallPlanStop& stop : plan.stops()) {
+    if (stop.call >= calls.size() ||
+        !is_integral(rfcalls[stop.call].ret_type)) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Call ", stop.call, " cannot have a stop value"));
+    }
+  }
+  SAPI_RETURN_IF_ERROR(TransferVarsToSandboxee(sync_vars));
+  if (track_dirty_pages_) {
+    ClearDirtyPages();
+  }
+
+  std::vector<FuncRet> frets;
+  RPCChannel* channel = AcquireCallChannel();
+  sapi::Status call_status =
+      channel->CallPlan(rfcalls, plan.links(), plan.stops(), &frets);
+  ReleaseCallChannel(channel);
+  if (!call_status.ok() && frets.empty()) {
+    return call_status;
+  }
+
+  // On a failing call, the calls before it still get their results, as their
+  // effects on sandboxee memory have happened.
+  sync_vars.clear();
+  for (size_t i = 0; i < frets.size(); ++i) {
+    SAPI_RETURN_IF_ERROR(
+        FinishCall(frets[i], calls[i].ret, calls[i].args, &sync_vars));
+  }
+  SAPI_RETURN_IF_ERROR(TransferVarsFromSandboxee(sync_vars));
+  SAPI_RETURN_IF_ERROR(call_status);
+  return frets.size();
+}
+
+sapi::Status Sandbox::CallBatchInternal(
+    const std::vector<BatchedCall>& calls, CallSample* sample,
+    std::vector<absl::Duration>* exec_times) {
+  absl::Time start = sample ? absl::Now() : absl::InfinitePast();
+  // Records the time since the end of the previous phase in 'phase'.
+  const auto end_phase = [sample, &start](absl::Duration* phase) {
+    if (sample) {
+      const absl::Time now = absl::Now();
+      *phase = now - start;
+      start = now;
+    }
+  };
+
+  std::vector<FuncCall> rfcalls(calls.size());
+  std::vector<v::Var*> sync_vars;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    rfcalls[i] = FuncCall{};
+    SAPI_RETURN_IF_ERROR(PrepareCall(calls[i].func, calls[i].ret,
+                                     calls[i].args, &rfcalls[i], &sync_vars));
+    absl::SNPrintF(rfcalls[i].func, ABSL_ARRAYSIZE(rfcalls[i].func), "%s",
+                   calls[i].func);
+  }
+  SAPI_RETURN_IF_ERROR(TransferVarsToSandboxee(
+      sync_vars, sample ? &sample->bytes_to_sandboxee : nullptr));
+  if (track_dirty_pages_) {
+    ClearDirtyPages();
+  }
+  end_phase(sample ? &sample->marshal : nullptr);
+
+  std::vector<FuncRet> frets;
+  RPCChannel* channel = AcquireCallChannel();
+  sapi::Status call_status = channel->CallBatch(rfcalls, &frets);
+  ReleaseCallChannel(channel);
+  end_phase(sample ? &sample->ipc : nullptr);
+  if (!call_status.ok() && frets.empty()) {
+    return call_status;
+  }
+  if (sample) {
+    for (size_t i = 0; i < frets.size(); ++i) {
+      (*exec_times)[i] = absl::Nanoseconds(frets[i].exec_time_ns);
+      sample->ipc -= (*exec_times)[i];
+    }
+    sample->ipc = std::max(sample->ipc, absl::ZeroDuration());
+  }
+
+  // On a failing call, the calls before it still get their results, as their
+  // effects on sandboxee memory have happened.
+  sync_vars.clear();
+  for (size_t i = 0; i < frets.size(); ++i) {
+    SAPI_RETURN_IF_ERROR(
+        FinishCall(frets[i], calls[i].ret, calls[i].args, &sync_vars));
+  }
+  SAPI_RETURN_IF_ERROR(TransferVarsFromSandboxee(
+      sync_vars, sample ? &sample->bytes_from_sandboxee : nullptr));
+  end_phase(sample ? &sample->unmarshal : nullptr);
+  return call_status;
+}
+
 sapi::Status Sandbox::Symbol(const char* symname, void** addr) {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
@@ -377,18 +1722,81 @@ sapi::Status Sandbox::Symbol(const char* symname, void** addr) {
   return rpc_channel_->Symbol(symname, addr);
 }
 
+sapi::Status Sandbox::MapBuffer(sandbox2::Buffer* buffer, int prot,
+                               void** addr) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  SAPI_RETURN_IF_ERROR(
+      rpc_channel_->MapSharedBuffer(buffer->fd(), buffer->size(), prot, addr));
+  absl::MutexLock lock(&mapped_buffers_mutex_);
+  mapped_buffers_[reinterpret_cast<uintptr_t>(*addr)] = {
+      reinterpret_cast<uintptr_t>(buffer->data()), buffer->size()};
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::UnmapBuffer(sandbox2::Buffer* buffer) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  uintptr_t remote = 0;
+  {
+    absl::MutexLock lock(&mapped_buffers_mutex_);
+    for (auto it = mapped_buffers_.begin(); it != mapped_buffers_.end();
+         ++it) {
+      if (it->second.local == reinterpret_cast<uintptr_t>(buffer->data())) {
+        remote = it->first;
+        mapped_buffers_.erase(it);
+        break;
+      }
+    }
+  }
+  if (remote == 0) {
+    return sapi::NotFoundError("Buffer is not mapped into the sandboxee");
+  }
+  return rpc_channel_->Free(reinterpret_cast<void*>(remote));
+}
+
+bool Sandbox::IsInMappedBuffer(const v::Var* var) const {
+  const uintptr_t remote = reinterpret_cast<uintptr_t>(var->GetRemote());
+  const size_t size = var->GetSize();
+  absl::MutexLock lock(&mapped_buffers_mutex_);
+  auto it = mapped_buffers_.upper_bound(remote);
+  if (it == mapped_buffers_.begin()) {
+    return false;
+  }
+  --it;
+  const uintptr_t offset = remote - it->first;
+  return size <= it->second.size && offset <= it->second.size - size &&
+         reinterpret_cast<uintptr_t>(var->GetLocal()) ==
+             it->second.local + offset;
+}
+
 sapi::Status Sandbox::TransferToSandboxee(v::Var* var) {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
   }
-  return var->TransferToSandboxee(GetRpcChannel(), GetPid());
+  if (IsInMappedBuffer(var)) {
+    return sapi::OkStatus();
+  }
+  return var->TransferToSandboxee(GetRpcChannel(), GetTransferPid());
+}
+
+sapi::Status Sandbox::TransferToSandboxee(const std::vector<v::Fd*>& fds) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  return v::Fd::TransferAllToSandboxee(GetRpcChannel(), fds);
 }
 
 sapi::Status Sandbox::TransferFromSandboxee(v::Var* var) {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
   }
-  return var->TransferFromSandboxee(GetRpcChannel(), GetPid());
+  if (IsInMappedBuffer(var)) {
+    return sapi::OkStatus();
+  }
+  return var->TransferFromSandboxee(GetRpcChannel(), GetTransferPid());
 }
 
 const sandbox2::Result& Sandbox::AwaitResult() {
@@ -400,13 +1808,218 @@ const sandbox2::Result& Sandbox::AwaitResult() {
 }
 
 sapi::Status Sandbox::SetWallTimeLimit(time_t limit) const {
+  return SetWallTimeLimit(absl::Seconds(limit));
+}
+
+sapi::Status Sandbox::SetWallTimeLimit(absl::Duration limit) const {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "The broker sets the limits of brokered sandboxes");
+  }
+  absl::MutexLock lock(&deadlines_mutex_);
+  wall_time_deadline_ = limit == absl::ZeroDuration() ? absl::InfiniteFuture()
+                                                      : absl::Now() + limit;
+  UpdateWallTimeLimit();
+  return sapi::OkStatus();
+}
+
+sapi::Status Sandbox::StartHeapProfiling(uint64_t sample_bytes) {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (sample_bytes == 0) {
+    return sapi::InvalidArgumentError("Sample distance must not be zero");
+  }
+  return rpc_channel_->SetHeapSampling(sample_bytes);
+}
+
+sapi::Status Sandbox::StopHeapProfiling() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  return rpc_channel_->SetHeapSampling(0);
+}
+
+sapi::StatusOr<std::string> Sandbox::GetHeapProfile() {
   if (!IsActive()) {
     return sapi::UnavailableError("Sandbox not active");
   }
-  s2_->SetWallTimeLimit(limit);
+  std::string profile;
+  SAPI_RETURN_IF_ERROR(rpc_channel_->GetHeapProfile(&profile));
+  return profile;
+}
+
+sapi::StatusOr<uint64_t> Sandbox::GetResidentMemory() const {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "Brokered sandboxees do not run in this process' PID namespace");
+  }
+  const std::string path = absl::StrCat("/proc/", GetPid(), "/statm");
+  std::unique_ptr<FILE, int (*)(FILE*)> statm(fopen(path.c_str(), "re"),
+                                              fclose);
+  if (!statm) {
+    return sapi::UnavailableError(absl::StrCat("Cannot open ", path));
+  }
+  // The second field is the resident set size in pages.
+  unsigned long long size, resident;  // NOLINT(runtime/int)
+  if (fscanf(statm.get(), "%llu %llu", &size, &resident) != 2) {
+    return sapi::UnavailableError(absl::StrCat("Cannot parse ", path));
+  }
+  return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Returns the PID of the child of 'parent' whose PID in the sandboxee's PID
+// namespace is 'ns_pid'.
+static sapi::StatusOr<pid_t> FindChildPid(pid_t parent, pid_t ns_pid) {
+  const std::string path =
+      absl::StrCat("/proc/", parent, "/task/", parent, "/children");
+  std::unique_ptr<FILE, int (*)(FILE*)> children(fopen(path.c_str(), "re"),
+                                                 fclose);
+  if (!children) {
+    return sapi::UnavailableError(absl::StrCat("Cannot open ", path));
+  }
+  int child;
+  while (fscanf(children.get(), "%d", &child) == 1) {
+    const std::string status_path = absl::StrCat("/proc/", child, "/status");
+    std::unique_ptr<FILE, int (*)(FILE*)> status(
+        fopen(status_path.c_str(), "re"), fclose);
+    char line[256];
+    while (status && fgets(line, sizeof(line), status.get())) {
+      if (strncmp(line, "NSpid:", 6) != 0) {
+        continue;
+      }
+      // From the outermost to the innermost PID namespace.
+      std::vector<absl::string_view> pids = absl::StrSplit(
+          line + 6, absl::ByAnyChar(" \t\n"), absl::SkipEmpty());
+      int innermost;
+      if (!pids.empty() && absl::SimpleAtoi(pids.back(), &innermost) &&
+          innermost == ns_pid) {
+        return child;
+      }
+      break;
+    }
+  }
+  return sapi::NotFoundError(
+      absl::StrCat("No child with PID ", ns_pid, " in the sandboxee"));
+}
+
+sapi::Status Sandbox::BeginRequest() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "Brokered sandboxees do not run in this process' PID namespace");
+  }
+  if (!UseRequestCheckpoints()) {
+    return sapi::FailedPreconditionError(
+        "Serving requests from a fork needs UseRequestCheckpoints()");
+  }
+  if (!worker_channels_.empty()) {
+    return sapi::FailedPreconditionError(
+        "Worker threads cannot serve requests from a fork");
+  }
+  if (request_parent_pid_ != -1) {
+    return sapi::FailedPreconditionError("A request is already in progress");
+  }
+  pid_t ns_pid;
+  SAPI_RETURN_IF_ERROR(rpc_channel_->BeginCheckpoint(&ns_pid));
+  sapi::StatusOr<pid_t> pid = FindChildPid(pid_, ns_pid);
+  if (!pid.ok()) {
+    rpc_channel_->EndCheckpoint().IgnoreError();
+    return pid.status();
+  }
+  request_parent_pid_ = pid_;
+  pid_ = pid.ValueOrDie();
+  absl::MutexLock lock(&mapped_buffers_mutex_);
+  request_mapped_buffers_ = mapped_buffers_;
   return sapi::OkStatus();
 }
 
+sapi::Status Sandbox::EndRequest() {
+  if (request_parent_pid_ == -1) {
+    return sapi::FailedPreconditionError("No request in progress");
+  }
+  pid_ = request_parent_pid_;
+  request_parent_pid_ = -1;
+  {
+    // Buffers mapped during the request went with the fork. Those unmapped
+    // during it are unmapped in the sandboxee by the frees sent to it next.
+    absl::MutexLock lock(&mapped_buffers_mutex_);
+    for (auto it = mapped_buffers_.begin(); it != mapped_buffers_.end();) {
+      auto before = request_mapped_buffers_.find(it->first);
+      if (before == request_mapped_buffers_.end() ||
+          before->second.local != it->second.local) {
+        it = mapped_buffers_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    request_mapped_buffers_.clear();
+  }
+  return rpc_channel_->EndCheckpoint();
+}
+
+sapi::Status Sandbox::EnableMemoryMerging() {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "Brokered sandboxees do not run in this process' PID namespace");
+  }
+  // The sandboxee has no /proc to list its mappings.
+  SAPI_ASSIGN_OR_RETURN(auto reader,
+                        sandbox2::ProcMapsReader::OpenForPid(GetPid()));
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  sandbox2::MapsEntryView entry;
+  while (reader->Next(&entry)) {
+    // KSM only merges private anonymous pages, which includes the written
+    // pages of private file mappings.
+    if (entry.is_writable && !entry.is_shared) {
+      ranges.emplace_back(entry.start, entry.end);
+    }
+  }
+  SAPI_RETURN_IF_ERROR(reader->status());
+  return rpc_channel_->EnableMemoryMerging(ranges);
+}
+
+sapi::StatusOr<sandbox2::util::MemoryUsage> Sandbox::GetMemoryUsage() const {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "Brokered sandboxees do not run in this process' PID namespace");
+  }
+  return sandbox2::util::GetMemoryUsage(GetPid());
+}
+
+sapi::StatusOr<sandbox2::util::ResourceUsage> Sandbox::GetResourceUsage()
+    const {
+  if (!IsActive()) {
+    return sapi::UnavailableError("Sandbox not active");
+  }
+  if (!s2_) {
+    return sapi::UnimplementedError(
+        "Brokered sandboxees do not run in this process' PID namespace");
+  }
+  return s2_->GetResourceUsage();
+}
+
+int Sandbox::GetNumaNode() const {
+  if (!IsActive() || !s2_) {
+    return sandbox2::Buffer::kAnyNumaNode;
+  }
+  return sandbox2::util::GetNumaNodeOfAffinity(GetPid());
+}
+
 void Sandbox::Exit() const {
   if (!IsActive()) {
     return;
@@ -15,21 +15,144 @@
 #ifndef SANDBOXED_API_SANDBOX_H_
 #define SANDBOXED_API_SANDBOX_H_
 
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>  // NOLINT(build/c++11)
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "sandboxed_api/file_toc.h"
 #include "absl/base/macros.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "absl/utility/utility.h"
+#include "sandboxed_api/call_cache.h"
+#include "sandboxed_api/call_plan.h"
+#include "sandboxed_api/call_signature.h"
+#include "sandboxed_api/call_stats.h"
+#include "sandboxed_api/perf_counters.h"
 #include "sandboxed_api/rpcchannel.h"
+#include "sandboxed_api/sandbox2/buffer.h"
 #include "sandboxed_api/sandbox2/client.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/metrics.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/policybuilder.h"
 #include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/vars.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
 
 namespace sapi {
+namespace internal {
+
+// Result type of Sandbox::CallScalar(): sapi::StatusOr<T>, or sapi::Status for
+// functions returning void.
+template <typename T>
+struct ScalarResult {
+  using type = sapi::StatusOr<T>;
+
+  // Reads the return value the same way v::Reg<T> does.
+  static type FromRet(const FuncRet& ret) {
+    T value;
+    if (std::is_floating_point<T>::value) {
+      memcpy(&value, &ret.float_val, sizeof(value));
+    } else {
+      memcpy(&value, &ret.int_val, sizeof(value));
+    }
+    return value;
+  }
+};
+
+template <>
+struct ScalarResult<void> {
+  using type = sapi::Status;
+
+  static type FromRet(const FuncRet& /* ret */) { return sapi::OkStatus(); }
+};
+
+// Result of a batch of calls returning T, see Sandbox::CallScalarBatch().
+template <typename T>
+struct ScalarBatchResult {
+  using type = sapi::StatusOr<std::vector<T>>;
+
+  static type FromResults(std::vector<sapi::StatusOr<T>> results) {
+    std::vector<T> values;
+    values.reserve(results.size());
+    for (auto& result : results) {
+      if (!result.ok()) {
+        return result.status();
+      }
+      values.push_back(std::move(result).ValueOrDie());
+    }
+    return values;
+  }
+};
+
+template <>
+struct ScalarBatchResult<void> {
+  using type = sapi::Status;
+
+  static type FromResults(const std::vector<sapi::Status>& results) {
+    for (const auto& result : results) {
+      if (!result.ok()) {
+        return result;
+      }
+    }
+    return sapi::OkStatus();
+  }
+};
+
+}  // namespace internal
+
+class Sandbox;
+
+// Bounds the calls the current thread makes into a sandbox while the object is
+// in scope, including those made by the generated API objects: a call which
+// has not returned at the deadline fails with a DeadlineExceededError, and
+// the sandboxee is killed, as the library may be in any state. Sandboxes from
+// a SandboxPool should thus be marked as failed. Nested deadlines of the same
+// sandbox only ever shorten the outer one. Applies to Call(), CallScalar()
+// and the generated stubs, not to the asynchronous and batched calls.
+//
+// Example:
+//   sapi::ScopedCallDeadline deadline(&sandbox, absl::Milliseconds(50));
+//   SAPI_ASSIGN_OR_RETURN(int result, api.compress(...));
+class ScopedCallDeadline {
+ public:
+  ScopedCallDeadline(const Sandbox* sandbox, absl::Time deadline);
+  ScopedCallDeadline(const Sandbox* sandbox, absl::Duration timeout)
+      : ScopedCallDeadline(sandbox, absl::Now() + timeout) {}
+  ~ScopedCallDeadline();
+
+  ScopedCallDeadline(const ScopedCallDeadline&) = delete;
+  ScopedCallDeadline& operator=(const ScopedCallDeadline&) = delete;
+
+  // Returns the earliest deadline of the current thread for calls into
+  // 'sandbox', absl::InfiniteFuture() if there is none.
+  static absl::Time Get(const Sandbox* sandbox);
+
+ private:
+  const Sandbox* sandbox_;
+  absl::Time deadline_;
+  // The enclosing deadline of the thread, of any sandbox.
+  const ScopedCallDeadline* previous_;
+};
 
 // The Sandbox class represents the sandboxed library. It provides users with
 // means to communicate with it (make function calls, transfer memory).
@@ -43,20 +166,80 @@ class Sandbox {
   virtual ~Sandbox();
 
   // Initializes a new sandboxing session.
-  sapi::Status Init();
+  sapi::Status Init() { return Start(/*reuse_policy=*/false); }
+
+  // Initializes many sandboxes of the same type and configuration at once,
+  // e.g. during service start-up. The first one is initialized as by Init(),
+  // the others share its library forkserver and its policy and start their
+  // sandboxees concurrently. ModifyPolicy() is only called for the first one.
+  // Returns the first error, the sandboxes which could not be initialized
+  // stay inactive. Fails with InvalidArgument, without initializing any of
+  // them, if the sandboxes differ in type or embedded library.
+  static sapi::Status InitMany(absl::Span<Sandbox* const> sandboxes);
+
+  // Attaches to a warm sandboxee from the pool 'pool' of the sandbox broker
+  // listening on 'socket_name', see sapi::SandboxBroker, instead of starting
+  // one. The broker keeps monitoring the sandboxee and replaces it once this
+  // session ends with Terminate(). Memory is transferred over the RPC channel,
+  // see TransferMemoryOverComms(). Worker threads, host callbacks and wall
+  // time limits are not available.
+  sapi::Status InitFromBroker(const std::string& socket_name,
+                              const std::string& pool);
 
   // Is the current sandboxing session alive?
   bool IsActive() const;
 
-  // Terminates the current sandboxing session (if it exists).
+  // Terminates the current sandboxing session (if it exists). Called from a
+  // host callback, it kills the sandboxee without waiting for it to exit.
   void Terminate(bool attempt_graceful_exit = true);
 
   // Restarts the sandbox.
   sapi::Status Restart(bool attempt_graceful_exit) {
+    sandbox2::metrics::IncrementCounter(sandbox2::metrics::kSandboxRestarts);
     Terminate(attempt_graceful_exit);
     return Init();
   }
 
+  // Restarts the sandbox like Restart(), but reuses the policy, including its
+  // mounts, built by the previous Init(), so that only a new sandboxee is
+  // forked from the running forkserver. ModifyPolicy() is not called again.
+  sapi::Status Reset(bool attempt_graceful_exit) {
+    sandbox2::metrics::IncrementCounter(sandbox2::metrics::kSandboxRestarts);
+    Terminate(attempt_graceful_exit);
+    return Start(/*reuse_policy=*/true);
+  }
+
+  // Serves the following requests from a copy-on-write fork of the sandboxee,
+  // taken now, until EndRequest() discards it and the sandboxee continues in
+  // the state it had before. Requests, e.g. of different tenants, thus cannot
+  // see each other's state, for the cost of a fork() instead of a Reset(). If
+  // the fork crashes, the call fails and the request ends, the sandboxee
+  // lives on. Meanwhile GetPid() returns the PID of the fork. Variables
+  // allocated and buffers mapped during the request must not be used after
+  // it, see RPCChannel::BeginCheckpoint(). Needs UseRequestCheckpoints(), not
+  // available with worker threads, the shared memory transport or
+  // InitFromBroker(), and must not be called concurrently with calls.
+  sapi::Status BeginRequest();
+  sapi::Status EndRequest();
+
+  // Durations of the phases of the most recent Init().
+  struct InitTimes {
+    // Starting the library forkserver, zero if it was already running.
+    absl::Duration forkserver;
+    // Building the policy and the executor.
+    absl::Duration policy;
+    // Starting the sandboxee until the end of its set-up, see
+    // 'sandboxee_phases' for the details.
+    absl::Duration sandboxee;
+    // Setting up transports, worker threads and preloaded symbols.
+    absl::Duration channels;
+    // Pre-faulting pages and WarmUp().
+    absl::Duration warm_up;
+    // Start-up phases of the sandboxee.
+    sandbox2::Result::StartupTimes sandboxee_phases;
+  };
+  const InitTimes& GetInitTimes() const { return init_times_; }
+
   // Getters for common fields.
   sandbox2::Comms* comms() const { return comms_; }
 
@@ -70,7 +253,9 @@ class Sandbox {
   // Synchronizes the underlying memory for pointer after the call.
   sapi::Status SynchronizePtrAfter(v::Callable* ptr) const;
 
-  // Makes a call to the sandboxee.
+  // Makes a call to the sandboxee. Calls from different threads run
+  // concurrently if the sandboxee has worker threads, see
+  // GetNumWorkerThreads().
   template <typename... Args>
   sapi::Status Call(const std::string& func, v::Callable* ret, Args&&... args) {
     static_assert(sizeof...(Args) <= FuncCall::kArgsMax,
@@ -80,6 +265,158 @@ class Sandbox {
   sapi::Status Call(const std::string& func, v::Callable* ret,
                     std::initializer_list<v::Callable*> args);
 
+  // Same as above, failing with a DeadlineExceededError if the call does not
+  // return within 'timeout', see ScopedCallDeadline.
+  template <typename... Args>
+  sapi::Status Call(absl::Duration timeout, const std::string& func,
+                    v::Callable* ret, Args&&... args) {
+    ScopedCallDeadline deadline(this, timeout);
+    return Call(func, ret, std::forward<Args>(args)...);
+  }
+
+  // Same as above, for the function at 'index' in 'table', as done by the
+  // stubs emitted by the code generator. The functions of the table are looked
+  // up once per sandboxee, calls then neither copy nor send the name.
+  template <typename... Args>
+  sapi::Status Call(const FunctionTable& table, size_t index, v::Callable* ret,
+                    Args&&... args) {
+    static_assert(sizeof...(Args) <= FuncCall::kArgsMax,
+                  "Too many arguments to sapi::Sandbox::Call()");
+    return Call(table, index, ret, {std::forward<Args>(args)...});
+  }
+  sapi::Status Call(const FunctionTable& table, size_t index, v::Callable* ret,
+                    std::initializer_list<v::Callable*> args);
+
+  // Calls a function taking only scalar arguments, described at compile time
+  // by 'sig' (see MakeCallSignature()). This is what the stubs emitted by the
+  // code generator use: the arguments are marshalled straight into the
+  // request, without v::Var objects or a lookup of the function by name.
+  // R and Args have to match the types 'sig' was made from.
+  template <typename R, typename... Args>
+  typename internal::ScalarResult<R>::type CallScalar(const CallSignature& sig,
+                                                      Args... args) {
+    static_assert(sizeof...(Args) <= FuncCall::kArgsMax,
+                  "Too many arguments to sapi::Sandbox::CallScalar()");
+    // One more element, as arrays must not be empty.
+    const FuncArg values[sizeof...(Args) + 1] = {
+        internal::MarshalScalar(args)...};
+    FuncRet ret;
+    SAPI_RETURN_IF_ERROR(CallScalarInternal(sig, values, &ret));
+    return internal::ScalarResult<R>::FromRet(ret);
+  }
+
+  // Like CallScalar(), but does not wait for the result. The calls are sent on
+  // the main channel and executed in the order in which they were made, while
+  // the caller goes on. Every returned future has to be waited on eventually,
+  // and the number of calls in flight should stay bounded, as the replies
+  // queue up until then. Not recorded in the call statistics.
+  template <typename R, typename... Args>
+  std::future<typename internal::ScalarResult<R>::type> CallScalarAsync(
+      const CallSignature& sig, Args... args) {
+    static_assert(sizeof...(Args) <= FuncCall::kArgsMax,
+                  "Too many arguments to sapi::Sandbox::CallScalarAsync()");
+    const FuncArg values[sizeof...(Args) + 1] = {
+        internal::MarshalScalar(args)...};
+    return std::async(
+        std::launch::deferred,
+        [](std::future<sapi::StatusOr<FuncRet>> ret)
+            -> typename internal::ScalarResult<R>::type {
+          sapi::StatusOr<FuncRet> ret_or = ret.get();
+          if (!ret_or.ok()) {
+            return ret_or.status();
+          }
+          return internal::ScalarResult<R>::FromRet(ret_or.ValueOrDie());
+        },
+        CallScalarAsyncInternal(sig, values));
+  }
+
+  // Like CallScalarAsync(), but runs 'done' with the result instead of
+  // returning a future, so that no thread blocks while the call executes. For
+  // event loops and coroutine frameworks: register GetReadinessFd() with the
+  // loop and call ProcessReplies() whenever it becomes readable, which runs
+  // the callbacks of the completed calls on that thread. An awaitable resumes
+  // its coroutine from 'done'. Not available with the shared memory
+  // transport, see UseSharedMemoryTransport().
+  template <typename R, typename... Args>
+  sapi::Status CallScalarWithCallback(
+      const CallSignature& sig,
+      std::function<void(typename internal::ScalarResult<R>::type)> done,
+      Args... args) {
+    static_assert(
+        sizeof...(Args) <= FuncCall::kArgsMax,
+        "Too many arguments to sapi::Sandbox::CallScalarWithCallback()");
+    const FuncArg values[sizeof...(Args) + 1] = {
+        internal::MarshalScalar(args)...};
+    return CallScalarWithCallbackInternal(
+        sig, values, [done](sapi::StatusOr<FuncRet> ret) {
+          if (!ret.ok()) {
+            done(ret.status());
+            return;
+          }
+          done(internal::ScalarResult<R>::FromRet(ret.ValueOrDie()));
+        });
+  }
+
+  // Returns a file descriptor which becomes readable when results of
+  // CallScalarWithCallback() arrive, -1 if the sandbox is not active.
+  int GetReadinessFd() const;
+  // Runs the callbacks of the calls made by CallScalarWithCallback() whose
+  // results arrived, without blocking. See RPCChannel::ProcessReplies().
+  sapi::Status ProcessReplies();
+
+  // Calls a function taking only scalar arguments once per element of 'args',
+  // pipelining the calls with CallScalarAsync(). All calls are made, the
+  // result is the first failure or the results of all calls in order. R and
+  // Args have to be given explicitly, like for CallScalar().
+  template <typename R, typename... Args>
+  typename internal::ScalarBatchResult<R>::type CallScalarBatch(
+      const CallSignature& sig,
+      absl::Span<const std::tuple<typename std::decay<Args>::type...>> args) {
+    // Bounds the replies queued up in the sandboxee's socket buffer.
+    constexpr size_t kMaxInFlight = 256;
+    std::vector<typename internal::ScalarResult<R>::type> results;
+    results.reserve(args.size());
+    std::vector<std::future<typename internal::ScalarResult<R>::type>> pending;
+    pending.reserve(args.size());
+    for (const auto& call_args : args) {
+      if (pending.size() - results.size() == kMaxInFlight) {
+        results.push_back(pending[results.size()].get());
+      }
+      pending.push_back(absl::apply(
+          [this, &sig](Args... values) {
+            return CallScalarAsync<R, Args...>(sig, values...);
+          },
+          call_args));
+    }
+    while (results.size() < pending.size()) {
+      results.push_back(pending[results.size()].get());
+    }
+    return internal::ScalarBatchResult<R>::FromResults(std::move(results));
+  }
+
+  // A single function call, as used by CallBatch().
+  struct BatchedCall {
+    std::string func;
+    v::Callable* ret;
+    std::vector<v::Callable*> args;
+  };
+
+  // Makes several calls to the sandboxee in a single round-trip. The calls are
+  // executed in order and the batch stops at the first failing call. Pointers
+  // are synchronized before the first and after the last call of the batch, so
+  // calls within a batch only observe each other's effects through sandboxee
+  // memory. If a call fails, the calls before it are still synchronized before
+  // the error is returned.
+  sapi::Status CallBatch(const std::vector<BatchedCall>& calls);
+
+  // Makes the calls of 'plan' in a single round-trip, passing return values
+  // on to later calls in the sandboxee, see sapi::CallPlan. Returns the number
+  // of calls that ran, fewer than planned if a stop value matched. Only the
+  // calls that ran get their return values and pointers synchronized. If a
+  // call fails, the calls before it are still synchronized before the error
+  // is returned.
+  sapi::StatusOr<size_t> RunPlan(const CallPlan& plan);
+
   // Allocates memory in the sandboxee, automatic_free indicates whether the
   // memory should be freed on the remote side when the 'var' goes out of scope.
   sapi::Status Allocate(v::Var* var, bool automatic_free = false);
@@ -87,19 +424,140 @@ class Sandbox {
   // Frees memory in the sandboxee.
   sapi::Status Free(v::Var* var);
 
-  // Finds address of a symbol in the sandboxee.
+  // Sends the frees of all variables which went out of scope with
+  // automatic_free set. These are otherwise sent along with the next request.
+  sapi::Status FlushFrees();
+
+  // Releases all memory allocated from the arena (see GetArenaSize()), e.g.
+  // at the end of a request. Variables allocated from the arena must not be
+  // used afterwards, but may still be freed or destroyed.
+  void ResetArena();
+
+  // Serves all allocations in the sandboxee from a region of up to 'capacity'
+  // bytes until EndRegion(), e.g. for the variables of a single request. The
+  // sandboxee's heap is not used, so it does not fragment over the lifetime of
+  // the sandbox. The first call reserves the address space, later ones must
+  // not ask for more.
+  sapi::Status BeginRegion(size_t capacity);
+
+  // Gives the memory of all allocations made since BeginRegion() back to the
+  // kernel at once. Variables allocated in the region must not outlive it, as
+  // their contents are gone and later regions reuse their memory. The
+  // sandboxee rejects reallocations of such memory unless a later region has
+  // an allocation at the same address. Freeing or destroying them is harmless.
+  sapi::Status EndRegion();
+
+  // Finds address of a symbol in the sandboxee. Addresses are cached until the
+  // sandboxee is restarted, see also GetPreloadedSymbols().
   sapi::Status Symbol(const char* symname, void** addr);
 
+  // Maps 'buffer' into the sandboxee with the protection 'prot', PROT_READ or
+  // PROT_READ | PROT_WRITE, and returns its address there in 'addr'. Variables
+  // whose local storage lies in the buffer and whose remote storage lies at
+  // the same offset in the mapping are never transferred, e.g. a v::Array
+  // over buffer->data() with its remote address set to 'addr'. With
+  // PROT_READ, the sandboxee only gets a read-only descriptor of the buffer
+  // and cannot write to it. The mapping lasts until UnmapBuffer() or a
+  // restart of the sandboxee, the buffer has to outlive it. Needs
+  // UseSharedBuffers().
+  sapi::Status MapBuffer(sandbox2::Buffer* buffer, int prot, void** addr);
+
+  // Removes the mapping of 'buffer' created by MapBuffer().
+  sapi::Status UnmapBuffer(sandbox2::Buffer* buffer);
+
   // Transfers memory (both directions). Status is returned (memory transfer
   // succeeded/failed).
   sapi::Status TransferToSandboxee(v::Var* var);
   sapi::Status TransferFromSandboxee(v::Var* var);
 
+  // Transfers several file descriptors to the sandboxee in a single
+  // round-trip.
+  sapi::Status TransferToSandboxee(const std::vector<v::Fd*>& fds);
+
+  // Host function run for sapi::CallHost() from the sandboxee, see
+  // sandboxed_api/host_callback.h. Stores its result in 'response', or returns
+  // an error which CallHost() returns. The request comes from the untrusted
+  // sandboxee and has to be validated like any other output of it.
+  using HostCallback = std::function<sapi::Status(
+      absl::Span<const uint8_t> request, std::vector<uint8_t>* response)>;
+
+  // Registers 'callback' under 'id', replacing a previous one. If callbacks
+  // are registered, Init() sets up a channel for them, served by a host thread
+  // while the sandboxee runs. Callbacks thus run concurrently with the call
+  // they were made from, and must not call into this sandbox unless it has
+  // worker threads. They may call Terminate() to abort that call.
+  void RegisterHostCallback(uint32_t id, HostCallback callback);
+
   // Waits until the sandbox terminated and returns the result.
   const sandbox2::Result& AwaitResult();
+  // Makes the sandboxees started by later calls to Init() report their result
+  // to 'on_done' when they finish, see sandbox2::Sandbox2::RunAsync(), so that
+  // no thread has to wait in AwaitResult() to learn about it. If 'executor'
+  // is set, the callback runs there instead of on the monitor thread and may
+  // block or call Terminate(). Not available with InitFromBroker().
+  void SetDoneCallback(sandbox2::Sandbox2::DoneCallback on_done,
+                       sandbox2::Sandbox2::CompletionExecutor executor = {}) {
+    done_callback_ = std::move(on_done);
+    completion_executor_ = std::move(executor);
+  }
   const sandbox2::Result& result() const { return result_; }
 
   sapi::Status SetWallTimeLimit(time_t limit) const;
+  // Same as above, with millisecond granularity. Zero disarms the limit, the
+  // deadlines of calls in flight still apply.
+  sapi::Status SetWallTimeLimit(absl::Duration limit) const;
+
+  // Makes the sandboxee sample its allocations, on average one every
+  // 'sample_bytes' allocated bytes, until StopHeapProfiling(). The sandboxee
+  // has to be built with heap profiling, see heap_profiler.h.
+  sapi::Status StartHeapProfiling(uint64_t sample_bytes = 512 << 10);
+  sapi::Status StopHeapProfiling();
+
+  // Returns a heap profile of the sampled allocations which are still live,
+  // in the legacy text format of pprof (e.g. "pprof --text <sandboxee binary>
+  // <profile>"). Works while sampling continues.
+  sapi::StatusOr<std::string> GetHeapProfile();
+
+  // Returns the resident memory of the sandboxee in bytes, as reported by
+  // /proc/<pid>/statm. Used by SandboxPool to recycle sandboxees which leak.
+  sapi::StatusOr<uint64_t> GetResidentMemory() const;
+
+  // Returns the memory of the sandboxee, split into pages it shares with other
+  // processes and private ones, e.g. to see what MergeIdenticalPages() saves
+  // across a pool.
+  sapi::StatusOr<sandbox2::util::MemoryUsage> GetMemoryUsage() const;
+
+  // Lets the kernel merge the pages of the sandboxee with identical pages of
+  // other processes, see MergeIdenticalPages(), which calls it at the end of
+  // Init(). Unless the sandboxee may enable merging for the whole process,
+  // the private writable mappings listed in /proc/<pid>/maps are marked, so
+  // later mappings are not merged.
+  sapi::Status EnableMemoryMerging();
+
+  // Returns the CPU time, RSS, context switches and I/O of the sandboxee so
+  // far, see sandbox2::Sandbox2::GetResourceUsage(). Cheap enough to be
+  // polled, e.g. by a scheduler placing work on sandboxes.
+  sapi::StatusOr<sandbox2::util::ResourceUsage> GetResourceUsage() const;
+
+  // Returns the NUMA node the sandboxee runs on, going by its CPU affinity
+  // (see sandbox2::Executor::set_cpu_placement()), for the
+  // sandbox2::Buffer::Options::numa_node of buffers it consumes. The shared
+  // memory transport is allocated there. sandbox2::Buffer::kAnyNumaNode if
+  // the sandboxee may run on several nodes.
+  int GetNumaNode() const;
+
+  // Returns the statistics of all calls made so far, by function. Empty unless
+  // CollectStats() returns true. Statistics are kept across restarts.
+  CallStatsMap GetStats() const { return stats_.GetSnapshot(); }
+
+  // Sets an exporter which receives every call recorded in the statistics.
+  void SetStatsExporter(std::unique_ptr<CallStatsExporter> exporter) {
+    stats_.SetExporter(std::move(exporter));
+  }
+
+  // Returns the cache of the functions listed by GetCachedFunctions(), e.g. to
+  // read its hit rate.
+  const CallCache& call_cache() const { return call_cache_; }
 
  protected:
 
@@ -108,6 +566,161 @@ class Sandbox {
     args->push_back("--logtostderr=true");
   }
 
+  // Returns the name of a function (taking no arguments and returning void)
+  // which the library forkserver runs once, before it spawns the first
+  // sandboxee. All sandboxees of this object, including those started by
+  // Restart(), are then forked from the initialized forkserver and share its
+  // pages copy-on-write, so expensive one-time setup is paid only once.
+  // The function runs outside of the sandbox policy: it must only process
+  // trusted data (e.g. load bundled dictionaries) and must not leave any
+  // threads behind.
+  virtual std::string GetTemplateInitFunction() const { return ""; }
+
+  // Returns whether requests to the sandboxee should be passed through shared
+  // memory instead of the Comms channel. The policy is extended to allow the
+  // sandboxee to map the shared region, custom policies not based on the
+  // default policy builder need to allow shared read/write mmap()s and the
+  // FUTEX_WAIT and FUTEX_WAKE operations (see PolicyBuilder::AllowFutexOp()).
+  virtual bool UseSharedMemoryTransport() const { return false; }
+
+  // Returns whether the sandboxee may map buffers shared with the host, which
+  // v::SharedArray, MapBuffer(), RPCChannel::ShareBuffers() and
+  // SandboxPool::AddSharedData() need. Adds shared mmap()s of the descriptors
+  // the host sends, read-only or read/write, to the policy, so off by default.
+  // Custom policies not based on the default policy builder need to allow
+  // them.
+  virtual bool UseSharedBuffers() const { return false; }
+
+  // Returns how long both sides of the shared memory transport busy-wait for
+  // the next message before they go to sleep on the futex doorbell, capped at
+  // SharedMemoryTransport::kMaxSpinDuration. Spinning saves the wake-up
+  // latency of short calls at the cost of a busy CPU on each side.
+  virtual absl::Duration GetSharedMemorySpinDuration() const {
+    return absl::ZeroDuration();
+  }
+
+  // Returns whether synchronizing pointers after a call only copies back the
+  // pages the sandboxee modified since the call started, as reported by the
+  // kernel's soft-dirty page tracking. Unmodified pages keep their local
+  // contents. Falls back to full copies if the kernel lacks soft-dirty
+  // support.
+  virtual bool TrackDirtyPages() const { return false; }
+
+  // Returns whether variables are copied to and from the sandboxee over the
+  // RPC channel instead of with process_vm_writev() and process_vm_readv().
+  // Slower, but works when the sandboxee is not a process on this host, e.g.
+  // when its Comms channel is a TCP or vsock connection to another machine.
+  // Disables TrackDirtyPages().
+  virtual bool TransferMemoryOverComms() const { return false; }
+
+  // Returns the size up to which variables synchronized before a call are sent
+  // inside the call request, where the sandboxee writes them into place,
+  // instead of being copied with a transfer of their own. At most 4 KiB are
+  // inlined per call, larger variables share a single process_vm_writev().
+  // 0 disables inlining. See CallStats::bytes_inlined.
+  virtual size_t GetInlineTransferThreshold() const { return 256; }
+
+  // Returns the size of a memory arena allocated in the sandboxee during
+  // Init(), or 0 to disable it. Variables are then allocated from the arena
+  // without a round-trip, and released all at once with ResetArena().
+  virtual size_t GetArenaSize() const { return 0; }
+
+  // Returns the number of threads in the sandboxee which serve function calls,
+  // each on its own Comms channel. Up to that many calls from different host
+  // threads then execute concurrently, so the library must be thread-safe.
+  // Other requests (memory management, file descriptors) and the shared memory
+  // transport stay on the main channel. With 0, calls are served one at a time
+  // by the sandboxee's main thread. Worker threads disable dirty page
+  // tracking. Custom policies not based on the default policy builder need to
+  // allow the sandboxee to create threads.
+  virtual int GetNumWorkerThreads() const { return 0; }
+
+  // Returns symbols which are looked up in a single round-trip during Init(),
+  // e.g. functions whose addresses are passed as callbacks. Symbol() and calls
+  // then need no lookup of their own.
+  virtual std::vector<std::string> GetPreloadedSymbols() const { return {}; }
+
+  // Returns whether Init() makes the sandboxee fault in the code and read-only
+  // data of the library and its dependencies, so that the first calls do not
+  // page them in one fault at a time. Custom policies not based on the
+  // default policy builder need to allow madvise(MADV_WILLNEED).
+  virtual bool PrefaultLibraryPages() const { return false; }
+
+  // Returns whether the sandboxee may slide windows over buffers too large to
+  // map at once, see RPCChannel::MapSharedBufferWindow(). Implies
+  // UseSharedBuffers(), and allows it to replace a shared mapping in place
+  // (MAP_FIXED) and madvise(MADV_WILLNEED). Custom policies not based on the
+  // default policy builder need to allow both.
+  virtual bool MapBufferWindows() const { return false; }
+
+  // Returns whether the dynamic loader of the sandboxee resolves all symbols
+  // at start-up (LD_BIND_NOW) instead of on their first call. The library
+  // forkserver pays for this once, its sandboxees inherit the bound symbols.
+  virtual bool BindSymbolsAtStartup() const { return false; }
+
+  // Returns whether the library forkserver moves the code of the library onto
+  // transparent huge pages before it spawns the first sandboxee, see
+  // sandbox2::ForkingClient::RemapTextOnHugePages(). Saves iTLB misses of
+  // large libraries, like codecs or ML runtimes. The sandboxees inherit the
+  // huge pages, the policy needs no additional syscalls.
+  virtual bool RemapTextOnHugePages() const { return false; }
+
+  // Returns whether the sandboxee lets the kernel merge its pages with
+  // identical pages of other sandboxees (KSM) at the end of Init(), after
+  // WarmUp(), so that the tables every instance of the library builds at
+  // initialization are kept once. Trades CPU time of the kernel's ksmd for
+  // the memory of a pool of sandboxes, and only saves memory while KSM runs
+  // on the host, see sandbox2::Client::EnableMemoryMerging(). Compare
+  // GetMemoryUsage() with and without.
+  virtual bool MergeIdenticalPages() const { return false; }
+
+  // Returns whether the sandboxee may map memory whose pages the host copies
+  // in on first access, which sapi::v::LazyArray needs. Adds
+  // sandbox2::PolicyBuilder::AllowUserfaultfd() to the policy, so off by
+  // default: userfaultfds are a common means to widen races in the kernel.
+  // The sandboxee requests UFFD_USER_MODE_ONLY where the kernel supports it.
+  virtual bool UseLazyPaging() const { return false; }
+
+  // Returns whether the sandboxee may fork the children which serve the
+  // requests between BeginRequest() and EndRequest(). Adds
+  // sandbox2::PolicyBuilder::AllowFork() and AllowWait() to the policy.
+  virtual bool UseRequestCheckpoints() const { return false; }
+
+  // Runs at the end of Init(), before the sandboxee serves any other request,
+  // e.g. to call the library's functions with canned arguments so that
+  // allocator arenas and caches are warm. Calls made here count towards
+  // neither GetStats() nor GetInitTimes().channels. An error fails Init().
+  virtual sapi::Status WarmUp() { return sapi::OkStatus(); }
+
+  // Returns whether per-function call statistics are collected, see
+  // GetStats(). The calls of a CallBatch() share their marshalling, IPC and
+  // unmarshalling time, which is split evenly among them.
+  virtual bool CollectStats() const { return false; }
+
+  // Returns whether the statistics include performance counters (cycles,
+  // instructions, cache misses, context switches and page faults) of the
+  // sandboxee's threads, read around each call, see CallStats::counters.
+  // Needs CollectStats(). The host opens the counters with perf_event_open()
+  // during Init(), so the policy stays unchanged, but the kernel has to allow
+  // it (see perf_event_paranoid). Threads the library starts later are not
+  // counted, and calls made concurrently from several host threads count each
+  // other's events.
+  virtual bool CollectPerfCounters() const { return false; }
+
+  // Returns pure functions whose results are cached on the host: a call with
+  // the same arguments as a cached one returns its result without a
+  // round-trip to the sandboxee. Scalar arguments are compared by value,
+  // pointers by the contents of the pointed-to variables, which thus have to
+  // be synchronized before the call only (v::Var::PtrBefore()) and must not be
+  // larger than CallCache::kMaxPointedBytes. Calls with other pointers or with
+  // file descriptors are never cached. The functions must not depend on or
+  // modify any state of the sandboxee. Init() discards all cached results.
+  virtual std::vector<std::string> GetCachedFunctions() const { return {}; }
+
+  // Returns the number of results kept by the cache of GetCachedFunctions(),
+  // the least recently used ones are evicted first.
+  virtual size_t GetCallCacheSize() const { return 1024; }
+
  private:
   // Returns the sandbox policy. Subclasses can modify the default policy
   // builder, or return a completely new policy.
@@ -129,12 +742,164 @@ class Sandbox {
   // Exits the sandboxee.
   void Exit() const;
 
-  // The client to the library forkserver.
-  std::unique_ptr<sandbox2::ForkClient> fork_client_;
-  std::unique_ptr<sandbox2::Executor> forkserver_executor_;
+  // Non-template parts of CallScalar() and CallScalarAsync().
+  sapi::Status CallScalarInternal(const CallSignature& sig,
+                                  const FuncArg* args, FuncRet* ret);
+  std::future<sapi::StatusOr<FuncRet>> CallScalarAsyncInternal(
+      const CallSignature& sig, const FuncArg* args);
+  sapi::Status CallScalarWithCallbackInternal(const CallSignature& sig,
+                                              const FuncArg* args,
+                                              RPCChannel::CallDone done);
+
+  // Implementations of Call() and CallBatch(). If 'sample' is not nullptr,
+  // the durations of the call phases and the number of synchronized bytes are
+  // recorded there, for a batch together with the execution time of each call
+  // in 'exec_times'.
+  // Call() by index passes its 'table', which is nullptr otherwise.
+  sapi::Status CallInternal(const std::string& func,
+                            const FunctionTable* table, size_t index,
+                            v::Callable* ret,
+                            std::initializer_list<v::Callable*> args,
+                            CallSample* sample);
+  sapi::Status CallBatchInternal(const std::vector<BatchedCall>& calls,
+                                 CallSample* sample,
+                                 std::vector<absl::Duration>* exec_times);
+
+  // Returns the performance counters of the sandboxee so far, all zero unless
+  // CollectPerfCounters() is enabled.
+  PerfCounterValues ReadPerfCounters() const {
+    return perf_counters_ ? perf_counters_->Read() : PerfCounterValues();
+  }
+
+  // Makes the monitor kill the sandboxee at 'deadline' unless
+  // EndCallDeadline() comes first, see ScopedCallDeadline. Does nothing for
+  // absl::InfiniteFuture().
+  sapi::Status BeginCallDeadline(absl::Time deadline);
+  // Returns 'status', or a DeadlineExceededError if the call failed because
+  // its deadline passed.
+  sapi::Status EndCallDeadline(absl::Time deadline, sapi::Status status);
+  // Arms the wall time limit of s2_ for the earliest deadline.
+  void UpdateWallTimeLimit() const EXCLUSIVE_LOCKS_REQUIRED(deadlines_mutex_);
+
+  // Fills in the call description for a function call, except for the name
+  // or handle of the function. Appends the variables which have to be
+  // synchronized before the call to 'sync_before'.
+  template <typename Container>
+  sapi::Status PrepareCall(absl::string_view func, v::Callable* ret,
+                           const Container& args, FuncCall* rfcall,
+                           std::vector<v::Var*>* sync_before);
+
+  // Stores the result of a function call in 'ret'. Appends the variables which
+  // have to be synchronized after the call to 'sync_after'.
+  template <typename Container>
+  sapi::Status FinishCall(const FuncRet& fret, v::Callable* ret,
+                          const Container& args,
+                          std::vector<v::Var*>* sync_after);
+
+  // Allocates the memory behind 'ptr' if needed and appends the pointed-to
+  // variable to 'vars' if it is synchronized before calls.
+  sapi::Status PreparePtrBefore(v::Callable* ptr, std::vector<v::Var*>* vars);
+
+  // Appends the variable pointed to by 'ptr' to 'vars' if it is synchronized
+  // after calls.
+  sapi::Status PreparePtrAfter(v::Callable* ptr,
+                               std::vector<v::Var*>* vars) const;
+
+  // Regions of small variables sent inside a call request, see
+  // GetInlineTransferThreshold().
+  struct InlineRegions {
+    std::vector<iovec> local;
+    std::vector<iovec> remote;
+    uint64_t size = 0;
+  };
+
+  // Transfers several variables at once, with a single process_vm_writev() or
+  // process_vm_readv() for all variables backed by plain memory regions. Adds
+  // the number of transferred bytes to 'bytes' if it is not nullptr. If
+  // 'inlined' is not nullptr, the regions of variables up to the inline
+  // threshold are added to it instead of being transferred.
+  sapi::Status TransferVarsToSandboxee(const std::vector<v::Var*>& vars,
+                                       uint64_t* bytes = nullptr,
+                                       InlineRegions* inlined = nullptr) const;
+  sapi::Status TransferVarsFromSandboxee(const std::vector<v::Var*>& vars,
+                                         uint64_t* bytes = nullptr) const;
+
+  // Returns the 'pid' passed to the transfer functions of the variables.
+  pid_t GetTransferPid() const {
+    return transfer_over_comms_ ? v::kTransferOverComms : GetPid();
+  }
+
+  // Copies memory regions to or from the sandboxee.
+  sapi::Status TransferRegions(bool to_sandboxee,
+                               const std::vector<iovec>& local,
+                               const std::vector<iovec>& remote) const;
+
+  // Points fork_client_ at the library forkserver shared by all sandboxes of
+  // the same library, arguments and environment, starting it if needed.
+  sapi::Status AcquireForkServer();
+
+  // Implements Init(), building a new policy unless 'reuse_policy' is set and
+  // there is one from a previous call.
+  sapi::Status Start(bool reuse_policy);
+
+  // Sets up the channels of a freshly started sandboxee and warms it up, as
+  // part of Start(). 'next_phase' returns the duration of each phase of
+  // init_times_.
+  sapi::Status SetUpSandboxee(
+      const std::function<absl::Duration()>& next_phase);
+
+  // Passes a new Comms channel for each of 'num_threads' worker threads to the
+  // sandboxee.
+  sapi::Status StartWorkerThreads(int num_threads);
+
+  // Returns an idle worker channel, waiting for one if all are busy, or the
+  // main channel if there are no worker threads. A thread gets the channel it
+  // released last whenever that one is idle.
+  RPCChannel* AcquireCallChannel();
+
+  // Sets up the host callback channel and starts serving it.
+  sapi::Status StartHostCallbacks();
+
+  // Waits until the host callback thread finished, i.e. the sandboxee exited.
+  void StopHostCallbacks();
+
+  // Body of the host callback thread.
+  void ServeHostCallbacks(sandbox2::Comms* comms);
+
+  // Returns a channel obtained from AcquireCallChannel().
+  void ReleaseCallChannel(RPCChannel* channel);
+
+  // Resets the soft-dirty bits of all pages of the sandboxee. Disables dirty
+  // page tracking if that fails.
+  void ClearDirtyPages();
+
+  // Returns whether the storage of 'var' lies in a buffer mapped by
+  // MapBuffer(), i.e. is shared and needs no transfers.
+  bool IsInMappedBuffer(const v::Var* var) const;
+
+  // Restricts the regions to the pages which were modified since the last
+  // ClearDirtyPages(). Regions whose state cannot be read are kept whole.
+  void FilterDirtyRegions(std::vector<iovec>* local,
+                          std::vector<iovec>* remote) const;
+
+  // The client to the library forkserver, shared by all sandboxes of the same
+  // library, see AcquireForkServer().
+  std::shared_ptr<sandbox2::ForkClient> fork_client_;
+  std::shared_ptr<sandbox2::Executor> forkserver_executor_;
+
+  // Policy of the most recent Init(), shared with s2_ and reused by Reset().
+  std::shared_ptr<sandbox2::Policy> policy_;
 
   // The main sandbox2::Sandbox2 object.
   std::unique_ptr<sandbox2::Sandbox2> s2_;
+  // The connection to the broker which handed out the sandboxee and the
+  // sandboxee's Comms channel, set instead of s2_ by InitFromBroker().
+  std::unique_ptr<sandbox2::Comms> broker_comms_;
+  std::unique_ptr<sandbox2::Comms> brokered_comms_;
+
+  // See SetDoneCallback().
+  sandbox2::Sandbox2::DoneCallback done_callback_;
+  sandbox2::Sandbox2::CompletionExecutor completion_executor_;
 
   // Result of the most recent sandbox execution
   sandbox2::Result result_;
@@ -145,6 +910,53 @@ class Sandbox {
   std::unique_ptr<RPCChannel> rpc_channel_;
   // The main pid of the sandboxee.
   pid_t pid_;
+  // The main pid while a request is served by a fork of it, see
+  // BeginRequest(), -1 otherwise.
+  pid_t request_parent_pid_ = -1;
+  // Channels served by the sandboxee's worker threads.
+  std::vector<std::unique_ptr<sandbox2::Comms>> worker_comms_;
+  std::vector<std::unique_ptr<RPCChannel>> worker_channels_;
+  absl::Mutex channels_mutex_;
+  std::vector<RPCChannel*> idle_channels_ GUARDED_BY(channels_mutex_);
+  // Host callbacks, see RegisterHostCallback().
+  absl::Mutex host_callbacks_mutex_;
+  absl::flat_hash_map<uint32_t, HostCallback> host_callbacks_
+      GUARDED_BY(host_callbacks_mutex_);
+  std::unique_ptr<sandbox2::Comms> host_call_comms_;
+  std::thread host_call_thread_;
+  struct MappedBuffer {
+    uintptr_t local;
+    size_t size;
+  };
+  mutable absl::Mutex mapped_buffers_mutex_;
+  // Buffers mapped by MapBuffer(), by their address in the sandboxee.
+  std::map<uintptr_t, MappedBuffer> mapped_buffers_
+      GUARDED_BY(mapped_buffers_mutex_);
+  // The buffers mapped when the current request began, see BeginRequest().
+  std::map<uintptr_t, MappedBuffer> request_mapped_buffers_
+      GUARDED_BY(mapped_buffers_mutex_);
+  // Deadline set by SetWallTimeLimit() and those of the calls in flight. The
+  // wall time limit of s2_ is set to the earliest.
+  mutable absl::Mutex deadlines_mutex_;
+  mutable absl::Time wall_time_deadline_ GUARDED_BY(deadlines_mutex_) =
+      absl::InfiniteFuture();
+  std::multiset<absl::Time> call_deadlines_ GUARDED_BY(deadlines_mutex_);
+  // Call statistics, see CollectStats().
+  CallStatsCollector stats_;
+  bool collect_stats_ = false;
+  // See CollectPerfCounters(), nullptr if disabled or not available.
+  std::unique_ptr<PerfCounters> perf_counters_;
+  // Results of the functions listed by GetCachedFunctions().
+  CallCache call_cache_;
+  // Whether dirty page tracking is active, see TrackDirtyPages().
+  bool track_dirty_pages_ = false;
+  // Whether memory is transferred over the RPC channel, see
+  // TransferMemoryOverComms().
+  bool transfer_over_comms_ = false;
+  // See GetInlineTransferThreshold().
+  size_t inline_threshold_ = 0;
+  // Phases of the most recent Init().
+  InitTimes init_times_;
 
   // FileTOC with the embedded library, takes precedence over GetLibPath if
   // present (not nullptr).
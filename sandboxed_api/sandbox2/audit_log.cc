@@ -0,0 +1,135 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::AuditLog class.
+
+#include "sandboxed_api/sandbox2/audit_log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+#include "sandboxed_api/util/canonical_errors.h"
+
+namespace sandbox2 {
+
+static_assert(sizeof(AuditRecord) == 96, "AuditRecord is part of the format");
+
+constexpr uint32_t AuditRecord::kMagic;
+constexpr uint16_t AuditRecord::kVersion;
+constexpr size_t AuditLog::kBufferedRecords;
+
+namespace {
+
+std::string KindToString(uint16_t kind) {
+  switch (kind) {
+    case AuditLog::kViolation:
+      return "VIOLATION";
+    case AuditLog::kPermitted:
+      return "PERMITTED";
+    case AuditLog::kLogged:
+      return "LOGGED";
+    default:
+      return absl::StrCat("KIND_", kind);
+  }
+}
+
+}  // namespace
+
+sapi::StatusOr<std::unique_ptr<AuditLog>> AuditLog::Open(
+    const std::string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return sapi::InternalError(
+        absl::StrCat("Could not open ", path, ": ", StrError(errno)));
+  }
+  return absl::WrapUnique(new AuditLog(fd));
+}
+
+AuditLog::~AuditLog() { Flush(); }
+
+void AuditLog::Add(Kind kind, const Syscall& syscall) {
+  if (num_buffered_ == kBufferedRecords) {
+    Flush();
+  }
+  AuditRecord& record = buffer_[num_buffered_++];
+  record = AuditRecord();
+  record.kind = kind;
+  record.pid = syscall.pid();
+  record.arch = syscall.arch();
+  record.time_ns = absl::GetCurrentTimeNanos();
+  record.nr = syscall.nr();
+  std::copy(syscall.args().begin(), syscall.args().end(), record.args);
+  record.instruction_pointer = syscall.instruction_pointer();
+  record.stack_pointer = syscall.stack_pointer();
+}
+
+bool AuditLog::Flush() {
+  const size_t size = num_buffered_ * sizeof(AuditRecord);
+  num_buffered_ = 0;
+  if (size == 0) {
+    return true;
+  }
+  // A short write would let the next batch start in the middle of a record,
+  // which would make the rest of the file undecodable. Regular files are
+  // written completely unless the disk is full.
+  ssize_t written = TEMP_FAILURE_RETRY(write(fd_.get(), buffer_, size));
+  if (written != static_cast<ssize_t>(size)) {
+    PLOG(ERROR) << "Writing the audit log failed";
+    return false;
+  }
+  return true;
+}
+
+bool AuditLog::Parse(absl::string_view contents,
+                     std::vector<AuditRecord>* records) {
+  while (contents.size() >= sizeof(AuditRecord)) {
+    AuditRecord record;
+    memcpy(&record, contents.data(), sizeof(record));
+    if (record.magic != AuditRecord::kMagic ||
+        record.version != AuditRecord::kVersion) {
+      return false;
+    }
+    records->push_back(record);
+    contents.remove_prefix(sizeof(record));
+  }
+  return contents.empty();
+}
+
+std::string AuditLog::ToString(const AuditRecord& record) {
+  Syscall::Args args;
+  std::copy(record.args, record.args + Syscall::kMaxArgs, args.begin());
+  // Without a PID, the arguments are printed as values.
+  Syscall syscall(static_cast<Syscall::CpuArch>(record.arch), record.nr, args);
+  return absl::StrFormat(
+      "%s %s PID: %d %s %s [%d](%s) IP: %#x, STACK: %#x",
+      absl::FormatTime(absl::FromUnixNanos(record.time_ns)),
+      KindToString(record.kind), record.pid,
+      Syscall::GetArchDescription(syscall.arch()), syscall.GetName(),
+      record.nr, absl::StrJoin(syscall.GetArgumentsDescription(), ", "),
+      record.instruction_pointer, record.stack_pointer);
+}
+
+}  // namespace sandbox2
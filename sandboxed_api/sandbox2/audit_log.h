@@ -0,0 +1,110 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::AuditLog class writes syscall events of sandboxees as fixed
+// size binary records, which are formatted offline by audit_log_decoder_bin.
+// That keeps logging the events of a policy audit cheap enough for production,
+// unlike formatting a description of every syscall in the Monitor.
+
+#ifndef SANDBOXED_API_SANDBOX2_AUDIT_LOG_H_
+#define SANDBOXED_API_SANDBOX2_AUDIT_LOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+// One event, in host byte order.
+struct AuditRecord {
+  static constexpr uint32_t kMagic = 0x4c413253;  // "S2AL"
+  static constexpr uint16_t kVersion = 1;
+
+  uint32_t magic = kMagic;
+  uint16_t version = kVersion;
+  // AuditLog::Kind
+  uint16_t kind = 0;
+  int32_t pid = -1;
+  // Syscall::CpuArch
+  uint32_t arch = 0;
+  // Nanoseconds since the Unix epoch.
+  int64_t time_ns = 0;
+  uint64_t nr = 0;
+  uint64_t args[Syscall::kMaxArgs] = {};
+  uint64_t instruction_pointer = 0;
+  uint64_t stack_pointer = 0;
+};
+
+class AuditLog {
+ public:
+  enum Kind : uint16_t {
+    // The syscall violated the policy.
+    kViolation = 1,
+    // Notify::EventSyscallTrap() permitted the syscall.
+    kPermitted = 2,
+    // Allowed by --sandbox2_danger_danger_permit_all_and_log.
+    kLogged = 3,
+  };
+
+  // Records are written in batches of this many.
+  static constexpr size_t kBufferedRecords = 64;
+
+  // Opens 'path' for appending. Several logs, e.g. of concurrent Monitors, may
+  // append to the same file: each batch is written by a single write(2).
+  static sapi::StatusOr<std::unique_ptr<AuditLog>> Open(
+      const std::string& path);
+
+  AuditLog(const AuditLog&) = delete;
+  AuditLog& operator=(const AuditLog&) = delete;
+
+  // Writes the buffered records.
+  ~AuditLog();
+
+  // Records 'syscall', with the current time.
+  void Add(Kind kind, const Syscall& syscall);
+
+  // Writes the buffered records. Returns false on write errors, the records
+  // are dropped then.
+  bool Flush();
+
+  // Appends the records in 'contents', the contents of a log file, to
+  // 'records'. Returns false if 'contents' is truncated or holds records of a
+  // different format, the records before are appended nevertheless.
+  static bool Parse(absl::string_view contents,
+                    std::vector<AuditRecord>* records);
+
+  // Returns a line describing 'record', like
+  //   "2020-01-01T00:00:00.123456789+00:00 VIOLATION PID: 42 X86-64 read [0]
+  //   (0x3, 0x7ffd12345678, 0x10) IP: 0x4016a1, STACK: 0x7ffd12345600"
+  // Pointers are not dereferenced, the process is gone.
+  static std::string ToString(const AuditRecord& record);
+
+ private:
+  explicit AuditLog(int fd) : fd_(fd) {}
+
+  file_util::fileops::FDCloser fd_;
+  AuditRecord buffer_[kBufferedRecords];
+  size_t num_buffered_ = 0;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_AUDIT_LOG_H_
@@ -0,0 +1,61 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Prints the binary audit logs written with --sandbox2_audit_log, one line per
+// event, see audit_log.h.
+//
+// Usage:
+// audit_log_decoder_bin audit.log [audit.log ...]
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/strings/str_format.h"
+#include "sandboxed_api/sandbox2/audit_log.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc < 2) {
+    absl::FPrintF(stderr, "Usage: %s audit.log [audit.log ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int exit_code = EXIT_SUCCESS;
+  for (int i = 1; i < argc; ++i) {
+    std::string contents;
+    auto status = sandbox2::file::GetContents(argv[i], &contents,
+                                              sandbox2::file::Defaults());
+    if (!status.ok()) {
+      absl::FPrintF(stderr, "Cannot read %s: %s\n", argv[i], status.message());
+      return EXIT_FAILURE;
+    }
+    std::vector<sandbox2::AuditRecord> records;
+    if (!sandbox2::AuditLog::Parse(contents, &records)) {
+      // The records before are still printed, e.g. of a log which is being
+      // written.
+      absl::FPrintF(stderr, "%s is truncated or not an audit log\n", argv[i]);
+      exit_code = EXIT_FAILURE;
+    }
+    for (const auto& record : records) {
+      absl::PrintF("%s\n", sandbox2::AuditLog::ToString(record));
+    }
+  }
+  return exit_code;
+}
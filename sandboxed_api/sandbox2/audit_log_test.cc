@@ -0,0 +1,87 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/audit_log.h"
+
+#include <linux/unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/temp_file.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::sapi::IsOk;
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
+using ::testing::SizeIs;
+
+namespace sandbox2 {
+namespace {
+
+TEST(AuditLogTest, RecordsRoundTrip) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::string path,
+                            CreateNamedTempFileAndClose("/tmp/audit"));
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto log, AuditLog::Open(path));
+    // More than one batch.
+    for (size_t i = 0; i < AuditLog::kBufferedRecords + 1; ++i) {
+      log->Add(AuditLog::kPermitted,
+               Syscall(Syscall::GetHostArch(), __NR_close, {i}));
+    }
+    log->Add(AuditLog::kViolation,
+             Syscall(Syscall::GetHostArch(), __NR_bpf, {1, 2, 3}));
+  }
+  std::string contents;
+  ASSERT_THAT(file::GetContents(path, &contents, file::Defaults()), IsOk());
+  remove(path.c_str());
+
+  std::vector<AuditRecord> records;
+  ASSERT_THAT(AuditLog::Parse(contents, &records), IsTrue());
+  ASSERT_THAT(records, SizeIs(AuditLog::kBufferedRecords + 2));
+  EXPECT_THAT(records[3].kind, Eq(AuditLog::kPermitted));
+  EXPECT_THAT(records[3].nr, Eq(__NR_close));
+  EXPECT_THAT(records[3].args[0], Eq(3));
+  const AuditRecord& violation = records.back();
+  EXPECT_THAT(violation.kind, Eq(AuditLog::kViolation));
+  EXPECT_THAT(violation.args[2], Eq(3));
+  EXPECT_THAT(AuditLog::ToString(violation), HasSubstr("VIOLATION"));
+  EXPECT_THAT(AuditLog::ToString(violation), HasSubstr("bpf"));
+}
+
+TEST(AuditLogTest, ParseRejectsTruncatedLogs) {
+  AuditRecord record;
+  std::string contents(reinterpret_cast<const char*>(&record), sizeof(record));
+  contents.append(contents.data(), sizeof(record) / 2);
+  std::vector<AuditRecord> records;
+  EXPECT_THAT(AuditLog::Parse(contents, &records), IsFalse());
+  EXPECT_THAT(records, SizeIs(1));
+
+  records.clear();
+  EXPECT_THAT(AuditLog::Parse("not an audit log, but long enough for a record"
+                              " of ninety-six bytes, which it is not.",
+                              &records),
+              IsFalse());
+  EXPECT_THAT(records, SizeIs(0));
+}
+
+}  // namespace
+}  // namespace sandbox2
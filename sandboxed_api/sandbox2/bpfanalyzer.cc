@@ -0,0 +1,348 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/bpfanalyzer.h"
+
+// IWYU pragma: no_include <asm/int-ll64.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/types/optional.h"
+#include "sandboxed_api/sandbox2/bpfdisassembler.h"
+
+namespace sandbox2 {
+namespace bpf {
+namespace {
+
+// Programs this close to BPF_MAXINSNS are flagged.
+constexpr size_t kSizeWarningMargin = BPF_MAXINSNS / 10;
+
+// The value of the accumulator, as far as it is known.
+struct Accumulator {
+  enum Kind : uint8_t {
+    kUnknown,
+    // Loaded with the syscall number. Comparisons are checks of the syscall.
+    kSyscallNr,
+    // Any other known value.
+    kConstant,
+  };
+  Accumulator() = default;
+  Accumulator(Kind kind, uint32_t value) : kind(kind), value(value) {}
+
+  Kind kind = kUnknown;
+  uint32_t value = 0;
+};
+
+uint64_t SaturatingAdd(uint64_t a, uint64_t b) {
+  return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+// Runs a program for one syscall number at a time, following both ways of
+// checks of unknown values.
+class Walker {
+ public:
+  // Loads of the architecture give 'arch', or an unknown value if not set.
+  Walker(const std::vector<sock_filter>& prog, absl::optional<uint32_t> arch)
+      : prog_(prog),
+        arch_(arch),
+        reached_(prog.size()),
+        nr_checked_(prog.size()),
+        nr_matched_(prog.size()) {}
+
+  SyscallCost Run(uint32_t nr) {
+    nr_ = nr;
+    memo_.clear();
+    return Walk(0, Accumulator());
+  }
+
+  // Whether the instruction at 'pc' ran for any syscall so far.
+  bool reached(int pc) const { return reached_[pc]; }
+  // Whether the instruction at 'pc' compared the syscall number, and whether
+  // the comparison was true for any syscall so far.
+  bool nr_checked(int pc) const { return nr_checked_[pc]; }
+  bool nr_matched(int pc) const { return nr_matched_[pc]; }
+
+ private:
+  const SyscallCost& Walk(size_t pc, Accumulator a);
+  SyscallCost Step(size_t pc, Accumulator a);
+
+  // Cost of an instruction followed by 'next'.
+  static SyscallCost Then(const SyscallCost& next) {
+    SyscallCost cost = next;
+    ++cost.min_insns;
+    ++cost.max_insns;
+    ++cost.expected_insns;
+    return cost;
+  }
+
+  // Cost of a jump followed by either 'a' or 'b'.
+  static SyscallCost Either(const SyscallCost& a, const SyscallCost& b) {
+    SyscallCost cost;
+    cost.min_insns = 1 + std::min(a.min_insns, b.min_insns);
+    cost.max_insns = 1 + std::max(a.max_insns, b.max_insns);
+    cost.expected_insns = 1 + (a.expected_insns + b.expected_insns) / 2;
+    cost.paths = SaturatingAdd(a.paths, b.paths);
+    cost.actions = a.actions;
+    cost.actions.insert(b.actions.begin(), b.actions.end());
+    return cost;
+  }
+
+  const std::vector<sock_filter>& prog_;
+  absl::optional<uint32_t> arch_;
+  uint32_t nr_ = 0;
+  // Costs of the states (pc and accumulator) reached with the current syscall
+  // number.
+  std::unordered_map<uint64_t, SyscallCost> memo_;
+  std::vector<bool> reached_;
+  std::vector<bool> nr_checked_;
+  std::vector<bool> nr_matched_;
+};
+
+const SyscallCost& Walker::Walk(size_t pc, Accumulator a) {
+  const uint64_t key = (static_cast<uint64_t>(pc) << 34) |
+                       (static_cast<uint64_t>(a.kind) << 32) | a.value;
+  auto it = memo_.find(key);
+  if (it != memo_.end()) {
+    return it->second;
+  }
+  SyscallCost cost = Step(pc, a);
+  return memo_.emplace(key, std::move(cost)).first->second;
+}
+
+SyscallCost Walker::Step(size_t pc, Accumulator a) {
+  if (pc >= prog_.size()) {
+    // Falling off the end is rejected by the kernel, count it as a kill.
+    SyscallCost cost;
+    cost.paths = 1;
+    cost.actions.insert(SECCOMP_RET_KILL);
+    return cost;
+  }
+  reached_[pc] = true;
+  const sock_filter& insn = prog_[pc];
+  const bool known = a.kind != Accumulator::kUnknown;
+  Accumulator next = a;
+  switch (BPF_CLASS(insn.code)) {
+    case BPF_RET: {
+      SyscallCost cost;
+      cost.min_insns = cost.max_insns = 1;
+      cost.expected_insns = 1;
+      cost.paths = 1;
+      if (BPF_RVAL(insn.code) == BPF_K) {
+        cost.actions.insert(insn.k);
+      } else if (BPF_RVAL(insn.code) == BPF_A && known) {
+        cost.actions.insert(a.value);
+      }
+      return cost;
+    }
+    case BPF_LD:
+      next = Accumulator();
+      if (insn.code == (BPF_LD | BPF_W | BPF_ABS)) {
+        if (insn.k == offsetof(seccomp_data, nr)) {
+          next = {Accumulator::kSyscallNr, nr_};
+        } else if (insn.k == offsetof(seccomp_data, arch) && arch_) {
+          next = {Accumulator::kConstant, *arch_};
+        }
+      } else if (insn.code == (BPF_LD | BPF_W | BPF_LEN)) {
+        next = {Accumulator::kConstant, sizeof(seccomp_data)};
+      } else if (insn.code == (BPF_LD | BPF_IMM)) {
+        next = {Accumulator::kConstant, insn.k};
+      }
+      return Then(Walk(pc + 1, next));
+    case BPF_ALU: {
+      next = Accumulator();
+      if (known &&
+          (BPF_SRC(insn.code) == BPF_K || BPF_OP(insn.code) == BPF_NEG)) {
+        uint32_t value = a.value;
+        bool valid = true;
+        switch (BPF_OP(insn.code)) {
+          case BPF_ADD:
+            value += insn.k;
+            break;
+          case BPF_SUB:
+            value -= insn.k;
+            break;
+          case BPF_MUL:
+            value *= insn.k;
+            break;
+          case BPF_DIV:
+            valid = insn.k != 0;
+            value = valid ? value / insn.k : 0;
+            break;
+          case BPF_AND:
+            value &= insn.k;
+            break;
+          case BPF_OR:
+            value |= insn.k;
+            break;
+          case BPF_XOR:
+            value ^= insn.k;
+            break;
+          case BPF_LSH:
+            value = insn.k < 32 ? value << insn.k : 0;
+            break;
+          case BPF_RSH:
+            value = insn.k < 32 ? value >> insn.k : 0;
+            break;
+          case BPF_NEG:
+            value = -value;
+            break;
+          default:
+            valid = false;
+        }
+        if (valid) {
+          next = {Accumulator::kConstant, value};
+        }
+      }
+      return Then(Walk(pc + 1, next));
+    }
+    case BPF_JMP: {
+      if (BPF_OP(insn.code) == BPF_JA) {
+        return Then(Walk(pc + 1 + insn.k, a));
+      }
+      const size_t jt = pc + 1 + insn.jt;
+      const size_t jf = pc + 1 + insn.jf;
+      if (jt == jf) {
+        return Then(Walk(jt, a));
+      }
+      if (!known || BPF_SRC(insn.code) != BPF_K) {
+        return Either(Walk(jt, a), Walk(jf, a));
+      }
+      bool taken;
+      switch (BPF_OP(insn.code)) {
+        case BPF_JEQ:
+          taken = a.value == insn.k;
+          break;
+        case BPF_JGT:
+          taken = a.value > insn.k;
+          break;
+        case BPF_JGE:
+          taken = a.value >= insn.k;
+          break;
+        case BPF_JSET:
+          taken = (a.value & insn.k) != 0;
+          break;
+        default:
+          return Either(Walk(jt, a), Walk(jf, a));
+      }
+      if (a.kind == Accumulator::kSyscallNr &&
+          BPF_OP(insn.code) == BPF_JEQ) {
+        nr_checked_[pc] = true;
+        if (taken) {
+          nr_matched_[pc] = true;
+        }
+      }
+      return Then(Walk(taken ? jt : jf, a));
+    }
+    default:
+      // LDX, ST, STX and MISC do not change the accumulator, except for TXA
+      // which loads the unknown index register.
+      if (insn.code == (BPF_MISC | BPF_TXA)) {
+        next = Accumulator();
+      }
+      return Then(Walk(pc + 1, next));
+  }
+}
+
+std::string ActionToString(uint32_t action) {
+  return DecodeInstruction(BPF_STMT(BPF_RET | BPF_K, action), 0);
+}
+
+}  // namespace
+
+Analysis Analyze(const std::vector<sock_filter>& prog, uint32_t audit_arch,
+                 uint32_t max_nr) {
+  Analysis analysis;
+  analysis.insns = prog.size();
+  analysis.near_size_limit = prog.size() + kSizeWarningMargin > BPF_MAXINSNS;
+
+  // The costs are those of syscalls of 'audit_arch'. Instructions for other
+  // architectures are still reachable, which a walk not knowing the
+  // architecture finds.
+  Walker walker(prog, audit_arch);
+  Walker any_arch(prog, absl::nullopt);
+  double expected_sum = 0;
+  for (uint32_t nr = 0; nr < max_nr; ++nr) {
+    SyscallCost cost = walker.Run(nr);
+    any_arch.Run(nr);
+    analysis.max_insns = std::max(analysis.max_insns, cost.max_insns);
+    expected_sum += cost.expected_insns;
+    analysis.syscalls.emplace(nr, std::move(cost));
+  }
+  if (max_nr > 0) {
+    analysis.expected_insns = expected_sum / max_nr;
+  }
+
+  for (size_t pc = 0; pc < prog.size(); ++pc) {
+    if (!any_arch.reached(pc)) {
+      analysis.unreachable.push_back(pc);
+    } else if (any_arch.nr_checked(pc) && !any_arch.nr_matched(pc) &&
+               prog[pc].k < max_nr) {
+      analysis.never_matching.push_back(pc);
+    }
+  }
+  return analysis;
+}
+
+std::string AnalysisToString(const std::vector<sock_filter>& prog,
+                             const Analysis& analysis, bool per_syscall) {
+  std::string out =
+      absl::StrCat("Instructions: ", analysis.insns, " of ", BPF_MAXINSNS,
+                   " allowed", analysis.near_size_limit ? " (near limit)" : "",
+                   "\n");
+  absl::StrAppendFormat(&out,
+                        "Instructions run per syscall: %d at most, %.1f "
+                        "expected on average\n",
+                        analysis.max_insns, analysis.expected_insns);
+  if (!analysis.unreachable.empty()) {
+    absl::StrAppend(&out, "Unreachable instructions:\n");
+    for (int pc : analysis.unreachable) {
+      absl::StrAppend(&out, "  ", pc, ": ", DecodeInstruction(prog[pc], pc),
+                      "\n");
+    }
+  }
+  if (!analysis.never_matching.empty()) {
+    absl::StrAppend(&out,
+                    "Syscall checks never matching (duplicate rules?):\n");
+    for (int pc : analysis.never_matching) {
+      absl::StrAppend(&out, "  ", pc, ": ", DecodeInstruction(prog[pc], pc),
+                      "\n");
+    }
+  }
+  if (per_syscall) {
+    absl::StrAppend(&out, "Per syscall (min/max/expected instructions):\n");
+    for (const auto& syscall : analysis.syscalls) {
+      const SyscallCost& cost = syscall.second;
+      std::vector<std::string> actions;
+      for (uint32_t action : cost.actions) {
+        actions.push_back(ActionToString(action));
+      }
+      absl::StrAppendFormat(&out, "  %u: %d/%d/%.1f, %u path(s): %s\n",
+                            syscall.first, cost.min_insns, cost.max_insns,
+                            cost.expected_insns, cost.paths,
+                            absl::StrJoin(actions, ", "));
+    }
+  }
+  return out;
+}
+
+}  // namespace bpf
+}  // namespace sandbox2
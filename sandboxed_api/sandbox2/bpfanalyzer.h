@@ -0,0 +1,80 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Static analysis of the runtime cost of seccomp-bpf programs.
+
+#ifndef SANDBOXED_API_SANDBOX2_BPFANALYZER_H_
+#define SANDBOXED_API_SANDBOX2_BPFANALYZER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct sock_filter;
+
+namespace sandbox2 {
+namespace bpf {
+
+// Instructions run by a program for one syscall number. Checks of anything but
+// the syscall number and architecture (the arguments, the instruction
+// pointer) can go either way, each way of a program through them is a path.
+struct SyscallCost {
+  // Instructions run on the shortest and the longest path.
+  int min_insns = 0;
+  int max_insns = 0;
+  // Instructions run on average, if every check of an argument is taken or
+  // not taken with equal probability.
+  double expected_insns = 0;
+  // Number of paths, saturated at UINT64_MAX.
+  uint64_t paths = 0;
+  // Return values of the paths.
+  std::set<uint32_t> actions;
+};
+
+struct Analysis {
+  // Size of the program in instructions.
+  size_t insns = 0;
+  // Whether the program is close to BPF_MAXINSNS, which the kernel does not
+  // load programs beyond.
+  bool near_size_limit = false;
+  // Costs for the syscall numbers analyzed.
+  std::map<uint32_t, SyscallCost> syscalls;
+  // Maximum of max_insns and average of expected_insns over all syscalls.
+  int max_insns = 0;
+  double expected_insns = 0;
+  // Instructions no syscall of any architecture runs.
+  std::vector<int> unreachable;
+  // Comparisons of the syscall number which never match, because the syscall
+  // was handled before. Usually a rule duplicating an earlier one.
+  std::vector<int> never_matching;
+};
+
+// Analyzes 'prog' for the syscall numbers [0, max_nr) of the architecture
+// 'audit_arch' (AUDIT_ARCH_*). Jumps on the index register are treated as
+// going either way.
+Analysis Analyze(const std::vector<sock_filter>& prog, uint32_t audit_arch,
+                 uint32_t max_nr = 1024);
+
+// Returns a human-readable summary of the 'analysis' of 'prog', which lists the
+// cost of each syscall if 'per_syscall' is set.
+std::string AnalysisToString(const std::vector<sock_filter>& prog,
+                             const Analysis& analysis, bool per_syscall);
+
+}  // namespace bpf
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_BPFANALYZER_H_
@@ -0,0 +1,82 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reports the runtime cost of a seccomp-bpf program, see bpfanalyzer.h.
+//
+// Usage:
+// bpfanalyzer_bin --bpfanalyzer_max_insns=40 policy.bpf
+//
+// The file holds the raw sock_filter array, as returned by
+// Policy::GetProgram(). Exits with an error if the program runs more
+// instructions than --bpfanalyzer_max_insns for any syscall, or if it is near
+// BPF_MAXINSNS, so that it can guard against regressions of the filter cost.
+
+#include <linux/filter.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/strings/str_format.h"
+#include "sandboxed_api/sandbox2/bpfanalyzer.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+
+ABSL_FLAG(bool, bpfanalyzer_per_syscall, false,
+          "List the cost of every syscall");
+ABSL_FLAG(uint32_t, bpfanalyzer_max_nr, 1024,
+          "Analyze the syscall numbers below this one");
+ABSL_FLAG(int32_t, bpfanalyzer_max_insns, 0,
+          "Fail if a syscall runs more instructions than this, 0 to not check");
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 2) {
+    absl::FPrintF(stderr, "Usage: %s [flags] policy.bpf\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string contents;
+  auto status = sandbox2::file::GetContents(argv[1], &contents,
+                                            sandbox2::file::Defaults());
+  if (!status.ok()) {
+    absl::FPrintF(stderr, "Cannot read %s: %s\n", argv[1], status.message());
+    return EXIT_FAILURE;
+  }
+  if (contents.size() % sizeof(sock_filter) != 0) {
+    absl::FPrintF(stderr, "%s is not a BPF program\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  const auto* begin = reinterpret_cast<const sock_filter*>(contents.data());
+  const std::vector<sock_filter> prog(
+      begin, begin + contents.size() / sizeof(sock_filter));
+
+  const sandbox2::bpf::Analysis analysis = sandbox2::bpf::Analyze(
+      prog, sandbox2::Syscall::GetHostAuditArch(),
+      absl::GetFlag(FLAGS_bpfanalyzer_max_nr));
+  absl::PrintF("%s", sandbox2::bpf::AnalysisToString(
+                         prog, analysis,
+                         absl::GetFlag(FLAGS_bpfanalyzer_per_syscall)));
+
+  const int max_insns = absl::GetFlag(FLAGS_bpfanalyzer_max_insns);
+  if (analysis.near_size_limit ||
+      (max_insns > 0 && analysis.max_insns > max_insns)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/bpfanalyzer.h"
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "sandboxed_api/sandbox2/util/bpf_helper.h"
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+
+namespace sandbox2 {
+namespace bpf {
+namespace {
+
+constexpr uint32_t kArch = AUDIT_ARCH_X86_64;
+
+std::vector<sock_filter> TestProgram() {
+  return {
+      /* 0 */ LOAD_ARCH,
+      /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kArch, 1, 0),
+      /* 2 */ TRACE(0),
+      /* 3 */ LOAD_SYSCALL_NR,
+      /* 4 */ SYSCALL(0, ALLOW),
+      // Syscall 1 is allowed if its first argument is 2.
+      /* 6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 3),
+      /* 7 */ ARG_32(0),
+      /* 8 */ JEQ32(2, ALLOW),
+      /* 10 */ LOAD_SYSCALL_NR,
+      // Duplicates the rule for syscall 0.
+      /* 11 */ SYSCALL(0, ERRNO(1)),
+      /* 13 */ KILL,
+  };
+}
+
+TEST(BpfAnalyzerTest, CountsInstructionsPerSyscall) {
+  const std::vector<sock_filter> prog = TestProgram();
+  Analysis analysis = Analyze(prog, kArch, 3);
+  EXPECT_THAT(analysis.insns, Eq(prog.size()));
+  EXPECT_FALSE(analysis.near_size_limit);
+
+  const SyscallCost& allowed = analysis.syscalls[0];
+  EXPECT_THAT(allowed.min_insns, Eq(5));
+  EXPECT_THAT(allowed.max_insns, Eq(5));
+  EXPECT_THAT(allowed.paths, Eq(1));
+  EXPECT_THAT(allowed.actions, ElementsAre(SECCOMP_RET_ALLOW));
+
+  const SyscallCost& filtered = analysis.syscalls[1];
+  EXPECT_THAT(filtered.min_insns, Eq(8));
+  EXPECT_THAT(filtered.max_insns, Eq(10));
+  EXPECT_THAT(filtered.expected_insns, DoubleEq(9));
+  EXPECT_THAT(filtered.paths, Eq(2));
+  EXPECT_THAT(filtered.actions,
+              ElementsAre(SECCOMP_RET_KILL, SECCOMP_RET_ALLOW));
+
+  EXPECT_THAT(analysis.syscalls[2].max_insns, Eq(8));
+  EXPECT_THAT(analysis.max_insns, Eq(10));
+}
+
+TEST(BpfAnalyzerTest, FindsUnreachableAndNeverMatchingCode) {
+  const std::vector<sock_filter> prog = TestProgram();
+  Analysis analysis = Analyze(prog, kArch, 3);
+  // The check for other architectures is reachable, the duplicate rule not.
+  EXPECT_THAT(analysis.unreachable, ElementsAre(12));
+  EXPECT_THAT(analysis.never_matching, ElementsAre(11));
+
+  const std::string report = AnalysisToString(prog, analysis, true);
+  EXPECT_THAT(report, HasSubstr("12: ERRNO 0x1"));
+  EXPECT_THAT(report, HasSubstr("1: 8/10/9.0, 2 path(s): KILL, ALLOW"));
+}
+
+TEST(BpfAnalyzerTest, FlagsLargePrograms) {
+  std::vector<sock_filter> prog(BPF_MAXINSNS - 1, LOAD_SYSCALL_NR);
+  prog.push_back(ALLOW);
+  Analysis analysis = Analyze(prog, kArch, 1);
+  EXPECT_TRUE(analysis.near_size_limit);
+  EXPECT_THAT(analysis.unreachable, IsEmpty());
+  EXPECT_THAT(analysis.max_insns, Eq(BPF_MAXINSNS));
+}
+
+}  // namespace
+}  // namespace bpf
+}  // namespace sandbox2
@@ -19,6 +19,7 @@
 #include <linux/seccomp.h>
 
 #include <cstddef>
+#include <cstdint>
 
 #include "absl/strings/str_cat.h"
 
@@ -243,5 +244,21 @@ std::string Disasm(const std::vector<sock_filter>& prog) {
   return rv;
 }
 
+std::string ToCArray(const std::vector<sock_filter>& prog,
+                     absl::string_view name) {
+  std::string rv = absl::StrCat("constexpr sock_filter ", name, "[] = {\n");
+  for (size_t i = 0, len = prog.size(); i < len; ++i) {
+    const sock_filter& inst = prog[i];
+    absl::StrAppend(&rv, "    {0x", absl::Hex(inst.code, absl::kZeroPad2),
+                    ", ", static_cast<uint32_t>(inst.jt), ", ",
+                    static_cast<uint32_t>(inst.jf), ", 0x",
+                    absl::Hex(inst.k, absl::kZeroPad8), "},  // ",
+                    absl::Dec(i, absl::kZeroPad3), ": ",
+                    DecodeInstruction(inst, i), "\n");
+  }
+  absl::StrAppend(&rv, "};\n");
+  return rv;
+}
+
 }  // namespace bpf
 }  // namespace sandbox2
@@ -18,6 +18,8 @@
 #include <string>
 #include <vector>
 
+#include "absl/strings/string_view.h"
+
 struct sock_filter;
 
 namespace sandbox2 {
@@ -30,6 +32,12 @@ std::string DecodeInstruction(const sock_filter& inst, int pc);
 // Returns a human-readable textual represenation.
 std::string Disasm(const std::vector<sock_filter>& prog);
 
+// Formats a BPF program as the definition of a constexpr array called 'name',
+// with the disassembly of each instruction as a comment. This allows to embed
+// a fixed policy in the binary, see PolicyBuilder::UsePrecompiledPolicy().
+std::string ToCArray(const std::vector<sock_filter>& prog,
+                     absl::string_view name);
+
 }  // namespace bpf
 }  // namespace sandbox2
 
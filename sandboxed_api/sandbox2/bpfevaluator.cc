@@ -0,0 +1,268 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/bpfevaluator.h"
+
+#include <cstring>
+#include <utility>
+
+#include "absl/strings/str_format.h"
+
+namespace sandbox2 {
+namespace bpf {
+
+bool Evaluator::Validate(const std::vector<sock_filter>& prog,
+                         std::string* error) {
+  if (prog.empty() || prog.size() > BPF_MAXINSNS) {
+    *error = absl::StrFormat("Invalid program size: %d", prog.size());
+    return false;
+  }
+  auto jumps_past_end = [&prog](size_t pc, uint64_t offset) {
+    return pc + 1 + offset >= prog.size();
+  };
+  for (size_t pc = 0; pc < prog.size(); ++pc) {
+    const sock_filter& insn = prog[pc];
+    bool valid = true;
+    switch (insn.code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        valid = insn.k < sizeof(seccomp_data) && insn.k % sizeof(uint32_t) == 0;
+        break;
+      case BPF_LD | BPF_MEM:
+      case BPF_LDX | BPF_MEM:
+      case BPF_ST:
+      case BPF_STX:
+        valid = insn.k < BPF_MEMWORDS;
+        break;
+      case BPF_ALU | BPF_DIV | BPF_K:
+        valid = insn.k != 0;
+        break;
+      case BPF_ALU | BPF_LSH | BPF_K:
+      case BPF_ALU | BPF_RSH | BPF_K:
+        valid = insn.k < 32;
+        break;
+      case BPF_JMP | BPF_JA:
+        valid = !jumps_past_end(pc, insn.k);
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+      case BPF_JMP | BPF_JEQ | BPF_X:
+      case BPF_JMP | BPF_JGT | BPF_K:
+      case BPF_JMP | BPF_JGT | BPF_X:
+      case BPF_JMP | BPF_JGE | BPF_K:
+      case BPF_JMP | BPF_JGE | BPF_X:
+      case BPF_JMP | BPF_JSET | BPF_K:
+      case BPF_JMP | BPF_JSET | BPF_X:
+        valid = !jumps_past_end(pc, insn.jt) && !jumps_past_end(pc, insn.jf);
+        break;
+      case BPF_LD | BPF_W | BPF_LEN:
+      case BPF_LDX | BPF_W | BPF_LEN:
+      case BPF_LD | BPF_IMM:
+      case BPF_LDX | BPF_IMM:
+      case BPF_ALU | BPF_ADD | BPF_K:
+      case BPF_ALU | BPF_ADD | BPF_X:
+      case BPF_ALU | BPF_SUB | BPF_K:
+      case BPF_ALU | BPF_SUB | BPF_X:
+      case BPF_ALU | BPF_MUL | BPF_K:
+      case BPF_ALU | BPF_MUL | BPF_X:
+      case BPF_ALU | BPF_DIV | BPF_X:
+      case BPF_ALU | BPF_AND | BPF_K:
+      case BPF_ALU | BPF_AND | BPF_X:
+      case BPF_ALU | BPF_OR | BPF_K:
+      case BPF_ALU | BPF_OR | BPF_X:
+      case BPF_ALU | BPF_XOR | BPF_K:
+      case BPF_ALU | BPF_XOR | BPF_X:
+      case BPF_ALU | BPF_LSH | BPF_X:
+      case BPF_ALU | BPF_RSH | BPF_X:
+      case BPF_ALU | BPF_NEG:
+      case BPF_MISC | BPF_TAX:
+      case BPF_MISC | BPF_TXA:
+      case BPF_RET | BPF_K:
+      case BPF_RET | BPF_A:
+        break;
+      default:
+        *error = absl::StrFormat("Unsupported opcode 0x%02x at %d", insn.code,
+                                 pc);
+        return false;
+    }
+    if (!valid) {
+      *error = absl::StrFormat("Invalid operand of opcode 0x%02x at %d",
+                               insn.code, pc);
+      return false;
+    }
+  }
+  // Jumps only go forward, so this is where every path ends.
+  const uint16_t last = prog.back().code;
+  if (last != (BPF_RET | BPF_K) && last != (BPF_RET | BPF_A)) {
+    *error = "The program does not end with a return";
+    return false;
+  }
+  return true;
+}
+
+Evaluator::Evaluator(std::vector<sock_filter> prog) : prog_(std::move(prog)) {}
+
+Verdict Evaluator::Evaluate(const seccomp_data& data) const {
+  const char* bytes = reinterpret_cast<const char*>(&data);
+  uint32_t a = 0;
+  uint32_t x = 0;
+  uint32_t mem[BPF_MEMWORDS] = {};
+  Verdict verdict;
+  for (size_t pc = 0; pc < prog_.size(); ++pc) {
+    const sock_filter& insn = prog_[pc];
+    ++verdict.insns;
+    switch (insn.code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        memcpy(&a, bytes + insn.k, sizeof(a));
+        break;
+      case BPF_LD | BPF_W | BPF_LEN:
+        a = sizeof(seccomp_data);
+        break;
+      case BPF_LDX | BPF_W | BPF_LEN:
+        x = sizeof(seccomp_data);
+        break;
+      case BPF_LD | BPF_IMM:
+        a = insn.k;
+        break;
+      case BPF_LDX | BPF_IMM:
+        x = insn.k;
+        break;
+      case BPF_LD | BPF_MEM:
+        a = mem[insn.k];
+        break;
+      case BPF_LDX | BPF_MEM:
+        x = mem[insn.k];
+        break;
+      case BPF_ST:
+        mem[insn.k] = a;
+        break;
+      case BPF_STX:
+        mem[insn.k] = x;
+        break;
+      case BPF_ALU | BPF_ADD | BPF_K:
+        a += insn.k;
+        break;
+      case BPF_ALU | BPF_ADD | BPF_X:
+        a += x;
+        break;
+      case BPF_ALU | BPF_SUB | BPF_K:
+        a -= insn.k;
+        break;
+      case BPF_ALU | BPF_SUB | BPF_X:
+        a -= x;
+        break;
+      case BPF_ALU | BPF_MUL | BPF_K:
+        a *= insn.k;
+        break;
+      case BPF_ALU | BPF_MUL | BPF_X:
+        a *= x;
+        break;
+      case BPF_ALU | BPF_DIV | BPF_K:
+        a /= insn.k;
+        break;
+      case BPF_ALU | BPF_DIV | BPF_X:
+        if (x == 0) {
+          // The kernel ends the program with a return value of 0.
+          verdict.action = 0;
+          return verdict;
+        }
+        a /= x;
+        break;
+      case BPF_ALU | BPF_AND | BPF_K:
+        a &= insn.k;
+        break;
+      case BPF_ALU | BPF_AND | BPF_X:
+        a &= x;
+        break;
+      case BPF_ALU | BPF_OR | BPF_K:
+        a |= insn.k;
+        break;
+      case BPF_ALU | BPF_OR | BPF_X:
+        a |= x;
+        break;
+      case BPF_ALU | BPF_XOR | BPF_K:
+        a ^= insn.k;
+        break;
+      case BPF_ALU | BPF_XOR | BPF_X:
+        a ^= x;
+        break;
+      case BPF_ALU | BPF_LSH | BPF_K:
+        a <<= insn.k;
+        break;
+      case BPF_ALU | BPF_LSH | BPF_X:
+        a <<= x & 31;
+        break;
+      case BPF_ALU | BPF_RSH | BPF_K:
+        a >>= insn.k;
+        break;
+      case BPF_ALU | BPF_RSH | BPF_X:
+        a >>= x & 31;
+        break;
+      case BPF_ALU | BPF_NEG:
+        a = -a;
+        break;
+      case BPF_MISC | BPF_TAX:
+        x = a;
+        break;
+      case BPF_MISC | BPF_TXA:
+        a = x;
+        break;
+      case BPF_JMP | BPF_JA:
+        pc += insn.k;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+        pc += a == insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_X:
+        pc += a == x ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGT | BPF_K:
+        pc += a > insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGT | BPF_X:
+        pc += a > x ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGE | BPF_K:
+        pc += a >= insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGE | BPF_X:
+        pc += a >= x ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JSET | BPF_K:
+        pc += (a & insn.k) ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JSET | BPF_X:
+        pc += (a & x) ? insn.jt : insn.jf;
+        break;
+      case BPF_RET | BPF_K:
+        verdict.action = insn.k;
+        return verdict;
+      case BPF_RET | BPF_A:
+        verdict.action = a;
+        return verdict;
+      default:
+        // Rejected by Validate().
+        return verdict;
+    }
+  }
+  return verdict;
+}
+
+void Evaluator::EvaluateBatch(const seccomp_data* data, size_t count,
+                              Verdict* verdicts) const {
+  for (size_t i = 0; i < count; ++i) {
+    verdicts[i] = Evaluate(data[i]);
+  }
+}
+
+}  // namespace bpf
+}  // namespace sandbox2
@@ -0,0 +1,70 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Userspace interpreter of seccomp-bpf programs, for replaying recorded
+// syscalls against candidate policies offline, see policy_replay_bin.
+
+#ifndef SANDBOXED_API_SANDBOX2_BPFEVALUATOR_H_
+#define SANDBOXED_API_SANDBOX2_BPFEVALUATOR_H_
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sandbox2 {
+namespace bpf {
+
+// Result of running a program for one syscall.
+struct Verdict {
+  // Return value of the program, a SECCOMP_RET_* action and its data.
+  uint32_t action = 0;
+  // Instructions run, including the return.
+  uint32_t insns = 0;
+};
+
+class Evaluator {
+ public:
+  // Returns whether the kernel would accept 'prog' as a seccomp filter, and
+  // the reason if not in 'error'. Checks the size of the program, opcodes,
+  // jump targets, loads from seccomp_data and scratch memory, and that the
+  // program cannot run past its end.
+  static bool Validate(const std::vector<sock_filter>& prog,
+                       std::string* error);
+
+  // 'prog' must be valid, see Validate().
+  explicit Evaluator(std::vector<sock_filter> prog);
+
+  // Runs the program for 'data'. The scratch memory starts zeroed.
+  Verdict Evaluate(const seccomp_data& data) const;
+
+  // Runs the program for each of the 'count' records in 'data', storing the
+  // results in 'verdicts'. Records are 64 bytes, so that each is a cache line
+  // read exactly once, while the program stays in the L1 cache.
+  void EvaluateBatch(const seccomp_data* data, size_t count,
+                     Verdict* verdicts) const;
+
+  const std::vector<sock_filter>& program() const { return prog_; }
+
+ private:
+  std::vector<sock_filter> prog_;
+};
+
+}  // namespace bpf
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_BPFEVALUATOR_H_
@@ -0,0 +1,146 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/bpfevaluator.h"
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "sandboxed_api/sandbox2/util/bpf_helper.h"
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+
+namespace sandbox2 {
+namespace bpf {
+namespace {
+
+constexpr uint32_t kArch = AUDIT_ARCH_X86_64;
+
+std::vector<sock_filter> TestProgram() {
+  return {
+      /* 0 */ LOAD_ARCH,
+      /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kArch, 1, 0),
+      /* 2 */ TRACE(0),
+      /* 3 */ LOAD_SYSCALL_NR,
+      /* 4 */ SYSCALL(0, ALLOW),
+      // Syscall 1 is allowed if its first argument is 2.
+      /* 6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 3),
+      /* 7 */ ARG_32(0),
+      /* 8 */ JEQ32(2, ALLOW),
+      /* 10 */ LOAD_SYSCALL_NR,
+      /* 11 */ SYSCALL(3, ERRNO(1)),
+      /* 13 */ KILL,
+  };
+}
+
+seccomp_data MakeData(int nr, uint64_t arg0 = 0, uint32_t arch = kArch) {
+  seccomp_data data{};
+  data.nr = nr;
+  data.arch = arch;
+  data.args[0] = arg0;
+  return data;
+}
+
+TEST(BpfEvaluatorTest, ValidatesTestProgram) {
+  std::string error;
+  EXPECT_TRUE(Evaluator::Validate(TestProgram(), &error));
+  EXPECT_THAT(error, IsEmpty());
+}
+
+TEST(BpfEvaluatorTest, ReturnsActionAndInstructions) {
+  Evaluator evaluator(TestProgram());
+
+  Verdict verdict = evaluator.Evaluate(MakeData(0));
+  EXPECT_THAT(verdict.action, Eq(SECCOMP_RET_ALLOW));
+  EXPECT_THAT(verdict.insns, Eq(5));
+
+  verdict = evaluator.Evaluate(MakeData(1, 2));
+  EXPECT_THAT(verdict.action, Eq(SECCOMP_RET_ALLOW));
+  EXPECT_THAT(verdict.insns, Eq(8));
+
+  // Only the lower 32 bits of the argument are checked.
+  EXPECT_THAT(evaluator.Evaluate(MakeData(1, 0x100000002)).action,
+              Eq(SECCOMP_RET_ALLOW));
+  verdict = evaluator.Evaluate(MakeData(1, 3));
+  EXPECT_THAT(verdict.action, Eq(SECCOMP_RET_KILL));
+  EXPECT_THAT(verdict.insns, Eq(10));
+
+  verdict = evaluator.Evaluate(MakeData(3));
+  EXPECT_THAT(verdict.action, Eq(SECCOMP_RET_ERRNO | 1));
+  EXPECT_THAT(verdict.insns, Eq(8));
+
+  verdict = evaluator.Evaluate(MakeData(0, 0, AUDIT_ARCH_I386));
+  EXPECT_THAT(verdict.action, Eq(SECCOMP_RET_TRACE));
+  EXPECT_THAT(verdict.insns, Eq(3));
+}
+
+TEST(BpfEvaluatorTest, EvaluatesBatches) {
+  Evaluator evaluator(TestProgram());
+  std::vector<seccomp_data> data = {MakeData(0), MakeData(1, 2), MakeData(2),
+                                    MakeData(3)};
+  std::vector<Verdict> verdicts(data.size());
+  evaluator.EvaluateBatch(data.data(), data.size(), verdicts.data());
+  for (size_t i = 0; i < data.size(); ++i) {
+    Verdict expected = evaluator.Evaluate(data[i]);
+    EXPECT_THAT(verdicts[i].action, Eq(expected.action));
+    EXPECT_THAT(verdicts[i].insns, Eq(expected.insns));
+  }
+}
+
+TEST(BpfEvaluatorTest, UsesScratchMemoryAndIndexRegister) {
+  Evaluator evaluator({
+      LOAD_SYSCALL_NR,
+      BPF_STMT(BPF_ST, 3),
+      BPF_STMT(BPF_LDX | BPF_MEM, 3),
+      BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  });
+  EXPECT_THAT(evaluator.Evaluate(MakeData(21)).action, Eq(42));
+}
+
+TEST(BpfEvaluatorTest, RejectsInvalidPrograms) {
+  std::string error;
+  EXPECT_FALSE(Evaluator::Validate({}, &error));
+
+  // Jumps past the end.
+  EXPECT_FALSE(Evaluator::Validate(
+      {LOAD_SYSCALL_NR, BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1), ALLOW},
+      &error));
+
+  // Misaligned load.
+  EXPECT_FALSE(Evaluator::Validate({BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+                                    ALLOW},
+                                   &error));
+
+  EXPECT_FALSE(Evaluator::Validate({LOAD_SYSCALL_NR}, &error));
+  EXPECT_THAT(error, HasSubstr("return"));
+
+  // Packet loads are not allowed in seccomp filters.
+  EXPECT_FALSE(Evaluator::Validate({BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+                                    ALLOW},
+                                   &error));
+  EXPECT_THAT(error, HasSubstr("opcode"));
+}
+
+}  // namespace
+}  // namespace bpf
+}  // namespace sandbox2
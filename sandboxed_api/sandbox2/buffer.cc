@@ -14,61 +14,300 @@
 
 #include "sandboxed_api/sandbox2/buffer.h"
 
+#include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <cstdint>
 
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
 
 namespace sandbox2 {
 
-// Creates a new Buffer that is backed by the specified file descriptor.
-sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateFromFd(int fd) {
-  auto buffer = absl::WrapUnique(new Buffer{});
+namespace {
+
+// Usually defined in linux/memfd.h and linux/fcntl.h. Defined here to avoid
+// a dependency on UAPI headers.
+constexpr uint32_t kMfdAllowSealing = 0x0002U;
+constexpr uint32_t kMfdHugetlb = 0x0004U;
+#ifndef F_ADD_SEALS
+constexpr int F_ADD_SEALS = 1024 + 9;
+constexpr int F_GET_SEALS = 1024 + 10;
+constexpr int F_SEAL_SEAL = 0x0001;
+constexpr int F_SEAL_SHRINK = 0x0002;
+constexpr int F_SEAL_GROW = 0x0004;
+constexpr int F_SEAL_WRITE = 0x0008;
+#endif
+
+// Seals which keep the size of a buffer fixed.
+constexpr int kSizeSeals = F_SEAL_SHRINK | F_SEAL_GROW;
 
+// Since Linux 5.14.
+constexpr int kMadvPopulateRead = 22;
+constexpr int kMadvPopulateWrite = 23;
+
+// Sets the memory policy of the pages of the mapping at 'addr' to prefer
+// 'node'. For shared memory, the policy is that of the file.
+sapi::Status PreferNumaNode(void* addr, size_t size, int node) {
+  constexpr int kMaxNodes = 8 * sizeof(unsigned long);  // NOLINT
+  if (node < 0 || node >= kMaxNodes) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Invalid NUMA node: ", node));
+  }
+  unsigned long nodes = 1UL << node;  // NOLINT
+  // The kernel ignores the last bit of maxnode.
+  if (util::Syscall(__NR_mbind, reinterpret_cast<uintptr_t>(addr), size,
+                    MPOL_PREFERRED, reinterpret_cast<uintptr_t>(&nodes),
+                    kMaxNodes + 1, 0) == -1 &&
+      errno != ENOSYS) {
+    return sapi::InternalError(absl::StrCat(
+        "Could not bind buffer to NUMA node ", node, ": ", StrError(errno)));
+  }
+  return sapi::OkStatus();
+}
+
+// Faults in the 'size' bytes at 'addr', instead of MAP_POPULATE when the
+// memory policy has to be set first.
+void Populate(uint8_t* addr, size_t size, bool writable) {
+  if (madvise(addr, size, writable ? kMadvPopulateWrite : kMadvPopulateRead) ==
+      0) {
+    return;
+  }
+  // Reading allocates the pages of shared memory as well.
+  const size_t page_size = getpagesize();
+  for (size_t offset = 0; offset < size; offset += page_size) {
+    static_cast<void>(*reinterpret_cast<volatile uint8_t*>(addr + offset));
+  }
+}
+
+// Returns the size of the file behind 'fd'.
+sapi::StatusOr<uint64_t> GetFileSize(int fd) {
   struct stat stat_buf;
   if (fstat(fd, &stat_buf) != 0) {
     return sapi::InternalError(
         absl::StrCat("Could not stat buffer fd: ", StrError(errno)));
   }
-  size_t size = stat_buf.st_size;
-  int prot = PROT_READ | PROT_WRITE;
+  return stat_buf.st_size;
+}
+
+// Creates a memfd of 'size' bytes, rounded up to the huge page size for
+// 'huge_pages'.
+sapi::StatusOr<int> CreateSizedMemFd(int64_t size, bool huge_pages,
+                                     bool allow_sealing) {
+  uint32_t memfd_flags = 0;
+  if (huge_pages) {
+    memfd_flags |= kMfdHugetlb;
+  }
+  if (allow_sealing) {
+    memfd_flags |= kMfdAllowSealing;
+  }
+  int fd;
+  if (!util::CreateMemFd(&fd, "buffer_file", memfd_flags)) {
+    return sapi::InternalError("Could not create buffer temp file");
+  }
+  if (huge_pages) {
+    // The block size of a hugetlbfs file is the huge page size.
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+      close(fd);
+      return sapi::InternalError(
+          absl::StrCat("Could not stat buffer fd: ", StrError(errno)));
+    }
+    const int64_t page_size = stat_buf.st_blksize;
+    size = (size + page_size - 1) / page_size * page_size;
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return sapi::InternalError(
+        absl::StrCat("Could not extend buffer fd: ", StrError(errno)));
+  }
+  return fd;
+}
+
+}  // namespace
+
+constexpr int Buffer::kAnyNumaNode;
+
+// Creates a new Buffer that is backed by the specified file descriptor.
+sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateFromFd(int fd) {
+  return CreateFromFd(fd, Options());
+}
+
+sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateFromFd(
+    int fd, const Options& options) {
+  auto buffer = absl::WrapUnique(new Buffer{});
+  // Closes the file descriptor on errors.
+  buffer->fd_ = fd;
+
+  if (options.seal) {
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1) {
+      return sapi::InternalError(
+          absl::StrCat("Could not get buffer fd seals: ", StrError(errno)));
+    }
+    if ((seals & kSizeSeals) != kSizeSeals) {
+      return sapi::FailedPreconditionError("Buffer size is not sealed");
+    }
+  }
+  SAPI_ASSIGN_OR_RETURN(const uint64_t file_size, GetFileSize(fd));
+  size_t size = file_size;
+  size_t mapping_size = file_size;
+  if (options.window_size != 0) {
+    const size_t page_size = getpagesize();
+    mapping_size =
+        (options.window_size + page_size - 1) / page_size * page_size;
+    size = std::min<uint64_t>(options.window_size, file_size);
+    // Windows are typically slid through the file front to back.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  int prot = options.read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  const bool numa = options.numa_node != kAnyNumaNode;
   int flags = MAP_SHARED;
+  if (options.populate && !numa) {
+    flags |= MAP_POPULATE;
+  }
   off_t offset = 0;
-  buffer->buf_ =
-      reinterpret_cast<uint8_t*>(mmap(nullptr, size, prot, flags, fd, offset));
-  if (buffer->buf_ == MAP_FAILED) {
+  void* buf = mmap(nullptr, mapping_size, prot, flags, fd, offset);
+  if (buf == MAP_FAILED) {
     return sapi::InternalError(
         absl::StrCat("Could not map buffer fd: ", StrError(errno)));
   }
-  buffer->fd_ = fd;
+  buffer->buf_ = reinterpret_cast<uint8_t*>(buf);
   buffer->size_ = size;
+  buffer->mapping_size_ = mapping_size;
+  buffer->prot_ = prot;
+  buffer->numa_node_ = options.numa_node;
+  buffer->window_size_ = options.window_size;
+  if (numa && size != 0) {
+    SAPI_RETURN_IF_ERROR(PreferNumaNode(buf, size, options.numa_node));
+    if (options.populate) {
+      Populate(buffer->buf_, size, !options.read_only);
+    }
+  }
+  // Only advice, there is nothing to do if the kernel does not follow it.
+  if (options.transparent_huge_pages) {
+    madvise(buf, mapping_size, MADV_HUGEPAGE);
+  }
+  if (options.window_size != 0 && size != 0) {
+    madvise(buf, size, MADV_WILLNEED);
+  }
   return buffer;
 }
 
+sapi::Status Buffer::MoveWindow(uint64_t offset) {
+  if (!windowed()) {
+    return sapi::FailedPreconditionError("Buffer is not windowed");
+  }
+  if (offset % getpagesize() != 0) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Window offset is not page-aligned: ", offset));
+  }
+  // The file may have grown since the last window was mapped.
+  SAPI_ASSIGN_OR_RETURN(const uint64_t file_size, GetFileSize(fd_));
+  if (offset > file_size) {
+    return sapi::OutOfRangeError(
+        absl::StrCat("Window offset ", offset, " beyond the end of the file"));
+  }
+  void* buf = mmap(buf_, mapping_size_, prot_, MAP_SHARED | MAP_FIXED, fd_,
+                   offset);
+  if (buf == MAP_FAILED) {
+    return sapi::InternalError(
+        absl::StrCat("Could not remap buffer fd: ", StrError(errno)));
+  }
+  window_offset_ = offset;
+  size_ = std::min<uint64_t>(window_size_, file_size - offset);
+  if (size_ != 0 && numa_node_ != kAnyNumaNode) {
+    // The policy was only set for the part of the file the old window mapped.
+    SAPI_RETURN_IF_ERROR(PreferNumaNode(buf_, size_, numa_node_));
+  }
+  if (size_ != 0) {
+    madvise(buf_, size_, MADV_WILLNEED);
+  }
+  return sapi::OkStatus();
+}
+
 // Creates a new Buffer of the specified size, backed by a temporary file that
 // will be immediately deleted.
 sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateWithSize(int64_t size) {
-  int fd;
-  if (!util::CreateMemFd(&fd)) {
-    return sapi::InternalError("Could not create buffer temp file");
+  return CreateWithSize(size, Options());
+}
+
+sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateWithSize(
+    int64_t size, const Options& options) {
+  SAPI_ASSIGN_OR_RETURN(
+      int fd, CreateSizedMemFd(size, options.huge_pages,
+                               /*allow_sealing=*/options.seal));
+  if (options.seal && fcntl(fd, F_ADD_SEALS, kSizeSeals | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return sapi::InternalError(
+        absl::StrCat("Could not seal buffer fd: ", StrError(errno)));
   }
-  if (ftruncate(fd, size) != 0) {
+  return CreateFromFd(fd, options);
+}
+
+sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateReadOnly(
+    int64_t size, const std::function<sapi::Status(uint8_t* data)>& fill) {
+  return CreateReadOnly(size, fill, Options());
+}
+
+sapi::StatusOr<std::unique_ptr<Buffer>> Buffer::CreateReadOnly(
+    int64_t size, const std::function<sapi::Status(uint8_t* data)>& fill,
+    Options options) {
+  SAPI_ASSIGN_OR_RETURN(int fd, CreateSizedMemFd(size, options.huge_pages,
+                                                 /*allow_sealing=*/true));
+  // Rounded up for huge pages.
+  sapi::StatusOr<uint64_t> file_size = GetFileSize(fd);
+  if (!file_size.ok()) {
+    close(fd);
+    return file_size.status();
+  }
+  if (file_size.ValueOrDie() != 0) {
+    void* data = mmap(nullptr, file_size.ValueOrDie(), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return sapi::InternalError(
+          absl::StrCat("Could not map buffer fd: ", StrError(errno)));
+    }
+    // Before the contents are written.
+    sapi::Status status =
+        options.numa_node != kAnyNumaNode
+            ? PreferNumaNode(data, file_size.ValueOrDie(), options.numa_node)
+            : sapi::OkStatus();
+    if (status.ok()) {
+      status = fill(reinterpret_cast<uint8_t*>(data));
+    }
+    // The write seal requires that no writable mapping remains.
+    munmap(data, file_size.ValueOrDie());
+    if (!status.ok()) {
+      close(fd);
+      return status;
+    }
+  }
+  if (fcntl(fd, F_ADD_SEALS, kSizeSeals | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    close(fd);
     return sapi::InternalError(
-        absl::StrCat("Could not extend buffer fd: ", StrError(errno)));
+        absl::StrCat("Could not seal buffer fd: ", StrError(errno)));
   }
-  return CreateFromFd(fd);
+  options.seal = true;
+  options.read_only = true;
+  options.window_size = 0;
+  return CreateFromFd(fd, options);
 }
 
 Buffer::~Buffer() {
   if (buf_ != nullptr) {
-    munmap(buf_, size_);
+    munmap(buf_, mapping_size_);
   }
   if (fd_ != -1) {
     close(fd_);
@@ -17,8 +17,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
 
+#include "sandboxed_api/util/status.h"
 #include "sandboxed_api/util/statusor.h"
 
 namespace sandbox2 {
@@ -31,6 +33,40 @@ class Buffer final {
  public:
   ~Buffer();
 
+  // Options::numa_node which leaves the placement of the pages to the kernel.
+  static constexpr int kAnyNumaNode = -1;
+
+  struct Options {
+    // Backs the buffer with huge pages (MFD_HUGETLB). The size is rounded up
+    // to a multiple of the huge page size. Fails unless the system has huge
+    // pages reserved. Only used when creating a buffer.
+    bool huge_pages = false;
+    // Asks for transparent huge pages (MADV_HUGEPAGE). Whether the kernel uses
+    // them for shared memory depends on its shmem_enabled setting.
+    bool transparent_huge_pages = false;
+    // Faults in the whole mapping right away (MAP_POPULATE), instead of on
+    // first touch.
+    bool populate = false;
+    // NUMA node the pages of the buffer are preferably allocated on
+    // (MPOL_PREFERRED), e.g. the one the consuming sandboxee runs on, see
+    // util::GetNumaNodeOfAffinity(). The policy belongs to the shared memory
+    // object and is set before anything is populated, so pages first touched
+    // by the sandboxee follow it as well. Pages allocated before, e.g. of an
+    // existing file, stay where they are. Ignored by kernels without NUMA
+    // support.
+    int numa_node = kAnyNumaNode;
+    // Seals the size of a new buffer, so that neither side can truncate it
+    // under the other's mapping, which would make accesses fault with SIGBUS.
+    // When mapping an existing buffer, requires that its size is sealed.
+    bool seal = false;
+    // Maps the file read-only, for descriptors not opened for writing.
+    bool read_only = false;
+    // Maps only a window of this many bytes of the file, starting at offset 0,
+    // instead of the whole file. See MoveWindow(). Only used when mapping an
+    // existing file.
+    size_t window_size = 0;
+  };
+
   Buffer(const Buffer&) = delete;
   Buffer& operator=(const Buffer&) = delete;
 
@@ -38,17 +74,51 @@ class Buffer final {
   // The Buffer takes ownership of the descriptor and will close it when
   // destroyed.
   static sapi::StatusOr<std::unique_ptr<Buffer>> CreateFromFd(int fd);
+  static sapi::StatusOr<std::unique_ptr<Buffer>> CreateFromFd(
+      int fd, const Options& options);
 
   // Creates a new Buffer of the specified size, backed by a temporary file that
   // will be immediately deleted.
   static sapi::StatusOr<std::unique_ptr<Buffer>> CreateWithSize(int64_t size);
+  static sapi::StatusOr<std::unique_ptr<Buffer>> CreateWithSize(
+      int64_t size, const Options& options);
+
+  // Creates a read-only buffer of the specified size, whose contents 'fill'
+  // writes once, e.g. a model loaded from disk. The file is then sealed
+  // against writes and resizing, so that it can be mapped into any number of
+  // sandboxees which cannot change it under each other, see
+  // sapi::SandboxPool::AddSharedData(). Options::seal and read_only are
+  // implied.
+  static sapi::StatusOr<std::unique_ptr<Buffer>> CreateReadOnly(
+      int64_t size, const std::function<sapi::Status(uint8_t* data)>& fill);
+  static sapi::StatusOr<std::unique_ptr<Buffer>> CreateReadOnly(
+      int64_t size, const std::function<sapi::Status(uint8_t* data)>& fill,
+      Options options);
 
-  // Returns a pointer to the buffer, which is read/write.
+  // Returns a pointer to the buffer, which is read/write unless it was mapped
+  // with Options::read_only. For windowed buffers, this is the start of the
+  // current window.
   uint8_t* data() const { return buf_; }
 
-  // Gets the size of the buffer in bytes.
+  // Gets the size of the buffer in bytes. For windowed buffers, this is the
+  // part of the current window which lies within the file.
   size_t size() const { return size_; }
 
+  // Returns whether only a window of the file is mapped, see
+  // Options::window_size.
+  bool windowed() const { return window_size_ != 0; }
+
+  // Returns the offset of the current window in the file, zero unless the
+  // buffer is windowed.
+  uint64_t window_offset() const { return window_offset_; }
+
+  // Slides the window of a windowed buffer to 'offset', which must be a
+  // multiple of the page size. The new window replaces the old one at the
+  // same address, which stays valid. Asks the kernel to read the new window
+  // ahead. The sandboxee slides its own mapping of the file with
+  // sapi::RPCChannel::MapSharedBufferWindow().
+  sapi::Status MoveWindow(uint64_t offset);
+
   // Gets the file descriptor backing the buffer.
   int fd() const { return fd_; }
 
@@ -58,6 +128,13 @@ class Buffer final {
   uint8_t* buf_ = nullptr;
   int fd_ = -1;
   size_t size_ = 0;
+  // Length of the mapping, which may extend beyond the end of the file for
+  // windowed buffers.
+  size_t mapping_size_ = 0;
+  int prot_ = 0;
+  int numa_node_ = kAnyNumaNode;
+  size_t window_size_ = 0;
+  uint64_t window_offset_ = 0;
 };
 
 }  // namespace sandbox2
@@ -0,0 +1,147 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/buffer_pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sandbox2 {
+
+BufferPool::BufferPool() : BufferPool(Options()) {}
+
+BufferPool::BufferPool(const Options& options) : options_(options) {
+  size_t num_classes = 0;
+  if (options_.min_size > 0) {
+    for (size_t size = options_.min_size; size <= options_.max_size;
+         size <<= 1) {
+      ++num_classes;
+      if (size > options_.max_size / 2) {
+        break;
+      }
+    }
+  }
+  classes_.resize(num_classes);
+}
+
+size_t BufferPool::GetClassSize(size_t size) const {
+  if (options_.min_size == 0 || options_.min_size > options_.max_size ||
+      size > options_.max_size) {
+    return 0;
+  }
+  size_t class_size = options_.min_size;
+  while (class_size < size) {
+    if (class_size > options_.max_size / 2) {
+      return 0;
+    }
+    class_size <<= 1;
+  }
+  return class_size;
+}
+
+size_t BufferPool::ClassIndex(size_t size) const {
+  size_t index = 0;
+  for (size_t class_size = options_.min_size; class_size < size;
+       class_size <<= 1) {
+    ++index;
+  }
+  return index;
+}
+
+sapi::StatusOr<std::unique_ptr<Buffer>> BufferPool::Acquire(size_t size) {
+  const size_t class_size = GetClassSize(size);
+  if (class_size == 0) {
+    return Buffer::CreateWithSize(size);
+  }
+  {
+    absl::MutexLock lock(&mutex_);
+    auto& idle = classes_[ClassIndex(class_size)].idle;
+    if (!idle.empty()) {
+      std::unique_ptr<Buffer> buffer = std::move(idle.back());
+      idle.pop_back();
+      return buffer;
+    }
+  }
+  return Buffer::CreateWithSize(class_size, options_.buffer_options);
+}
+
+void BufferPool::Release(std::unique_ptr<Buffer> buffer) {
+  if (buffer == nullptr || GetClassSize(buffer->size()) != buffer->size()) {
+    return;
+  }
+  // Scrubbing happens outside of the lock, it is the expensive part.
+  ScrubBuffer(buffer.get());
+  absl::MutexLock lock(&mutex_);
+  SizeClass& size_class = classes_[ClassIndex(buffer->size())];
+  if (size_class.idle.size() <
+      std::max(options_.max_idle, size_class.reserved)) {
+    size_class.idle.push_back(std::move(buffer));
+  }
+}
+
+sapi::Status BufferPool::Reserve(size_t size, int count) {
+  const size_t class_size = GetClassSize(size);
+  if (class_size == 0) {
+    return sapi::InvalidArgumentError("Buffer size is not pooled");
+  }
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  for (int i = 0; i < count; ++i) {
+    SAPI_ASSIGN_OR_RETURN(std::unique_ptr<Buffer> buffer,
+                          Buffer::CreateWithSize(class_size,
+                                                 options_.buffer_options));
+    buffers.push_back(std::move(buffer));
+  }
+  absl::MutexLock lock(&mutex_);
+  SizeClass& size_class = classes_[ClassIndex(class_size)];
+  size_class.reserved += buffers.size();
+  for (auto& buffer : buffers) {
+    size_class.idle.push_back(std::move(buffer));
+  }
+  return sapi::OkStatus();
+}
+
+std::vector<const Buffer*> BufferPool::GetIdleBuffers() const {
+  std::vector<const Buffer*> buffers;
+  absl::MutexLock lock(&mutex_);
+  for (const SizeClass& size_class : classes_) {
+    for (const auto& buffer : size_class.idle) {
+      buffers.push_back(buffer.get());
+    }
+  }
+  return buffers;
+}
+
+void BufferPool::ScrubBuffer(Buffer* buffer) const {
+  switch (options_.scrub) {
+    case Scrub::kNone:
+      break;
+    case Scrub::kZero:
+      memset(buffer->data(), 0, buffer->size());
+      break;
+    case Scrub::kRelease:
+      if (madvise(buffer->data(), buffer->size(), MADV_REMOVE) != 0) {
+        PLOG(WARNING) << "madvise(MADV_REMOVE), zeroing the buffer instead";
+        memset(buffer->data(), 0, buffer->size());
+      }
+      break;
+  }
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,111 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::BufferPool class recycles sandbox2::Buffer objects, so that a
+// buffer needed for a single request does not have to be created, resized and
+// mapped every time.
+
+#ifndef SANDBOXED_API_SANDBOX2_BUFFER_POOL_H_
+#define SANDBOXED_API_SANDBOX2_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+class BufferPool final {
+ public:
+  // What happens to the contents of a buffer when it is returned.
+  enum class Scrub {
+    // The contents are kept, the next user sees them.
+    kNone,
+    // The buffer is zero-filled, its memory stays allocated.
+    kZero,
+    // The memory is released with MADV_REMOVE and reads as zeros. MADV_DONTNEED
+    // would keep the contents of a shared mapping.
+    kRelease,
+  };
+
+  struct Options {
+    // Size of the smallest size class. The other classes are twice as large as
+    // their predecessor.
+    size_t min_size = 4096;
+    // Buffers larger than this are not pooled.
+    size_t max_size = 64 << 20;
+    // Most idle buffers kept per size class, see also Reserve().
+    size_t max_idle = 8;
+    Scrub scrub = Scrub::kRelease;
+    // Used to create the pooled buffers. With huge pages, min_size should be
+    // at least the huge page size. Pre-faulted buffers stay so only with
+    // Scrub::kNone or Scrub::kZero.
+    Buffer::Options buffer_options;
+  };
+
+  BufferPool();
+  explicit BufferPool(const Options& options);
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Returns a buffer of at least 'size' bytes, an idle one if there is one in
+  // the size class of 'size'. New buffers are zero-filled, recycled ones as
+  // well unless the pool uses Scrub::kNone.
+  sapi::StatusOr<std::unique_ptr<Buffer>> Acquire(size_t size);
+
+  // Returns 'buffer' to the pool. Buffers not matching a size class, and those
+  // beyond the idle limit of their class, are destroyed.
+  void Release(std::unique_ptr<Buffer> buffer);
+
+  // Creates 'count' idle buffers in the size class of 'size'. These are kept
+  // even beyond Options::max_idle, so that they can be shared with a sandboxee
+  // once, see GetIdleBuffers().
+  sapi::Status Reserve(size_t size, int count);
+
+  // Returns the buffers currently idle in the pool. They stay owned by the
+  // pool.
+  std::vector<const Buffer*> GetIdleBuffers() const;
+
+  // Returns the size of the size class of 'size', or 0 if such buffers are not
+  // pooled.
+  size_t GetClassSize(size_t size) const;
+
+ private:
+  struct SizeClass {
+    std::vector<std::unique_ptr<Buffer>> idle;
+    // Buffers created by Reserve(), kept regardless of Options::max_idle.
+    size_t reserved = 0;
+  };
+
+  // Index of the size class of 'size', which must be pooled.
+  size_t ClassIndex(size_t size) const;
+
+  // Applies Options::scrub to 'buffer'.
+  void ScrubBuffer(Buffer* buffer) const;
+
+  const Options options_;
+
+  mutable absl::Mutex mutex_;
+  std::vector<SizeClass> classes_ GUARDED_BY(mutex_);
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_BUFFER_POOL_H_
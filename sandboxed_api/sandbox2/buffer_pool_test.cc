@@ -0,0 +1,126 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/buffer_pool.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::Ne;
+using ::testing::SizeIs;
+using ::testing::UnorderedElementsAre;
+
+namespace sandbox2 {
+namespace {
+
+BufferPool::Options SmallPool(BufferPool::Scrub scrub) {
+  BufferPool::Options options;
+  options.min_size = 4096;
+  options.max_size = 64 << 10;
+  options.max_idle = 2;
+  options.scrub = scrub;
+  return options;
+}
+
+TEST(BufferPoolTest, RoundsUpToSizeClasses) {
+  BufferPool pool(SmallPool(BufferPool::Scrub::kNone));
+  EXPECT_THAT(pool.GetClassSize(0), Eq(4096));
+  EXPECT_THAT(pool.GetClassSize(4096), Eq(4096));
+  EXPECT_THAT(pool.GetClassSize(4097), Eq(8192));
+  EXPECT_THAT(pool.GetClassSize(64 << 10), Eq(64 << 10));
+  EXPECT_THAT(pool.GetClassSize((64 << 10) + 1), Eq(0));
+
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> buffer,
+                            pool.Acquire(5000));
+  EXPECT_THAT(buffer->size(), Eq(8192));
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> large,
+                            pool.Acquire(100000));
+  EXPECT_THAT(large->size(), Eq(100000));
+  pool.Release(std::move(large));
+  EXPECT_THAT(pool.GetIdleBuffers(), IsEmpty());
+}
+
+TEST(BufferPoolTest, RecyclesBuffers) {
+  BufferPool pool(SmallPool(BufferPool::Scrub::kNone));
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> buffer,
+                            pool.Acquire(4096));
+  const Buffer* raw = buffer.get();
+  buffer->data()[0] = 42;
+  pool.Release(std::move(buffer));
+
+  SAPI_ASSERT_OK_AND_ASSIGN(buffer, pool.Acquire(1000));
+  EXPECT_THAT(buffer.get(), Eq(raw));
+  EXPECT_THAT(buffer->data()[0], Eq(42));
+}
+
+TEST(BufferPoolTest, ScrubsReturnedBuffers) {
+  for (auto scrub : {BufferPool::Scrub::kZero, BufferPool::Scrub::kRelease}) {
+    BufferPool pool(SmallPool(scrub));
+    SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> buffer,
+                              pool.Acquire(8192));
+    buffer->data()[0] = 1;
+    buffer->data()[8191] = 2;
+    pool.Release(std::move(buffer));
+
+    SAPI_ASSERT_OK_AND_ASSIGN(buffer, pool.Acquire(8192));
+    EXPECT_THAT(buffer->data()[0], Eq(0));
+    EXPECT_THAT(buffer->data()[8191], Eq(0));
+  }
+}
+
+TEST(BufferPoolTest, KeepsAtMostMaxIdle) {
+  BufferPool pool(SmallPool(BufferPool::Scrub::kNone));
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  for (int i = 0; i < 4; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> buffer,
+                              pool.Acquire(4096));
+    buffers.push_back(std::move(buffer));
+  }
+  for (auto& buffer : buffers) {
+    pool.Release(std::move(buffer));
+  }
+  EXPECT_THAT(pool.GetIdleBuffers(), SizeIs(2));
+}
+
+TEST(BufferPoolTest, KeepsReservedBuffers) {
+  BufferPool pool(SmallPool(BufferPool::Scrub::kNone));
+  ASSERT_THAT(pool.Reserve(4096, 3), sapi::IsOk());
+  EXPECT_THAT(pool.Reserve(1 << 20, 1), Ne(sapi::OkStatus()));
+  std::vector<const Buffer*> reserved = pool.GetIdleBuffers();
+  ASSERT_THAT(reserved, SizeIs(3));
+
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  for (int i = 0; i < 3; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Buffer> buffer,
+                              pool.Acquire(4096));
+    buffers.push_back(std::move(buffer));
+  }
+  EXPECT_THAT(pool.GetIdleBuffers(), IsEmpty());
+  for (auto& buffer : buffers) {
+    pool.Release(std::move(buffer));
+  }
+  EXPECT_THAT(pool.GetIdleBuffers(),
+              UnorderedElementsAre(reserved[0], reserved[1], reserved[2]));
+}
+
+}  // namespace
+}  // namespace sandbox2
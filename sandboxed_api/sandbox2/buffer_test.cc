@@ -14,11 +14,15 @@
 
 #include "sandboxed_api/sandbox2/buffer.h"
 
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
@@ -36,6 +40,8 @@
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/testing.h"
+#include "sandboxed_api/sandbox2/util.h"
+#include "sandboxed_api/util/canonical_errors.h"
 #include "sandboxed_api/util/status_matchers.h"
 
 using ::testing::Eq;
@@ -61,6 +67,152 @@ TEST(BufferTest, TestImplementation) {
   }
 }
 
+TEST(BufferTest, SealsAndPopulates) {
+  constexpr int kSize = 1 << 20;
+  Buffer::Options options;
+  options.populate = true;
+  options.seal = true;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto buffer,
+                            Buffer::CreateWithSize(kSize, options));
+  EXPECT_THAT(buffer->size(), Eq(kSize));
+  EXPECT_THAT(ftruncate(buffer->fd(), kSize / 2), Eq(-1));
+  EXPECT_THAT(errno, Eq(EPERM));
+
+  // The receiving side can insist on a sealed buffer.
+  SAPI_ASSERT_OK_AND_ASSIGN(auto mapped,
+                            Buffer::CreateFromFd(dup(buffer->fd()), options));
+  buffer->data()[kSize - 1] = 'X';
+  EXPECT_THAT(mapped->data()[kSize - 1], Eq('X'));
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto unsealed, Buffer::CreateWithSize(kSize));
+  EXPECT_THAT(Buffer::CreateFromFd(dup(unsealed->fd()), options).status(),
+              sapi::StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
+TEST(BufferTest, AllocatesOnNumaNode) {
+  constexpr int kSize = 1 << 20;
+  // Any node will do, the last one is the least likely to be the default.
+  std::map<int, std::vector<int>> nodes = util::GetNumaNodes();
+  const int node = nodes.empty() ? 0 : nodes.rbegin()->first;
+  Buffer::Options options;
+  options.populate = true;
+  options.numa_node = node;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto buffer,
+                            Buffer::CreateWithSize(kSize, options));
+  buffer->data()[kSize - 1] = 'X';
+  if (nodes.size() > 1) {
+    int page_node = -1;
+    ASSERT_THAT(syscall(__NR_get_mempolicy, &page_node, nullptr, 0,
+                        buffer->data(), MPOL_F_NODE | MPOL_F_ADDR),
+                Eq(0));
+    EXPECT_THAT(page_node, Eq(node));
+  }
+
+  options.numa_node = 1 << 20;
+  EXPECT_THAT(Buffer::CreateWithSize(kSize, options).status(),
+              sapi::StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
+TEST(BufferTest, CreatesReadOnlyBuffers) {
+  constexpr int kSize = 1 << 20;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto buffer,
+                            Buffer::CreateReadOnly(kSize, [](uint8_t* data) {
+                              data[kSize - 1] = 'X';
+                              return sapi::OkStatus();
+                            }));
+  EXPECT_THAT(buffer->size(), Eq(kSize));
+  EXPECT_THAT(buffer->data()[kSize - 1], Eq('X'));
+  // Neither writable mappings nor resizing are possible.
+  EXPECT_THAT(mmap(nullptr, kSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   buffer->fd(), 0),
+              Eq(MAP_FAILED));
+  EXPECT_THAT(ftruncate(buffer->fd(), kSize / 2), Eq(-1));
+
+  EXPECT_THAT(Buffer::CreateReadOnly(kSize,
+                                     [](uint8_t*) {
+                                       return sapi::UnavailableError("Gone");
+                                     })
+                  .status(),
+              sapi::StatusIs(sapi::StatusCode::kUnavailable));
+}
+
+TEST(BufferTest, SlidesWindows) {
+  const size_t page_size = getpagesize();
+  const size_t file_size = 10 * page_size + 100;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto file, Buffer::CreateWithSize(file_size));
+  for (size_t i = 0; i < file_size; i += page_size) {
+    file->data()[i] = static_cast<uint8_t>(i / page_size);
+  }
+
+  Buffer::Options options;
+  options.read_only = true;
+  options.window_size = 4 * page_size;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto window,
+                            Buffer::CreateFromFd(dup(file->fd()), options));
+  EXPECT_THAT(window->windowed(), IsTrue());
+  EXPECT_THAT(window->size(), Eq(4 * page_size));
+  const uint8_t* data = window->data();
+  EXPECT_THAT(data[page_size], Eq(1));
+
+  // The window stays at the same address.
+  ASSERT_THAT(window->MoveWindow(4 * page_size), sapi::IsOk());
+  EXPECT_THAT(window->data(), Eq(data));
+  EXPECT_THAT(window->window_offset(), Eq(4 * page_size));
+  EXPECT_THAT(data[0], Eq(4));
+
+  // The last window is cut off at the end of the file.
+  ASSERT_THAT(window->MoveWindow(8 * page_size), sapi::IsOk());
+  EXPECT_THAT(window->size(), Eq(2 * page_size + 100));
+  EXPECT_THAT(data[2 * page_size], Eq(10));
+
+  EXPECT_THAT(window->MoveWindow(1),
+              sapi::StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(window->MoveWindow(20 * page_size),
+              sapi::StatusIs(sapi::StatusCode::kOutOfRange));
+  EXPECT_THAT(file->MoveWindow(0),
+              sapi::StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
+// Returns the byte at 'offset' of the files in the window tests, which
+// differs between neighbouring pages and within them.
+uint8_t WindowTestByte(size_t offset) {
+  return static_cast<uint8_t>(offset * 7 + offset / 4096);
+}
+
+TEST(BufferTest, MovedWindowsShowTheirPartOfTheFile) {
+  const size_t page_size = getpagesize();
+  const size_t file_size = 10 * page_size + 100;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto file, Buffer::CreateWithSize(file_size));
+  for (size_t i = 0; i < file_size; ++i) {
+    file->data()[i] = WindowTestByte(i);
+  }
+
+  Buffer::Options options;
+  options.window_size = 4 * page_size;
+  SAPI_ASSERT_OK_AND_ASSIGN(auto window,
+                            Buffer::CreateFromFd(dup(file->fd()), options));
+  // Forward, back to the start, to the cut-off end and back into the middle.
+  for (size_t page : {4, 0, 8, 3}) {
+    const uint64_t offset = page * page_size;
+    ASSERT_THAT(window->MoveWindow(offset), sapi::IsOk());
+    ASSERT_THAT(window->size(),
+                Eq(std::min<size_t>(4 * page_size, file_size - offset)));
+    for (size_t i = 0; i < window->size(); ++i) {
+      ASSERT_THAT(window->data()[i], Eq(WindowTestByte(offset + i)))
+          << "Window at page " << page << ", byte " << i;
+    }
+  }
+
+  // Writes through a window end up in the file and are seen again by later
+  // windows over the same part.
+  window->data()[page_size] = 0xab;
+  EXPECT_THAT(file->data()[4 * page_size], Eq(0xab));
+  ASSERT_THAT(window->MoveWindow(0), sapi::IsOk());
+  ASSERT_THAT(window->MoveWindow(4 * page_size), sapi::IsOk());
+  EXPECT_THAT(window->data()[0], Eq(0xab));
+  EXPECT_THAT(window->data()[1], Eq(WindowTestByte(4 * page_size + 1)));
+}
+
 std::unique_ptr<Policy> BufferTestcasePolicy() {
   auto s2p = PolicyBuilder()
                  .DisableNamespaces()
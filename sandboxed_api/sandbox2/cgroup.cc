@@ -0,0 +1,275 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::Cgroup class.
+
+#include "sandboxed_api/sandbox2/cgroup.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <vector>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sandbox2 {
+
+namespace {
+
+// Returns the value of 'key' in the "key value" lines of 'contents', 0 if
+// there is none.
+uint64_t GetKeyedValue(absl::string_view contents, absl::string_view key) {
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    uint64_t value;
+    if (fields.size() == 2 && fields[0] == key &&
+        absl::SimpleAtoi(fields[1], &value)) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+// Returns the sum of 'key' over the devices of io.stat, whose lines are like
+// "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0".
+uint64_t GetIoStatSum(absl::string_view contents, absl::string_view key) {
+  uint64_t sum = 0;
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    for (absl::string_view field :
+         absl::StrSplit(line, ' ', absl::SkipEmpty())) {
+      uint64_t value;
+      if (absl::ConsumePrefix(&field, key) &&
+          absl::ConsumePrefix(&field, "=") &&
+          absl::SimpleAtoi(field, &value)) {
+        sum += value;
+      }
+    }
+  }
+  return sum;
+}
+
+}  // namespace
+
+sapi::StatusOr<std::unique_ptr<Cgroup>> Cgroup::Create(
+    const std::string& parent, const std::string& name) {
+  std::string path = file::JoinPath(parent, name);
+  if (mkdir(path.c_str(), 0700) == -1) {
+    return sapi::InternalError(
+        absl::StrCat("mkdir(", path, ") failed: ", StrError(errno)));
+  }
+  return absl::WrapUnique(new Cgroup(std::move(path)));
+}
+
+Cgroup::~Cgroup() {
+  if (rmdir(path_.c_str()) == -1) {
+    PLOG(ERROR) << "rmdir(" << path_ << ")";
+  }
+}
+
+sapi::Status Cgroup::Write(const std::string& file, const std::string& value) {
+  const std::string path = file::JoinPath(path_, file);
+  file_util::fileops::FDCloser fd(open(path.c_str(), O_WRONLY | O_CLOEXEC));
+  if (fd.get() == -1) {
+    return sapi::InternalError(
+        absl::StrCat("open(", path, ") failed: ", StrError(errno)));
+  }
+  // The kernel reports invalid values as errors of write().
+  if (write(fd.get(), value.data(), value.size()) !=
+      static_cast<ssize_t>(value.size())) {
+    return sapi::InternalError(absl::StrCat("writing '", value, "' to ", path,
+                                            " failed: ", StrError(errno)));
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Cgroup::ApplyLimits(const Limits& limits) {
+  if (limits.cgroup_memory_max() != 0) {
+    SAPI_RETURN_IF_ERROR(
+        Write("memory.max", absl::StrCat(limits.cgroup_memory_max())));
+  }
+  if (limits.cgroup_cpu_quota() != absl::InfiniteDuration()) {
+    SAPI_RETURN_IF_ERROR(Write(
+        "cpu.max",
+        absl::StrCat(absl::ToInt64Microseconds(limits.cgroup_cpu_quota()), " ",
+                     absl::ToInt64Microseconds(limits.cgroup_cpu_period()))));
+  }
+  if (!limits.cgroup_io_max().empty()) {
+    // The kernel takes one device per write.
+    for (absl::string_view line :
+         absl::StrSplit(limits.cgroup_io_max(), '\n', absl::SkipEmpty())) {
+      SAPI_RETURN_IF_ERROR(Write("io.max", std::string(line)));
+    }
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status Cgroup::AddProcess(pid_t pid) {
+  return Write("cgroup.procs", absl::StrCat(pid));
+}
+
+bool Cgroup::IsPopulated() const {
+  std::string events;
+  if (!file::GetContents(file::JoinPath(path_, "cgroup.events"), &events,
+                         file::Defaults())
+           .ok()) {
+    return false;
+  }
+  return GetKeyedValue(events, "populated") != 0;
+}
+
+sapi::Status Cgroup::KillAll() { return Write("cgroup.kill", "1"); }
+
+sapi::Status Cgroup::Kill(absl::Duration timeout) {
+  if (!IsPopulated()) {
+    return sapi::OkStatus();
+  }
+  // Without cgroup.kill, kill the processes one by one. Processes forking in
+  // the meantime are caught by the next round.
+  const bool kill_file = KillAll().ok();
+  const absl::Time deadline = absl::Now() + timeout;
+  do {
+    if (!kill_file) {
+      std::string procs;
+      file::GetContents(file::JoinPath(path_, "cgroup.procs"), &procs,
+                        file::Defaults())
+          .IgnoreError();
+      for (absl::string_view line :
+           absl::StrSplit(procs, '\n', absl::SkipEmpty())) {
+        pid_t pid;
+        if (absl::SimpleAtoi(line, &pid)) {
+          kill(pid, SIGKILL);
+        }
+      }
+    }
+    if (!IsPopulated()) {
+      return sapi::OkStatus();
+    }
+    absl::SleepFor(absl::Milliseconds(1));
+  } while (absl::Now() < deadline);
+  return sapi::DeadlineExceededError(
+      absl::StrCat("Processes left in cgroup ", path_));
+}
+
+Result::CgroupStats Cgroup::GetStats() const {
+  Result::CgroupStats stats;
+  auto read = [this](const char* file) {
+    std::string contents;
+    file::GetContents(file::JoinPath(path_, file), &contents, file::Defaults())
+        .IgnoreError();
+    return contents;
+  };
+  ParseCpuStat(read("cpu.stat"), &stats);
+  const std::string memory_peak = read("memory.peak");
+  if (!absl::SimpleAtoi(absl::StripAsciiWhitespace(memory_peak),
+                        &stats.memory_peak)) {
+    stats.memory_peak = 0;
+  }
+  ParseMemoryStat(read("memory.stat"), &stats);
+  const std::string cpu_pressure = read("cpu.pressure");
+  stats.cpu_some_stall = ParseStallTime(cpu_pressure, "some");
+  const std::string memory_pressure = read("memory.pressure");
+  stats.memory_some_stall = ParseStallTime(memory_pressure, "some");
+  stats.memory_full_stall = ParseStallTime(memory_pressure, "full");
+  const std::string io_pressure = read("io.pressure");
+  stats.io_some_stall = ParseStallTime(io_pressure, "some");
+  stats.io_full_stall = ParseStallTime(io_pressure, "full");
+  return stats;
+}
+
+void Cgroup::ParseCpuStat(absl::string_view cpu_stat,
+                          Result::CgroupStats* stats) {
+  stats->cpu_time = absl::Microseconds(GetKeyedValue(cpu_stat, "usage_usec"));
+  stats->user_time = absl::Microseconds(GetKeyedValue(cpu_stat, "user_usec"));
+  stats->system_time =
+      absl::Microseconds(GetKeyedValue(cpu_stat, "system_usec"));
+}
+
+void Cgroup::ParseMemoryStat(absl::string_view memory_stat,
+                             Result::CgroupStats* stats) {
+  stats->memory_anon = GetKeyedValue(memory_stat, "anon");
+  stats->memory_file = GetKeyedValue(memory_stat, "file");
+}
+
+// See https://www.kernel.org/doc/html/latest/accounting/psi.html.
+absl::Duration Cgroup::ParseStallTime(absl::string_view pressure,
+                                      absl::string_view kind) {
+  for (absl::string_view line : absl::StrSplit(pressure, '\n')) {
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    if (fields.empty() || fields[0] != kind) {
+      continue;
+    }
+    for (absl::string_view field : fields) {
+      uint64_t usecs;
+      if (absl::ConsumePrefix(&field, "total=") &&
+          absl::SimpleAtoi(field, &usecs)) {
+        return absl::Microseconds(usecs);
+      }
+    }
+  }
+  return absl::ZeroDuration();
+}
+
+sapi::StatusOr<util::ResourceUsage> Cgroup::GetResourceUsage(
+    const std::string& path) {
+  std::string procs;
+  SAPI_RETURN_IF_ERROR(file::GetContents(file::JoinPath(path, "cgroup.procs"),
+                                         &procs, file::Defaults()));
+  std::vector<pid_t> pids;
+  for (absl::string_view line : absl::StrSplit(procs, '\n')) {
+    pid_t pid;
+    if (absl::SimpleAtoi(line, &pid)) {
+      pids.push_back(pid);
+    }
+  }
+  util::ResourceUsage usage = util::GetResourceUsage(pids);
+
+  std::string cpu_stat;
+  if (file::GetContents(file::JoinPath(path, "cpu.stat"), &cpu_stat,
+                        file::Defaults())
+          .ok()) {
+    usage.user_time = absl::Microseconds(GetKeyedValue(cpu_stat, "user_usec"));
+    usage.system_time =
+        absl::Microseconds(GetKeyedValue(cpu_stat, "system_usec"));
+  }
+  // Only there with the io controller enabled.
+  std::string io_stat;
+  if (file::GetContents(file::JoinPath(path, "io.stat"), &io_stat,
+                        file::Defaults())
+          .ok()) {
+    usage.read_bytes = GetIoStatSum(io_stat, "rbytes");
+    usage.write_bytes = GetIoStatSum(io_stat, "wbytes");
+  }
+  return usage;
+}
+
+}  // namespace sandbox2
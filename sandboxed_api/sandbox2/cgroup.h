@@ -0,0 +1,105 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::Cgroup class manages the cgroup v2 of a single sandboxee.
+
+#ifndef SANDBOXED_API_SANDBOX2_CGROUP_H_
+#define SANDBOXED_API_SANDBOX2_CGROUP_H_
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/limits.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/util.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+class Cgroup final {
+ public:
+  // Creates the cgroup 'name' below the cgroup v2 directory 'parent'.
+  static sapi::StatusOr<std::unique_ptr<Cgroup>> Create(
+      const std::string& parent, const std::string& name);
+
+  Cgroup(const Cgroup&) = delete;
+  Cgroup& operator=(const Cgroup&) = delete;
+
+  // Removes the cgroup, which fails if processes are left in it, see Kill().
+  ~Cgroup();
+
+  // Writes the cgroup limits of 'limits' (memory.max, cpu.max, io.max).
+  sapi::Status ApplyLimits(const Limits& limits);
+
+  // Moves 'pid' into the cgroup. Its future children and threads start in the
+  // cgroup as well.
+  sapi::Status AddProcess(pid_t pid);
+
+  // Sends SIGKILL to all processes in the cgroup at once with cgroup.kill,
+  // which needs Linux 5.14+. Does not wait for them to exit.
+  sapi::Status KillAll();
+
+  // Kills all processes in the cgroup and waits up to 'timeout' for them to
+  // exit.
+  sapi::Status Kill(absl::Duration timeout);
+
+  // Reads the resource usage accounted so far.
+  Result::CgroupStats GetStats() const;
+
+  // Returns the usage so far of the processes in the cgroup at 'path'. The CPU
+  // time and I/O are those of the cgroup (cpu.stat and io.stat), so they
+  // include processes which exited. Static, as it is called while the
+  // sandboxee runs, which may race with the destruction of the Cgroup object
+  // once it finished. Fails if the cgroup is gone.
+  static sapi::StatusOr<util::ResourceUsage> GetResourceUsage(
+      const std::string& path);
+
+  // Sets the CPU times of 'stats' from the contents of cpu.stat.
+  static void ParseCpuStat(absl::string_view cpu_stat,
+                           Result::CgroupStats* stats);
+
+  // Sets the anonymous and page cache memory of 'stats' from the contents of
+  // memory.stat.
+  static void ParseMemoryStat(absl::string_view memory_stat,
+                              Result::CgroupStats* stats);
+
+  // Returns the total stall time of the 'kind' ("some" or "full") line of the
+  // contents of a pressure file (cpu.pressure, memory.pressure, io.pressure),
+  // zero if there is none.
+  static absl::Duration ParseStallTime(absl::string_view pressure,
+                                       absl::string_view kind);
+
+  const std::string& path() const { return path_; }
+
+ private:
+  explicit Cgroup(std::string path) : path_(std::move(path)) {}
+
+  // Writes 'value' to the control file 'file' of the cgroup.
+  sapi::Status Write(const std::string& file, const std::string& value);
+
+  // Returns whether processes are left in the cgroup (cgroup.events).
+  bool IsPopulated() const;
+
+  std::string path_;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_CGROUP_H_
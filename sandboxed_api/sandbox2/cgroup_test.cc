@@ -0,0 +1,205 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/cgroup.h"
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::sapi::IsOk;
+using ::testing::Eq;
+using ::testing::Gt;
+using ::testing::IsTrue;
+using ::testing::Ne;
+
+namespace sandbox2 {
+namespace {
+
+// Returns the cgroup v2 directory of this process, or an empty string if there
+// is no cgroup v2 hierarchy.
+std::string GetOwnCgroup() {
+  std::string mounts;
+  std::string cgroups;
+  if (!file::GetContents("/proc/self/mounts", &mounts, file::Defaults())
+           .ok() ||
+      !file::GetContents("/proc/self/cgroup", &cgroups, file::Defaults())
+           .ok()) {
+    return "";
+  }
+  std::string mount_point;
+  for (absl::string_view line : absl::StrSplit(mounts, '\n')) {
+    std::vector<absl::string_view> fields = absl::StrSplit(line, ' ');
+    if (fields.size() > 2 && fields[2] == "cgroup2") {
+      mount_point = std::string(fields[1]);
+      break;
+    }
+  }
+  for (absl::string_view line : absl::StrSplit(cgroups, '\n')) {
+    if (!mount_point.empty() && absl::ConsumePrefix(&line, "0::")) {
+      return file::JoinPath(mount_point, line);
+    }
+  }
+  return "";
+}
+
+TEST(CgroupTest, ParsesCpuStat) {
+  Result::CgroupStats stats;
+  Cgroup::ParseCpuStat("usage_usec 3000500\n"
+                       "user_usec 2000000\n"
+                       "system_usec 1000500\n"
+                       "nr_periods 0\n"
+                       "nr_throttled 0\n"
+                       "throttled_usec 0\n",
+                       &stats);
+  EXPECT_THAT(stats.cpu_time, Eq(absl::Microseconds(3000500)));
+  EXPECT_THAT(stats.user_time, Eq(absl::Seconds(2)));
+  EXPECT_THAT(stats.system_time, Eq(absl::Microseconds(1000500)));
+
+  // Missing keys count as zero.
+  Cgroup::ParseCpuStat("usage_usec 10\n", &stats);
+  EXPECT_THAT(stats.cpu_time, Eq(absl::Microseconds(10)));
+  EXPECT_THAT(stats.user_time, Eq(absl::ZeroDuration()));
+  EXPECT_THAT(stats.system_time, Eq(absl::ZeroDuration()));
+}
+
+TEST(CgroupTest, ParsesMemoryStat) {
+  Result::CgroupStats stats;
+  // Keys which start like others must not be taken for them.
+  Cgroup::ParseMemoryStat("anon 1048576\n"
+                          "file 4096\n"
+                          "kernel 8192\n"
+                          "anon_thp 0\n"
+                          "file_mapped 2048\n"
+                          "file_dirty 0\n",
+                          &stats);
+  EXPECT_THAT(stats.memory_anon, Eq(uint64_t{1048576}));
+  EXPECT_THAT(stats.memory_file, Eq(uint64_t{4096}));
+
+  Cgroup::ParseMemoryStat("", &stats);
+  EXPECT_THAT(stats.memory_anon, Eq(0));
+  EXPECT_THAT(stats.memory_file, Eq(0));
+}
+
+TEST(CgroupTest, ParsesPressure) {
+  constexpr char kPressure[] =
+      "some avg10=0.00 avg60=1.50 avg300=0.20 total=123456\n"
+      "full avg10=0.00 avg60=0.00 avg300=0.00 total=789\n";
+  EXPECT_THAT(Cgroup::ParseStallTime(kPressure, "some"),
+              Eq(absl::Microseconds(123456)));
+  EXPECT_THAT(Cgroup::ParseStallTime(kPressure, "full"),
+              Eq(absl::Microseconds(789)));
+  // cpu.pressure has no "full" line before Linux 5.13.
+  EXPECT_THAT(Cgroup::ParseStallTime("some avg10=0.00 total=5\n", "full"),
+              Eq(absl::ZeroDuration()));
+  EXPECT_THAT(Cgroup::ParseStallTime("some avg10=0.00 total=x\n", "some"),
+              Eq(absl::ZeroDuration()));
+}
+
+// Reads a PID written by the other end of 'fd'.
+pid_t ReadPid(int fd) {
+  pid_t pid = -1;
+  return read(fd, &pid, sizeof(pid)) == sizeof(pid) ? pid : -1;
+}
+
+TEST(CgroupTest, KillAllKillsForkedChildren) {
+  const std::string parent = GetOwnCgroup();
+  if (parent.empty()) {
+    // No cgroup v2 hierarchy.
+    return;
+  }
+  auto cgroup_or =
+      Cgroup::Create(parent, absl::StrCat("cgroup_test-", getpid()));
+  if (!cgroup_or.ok()) {
+    // The cgroup of this process is not delegated to it.
+    return;
+  }
+  std::unique_ptr<Cgroup> cgroup = std::move(cgroup_or).ValueOrDie();
+
+  // The grandchild is reparented to this process once its parent is killed,
+  // so that its exit status can be checked.
+  ASSERT_THAT(prctl(PR_SET_CHILD_SUBREAPER, 1), Eq(0));
+  int go[2];
+  int grandchild_pid[2];
+  ASSERT_THAT(pipe(go), Eq(0));
+  ASSERT_THAT(pipe(grandchild_pid), Eq(0));
+  const pid_t child = fork();
+  ASSERT_THAT(child, Ne(-1));
+  if (child == 0) {
+    // Fork only once moved into the cgroup, so that the grandchild starts
+    // there as well.
+    char c;
+    if (read(go[0], &c, 1) != 1) {
+      _exit(1);
+    }
+    const pid_t grandchild = fork();
+    if (grandchild == 0) {
+      for (;;) {
+        pause();
+      }
+    }
+    write(grandchild_pid[1], &grandchild, sizeof(grandchild));
+    for (;;) {
+      pause();
+    }
+  }
+  close(go[0]);
+  close(grandchild_pid[1]);
+
+  if (!cgroup->AddProcess(child).ok()) {
+    // Moving processes needs write access to this process' own cgroup.
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    return;
+  }
+  ASSERT_THAT(write(go[1], "x", 1), Eq(1));
+  const pid_t grandchild = ReadPid(grandchild_pid[0]);
+  ASSERT_THAT(grandchild, Gt(0));
+
+  if (!cgroup->KillAll().ok()) {
+    // cgroup.kill needs Linux 5.14.
+    EXPECT_THAT(cgroup->Kill(absl::Seconds(10)), IsOk());
+    waitpid(child, nullptr, 0);
+    waitpid(grandchild, nullptr, 0);
+    return;
+  }
+  int status;
+  ASSERT_THAT(waitpid(child, &status, 0), Eq(child));
+  EXPECT_THAT(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, IsTrue());
+  ASSERT_THAT(waitpid(grandchild, &status, 0), Eq(grandchild));
+  EXPECT_THAT(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, IsTrue());
+  // Nothing is left behind, the cgroup can be removed.
+  EXPECT_THAT(cgroup->Kill(absl::Seconds(10)), IsOk());
+
+  close(go[1]);
+  close(grandchild_pid[0]);
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -19,17 +19,23 @@
 #include <fcntl.h>
 #include <linux/filter.h>
 #include <linux/seccomp.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/internal/raw_logging.h"
 #include "absl/base/attributes.h"
@@ -40,16 +46,58 @@
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/ipc.pb.h"
 #include "sandboxed_api/sandbox2/network_proxy_client.h"
 #include "sandboxed_api/sandbox2/sanitizer.h"
+#include "sandboxed_api/sandbox2/startup_times.h"
+#include "sandboxed_api/sandbox2/util/maps_parser.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/raw_logging.h"
 #include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+#ifndef SECCOMP_RET_USER_NOTIF
+#define SECCOMP_RET_USER_NOTIF 0x7fc00000U
+#endif
+#ifndef SECCOMP_RET_ACTION_FULL
+#define SECCOMP_RET_ACTION_FULL 0xffff0000U
+#endif
+#ifndef SECCOMP_FILTER_FLAG_NEW_LISTENER
+#define SECCOMP_FILTER_FLAG_NEW_LISTENER (1UL << 3)
+#endif
+#ifndef SECCOMP_FILTER_FLAG_TSYNC_ESRCH
+#define SECCOMP_FILTER_FLAG_TSYNC_ESRCH (1UL << 4)
+#endif
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
 
 namespace sandbox2 {
 
+namespace {
+
+// Replaces the SECCOMP_RET_USER_NOTIF actions of 'prog' with
+// SECCOMP_RET_TRACE if 'to_trace' is true. Returns whether there are any.
+bool RewriteUserNotifyActions(sock_fprog* prog, bool to_trace) {
+  bool found = false;
+  for (uint16_t i = 0; i < prog->len; ++i) {
+    sock_filter& insn = prog->filter[i];
+    if (BPF_CLASS(insn.code) == BPF_RET && BPF_RVAL(insn.code) == BPF_K &&
+        (insn.k & SECCOMP_RET_ACTION_FULL) == SECCOMP_RET_USER_NOTIF) {
+      found = true;
+      if (to_trace) {
+        insn.k = SECCOMP_RET_TRACE;
+      }
+    }
+  }
+  return found;
+}
+
+}  // namespace
+
 constexpr uint32_t Client::kClient2SandboxReady;
 constexpr uint32_t Client::kSandbox2ClientDone;
+constexpr uint32_t Client::kJobIsolated;
 constexpr const char* Client::kFDMapEnvVar;
 
 Client::Client(Comms* comms) : comms_(comms) {
@@ -128,21 +176,24 @@ void Client::SetUpCwd() {
 }
 
 void Client::SetUpIPC() {
-  uint32_t num_of_fd_pairs;
-  SAPI_RAW_CHECK(comms_->RecvUint32(&num_of_fd_pairs),
-                 "receiving number of fd pairs");
+  FdMappings mappings;
+  SAPI_RAW_CHECK(comms_->RecvProtoBuf(&mappings), "receiving fd mappings");
   SAPI_RAW_CHECK(fd_map_.empty(), "fd map not empty");
+  const int num_of_fd_pairs = mappings.mappings_size();
 
   SAPI_RAW_VLOG(1, "Will receive %d file descriptor pairs", num_of_fd_pairs);
 
-  for (uint32_t i = 0; i < num_of_fd_pairs; ++i) {
-    int32_t requested_fd;
-    int32_t fd;
-    std::string name;
+  std::vector<int> fds;
+  if (num_of_fd_pairs != 0) {
+    SAPI_RAW_CHECK(comms_->RecvFDs(&fds), "receiving current fds");
+    SAPI_RAW_CHECK(fds.size() == static_cast<size_t>(num_of_fd_pairs),
+                   "unexpected number of fds");
+  }
 
-    SAPI_RAW_CHECK(comms_->RecvInt32(&requested_fd), "receiving requested fd");
-    SAPI_RAW_CHECK(comms_->RecvFD(&fd), "receiving current fd");
-    SAPI_RAW_CHECK(comms_->RecvString(&name), "receiving name string");
+  for (int i = 0; i < num_of_fd_pairs; ++i) {
+    const int32_t requested_fd = mappings.mappings(i).remote_fd();
+    int32_t fd = fds[i];
+    const std::string& name = mappings.mappings(i).name();
 
     if (requested_fd != -1 && fd != requested_fd) {
       if (requested_fd > STDERR_FILENO && fcntl(requested_fd, F_GETFD) != -1) {
@@ -173,12 +224,30 @@ void Client::SetUpIPC() {
 }
 
 void Client::ReceivePolicy() {
-  std::vector<uint8_t> bytes;
-  SAPI_RAW_CHECK(comms_->RecvBytes(&bytes), "receive bytes");
-  policy_len_ = bytes.size();
+  bool use_memfd;
+  SAPI_RAW_CHECK(comms_->RecvBool(&use_memfd), "receive policy kind");
+  if (!use_memfd) {
+    std::vector<uint8_t> bytes;
+    SAPI_RAW_CHECK(comms_->RecvBytes(&bytes), "receive bytes");
+    policy_len_ = bytes.size();
+
+    policy_ = absl::make_unique<uint8_t[]>(policy_len_);
+    memcpy(policy_.get(), bytes.data(), policy_len_);
+    return;
+  }
 
+  // The sealed memfd is shared by all sandboxees with the same policy.
+  int fd;
+  SAPI_RAW_CHECK(comms_->RecvFD(&fd), "receive policy fd");
+  struct stat st;
+  SAPI_RAW_PCHECK(fstat(fd, &st) == 0, "fstat() of the policy fd");
+  policy_len_ = st.st_size;
   policy_ = absl::make_unique<uint8_t[]>(policy_len_);
-  memcpy(policy_.get(), bytes.data(), policy_len_);
+  SAPI_RAW_PCHECK(
+      TEMP_FAILURE_RETRY(pread(fd, policy_.get(), policy_len_, 0)) ==
+          policy_len_,
+      "reading the policy fd");
+  close(fd);
 }
 
 void Client::ApplyPolicyAndBecomeTracee() {
@@ -214,6 +283,15 @@ void Client::ApplyPolicyAndBecomeTracee() {
       1, "Applying policy in PID %d, sock_fprog.len: %hd entries (%d bytes)",
       syscall(__NR_gettid), prog.len, policy_len_);
 
+  // Pass on the times recorded by the fork server, if any. The monitor expects
+  // them right before the ready signal.
+  const SandboxeeStartupTimes* times = GetSandboxeeStartupTimes();
+  if (times->clone != 0) {
+    SAPI_RAW_CHECK(
+        comms_->SendBytes(reinterpret_cast<const uint8_t*>(times),
+                          sizeof(*times)),
+        "sending start-up times to executor");
+  }
   // Signal executor we are ready to have limits applied on us and be ptraced.
   // We want limits at the last moment to avoid triggering them too early and we
   // want ptrace at the last moment to avoid synchronization deadlocks.
@@ -225,6 +303,19 @@ void Client::ApplyPolicyAndBecomeTracee() {
   SAPI_RAW_CHECK(ret == kSandbox2ClientDone,
                  "invalid confirmation from executor");
 
+  if (RewriteUserNotifyActions(&prog, /*to_trace=*/false)) {
+    // The monitor takes the listener before execve(), which closes our copy.
+    // TSYNC together with a listener needs TSYNC_ESRCH.
+    if (syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER,
+                SECCOMP_FILTER_FLAG_TSYNC | SECCOMP_FILTER_FLAG_TSYNC_ESRCH |
+                    SECCOMP_FILTER_FLAG_NEW_LISTENER,
+                reinterpret_cast<uintptr_t>(&prog)) >= 0) {
+      return;
+    }
+    SAPI_RAW_VLOG(1, "No seccomp user notifications (%s), using ptrace",
+                  StrError(errno));
+    RewriteUserNotifyActions(&prog, /*to_trace=*/true);
+  }
   SAPI_RAW_CHECK(
       syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_TSYNC,
               reinterpret_cast<uintptr_t>(&prog)) == 0,
@@ -245,9 +336,24 @@ bool Client::HasMappedFD(const std::string& name) {
 }
 
 void Client::SendLogsToSupervisor() {
+  SendLogsToSupervisor(LogSink::Options());
+}
+
+void Client::SendLogsToSupervisor(const LogSink::Options& options) {
   // This LogSink will register itself and send all logs to the executor until
   // the object is destroyed.
-  logsink_ = absl::make_unique<LogSink>(GetMappedFD(LogSink::kLogFDName));
+  int fd = GetMappedFD(LogSink::kLogFDName);
+  if (HasMappedFD(LogRing::kFDName)) {
+    auto ring_or = LogRing::CreateFromFd(GetMappedFD(LogRing::kFDName));
+    if (ring_or.ok()) {
+      logsink_ = absl::make_unique<LogSink>(
+          fd, std::move(ring_or).ValueOrDie(), options);
+      return;
+    }
+    SAPI_RAW_LOG(WARNING, "Could not map the shared log ring: %s",
+                 ring_or.status().message());
+  }
+  logsink_ = absl::make_unique<LogSink>(fd, options);
 }
 
 NetworkProxyClient* Client::GetNetworkProxyClient() {
@@ -269,4 +375,158 @@ sapi::Status Client::InstallNetworkProxyHandler() {
       GetNetworkProxyClient());
 }
 
+// Enables memory merging for the whole process, returns false if this is not
+// permitted.
+static bool EnableProcessMemoryMerging() {
+  if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) == 0) {
+    SAPI_RAW_VLOG(1, "Memory merging enabled for the whole process");
+    return true;
+  }
+  return false;
+}
+
+// Marks the mappings of 'ranges' MADV_MERGEABLE.
+static sapi::Status MarkMergeable(
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+  size_t bytes = 0;
+  for (const auto& range : ranges) {
+    if (madvise(reinterpret_cast<void*>(range.first),
+                range.second - range.first, MADV_MERGEABLE) == -1) {
+      // EINVAL if the kernel is built without KSM.
+      return sapi::UnavailableError(
+          absl::StrCat("madvise(MADV_MERGEABLE): ", StrError(errno)));
+    }
+    bytes += range.second - range.first;
+  }
+  SAPI_RAW_VLOG(1, "Memory merging enabled for %zu mapping(s), %zu bytes",
+                ranges.size(), bytes);
+  return sapi::OkStatus();
+}
+
+sapi::Status Client::EnableMemoryMerging() {
+  if (EnableProcessMemoryMerging()) {
+    return sapi::OkStatus();
+  }
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return sapi::UnavailableError(
+        absl::StrCat("open(/proc/self/maps): ", StrError(errno)));
+  }
+  // Collected first, as marking mappings may split or merge them.
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  {
+    ProcMapsReader reader(fd);
+    MapsEntryView entry;
+    while (reader.Next(&entry)) {
+      // KSM only merges private anonymous pages, which includes the written
+      // pages of private file mappings.
+      if (entry.is_writable && !entry.is_shared) {
+        ranges.emplace_back(entry.start, entry.end);
+      }
+    }
+    SAPI_RETURN_IF_ERROR(reader.status());
+  }
+  return MarkMergeable(ranges);
+}
+
+sapi::Status Client::EnableMemoryMerging(
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+  if (EnableProcessMemoryMerging()) {
+    return sapi::OkStatus();
+  }
+  return MarkMergeable(ranges);
+}
+
+void Client::RunJobLoop(const JobHandler& handler) {
+  for (;;) {
+    uint32_t tag;
+    std::vector<uint8_t> value;
+    if (!comms_->RecvTLV(&tag, &value)) {
+      SAPI_RAW_VLOG(1, "Job loop: the host disconnected");
+      return;
+    }
+    if (tag == Comms::kTagJobLoopExit) {
+      return;
+    }
+    SAPI_RAW_CHECK(tag == Comms::kTagJob, "Job loop: unexpected tag");
+    SAPI_RAW_CHECK(value.size() >= sizeof(JobHeader),
+                   "Job loop: truncated job");
+    JobHeader header;
+    memcpy(&header, value.data(), sizeof(header));
+    Job job;
+    job.data.assign(value.begin() + sizeof(header), value.end());
+    if (header.num_fds != 0) {
+      SAPI_RAW_CHECK(comms_->RecvFDs(&job.fds), "Job loop: receiving fds");
+      SAPI_RAW_CHECK(job.fds.size() == header.num_fds,
+                     "Job loop: unexpected number of fds");
+    }
+    if (header.flags & kJobIsolated) {
+      RunIsolatedJob(handler, job);
+      continue;
+    }
+    const int32_t result = handler(job);
+    SAPI_RAW_CHECK(
+        comms_->SendTLV(Comms::kTagJobResult, sizeof(result),
+                        reinterpret_cast<const uint8_t*>(&result)),
+        "Job loop: sending the result");
+  }
+}
+
+void Client::RunIsolatedJob(const JobHandler& handler, const Job& job) {
+  // The child hands its result to the loop, which only reports it once the
+  // child exited cleanly. A handler which exits by itself therefore does not
+  // leave the host waiting for a reply. Non-blocking, as children of the job
+  // may still hold the write end.
+  int result_pipe[2];
+  pid_t pid = -1;
+  if (pipe2(result_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    SAPI_RAW_PLOG(ERROR, "Job loop: pipe2()");
+  } else {
+    pid = fork();
+    if (pid == 0) {
+      close(result_pipe[0]);
+      const int32_t result = handler(job);
+      const bool written =
+          write(result_pipe[1], &result, sizeof(result)) == sizeof(result);
+      _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(result_pipe[1]);
+    if (pid == -1) {
+      SAPI_RAW_PLOG(ERROR, "Job loop: fork()");
+      close(result_pipe[0]);
+    }
+  }
+  // The child has its own copies of the fds.
+  for (int fd : job.fds) {
+    close(fd);
+  }
+  int32_t status = 0;
+  if (pid == -1) {
+    status = -1;
+  } else {
+    int wstatus;
+    SAPI_RAW_CHECK(TEMP_FAILURE_RETRY(waitpid(pid, &wstatus, 0)) == pid,
+                   "Job loop: waitpid()");
+    int32_t result;
+    const bool has_result =
+        read(result_pipe[0], &result, sizeof(result)) == sizeof(result);
+    close(result_pipe[0]);
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EXIT_SUCCESS) {
+      if (has_result) {
+        SAPI_RAW_CHECK(
+            comms_->SendTLV(Comms::kTagJobResult, sizeof(result),
+                            reinterpret_cast<const uint8_t*>(&result)),
+            "Job loop: sending the result");
+        return;
+      }
+      SAPI_RAW_LOG(ERROR, "Job loop: isolated job exited without a result");
+    }
+    status = wstatus;
+  }
+  SAPI_RAW_CHECK(
+      comms_->SendTLV(Comms::kTagJobCrashed, sizeof(status),
+                      reinterpret_cast<const uint8_t*>(&status)),
+      "Job loop: reporting the crash");
+}
+
 }  // namespace sandbox2
@@ -19,9 +19,12 @@
 #define SANDBOXED_API_SANDBOX2_CLIENT_H_
 
 #include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/logsink.h"
@@ -36,6 +39,24 @@ class Client {
   // Sandbox is ready to monitor the sandboxee.
   static constexpr uint32_t kSandbox2ClientDone = 0x0A0B0C02;
 
+  // Starts a kTagJob message, followed by the job's data. If 'num_fds' is not
+  // zero, the file descriptors are sent right after the message.
+  struct JobHeader {
+    uint32_t flags;
+    uint32_t num_fds;
+  };
+  // The job runs in a child forked from the job loop, see RunJobLoop().
+  static constexpr uint32_t kJobIsolated = 0x1;
+
+  // A job received by RunJobLoop().
+  struct Job {
+    std::vector<uint8_t> data;
+    // Owned by the handler.
+    std::vector<int> fds;
+  };
+  // Processes a job and returns its result, which is passed to the host.
+  using JobHandler = std::function<int32_t(const Job& job)>;
+
   explicit Client(Comms* comms);
 
   Client(const Client&) = delete;
@@ -53,6 +74,7 @@ class Client {
 
   // Registers a LogSink that forwards all logs to the supervisor.
   void SendLogsToSupervisor();
+  void SendLogsToSupervisor(const LogSink::Options& options);
 
   // Returns the network proxy client and starts it if this function is called
   // for the first time.
@@ -62,6 +84,33 @@ class Client {
   // the NetworkProxyClient class.
   sapi::Status InstallNetworkProxyHandler();
 
+  // Makes the kernel merge the pages of this process with identical pages of
+  // other processes (KSM), e.g. the tables a library builds when it is
+  // initialized in every sandboxee of a pool. Meant to be called once the
+  // sandboxee is initialized. Uses prctl(PR_SET_MEMORY_MERGE) where permitted
+  // (Linux 6.4+, CAP_SYS_RESOURCE), which covers later mappings as well.
+  // Otherwise marks the existing private writable mappings, listed in
+  // /proc/self/maps, with madvise(MADV_MERGEABLE). Inside the sandbox, this
+  // needs PolicyBuilder::AllowMemoryMerging() and AllowOpen(). Pages are only
+  // merged while KSM runs on the host, see /sys/kernel/mm/ksm/run.
+  static sapi::Status EnableMemoryMerging();
+
+  // Like above, but marks the mappings of 'ranges' (start and end addresses)
+  // if the prctl() is not permitted, e.g. as listed by the host when the
+  // sandboxee cannot read /proc/self/maps. Needs only
+  // PolicyBuilder::AllowMemoryMerging().
+  static sapi::Status EnableMemoryMerging(
+      const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+  // Processes the jobs sent by a JobRunner on the host, one at a time, until
+  // the host ends the loop or disconnects. Meant to be called after
+  // SandboxMeHere(), so that a single sandboxee serves many jobs without being
+  // respawned. Isolated jobs run in a child forked from the loop, which starts
+  // each of them from the same pristine state and discards whatever state it
+  // leaves behind. The policy then has to allow pipe2(), fork() and wait4(),
+  // and the handler must not depend on threads other than the calling one.
+  void RunJobLoop(const JobHandler& handler);
+
  protected:
   // Comms used for synchronization with the monitor, not owned by the object.
   Comms* comms_;
@@ -105,6 +154,11 @@ class Client {
 
   void PrepareEnvironment();
   void EnableSandbox();
+
+  // Runs 'job' in a forked child, which passes its result back over a pipe.
+  // Reports a child which did not exit cleanly, or exited without a result,
+  // as crashed.
+  void RunIsolatedJob(const JobHandler& handler, const Job& job);
 };
 
 }  // namespace sandbox2
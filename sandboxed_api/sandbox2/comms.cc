@@ -21,23 +21,33 @@
 
 #include "sandboxed_api/sandbox2/comms.h"
 
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <functional>
 
+#include <zlib.h>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/message.h"
+#include "absl/base/macros.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/synchronization/mutex.h"
+#include "sandboxed_api/sandbox2/metrics.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/raw_logging.h"
@@ -68,6 +78,59 @@ bool IsFatalError(int saved_errno) {
          saved_errno != EFAULT && saved_errno != EINTR &&
          saved_errno != EINVAL && saved_errno != ENOMEM;
 }
+
+// Protos up to this size are serialized on the stack by SendProtoBuf().
+constexpr size_t kMaxStackProtoSize = 4096;
+
+// Largest receive buffer which RecvProtoBuf() keeps for the next message.
+constexpr size_t kMaxRetainedProtoSize = 1 << 20;
+
+// Largest TLV value which TryRecvTLV() waits for to arrive completely.
+constexpr uint64_t kMaxTryRecvSize = 64 << 10;
+
+// Value of a kTagSpilled TLV. The original value follows as a Buffer.
+struct SpilledTLV {
+  uint32_t tag;
+  uint64_t length;
+};
+
+// Value of a kTagCompressed TLV. The deflated original value follows in the
+// zlib format.
+struct CompressedTLV {
+  uint32_t tag;
+  uint64_t length;
+};
+
+// Deflates the value of a TLV into 'compressed', after its CompressedTLV.
+// Returns false if the result would not be smaller than 'length'.
+bool CompressTLV(uint32_t tag, uint64_t length, const iovec* fragments,
+                 int num_fragments, std::vector<uint8_t>* compressed) {
+  z_stream stream = {};
+  // Favors throughput, which is what compression is enabled for.
+  if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) {
+    SAPI_RAW_LOG(ERROR, "deflateInit() failed");
+    return false;
+  }
+  const CompressedTLV header = {tag, length};
+  compressed->resize(sizeof(header) + deflateBound(&stream, length));
+  memcpy(compressed->data(), &header, sizeof(header));
+  stream.next_out = compressed->data() + sizeof(header);
+  stream.avail_out = compressed->size() - sizeof(header);
+  int rc = Z_OK;
+  for (int i = 0; i < num_fragments && rc == Z_OK; ++i) {
+    stream.next_in = static_cast<Bytef*>(fragments[i].iov_base);
+    stream.avail_in = fragments[i].iov_len;
+    rc = deflate(&stream, i + 1 == num_fragments ? Z_FINISH : Z_NO_FLUSH);
+  }
+  const bool smaller =
+      rc == Z_STREAM_END && sizeof(header) + stream.total_out < length;
+  compressed->resize(sizeof(header) + stream.total_out);
+  deflateEnd(&stream);
+  return smaller;
+}
+
+// RecvTL() result in 'spilled_fd' for a value in 'inflated_'.
+constexpr int kInflatedValue = -2;
 }  // namespace
 
 constexpr uint32_t Comms::kTagBool;
@@ -83,12 +146,32 @@ constexpr uint32_t Comms::kTagString;
 constexpr uint32_t Comms::kTagBytes;
 constexpr uint32_t Comms::kTagProto2;
 constexpr uint32_t Comms::kTagFd;
+constexpr uint32_t Comms::kTagSpilled;
+constexpr uint32_t Comms::kTagCompressed;
+constexpr uint32_t Comms::kTagJob;
+constexpr uint32_t Comms::kTagJobResult;
+constexpr uint32_t Comms::kTagJobCrashed;
+constexpr uint32_t Comms::kTagJobLoopExit;
+constexpr size_t Comms::kMaxFDsPerMessage;
+constexpr char Comms::kSeqpacketEnv[];
+constexpr uint64_t Comms::kMaxPacketValueSize;
+constexpr uint64_t Comms::kNoSpill;
+constexpr uint64_t Comms::kNoCompression;
 
 constexpr int Comms::kSandbox2ClientCommsFD;
 
 Comms::Comms(const std::string& socket_name) : socket_name_(socket_name) {}
 
-Comms::Comms(int fd) : connection_fd_(fd) {
+// Sandboxees might not be allowed to call getsockopt(), the Executor tells
+// them the socket type of their Comms FD through the environment instead.
+Comms::Comms(int fd)
+    : Comms(fd, fd == kSandbox2ClientCommsFD
+                    ? getenv(kSeqpacketEnv) != nullptr &&
+                          strcmp(getenv(kSeqpacketEnv), "1") == 0
+                    : IsSeqpacketSocket(fd)) {}
+
+Comms::Comms(int fd, bool seqpacket)
+    : connection_fd_(fd), seqpacket_(seqpacket) {
   // Generate a unique and meaningful socket name for this FD.
   // Note: getpid()/gettid() are non-blocking syscalls.
   socket_name_ = absl::StrFormat("sandbox2::Comms:FD=%d/PID=%d/TID=%ld", fd,
@@ -98,6 +181,13 @@ Comms::Comms(int fd) : connection_fd_(fd) {
   state_ = State::kConnected;
 }
 
+bool Comms::IsSeqpacketSocket(int fd) {
+  int type;
+  socklen_t len = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+         type == SOCK_SEQPACKET;
+}
+
 Comms::~Comms() { Terminate(); }
 
 int Comms::GetConnectionFD() const {
@@ -228,11 +318,37 @@ void Comms::Terminate() {
 }
 
 bool Comms::SendTLV(uint32_t tag, uint64_t length, const uint8_t* bytes) {
+  iovec fragment = {const_cast<uint8_t*>(bytes), length};
+  return SendTLVv(tag, &fragment, 1);
+}
+
+bool Comms::SendTLVv(uint32_t tag, const iovec* fragments, int num_fragments) {
+  uint64_t length = 0;
+  for (int i = 0; i < num_fragments; ++i) {
+    length += fragments[i].iov_len;
+  }
   if (length > GetMaxMsgSize()) {
     SAPI_RAW_LOG(ERROR, "Maximum TLV message size exceeded: (%u > %u)", length,
                  GetMaxMsgSize());
     return false;
   }
+  if (length >= compression_threshold_ && length > 0 &&
+      tag != kTagCompressed) {
+    std::vector<uint8_t> compressed;
+    if (CompressTLV(tag, length, fragments, num_fragments, &compressed)) {
+      SAPI_RAW_VLOG(3, "Compressed a TLV message, tag: 0x%08x, %u -> %u bytes",
+                    tag, length, compressed.size());
+      iovec fragment = {compressed.data(), compressed.size()};
+      return SendTLVv(kTagCompressed, &fragment, 1);
+    }
+  }
+  metrics::IncrementCounter(metrics::kCommsMessagesSent);
+  metrics::IncrementCounter(metrics::kCommsBytesSent, length);
+  if (length >= spill_threshold_ ||
+      (seqpacket_ && length > kMaxPacketValueSize)) {
+    absl::MutexLock lock(&tlv_send_transmission_mutex_);
+    return SendSpilled(tag, length, fragments, num_fragments);
+  }
   if (length > kWarnMsgSize) {
     static int times_warned = 0;
     if (times_warned < 10) {
@@ -246,21 +362,75 @@ bool Comms::SendTLV(uint32_t tag, uint64_t length, const uint8_t* bytes) {
 
   SAPI_RAW_VLOG(3, "Sending a TLV message, tag: 0x%08x, length: %u", tag,
                 length);
-  {
-    absl::MutexLock lock(&tlv_send_transmission_mutex_);
-    if (!Send(reinterpret_cast<uint8_t*>(&tag), sizeof(tag))) {
-      return false;
+  // Tag, length and value are written with a single system call, unless
+  // there are more fragments than writev() accepts at once.
+  constexpr int kMaxInlineFragments = 8;
+  iovec inline_iov[2 + kMaxInlineFragments];
+  std::vector<iovec> heap_iov;
+  iovec* iov = inline_iov;
+  if (num_fragments > kMaxInlineFragments) {
+    heap_iov.resize(2 + num_fragments);
+    iov = heap_iov.data();
+  }
+  iov[0] = {&tag, sizeof(tag)};
+  iov[1] = {&length, sizeof(length)};
+  int iovcnt = 2;
+  for (int i = 0; i < num_fragments; ++i) {
+    if (fragments[i].iov_len > 0) {
+      iov[iovcnt++] = fragments[i];
     }
-    if (!Send(reinterpret_cast<uint8_t*>(&length), sizeof(length))) {
+  }
+  absl::MutexLock lock(&tlv_send_transmission_mutex_);
+  return SendIov(iov, iovcnt);
+}
+
+bool Comms::SendSpilled(uint32_t tag, uint64_t length,
+                         const iovec* fragments, int num_fragments) {
+  SAPI_RAW_VLOG(3, "Spilling a TLV message, tag: 0x%08x, length: %u", tag,
+                length);
+  int fd;
+  if (!util::CreateMemFd(&fd, "sandbox2_comms_tlv")) {
+    return false;
+  }
+  std::vector<iovec> iov(fragments, fragments + num_fragments);
+  iovec* next = iov.data();
+  int num_left = num_fragments;
+  for (uint64_t written = 0; written < length;) {
+    while (next->iov_len == 0) {
+      ++next;
+      --num_left;
+    }
+    ssize_t s = TEMP_FAILURE_RETRY(
+        pwritev(fd, next, std::min(num_left, IOV_MAX), written));
+    if (s <= 0) {
+      SAPI_RAW_PLOG(ERROR, "pwritev() of spilled TLV");
+      close(fd);
       return false;
     }
-    if (length > 0) {
-      if (!Send(bytes, length)) {
-        return false;
-      }
+    written += s;
+    for (size_t left = s; left > 0;) {
+      const size_t n = std::min(left, next->iov_len);
+      next->iov_base = reinterpret_cast<uint8_t*>(next->iov_base) + n;
+      next->iov_len -= n;
+      left -= n;
     }
-    return true;
   }
+
+  SpilledTLV spilled = {tag, length};
+  uint32_t spilled_tag = kTagSpilled;
+  uint64_t spilled_length = sizeof(spilled);
+  iovec header[] = {
+      {&spilled_tag, sizeof(spilled_tag)},
+      {&spilled_length, sizeof(spilled_length)},
+      {&spilled, sizeof(spilled)},
+  };
+  // Packets carry the memfd along with the header.
+  const bool sent =
+      seqpacket_
+          ? SendPacket(header, ABSL_ARRAYSIZE(header), fd)
+          : SendIov(header, ABSL_ARRAYSIZE(header)) && SendFDsChunk(&fd, 1, 0);
+  close(fd);
+  return sent;
 }
 
 bool Comms::RecvString(std::string* v) {
@@ -329,7 +499,61 @@ bool Comms::RecvCreds(pid_t* pid, uid_t* uid, gid_t* gid) {
 }
 
 bool Comms::RecvFD(int* fd) {
-  char fd_msg[8192];
+  std::vector<int> fds;
+  uint64_t num_remaining;
+  if (!RecvFDsChunk(&fds, &num_remaining)) {
+    return false;
+  }
+  if (fds.empty()) {
+    SAPI_RAW_LOG(ERROR,
+                 "Haven't received the SCM_RIGHTS message, process is probably "
+                 "out of free file descriptors");
+    return false;
+  }
+  if (fds.size() != 1 || num_remaining != 0) {
+    SAPI_RAW_LOG(ERROR, "Expected a single fd, got %zu (%" PRIu64 " more)",
+                 fds.size(), num_remaining);
+    for (int received : fds) {
+      close(received);
+    }
+    return false;
+  }
+  *fd = fds[0];
+  return true;
+}
+
+bool Comms::SendFD(int fd) { return SendFDsChunk(&fd, 1, 0); }
+
+bool Comms::RecvFDs(std::vector<int>* fds) {
+  fds->clear();
+  uint64_t num_remaining;
+  do {
+    if (!RecvFDsChunk(fds, &num_remaining)) {
+      for (int received : *fds) {
+        close(received);
+      }
+      fds->clear();
+      return false;
+    }
+  } while (num_remaining != 0);
+  return true;
+}
+
+bool Comms::SendFDs(const std::vector<int>& fds) {
+  if (fds.empty()) {
+    return SendFDsChunk(nullptr, 0, 0);
+  }
+  for (size_t i = 0; i < fds.size(); i += kMaxFDsPerMessage) {
+    const size_t num_fds = std::min(kMaxFDsPerMessage, fds.size() - i);
+    if (!SendFDsChunk(&fds[i], num_fds, fds.size() - i - num_fds)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Comms::RecvFDsChunk(std::vector<int>* fds, uint64_t* num_remaining) {
+  char fd_msg[CMSG_SPACE(sizeof(int) * kMaxFDsPerMessage)];
   cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(fd_msg);
 
   InternalTLV tlv;
@@ -380,45 +604,48 @@ bool Comms::RecvFD(int* fd) {
     SAPI_RAW_LOG(ERROR, "Expected (kTagFD: 0x%x), got: 0x%u", kTagFd, tlv.tag);
     return false;
   }
+  *num_remaining = tlv.val;
 
-  cmsg = CMSG_FIRSTHDR(&msg);
+  const size_t num_received_before = fds->size();
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 #ifdef MEMORY_SANITIZER
-  ANNOTATE_MEMORY_IS_INITIALIZED(cmsg, sizeof(cmsghdr));
+    ANNOTATE_MEMORY_IS_INITIALIZED(cmsg, sizeof(cmsghdr));
 #endif
-  while (cmsg) {
-    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-      if (cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
-        SAPI_RAW_VLOG(1,
-                      "recvmsg(SCM_RIGHTS): cmsg->cmsg_len != "
-                      "CMSG_LEN(sizeof(int)), skipping");
-        continue;
-      }
-      int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
-      *fd = fds[0];
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
 #ifdef MEMORY_SANITIZER
-      ANNOTATE_MEMORY_IS_INITIALIZED(fd, sizeof(int));
+    ANNOTATE_MEMORY_IS_INITIALIZED(received, sizeof(int) * num_fds);
 #endif
-      return true;
+    fds->insert(fds->end(), received, received + num_fds);
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    SAPI_RAW_LOG(ERROR,
+                 "recvmsg(SCM_RIGHTS): control data truncated, process is "
+                 "probably out of free file descriptors");
+    for (size_t i = num_received_before; i < fds->size(); ++i) {
+      close((*fds)[i]);
     }
-    cmsg = CMSG_NXTHDR(&msg, cmsg);
+    fds->resize(num_received_before);
+    return false;
   }
-  SAPI_RAW_LOG(ERROR,
-               "Haven't received the SCM_RIGHTS message, process is probably "
-               "out of free file descriptors");
-  return false;
+  return true;
 }
 
-bool Comms::SendFD(int fd) {
-  char fd_msg[CMSG_SPACE(sizeof(int))] = {0};
+bool Comms::SendFDsChunk(const int* fds, size_t num_fds,
+                         uint64_t num_remaining) {
+  char fd_msg[CMSG_SPACE(sizeof(int) * kMaxFDsPerMessage)] = {0};
   cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(fd_msg);
   cmsg->cmsg_level = SOL_SOCKET;
   cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-
-  int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
-  fds[0] = fd;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+  if (num_fds != 0) {
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+  }
 
-  InternalTLV tlv = {kTagFd, sizeof(tlv.val), 0};
+  InternalTLV tlv = {kTagFd, sizeof(tlv.val), num_remaining};
 
   iovec iov;
   iov.iov_base = &tlv;
@@ -429,8 +656,8 @@ bool Comms::SendFD(int fd) {
   msg.msg_namelen = 0;
   msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
-  msg.msg_control = cmsg;
-  msg.msg_controllen = sizeof(fd_msg);
+  msg.msg_control = num_fds != 0 ? cmsg : nullptr;
+  msg.msg_controllen = num_fds != 0 ? CMSG_SPACE(sizeof(int) * num_fds) : 0;
   msg.msg_flags = 0;
 
   const auto op = [&msg](int fd) -> ssize_t {
@@ -461,8 +688,20 @@ bool Comms::SendFD(int fd) {
 }
 
 bool Comms::RecvProtoBuf(google::protobuf::Message* message) {
-  TLV tlv;
-  if (!RecvTLV(&tlv)) {
+  absl::MutexLock lock(&tlv_recv_transmission_mutex_);
+  uint32_t tag;
+  uint64_t length;
+  int spilled_fd;
+  // Serialized protos are received into a buffer kept across messages.
+  if (proto_buffer_.capacity() > kMaxRetainedProtoSize) {
+    std::vector<uint8_t>().swap(proto_buffer_);
+  }
+  bool received = RecvTL(&tag, &length, &spilled_fd);
+  if (received) {
+    proto_buffer_.resize(length);
+    received = RecvValue(proto_buffer_.data(), length, spilled_fd);
+  }
+  if (!received) {
     if (IsConnected()) {
       SAPI_RAW_PLOG(ERROR, "RecvProtoBuf failed for (%s)", socket_name_);
     } else {
@@ -472,22 +711,73 @@ bool Comms::RecvProtoBuf(google::protobuf::Message* message) {
     return false;
   }
 
-  if (tlv.tag != kTagProto2) {
-    SAPI_RAW_LOG(ERROR, "Expected tag: 0x%x, got: 0x%u", kTagProto2, tlv.tag);
+  if (tag != kTagProto2) {
+    SAPI_RAW_LOG(ERROR, "Expected tag: 0x%x, got: 0x%u", kTagProto2, tag);
     return false;
   }
-  return message->ParseFromArray(tlv.value.data(), tlv.value.size());
+  return message->ParseFromArray(proto_buffer_.data(), length);
 }
 
 bool Comms::SendProtoBuf(const google::protobuf::Message& message) {
-  std::string str;
-  if (!message.SerializeToString(&str)) {
-    SAPI_RAW_LOG(ERROR, "Couldn't serialize the ProtoBuf");
+  const size_t size = message.ByteSizeLong();
+  if (size > GetMaxMsgSize()) {
+    SAPI_RAW_LOG(ERROR, "Maximum TLV message size exceeded: (%u > %u)", size,
+                 GetMaxMsgSize());
     return false;
   }
+  // Small protos are serialized on the stack.
+  if (size <= kMaxStackProtoSize) {
+    uint8_t buf[kMaxStackProtoSize];
+    message.SerializeWithCachedSizesToArray(buf);
+    return SendTLV(kTagProto2, size, buf);
+  }
+  // Spilled and compressed values are copied anyway, packets are written at
+  // once.
+  if (size >= spill_threshold_ || size >= compression_threshold_ ||
+      seqpacket_) {
+    std::string str;
+    if (!message.SerializeToString(&str)) {
+      SAPI_RAW_LOG(ERROR, "Couldn't serialize the ProtoBuf");
+      return false;
+    }
+    return SendTLV(kTagProto2, str.length(),
+                   reinterpret_cast<const uint8_t*>(str.data()));
+  }
 
-  return SendTLV(kTagProto2, str.length(),
-                 reinterpret_cast<const uint8_t*>(str.data()));
+  // Larger protos are serialized straight into the socket, buffered in small
+  // chunks, after the header.
+  SAPI_RAW_VLOG(3, "Sending a TLV message, tag: 0x%08x, length: %u", kTagProto2,
+                size);
+  uint32_t tag = kTagProto2;
+  uint64_t length = size;
+  iovec header[] = {
+      {&tag, sizeof(tag)},
+      {&length, sizeof(length)},
+  };
+  absl::MutexLock lock(&tlv_send_transmission_mutex_);
+  if (!SendIov(header, ABSL_ARRAYSIZE(header))) {
+    return false;
+  }
+  google::protobuf::io::FileOutputStream output(connection_fd_);
+  {
+    google::protobuf::io::CodedOutputStream coded(&output);
+    message.SerializeWithCachedSizes(&coded);
+    if (coded.HadError() || static_cast<size_t>(coded.ByteCount()) != size) {
+      SAPI_RAW_LOG(ERROR, "Couldn't serialize the ProtoBuf");
+      // The peer expects 'size' bytes, the channel cannot be used anymore.
+      Terminate();
+      return false;
+    }
+  }
+  if (!output.Flush()) {
+    errno = output.GetErrno();
+    SAPI_RAW_PLOG(ERROR, "write");
+    if (errno == EPIPE || IsFatalError(errno)) {
+      Terminate();
+    }
+    return false;
+  }
+  return true;
 }
 
 // *****************************************************************************
@@ -513,12 +803,26 @@ socklen_t Comms::CreateSockaddrUn(sockaddr_un* sun) {
 }
 
 bool Comms::Send(const uint8_t* bytes, uint64_t len) {
+  iovec iov = {const_cast<uint8_t*>(bytes), len};
+  return SendIov(&iov, 1);
+}
+
+bool Comms::SendIov(iovec* iov, int iovcnt) {
+  uint64_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
   uint64_t total_sent = 0;
-  const auto op = [bytes, len, &total_sent](int fd) -> ssize_t {
+  const auto op = [&iov, &iovcnt](int fd) -> ssize_t {
     PotentiallyBlockingRegion region;
-    return TEMP_FAILURE_RETRY(write(fd, &bytes[total_sent], len - total_sent));
+    return TEMP_FAILURE_RETRY(writev(fd, iov, std::min(iovcnt, IOV_MAX)));
   };
   while (total_sent < len) {
+    // Skip the buffers which were sent completely.
+    while (iov->iov_len == 0) {
+      ++iov;
+      --iovcnt;
+    }
     ssize_t s;
     s = op(connection_fd_);
     if (s == -1 && errno == EPIPE) {
@@ -531,7 +835,7 @@ bool Comms::Send(const uint8_t* bytes, uint64_t len) {
       if (IsFatalError(errno)) {
         Terminate();
       }
-      SAPI_RAW_PLOG(ERROR, "write");
+      SAPI_RAW_PLOG(ERROR, "writev");
       return false;
     }
     if (s == 0) {
@@ -540,6 +844,16 @@ bool Comms::Send(const uint8_t* bytes, uint64_t len) {
       return false;
     }
     total_sent += s;
+    for (size_t left = s; left > 0;) {
+      const size_t n = std::min(left, iov->iov_len);
+      iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+      left -= n;
+      if (iov->iov_len == 0 && left > 0) {
+        ++iov;
+        --iovcnt;
+      }
+    }
   }
   return true;
 }
@@ -572,19 +886,19 @@ bool Comms::Recv(uint8_t* bytes, uint64_t len) {
 }
 
 // Internal helper method (low level).
-bool Comms::RecvTL(uint32_t* tag, uint64_t* length) {
-  if (!Recv(reinterpret_cast<uint8_t*>(tag), sizeof(*tag))) {
+bool Comms::RecvTL(uint32_t* tag, uint64_t* length, int* spilled_fd) {
+  *spilled_fd = -1;
+  if (seqpacket_) {
+    if (!RecvPacketTL(tag, length, spilled_fd)) {
+      return false;
+    }
+  } else if (!RecvStreamTL(tag, length, spilled_fd)) {
     return false;
   }
-  if (!Recv(reinterpret_cast<uint8_t*>(length), sizeof(*length))) {
+  if (*tag == kTagCompressed && !RecvCompressed(tag, length, spilled_fd)) {
     return false;
   }
-  if (*length > GetMaxMsgSize()) {
-    SAPI_RAW_LOG(ERROR, "Maximum TLV message size exceeded: (%u > %d)", *length,
-                 GetMaxMsgSize());
-    return false;
-  }
-  if (*length > kWarnMsgSize) {
+  if (*spilled_fd == -1 && *length > kWarnMsgSize) {
     static int times_warned = 0;
     if (times_warned < 10) {
       ++times_warned;
@@ -595,48 +909,396 @@ bool Comms::RecvTL(uint32_t* tag, uint64_t* length) {
           *length);
     }
   }
+  if (*length > GetMaxMsgSize()) {
+    SAPI_RAW_LOG(ERROR, "Maximum TLV message size exceeded: (%u > %d)", *length,
+                 GetMaxMsgSize());
+    DiscardValue(*spilled_fd);
+    return false;
+  }
+  metrics::IncrementCounter(metrics::kCommsMessagesReceived);
+  metrics::IncrementCounter(metrics::kCommsBytesReceived, *length);
+  return true;
+}
+
+bool Comms::RecvCompressed(uint32_t* tag, uint64_t* length, int* spilled_fd) {
+  if (*length <= sizeof(CompressedTLV) || *length > GetMaxMsgSize()) {
+    SAPI_RAW_LOG(ERROR, "Invalid length of compressed TLV: %u", *length);
+    DiscardValue(*spilled_fd);
+    return false;
+  }
+  std::vector<uint8_t> compressed(*length);
+  if (!RecvValue(compressed.data(), *length, *spilled_fd)) {
+    return false;
+  }
+  CompressedTLV header;
+  memcpy(&header, compressed.data(), sizeof(header));
+  if (header.length > GetMaxMsgSize()) {
+    SAPI_RAW_LOG(ERROR, "Maximum TLV message size exceeded: (%u > %d)",
+                 header.length, GetMaxMsgSize());
+    return false;
+  }
+  if (inflated_.capacity() > kMaxRetainedProtoSize) {
+    std::vector<uint8_t>().swap(inflated_);
+  }
+  inflated_.resize(header.length);
+  uLongf inflated_length = header.length;
+  int rc = uncompress(inflated_.data(), &inflated_length,
+                      compressed.data() + sizeof(header),
+                      compressed.size() - sizeof(header));
+  if (rc != Z_OK || inflated_length != header.length) {
+    SAPI_RAW_LOG(ERROR, "Could not inflate TLV, tag: 0x%08x, zlib error: %d",
+                 header.tag, rc);
+    return false;
+  }
+  SAPI_RAW_VLOG(3, "Received a compressed TLV message, tag: 0x%08x, length: %u",
+                header.tag, header.length);
+  *tag = header.tag;
+  *length = header.length;
+  *spilled_fd = kInflatedValue;
+  return true;
+}
+
+void Comms::DiscardValue(int spilled_fd) {
+  if (spilled_fd >= 0) {
+    close(spilled_fd);
+  } else if (spilled_fd != kInflatedValue && seqpacket_) {
+    DiscardPacket();
+  }
+}
+
+bool Comms::RecvStreamTL(uint32_t* tag, uint64_t* length, int* spilled_fd) {
+  // Tag and length are sent back to back, read them with a single call.
+  uint8_t header[sizeof(*tag) + sizeof(*length)];
+  if (!Recv(header, sizeof(header))) {
+    return false;
+  }
+  memcpy(tag, header, sizeof(*tag));
+  memcpy(length, header + sizeof(*tag), sizeof(*length));
+  if (*tag == kTagSpilled) {
+    SpilledTLV spilled;
+    if (*length != sizeof(spilled)) {
+      SAPI_RAW_LOG(ERROR, "Invalid length of spilled TLV header: %u", *length);
+      return false;
+    }
+    std::vector<int> fds;
+    uint64_t num_remaining;
+    if (!Recv(reinterpret_cast<uint8_t*>(&spilled), sizeof(spilled)) ||
+        !RecvFDsChunk(&fds, &num_remaining)) {
+      return false;
+    }
+    if (fds.size() != 1 || num_remaining != 0) {
+      SAPI_RAW_LOG(ERROR, "Expected one fd with spilled TLV, got %u",
+                   fds.size());
+      for (int fd : fds) {
+        close(fd);
+      }
+      return false;
+    }
+    *spilled_fd = fds[0];
+    *tag = spilled.tag;
+    *length = spilled.length;
+    SAPI_RAW_VLOG(3, "Received a spilled TLV message, tag: 0x%08x, length: %u",
+                  *tag, *length);
+  }
   return true;
 }
 
-bool Comms::RecvTLV(TLV* tlv) {
+bool Comms::RecvPacketTL(uint32_t* tag, uint64_t* length, int* spilled_fd) {
+  // Peeking at the header also yields the size of the packet.
+  uint8_t header[sizeof(*tag) + sizeof(*length)];
+  iovec header_iov = {header, sizeof(header)};
+  const ssize_t size = RecvPacket(&header_iov, 1, nullptr, MSG_PEEK);
+  if (size < 0) {
+    return false;
+  }
+  if (static_cast<size_t>(size) < sizeof(header)) {
+    SAPI_RAW_LOG(ERROR, "Packet of %d bytes is too short for a TLV", size);
+    DiscardPacket();
+    return false;
+  }
+  memcpy(tag, header, sizeof(*tag));
+  memcpy(length, header + sizeof(*tag), sizeof(*length));
+  if (*length != size - sizeof(header)) {
+    SAPI_RAW_LOG(ERROR, "TLV length %u does not match its packet of %d bytes",
+                 *length, size);
+    DiscardPacket();
+    return false;
+  }
+  if (*tag != kTagSpilled) {
+    return true;
+  }
+  SpilledTLV spilled;
+  if (*length != sizeof(spilled)) {
+    SAPI_RAW_LOG(ERROR, "Invalid length of spilled TLV header: %u", *length);
+    DiscardPacket();
+    return false;
+  }
+  iovec iov[] = {
+      {header, sizeof(header)},
+      {&spilled, sizeof(spilled)},
+  };
+  if (RecvPacket(iov, ABSL_ARRAYSIZE(iov), spilled_fd, 0) < 0) {
+    return false;
+  }
+  if (*spilled_fd < 0) {
+    SAPI_RAW_LOG(ERROR, "Expected one fd with spilled TLV");
+    return false;
+  }
+  *tag = spilled.tag;
+  *length = spilled.length;
+  SAPI_RAW_VLOG(3, "Received a spilled TLV message, tag: 0x%08x, length: %u",
+                *tag, *length);
+  return true;
+}
+
+bool Comms::RecvPacketValue(uint8_t* bytes, uint64_t length) {
+  // The header was peeked at before, it is received again along with the
+  // value.
+  uint8_t header[sizeof(uint32_t) + sizeof(uint64_t)];
+  iovec iov[] = {
+      {header, sizeof(header)},
+      {bytes, length},
+  };
+  return RecvPacket(iov, ABSL_ARRAYSIZE(iov), nullptr, 0) >= 0;
+}
+
+void Comms::DiscardPacket() {
+  iovec iov = {nullptr, 0};
+  RecvPacket(&iov, 1, nullptr, 0);
+}
+
+ssize_t Comms::RecvPacket(iovec* iov, int iovcnt, int* fd, int flags) {
+  char fd_msg[CMSG_SPACE(sizeof(int))];
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  if (fd) {
+    *fd = -1;
+    msg.msg_control = fd_msg;
+    msg.msg_controllen = sizeof(fd_msg);
+  }
+  ssize_t size;
+  {
+    PotentiallyBlockingRegion region;
+    size = TEMP_FAILURE_RETRY(
+        util::Syscall(__NR_recvmsg, connection_fd_,
+                      reinterpret_cast<uintptr_t>(&msg), flags | MSG_TRUNC));
+  }
+  if (size < 0) {
+    if (IsFatalError(errno)) {
+      Terminate();
+    }
+    SAPI_RAW_PLOG(ERROR, "recvmsg");
+    return -1;
+  }
+  if (size == 0) {
+    Terminate();
+    // The other end might have finished its work.
+    SAPI_RAW_VLOG(2, "RecvPacket: end-point terminated the connection.");
+    return -1;
+  }
+#ifdef MEMORY_SANITIZER
+  ANNOTATE_MEMORY_IS_INITIALIZED(&msg, sizeof(msg));
+#endif
+  if (fd) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+          cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+      SAPI_RAW_LOG(ERROR,
+                   "recvmsg(SCM_RIGHTS): control data truncated, process is "
+                   "probably out of free file descriptors");
+      if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+      }
+      return -1;
+    }
+  }
+  uint64_t capacity = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    capacity += iov[i].iov_len;
+  }
+  if (!(flags & MSG_PEEK) && capacity != 0 &&
+      static_cast<uint64_t>(size) != capacity) {
+    SAPI_RAW_LOG(ERROR, "Expected a packet of %u bytes, got %d", capacity,
+                 size);
+    if (fd && *fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+    return -1;
+  }
+  return size;
+}
+
+bool Comms::SendPacket(iovec* iov, int iovcnt, int fd) {
+  char fd_msg[CMSG_SPACE(sizeof(int))] = {0};
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  if (fd != -1) {
+    cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(fd_msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    msg.msg_control = fd_msg;
+    msg.msg_controllen = sizeof(fd_msg);
+  }
+  uint64_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  ssize_t sent;
+  {
+    PotentiallyBlockingRegion region;
+    // Use syscall, otherwise we would need to whitelist socketcall() on PPC.
+    sent = TEMP_FAILURE_RETRY(util::Syscall(
+        __NR_sendmsg, connection_fd_, reinterpret_cast<uintptr_t>(&msg), 0));
+  }
+  if (sent == -1 && errno == EPIPE) {
+    Terminate();
+    SAPI_RAW_LOG(ERROR, "sendmsg: Peer disconnected");
+    return false;
+  }
+  if (sent < 0) {
+    if (IsFatalError(errno)) {
+      Terminate();
+    }
+    SAPI_RAW_PLOG(ERROR, "sendmsg");
+    return false;
+  }
+  if (static_cast<uint64_t>(sent) != len) {
+    SAPI_RAW_LOG(ERROR, "Expected to send %u bytes, sent %d", len, sent);
+    return false;
+  }
+  return true;
+}
+
+bool Comms::RecvValue(uint8_t* bytes, uint64_t length, int spilled_fd) {
+  if (spilled_fd == kInflatedValue) {
+    if (length != inflated_.size()) {
+      SAPI_RAW_LOG(ERROR, "Inflated TLV size mismatch (%u != %u)", length,
+                   inflated_.size());
+      return false;
+    }
+    if (length > 0) {
+      memcpy(bytes, inflated_.data(), length);
+    }
+    return true;
+  }
+  if (spilled_fd < 0) {
+    if (seqpacket_) {
+      return RecvPacketValue(bytes, length);
+    }
+    return length == 0 || Recv(bytes, length);
+  }
+  // Read with pread() instead of mapping the file: the sender could truncate
+  // it at any time, which must not fault the receiver.
+  uint64_t total_read = 0;
+  while (total_read < length) {
+    ssize_t s = TEMP_FAILURE_RETRY(pread(spilled_fd, bytes + total_read,
+                                         length - total_read, total_read));
+    if (s <= 0) {
+      if (s < 0) {
+        SAPI_RAW_PLOG(ERROR, "pread() of spilled TLV");
+      } else {
+        SAPI_RAW_LOG(ERROR, "Spilled TLV truncated (%u < %u)", total_read,
+                     length);
+      }
+      break;
+    }
+    total_read += s;
+  }
+  close(spilled_fd);
+  return total_read == length;
+}
+
+bool Comms::RecvTLV(TLV* tlv) { return RecvTLV(&tlv->tag, &tlv->value); }
+
+bool Comms::RecvTLV(uint32_t* tag, std::vector<uint8_t>* value) {
   absl::MutexLock lock(&tlv_recv_transmission_mutex_);
   uint64_t length;
-  if (!RecvTL(&tlv->tag, &length)) {
+  int spilled_fd;
+  if (!RecvTL(tag, &length, &spilled_fd)) {
     return false;
   }
 
-  tlv->value.resize(length);
-  return length == 0 || Recv(tlv->value.data(), length);
+  value->resize(length);
+  return RecvValue(value->data(), length, spilled_fd);
 }
 
-bool Comms::RecvTLV(uint32_t* tag, std::vector<uint8_t>* value) {
+bool Comms::TryRecvTLV(uint32_t* tag, std::vector<uint8_t>* value,
+                       bool* received) {
+  *received = false;
   absl::MutexLock lock(&tlv_recv_transmission_mutex_);
+  uint8_t header[sizeof(*tag) + sizeof(uint64_t)];
+  ssize_t s = TEMP_FAILURE_RETRY(
+      recv(connection_fd_, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT));
+  if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  if (s == -1) {
+    if (IsFatalError(errno)) {
+      Terminate();
+    }
+    SAPI_RAW_PLOG(ERROR, "recv(MSG_PEEK)");
+    return false;
+  }
+  if (s == 0) {
+    Terminate();
+    SAPI_RAW_VLOG(2, "TryRecvTLV: end-point terminated the connection.");
+    return false;
+  }
+  if (static_cast<size_t>(s) < sizeof(header)) {
+    return true;
+  }
   uint64_t length;
-  if (!RecvTL(tag, &length)) {
+  memcpy(&length, header + sizeof(*tag), sizeof(length));
+  int queued;
+  if (ioctl(connection_fd_, FIONREAD, &queued) != 0) {
+    SAPI_RAW_PLOG(ERROR, "ioctl(FIONREAD)");
     return false;
   }
+  // The socket buffer might be too small to ever hold the whole TLV, but the
+  // sender is in the middle of writing it then.
+  if (length < kMaxTryRecvSize &&
+      static_cast<uint64_t>(queued) < sizeof(header) + length) {
+    return true;
+  }
 
+  int spilled_fd;
+  if (!RecvTL(tag, &length, &spilled_fd)) {
+    return false;
+  }
   value->resize(length);
-  return length == 0 || Recv(value->data(), length);
+  if (!RecvValue(value->data(), length, spilled_fd)) {
+    return false;
+  }
+  *received = true;
+  return true;
 }
 
 bool Comms::RecvTLV(uint32_t* tag, uint64_t* length, void* buffer,
                     uint64_t buffer_size) {
   absl::MutexLock lock(&tlv_recv_transmission_mutex_);
-  if (!RecvTL(tag, length)) {
+  int spilled_fd;
+  if (!RecvTL(tag, length, &spilled_fd)) {
     return false;
   }
 
   if (*length > buffer_size) {
     SAPI_RAW_LOG(ERROR, "Buffer size too small (0x%x > 0x%x)", *length,
                  buffer_size);
+    DiscardValue(spilled_fd);
     return false;
-  } else if (*length > 0) {
-    if (!Recv(reinterpret_cast<uint8_t*>(buffer), *length)) {
-      return false;
-    }
   }
-  return true;
+  return RecvValue(reinterpret_cast<uint8_t*>(buffer), *length, spilled_fd);
 }
 
 bool Comms::RecvInt(void* buffer, uint64_t len, uint32_t tag) {
@@ -23,13 +23,16 @@
 #ifndef SANDBOXED_API_SANDBOX2_COMMS_H_
 #define SANDBOXED_API_SANDBOX2_COMMS_H_
 
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <limits>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/synchronization/mutex.h"
@@ -58,15 +61,47 @@ class Comms {
   static constexpr uint32_t kTagBytes = 0x80000101;
   static constexpr uint32_t kTagProto2 = 0x80000102;
   static constexpr uint32_t kTagFd = 0X80000201;
+  // Header of a TLV whose value was spilled into a memfd, see
+  // SetSpillThreshold().
+  static constexpr uint32_t kTagSpilled = 0x80000202;
+  // Header of a TLV whose value was deflated, see SetCompressionThreshold().
+  static constexpr uint32_t kTagCompressed = 0x80000203;
+  // Messages of the job loop, see Client::RunJobLoop().
+  static constexpr uint32_t kTagJob = 0x80000401;
+  static constexpr uint32_t kTagJobResult = 0x80000402;
+  static constexpr uint32_t kTagJobCrashed = 0x80000403;
+  static constexpr uint32_t kTagJobLoopExit = 0x80000404;
+
+  // Maximum number of file descriptors passed in a single message, as limited
+  // by the kernel (SCM_MAX_FD).
+  static constexpr size_t kMaxFDsPerMessage = 253;
 
   // Any payload size above this limit will LOG(WARNING).
   static constexpr uint64_t kWarnMsgSize = (256ULL << 20);
 
+  // Spill threshold which disables spilling.
+  static constexpr uint64_t kNoSpill = std::numeric_limits<uint64_t>::max();
+
+  // Compression threshold which disables compression.
+  static constexpr uint64_t kNoCompression =
+      std::numeric_limits<uint64_t>::max();
+
   // Sandbox2-specific convention where FD=1023 is always passed to the
   // sandboxed process as a communication channel (encapsulated in the
   // sandbox2::Comms object at the server-side).
   static constexpr int kSandbox2ClientCommsFD = 1023;
 
+  // Envvar which, if set to 1, tells a sandboxee that its
+  // kSandbox2ClientCommsFD is a SOCK_SEQPACKET socket, as it might not be
+  // allowed to ask the kernel. Set by the Executor for the executed binary,
+  // the forkserver asks the kernel before that.
+  static constexpr char kSeqpacketEnv[] = "SANDBOX2_COMMS_SEQPACKET";
+
+  // Largest TLV value sent as a single packet over a SOCK_SEQPACKET socket,
+  // larger ones are spilled (see SetSpillThreshold()) as the kernel limits the
+  // packet size to the socket buffer.
+  static constexpr uint64_t kMaxPacketValueSize = 64 << 10;
+
   // This object will have to be connected later on.
   explicit Comms(const std::string& socket_name);
 
@@ -75,8 +110,21 @@ class Comms {
 
   // Instantiates a pre-connected object.
   // Takes ownership over fd, which will be closed on object's destruction.
+  //
+  // If 'fd' is a SOCK_SEQPACKET socket, each TLV travels as one packet: it is
+  // written with a single system call and received with a single recvmsg()
+  // after peeking at its size, instead of reading the header and the value
+  // separately. The spilled memfd of a TLV travels in the same packet. Both
+  // ends must use the same socket type. For kSandbox2ClientCommsFD the type is
+  // taken from kSeqpacketEnv, for any other 'fd' it is asked from the kernel.
   explicit Comms(int fd);
 
+  // Like above, with the socket type of 'fd' passed in.
+  Comms(int fd, bool seqpacket);
+
+  // Returns whether 'fd' is a SOCK_SEQPACKET socket.
+  static bool IsSeqpacketSocket(int fd);
+
   ~Comms();
 
   // Binds to an address and make it listen to connections.
@@ -98,6 +146,9 @@ class Comms {
   bool IsConnected() const { return state_ == State::kConnected; }
   bool IsTerminated() const { return state_ == State::kTerminated; }
 
+  // Whether each TLV is a packet of a SOCK_SEQPACKET socket, see Comms(int).
+  bool IsSeqpacket() const { return seqpacket_; }
+
   // Returns the maximum size of a message that can be send over the comms
   // channel.
   // Note: The actual size is "unlimited", although the Buffer API is more
@@ -105,10 +156,39 @@ class Comms {
   // avoid protobuf serialization issues.
   uint64_t GetMaxMsgSize() const { return std::numeric_limits<int32_t>::max(); }
 
+  // Sends the values of all TLVs of at least 'threshold' bytes through a memfd
+  // instead of the socket: the value is written into a new memfd, and only the
+  // fd and the length are sent. Receiving spilled TLVs is transparent and
+  // always supported. A sandboxed sender needs memfd_create() and pwritev(),
+  // a sandboxed receiver pread64(). Disabled by default (kNoSpill).
+  void SetSpillThreshold(uint64_t threshold) { spill_threshold_ = threshold; }
+
+  // Deflates the values of all TLVs of at least 'threshold' bytes, for
+  // channels on which bandwidth is scarcer than CPU time. Values which do not
+  // get smaller are sent as they are, and smaller TLVs are not touched at all.
+  // Receiving compressed TLVs is transparent and always supported, so only the
+  // sender opts in. Compressed values can still be spilled. Disabled by
+  // default (kNoCompression).
+  void SetCompressionThreshold(uint64_t threshold) {
+    compression_threshold_ = threshold;
+  }
+
   bool SendTLV(uint32_t tag, uint64_t length, const uint8_t* bytes);
+  // Sends a TLV structure whose value is the concatenation of 'fragments'.
+  // The header and the fragments are written with a single writev() call
+  // where possible, without copying them into one buffer first.
+  bool SendTLVv(uint32_t tag, const iovec* fragments, int num_fragments);
   // Receive a TLV structure, the memory for the value will be allocated
-  // by std::vector.
+  // by std::vector. The capacity of 'value' is reused, so receiving all
+  // messages into the same vector avoids an allocation per message.
   bool RecvTLV(uint32_t* tag, std::vector<uint8_t>* value);
+  // Receives a TLV only if it can be read without blocking, for event loops
+  // polling GetConnectionFD() for readability. Returns false on errors and
+  // otherwise sets 'received' to whether a TLV was read. Nothing is consumed
+  // until the TLV arrived completely, so this can be mixed with all blocking
+  // receives. TLVs larger than 64 KiB are read blocking as soon as their
+  // header arrived, as they might not fit into the socket buffer at once.
+  bool TryRecvTLV(uint32_t* tag, std::vector<uint8_t>* value, bool* received);
   // Receives a TLV value into a specified buffer without allocating memory.
   bool RecvTLV(uint32_t* tag, uint64_t* length, void* buffer, uint64_t buffer_size);
 
@@ -145,6 +225,11 @@ class Comms {
   bool RecvFD(int* fd);
   bool SendFD(int fd);
 
+  // Receives/sends several file descriptors, in as few messages as possible.
+  // On failure, no file descriptors are returned.
+  bool RecvFDs(std::vector<int>* fds);
+  bool SendFDs(const std::vector<int>& fds);
+
   // Receives/sends protobufs.
   bool RecvProtoBuf(google::protobuf::Message* message);
   bool SendProtoBuf(const google::protobuf::Message& message);
@@ -176,6 +261,21 @@ class Comms {
   // State of the channel (enum), socket will have to be connected later on.
   State state_ = State::kUnconnected;
 
+  // See Comms(int).
+  bool seqpacket_ = false;
+
+  // See SetSpillThreshold().
+  uint64_t spill_threshold_ = kNoSpill;
+
+  // See SetCompressionThreshold().
+  uint64_t compression_threshold_ = kNoCompression;
+
+  // Receives serialized protos, kept to reuse its allocation.
+  std::vector<uint8_t> proto_buffer_ GUARDED_BY(tlv_recv_transmission_mutex_);
+
+  // Value of the last compressed TLV, inflated by RecvTL().
+  std::vector<uint8_t> inflated_ GUARDED_BY(tlv_recv_transmission_mutex_);
+
   // TLV structure used to pass messages around.
   struct TLV {
     uint32_t tag;
@@ -191,6 +291,12 @@ class Comms {
     uint64_t val;
   };
 
+  // Receives/sends a single message with up to kMaxFDsPerMessage file
+  // descriptors. 'num_remaining' is the number of file descriptors following
+  // in subsequent messages. Received file descriptors are appended to 'fds'.
+  bool RecvFDsChunk(std::vector<int>* fds, uint64_t* num_remaining);
+  bool SendFDsChunk(const int* fds, size_t num_fds, uint64_t num_remaining);
+
   // Fills sockaddr_un struct with proper values.
   socklen_t CreateSockaddrUn(sockaddr_un* sun);
 
@@ -198,10 +304,51 @@ class Comms {
   bool Send(const uint8_t* bytes, uint64_t len);
   bool Recv(uint8_t* bytes, uint64_t len);
 
+  // Sends all buffers of 'iov' with as few writev() calls as possible.
+  // Modifies 'iov' to track partial writes.
+  bool SendIov(iovec* iov, int iovcnt);
+
   // Receives tag and length. Assumes that the `tlv_transmission_mutex_` mutex
-  // is locked.
-  bool RecvTL(uint32_t* tag, uint64_t* length)
+  // is locked. For a spilled TLV, returns the original tag and length and
+  // the memfd holding the value in 'spilled_fd', -1 otherwise. Compressed TLVs
+  // are inflated into 'inflated_', 'spilled_fd' is kInflatedValue then.
+  bool RecvTL(uint32_t* tag, uint64_t* length, int* spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+  bool RecvStreamTL(uint32_t* tag, uint64_t* length, int* spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+
+  // Receives the value of a TLV after RecvTL(), either from the socket, from
+  // 'spilled_fd', which is closed, or from 'inflated_'.
+  bool RecvValue(uint8_t* bytes, uint64_t length, int spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+  // Drops the value of a TLV after RecvTL() instead.
+  void DiscardValue(int spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+  // Replaces a kTagCompressed TLV received by RecvTL() with the original one.
+  bool RecvCompressed(uint32_t* tag, uint64_t* length, int* spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+
+  // RecvTL() and RecvValue() of SOCK_SEQPACKET sockets. The packet stays
+  // queued after RecvPacketTL() unless the TLV was spilled, and is consumed
+  // by RecvPacketValue() or DiscardPacket().
+  bool RecvPacketTL(uint32_t* tag, uint64_t* length, int* spilled_fd)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+  bool RecvPacketValue(uint8_t* bytes, uint64_t length)
       EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+  void DiscardPacket() EXCLUSIVE_LOCKS_REQUIRED(tlv_recv_transmission_mutex_);
+
+  // Receives one packet of a SOCK_SEQPACKET socket into 'iov', with recvmsg()
+  // 'flags', and the fd sent with it into 'fd' if not null. Returns the size
+  // of the whole packet even if 'iov' is smaller, or -1 if receiving failed.
+  ssize_t RecvPacket(iovec* iov, int iovcnt, int* fd, int flags);
+  // Sends 'iov' as one packet of a SOCK_SEQPACKET socket, together with 'fd'
+  // unless it is -1.
+  bool SendPacket(iovec* iov, int iovcnt, int fd);
+
+  // Sends the value of a TLV through a new memfd, see SetSpillThreshold().
+  bool SendSpilled(uint32_t tag, uint64_t length, const iovec* fragments,
+                   int num_fragments)
+      EXCLUSIVE_LOCKS_REQUIRED(tlv_send_transmission_mutex_);
 
   // Receives whole TLV structure, allocates memory for the data.
   bool RecvTLV(TLV* tlv);
@@ -19,16 +19,20 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <string>
 #include <thread>  // NOLINT(build/c++11)
 #include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include "google/protobuf/text_format.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/base/macros.h"
 #include "absl/container/fixed_array.h"
 #include "absl/strings/string_view.h"
 #include "sandboxed_api/sandbox2/comms_test.pb.h"
@@ -232,6 +236,225 @@ TEST_F(CommsTest, TestSendRecvArray) {
   HandleCommunication(sockname_, a, b);
 }
 
+TEST_F(CommsTest, TestSendRecvTLVsPartialWrites) {
+  // Messages larger than the socket buffer are written in several parts, the
+  // contents must survive all of them.
+  constexpr int kNumMessages = 8;
+  const auto message = [](int i) {
+    std::vector<uint8_t> value((1 << 20) + i * 4097);
+    for (size_t j = 0; j < value.size(); ++j) {
+      value[j] = static_cast<uint8_t>(j * 31 + i);
+    }
+    return value;
+  };
+  auto a = [&message](Comms* comms) {
+    for (int i = 0; i < kNumMessages; ++i) {
+      uint32_t tag;
+      std::vector<uint8_t> value;
+      ASSERT_THAT(comms->RecvTLV(&tag, &value), IsTrue());
+      EXPECT_THAT(tag, Eq(0x100 + i));
+      EXPECT_THAT(value == message(i), IsTrue());
+    }
+  };
+  auto b = [&message](Comms* comms) {
+    for (int i = 0; i < kNumMessages; ++i) {
+      std::vector<uint8_t> value = message(i);
+      ASSERT_THAT(comms->SendTLV(0x100 + i, value.size(), value.data()),
+                  IsTrue());
+    }
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
+TEST_F(CommsTest, TestSendRecvTLVv) {
+  auto a = [](Comms* comms) {
+    uint32_t tag;
+    std::vector<uint8_t> value;
+    ASSERT_THAT(comms->RecvTLV(&tag, &value), IsTrue());
+    EXPECT_THAT(tag, Eq(0x100));
+    EXPECT_THAT(std::string(value.begin(), value.end()), Eq("headerpayload"));
+    // The buffer is reused for the next message.
+    ASSERT_THAT(comms->RecvTLV(&tag, &value), IsTrue());
+    EXPECT_THAT(tag, Eq(0x101));
+    EXPECT_THAT(value.empty(), IsTrue());
+  };
+  auto b = [](Comms* comms) {
+    char header[] = "header";
+    char payload[] = "payload";
+    iovec fragments[] = {
+        {header, strlen(header)},
+        {nullptr, 0},
+        {payload, strlen(payload)},
+    };
+    ASSERT_THAT(comms->SendTLVv(0x100, fragments, ABSL_ARRAYSIZE(fragments)),
+                IsTrue());
+    ASSERT_THAT(comms->SendTLVv(0x101, nullptr, 0), IsTrue());
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
+TEST_F(CommsTest, TestSendRecvSpilledTLVs) {
+  std::vector<uint8_t> large(1024 * 1024);
+  for (size_t i = 0; i < large.size(); ++i) {
+    large[i] = static_cast<uint8_t>(i);
+  }
+  auto a = [&large](Comms* comms) {
+    std::vector<uint8_t> buffer;
+    ASSERT_THAT(comms->RecvBytes(&buffer), IsTrue());
+    EXPECT_THAT(buffer == large, IsTrue());
+    // Values below the threshold still go through the socket.
+    uint32_t value;
+    ASSERT_THAT(comms->RecvUint32(&value), IsTrue());
+    EXPECT_THAT(value, Eq(42));
+    uint32_t tag;
+    uint64_t length;
+    std::vector<uint8_t> fixed(large.size());
+    ASSERT_THAT(comms->RecvTLV(&tag, &length, fixed.data(), fixed.size()),
+                IsTrue());
+    EXPECT_THAT(tag, Eq(0x100));
+    EXPECT_THAT(length, Eq(large.size()));
+    EXPECT_THAT(fixed == large, IsTrue());
+  };
+  auto b = [&large](Comms* comms) {
+    comms->SetSpillThreshold(4096);
+    ASSERT_THAT(comms->SendBytes(large), IsTrue());
+    ASSERT_THAT(comms->SendUint32(42), IsTrue());
+    ASSERT_THAT(comms->SendTLV(0x100, large.size(), large.data()), IsTrue());
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
+TEST_F(CommsTest, TestSendRecvCompressedTLVs) {
+  std::vector<uint8_t> compressible(1024 * 1024);
+  for (size_t i = 0; i < compressible.size(); ++i) {
+    compressible[i] = static_cast<uint8_t>(i % 251);
+  }
+  // Does not get smaller, and is sent as it is.
+  std::vector<uint8_t> random(64 * 1024);
+  uint32_t state = 1;
+  for (size_t i = 0; i < random.size(); ++i) {
+    state = state * 1103515245 + 12345;
+    random[i] = static_cast<uint8_t>(state >> 24);
+  }
+  CommsTestMsg msg;
+  msg.add_value(std::string(100000, 'a'));
+  auto a = [&compressible, &random, &msg](Comms* comms) {
+    std::vector<uint8_t> buffer;
+    ASSERT_THAT(comms->RecvBytes(&buffer), IsTrue());
+    EXPECT_THAT(buffer == compressible, IsTrue());
+    ASSERT_THAT(comms->RecvBytes(&buffer), IsTrue());
+    EXPECT_THAT(buffer == random, IsTrue());
+    uint32_t value;
+    ASSERT_THAT(comms->RecvUint32(&value), IsTrue());
+    EXPECT_THAT(value, Eq(42));
+    CommsTestMsg received_msg;
+    ASSERT_THAT(comms->RecvProtoBuf(&received_msg), IsTrue());
+    EXPECT_THAT(received_msg.SerializeAsString(), Eq(msg.SerializeAsString()));
+    // Compressed and then spilled.
+    ASSERT_THAT(comms->RecvBytes(&buffer), IsTrue());
+    EXPECT_THAT(buffer == compressible, IsTrue());
+    // Inflated values which do not fit are dropped, the next one is intact.
+    uint32_t tag;
+    uint64_t length;
+    std::vector<uint8_t> fixed(1024);
+    EXPECT_THAT(comms->RecvTLV(&tag, &length, fixed.data(), fixed.size()),
+                IsFalse());
+    ASSERT_THAT(comms->RecvUint32(&value), IsTrue());
+    EXPECT_THAT(value, Eq(43));
+  };
+  auto b = [&compressible, &random, &msg](Comms* comms) {
+    comms->SetCompressionThreshold(4096);
+    ASSERT_THAT(comms->SendBytes(compressible), IsTrue());
+    ASSERT_THAT(comms->SendBytes(random), IsTrue());
+    ASSERT_THAT(comms->SendUint32(42), IsTrue());
+    ASSERT_THAT(comms->SendProtoBuf(msg), IsTrue());
+    comms->SetSpillThreshold(1024);
+    ASSERT_THAT(comms->SendBytes(compressible), IsTrue());
+    ASSERT_THAT(comms->SendTLV(0x100, compressible.size(), compressible.data()),
+                IsTrue());
+    ASSERT_THAT(comms->SendUint32(43), IsTrue());
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
+TEST_F(CommsTest, TestSendRecvCompressedSeqpacket) {
+  int sv[2];
+  ASSERT_THAT(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), Eq(0));
+  Comms sender(sv[0]);
+  Comms receiver(sv[1]);
+  sender.SetCompressionThreshold(1024);
+  // Compresses into a single packet, which it would not fit otherwise.
+  std::vector<uint8_t> large(1024 * 1024, 'a');
+
+  std::thread remote([&sender, &large]() {
+    ASSERT_THAT(sender.SendBytes(large), IsTrue());
+    ASSERT_THAT(sender.SendTLV(0x100, large.size(), large.data()), IsTrue());
+    ASSERT_THAT(sender.SendUint32(42), IsTrue());
+  });
+  std::vector<uint8_t> buffer;
+  ASSERT_THAT(receiver.RecvBytes(&buffer), IsTrue());
+  EXPECT_THAT(buffer == large, IsTrue());
+  uint32_t tag;
+  uint64_t length;
+  std::vector<uint8_t> fixed(1024);
+  EXPECT_THAT(receiver.RecvTLV(&tag, &length, fixed.data(), fixed.size()),
+              IsFalse());
+  uint32_t value;
+  ASSERT_THAT(receiver.RecvUint32(&value), IsTrue());
+  EXPECT_THAT(value, Eq(42));
+  remote.join();
+}
+
+TEST_F(CommsTest, TestSendRecvSeqpacket) {
+  int sv[2];
+  ASSERT_THAT(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), Eq(0));
+  Comms sender(sv[0]);
+  Comms receiver(sv[1]);
+  ASSERT_THAT(sender.IsSeqpacket(), IsTrue());
+  ASSERT_THAT(receiver.IsSeqpacket(), IsTrue());
+  // Large values are spilled, as packets are limited by the socket buffer.
+  std::vector<uint8_t> large(1024 * 1024);
+  for (size_t i = 0; i < large.size(); ++i) {
+    large[i] = static_cast<uint8_t>(i);
+  }
+  CommsTestMsg msg;
+  msg.add_value(std::string(10000, 'a'));
+
+  std::thread remote([&sender, &large, &msg]() {
+    ASSERT_THAT(sender.SendUint32(42), IsTrue());
+    ASSERT_THAT(sender.SendTLV(0x100, 0, nullptr), IsTrue());
+    ASSERT_THAT(sender.SendProtoBuf(msg), IsTrue());
+    ASSERT_THAT(sender.SendBytes(large), IsTrue());
+    ASSERT_THAT(sender.SendFD(STDERR_FILENO), IsTrue());
+    ASSERT_THAT(sender.SendUint32(43), IsTrue());
+    ASSERT_THAT(sender.SendUint32(44), IsTrue());
+  });
+  uint32_t value;
+  ASSERT_THAT(receiver.RecvUint32(&value), IsTrue());
+  EXPECT_THAT(value, Eq(42));
+  uint32_t tag;
+  std::vector<uint8_t> empty;
+  ASSERT_THAT(receiver.RecvTLV(&tag, &empty), IsTrue());
+  EXPECT_THAT(tag, Eq(0x100));
+  EXPECT_THAT(empty.empty(), IsTrue());
+  CommsTestMsg received_msg;
+  ASSERT_THAT(receiver.RecvProtoBuf(&received_msg), IsTrue());
+  EXPECT_THAT(received_msg.SerializeAsString(), Eq(msg.SerializeAsString()));
+  std::vector<uint8_t> buffer;
+  ASSERT_THAT(receiver.RecvBytes(&buffer), IsTrue());
+  EXPECT_THAT(buffer == large, IsTrue());
+  int fd = -1;
+  ASSERT_THAT(receiver.RecvFD(&fd), IsTrue());
+  EXPECT_THAT(fd, testing::Ge(0));
+  close(fd);
+  // A mismatching receive consumes the packet, the next one is intact.
+  uint8_t small;
+  EXPECT_THAT(receiver.RecvUint8(&small), IsFalse());
+  ASSERT_THAT(receiver.RecvUint32(&value), IsTrue());
+  EXPECT_THAT(value, Eq(44));
+  remote.join();
+}
+
 TEST_F(CommsTest, TestSendRecvFD) {
   auto a = [](Comms* comms) {
     // Receive FD and test it.
@@ -247,6 +470,28 @@ TEST_F(CommsTest, TestSendRecvFD) {
   HandleCommunication(sockname_, a, b);
 }
 
+TEST_F(CommsTest, TestSendRecvFDs) {
+  // More file descriptors than fit into a single message.
+  constexpr size_t kNumFDs = Comms::kMaxFDsPerMessage + 10;
+  auto a = [](Comms* comms) {
+    std::vector<int> fds;
+    ASSERT_THAT(comms->RecvFDs(&fds), IsTrue());
+    EXPECT_THAT(fds.size(), Eq(kNumFDs));
+    for (int fd : fds) {
+      EXPECT_NE(fcntl(fd, F_GETFD), -1);
+      close(fd);
+    }
+    ASSERT_THAT(comms->RecvFDs(&fds), IsTrue());
+    EXPECT_THAT(fds.size(), Eq(0));
+  };
+  auto b = [](Comms* comms) {
+    ASSERT_THAT(comms->SendFDs(std::vector<int>(kNumFDs, STDERR_FILENO)),
+                IsTrue());
+    ASSERT_THAT(comms->SendFDs({}), IsTrue());
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
 TEST_F(CommsTest, TestSendRecvEmptyTLV) {
   auto a = [](Comms* comms) {
     // Receive TLV without a value.
@@ -299,6 +544,31 @@ TEST_F(CommsTest, TestSendRecvProto) {
   HandleCommunication(sockname_, a, b);
 }
 
+TEST_F(CommsTest, TestSendRecvLargeProtos) {
+  // Protos which are too large to be serialized on the stack are streamed
+  // into the socket. Sizes vary to exercise the reused receive buffer.
+  const auto message = [](int i) {
+    CommsTestMsg msg;
+    for (int j = 0; j <= i; ++j) {
+      msg.add_value(std::string(100000 + i * 1000, 'a' + j));
+    }
+    return msg;
+  };
+  auto a = [&message](Comms* comms) {
+    for (int i = 3; i >= 0; --i) {
+      CommsTestMsg msg;
+      ASSERT_THAT(comms->RecvProtoBuf(&msg), IsTrue());
+      EXPECT_THAT(msg.SerializeAsString(), Eq(message(i).SerializeAsString()));
+    }
+  };
+  auto b = [&message](Comms* comms) {
+    for (int i = 3; i >= 0; --i) {
+      ASSERT_THAT(comms->SendProtoBuf(message(i)), IsTrue());
+    }
+  };
+  HandleCommunication(sockname_, a, b);
+}
+
 TEST_F(CommsTest, TestSendRecvStatusOK) {
   auto a = [](Comms* comms) {
     // Receive a good status.
@@ -16,18 +16,26 @@
 // to be sandboxed by the sandbox2.
 
 #include <syscall.h>
+#include <unistd.h>
 
 #include <cstdint>
 #include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include "sandboxed_api/util/flag.h"
+#include "sandboxed_api/sandbox2/buffer.h"
 #include "sandboxed_api/sandbox2/client.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/util.h"
+#include "sandboxed_api/util/status.pb.h"
 
 ABSL_FLAG(bool, call_syscall_not_allowed, false,
           "Call a syscall that is not allowed by policy.");
+ABSL_FLAG(bool, benchmark, false,
+          "Serve the Comms benchmark of crc4sandbox instead of a single CRC4.");
 
 // This function is insecure (i.e. can be crashed and exploited) to demonstrate
 // how sandboxing can be helpful in defending against bugs.
@@ -45,6 +53,82 @@ static uint32_t ComputeCRC4Impl(const uint8_t* ptr, uint64_t len) {
   return crc4;
 }
 
+// Serves the round trips of the Comms benchmark. Each run starts with the
+// tag of the messages to expect (zero ends the benchmark), the message size
+// and the number of round trips. Every message is acknowledged with the number
+// of payload bytes received, without looking at them, so that only the
+// transport is measured.
+static bool ServeBenchmark(sandbox2::Comms* comms) {
+  std::vector<uint8_t> bytes;
+  sapi::StatusProto proto;
+  std::unique_ptr<sandbox2::Buffer> shared;
+  while (true) {
+    uint32_t tag;
+    uint64_t size;
+    uint64_t iterations;
+    if (!comms->RecvUint32(&tag)) {
+      return false;
+    }
+    if (tag == 0) {
+      return true;
+    }
+    if (!comms->RecvUint64(&size) || !comms->RecvUint64(&iterations)) {
+      return false;
+    }
+    if (tag == sandbox2::Comms::kTagUint64) {
+      // The Buffer is mapped once, only the lengths are sent per round trip.
+      int fd;
+      if (!comms->RecvFD(&fd)) {
+        return false;
+      }
+      auto shared_or = sandbox2::Buffer::CreateFromFd(fd);
+      if (!shared_or.ok()) {
+        return false;
+      }
+      shared = std::move(shared_or).ValueOrDie();
+      if (shared->size() < size) {
+        return false;
+      }
+    }
+    for (uint64_t i = 0; i < iterations; ++i) {
+      uint64_t received = 0;
+      switch (tag) {
+        case sandbox2::Comms::kTagBytes:
+          if (!comms->RecvBytes(&bytes)) {
+            return false;
+          }
+          received = bytes.size();
+          break;
+        case sandbox2::Comms::kTagProto2:
+          if (!comms->RecvProtoBuf(&proto)) {
+            return false;
+          }
+          received = proto.error_message().size();
+          break;
+        case sandbox2::Comms::kTagFd: {
+          int fd;
+          if (!comms->RecvFD(&fd)) {
+            return false;
+          }
+          close(fd);
+          break;
+        }
+        case sandbox2::Comms::kTagUint64:
+          if (!comms->RecvUint64(&received) || received > shared->size()) {
+            return false;
+          }
+          break;
+        default:
+          return false;
+      }
+      if (!comms->SendUint64(received)) {
+        return false;
+      }
+    }
+    shared.reset();
+  }
+}
+
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
 
@@ -59,6 +143,10 @@ int main(int argc, char** argv) {
     sandbox2::util::Syscall(__NR_sendfile, 0, 0, 0, 0, 0, 0);
   }
 
+  if (absl::GetFlag(FLAGS_benchmark)) {
+    return ServeBenchmark(&comms) ? 0 : 1;
+  }
+
   // Receive data to be processed, process it, and return results.
   std::vector<uint8_t> buffer;
   if (!comms.RecvBytes(&buffer)) {
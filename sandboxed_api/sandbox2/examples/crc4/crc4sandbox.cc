@@ -18,10 +18,13 @@
 #include <sys/resource.h>
 #include <syscall.h>
 
+#include <algorithm>
+#include <cinttypes>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <utility>
@@ -30,6 +33,9 @@
 #include <glog/logging.h>
 #include "sandboxed_api/util/flag.h"
 #include "absl/memory/memory.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/buffer.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/ipc.h"
@@ -40,10 +46,14 @@
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
 #include "sandboxed_api/sandbox2/util/runfiles.h"
+#include "sandboxed_api/util/status.pb.h"
 
 ABSL_FLAG(string, input, "", "Input to calculate CRC4 of.");
 ABSL_FLAG(bool, call_syscall_not_allowed, false,
           "Have sandboxee call clone (violation).");
+ABSL_FLAG(bool, benchmark, false,
+          "Measure the Comms round-trip rate and bandwidth over the bytes, "
+          "protobuf, fd-passing and Buffer paths instead of computing a CRC4.");
 
 namespace {
 
@@ -61,6 +71,123 @@ std::unique_ptr<sandbox2::Policy> GetPolicy() {
       .BuildOrDie();
 }
 
+// The sandboxee additionally needs to receive file descriptors, map a Buffer
+// and allocate the received messages in benchmark mode.
+std::unique_ptr<sandbox2::Policy> GetBenchmarkPolicy() {
+  return sandbox2::PolicyBuilder()
+      .DisableNamespaces()
+      .AllowExit()
+      .AllowSystemMalloc()
+      .AllowMmap()
+      .AllowSyscalls({__NR_close, __NR_fstat})
+      .AddPolicyOnSyscalls(
+          {__NR_read, __NR_write, __NR_recvmsg},
+          {ARG_32(0), JEQ32(sandbox2::Comms::kSandbox2ClientCommsFD, ALLOW)})
+      .BuildOrDie();
+}
+
+// Message sizes of the benchmark, growing by a factor of 16.
+constexpr uint64_t kBenchmarkMinSize = 16;
+constexpr uint64_t kBenchmarkMaxSize = 16 << 20;
+// Payload moved per run, bounded by the number of round trips.
+constexpr uint64_t kBenchmarkBytesPerRun = 256 << 20;
+constexpr uint64_t kBenchmarkMinIterations = 16;
+constexpr uint64_t kBenchmarkMaxIterations = 20000;
+
+// Runs 'iterations' round trips of 'size' byte messages with the given tag,
+// see ServeBenchmark() in crc4bin.cc for the protocol.
+bool RunBenchmark(sandbox2::Comms* comms, uint32_t tag, uint64_t size,
+                  uint64_t iterations, const sandbox2::Buffer& shared) {
+  if (!comms->SendUint32(tag) || !comms->SendUint64(size) ||
+      !comms->SendUint64(iterations)) {
+    return false;
+  }
+  if (tag == sandbox2::Comms::kTagUint64 && !comms->SendFD(shared.fd())) {
+    return false;
+  }
+  const uint8_t* data = shared.data();
+  sapi::StatusProto proto;
+  if (tag == sandbox2::Comms::kTagProto2) {
+    proto.mutable_error_message()->assign(size, 'x');
+  }
+  const uint64_t expected = tag == sandbox2::Comms::kTagFd ? 0 : size;
+
+  const absl::Time start = absl::Now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    bool sent = false;
+    switch (tag) {
+      case sandbox2::Comms::kTagBytes:
+        sent = comms->SendBytes(data, size);
+        break;
+      case sandbox2::Comms::kTagProto2:
+        sent = comms->SendProtoBuf(proto);
+        break;
+      case sandbox2::Comms::kTagFd:
+        sent = comms->SendFD(shared.fd());
+        break;
+      case sandbox2::Comms::kTagUint64:
+        sent = comms->SendUint64(size);
+        break;
+    }
+    uint64_t received;
+    if (!sent || !comms->RecvUint64(&received) || received != expected) {
+      LOG(ERROR) << "Round trip " << i << " failed";
+      return false;
+    }
+  }
+  const double seconds = absl::ToDoubleSeconds(absl::Now() - start);
+
+  const char* name = "";
+  switch (tag) {
+    case sandbox2::Comms::kTagBytes:
+      name = "bytes";
+      break;
+    case sandbox2::Comms::kTagProto2:
+      name = "proto";
+      break;
+    case sandbox2::Comms::kTagFd:
+      name = "fd";
+      break;
+    case sandbox2::Comms::kTagUint64:
+      name = "buffer";
+      break;
+  }
+  printf("%-6s %10" PRIu64 " B %12.0f msgs/s %10.1f MiB/s %10.2f us/rtt\n",
+         name, size, iterations / seconds,
+         size * iterations / seconds / (1 << 20), seconds * 1e6 / iterations);
+  return true;
+}
+
+bool SandboxedBenchmark(sandbox2::Comms* comms) {
+  auto shared_or = sandbox2::Buffer::CreateWithSize(kBenchmarkMaxSize);
+  if (!shared_or.ok()) {
+    LOG(ERROR) << "Could not create the Buffer: " << shared_or.status();
+    return false;
+  }
+  auto shared = std::move(shared_or).ValueOrDie();
+  memset(shared->data(), 'x', shared->size());
+
+  // Passing an fd does not depend on a message size.
+  if (!RunBenchmark(comms, sandbox2::Comms::kTagFd, 0, kBenchmarkMaxIterations,
+                    *shared)) {
+    return false;
+  }
+  for (uint32_t tag : {sandbox2::Comms::kTagBytes, sandbox2::Comms::kTagProto2,
+                       sandbox2::Comms::kTagUint64}) {
+    for (uint64_t size = kBenchmarkMinSize; size <= kBenchmarkMaxSize;
+         size *= 16) {
+      const uint64_t iterations =
+          std::min(std::max(kBenchmarkBytesPerRun / size,
+                            kBenchmarkMinIterations),
+                   kBenchmarkMaxIterations);
+      if (!RunBenchmark(comms, tag, size, iterations, *shared)) {
+        return false;
+      }
+    }
+  }
+  return comms->SendUint32(0);
+}
+
 bool SandboxedCRC4(sandbox2::Comms* comms, uint32_t* crc4) {
   std::string input(absl::GetFlag(FLAGS_input));
 
@@ -85,7 +212,8 @@ int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
 
-  if (absl::GetFlag(FLAGS_input).empty()) {
+  const bool benchmark = absl::GetFlag(FLAGS_benchmark);
+  if (!benchmark && absl::GetFlag(FLAGS_input).empty()) {
     LOG(ERROR) << "Parameter --input required.";
     return 1;
   }
@@ -96,6 +224,9 @@ int main(int argc, char** argv) {
   if (absl::GetFlag(FLAGS_call_syscall_not_allowed)) {
     args.push_back("-call_syscall_not_allowed");
   }
+  if (benchmark) {
+    args.push_back("-benchmark");
+  }
   std::vector<std::string> envs = {};
   auto executor = absl::make_unique<sandbox2::Executor>(path, args, envs);
 
@@ -111,10 +242,10 @@ int main(int argc, char** argv) {
       // these many bytes to the file-system.
       .set_rlimit_fsize(1024)
       .set_rlimit_cpu(60)  // The CPU time limit in seconds.
-      .set_walltime_limit(absl::Seconds(5));
+      .set_walltime_limit(absl::Seconds(benchmark ? 300 : 5));
 
   auto* comms = executor->ipc()->comms();
-  auto policy = GetPolicy();
+  auto policy = benchmark ? GetBenchmarkPolicy() : GetPolicy();
 
   sandbox2::Sandbox2 s2(std::move(executor), std::move(policy));
 
@@ -125,9 +256,11 @@ int main(int argc, char** argv) {
     return 2;
   }
 
-  uint32_t crc4;
-  if (!SandboxedCRC4(comms, &crc4)) {
-    LOG(ERROR) << "GetCRC4 failed";
+  uint32_t crc4 = 0;
+  const bool success =
+      benchmark ? SandboxedBenchmark(comms) : SandboxedCRC4(comms, &crc4);
+  if (!success) {
+    LOG(ERROR) << (benchmark ? "Benchmark failed" : "GetCRC4 failed");
     if (!s2.IsTerminated()) {
       // Kill the sandboxee, because failure to receive the data over the Comms
       // channel doesn't automatically mean that the sandboxee itself had
@@ -150,6 +283,8 @@ int main(int argc, char** argv) {
     return 4;  // e.g. normal child error
   }
   LOG(INFO) << "Sandboxee finished: " << result.ToString();
-  printf("0x%08x\n", crc4);
+  if (!benchmark) {
+    printf("0x%08x\n", crc4);
+  }
   return EXIT_SUCCESS;
 }
@@ -47,6 +47,15 @@ int main(int argc, char** argv) {
   sandbox2::Comms comms(sandbox2::Comms::kSandbox2ClientCommsFD);
   sandbox2::ForkingClient s2client(&comms);
 
+  // State loaded here is shared by all sandboxees. Trimming the heap before
+  // the first fork keeps each of them small.
+  sandbox2::ForkingClient::ZygoteOptions zygote_options;
+  auto status = s2client.PrepareZygote(zygote_options);
+  if (!status.ok()) {
+    SAPI_RAW_LOG(WARNING, "Could not prepare the zygote: %s",
+                 status.message());
+  }
+
   for (;;) {
     // Start a new process, if the sandboxer requests us to do so. No need to
     // wait for the new process, as the call to sandbox2::Client::Fork will
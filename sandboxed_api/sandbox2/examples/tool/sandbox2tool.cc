@@ -16,16 +16,24 @@
 //
 // Usage:
 // sandbox2tool -v=1 -sandbox2_danger_danger_permit_all -logtostderr -- /bin/ls
+//
+// With --sandbox2tool_benchmark=N, the command is run N times and the
+// percentiles of the spawn-to-exec and spawn-to-exit latencies are printed:
+// sandbox2tool --sandbox2tool_benchmark=1000 \
+//     --sandbox2tool_benchmark_concurrency=8 -- /bin/true
 
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <cstdlib>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -34,6 +42,9 @@
 #include "absl/memory/memory.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_split.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/ipc.h"
 #include "sandboxed_api/sandbox2/limits.h"
@@ -76,6 +87,17 @@ ABSL_FLAG(string, sandbox2tool_additional_bind_mounts, "",
           "bind mounts. Mounts are separated by comma and can optionally "
           "specify a target using \"=>\" "
           "(e.g. \"/usr,/bin,/lib,/tmp/foo=>/etc/passwd\")");
+ABSL_FLAG(bool, sandbox2tool_disable_namespaces, false,
+          "Run the sandboxee without namespaces, which rules out the mount "
+          "and networking options");
+ABSL_FLAG(int32_t, sandbox2tool_benchmark, 0,
+          "If > 0, run the command this many times and report the spawn "
+          "latencies instead of its result");
+ABSL_FLAG(int32_t, sandbox2tool_benchmark_concurrency, 1,
+          "Number of sandboxees started at the same time in benchmark mode");
+ABSL_FLAG(int32_t, sandbox2tool_benchmark_prefork, 0,
+          "Number of sandboxees the forkserver keeps forked ahead of time in "
+          "benchmark mode, 0 to fork each on request");
 
 namespace {
 
@@ -93,33 +115,15 @@ void OutputFD(int fd) {
   }
 }
 
-}  // namespace
-
-int main(int argc, char** argv) {
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
-  google::InitGoogleLogging(argv[0]);
-
-  if (argc < 2) {
-    absl::FPrintF(stderr, "Usage: %s [flags] -- cmd args...", argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  // Pass everything after '--' to the sandbox.
-  std::vector<std::string> args;
-  sandbox2::util::CharPtrArrToVecString(&argv[1], &args);
-
+// Creates the executor for 'args', with the limits set by the flags.
+std::unique_ptr<sandbox2::Executor> CreateExecutor(
+    const std::vector<std::string>& args) {
   // Pass the current environ pointer, depending on the flag.
   std::vector<std::string> envp;
   if (absl::GetFlag(FLAGS_sandbox2tool_keep_env)) {
     sandbox2::util::CharPtrArrToVecString(environ, &envp);
   }
-  auto executor = absl::make_unique<sandbox2::Executor>(argv[1], args, envp);
-
-  int recv_fd1 = -1;
-  if (absl::GetFlag(FLAGS_sandbox2tool_redirect_fd1)) {
-    // Make the sandboxed process' fd be available as fd in the current process.
-    recv_fd1 = executor->ipc()->ReceiveFd(STDOUT_FILENO);
-  }
+  auto executor = absl::make_unique<sandbox2::Executor>(args[0], args, envp);
 
   executor
       ->limits()
@@ -140,10 +144,22 @@ int main(int argc, char** argv) {
         absl::GetFlag(FLAGS_sandbox2tool_cpu_timeout));
   }
 
+  // Current working directory.
+  if (!absl::GetFlag(FLAGS_sandbox2tool_cwd).empty()) {
+    executor->set_cwd(absl::GetFlag(FLAGS_sandbox2tool_cwd));
+  }
+  return executor;
+}
+
+// Builds the policy set by the flags for running 'binary'.
+std::unique_ptr<sandbox2::Policy> CreatePolicy(const std::string& binary) {
   sandbox2::PolicyBuilder builder;
   builder.AddPolicyOnSyscall(__NR_tee, {KILL});
   builder.DangerDefaultAllowAll();
 
+  if (absl::GetFlag(FLAGS_sandbox2tool_disable_namespaces)) {
+    builder.DisableNamespaces();
+  }
   if (absl::GetFlag(FLAGS_sandbox2tool_need_networking)) {
     builder.AllowUnrestrictedNetworking();
   }
@@ -172,15 +188,129 @@ int main(int argc, char** argv) {
   }
 
   if (absl::GetFlag(FLAGS_sandbox2tool_resolve_and_add_libraries)) {
-    builder.AddLibrariesForBinary(argv[1]);
+    builder.AddLibrariesForBinary(binary);
   }
 
-  auto policy = builder.BuildOrDie();
+  return builder.BuildOrDie();
+}
 
-  // Current working directory.
-  if (!absl::GetFlag(FLAGS_sandbox2tool_cwd).empty()) {
-    executor->set_cwd(absl::GetFlag(FLAGS_sandbox2tool_cwd));
+// Latencies of one sandboxee, measured from just before it is started.
+struct SpawnLatency {
+  absl::Duration exec;
+  absl::Duration exit;
+};
+
+// Prints the 50th, 90th and 99th percentile of 'latencies'.
+void PrintPercentiles(const char* name, std::vector<absl::Duration> latencies) {
+  if (latencies.empty()) {
+    absl::PrintF("%-14s no samples\n", name);
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](int p) {
+    return absl::FormatDuration(latencies[std::min(
+        latencies.size() - 1, latencies.size() * p / 100)]);
+  };
+  absl::PrintF("%-14s p50 %-12s p90 %-12s p99 %s\n", name, percentile(50),
+               percentile(90), percentile(99));
+}
+
+// Runs the command --sandbox2tool_benchmark times, up to
+// --sandbox2tool_benchmark_concurrency of them at the same time, and prints
+// the percentiles of the spawn latencies.
+int RunBenchmark(const std::vector<std::string>& args) {
+  const int runs = absl::GetFlag(FLAGS_sandbox2tool_benchmark);
+  const int concurrency =
+      std::max(1, std::min(runs, absl::GetFlag(
+                                     FLAGS_sandbox2tool_benchmark_concurrency)));
+
+  // Guarded by 'mutex'.
+  absl::Mutex mutex;
+  std::vector<SpawnLatency> latencies;
+  int failed = 0;
+  std::atomic<int> next_run(0);
+  const auto run_loop = [&] {
+    while (next_run.fetch_add(1, std::memory_order_relaxed) < runs) {
+      auto executor = CreateExecutor(args);
+      executor->set_prefork(
+          absl::GetFlag(FLAGS_sandbox2tool_benchmark_prefork));
+      sandbox2::Sandbox2 s2(std::move(executor), CreatePolicy(args[0]));
+
+      const absl::Time start = absl::Now();
+      const bool started = s2.RunAsync();
+      const sandbox2::Result& result = s2.AwaitResult();
+      const absl::Time end = absl::Now();
+
+      absl::MutexLock lock(&mutex);
+      if (!started || result.final_status() != sandbox2::Result::OK) {
+        LOG(ERROR) << "Sandbox error: " << result.ToString();
+        ++failed;
+        continue;
+      }
+      absl::Time exec = result.GetStartupTimes().execve;
+      if (exec == absl::InfinitePast()) {
+        exec = result.GetStartupTimes().first_syscall;
+      }
+      latencies.push_back({exec - start, end - start});
+    }
+  };
+
+  const absl::Time start = absl::Now();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < concurrency; ++i) {
+    threads.emplace_back(run_loop);
+  }
+  run_loop();
+  for (auto& thread : threads) {
+    thread.join();
   }
+  const absl::Duration elapsed = absl::Now() - start;
+
+  absl::MutexLock lock(&mutex);
+  std::vector<absl::Duration> exec_latencies;
+  std::vector<absl::Duration> exit_latencies;
+  for (const SpawnLatency& latency : latencies) {
+    // Negative if the start-up times were not recorded.
+    if (latency.exec >= absl::ZeroDuration()) {
+      exec_latencies.push_back(latency.exec);
+    }
+    exit_latencies.push_back(latency.exit);
+  }
+  absl::PrintF("%d runs, %d concurrent, %d failed, %.1f runs/s\n", runs,
+               concurrency, failed, runs / absl::ToDoubleSeconds(elapsed));
+  PrintPercentiles("spawn-to-exec", std::move(exec_latencies));
+  PrintPercentiles("spawn-to-exit", std::move(exit_latencies));
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc < 2) {
+    absl::FPrintF(stderr, "Usage: %s [flags] -- cmd args...", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Pass everything after '--' to the sandbox.
+  std::vector<std::string> args;
+  sandbox2::util::CharPtrArrToVecString(&argv[1], &args);
+
+  if (absl::GetFlag(FLAGS_sandbox2tool_benchmark) > 0) {
+    return RunBenchmark(args);
+  }
+
+  auto executor = CreateExecutor(args);
+
+  int recv_fd1 = -1;
+  if (absl::GetFlag(FLAGS_sandbox2tool_redirect_fd1)) {
+    // Make the sandboxed process' fd be available as fd in the current process.
+    recv_fd1 = executor->ipc()->ReceiveFd(STDOUT_FILENO);
+  }
+
+  auto policy = CreatePolicy(argv[1]);
 
   // Instantiate the Sandbox2 object with policies and executors.
   sandbox2::Sandbox2 s2(std::move(executor), std::move(policy));
@@ -18,23 +18,50 @@
 
 #include <fcntl.h>
 #include <libgen.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <climits>
 #include <cstddef>
+#include <iterator>
+#include <map>
 
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "libcap/include/sys/capability.h"
+#include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkserver.h"
 #include "sandboxed_api/sandbox2/forkserver.pb.h"
 #include "sandboxed_api/sandbox2/global_forkclient.h"
 #include "sandboxed_api/sandbox2/ipc.h"
+#include "sandboxed_api/sandbox2/metrics.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
 
 namespace sandbox2 {
+namespace {
+
+// Prepends 'dir' to LD_LIBRARY_PATH in the environment of 'request'.
+void AddFlatLibraryDir(const std::string& dir, ForkRequest* request) {
+  constexpr absl::string_view kVar = "LD_LIBRARY_PATH=";
+  for (int i = 0; i < request->envs_size(); ++i) {
+    absl::string_view env = request->envs(i);
+    if (absl::ConsumePrefix(&env, kVar)) {
+      *request->mutable_envs(i) = absl::StrCat(kVar, dir, ":", env);
+      return;
+    }
+  }
+  request->add_envs(absl::StrCat(kVar, dir));
+}
+
+}  // namespace
 
 // Delegate constructor that gets called by the public ones.
 Executor::Executor(int exec_fd, const std::string& path,
@@ -66,9 +93,71 @@ std::vector<std::string> Executor::CopyEnviron() {
   return environ_copy;
 }
 
+void Executor::SetScheduling(ForkRequest* request) const {
+  switch (scheduling_policy_) {
+    case SchedulingPolicy::kDefault:
+      break;
+    case SchedulingPolicy::kOther:
+      request->set_sched_policy(SCHED_OTHER);
+      break;
+    case SchedulingPolicy::kBatch:
+      request->set_sched_policy(SCHED_BATCH);
+      break;
+    case SchedulingPolicy::kIdle:
+      request->set_sched_policy(SCHED_IDLE);
+      break;
+  }
+  if (nice_.has_value()) {
+    request->set_nice(*nice_);
+  }
+  request->set_util_min(util_min_);
+  request->set_util_max(util_max_);
+}
+
+void Executor::SetPlacement(ForkRequest* request) const {
+  if (cpu_placement_ == CpuPlacement::kAny) {
+    return;
+  }
+  if (cpu_placement_ == CpuPlacement::kCpus) {
+    for (int cpu : cpus_) {
+      request->add_cpus(cpu);
+    }
+    return;
+  }
+
+  // The NUMA topology does not change while we are running.
+  static const auto* nodes =
+      new std::map<int, std::vector<int>>(util::GetNumaNodes());
+  if (nodes->empty()) {
+    return;
+  }
+  auto node = nodes->end();
+  if (cpu_placement_ == CpuPlacement::kSameNodeAsCaller) {
+    for (auto it = nodes->begin(); it != nodes->end(); ++it) {
+      if (std::find(it->second.begin(), it->second.end(), caller_cpu_) !=
+          it->second.end()) {
+        node = it;
+        break;
+      }
+    }
+  } else {
+    static std::atomic<size_t> next_node{0};
+    node = std::next(nodes->begin(), next_node++ % nodes->size());
+  }
+  if (node == nodes->end()) {
+    VLOG(1) << "CPU " << caller_cpu_ << " not found on any NUMA node";
+    return;
+  }
+  for (int cpu : node->second) {
+    request->add_cpus(cpu);
+  }
+  request->set_memory_node(node->first);
+}
+
 pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
                                 const std::vector<cap_value_t>* caps,
-                                pid_t* init_pid_out) {
+                                pid_t* init_pid_out, int cgroup_fd,
+                                int* pid_fd_out, bool* in_cgroup_out) {
   if (started_) {
     LOG(ERROR) << "This executor has already been started";
     return -1;
@@ -77,6 +166,7 @@ pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
     LOG(ERROR) << "The ForkClient object is not instantiated";
     return -1;
   }
+  const absl::Time start = absl::Now();
 
   if (!path_.empty()) {
     exec_fd_ = open(path_.c_str(), O_PATH);
@@ -111,6 +201,17 @@ pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
                                   file_util::fileops::StripBasename(path_)));
   }
 
+  if (comms_seqpacket_ && (!path_.empty() || exec_fd_ >= 0)) {
+    request.add_envs(absl::StrCat(Comms::kSeqpacketEnv, "=1"));
+  }
+
+  // Point ld.so at the flattened library directory, if any, so it finds each
+  // library at the first attempt.
+  if (ns != nullptr && (!path_.empty() || exec_fd_ >= 0) &&
+      !ns->mounts().flat_library_dir().empty()) {
+    AddFlatLibraryDir(ns->mounts().flat_library_dir(), &request);
+  }
+
   // If neither the path, nor exec_fd is specified, just assume that we need to
   // send a fork request.
   //
@@ -128,11 +229,23 @@ pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
 
   if (ns) {
     clone_flags |= ns->GetCloneFlags();
-    *request.mutable_mount_tree() = ns->mounts().GetMountTree();
-    request.set_hostname(ns->hostname());
+    // The mount tree is large, the ForkServer keeps it from the first request.
+    request.set_template_id(ns->template_id());
+    if (!fork_client_->HasTemplate(ns->template_id())) {
+      *request.mutable_mount_tree() = ns->mounts().GetMountTree();
+      request.set_hostname(ns->hostname());
+    }
+    request.set_join_namespace_template(ns->uses_namespace_template());
+    request.set_use_network_namespace_pool(ns->uses_network_namespace_pool());
+    request.set_sandboxee_is_init(ns->runs_sandboxee_as_init());
   }
 
   request.set_clone_flags(clone_flags);
+  request.set_prefork(prefork_);
+  request.set_priority(priority_);
+  request.set_into_cgroup(cgroup_fd != -1);
+  SetPlacement(&request);
+  SetScheduling(&request);
 
   if (caps) {
     for (auto cap : *caps) {
@@ -151,11 +264,15 @@ pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
   pid_t init_pid = -1;
 
   pid_t sandboxee_pid = fork_client_->SendRequest(
-      request, exec_fd_, client_comms_fd_, ns_fd, &init_pid);
+      request, exec_fd_, client_comms_fd_, ns_fd, &init_pid, cgroup_fd,
+      pid_fd_out, in_cgroup_out, &request_shed_);
 
-  if (init_pid < 0) {
+  if (request_shed_) {
+    LOG(WARNING) << "Fork request shed, the ForkServer is overloaded";
+  } else if (init_pid < 0) {
     LOG(ERROR) << "Could not obtain init PID";
-  } else if (init_pid == 0 && request.clone_flags() & CLONE_NEWPID) {
+  } else if (init_pid == 0 && request.clone_flags() & CLONE_NEWPID &&
+             !request.sandboxee_is_init()) {
     LOG(FATAL)
         << "No init process was spawned even though a PID NS was created, "
         << "potential logic bug";
@@ -178,6 +295,10 @@ pid_t Executor::StartSubProcess(int32_t clone_flags, const Namespace* ns,
     close(ns_fd);
   }
 
+  if (sandboxee_pid != -1) {
+    metrics::IncrementCounter(metrics::kSpawns);
+    metrics::RecordDuration(metrics::kSpawnLatency, absl::Now() - start);
+  }
   VLOG(1) << "StartSubProcess returned with: " << sandboxee_pid;
   return sandboxee_pid;
 }
@@ -192,10 +313,22 @@ std::unique_ptr<ForkClient> Executor::StartForkServer() {
   return absl::make_unique<ForkClient>(ipc_.comms());
 }
 
+Executor& Executor::set_comms_seqpacket(bool value) {
+  if (value != comms_seqpacket_) {
+    CHECK(!started_) << "The sandboxee has been started already";
+    comms_seqpacket_ = value;
+    // The server side is closed by its Comms.
+    close(client_comms_fd_);
+    SetUpServerSideCommsFd();
+  }
+  return *this;
+}
+
 void Executor::SetUpServerSideCommsFd() {
   int sv[2];
-  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
-    PLOG(FATAL) << "socketpair(AF_UNIX, SOCK_STREAM) failed";
+  if (socketpair(AF_UNIX, comms_seqpacket_ ? SOCK_SEQPACKET : SOCK_STREAM, 0,
+                 sv) == -1) {
+    PLOG(FATAL) << "socketpair(AF_UNIX) failed";
   }
 
   client_comms_fd_ = sv[0];
@@ -20,10 +20,12 @@
 #include <unistd.h>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <glog/logging.h>
 #include "absl/base/macros.h"
+#include "absl/types/optional.h"
 #include "sandboxed_api/sandbox2/forkserver.h"
 #include "sandboxed_api/sandbox2/ipc.h"
 #include "sandboxed_api/sandbox2/limits.h"
@@ -92,6 +94,89 @@ class Executor final {
     return *this;
   }
 
+  // Asks the ForkServer to keep 'value' children forked ahead of time, with
+  // the namespaces and capabilities of this Executor already set up. Later
+  // requests with the same namespace, clone flags, capabilities and mode are
+  // then handed to one of them instead of forking. Has no effect for the
+  // libunwind sandbox.
+  Executor& set_prefork(int value) {
+    prefork_ = value;
+    return *this;
+  }
+
+  // Connects the sandboxee over a SOCK_SEQPACKET socket pair instead of a
+  // SOCK_STREAM one, so that each Comms message takes one system call on
+  // either end, see Comms(int). The sandboxee learns the socket type from
+  // Comms::kSeqpacketEnv, so this only works for sandboxees executing a
+  // binary. Recreates the connection, call it before using ipc().
+  Executor& set_comms_seqpacket(bool value);
+
+  // Priority of the fork request, see ForkClient::AdmissionLimits. Latency
+  // critical sandboxees should use a higher one than batch work.
+  Executor& set_priority(int value) {
+    priority_ = value;
+    return *this;
+  }
+
+  // Where the ForkServer places the sandboxee.
+  enum class CpuPlacement {
+    // Wherever the scheduler sees fit.
+    kAny,
+    // On the CPUs passed to set_cpus().
+    kCpus,
+    // On the NUMA node of the CPU that the thread starting the sandboxee runs
+    // on, so that the sandboxee shares caches and memory with its caller.
+    kSameNodeAsCaller,
+    // On the NUMA nodes in turn, one sandboxee after the other.
+    kRoundRobinNodes,
+  };
+
+  // With the NUMA placements, memory is preferably allocated from the same
+  // node as well. Without NUMA nodes in sysfs, they behave like kAny.
+  Executor& set_cpu_placement(CpuPlacement value) {
+    cpu_placement_ = value;
+    return *this;
+  }
+
+  // Pins the sandboxee to 'cpus', implies CpuPlacement::kCpus.
+  Executor& set_cpus(std::vector<int> cpus) {
+    cpus_ = std::move(cpus);
+    cpu_placement_ = CpuPlacement::kCpus;
+    return *this;
+  }
+
+  // Scheduling class of the sandboxee, see sched(7). Batch sandboxees sharing
+  // a host with latency sensitive ones should use kBatch or kIdle. A policy
+  // calling sched_yield() needs PolicyBuilder::AllowSchedYield().
+  enum class SchedulingPolicy {
+    // Inherited from the ForkServer.
+    kDefault,
+    kOther,
+    kBatch,
+    kIdle,
+  };
+
+  Executor& set_scheduling_policy(SchedulingPolicy value) {
+    scheduling_policy_ = value;
+    return *this;
+  }
+
+  // Nice value of the sandboxee. Values below the one of the ForkServer need
+  // CAP_SYS_NICE.
+  Executor& set_nice(int value) {
+    nice_ = value;
+    return *this;
+  }
+
+  // Utilization clamps of the sandboxee, from 0 to 1024, see
+  // SCHED_FLAG_UTIL_CLAMP in sched_setattr(2). Ignored by kernels without
+  // CONFIG_UCLAMP_TASK. A negative value keeps the respective clamp.
+  Executor& set_util_clamp(int min, int max) {
+    util_min_ = min;
+    util_max_ = max;
+    return *this;
+  }
+
  private:
   friend class Monitor;
   friend class StackTracePeer;
@@ -133,10 +218,23 @@ class Executor final {
   // caps is a vector of capabilities that are kept in the permitted set after
   // the clone, use with caution.
   //
+  // Unless cgroup_fd is -1, the process is started in that cgroup v2 directory
+  // where the kernel supports it, in_cgroup_out is set to whether it was.
+  // pid_fd_out receives a pidfd of the process, or -1.
+  //
   // Returns the same values as fork().
   pid_t StartSubProcess(int clone_flags, const Namespace* ns = nullptr,
                         const std::vector<cap_value_t>* caps = nullptr,
-                        pid_t* init_pid_out = nullptr);
+                        pid_t* init_pid_out = nullptr, int cgroup_fd = -1,
+                        int* pid_fd_out = nullptr,
+                        bool* in_cgroup_out = nullptr);
+
+  // Fills in the CPUs and memory node of 'request' according to
+  // cpu_placement_.
+  void SetPlacement(ForkRequest* request) const;
+
+  // Fills in the scheduling of the sandboxee.
+  void SetScheduling(ForkRequest* request) const;
 
   // Whether the Executor has been started yet
   bool started_ = false;
@@ -158,6 +256,27 @@ class Executor final {
   // chdir to cwd_, if set.
   std::string cwd_;
 
+  // Number of children the ForkServer keeps forked ahead of time.
+  int prefork_ = 0;
+  int priority_ = 0;
+  bool comms_seqpacket_ = false;
+  // Whether the fork request was shed by the admission control of the
+  // ForkClient.
+  bool request_shed_ = false;
+
+  // See set_cpu_placement().
+  CpuPlacement cpu_placement_ = CpuPlacement::kAny;
+  std::vector<int> cpus_;
+  // CPU the thread starting the sandboxee ran on, set by the Monitor. -1 if
+  // unknown.
+  int caller_cpu_ = -1;
+
+  // See set_scheduling_policy(), set_nice() and set_util_clamp().
+  SchedulingPolicy scheduling_policy_ = SchedulingPolicy::kDefault;
+  absl::optional<int> nice_;
+  int util_min_ = -1;
+  int util_max_ = -1;
+
   // Server (sandbox) end-point of a socket-pair used to create Comms channel
   int server_comms_fd_ = -1;
   // Client (sandboxee) end-point of a socket-pair used to create Comms channel
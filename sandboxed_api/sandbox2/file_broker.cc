@@ -0,0 +1,155 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::FileBroker class.
+
+#include "sandboxed_api/sandbox2/file_broker.h"
+
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+#include "sandboxed_api/util/canonical_errors.h"
+
+#ifndef SECCOMP_IOCTL_NOTIF_ADDFD
+struct seccomp_notif_addfd {
+  __u64 id;
+  __u32 flags;
+  __u32 srcfd;
+  __u32 newfd;
+  __u32 newfd_flags;
+};
+#define SECCOMP_IOCTL_NOTIF_ADDFD \
+  _IOW(SECCOMP_IOC_MAGIC, 3, struct seccomp_notif_addfd)
+#endif
+
+namespace sandbox2 {
+
+constexpr int FileBroker::kUnbrokeredFlags;
+
+namespace {
+
+// Reads the NUL-terminated path at 'addr' of the process 'pid'. Returns an
+// empty string if it cannot be read or is longer than PATH_MAX.
+std::string ReadPath(pid_t pid, uint64_t addr) {
+  char buf[PATH_MAX];
+  iovec local = {buf, sizeof(buf)};
+  iovec remote = {reinterpret_cast<void*>(addr), sizeof(buf)};
+  // Stops at the first unmapped page, the path may end just before it.
+  ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+  if (n <= 0) {
+    return "";
+  }
+  const void* end = memchr(buf, '\0', n);
+  if (end == nullptr) {
+    return "";
+  }
+  return std::string(buf, static_cast<const char*>(end) - buf);
+}
+
+}  // namespace
+
+sapi::StatusOr<std::unique_ptr<FileBroker>> FileBroker::Create(
+    const std::map<std::string, std::string>& paths) {
+  auto broker = absl::WrapUnique(new FileBroker());
+  for (const auto& path : paths) {
+    file_util::fileops::FDCloser fd(
+        open(path.second.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Could not open brokered file ", path.second, ": ",
+                       StrError(errno)));
+    }
+    broker->fds_.emplace(path.first, std::move(fd));
+  }
+  return broker;
+}
+
+int FileBroker::Open(const std::string& path, int flags) const {
+  auto it = fds_.find(path);
+  if (it == fds_.end()) {
+    errno = ENOENT;
+    return -1;
+  }
+  // A dup() would share the file offset with every other open of the file,
+  // reopening the cached descriptor skips only the path walk.
+  return open(absl::StrCat("/proc/self/fd/", it->second.get()).c_str(),
+              O_RDONLY | O_CLOEXEC | (flags & (O_NONBLOCK | O_NOATIME)));
+}
+
+bool FileBroker::AnswerOpen(int notify_fd, const seccomp_notif& req) const {
+  int path_arg = 0;
+  int flags_arg = 1;
+  if (req.data.nr == __NR_openat) {
+    path_arg = 1;
+    flags_arg = 2;
+  }
+  const int flags = static_cast<int>(req.data.args[flags_arg]);
+  if ((flags & kUnbrokeredFlags) != 0) {
+    return false;
+  }
+  // Brokered paths are absolute, so the dirfd of openat() does not matter.
+  const std::string path = ReadPath(req.pid, req.data.args[path_arg]);
+  if (path.empty() || path[0] != '/' || fds_.count(path) == 0) {
+    return false;
+  }
+
+  seccomp_notif_resp resp = {};
+  resp.id = req.id;
+  file_util::fileops::FDCloser fd(Open(path, flags));
+  if (fd.get() == -1) {
+    resp.error = -errno;
+  } else {
+    // The path was the notifying process' only if the notification is still
+    // pending.
+    uint64_t id = req.id;
+    if (ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_ID_VALID, &id) == -1) {
+      VLOG(1) << "PID: " << req.pid << " is gone, dropping its notification";
+      return true;
+    }
+    seccomp_notif_addfd addfd = {};
+    addfd.id = req.id;
+    addfd.srcfd = fd.get();
+    addfd.newfd_flags = flags & O_CLOEXEC;
+    int remote_fd = ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+    if (remote_fd == -1) {
+      if (errno == ENOENT) {
+        // The process died or its syscall was interrupted in the meantime.
+        return true;
+      }
+      // Linux before 5.9 cannot install file descriptors.
+      PLOG_IF(WARNING, errno != EINVAL && errno != ENOTTY)
+          << "ioctl(SECCOMP_IOCTL_NOTIF_ADDFD)";
+      return false;
+    }
+    resp.val = remote_fd;
+  }
+  if (ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1 &&
+      errno != ENOENT) {
+    PLOG(ERROR) << "ioctl(SECCOMP_IOCTL_NOTIF_SEND)";
+  }
+  return true;
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,78 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::FileBroker class opens read-only files on behalf of
+// sandboxees.
+
+#ifndef SANDBOXED_API_SANDBOX2_FILE_BROKER_H_
+#define SANDBOXED_API_SANDBOX2_FILE_BROKER_H_
+
+#include <fcntl.h>
+#include <linux/seccomp.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+// Keeps file descriptors of the files added with
+// PolicyBuilder::AddBrokeredFile(), opened once when the policy is built. The
+// read-only open() and openat() calls of the sandboxees are reported via
+// seccomp user notifications, and those of brokered paths are answered with a
+// new file descriptor installed in the sandboxee. All other opens are left to
+// the Monitor, which handles them like any other traced syscall. This saves
+// the path walk of each open and the mounts of the files. All sandboxees of a
+// Policy share its FileBroker.
+class FileBroker final {
+ public:
+  // Flags of open() which the broker leaves to the sandboxee, any other read
+  // access can be brokered.
+  static constexpr int kUnbrokeredFlags = O_WRONLY | O_RDWR | O_CREAT |
+                                          O_TRUNC | O_APPEND | O_PATH |
+                                          O_TMPFILE;
+
+  // Opens the files of 'paths', which maps paths of the sandboxee to paths of
+  // the host.
+  static sapi::StatusOr<std::unique_ptr<FileBroker>> Create(
+      const std::map<std::string, std::string>& paths);
+
+  FileBroker(const FileBroker&) = delete;
+  FileBroker& operator=(const FileBroker&) = delete;
+
+  // Returns a new read-only file descriptor of the brokered 'path', with a
+  // file offset of its own. Returns -1 and sets errno to ENOENT if 'path' is
+  // not brokered, or to the error of reopening it.
+  int Open(const std::string& path, int flags) const;
+
+  // Answers the open() or openat() notification 'req' via 'notify_fd' if it
+  // opens a brokered path. Returns false without answering for any other
+  // path, for relative paths and on kernels which cannot install file
+  // descriptors (before Linux 5.9). The sandboxee is never let to open a file
+  // itself, a path it passes could change before the kernel reads it.
+  bool AnswerOpen(int notify_fd, const seccomp_notif& req) const;
+
+ private:
+  FileBroker() = default;
+
+  // Sandboxee paths to the opened files.
+  std::map<std::string, file_util::fileops::FDCloser> fds_;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_FILE_BROKER_H_
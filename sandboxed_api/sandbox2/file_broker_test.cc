@@ -0,0 +1,181 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/file_broker.h"
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <sys/uio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/notify.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/testing.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/temp_file.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::sapi::IsOk;
+using ::testing::Eq;
+using ::testing::Gt;
+using ::testing::Not;
+using ::testing::StrEq;
+
+namespace sandbox2 {
+namespace {
+
+using file_util::fileops::FDCloser;
+
+constexpr char kContent[] = "brokered content\n";
+
+class FileBrokerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto file,
+                              CreateNamedTempFile(GetTestTempPath("broker")));
+    path_ = file.first;
+    FDCloser fd(file.second);
+    ASSERT_THAT(write(fd.get(), kContent, sizeof(kContent) - 1),
+                Eq(static_cast<ssize_t>(sizeof(kContent) - 1)));
+  }
+
+  void TearDown() override { remove(path_.c_str()); }
+
+  std::string path_;
+};
+
+// Permits the opens of the sandboxee which the broker leaves to the monitor,
+// except those of 'denied'.
+class OpenNotify : public Notify {
+ public:
+  explicit OpenNotify(std::string denied) : denied_(std::move(denied)) {}
+
+  bool EventSyscallTrap(const Syscall& syscall) override {
+    const int path_arg = syscall.nr() == __NR_openat ? 1 : 0;
+    char path[PATH_MAX] = {};
+    iovec local = {path, sizeof(path) - 1};
+    iovec remote = {reinterpret_cast<void*>(syscall.args()[path_arg]),
+                    sizeof(path) - 1};
+    process_vm_readv(syscall.pid(), &local, 1, &remote, 1, 0);
+    return denied_ != path;
+  }
+
+ private:
+  std::string denied_;
+};
+
+std::string ReadAll(int fd) {
+  std::string data;
+  char buf[256];
+  ssize_t n;
+  while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+    data.append(buf, n);
+  }
+  return data;
+}
+
+TEST_F(FileBrokerTest, OpensWithOwnOffset) {
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      auto broker,
+      FileBroker::Create(std::map<std::string, std::string>{
+          {"/brokered", path_}}));
+  FDCloser first(broker->Open("/brokered", O_RDONLY));
+  FDCloser second(broker->Open("/brokered", O_RDONLY));
+  ASSERT_THAT(first.get(), Gt(-1));
+  ASSERT_THAT(second.get(), Gt(-1));
+  EXPECT_THAT(ReadAll(first.get()), StrEq(kContent));
+  EXPECT_THAT(ReadAll(second.get()), StrEq(kContent));
+
+  errno = 0;
+  EXPECT_THAT(broker->Open(path_, O_RDONLY), Eq(-1));
+  EXPECT_THAT(errno, Eq(ENOENT));
+}
+
+TEST_F(FileBrokerTest, FailsForMissingFiles) {
+  EXPECT_THAT(FileBroker::Create(std::map<std::string, std::string>{
+                                     {"/brokered", "/nonexistent/file"}})
+                  .status(),
+              Not(IsOk()));
+}
+
+// The brokered file is not mounted, cat can only read it via the broker.
+TEST_F(FileBrokerTest, ServesSandboxeeOpens) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string cat = "/bin/cat";
+  auto executor = absl::make_unique<Executor>(
+      cat, std::vector<std::string>{cat, "/brokered/file"});
+  int fds[2];
+  ASSERT_THAT(pipe2(fds, O_CLOEXEC), Eq(0));
+  FDCloser out(fds[0]);
+  executor->ipc()->MapFd(fds[1], STDOUT_FILENO);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy,
+                            PolicyBuilder()
+                                .AddBrokeredFileAt(path_, "/brokered/file")
+                                // Don't restrict the other syscalls at all.
+                                .DangerDefaultAllowAll()
+                                .AddFile(cat)
+                                .AddLibrariesForBinary(cat)
+                                .TryBuild());
+  Sandbox2 s2(std::move(executor), std::move(policy),
+              absl::make_unique<OpenNotify>(""));
+  ASSERT_TRUE(s2.RunAsync());
+  std::string output = ReadAll(out.get());
+  Result result = s2.AwaitResult();
+
+  EXPECT_THAT(result.final_status(), Eq(Result::OK));
+  EXPECT_THAT(result.reason_code(), Eq(0));
+  EXPECT_THAT(output, StrEq(kContent));
+}
+
+// Opens of paths which are not brokered are not let through by the broker.
+TEST_F(FileBrokerTest, ReportsUnbrokeredOpens) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string cat = "/bin/cat";
+  auto executor = absl::make_unique<Executor>(
+      cat, std::vector<std::string>{cat, "/mounted/file"});
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy,
+                            PolicyBuilder()
+                                .AddBrokeredFileAt(path_, "/brokered/file")
+                                .DangerDefaultAllowAll()
+                                .AddFileAt(path_, "/mounted/file")
+                                .AddFile(cat)
+                                .AddLibrariesForBinary(cat)
+                                .TryBuild());
+  Sandbox2 s2(std::move(executor), std::move(policy),
+              absl::make_unique<OpenNotify>("/mounted/file"));
+  Result result = s2.Run();
+
+  EXPECT_THAT(result.final_status(), Eq(Result::VIOLATION));
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -14,13 +14,177 @@
 
 #include "sandboxed_api/sandbox2/forkingclient.h"
 
+#include <malloc.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
 #include <glog/logging.h>
 #include "sandboxed_api/sandbox2/sanitizer.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/util/maps_parser.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
 
 namespace sandbox2 {
+namespace {
+
+constexpr uintptr_t kHugePageSize = 2 << 20;
+
+uintptr_t AlignUp(uintptr_t addr) {
+  return (addr + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+uintptr_t AlignDown(uintptr_t addr) { return addr & ~(kHugePageSize - 1); }
+
+sapi::Status ErrnoStatus(const char* call) {
+  return sapi::InternalError(
+      absl::StrCat(call, "() failed: ", StrError(errno)));
+}
+
+}  // namespace
+
+sapi::Status ForkingClient::RemapTextOnHugePages() {
+  // The code of the binary is the mapping holding this function.
+  const uintptr_t self =
+      reinterpret_cast<uintptr_t>(&ForkingClient::RemapTextOnHugePages);
+  uintptr_t start = 0;
+  uintptr_t end = 0;
+  {
+    SAPI_ASSIGN_OR_RETURN(auto reader, ProcMapsReader::OpenForPid(getpid()));
+    MapsEntryView entry;
+    while (reader->Next(&entry)) {
+      if (entry.is_executable && self >= entry.start && self < entry.end) {
+        start = AlignUp(entry.start);
+        end = AlignDown(entry.end);
+        break;
+      }
+    }
+    SAPI_RETURN_IF_ERROR(reader->status());
+  }
+  if (start >= end) {
+    VLOG(1) << "No huge page of code to remap";
+    return sapi::OkStatus();
+  }
+  void* text = reinterpret_cast<void*>(start);
+  const size_t size = end - start;
+  if (madvise(text, size, MADV_COLLAPSE) == 0) {
+    return sapi::OkStatus();
+  }
+
+  // One more huge page, so that the copy can be aligned.
+  void* mapping = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return ErrnoStatus("mmap");
+  }
+  const uintptr_t raw = reinterpret_cast<uintptr_t>(mapping);
+  const uintptr_t aligned = AlignUp(raw);
+  if (aligned > raw) {
+    munmap(mapping, aligned - raw);
+  }
+  if (raw + kHugePageSize > aligned) {
+    munmap(reinterpret_cast<void*>(aligned + size),
+           raw + kHugePageSize - aligned);
+  }
+  void* copy = reinterpret_cast<void*>(aligned);
+  // Without THP, the copy still works, just on small pages.
+  if (madvise(copy, size, MADV_HUGEPAGE) == -1) {
+    PLOG(WARNING) << "madvise(MADV_HUGEPAGE) failed";
+  }
+  memcpy(copy, text, size);
+  if (mprotect(copy, size, PROT_READ | PROT_EXEC) == -1) {
+    munmap(copy, size);
+    return ErrnoStatus("mprotect");
+  }
+  // Atomically replaces the code, including the one running, with the
+  // identical copy.
+  if (mremap(copy, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, text) ==
+      MAP_FAILED) {
+    munmap(copy, size);
+    return ErrnoStatus("mremap");
+  }
+  return sapi::OkStatus();
+}
+
+sapi::Status ForkingClient::PrepareZygote(const ZygoteOptions& options) {
+  CHECK(!fork_server_worker_) << "PrepareZygote() after WaitAndFork()";
+  if (options.preload) {
+    options.preload();
+  }
+  if (options.trim_heap) {
+    malloc_trim(0);
+  }
+  if (options.huge_page_text) {
+    sapi::Status status = RemapTextOnHugePages();
+    if (!status.ok()) {
+      LOG(WARNING) << "Could not remap the code onto huge pages: " << status;
+    }
+  }
+  if (!options.prefault_read_only && !options.merge_pages) {
+    return sapi::OkStatus();
+  }
+
+  // The mappings are collected first, madvise() may split and merge them.
+  std::vector<std::pair<uintptr_t, size_t>> read_only;
+  std::vector<std::pair<uintptr_t, size_t>> anonymous;
+  {
+    SAPI_ASSIGN_OR_RETURN(auto reader, ProcMapsReader::OpenForPid(getpid()));
+    MapsEntryView entry;
+    while (reader->Next(&entry)) {
+      const size_t size = entry.end - entry.start;
+      if (!entry.is_readable || entry.is_shared) {
+        continue;
+      }
+      if (!entry.is_writable && entry.inode != 0) {
+        read_only.emplace_back(entry.start, size);
+      } else if (entry.is_writable &&
+                 (entry.path.empty() || entry.path == "[heap]")) {
+        anonymous.emplace_back(entry.start, size);
+      }
+    }
+    SAPI_RETURN_IF_ERROR(reader->status());
+  }
+
+  if (options.prefault_read_only) {
+    for (const auto& mapping : read_only) {
+      void* addr = reinterpret_cast<void*>(mapping.first);
+      // MADV_POPULATE_READ (Linux 5.14) fails instead of raising SIGBUS past
+      // the end of a file. Older kernels only read the pages ahead.
+      if (madvise(addr, mapping.second, MADV_POPULATE_READ) == -1 &&
+          madvise(addr, mapping.second, MADV_WILLNEED) == -1) {
+        PLOG(WARNING) << "Could not prefault the mapping at " << addr;
+      }
+    }
+  }
+  if (options.merge_pages) {
+    for (const auto& mapping : anonymous) {
+      void* addr = reinterpret_cast<void*>(mapping.first);
+      if (madvise(addr, mapping.second, MADV_MERGEABLE) == -1) {
+        if (errno == EINVAL) {
+          LOG(WARNING) << "KSM is not available, pages are not merged";
+          break;
+        }
+        PLOG(WARNING) << "madvise(MADV_MERGEABLE) of " << addr << " failed";
+      }
+    }
+  }
+  return sapi::OkStatus();
+}
 
 pid_t ForkingClient::WaitAndFork() {
   // We don't instantiate the Fork-Server until the first Fork() call takes
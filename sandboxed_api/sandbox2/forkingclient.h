@@ -16,18 +16,47 @@
 #define SANDBOXED_API_SANDBOX2_FORKINGCLIENT_H_
 
 #include <sys/types.h>
+#include <functional>
 #include <memory>
 
 #include "sandboxed_api/sandbox2/client.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkserver.h"
+#include "sandboxed_api/util/status.h"
 
 namespace sandbox2 {
 
 class ForkingClient : public Client {
  public:
+  // Preparation of the process before it starts forking, see PrepareZygote().
+  struct ZygoteOptions {
+    // Called first, to load the state which all children share, e.g. models
+    // or caches.
+    std::function<void()> preload;
+    // Returns the free memory of the allocator to the kernel with
+    // malloc_trim(3), so that the children do not inherit a fragmented heap
+    // whose dirty pages they copy on write.
+    bool trim_heap = true;
+    // Populates the page tables of the read-only file mappings, like the code
+    // and constant data of the binary, so that they are not faulted in from
+    // disk by the first request of every child.
+    bool prefault_read_only = true;
+    // Marks the private anonymous mappings MADV_MERGEABLE, so that KSM merges
+    // the identical pages the children write. Needs a kernel with CONFIG_KSM
+    // and KSM enabled, is ignored otherwise.
+    bool merge_pages = false;
+    // Moves the code of the binary onto transparent huge pages, see
+    // RemapTextOnHugePages(). The children inherit them.
+    bool huge_page_text = false;
+  };
+
   explicit ForkingClient(Comms* comms) : Client(comms) {}
 
+  // Turns the current process into a zygote, whose children start from a
+  // compact and warm state. Must be called before the first WaitAndFork() and
+  // must not leave threads behind.
+  sapi::Status PrepareZygote(const ZygoteOptions& options);
+
   // Forks the current process (if asked by the Executor in the parent process),
   // and returns the newly created PID to this Executor. This is used if the
   // current Client objects acts as a wrapper of ForkServer (and this process
@@ -35,6 +64,16 @@ class ForkingClient : public Client {
   // Return values specified as with 'fork' (incl. -1).
   pid_t WaitAndFork();
 
+  // Backs the 2 MiB aligned part of the code of the binary with transparent
+  // huge pages, to save iTLB misses of large binaries. Tries MADV_COLLAPSE on
+  // the file mapping first (Linux 6.1 with CONFIG_READ_ONLY_THP_FOR_FS), and
+  // otherwise copies the code to anonymous memory marked MADV_HUGEPAGE that
+  // is moved over the mapping. Such code is no longer file-backed, so it is
+  // not symbolized in stack traces. Must run while the process is single-
+  // threaded. Inside the sandbox, the policy needs
+  // PolicyBuilder::AllowHugePageText() and read access to /proc/self/maps.
+  static sapi::Status RemapTextOnHugePages();
+
  private:
   // ForkServer object, which is used only if the current process is meant
   // to behave like a Fork-Server, i.e. to create a new process which will be
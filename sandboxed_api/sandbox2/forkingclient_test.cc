@@ -0,0 +1,169 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/forkingclient.h"
+
+#include <sys/wait.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/attributes.h"
+#include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/forkserver.h"
+#include "sandboxed_api/sandbox2/ipc.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/testing.h"
+#include "sandboxed_api/sandbox2/util/maps_parser.h"
+
+// Placed among the code, so that the executable mapping of the test spans at
+// least one 2 MiB aligned huge page.
+__attribute__((used, section(".text.huge_page_padding")))
+const char kPadding[6 << 20] = {1};
+
+namespace sandbox2 {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Ne;
+using ::testing::NotNull;
+
+ABSL_ATTRIBUTE_NOINLINE int Triple(int value) { return 3 * value; }
+
+// Returns whether the mapping of 'addr' is executable.
+bool IsExecutable(const void* addr) {
+  const uintptr_t address = reinterpret_cast<uintptr_t>(addr);
+  auto reader = ProcMapsReader::OpenForPid(getpid());
+  if (!reader.ok()) {
+    return false;
+  }
+  MapsEntryView entry;
+  while (reader.ValueOrDie()->Next(&entry)) {
+    if (address >= entry.start && address < entry.end) {
+      return entry.is_executable;
+    }
+  }
+  return false;
+}
+
+TEST(ForkingClientTest, RemapsTextOnHugePages) {
+  // The remapping needs a single-threaded process.
+  const pid_t pid = fork();
+  ASSERT_THAT(pid, Ne(-1));
+  if (pid == 0) {
+    if (!ForkingClient::RemapTextOnHugePages().ok()) {
+      _exit(1);
+    }
+    // The code runs on from the remapped pages, with the same contents.
+    const volatile char* padding = kPadding;
+    if (Triple(padding[0]) != 3 || padding[3 << 20] != 0) {
+      _exit(2);
+    }
+    if (!IsExecutable(&kPadding[3 << 20])) {
+      _exit(3);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  ASSERT_THAT(TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)), Eq(pid));
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_THAT(WEXITSTATUS(status), Eq(EXIT_SUCCESS));
+}
+
+TEST(ForkingClientTest, RemapsTextOnHugePagesInSandbox) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path =
+      GetTestSourcePath("sandbox2/testcases/huge_page_text");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+
+  auto policy = PolicyBuilder()
+                    // For /proc/self/maps.
+                    .DisableNamespaces()
+                    .AllowStartupOfBinary(path)
+                    .AllowHugePageText()
+                    .AllowSystemMalloc()
+                    .AllowOpen()
+                    .AllowRead()
+                    .AllowSyscall(__NR_close)
+                    .AllowGetPIDs()
+                    // For log messages, e.g. if THP are disabled.
+                    .AllowWrite()
+                    .AllowStat()
+                    .AllowTime()
+                    .AllowGetIDs()
+                    .AllowExit()
+                    .BlockSyscallWithErrno(__NR_prlimit64, EPERM)
+                    .BlockSyscallWithErrno(__NR_access, ENOENT)
+                    .BuildOrDie();
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::OK));
+  EXPECT_THAT(result.reason_code(), Eq(EXIT_SUCCESS));
+}
+
+TEST(ForkingClientTest, ZygoteChildrenRunIsolated) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/zygote");
+  std::vector<std::string> args = {path};
+  auto fork_executor = absl::make_unique<Executor>(path, args);
+  std::unique_ptr<ForkClient> fork_client = fork_executor->StartForkServer();
+  ASSERT_THAT(fork_client, NotNull());
+
+  // Both run from the same zygote at the same time.
+  std::vector<std::unique_ptr<Sandbox2>> sandboxes;
+  std::vector<Comms*> comms;
+  for (int i = 0; i < 2; ++i) {
+    auto executor = absl::make_unique<Executor>(fork_client.get());
+    comms.push_back(executor->ipc()->comms());
+    sandboxes.push_back(absl::make_unique<Sandbox2>(
+        std::move(executor), PolicyBuilder()
+                                 // Don't restrict the syscalls at all.
+                                 .DangerDefaultAllowAll()
+                                 .BuildOrDie()));
+    ASSERT_TRUE(sandboxes.back()->RunAsync());
+  }
+  // The second one only starts checking the preloaded state once the first
+  // one overwrote its copy.
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(comms[i]->SendInt32(i + 1));
+    int32_t value;
+    ASSERT_TRUE(comms[i]->RecvInt32(&value));
+    EXPECT_THAT(value, Eq(i + 1));
+  }
+  for (auto& sandbox : sandboxes) {
+    Result result = sandbox->AwaitResult();
+    EXPECT_THAT(result.final_status(), Eq(Result::OK));
+    EXPECT_THAT(result.reason_code(), Eq(EXIT_SUCCESS));
+  }
+}
+
+}  // namespace
+}  // namespace sandbox2
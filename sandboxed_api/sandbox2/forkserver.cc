@@ -18,9 +18,12 @@
 
 #include <asm/types.h>
 #include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
 #include <sched.h>
 #include <sys/capability.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -28,25 +31,34 @@
 #include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <cinttypes>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <utility>
 
 #include <glog/logging.h>
+#include "absl/memory/memory.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
 #include "absl/synchronization/mutex.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/message.h>
 #include "sandboxed_api/sandbox2/client.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkserver.pb.h"
+#include "sandboxed_api/sandbox2/metrics.h"
 #include "sandboxed_api/sandbox2/namespace.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/sanitizer.h"
+#include "sandboxed_api/sandbox2/startup_times.h"
 #include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/unwind/ptrace_hook.h"
 #include "sandboxed_api/sandbox2/unwind/unwind.h"
@@ -60,7 +72,15 @@
 #include "sandboxed_api/util/status.h"
 #include "sandboxed_api/util/statusor.h"
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
 namespace {
+// Keep the low FD numbers clean so that client FD mappings don't interfer
+// with us.
+constexpr int kTargetExecFd = 1022;
+
 // "Moves" the old FD to the new FD number.
 // The old FD will be closed, the new one is marked as CLOEXEC.
 void MoveToFdNumber(int* old_fd, int new_fd) {
@@ -84,6 +104,9 @@ void RunInitProcess(std::set<int> open_fds) {
   }
   // Close all open fds (equals to CloseAllFDsExcept but does not require /proc
   // to be available).
+  if (sandbox2::sanitizer::HasCloseRange()) {
+    sandbox2::sanitizer::CloseAllFDsExcept({});
+  }
   for (const auto& fd : open_fds) {
     close(fd);
   }
@@ -133,22 +156,171 @@ void RunInitProcess(std::set<int> open_fds) {
   }
 }
 
+// Serializes 'message' so that equal messages give equal strings, which is not
+// guaranteed for maps otherwise.
+std::string SerializeDeterministically(
+    const google::protobuf::Message& message) {
+  message.ByteSizeLong();
+  std::string serialized;
+  {
+    google::protobuf::io::StringOutputStream stream(&serialized);
+    google::protobuf::io::CodedOutputStream coded(&stream);
+    coded.SetSerializationDeterministic(true);
+    message.SerializeWithCachedSizes(&coded);
+  }
+  return serialized;
+}
+
+// Pins the child to the CPUs and memory node of the request. These are only
+// hints for the scheduler and allocator, so failures are not fatal. Both
+// settings survive execve().
+void ApplyPlacement(const sandbox2::ForkRequest& request) {
+  if (request.cpus_size() > 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : request.cpus()) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+      SAPI_RAW_PLOG(WARNING, "sched_setaffinity()");
+    }
+  }
+  const int node = request.memory_node();
+  constexpr int kMaxNodes = 8 * sizeof(unsigned long);  // NOLINT
+  if (node >= 0 && node < kMaxNodes) {
+    unsigned long nodes = 1UL << node;  // NOLINT
+    // The kernel ignores the last bit of maxnode.
+    if (sandbox2::util::Syscall(__NR_set_mempolicy, MPOL_PREFERRED,
+                                reinterpret_cast<uintptr_t>(&nodes),
+                                kMaxNodes + 1) == -1) {
+      SAPI_RAW_PLOG(WARNING, "set_mempolicy(MPOL_PREFERRED, %d)", node);
+    }
+  }
+}
+
+// Layout of sched_setattr() up to the utilization clamps
+// (SCHED_ATTR_SIZE_VER1), not exported by the libc headers.
+struct SchedAttr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+  uint32_t sched_util_min;
+  uint32_t sched_util_max;
+};
+
+constexpr uint64_t kSchedFlagKeepPolicy = 0x08;
+constexpr uint64_t kSchedFlagKeepParams = 0x10;
+constexpr uint64_t kSchedFlagUtilClampMin = 0x20;
+constexpr uint64_t kSchedFlagUtilClampMax = 0x40;
+
+// Sets the scheduling policy, nice value and utilization clamps of the child.
+// Like the placement, they survive execve() and failures are not fatal: a
+// lower nice value needs CAP_SYS_NICE and older kernels lack the clamps.
+void ApplyScheduling(const sandbox2::ForkRequest& request) {
+  if (request.sched_policy() >= 0) {
+    struct sched_param param = {};
+    if (sched_setscheduler(0, request.sched_policy(), &param) == -1) {
+      SAPI_RAW_PLOG(WARNING, "sched_setscheduler(%d)", request.sched_policy());
+    }
+  }
+  if (request.has_nice() &&
+      setpriority(PRIO_PROCESS, 0, request.nice()) == -1) {
+    SAPI_RAW_PLOG(WARNING, "setpriority(%d)", request.nice());
+  }
+  if (request.util_min() < 0 && request.util_max() < 0) {
+    return;
+  }
+  SchedAttr attr = {};
+  attr.size = sizeof(attr);
+  attr.sched_flags = kSchedFlagKeepPolicy | kSchedFlagKeepParams;
+  if (request.util_min() >= 0) {
+    attr.sched_flags |= kSchedFlagUtilClampMin;
+    attr.sched_util_min = request.util_min();
+  }
+  if (request.util_max() >= 0) {
+    attr.sched_flags |= kSchedFlagUtilClampMax;
+    attr.sched_util_max = request.util_max();
+  }
+  if (sandbox2::util::Syscall(__NR_sched_setattr, 0,
+                              reinterpret_cast<uintptr_t>(&attr), 0) == -1) {
+    SAPI_RAW_PLOG(WARNING, "sched_setattr(util_min=%d, util_max=%d)",
+                  request.util_min(), request.util_max());
+  }
+}
+
+// Creates the socketpair over which the sandboxee sends its PID.
+bool CreateSignalingSocketPair(int socketpair_fds[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socketpair_fds)) {
+    SAPI_RAW_PLOG(ERROR, "socketpair()");
+    return false;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    int val = 1;
+    if (setsockopt(socketpair_fds[i], SOL_SOCKET, SO_PASSCRED, &val,
+                   sizeof(val))) {
+      SAPI_RAW_PLOG(ERROR, "setsockopt failed");
+      close(socketpair_fds[0]);
+      close(socketpair_fds[1]);
+      return false;
+    }
+  }
+  return true;
+}
+
 sapi::Status SendPid(int signaling_fd) {
   // Send our PID (the actual sandboxee process) via SCM_CREDENTIALS.
   // The ancillary message will be attached to the message as SO_PASSCRED is set
-  // on the socket.
+  // on the socket. A pidfd goes along if the kernel supports them (Linux 5.3+),
+  // the ForkServer could only open one once the PID may have been reused.
+  sandbox2::file_util::fileops::FDCloser pid_fd{
+      static_cast<int>(syscall(__NR_pidfd_open, getpid(), 0))};
+  union {
+    struct cmsghdr cmh;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+  } rights_msg{};
+
   char dummy = ' ';
-  if (TEMP_FAILURE_RETRY(send(signaling_fd, &dummy, 1, 0)) != 1) {
+  struct iovec iov {};
+  iov.iov_base = &dummy;
+  iov.iov_len = sizeof(char);
+
+  struct msghdr msgh {};
+  msgh.msg_iov = &iov;
+  msgh.msg_iovlen = 1;
+  if (pid_fd.get() != -1) {
+    msgh.msg_control = rights_msg.ctrl;
+    msgh.msg_controllen = sizeof(rights_msg);
+    struct cmsghdr* cmsgp = CMSG_FIRSTHDR(&msgh);
+    cmsgp->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsgp->cmsg_level = SOL_SOCKET;
+    cmsgp->cmsg_type = SCM_RIGHTS;
+    int fd = pid_fd.get();
+    memcpy(CMSG_DATA(cmsgp), &fd, sizeof(fd));
+  }
+  if (TEMP_FAILURE_RETRY(sendmsg(signaling_fd, &msgh, 0)) != 1) {
     return sapi::InternalError(
-        absl::StrCat("Sending PID: send: ", sandbox2::StrError(errno)));
+        absl::StrCat("Sending PID: sendmsg: ", sandbox2::StrError(errno)));
   }
   return sapi::OkStatus();
 }
 
-sapi::StatusOr<pid_t> ReceivePid(int signaling_fd) {
+// Receives the PID sent with SendPid(), and its pidfd in 'pid_fd' if not
+// nullptr. *pid_fd is -1 if no pidfd came along.
+sapi::StatusOr<pid_t> ReceivePid(int signaling_fd, int* pid_fd = nullptr) {
+  if (pid_fd) {
+    *pid_fd = -1;
+  }
   union {
     struct cmsghdr cmh;
-    char ctrl[CMSG_SPACE(sizeof(struct ucred))];
+    char ctrl[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(sizeof(int))];
   } ucred_msg{};
 
   struct msghdr msgh {};
@@ -163,42 +335,369 @@ sapi::StatusOr<pid_t> ReceivePid(int signaling_fd) {
   iov.iov_base = &dummy;
   iov.iov_len = sizeof(char);
 
-  if (TEMP_FAILURE_RETRY(recvmsg(signaling_fd, &msgh, MSG_WAITALL)) != 1) {
+  if (TEMP_FAILURE_RETRY(recvmsg(signaling_fd, &msgh,
+                                 MSG_WAITALL | MSG_CMSG_CLOEXEC)) != 1) {
     return sapi::InternalError(absl::StrCat("Receiving pid failed: recvmsg: ",
                                             sandbox2::StrError(errno)));
   }
-  struct cmsghdr* cmsgp = CMSG_FIRSTHDR(&msgh);
-  if (cmsgp->cmsg_len != CMSG_LEN(sizeof(struct ucred)) ||
-      cmsgp->cmsg_level != SOL_SOCKET || cmsgp->cmsg_type != SCM_CREDENTIALS) {
+  struct ucred* ucredp = nullptr;
+  int received_fd = -1;
+  for (struct cmsghdr* cmsgp = CMSG_FIRSTHDR(&msgh); cmsgp != nullptr;
+       cmsgp = CMSG_NXTHDR(&msgh, cmsgp)) {
+    if (cmsgp->cmsg_level != SOL_SOCKET) {
+      continue;
+    }
+    if (cmsgp->cmsg_type == SCM_CREDENTIALS &&
+        cmsgp->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
+      ucredp = reinterpret_cast<struct ucred*>(CMSG_DATA(cmsgp));
+    } else if (cmsgp->cmsg_type == SCM_RIGHTS &&
+               cmsgp->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(&received_fd, CMSG_DATA(cmsgp), sizeof(received_fd));
+    }
+  }
+  sandbox2::file_util::fileops::FDCloser received_fd_closer{received_fd};
+  if (ucredp == nullptr) {
     return sapi::InternalError("Receiving pid failed");
   }
-  struct ucred* ucredp = reinterpret_cast<struct ucred*>(CMSG_DATA(cmsgp));
+  if (pid_fd) {
+    *pid_fd = received_fd_closer.Release();
+  }
   return ucredp->pid;
 }
+
+// Receives the PIDs of the init process and of the sandboxee of a child forked
+// for 'request'. 'sandboxee_pid_fd' is passed in as the pidfd of the child or
+// -1, and is set to the pidfd of the sandboxee or -1. Kills the child on
+// errors. 'init_pid' is 0 if there is no init process.
+bool ReceiveChildPids(const sandbox2::ForkRequest& request, pid_t child,
+                      int signaling_fd, pid_t* init_pid, pid_t* sandboxee_pid,
+                      int* sandboxee_pid_fd) {
+  *init_pid = 0;
+  *sandboxee_pid = child;
+  // A custom init process is only spawned if a new PID NS is created.
+  if (!(request.clone_flags() & CLONE_NEWPID)) {
+    return true;
+  }
+  if (request.sandboxee_is_init()) {
+    if (!request.join_namespace_template()) {
+      // The child is the sandboxee.
+      return true;
+    }
+    // The child forked the sandboxee after joining the template, and exited.
+    if (*sandboxee_pid_fd != -1) {
+      close(*sandboxee_pid_fd);
+      *sandboxee_pid_fd = -1;
+    }
+    auto pid_or = ReceivePid(signaling_fd, sandboxee_pid_fd);
+    if (!pid_or.ok()) {
+      SAPI_RAW_LOG(ERROR, "%s", pid_or.status().message());
+      kill(child, SIGKILL);
+      return false;
+    }
+    *sandboxee_pid = pid_or.ValueOrDie();
+    return true;
+  }
+  // The child is not the sandboxee then.
+  if (*sandboxee_pid_fd != -1) {
+    close(*sandboxee_pid_fd);
+    *sandboxee_pid_fd = -1;
+  }
+  if (request.join_namespace_template()) {
+    // The child only forked the init process after joining the template, and
+    // exited.
+    auto pid_or = ReceivePid(signaling_fd);
+    if (!pid_or.ok()) {
+      SAPI_RAW_LOG(ERROR, "%s", pid_or.status().message());
+      kill(child, SIGKILL);
+      return false;
+    }
+    *init_pid = pid_or.ValueOrDie();
+  } else {
+    // The pid of the init process is equal to the child process that we've
+    // previously forked.
+    *init_pid = child;
+  }
+  // And the actual sandboxee is forked from the init process, so we need to
+  // receive the actual PID.
+  auto pid_or = ReceivePid(signaling_fd, sandboxee_pid_fd);
+  if (!pid_or.ok()) {
+    SAPI_RAW_LOG(ERROR, "%s", pid_or.status().message());
+    kill(*init_pid, SIGKILL);
+    return false;
+  }
+  *sandboxee_pid = pid_or.ValueOrDie();
+  return true;
+}
 }  // namespace
 
 namespace sandbox2 {
 
+constexpr int ForkServer::kMaxPreforkedChildren;
+constexpr size_t ForkServer::kMaxBatchSize;
+constexpr size_t ForkServer::kMaxPrebuiltRoots;
+constexpr size_t ForkServer::kMaxTemplates;
+constexpr int ForkServer::kNetworkNamespacePoolSize;
+constexpr int32_t ForkServer::kReplyHasPidFd;
+constexpr int32_t ForkServer::kReplyInCgroup;
+
+ForkClient::~ForkClient() {
+  for (int fd : child_pid_fds_) {
+    close(fd);
+  }
+}
+
+void ForkClient::SetAdmissionLimits(const AdmissionLimits& limits) {
+  absl::MutexLock lock(&admission_mutex_);
+  limits_ = limits;
+}
+
 pid_t ForkClient::SendRequest(const ForkRequest& request, int exec_fd,
-                              int comms_fd, int user_ns_fd, pid_t* init_pid) {
-  // Acquire the channel ownership for this request (transaction).
-  absl::MutexLock l(&comms_mutex_);
+                              int comms_fd, int user_ns_fd, pid_t* init_pid,
+                              int cgroup_fd, int* pid_fd, bool* in_cgroup,
+                              bool* shed) {
+  std::vector<Reply> replies;
+  bool admitted = Send(request, exec_fd, {comms_fd}, user_ns_fd, cgroup_fd,
+                       &replies);
+  if (shed) {
+    *shed = !admitted;
+  }
+  Reply reply;
+  if (!replies.empty()) {
+    reply = replies[0];
+    if (init_pid) {
+      *init_pid = reply.init_pid;
+    }
+  }
+  if (pid_fd) {
+    *pid_fd = reply.pid_fd;
+  } else if (reply.pid_fd != -1) {
+    close(reply.pid_fd);
+  }
+  if (in_cgroup) {
+    *in_cgroup = reply.in_cgroup;
+  }
+  return reply.pid;
+}
 
+std::vector<pid_t> ForkClient::SendRequests(const ForkRequest& request,
+                                            int exec_fd,
+                                            const std::vector<int>& comms_fds,
+                                            int cgroup_fd,
+                                            std::vector<pid_t>* init_pids,
+                                            std::vector<int>* pid_fds,
+                                            bool* shed) {
+  std::vector<pid_t> pids(comms_fds.size(), -1);
+  if (init_pids) {
+    init_pids->assign(comms_fds.size(), -1);
+  }
+  if (pid_fds) {
+    pid_fds->assign(comms_fds.size(), -1);
+  }
+  if (shed) {
+    *shed = false;
+  }
+  if (comms_fds.empty() || comms_fds.size() > ForkServer::kMaxBatchSize ||
+      request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
+    SAPI_RAW_LOG(ERROR, "Invalid batch of %zu fork requests",
+                 comms_fds.size());
+    return pids;
+  }
+  ForkRequest batch = request;
+  batch.set_batch_size(comms_fds.size());
+  std::vector<Reply> replies;
+  bool admitted =
+      Send(batch, exec_fd, comms_fds, /*user_ns_fd=*/-1, cgroup_fd, &replies);
+  if (shed) {
+    *shed = !admitted;
+  }
+  for (size_t i = 0; i < replies.size(); ++i) {
+    pids[i] = replies[i].pid;
+    if (init_pids) {
+      (*init_pids)[i] = replies[i].init_pid;
+    }
+    if (pid_fds) {
+      (*pid_fds)[i] = replies[i].pid_fd;
+    } else if (replies[i].pid_fd != -1) {
+      close(replies[i].pid_fd);
+    }
+  }
+  return pids;
+}
+
+bool ForkClient::Send(const ForkRequest& request, int exec_fd,
+                      const std::vector<int>& comms_fds, int user_ns_fd,
+                      int cgroup_fd, std::vector<Reply>* replies) {
+  pending_requests_.fetch_add(1, std::memory_order_relaxed);
+  metrics::UpdateGauge(metrics::kForkServerQueueDepth, 1);
+  bool admitted = Admit(request.priority(), comms_fds.size());
+  if (!admitted) {
+    SAPI_RAW_VLOG(1, "Fork request with priority %d shed",
+                  request.priority());
+    metrics::IncrementCounter(metrics::kForkServerShedRequests);
+  } else {
+    {
+      // Acquire the channel ownership for this request (transaction).
+      absl::MutexLock l(&comms_mutex_);
+      SendRequestLocked(request, exec_fd, comms_fds, user_ns_fd, cgroup_fd,
+                        replies);
+    }
+    Release(*replies);
+  }
+  pending_requests_.fetch_sub(1, std::memory_order_relaxed);
+  metrics::UpdateGauge(metrics::kForkServerQueueDepth, -1);
+  return admitted;
+}
+
+bool ForkClient::Admit(int priority, size_t num_children) {
+  absl::MutexLock lock(&admission_mutex_);
+  Waiter self{this, priority, next_waiter_seq_++, /*shed=*/false};
+  if (limits_.max_queued_requests > 0 &&
+      waiters_.size() >= static_cast<size_t>(limits_.max_queued_requests)) {
+    // Lowest priority first, the latest arrival among equal ones.
+    auto lowest = std::min_element(
+        waiters_.begin(), waiters_.end(), [](const Waiter* a, const Waiter* b) {
+          return a->priority < b->priority ||
+                 (a->priority == b->priority && a->seq > b->seq);
+        });
+    if ((*lowest)->priority >= priority) {
+      return false;
+    }
+    (*lowest)->shed = true;
+    waiters_.erase(lowest);
+  }
+  waiters_.push_back(&self);
+
+  for (;;) {
+    admission_mutex_.Await(absl::Condition(
+        +[](Waiter* waiter) {
+          waiter->client->admission_mutex_.AssertHeld();
+          return waiter->shed || waiter->client->IsNext(waiter);
+        },
+        &self));
+    if (self.shed) {
+      return false;
+    }
+    if (HasChildSlots(num_children)) {
+      break;
+    }
+    // Wait for a child to exit. Higher priority requests arriving meanwhile
+    // take over on the next round.
+    std::vector<pollfd> fds(child_pid_fds_.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+      fds[i] = {child_pid_fds_[i], POLLIN, 0};
+    }
+    constexpr int kChildPollIntervalMs = 10;
+    admission_mutex_.Unlock();
+    poll(fds.data(), fds.size(), kChildPollIntervalMs);
+    admission_mutex_.Lock();
+    if (self.shed) {
+      return false;
+    }
+  }
+  waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &self));
+  channel_busy_ = true;
+  return true;
+}
+
+void ForkClient::Release(const std::vector<Reply>& replies) {
+  absl::MutexLock lock(&admission_mutex_);
+  channel_busy_ = false;
+  if (limits_.max_children <= 0) {
+    return;
+  }
+  for (const Reply& reply : replies) {
+    if (reply.pid <= 0 || reply.pid_fd == -1) {
+      continue;
+    }
+    int fd = fcntl(reply.pid_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+      SAPI_RAW_PLOG(WARNING, "Could not duplicate the pidfd of a child");
+      continue;
+    }
+    child_pid_fds_.push_back(fd);
+  }
+}
+
+bool ForkClient::IsNext(const Waiter* waiter) const {
+  if (channel_busy_) {
+    return false;
+  }
+  for (const Waiter* other : waiters_) {
+    if (other->priority > waiter->priority ||
+        (other->priority == waiter->priority && other->seq < waiter->seq)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ForkClient::HasChildSlots(size_t num_children) {
+  if (limits_.max_children <= 0) {
+    return true;
+  }
+  // Batches larger than the limit start once no child is left.
+  const size_t max_children = limits_.max_children;
+  const size_t limit = max_children - std::min(num_children, max_children);
+  if (child_pid_fds_.size() <= limit) {
+    return true;
+  }
+  // pidfds become readable once their process has exited.
+  std::vector<pollfd> fds(child_pid_fds_.size());
+  for (size_t i = 0; i < fds.size(); ++i) {
+    fds[i] = {child_pid_fds_[i], POLLIN, 0};
+  }
+  if (poll(fds.data(), fds.size(), 0) > 0) {
+    child_pid_fds_.clear();
+    for (const pollfd& fd : fds) {
+      if (fd.revents != 0) {
+        close(fd.fd);
+      } else {
+        child_pid_fds_.push_back(fd.fd);
+      }
+    }
+  }
+  return child_pid_fds_.size() <= limit;
+}
+
+bool ForkClient::HasTemplate(uint64_t id) const {
+  absl::MutexLock lock(&templates_mutex_);
+  return sent_templates_.contains(id);
+}
+
+void ForkClient::SendRequestLocked(const ForkRequest& request, int exec_fd,
+                                   const std::vector<int>& comms_fds,
+                                   int user_ns_fd, int cgroup_fd,
+                                   std::vector<Reply>* replies) {
+  replies->clear();
   if (!comms_->SendProtoBuf(request)) {
     SAPI_RAW_LOG(ERROR, "Sending PB to the ForkServer failed");
-    return -1;
+    return;
+  }
+  if (request.template_id() != 0 && request.has_mount_tree()) {
+    // Same condition as in ForkServer::ApplyTemplate(), the requests arrive
+    // in the order they are sent.
+    absl::MutexLock lock(&templates_mutex_);
+    if (sent_templates_.size() < ForkServer::kMaxTemplates) {
+      sent_templates_.insert(request.template_id());
+    }
   }
-  if (!comms_->SendFD(comms_fd)) {
+  if (request.batch_size() > 1) {
+    if (!comms_->SendFDs(comms_fds)) {
+      SAPI_RAW_LOG(ERROR, "Sending %zu Comms FDs to the ForkServer failed",
+                   comms_fds.size());
+      return;
+    }
+  } else if (!comms_->SendFD(comms_fds[0])) {
     SAPI_RAW_LOG(ERROR, "Sending Comms FD (%d) to the ForkServer failed",
-                 comms_fd);
-    return -1;
+                 comms_fds[0]);
+    return;
   }
   if (request.mode() == FORKSERVER_FORK_EXECVE ||
       request.mode() == FORKSERVER_FORK_EXECVE_SANDBOX) {
     if (!comms_->SendFD(exec_fd)) {
       SAPI_RAW_LOG(ERROR, "Sending Exec FD (%d) to the ForkServer failed",
                    exec_fd);
-      return -1;
+      return;
     }
   }
 
@@ -206,26 +705,58 @@ pid_t ForkClient::SendRequest(const ForkRequest& request, int exec_fd,
     if (!comms_->SendFD(user_ns_fd)) {
       SAPI_RAW_LOG(ERROR, "Sending user ns FD (%d) to the ForkServer failed",
                    user_ns_fd);
-      return -1;
+      return;
+    }
+  }
+
+  if (request.into_cgroup()) {
+    if (!comms_->SendFD(cgroup_fd)) {
+      SAPI_RAW_LOG(ERROR, "Sending cgroup FD (%d) to the ForkServer failed",
+                   cgroup_fd);
+      return;
     }
   }
 
+  // One reply per child, in the order of comms_fds.
+  for (size_t i = 0; i < comms_fds.size(); ++i) {
+    Reply reply;
+    if (!RecvReply(&reply)) {
+      return;
+    }
+    replies->push_back(reply);
+  }
+}
+
+bool ForkClient::RecvReply(Reply* reply) {
   int32_t pid;
   // Receive init process ID.
   if (!comms_->RecvInt32(&pid)) {
     SAPI_RAW_LOG(ERROR, "Receiving init PID from the ForkServer failed");
-    return -1;
-  }
-  if (init_pid) {
-    *init_pid = static_cast<pid_t>(pid);
+    return false;
   }
+  reply->init_pid = static_cast<pid_t>(pid);
 
   // Receive sandboxee process ID.
   if (!comms_->RecvInt32(&pid)) {
     SAPI_RAW_LOG(ERROR, "Receiving sandboxee PID from the ForkServer failed");
-    return -1;
+    return false;
+  }
+
+  int32_t flags;
+  if (!comms_->RecvInt32(&flags)) {
+    SAPI_RAW_LOG(ERROR, "Receiving reply flags from the ForkServer failed");
+    return false;
   }
-  return static_cast<pid_t>(pid);
+  if (flags & ForkServer::kReplyHasPidFd) {
+    if (!comms_->RecvFD(&reply->pid_fd)) {
+      SAPI_RAW_LOG(ERROR, "Receiving pidfd from the ForkServer failed");
+      reply->pid_fd = -1;
+      return false;
+    }
+  }
+  reply->in_cgroup = flags & ForkServer::kReplyInCgroup;
+  reply->pid = static_cast<pid_t>(pid);
+  return true;
 }
 
 void ForkServer::PrepareExecveArgs(const ForkRequest& request,
@@ -270,18 +801,25 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
   // sandoxing can cause syscall violations (e.g. related to memory management).
   std::vector<std::string> args;
   std::vector<std::string> envs;
-  const char** argv = nullptr;
-  const char** envp = nullptr;
   if (will_execve) {
     PrepareExecveArgs(request, &args, &envs);
   }
 
   SanitizeEnvironment(client_fd);
+  GetSandboxeeStartupTimes()->sanitization = MonotonicNanos();
 
+  // Only needed by the init process without close_range(2), /proc may be gone
+  // by then.
   std::set<int> open_fds;
-  if (!sanitizer::GetListOfFDs(&open_fds)) {
+  if (!sanitizer::HasCloseRange() && !sanitizer::GetListOfFDs(&open_fds)) {
     SAPI_RAW_LOG(WARNING, "Could not get list of current open FDs");
   }
+  SetUpChild(request, uid, gid, signaling_fd, open_fds);
+  FinishChild(request, execve_fd, &args, &envs);
+}
+
+void ForkServer::SetUpChild(const ForkRequest& request, uid_t uid, gid_t gid,
+                            int signaling_fd, const std::set<int>& open_fds) {
   InitializeNamespaces(request, uid, gid);
 
   auto caps = cap_init();
@@ -297,8 +835,9 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
   SAPI_RAW_CHECK(cap_set_proc(caps) == 0, "while dropping capabilities");
   cap_free(caps);
 
-  // A custom init process is only needed if a new PID NS is created.
-  if (request.clone_flags() & CLONE_NEWPID) {
+  // A custom init process is only needed if a new PID NS is created, and the
+  // sandboxee does not reap its children itself.
+  if ((request.clone_flags() & CLONE_NEWPID) && !request.sandboxee_is_init()) {
     // Spawn a child process
     pid_t child = fork();
     if (child < 0) {
@@ -313,7 +852,20 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
       SAPI_RAW_LOG(FATAL, "%s", status.message());
     }
   }
+}
 
+void ForkServer::FinishChild(const ForkRequest& request, int execve_fd,
+                             std::vector<std::string>* args,
+                             std::vector<std::string>* envs) {
+  // Parked children are shared between placements, so this waits until the
+  // request is known.
+  ApplyPlacement(request);
+  ApplyScheduling(request);
+
+  bool will_execve = (request.mode() == FORKSERVER_FORK_EXECVE ||
+                      request.mode() == FORKSERVER_FORK_EXECVE_SANDBOX);
+  const char** argv = nullptr;
+  const char** envp = nullptr;
   if (request.mode() == FORKSERVER_FORK_EXECVE_SANDBOX ||
       request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
     // Sandboxing can be enabled either here - just before execve, or somewhere
@@ -325,7 +877,11 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
     // Create a Comms object here and not above, as we know we will execve and
     // therefore not call the Comms destructor, which would otherwise close the
     // comms file descriptor, which we do not want for the general case.
-    Comms client_comms(Comms::kSandbox2ClientCommsFD);
+    // The forkserver is not told the socket type through kSeqpacketEnv, and is
+    // not sandboxed yet.
+    Comms client_comms(
+        Comms::kSandbox2ClientCommsFD,
+        Comms::IsSeqpacketSocket(Comms::kSandbox2ClientCommsFD));
     Client c(&client_comms);
 
     // The following client calls are basically SandboxMeHere. We split it so
@@ -333,25 +889,33 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
     // before we enable the syscall filter.
     c.PrepareEnvironment();
 
-    envs.push_back(c.GetFdMapEnvVar());
+    envs->push_back(c.GetFdMapEnvVar());
     // Convert argv and envs to const char **. No need to free it, as the
     // code will either execve() or exit().
-    argv = util::VecStringToCharPtrArr(args);
-    envp = util::VecStringToCharPtrArr(envs);
+    argv = util::VecStringToCharPtrArr(*args);
+    envp = util::VecStringToCharPtrArr(*envs);
 
     c.EnableSandbox();
     if (request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
+      // Serve requests until the Comms channel is closed, see
+      // StackTraceCollector.
       UnwindSetup pb_setup;
-      if (!client_comms.RecvProtoBuf(&pb_setup)) {
-        exit(1);
+      while (client_comms.RecvProtoBuf(&pb_setup)) {
+        if (pb_setup.thread_regs_size() > 0) {
+          RunLibUnwindAndSymbolizerForThreads(
+              pb_setup.pid(), &client_comms,
+              std::vector<std::string>(pb_setup.thread_regs().begin(),
+                                       pb_setup.thread_regs().end()),
+              pb_setup.default_max_frames(), pb_setup.delim());
+          continue;
+        }
+        std::string data = pb_setup.regs();
+        InstallUserRegs(data.c_str(), data.length());
+        ArmPtraceEmulation();
+        RunLibUnwindAndSymbolizer(pb_setup.pid(), &client_comms,
+                                  pb_setup.default_max_frames(),
+                                  pb_setup.delim());
       }
-
-      std::string data = pb_setup.regs();
-      InstallUserRegs(data.c_str(), data.length());
-      ArmPtraceEmulation();
-      RunLibUnwindAndSymbolizer(pb_setup.pid(), &client_comms,
-                                pb_setup.default_max_frames(),
-                                pb_setup.delim());
       exit(0);
     } else {
       ExecuteProcess(execve_fd, argv, envp);
@@ -360,18 +924,240 @@ void ForkServer::LaunchChild(const ForkRequest& request, int execve_fd,
   }
 
   if (will_execve) {
-    argv = util::VecStringToCharPtrArr(args);
-    envp = util::VecStringToCharPtrArr(envs);
+    argv = util::VecStringToCharPtrArr(*args);
+    envp = util::VecStringToCharPtrArr(*envs);
     ExecuteProcess(execve_fd, argv, envp);
     abort();
   }
 }
 
-pid_t ForkServer::ServeRequest() const {
-  // Keep the low FD numbers clean so that client FD mappings don't interfer
-  // with us.
-  constexpr int kTargetExecFd = 1022;
+ForkServer::ForkServer(Comms* comms) : comms_(comms) {
+  if (!Initialize()) {
+    LOG(FATAL) << "Could not initialize the ForkServer";
+  }
+}
+
+ForkServer::~ForkServer() {
+  ClosePoolFds();
+  CloseNetworkNamespacePool();
+  CloseNamespaceTemplate();
+}
+
+bool ForkServer::CanPrefork(const ForkRequest& request) {
+  return request.prefork() > 0 &&
+         request.mode() != FORKSERVER_FORK_JOIN_SANDBOX_UNWIND;
+}
+
+std::string ForkServer::GetForkTimeConfig(const ForkRequest& request) {
+  ForkRequest config = request;
+  config.clear_args();
+  config.clear_envs();
+  config.clear_prefork();
+  config.clear_cpus();
+  config.clear_memory_node();
+  config.clear_sched_policy();
+  config.clear_nice();
+  config.clear_util_min();
+  config.clear_util_max();
+  // Parked children are not started in a cgroup, the client moves them.
+  config.clear_into_cgroup();
+  if (config.template_id() != 0) {
+    // Determined by the template_id, and large.
+    config.clear_mount_tree();
+    config.clear_hostname();
+  }
+  return SerializeDeterministically(config);
+}
+
+void ForkServer::ClosePoolFds() {
+  for (const ParkedChild& parked : pool_) {
+    close(parked.fd);
+    if (parked.pid_fd != -1) {
+      close(parked.pid_fd);
+    }
+  }
+  pool_.clear();
+}
+
+bool ForkServer::HandToParkedChild(const ForkRequest& request, int exec_fd,
+                                   int comms_fd, pid_t* init_pid,
+                                   pid_t* sandboxee_pid, int* pid_fd) {
+  if (!CanPrefork(request) || GetForkTimeConfig(request) != pool_config_) {
+    return false;
+  }
+  while (!pool_.empty()) {
+    ParkedChild parked = pool_.front();
+    pool_.pop_front();
+    // Takes ownership of the fd.
+    Comms parked_comms(parked.fd);
+    file_util::fileops::FDCloser pid_fd_closer{parked.pid_fd};
+
+    // A parked child never writes to its end, so any event means that it went
+    // away. Checking first also avoids a SIGPIPE when sending to it.
+    struct pollfd pfd = {parked.fd, POLLIN, 0};
+    if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) != 0) {
+      SAPI_RAW_VLOG(1, "Parked child %d is gone", parked.sandboxee_pid);
+      continue;
+    }
+    if (!parked_comms.SendProtoBuf(request) ||
+        !parked_comms.SendFD(comms_fd) ||
+        (exec_fd >= 0 && !parked_comms.SendFD(exec_fd))) {
+      SAPI_RAW_LOG(WARNING, "Handing request to parked child %d failed",
+                   parked.sandboxee_pid);
+      continue;
+    }
+    *init_pid = parked.init_pid;
+    *sandboxee_pid = parked.sandboxee_pid;
+    *pid_fd = pid_fd_closer.Release();
+    return true;
+  }
+  return false;
+}
+
+bool ForkServer::RefillPool(const ForkRequest& request) {
+  // Requests without pre-forked children leave the pool alone.
+  if (!CanPrefork(request)) {
+    return true;
+  }
+  std::string config = GetForkTimeConfig(request);
+  if (config != pool_config_) {
+    ClosePoolFds();
+    pool_config_ = std::move(config);
+  }
+  const size_t size = std::min(request.prefork(), kMaxPreforkedChildren);
+  while (pool_.size() < size) {
+    ParkedChild parked;
+    pid_t pid = ParkChild(request, &parked);
+    if (pid == 0) {
+      return false;
+    }
+    if (pid < 0) {
+      // Retried after the next request.
+      break;
+    }
+    pool_.push_back(parked);
+  }
+  return true;
+}
+
+pid_t ForkServer::ParkChild(const ForkRequest& request, ParkedChild* parked) {
+  int park_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, park_fds)) {
+    SAPI_RAW_PLOG(ERROR, "socketpair()");
+    return -1;
+  }
+  file_util::fileops::FDCloser park_closer0{park_fds[0]};
+  file_util::fileops::FDCloser park_closer1{park_fds[1]};
 
+  int signaling_fds[2];
+  if (!CreateSignalingSocketPair(signaling_fds)) {
+    return -1;
+  }
+  file_util::fileops::FDCloser fd_closer0{signaling_fds[0]};
+  file_util::fileops::FDCloser fd_closer1{signaling_fds[1]};
+
+  // Store uid and gid since they will change if CLONE_NEWUSER is set.
+  uid_t uid = getuid();
+  uid_t gid = getgid();
+
+  file_util::fileops::FDCloser net_ns{TakeNetworkNamespace(request)};
+  int clone_flags = GetCloneFlags(request);
+  // Parked children are shared between requests, so they start in the
+  // ForkServer's cgroup.
+  int pid_fd;
+  bool in_cgroup;
+  pid_t child = util::ForkWithPidFd(clone_flags, /*cgroup_fd=*/-1, &pid_fd,
+                                    &in_cgroup);
+  if (child == -1) {
+    SAPI_RAW_LOG(ERROR, "util::ForkWithPidFd(%x)", clone_flags);
+    return -1;
+  }
+
+  // Child.
+  if (child == 0) {
+    GetSandboxeeStartupTimes()->clone = MonotonicNanos();
+    park_closer0.Close();
+    fd_closer0.Close();
+    PrepareChild(request, fd_closer1.get(), net_ns.Release());
+    // The Comms object in RunParkedChild() closes the fd.
+    RunParkedChild(request, park_closer1.Release(), uid, gid,
+                   fd_closer1.get());
+    return 0;
+  }
+
+  fd_closer1.Close();
+  park_closer1.Close();
+
+  pid_t init_pid;
+  pid_t sandboxee_pid;
+  if (!ReceiveChildPids(request, child, fd_closer0.get(), &init_pid,
+                        &sandboxee_pid, &pid_fd)) {
+    return -1;
+  }
+
+  parked->fd = park_closer0.Release();
+  parked->init_pid = init_pid;
+  parked->sandboxee_pid = sandboxee_pid;
+  parked->pid_fd = pid_fd;
+  return sandboxee_pid;
+}
+
+void ForkServer::RunParkedChild(const ForkRequest& config, int park_fd,
+                                uid_t uid, gid_t gid, int signaling_fd) {
+  // Same as SanitizeEnvironment(), but the client's Comms FD is not known yet.
+  if (!sanitizer::SanitizeCurrentProcess(
+          {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, park_fd},
+          /* close_fds = */ false)) {
+    SAPI_RAW_LOG(FATAL, "sanitizer::SanitizeCurrentProcess(close_fds=false)");
+  }
+  GetSandboxeeStartupTimes()->sanitization = MonotonicNanos();
+
+  // Only needed by the init process without close_range(2), /proc may be gone
+  // by then.
+  std::set<int> open_fds;
+  if (!sanitizer::HasCloseRange() && !sanitizer::GetListOfFDs(&open_fds)) {
+    SAPI_RAW_LOG(WARNING, "Could not get list of current open FDs");
+  }
+  SetUpChild(config, uid, gid, signaling_fd, open_fds);
+
+  // Wait for the request. If the ForkServer goes away first, so do we.
+  ForkRequest request;
+  int client_fd;
+  int exec_fd = -1;
+  {
+    Comms park_comms(park_fd);
+    if (!park_comms.RecvProtoBuf(&request) ||
+        !park_comms.RecvFD(&client_fd)) {
+      _exit(0);
+    }
+    if (request.mode() == FORKSERVER_FORK_EXECVE ||
+        request.mode() == FORKSERVER_FORK_EXECVE_SANDBOX) {
+      if (!park_comms.RecvFD(&exec_fd)) {
+        _exit(0);
+      }
+      MoveToFdNumber(&exec_fd, kTargetExecFd);
+    }
+  }
+
+  std::vector<std::string> args;
+  std::vector<std::string> envs;
+  if (exec_fd >= 0) {
+    PrepareExecveArgs(request, &args, &envs);
+  }
+  SAPI_RAW_CHECK(dup2(client_fd, Comms::kSandbox2ClientCommsFD) != -1,
+                 "while remapping client comms fd");
+  close(client_fd);
+  FinishChild(request, exec_fd, &args, &envs);
+}
+
+pid_t ForkServer::ServeRequest() {
+  pid_t pid;
+  while (!ServeOneRequest(&pid)) {
+  }
+  return pid;
+}
+
+bool ForkServer::ServeOneRequest(pid_t* pid) {
   ForkRequest fork_request;
   if (!comms_->RecvProtoBuf(&fork_request)) {
     if (comms_->IsTerminated()) {
@@ -381,9 +1167,23 @@ pid_t ForkServer::ServeRequest() const {
       SAPI_RAW_LOG(FATAL, "Failed to receive ForkServer request");
     }
   }
-  int comms_fd;
-  if (!comms_->RecvFD(&comms_fd)) {
-    SAPI_RAW_LOG(FATAL, "Failed to receive Comms FD");
+  std::vector<int> comms_fds;
+  if (fork_request.batch_size() > 1) {
+    if (static_cast<size_t>(fork_request.batch_size()) > kMaxBatchSize ||
+        fork_request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
+      SAPI_RAW_LOG(FATAL, "Invalid batch size %d", fork_request.batch_size());
+    }
+    if (!comms_->RecvFDs(&comms_fds) ||
+        comms_fds.size() != static_cast<size_t>(fork_request.batch_size())) {
+      SAPI_RAW_LOG(FATAL, "Failed to receive %d Comms FDs",
+                   fork_request.batch_size());
+    }
+  } else {
+    int comms_fd;
+    if (!comms_->RecvFD(&comms_fd)) {
+      SAPI_RAW_LOG(FATAL, "Failed to receive Comms FD");
+    }
+    comms_fds.push_back(comms_fd);
   }
 
   int exec_fd = -1;
@@ -397,11 +1197,6 @@ pid_t ForkServer::ServeRequest() const {
     MoveToFdNumber(&exec_fd, kTargetExecFd);
   }
 
-  // Make the kernel notify us with SIGCHLD when the process terminates.
-  // We use sigaction(SIGCHLD, flags=SA_NOCLDWAIT) in combination with
-  // this to make sure the zombie process is reaped immediately.
-  int clone_flags = fork_request.clone_flags() | SIGCHLD;
-
   int user_ns_fd = -1;
   if (fork_request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
     if (!comms_->RecvFD(&user_ns_fd)) {
@@ -409,77 +1204,515 @@ pid_t ForkServer::ServeRequest() const {
     }
   }
 
-  // Store uid and gid since they will change if CLONE_NEWUSER is set.
-  uid_t uid = getuid();
-  uid_t gid = getgid();
+  int cgroup_fd = -1;
+  if (fork_request.into_cgroup()) {
+    if (!comms_->RecvFD(&cgroup_fd)) {
+      SAPI_RAW_LOG(FATAL, "Failed to receive cgroup fd");
+    }
+  }
 
-  int socketpair_fds[2];
-  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socketpair_fds)) {
-    SAPI_RAW_LOG(FATAL, "socketpair()");
+  if (!ApplyTemplate(&fork_request)) {
+    SAPI_RAW_LOG(ERROR, "Unknown template id %" PRIu64,
+                 fork_request.template_id());
+    RejectRequest(comms_fds, exec_fd, user_ns_fd, cgroup_fd);
+    return false;
   }
 
-  for (int i = 0; i < 2; i++) {
-    int val = 1;
-    if (setsockopt(socketpair_fds[i], SOL_SOCKET, SO_PASSCRED, &val,
-                   sizeof(val))) {
-      SAPI_RAW_LOG(FATAL, "setsockopt failed");
+  // Fall back to creating all namespaces if the template cannot be used.
+  if (fork_request.join_namespace_template() &&
+      !(CanJoinNamespaceTemplate(fork_request) && CreateNamespaceTemplate())) {
+    fork_request.clear_join_namespace_template();
+  }
+  fork_request.clear_prebuilt_root();
+  if (fork_request.join_namespace_template() && fork_request.has_mount_tree()) {
+    // The tree of a template is only looked up once.
+    ForkRequest* request_template = nullptr;
+    auto it = templates_.find(fork_request.template_id());
+    if (it != templates_.end()) {
+      request_template = it->second.get();
+    }
+    if (request_template != nullptr &&
+        !request_template->prebuilt_root().empty()) {
+      fork_request.set_prebuilt_root(request_template->prebuilt_root());
+    } else {
+      fork_request.set_prebuilt_root(
+          GetPrebuiltRoot(fork_request.mount_tree()));
+      if (request_template != nullptr) {
+        request_template->set_prebuilt_root(fork_request.prebuilt_root());
+      }
+    }
+  }
+
+  struct Reply {
+    // Note: init_pid will be overwritten with the actual init pid if the init
+    //       process was started or stays at 0 if that is not needed (custom
+    //       forkserver).
+    pid_t init_pid = 0;
+    pid_t sandboxee_pid = -1;
+    int pid_fd = -1;
+    bool in_cgroup = false;
+  };
+  std::vector<Reply> replies(comms_fds.size());
+  batch_comms_fds_ = comms_fds;
+  for (size_t i = 0; i < comms_fds.size(); ++i) {
+    Reply& reply = replies[i];
+    if (!HandToParkedChild(fork_request, exec_fd, comms_fds[i],
+                           &reply.init_pid, &reply.sandboxee_pid,
+                           &reply.pid_fd)) {
+      reply.sandboxee_pid =
+          ForkChild(fork_request, exec_fd, comms_fds[i], user_ns_fd, cgroup_fd,
+                    &reply.init_pid, &reply.pid_fd, &reply.in_cgroup);
+      // Child.
+      if (reply.sandboxee_pid == 0) {
+        *pid = 0;
+        return true;
+      }
+    }
+  }
+  batch_comms_fds_.clear();
+
+  // Parent.
+  for (int comms_fd : comms_fds) {
+    close(comms_fd);
+  }
+  if (exec_fd >= 0) {
+    close(exec_fd);
+  }
+  if (user_ns_fd >= 0) {
+    close(user_ns_fd);
+  }
+  if (cgroup_fd >= 0) {
+    close(cgroup_fd);
+  }
+  for (const Reply& reply : replies) {
+    file_util::fileops::FDCloser pid_fd_closer{reply.pid_fd};
+    if (!comms_->SendInt32(reply.init_pid)) {
+      SAPI_RAW_LOG(FATAL, "Failed to send init PID: %d", reply.init_pid);
+    }
+    if (!comms_->SendInt32(reply.sandboxee_pid)) {
+      SAPI_RAW_LOG(FATAL, "Failed to send sandboxee PID: %d",
+                   reply.sandboxee_pid);
+    }
+    int32_t reply_flags = 0;
+    if (reply.pid_fd != -1) {
+      reply_flags |= kReplyHasPidFd;
+    }
+    if (reply.in_cgroup) {
+      reply_flags |= kReplyInCgroup;
+    }
+    if (!comms_->SendInt32(reply_flags)) {
+      SAPI_RAW_LOG(FATAL, "Failed to send reply flags");
+    }
+    if (reply.pid_fd != -1 && !comms_->SendFD(reply.pid_fd)) {
+      SAPI_RAW_LOG(FATAL, "Failed to send the pidfd of PID %d",
+                   reply.sandboxee_pid);
+    }
+  }
+
+  // Refill the pool only now, so that the requester does not wait for it.
+  if (!RefillPool(fork_request)) {
+    // A parked child which received a FORKSERVER_FORK request.
+    *pid = 0;
+    return true;
+  }
+  *pid = replies.back().sandboxee_pid;
+  return true;
+}
+
+void ForkServer::RejectRequest(const std::vector<int>& comms_fds, int exec_fd,
+                               int user_ns_fd, int cgroup_fd) {
+  for (int fd : comms_fds) {
+    close(fd);
+  }
+  for (int fd : {exec_fd, user_ns_fd, cgroup_fd}) {
+    if (fd >= 0) {
+      close(fd);
     }
   }
+  // The ForkClient reports the failed launch of each child.
+  for (size_t i = 0; i < comms_fds.size(); ++i) {
+    if (!comms_->SendInt32(0) || !comms_->SendInt32(-1) ||
+        !comms_->SendInt32(0)) {
+      SAPI_RAW_LOG(FATAL, "Failed to reject the fork request");
+    }
+  }
+}
+
+pid_t ForkServer::ForkChild(const ForkRequest& fork_request, int exec_fd,
+                            int comms_fd, int user_ns_fd, int cgroup_fd,
+                            pid_t* init_pid, int* pid_fd, bool* in_cgroup) {
+  int clone_flags = GetCloneFlags(fork_request);
 
+  // Store uid and gid since they will change if CLONE_NEWUSER is set.
+  uid_t uid = getuid();
+  uid_t gid = getgid();
+
+  int socketpair_fds[2];
+  if (!CreateSignalingSocketPair(socketpair_fds)) {
+    SAPI_RAW_LOG(FATAL, "Could not create the signaling socketpair");
+  }
   file_util::fileops::FDCloser fd_closer0{socketpair_fds[0]};
   file_util::fileops::FDCloser fd_closer1{socketpair_fds[1]};
+  file_util::fileops::FDCloser net_ns{TakeNetworkNamespace(fork_request)};
 
-  pid_t sandboxee_pid = util::ForkWithFlags(clone_flags);
-  // Note: init_pid will be overwritten with the actual init pid if the init
-  //       process was started or stays at 0 if that is not needed (custom
-  //       forkserver).
-  pid_t init_pid = 0;
-  if (sandboxee_pid == -1) {
-    SAPI_RAW_LOG(ERROR, "util::ForkWithFlags(%x)", clone_flags);
+  // Starting the child in its cgroup saves moving it there afterwards. With a
+  // PID namespace, the sandboxee inherits the cgroup from the init process.
+  pid_t child = util::ForkWithPidFd(clone_flags, cgroup_fd, pid_fd, in_cgroup);
+  if (child == -1) {
+    SAPI_RAW_LOG(ERROR, "util::ForkWithPidFd(%x)", clone_flags);
+    return -1;
   }
 
   // Child.
-  if (sandboxee_pid == 0) {
+  if (child == 0) {
+    GetSandboxeeStartupTimes()->clone = MonotonicNanos();
+    if (cgroup_fd >= 0) {
+      close(cgroup_fd);
+    }
+    // The other children of the batch have their own copies.
+    for (int fd : batch_comms_fds_) {
+      if (fd != comms_fd) {
+        close(fd);
+      }
+    }
+    PrepareChild(fork_request, fd_closer1.get(), net_ns.Release());
     LaunchChild(fork_request, exec_fd, comms_fd, uid, gid, user_ns_fd,
                 fd_closer1.get());
-    return sandboxee_pid;
+    return 0;
   }
 
   fd_closer1.Close();
 
-  if (fork_request.clone_flags() & CLONE_NEWPID) {
-    // The pid of the init process is equal to the child process that we've
-    // previously forked.
-    init_pid = sandboxee_pid;
-    sandboxee_pid = -1;
-    // And the actual sandboxee is forked from the init process, so we need to
-    // receive the actual PID.
-    auto pid_or = ReceivePid(fd_closer0.get());
-    if (!pid_or.ok()) {
-      SAPI_RAW_LOG(ERROR, "%s", pid_or.status().message());
-      kill(init_pid, SIGKILL);
-      init_pid = -1;
-    } else {
-      sandboxee_pid = pid_or.ValueOrDie();
+  pid_t sandboxee_pid;
+  if (!ReceiveChildPids(fork_request, child, fd_closer0.get(), init_pid,
+                        &sandboxee_pid, pid_fd)) {
+    *init_pid = -1;
+    return -1;
+  }
+  return sandboxee_pid;
+}
+
+int ForkServer::GetCloneFlags(const ForkRequest& request) {
+  // Make the kernel notify us with SIGCHLD when the process terminates.
+  // We use sigaction(SIGCHLD, flags=SA_NOCLDWAIT) in combination with
+  // this to make sure the zombie process is reaped immediately.
+  if (request.join_namespace_template()) {
+    // The namespaces are joined or created after the fork, see PrepareChild().
+    return SIGCHLD;
+  }
+  return request.clone_flags() | SIGCHLD;
+}
+
+void ForkServer::PrepareChild(const ForkRequest& request, int signaling_fd,
+                              int net_ns_fd) {
+  ClosePoolFds();
+  CloseNetworkNamespacePool();
+  if (!request.join_namespace_template()) {
+    CloseNamespaceTemplate();
+    return;
+  }
+
+  SAPI_RAW_PCHECK(setns(template_user_ns_fd_, CLONE_NEWUSER) == 0,
+                  "Could not join the template user namespace");
+  if (!request.use_network_namespace_pool()) {
+    SAPI_RAW_PCHECK(setns(template_net_ns_fd_, CLONE_NEWNET) == 0,
+                    "Could not join the template network namespace");
+  } else if (net_ns_fd >= 0) {
+    SAPI_RAW_PCHECK(setns(net_ns_fd, CLONE_NEWNET) == 0,
+                    "Could not join a pooled network namespace");
+    close(net_ns_fd);
+  } else {
+    // The pool ran dry.
+    Namespace::CreateNetworkNamespace();
+  }
+  // The new mount namespace is then a copy of the template's, which contains
+  // the prebuilt root.
+  if (!request.prebuilt_root().empty()) {
+    SAPI_RAW_PCHECK(setns(template_mnt_ns_fd_, CLONE_NEWNS) == 0,
+                    "Could not join the template mount namespace");
+  }
+  CloseNamespaceTemplate();
+  SAPI_RAW_PCHECK(unshare(request.clone_flags() & (CLONE_NEWNS | CLONE_NEWUTS |
+                                                   CLONE_NEWIPC |
+                                                   CLONE_NEWPID)) == 0,
+                  "Could not create new namespaces");
+
+  // Only the children of this process are in the new PID namespace, so the
+  // child continues as its first process.
+  pid_t child = fork();
+  if (child < 0) {
+    SAPI_RAW_PLOG(FATAL, "Could not fork into the new namespaces");
+  }
+  if (child != 0) {
+    _exit(0);
+  }
+  auto status = SendPid(signaling_fd);
+  if (!status.ok()) {
+    SAPI_RAW_LOG(FATAL, "%s", status.message());
+  }
+}
+
+bool ForkServer::CanJoinNamespaceTemplate(const ForkRequest& request) {
+  constexpr int32_t kRequiredFlags =
+      CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWPID;
+  return request.mode() != FORKSERVER_FORK_JOIN_SANDBOX_UNWIND &&
+         (request.clone_flags() & kRequiredFlags) == kRequiredFlags;
+}
+
+bool ForkServer::CreateNamespaceTemplate() {
+  if (template_user_ns_fd_ != -1) {
+    return true;
+  }
+  if (template_failed_) {
+    return false;
+  }
+  // Only try once, the namespaces are created per sandboxee otherwise.
+  template_failed_ = true;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    SAPI_RAW_PLOG(ERROR, "socketpair()");
+    return false;
+  }
+  file_util::fileops::FDCloser fd_closer0{sv[0]};
+  file_util::fileops::FDCloser fd_closer1{sv[1]};
+
+  uid_t uid = getuid();
+  uid_t gid = getgid();
+  pid_t pid = util::ForkWithFlags(CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWNS |
+                                  SIGCHLD);
+  if (pid == -1) {
+    SAPI_RAW_LOG(ERROR, "Could not create the namespace template");
+    return false;
+  }
+
+  // Child: set up the namespaces, and keep them alive until the ForkServer
+  // has opened them.
+  if (pid == 0) {
+    ClosePoolFds();
+    fd_closer0.Close();
+    Namespace::InitializeNamespaceTemplate(uid, gid);
+    char ready = ' ';
+    if (TEMP_FAILURE_RETRY(write(fd_closer1.get(), &ready, 1)) == 1) {
+      TEMP_FAILURE_RETRY(read(fd_closer1.get(), &ready, 1));
     }
+    _exit(0);
   }
 
-  // Parent.
-  close(comms_fd);
-  if (exec_fd >= 0) {
-    close(exec_fd);
+  fd_closer1.Close();
+  char ready;
+  if (TEMP_FAILURE_RETRY(read(fd_closer0.get(), &ready, 1)) != 1) {
+    SAPI_RAW_LOG(ERROR, "Setting up the namespace template failed");
+    return false;
   }
-  if (user_ns_fd >= 0) {
-    close(user_ns_fd);
+  // The open fds keep the namespaces alive after the child exits, which it
+  // does once fd_closer0 is closed.
+  template_user_ns_fd_ = open(absl::StrCat("/proc/", pid, "/ns/user").c_str(),
+                              O_RDONLY | O_CLOEXEC);
+  template_net_ns_fd_ = open(absl::StrCat("/proc/", pid, "/ns/net").c_str(),
+                             O_RDONLY | O_CLOEXEC);
+  template_mnt_ns_fd_ = open(absl::StrCat("/proc/", pid, "/ns/mnt").c_str(),
+                             O_RDONLY | O_CLOEXEC);
+  if (template_user_ns_fd_ == -1 || template_net_ns_fd_ == -1 ||
+      template_mnt_ns_fd_ == -1) {
+    SAPI_RAW_PLOG(ERROR, "Opening the namespace template failed");
+    CloseNamespaceTemplate();
+    return false;
   }
-  if (!comms_->SendInt32(init_pid)) {
-    SAPI_RAW_LOG(FATAL, "Failed to send init PID: %d", init_pid);
+  template_failed_ = false;
+  return true;
+}
+
+void ForkServer::CloseNamespaceTemplate() {
+  if (template_user_ns_fd_ != -1) {
+    close(template_user_ns_fd_);
+    template_user_ns_fd_ = -1;
   }
-  if (!comms_->SendInt32(sandboxee_pid)) {
-    SAPI_RAW_LOG(FATAL, "Failed to send sandboxee PID: %d", sandboxee_pid);
+  if (template_net_ns_fd_ != -1) {
+    close(template_net_ns_fd_);
+    template_net_ns_fd_ = -1;
   }
+  if (template_mnt_ns_fd_ != -1) {
+    close(template_mnt_ns_fd_);
+    template_mnt_ns_fd_ = -1;
+  }
+}
 
-  return sandboxee_pid;
+int ForkServer::TakeNetworkNamespace(const ForkRequest& request) {
+  if (!request.join_namespace_template() ||
+      !request.use_network_namespace_pool() || !StartNetworkNamespaceKeeper()) {
+    return -1;
+  }
+  // Collect the namespaces the keeper created since the last request.
+  struct pollfd pfd = {net_ns_keeper_->GetConnectionFD(), POLLIN, 0};
+  while (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) == 1) {
+    int fd;
+    if (!(pfd.revents & POLLIN) || !net_ns_keeper_->RecvFD(&fd)) {
+      SAPI_RAW_LOG(WARNING, "The network namespace keeper is gone");
+      net_ns_keeper_.reset();
+      break;
+    }
+    net_ns_pool_.push_back(fd);
+  }
+  if (net_ns_pool_.empty()) {
+    return -1;
+  }
+  int fd = net_ns_pool_.front();
+  net_ns_pool_.pop_front();
+  if (net_ns_keeper_ && !net_ns_keeper_->SendUint32(1)) {
+    net_ns_keeper_.reset();
+  }
+  return fd;
+}
+
+bool ForkServer::StartNetworkNamespaceKeeper() {
+  if (net_ns_keeper_) {
+    return true;
+  }
+  if (net_ns_keeper_failed_ || !CreateNamespaceTemplate()) {
+    return false;
+  }
+  // Only try once, or again after the keeper died.
+  net_ns_keeper_failed_ = true;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    SAPI_RAW_PLOG(ERROR, "socketpair()");
+    return false;
+  }
+  file_util::fileops::FDCloser fd_closer0{sv[0]};
+  file_util::fileops::FDCloser fd_closer1{sv[1]};
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    SAPI_RAW_PLOG(ERROR, "Could not fork the network namespace keeper");
+    return false;
+  }
+
+  // Child: joins the template's user namespace, which then owns the network
+  // namespaces it creates.
+  if (pid == 0) {
+    ClosePoolFds();
+    CloseNetworkNamespacePool();
+    fd_closer0.Close();
+    SAPI_RAW_PCHECK(setns(template_user_ns_fd_, CLONE_NEWUSER) == 0,
+                    "Could not join the template user namespace");
+    CloseNamespaceTemplate();
+    RunNetworkNamespaceKeeper(fd_closer1.Release());
+    _exit(0);
+  }
+
+  fd_closer1.Close();
+  net_ns_keeper_ = absl::make_unique<Comms>(fd_closer0.Release());
+  if (!net_ns_keeper_->SendUint32(kNetworkNamespacePoolSize)) {
+    net_ns_keeper_.reset();
+    return false;
+  }
+  net_ns_keeper_failed_ = false;
+  return true;
+}
+
+void ForkServer::RunNetworkNamespaceKeeper(int fd) {
+  Comms comms(fd);
+  uint32_t count;
+  // Exits once the ForkServer closes its end.
+  while (comms.RecvUint32(&count)) {
+    for (uint32_t i = 0; i < count; ++i) {
+      Namespace::CreateNetworkNamespace();
+      file_util::fileops::FDCloser net_ns{
+          open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)};
+      SAPI_RAW_PCHECK(net_ns.get() != -1,
+                      "Could not open the network namespace");
+      if (!comms.SendFD(net_ns.get())) {
+        return;
+      }
+    }
+  }
+}
+
+void ForkServer::CloseNetworkNamespacePool() {
+  for (int fd : net_ns_pool_) {
+    close(fd);
+  }
+  net_ns_pool_.clear();
+  net_ns_keeper_.reset();
+}
+
+bool ForkServer::ApplyTemplate(ForkRequest* request) {
+  if (request->template_id() == 0) {
+    return true;
+  }
+  auto it = templates_.find(request->template_id());
+  if (request->has_mount_tree()) {
+    // Same condition as in ForkClient::SendRequestLocked().
+    if (it == templates_.end() && templates_.size() < kMaxTemplates) {
+      auto request_template = absl::make_unique<ForkRequest>();
+      *request_template->mutable_mount_tree() = request->mount_tree();
+      request_template->set_hostname(request->hostname());
+      templates_.emplace(request->template_id(), std::move(request_template));
+    }
+    return true;
+  }
+  if (it == templates_.end()) {
+    return false;
+  }
+  *request->mutable_mount_tree() = it->second->mount_tree();
+  request->set_hostname(it->second->hostname());
+  return true;
+}
+
+std::string ForkServer::GetPrebuiltRoot(const MountTree& tree) {
+  if (!Namespace::CanPrebuildMountTree(tree)) {
+    return "";
+  }
+  std::string key = SerializeDeterministically(tree);
+  auto it = prebuilt_roots_.find(key);
+  if (it != prebuilt_roots_.end()) {
+    return it->second;
+  }
+  if (prebuilt_roots_.size() >= kMaxPrebuiltRoots) {
+    return "";
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    SAPI_RAW_PLOG(ERROR, "socketpair()");
+    return "";
+  }
+  file_util::fileops::FDCloser fd_closer0{sv[0]};
+  file_util::fileops::FDCloser fd_closer1{sv[1]};
+
+  std::string root = Namespace::GetPrebuiltRoot(prebuilt_roots_.size());
+  pid_t pid = fork();
+  if (pid == -1) {
+    SAPI_RAW_PLOG(ERROR, "Could not fork to prebuild a mount tree");
+    return "";
+  }
+
+  // Child: create the mounts in the namespace template.
+  if (pid == 0) {
+    ClosePoolFds();
+    fd_closer0.Close();
+    SAPI_RAW_PCHECK(setns(template_user_ns_fd_, CLONE_NEWUSER) == 0,
+                    "Could not join the template user namespace");
+    SAPI_RAW_PCHECK(setns(template_mnt_ns_fd_, CLONE_NEWNS) == 0,
+                    "Could not join the template mount namespace");
+    char done = ' ';
+    if (Namespace::PrebuildMountTree(Mounts(tree), root)) {
+      TEMP_FAILURE_RETRY(write(fd_closer1.get(), &done, 1));
+    }
+    _exit(0);
+  }
+
+  fd_closer1.Close();
+  char done;
+  if (TEMP_FAILURE_RETRY(read(fd_closer0.get(), &done, 1)) != 1) {
+    SAPI_RAW_LOG(WARNING, "Prebuilding a mount tree failed");
+    // Not retried, the sandboxees create their mounts themselves.
+    root.clear();
+  }
+  prebuilt_roots_.emplace(std::move(key), root);
+  return root;
 }
 
 bool ForkServer::Initialize() {
@@ -557,6 +1790,10 @@ void ForkServer::InitializeNamespaces(const ForkRequest& request, uid_t uid,
     return;
   }
   int32_t clone_flags = request.clone_flags();
+  if (request.join_namespace_template()) {
+    // The ID maps have been written when the template was created.
+    clone_flags &= ~CLONE_NEWUSER;
+  }
   if (request.mode() == FORKSERVER_FORK_JOIN_SANDBOX_UNWIND) {
     clone_flags = CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC;
     SAPI_RAW_PCHECK(!unshare(clone_flags),
@@ -565,7 +1802,7 @@ void ForkServer::InitializeNamespaces(const ForkRequest& request, uid_t uid,
   Namespace::InitializeNamespaces(
       uid, gid, clone_flags, Mounts(request.mount_tree()),
       request.mode() != FORKSERVER_FORK_JOIN_SANDBOX_UNWIND,
-      request.hostname());
+      request.hostname(), request.prebuilt_root());
 }
 
 }  // namespace sandbox2
@@ -20,16 +20,25 @@
 
 #include <sys/types.h>
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <glog/logging.h>
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/synchronization/mutex.h"
 
 namespace sandbox2 {
 
 class Comms;
 class ForkRequest;
+class MountTree;
 
 // Envvar indicating that this process should not start the fork-server.
 static constexpr const char* kForkServerDisableEnv = "SANDBOX2_NOFORKSERVER";
@@ -41,15 +50,142 @@ class ForkClient {
 
   explicit ForkClient(Comms* comms) : comms_(comms) {}
 
+  // Closes the pidfds of the children counted towards
+  // AdmissionLimits.max_children.
+  ~ForkClient();
+
+  // Bounds the requests waiting for the channel and the sandboxees running at
+  // the same time. Requests over the limits are rejected or wait, so that an
+  // overload does not turn into a fork storm on the host.
+  struct AdmissionLimits {
+    // Requests which may wait while another one is sent. When a request
+    // arrives at a full queue, the one with the lowest ForkRequest.priority,
+    // the latest of them if several have it, is shed: it fails right away
+    // instead of waiting. A request never sheds one with the same or a
+    // higher priority. 0 means no limit.
+    int max_queued_requests = 0;
+    // Children started through this client which may run at the same time.
+    // Requests wait for one of them to exit at this limit. Children are only
+    // counted where the kernel hands out pidfds (Linux 5.3), and only those
+    // started after the limit was set. 0 means no limit.
+    int max_children = 0;
+  };
+
+  void SetAdmissionLimits(const AdmissionLimits& limits)
+      LOCKS_EXCLUDED(admission_mutex_);
+
   // Sends the fork request over the supplied Comms channel.
+  //
+  // If ForkRequest.into_cgroup is set, the sandboxee is started in the cgroup
+  // v2 directory 'cgroup_fd' if possible, and 'in_cgroup' is set to whether it
+  // was. 'pid_fd' receives a pidfd of the sandboxee, or -1 if the kernel does
+  // not support them.
+  //
+  // Requests waiting for the channel are sent in the order of their
+  // ForkRequest.priority, highest first. 'shed' is set to whether the request
+  // failed because it was shed, see AdmissionLimits.
   pid_t SendRequest(const ForkRequest& request, int exec_fd, int comms_fd,
-                    int user_ns_fd = -1, pid_t* init_pid = nullptr);
+                    int user_ns_fd = -1, pid_t* init_pid = nullptr,
+                    int cgroup_fd = -1, int* pid_fd = nullptr,
+                    bool* in_cgroup = nullptr, bool* shed = nullptr)
+      LOCKS_EXCLUDED(admission_mutex_);
+
+  // Starts comms_fds.size() children from 'request' in one exchange with the
+  // ForkServer, which forks them in a row. Child i talks over comms_fds[i],
+  // all of them execute 'exec_fd' and start in the cgroup 'cgroup_fd'. At most
+  // ForkServer::kMaxBatchSize children can be batched, and not for
+  // FORKSERVER_FORK_JOIN_SANDBOX_UNWIND. ForkRequest.batch_size is set here.
+  //
+  // Returns the PIDs of the sandboxees, -1 for those which could not be
+  // started. 'init_pids' and 'pid_fds' receive the init PIDs and the pidfds
+  // in the same order. The batch counts as one request towards
+  // AdmissionLimits.max_queued_requests.
+  std::vector<pid_t> SendRequests(const ForkRequest& request, int exec_fd,
+                                  const std::vector<int>& comms_fds,
+                                  int cgroup_fd = -1,
+                                  std::vector<pid_t>* init_pids = nullptr,
+                                  std::vector<int>* pid_fds = nullptr,
+                                  bool* shed = nullptr)
+      LOCKS_EXCLUDED(admission_mutex_);
+
+  // Returns the number of requests which are being sent or wait for the
+  // channel, used to balance requests over several ForkServers.
+  int GetNumPendingRequests() const {
+    return pending_requests_.load(std::memory_order_relaxed);
+  }
+
+  // Returns whether the ForkServer already knows the mount tree and hostname
+  // of ForkRequest.template_id 'id', so that requests can leave them out.
+  bool HasTemplate(uint64_t id) const LOCKS_EXCLUDED(templates_mutex_);
 
  private:
+  // The answer of the ForkServer about one child.
+  struct Reply {
+    pid_t init_pid = -1;
+    pid_t pid = -1;
+    int pid_fd = -1;
+    bool in_cgroup = false;
+  };
+
+  // A request waiting for its turn on the channel.
+  struct Waiter {
+    ForkClient* client;
+    int priority;
+    uint64_t seq;
+    bool shed;
+  };
+
+  // Sends 'request' once admitted, and fills in the replies received for its
+  // children. Returns false if it was shed.
+  bool Send(const ForkRequest& request, int exec_fd,
+            const std::vector<int>& comms_fds, int user_ns_fd, int cgroup_fd,
+            std::vector<Reply>* replies) LOCKS_EXCLUDED(admission_mutex_);
+
+  // Waits until a request for 'num_children' may be sent, returns false if it
+  // was shed.
+  bool Admit(int priority, size_t num_children)
+      LOCKS_EXCLUDED(admission_mutex_);
+
+  // Ends the turn of the admitted request. Counts the started children
+  // towards AdmissionLimits.max_children.
+  void Release(const std::vector<Reply>& replies)
+      LOCKS_EXCLUDED(admission_mutex_);
+
+  // Whether 'waiter' is next, i.e. the channel is free and no other waiter
+  // has a higher priority or the same one and arrived earlier.
+  bool IsNext(const Waiter* waiter) const
+      EXCLUSIVE_LOCKS_REQUIRED(admission_mutex_);
+
+  // Closes the pidfds of exited children, and returns whether 'num_children'
+  // more may be started.
+  bool HasChildSlots(size_t num_children)
+      EXCLUSIVE_LOCKS_REQUIRED(admission_mutex_);
+
+  // Stops at the first reply which cannot be received, 'replies' then has
+  // fewer entries than 'comms_fds'.
+  void SendRequestLocked(const ForkRequest& request, int exec_fd,
+                         const std::vector<int>& comms_fds, int user_ns_fd,
+                         int cgroup_fd, std::vector<Reply>* replies)
+      EXCLUSIVE_LOCKS_REQUIRED(comms_mutex_);
+  bool RecvReply(Reply* reply) EXCLUSIVE_LOCKS_REQUIRED(comms_mutex_);
+
   // Comms channel connecting with the ForkServer. Not owned by the object.
   Comms* comms_;
   // Mutex locking transactions (requests) over the Comms channel.
   absl::Mutex comms_mutex_;
+  std::atomic<int> pending_requests_{0};
+  // Turns on the channel, handed out by priority.
+  absl::Mutex admission_mutex_;
+  AdmissionLimits limits_ GUARDED_BY(admission_mutex_);
+  std::vector<Waiter*> waiters_ GUARDED_BY(admission_mutex_);
+  uint64_t next_waiter_seq_ GUARDED_BY(admission_mutex_) = 0;
+  bool channel_busy_ GUARDED_BY(admission_mutex_) = false;
+  // Pidfds of the children counted towards AdmissionLimits.max_children.
+  std::vector<int> child_pid_fds_ GUARDED_BY(admission_mutex_);
+  // Template ids which have been sent with a mount tree, at most
+  // ForkServer::kMaxTemplates of them like the ForkServer keeps.
+  mutable absl::Mutex templates_mutex_;
+  absl::flat_hash_set<uint64_t> sent_templates_ GUARDED_BY(templates_mutex_);
 };
 
 class ForkServer {
@@ -57,19 +193,163 @@ class ForkServer {
   ForkServer(const ForkServer&) = delete;
   ForkServer& operator=(const ForkServer&) = delete;
 
-  explicit ForkServer(Comms* comms) : comms_(comms) {
-    if (!Initialize()) {
-      LOG(FATAL) << "Could not initialize the ForkServer";
-    }
-  }
+  explicit ForkServer(Comms* comms);
+
+  // Closes the connections to all parked children, which makes them exit, and
+  // releases the namespace template.
+  ~ForkServer();
 
   // Receives a fork request from the master process. The started process does
   // not need to be waited for (with waitid/waitpid/wait3/wait4) as the current
   // process will have the SIGCHLD set to sa_flags=SA_NOCLDWAIT.
-  // Returns values defined as with fork() (-1 means error).
-  pid_t ServeRequest() const;
+  // Returns values defined as with fork() (-1 means error). Requests with an
+  // unknown ForkRequest.template_id are answered with a failed launch, and the
+  // next request is served instead.
+  //
+  // If the request asks for pre-forked children (ForkRequest.prefork), the
+  // request is handed to a child parked with the same fork-time configuration
+  // if there is one, and the pool is refilled after the reply has been sent.
+  //
+  // Requests with a ForkRequest.batch_size start that many children one after
+  // the other, and the replies for all of them are sent at the end.
+  pid_t ServeRequest();
+
+  // Upper limit of ForkRequest.batch_size.
+  static constexpr size_t kMaxBatchSize = 64;
 
  private:
+  friend class ForkClient;
+
+  // Upper limit of ForkRequest.prefork.
+  static constexpr int kMaxPreforkedChildren = 16;
+  // Number of distinct mount trees which are prebuilt at most.
+  static constexpr size_t kMaxPrebuiltRoots = 64;
+  // Number of ForkRequest.template_ids which are remembered, the ForkClient
+  // keeps sending the fields of the others.
+  static constexpr size_t kMaxTemplates = 64;
+  // Number of network namespaces kept ready for requests with
+  // use_network_namespace_pool, including those still being created.
+  static constexpr int kNetworkNamespacePoolSize = 8;
+
+  // Flags sent after the PIDs of a reply. kReplyHasPidFd: a pidfd of the
+  // sandboxee follows. kReplyInCgroup: the sandboxee started in the cgroup of
+  // the request.
+  static constexpr int32_t kReplyHasPidFd = 1 << 0;
+  static constexpr int32_t kReplyInCgroup = 1 << 1;
+
+  // A child which has been forked and had its namespaces set up ahead of a
+  // request, and waits for the request on 'fd'.
+  struct ParkedChild {
+    int fd;
+    pid_t init_pid;
+    pid_t sandboxee_pid;
+    // pidfd of the sandboxee, or -1.
+    int pid_fd;
+  };
+
+  // Body of ServeRequest(). Returns false if the request was rejected, in which
+  // case the next one is served, or stores the value ServeRequest() returns in
+  // 'pid'.
+  bool ServeOneRequest(pid_t* pid);
+
+  // Closes the descriptors of a request which cannot be served and replies to
+  // it with failed launches, i.e. a sandboxee PID of -1.
+  void RejectRequest(const std::vector<int>& comms_fds, int exec_fd,
+                     int user_ns_fd, int cgroup_fd);
+
+  // Returns whether 'request' can be served by a parked child.
+  static bool CanPrefork(const ForkRequest& request);
+
+  // Returns the parts of 'request' that are applied when a child is parked,
+  // i.e. everything but the arguments and the environment.
+  static std::string GetForkTimeConfig(const ForkRequest& request);
+
+  // Hands the request to a parked child, if one is available for its
+  // configuration. Returns false if the request has to be served by a freshly
+  // forked child instead.
+  bool HandToParkedChild(const ForkRequest& request, int exec_fd, int comms_fd,
+                         pid_t* init_pid, pid_t* sandboxee_pid, int* pid_fd);
+
+  // Parks new children until the pool holds as many as 'request' asks for,
+  // discarding children parked for a different configuration. Requests which
+  // do not ask for pre-forked children leave the pool alone. Returns false in
+  // a parked child which received a FORKSERVER_FORK request, which then has to
+  // return from ServeRequest().
+  bool RefillPool(const ForkRequest& request);
+
+  // Forks a child which sets up the fork-time configuration of 'request' and
+  // then waits for its request. Returns values defined as with fork().
+  pid_t ParkChild(const ForkRequest& request, ParkedChild* parked);
+
+  // Forks and launches a new child for the request, in the cgroup 'cgroup_fd'
+  // if it is not -1 and the kernel supports it. Sets 'pid_fd' to a pidfd of
+  // the sandboxee or -1, and 'in_cgroup' to whether it started in the cgroup.
+  // Returns values defined as with fork().
+  pid_t ForkChild(const ForkRequest& request, int exec_fd, int comms_fd,
+                  int user_ns_fd, int cgroup_fd, pid_t* init_pid, int* pid_fd,
+                  bool* in_cgroup);
+
+  // Returns the flags to fork a child for 'request' with.
+  static int GetCloneFlags(const ForkRequest& request);
+
+  // Called first in every new child. Closes the file descriptors of the
+  // ForkServer, and joins the namespace template if requested. In the latter
+  // case, the child forks again into the new PID namespace and sends the PID of
+  // that process over 'signaling_fd'. 'net_ns_fd' is the network namespace
+  // from TakeNetworkNamespace() to join, which is closed.
+  void PrepareChild(const ForkRequest& request, int signaling_fd,
+                    int net_ns_fd);
+
+  // Returns whether 'request' creates the namespaces the template provides.
+  static bool CanJoinNamespaceTemplate(const ForkRequest& request);
+
+  // Creates the user and network namespace which requests with
+  // join_namespace_template set share, unless that has been done already.
+  // Returns false if the template is not available.
+  bool CreateNamespaceTemplate();
+
+  // Closes the file descriptors keeping the namespace template alive.
+  void CloseNamespaceTemplate();
+
+  // Returns a network namespace for a child serving 'request' from the pool,
+  // and asks for a replacement. Returns -1 if the request does not use the
+  // pool, or if the pool is empty, the child then creates the namespace
+  // itself.
+  int TakeNetworkNamespace(const ForkRequest& request);
+
+  // Starts the process filling the pool of network namespaces, unless that has
+  // been done already. Returns false if the pool is not available.
+  bool StartNetworkNamespaceKeeper();
+
+  // Body of the process filling the pool, which lives in the user namespace
+  // of the template. Creates a network namespace for every one requested on
+  // 'fd' and sends it back.
+  static void RunNetworkNamespaceKeeper(int fd);
+
+  // Closes the pooled network namespaces and the connection to the keeper.
+  // Also called in every new child.
+  void CloseNetworkNamespacePool();
+
+  // Returns the directory in the namespace template which holds the mounts of
+  // 'tree', which is built on first use. Returns an empty string if the tree
+  // cannot be prebuilt.
+  std::string GetPrebuiltRoot(const MountTree& tree);
+
+  // Fills in the mount tree and hostname of 'request' if its ForkClient left
+  // them out, or remembers them for its template_id. Returns false if the
+  // template_id is unknown.
+  bool ApplyTemplate(ForkRequest* request);
+
+  // Body of a parked child, returns once it received a FORKSERVER_FORK
+  // request, otherwise execve()s or exits.
+  static void RunParkedChild(const ForkRequest& config, int park_fd,
+                             uid_t uid, gid_t gid, int signaling_fd);
+
+  // Closes the parent ends of the connections to the parked children. Also
+  // called in every new child, so that sandboxees cannot reach parked
+  // children.
+  void ClosePoolFds();
+
   // Analyzes the PB received, and execute the process. If kept_fds is
   // non-nullptr, it specifies a list of file descriptors to be kept open after
   // sanitization call is done, the remaining file descriptors will be closed.
@@ -77,6 +357,18 @@ class ForkServer {
                           int client_fd, uid_t uid, gid_t gid, int user_ns_fd,
                           int signaling_fd);
 
+  // Sets up namespaces and capabilities for a new child, and spawns the init
+  // process if a new PID namespace is created. 'open_fds' are closed by the
+  // init process, which closes all of them with close_range(2) if available.
+  static void SetUpChild(const ForkRequest& request, uid_t uid, gid_t gid,
+                         int signaling_fd, const std::set<int>& open_fds);
+
+  // Enables sandboxing and executes the sandboxee, as requested. Returns only
+  // for FORKSERVER_FORK requests.
+  static void FinishChild(const ForkRequest& request, int execve_fd,
+                          std::vector<std::string>* args,
+                          std::vector<std::string>* envs);
+
   // Prepares the Fork-Server (worker side, not the requester side) for work by
   // sanitizing the environment:
   // - go down if the parent goes down,
@@ -103,6 +395,36 @@ class ForkServer {
   // Comms channel which is used to send requests to this class. Not owned by
   // the object.
   Comms* comms_;
+
+  // Children parked for the configuration in pool_config_.
+  std::deque<ParkedChild> pool_;
+  std::string pool_config_;
+
+  // Directories of the prebuilt mount trees in the namespace template, by the
+  // serialized MountTree. Empty if prebuilding the tree failed.
+  absl::flat_hash_map<std::string, std::string> prebuilt_roots_;
+
+  // Requests holding only the mount_tree, hostname and, once known, the
+  // prebuilt_root of each ForkRequest.template_id.
+  absl::flat_hash_map<uint64_t, std::unique_ptr<ForkRequest>> templates_;
+
+  // Pin the user, network and mount namespace of the namespace template.
+  int template_user_ns_fd_ = -1;
+  int template_net_ns_fd_ = -1;
+  int template_mnt_ns_fd_ = -1;
+  // Whether creating the namespace template failed, it is not retried.
+  bool template_failed_ = false;
+  // Comms FDs of the batch of children being started, each child closes
+  // those of the others.
+  std::vector<int> batch_comms_fds_;
+
+  // Network namespaces with the loopback interface up, owned by the user
+  // namespace of the template.
+  std::deque<int> net_ns_pool_;
+  // Connection to the process filling net_ns_pool_.
+  std::unique_ptr<Comms> net_ns_keeper_;
+  // Whether starting the keeper failed, it is not retried.
+  bool net_ns_keeper_failed_ = false;
 };
 
 }  // namespace sandbox2
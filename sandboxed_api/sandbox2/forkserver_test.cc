@@ -18,15 +18,23 @@
 #include <sys/socket.h>
 #include <syscall.h>
 #include <unistd.h>
+#include <set>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include "gtest/gtest.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/forkserver.pb.h"
 #include "sandboxed_api/sandbox2/global_forkclient.h"
 #include "sandboxed_api/sandbox2/ipc.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/testing.h"
 
 namespace sandbox2 {
@@ -46,7 +54,8 @@ int GetMinimalTestcaseFd() {
   return open(path.c_str(), O_RDONLY);
 }
 
-pid_t TestSingleRequest(Mode mode, int exec_fd, int userns_fd) {
+pid_t TestSingleRequest(Mode mode, int exec_fd, int userns_fd,
+                        int prefork = 0) {
   ForkRequest fork_req;
   IPC ipc;
   int sv[2];
@@ -57,6 +66,7 @@ pid_t TestSingleRequest(Mode mode, int exec_fd, int userns_fd) {
   fork_req.set_mode(mode);
   fork_req.add_args("/binary");
   fork_req.add_envs("FOO=1");
+  fork_req.set_prefork(prefork);
 
   pid_t pid =
       GetGlobalForkClient()->SendRequest(fork_req, exec_fd, sv[0], userns_fd);
@@ -119,4 +129,145 @@ TEST(ForkserverTest, ForkExecveSandboxRequiresExecFD) {
   ASSERT_EQ(TestSingleRequest(FORKSERVER_FORK_EXECVE_SANDBOX, -1, -1), -1);
 }
 
+TEST(ForkserverTest, ForkExecvePreforked) {
+  // The first request parks children, the following ones are handed to them.
+  for (int i = 0; i < 4; ++i) {
+    int exec_fd = GetMinimalTestcaseFd();
+    PCHECK(exec_fd != -1) << "Could not open test binary";
+    ASSERT_NE(TestSingleRequest(FORKSERVER_FORK_EXECVE, exec_fd, -1,
+                                /*prefork=*/2),
+              -1);
+  }
+}
+
+TEST(ForkserverTest, NamespaceTemplateIsSentOnce) {
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::shared_ptr<Policy> policy = PolicyBuilder()
+                                       // Don't restrict the syscalls at all.
+                                       .DangerDefaultAllowAll()
+                                       .AddFile(path)
+                                       .BuildOrDie();
+  // The later sandboxees get the mount tree of the first one's request.
+  std::vector<std::string> args = {path};
+  for (int i = 0; i < 3; ++i) {
+    Sandbox2 s2(absl::make_unique<Executor>(path, args), policy);
+    Result result = s2.Run();
+    EXPECT_EQ(result.final_status(), Result::OK);
+    EXPECT_EQ(result.reason_code(), 0);
+  }
+}
+
+TEST(ForkserverTest, UnknownTemplateIsRejected) {
+  ForkRequest fork_req;
+  fork_req.set_mode(FORKSERVER_FORK);
+  fork_req.add_args("/binary");
+  // Neither sent before nor carrying a mount tree.
+  fork_req.set_template_id(~uint64_t{0});
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != -1);
+  EXPECT_EQ(GetGlobalForkClient()->SendRequest(fork_req, -1, sv[1]), -1);
+  close(sv[0]);
+  close(sv[1]);
+  // The ForkServer keeps serving requests.
+  ASSERT_NE(TestSingleRequest(FORKSERVER_FORK, -1, -1), -1);
+}
+
+TEST(ForkserverTest, SimpleForkBatch) {
+  constexpr size_t kNumChildren = 4;
+  std::vector<int> client_fds;
+  std::vector<int> sandboxee_fds;
+  for (size_t i = 0; i < kNumChildren; ++i) {
+    int sv[2];
+    PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != -1);
+    client_fds.push_back(sv[0]);
+    sandboxee_fds.push_back(sv[1]);
+  }
+  ForkRequest fork_req;
+  fork_req.set_mode(FORKSERVER_FORK);
+  fork_req.add_args("/binary");
+
+  std::vector<pid_t> pids =
+      GetGlobalForkClient()->SendRequests(fork_req, -1, sandboxee_fds);
+  ASSERT_EQ(pids.size(), kNumChildren);
+  std::set<pid_t> distinct_pids(pids.begin(), pids.end());
+  EXPECT_EQ(distinct_pids.size(), kNumChildren);
+  EXPECT_EQ(distinct_pids.count(-1), 0u);
+
+  for (int fd : sandboxee_fds) {
+    close(fd);
+  }
+  // The children exit right away, closing their ends.
+  for (int fd : client_fds) {
+    char c;
+    EXPECT_EQ(TEMP_FAILURE_RETRY(read(fd, &c, 1)), 0);
+    close(fd);
+  }
+}
+
+// Receives a FORKSERVER_FORK request on 'comms' like a ForkServer does, and
+// returns its first argument.
+std::string RecvFakeForkRequest(Comms* comms) {
+  ForkRequest request;
+  int comms_fd = -1;
+  CHECK(comms->RecvProtoBuf(&request));
+  CHECK(comms->RecvFD(&comms_fd));
+  close(comms_fd);
+  return request.args(0);
+}
+
+// Answers the request with a made-up PID and no pidfd.
+void SendFakeForkReply(Comms* comms, pid_t pid) {
+  CHECK(comms->SendInt32(0));
+  CHECK(comms->SendInt32(pid));
+  CHECK(comms->SendInt32(0));
+}
+
+TEST(ForkClientTest, ShedsLowestPriorityRequest) {
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != -1);
+  Comms client_comms(sv[0]);
+  Comms server_comms(sv[1]);
+  ForkClient client(&client_comms);
+  ForkClient::AdmissionLimits limits;
+  limits.max_queued_requests = 1;
+  client.SetAdmissionLimits(limits);
+
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  PCHECK(null_fd != -1);
+  auto send = [&client, null_fd](const std::string& name, int priority,
+                                 pid_t* pid, bool* shed) {
+    ForkRequest request;
+    request.set_mode(FORKSERVER_FORK);
+    request.set_priority(priority);
+    request.add_args(name);
+    *pid = client.SendRequest(request, -1, null_fd, -1, nullptr, -1, nullptr,
+                              nullptr, shed);
+  };
+
+  pid_t first_pid, low_pid, high_pid;
+  bool first_shed, low_shed, high_shed;
+  std::thread first(send, "first", 0, &first_pid, &first_shed);
+  // The first request keeps the channel until it is answered.
+  ASSERT_EQ(RecvFakeForkRequest(&server_comms), "first");
+  // Either the high priority request sheds the low priority one from the
+  // queue, or the latter finds the queue full when it arrives.
+  std::thread low(send, "low", 0, &low_pid, &low_shed);
+  std::thread high(send, "high", 1, &high_pid, &high_shed);
+  low.join();
+  EXPECT_EQ(low_pid, -1);
+  EXPECT_TRUE(low_shed);
+
+  SendFakeForkReply(&server_comms, 100);
+  first.join();
+  EXPECT_EQ(first_pid, 100);
+  EXPECT_FALSE(first_shed);
+
+  ASSERT_EQ(RecvFakeForkRequest(&server_comms), "high");
+  SendFakeForkReply(&server_comms, 101);
+  high.join();
+  EXPECT_EQ(high_pid, 101);
+  EXPECT_FALSE(high_shed);
+  close(null_fd);
+}
+
 }  // namespace sandbox2
@@ -17,61 +17,183 @@
 #include "sandboxed_api/sandbox2/global_forkclient.h"
 
 #include <fcntl.h>
+#include <sched.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "sandboxed_api/embed_file.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkserver.h"
 #include "sandboxed_api/sandbox2/forkserver_bin_embed.h"
 #include "sandboxed_api/sandbox2/sanitizer.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/raw_logging.h"
 
 namespace sandbox2 {
 
-// Global ForkClient object linking with the global ForkServer.
-static ForkClient* global_fork_client = nullptr;
-static pid_t global_fork_server_pid = -1;
+namespace {
 
-ForkClient* GetGlobalForkClient() {
-  SAPI_RAW_CHECK(global_fork_client != nullptr,
-                 "global fork client not initialized");
-  return global_fork_client;
+// A global ForkServer and the ForkClient linking with it.
+struct GlobalForkServer {
+  ForkClient* client;
+  pid_t pid;
+  // NUMA node the fork server runs on, -1 if it is not bound to one.
+  int numa_node;
+};
+
+// Parses a list of CPUs or nodes as found in sysfs, e.g. "0-3,8-11".
+bool ParseSysfsList(const std::string& text, std::vector<int>* out) {
+  for (absl::string_view range :
+       absl::StrSplit(absl::StripAsciiWhitespace(text), ',',
+                      absl::SkipEmpty())) {
+    std::pair<absl::string_view, absl::string_view> bounds =
+        absl::StrSplit(range, absl::MaxSplits('-', 1));
+    int first;
+    int last;
+    if (!absl::SimpleAtoi(bounds.first, &first)) {
+      return false;
+    }
+    if (bounds.second.empty()) {
+      last = first;
+    } else if (!absl::SimpleAtoi(bounds.second, &last) || last < first) {
+      return false;
+    }
+    for (int i = first; i <= last; ++i) {
+      out->push_back(i);
+    }
+  }
+  return true;
 }
 
-pid_t GetGlobalForkServerPid() { return global_fork_server_pid; }
+// Reads the CPUs of each online NUMA node. Returns false if this is not a NUMA
+// system, or if the topology cannot be read.
+bool GetNumaTopology(std::vector<std::pair<int, cpu_set_t>>* nodes) {
+  constexpr char kNodeDir[] = "/sys/devices/system/node/";
+  std::string text;
+  std::vector<int> node_ids;
+  if (!file::GetContents(absl::StrCat(kNodeDir, "online"), &text,
+                         file::Defaults())
+           .ok() ||
+      !ParseSysfsList(text, &node_ids) || node_ids.size() < 2) {
+    return false;
+  }
+  for (int node : node_ids) {
+    std::vector<int> cpus;
+    if (!file::GetContents(absl::StrCat(kNodeDir, "node", node, "/cpulist"),
+                           &text, file::Defaults())
+             .ok() ||
+        !ParseSysfsList(text, &cpus)) {
+      return false;
+    }
+    // Memory-only nodes have no CPUs to run on.
+    if (cpus.empty()) {
+      continue;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &cpu_set);
+      }
+    }
+    nodes->emplace_back(node, cpu_set);
+  }
+  return nodes->size() > 1;
+}
 
-static void StartGlobalForkServer() {
-  SAPI_RAW_CHECK(global_fork_client == nullptr,
-                 "global fork server already initialized");
-  if (getenv(kForkServerDisableEnv)) {
-    SAPI_RAW_VLOG(1,
-                  "Start of the Global Fork-Server prevented by the '%s' "
-                  "environment variable present",
-                  kForkServerDisableEnv);
-    return;
+// Returns the value of kForkServerInstancesEnv, capped at the number of CPUs.
+int GetNumInstancesFromEnv() {
+  const char* value = getenv(kForkServerInstancesEnv);
+  int instances = 1;
+  if (value && !absl::SimpleAtoi(value, &instances)) {
+    SAPI_RAW_LOG(WARNING, "Ignoring invalid %s='%s'", kForkServerInstancesEnv,
+                 value);
+    instances = 1;
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);  // NOLINT(runtime/int)
+  if (num_cpus > 0 && instances > num_cpus) {
+    instances = num_cpus;
   }
+  return std::max(instances, 1);
+}
 
-  sanitizer::WaitForTsan();
+}  // namespace
 
-  // We should be really single-threaded now, as it's the point of the whole
-  // exercise.
-  int num_threads = sanitizer::GetNumberOfThreads(getpid());
-  if (num_threads != 1) {
-    SAPI_RAW_LOG(ERROR,
-                 "BADNESS MAY HAPPEN. ForkServer::Init() created in a "
-                 "multi-threaded context, %d threads present",
-                 num_threads);
+// Global fork servers, never freed. Only written before main().
+static std::vector<GlobalForkServer>* global_fork_servers = nullptr;
+// Rotates the first fork server considered, so that ties are spread evenly.
+static std::atomic<uint32_t> next_global_fork_server{0};
+
+ForkClient* GetGlobalForkClient() {
+  SAPI_RAW_CHECK(global_fork_servers != nullptr,
+                 "global fork client not initialized");
+  const std::vector<GlobalForkServer>& servers = *global_fork_servers;
+  if (servers.size() == 1) {
+    return servers[0].client;
   }
 
+  unsigned int node = 0;
+  bool numa = servers[0].numa_node >= 0 &&
+              syscall(__NR_getcpu, nullptr, &node, nullptr) == 0;
+
+  // Fewer pending requests win, the NUMA node only breaks ties.
+  const size_t start =
+      next_global_fork_server.fetch_add(1, std::memory_order_relaxed);
+  ForkClient* best = nullptr;
+  int best_score = 0;
+  for (size_t i = 0; i < servers.size(); ++i) {
+    const GlobalForkServer& server = servers[(start + i) % servers.size()];
+    int score = 2 * server.client->GetNumPendingRequests();
+    if (numa && server.numa_node != static_cast<int>(node)) {
+      ++score;
+    }
+    if (!best || score < best_score) {
+      best = server.client;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+void SetGlobalForkServerAdmissionLimits(
+    const ForkClient::AdmissionLimits& limits) {
+  SAPI_RAW_CHECK(global_fork_servers != nullptr,
+                 "global fork client not initialized");
+  for (const GlobalForkServer& server : *global_fork_servers) {
+    server.client->SetAdmissionLimits(limits);
+  }
+}
+
+int GetNumGlobalForkServers() {
+  return global_fork_servers ? global_fork_servers->size() : 0;
+}
+
+pid_t GetGlobalForkServerPid() {
+  return global_fork_servers ? (*global_fork_servers)[0].pid : -1;
+}
+
+// Starts a fork server, bound to the CPUs in 'cpu_set' if that is not null.
+static GlobalForkServer StartOneGlobalForkServer(int numa_node,
+                                                 const cpu_set_t* cpu_set) {
   int sv[2];
   SAPI_RAW_CHECK(socketpair(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != -1,
                  "creating socket pair");
@@ -83,9 +205,12 @@ static void StartGlobalForkServer() {
   // Parent.
   if (pid > 0) {
     close(sv[0]);
-    global_fork_client = new ForkClient{new Comms{sv[1]}};
-    global_fork_server_pid = pid;
-    return;
+    return {new ForkClient{new Comms{sv[1]}}, pid, numa_node};
+  }
+
+  // Sandboxees started by this fork server inherit the affinity.
+  if (cpu_set && sched_setaffinity(0, sizeof(*cpu_set), cpu_set) != 0) {
+    SAPI_RAW_PLOG(WARNING, "sched_setaffinity(NUMA node %d)", numa_node);
   }
 
   // Move the comms FD to the proper, expected FD number.
@@ -102,6 +227,50 @@ static void StartGlobalForkServer() {
   char* const envp[] = {nullptr};
   syscall(__NR_execveat, exec_fd, "", args, envp, AT_EMPTY_PATH);
   SAPI_RAW_PCHECK(false, "Could not launch forkserver binary");
+  abort();
+}
+
+static void StartGlobalForkServer() {
+  SAPI_RAW_CHECK(global_fork_servers == nullptr,
+                 "global fork server already initialized");
+  if (getenv(kForkServerDisableEnv)) {
+    SAPI_RAW_VLOG(1,
+                  "Start of the Global Fork-Server prevented by the '%s' "
+                  "environment variable present",
+                  kForkServerDisableEnv);
+    return;
+  }
+
+  sanitizer::WaitForTsan();
+
+  // We should be really single-threaded now, as it's the point of the whole
+  // exercise.
+  int num_threads = sanitizer::GetNumberOfThreads(getpid());
+  if (num_threads != 1) {
+    SAPI_RAW_LOG(ERROR,
+                 "BADNESS MAY HAPPEN. ForkServer::Init() created in a "
+                 "multi-threaded context, %d threads present",
+                 num_threads);
+  }
+
+  const int instances = GetNumInstancesFromEnv();
+  std::vector<std::pair<int, cpu_set_t>> numa_nodes;
+  const char* numa = getenv(kForkServerNumaEnv);
+  if (numa && strcmp(numa, "1") == 0 && !GetNumaTopology(&numa_nodes)) {
+    SAPI_RAW_VLOG(1, "No NUMA topology found, not binding the fork servers");
+  }
+
+  auto* servers = new std::vector<GlobalForkServer>();
+  servers->reserve(instances);
+  for (int i = 0; i < instances; ++i) {
+    if (numa_nodes.empty()) {
+      servers->push_back(StartOneGlobalForkServer(-1, nullptr));
+    } else {
+      const auto& node = numa_nodes[i % numa_nodes.size()];
+      servers->push_back(StartOneGlobalForkServer(node.first, &node.second));
+    }
+  }
+  global_fork_servers = servers;
 }
 
 }  // namespace sandbox2
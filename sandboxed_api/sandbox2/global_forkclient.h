@@ -22,9 +22,32 @@
 
 namespace sandbox2 {
 
+// Envvar with the number of global fork servers to start, 1 by default. It is
+// capped at the number of CPUs. The fork servers are started before main(), so
+// this can only be configured through the environment.
+static constexpr const char* kForkServerInstancesEnv =
+    "SANDBOX2_FORKSERVER_INSTANCES";
+
+// Envvar which, if set to 1, spreads the global fork servers over the NUMA
+// nodes. Each fork server (and thus each sandboxee it starts) then runs on the
+// CPUs of its node, and requests prefer fork servers on the node of the
+// calling thread.
+static constexpr const char* kForkServerNumaEnv = "SANDBOX2_FORKSERVER_NUMA";
+
+// Returns the ForkClient of the global fork server with the fewest pending
+// requests.
 ForkClient* GetGlobalForkClient();
 
-// Returns the fork server PID. Used in tests.
+// Sets the admission limits of the ForkClients of all global fork servers.
+// They apply to each of them, i.e. with several instances the limits of the
+// whole process are that many times higher.
+void SetGlobalForkServerAdmissionLimits(
+    const ForkClient::AdmissionLimits& limits);
+
+// Returns the number of global fork servers.
+int GetNumGlobalForkServers();
+
+// Returns the PID of the first fork server. Used in tests.
 pid_t GetGlobalForkServerPid();
 
 }  // namespace sandbox2
@@ -16,6 +16,7 @@
 
 #include "sandboxed_api/sandbox2/ipc.h"
 
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -23,10 +24,10 @@
 
 #include <glog/logging.h>
 #include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/ipc.pb.h"
 #include "sandboxed_api/sandbox2/logserver.h"
 #include "sandboxed_api/sandbox2/logsink.h"
 #include "sandboxed_api/sandbox2/network_proxy_client.h"
-#include "sandboxed_api/sandbox2/network_proxy_server.h"
 
 namespace sandbox2 {
 
@@ -59,26 +60,26 @@ int IPC::ReceiveFd(int remote_fd, absl::string_view name) {
 }
 
 bool IPC::SendFdsOverComms() {
-  if (!(comms_->SendUint32(fd_map_.size()))) {
-    LOG(ERROR) << "Couldn't send IPC fd size";
+  // The whole table is sent in a single message, followed by all file
+  // descriptors in as few messages as possible.
+  FdMappings mappings;
+  std::vector<int> local_fds;
+  local_fds.reserve(fd_map_.size());
+  for (const auto& fd_tuple : fd_map_) {
+    FdMappings::Mapping* mapping = mappings.add_mappings();
+    mapping->set_remote_fd(std::get<1>(fd_tuple));
+    mapping->set_name(std::get<2>(fd_tuple));
+    local_fds.push_back(std::get<0>(fd_tuple));
+  }
+  if (!comms_->SendProtoBuf(mappings)) {
+    LOG(ERROR) << "Couldn't send the IPC fd mappings";
+    return false;
+  }
+  if (!fd_map_.empty() && !comms_->SendFDs(local_fds)) {
+    LOG(ERROR) << "SendFDs: Couldn't send " << local_fds.size() << " fds";
     return false;
   }
-
   for (const auto& fd_tuple : fd_map_) {
-    if (!(comms_->SendInt32(std::get<1>(fd_tuple)))) {
-      LOG(ERROR) << "SendInt32: Couldn't send " << std::get<1>(fd_tuple);
-      return false;
-    }
-    if (!(comms_->SendFD(std::get<0>(fd_tuple)))) {
-      LOG(ERROR) << "SendFd: Couldn't send " << std::get<0>(fd_tuple);
-      return false;
-    }
-
-    if (!(comms_->SendString(std::get<2>(fd_tuple)))) {
-      LOG(ERROR) << "SendString: Couldn't send " << std::get<2>(fd_tuple);
-      return false;
-    }
-
     VLOG(3) << "IPC: local_fd: " << std::get<0>(fd_tuple)
             << ", remote_fd: " << std::get<1>(fd_tuple) << " sent";
   }
@@ -103,11 +104,40 @@ void IPC::EnableLogServer() {
   log_thread.detach();
 }
 
-void IPC::EnableNetworkProxyServer() {
+void IPC::EnableSharedLogServer(size_t slots, LogRing::Mode mode) {
+  auto ring_or = LogRing::Create(slots, mode);
+  if (!ring_or.ok()) {
+    LOG(ERROR) << "Could not create the shared log ring: "
+               << ring_or.status().message();
+    EnableLogServer();
+    return;
+  }
+  std::unique_ptr<LogRing> ring = std::move(ring_or).ValueOrDie();
+  // The mapped descriptor is closed once it has been sent.
+  int ring_fd = fcntl(ring->fd(), F_DUPFD_CLOEXEC, 0);
+  if (ring_fd == -1) {
+    PLOG(ERROR) << "fcntl(F_DUPFD_CLOEXEC)";
+    EnableLogServer();
+    return;
+  }
+  fd_map_.push_back(std::make_tuple(ring_fd, -1, LogRing::kFDName));
+
+  int fd = ReceiveFd(LogSink::kLogFDName);
+  LogRing* raw_ring = ring.release();
+  auto logger = [fd, raw_ring] {
+    LogServer log_server(fd, absl::WrapUnique(raw_ring));
+    log_server.Run();
+  };
+  std::thread log_thread{logger};
+  log_thread.detach();
+}
+
+void IPC::EnableNetworkProxyServer(
+    const std::vector<NetworkProxyServer::PooledDestination>& pools) {
   int fd = ReceiveFd(NetworkProxyClient::kFDName);
 
-  auto proxy_server = [fd]() {
-    NetworkProxyServer network_proxy_server(fd);
+  auto proxy_server = [fd, pools]() {
+    NetworkProxyServer network_proxy_server(fd, pools);
     network_proxy_server.Run();
   };
 
@@ -26,6 +26,8 @@
 #include "absl/base/macros.h"
 #include "absl/strings/string_view.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/logring.h"
+#include "sandboxed_api/sandbox2/network_proxy_server.h"
 
 namespace sandbox2 {
 
@@ -60,9 +62,20 @@ class IPC final {
   // Client::SendLogsToSupervisor in the sandboxee.
   void EnableLogServer();
 
+  // Like EnableLogServer(), but the sandboxee writes its messages into a ring
+  // of 'slots' messages in shared memory, without making system calls. The
+  // log server thread polls the ring. 'mode' tells whether the sandboxee
+  // overwrites unread messages or waits for the log server when the ring is
+  // full. Falls back to EnableLogServer() if the ring cannot be created.
+  void EnableSharedLogServer(
+      size_t slots = LogRing::kDefaultSlots,
+      LogRing::Mode mode = LogRing::Mode::kOverwriteOldest);
+
   // Enable network proxy server, this will start a thread in the sandbox
-  // that waits for connection requests from the sandboxee.
-  void EnableNetworkProxyServer();
+  // that waits for connection requests from the sandboxee. The server keeps
+  // connections to the destinations 'pools' open.
+  void EnableNetworkProxyServer(
+      const std::vector<NetworkProxyServer::PooledDestination>& pools = {});
 
  private:
   friend class Executor;
@@ -95,6 +95,40 @@ TEST(IPCTest, MapFDByNamePostExecve) {
   ASSERT_EQ(result.reason_code(), 0);
 }
 
+// Both the forkserver and the sandboxee must pick up the socket type of a
+// SOCK_SEQPACKET Comms channel.
+TEST(IPCTest, MapFDByNameOverSeqpacketComms) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/ipc");
+  for (bool pre_execve : {true, false}) {
+    SCOPED_TRACE(pre_execve ? "pre-execve" : "post-execve");
+    std::vector<std::string> args = {path, pre_execve ? "1" : "2",
+                                     std::to_string(kPreferredIpcFd)};
+    auto executor = absl::make_unique<Executor>(path, args);
+    executor->set_comms_seqpacket(true);
+    executor->set_enable_sandbox_before_exec(pre_execve);
+    Comms comms(executor->ipc()->ReceiveFd(kPreferredIpcFd, "ipc_test"));
+
+    SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                          .DisableNamespaces()
+                                          // Don't restrict the syscalls at all.
+                                          .DangerDefaultAllowAll()
+                                          .TryBuild());
+
+    Sandbox2 s2(std::move(executor), std::move(policy));
+    s2.RunAsync();
+
+    ASSERT_TRUE(comms.SendString("hello"));
+    std::string resp;
+    ASSERT_TRUE(comms.RecvString(&resp));
+    EXPECT_EQ(resp, "world");
+
+    auto result = s2.AwaitResult();
+    EXPECT_EQ(result.final_status(), Result::OK);
+    EXPECT_EQ(result.reason_code(), 0);
+  }
+}
+
 TEST(IPCTest, NoMappedFDsPreExecve) {
   SKIP_SANITIZERS_AND_COVERAGE;
   const std::string path = GetTestSourcePath("sandbox2/testcases/ipc");
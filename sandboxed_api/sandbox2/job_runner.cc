@@ -0,0 +1,74 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::JobRunner class.
+
+#include "sandboxed_api/sandbox2/job_runner.h"
+
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/client.h"
+#include "sandboxed_api/util/canonical_errors.h"
+
+namespace sandbox2 {
+
+sapi::StatusOr<int32_t> JobRunner::Run(const std::vector<uint8_t>& data,
+                                       const std::vector<int>& fds,
+                                       bool isolated) {
+  Client::JobHeader header;
+  header.flags = isolated ? Client::kJobIsolated : 0;
+  header.num_fds = fds.size();
+  const iovec fragments[] = {
+      {&header, sizeof(header)},
+      {const_cast<uint8_t*>(data.data()), data.size()},
+  };
+  if (!comms_->SendTLVv(Comms::kTagJob, fragments, 2)) {
+    return sapi::UnavailableError("Sending the job failed");
+  }
+  if (!fds.empty() && !comms_->SendFDs(fds)) {
+    return sapi::UnavailableError("Sending the job's fds failed");
+  }
+
+  uint32_t tag;
+  std::vector<uint8_t> reply;
+  if (!comms_->RecvTLV(&tag, &reply)) {
+    return sapi::UnavailableError("Receiving the job's result failed");
+  }
+  int32_t result;
+  if ((tag != Comms::kTagJobResult && tag != Comms::kTagJobCrashed) ||
+      reply.size() != sizeof(result)) {
+    return sapi::UnavailableError("Received an unexpected reply to the job");
+  }
+  memcpy(&result, reply.data(), sizeof(result));
+  if (tag == Comms::kTagJobCrashed) {
+    if (result != -1 && WIFSIGNALED(result)) {
+      return sapi::InternalError(
+          absl::StrCat("Job killed by signal ", WTERMSIG(result)));
+    }
+    return sapi::InternalError(absl::StrCat(
+        "Job did not exit cleanly, status: ",
+        result != -1 && WIFEXITED(result) ? WEXITSTATUS(result) : result));
+  }
+  return result;
+}
+
+bool JobRunner::Stop() {
+  return comms_->SendTLV(Comms::kTagJobLoopExit, 0, nullptr);
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,67 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::JobRunner class sends jobs to a sandboxee which serves them
+// with sandbox2::Client::RunJobLoop().
+
+#ifndef SANDBOXED_API_SANDBOX2_JOB_RUNNER_H_
+#define SANDBOXED_API_SANDBOX2_JOB_RUNNER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+// Runs jobs in a long-lived sandboxee, one at a time, instead of spawning a
+// sandboxee per job.
+//
+// Example:
+//   Sandbox2 s2(std::move(executor), std::move(policy));
+//   s2.RunAsync();
+//   JobRunner runner(s2.comms());
+//   for (...) {
+//     SAPI_ASSIGN_OR_RETURN(int32_t result, runner.Run(data, {input_fd}));
+//   }
+//   runner.Stop();
+//   s2.AwaitResult();
+class JobRunner {
+ public:
+  // 'comms' is not owned.
+  explicit JobRunner(Comms* comms) : comms_(comms) {}
+
+  JobRunner(const JobRunner&) = delete;
+  JobRunner& operator=(const JobRunner&) = delete;
+
+  // Sends a job with 'data' and a copy of 'fds' to the sandboxee and returns
+  // the result of its handler. An isolated job runs in a child forked from
+  // the job loop, so that it cannot leave any state behind for later jobs.
+  // Fails with an internal error if an isolated job crashed, the sandboxee
+  // then serves the next job as usual.
+  sapi::StatusOr<int32_t> Run(const std::vector<uint8_t>& data,
+                              const std::vector<int>& fds = {},
+                              bool isolated = false);
+
+  // Ends the job loop of the sandboxee.
+  bool Stop();
+
+ private:
+  Comms* comms_;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_JOB_RUNNER_H_
@@ -0,0 +1,136 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/job_runner.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/testing.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+namespace sandbox2 {
+namespace {
+
+using ::sapi::StatusIs;
+using ::testing::Eq;
+
+std::vector<uint8_t> Bytes(const std::string& s) {
+  return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+class JobRunnerTest : public ::testing::Test {
+ protected:
+  // Not in SetUp(), so that the tests can skip it under sanitizers.
+  void StartSandboxee() {
+    const std::string path = GetTestSourcePath("sandbox2/testcases/job_loop");
+    auto executor =
+        absl::make_unique<Executor>(path, std::vector<std::string>{path});
+    executor->set_enable_sandbox_before_exec(false);
+    SAPI_ASSERT_OK_AND_ASSIGN(auto policy,
+                              PolicyBuilder()
+                                  .DisableNamespaces()
+                                  // Don't restrict the syscalls at all.
+                                  .DangerDefaultAllowAll()
+                                  .TryBuild());
+    s2_ = absl::make_unique<Sandbox2>(std::move(executor), std::move(policy));
+    ASSERT_TRUE(s2_->RunAsync());
+    runner_ = absl::make_unique<JobRunner>(s2_->comms());
+  }
+
+  void ExpectCleanExit() {
+    ASSERT_TRUE(runner_->Stop());
+    const Result result = s2_->AwaitResult();
+    EXPECT_THAT(result.final_status(), Eq(Result::OK));
+    EXPECT_THAT(result.reason_code(), Eq(0));
+  }
+
+  std::unique_ptr<Sandbox2> s2_;
+  std::unique_ptr<JobRunner> runner_;
+};
+
+TEST_F(JobRunnerTest, KeepsStateAcrossJobs) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  StartSandboxee();
+  for (int i = 1; i <= 3; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(int32_t count, runner_->Run(Bytes("count")));
+    EXPECT_THAT(count, Eq(i));
+  }
+  ExpectCleanExit();
+}
+
+TEST_F(JobRunnerTest, IsolatedJobsStartFromPristineState) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  StartSandboxee();
+  SAPI_ASSERT_OK_AND_ASSIGN(int32_t count, runner_->Run(Bytes("count")));
+  EXPECT_THAT(count, Eq(1));
+  for (int i = 0; i < 2; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        count, runner_->Run(Bytes("count"), {}, /*isolated=*/true));
+    EXPECT_THAT(count, Eq(2));
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(count, runner_->Run(Bytes("count")));
+  EXPECT_THAT(count, Eq(2));
+  ExpectCleanExit();
+}
+
+TEST_F(JobRunnerTest, SurvivesCrashingIsolatedJobs) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  StartSandboxee();
+  EXPECT_THAT(runner_->Run(Bytes("crash"), {}, /*isolated=*/true),
+              StatusIs(sapi::StatusCode::kInternal));
+  SAPI_ASSERT_OK_AND_ASSIGN(int32_t count, runner_->Run(Bytes("count")));
+  EXPECT_THAT(count, Eq(1));
+  ExpectCleanExit();
+}
+
+TEST_F(JobRunnerTest, ReportsIsolatedJobsExitingWithoutResult) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  StartSandboxee();
+  EXPECT_THAT(runner_->Run(Bytes("exit"), {}, /*isolated=*/true),
+              StatusIs(sapi::StatusCode::kInternal));
+  SAPI_ASSERT_OK_AND_ASSIGN(int32_t count, runner_->Run(Bytes("count")));
+  EXPECT_THAT(count, Eq(1));
+  ExpectCleanExit();
+}
+
+TEST_F(JobRunnerTest, PassesFds) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  StartSandboxee();
+  int fds[2];
+  ASSERT_THAT(pipe2(fds, O_CLOEXEC), Eq(0));
+  SAPI_ASSERT_OK_AND_ASSIGN(int32_t written,
+                            runner_->Run(Bytes("hello"), {fds[1]}));
+  EXPECT_THAT(written, Eq(5));
+  close(fds[1]);
+  char buffer[16] = {};
+  EXPECT_THAT(read(fds[0], buffer, sizeof(buffer)), Eq(5));
+  EXPECT_THAT(std::string(buffer), Eq("hello"));
+  close(fds[0]);
+  ExpectCleanExit();
+}
+
+}  // namespace
+}  // namespace sandbox2
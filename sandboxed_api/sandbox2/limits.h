@@ -21,6 +21,8 @@
 #include <sys/resource.h>
 #include <cstdint>
 #include <ctime>
+#include <string>
+#include <utility>
 
 #include "absl/base/macros.h"
 #include "absl/time/time.h"
@@ -112,6 +114,46 @@ class Limits final {
   }
   absl::Duration wall_time_limit() const { return wall_time_limit_; }
 
+  // cgroup v2 getters/setters, see
+  // https://www.kernel.org/doc/html/latest/admin-guide/cgroup-v2.html.
+  //
+  // If a parent cgroup is set, the sandboxee is put into a cgroup of its own
+  // below it. The limits below then apply to all processes of the sandboxee
+  // together, and their usage is reported in Result::GetCgroupStats(). The
+  // parent must be writable by the Monitor, have no processes of its own and
+  // have the needed controllers enabled in its cgroup.subtree_control.
+  Limits& set_cgroup_parent(std::string path) {
+    cgroup_parent_ = std::move(path);
+    return *this;
+  }
+  const std::string& cgroup_parent() const { return cgroup_parent_; }
+
+  // Memory of the sandboxee (memory.max) in bytes, 0 for no limit.
+  Limits& set_cgroup_memory_max(uint64_t bytes) {
+    cgroup_memory_max_ = bytes;
+    return *this;
+  }
+  uint64_t cgroup_memory_max() const { return cgroup_memory_max_; }
+
+  // CPU bandwidth of the sandboxee (cpu.max): 'quota' of CPU time in each
+  // 'period'. absl::InfiniteDuration() for no limit.
+  Limits& set_cgroup_cpu_max(absl::Duration quota,
+                             absl::Duration period = absl::Milliseconds(100)) {
+    cgroup_cpu_quota_ = quota;
+    cgroup_cpu_period_ = period;
+    return *this;
+  }
+  absl::Duration cgroup_cpu_quota() const { return cgroup_cpu_quota_; }
+  absl::Duration cgroup_cpu_period() const { return cgroup_cpu_period_; }
+
+  // I/O limits of the sandboxee (io.max), written as is. One line per device,
+  // e.g. "8:0 rbps=1048576 wiops=120". Empty for no limit.
+  Limits& set_cgroup_io_max(std::string value) {
+    cgroup_io_max_ = std::move(value);
+    return *this;
+  }
+  const std::string& cgroup_io_max() const { return cgroup_io_max_; }
+
  private:
   // Initial values for limits. Fields of rlimit64 are defined as __u64,
   // so we use uint64_t here.
@@ -149,6 +191,14 @@ class Limits final {
 
   // Wall-time limit (local to Monitor).
   absl::Duration wall_time_limit_;
+
+  // cgroup v2 directory below which the sandboxee gets its cgroup, none if
+  // empty.
+  std::string cgroup_parent_;
+  uint64_t cgroup_memory_max_ = 0;
+  absl::Duration cgroup_cpu_quota_ = absl::InfiniteDuration();
+  absl::Duration cgroup_cpu_period_ = absl::Milliseconds(100);
+  std::string cgroup_io_max_;
 };
 
 }  // namespace sandbox2
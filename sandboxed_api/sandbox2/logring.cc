@@ -0,0 +1,197 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/logring.h"
+
+#include <linux/futex.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sandbox2 {
+
+namespace {
+
+// How long a blocked writer sleeps before checking whether the reader went
+// away.
+constexpr long kWriterWaitNs = 100 * 1000 * 1000;  // NOLINT(runtime/int)
+
+}  // namespace
+
+constexpr char LogRing::kFDName[];
+constexpr size_t LogRing::kSlotSize;
+constexpr size_t LogRing::kDefaultSlots;
+constexpr size_t LogRing::kMaxSlots;
+constexpr size_t LogRing::kDataOffset;
+constexpr size_t LogRing::kMaxTextSize;
+
+sapi::StatusOr<std::unique_ptr<LogRing>> LogRing::Create(size_t slots,
+                                                          Mode mode) {
+  if (slots == 0 || slots > kMaxSlots) {
+    return sapi::InvalidArgumentError("Invalid number of log ring slots");
+  }
+  SAPI_ASSIGN_OR_RETURN(
+      std::unique_ptr<Buffer> buffer,
+      Buffer::CreateWithSize(kDataOffset + slots * kSlotSize));
+  // A freshly created buffer is zero-filled, i.e. empty.
+  auto ring = absl::WrapUnique(new LogRing(std::move(buffer), slots, mode));
+  ring->header()->slots = slots;
+  ring->header()->mode = mode;
+  ring->reader_ = true;
+  return ring;
+}
+
+sapi::StatusOr<std::unique_ptr<LogRing>> LogRing::CreateFromFd(int fd) {
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<Buffer> buffer,
+                        Buffer::CreateFromFd(fd));
+  if (buffer->size() < kDataOffset) {
+    return sapi::InvalidArgumentError("Log ring region too small");
+  }
+  const Header* hdr = reinterpret_cast<const Header*>(buffer->data());
+  const uint64_t slots = hdr->slots;
+  const Mode mode = hdr->mode;
+  if (slots == 0 || slots > kMaxSlots ||
+      buffer->size() < kDataOffset + slots * kSlotSize ||
+      (mode != Mode::kOverwriteOldest && mode != Mode::kBlock)) {
+    return sapi::InvalidArgumentError("Invalid log ring header");
+  }
+  return absl::WrapUnique(new LogRing(std::move(buffer), slots, mode));
+}
+
+LogRing::~LogRing() {
+  if (reader_) {
+    Header* hdr = header();
+    hdr->abandoned.store(1, std::memory_order_seq_cst);
+    hdr->tail_seq.fetch_add(1, std::memory_order_seq_cst);
+    syscall(__NR_futex, &hdr->tail_seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+  }
+}
+
+bool LogRing::WaitForRoom(uint64_t pos) {
+  Header* hdr = header();
+  const timespec interval = {0, kWriterWaitNs};
+  while (pos - hdr->tail.load(std::memory_order_acquire) >= slots_) {
+    if (hdr->abandoned.load(std::memory_order_acquire)) {
+      return false;
+    }
+    hdr->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    const uint32_t seq = hdr->tail_seq.load(std::memory_order_seq_cst);
+    if (pos - hdr->tail.load(std::memory_order_seq_cst) >= slots_) {
+      syscall(__NR_futex, &hdr->tail_seq, FUTEX_WAIT, seq, &interval, nullptr,
+              0);
+    }
+    hdr->sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool LogRing::Write(int severity, absl::string_view path, int line, int pid,
+                    absl::string_view message) {
+  Header* hdr = header();
+  const uint64_t pos = hdr->head.load(std::memory_order_relaxed);
+  if (mode_ == Mode::kBlock && !WaitForRoom(pos)) {
+    CountDropped();
+    return false;
+  }
+
+  // Announce the write before touching the slot, a reader copying it at the
+  // same time then discards the copy.
+  hdr->write_begin.store(pos + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  path = path.substr(0, kMaxTextSize);
+  message = message.substr(0, kMaxTextSize - path.size());
+  Record record;
+  record.severity = severity;
+  record.line = line;
+  record.pid = pid;
+  record.path_length = path.size();
+  record.message_length = message.size();
+  uint8_t* dst = slot(pos);
+  memcpy(dst, &record, sizeof(record));
+  memcpy(dst + sizeof(record), path.data(), path.size());
+  memcpy(dst + sizeof(record) + path.size(), message.data(), message.size());
+
+  hdr->head.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+void LogRing::CountDropped() {
+  header()->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t LogRing::Read(std::vector<LogMessage>* messages) {
+  Header* hdr = header();
+  uint64_t lost = hdr->dropped.exchange(0, std::memory_order_relaxed);
+  // Everything in the region is under control of the sandboxee, the
+  // positions are validated and the slots copied before they are parsed.
+  const uint64_t head = hdr->head.load(std::memory_order_acquire);
+  if (head < read_pos_) {
+    return lost;
+  }
+  if (head - read_pos_ > slots_) {
+    lost += head - slots_ - read_pos_;
+    read_pos_ = head - slots_;
+  }
+  uint8_t copy[kSlotSize];
+  for (; read_pos_ < head; ++read_pos_) {
+    memcpy(copy, slot(read_pos_), kSlotSize);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (hdr->write_begin.load(std::memory_order_relaxed) >
+        read_pos_ + slots_) {
+      ++lost;
+      continue;
+    }
+    Record record;
+    memcpy(&record, copy, sizeof(record));
+    if (static_cast<size_t>(record.path_length) + record.message_length >
+        kMaxTextSize) {
+      ++lost;
+      continue;
+    }
+    const char* text = reinterpret_cast<const char*>(copy + sizeof(record));
+    messages->emplace_back();
+    LogMessage& msg = messages->back();
+    msg.set_severity(record.severity);
+    msg.set_path(text, record.path_length);
+    msg.set_line(record.line);
+    // Terminated by a newline, like the messages sent by the LogSink.
+    msg.set_message(absl::StrCat(
+        absl::string_view(text + record.path_length, record.message_length),
+        "\n"));
+    msg.set_pid(record.pid);
+  }
+
+  hdr->tail.store(read_pos_, std::memory_order_seq_cst);
+  if (mode_ == Mode::kBlock) {
+    hdr->tail_seq.fetch_add(1, std::memory_order_seq_cst);
+    if (hdr->sleepers.load(std::memory_order_seq_cst) != 0) {
+      syscall(__NR_futex, &hdr->tail_seq, FUTEX_WAKE, INT_MAX, nullptr,
+              nullptr, 0);
+    }
+  }
+  return lost;
+}
+
+}  // namespace sandbox2
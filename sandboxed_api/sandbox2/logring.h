@@ -0,0 +1,147 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::LogRing class is a single-producer single-consumer ring of log
+// messages in a sandbox2::Buffer shared by the sandboxee (the writer) and the
+// LogServer (the reader).
+//
+// Writing a message is a copy into the shared region and needs no system call,
+// unless the ring is full in Mode::kBlock. The reader polls the ring. Messages
+// are stored in fixed-size slots, longer ones are truncated.
+
+#ifndef SANDBOXED_API_SANDBOX2_LOGRING_H_
+#define SANDBOXED_API_SANDBOX2_LOGRING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/sandbox2/logserver.pb.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+class LogRing {
+ public:
+  static constexpr char kFDName[] = "sb2_logring";
+  // Size of a slot, including the fixed fields of the message.
+  static constexpr size_t kSlotSize = 512;
+  static constexpr size_t kDefaultSlots = 4096;
+  static constexpr size_t kMaxSlots = 1 << 20;
+
+  // What the writer does when the ring is full.
+  enum class Mode : uint32_t {
+    // Overwrites the oldest message, the reader counts it as lost.
+    kOverwriteOldest = 0,
+    // Waits until the reader made room, or drops the message if the reader
+    // went away.
+    kBlock = 1,
+  };
+
+  LogRing(const LogRing&) = delete;
+  LogRing& operator=(const LogRing&) = delete;
+
+  // Marks the ring as abandoned, which unblocks waiting writers.
+  ~LogRing();
+
+  // Creates a ring of 'slots' messages backed by a new shared buffer (host
+  // side).
+  static sapi::StatusOr<std::unique_ptr<LogRing>> Create(
+      size_t slots = kDefaultSlots, Mode mode = Mode::kOverwriteOldest);
+
+  // Creates a ring from a buffer received from the host (sandboxee side).
+  // Takes ownership of the file descriptor.
+  static sapi::StatusOr<std::unique_ptr<LogRing>> CreateFromFd(int fd);
+
+  // Gets the file descriptor backing the shared region.
+  int fd() const { return buffer_->fd(); }
+
+  size_t slots() const { return slots_; }
+  Mode mode() const { return mode_; }
+
+  // Writer side, calls must be serialized. Returns false if the message was
+  // dropped.
+  bool Write(int severity, absl::string_view path, int line, int pid,
+             absl::string_view message);
+
+  // Writer side: counts a message dropped before it reached the ring.
+  void CountDropped();
+
+  // Reader side: appends the messages written since the last call to
+  // 'messages' and returns the number of messages lost in the meantime, i.e.
+  // overwritten, dropped by the writer or corrupt.
+  uint64_t Read(std::vector<LogMessage>* messages);
+
+ private:
+  // Header at the start of the shared region, followed by the slots.
+  struct Header {
+    // Written by the host before the region is passed on.
+    uint64_t slots;
+    Mode mode;
+    // Set by the reader when it stops reading.
+    std::atomic<uint32_t> abandoned;
+    // Position of the message being written, plus one. A slot copied by the
+    // reader was overwritten if this moved a whole ring past it.
+    std::atomic<uint64_t> write_begin;
+    // Number of messages written (writer) and read (reader).
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    // Bumped whenever 'tail' moves, writers blocked in Mode::kBlock sleep on
+    // it.
+    std::atomic<uint32_t> tail_seq;
+    std::atomic<uint32_t> sleepers;
+    // Messages dropped by the writer, reset by the reader.
+    std::atomic<uint64_t> dropped;
+  };
+
+  // Fixed fields at the start of a slot, followed by the path and message.
+  struct Record {
+    int32_t severity;
+    int32_t line;
+    int32_t pid;
+    uint16_t path_length;
+    uint16_t message_length;
+  };
+
+  static constexpr size_t kDataOffset = (sizeof(Header) + 63) & ~size_t{63};
+  static constexpr size_t kMaxTextSize = kSlotSize - sizeof(Record);
+
+  LogRing(std::unique_ptr<Buffer> buffer, size_t slots, Mode mode)
+      : buffer_(std::move(buffer)), slots_(slots), mode_(mode) {}
+
+  Header* header() const { return reinterpret_cast<Header*>(buffer_->data()); }
+  uint8_t* slot(uint64_t pos) const {
+    return buffer_->data() + kDataOffset + (pos % slots_) * kSlotSize;
+  }
+
+  // Waits until the reader made room for the message at 'pos'. Returns false
+  // if the reader went away.
+  bool WaitForRoom(uint64_t pos);
+
+  std::unique_ptr<Buffer> buffer_;
+  const size_t slots_;
+  const Mode mode_;
+  // Reader side: the next position to read.
+  uint64_t read_pos_ = 0;
+  // Whether this is the reader side.
+  bool reader_ = false;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_LOGRING_H_
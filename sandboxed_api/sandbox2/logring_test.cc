@@ -0,0 +1,140 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/logring.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/logserver.pb.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+namespace sandbox2 {
+namespace {
+
+// Opens the writer side of 'reader' in the same process.
+std::unique_ptr<LogRing> OpenWriter(const LogRing& reader) {
+  auto writer_or =
+      LogRing::CreateFromFd(fcntl(reader.fd(), F_DUPFD_CLOEXEC, 0));
+  EXPECT_THAT(writer_or.status(), sapi::IsOk());
+  return writer_or.ok() ? std::move(writer_or).ValueOrDie() : nullptr;
+}
+
+TEST(LogRingTest, PassesMessages) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(8));
+  std::unique_ptr<LogRing> writer = OpenWriter(*reader);
+  ASSERT_TRUE(writer != nullptr);
+  EXPECT_THAT(writer->slots(), Eq(8));
+  EXPECT_THAT(writer->mode(), Eq(LogRing::Mode::kOverwriteOldest));
+
+  ASSERT_TRUE(writer->Write(1, "file.cc", 42, 123, "hello"));
+  std::vector<LogMessage> messages;
+  EXPECT_THAT(reader->Read(&messages), Eq(0));
+  ASSERT_THAT(messages, SizeIs(1));
+  EXPECT_THAT(messages[0].severity(), Eq(1));
+  EXPECT_THAT(messages[0].path(), Eq("file.cc"));
+  EXPECT_THAT(messages[0].line(), Eq(42));
+  EXPECT_THAT(messages[0].pid(), Eq(123));
+  EXPECT_THAT(messages[0].message(), Eq("hello\n"));
+
+  messages.clear();
+  EXPECT_THAT(reader->Read(&messages), Eq(0));
+  EXPECT_THAT(messages, IsEmpty());
+}
+
+TEST(LogRingTest, TruncatesLongMessages) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(8));
+  std::unique_ptr<LogRing> writer = OpenWriter(*reader);
+  ASSERT_TRUE(writer != nullptr);
+
+  ASSERT_TRUE(writer->Write(0, "file.cc", 1, 1,
+                            std::string(2 * LogRing::kSlotSize, 'x')));
+  std::vector<LogMessage> messages;
+  reader->Read(&messages);
+  ASSERT_THAT(messages, SizeIs(1));
+  EXPECT_THAT(messages[0].path(), Eq("file.cc"));
+  EXPECT_THAT(messages[0].message().size(), testing::Lt(LogRing::kSlotSize));
+}
+
+TEST(LogRingTest, OverwritesOldestMessages) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(8));
+  std::unique_ptr<LogRing> writer = OpenWriter(*reader);
+  ASSERT_TRUE(writer != nullptr);
+
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_TRUE(writer->Write(0, "file.cc", i, 1, "message"));
+  }
+  writer->CountDropped();
+  std::vector<LogMessage> messages;
+  EXPECT_THAT(reader->Read(&messages), Eq(12 + 1));
+  ASSERT_THAT(messages, SizeIs(8));
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_THAT(messages[i].line(), Eq(12 + i));
+  }
+}
+
+TEST(LogRingTest, BlockingWriterWaitsForReader) {
+  constexpr int kMessages = 1000;
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(4, LogRing::Mode::kBlock));
+  std::unique_ptr<LogRing> writer = OpenWriter(*reader);
+  ASSERT_TRUE(writer != nullptr);
+
+  std::thread writer_thread([&writer] {
+    for (int i = 0; i < kMessages; ++i) {
+      writer->Write(0, "file.cc", i, 1, absl::StrCat("message ", i));
+    }
+  });
+  std::vector<LogMessage> messages;
+  uint64_t lost = 0;
+  while (messages.size() + lost < kMessages) {
+    lost += reader->Read(&messages);
+  }
+  writer_thread.join();
+
+  EXPECT_THAT(lost, Eq(0));
+  ASSERT_THAT(messages, SizeIs(kMessages));
+  for (int i = 0; i < kMessages; ++i) {
+    EXPECT_THAT(messages[i].line(), Eq(i));
+  }
+}
+
+TEST(LogRingTest, BlockingWriterDropsWithoutReader) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(2, LogRing::Mode::kBlock));
+  std::unique_ptr<LogRing> writer = OpenWriter(*reader);
+  ASSERT_TRUE(writer != nullptr);
+
+  EXPECT_TRUE(writer->Write(0, "file.cc", 1, 1, "first"));
+  EXPECT_TRUE(writer->Write(0, "file.cc", 2, 1, "second"));
+  reader.reset();
+  EXPECT_FALSE(writer->Write(0, "file.cc", 3, 1, "third"));
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -14,32 +14,96 @@
 
 #include "sandboxed_api/sandbox2/logserver.h"
 
+#include <poll.h>
+#include <unistd.h>
+
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include "sandboxed_api/sandbox2/logserver.pb.h"
 
 namespace sandbox2 {
 
+constexpr int LogServer::kRingPollIntervalMs;
+
 LogServer::LogServer(int fd) : comms_(fd) {}
 
+LogServer::LogServer(int fd, std::unique_ptr<LogRing> ring)
+    : comms_(fd), ring_(std::move(ring)) {}
+
 void LogServer::Run() {
-  namespace logging = ::google;
-  LogMessage msg;
-  while (comms_.RecvProtoBuf(&msg)) {
-    logging::LogSeverity severity = msg.severity();
-    const char* fatal_string = "";
-    if (severity == logging::FATAL) {
-      // We don't want to trigger an abort() in the executor for FATAL logs.
-      severity = logging::ERROR;
-      fatal_string = " FATAL";
-    }
-    logging::LogMessage log_message(msg.path().c_str(), msg.line(), severity);
-    log_message.stream()
-        << "(sandboxee " << msg.pid() << fatal_string << "): " << msg.message();
+  if (ring_ != nullptr) {
+    RunWithRing();
+    return;
+  }
+  LogMessageBatch batch;
+  while (comms_.RecvProtoBuf(&batch)) {
+    LogBatch(batch);
   }
 
   LOG(INFO) << "Receive failed, shutting down LogServer";
 }
 
+void LogServer::RunWithRing() {
+  // Processes forked by the sandboxee send their messages over comms_.
+  pollfd pfd = {comms_.GetConnectionFD(), POLLIN, 0};
+  LogMessageBatch batch;
+  for (;;) {
+    const int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, kRingPollIntervalMs));
+    DrainRing();
+    if (ret == -1) {
+      PLOG(ERROR) << "poll() on the log channel";
+      break;
+    }
+    if (ret == 0) {
+      continue;
+    }
+    if ((pfd.revents & POLLIN) == 0 || !comms_.RecvProtoBuf(&batch)) {
+      break;
+    }
+    LogBatch(batch);
+  }
+  // The last messages were written before the sandboxee went away.
+  DrainRing();
+
+  LOG(INFO) << "Sandboxee closed the log channel, shutting down LogServer";
+}
+
+void LogServer::DrainRing() {
+  std::vector<LogMessage> messages;
+  const uint64_t lost = ring_->Read(&messages);
+  for (const LogMessage& msg : messages) {
+    Log(msg);
+  }
+  ReportDropped(lost);
+}
+
+void LogServer::LogBatch(const LogMessageBatch& batch) {
+  for (const LogMessage& msg : batch.messages()) {
+    Log(msg);
+  }
+  ReportDropped(batch.dropped());
+}
+
+void LogServer::Log(const LogMessage& msg) {
+  namespace logging = ::google;
+  logging::LogSeverity severity = msg.severity();
+  const char* fatal_string = "";
+  if (severity == logging::FATAL) {
+    // We don't want to trigger an abort() in the executor for FATAL logs.
+    severity = logging::ERROR;
+    fatal_string = " FATAL";
+  }
+  logging::LogMessage log_message(msg.path().c_str(), msg.line(), severity);
+  log_message.stream() << "(sandboxee " << msg.pid() << fatal_string
+                       << "): " << msg.message();
+}
+
+void LogServer::ReportDropped(uint64_t dropped) {
+  if (dropped > 0) {
+    LOG(WARNING) << "Sandboxee dropped " << dropped << " log message(s)";
+  }
+}
+
 }  // namespace sandbox2
@@ -15,15 +15,27 @@
 #ifndef SANDBOXED_API_SANDBOX2_LOGSERVER_H_
 #define SANDBOXED_API_SANDBOX2_LOGSERVER_H_
 
+#include <cstdint>
+#include <memory>
+
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/logring.h"
+#include "sandboxed_api/sandbox2/logserver.pb.h"
 
 namespace sandbox2 {
 
-// The LogServer waits for messages from the sandboxee on a given file
-// descriptor and logs them using the standard base/logging facilities.
+// The LogServer waits for batches of messages from the sandboxee on a given
+// file descriptor and logs them using the standard base/logging facilities.
+// Messages dropped by the sandboxee are reported with a warning.
 class LogServer {
  public:
+  // Interval at which a shared LogRing is polled for new messages.
+  static constexpr int kRingPollIntervalMs = 20;
+
   explicit LogServer(int fd);
+  // Also reads the messages the sandboxee writes into 'ring', until the
+  // sandboxee closes its end of 'fd'.
+  LogServer(int fd, std::unique_ptr<LogRing> ring);
 
   LogServer(const LogServer&) = delete;
   LogServer& operator=(const LogServer&) = delete;
@@ -32,7 +44,19 @@ class LogServer {
   void Run();
 
  private:
+  // Handles messages written into ring_ as well as sent over comms_.
+  void RunWithRing();
+
+  // Logs the messages of 'batch' and reports its dropped ones.
+  static void LogBatch(const LogMessageBatch& batch);
+  static void Log(const LogMessage& msg);
+  static void ReportDropped(uint64_t dropped);
+
+  // Logs the messages of ring_ and reports its lost ones.
+  void DrainRing();
+
   Comms comms_;
+  std::unique_ptr<LogRing> ring_;
 };
 
 }  // namespace sandbox2
@@ -14,29 +14,147 @@
 
 #include "sandboxed_api/sandbox2/logsink.h"
 
+#include <pthread.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
-#include "sandboxed_api/sandbox2/logserver.pb.h"
+#include "absl/time/clock.h"
 
 namespace sandbox2 {
 
+namespace {
+
+// Set in forked children. They send their messages right away, as they must
+// not write into the shared ring of their parent, and have no flusher thread.
+std::atomic<bool> g_forked{false};
+
+// The LogSinks of this process.
+struct SinkRegistry {
+  absl::Mutex mutex;
+  std::vector<LogSink*> sinks GUARDED_BY(mutex);
+};
+
+SinkRegistry& GetSinkRegistry() {
+  static auto* registry = new SinkRegistry();
+  return *registry;
+}
+
+}  // namespace
+
+void LogSink::Register() {
+  static const int registered = pthread_atfork(
+      &LogSink::PrepareFork, &LogSink::ParentAfterFork,
+      &LogSink::ChildAfterFork);
+  (void)registered;
+  SinkRegistry& registry = GetSinkRegistry();
+  absl::MutexLock lock(&registry.mutex);
+  registry.sinks.push_back(this);
+}
+
+void LogSink::Unregister() {
+  SinkRegistry& registry = GetSinkRegistry();
+  absl::MutexLock lock(&registry.mutex);
+  registry.sinks.erase(
+      std::find(registry.sinks.begin(), registry.sinks.end(), this));
+}
+
+void LogSink::PrepareFork() {
+  SinkRegistry& registry = GetSinkRegistry();
+  registry.mutex.Lock();
+  for (LogSink* sink : registry.sinks) {
+    sink->flush_mutex_.Lock();
+  }
+}
+
+void LogSink::ParentAfterFork() {
+  SinkRegistry& registry = GetSinkRegistry();
+  for (LogSink* sink : registry.sinks) {
+    sink->flush_mutex_.Unlock();
+  }
+  registry.mutex.Unlock();
+}
+
+void LogSink::ChildAfterFork() {
+  g_forked.store(true, std::memory_order_relaxed);
+  ParentAfterFork();
+}
+
 constexpr char LogSink::kLogFDName[];
 
-LogSink::LogSink(int fd) : comms_(fd) { AddLogSink(this); }
+LogSink::LogSink(int fd) : LogSink(fd, Options()) {}
 
-LogSink::~LogSink() { RemoveLogSink(this); }
+LogSink::LogSink(int fd, const Options& options)
+    : options_(options), comms_(fd) {
+  if (options_.async) {
+    size_t size = 1;
+    while (size < std::max<size_t>(options_.buffer_size, 2)) {
+      size <<= 1;
+    }
+    ring_ = absl::make_unique<Slot[]>(size);
+    ring_mask_ = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+      ring_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    flusher_ = std::thread(&LogSink::Run, this);
+  }
+  Register();
+  AddLogSink(this);
+}
+
+LogSink::LogSink(int fd, std::unique_ptr<LogRing> shared_ring,
+                 const Options& options)
+    : options_(options),
+      comms_(fd),
+      shared_ring_(std::move(shared_ring)),
+      pid_(getpid()) {
+  Register();
+  AddLogSink(this);
+}
+
+LogSink::~LogSink() {
+  RemoveLogSink(this);
+  Unregister();
+  if (flusher_.joinable()) {
+    {
+      absl::MutexLock lock(&wake_mutex_);
+      stop_ = true;
+      wake_cv_.Signal();
+    }
+    flusher_.join();
+  }
+  Flush();
+}
 
 void LogSink::send(google::LogSeverity severity, const char* full_filename,
                    const char* base_filename, int line,
                    const struct tm* tm_time, const char* message,
                    size_t message_len) {
-  absl::MutexLock l(&lock_);
+  if (shared_ring_ != nullptr && !g_forked.load(std::memory_order_relaxed)) {
+    {
+      absl::MutexLock lock(&flush_mutex_);
+      if (!Admit(severity)) {
+        CountDropped();
+      } else if (!shared_ring_->Write(severity, base_filename, line, pid_,
+                                      {message, message_len})) {
+        total_dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    if (severity == google::FATAL) {
+      // The supervisor drains the ring once the sandboxee is gone.
+      kill(0, SIGABRT);
+    }
+    return;
+  }
 
   LogMessage msg;
   msg.set_severity(static_cast<int>(severity));
@@ -45,16 +163,146 @@ void LogSink::send(google::LogSeverity severity, const char* full_filename,
   msg.set_message(absl::StrCat(absl::string_view{message, message_len}, "\n"));
   msg.set_pid(getpid());
 
-  if (!comms_.SendProtoBuf(msg)) {
-    std::cerr << "sending log message to supervisor failed: " << std::endl
-              << msg.DebugString() << std::endl;
+  if (ring_ == nullptr || g_forked.load(std::memory_order_relaxed)) {
+    absl::MutexLock lock(&flush_mutex_);
+    LogMessageBatch batch;
+    if (Admit(severity)) {
+      batch.add_messages()->Swap(&msg);
+    } else {
+      CountDropped();
+    }
+    if (batch.messages_size() > 0) {
+      SendBatch(&batch);
+    }
+  } else if (!Push(&msg)) {
+    CountDropped();
   }
 
   if (severity == google::FATAL) {
+    Flush();
     // Raise a SIGABRT to prevent the remaining code in logging to try to dump a
     // symbolized stack trace which can lead to syscall violations.
     kill(0, SIGABRT);
   }
 }
 
+void LogSink::Flush() {
+  absl::MutexLock lock(&flush_mutex_);
+  FlushLocked();
+}
+
+// The ring buffer is a bounded multi-producer queue as described by Dmitry
+// Vyukov, read by whoever holds flush_mutex_.
+bool LogSink::Push(LogMessage* msg) {
+  size_t pos = write_pos_.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot& slot = ring_[pos & ring_mask_];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    const intptr_t diff =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (write_pos_.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+        slot.message.Swap(msg);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        if ((pos + 1) % std::max<size_t>(options_.max_batch, 1) == 0) {
+          Wake();
+        }
+        return true;
+      }
+    } else if (diff < 0) {
+      // The slot still holds the message of the previous round.
+      return false;
+    } else {
+      pos = write_pos_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void LogSink::FlushLocked() {
+  const size_t max_batch = std::max<size_t>(options_.max_batch, 1);
+  LogMessageBatch batch;
+  while (ring_ != nullptr) {
+    Slot& slot = ring_[read_pos_ & ring_mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != read_pos_ + 1) {
+      break;
+    }
+    if (Admit(static_cast<google::LogSeverity>(slot.message.severity()))) {
+      batch.add_messages()->Swap(&slot.message);
+    } else {
+      CountDropped();
+    }
+    slot.sequence.store(read_pos_ + ring_mask_ + 1, std::memory_order_release);
+    ++read_pos_;
+    if (batch.messages_size() >= max_batch) {
+      SendBatch(&batch);
+    }
+  }
+  if (batch.messages_size() > 0 ||
+      dropped_.load(std::memory_order_relaxed) > 0) {
+    SendBatch(&batch);
+  }
+}
+
+void LogSink::SendBatch(LogMessageBatch* batch) {
+  const uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    batch->set_dropped(dropped);
+  }
+  if (!comms_.SendProtoBuf(*batch)) {
+    std::cerr << "sending log messages to supervisor failed: " << std::endl
+              << batch->DebugString() << std::endl;
+  }
+  batch->Clear();
+}
+
+bool LogSink::Admit(google::LogSeverity severity) {
+  if (options_.max_messages_per_second <= 0 || severity == google::FATAL) {
+    return true;
+  }
+  const absl::Time now = absl::Now();
+  if (now - window_start_ >= absl::Seconds(1)) {
+    window_start_ = now;
+    window_messages_ = 0;
+  }
+  if (window_messages_ >= options_.max_messages_per_second) {
+    return false;
+  }
+  ++window_messages_;
+  return true;
+}
+
+void LogSink::CountDropped() {
+  if (shared_ring_ != nullptr) {
+    shared_ring_->CountDropped();
+  } else {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+  total_dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LogSink::Wake() {
+  absl::MutexLock lock(&wake_mutex_);
+  wake_ = true;
+  wake_cv_.Signal();
+}
+
+void LogSink::Run() {
+  for (;;) {
+    bool stop;
+    {
+      absl::MutexLock lock(&wake_mutex_);
+      if (!wake_ && !stop_) {
+        wake_cv_.WaitWithTimeout(&wake_mutex_, options_.flush_interval);
+      }
+      wake_ = false;
+      stop = stop_;
+    }
+    Flush();
+    if (stop) {
+      return;
+    }
+  }
+}
+
 }  // namespace sandbox2
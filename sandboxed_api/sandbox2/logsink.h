@@ -17,18 +17,61 @@
 
 #include <glog/logging.h>
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/logring.h"
+#include "sandboxed_api/sandbox2/logserver.pb.h"
 
 namespace sandbox2 {
 
 // The LogSink will register itself with the logging facilities and forward all
 // log messages to the executor on a given file descriptor.
+//
+// By default every message is sent right away by the logging thread. With
+// Options::async set, messages are appended to a lock-free ring buffer instead
+// and a background thread sends them in batches, so logging threads never
+// block on the supervisor. Messages which do not fit into the buffer are
+// dropped and counted.
+//
+// Given a LogRing shared with the supervisor, messages are written into it
+// directly instead, without any system call.
+//
+// Processes forked off after the LogSink was created send their messages right
+// away over the file descriptor.
 class LogSink : public google::LogSink {
  public:
   static constexpr char kLogFDName[] = "sb2_logsink";
 
+  struct Options {
+    // Whether to forward messages from a background thread. The thread is
+    // started by the constructor, so unless the LogSink is created before the
+    // sandbox is enabled, the policy has to allow creating threads.
+    bool async = false;
+    // Messages buffered before further messages are dropped, rounded up to a
+    // power of two.
+    size_t buffer_size = 1024;
+    // Most messages sent in one batch. A full batch wakes up the flusher.
+    size_t max_batch = 64;
+    // How long buffered messages wait for a batch to fill up.
+    absl::Duration flush_interval = absl::Milliseconds(100);
+    // Most messages forwarded per second, 0 for no limit. Messages beyond the
+    // limit are dropped and counted, FATAL messages are always forwarded.
+    int max_messages_per_second = 0;
+  };
+
   explicit LogSink(int fd);
+  LogSink(int fd, const Options& options);
+  // Options::async is ignored with a 'shared_ring'.
+  LogSink(int fd, std::unique_ptr<LogRing> shared_ring,
+          const Options& options);
   ~LogSink() override;
 
   LogSink(const LogSink&) = delete;
@@ -38,11 +81,85 @@ class LogSink : public google::LogSink {
             const char* base_filename, int line, const struct tm* tm_time,
             const char* message, size_t message_len) override;
 
+  // Sends all buffered messages and the count of messages dropped since the
+  // last batch.
+  void Flush();
+
+  // Number of messages dropped so far.
+  uint64_t dropped_messages() const {
+    return total_dropped_.load(std::memory_order_relaxed);
+  }
+
  private:
-  Comms comms_;
+  // A slot of the ring buffer. 'sequence' tells whether the slot is free for
+  // the writer of position 'sequence', or holds the message of position
+  // 'sequence - 1'.
+  struct Slot {
+    std::atomic<size_t> sequence;
+    LogMessage message;
+  };
+
+  // Moves 'msg' into the ring buffer, returns false if it is full.
+  bool Push(LogMessage* msg);
+
+  // Sends the messages in the ring buffer, if any.
+  void FlushLocked() EXCLUSIVE_LOCKS_REQUIRED(flush_mutex_);
+
+  // Sends 'batch' along with the count of dropped messages, and clears it.
+  void SendBatch(LogMessageBatch* batch) EXCLUSIVE_LOCKS_REQUIRED(flush_mutex_);
+
+  // Returns whether the rate limit allows forwarding another message.
+  bool Admit(google::LogSeverity severity)
+      EXCLUSIVE_LOCKS_REQUIRED(flush_mutex_);
+
+  // Counts a dropped message, to be reported to the supervisor.
+  void CountDropped();
+
+  // Wakes up the flusher thread.
+  void Wake();
+
+  // Main loop of the flusher thread.
+  void Run();
+
+  // Add the LogSink to the ones whose flush_mutex_ is held across fork(), so
+  // that no child starts with a copy locked by a thread it does not have, and
+  // remove it again.
+  void Register();
+  void Unregister();
+  static void PrepareFork() NO_THREAD_SAFETY_ANALYSIS;
+  static void ParentAfterFork() NO_THREAD_SAFETY_ANALYSIS;
+  static void ChildAfterFork() NO_THREAD_SAFETY_ANALYSIS;
+
+  const Options options_;
+
+  // Held while reading the ring buffer and sending to the supervisor, which
+  // makes the LogSink thread safe.
+  absl::Mutex flush_mutex_;
+  Comms comms_ GUARDED_BY(flush_mutex_);
+  // Start of the current rate limiting window and messages forwarded in it.
+  absl::Time window_start_ GUARDED_BY(flush_mutex_);
+  int window_messages_ GUARDED_BY(flush_mutex_) = 0;
+
+  // Ring shared with the supervisor, written under flush_mutex_.
+  std::unique_ptr<LogRing> shared_ring_;
+  // PID of the process which created the LogSink, reported for messages
+  // written to the shared ring.
+  int pid_ = 0;
+
+  std::unique_ptr<Slot[]> ring_;
+  size_t ring_mask_ = 0;
+  std::atomic<size_t> write_pos_{0};
+  size_t read_pos_ GUARDED_BY(flush_mutex_) = 0;
+
+  // Drops not reported to the supervisor yet and drops overall.
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> total_dropped_{0};
 
-  // Needed to make the LogSink thread safe.
-  absl::Mutex lock_;
+  absl::Mutex wake_mutex_;
+  absl::CondVar wake_cv_;
+  bool wake_ GUARDED_BY(wake_mutex_) = false;
+  bool stop_ GUARDED_BY(wake_mutex_) = false;
+  std::thread flusher_;
 };
 
 }  // namespace sandbox2
@@ -0,0 +1,185 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/logsink.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include <glog/logging.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/logring.h"
+#include "sandboxed_api/sandbox2/logserver.pb.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::Ge;
+using ::testing::HasSubstr;
+using ::testing::Le;
+
+namespace sandbox2 {
+namespace {
+
+class LogSinkTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    int sv[2];
+    ASSERT_THAT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), Eq(0));
+    sink_fd_ = sv[0];
+    server_ = absl::make_unique<Comms>(sv[1]);
+  }
+
+  // Receives batches until 'messages' messages and drops are accounted for.
+  void Receive(int messages) {
+    while (messages_.size() + dropped_ < messages) {
+      LogMessageBatch batch;
+      ASSERT_TRUE(server_->RecvProtoBuf(&batch));
+      ++batches_;
+      dropped_ += batch.dropped();
+      for (const LogMessage& msg : batch.messages()) {
+        messages_.push_back(msg.message());
+      }
+    }
+  }
+
+  int sink_fd_;
+  std::unique_ptr<Comms> server_;
+  std::vector<std::string> messages_;
+  uint64_t dropped_ = 0;
+  int batches_ = 0;
+};
+
+TEST_F(LogSinkTest, SendsEachMessage) {
+  {
+    LogSink sink(sink_fd_);
+    LOG(INFO) << "first";
+    LOG(WARNING) << "second";
+  }
+  Receive(2);
+  EXPECT_THAT(batches_, Eq(2));
+  EXPECT_THAT(messages_, ElementsAre(HasSubstr("first"), HasSubstr("second")));
+}
+
+TEST_F(LogSinkTest, AsyncSendsBatches) {
+  LogSink::Options options;
+  options.async = true;
+  options.max_batch = 16;
+  options.flush_interval = absl::InfiniteDuration();
+  {
+    LogSink sink(sink_fd_, options);
+    for (int i = 0; i < 40; ++i) {
+      LOG(INFO) << "message " << i;
+    }
+    sink.Flush();
+    EXPECT_THAT(sink.dropped_messages(), Eq(0));
+  }
+  Receive(40);
+  EXPECT_THAT(dropped_, Eq(0));
+  EXPECT_THAT(batches_, Le(5));
+  for (int i = 0; i < 40; ++i) {
+    EXPECT_THAT(messages_[i], HasSubstr(absl::StrCat("message ", i, "\n")));
+  }
+}
+
+TEST_F(LogSinkTest, CountsMessagesBeyondRateLimit) {
+  LogSink::Options options;
+  options.max_messages_per_second = 5;
+  {
+    LogSink sink(sink_fd_, options);
+    for (int i = 0; i < 20; ++i) {
+      LOG(INFO) << "message " << i;
+    }
+    EXPECT_THAT(sink.dropped_messages(), Ge(10));
+  }
+  // Drops left are reported when the LogSink is destroyed. The messages may
+  // span two rate limiting windows.
+  Receive(20);
+  EXPECT_THAT(messages_.size(), Ge(5));
+  EXPECT_THAT(messages_.size(), Le(10));
+  EXPECT_THAT(messages_.size() + dropped_, Eq(20));
+}
+
+TEST_F(LogSinkTest, WritesIntoSharedRing) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<LogRing> reader,
+                            LogRing::Create(16));
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<LogRing> writer,
+      LogRing::CreateFromFd(fcntl(reader->fd(), F_DUPFD_CLOEXEC, 0)));
+  {
+    LogSink sink(sink_fd_, std::move(writer), LogSink::Options());
+    LOG(INFO) << "first";
+    LOG(WARNING) << "second";
+  }
+  std::vector<LogMessage> messages;
+  EXPECT_THAT(reader->Read(&messages), Eq(0));
+  ASSERT_THAT(messages.size(), Eq(2));
+  EXPECT_THAT(messages[0].message(), Eq("first\n"));
+  EXPECT_THAT(messages[1].message(), Eq("second\n"));
+  EXPECT_THAT(messages[1].severity(), Eq(google::WARNING));
+}
+
+TEST_F(LogSinkTest, ForkedChildrenLogWhileTheFlusherSends) {
+  LogSink::Options options;
+  options.async = true;
+  options.max_batch = 1;
+  std::thread drain([this] {
+    LogMessageBatch batch;
+    while (server_->RecvProtoBuf(&batch)) {
+    }
+  });
+  {
+    LogSink sink(sink_fd_, options);
+    std::atomic<bool> stop{false};
+    std::thread logger([&stop] {
+      while (!stop.load()) {
+        LOG(INFO) << "parent";
+      }
+    });
+    // A child forked while the flusher holds the lock of the LogSink must
+    // still be able to log.
+    for (int i = 0; i < 20; ++i) {
+      const pid_t pid = fork();
+      ASSERT_THAT(pid, Ge(0));
+      if (pid == 0) {
+        alarm(10);
+        LOG(INFO) << "child";
+        _exit(0);
+      }
+      int status;
+      ASSERT_THAT(waitpid(pid, &status, 0), Eq(pid));
+      EXPECT_TRUE(WIFEXITED(status)) << "Child " << i << " hung";
+    }
+    stop = true;
+    logger.join();
+  }
+  drain.join();
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -0,0 +1,54 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::metrics functions.
+
+#include "sandboxed_api/sandbox2/metrics.h"
+
+#include <atomic>
+
+namespace sandbox2 {
+namespace metrics {
+namespace {
+
+std::atomic<Exporter*> g_exporter{nullptr};
+
+}  // namespace
+
+void SetExporter(Exporter* exporter) {
+  g_exporter.store(exporter, std::memory_order_release);
+}
+
+Exporter* GetExporter() { return g_exporter.load(std::memory_order_acquire); }
+
+void IncrementCounter(absl::string_view name, int64_t delta) {
+  if (Exporter* exporter = GetExporter()) {
+    exporter->IncrementCounter(name, delta);
+  }
+}
+
+void UpdateGauge(absl::string_view name, int64_t delta) {
+  if (Exporter* exporter = GetExporter()) {
+    exporter->UpdateGauge(name, delta);
+  }
+}
+
+void RecordDuration(absl::string_view name, absl::Duration value) {
+  if (Exporter* exporter = GetExporter()) {
+    exporter->RecordDuration(name, value);
+  }
+}
+
+}  // namespace metrics
+}  // namespace sandbox2
@@ -0,0 +1,117 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Metrics of sandbox2 and sandboxed API, reported to a pluggable
+// sandbox2::metrics::Exporter.
+
+#ifndef SANDBOXED_API_SANDBOX2_METRICS_H_
+#define SANDBOXED_API_SANDBOX2_METRICS_H_
+
+#include <cstdint>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+
+namespace sandbox2 {
+namespace metrics {
+
+// Counters, which only go up.
+// Sandboxees started, see kSpawnLatency.
+constexpr char kSpawns[] = "sandbox2/spawns";
+// Stops and exits of traced processes handled by the Monitor. Exporters
+// derive the rate from it.
+constexpr char kPtraceEvents[] = "sandbox2/ptrace_events";
+// Syscalls which violated the policy.
+constexpr char kSyscallViolations[] = "sandbox2/syscall_violations";
+// Messages and their bytes sent and received over Comms, in all processes
+// using it.
+constexpr char kCommsMessagesSent[] = "sandbox2/comms/messages_sent";
+constexpr char kCommsBytesSent[] = "sandbox2/comms/bytes_sent";
+constexpr char kCommsMessagesReceived[] = "sandbox2/comms/messages_received";
+constexpr char kCommsBytesReceived[] = "sandbox2/comms/bytes_received";
+// Sandboxees which finished, followed by the Result::StatusEnumToString()
+// of their final status, e.g. "sandbox2/results/TIMEOUT".
+constexpr char kResultsPrefix[] = "sandbox2/results/";
+// Sandboxes of sandboxed API restarted with Sandbox::Restart() or reset with
+// Sandbox::Reset().
+constexpr char kSandboxRestarts[] = "sapi/restarts";
+// Fork requests shed by ForkClient::AdmissionLimits.max_queued_requests.
+constexpr char kForkServerShedRequests[] = "sandbox2/forkserver_shed_requests";
+// Acquire() calls of a sapi::SandboxPool which found no sandbox ready.
+constexpr char kPoolMisses[] = "sapi/pool/misses";
+// Sandboxes terminated by a sapi::SandboxPool after idling, see
+// SandboxPoolOptions::idle_ttl.
+constexpr char kPoolIdleTerminations[] = "sapi/pool/idle_terminations";
+// Keyed Acquire() calls of a sapi::SandboxPool which were not served by the
+// sandbox their key maps to.
+constexpr char kPoolAffinityMisses[] = "sapi/pool/affinity_misses";
+
+// Gauges, which go up and down.
+// Sandboxees being monitored.
+constexpr char kActiveSandboxees[] = "sandbox2/active_sandboxees";
+// Fork requests sent to a fork server and not answered yet, in this process.
+constexpr char kForkServerQueueDepth[] = "sandbox2/forkserver_queue_depth";
+// Sandboxes ready in all sapi::SandboxPools, and the sum of their target
+// sizes, see SandboxPoolOptions::max_size.
+constexpr char kPoolReady[] = "sapi/pool/ready";
+constexpr char kPoolTargetSize[] = "sapi/pool/target_size";
+// Resident memory charged to all sapi::PoolMemoryBudgets.
+constexpr char kPoolBudgetedMemory[] = "sapi/pool/budgeted_memory";
+
+// Histograms of durations.
+// Time from the start of Executor::StartSubProcess() to the sandboxee's PID.
+constexpr char kSpawnLatency[] = "sandbox2/spawn_latency";
+// Duration of a call into the sandboxed library, followed by the name of the
+// function, e.g. "sapi/call_latency/deflate".
+constexpr char kCallLatencyPrefix[] = "sapi/call_latency/";
+// Duration of SandboxPool::Acquire(), including starting a sandbox if none
+// was ready.
+constexpr char kPoolCheckoutWait[] = "sapi/pool/checkout_wait";
+// Time a sapi::SandboxPool takes to start and initialize a sandbox.
+constexpr char kPoolSpawnLatency[] = "sapi/pool/spawn_latency";
+
+// Receives all metric updates. The methods are called from any thread, often
+// on hot paths, so they must be thread-safe and quick.
+class Exporter {
+ public:
+  virtual ~Exporter() = default;
+
+  // Adds 'delta' (positive) to the counter 'name'.
+  virtual void IncrementCounter(absl::string_view name, int64_t delta) = 0;
+
+  // Adds 'delta' (positive or negative) to the gauge 'name'.
+  virtual void UpdateGauge(absl::string_view name, int64_t delta) = 0;
+
+  // Records 'value' in the histogram 'name'.
+  virtual void RecordDuration(absl::string_view name, absl::Duration value) = 0;
+};
+
+// Reports all metrics to 'exporter' from now on, nullptr disables them. The
+// exporter is not owned and must stay alive until it is replaced, and for as
+// long as threads may still be reporting to it.
+void SetExporter(Exporter* exporter);
+
+// Returns the current exporter, nullptr if metrics are disabled.
+Exporter* GetExporter();
+
+// Shorthands for the methods of the current exporter, which do nothing
+// without one.
+void IncrementCounter(absl::string_view name, int64_t delta = 1);
+void UpdateGauge(absl::string_view name, int64_t delta);
+void RecordDuration(absl::string_view name, absl::Duration value);
+
+}  // namespace metrics
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_METRICS_H_
@@ -0,0 +1,132 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/metrics.h"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/comms.h"
+
+using ::testing::Eq;
+using ::testing::IsEmpty;
+
+namespace sandbox2 {
+namespace metrics {
+namespace {
+
+class RecordingExporter : public Exporter {
+ public:
+  void IncrementCounter(absl::string_view name, int64_t delta) override {
+    absl::MutexLock lock(&mutex_);
+    counters_[std::string(name)] += delta;
+  }
+
+  void UpdateGauge(absl::string_view name, int64_t delta) override {
+    absl::MutexLock lock(&mutex_);
+    gauges_[std::string(name)] += delta;
+  }
+
+  void RecordDuration(absl::string_view name, absl::Duration value) override {
+    absl::MutexLock lock(&mutex_);
+    durations_[std::string(name)] += value;
+  }
+
+  std::map<std::string, int64_t> counters() {
+    absl::MutexLock lock(&mutex_);
+    return counters_;
+  }
+
+  std::map<std::string, int64_t> gauges() {
+    absl::MutexLock lock(&mutex_);
+    return gauges_;
+  }
+
+  std::map<std::string, absl::Duration> durations() {
+    absl::MutexLock lock(&mutex_);
+    return durations_;
+  }
+
+ private:
+  absl::Mutex mutex_;
+  std::map<std::string, int64_t> counters_ GUARDED_BY(mutex_);
+  std::map<std::string, int64_t> gauges_ GUARDED_BY(mutex_);
+  std::map<std::string, absl::Duration> durations_ GUARDED_BY(mutex_);
+};
+
+// Installs the exporter for the duration of a test.
+class ScopedExporter {
+ public:
+  explicit ScopedExporter(Exporter* exporter) { SetExporter(exporter); }
+  ~ScopedExporter() { SetExporter(nullptr); }
+};
+
+TEST(MetricsTest, UpdatesGoToTheExporter) {
+  RecordingExporter exporter;
+  {
+    ScopedExporter scoped(&exporter);
+    IncrementCounter("counter");
+    IncrementCounter("counter", 2);
+    UpdateGauge("gauge", 5);
+    UpdateGauge("gauge", -3);
+    RecordDuration("histogram", absl::Milliseconds(7));
+  }
+  // Disabled again.
+  IncrementCounter("counter");
+
+  EXPECT_THAT(exporter.counters()["counter"], Eq(3));
+  EXPECT_THAT(exporter.gauges()["gauge"], Eq(2));
+  EXPECT_THAT(exporter.durations()["histogram"], Eq(absl::Milliseconds(7)));
+}
+
+TEST(MetricsTest, DisabledWithoutExporter) {
+  EXPECT_THAT(GetExporter(), Eq(nullptr));
+  // Must not crash.
+  IncrementCounter(kSpawns);
+  UpdateGauge(kActiveSandboxees, 1);
+  RecordDuration(kSpawnLatency, absl::Seconds(1));
+}
+
+TEST(MetricsTest, CommsCountsMessagesAndBytes) {
+  int sv[2];
+  ASSERT_THAT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), Eq(0));
+  Comms sender(sv[0]);
+  Comms receiver(sv[1]);
+
+  RecordingExporter exporter;
+  ScopedExporter scoped(&exporter);
+  ASSERT_TRUE(sender.SendString("hello"));
+  ASSERT_TRUE(sender.SendString("world!"));
+  std::string value;
+  ASSERT_TRUE(receiver.RecvString(&value));
+  ASSERT_TRUE(receiver.RecvString(&value));
+
+  auto counters = exporter.counters();
+  EXPECT_THAT(counters[kCommsMessagesSent], Eq(2));
+  EXPECT_THAT(counters[kCommsBytesSent], Eq(11));
+  EXPECT_THAT(counters[kCommsMessagesReceived], Eq(2));
+  EXPECT_THAT(counters[kCommsBytesReceived], Eq(11));
+  EXPECT_THAT(exporter.gauges(), IsEmpty());
+}
+
+}  // namespace
+}  // namespace metrics
+}  // namespace sandbox2
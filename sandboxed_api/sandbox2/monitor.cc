@@ -20,10 +20,19 @@
 #include <linux/posix_types.h>  // NOLINT: Needs to come before linux/ipc.h
 #include <linux/ipc.h>
 // clang-format on
+#include <fcntl.h>
+#include <linux/seccomp.h>
+#include <poll.h>
 #include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <syscall.h>
 #include <unistd.h>
@@ -36,21 +45,33 @@
 #include <cstring>
 #include <ctime>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include "sandboxed_api/util/flag.h"
 #include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/audit_log.h"
 #include "sandboxed_api/sandbox2/client.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/file_broker.h"
 #include "sandboxed_api/sandbox2/limits.h"
+#include "sandboxed_api/sandbox2/metrics.h"
 #include "sandboxed_api/sandbox2/mounts.h"
 #include "sandboxed_api/sandbox2/namespace.h"
 #include "sandboxed_api/sandbox2/policy.h"
@@ -58,6 +79,7 @@
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/sanitizer.h"
 #include "sandboxed_api/sandbox2/stack_trace.h"
+#include "sandboxed_api/sandbox2/startup_times.h"
 #include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/util/raw_logging.h"
@@ -68,6 +90,24 @@ ABSL_FLAG(bool, sandbox2_report_on_sandboxee_signal, true,
 ABSL_FLAG(bool, sandbox2_report_on_sandboxee_timeout, true,
           "Report sandbox2 sandboxee timeouts");
 
+ABSL_FLAG(string, sandbox2_audit_log, "",
+          "Append violations and permitted traced syscalls to this file as "
+          "binary records instead of logging their descriptions, see "
+          "audit_log_decoder_bin");
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_getfd
+#define __NR_pidfd_getfd 438
+#endif
+#ifndef SECCOMP_USER_NOTIF_FLAG_CONTINUE
+#define SECCOMP_USER_NOTIF_FLAG_CONTINUE (1UL << 0)
+#endif
+
 ABSL_DECLARE_FLAG(bool, sandbox2_danger_danger_permit_all);
 ABSL_DECLARE_FLAG(string, sandbox2_danger_danger_permit_all_and_log);
 
@@ -84,6 +124,25 @@ std::string ReadProcMaps(pid_t pid) {
   return contents.str();
 }
 
+// Turns a stack trace with one frame per line into a folded stack: the frames
+// from the outermost one, without offsets and addresses, separated by ';'.
+std::string FoldStackTrace(absl::string_view stack_trace) {
+  std::vector<absl::string_view> frames =
+      absl::StrSplit(stack_trace, '\n', absl::SkipEmpty());
+  std::string folded_stack;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    // Frames look like "symbol+0x1f(0x7f0123456789)".
+    absl::string_view frame = *it;
+    frame = frame.substr(0, frame.rfind("(0x"));
+    frame = frame.substr(0, frame.rfind("+0x"));
+    if (!folded_stack.empty()) {
+      folded_stack.push_back(';');
+    }
+    absl::StrAppend(&folded_stack, frame.empty() ? "[unknown]" : frame);
+  }
+  return folded_stack;
+}
+
 void InterruptProcess(pid_t pid) {
   if (ptrace(PTRACE_INTERRUPT, pid, 0, 0) == -1) {
     PLOG(WARNING) << "ptrace(PTRACE_INTERRUPT, pid=" << pid << ")";
@@ -102,6 +161,79 @@ void ContinueProcess(pid_t pid, int signo) {
   }
 }
 
+// Lets 'pid' run until the next syscall entry or exit.
+void ContinueProcessToSyscall(pid_t pid) {
+  if (ptrace(PTRACE_SYSCALL, pid, 0, 0) == -1) {
+    if (errno == ESRCH) {
+      LOG(WARNING) << "Process " << pid
+                   << " died while trying to PTRACE_SYSCALL it";
+    } else {
+      PLOG(ERROR) << "ptrace(PTRACE_SYSCALL, pid=" << pid << ")";
+    }
+  }
+}
+
+// The seccomp user notification listener is taken from the sandboxee with
+// pidfd_getfd(), which needs Linux 5.6.
+bool UserNotifySupported() {
+  return syscall(__NR_pidfd_getfd, -1, 0, 0) == -1 && errno == EBADF;
+}
+
+// Returns a pidfd of the process of the thread 'tid', or -1.
+int OpenProcessOfThread(pid_t tid) {
+  int pid_fd = syscall(__NR_pidfd_open, tid, 0);
+  if (pid_fd != -1 || errno != EINVAL) {
+    return pid_fd;
+  }
+  // Not a thread group leader.
+  std::ifstream status(absl::StrCat("/proc/", tid, "/status"));
+  std::string line;
+  while (std::getline(status, line)) {
+    absl::string_view value = line;
+    pid_t tgid;
+    if (absl::ConsumePrefix(&value, "Tgid:") &&
+        absl::SimpleAtoi(value, &tgid)) {
+      return syscall(__NR_pidfd_open, tgid, 0);
+    }
+  }
+  return -1;
+}
+
+// Returns whether 'nr' opens a file by its path, see FileBroker.
+bool IsOpenSyscall(uint64_t nr) {
+#ifdef __NR_open
+  if (nr == __NR_open) {
+    return true;
+  }
+#endif
+  return nr == __NR_openat;
+}
+
+// Returns whether 'fd' of the thread 'tid' is a stream socket.
+bool IsStreamSocket(pid_t tid, int fd) {
+  file_util::fileops::FDCloser pid_fd(OpenProcessOfThread(tid));
+  if (pid_fd.get() == -1) {
+    return false;
+  }
+  file_util::fileops::FDCloser socket(
+      syscall(__NR_pidfd_getfd, pid_fd.get(), fd, 0));
+  int type;
+  socklen_t type_size = sizeof(type);
+  return socket.get() != -1 &&
+         getsockopt(socket.get(), SOL_SOCKET, SO_TYPE, &type, &type_size) ==
+             0 &&
+         type == SOCK_STREAM;
+}
+
+// Returns true with the probability 'fraction'.
+bool Sample(double fraction) {
+  if (fraction >= 1.0) {
+    return true;
+  }
+  static thread_local absl::BitGen bitgen;
+  return absl::Bernoulli(bitgen, fraction);
+}
+
 void StopProcess(pid_t pid, int signo) {
   if (ptrace(PTRACE_LISTEN, pid, 0, signo) == -1) {
     if (errno == ESRCH) {
@@ -129,16 +261,62 @@ Monitor::Monitor(Executor* executor, Policy* policy, Notify* notify)
       absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all_and_log);
   external_kill_request_flag_.test_and_set(std::memory_order_relaxed);
   dump_stack_request_flag_.test_and_set(std::memory_order_relaxed);
+  wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  PLOG_IF(WARNING, wakeup_fd_ == -1) << "eventfd()";
+  // The Monitor is created on the thread starting the sandboxee, unlike the
+  // thread running it.
+  executor_->caller_cpu_ = sched_getcpu();
   if (!path.empty()) {
     log_file_ = std::fopen(path.c_str(), "a+");
     PCHECK(log_file_ != nullptr) << "Failed to open log file '" << path << "'";
   }
+  const std::string audit_path = absl::GetFlag(FLAGS_sandbox2_audit_log);
+  if (!audit_path.empty()) {
+    auto audit_log = AuditLog::Open(audit_path);
+    CHECK(audit_log.ok()) << audit_log.status();
+    audit_log_ = std::move(audit_log).ValueOrDie();
+  }
+  metrics::UpdateGauge(metrics::kActiveSandboxees, 1);
+  if (notify_->IsAsync()) {
+    trap_decisions_ = std::make_shared<TrapDecisions>();
+    absl::MutexLock lock(&trap_decisions_->mutex);
+    trap_decisions_->monitor = this;
+  }
 }
 
+constexpr absl::Duration Monitor::kWakeUpPeriod;
+constexpr absl::Duration Monitor::kGracefulExitTimeout;
+
 Monitor::~Monitor() {
+  if (trap_decisions_) {
+    absl::MutexLock lock(&trap_decisions_->mutex);
+    trap_decisions_->monitor = nullptr;
+  }
+  FinishNotifyEvents();
+  if (network_proxy_) {
+    network_proxy_->Stop();
+    network_proxy_thread_.join();
+  }
   if (log_file_) {
+    if (!syscall_trace_.empty()) {
+      PCHECK(absl::FPrintF(log_file_, "%s", syscall_trace_.ToString()) >= 0);
+    }
     std::fclose(log_file_);
   }
+  if (wakeup_fd_ != -1) {
+    close(wakeup_fd_);
+  }
+}
+
+void Monitor::WakeUp() {
+  if (wakeup_fd_ == -1) {
+    return;
+  }
+  uint64_t one = 1;
+  if (TEMP_FAILURE_RETRY(write(wakeup_fd_, &one, sizeof(one))) == -1 &&
+      errno != EAGAIN) {
+    PLOG(ERROR) << "Could not wake up the monitor";
+  }
 }
 
 namespace {
@@ -152,34 +330,35 @@ void LogContainer(const std::vector<std::string>& container) {
 }  // namespace
 
 void Monitor::Run() {
-  std::unique_ptr<absl::Notification, void (*)(absl::Notification*)>
-      setup_notify{&setup_notification_, [](absl::Notification* notification) {
-                     notification->Notify();
-                   }};
-
-  struct MonitorCleanup {
-    ~MonitorCleanup() {
-      getrusage(RUSAGE_THREAD, capture->result_.GetRUsageMonitor());
-      capture->notify_->EventFinished(capture->result_);
-      capture->ipc_->InternalCleanupFdMap();
-      capture->done_notification_.Notify();
-    }
-    Monitor* capture;
-  } monitor_cleanup{this};
-
-  if (executor_->limits()->wall_time_limit() != absl::ZeroDuration()) {
-    auto deadline = absl::Now() + executor_->limits()->wall_time_limit();
-    deadline_millis_.store(absl::ToUnixMillis(deadline),
-                           std::memory_order_relaxed);
-  }
-
   // It'd be costly to initialize the sigset_t for each sigtimedwait()
   // invocation, so do it once per Monitor.
   sigset_t sigtimedwait_sset;
   if (!InitSetupSignals(&sigtimedwait_sset)) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_SIGNALS);
+    Finish();
+    setup_notification_.Notify();
     return;
   }
+  if (!SetUpSandboxee()) {
+    Finish();
+    setup_notification_.Notify();
+    return;
+  }
+
+  // Tell the parent thread (Sandbox2 object) that we're done with the initial
+  // set-up process of the sandboxee.
+  setup_notification_.Notify();
+
+  MainLoop(&sigtimedwait_sset);
+  Finish();
+}
+
+bool Monitor::SetUpSandboxee() {
+  if (executor_->limits()->wall_time_limit() != absl::ZeroDuration()) {
+    auto deadline = absl::Now() + executor_->limits()->wall_time_limit();
+    deadline_millis_.store(absl::ToUnixMillis(deadline),
+                           std::memory_order_relaxed);
+  }
 
   if (SAPI_VLOG_IS_ON(1) && policy_->GetNamespace() != nullptr) {
     std::vector<std::string> outside_entries;
@@ -198,58 +377,107 @@ void Monitor::Run() {
   int clone_flags = CLONE_UNTRACED;
 
   // Get PID of the sandboxee.
-  pid_t init_pid = 0;
   Namespace* ns = policy_->GetNamespace();
-  bool should_have_init = ns && (ns->GetCloneFlags() & CLONE_NEWPID);
+  bool should_have_init = ns && (ns->GetCloneFlags() & CLONE_NEWPID) &&
+                          !ns->runs_sandboxee_as_init();
+  Result::StartupTimes* startup_times = result_.MutableStartupTimes();
+  // The cgroup exists before the sandboxee, so that the ForkServer can start
+  // it there instead of it being moved afterwards.
+  if (!InitCgroup()) {
+    SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_LIMITS);
+    return false;
+  }
+  file_util::fileops::FDCloser cgroup_fd{
+      cgroup_ ? open(cgroup_->path().c_str(),
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+              : -1};
+  startup_times->fork_request = absl::Now();
+  int pid_fd = -1;
   pid_ = executor_->StartSubProcess(clone_flags, ns, policy_->GetCapabilities(),
-                                    &init_pid);
+                                    &init_pid_, cgroup_fd.get(), &pid_fd,
+                                    &started_in_cgroup_);
+  cgroup_fd.Close();
+  if (pid_fd != -1) {
+    // Refers to the sandboxee even if it has exited and its PID was reused.
+    pid_fd_ = absl::make_unique<file_util::fileops::FDCloser>(pid_fd);
+  }
 
-  if (init_pid > 0) {
-    PCHECK(ptrace(PTRACE_SEIZE, init_pid, 0, PTRACE_O_EXITKILL) == 0);
+  if (init_pid_ > 0) {
+    PCHECK(ptrace(PTRACE_SEIZE, init_pid_, 0, PTRACE_O_EXITKILL) == 0);
   }
 
-  if (pid_ <= 0 || (should_have_init && init_pid <= 0)) {
-    SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_SUBPROCESS);
-    return;
+  if (pid_ <= 0 || (should_have_init && init_pid_ <= 0)) {
+    SetExitStatusCode(Result::SETUP_ERROR, executor_->request_shed_
+                                               ? Result::FAILED_ADMISSION
+                                               : Result::FAILED_SUBPROCESS);
+    return false;
   }
 
   if (!notify_->EventStarted(pid_, comms_)) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_NOTIFY);
-    return;
+    return false;
   }
   if (!InitSendIPC()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_IPC);
-    return;
+    return false;
   }
   if (!InitSendCwd()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_CWD);
-    return;
+    return false;
   }
   if (!InitSendPolicy()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_POLICY);
-    return;
+    return false;
   }
   if (!WaitForSandboxReady()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_WAIT);
-    return;
+    return false;
   }
+  startup_times->sandbox_ready = absl::Now();
   if (!InitApplyLimits()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_LIMITS);
-    return;
+    return false;
   }
   // This call should be the last in the init sequence, because it can cause the
   // sandboxee to enter ptrace-stopped state, in which it will not be able to
   // send any messages over the Comms channel.
   if (!InitPtraceAttach()) {
     SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_PTRACE);
-    return;
+    return false;
   }
+  startup_times->policy_install = absl::Now();
+  setup_startup_times_ = *startup_times;
+  return true;
+}
 
-  // Tell the parent thread (Sandbox2 object) that we're done with the initial
-  // set-up process of the sandboxee.
-  setup_notify.reset();
-
-  MainLoop(&sigtimedwait_sset);
+void Monitor::Finish() {
+  // In a MonitorPool the thread is shared with other sandboxees.
+  if (!pooled_) {
+    getrusage(RUSAGE_THREAD, result_.GetRUsageMonitor());
+  }
+  if (cgroup_) {
+    // Takes down what PTRACE_O_EXITKILL would only kill after this, the cgroup
+    // cannot be removed before.
+    auto status = cgroup_->Kill(kGracefulExitTimeout);
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+    }
+    result_.SetCgroupStats(
+        absl::make_unique<Result::CgroupStats>(cgroup_->GetStats()));
+    cgroup_.reset();
+  }
+  stack_trace_collector_.reset();
+  FinishNotifyEvents();
+  metrics::UpdateGauge(metrics::kActiveSandboxees, -1);
+  metrics::IncrementCounter(
+      absl::StrCat(metrics::kResultsPrefix,
+                   Result::StatusEnumToString(result_.final_status())));
+  notify_->EventFinished(result_);
+  ipc_->InternalCleanupFdMap();
+  if (done_callback_) {
+    done_callback_(result_);
+  }
+  done_notification_.Notify();
 }
 
 bool Monitor::IsActivelyMonitoring() {
@@ -263,6 +491,9 @@ void Monitor::SetExitStatusCode(Result::StatusEnum final_status,
                                 uintptr_t reason_code) {
   CHECK(result_.final_status() == Result::UNSET);
   result_.SetExitStatusCode(final_status, reason_code);
+  if (final_status == Result::VIOLATION) {
+    metrics::IncrementCounter(metrics::kSyscallViolations);
+  }
 }
 
 bool Monitor::ShouldCollectStackTrace() {
@@ -294,49 +525,397 @@ void Monitor::SetAdditionalResultInfo(std::unique_ptr<Regs> regs) {
   pid_t pid = regs->pid();
   result_.SetRegs(std::move(regs));
   result_.SetProgName(util::GetProgName(pid));
+  if (!Sample(policy_->stacktrace_sample_fraction_)) {
+    LOG(INFO) << "Stack trace and memory maps not sampled";
+    return;
+  }
   result_.SetProcMaps(ReadProcMaps(pid_));
   if (ShouldCollectStackTrace()) {
     result_.SetStackTrace(
-        GetStackTrace(result_.GetRegs(), policy_->GetNamespace()->mounts()));
+        GetStackTraceCollector()->Collect(result_.GetRegs()));
     LOG(INFO) << "Stack trace: " << result_.GetStackTrace();
+    if (policy_->collect_stacktrace_of_all_threads_ && !lightweight_tracing_) {
+      CollectThreadStackTraces(pid);
+    }
   } else {
     LOG(INFO) << "Stack traces have been disabled";
   }
 }
 
+void Monitor::CollectThreadStackTraces(pid_t stopped_tid) {
+  std::set<int> tasks;
+  if (!sanitizer::GetListOfTasks(pid_, &tasks)) {
+    LOG(WARNING) << "Could not list the threads of PID " << pid_;
+    return;
+  }
+  tasks.erase(stopped_tid);
+  // Interrupts all threads first, so that they are frozen at about the same
+  // time, then collects the stops.
+  std::set<pid_t> interrupted;
+  for (pid_t tid : tasks) {
+    if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) == 0) {
+      interrupted.insert(tid);
+    } else if (errno != ESRCH) {
+      PLOG(WARNING) << "ptrace(PTRACE_INTERRUPT, pid=" << tid << ")";
+    }
+  }
+  std::map<pid_t, int> stops;
+  const absl::Time deadline = absl::Now() + absl::Seconds(1);
+  while (stops.size() < interrupted.size() && absl::Now() < deadline) {
+    bool waiting = false;
+    for (pid_t tid : interrupted) {
+      if (stops.count(tid) != 0) {
+        continue;
+      }
+      int status;
+      pid_t ret = TEMP_FAILURE_RETRY(waitpid(tid, &status, __WALL | WNOHANG));
+      if (ret == tid && WIFSTOPPED(status)) {
+        stops[tid] = status;
+      } else if (ret == 0) {
+        waiting = true;
+      } else {
+        // Exited in the meantime, its exit status is lost to the event loop,
+        // which only needs the one of the main thread.
+        stops[tid] = -1;
+      }
+    }
+    if (waiting) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  }
+  LOG_IF(WARNING, stops.size() < interrupted.size())
+      << "Only " << stops.size() << " of " << interrupted.size()
+      << " threads stopped in time";
+  pending_stack_samples_.clear();
+
+  std::vector<std::unique_ptr<Regs>> regs;
+  std::vector<const Regs*> thread_regs;
+  for (const auto& stop : stops) {
+    if (stop.second == -1) {
+      continue;
+    }
+    auto tid_regs = absl::make_unique<Regs>(stop.first);
+    auto fetched = tid_regs->Fetch();
+    if (!fetched.ok()) {
+      VLOG(1) << "Could not fetch the registers of PID " << stop.first << ": "
+              << fetched;
+      continue;
+    }
+    thread_regs.push_back(tid_regs.get());
+    regs.push_back(std::move(tid_regs));
+  }
+  std::vector<std::string> traces =
+      GetStackTraceCollector()->CollectThreads(pid_, thread_regs);
+  Result::ThreadStackTraces thread_stack_traces;
+  for (size_t i = 0; i < thread_regs.size(); ++i) {
+    LOG(INFO) << "Stack trace of thread " << thread_regs[i]->pid() << ": "
+              << traces[i];
+    thread_stack_traces[thread_regs[i]->pid()] = std::move(traces[i]);
+  }
+  result_.SetThreadStackTraces(std::move(thread_stack_traces));
+
+  // Resumes the threads from the stops consumed above. Signals are delivered
+  // again. Seccomp and syscall stops are left alone, the sandboxee is about to
+  // be terminated and such a syscall must not run unchecked.
+  for (const auto& stop : stops) {
+    if (stop.second == -1) {
+      continue;
+    }
+    const int event = stop.second >> 16;
+    const int stopsig = WSTOPSIG(stop.second);
+    if (event == PTRACE_EVENT_STOP || event == PTRACE_EVENT_EXIT) {
+      ContinueProcess(stop.first, 0);
+    } else if (event == 0 && stopsig != (SIGTRAP | 0x80)) {
+      ContinueProcess(stop.first, stopsig);
+    }
+  }
+}
+
+StackTraceCollector* Monitor::GetStackTraceCollector() {
+  if (!stack_trace_collector_) {
+    stack_trace_collector_ = absl::make_unique<StackTraceCollector>(
+        policy_->GetNamespace()->mounts());
+  }
+  return stack_trace_collector_.get();
+}
+
+void Monitor::TakeStackSample(pid_t pid) {
+  Regs regs(pid);
+  auto status = regs.Fetch();
+  if (!status.ok()) {
+    VLOG(1) << "Could not sample the stack of PID " << pid << ": " << status;
+    return;
+  }
+  std::string stack_trace =
+      GetStackTraceCollector()->Collect(pid_, &regs, "\n");
+  if (stack_trace.empty()) {
+    return;
+  }
+  std::string folded_stack = FoldStackTrace(stack_trace);
+  ++(*result_.MutableStackSamples())[folded_stack];
+  DispatchNotifyEvent([this, pid, folded_stack] {
+    notify_->EventStackSample(pid, folded_stack);
+  });
+}
+
 void Monitor::KillSandboxee() {
   VLOG(1) << "Sending SIGKILL to the PID: " << pid_;
-  if (kill(pid_, SIGKILL) != 0) {
+  if (!SendKill()) {
     LOG(ERROR) << "Could not send SIGKILL to PID " << pid_;
     SetExitStatusCode(Result::INTERNAL_ERROR, Result::FAILED_KILL);
   }
 }
 
+bool Monitor::SendKill() {
+  // cgroup.kill leaves no process of the sandboxee running or forking while
+  // the main process is taken down.
+  if (cgroup_ && cgroup_->KillAll().ok()) {
+    return true;
+  }
+  // Unlike the PID, the pidfd cannot come to refer to another process.
+  if (pid_fd_ && pid_fd_->get() != -1 &&
+      syscall(__NR_pidfd_send_signal, pid_fd_->get(), SIGKILL, nullptr, 0) ==
+          0) {
+    return true;
+  }
+  return kill(pid_, SIGKILL) == 0;
+}
+
 // Not defined in glibc.
 #define __WPTRACEEVENT(x) ((x & 0xff0000) >> 16)
 
-void Monitor::MainLoop(sigset_t* sset) {
-  bool sandboxee_exited = false;
-  int status;
-  // All possible still running children of main process, will be killed due to
-  // PTRACE_O_EXITKILL ptrace() flag.
-  while (result_.final_status() == Result::UNSET) {
-    int64_t deadline = deadline_millis_.load(std::memory_order_relaxed);
-    if (deadline != 0 && absl::Now() >= absl::FromUnixMillis(deadline)) {
-      VLOG(1) << "Sandbox process hit timeout due to the walltime timer";
-      timed_out_ = true;
-      KillSandboxee();
+bool Monitor::InitEventLoop(sigset_t* sset) {
+  // SIGCHLD reports ptrace events, the pidfd the exit of the main process even
+  // if its SIGCHLD went to another thread, and the eventfd requests from other
+  // threads.
+  signal_fd_.reset(new file_util::fileops::FDCloser(
+      signalfd(-1, sset, SFD_CLOEXEC | SFD_NONBLOCK)));
+  epoll_fd_.reset(
+      new file_util::fileops::FDCloser(epoll_create1(EPOLL_CLOEXEC)));
+  if (signal_fd_->get() == -1 || epoll_fd_->get() == -1 || wakeup_fd_ == -1) {
+    PLOG(WARNING) << "Could not set up the event loop, using sigtimedwait()";
+    epoll_fd_.reset();
+    return false;
+  }
+  // pidfds need Linux 5.3, without them SIGCHLD and the periodic wake-up have
+  // to do. The ForkServer usually sent one along with the PID.
+  if (pid_fd_ == nullptr || pid_fd_->get() == -1) {
+    pid_fd_.reset(
+        new file_util::fileops::FDCloser(syscall(__NR_pidfd_open, pid_, 0)));
+  }
+  for (int fd : {signal_fd_->get(), wakeup_fd_, pid_fd_->get()}) {
+    if (fd == -1) {
+      continue;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_->get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+      PLOG(WARNING) << "epoll_ctl(EPOLL_CTL_ADD)";
+      epoll_fd_.reset();
+      return false;
     }
+  }
+  return true;
+}
 
-    if (!dump_stack_request_flag_.test_and_set(std::memory_order_relaxed)) {
-      should_dump_stack_ = true;
-      InterruptProcess(pid_);
+void Monitor::WaitForEvent(sigset_t* sset, absl::Duration timeout) {
+  timeout = std::max(timeout, absl::ZeroDuration());
+  if (!epoll_fd_) {
+    const timespec ts = absl::ToTimespec(timeout);
+    int signo = sigtimedwait(sset, nullptr, &ts);
+    LOG_IF(ERROR, signo != -1 && signo != SIGCHLD)
+        << "Unknown signal received: " << signo;
+    return;
+  }
+  constexpr int kMaxEvents = 3;
+  epoll_event events[kMaxEvents];
+  // Round up, so that deadlines are not polled for repeatedly.
+  int timeout_ms = absl::ToInt64Milliseconds(
+      timeout + absl::Milliseconds(1) - absl::Nanoseconds(1));
+  int num_events = epoll_wait(epoll_fd_->get(), events, kMaxEvents, timeout_ms);
+  if (num_events == -1 && errno != EINTR) {
+    PLOG(ERROR) << "epoll_wait()";
+  }
+  for (int i = 0; i < num_events; ++i) {
+    const int fd = events[i].data.fd;
+    if (fd == signal_fd_->get()) {
+      signalfd_siginfo info;
+      while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        LOG_IF(ERROR, info.ssi_signo != SIGCHLD)
+            << "Unknown signal received: " << info.ssi_signo;
+      }
+    } else if (fd == wakeup_fd_) {
+      uint64_t value;
+      if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        PLOG(ERROR) << "read(wakeup_fd)";
+      }
+    } else if (fd == pid_fd_->get()) {
+      // Stays readable once the process exited, it only needs to wake us up
+      // once.
+      epoll_ctl(epoll_fd_->get(), EPOLL_CTL_DEL, fd, nullptr);
     }
+  }
+}
 
-    if (!external_kill_request_flag_.test_and_set(std::memory_order_relaxed)) {
-      external_kill_ = true;
-      KillSandboxee();
+void Monitor::CheckDeadline() {
+  int64_t deadline = deadline_millis_.load(std::memory_order_relaxed);
+  if (deadline != 0 && absl::Now() >= absl::FromUnixMillis(deadline)) {
+    VLOG(1) << "Sandbox process hit timeout due to the walltime timer";
+    timed_out_ = true;
+    KillSandboxee();
+  }
+}
+
+void Monitor::CheckRequests() {
+  if (trap_decisions_) {
+    std::vector<TrapDecision> decided;
+    {
+      absl::MutexLock lock(&trap_decisions_->mutex);
+      decided.swap(trap_decisions_->decided);
     }
+    for (const TrapDecision& decision : decided) {
+      // Syscalls held up beyond the end are taken down with the sandboxee.
+      if (result_.final_status() != Result::UNSET) {
+        break;
+      }
+      ApplyTrapDecision(decision);
+    }
+  }
+
+  if (!dump_stack_request_flag_.test_and_set(std::memory_order_relaxed)) {
+    should_dump_stack_ = true;
+    InterruptProcess(pid_);
+  }
+
+  if (!external_kill_request_flag_.test_and_set(std::memory_order_relaxed)) {
+    external_kill_ = true;
+    KillSandboxee();
+  }
+
+  // Stack traces cannot be collected from libunwind or without namespaces,
+  // see ShouldCollectStackTrace().
+  if (stack_sampling_period_ == absl::ZeroDuration() ||
+      !IsActivelyMonitoring() || !policy_->GetNamespace() ||
+      executor_->libunwind_sbox_for_pid_ != 0) {
+    return;
+  }
+  const absl::Time now = absl::Now();
+  if (now < next_stack_sample_) {
+    return;
+  }
+  // Samples which are overdue are skipped rather than taken in a burst.
+  next_stack_sample_ = now + stack_sampling_period_;
+  std::vector<pid_t> tids;
+  if (lightweight_tracing_) {
+    tids.push_back(pid_);
+  } else {
+    std::vector<std::string> entries;
+    std::string error;
+    if (!file_util::fileops::ListDirectoryEntries(
+            absl::StrCat("/proc/", pid_, "/task"), &entries, &error)) {
+      VLOG(1) << "Could not list the threads of PID " << pid_ << ": " << error;
+      return;
+    }
+    for (const auto& entry : entries) {
+      pid_t tid;
+      if (absl::SimpleAtoi(entry, &tid)) {
+        tids.push_back(tid);
+      }
+    }
+  }
+  for (pid_t tid : tids) {
+    // Threads which have not stopped for the previous sample are skipped, the
+    // sample is taken in StateProcessStopped().
+    if (pending_stack_samples_.insert(tid).second &&
+        ptrace(PTRACE_INTERRUPT, tid, 0, 0) == -1) {
+      pending_stack_samples_.erase(tid);
+    }
+  }
+}
+
+absl::Duration Monitor::TimeToNextStackSample() const {
+  if (stack_sampling_period_ == absl::ZeroDuration()) {
+    return absl::InfiniteDuration();
+  }
+  return next_stack_sample_ - absl::Now();
+}
+
+absl::Duration Monitor::TimeToDeadline() const {
+  int64_t deadline = deadline_millis_.load(std::memory_order_relaxed);
+  if (deadline == 0) {
+    return absl::InfiniteDuration();
+  }
+  return absl::FromUnixMillis(deadline) - absl::Now();
+}
+
+void Monitor::ProcessStatus(pid_t pid, int status) {
+  VLOG(3) << "waitpid() returned with PID: " << pid << ", status: " << status;
+  metrics::IncrementCounter(metrics::kPtraceEvents);
+
+  if (WIFEXITED(status)) {
+    VLOG(1) << "PID: " << pid << " finished with code: " << WEXITSTATUS(status);
+    // That's the main process, set the exit code, and exit. It will kill
+    // all remaining processes (if there are any) because of the
+    // PTRACE_O_EXITKILL ptrace() flag.
+    if (pid == pid_) {
+      if (IsActivelyMonitoring()) {
+        SetExitStatusCode(Result::OK, WEXITSTATUS(status));
+      } else {
+        SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_MONITOR);
+      }
+      sandboxee_exited_ = true;
+    }
+  } else if (WIFSIGNALED(status)) {
+    //  This usually does not happen, but might.
+    //  Quote from the manual:
+    //   A SIGKILL signal may still cause a PTRACE_EVENT_EXIT stop before
+    //   actual signal death.  This may be changed in the future;
+    VLOG(1) << "PID: " << pid << " terminated with signal: "
+            << util::GetSignalName(WTERMSIG(status));
+    if (pid == pid_) {
+      if (external_kill_) {
+        SetExitStatusCode(Result::EXTERNAL_KILL, 0);
+      } else if (timed_out_) {
+        SetExitStatusCode(Result::TIMEOUT, 0);
+      } else {
+        SetExitStatusCode(Result::SIGNALED, WTERMSIG(status));
+      }
+      sandboxee_exited_ = true;
+    }
+  } else if (WIFSTOPPED(status)) {
+    VLOG(2) << "PID: " << pid
+            << " received signal: " << util::GetSignalName(WSTOPSIG(status))
+            << " with event: " << __WPTRACEEVENT(status);
+    StateProcessStopped(pid, status);
+  } else if (WIFCONTINUED(status)) {
+    VLOG(2) << "PID: " << pid << " is being continued";
+  }
+}
+
+bool Monitor::ProcessStatusWhileReaping(pid_t pid, int status) {
+  if (pid == pid_ && (WIFSIGNALED(status) || WIFEXITED(status))) {
+    sandboxee_exited_ = true;
+    return true;
+  }
+  if (WIFSTOPPED(status) && __WPTRACEEVENT(status) == PTRACE_EVENT_EXIT) {
+    VLOG(2) << "PID: " << pid << " PTRACE_EVENT_EXIT ";
+    ContinueProcess(pid, 0);
+  } else {
+    kill(pid_, SIGKILL);
+  }
+  return false;
+}
+
+void Monitor::MainLoop(sigset_t* sset) {
+  int status;
+  InitEventLoop(sset);
+  // All possible still running children of main process, will be killed due to
+  // PTRACE_O_EXITKILL ptrace() flag.
+  while (result_.final_status() == Result::UNSET) {
+    CheckDeadline();
+    CheckRequests();
+    ProcessUserNotifications();
 
     // It should be a non-blocking operation (hence WNOHANG), so this function
     // returns quickly if there are no events to be processed.
@@ -348,10 +927,11 @@ void Monitor::MainLoop(sigset_t* sset) {
     }
 
     if (ret == 0) {
-      constexpr timespec ts = {kWakeUpPeriodSec, kWakeUpPeriodNSec};
-      int signo = sigtimedwait(sset, nullptr, &ts);
-      LOG_IF(ERROR, signo != -1 && signo != SIGCHLD)
-          << "Unknown signal received: " << signo;
+      // Sleep until the next event. SIGCHLD is sent to the whole process and
+      // may be taken by another thread, so waitpid() is still polled at
+      // kWakeUpPeriod.
+      WaitForEvent(sset, std::min({kWakeUpPeriod, TimeToDeadline(),
+                                   TimeToNextStackSample()}));
       continue;
     }
 
@@ -366,53 +946,12 @@ void Monitor::MainLoop(sigset_t* sset) {
       continue;
     }
 
-    VLOG(3) << "waitpid() returned with PID: " << ret << ", status: " << status;
-
-    if (WIFEXITED(status)) {
-      VLOG(1) << "PID: " << ret
-              << " finished with code: " << WEXITSTATUS(status);
-      // That's the main process, set the exit code, and exit. It will kill
-      // all remaining processes (if there are any) because of the
-      // PTRACE_O_EXITKILL ptrace() flag.
-      if (ret == pid_) {
-        if (IsActivelyMonitoring()) {
-          SetExitStatusCode(Result::OK, WEXITSTATUS(status));
-        } else {
-          SetExitStatusCode(Result::SETUP_ERROR, Result::FAILED_MONITOR);
-        }
-        sandboxee_exited = true;
-      }
-    } else if (WIFSIGNALED(status)) {
-      //  This usually does not happen, but might.
-      //  Quote from the manual:
-      //   A SIGKILL signal may still cause a PTRACE_EVENT_EXIT stop before
-      //   actual signal death.  This may be changed in the future;
-      VLOG(1) << "PID: " << ret << " terminated with signal: "
-              << util::GetSignalName(WTERMSIG(status));
-      if (ret == pid_) {
-        if (external_kill_) {
-          SetExitStatusCode(Result::EXTERNAL_KILL, 0);
-        } else if (timed_out_) {
-          SetExitStatusCode(Result::TIMEOUT, 0);
-        } else {
-          SetExitStatusCode(Result::SIGNALED, WTERMSIG(status));
-        }
-        sandboxee_exited = true;
-      }
-    } else if (WIFSTOPPED(status)) {
-      VLOG(2) << "PID: " << ret
-              << " received signal: " << util::GetSignalName(WSTOPSIG(status))
-              << " with event: " << __WPTRACEEVENT(status);
-      StateProcessStopped(ret, status);
-    } else if (WIFCONTINUED(status)) {
-      VLOG(2) << "PID: " << ret << " is being continued";
-    }
+    ProcessStatus(ret, status);
   }
   // Try to make sure main pid is killed and reaped
-  if (!sandboxee_exited) {
-    kill(pid_, SIGKILL);
-    constexpr auto kGracefullExitTimeout = absl::Milliseconds(200);
-    auto deadline = absl::Now() + kGracefullExitTimeout;
+  if (!sandboxee_exited_) {
+    SendKill();
+    auto deadline = absl::Now() + kGracefulExitTimeout;
     for (;;) {
       auto left = deadline - absl::Now();
       if (absl::Now() >= deadline) {
@@ -430,21 +969,26 @@ void Monitor::MainLoop(sigset_t* sset) {
         PLOG(ERROR) << "waitpid() failed";
         break;
       }
-      if (ret == pid_ && (WIFSIGNALED(status) || WIFEXITED(status))) {
-        break;
-      }
       if (ret == 0) {
-        auto ts = absl::ToTimespec(left);
-        sigtimedwait(sset, nullptr, &ts);
-      } else if (WIFSTOPPED(status) &&
-                 __WPTRACEEVENT(status) == PTRACE_EVENT_EXIT) {
-        VLOG(2) << "PID: " << ret << " PTRACE_EVENT_EXIT ";
-        ContinueProcess(ret, 0);
-      } else {
-        kill(pid_, SIGKILL);
+        // The pidfd wakes us up as soon as the main process exited, even if
+        // its SIGCHLD went to another thread.
+        WaitForEvent(sset, std::min(left, kWakeUpPeriod));
+      } else if (ProcessStatusWhileReaping(ret, status)) {
+        break;
       }
     }
   }
+  if (lightweight_tracing_ && init_pid_ > 0) {
+    // PTRACE_O_EXITKILL only covers the traced main process. Taking down the
+    // init process kills everything else in its PID namespace.
+    VLOG(1) << "Sending SIGKILL to the init process: " << init_pid_;
+    if (kill(init_pid_, SIGKILL) == 0) {
+      TEMP_FAILURE_RETRY(waitpid(init_pid_, &status, __WALL));
+    } else {
+      PLOG(ERROR) << "Could not kill the init process " << init_pid_;
+    }
+    init_pid_ = 0;
+  }
 }
 
 bool Monitor::InitSetupSignals(sigset_t* sset) {
@@ -468,7 +1012,18 @@ bool Monitor::InitSetupSignals(sigset_t* sset) {
 }
 
 bool Monitor::InitSendPolicy() {
-  if (!policy_->SendPolicy(comms_)) {
+  // Without the initial execveat() there is no point at which the listener
+  // could be taken away from the sandboxee.
+  // Profiling needs the syscall stops of all threads.
+  lightweight_tracing_ =
+      !profile_syscalls_ && policy_->UsesLightweightTracing();
+  use_user_notify_ = policy_->user_notify_ &&
+                     executor_->enable_sandboxing_pre_execve_ &&
+                     UserNotifySupported();
+  Policy::Options options;
+  options.user_notify = use_user_notify_;
+  options.profile = profile_syscalls_;
+  if (!policy_->SendPolicy(comms_, options)) {
     LOG(ERROR) << "Couldn't send policy";
     return false;
   }
@@ -515,17 +1070,80 @@ bool Monitor::InitApplyLimits() {
          InitApplyLimit(pid_, RLIMIT_CPU, limits->rlimit_cpu()) &&
          InitApplyLimit(pid_, RLIMIT_FSIZE, limits->rlimit_fsize()) &&
          InitApplyLimit(pid_, RLIMIT_NOFILE, limits->rlimit_nofile()) &&
-         InitApplyLimit(pid_, RLIMIT_CORE, limits->rlimit_core());
+         InitApplyLimit(pid_, RLIMIT_CORE, limits->rlimit_core()) &&
+         InitCgroupProcess();
+}
+
+bool Monitor::InitCgroup() {
+  const Limits& limits = *executor_->limits();
+  if (limits.cgroup_parent().empty()) {
+    return true;
+  }
+  // The PID is not known yet.
+  static std::atomic<uint64_t> cgroup_counter{0};
+  auto cgroup_or = Cgroup::Create(
+      limits.cgroup_parent(),
+      absl::StrCat("sandbox2-", getpid(), "-", cgroup_counter.fetch_add(1)));
+  if (!cgroup_or.ok()) {
+    LOG(ERROR) << cgroup_or.status();
+    return false;
+  }
+  cgroup_ = std::move(cgroup_or).ValueOrDie();
+  cgroup_path_ = cgroup_->path();
+  auto status = cgroup_->ApplyLimits(limits);
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return false;
+  }
+  return true;
+}
+
+bool Monitor::InitCgroupProcess() {
+  if (!cgroup_ || started_in_cgroup_) {
+    return true;
+  }
+  // Parked children and kernels before Linux 5.7 start outside of the cgroup.
+  // The sandboxee is still waiting for the go-ahead, so all it runs from now
+  // on is accounted for.
+  auto status = cgroup_->AddProcess(pid_);
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return false;
+  }
+  return true;
 }
 
 bool Monitor::InitSendIPC() { return ipc_->SendFdsOverComms(); }
 
 bool Monitor::WaitForSandboxReady() {
+  // The ready signal may be preceded by the start-up times of the sandboxee.
+  uint32_t tag;
+  std::vector<uint8_t> value;
+  if (!comms_->RecvTLV(&tag, &value)) {
+    LOG(ERROR) << "Couldn't receive 'Client::kClient2SandboxReady' message";
+    return false;
+  }
+  if (tag == Comms::kTagBytes) {
+    SandboxeeStartupTimes times;
+    if (value.size() == sizeof(times)) {
+      memcpy(&times, value.data(), sizeof(times));
+      Result::StartupTimes* startup_times = result_.MutableStartupTimes();
+      startup_times->clone = MonotonicNanosToTime(times.clone);
+      startup_times->sanitization = MonotonicNanosToTime(times.sanitization);
+      startup_times->namespaces = MonotonicNanosToTime(times.namespaces);
+      startup_times->mounts = MonotonicNanosToTime(times.mounts);
+    }
+    if (!comms_->RecvTLV(&tag, &value)) {
+      LOG(ERROR) << "Couldn't receive 'Client::kClient2SandboxReady' message";
+      return false;
+    }
+  }
   uint32_t tmp;
-  if (!comms_->RecvUint32(&tmp)) {
+  if (tag != Comms::kTagUint32 || value.size() != sizeof(tmp)) {
     LOG(ERROR) << "Couldn't receive 'Client::kClient2SandboxReady' message";
     return false;
   }
+  memcpy(&tmp, value.data(), sizeof(tmp));
   if (tmp != Client::kClient2SandboxReady) {
     LOG(ERROR) << "Received " << tmp << " != Client::kClient2SandboxReady ("
                << Client::kClient2SandboxReady << ")";
@@ -558,11 +1176,19 @@ bool Monitor::InitPtraceAttach() {
       PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
       PTRACE_O_TRACEVFORKDONE | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
       PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_EXITKILL;
+  if (lightweight_tracing_) {
+    // The main thread is still traced for the initial execveat(), its exit
+    // status and signals. Threads and children it creates stay untraced.
+    ptrace_opts &= ~(PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                     PTRACE_O_TRACEVFORKDONE | PTRACE_O_TRACECLONE);
+  }
 
   bool main_pid_found = false;
   for (auto task : tasks) {
     if (task == pid_) {
       main_pid_found = true;
+    } else if (lightweight_tracing_) {
+      continue;
     }
 
     // In some situations we allow ptrace to try again when it fails.
@@ -572,6 +1198,9 @@ bool Monitor::InitPtraceAttach() {
     while (absl::Now() < deadline) {
       int ret = ptrace(PTRACE_SEIZE, task, 0, ptrace_opts);
       if (ret == 0) {
+        if (pooled_) {
+          new_tracees_.push_back(task);
+        }
         ptrace_succeeded = true;
         break;
       }
@@ -655,41 +1284,152 @@ bool Monitor::InitPtraceAttach() {
   return true;
 }
 
+bool Monitor::IsTracedSyscallPermitted(const Syscall& syscall,
+                                       bool notify_permitted) {
+  // Notify can decide whether we want to allow this syscall. It could be useful
+  // for sandbox setups in which some syscalls might still need some logging,
+  // but nonetheless be allowed ('permissible syscalls' in sandbox v1).
+  if (notify_permitted) {
+    if (audit_log_) {
+      audit_log_->Add(AuditLog::kPermitted, syscall);
+      return true;
+    }
+    LOG(WARNING) << "[PERMITTED]: SYSCALL ::: PID: " << syscall.pid()
+                 << ", PROG: '" << util::GetProgName(syscall.pid())
+                 << "' : " << syscall.GetDescription();
+    return true;
+  }
+
+  // TODO(wiktorg): Further clean that up, probably while doing monitor cleanup
+  // log_file_ not null iff FLAGS_sandbox2_danger_danger_permit_all_and_log is
+  // set.
+  if (log_file_) {
+    if (audit_log_) {
+      audit_log_->Add(AuditLog::kLogged, syscall);
+    } else {
+      std::string syscall_description = syscall.GetDescription();
+      PCHECK(absl::FPrintF(log_file_, "PID: %d %s\n", syscall.pid(),
+                           syscall_description) >= 0);
+    }
+    syscall_trace_.Add(syscall);
+    return true;
+  }
+
+  return absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all);
+}
+
+void Monitor::RequestTrapDecision(const Syscall& syscall, bool user_notify,
+                                  uint64_t user_notify_id) {
+  std::shared_ptr<TrapDecisions> decisions = trap_decisions_;
+  TrapDecision decision{syscall, user_notify, user_notify_id,
+                        /*permitted=*/false};
+  notify_->EventSyscallTrapAsync(
+      syscall, [decisions, decision](bool permitted) mutable {
+        decision.permitted = permitted;
+        absl::MutexLock lock(&decisions->mutex);
+        if (decisions->monitor) {
+          decisions->decided.push_back(decision);
+          decisions->monitor->WakeUp();
+        }
+      });
+}
+
+void Monitor::ApplyTrapDecision(const TrapDecision& decision) {
+  const bool permitted =
+      IsTracedSyscallPermitted(decision.syscall, decision.permitted);
+  if (decision.user_notify) {
+    RespondToUserNotification(decision.user_notify_id, decision.syscall,
+                              permitted);
+    return;
+  }
+  if (permitted) {
+    ContinueProcess(decision.syscall.pid(), 0);
+    return;
+  }
+  Regs regs(decision.syscall.pid());
+  ActionProcessSyscallViolation(&regs, decision.syscall, kSyscallViolation);
+}
+
+void Monitor::DispatchNotifyEvent(std::function<void()> event) {
+  if (!notify_->IsAsync()) {
+    event();
+    return;
+  }
+  absl::MutexLock lock(&notify_mutex_);
+  notify_events_.push_back(std::move(event));
+  if (notify_thread_.joinable()) {
+    return;
+  }
+  notify_thread_ = std::thread([this] {
+    for (;;) {
+      std::function<void()> next;
+      {
+        absl::MutexLock lock(&notify_mutex_);
+        notify_mutex_.Await(absl::Condition(
+            +[](Monitor* monitor) {
+              monitor->notify_mutex_.AssertHeld();
+              return !monitor->notify_events_.empty() ||
+                     monitor->notify_events_done_;
+            },
+            this));
+        if (notify_events_.empty()) {
+          return;
+        }
+        next = std::move(notify_events_.front());
+        notify_events_.pop_front();
+      }
+      next();
+    }
+  });
+}
+
+void Monitor::FinishNotifyEvents() {
+  if (!notify_thread_.joinable()) {
+    return;
+  }
+  {
+    absl::MutexLock lock(&notify_mutex_);
+    notify_events_done_ = true;
+  }
+  notify_thread_.join();
+}
+
 void Monitor::ActionProcessSyscall(Regs* regs, const Syscall& syscall) {
   // If the sandboxing is not enabled yet, allow the first __NR_execveat.
   if (syscall.nr() == __NR_execveat && !IsActivelyMonitoring()) {
+    result_.MutableStartupTimes()->execve = absl::Now();
     VLOG(1) << "[PERMITTED/BEFORE_EXECVEAT]: "
             << "SYSCALL ::: PID: " << regs->pid() << ", PROG: '"
             << util::GetProgName(regs->pid())
             << "' : " << syscall.GetDescription();
+    if (use_user_notify_ && !user_notify_fd_ &&
+        !AcquireUserNotifyFd(regs->pid())) {
+      SetExitStatusCode(Result::INTERNAL_ERROR, Result::FAILED_FETCH);
+      return;
+    }
     ContinueProcess(regs->pid(), 0);
     return;
   }
 
-  // Notify can decide whether we want to allow this syscall. It could be useful
-  // for sandbox setups in which some syscalls might still need some logging,
-  // but nonetheless be allowed ('permissible syscalls' in sandbox v1).
-  if (notify_->EventSyscallTrap(syscall)) {
-    LOG(WARNING) << "[PERMITTED]: SYSCALL ::: PID: " << regs->pid()
-                 << ", PROG: '" << util::GetProgName(regs->pid())
-                 << "' : " << syscall.GetDescription();
-
+  if (policy_->user_notify_network_proxy_ && syscall.nr() == __NR_connect) {
+    // Without seccomp user notifications there is no way to hand over the
+    // socket.
+    LOG(WARNING) << "connect() cannot be proxied without seccomp user "
+                    "notifications, failing it";
+    auto status = regs->SkipSyscallReturnValue(-ENOSYS);
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+    }
     ContinueProcess(regs->pid(), 0);
     return;
   }
 
-  // TODO(wiktorg): Further clean that up, probably while doing monitor cleanup
-  // log_file_ not null iff FLAGS_sandbox2_danger_danger_permit_all_and_log is
-  // set.
-  if (log_file_) {
-    std::string syscall_description = syscall.GetDescription();
-    PCHECK(absl::FPrintF(log_file_, "PID: %d %s\n", regs->pid(),
-                         syscall_description) >= 0);
-    ContinueProcess(regs->pid(), 0);
+  if (notify_->IsAsync()) {
+    // The thread stays stopped until the decision, see CheckRequests().
+    RequestTrapDecision(syscall, /*user_notify=*/false, /*user_notify_id=*/0);
     return;
   }
-
-  if (absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all)) {
+  if (IsTracedSyscallPermitted(syscall, notify_->EventSyscallTrap(syscall))) {
     ContinueProcess(regs->pid(), 0);
     return;
   }
@@ -697,12 +1437,222 @@ void Monitor::ActionProcessSyscall(Regs* regs, const Syscall& syscall) {
   ActionProcessSyscallViolation(regs, syscall, kSyscallViolation);
 }
 
+bool Monitor::AcquireUserNotifyFd(pid_t pid) {
+  // The listener is created with O_CLOEXEC, this is the last moment before the
+  // sandboxee loses it.
+  const std::string fd_dir = absl::StrCat("/proc/", pid, "/fd");
+  std::vector<std::string> entries;
+  std::string error;
+  if (!file_util::fileops::ListDirectoryEntries(fd_dir, &entries, &error)) {
+    LOG(ERROR) << "Could not list " << fd_dir << ": " << error;
+    return false;
+  }
+  int listener = -1;
+  for (const auto& entry : entries) {
+    if (file_util::fileops::ReadLink(absl::StrCat(fd_dir, "/", entry)) ==
+        "anon_inode:seccomp notify") {
+      listener = std::stoi(entry);
+      break;
+    }
+  }
+  if (listener == -1) {
+    // The kernel lacks SECCOMP_FILTER_FLAG_TSYNC_ESRCH, the client fell back to
+    // SECCOMP_RET_TRACE.
+    VLOG(1) << "No seccomp user notification listener, using ptrace";
+    use_user_notify_ = false;
+    return true;
+  }
+
+  file_util::fileops::FDCloser pid_fd(syscall(__NR_pidfd_open, pid, 0));
+  if (pid_fd.get() == -1) {
+    PLOG(ERROR) << "pidfd_open(" << pid << ")";
+    return false;
+  }
+  user_notify_fd_ = absl::make_unique<file_util::fileops::FDCloser>(
+      syscall(__NR_pidfd_getfd, pid_fd.get(), listener, 0));
+  if (user_notify_fd_->get() == -1) {
+    PLOG(ERROR) << "pidfd_getfd(" << pid << ", " << listener << ")";
+    user_notify_fd_.reset();
+    return false;
+  }
+  if (!pooled_ && epoll_fd_) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = user_notify_fd_->get();
+    PLOG_IF(WARNING, epoll_ctl(epoll_fd_->get(), EPOLL_CTL_ADD,
+                               user_notify_fd_->get(), &event) == -1)
+        << "epoll_ctl(EPOLL_CTL_ADD)";
+  }
+  if (policy_->user_notify_network_proxy_) {
+    StartNetworkProxy();
+  }
+  return true;
+}
+
+void Monitor::StartNetworkProxy() {
+  auto network_proxy = absl::make_unique<NetworkProxyServer>(-1);
+  if (!network_proxy->SetUserNotifyFd(user_notify_fd_->get())) {
+    // connect() fails with ENOSYS then.
+    return;
+  }
+  network_proxy_ = std::move(network_proxy);
+  NetworkProxyServer* server = network_proxy_.get();
+  network_proxy_thread_ = std::thread([server] { server->Run(); });
+}
+
+void Monitor::ProxyConnect(const seccomp_notif& req, const Syscall& syscall) {
+  const int sockfd = static_cast<int>(syscall.args()[0]);
+  const socklen_t addrlen = static_cast<socklen_t>(syscall.args()[2]);
+
+  int error = 0;
+  std::vector<uint8_t> addr(
+      std::min<size_t>(addrlen, sizeof(struct sockaddr_storage)));
+  iovec local = {addr.data(), addr.size()};
+  iovec remote = {reinterpret_cast<void*>(syscall.args()[1]), addr.size()};
+  if (!network_proxy_) {
+    error = ENOSYS;
+  } else if (process_vm_readv(req.pid, &local, 1, &remote, 1, 0) !=
+             static_cast<ssize_t>(addr.size())) {
+    error = EFAULT;
+  } else if (!IsStreamSocket(req.pid, sockfd)) {
+    // Same as NetworkProxyClient::Connect().
+    error = EINVAL;
+  }
+  // The memory read was the notifying process' only if the notification is
+  // still pending.
+  uint64_t id = req.id;
+  if (ioctl(user_notify_fd_->get(), SECCOMP_IOCTL_NOTIF_ID_VALID, &id) == -1) {
+    VLOG(1) << "PID: " << req.pid << " is gone, dropping its notification";
+    return;
+  }
+  if (error == 0) {
+    network_proxy_->ConnectForNotification(req.id, sockfd, std::move(addr));
+    return;
+  }
+  seccomp_notif_resp resp;
+  memset(&resp, 0, sizeof(resp));
+  resp.id = req.id;
+  resp.error = -error;
+  if (ioctl(user_notify_fd_->get(), SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1 &&
+      errno != ENOENT) {
+    PLOG(ERROR) << "ioctl(SECCOMP_IOCTL_NOTIF_SEND)";
+  }
+}
+
+void Monitor::ProcessUserNotifications() {
+  while (user_notify_fd_ && result_.final_status() == Result::UNSET) {
+    pollfd pfd{user_notify_fd_->get(), POLLIN, 0};
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, 0));
+    if (ret == -1) {
+      PLOG(ERROR) << "poll(user_notify_fd)";
+      return;
+    }
+    if (ret == 0) {
+      return;
+    }
+    if (!(pfd.revents & POLLIN)) {
+      // All processes using the filter are gone. Closing the fd also removes
+      // it from the event loop.
+      user_notify_fd_.reset();
+      return;
+    }
+
+    seccomp_notif req;
+    memset(&req, 0, sizeof(req));
+    if (ioctl(user_notify_fd_->get(), SECCOMP_IOCTL_NOTIF_RECV, &req) == -1) {
+      if (errno == ENOENT || errno == EINTR) {
+        // The process died or its syscall was interrupted in the meantime.
+        continue;
+      }
+      PLOG(ERROR) << "ioctl(SECCOMP_IOCTL_NOTIF_RECV)";
+      SetExitStatusCode(Result::INTERNAL_ERROR, Result::FAILED_FETCH);
+      return;
+    }
+    EventUserNotification(req);
+  }
+}
+
+void Monitor::EventUserNotification(const seccomp_notif& req) {
+  // Architecture switches are reported via ptrace by the default policy.
+  Syscall::Args args;
+  std::copy(std::begin(req.data.args), std::end(req.data.args), args.begin());
+  Syscall syscall(Syscall::GetHostArch(), req.data.nr, args, req.pid,
+                  /*sp=*/0, req.data.instruction_pointer);
+  VLOG(2) << "PID: " << req.pid << " user notification: "
+          << syscall.GetDescription();
+  if (policy_->user_notify_network_proxy_ && syscall.nr() == __NR_connect) {
+    ProxyConnect(req, syscall);
+    return;
+  }
+  if (policy_->file_broker_ && IsOpenSyscall(syscall.nr()) &&
+      policy_->file_broker_->AnswerOpen(user_notify_fd_->get(), req)) {
+    return;
+  }
+
+  if (notify_->IsAsync()) {
+    RequestTrapDecision(syscall, /*user_notify=*/true, req.id);
+    return;
+  }
+  RespondToUserNotification(
+      req.id, syscall,
+      IsTracedSyscallPermitted(syscall, notify_->EventSyscallTrap(syscall)));
+}
+
+void Monitor::RespondToUserNotification(uint64_t id, const Syscall& syscall,
+                                        bool permitted) {
+  // All processes using the filter may be gone by the time of the decision.
+  if (!user_notify_fd_) {
+    return;
+  }
+  // The process may have died and its PID been reused while Notify looked at
+  // it.
+  uint64_t valid_id = id;
+  if (ioctl(user_notify_fd_->get(), SECCOMP_IOCTL_NOTIF_ID_VALID, &valid_id) ==
+      -1) {
+    VLOG(1) << "PID: " << syscall.pid()
+            << " is gone, dropping its notification";
+    return;
+  }
+
+  seccomp_notif_resp resp;
+  memset(&resp, 0, sizeof(resp));
+  resp.id = id;
+  if (permitted) {
+    resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+  } else {
+    LogSyscallViolation(syscall);
+    DispatchNotifyEvent([this, syscall] {
+      notify_->EventSyscallViolation(syscall, kSyscallViolation);
+    });
+    SetExitStatusCode(Result::VIOLATION, syscall.nr());
+    result_.SetSyscall(absl::make_unique<Syscall>(syscall));
+    result_.SetProgName(util::GetProgName(syscall.pid()));
+    result_.SetProcMaps(ReadProcMaps(pid_));
+    LOG(INFO) << "No stack trace for violations reported via user "
+                 "notifications";
+    // The process will be killed anyway so this is just a precaution.
+    resp.error = -ENOSYS;
+  }
+  if (ioctl(user_notify_fd_->get(), SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1 &&
+      errno != ENOENT) {
+    PLOG(ERROR) << "ioctl(SECCOMP_IOCTL_NOTIF_SEND)";
+  }
+}
+
 void Monitor::ActionProcessSyscallViolation(Regs* regs, const Syscall& syscall,
                                             ViolationType violation_type) {
   LogSyscallViolation(syscall);
-  notify_->EventSyscallViolation(syscall, violation_type);
+  DispatchNotifyEvent([this, syscall, violation_type] {
+    notify_->EventSyscallViolation(syscall, violation_type);
+  });
   SetExitStatusCode(Result::VIOLATION, syscall.nr());
   result_.SetSyscall(absl::make_unique<Syscall>(syscall));
+  if (!regs->HasAllRegisters()) {
+    auto status = regs->Fetch();
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+    }
+  }
   SetAdditionalResultInfo(absl::make_unique<Regs>(*regs));
   // Rewrite the syscall argument to something invalid (-1).
   // The process will be killed anyway so this is just a precaution.
@@ -720,6 +1670,11 @@ void Monitor::LogSyscallViolation(const Syscall& syscall) const {
     return;
   }
 
+  // Violations end the sandboxee, their description is logged regardless.
+  if (audit_log_) {
+    audit_log_->Add(AuditLog::kViolation, syscall);
+  }
+
   // So, this is an invalid syscall. Will be killed by seccomp-bpf policies as
   // well, but we should be on a safe side here as well.
   LOG(ERROR) << "SANDBOX VIOLATION : PID: " << syscall.pid() << ", PROG: '"
@@ -732,9 +1687,12 @@ void Monitor::LogSyscallViolation(const Syscall& syscall) const {
 void Monitor::EventPtraceSeccomp(pid_t pid, int event_msg) {
   // If the seccomp-policy is using RET_TRACE, we request that it returns the
   // syscall architecture identifier in the SECCOMP_RET_DATA.
-  const auto syscall_arch = static_cast<Syscall::CpuArch>(event_msg);
+  const bool profiled = event_msg & internal::kProfileTraceFlag;
+  const auto syscall_arch =
+      static_cast<Syscall::CpuArch>(event_msg & ~internal::kProfileTraceFlag);
+  // Only violations need all registers, see ActionProcessSyscallViolation().
   Regs regs(pid);
-  auto status = regs.Fetch();
+  auto status = regs.FetchSyscall();
   if (!status.ok()) {
     LOG(ERROR) << status;
     SetExitStatusCode(Result::INTERNAL_ERROR, Result::FAILED_FETCH);
@@ -749,19 +1707,71 @@ void Monitor::EventPtraceSeccomp(pid_t pid, int event_msg) {
     return;
   }
 
+  if (profiled) {
+    ProfileSyscallEntry(syscall);
+    return;
+  }
   ActionProcessSyscall(&regs, syscall);
 }
 
+void Monitor::ProfileSyscallEntry(const Syscall& syscall) {
+  Result::SyscallStats& stats =
+      (*result_.MutableSyscallProfile())[syscall.nr()];
+  ++stats.count;
+  const uint64_t first_arg = syscall.args()[0];
+  auto it = stats.first_args.find(first_arg);
+  if (it != stats.first_args.end()) {
+    ++it->second;
+  } else if (stats.first_args.size() < Result::kMaxFirstArgBuckets) {
+    stats.first_args[first_arg] = 1;
+  } else {
+    ++stats.other_first_args;
+  }
+  profiled_syscalls_[syscall.pid()] = {syscall.nr(), absl::Now()};
+  ContinueProcessToSyscall(syscall.pid());
+}
+
+bool Monitor::ProfileSyscallExit(pid_t pid) {
+  auto it = profiled_syscalls_.find(pid);
+  if (it == profiled_syscalls_.end()) {
+    return false;
+  }
+  const absl::Duration time = absl::Now() - it->second.second;
+  Result::SyscallStats& stats =
+      (*result_.MutableSyscallProfile())[it->second.first];
+  stats.total_time += time;
+  stats.max_time = std::max(stats.max_time, time);
+  profiled_syscalls_.erase(it);
+  ContinueProcess(pid, 0);
+  return true;
+}
+
 void Monitor::EventPtraceExec(pid_t pid, int event_msg) {
+  // Neither a profiled execve() nor the one of another thread, which took over
+  // its PID, stops at their exit.
+  profiled_syscalls_.erase(pid);
+  profiled_syscalls_.erase(event_msg);
+  // Neither might stop for a pending stack sample anymore.
+  pending_stack_samples_.erase(pid);
+  pending_stack_samples_.erase(event_msg);
   if (!IsActivelyMonitoring()) {
     VLOG(1) << "PTRACE_EVENT_EXEC seen from PID: " << event_msg
             << ". SANDBOX ENABLED!";
     SetActivelyMonitoring();
+    if (pid == pid_) {
+      // Catch the first syscall: the next syscall stop is the exit from
+      // execve(), the one after that the entry to the first syscall.
+      syscall_stops_to_first_syscall_ = 2;
+      ContinueProcessToSyscall(pid);
+      return;
+    }
   }
   ContinueProcess(pid, 0);
 }
 
 void Monitor::EventPtraceExit(pid_t pid, int event_msg) {
+  profiled_syscalls_.erase(pid);
+  pending_stack_samples_.erase(pid);
   // A regular exit, let it continue (fast-path).
   if (WIFEXITED(event_msg)) {
     ContinueProcess(pid, 0);
@@ -778,6 +1788,22 @@ void Monitor::EventPtraceExit(pid_t pid, int event_msg) {
   }
 
   // Process signaled due to seccomp violation.
+  if (WIFSIGNALED(event_msg) && WTERMSIG(event_msg) == SIGSYS &&
+      lightweight_tracing_) {
+    // Any of the untraced threads may have been the one violating the policy,
+    // the registers of the main thread tell nothing.
+    LOG(ERROR) << "SANDBOX VIOLATION : PID: " << pid << ", PROG: '"
+               << util::GetProgName(pid)
+               << "' : unknown syscall, only the main thread is traced";
+    Syscall syscall(pid);
+    DispatchNotifyEvent([this, syscall] {
+      notify_->EventSyscallViolation(syscall, kSyscallViolation);
+    });
+    SetExitStatusCode(Result::VIOLATION, syscall.nr());
+    result_.SetSyscall(absl::make_unique<Syscall>(syscall));
+    SetAdditionalResultInfo(std::move(regs));
+    return;
+  }
   if (WIFSIGNALED(event_msg) && WTERMSIG(event_msg) == SIGSYS) {
     VLOG(1) << "PID: " << pid << " violation uncovered via the EXIT_EVENT";
     ActionProcessSyscallViolation(
@@ -820,11 +1846,28 @@ void Monitor::EventPtraceStop(pid_t pid, int stopsig) {
 
 void Monitor::StateProcessStopped(pid_t pid, int status) {
   int stopsig = WSTOPSIG(status);
+  // Syscall stops (with PTRACE_O_TRACESYSGOOD) are only requested to record
+  // the first syscall after execve(), and for the exits of profiled syscalls.
+  if (stopsig == (SIGTRAP | 0x80) && __WPTRACEEVENT(status) == 0) {
+    if (ProfileSyscallExit(pid)) {
+      return;
+    }
+    if (pid == pid_ && --syscall_stops_to_first_syscall_ > 0) {
+      ContinueProcessToSyscall(pid);
+      return;
+    }
+    if (pid == pid_ && syscall_stops_to_first_syscall_ == 0) {
+      result_.MutableStartupTimes()->first_syscall = absl::Now();
+    }
+    ContinueProcess(pid, 0);
+    return;
+  }
   if (__WPTRACEEVENT(status) == 0) {
     // Must be a regular signal delivery.
     VLOG(2) << "PID: " << pid
             << " received signal: " << util::GetSignalName(stopsig);
-    notify_->EventSignal(pid, stopsig);
+    DispatchNotifyEvent(
+        [this, pid, stopsig] { notify_->EventSignal(pid, stopsig); });
     ContinueProcess(pid, stopsig);
     return;
   }
@@ -849,13 +1892,18 @@ void Monitor::StateProcessStopped(pid_t pid, int status) {
     auto status = regs.Fetch();
     if (status.ok()) {
       VLOG(0) << "SANDBOX STACK : PID: " << pid << ", ["
-              << GetStackTrace(&regs, policy_->GetNamespace()->mounts()) << "]";
+              << GetStackTraceCollector()->Collect(&regs) << "]";
     } else {
       LOG(WARNING) << "FAILED TO GET SANDBOX STACK : " << status;
     }
     should_dump_stack_ = false;
   }
 
+  if (ABSL_PREDICT_FALSE(!pending_stack_samples_.empty()) &&
+      pending_stack_samples_.erase(pid) != 0) {
+    TakeStackSample(pid);
+  }
+
 #if !defined(PTRACE_EVENT_STOP)
 #define PTRACE_EVENT_STOP 128
 #endif
@@ -866,7 +1914,12 @@ void Monitor::StateProcessStopped(pid_t pid, int status) {
     case PTRACE_EVENT_VFORK:
       /* fall through */
     case PTRACE_EVENT_CLONE:
-      /* fall through */
+      if (pooled_) {
+        // The new tracee is automatically attached to the pool thread.
+        new_tracees_.push_back(event_msg);
+      }
+      ContinueProcess(pid, 0);
+      break;
     case PTRACE_EVENT_VFORK_DONE:
       ContinueProcess(pid, 0);
       break;
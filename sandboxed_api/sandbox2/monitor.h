@@ -18,6 +18,7 @@
 #ifndef SANDBOXED_API_SANDBOX2_MONITOR_H_
 #define SANDBOXED_API_SANDBOX2_MONITOR_H_
 
+#include <linux/seccomp.h>
 #include <sys/resource.h>
 
 #include <atomic>
@@ -25,17 +26,32 @@
 #include <cstdint>
 #include <cstdio>
 #include <ctime>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/audit_log.h"
+#include "sandboxed_api/sandbox2/cgroup.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/ipc.h"
+#include "sandboxed_api/sandbox2/network_proxy_server.h"
 #include "sandboxed_api/sandbox2/notify.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/regs.h"
 #include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/stack_trace.h"
 #include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/syscall_trace.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
 
 namespace sandbox2 {
 
@@ -50,15 +66,55 @@ class Monitor final {
   ~Monitor();
 
  private:
+  friend class MonitorPool;
   friend class Sandbox2;
 
-  // Timeout used with sigtimedwait (0.5s).
-  static const int kWakeUpPeriodSec = 0L;
-  static const int kWakeUpPeriodNSec = (500L * 1000L * 1000L);
+  // A traced syscall decided by Notify::EventSyscallTrapAsync().
+  struct TrapDecision {
+    Syscall syscall;
+    // Whether the syscall came as the seccomp user notification
+    // 'user_notify_id' rather than as a ptrace stop.
+    bool user_notify;
+    uint64_t user_notify_id;
+    bool permitted;
+  };
+
+  // Decisions handed back by the continuations of
+  // Notify::EventSyscallTrapAsync(), which may outlive the Monitor.
+  struct TrapDecisions {
+    absl::Mutex mutex;
+    std::vector<TrapDecision> decided GUARDED_BY(mutex);
+    // Woken up for each decision, nullptr once the Monitor is gone.
+    Monitor* monitor GUARDED_BY(mutex) = nullptr;
+  };
+
+  // Longest time the main loop sleeps without an event.
+  static constexpr absl::Duration kWakeUpPeriod = absl::Milliseconds(500);
+  // How long a killed sandboxee is waited for before giving up on it.
+  static constexpr absl::Duration kGracefulExitTimeout =
+      absl::Milliseconds(200);
 
   // Starts the Monitor.
   void Run();
 
+  // Starts the sandboxee and attaches to it. Sets the exit status on failure.
+  // Returns success/failure status.
+  bool SetUpSandboxee();
+
+  // Reports the result and marks the Monitor as done. The Monitor may be
+  // destroyed by the Sandbox2 object right after.
+  void Finish();
+
+  // Wakes up the main loop, e.g. after a kill request. Thread-safe.
+  void WakeUp();
+
+  // Sets up the epoll instance the main loop sleeps on. Returns false if the
+  // loop has to fall back to sigtimedwait().
+  bool InitEventLoop(sigset_t* sset);
+
+  // Sleeps until an event arrives or 'timeout' expired.
+  void WaitForEvent(sigset_t* sset, absl::Duration timeout);
+
   // Getters for private fields.
   bool IsDone() const { return done_notification_.HasBeenNotified(); }
 
@@ -90,13 +146,47 @@ class Monitor final {
   // Applies limits on the sandboxee.
   bool InitApplyLimits();
 
+  // Creates the cgroup of the sandboxee and applies its limits, if
+  // Limits::cgroup_parent() is set. Called before the sandboxee is started, so
+  // that it can start in the cgroup.
+  bool InitCgroup();
+
+  // Moves the sandboxee into its cgroup, unless it started there.
+  bool InitCgroupProcess();
+
   // Applies individual limit on the sandboxee.
   bool InitApplyLimit(pid_t pid, __rlimit_resource resource,
                       const rlimit64& rlim) const;
 
-  // Kills the main traced PID with PTRACE_KILL.
+  // Kills the sandboxee, see SendKill().
   void KillSandboxee();
 
+  // Sends SIGKILL to the sandboxee. All of its processes are killed at once if
+  // it has a cgroup, otherwise its main process through its pidfd if there is
+  // one. Returns whether sending the signal succeeded.
+  bool SendKill();
+
+  // Kills the sandboxee if the wall time limit has been reached.
+  void CheckDeadline();
+
+  // Handles stack dump and kill requests and the decisions of an asynchronous
+  // Notify, and interrupts the threads of the sandboxee for the next stack
+  // sample when it is due.
+  void CheckRequests();
+
+  // Time left until the wall time limit, infinite if there is none.
+  absl::Duration TimeToDeadline() const;
+
+  // Time left until the next stack sample, infinite if stacks are not sampled.
+  absl::Duration TimeToNextStackSample() const;
+
+  // Handles a status of a traced process as returned by waitpid().
+  void ProcessStatus(pid_t pid, int status);
+
+  // Handles a status of a traced process after the sandboxee was killed.
+  // Returns true once the main process has been reaped.
+  bool ProcessStatusWhileReaping(pid_t pid, int status);
+
   // Waits for events from monitored clients and signals from the main process.
   void MainLoop(sigset_t* sset);
 
@@ -110,6 +200,49 @@ class Monitor final {
   // PID called a traced syscall, or was killed due to syscall.
   void ActionProcessSyscall(Regs* regs, const Syscall& syscall);
 
+  // Whether a syscall traced by the policy may proceed, given whether Notify
+  // permitted it.
+  bool IsTracedSyscallPermitted(const Syscall& syscall, bool notify_permitted);
+
+  // Asks the asynchronous Notify about a traced syscall, which is held until
+  // the decision arrives in CheckRequests().
+  void RequestTrapDecision(const Syscall& syscall, bool user_notify,
+                           uint64_t user_notify_id);
+
+  // Lets a traced syscall held for Notify proceed, or reports the violation.
+  void ApplyTrapDecision(const TrapDecision& decision);
+
+  // Runs 'event', a call of Notify, on notify_thread_ if Notify::IsAsync(),
+  // right away otherwise.
+  void DispatchNotifyEvent(std::function<void()> event);
+
+  // Waits for the events passed to DispatchNotifyEvent() to be handled, and
+  // stops notify_thread_.
+  void FinishNotifyEvents();
+
+  // Takes the seccomp user notification listener from the sandboxee 'pid',
+  // stopped at its initial execveat(). Returns success/failure status.
+  bool AcquireUserNotifyFd(pid_t pid);
+
+  // Answers all pending seccomp user notifications.
+  void ProcessUserNotifications();
+
+  // Answers a seccomp user notification, a traced syscall of the sandboxee.
+  void EventUserNotification(const seccomp_notif& req);
+
+  // Allows the syscall of the seccomp user notification 'id', or fails it and
+  // reports the violation.
+  void RespondToUserNotification(uint64_t id, const Syscall& syscall,
+                                 bool permitted);
+
+  // Starts network_proxy_, which connects sockets for connect() user
+  // notifications.
+  void StartNetworkProxy();
+
+  // Hands the connect() of the user notification 'req' over to
+  // network_proxy_, or fails it.
+  void ProxyConnect(const seccomp_notif& req, const Syscall& syscall);
+
   // Sets basic info status and reason code in the result object.
   void SetExitStatusCode(Result::StatusEnum final_status,
                          uintptr_t reason_code);
@@ -118,6 +251,15 @@ class Monitor final {
   // Sets additional information in the result object, such as program name,
   // stack trace etc.
   void SetAdditionalResultInfo(std::unique_ptr<Regs> regs);
+  // Stops all threads of the sandboxee but 'stopped_tid', which already is in
+  // a ptrace-stop, and unwinds them into the result.
+  void CollectThreadStackTraces(pid_t stopped_tid);
+  // Returns the collector for the stack traces of the sandboxee, creating it on
+  // first use.
+  StackTraceCollector* GetStackTraceCollector();
+  // Unwinds the interrupted thread 'pid' and records the sample, see
+  // Sandbox2::EnableStackSampling().
+  void TakeStackSample(pid_t pid);
 
   // Logs a SANDBOX VIOLATION message based on the registers and additional
   // explanation for the reason of the violation.
@@ -129,6 +271,12 @@ class Monitor final {
   // Ptrace events:
   // Syscall violation processing path.
   void EventPtraceSeccomp(pid_t pid, int event_msg);
+  // Counts an allowed syscall and lets it run until its exit, see
+  // Sandbox2::EnableSyscallProfiling().
+  void ProfileSyscallEntry(const Syscall& syscall);
+  // Measures the profiled syscall of 'pid' at its exit. Returns false if there
+  // is none.
+  bool ProfileSyscallExit(pid_t pid);
 
   // Processes exit path.
   void EventPtraceExit(pid_t pid, int event_msg);
@@ -144,6 +292,12 @@ class Monitor final {
   Notify* notify_;
   Policy* policy_;
   Result result_;
+  // Start-up times up to the end of the set-up, see
+  // Sandbox2::GetStartupTimes().
+  Result::StartupTimes setup_startup_times_;
+  // Number of syscall stops of the main process left until its first syscall
+  // after execve().
+  int syscall_stops_to_first_syscall_ = 0;
   // Comms channel ptr, copied from the Executor object for convenience.
   Comms* comms_;
   // IPC ptr, used for exchanging data with the sandboxee.
@@ -159,6 +313,21 @@ class Monitor final {
 
   // The main tracked PID.
   pid_t pid_ = -1;
+  // The init process of the sandboxee's PID namespace, if any.
+  pid_t init_pid_ = 0;
+  // Whether the main process has been reaped.
+  bool sandboxee_exited_ = false;
+
+  // Whether the sandboxee is supervised by a MonitorPool thread.
+  bool pooled_ = false;
+  // Processes attached via fork/clone events that the pool has not been told
+  // about yet. Only used if pooled_.
+  std::vector<pid_t> new_tracees_;
+  // Deadline for reaping the killed sandboxee. Only used if pooled_.
+  absl::Time reap_deadline_ = absl::InfiniteFuture();
+  // Value of deadline_millis_ the pool's timer wheel is armed for. Only used
+  // if pooled_.
+  int64_t scheduled_deadline_millis_ = 0;
 
   // False iff external kill is requested
   std::atomic_flag external_kill_request_flag_ = ATOMIC_FLAG_INIT;
@@ -172,12 +341,71 @@ class Monitor final {
   bool timed_out_ = false;
   // Should we dump the main sandboxed PID's stack?
   bool should_dump_stack_ = false;
+  // Keeps the libunwind sandbox running between the stack traces of the
+  // sandboxee. Created on first use, reset in Finish().
+  std::unique_ptr<StackTraceCollector> stack_trace_collector_;
+  // See Sandbox2::EnableStackSampling(), zero if disabled.
+  absl::Duration stack_sampling_period_ = absl::ZeroDuration();
+  // Called with the result by Finish(), see Sandbox2::RunAsync(DoneCallback).
+  std::function<void(const Result&)> done_callback_;
+  absl::Time next_stack_sample_ = absl::InfinitePast();
+  // Threads interrupted for a stack sample which have not stopped yet.
+  absl::flat_hash_set<pid_t> pending_stack_samples_;
+  // Written to by WakeUp(), -1 if it could not be created.
+  int wakeup_fd_ = -1;
+  // Event loop of the main loop, see InitEventLoop().
+  std::unique_ptr<file_util::fileops::FDCloser> epoll_fd_;
+  std::unique_ptr<file_util::fileops::FDCloser> signal_fd_;
+  std::unique_ptr<file_util::fileops::FDCloser> pid_fd_;
+
+  // Whether only the main thread is traced, see
+  // PolicyBuilder::UseLightweightTracing().
+  bool lightweight_tracing_ = false;
+  // Whether allowed syscalls are measured, see
+  // Sandbox2::EnableSyscallProfiling().
+  bool profile_syscalls_ = false;
+  // Syscall number and entry time of the profiled syscall each process is in.
+  absl::flat_hash_map<pid_t, std::pair<uint64_t, absl::Time>>
+      profiled_syscalls_;
+  // Whether traced syscalls are reported via seccomp user notifications, see
+  // PolicyBuilder::UseSeccompUserNotify().
+  bool use_user_notify_ = false;
+  // The seccomp user notification listener, taken from the sandboxee.
+  std::unique_ptr<file_util::fileops::FDCloser> user_notify_fd_;
+  // Whether the MonitorPool watches user_notify_fd_. Only used if pooled_.
+  bool user_notify_fd_watched_ = false;
+  // Connects sockets for the sandboxee on its own thread, see
+  // PolicyBuilder::AddNetworkProxyUserNotifyPolicy().
+  std::unique_ptr<NetworkProxyServer> network_proxy_;
+  std::thread network_proxy_thread_;
+
+  // See TrapDecisions, created if Notify::IsAsync().
+  std::shared_ptr<TrapDecisions> trap_decisions_;
+  // Runs the notification-only events of an asynchronous Notify, see
+  // DispatchNotifyEvent(). Started on first use.
+  std::thread notify_thread_;
+  absl::Mutex notify_mutex_;
+  std::deque<std::function<void()>> notify_events_ GUARDED_BY(notify_mutex_);
+  bool notify_events_done_ GUARDED_BY(notify_mutex_) = false;
+
+  // The cgroup of the sandboxee, see InitCgroup().
+  std::unique_ptr<Cgroup> cgroup_;
+  // Path of cgroup_, kept when it is removed at the end, see
+  // Sandbox2::GetResourceUsage().
+  std::string cgroup_path_;
+  // Whether the sandboxee was started in cgroup_ by the ForkServer.
+  bool started_in_cgroup_ = false;
 
   // Is the sandboxee actively monitored, or maybe we're waiting for execve()?
   bool wait_for_execve_;
   // Log file specified by
   // --sandbox_danger_danger_permit_all_and_log flag.
   FILE* log_file_ = nullptr;
+  // The syscalls logged to log_file_, appended to it as TRACE lines when the
+  // Monitor is destroyed.
+  SyscallTrace syscall_trace_;
+  // Binary log of --sandbox2_audit_log, flushed when the Monitor is destroyed.
+  std::unique_ptr<AuditLog> audit_log_;
 };
 
 }  // namespace sandbox2
@@ -0,0 +1,426 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation file for the sandbox2::MonitorPool class.
+
+#include "sandboxed_api/sandbox2/monitor_pool.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <initializer_list>
+#include <cstdint>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+
+#include <glog/logging.h>
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/timer_wheel.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+
+namespace sandbox2 {
+
+namespace {
+
+// Statuses of processes that are not known to any Monitor are kept up to this
+// number. Processes of removed sandboxees are killed, so their statuses would
+// otherwise pile up.
+constexpr size_t kMaxPendingStatuses = 1024;
+
+// What an epoll event was registered for, stored in the upper half of
+// epoll_event::data.u64.
+enum EventKind : uint64_t {
+  kEventFd = 0,
+  kSignalFd = 1,
+  kPidFd = 2,
+  kUserNotifyFd = 3,
+};
+
+// Granularity of the wall time limits of pooled sandboxees.
+constexpr absl::Duration kDeadlineTick = absl::Milliseconds(1);
+
+uint64_t TimerId(Monitor* monitor) {
+  return reinterpret_cast<uintptr_t>(monitor);
+}
+
+bool WatchFd(int epoll_fd, int fd, EventKind kind, uint32_t events) {
+  epoll_event event{};
+  event.events = events;
+  event.data.u64 = (static_cast<uint64_t>(kind) << 32) | fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    PLOG(ERROR) << "epoll_ctl(EPOLL_CTL_ADD, " << fd << ")";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+struct MonitorPool::Worker {
+  Worker()
+      : queue_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+        deadlines(kDeadlineTick, absl::Now()) {
+    PCHECK(queue_fd.get() != -1) << "eventfd()";
+    PCHECK(epoll_fd.get() != -1) << "epoll_create1()";
+    CHECK(WatchFd(epoll_fd.get(), queue_fd.get(), kEventFd, EPOLLIN));
+  }
+
+  absl::Mutex mutex;
+  std::vector<Monitor*> incoming GUARDED_BY(mutex);
+  bool shutdown GUARDED_BY(mutex) = false;
+
+  // Written to whenever 'incoming' or 'shutdown' changes.
+  file_util::fileops::FDCloser queue_fd;
+  file_util::fileops::FDCloser epoll_fd;
+  std::thread thread;
+
+  // Only accessed by 'thread'.
+  std::vector<Monitor*> monitors;
+  absl::flat_hash_map<pid_t, Monitor*> tracees;
+  // A new process can report its first stop before its parent reports the
+  // fork/clone event which tells us which Monitor it belongs to.
+  std::vector<std::pair<pid_t, int>> pending_statuses;
+  // Wall time limits of the monitors, by TimerId().
+  TimerWheel deadlines;
+};
+
+MonitorPool::MonitorPool(int num_threads) {
+  CHECK_GT(num_threads, 0);
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.push_back(absl::make_unique<Worker>());
+    Worker* worker = workers_.back().get();
+    worker->thread = std::thread(&MonitorPool::RunWorker, worker);
+  }
+}
+
+MonitorPool::~MonitorPool() {
+  for (auto& worker : workers_) {
+    absl::MutexLock lock(&worker->mutex);
+    worker->shutdown = true;
+  }
+  for (auto& worker : workers_) {
+    uint64_t one = 1;
+    PCHECK(write(worker->queue_fd.get(), &one, sizeof(one)) == sizeof(one));
+    worker->thread.join();
+  }
+}
+
+void MonitorPool::Add(Monitor* monitor) {
+  Worker* worker =
+      workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) %
+               workers_.size()]
+          .get();
+  {
+    absl::MutexLock lock(&worker->mutex);
+    worker->incoming.push_back(monitor);
+  }
+  uint64_t one = 1;
+  PCHECK(write(worker->queue_fd.get(), &one, sizeof(one)) == sizeof(one));
+}
+
+void MonitorPool::RunWorker(Worker* worker) {
+  // SIGCHLD is only read from the signalfd.
+  sigset_t sset;
+  sigemptyset(&sset);
+  sigaddset(&sset, SIGCHLD);
+  PCHECK(pthread_sigmask(SIG_BLOCK, &sset, nullptr) == 0);
+  file_util::fileops::FDCloser signal_fd(
+      signalfd(-1, &sset, SFD_CLOEXEC | SFD_NONBLOCK));
+  PCHECK(signal_fd.get() != -1) << "signalfd()";
+  CHECK(WatchFd(worker->epoll_fd.get(), signal_fd.get(), kSignalFd, EPOLLIN));
+
+  for (;;) {
+    std::vector<Monitor*> incoming;
+    {
+      absl::MutexLock lock(&worker->mutex);
+      if (worker->shutdown && worker->incoming.empty() &&
+          worker->monitors.empty()) {
+        return;
+      }
+      incoming.swap(worker->incoming);
+    }
+    for (Monitor* monitor : incoming) {
+      SetUpMonitor(worker, monitor);
+    }
+
+    for (;;) {
+      int status;
+      pid_t pid =
+          waitpid(-1, &status, __WNOTHREAD | __WALL | WUNTRACED | WNOHANG);
+      if (pid > 0) {
+        DispatchStatus(worker, pid, status);
+        continue;
+      }
+      if (pid == -1 && errno == ECHILD) {
+        // Every watched sandboxee has a traced main process that has not been
+        // reaped yet, so this should not happen.
+        for (Monitor* monitor : worker->monitors) {
+          if (monitor->result_.final_status() == Result::UNSET) {
+            LOG(ERROR) << "PANIC(). The main process has not exited yet, "
+                       << "yet we haven't seen its exit event";
+            monitor->SetExitStatusCode(Result::INTERNAL_ERROR,
+                                       Result::FAILED_CHILD);
+          }
+          // Nothing left to reap.
+          monitor->reap_deadline_ = absl::InfinitePast();
+        }
+      } else if (pid == -1) {
+        PLOG(ERROR) << "waitpid() failed";
+      }
+      break;
+    }
+
+    for (uint64_t id : worker->deadlines.Advance(absl::Now())) {
+      Monitor* monitor = reinterpret_cast<Monitor*>(id);
+      if (monitor->result_.final_status() == Result::UNSET) {
+        monitor->CheckDeadline();
+        // Re-armed by ScheduleDeadline() should it not have been reached.
+        monitor->scheduled_deadline_millis_ = 0;
+      }
+    }
+
+    // Copied, as finished monitors are removed from the list.
+    std::vector<Monitor*> monitors = worker->monitors;
+    absl::Duration timeout = Monitor::kWakeUpPeriod;
+    for (Monitor* monitor : monitors) {
+      if (monitor->result_.final_status() == Result::UNSET) {
+        monitor->CheckRequests();
+        monitor->ProcessUserNotifications();
+      }
+      if (monitor->result_.final_status() == Result::UNSET) {
+        ScheduleDeadline(worker, monitor);
+        timeout = std::min(timeout, monitor->TimeToNextStackSample());
+        continue;
+      }
+      // Same as the end of Monitor::MainLoop(): make sure the main process is
+      // killed and reaped.
+      if (!monitor->sandboxee_exited_ &&
+          monitor->reap_deadline_ == absl::InfiniteFuture()) {
+        kill(monitor->pid_, SIGKILL);
+        monitor->reap_deadline_ = absl::Now() + Monitor::kGracefulExitTimeout;
+      }
+      if (monitor->sandboxee_exited_ ||
+          absl::Now() >= monitor->reap_deadline_) {
+        LOG_IF(INFO, !monitor->sandboxee_exited_)
+            << "Waiting for sandboxee exit timed out";
+        RemoveMonitor(worker, monitor);
+        continue;
+      }
+      timeout = std::min(timeout, monitor->reap_deadline_ - absl::Now());
+    }
+
+    timeout =
+        std::min(timeout, worker->deadlines.NextWakeUp() - absl::Now());
+    WaitForEvents(worker, signal_fd.get(), timeout);
+  }
+}
+
+void MonitorPool::SetUpMonitor(Worker* worker, Monitor* monitor) {
+  monitor->pooled_ = true;
+  if (!monitor->SetUpSandboxee()) {
+    // The pool thread does not exit, so PTRACE_O_EXITKILL does not take down
+    // the init process.
+    if (monitor->init_pid_ > 0) {
+      kill(monitor->init_pid_, SIGKILL);
+    }
+    monitor->new_tracees_.clear();
+    monitor->Finish();
+    monitor->setup_notification_.Notify();
+    return;
+  }
+
+  worker->tracees[monitor->pid_] = monitor;
+  if (monitor->init_pid_ > 0) {
+    worker->tracees[monitor->init_pid_] = monitor;
+  }
+  if (monitor->wakeup_fd_ != -1) {
+    WatchFd(worker->epoll_fd.get(), monitor->wakeup_fd_, kEventFd, EPOLLIN);
+  }
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+  // Catches the exit of the main process even if another thread took the
+  // SIGCHLD. Only needs to fire once. The ForkServer usually sent one along
+  // with the PID.
+  if (monitor->pid_fd_ == nullptr || monitor->pid_fd_->get() == -1) {
+    monitor->pid_fd_ = absl::make_unique<file_util::fileops::FDCloser>(
+        syscall(__NR_pidfd_open, monitor->pid_, 0));
+  }
+  if (monitor->pid_fd_->get() != -1) {
+    WatchFd(worker->epoll_fd.get(), monitor->pid_fd_->get(), kPidFd,
+            EPOLLIN | EPOLLONESHOT);
+  }
+  worker->monitors.push_back(monitor);
+  RegisterNewTracees(worker, monitor);
+
+  // Tell the Sandbox2 object that we're done with the initial set-up process
+  // of the sandboxee.
+  monitor->setup_notification_.Notify();
+}
+
+void MonitorPool::DispatchStatus(Worker* worker, pid_t pid, int status) {
+  const bool exited = WIFEXITED(status) || WIFSIGNALED(status);
+  auto it = worker->tracees.find(pid);
+  if (it == worker->tracees.end()) {
+    // Exited processes have been reaped already, only stopped ones are waiting
+    // for us.
+    if (exited) {
+      return;
+    }
+    if (worker->pending_statuses.size() >= kMaxPendingStatuses) {
+      LOG(ERROR) << "Dropping " << worker->pending_statuses.size()
+                 << " statuses of unknown processes";
+      worker->pending_statuses.clear();
+    }
+    worker->pending_statuses.emplace_back(pid, status);
+    return;
+  }
+
+  Monitor* monitor = it->second;
+  if (exited) {
+    // The pid may be reused from now on.
+    worker->tracees.erase(it);
+  }
+  if (monitor->result_.final_status() == Result::UNSET) {
+    monitor->ProcessStatus(pid, status);
+  } else {
+    monitor->ProcessStatusWhileReaping(pid, status);
+  }
+  if (monitor->user_notify_fd_ && !monitor->user_notify_fd_watched_) {
+    monitor->user_notify_fd_watched_ =
+        WatchFd(worker->epoll_fd.get(), monitor->user_notify_fd_->get(),
+                kUserNotifyFd, EPOLLIN);
+  }
+  RegisterNewTracees(worker, monitor);
+}
+
+void MonitorPool::RegisterNewTracees(Worker* worker, Monitor* monitor) {
+  if (monitor->new_tracees_.empty()) {
+    return;
+  }
+  for (pid_t pid : monitor->new_tracees_) {
+    worker->tracees[pid] = monitor;
+  }
+  monitor->new_tracees_.clear();
+
+  std::vector<std::pair<pid_t, int>> known;
+  auto& pending = worker->pending_statuses;
+  for (auto it = pending.begin(); it != pending.end();) {
+    if (worker->tracees.contains(it->first)) {
+      known.push_back(*it);
+      it = pending.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (const auto& pid_status : known) {
+    DispatchStatus(worker, pid_status.first, pid_status.second);
+  }
+}
+
+void MonitorPool::ScheduleDeadline(Worker* worker, Monitor* monitor) {
+  // Sandbox2::SetWallTimeLimit() wakes us up after changing the deadline.
+  int64_t deadline = monitor->deadline_millis_.load(std::memory_order_relaxed);
+  if (deadline == monitor->scheduled_deadline_millis_) {
+    return;
+  }
+  monitor->scheduled_deadline_millis_ = deadline;
+  if (deadline == 0) {
+    worker->deadlines.Cancel(TimerId(monitor));
+  } else {
+    worker->deadlines.Schedule(TimerId(monitor),
+                               absl::FromUnixMillis(deadline));
+  }
+}
+
+void MonitorPool::RemoveMonitor(Worker* worker, Monitor* monitor) {
+  worker->deadlines.Cancel(TimerId(monitor));
+  // Done by PTRACE_O_EXITKILL when a monitor thread exits.
+  for (auto it = worker->tracees.begin(); it != worker->tracees.end();) {
+    if (it->second == monitor) {
+      kill(it->first, SIGKILL);
+      worker->tracees.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (monitor->wakeup_fd_ != -1) {
+    epoll_ctl(worker->epoll_fd.get(), EPOLL_CTL_DEL, monitor->wakeup_fd_,
+              nullptr);
+  }
+  for (const auto* fd : {monitor->pid_fd_.get(),
+                         monitor->user_notify_fd_.get()}) {
+    if (fd != nullptr && fd->get() != -1) {
+      epoll_ctl(worker->epoll_fd.get(), EPOLL_CTL_DEL, fd->get(), nullptr);
+    }
+  }
+  worker->monitors.erase(
+      std::find(worker->monitors.begin(), worker->monitors.end(), monitor));
+  // The Sandbox2 object may destroy the Monitor after this.
+  monitor->Finish();
+}
+
+void MonitorPool::WaitForEvents(Worker* worker, int signal_fd,
+                                absl::Duration timeout) {
+  constexpr int kMaxEvents = 16;
+  epoll_event events[kMaxEvents];
+  timeout = std::max(timeout, absl::ZeroDuration());
+  // Round up, so that deadlines are not polled for repeatedly.
+  int timeout_ms = absl::ToInt64Milliseconds(
+      timeout + absl::Milliseconds(1) - absl::Nanoseconds(1));
+  int num_events =
+      epoll_wait(worker->epoll_fd.get(), events, kMaxEvents, timeout_ms);
+  if (num_events == -1 && errno != EINTR) {
+    PLOG(ERROR) << "epoll_wait()";
+  }
+  for (int i = 0; i < num_events; ++i) {
+    const int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+    switch (events[i].data.u64 >> 32) {
+      case kSignalFd: {
+        signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+          LOG_IF(ERROR, info.ssi_signo != SIGCHLD)
+              << "Unknown signal received: " << info.ssi_signo;
+        }
+        break;
+      }
+      case kEventFd: {
+        uint64_t value;
+        if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+          PLOG(ERROR) << "read(eventfd)";
+        }
+        break;
+      }
+      default:
+        // pidfds are registered with EPOLLONESHOT, user notifications are
+        // answered by the main loop.
+        break;
+    }
+  }
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,93 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::MonitorPool class supervises many sandboxees from a fixed
+// number of threads, instead of one monitor thread per sandboxee.
+
+#ifndef SANDBOXED_API_SANDBOX2_MONITOR_POOL_H_
+#define SANDBOXED_API_SANDBOX2_MONITOR_POOL_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/monitor.h"
+
+namespace sandbox2 {
+
+// ptrace() ties a tracee to the thread that attached to it, so each sandboxee
+// stays on the same pool thread for its whole lifetime. Sandboxees are
+// assigned to the threads round-robin, and the set-up of a sandboxee blocks
+// the other sandboxees of its thread until it is done.
+//
+// Usage:
+//   MonitorPool pool(/*num_threads=*/2);
+//   Sandbox2 s2(std::move(executor), std::move(policy));
+//   s2.set_monitor_pool(&pool);
+//   s2.RunAsync();
+class MonitorPool final {
+ public:
+  explicit MonitorPool(int num_threads);
+
+  MonitorPool(const MonitorPool&) = delete;
+  MonitorPool& operator=(const MonitorPool&) = delete;
+
+  // Waits for the remaining sandboxees to finish.
+  ~MonitorPool();
+
+ private:
+  friend class Sandbox2;
+
+  struct Worker;
+
+  // Hands 'monitor' over to one of the threads, which sets up the sandboxee
+  // and notifies Monitor::setup_notification_ when done.
+  void Add(Monitor* monitor);
+
+  // Main loop of a pool thread.
+  static void RunWorker(Worker* worker);
+
+  // Sets up the sandboxee of 'monitor' and starts watching it.
+  static void SetUpMonitor(Worker* worker, Monitor* monitor);
+
+  // Passes a waitpid() status on to the Monitor the process belongs to.
+  static void DispatchStatus(Worker* worker, pid_t pid, int status);
+
+  // Starts routing statuses of the processes 'monitor' got attached to, and
+  // replays the statuses that arrived for them before.
+  static void RegisterNewTracees(Worker* worker, Monitor* monitor);
+
+  // Arms the timer of 'monitor' if its wall time limit changed.
+  static void ScheduleDeadline(Worker* worker, Monitor* monitor);
+
+  // Kills the remains of the sandboxee, stops watching it and finishes
+  // 'monitor'.
+  static void RemoveMonitor(Worker* worker, Monitor* monitor);
+
+  // Sleeps until an event arrives for one of the sandboxees of 'worker', or
+  // 'timeout' expired.
+  static void WaitForEvents(Worker* worker, int signal_fd,
+                            absl::Duration timeout);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_{0};
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_MONITOR_POOL_H_
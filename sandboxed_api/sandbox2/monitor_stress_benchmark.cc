@@ -0,0 +1,255 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stress benchmarks of the sandbox monitor. Each run starts a number of
+// sandboxees at once, each of which forks processes that start threads, and
+// every thread calls a syscall the policy traces in a loop (see
+// testcases/monitor_stress). Runs compare a monitor thread per sandboxee with
+// ptrace, a shared MonitorPool and seccomp user notifications.
+//
+// Reported counters, besides the wall time of a run:
+// - monitor_cpu_ms: CPU time of the benchmark process per sandboxee, which is
+//   almost all spent by the monitors
+// - event_latency_ns, event_latency_max_ns: time a traced syscall takes in the
+//   sandboxee, i.e. how long it waits for the monitor
+// - events_per_s: traced syscalls handled per second over all sandboxees
+//
+// Run with: bazel run -c opt //sandboxed_api/sandbox2:monitor_stress_benchmark
+// Add --benchmark_format=json (or csv) for machine-readable results.
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/monitor_pool.h"
+#include "sandboxed_api/sandbox2/notify.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "sandboxed_api/sandbox2/util/runfiles.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sandbox2 {
+namespace {
+
+// Traced syscalls per thread of the sandboxee.
+constexpr int64_t kSyscallsPerThread = 1000;
+
+// Threads of the MonitorPool of kMonitorPool.
+constexpr int kPoolThreads = 4;
+
+enum MonitorKind {
+  // A monitor thread per sandboxee, traced syscalls stop it with ptrace.
+  kPtrace,
+  // The same, with all sandboxees supervised by a MonitorPool.
+  kMonitorPool,
+  // PolicyBuilder::UseSeccompUserNotify().
+  kUserNotify,
+};
+
+const char* const kMonitorNames[] = {"ptrace", "monitor_pool", "user_notify"};
+
+// Allows every traced syscall.
+class AllowTracedNotify : public Notify {
+ public:
+  bool EventSyscallTrap(const Syscall& syscall) override { return true; }
+};
+
+std::unique_ptr<Policy> BuildPolicy(MonitorKind kind) {
+  PolicyBuilder builder;
+  if (kind == kUserNotify) {
+    builder.UseSeccompUserNotify();
+  }
+  // Namespaces only add to the start-up, which is not what is measured here.
+  builder.DisableNamespaces()
+      .AllowStaticStartup()
+      .AllowExit()
+      .AllowWrite()
+      .AllowFork()
+      .AllowWait()
+      .AllowMmap()
+      .AllowSyscalls({__NR_futex, __NR_mprotect, __NR_munmap, __NR_madvise,
+                      __NR_set_robust_list, __NR_rt_sigprocmask,
+                      __NR_clock_gettime, __NR_getpid, __NR_gettid,
+                      __NR_sched_yield})
+      .AddPolicyOnSyscall(__NR_getppid, {SANDBOX2_TRACE});
+  // Make the C library fall back to clone() and skip the optional rseq
+  // registration of new threads.
+#ifdef __NR_clone3
+  builder.BlockSyscallWithErrno(__NR_clone3, ENOSYS);
+#endif
+#ifdef __NR_rseq
+  builder.BlockSyscallWithErrno(__NR_rseq, ENOSYS);
+#endif
+  return builder.BuildOrDie();
+}
+
+int64_t CpuNanos() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (static_cast<int64_t>(usage.ru_utime.tv_sec) +
+          usage.ru_stime.tv_sec) *
+             1000000000 +
+         (static_cast<int64_t>(usage.ru_utime.tv_usec) +
+          usage.ru_stime.tv_usec) *
+             1000;
+}
+
+// What the sandboxees of a run report.
+struct RunStats {
+  uint64_t syscalls = 0;
+  uint64_t total_nanos = 0;
+  uint64_t max_nanos = 0;
+};
+
+// Parses the output of monitor_stress into 'stats'.
+sapi::Status AddOutput(const std::string& output, RunStats* stats) {
+  std::vector<std::string> fields =
+      absl::StrSplit(output, absl::ByAnyChar(" \n"), absl::SkipEmpty());
+  uint64_t syscalls, total_nanos, max_nanos;
+  if (fields.size() != 4 || !absl::SimpleAtoi(fields[0], &syscalls) ||
+      !absl::SimpleAtoi(fields[1], &total_nanos) ||
+      !absl::SimpleAtoi(fields[2], &max_nanos)) {
+    return sapi::InternalError(
+        absl::StrCat("Unexpected output of monitor_stress: ", output));
+  }
+  stats->syscalls += syscalls;
+  stats->total_nanos += total_nanos;
+  stats->max_nanos = std::max(stats->max_nanos, max_nanos);
+  return sapi::OkStatus();
+}
+
+// Runs 'sandboxes' sandboxees at once and waits for all of them.
+sapi::Status RunSandboxees(MonitorKind kind, int sandboxes, int processes,
+                           int threads, RunStats* stats) {
+  const std::string path = GetDataDependencyFilePath(
+      "sandboxed_api/sandbox2/testcases/monitor_stress");
+  const std::vector<std::string> args = {path, absl::StrCat(processes),
+                                         absl::StrCat(threads),
+                                         absl::StrCat(kSyscallsPerThread)};
+  std::unique_ptr<MonitorPool> pool;
+  if (kind == kMonitorPool) {
+    pool = absl::make_unique<MonitorPool>(kPoolThreads);
+  }
+  std::vector<std::unique_ptr<Sandbox2>> sandboxees;
+  std::vector<int> out_fds;
+  sapi::Status status;
+  for (int i = 0; i < sandboxes; ++i) {
+    auto executor = absl::make_unique<Executor>(path, args);
+    out_fds.push_back(executor->ipc()->ReceiveFd(STDOUT_FILENO));
+    sandboxees.push_back(absl::make_unique<Sandbox2>(
+        std::move(executor), BuildPolicy(kind),
+        absl::make_unique<AllowTracedNotify>()));
+    if (pool) {
+      sandboxees.back()->set_monitor_pool(pool.get());
+    }
+    if (!sandboxees.back()->RunAsync()) {
+      status = sapi::InternalError("Could not start the sandboxee");
+      break;
+    }
+  }
+  for (size_t i = 0; i < sandboxees.size(); ++i) {
+    Result result = sandboxees[i]->AwaitResult();
+    std::string output;
+    char buf[128];
+    ssize_t n;
+    while ((n = read(out_fds[i], buf, sizeof(buf))) > 0) {
+      output.append(buf, n);
+    }
+    close(out_fds[i]);
+    if (!status.ok()) {
+      continue;
+    }
+    if (result.final_status() != Result::OK) {
+      status = sapi::InternalError(
+          absl::StrCat("monitor_stress failed: ", result.ToString()));
+      continue;
+    }
+    status = AddOutput(output, stats);
+  }
+  return status;
+}
+
+// Arguments are the MonitorKind and the numbers of sandboxees, processes per
+// sandboxee and threads per process.
+void BenchmarkMonitorStress(benchmark::State& state) {
+  const auto kind = static_cast<MonitorKind>(state.range(0));
+  const int sandboxes = state.range(1);
+  const int processes = state.range(2);
+  const int threads = state.range(3);
+  RunStats stats;
+  int64_t cpu_nanos = 0;
+  double wall_seconds = 0;
+  for (auto _ : state) {
+    const int64_t cpu_start = CpuNanos();
+    const auto start = absl::Now();
+    sapi::Status status =
+        RunSandboxees(kind, sandboxes, processes, threads, &stats);
+    const double seconds = absl::ToDoubleSeconds(absl::Now() - start);
+    cpu_nanos += CpuNanos() - cpu_start;
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      return;
+    }
+    wall_seconds += seconds;
+    state.SetIterationTime(seconds);
+  }
+  state.SetLabel(absl::StrCat(kMonitorNames[kind], "/sandboxes:", sandboxes,
+                              "/processes:", processes, "/threads:", threads));
+  const double runs = state.iterations();
+  state.counters["monitor_cpu_ms"] = cpu_nanos / 1e6 / runs / sandboxes;
+  if (stats.syscalls > 0) {
+    state.counters["event_latency_ns"] =
+        static_cast<double>(stats.total_nanos) / stats.syscalls;
+    state.counters["event_latency_max_ns"] = stats.max_nanos;
+    state.counters["events_per_s"] = stats.syscalls / wall_seconds;
+  }
+}
+
+void StressMatrix(benchmark::internal::Benchmark* b) {
+  for (int kind = kPtrace; kind <= kUserNotify; ++kind) {
+    for (int sandboxes : {1, 8, 32}) {
+      for (int processes : {1, 4}) {
+        for (int threads : {1, 8}) {
+          b->Args({kind, sandboxes, processes, threads});
+        }
+      }
+    }
+  }
+}
+BENCHMARK(BenchmarkMonitorStress)->Apply(StressMatrix)->UseManualTime();
+
+}  // namespace
+}  // namespace sandbox2
+
+BENCHMARK_MAIN();
@@ -15,6 +15,8 @@
 #include "sandboxed_api/sandbox2/mounts.h"
 
 #include <fcntl.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -23,15 +25,20 @@
 
 #include <climits>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/util/message_differencer.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/strings/ascii.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
 #include "sandboxed_api/sandbox2/util/minielf.h"
 #include "sandboxed_api/sandbox2/util/path.h"
@@ -91,6 +98,8 @@ absl::string_view GetOutsidePath(const MountTree::Node& node) {
       return node.file_node().outside();
     case MountTree::Node::kDirNode:
       return node.dir_node().outside();
+    case MountTree::Node::kImageNode:
+      return node.image_node().outside();
     default:
       SAPI_RAW_LOG(FATAL, "Invalid node type");
       return "";  // NOT REACHED
@@ -143,24 +152,12 @@ std::string GetPlatform(absl::string_view interpreter) {
   return absl::StrCat(kCpuPlatform, "-linux-gnu");
 }
 
-}  // namespace
-
-sapi::Status Mounts::Insert(absl::string_view path,
-                            const MountTree::Node& new_node) {
-  // Some sandboxes allow the inside/outside paths to be partially
-  // user-controlled with some sanitization.
-  // Since we're handling C++ strings and later convert them to C style
-  // strings, a null byte in a path component might silently truncate the path
-  // and mount something not expected by the caller. Check for null bytes in the
-  // strings to protect against this.
-  if (PathContainsNullByte(path)) {
-    return sapi::InvalidArgumentError(
-        absl::StrCat("Inside path contains a null byte: ", path));
-  }
-  switch (new_node.node_case()) {
+sapi::Status ValidateNode(const MountTree::Node& node) {
+  switch (node.node_case()) {
     case MountTree::Node::kFileNode:
-    case MountTree::Node::kDirNode: {
-      auto outside_path = GetOutsidePath(new_node);
+    case MountTree::Node::kDirNode:
+    case MountTree::Node::kImageNode: {
+      auto outside_path = GetOutsidePath(node);
       if (outside_path.empty()) {
         return sapi::InvalidArgumentError("Outside path cannot be empty");
       }
@@ -168,70 +165,117 @@ sapi::Status Mounts::Insert(absl::string_view path,
         return sapi::InvalidArgumentError(
             absl::StrCat("Outside path contains a null byte: ", outside_path));
       }
+      if (node.has_image_node() && node.image_node().fs_type() != "erofs" &&
+          node.image_node().fs_type() != "squashfs") {
+        return sapi::InvalidArgumentError(absl::StrCat(
+            "Unsupported image type: ", node.image_node().fs_type()));
+      }
       break;
     }
     case MountTree::Node::kTmpfsNode:
     case MountTree::Node::NODE_NOT_SET:
       break;
   }
+  return sapi::OkStatus();
+}
 
-  std::string fixed_path = file::CleanPath(path);
-
-  if (!absl::StartsWith(fixed_path, "/")) {
-    return sapi::InvalidArgumentError("Only absolute paths are supported");
-  }
-
-  if (fixed_path == "/") {
-    return sapi::InvalidArgumentError("The root already exists");
-  }
-
-  std::vector<absl::string_view> parts;
+}  // namespace
 
-  auto split = file::SplitPath(fixed_path);
-  absl::string_view cur = split.first;
-  auto final_part = std::string(split.second);
+Mounts::Mounts(const MountTree& mount_tree) : nodes_(1) {
+  AddMountTree(0, mount_tree);
+}
 
-  while (cur != "/") {
-    auto split = file::SplitPath(cur);
-    cur = split.first;
-    parts.push_back(split.second);
-  }
+uint32_t Mounts::FindOrAddChild(uint32_t parent, absl::string_view name) {
+  uint32_t id;
+  auto name_it = name_ids_.find(name);
+  if (name_it != name_ids_.end()) {
+    id = name_it->second;
+    auto it = nodes_[parent].entries.find(id);
+    if (it != nodes_[parent].entries.end()) {
+      return it->second;
+    }
+  } else {
+    id = names_.size();
+    names_.emplace_back(name);
+    name_ids_.emplace(names_.back(), id);
+  }
+  uint32_t index = nodes_.size();
+  // Invalidates references into nodes_.
+  nodes_.emplace_back();
+  nodes_[parent].entries.emplace(id, index);
+  return index;
+}
 
-  MountTree* curtree = &mount_tree_;
-  for (auto part = parts.rbegin(); part != parts.rend(); ++part) {
-    curtree = &(curtree->mutable_entries()
-                    ->insert({std::string(*part), MountTree()})
-                    .first->second);
-    if (curtree->has_node() && curtree->node().has_file_node()) {
+sapi::Status Mounts::FindOrAddDirectory(uint32_t parent,
+                                        absl::string_view relative_path,
+                                        absl::string_view path,
+                                        uint32_t* index) {
+  for (absl::string_view part :
+       absl::StrSplit(relative_path, '/', absl::SkipEmpty())) {
+    parent = FindOrAddChild(parent, part);
+    if (nodes_[parent].node.has_file_node()) {
       return sapi::FailedPreconditionError(
           absl::StrCat("Cannot insert ", path,
                        " since a file is mounted as a parent directory"));
     }
   }
+  *index = parent;
+  return sapi::OkStatus();
+}
 
-  curtree = &(curtree->mutable_entries()
-                  ->insert({final_part, MountTree()})
-                  .first->second);
+sapi::Status Mounts::InsertAt(uint32_t parent, absl::string_view relative_path,
+                              absl::string_view path,
+                              const MountTree::Node& new_node) {
+  auto split = file::SplitPath(relative_path);
+  SAPI_RETURN_IF_ERROR(FindOrAddDirectory(parent, split.first, path, &parent));
+  TrieNode& node = nodes_[FindOrAddChild(parent, split.second)];
 
-  if (curtree->has_node()) {
-    if (IsEquivalentNode(curtree->node(), new_node)) {
+  if (node.node.node_case() != MountTree::Node::NODE_NOT_SET) {
+    if (IsEquivalentNode(node.node, new_node)) {
       SAPI_RAW_LOG(INFO, "Inserting %s with the same value twice", path);
       return sapi::OkStatus();
     }
     return sapi::FailedPreconditionError(absl::StrCat(
         "Inserting ", path, " twice with conflicting values ",
-        curtree->node().DebugString(), " vs. ", new_node.DebugString()));
+        node.node.DebugString(), " vs. ", new_node.DebugString()));
   }
 
-  if (new_node.has_file_node() && !curtree->entries().empty()) {
+  if (new_node.has_file_node() && !node.entries.empty()) {
     return sapi::FailedPreconditionError(
         absl::StrCat("Trying to mount file over existing directory at ", path));
   }
 
-  *curtree->mutable_node() = new_node;
+  node.node = new_node;
   return sapi::OkStatus();
 }
 
+sapi::Status Mounts::Insert(absl::string_view path,
+                            const MountTree::Node& new_node) {
+  // Some sandboxes allow the inside/outside paths to be partially
+  // user-controlled with some sanitization.
+  // Since we're handling C++ strings and later convert them to C style
+  // strings, a null byte in a path component might silently truncate the path
+  // and mount something not expected by the caller. Check for null bytes in the
+  // strings to protect against this.
+  if (PathContainsNullByte(path)) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Inside path contains a null byte: ", path));
+  }
+  SAPI_RETURN_IF_ERROR(ValidateNode(new_node));
+
+  std::string fixed_path = file::CleanPath(path);
+
+  if (!absl::StartsWith(fixed_path, "/")) {
+    return sapi::InvalidArgumentError("Only absolute paths are supported");
+  }
+
+  if (fixed_path == "/") {
+    return sapi::InvalidArgumentError("The root already exists");
+  }
+
+  return InsertAt(0, absl::string_view(fixed_path).substr(1), path, new_node);
+}
+
 sapi::Status Mounts::AddFile(absl::string_view path, bool is_ro) {
   return AddFileAt(path, path, is_ro);
 }
@@ -245,6 +289,44 @@ sapi::Status Mounts::AddFileAt(absl::string_view outside,
   return Insert(inside, node);
 }
 
+sapi::Status Mounts::AddFilesAt(absl::string_view outside_dir,
+                                absl::string_view inside_dir,
+                                const std::vector<std::string>& names,
+                                bool is_ro) {
+  if (PathContainsNullByte(inside_dir)) {
+    return sapi::InvalidArgumentError(
+        absl::StrCat("Inside path contains a null byte: ", inside_dir));
+  }
+  std::string fixed_dir = file::CleanPath(inside_dir);
+  if (!absl::StartsWith(fixed_dir, "/")) {
+    return sapi::InvalidArgumentError("Only absolute paths are supported");
+  }
+  uint32_t dir;
+  SAPI_RETURN_IF_ERROR(FindOrAddDirectory(
+      0, absl::string_view(fixed_dir).substr(1), inside_dir, &dir));
+
+  MountTree::Node node;
+  auto* file_node = node.mutable_file_node();
+  file_node->set_is_ro(is_ro);
+  for (const auto& name : names) {
+    std::string fixed_name = file::CleanPath(name);
+    if (fixed_name.empty() || fixed_name == "." || fixed_name == ".." ||
+        absl::StartsWith(fixed_name, "/") ||
+        absl::StartsWith(fixed_name, "../")) {
+      return sapi::InvalidArgumentError(
+          absl::StrCat("Not a path below ", inside_dir, ": ", name));
+    }
+    file_node->set_outside(file::JoinPath(outside_dir, fixed_name));
+    SAPI_RETURN_IF_ERROR(ValidateNode(node));
+    sapi::Status status = InsertAt(dir, fixed_name, name, node);
+    if (!status.ok()) {
+      return sapi::Status(status.code(),
+                          absl::StrCat(inside_dir, ": ", status.message()));
+    }
+  }
+  return sapi::OkStatus();
+}
+
 sapi::Status Mounts::AddDirectoryAt(absl::string_view outside,
                                     absl::string_view inside, bool is_ro) {
   MountTree::Node node;
@@ -262,23 +344,63 @@ void LogContainer(const std::vector<std::string>& container) {
   }
 }
 
-}  // namespace
+// Identifies a version of a file without reading it.
+struct FileVersion {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
 
-sapi::Status Mounts::AddMappingsForBinary(const std::string& path,
-                                          absl::string_view ld_library_path) {
-  auto elf_or = ElfFile::ParseFromFile(
-      path, ElfFile::kGetInterpreter | ElfFile::kLoadImportedLibraries);
+  bool operator==(const FileVersion& other) const {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           mtime.tv_sec == other.mtime.tv_sec &&
+           mtime.tv_nsec == other.mtime.tv_nsec;
+  }
+};
+
+bool GetFileVersion(const std::string& path, FileVersion* version) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    return false;
+  }
+  version->dev = st.st_dev;
+  version->ino = st.st_ino;
+  version->size = st.st_size;
+  version->mtime = st.st_mtim;
+  return true;
+}
+
+struct BinaryDependencies {
+  std::string interpreter;
+  std::vector<std::string> libraries;
+  // Versions of the libraries, as they were resolved.
+  std::vector<std::pair<std::string, FileVersion>> versions;
+};
+
+// Resolves the interpreter and the shared libraries 'path' needs.
+sapi::StatusOr<BinaryDependencies> ResolveBinaryDependencies(
+    const std::string& path, absl::string_view ld_library_path) {
+  BinaryDependencies dependencies;
+  // Only the program headers are read first: static and static-PIE binaries
+  // have no interpreter and need neither their section headers parsed nor
+  // any libraries resolved.
+  auto elf_or = ElfFile::ParseFromFile(path, ElfFile::kGetInterpreter);
   if (!elf_or.ok()) {
     return sapi::FailedPreconditionError(
         absl::StrCat("Could not parse ELF file: ", elf_or.status().message()));
   }
-  auto elf = elf_or.ValueOrDie();
-  const std::string interpreter = elf.interpreter();
+  const std::string interpreter = elf_or.ValueOrDie().interpreter();
 
   if (interpreter.empty()) {
     SAPI_RAW_VLOG(1, "The file %s is not a dynamic executable", path);
-    return sapi::OkStatus();
+    return dependencies;
+  }
+  elf_or = ElfFile::ParseFromFile(path, ElfFile::kLoadImportedLibraries);
+  if (!elf_or.ok()) {
+    return sapi::FailedPreconditionError(
+        absl::StrCat("Could not parse ELF file: ", elf_or.status().message()));
   }
+  auto elf = elf_or.ValueOrDie();
 
   SAPI_RAW_VLOG(1, "The file %s is using interpreter %s", path, interpreter);
   SAPI_RETURN_IF_ERROR(ValidateInterpreter(interpreter));
@@ -386,6 +508,11 @@ sapi::Status Mounts::AddMappingsForBinary(const std::string& path,
     if (loaded > kMaxLoadedEntries) {
       return sapi::FailedPreconditionError("Exceeded max loaded entries limit");
     }
+    // Taken before parsing, so that a concurrent update invalidates the cache.
+    FileVersion version;
+    if (GetFileVersion(resolved_lib, &version)) {
+      dependencies.versions.emplace_back(resolved_lib, version);
+    }
     SAPI_ASSIGN_OR_RETURN(
         auto lib_elf,
         ElfFile::ParseFromFile(resolved_lib, ElfFile::kLoadImportedLibraries));
@@ -407,9 +534,101 @@ sapi::Status Mounts::AddMappingsForBinary(const std::string& path,
     }
   }
 
-  SAPI_RETURN_IF_ERROR(AddFile(interpreter));
-  for (const auto& lib : imported_libraries) {
-    SAPI_RETURN_IF_ERROR(AddFile(lib));
+  dependencies.interpreter = interpreter;
+  dependencies.libraries.assign(imported_libraries.begin(),
+                                imported_libraries.end());
+  return dependencies;
+}
+
+// Process-wide cache of resolved dependencies, as most sandboxes start the same
+// few binaries. Entries are only used while the binary and all resolved
+// libraries are unchanged.
+class DependencyCache {
+ public:
+  static DependencyCache* Get() {
+    static auto* cache = new DependencyCache();
+    return cache;
+  }
+
+  // Returns the dependencies of the binary if they are cached and still valid.
+  bool Lookup(const std::string& key, const FileVersion& binary,
+              BinaryDependencies* dependencies) {
+    {
+      absl::MutexLock lock(&mutex_);
+      auto it = entries_.find(key);
+      if (it == entries_.end() || !(it->second.binary == binary)) {
+        return false;
+      }
+      *dependencies = it->second.dependencies;
+    }
+    for (const auto& entry : dependencies->versions) {
+      FileVersion version;
+      if (!GetFileVersion(entry.first, &version) ||
+          !(version == entry.second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Insert(const std::string& key, const FileVersion& binary,
+              const BinaryDependencies& dependencies) {
+    absl::MutexLock lock(&mutex_);
+    if (entries_.size() >= kMaxEntries) {
+      entries_.clear();
+    }
+    entries_[key] = {binary, dependencies};
+  }
+
+ private:
+  static constexpr size_t kMaxEntries = 256;
+
+  struct Entry {
+    FileVersion binary;
+    BinaryDependencies dependencies;
+  };
+
+  absl::Mutex mutex_;
+  absl::flat_hash_map<std::string, Entry> entries_ GUARDED_BY(mutex_);
+};
+
+}  // namespace
+
+sapi::Status Mounts::AddMappingsForBinary(const std::string& path,
+                                          absl::string_view ld_library_path,
+                                          bool* is_static) {
+  const std::string key = absl::StrCat(path, std::string(1, '\0'),
+                                       ld_library_path);
+  // Taken before resolving, see ResolveBinaryDependencies().
+  FileVersion binary;
+  bool cacheable = GetFileVersion(path, &binary);
+  BinaryDependencies dependencies;
+  if (!cacheable ||
+      !DependencyCache::Get()->Lookup(key, binary, &dependencies)) {
+    SAPI_ASSIGN_OR_RETURN(dependencies,
+                          ResolveBinaryDependencies(path, ld_library_path));
+    if (cacheable) {
+      DependencyCache::Get()->Insert(key, binary, dependencies);
+    }
+  } else {
+    SAPI_RAW_VLOG(1, "Using cached dependencies of %s", path);
+  }
+
+  if (is_static != nullptr) {
+    *is_static = dependencies.interpreter.empty();
+  }
+  if (dependencies.interpreter.empty()) {
+    return sapi::OkStatus();
+  }
+  SAPI_RETURN_IF_ERROR(AddFile(dependencies.interpreter));
+  for (const auto& lib : dependencies.libraries) {
+    if (flat_library_dir_.empty()) {
+      SAPI_RETURN_IF_ERROR(AddFile(lib));
+    } else {
+      SAPI_RETURN_IF_ERROR(AddFileAt(
+          lib, file::JoinPath(flat_library_dir_,
+                              file_util::fileops::Basename(lib))));
+    }
   }
 
   return sapi::OkStatus();
@@ -422,6 +641,23 @@ sapi::Status Mounts::AddTmpfs(absl::string_view inside, size_t sz) {
   return Insert(inside, node);
 }
 
+sapi::Status Mounts::SetRootImage(absl::string_view image,
+                                  absl::string_view fs_type) {
+  MountTree::Node node;
+  auto* image_node = node.mutable_image_node();
+  image_node->set_outside(std::string(image));
+  image_node->set_fs_type(std::string(fs_type));
+  SAPI_RETURN_IF_ERROR(ValidateNode(node));
+
+  MountTree::Node& root = nodes_[0].node;
+  if (root.has_image_node() && !IsEquivalentNode(root, node)) {
+    return sapi::FailedPreconditionError(absl::StrCat(
+        "Root image already set to ", root.image_node().outside()));
+  }
+  root = node;
+  return sapi::OkStatus();
+}
+
 namespace {
 
 uint64_t GetMountFlagsFor(const std::string& path) {
@@ -480,12 +716,67 @@ void MountWithDefaults(const std::string& source, const std::string& target,
   }
 }
 
-// Traverses the MountTree to create all required files and perform the mounts.
-void CreateMounts(const MountTree& tree, const std::string& path,
-                  bool create_backing_files) {
+// Attaches 'image' read-only to a free loop device, which is detached again
+// when it is unmounted. Returns the path of the device.
+std::string AttachLoopDevice(const std::string& image) {
+  int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  SAPI_RAW_PCHECK(control != -1, "opening /dev/loop-control failed");
+  file_util::fileops::FDCloser control_closer{control};
+  int image_fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+  SAPI_RAW_PCHECK(image_fd != -1, "opening image %s failed", image);
+  file_util::fileops::FDCloser image_closer{image_fd};
+
+  int number = ioctl(control, LOOP_CTL_GET_FREE);
+  SAPI_RAW_PCHECK(number != -1, "no free loop device for %s", image);
+  std::string device = absl::StrCat("/dev/loop", number);
+  int device_fd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+  SAPI_RAW_PCHECK(device_fd != -1, "opening %s failed", device);
+  file_util::fileops::FDCloser device_closer{device_fd};
+
+  loop_config config = {};
+  config.fd = image_fd;
+  config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+  SAPI_RAW_PCHECK(ioctl(device_fd, LOOP_CONFIGURE, &config) != -1,
+                  "attaching %s to %s failed", image, device);
+  return device;
+}
+
+void MountImage(const std::string& image, const std::string& target,
+                const std::string& fs_type) {
+  struct stat st;
+  SAPI_RAW_PCHECK(stat(image.c_str(), &st) != -1, "stat(%s) failed", image);
+  if (S_ISDIR(st.st_mode)) {
+    MountWithDefaults(image, target, "", MS_BIND, nullptr, /* is_ro */ true);
+    return;
+  }
+
+  const uint64_t flags = MS_RDONLY | MS_NODEV | MS_NOSUID;
+  SAPI_RAW_VLOG(1, R"(mount("%s", "%s", "%s", %d))", image, target, fs_type,
+                flags);
+  // erofs mounts regular files itself since Linux 6.12, squashfs and older
+  // kernels need a loop device.
+  if (mount(image.c_str(), target.c_str(), fs_type.c_str(), flags, nullptr) ==
+      0) {
+    return;
+  }
+  SAPI_RAW_PCHECK(errno == ENOTBLK, "mounting image %s to %s failed", image,
+                  target);
+  const std::string device = AttachLoopDevice(image);
+  SAPI_RAW_PCHECK(
+      mount(device.c_str(), target.c_str(), fs_type.c_str(), flags, nullptr) ==
+          0,
+      "mounting image %s (%s) to %s failed", image, device, target);
+}
+
+}  // namespace
+
+// Traverses the trie to create all required files and perform the mounts.
+void Mounts::CreateMounts(uint32_t index, const std::string& path,
+                          bool create_backing_files) const {
+  const MountTree::Node& mount = nodes_[index].node;
   // First, create the backing files if needed.
   if (create_backing_files) {
-    switch (tree.node().node_case()) {
+    switch (mount.node_case()) {
       case MountTree::Node::kFileNode: {
         SAPI_RAW_VLOG(2, "Creating backing file at %s", path);
         int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
@@ -495,6 +786,7 @@ void CreateMounts(const MountTree& tree, const std::string& path,
       }
       case MountTree::Node::kDirNode:
       case MountTree::Node::kTmpfsNode:
+      case MountTree::Node::kImageNode:
       case MountTree::Node::NODE_NOT_SET:
         SAPI_RAW_VLOG(2, "Creating directory at %s", path);
         SAPI_RAW_PCHECK(mkdir(path.c_str(), 0700) == 0 || errno == EEXIST, "");
@@ -504,13 +796,13 @@ void CreateMounts(const MountTree& tree, const std::string& path,
   }
 
   // Perform the actual mounts based on the node type.
-  switch (tree.node().node_case()) {
+  switch (mount.node_case()) {
     case MountTree::Node::kDirNode: {
       // Since this directory is bind mounted, it's the users
       // responsibility to make sure that all backing files are in place.
       create_backing_files = false;
 
-      auto node = tree.node().dir_node();
+      const auto& node = mount.dir_node();
       MountWithDefaults(node.outside(), path, "", MS_BIND, nullptr,
                         node.is_ro());
       break;
@@ -519,13 +811,21 @@ void CreateMounts(const MountTree& tree, const std::string& path,
       // We can always create backing files under a tmpfs.
       create_backing_files = true;
 
-      auto node = tree.node().tmpfs_node();
+      const auto& node = mount.tmpfs_node();
       MountWithDefaults("", path, "tmpfs", 0, node.tmpfs_options().c_str(),
                         /* is_ro */ false);
       break;
     }
+    case MountTree::Node::kImageNode: {
+      // The image is read-only, its mount points are part of it.
+      create_backing_files = false;
+
+      const auto& node = mount.image_node();
+      MountImage(node.outside(), path, node.fs_type());
+      break;
+    }
     case MountTree::Node::kFileNode: {
-      auto node = tree.node().file_node();
+      const auto& node = mount.file_node();
       MountWithDefaults(node.outside(), path, "", MS_BIND, nullptr,
                         node.is_ro());
 
@@ -539,25 +839,46 @@ void CreateMounts(const MountTree& tree, const std::string& path,
   }
 
   // Traverse the subtrees.
-  for (const auto& kv : tree.entries()) {
-    std::string new_path = file::JoinPath(path, kv.first);
-    CreateMounts(kv.second, new_path, create_backing_files);
+  for (const auto& entry : nodes_[index].entries) {
+    std::string new_path = file::JoinPath(path, names_[entry.first]);
+    CreateMounts(entry.second, new_path, create_backing_files);
   }
 }
 
-}  // namespace
-
 void Mounts::CreateMounts(const std::string& root_path) const {
-  sandbox2::CreateMounts(mount_tree_, root_path, true);
+  CreateMounts(0, root_path, true);
 }
 
-namespace {
+void Mounts::AddMountTree(uint32_t index, const MountTree& tree) {
+  if (tree.has_node()) {
+    nodes_[index].node = tree.node();
+  }
+  for (const auto& entry : tree.entries()) {
+    AddMountTree(FindOrAddChild(index, entry.first), entry.second);
+  }
+}
+
+void Mounts::BuildMountTree(uint32_t index, MountTree* tree) const {
+  const TrieNode& node = nodes_[index];
+  if (node.node.node_case() != MountTree::Node::NODE_NOT_SET) {
+    *tree->mutable_node() = node.node;
+  }
+  auto* entries = tree->mutable_entries();
+  for (const auto& entry : node.entries) {
+    BuildMountTree(entry.second, &(*entries)[names_[entry.first]]);
+  }
+}
 
-void RecursivelyListMountsImpl(const MountTree& tree,
-                               const std::string& tree_path,
-                               std::vector<std::string>* outside_entries,
-                               std::vector<std::string>* inside_entries) {
-  const MountTree::Node& node = tree.node();
+MountTree Mounts::GetMountTree() const {
+  MountTree tree;
+  BuildMountTree(0, &tree);
+  return tree;
+}
+
+void Mounts::ListMounts(uint32_t index, const std::string& tree_path,
+                        std::vector<std::string>* outside_entries,
+                        std::vector<std::string>* inside_entries) const {
+  const MountTree::Node& node = nodes_[index].node;
   if (node.has_dir_node()) {
     const char* rw_str = node.dir_node().is_ro() ? "R " : "W ";
     inside_entries->emplace_back(absl::StrCat(rw_str, tree_path, "/"));
@@ -569,21 +890,21 @@ void RecursivelyListMountsImpl(const MountTree& tree,
   } else if (node.has_tmpfs_node()) {
     outside_entries->emplace_back(
         absl::StrCat("tmpfs: ", node.tmpfs_node().tmpfs_options()));
+  } else if (node.has_image_node()) {
+    inside_entries->emplace_back(absl::StrCat("R ", tree_path, "/"));
+    outside_entries->emplace_back(absl::StrCat(
+        node.image_node().fs_type(), ": ", node.image_node().outside()));
   }
 
-  for (const auto& subentry : tree.entries()) {
-    RecursivelyListMountsImpl(subentry.second,
-                              absl::StrCat(tree_path, "/", subentry.first),
-                              outside_entries, inside_entries);
+  for (const auto& entry : nodes_[index].entries) {
+    ListMounts(entry.second, absl::StrCat(tree_path, "/", names_[entry.first]),
+               outside_entries, inside_entries);
   }
 }
 
-}  // namespace
-
 void Mounts::RecursivelyListMounts(std::vector<std::string>* outside_entries,
                                    std::vector<std::string>* inside_entries) {
-  RecursivelyListMountsImpl(GetMountTree(), "", outside_entries,
-                            inside_entries);
+  ListMounts(0, "", outside_entries, inside_entries);
 }
 
 }  // namespace sandbox2
@@ -15,37 +15,73 @@
 #ifndef SANDBOXED_API_SANDBOX2_MOUNTTREE_H_
 #define SANDBOXED_API_SANDBOX2_MOUNTTREE_H_
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
 #include "absl/base/attributes.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/string_view.h"
 #include "sandboxed_api/sandbox2/mounttree.pb.h"
 #include "sandboxed_api/util/status.h"
 
 namespace sandbox2 {
 
+// The mounts of a sandboxee. They are kept in a trie of interned path
+// components while they are being added, and only converted to a MountTree
+// when they are sent to the fork server.
 class Mounts {
  public:
-  Mounts() = default;
-  explicit Mounts(MountTree mount_tree) : mount_tree_(std::move(mount_tree)) {}
+  Mounts() : nodes_(1) {}
+  explicit Mounts(const MountTree& mount_tree);
 
   sapi::Status AddFile(absl::string_view path, bool is_ro = true);
 
   sapi::Status AddFileAt(absl::string_view outside, absl::string_view inside,
                          bool is_ro = true);
 
+  // Adds the files 'names', paths relative to 'outside_dir', at the same
+  // relative paths below 'inside_dir', e.g. a whole directory listing. The
+  // common prefix is only looked up once.
+  sapi::Status AddFilesAt(absl::string_view outside_dir,
+                          absl::string_view inside_dir,
+                          const std::vector<std::string>& names,
+                          bool is_ro = true);
+
   sapi::Status AddDirectoryAt(absl::string_view outside,
                               absl::string_view inside, bool is_ro = true);
 
+  // Adds the interpreter and the shared libraries of the binary 'path'. Sets
+  // 'is_static', if not null, to whether the binary is static or static-PIE,
+  // i.e. has no interpreter, in which case nothing is added. The libraries are
+  // mounted at their own paths, or all in flat_library_dir() if it is set.
   sapi::Status AddMappingsForBinary(const std::string& path,
-                                    absl::string_view ld_library_path = {});
+                                    absl::string_view ld_library_path = {},
+                                    bool* is_static = nullptr);
 
   sapi::Status AddTmpfs(absl::string_view inside, size_t sz);
 
+  // Makes the read-only filesystem image 'image' the root directory, with a
+  // single mount instead of one per file. 'fs_type' is "erofs" or "squashfs".
+  // The other mounts are made on top of it, their mount points have to exist
+  // in the image since it cannot be written to. A directory 'image' is bind
+  // mounted, e.g. the image mounted once by the host.
+  sapi::Status SetRootImage(absl::string_view image, absl::string_view fs_type);
+
+  // Makes later calls to AddMappingsForBinary() mount the shared libraries in
+  // the single directory 'dir', under their sonames, instead of at their
+  // outside paths. With 'dir' in LD_LIBRARY_PATH, ld.so finds every library
+  // at its first attempt instead of probing the hwcap subdirectories and the
+  // default paths. Libraries with equal names but different outside paths
+  // conflict. The interpreter is still mounted at its own path.
+  void SetFlatLibraryDir(absl::string_view dir) {
+    flat_library_dir_ = std::string(dir);
+  }
+  const std::string& flat_library_dir() const { return flat_library_dir_; }
+
   void CreateMounts(const std::string& root_path) const;
 
-  MountTree GetMountTree() const { return mount_tree_; }
+  MountTree GetMountTree() const;
 
   // Lists the outside and inside entries of the input tree in the output
   // parameters, in an ls-like manner. Each entry is traversed in the
@@ -59,8 +95,43 @@ class Mounts {
 
  private:
   friend class MountTreeTest;
+
+  // A node of the trie. Directories which are only there to hold their
+  // entries have no node set.
+  struct TrieNode {
+    MountTree::Node node;
+    // Indices of the child nodes in nodes_, by the ids of their names.
+    absl::flat_hash_map<uint32_t, uint32_t> entries;
+  };
+
   sapi::Status Insert(absl::string_view path, const MountTree::Node& node);
-  MountTree mount_tree_;
+  // Inserts 'node' at 'path' relative to the trie node 'parent'. 'path' is
+  // only used in error messages.
+  sapi::Status InsertAt(uint32_t parent, absl::string_view relative_path,
+                        absl::string_view path, const MountTree::Node& node);
+  // Returns the index of the directory at the clean, absolute 'path', which is
+  // created if needed, or an error if a file is mounted on the way.
+  sapi::Status FindOrAddDirectory(uint32_t parent,
+                                  absl::string_view relative_path,
+                                  absl::string_view path, uint32_t* index);
+  // Returns the index of the child 'name' of 'parent', adding it if needed.
+  uint32_t FindOrAddChild(uint32_t parent, absl::string_view name);
+
+  void AddMountTree(uint32_t index, const MountTree& tree);
+  void BuildMountTree(uint32_t index, MountTree* tree) const;
+  void CreateMounts(uint32_t index, const std::string& path,
+                    bool create_backing_files) const;
+  void ListMounts(uint32_t index, const std::string& tree_path,
+                  std::vector<std::string>* outside_entries,
+                  std::vector<std::string>* inside_entries) const;
+
+  // nodes_[0] is the root directory.
+  std::vector<TrieNode> nodes_;
+  // Interned path components, names_[id] has the id name_ids_[names_[id]].
+  std::vector<std::string> names_;
+  absl::flat_hash_map<std::string, uint32_t> name_ids_;
+  // Not part of the MountTree, see SetFlatLibraryDir().
+  std::string flat_library_dir_;
 };
 
 }  // namespace sandbox2
@@ -30,7 +30,11 @@
 
 using sapi::IsOk;
 using sapi::StatusIs;
+using ::testing::Contains;
 using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
 using ::testing::UnorderedElementsAreArray;
 
 namespace sandbox2 {
@@ -68,6 +72,51 @@ TEST(MountTreeTest, TestAddFile) {
   EXPECT_THAT(mounts.AddFileAt("/a", "/f"), IsOk());
 }
 
+TEST(MountTreeTest, TestAddFilesAt) {
+  Mounts mounts;
+
+  EXPECT_THAT(
+      mounts.AddFilesAt("/usr/lib/py", "/py", {"os.py", "json/__init__.py"}),
+      IsOk());
+  // Inserting the same files again is fine.
+  EXPECT_THAT(mounts.AddFilesAt("/usr/lib/py", "/py/", {"os.py"}), IsOk());
+  EXPECT_THAT(mounts.AddFilesAt("/usr/lib/py", "/py", {"../etc/passwd"}),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(mounts.AddFilesAt("/usr/lib/py", "/py/os.py", {"a"}),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+
+  std::vector<std::string> outside_entries;
+  std::vector<std::string> inside_entries;
+  mounts.RecursivelyListMounts(&outside_entries, &inside_entries);
+  EXPECT_THAT(inside_entries, UnorderedElementsAreArray({
+                                  "R /py/os.py",
+                                  "R /py/json/__init__.py",
+                              }));
+  EXPECT_THAT(outside_entries, UnorderedElementsAreArray({
+                                   "/usr/lib/py/os.py",
+                                   "/usr/lib/py/json/__init__.py",
+                               }));
+}
+
+TEST(MountTreeTest, TestMountTreeRoundTrip) {
+  Mounts mounts;
+  ASSERT_THAT(mounts.AddFile("/a/b"), IsOk());
+  ASSERT_THAT(mounts.AddDirectoryAt("/c", "/d/e", false), IsOk());
+  ASSERT_THAT(mounts.AddTmpfs("/f", kTmpfsSize), IsOk());
+
+  Mounts copy(mounts.GetMountTree());
+  std::vector<std::string> outside_entries;
+  std::vector<std::string> inside_entries;
+  copy.RecursivelyListMounts(&outside_entries, &inside_entries);
+  EXPECT_THAT(inside_entries, UnorderedElementsAreArray({
+                                  "R /a/b",
+                                  "W /d/e/",
+                              }));
+  // Conflicts are still detected after the conversion.
+  EXPECT_THAT(copy.AddFile("/a/b/c"),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
 TEST(MountTreeTest, TestAddDir) {
   Mounts mounts;
 
@@ -85,6 +134,26 @@ TEST(MountTreeTest, TestAddTmpFs) {
   EXPECT_THAT(mounts.AddDirectoryAt("/a/b/d", "/a/b/d"), IsOk());
 }
 
+TEST(MountTreeTest, TestSetRootImage) {
+  Mounts mounts;
+
+  EXPECT_THAT(mounts.SetRootImage("/images/root.erofs", "ext4"),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(mounts.SetRootImage("", "erofs"),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  ASSERT_THAT(mounts.SetRootImage("/images/root.erofs", "erofs"), IsOk());
+  EXPECT_THAT(mounts.SetRootImage("/images/root.erofs", "erofs"), IsOk());
+  EXPECT_THAT(mounts.SetRootImage("/images/other.sqfs", "squashfs"),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+  EXPECT_THAT(mounts.AddTmpfs("/tmp", kTmpfsSize), IsOk());
+
+  MountTree tree = mounts.GetMountTree();
+  ASSERT_THAT(tree.node().has_image_node(), IsTrue());
+  EXPECT_THAT(tree.node().image_node().outside(), Eq("/images/root.erofs"));
+  EXPECT_THAT(Mounts(tree).GetMountTree().node().image_node().fs_type(),
+              Eq("erofs"));
+}
+
 TEST(MountTreeTest, TestMultipleInsertionFileSymlink) {
   Mounts mounts;
 
@@ -169,6 +238,63 @@ TEST(MountTreeTest, TestMinimalDynamicBinary) {
   EXPECT_THAT(mounts.AddFile("/lib/x86_64-linux-gnu/libc.so.6"), IsOk());
 }
 
+TEST(MountTreeTest, TestMinimalStaticBinary) {
+  Mounts mounts;
+  bool is_static = false;
+  EXPECT_THAT(
+      mounts.AddMappingsForBinary(
+          GetTestSourcePath("sandbox2/testcases/minimal"), {}, &is_static),
+      IsOk());
+  EXPECT_THAT(is_static, IsTrue());
+  std::vector<std::string> outside, inside;
+  mounts.RecursivelyListMounts(&outside, &inside);
+  EXPECT_THAT(outside, IsEmpty());
+
+  EXPECT_THAT(
+      mounts.AddMappingsForBinary(
+          GetTestSourcePath("sandbox2/testcases/minimal_dynamic"), {},
+          &is_static),
+      IsOk());
+  EXPECT_THAT(is_static, IsFalse());
+}
+
+TEST(MountTreeTest, TestMinimalDynamicBinaryCached) {
+  // The second call uses the cached dependencies.
+  const std::string path =
+      GetTestSourcePath("sandbox2/testcases/minimal_dynamic");
+  Mounts first;
+  Mounts second;
+  ASSERT_THAT(first.AddMappingsForBinary(path), IsOk());
+  ASSERT_THAT(second.AddMappingsForBinary(path), IsOk());
+
+  std::vector<std::string> first_outside, first_inside;
+  std::vector<std::string> second_outside, second_inside;
+  first.RecursivelyListMounts(&first_outside, &first_inside);
+  second.RecursivelyListMounts(&second_outside, &second_inside);
+  EXPECT_THAT(second_outside, Eq(first_outside));
+  EXPECT_THAT(second_inside, Eq(first_inside));
+}
+
+TEST(MountTreeTest, TestMinimalDynamicBinaryFlatLibraryDir) {
+  Mounts mounts;
+  mounts.SetFlatLibraryDir("/lib_flat");
+  ASSERT_THAT(mounts.AddMappingsForBinary(
+                  GetTestSourcePath("sandbox2/testcases/minimal_dynamic")),
+              IsOk());
+
+  std::vector<std::string> outside, inside;
+  mounts.RecursivelyListMounts(&outside, &inside);
+  ASSERT_THAT(inside, Contains("R /lib_flat/libc.so.6"));
+  // Only the interpreter is mounted at its own path.
+  size_t num_flat = 0;
+  for (const auto& entry : inside) {
+    if (absl::StartsWith(entry, "R /lib_flat/")) {
+      ++num_flat;
+    }
+  }
+  EXPECT_THAT(num_flat, Eq(inside.size() - 1));
+}
+
 TEST(MountTreeTest, TestList) {
   struct TestCase {
     const char *path;
@@ -27,6 +27,7 @@
 #include <syscall.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <utility>
@@ -35,6 +36,7 @@
 #include "absl/strings/str_format.h"
 
 #include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/startup_times.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
 #include "sandboxed_api/sandbox2/util/path.h"
@@ -191,6 +193,8 @@ Namespace::Namespace(bool allow_unrestricted_networking, Mounts mounts,
                    CLONE_NEWIPC),
       mounts_(std::move(mounts)),
       hostname_(std::move(hostname)) {
+  static std::atomic<uint64_t> next_template_id{1};
+  template_id_ = next_template_id.fetch_add(1, std::memory_order_relaxed);
   if (!allow_unrestricted_networking) {
     clone_flags_ |= CLONE_NEWNET;
   }
@@ -202,7 +206,8 @@ int32_t Namespace::GetCloneFlags() const { return clone_flags_; }
 
 void Namespace::InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
                                      const Mounts& mounts, bool mount_proc,
-                                     const std::string& hostname) {
+                                     const std::string& hostname,
+                                     const std::string& prebuilt_root) {
   if (clone_flags & CLONE_NEWUSER) {
     // Set up the uid and gid map.
     TryDenySetgroups();
@@ -212,6 +217,7 @@ void Namespace::InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
 
   if (!(clone_flags & CLONE_NEWNS)) {
     // CLONE_NEWNS is always set if we're running in namespaces.
+    GetSandboxeeStartupTimes()->namespaces = MonotonicNanos();
     return;
   }
 
@@ -237,7 +243,14 @@ void Namespace::InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
     ActivateLoopbackInterface();
   }
 
-  PrepareChroot(mounts);
+  GetSandboxeeStartupTimes()->namespaces = MonotonicNanos();
+
+  const char* new_root = kSandbox2ChrootPath;
+  if (prebuilt_root.empty()) {
+    PrepareChroot(mounts);
+  } else {
+    new_root = prebuilt_root.c_str();
+  }
 
   // This requires some explanation: It's actually possible to pivot_root('/',
   // '/'). After this operation has been completed, the old root is mounted over
@@ -245,11 +258,11 @@ void Namespace::InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
   // as '/'. This allows us not care about providing any special directory for
   // old_root, which is sometimes not easy, given that e.g. /tmp might not
   // always be present inside new_root.
-  SAPI_RAW_PCHECK(
-      syscall(__NR_pivot_root, kSandbox2ChrootPath, kSandbox2ChrootPath) != -1,
-      "pivot root");
+  SAPI_RAW_PCHECK(syscall(__NR_pivot_root, new_root, new_root) != -1,
+                  "pivot root");
   SAPI_RAW_PCHECK(umount2("/", MNT_DETACH) != -1, "detaching old root");
   SAPI_RAW_PCHECK(chdir("/") == 0, "changing cwd after pivot_root failed");
+  GetSandboxeeStartupTimes()->mounts = MonotonicNanos();
 
   if (SAPI_VLOG_IS_ON(2)) {
     SAPI_RAW_VLOG(2, "Dumping the sandboxee's filesystem:");
@@ -257,6 +270,67 @@ void Namespace::InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
   }
 }
 
+void Namespace::InitializeNamespaceTemplate(uid_t uid, gid_t gid) {
+  TryDenySetgroups();
+  WriteIDMap("/proc/self/uid_map", uid);
+  WriteIDMap("/proc/self/gid_map", gid);
+  ActivateLoopbackInterface();
+
+  // Keep the prebuilt mount trees from propagating anywhere, and give them a
+  // place of their own.
+  SAPI_RAW_PCHECK(mount("", "/", nullptr, MS_REC | MS_PRIVATE, nullptr) == 0,
+                  "making mounts private failed");
+  SAPI_RAW_CHECK(util::CreateDirRecursive(kSandbox2ChrootPath, 0700),
+                 "could not create directory for prebuilt roots");
+  SAPI_RAW_PCHECK(mount("none", kSandbox2ChrootPath, "tmpfs", 0, nullptr) == 0,
+                  "mounting the tmpfs for prebuilt roots failed");
+}
+
+void Namespace::CreateNetworkNamespace() {
+  SAPI_RAW_PCHECK(unshare(CLONE_NEWNET) == 0,
+                  "Could not create a network namespace");
+  ActivateLoopbackInterface();
+}
+
+bool Namespace::CanPrebuildMountTree(const MountTree& tree) {
+  if (tree.has_node() && tree.node().has_tmpfs_node()) {
+    return false;
+  }
+  for (const auto& entry : tree.entries()) {
+    if (!CanPrebuildMountTree(entry.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string Namespace::GetPrebuiltRoot(int id) {
+  return absl::StrCat(kSandbox2ChrootPath, "/", id);
+}
+
+bool Namespace::PrebuildMountTree(const Mounts& mounts,
+                                  const std::string& root) {
+  if (mkdir(root.c_str(), 0700) != 0) {
+    SAPI_RAW_PLOG(ERROR, "creating directory for prebuilt root %s", root);
+    return false;
+  }
+  if (mount("none", root.c_str(), "tmpfs", 0, nullptr) != 0) {
+    SAPI_RAW_PLOG(ERROR, "mounting prebuilt root %s", root);
+    return false;
+  }
+
+  // Walk the tree and perform all the mount operations.
+  mounts.CreateMounts(root);
+
+  // The sandboxees share the root directory.
+  if (mount(root.c_str(), root.c_str(), "",
+            MS_BIND | MS_REMOUNT | MS_RDONLY, nullptr) != 0) {
+    SAPI_RAW_PLOG(ERROR, "remounting prebuilt root %s RO", root);
+    return false;
+  }
+  return true;
+}
+
 void Namespace::GetNamespaceDescription(NamespaceDescription* pb_description) {
   pb_description->set_clone_flags(clone_flags_);
   *pb_description->mutable_mount_tree_mounts() = mounts_.GetMountTree();
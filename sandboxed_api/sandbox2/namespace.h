@@ -32,10 +32,37 @@ namespace sandbox2 {
 
 class Namespace final {
  public:
-  // Performs the namespace setup (mounts, write the uid_map, etc.).
+  // Performs the namespace setup (mounts, write the uid_map, etc.). If
+  // prebuilt_root is not empty, it is used as the root directory instead of
+  // creating the mounts, see PrebuildMountTree().
   static void InitializeNamespaces(uid_t uid, gid_t gid, int32_t clone_flags,
                                    const Mounts& mounts, bool mount_proc,
-                                   const std::string& hostname);
+                                   const std::string& hostname,
+                                   const std::string& prebuilt_root = "");
+
+  // Sets up the user, network and mount namespace the calling process has just
+  // been cloned into, so that sandboxees can join them as a namespace
+  // template.
+  static void InitializeNamespaceTemplate(uid_t uid, gid_t gid);
+
+  // Moves the calling process into a new network namespace and brings up its
+  // loopback interface. Used to fill the pool of network namespaces of the
+  // fork server.
+  static void CreateNetworkNamespace();
+
+  // Returns whether a mount tree can be prebuilt and shared by sandboxees. It
+  // must not contain tmpfs mounts, as their contents would be shared.
+  static bool CanPrebuildMountTree(const MountTree& tree);
+
+  // Returns the directory in the namespace template for the prebuilt mount
+  // tree with the given id.
+  static std::string GetPrebuiltRoot(int id);
+
+  // Creates all mounts in 'root', in the mount namespace of the namespace
+  // template. Sandboxees which join the template find the mounts in their copy
+  // of the mount namespace, so that they only have to pivot_root() into it.
+  // The root directory itself is read-only.
+  static bool PrebuildMountTree(const Mounts& mounts, const std::string& root);
 
   Namespace() = delete;
   Namespace(const Namespace&) = delete;
@@ -46,6 +73,24 @@ class Namespace final {
 
   void DisableUserNamespace();
 
+  // Makes sandboxees join a user and network namespace which the fork server
+  // creates once, instead of creating new ones, see
+  // PolicyBuilder::UseNamespaceTemplate().
+  void EnableNamespaceTemplate() { use_namespace_template_ = true; }
+  bool uses_namespace_template() const { return use_namespace_template_; }
+
+  // Makes sandboxees joining the namespace template take a network namespace
+  // of their own from a pool, see PolicyBuilder::UseNetworkNamespacePool().
+  void EnableNetworkNamespacePool() { use_network_namespace_pool_ = true; }
+  bool uses_network_namespace_pool() const {
+    return use_network_namespace_pool_;
+  }
+
+  // Makes the sandboxee run as PID 1 of its PID namespace, without an init
+  // process, see PolicyBuilder::RunSandboxeeAsInit().
+  void EnableSandboxeeAsInit() { sandboxee_as_init_ = true; }
+  bool runs_sandboxee_as_init() const { return sandboxee_as_init_; }
+
   // Returns all needed CLONE_NEW* flags.
   int32_t GetCloneFlags() const;
 
@@ -57,12 +102,21 @@ class Namespace final {
 
   const std::string& hostname() const { return hostname_; }
 
+  // Identifies the mounts and the hostname of this Namespace towards the
+  // ForkServer, which only receives them with the first request, see
+  // ForkRequest.template_id. Unique within the process and never 0.
+  uint64_t template_id() const { return template_id_; }
+
  private:
   friend class StackTracePeer;
 
   int32_t clone_flags_;
   Mounts mounts_;
   std::string hostname_;
+  bool use_namespace_template_ = false;
+  bool use_network_namespace_pool_ = false;
+  bool sandboxee_as_init_ = false;
+  uint64_t template_id_;
 };
 
 }  // namespace sandbox2
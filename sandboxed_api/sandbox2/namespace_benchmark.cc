@@ -0,0 +1,243 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the cost of namespaces and mounts when starting a sandboxee.
+// Each run times a Sandbox2::Run() of a sandboxee exiting right away, for the
+// namespace setups PolicyBuilder offers, different numbers of mounted files,
+// with and without a tmpfs, and launched either by the global ForkServer with
+// execve() or forked by a custom fork server (see ForkingClient).
+//
+// Run with: bazel run -c opt //sandboxed_api/sandbox2:namespace_benchmark
+// Add --benchmark_format=json (or csv) for machine-readable results, the
+// dimensions of every run are also reported as counters.
+
+#include <syscall.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/base/macros.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/forkserver.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/sandbox2/util/runfiles.h"
+#include "sandboxed_api/sandbox2/util/temp_file.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+namespace {
+
+enum NamespaceKind {
+  // PolicyBuilder::DisableNamespaces(), no mounts possible.
+  kNoNamespaces,
+  // The default: user, mount, UTS, PID, IPC and network namespaces.
+  kAllNamespaces,
+  // PolicyBuilder::AllowUnrestrictedNetworking(), no network namespace.
+  kNoNetworkNamespace,
+  // PolicyBuilder::UseNamespaceTemplate().
+  kNamespaceTemplate,
+  // PolicyBuilder::UseNetworkNamespacePool().
+  kNetworkNamespacePool,
+};
+
+const char* const kNamespaceNames[] = {"none", "all", "no_net", "template",
+                                       "net_pool"};
+
+enum LaunchKind {
+  // The global ForkServer, which execve()s the sandboxee.
+  kForkServerExecve,
+  // Forked by custom_fork_bin, without execve(). It expects to be PID 2 of a
+  // PID namespace of its own, so only used with kAllNamespaces and
+  // kNoNetworkNamespace.
+  kCustomFork,
+};
+
+const char* const kLaunchNames[] = {"forkserver_execve", "custom_fork"};
+
+const int64_t kMountCounts[] = {0, 10, 100, 1000};
+
+// Creates a directory with as many files as the largest mount count.
+sapi::StatusOr<std::string> CreateMountedFiles() {
+  SAPI_ASSIGN_OR_RETURN(std::string dir,
+                        CreateTempDir("/tmp/namespace_benchmark_"));
+  const int64_t max_mounts = kMountCounts[ABSL_ARRAYSIZE(kMountCounts) - 1];
+  for (int64_t i = 0; i < max_mounts; ++i) {
+    SAPI_RETURN_IF_ERROR(file::SetContents(
+        file::JoinPath(dir, absl::StrCat(i)), "", file::Defaults()));
+  }
+  return dir;
+}
+
+// Returns the directory holding the files passed to AddFileAt(), created on
+// first use.
+sapi::StatusOr<std::string> GetMountedFilesDir() {
+  static auto* dir = new sapi::StatusOr<std::string>(CreateMountedFiles());
+  return *dir;
+}
+
+sapi::StatusOr<std::unique_ptr<Policy>> BuildPolicy(NamespaceKind kind,
+                                                   LaunchKind launch,
+                                                   int64_t mounts,
+                                                   bool tmpfs) {
+  PolicyBuilder builder;
+  if (launch == kCustomFork) {
+    // What custom_fork_bin needs after SandboxMeHere().
+    builder.AllowRead().AllowWrite().AllowExit().AllowTime().AllowSyscalls({
+      __NR_close, __NR_getpid,
+#ifdef __NR_arch_prctl
+          __NR_arch_prctl,
+#endif
+    });
+  } else {
+    builder.AllowStaticStartup().AllowExit();
+  }
+  switch (kind) {
+    case kNoNamespaces:
+      builder.DisableNamespaces();
+      break;
+    case kAllNamespaces:
+      break;
+    case kNoNetworkNamespace:
+      builder.AllowUnrestrictedNetworking();
+      break;
+    case kNamespaceTemplate:
+      builder.UseNamespaceTemplate();
+      break;
+    case kNetworkNamespacePool:
+      builder.UseNetworkNamespacePool();
+      break;
+  }
+  if (mounts > 0) {
+    SAPI_ASSIGN_OR_RETURN(std::string dir, GetMountedFilesDir());
+    for (int64_t i = 0; i < mounts; ++i) {
+      const std::string name = absl::StrCat(i);
+      builder.AddFileAt(file::JoinPath(dir, name),
+                        file::JoinPath("/mounted", name));
+    }
+  }
+  if (tmpfs) {
+    builder.AddTmpfs("/tmp");
+  }
+  return builder.TryBuild();
+}
+
+// Starts custom_fork_bin once, it forks all sandboxees of kCustomFork.
+ForkClient* GetCustomForkClient() {
+  static ForkClient* fork_client = []() -> ForkClient* {
+    const std::string path = GetInternalDataDependencyFilePath(
+        "sandbox2/examples/custom_fork/custom_fork_bin");
+    // Leaked, the fork server runs as long as the benchmark.
+    auto* executor = new Executor(path, std::vector<std::string>{path},
+                                  std::vector<std::string>{});
+    return executor->StartForkServer().release();
+  }();
+  return fork_client;
+}
+
+// Starts a sandboxee and waits for it to exit.
+sapi::Status RunSandboxee(NamespaceKind kind, LaunchKind launch,
+                          int64_t mounts, bool tmpfs) {
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<Policy> policy,
+                        BuildPolicy(kind, launch, mounts, tmpfs));
+  std::unique_ptr<Executor> executor;
+  if (launch == kCustomFork) {
+    ForkClient* fork_client = GetCustomForkClient();
+    if (fork_client == nullptr) {
+      return sapi::InternalError("Could not start custom_fork_bin");
+    }
+    executor = absl::make_unique<Executor>(fork_client);
+  } else {
+    const std::string path = GetDataDependencyFilePath(
+        "sandboxed_api/sandbox2/testcases/minimal");
+    executor =
+        absl::make_unique<Executor>(path, std::vector<std::string>{path});
+  }
+  Comms* comms = executor->ipc()->comms();
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  if (!s2.RunAsync()) {
+    return sapi::InternalError("Could not start the sandboxee");
+  }
+  // custom_fork_bin exits with the value sent.
+  if (launch == kCustomFork && !comms->SendInt32(0)) {
+    s2.Kill();
+  }
+  Result result = s2.AwaitResult();
+  if (result.final_status() != Result::OK) {
+    return sapi::InternalError(
+        absl::StrCat("Sandboxee failed: ", result.ToString()));
+  }
+  return sapi::OkStatus();
+}
+
+// Arguments are the NamespaceKind, the LaunchKind, the number of mounted files
+// and whether a tmpfs is mounted.
+void BenchmarkSpawn(benchmark::State& state) {
+  const auto kind = static_cast<NamespaceKind>(state.range(0));
+  const auto launch = static_cast<LaunchKind>(state.range(1));
+  const int64_t mounts = state.range(2);
+  const bool tmpfs = state.range(3) != 0;
+  for (auto _ : state) {
+    sapi::Status status = RunSandboxee(kind, launch, mounts, tmpfs);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      return;
+    }
+  }
+  state.SetLabel(absl::StrCat(kNamespaceNames[kind], "/", kLaunchNames[launch],
+                              "/mounts:", mounts, tmpfs ? "/tmpfs" : ""));
+  state.counters["namespaces"] = kind;
+  state.counters["launch"] = launch;
+  state.counters["mounts"] = mounts;
+  state.counters["tmpfs"] = tmpfs;
+}
+
+void SpawnMatrix(benchmark::internal::Benchmark* b) {
+  for (int kind = kNoNamespaces; kind <= kNetworkNamespacePool; ++kind) {
+    for (int launch = kForkServerExecve; launch <= kCustomFork; ++launch) {
+      for (int64_t mounts : kMountCounts) {
+        for (int tmpfs = 0; tmpfs <= 1; ++tmpfs) {
+          // Mounts need a mount namespace.
+          if (kind == kNoNamespaces && (mounts > 0 || tmpfs)) {
+            continue;
+          }
+          if (launch == kCustomFork && kind != kAllNamespaces &&
+              kind != kNoNetworkNamespace) {
+            continue;
+          }
+          b->Args({kind, launch, mounts, tmpfs});
+        }
+      }
+    }
+  }
+}
+BENCHMARK(BenchmarkSpawn)->Apply(SpawnMatrix)->UseRealTime();
+
+}  // namespace
+}  // namespace sandbox2
+
+BENCHMARK_MAIN();
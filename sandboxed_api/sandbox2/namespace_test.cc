@@ -16,6 +16,7 @@
 
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <syscall.h>
 #include <unistd.h>
 
@@ -35,6 +36,9 @@
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/sandbox2/util/temp_file.h"
 #include "sandboxed_api/util/status_matchers.h"
 
 namespace sandbox2 {
@@ -94,6 +98,72 @@ TEST(NamespaceTest, UserNamespaceWorks) {
   }
 }
 
+TEST(NamespaceTest, SandboxeeAsInitIsPidOne) {
+  const std::string path = GetTestSourcePath("sandbox2/testcases/namespace");
+  std::vector<std::string> args = {path, "4"};
+  for (bool use_template : {false, true}) {
+    SCOPED_TRACE(use_template ? "namespace template" : "new namespaces");
+    PolicyBuilder builder;
+    builder.RunSandboxeeAsInit()
+        // Don't restrict the syscalls at all
+        .DangerDefaultAllowAll();
+    if (use_template) {
+      builder.UseNamespaceTemplate();
+    }
+    SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+
+    Sandbox2 sandbox(absl::make_unique<Executor>(path, args),
+                     std::move(policy));
+    auto result = sandbox.Run();
+
+    ASSERT_EQ(result.final_status(), Result::OK);
+    EXPECT_EQ(result.reason_code(), 0);
+  }
+}
+
+TEST(NamespaceTest, RootImageDirectoryIsBindMountedReadOnly) {
+  // Stands in for an image mounted on the host, with the mount point of /proc.
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::string root,
+      CreateTempDir(file::JoinPath(GetTestTempPath(), "root_image_")));
+  ASSERT_EQ(mkdir(file::JoinPath(root, "proc").c_str(), 0755), 0);
+  ASSERT_EQ(mkdir(file::JoinPath(root, "etc").c_str(), 0755), 0);
+  ASSERT_THAT(file::SetContents(file::JoinPath(root, "etc/marker"), "image",
+                                file::Defaults()),
+              sapi::IsOk());
+
+  const std::string path = GetTestSourcePath("sandbox2/testcases/namespace");
+  // The file of the image is there, the host's binary is not.
+  std::vector<std::string> args = {path, "0", "/etc/marker", path};
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        // Don't restrict the syscalls at all
+                                        .DangerDefaultAllowAll()
+                                        .UseRootImage(root)
+                                        .TryBuild());
+  {
+    Sandbox2 sandbox(absl::make_unique<Executor>(path, args),
+                     std::move(policy));
+    auto result = sandbox.Run();
+    ASSERT_EQ(result.final_status(), Result::OK);
+    EXPECT_EQ(result.reason_code(), 2);
+  }
+
+  // And it cannot be written.
+  args = {path, "1", "/etc/marker"};
+  SAPI_ASSERT_OK_AND_ASSIGN(policy, PolicyBuilder()
+                                        // Don't restrict the syscalls at all
+                                        .DangerDefaultAllowAll()
+                                        .UseRootImage(root)
+                                        .TryBuild());
+  {
+    Sandbox2 sandbox(absl::make_unique<Executor>(path, args),
+                     std::move(policy));
+    auto result = sandbox.Run();
+    ASSERT_EQ(result.final_status(), Result::OK);
+    EXPECT_EQ(result.reason_code(), 1);
+  }
+}
+
 TEST(NamespaceTest, UserNamespaceIDMapWritten) {
   // Check that the idmap is initialized before the sandbox application is
   // started.
@@ -67,8 +67,6 @@ int NetworkProxyClient::ConnectHandler(int sockfd, const struct sockaddr* addr,
 sapi::Status NetworkProxyClient::Connect(int sockfd,
                                          const struct sockaddr* addr,
                                          socklen_t addrlen) {
-  absl::MutexLock lock(&mutex_);
-
   // Check if socket is SOCK_STREAM
   int type;
   socklen_t type_size = sizeof(int);
@@ -82,39 +80,68 @@ sapi::Status NetworkProxyClient::Connect(int sockfd,
         "Invalid socket, only SOCK_STREAM is allowed");
   }
 
-  // Send sockaddr struct
-  if (!comms_.SendBytes(reinterpret_cast<const uint8_t*>(addr), addrlen)) {
+  absl::MutexLock lock(&mutex_);
+  const uint32_t id = next_id_++;
+
+  // Send request id and sockaddr struct
+  if (!comms_.SendUint32(id) ||
+      !comms_.SendBytes(reinterpret_cast<const uint8_t*>(addr), addrlen)) {
     errno = EIO;
     return sapi::InternalError("Sending data to network proxy failed");
   }
 
-  SAPI_RETURN_IF_ERROR(ReceiveRemoteResult());
-
-  // Receive new socket
   int s;
-  if (!comms_.RecvFD(&s)) {
-    errno = EIO;
-    return sapi::InternalError("Receiving data from network proxy failed");
-  }
+  SAPI_RETURN_IF_ERROR(ReceiveRemoteResult(id, &s));
+
   if (dup2(s, sockfd) == -1) {
     close(s);
     return sapi::InternalError("Processing data from network proxy failed");
   }
+  close(s);
   return sapi::OkStatus();
 }
 
-sapi::Status NetworkProxyClient::ReceiveRemoteResult() {
-  int result;
-  if (!comms_.RecvInt32(&result)) {
-    errno = EIO;
-    return sapi::InternalError("Receiving data from the network proxy failed");
-  }
-  if (result != 0) {
-    errno = result;
-    return sapi::InternalError(
-        absl::StrCat("Error in network proxy server: ", StrError(errno)));
+sapi::Status NetworkProxyClient::ReceiveRemoteResult(uint32_t id, int* fd) {
+  while (true) {
+    auto it = replies_.find(id);
+    if (it != replies_.end()) {
+      const int result = it->second.first;
+      *fd = it->second.second;
+      replies_.erase(it);
+      if (result != 0) {
+        errno = result;
+        return sapi::InternalError(
+            absl::StrCat("Error in network proxy server: ", StrError(errno)));
+      }
+      return sapi::OkStatus();
+    }
+    if (broken_) {
+      errno = EIO;
+      return sapi::InternalError(
+          "Receiving data from the network proxy failed");
+    }
+    if (reading_) {
+      replies_changed_.Wait(&mutex_);
+      continue;
+    }
+
+    // Read one reply without blocking the other threads.
+    reading_ = true;
+    mutex_.Unlock();
+    uint32_t reply_id;
+    int32_t reply_result;
+    int reply_fd = -1;
+    bool ok = comms_.RecvUint32(&reply_id) && comms_.RecvInt32(&reply_result) &&
+              (reply_result != 0 || comms_.RecvFD(&reply_fd));
+    mutex_.Lock();
+    reading_ = false;
+    if (ok) {
+      replies_[reply_id] = {reply_result, reply_fd};
+    } else {
+      broken_ = true;
+    }
+    replies_changed_.SignalAll();
   }
-  return sapi::OkStatus();
 }
 
 namespace {
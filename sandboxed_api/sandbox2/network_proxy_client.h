@@ -17,6 +17,11 @@
 
 #include <netinet/in.h>
 
+#include <cstdint>
+#include <map>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/util/status.h"
@@ -35,7 +40,8 @@ class NetworkProxyClient {
   // Establishes a new network connection.
   // Semantic is similar to a regular connect() call.
   // Arguments are sent to network proxy server, which sends back a connected
-  // socket.
+  // socket. Threads can connect concurrently, the server handles their
+  // requests in parallel.
   sapi::Status Connect(int sockfd, const struct sockaddr* addr,
                        socklen_t addrlen);
   // Same as Connect, but with same API as regular connect() call.
@@ -43,11 +49,24 @@ class NetworkProxyClient {
                      socklen_t addrlen);
 
  private:
+  // Waits for the result of the request 'id' and stores the connected socket
+  // in 'fd'. Whichever thread waits reads the replies, and hands those of
+  // other requests over to their threads.
+  sapi::Status ReceiveRemoteResult(uint32_t id, int* fd)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   Comms comms_;
-  sapi::Status ReceiveRemoteResult();
 
   // Needed to make the Proxy thread safe.
   absl::Mutex mutex_;
+  absl::CondVar replies_changed_;
+  uint32_t next_id_ GUARDED_BY(mutex_) = 0;
+  // Whether some thread reads a reply from comms_.
+  bool reading_ GUARDED_BY(mutex_) = false;
+  // Whether reading from comms_ failed.
+  bool broken_ GUARDED_BY(mutex_) = false;
+  // Replies (errno value and socket) not picked up yet, by request id.
+  std::map<uint32_t, std::pair<int32_t, int>> replies_ GUARDED_BY(mutex_);
 };
 
 class NetworkProxyHandler {
@@ -15,79 +15,454 @@
 #include "sandboxed_api/sandbox2/network_proxy_server.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <linux/seccomp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include "absl/memory/memory.h"
-#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+
+#ifndef SECCOMP_IOCTL_NOTIF_ADDFD
+#define SECCOMP_ADDFD_FLAG_SETFD (1UL << 0)
+struct seccomp_notif_addfd {
+  __u64 id;
+  __u32 flags;
+  __u32 srcfd;
+  __u32 newfd;
+  __u32 newfd_flags;
+};
+#define SECCOMP_IOCTL_NOTIF_ADDFD \
+  _IOW(SECCOMP_IOC_MAGIC, 3, struct seccomp_notif_addfd)
+#endif
 
 namespace sandbox2 {
 
-NetworkProxyServer::NetworkProxyServer(int fd)
-    : comms_{absl::make_unique<Comms>(fd)}, fatal_error_{false} {}
+namespace {
+
+// Granularity of the connect timeouts.
+constexpr absl::Duration kTimeoutTick = absl::Milliseconds(10);
+
+// Maximum number of events handled per epoll_wait().
+constexpr int kMaxEvents = 64;
+
+// Time a pool waits after a failed connect before connecting again.
+constexpr absl::Duration kPoolRetryDelay = absl::Seconds(1);
+
+// Timer ids of the pool retries start here, above all file descriptors.
+constexpr uint64_t kPoolTimerBase = uint64_t{1} << 32;
+
+// Only IPv4 TCP and IPv6 TCP are supported.
+bool IsSupportedAddress(const std::vector<uint8_t>& addr) {
+  const struct sockaddr_in* saddr =
+      reinterpret_cast<const sockaddr_in*>(addr.data());
+  return (addr.size() == sizeof(sockaddr_in) && saddr->sin_family == AF_INET) ||
+         (addr.size() == sizeof(sockaddr_in6) &&
+          saddr->sin_family == AF_INET6);
+}
+
+// Returns the family, address and port of a supported 'addr', ignoring the
+// fields the destination does not depend on.
+std::string DestinationKey(const std::vector<uint8_t>& addr) {
+  std::string key;
+  auto append = [&key](const void* data, size_t size) {
+    key.append(reinterpret_cast<const char*>(data), size);
+  };
+  const struct sockaddr_in* saddr =
+      reinterpret_cast<const sockaddr_in*>(addr.data());
+  if (saddr->sin_family == AF_INET) {
+    append(&saddr->sin_family, sizeof(saddr->sin_family));
+    append(&saddr->sin_port, sizeof(saddr->sin_port));
+    append(&saddr->sin_addr, sizeof(saddr->sin_addr));
+  } else {
+    const struct sockaddr_in6* saddr6 =
+        reinterpret_cast<const sockaddr_in6*>(addr.data());
+    append(&saddr6->sin6_family, sizeof(saddr6->sin6_family));
+    append(&saddr6->sin6_port, sizeof(saddr6->sin6_port));
+    append(&saddr6->sin6_addr, sizeof(saddr6->sin6_addr));
+    append(&saddr6->sin6_scope_id, sizeof(saddr6->sin6_scope_id));
+  }
+  return key;
+}
+
+}  // namespace
+
+NetworkProxyServer::NetworkProxyServer(
+    int fd, const std::vector<PooledDestination>& pools,
+    absl::Duration connect_timeout)
+    : comms_{fd != -1 ? absl::make_unique<Comms>(fd) : nullptr},
+      connect_timeout_{connect_timeout},
+      epoll_fd_{epoll_create1(EPOLL_CLOEXEC)},
+      wakeup_fd_{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)},
+      deadlines_{kTimeoutTick, absl::Now()},
+      fatal_error_{false} {
+  for (const auto& destination : pools) {
+    if (!IsSupportedAddress(destination.addr) || destination.size <= 0) {
+      LOG(ERROR) << "Ignoring connection pool with an unsupported address or "
+                    "size";
+      continue;
+    }
+    Pool pool;
+    pool.addr = destination.addr;
+    pool.key = DestinationKey(destination.addr);
+    pool.size = destination.size;
+    pools_.push_back(std::move(pool));
+  }
+}
+
+NetworkProxyServer::~NetworkProxyServer() {
+  for (const auto& pending : pending_) {
+    close(pending.first);
+  }
+  for (const auto& pool : pools_) {
+    for (int fd : pool.idle) {
+      close(fd);
+    }
+  }
+}
 
 void NetworkProxyServer::ProcessConnectRequest() {
+  uint32_t id;
   std::vector<uint8_t> addr;
-  if (!comms_->RecvBytes(&addr)) {
+  if (!comms_->RecvUint32(&id) || !comms_->RecvBytes(&addr)) {
     fatal_error_ = true;
     return;
   }
+  Connect({PendingConnect::kRequest, id, 0, -1}, addr);
+}
 
-  const struct sockaddr_in* saddr =
-      reinterpret_cast<const sockaddr_in*>(addr.data());
+void NetworkProxyServer::Connect(const PendingConnect& pending,
+                                 const std::vector<uint8_t>& addr) {
+  if (!IsSupportedAddress(addr)) {
+    Reply(pending, EINVAL);
+    return;
+  }
+
+  if (!pools_.empty()) {
+    const std::string key = DestinationKey(addr);
+    for (size_t i = 0; i < pools_.size(); ++i) {
+      if (pools_[i].key != key) {
+        continue;
+      }
+      int fd = TakeIdleConnection(&pools_[i]);
+      RefillPool(i);
+      if (fd != -1) {
+        file_util::fileops::FDCloser socket_closer(fd);
+        Reply(pending, 0, fd);
+        return;
+      }
+      break;
+    }
+  }
 
-  // Only IPv4 TCP and IPv6 TCP are supported.
-  if (!((addr.size() == sizeof(sockaddr_in) && saddr->sin_family == AF_INET) ||
-        (addr.size() == sizeof(sockaddr_in6) &&
-         saddr->sin_family == AF_INET6))) {
-    SendError(EINVAL);
+  bool connected;
+  int new_socket = StartConnect(addr, pending, &connected);
+  if (new_socket == -1) {
+    Reply(pending, errno);
     return;
   }
+  if (connected) {
+    file_util::fileops::FDCloser new_socket_closer(new_socket);
+    Reply(pending, 0, new_socket);
+  }
+}
 
-  int new_socket = socket(saddr->sin_family, SOCK_STREAM, 0);
-  if (new_socket < 0) {
-    SendError(errno);
+bool NetworkProxyServer::SetUserNotifyFd(int notify_fd) {
+  notify_fd_ = absl::make_unique<file_util::fileops::FDCloser>(
+      fcntl(notify_fd, F_DUPFD_CLOEXEC, 0));
+  if (notify_fd_->get() == -1) {
+    PLOG(ERROR) << "fcntl(F_DUPFD_CLOEXEC)";
+    notify_fd_.reset();
+    return false;
+  }
+  return true;
+}
+
+void NetworkProxyServer::ConnectForNotification(uint64_t id, int target_fd,
+                                                std::vector<uint8_t> addr) {
+  {
+    absl::MutexLock lock(&queue_mutex_);
+    queue_.push_back({id, target_fd, std::move(addr)});
+  }
+  uint64_t one = 1;
+  PLOG_IF(ERROR, write(wakeup_fd_.get(), &one, sizeof(one)) == -1 &&
+                     errno != EAGAIN)
+      << "write(wakeup_fd)";
+}
+
+void NetworkProxyServer::Stop() {
+  {
+    absl::MutexLock lock(&queue_mutex_);
+    stopped_ = true;
+  }
+  uint64_t one = 1;
+  PLOG_IF(ERROR, write(wakeup_fd_.get(), &one, sizeof(one)) == -1 &&
+                     errno != EAGAIN)
+      << "write(wakeup_fd)";
+}
+
+void NetworkProxyServer::ProcessNotificationQueue() {
+  uint64_t value;
+  while (read(wakeup_fd_.get(), &value, sizeof(value)) > 0) {
+  }
+  std::vector<NotificationRequest> requests;
+  {
+    absl::MutexLock lock(&queue_mutex_);
+    if (stopped_) {
+      fatal_error_ = true;
+    }
+    requests.swap(queue_);
+  }
+  if (!requests.empty() && !notify_fd_) {
+    LOG(ERROR) << "Notifications without a user notification fd";
     return;
   }
+  for (const auto& request : requests) {
+    Connect({PendingConnect::kNotification, request.id, 0, request.target_fd},
+            request.addr);
+  }
+}
+
+int NetworkProxyServer::StartConnect(const std::vector<uint8_t>& addr,
+                                     const PendingConnect& pending,
+                                     bool* connected) {
+  const struct sockaddr* saddr =
+      reinterpret_cast<const sockaddr*>(addr.data());
+  int new_socket =
+      socket(saddr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (new_socket < 0) {
+    return -1;
+  }
 
   file_util::fileops::FDCloser new_socket_closer(new_socket);
 
-  int result = connect(
-      new_socket, reinterpret_cast<const sockaddr*>(addr.data()), addr.size());
+  *connected = connect(new_socket, saddr, addr.size()) == 0;
+  if (*connected) {
+    return new_socket_closer.Release();
+  }
+  if (errno != EINPROGRESS) {
+    return -1;
+  }
 
-  if (result == 0) {
-    NotifySuccess();
-    if (!fatal_error_) {
-      if (!comms_->SendFD(new_socket)) {
-        fatal_error_ = true;
-        return;
-      }
+  epoll_event event = {};
+  event.events = EPOLLOUT;
+  event.data.fd = new_socket;
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, new_socket, &event) == -1) {
+    return -1;
+  }
+  pending_.emplace(new_socket, pending);
+  deadlines_.Schedule(new_socket, absl::Now() + connect_timeout_);
+  return new_socket_closer.Release();
+}
+
+void NetworkProxyServer::FinishConnect(int fd, int saved_errno) {
+  auto it = pending_.find(fd);
+  if (it == pending_.end()) {
+    return;
+  }
+  const PendingConnect pending = it->second;
+  pending_.erase(it);
+  deadlines_.Cancel(fd);
+  file_util::fileops::FDCloser socket_closer(fd);
+  epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, nullptr);
+
+  if (saved_errno == 0) {
+    socklen_t len = sizeof(saved_errno);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &saved_errno, &len) == -1) {
+      saved_errno = errno;
+    }
+  }
+  if (pending.kind != PendingConnect::kPool) {
+    Reply(pending, saved_errno, fd);
+    return;
+  }
+
+  Pool& pool = pools_[pending.pool];
+  --pool.connecting;
+  if (saved_errno != 0) {
+    VLOG(1) << "Connecting a pooled connection failed: "
+            << StrError(saved_errno);
+    BackOff(pending.pool);
+    return;
+  }
+  pool.idle.push_back(socket_closer.Release());
+}
+
+int NetworkProxyServer::TakeIdleConnection(Pool* pool) {
+  while (!pool->idle.empty()) {
+    file_util::fileops::FDCloser fd(pool->idle.front());
+    pool->idle.pop_front();
+    // A peer which closed the connection makes it readable at EOF. Data the
+    // peer sent first stays queued for the sandboxee.
+    char c;
+    ssize_t received = recv(fd.get(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (received > 0 ||
+        (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+      return fd.Release();
+    }
+  }
+  return -1;
+}
+
+void NetworkProxyServer::RefillPool(size_t index) {
+  Pool& pool = pools_[index];
+  while (!pool.backing_off && pool.idle.size() + pool.connecting < pool.size) {
+    bool connected;
+    int fd = StartConnect(pool.addr, {PendingConnect::kPool, 0, index, -1},
+                          &connected);
+    if (fd == -1) {
+      VLOG(1) << "Connecting a pooled connection failed: " << StrError(errno);
+      BackOff(index);
+      return;
+    }
+    if (connected) {
+      pool.idle.push_back(fd);
+    } else {
+      ++pool.connecting;
     }
   }
 }
 
+void NetworkProxyServer::BackOff(size_t index) {
+  pools_[index].backing_off = true;
+  deadlines_.Schedule(kPoolTimerBase + index, absl::Now() + kPoolRetryDelay);
+}
+
 void NetworkProxyServer::Run() {
+  if (epoll_fd_.get() == -1 || wakeup_fd_.get() == -1) {
+    LOG(ERROR) << "epoll_create1() or eventfd() failed";
+    return;
+  }
+  const int comms_fd = comms_ ? comms_->GetConnectionFD() : -1;
+  for (int fd : {comms_fd, wakeup_fd_.get()}) {
+    if (fd == -1) {
+      continue;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+      PLOG(ERROR) << "epoll_ctl() failed";
+      return;
+    }
+  }
+  for (size_t i = 0; i < pools_.size(); ++i) {
+    RefillPool(i);
+  }
+
+  epoll_event events[kMaxEvents];
   while (!fatal_error_) {
-    ProcessConnectRequest();
+    int timeout_ms = -1;
+    const absl::Time wake_up = deadlines_.NextWakeUp();
+    if (wake_up != absl::InfiniteFuture()) {
+      timeout_ms = std::max<int64_t>(
+          0, absl::ToInt64Milliseconds(absl::Ceil(wake_up - absl::Now(),
+                                                  absl::Milliseconds(1))));
+    }
+    int num_events =
+        epoll_wait(epoll_fd_.get(), events, kMaxEvents, timeout_ms);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "epoll_wait() failed";
+      break;
+    }
+    for (int i = 0; i < num_events && !fatal_error_; ++i) {
+      if (events[i].data.fd == comms_fd) {
+        ProcessConnectRequest();
+      } else if (events[i].data.fd == wakeup_fd_.get()) {
+        ProcessNotificationQueue();
+      } else {
+        FinishConnect(events[i].data.fd, 0);
+      }
+    }
+    for (uint64_t id : deadlines_.Advance(absl::Now())) {
+      if (id >= kPoolTimerBase) {
+        const size_t index = id - kPoolTimerBase;
+        pools_[index].backing_off = false;
+        RefillPool(index);
+      } else {
+        FinishConnect(id, ETIMEDOUT);
+      }
+    }
   }
   LOG(INFO)
       << "Clean shutdown or error occurred, shutting down NetworkProxyServer";
 }
 
-void NetworkProxyServer::SendError(int saved_errno) {
-  if (!comms_->SendInt32(saved_errno)) {
-    fatal_error_ = true;
+void NetworkProxyServer::Reply(const PendingConnect& pending, int saved_errno,
+                               int fd) {
+  if (pending.kind == PendingConnect::kNotification) {
+    AnswerNotification(pending, saved_errno, fd);
+  } else {
+    SendResult(pending.id, saved_errno, fd);
   }
 }
 
-void NetworkProxyServer::NotifySuccess() {
-  if (!comms_->SendInt32(0)) {
+void NetworkProxyServer::AnswerNotification(const PendingConnect& pending,
+                                            int saved_errno, int fd) {
+  if (saved_errno == 0) {
+    // Same as connect() leaves it, see SendResult().
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+      saved_errno = errno;
+    }
+  }
+  if (saved_errno == 0) {
+    seccomp_notif_addfd addfd = {};
+    addfd.id = pending.id;
+    addfd.flags = SECCOMP_ADDFD_FLAG_SETFD;
+    addfd.srcfd = fd;
+    addfd.newfd = pending.target_fd;
+    if (ioctl(notify_fd_->get(), SECCOMP_IOCTL_NOTIF_ADDFD, &addfd) == -1) {
+      if (errno == ENOENT) {
+        // The process died or its syscall was interrupted in the meantime.
+        return;
+      }
+      // Linux before 5.9 cannot install file descriptors.
+      PLOG(WARNING) << "ioctl(SECCOMP_IOCTL_NOTIF_ADDFD)";
+      saved_errno = errno == EINVAL || errno == ENOTTY ? ENOSYS : errno;
+    }
+  }
+  seccomp_notif_resp resp = {};
+  resp.id = pending.id;
+  resp.error = -saved_errno;
+  if (ioctl(notify_fd_->get(), SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1 &&
+      errno != ENOENT) {
+    PLOG(ERROR) << "ioctl(SECCOMP_IOCTL_NOTIF_SEND)";
+  }
+}
+
+void NetworkProxyServer::SendResult(uint32_t id, int saved_errno, int fd) {
+  if (saved_errno == 0) {
+    // The sandboxee expects a blocking socket, like connect() leaves it.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+      saved_errno = errno;
+    }
+  }
+  if (!comms_->SendUint32(id) || !comms_->SendInt32(saved_errno)) {
+    fatal_error_ = true;
+    return;
+  }
+  if (saved_errno == 0 && !comms_->SendFD(fd)) {
     fatal_error_ = true;
   }
 }
@@ -15,18 +15,62 @@
 #ifndef SANDBOXED_API_SANDBOX2_NETWORK_PROXY_SERVER_H_
 #define SANDBOXED_API_SANDBOX2_NETWORK_PROXY_SERVER_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/timer_wheel.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
 
 namespace sandbox2 {
 
 // This is a proxy server that spawns connected sockets on requests.
 // Then it sends the file descriptor to the requestor. It is used to get around
 // limitations created by network namespaces.
+//
+// Connects are non-blocking and waited for with epoll, so a slow remote
+// endpoint does not hold up other requests. Replies carry the id of their
+// request and can come in any order.
+//
+// For destinations the sandboxee connects to repeatedly, the server can keep
+// a pool of connections open, which requests get right away. The pools are
+// refilled in the background.
+//
+// Instead of requests over Comms, the server can also serve the seccomp user
+// notifications of connect() the Monitor forwards, see
+// PolicyBuilder::AddNetworkProxyUserNotifyPolicy().
 class NetworkProxyServer {
  public:
-  explicit NetworkProxyServer(int fd);
+  // A destination to keep idle connections to.
+  struct PooledDestination {
+    PooledDestination() = default;
+    explicit PooledDestination(std::vector<uint8_t> addr, int size = 1)
+        : addr(std::move(addr)), size(size) {}
+
+    // Address of the destination, a sockaddr_in or sockaddr_in6. Requests for
+    // the same family, address and port get the pooled connections.
+    std::vector<uint8_t> addr;
+    // Number of idle connections to keep.
+    int size = 1;
+  };
+
+  // Serves requests over the Comms channel 'fd', or only the notifications
+  // passed to ConnectForNotification() if 'fd' is -1. Keeps connections to
+  // the destinations 'pools' open. Connects not finished within
+  // 'connect_timeout' fail with ETIMEDOUT.
+  explicit NetworkProxyServer(
+      int fd, const std::vector<PooledDestination>& pools = {},
+      absl::Duration connect_timeout = absl::Minutes(2));
+  ~NetworkProxyServer();
 
   NetworkProxyServer(const NetworkProxyServer&) = delete;
   NetworkProxyServer& operator=(const NetworkProxyServer&) = delete;
@@ -34,18 +78,105 @@ class NetworkProxyServer {
   // Starts handling incoming connection requests.
   void Run();
 
+  // Answers connect() notifications of the seccomp user notification fd
+  // 'notify_fd', which is duplicated. Call before Run().
+  bool SetUserNotifyFd(int notify_fd);
+
+  // Connects to 'addr' for the user notification 'id' of a connect() on
+  // 'target_fd', and answers the notification: on success, the socket
+  // replaces 'target_fd' of the notifying process. Thread-safe.
+  void ConnectForNotification(uint64_t id, int target_fd,
+                              std::vector<uint8_t> addr);
+
+  // Makes Run() return. Thread-safe.
+  void Stop();
+
  private:
-  // Notifies the network proxy client about the error and sends its code.
-  void SendError(int saved_errno);
+  struct Pool {
+    std::vector<uint8_t> addr;
+    std::string key;
+    size_t size;
+    // Connected sockets, oldest first.
+    std::deque<int> idle;
+    size_t connecting = 0;
+    // Whether refilling waits for a retry after a failed connect.
+    bool backing_off = false;
+  };
+
+  // Who a connect is for.
+  struct PendingConnect {
+    enum Kind { kRequest, kPool, kNotification };
+    Kind kind;
+    // Request or notification id.
+    uint64_t id;
+    // Index of the pool for kPool, file descriptor to replace for
+    // kNotification.
+    size_t pool;
+    int target_fd;
+  };
+
+  struct NotificationRequest {
+    uint64_t id;
+    int target_fd;
+    std::vector<uint8_t> addr;
+  };
 
-  // Notifies the network proxy client that no error occurred.
-  void NotifySuccess();
+  // Sends the result of the request 'id' to the network proxy client: an
+  // errno value, and the connected socket 'fd' if it is 0.
+  void SendResult(uint32_t id, int saved_errno, int fd = -1);
 
-  // Serves connection requests from the network proxy client.
+  // Answers the user notification of 'pending' the same way.
+  void AnswerNotification(const PendingConnect& pending, int saved_errno,
+                          int fd);
+
+  // Dispatches to SendResult() or AnswerNotification().
+  void Reply(const PendingConnect& pending, int saved_errno, int fd = -1);
+
+  // Receives a connection request from the network proxy client.
   void ProcessConnectRequest();
 
+  // Connects for a request or notification, or answers it from a pool.
+  void Connect(const PendingConnect& pending, const std::vector<uint8_t>& addr);
+
+  // Serves the notifications queued by ConnectForNotification().
+  void ProcessNotificationQueue();
+
+  // Starts connecting a non-blocking socket to 'addr'. Returns the socket,
+  // which is either connected or waited for with epoll until 'pending' is
+  // finished, or -1 and sets errno.
+  int StartConnect(const std::vector<uint8_t>& addr,
+                   const PendingConnect& pending, bool* connected);
+
+  // Finishes the connect of 'fd', which ended with 'saved_errno' (or the
+  // pending error of the socket if 0).
+  void FinishConnect(int fd, int saved_errno);
+
+  // Returns an idle connection of 'pool' the peer did not close, or -1.
+  int TakeIdleConnection(Pool* pool);
+
+  // Starts connects until 'pool' is full, unless it is backing off.
+  void RefillPool(size_t index);
+
+  // Makes 'pool' wait before connecting again.
+  void BackOff(size_t index);
+
   std::unique_ptr<Comms> comms_;
+  absl::Duration connect_timeout_;
+  file_util::fileops::FDCloser epoll_fd_;
+  // Wakes up Run() for queued notifications and Stop().
+  file_util::fileops::FDCloser wakeup_fd_;
+  std::unique_ptr<file_util::fileops::FDCloser> notify_fd_;
+  std::vector<Pool> pools_;
+  // Connects in flight, by socket.
+  std::map<int, PendingConnect> pending_;
+  // Deadlines of the pending connects, by socket, and retries of the pools
+  // backing off, by kPoolTimerBase plus their index.
+  TimerWheel deadlines_;
   bool fatal_error_;
+
+  absl::Mutex queue_mutex_;
+  std::vector<NotificationRequest> queue_ GUARDED_BY(queue_mutex_);
+  bool stopped_ GUARDED_BY(queue_mutex_) = false;
 };
 
 }  // namespace sandbox2
@@ -0,0 +1,242 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/ipc.h"
+#include "sandboxed_api/sandbox2/network_proxy_server.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/testing.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+
+namespace sandbox2 {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Ne;
+
+// Returns a socket bound to an ephemeral port of the loopback address, and the
+// port in 'port'. The socket listens if 'listen' is true.
+int BindLoopback(bool listen, int* port) {
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (s == -1 ||
+      bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+      getsockname(s, reinterpret_cast<sockaddr*>(&addr), &len) == -1 ||
+      (listen && ::listen(s, 8) == -1)) {
+    PLOG(ERROR) << "Binding to the loopback address";
+    if (s != -1) {
+      close(s);
+    }
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return s;
+}
+
+// Returns a port of the loopback address nobody listens on.
+int GetClosedPort() {
+  int port = 0;
+  file_util::fileops::FDCloser s(BindLoopback(/*listen=*/false, &port));
+  return port;
+}
+
+// Returns the sockaddr_in of 'port' of the loopback address, as a pool takes
+// it.
+std::vector<uint8_t> LoopbackAddress(int port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&addr);
+  return std::vector<uint8_t>(bytes, bytes + sizeof(addr));
+}
+
+// Returns what the peer of 'fd' sent, or an empty string if it sent nothing
+// for a while.
+std::string Read(int fd) {
+  pollfd pfd = {fd, POLLIN, 0};
+  if (TEMP_FAILURE_RETRY(poll(&pfd, 1, /*timeout=*/10000)) != 1) {
+    return "";
+  }
+  char buffer[16] = {};
+  ssize_t n = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)));
+  return n > 0 ? std::string(buffer, n) : "";
+}
+
+// Accepts a connection on 'listener' and returns what the peer sent.
+std::string AcceptAndRead(int listener) {
+  file_util::fileops::FDCloser client(accept(listener, nullptr, nullptr));
+  return client.get() == -1 ? "" : Read(client.get());
+}
+
+class NetworkProxyTest : public ::testing::Test {
+ protected:
+  // Starts the sandboxee in a network namespace of its own. Its connects go
+  // through a NetworkProxyServer, which keeps connections to 'pools' open, or
+  // through the monitor if 'user_notify' is true.
+  void Start(bool user_notify,
+             const std::vector<NetworkProxyServer::PooledDestination>& pools =
+                 {}) {
+    const std::string path =
+        GetTestSourcePath("sandbox2/testcases/network_proxy_connect");
+    std::vector<std::string> args = {path};
+    if (!user_notify) {
+      args.push_back("handler");
+    }
+    auto executor = absl::make_unique<Executor>(path, args);
+    executor->set_cwd("/");
+    PolicyBuilder builder;
+    if (user_notify) {
+      // Seccomp user notifications need the sandbox before execve().
+      builder.AddNetworkProxyUserNotifyPolicy();
+    } else {
+      executor->set_enable_sandbox_before_exec(false);
+      executor->ipc()->EnableNetworkProxyServer(pools);
+      builder.AddNetworkProxyHandlerPolicy();
+    }
+    auto policy = builder
+                      .AddLibrariesForBinary(path)
+                      // Anything but connect(), which has to go through the
+                      // proxy.
+                      .DangerDefaultAllowAll()
+                      .BuildOrDie();
+    s2_ = absl::make_unique<Sandbox2>(std::move(executor), std::move(policy));
+    ASSERT_TRUE(s2_->RunAsync());
+  }
+
+  // Returns the errno of a connect of the sandboxee to 'port' followed by a
+  // write, see testcases/network_proxy_connect.cc.
+  int32_t Connect(int port) {
+    int32_t result = -1;
+    if (!s2_->comms()->SendInt32(port) || !s2_->comms()->RecvInt32(&result)) {
+      ADD_FAILURE() << "Lost the connection to the sandboxee";
+    }
+    return result;
+  }
+
+  void ExpectCleanExit() {
+    ASSERT_TRUE(s2_->comms()->SendInt32(0));
+    const Result result = s2_->AwaitResult();
+    EXPECT_THAT(result.final_status(), Eq(Result::OK));
+    EXPECT_THAT(result.reason_code(), Eq(0));
+  }
+
+  std::unique_ptr<Sandbox2> s2_;
+};
+
+TEST_F(NetworkProxyTest, HandlerConnectsAndRejects) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  int port = 0;
+  file_util::fileops::FDCloser listener(BindLoopback(/*listen=*/true, &port));
+  ASSERT_THAT(listener.get(), Ne(-1));
+  Start(/*user_notify=*/false);
+
+  EXPECT_THAT(Connect(port), Eq(0));
+  EXPECT_THAT(AcceptAndRead(listener.get()), Eq("hello"));
+  // The error of the connect on the host is passed on.
+  EXPECT_THAT(Connect(GetClosedPort()), Eq(ECONNREFUSED));
+  // Only stream sockets are proxied.
+  EXPECT_THAT(Connect(-port), Eq(EINVAL));
+  // The proxy still serves connects after failed ones.
+  EXPECT_THAT(Connect(port), Eq(0));
+  EXPECT_THAT(AcceptAndRead(listener.get()), Eq("hello"));
+  ExpectCleanExit();
+}
+
+TEST_F(NetworkProxyTest, HandlerHandsOutPooledConnections) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  int port = 0;
+  file_util::fileops::FDCloser listener(BindLoopback(/*listen=*/true, &port));
+  ASSERT_THAT(listener.get(), Ne(-1));
+  Start(/*user_notify=*/false,
+        {NetworkProxyServer::PooledDestination(LoopbackAddress(port), 1)});
+
+  // The pool connects before the sandboxee asks for a connection, and the
+  // sandboxee gets that connection.
+  file_util::fileops::FDCloser pooled(accept(listener.get(), nullptr, nullptr));
+  ASSERT_THAT(pooled.get(), Ne(-1));
+  EXPECT_THAT(Connect(port), Eq(0));
+  EXPECT_THAT(Read(pooled.get()), Eq("hello"));
+  // The pool refills, so the next connect gets a pooled connection too.
+  file_util::fileops::FDCloser refilled(
+      accept(listener.get(), nullptr, nullptr));
+  ASSERT_THAT(refilled.get(), Ne(-1));
+  EXPECT_THAT(Connect(port), Eq(0));
+  EXPECT_THAT(Read(refilled.get()), Eq("hello"));
+  ExpectCleanExit();
+}
+
+TEST_F(NetworkProxyTest, HandlerConnectsDirectlyWithoutPooledConnections) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  // A pool that never gets a connection leaves connects to its destination
+  // to the proxy, which reports the error of its own connect.
+  const int closed_port = GetClosedPort();
+  Start(/*user_notify=*/false,
+        {NetworkProxyServer::PooledDestination(
+            LoopbackAddress(closed_port), 2)});
+  EXPECT_THAT(Connect(closed_port), Eq(ECONNREFUSED));
+  ExpectCleanExit();
+}
+
+TEST_F(NetworkProxyTest, UserNotifyConnectsAndRejects) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  int port = 0;
+  file_util::fileops::FDCloser listener(BindLoopback(/*listen=*/true, &port));
+  ASSERT_THAT(listener.get(), Ne(-1));
+  Start(/*user_notify=*/true);
+
+  const int32_t result = Connect(port);
+  if (result == ENOSYS) {
+    // The kernel is older than 5.9 and cannot hand sockets to the sandboxee.
+    ExpectCleanExit();
+    return;
+  }
+  EXPECT_THAT(result, Eq(0));
+  EXPECT_THAT(AcceptAndRead(listener.get()), Eq("hello"));
+  // The error of the connect on the host is the answer to the notification.
+  EXPECT_THAT(Connect(GetClosedPort()), Eq(ECONNREFUSED));
+  // The monitor answers connects of datagram sockets itself.
+  EXPECT_THAT(Connect(-port), Eq(EINVAL));
+  EXPECT_THAT(Connect(port), Eq(0));
+  EXPECT_THAT(AcceptAndRead(listener.get()), Eq("hello"));
+  ExpectCleanExit();
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -19,6 +19,9 @@
 
 #include <sys/types.h>
 
+#include <functional>
+#include <string>
+
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/syscall.h"
@@ -57,6 +60,27 @@ class Notify {
 
   // Called when a process received a signal.
   virtual void EventSignal(pid_t pid, int sig_no) {}
+
+  // Returns whether the handlers may run off the Monitor thread, so that
+  // expensive ones (e.g. logging to a remote service) do not stall the
+  // sandboxee. EventSyscallViolation(), EventSignal() and EventStackSample()
+  // are then called on a thread of their own, in order and all before
+  // EventFinished(). Traced syscalls are decided by EventSyscallTrapAsync().
+  virtual bool IsAsync() const { return false; }
+
+  // Called instead of EventSyscallTrap() if IsAsync(). 'done' must be called
+  // exactly once, from any thread, with whether the syscall is allowed. The
+  // calling thread of the sandboxee stays stopped until then, while the
+  // Monitor goes on handling the other ones.
+  virtual void EventSyscallTrapAsync(const Syscall& syscall,
+                                     std::function<void(bool)> done) {
+    done(EventSyscallTrap(syscall));
+  }
+
+  // Called for each stack sample taken of thread 'pid', see
+  // Sandbox2::EnableStackSampling(). 'folded_stack' is the key of the sample in
+  // Result::GetStackSamples().
+  virtual void EventStackSample(pid_t pid, const std::string& folded_stack) {}
 };
 
 }  // namespace sandbox2
@@ -16,8 +16,10 @@
 
 #include <syscall.h>
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -26,6 +28,8 @@
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_join.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/policy.h"
@@ -39,10 +43,14 @@ namespace sandbox2 {
 namespace {
 
 // Allow typical syscalls and call SECCOMP_RET_TRACE for personality syscall,
-// chosen because unlikely to be called by a regular program.
-std::unique_ptr<Policy> NotifyTestcasePolicy() {
-  return PolicyBuilder()
-      .DisableNamespaces()
+// chosen because unlikely to be called by a regular program. With
+// 'user_notify', the trace is handled via seccomp user notifications.
+std::unique_ptr<Policy> NotifyTestcasePolicy(bool user_notify = false) {
+  PolicyBuilder builder;
+  if (user_notify) {
+    builder.UseSeccompUserNotify();
+  }
+  return builder.DisableNamespaces()
       .AllowStaticStartup()
       .AllowExit()
       .AllowRead()
@@ -81,6 +89,33 @@ class PersonalityNotify : public Notify {
   bool allow_;
 };
 
+// Decides the traced syscalls like PersonalityNotify, but later and on a thread
+// of its own.
+class AsyncPersonalityNotify : public PersonalityNotify {
+ public:
+  using PersonalityNotify::PersonalityNotify;
+
+  ~AsyncPersonalityNotify() override {
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  bool IsAsync() const override { return true; }
+
+  void EventSyscallTrapAsync(const Syscall& syscall,
+                             std::function<void(bool)> done) override {
+    const bool permitted = EventSyscallTrap(syscall);
+    threads_.emplace_back([done, permitted] {
+      absl::SleepFor(absl::Milliseconds(100));
+      done(permitted);
+    });
+  }
+
+ private:
+  std::vector<std::thread> threads_;
+};
+
 // Print the newly created PID, and exchange data over Comms before sandboxing.
 class PidCommsNotify : public Notify {
  public:
@@ -125,6 +160,68 @@ TEST(NotifyTest, DisallowPersonality) {
   ASSERT_EQ(result.reason_code(), __NR_personality);
 }
 
+// Test EventSyscallTrap via seccomp user notifications and allow the syscall.
+TEST(NotifyTest, AllowPersonalityWithUserNotify) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/personality");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+  auto policy = NotifyTestcasePolicy(/*user_notify=*/true);
+  ASSERT_THAT(policy, testing::Not(testing::IsNull()));
+  auto notify = absl::make_unique<PersonalityNotify>(true);
+
+  Sandbox2 s2(std::move(executor), std::move(policy), std::move(notify));
+  auto result = s2.Run();
+
+  ASSERT_EQ(result.final_status(), Result::OK);
+  ASSERT_EQ(result.reason_code(), 22);
+}
+
+// Test EventSyscallTrap via seccomp user notifications and disallow the
+// syscall.
+TEST(NotifyTest, DisallowPersonalityWithUserNotify) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/personality");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+  auto policy = NotifyTestcasePolicy(/*user_notify=*/true);
+  ASSERT_THAT(policy, testing::Not(testing::IsNull()));
+  auto notify = absl::make_unique<PersonalityNotify>(false);
+
+  Sandbox2 s2(std::move(executor), std::move(policy), std::move(notify));
+  auto result = s2.Run();
+
+  ASSERT_EQ(result.final_status(), Result::VIOLATION);
+  ASSERT_EQ(result.reason_code(), __NR_personality);
+}
+
+// Test EventSyscallTrapAsync on personality syscall, with ptrace and with
+// seccomp user notifications.
+TEST(NotifyTest, AllowAndDisallowPersonalityAsync) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/personality");
+  for (bool user_notify : {false, true}) {
+    for (bool allow : {false, true}) {
+      std::vector<std::string> args = {path};
+      auto executor = absl::make_unique<Executor>(path, args);
+      auto policy = NotifyTestcasePolicy(user_notify);
+      ASSERT_THAT(policy, testing::Not(testing::IsNull()));
+      auto notify = absl::make_unique<AsyncPersonalityNotify>(allow);
+
+      Sandbox2 s2(std::move(executor), std::move(policy), std::move(notify));
+      auto result = s2.Run();
+
+      if (allow) {
+        EXPECT_EQ(result.final_status(), Result::OK) << user_notify;
+        EXPECT_EQ(result.reason_code(), 22) << user_notify;
+      } else {
+        EXPECT_EQ(result.final_status(), Result::VIOLATION) << user_notify;
+        EXPECT_EQ(result.reason_code(), __NR_personality) << user_notify;
+      }
+    }
+  }
+}
+
 // Test EventStarted by exchanging data after started but before sandboxed.
 TEST(NotifyTest, PrintPidAndComms) {
   SKIP_SANITIZERS_AND_COVERAGE;
@@ -0,0 +1,330 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::Pipeline class.
+
+#include "sandboxed_api/sandbox2/pipeline.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <utility>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+
+namespace sandbox2 {
+namespace {
+
+// Bytes moved per splice(2) call, the default capacity of a pipe.
+constexpr size_t kChunkSize = 64 << 10;
+
+// Writing to a pipe whose reader has exited raises SIGPIPE. The pump threads
+// handle EPIPE instead, a pending SIGPIPE is discarded when they exit.
+void BlockSigpipe() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+// Moves up to 'size' bytes from 'from' to 'to'. Returns the number of bytes
+// moved, 0 on EOF and -1 on errors. Once splice(2) turned out not to be
+// supported by the file descriptors, copies through 'buffer' instead.
+ssize_t Transfer(int from, int to, size_t size, bool* use_splice,
+                 std::vector<char>* buffer) {
+  if (*use_splice) {
+    ssize_t n = splice(from, nullptr, to, nullptr, size,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n != -1 || errno != EINVAL) {
+      return n;
+    }
+    VLOG(1) << "splice() not supported, falling back to read() and write()";
+    *use_splice = false;
+  }
+  buffer->resize(kChunkSize);
+  ssize_t n = TEMP_FAILURE_RETRY(
+      read(from, buffer->data(), std::min(size, buffer->size())));
+  if (n <= 0) {
+    return n;
+  }
+  for (ssize_t written = 0; written < n;) {
+    ssize_t w = TEMP_FAILURE_RETRY(
+        write(to, buffer->data() + written, n - written));
+    if (w == -1) {
+      return -1;
+    }
+    written += w;
+  }
+  return n;
+}
+
+// Moves exactly 'size' bytes, which must be available in 'from'.
+bool TransferAll(int from, int to, size_t size, bool* use_splice,
+                 std::vector<char>* buffer) {
+  while (size > 0) {
+    ssize_t n = Transfer(from, to, size, use_splice, buffer);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    size -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+Pipeline::Pipeline()
+    : cancel_fd_{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)},
+      bytes_in_{0},
+      bytes_out_{0} {}
+
+Pipeline::~Pipeline() {
+  if (started_ && !awaited_) {
+    Kill();
+    AwaitResults();
+  }
+}
+
+Pipeline& Pipeline::AddStage(std::unique_ptr<Executor> executor,
+                             std::shared_ptr<Policy> policy) {
+  CHECK(!started_) << "Stages must be added before RunAsync()";
+  CHECK(executor != nullptr);
+  CHECK(policy != nullptr);
+  stages_.push_back({std::move(executor), std::move(policy)});
+  return *this;
+}
+
+Pipeline& Pipeline::SetInput(int fd) {
+  input_fd_ = fd;
+  return *this;
+}
+
+Pipeline& Pipeline::SetOutput(int fd) {
+  output_fd_ = fd;
+  return *this;
+}
+
+Pipeline& Pipeline::SetOutputCopy(int fd) {
+  output_copy_fd_ = fd;
+  return *this;
+}
+
+Pipeline& Pipeline::set_cpus(std::vector<int> cpus) {
+  cpus_ = std::move(cpus);
+  return *this;
+}
+
+bool Pipeline::RunAsync() {
+  CHECK(!started_) << "RunAsync() can only be called once";
+  started_ = true;
+  if (stages_.empty()) {
+    LOG(ERROR) << "Pipeline without stages";
+    return false;
+  }
+  if (cancel_fd_.get() == -1) {
+    PLOG(ERROR) << "eventfd() failed";
+    return false;
+  }
+
+  // All pipes are created first, so that a failure does not leave stages
+  // behind which wait for input forever.
+  int fds[2];
+  if (input_fd_ != -1) {
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+      PLOG(ERROR) << "pipe2() failed";
+      return false;
+    }
+    stages_.front().executor->ipc()->MapFd(fds[0], STDIN_FILENO);
+    input_pipe_ = absl::make_unique<file_util::fileops::FDCloser>(fds[1]);
+  }
+  for (size_t i = 0; i + 1 < stages_.size(); ++i) {
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+      PLOG(ERROR) << "pipe2() failed";
+      return false;
+    }
+    stages_[i].executor->ipc()->MapFd(fds[1], STDOUT_FILENO);
+    stages_[i + 1].executor->ipc()->MapFd(fds[0], STDIN_FILENO);
+  }
+  if (output_fd_ != -1) {
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+      PLOG(ERROR) << "pipe2() failed";
+      return false;
+    }
+    stages_.back().executor->ipc()->MapFd(fds[1], STDOUT_FILENO);
+    output_pipe_ = absl::make_unique<file_util::fileops::FDCloser>(fds[0]);
+  }
+
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    Stage& stage = stages_[i];
+    if (!cpus_.empty()) {
+      stage.executor->set_cpus({cpus_[i % cpus_.size()]});
+    }
+    sandboxes_.push_back(absl::make_unique<Sandbox2>(
+        std::move(stage.executor), std::move(stage.policy)));
+    if (!sandboxes_.back()->RunAsync()) {
+      LOG(ERROR) << "Could not start stage " << i << " of the pipeline";
+      Kill();
+      return false;
+    }
+  }
+  // The executor only keeps its ends of the pipes to the first and last
+  // stage, everything in between is connected directly.
+  stages_.clear();
+
+  if (input_pipe_ != nullptr) {
+    input_pump_ = std::thread(&Pipeline::PumpInput, this);
+  }
+  if (output_pipe_ != nullptr) {
+    output_pump_ = std::thread(&Pipeline::PumpOutput, this);
+  }
+  return true;
+}
+
+std::vector<Result> Pipeline::AwaitResults() {
+  CHECK(started_) << "RunAsync() has not been called";
+  CHECK(!awaited_) << "AwaitResults() can only be called once";
+  awaited_ = true;
+  std::vector<Result> results;
+  results.reserve(sandboxes_.size());
+  for (auto& sandbox : sandboxes_) {
+    results.push_back(sandbox->AwaitResult());
+  }
+  // Stops reading an input which the first stage did not consume to its end.
+  uint64_t value = 1;
+  if (TEMP_FAILURE_RETRY(write(cancel_fd_.get(), &value, sizeof(value))) ==
+      -1) {
+    PLOG(ERROR) << "Could not cancel the input pump";
+  }
+  if (input_pump_.joinable()) {
+    input_pump_.join();
+  }
+  if (output_pump_.joinable()) {
+    output_pump_.join();
+  }
+  input_pipe_.reset();
+  output_pipe_.reset();
+  return results;
+}
+
+void Pipeline::Kill() {
+  for (auto& sandbox : sandboxes_) {
+    sandbox->Kill();
+  }
+}
+
+void Pipeline::PumpInput() {
+  BlockSigpipe();
+  const int to = input_pipe_->get();
+  bool use_splice = true;
+  std::vector<char> buffer;
+  for (;;) {
+    // The input may be a socket or a pipe which never reaches EOF, so wait for
+    // it together with the cancellation.
+    pollfd pfds[] = {{input_fd_, POLLIN, 0}, {cancel_fd_.get(), POLLIN, 0}};
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "poll() failed";
+      break;
+    }
+    if (pfds[1].revents != 0) {
+      break;
+    }
+    ssize_t n = Transfer(input_fd_, to, kChunkSize, &use_splice, &buffer);
+    if (n == 0) {
+      break;
+    }
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      if (errno == EPIPE) {
+        VLOG(1) << "The first stage closed its input";
+      } else {
+        PLOG(ERROR) << "Pumping the input failed";
+      }
+      break;
+    }
+    bytes_in_ += n;
+  }
+  // Lets the first stage see EOF.
+  input_pipe_->Close();
+}
+
+void Pipeline::PumpOutput() {
+  BlockSigpipe();
+  const int from = output_pipe_->get();
+  bool use_splice = true;
+  std::vector<char> buffer;
+
+  int copy_to = output_copy_fd_;
+  bool copy_use_splice = true;
+  int fds[2] = {-1, -1};
+  if (copy_to != -1 && pipe2(fds, O_CLOEXEC) == -1) {
+    PLOG(ERROR) << "pipe2() failed, not copying the output";
+    copy_to = -1;
+  }
+  file_util::fileops::FDCloser copy_read{fds[0]};
+  file_util::fileops::FDCloser copy_write{fds[1]};
+
+  for (;;) {
+    ssize_t n;
+    if (copy_to != -1) {
+      // tee(2) duplicates the pages into the copy pipe without consuming
+      // them, the same bytes are then spliced to both destinations.
+      n = tee(from, copy_write.get(), kChunkSize, 0);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n > 0) {
+        if (!TransferAll(copy_read.get(), copy_to, n, &copy_use_splice,
+                         &buffer)) {
+          PLOG(ERROR) << "Writing the output copy failed";
+          copy_to = -1;
+        }
+        if (!TransferAll(from, output_fd_, n, &use_splice, &buffer)) {
+          n = -1;
+        }
+      }
+    } else {
+      n = Transfer(from, output_fd_, kChunkSize, &use_splice, &buffer);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+    if (n == -1) {
+      PLOG(ERROR) << "Pumping the output failed";
+      break;
+    }
+    bytes_out_ += n;
+  }
+  // The last stage gets EPIPE if it still writes.
+  output_pipe_->Close();
+}
+
+}  // namespace sandbox2
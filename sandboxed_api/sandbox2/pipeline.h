@@ -0,0 +1,139 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::Pipeline class runs sandboxees as the stages of a Unix
+// pipeline.
+
+#ifndef SANDBOXED_API_SANDBOX2_PIPELINE_H_
+#define SANDBOXED_API_SANDBOX2_PIPELINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+
+namespace sandbox2 {
+
+// Connects the standard output of each stage to the standard input of the
+// next one. The data between two stages flows through a kernel pipe and never
+// passes through the executor. The input of the first stage and the output of
+// the last one are pumped from and to the host file descriptors with
+// splice(2), which moves the pages without copying them to userspace.
+//
+// Example:
+//   Pipeline pipeline;
+//   pipeline.AddStage(std::move(decompress), decompress_policy)
+//       .AddStage(std::move(filter), filter_policy)
+//       .SetInput(input_fd)
+//       .SetOutput(output_fd);
+//   std::vector<Result> results = pipeline.Run();
+class Pipeline final {
+ public:
+  Pipeline();
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  // Kills the stages that still run and waits for them.
+  ~Pipeline();
+
+  // Appends a stage. Must be called before RunAsync().
+  Pipeline& AddStage(std::unique_ptr<Executor> executor,
+                     std::shared_ptr<Policy> policy);
+
+  // Feeds 'fd' to the standard input of the first stage. It may be a file, a
+  // pipe or a socket and is not owned. Without it, the first stage keeps the
+  // standard input set up by its Executor.
+  Pipeline& SetInput(int fd);
+
+  // Writes the standard output of the last stage to 'fd', which is not owned.
+  // Without it, the last stage keeps the standard output set up by its
+  // Executor.
+  Pipeline& SetOutput(int fd);
+
+  // Also writes the output to 'fd' with tee(2), e.g. to checksum or log it.
+  // Requires SetOutput().
+  Pipeline& SetOutputCopy(int fd);
+
+  // Pins stage i to cpus[i % cpus.size()], so that the stages run in parallel
+  // on cores of their own. Overrides the CPU placement of the Executors.
+  Pipeline& set_cpus(std::vector<int> cpus);
+
+  // Starts all stages and the pumps of the host file descriptors. Returns
+  // false if a stage could not be started, the others are killed then.
+  // AwaitResults() must still be called.
+  bool RunAsync();
+
+  // Waits for all stages and returns their results, in the order of the
+  // stages.
+  std::vector<Result> AwaitResults();
+
+  // Runs the pipeline to completion.
+  std::vector<Result> Run() {
+    RunAsync();
+    return AwaitResults();
+  }
+
+  // Requests termination of all stages.
+  void Kill();
+
+  // Number of bytes pumped into the first stage and out of the last one.
+  uint64_t bytes_in() const { return bytes_in_.load(); }
+  uint64_t bytes_out() const { return bytes_out_.load(); }
+
+ private:
+  struct Stage {
+    std::unique_ptr<Executor> executor;
+    std::shared_ptr<Policy> policy;
+  };
+
+  // Moves data from input_fd_ to the first stage until EOF, a write error,
+  // or until cancel_fd_ is signaled. Falls back to read(2) and write(2) for
+  // file descriptors which do not support splice(2).
+  void PumpInput();
+
+  // Moves data from the last stage to output_fd_ until EOF, teeing it to
+  // output_copy_fd_ as well if set.
+  void PumpOutput();
+
+  std::vector<Stage> stages_;
+  std::vector<std::unique_ptr<Sandbox2>> sandboxes_;
+  std::vector<int> cpus_;
+  int input_fd_ = -1;
+  int output_fd_ = -1;
+  int output_copy_fd_ = -1;
+  bool started_ = false;
+  bool awaited_ = false;
+
+  // Signaled once all stages have finished, in order to stop reading an input
+  // which would never reach EOF.
+  file_util::fileops::FDCloser cancel_fd_;
+  // The executor's ends of the pipes to the first and the last stage.
+  std::unique_ptr<file_util::fileops::FDCloser> input_pipe_;
+  std::unique_ptr<file_util::fileops::FDCloser> output_pipe_;
+  std::thread input_pump_;
+  std::thread output_pump_;
+  std::atomic<uint64_t> bytes_in_;
+  std::atomic<uint64_t> bytes_out_;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_PIPELINE_H_
@@ -0,0 +1,144 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/pipeline.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::testing::Eq;
+using ::testing::SizeIs;
+
+namespace sandbox2 {
+namespace {
+
+using file_util::fileops::FDCloser;
+
+constexpr char kCat[] = "/bin/cat";
+
+std::unique_ptr<Policy> CatPolicy() {
+  return PolicyBuilder()
+      // Don't restrict the syscalls at all.
+      .DangerDefaultAllowAll()
+      .AddFile(kCat)
+      .AddLibrariesForBinary(kCat)
+      .BuildOrDie();
+}
+
+std::string ReadAll(int fd) {
+  std::string data;
+  char buf[4096];
+  ssize_t n;
+  while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+    data.append(buf, n);
+  }
+  return data;
+}
+
+// Streams data through two chained stages and tees the output to a second
+// pipe.
+TEST(PipelineTest, ChainsStages) {
+  std::string input(1 << 20, '\0');
+  for (size_t i = 0; i < input.size(); ++i) {
+    input[i] = static_cast<char>(i * 31);
+  }
+
+  int in[2], out[2], copy[2];
+  ASSERT_THAT(pipe2(in, O_CLOEXEC), Eq(0));
+  ASSERT_THAT(pipe2(out, O_CLOEXEC), Eq(0));
+  ASSERT_THAT(pipe2(copy, O_CLOEXEC), Eq(0));
+  FDCloser in_read{in[0]}, out_write{out[1]}, copy_write{copy[1]};
+  FDCloser in_write{in[1]}, out_read{out[0]}, copy_read{copy[0]};
+
+  std::vector<std::string> args = {kCat};
+  std::shared_ptr<Policy> policy = CatPolicy();
+  Pipeline pipeline;
+  pipeline.AddStage(absl::make_unique<Executor>(kCat, args), policy)
+      .AddStage(absl::make_unique<Executor>(kCat, args), policy)
+      .SetInput(in_read.get())
+      .SetOutput(out_write.get())
+      .SetOutputCopy(copy_write.get());
+  ASSERT_TRUE(pipeline.RunAsync());
+
+  std::thread writer([&input, &in_write] {
+    ASSERT_THAT(write(in_write.get(), input.data(), input.size()),
+                Eq(static_cast<ssize_t>(input.size())));
+    in_write.Close();
+  });
+  std::string output;
+  std::thread reader(
+      [&output, &out_read] { output = ReadAll(out_read.get()); });
+  std::string copied;
+  std::thread copy_reader(
+      [&copied, &copy_read] { copied = ReadAll(copy_read.get()); });
+  writer.join();
+
+  std::vector<Result> results = pipeline.AwaitResults();
+  // The pipes to the test are kept open by the pipeline until here.
+  out_write.Close();
+  copy_write.Close();
+  reader.join();
+  copy_reader.join();
+
+  ASSERT_THAT(results, SizeIs(2));
+  for (const Result& result : results) {
+    EXPECT_THAT(result.final_status(), Eq(Result::OK));
+    EXPECT_THAT(result.reason_code(), Eq(0));
+  }
+  EXPECT_TRUE(output == input);
+  EXPECT_TRUE(copied == input);
+  EXPECT_THAT(pipeline.bytes_in(), Eq(input.size()));
+  EXPECT_THAT(pipeline.bytes_out(), Eq(input.size()));
+}
+
+// A stage which exits early does not leave the input pump blocked on an input
+// which never ends.
+TEST(PipelineTest, StopsPumpingWhenStagesExit) {
+  constexpr char kTrue[] = "/bin/true";
+  int in[2];
+  ASSERT_THAT(pipe2(in, O_CLOEXEC), Eq(0));
+  FDCloser in_read{in[0]}, in_write{in[1]};
+
+  std::vector<std::string> args = {kTrue};
+  Pipeline pipeline;
+  pipeline
+      .AddStage(absl::make_unique<Executor>(kTrue, args),
+                PolicyBuilder()
+                    .DangerDefaultAllowAll()
+                    .AddFile(kTrue)
+                    .AddLibrariesForBinary(kTrue)
+                    .BuildOrDie())
+      .SetInput(in_read.get());
+  std::vector<Result> results = pipeline.Run();
+  ASSERT_THAT(results, SizeIs(1));
+  EXPECT_THAT(results[0].final_status(), Eq(Result::OK));
+}
+
+}  // namespace
+}  // namespace sandbox2
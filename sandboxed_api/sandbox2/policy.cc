@@ -19,12 +19,17 @@
 #include <fcntl.h>
 #include <linux/audit.h>
 #include <linux/ipc.h>
+#include <linux/seccomp.h>
 #include <sched.h>
 #include <sys/mman.h>
 #include <syscall.h>
+#include <unistd.h>
 
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include "sandboxed_api/util/flag.h"
@@ -33,20 +38,138 @@
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/regs.h"
 #include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
 
 ABSL_FLAG(bool, sandbox2_danger_danger_permit_all, false,
           "Allow all syscalls, useful for testing");
 ABSL_FLAG(string, sandbox2_danger_danger_permit_all_and_log, "",
-          "Allow all syscalls and log them into specified file");
+          "Allow all syscalls and log them into specified file, followed by a "
+          "trace for policy_synthesizer_bin");
+
+#ifndef SECCOMP_RET_USER_NOTIF
+#define SECCOMP_RET_USER_NOTIF 0x7fc00000U
+#endif
+#ifndef SECCOMP_RET_ACTION_FULL
+#define SECCOMP_RET_ACTION_FULL 0xffff0000U
+#endif
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS 0x80000000U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
 
 namespace sandbox2 {
 
+namespace {
+
+bool IsReturn(const sock_filter& insn, uint32_t action) {
+  return BPF_CLASS(insn.code) == BPF_RET && BPF_RVAL(insn.code) == BPF_K &&
+         (insn.k & SECCOMP_RET_ACTION_FULL) == action;
+}
+
+// FNV-1a, the programs are small.
+size_t HashProgram(const std::vector<sock_filter>& program) {
+  uint64_t hash = 0xcbf29ce484222325;
+  const auto* bytes = reinterpret_cast<const uint8_t*>(program.data());
+  for (size_t i = 0; i < program.size() * sizeof(sock_filter); ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// Writes 'program' to a memfd and seals it, so that sandboxees can share it
+// without being able to modify it. Returns -1 on errors.
+int CreateSealedMemFd(const std::vector<sock_filter>& program) {
+  int fd = util::Syscall(__NR_memfd_create,
+                         reinterpret_cast<uintptr_t>("sandbox2_policy"),
+                         MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    PLOG(WARNING) << "memfd_create() for the policy failed";
+    return -1;
+  }
+  const size_t size = program.size() * sizeof(sock_filter);
+  if (TEMP_FAILURE_RETRY(pwrite(fd, program.data(), size, 0)) !=
+          static_cast<ssize_t>(size) ||
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0) {
+    PLOG(WARNING) << "Could not write and seal the policy memfd";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Index of the compiled policy for 'options' in Policy::compiled_.
+int CompiledIndex(bool user_notify, bool profile) {
+  return (user_notify ? 1 : 0) | (profile ? 2 : 0);
+}
+
+// Beyond the syscall numbers of all supported architectures.
+constexpr uint32_t kMaxSyscallNr = 1024;
+
+// Runs 'policy' for the syscall 'nr' of 'arch' the way the kernel does to fill
+// its action cache (seccomp_is_const_allow() in kernel/seccomp.c). Returns
+// true if the policy allows the syscall without loading anything but the
+// syscall number and architecture.
+bool IsConstantAllow(const std::vector<sock_filter>& policy, uint32_t arch,
+                     uint32_t nr) {
+  uint32_t a = 0;
+  for (size_t pc = 0; pc < policy.size(); ++pc) {
+    const sock_filter& insn = policy[pc];
+    switch (insn.code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        if (insn.k == offsetof(seccomp_data, nr)) {
+          a = nr;
+        } else if (insn.k == offsetof(seccomp_data, arch)) {
+          a = arch;
+        } else {
+          return false;
+        }
+        break;
+      case BPF_RET | BPF_K:
+        return insn.k == SECCOMP_RET_ALLOW;
+      case BPF_JMP | BPF_JA:
+        pc += insn.k;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+        pc += a == insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGE | BPF_K:
+        pc += a >= insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JGT | BPF_K:
+        pc += a > insn.k ? insn.jt : insn.jf;
+        break;
+      case BPF_JMP | BPF_JSET | BPF_K:
+        pc += (a & insn.k) != 0 ? insn.jt : insn.jf;
+        break;
+      case BPF_ALU | BPF_AND | BPF_K:
+        a &= insn.k;
+        break;
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
 // The final policy is the concatenation of:
 //   1. default policy (GetDefaultPolicy, private),
 //   2. user policy (user_policy_, public),
 //   3. default KILL action (avoid failing open if user policy did not do it).
-std::vector<sock_filter> Policy::GetPolicy() const {
+std::vector<sock_filter> Policy::GetPolicy(const Options& options) const {
   if (absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all) ||
       !absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all_and_log).empty()) {
     return GetTrackingPolicy();
@@ -61,11 +184,42 @@ std::vector<sock_filter> Policy::GetPolicy() const {
   VLOG(3) << "User policy:\n" << bpf::Disasm(user_policy_);
   // Add default syscall_nr loading in case the user forgets.
   policy.push_back(LOAD_SYSCALL_NR);
+  const size_t user_policy_start = policy.size();
   policy.insert(policy.end(), user_policy_.begin(), user_policy_.end());
+  if (options.user_notify) {
+    // The monitor answers these from the notification fd, without stopping the
+    // sandboxee with ptrace. The default policy still traces via ptrace, as
+    // the monitor needs the registers there.
+    for (size_t i = user_policy_start; i < policy.size(); ++i) {
+      if (IsReturn(policy[i], SECCOMP_RET_TRACE)) {
+        policy[i].k = SECCOMP_RET_USER_NOTIF;
+      }
+    }
+  }
+  if (options.profile) {
+    // Stop on every allowed syscall, the Monitor then lets it run until its
+    // exit.
+    for (size_t i = user_policy_start; i < policy.size(); ++i) {
+      if (IsReturn(policy[i], SECCOMP_RET_ALLOW)) {
+        policy[i].k = SECCOMP_RET_TRACE | internal::kProfileTraceFlag |
+                      Syscall::GetHostArch();
+      }
+    }
+  }
 
   // 3. Finish with default KILL action.
   policy.push_back(KILL);
 
+  if (!options.profile && UsesLightweightTracing()) {
+    // Threads and children are not traced, so nobody would notice if one of
+    // them got killed on its own. Take down the whole process instead.
+    for (auto& insn : policy) {
+      if (IsReturn(insn, SECCOMP_RET_KILL)) {
+        insn.k = SECCOMP_RET_KILL_PROCESS;
+      }
+    }
+  }
+
   VLOG(2) << "Final policy:\n" << bpf::Disasm(policy);
   return policy;
 }
@@ -126,6 +280,28 @@ std::vector<sock_filter> Policy::GetDefaultPolicy() const {
 }
 // LINT.ThenChange(monitor.cc)
 
+bool Policy::UsesLightweightTracing() const {
+  if (!lightweight_tracing_ ||
+      absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all) ||
+      !absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all_and_log).empty()) {
+    return false;
+  }
+  // Untraced children are not covered by PTRACE_O_EXITKILL, only killing the
+  // init process of their PID namespace takes them down with the sandboxee.
+  if (namespace_ == nullptr ||
+      !(namespace_->GetCloneFlags() & CLONE_NEWPID)) {
+    return false;
+  }
+  // Traced syscalls of untraced threads would fail with ENOSYS.
+  for (const auto& insn : user_policy_) {
+    if (IsReturn(insn, SECCOMP_RET_TRACE) ||
+        IsReturn(insn, SECCOMP_RET_USER_NOTIF)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 std::vector<sock_filter> Policy::GetTrackingPolicy() const {
   return {
       LOAD_ARCH,
@@ -136,10 +312,81 @@ std::vector<sock_filter> Policy::GetTrackingPolicy() const {
   };
 }
 
-bool Policy::SendPolicy(Comms* comms) const {
-  auto policy = GetPolicy();
+CompiledPolicy::CompiledPolicy(std::vector<sock_filter> program, size_t hash)
+    : program_(std::move(program)),
+      hash_(hash),
+      memfd_(CreateSealedMemFd(program_)) {}
+
+CompiledPolicy::~CompiledPolicy() {
+  if (memfd_ != -1) {
+    close(memfd_);
+  }
+}
+
+std::shared_ptr<const CompiledPolicy> CompiledPolicy::Get(
+    std::vector<sock_filter> program) {
+  static auto* mutex = new absl::Mutex();
+  // Only referenced weakly, so that programs no longer in use are released
+  // together with their memfd. Few distinct programs are alive at any time,
+  // the expired ones are dropped on lookup.
+  static auto* cache = new std::vector<std::weak_ptr<const CompiledPolicy>>();
+
+  const size_t hash = HashProgram(program);
+  absl::MutexLock lock(mutex);
+  for (auto it = cache->begin(); it != cache->end();) {
+    std::shared_ptr<const CompiledPolicy> compiled = it->lock();
+    if (!compiled) {
+      it = cache->erase(it);
+      continue;
+    }
+    if (compiled->hash_ == hash &&
+        compiled->program_.size() == program.size() &&
+        memcmp(compiled->program_.data(), program.data(),
+               program.size() * sizeof(sock_filter)) == 0) {
+      return compiled;
+    }
+    ++it;
+  }
+  std::shared_ptr<const CompiledPolicy> compiled(
+      new CompiledPolicy(std::move(program), hash));
+  cache->push_back(compiled);
+  return compiled;
+}
+
+std::shared_ptr<const CompiledPolicy> Policy::Compile(
+    const Options& options) const {
+  // The flags may change at runtime, don't keep the tracking policy around.
+  if (absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all) ||
+      !absl::GetFlag(FLAGS_sandbox2_danger_danger_permit_all_and_log).empty()) {
+    return CompiledPolicy::Get(GetPolicy(options));
+  }
+  absl::MutexLock lock(&compiled_mutex_);
+  auto& compiled =
+      compiled_[CompiledIndex(options.user_notify, options.profile)];
+  if (!compiled) {
+    compiled = CompiledPolicy::Get(GetPolicy(options));
+  }
+  return compiled;
+}
+
+bool Policy::SendPolicy(Comms* comms, const Options& options) const {
+  std::shared_ptr<const CompiledPolicy> compiled = Compile(options);
+  // Passing the shared memfd saves copying the program through the socket.
+  const bool use_memfd = compiled->memfd() != -1;
+  if (!comms->SendBool(use_memfd)) {
+    LOG(ERROR) << "Couldn't send policy";
+    return false;
+  }
+  if (use_memfd) {
+    if (!comms->SendFD(compiled->memfd())) {
+      LOG(ERROR) << "Couldn't send policy memfd";
+      return false;
+    }
+    return true;
+  }
+  const std::vector<sock_filter>& policy = compiled->program();
   if (!comms->SendBytes(
-          reinterpret_cast<uint8_t*>(policy.data()),
+          reinterpret_cast<const uint8_t*>(policy.data()),
           static_cast<uint64_t>(policy.size()) * sizeof(sock_filter))) {
     LOG(ERROR) << "Couldn't send policy";
     return false;
@@ -156,6 +403,22 @@ void Policy::AllowUnsafeKeepCapabilities(
   capabilities_ = std::move(caps);
 }
 
+std::vector<uint32_t> Policy::GetCacheableSyscalls() const {
+  std::shared_ptr<const CompiledPolicy> compiled = Compile(Options());
+  const std::vector<sock_filter>& policy = compiled->program();
+  std::vector<uint32_t> syscalls;
+  for (uint32_t nr = 0; nr < kMaxSyscallNr; ++nr) {
+    if (IsConstantAllow(policy, Syscall::GetHostAuditArch(), nr)) {
+      syscalls.push_back(nr);
+    }
+  }
+  return syscalls;
+}
+
+std::vector<sock_filter> Policy::GetProgram() const {
+  return Compile(Options())->program();
+}
+
 void Policy::GetPolicyDescription(PolicyDescription* policy) const {
   policy->set_user_bpf_policy(user_policy_.data(),
                               user_policy_.size() * sizeof(sock_filter));
@@ -174,6 +437,10 @@ void Policy::GetPolicyDescription(PolicyDescription* policy) const {
       policy->add_capabilities(cap);
     }
   }
+
+  for (uint32_t nr : GetCacheableSyscalls()) {
+    policy->add_cacheable_syscalls(nr);
+  }
 }
 
 }  // namespace sandbox2
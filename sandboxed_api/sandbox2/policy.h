@@ -23,12 +23,15 @@
 #include <sys/capability.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <set>
 #include <utility>
 #include <vector>
 
 #include "absl/base/macros.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/types/optional.h"
 #include "sandboxed_api/sandbox2/namespace.h"
 #include "sandboxed_api/sandbox2/syscall.h"
@@ -42,9 +45,45 @@ namespace internal {
 // Magic values of registers when executing sys_execveat, so we can recognize
 // the pre-sandboxing state and notify the Monitor
 constexpr uintptr_t kExecveMagic = 0x921c2c34;
+
+// Set in the SECCOMP_RET_TRACE data of allowed syscalls when profiling, next
+// to the architecture of the syscall.
+constexpr uint32_t kProfileTraceFlag = 0x8000;
 }  // namespace internal
 
 class Comms;
+class FileBroker;
+
+// A final BPF program as loaded into the kernel. Immutable, so that any number
+// of sandboxes can share it. Sandboxees receive the program as a sealed memfd,
+// which is created only once as well.
+class CompiledPolicy final {
+ public:
+  // Returns the compiled policy holding 'program'. Equal programs share one
+  // CompiledPolicy as long as it is in use anywhere in the process.
+  static std::shared_ptr<const CompiledPolicy> Get(
+      std::vector<sock_filter> program);
+
+  CompiledPolicy(const CompiledPolicy&) = delete;
+  CompiledPolicy& operator=(const CompiledPolicy&) = delete;
+
+  ~CompiledPolicy();
+
+  const std::vector<sock_filter>& program() const { return program_; }
+
+  // Hash of program(), equal programs have equal hashes.
+  size_t hash() const { return hash_; }
+
+  // Sealed memfd holding program(), -1 if it could not be created.
+  int memfd() const { return memfd_; }
+
+ private:
+  CompiledPolicy(std::vector<sock_filter> program, size_t hash);
+
+  std::vector<sock_filter> program_;
+  size_t hash_;
+  int memfd_ = -1;
+};
 
 class Policy final {
  public:
@@ -59,16 +98,42 @@ class Policy final {
   // in the protobuf structure.
   void GetPolicyDescription(PolicyDescription* policy) const;
 
+  // Returns the syscalls of the host architecture which the policy allows
+  // without looking at their arguments. Since Linux 5.11 the kernel caches
+  // these verdicts and skips the filter for them.
+  std::vector<uint32_t> GetCacheableSyscalls() const;
+
+  // Returns the BPF program sandboxees load, e.g. for bpf::Analyze().
+  std::vector<sock_filter> GetProgram() const;
+
+  // Returns the part of the program built from the rules of the
+  // PolicyBuilder. Emit it with bpf::ToCArray() to pass it to
+  // PolicyBuilder::UsePrecompiledPolicy() in later builds.
+  const std::vector<sock_filter>& GetUserPolicy() const { return user_policy_; }
+
  private:
   // Private constructor only called by the PolicyBuilder.
   Policy() = default;
 
+  // Monitor-side modifications of the policy.
+  struct Options {
+    // Traced syscalls of the user policy are reported via seccomp user
+    // notifications.
+    bool user_notify = false;
+    // Allowed syscalls of the user policy are traced with kProfileTraceFlag,
+    // so that the Monitor can measure them.
+    bool profile = false;
+  };
+
   // Sends the policy over the IPC channel.
-  bool SendPolicy(Comms* comms) const;
+  bool SendPolicy(Comms* comms, const Options& options) const;
+
+  // Returns GetPolicy(options), compiled on first use only.
+  std::shared_ptr<const CompiledPolicy> Compile(const Options& options) const;
 
   // Returns the policy, but modifies it according to FLAGS and internal
   // requirements (message passing via Comms, Executor::WaitForExecve etc.).
-  std::vector<sock_filter> GetPolicy() const;
+  std::vector<sock_filter> GetPolicy(const Options& options) const;
 
   Namespace* GetNamespace() { return namespace_.get(); }
   void SetNamespace(std::unique_ptr<Namespace> ns) {
@@ -88,6 +153,32 @@ class Policy final {
   bool collect_stacktrace_on_signal_ = true;
   bool collect_stacktrace_on_timeout_ = true;
   bool collect_stacktrace_on_kill_ = true;
+  // Whether the other threads are unwound together with the stopped one.
+  bool collect_stacktrace_of_all_threads_ = false;
+  // Fraction of the abnormal exits for which the stack trace and the memory
+  // maps are collected.
+  double stacktrace_sample_fraction_ = 1.0;
+
+  // Whether traced syscalls should be handled via seccomp user notifications
+  // instead of ptrace, if possible. See policybuilder.h.
+  bool user_notify_ = false;
+
+  // Whether the Monitor connects sockets for connect() user notifications.
+  // See PolicyBuilder::AddNetworkProxyUserNotifyPolicy().
+  bool user_notify_network_proxy_ = false;
+
+  // Opens the files of PolicyBuilder::AddBrokeredFile() for the sandboxees,
+  // shared by all of them.
+  std::shared_ptr<FileBroker> file_broker_;
+
+  // Whether only the main thread should be traced, if the policy allows it.
+  // See policybuilder.h and UsesLightweightTracing().
+  bool lightweight_tracing_ = false;
+
+  // Returns whether the Monitor only needs to trace the main thread, as
+  // requested with lightweight_tracing_ and possible because the user policy
+  // has no trace actions.
+  bool UsesLightweightTracing() const;
 
   // The capabilities to keep in the sandboxee.
   std::unique_ptr<std::vector<cap_value_t>> capabilities_;
@@ -98,6 +189,11 @@ class Policy final {
   // The policy set by the user.
   std::vector<sock_filter> user_policy_;
 
+  // Compiled policies, indexed by CompiledIndex() of their Options.
+  mutable absl::Mutex compiled_mutex_;
+  mutable std::shared_ptr<const CompiledPolicy> compiled_[4]
+      GUARDED_BY(compiled_mutex_);
+
   // Get the default policy, which blocks certain dangerous syscalls and
   // mismatched syscall tables.
   std::vector<sock_filter> GetDefaultPolicy() const;
@@ -0,0 +1,180 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the cost of the seccomp filter per syscall. A sandboxee runs
+// a syscall in a tight loop, under policies of different sizes and without a
+// sandbox as the baseline.
+//
+// Run with: bazel run -c opt //sandboxed_api/sandbox2:policy_benchmark
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/base/macros.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/util.h"
+#include "sandboxed_api/sandbox2/util/runfiles.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+namespace {
+
+// Syscalls per run of the sandboxee.
+constexpr int64_t kIterations = 100000;
+
+struct Syscall {
+  const char* name;
+  uint32_t nr;
+};
+
+const Syscall kSyscalls[] = {
+    {"getpid", __NR_getpid},
+    {"read", __NR_read},
+    {"futex", __NR_futex},
+    {"mmap", __NR_mmap},
+};
+
+enum PolicyKind {
+  // No sandbox, the baseline.
+  kNoSandbox,
+  // Only what the sandboxee needs.
+  kMinimal,
+  // Rules for hundreds of other syscalls as well.
+  kLarge,
+  // The same, ordered by the frequencies of the syscall looped.
+  kLargeOrdered,
+};
+
+const char* const kPolicyNames[] = {"no_sandbox", "minimal", "large",
+                                    "large_ordered"};
+
+std::unique_ptr<Policy> BuildPolicy(PolicyKind kind, const Syscall& syscall) {
+  PolicyBuilder builder;
+  builder.AllowStaticStartup()
+      .AllowExit()
+      .AllowWrite()
+      .AllowSyscalls({__NR_getpid, __NR_read, __NR_futex, __NR_mmap,
+                      __NR_munmap, __NR_clock_gettime});
+  if (kind == kLarge || kind == kLargeOrdered) {
+    // Earlier rules take precedence, this leaves the allowed syscalls as is.
+    for (uint32_t nr = 0; nr < 400; ++nr) {
+      builder.BlockSyscallWithErrno(nr, ENOSYS);
+    }
+  }
+  if (kind == kLargeOrdered) {
+    std::map<uint32_t, uint64_t> frequencies = {{syscall.nr, kIterations}};
+    if (syscall.nr == __NR_mmap) {
+      frequencies[__NR_munmap] = kIterations;
+    }
+    builder.OrderSyscallsByFrequency(frequencies);
+  }
+  return builder.BuildOrDie();
+}
+
+std::string GetSyscallLoopPath() {
+  return GetDataDependencyFilePath(
+      "sandboxed_api/sandbox2/testcases/syscall_loop");
+}
+
+// Runs the sandboxee under 'kind' and returns the nanoseconds its loop took.
+sapi::StatusOr<int64_t> RunSyscallLoop(PolicyKind kind,
+                                       const Syscall& syscall) {
+  const std::string path = GetSyscallLoopPath();
+  std::vector<std::string> args = {path, syscall.name,
+                                   absl::StrCat(kIterations)};
+  std::string output;
+  if (kind == kNoSandbox) {
+    SAPI_ASSIGN_OR_RETURN(int exit_code, util::Communicate(args, {}, &output));
+    if (exit_code != 0) {
+      return sapi::InternalError(
+          absl::StrCat("syscall_loop exited with ", exit_code));
+    }
+  } else {
+    auto executor = absl::make_unique<Executor>(path, args);
+    const int out_fd = executor->ipc()->ReceiveFd(STDOUT_FILENO);
+    Sandbox2 s2(std::move(executor), BuildPolicy(kind, syscall));
+    Result result = s2.Run();
+    if (result.final_status() != Result::OK) {
+      close(out_fd);
+      return sapi::InternalError(
+          absl::StrCat("syscall_loop failed: ", result.ToString()));
+    }
+    char buf[64];
+    ssize_t n;
+    while ((n = read(out_fd, buf, sizeof(buf))) > 0) {
+      output.append(buf, n);
+    }
+    close(out_fd);
+  }
+  int64_t nanos;
+  if (!absl::SimpleAtoi(output, &nanos)) {
+    return sapi::InternalError(
+        absl::StrCat("Unexpected output of syscall_loop: ", output));
+  }
+  return nanos;
+}
+
+// Arguments are the index into kSyscalls and the PolicyKind. Only the loop of
+// the sandboxee is timed, not its startup.
+void BenchmarkSyscall(benchmark::State& state) {
+  const Syscall& syscall = kSyscalls[state.range(0)];
+  const auto kind = static_cast<PolicyKind>(state.range(1));
+  int64_t total_nanos = 0;
+  for (auto _ : state) {
+    sapi::StatusOr<int64_t> nanos = RunSyscallLoop(kind, syscall);
+    if (!nanos.ok()) {
+      state.SkipWithError(nanos.status().ToString().c_str());
+      return;
+    }
+    total_nanos += nanos.ValueOrDie();
+    state.SetIterationTime(nanos.ValueOrDie() / 1e9);
+  }
+  state.SetLabel(absl::StrCat(syscall.name, "/", kPolicyNames[kind]));
+  state.counters["ns_per_syscall"] = benchmark::Counter(
+      static_cast<double>(total_nanos) / kIterations,
+      benchmark::Counter::kAvgIterations);
+}
+
+void SyscallsAndPolicies(benchmark::internal::Benchmark* b) {
+  for (size_t syscall = 0; syscall < ABSL_ARRAYSIZE(kSyscalls); ++syscall) {
+    for (int kind = kNoSandbox; kind <= kLargeOrdered; ++kind) {
+      b->Args({static_cast<int64_t>(syscall), kind});
+    }
+  }
+}
+BENCHMARK(BenchmarkSyscall)->Apply(SyscallsAndPolicies)->UseManualTime();
+
+}  // namespace
+}  // namespace sandbox2
+
+BENCHMARK_MAIN();
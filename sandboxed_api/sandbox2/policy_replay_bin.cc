@@ -0,0 +1,250 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays the syscalls of binary audit logs (see audit_log.h) against two
+// seccomp-bpf programs, to check a changed policy before deploying it.
+//
+// Usage:
+// policy_replay_bin current.bpf candidate.bpf audit.log [audit.log ...]
+//
+// The programs hold the raw sock_filter array, as returned by
+// Policy::GetProgram(). Lists the records for which the programs return
+// different actions, and the instructions both run on average. Exits with an
+// error if there are any differences.
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/audit_log.h"
+#include "sandboxed_api/sandbox2/bpfevaluator.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+
+#ifndef AUDIT_ARCH_PPC64LE
+#define AUDIT_ARCH_PPC64LE (EM_PPC64 | __AUDIT_ARCH_64BIT | __AUDIT_ARCH_LE)
+#endif
+
+ABSL_FLAG(int32_t, policy_replay_max_differences, 100,
+          "Number of differing records to list, -1 for all");
+ABSL_FLAG(bool, policy_replay_per_record, false,
+          "List the actions and instruction counts of every record");
+
+namespace {
+
+// Records evaluated per pass, about 400 KiB of seccomp_data.
+constexpr size_t kBatchSize = 1 << 12;
+
+bool ReadProgram(const char* path, std::vector<sock_filter>* prog) {
+  std::string contents;
+  auto status = sandbox2::file::GetContents(path, &contents,
+                                            sandbox2::file::Defaults());
+  if (!status.ok()) {
+    absl::FPrintF(stderr, "Cannot read %s: %s\n", path, status.message());
+    return false;
+  }
+  if (contents.size() % sizeof(sock_filter) != 0) {
+    absl::FPrintF(stderr, "%s is not a BPF program\n", path);
+    return false;
+  }
+  const auto* begin = reinterpret_cast<const sock_filter*>(contents.data());
+  prog->assign(begin, begin + contents.size() / sizeof(sock_filter));
+  std::string error;
+  if (!sandbox2::bpf::Evaluator::Validate(*prog, &error)) {
+    absl::FPrintF(stderr, "%s is not a valid seccomp filter: %s\n", path,
+                  error);
+    return false;
+  }
+  return true;
+}
+
+uint32_t GetAuditArch(uint32_t arch) {
+  switch (arch) {
+    case sandbox2::Syscall::kX86_64:
+      return AUDIT_ARCH_X86_64;
+    case sandbox2::Syscall::kX86_32:
+      return AUDIT_ARCH_I386;
+    case sandbox2::Syscall::kPPC_64:
+      return AUDIT_ARCH_PPC64LE;
+    default:
+      return 0;
+  }
+}
+
+seccomp_data ToSeccompData(const sandbox2::AuditRecord& record) {
+  seccomp_data data{};
+  data.nr = static_cast<int>(record.nr);
+  data.arch = GetAuditArch(record.arch);
+  data.instruction_pointer = record.instruction_pointer;
+  std::copy(std::begin(record.args), std::end(record.args), data.args);
+  return data;
+}
+
+struct Totals {
+  uint64_t records = 0;
+  uint64_t differences = 0;
+  uint64_t current_insns = 0;
+  uint64_t candidate_insns = 0;
+  uint32_t current_max_insns = 0;
+  uint32_t candidate_max_insns = 0;
+};
+
+class Replay {
+ public:
+  Replay(std::vector<sock_filter> current, std::vector<sock_filter> candidate)
+      : current_(std::move(current)),
+        candidate_(std::move(candidate)),
+        max_differences_(absl::GetFlag(FLAGS_policy_replay_max_differences)),
+        per_record_(absl::GetFlag(FLAGS_policy_replay_per_record)) {}
+
+  // Replays the records of the audit log at 'path', returns false if it could
+  // not be read completely.
+  bool ReplayLog(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+      absl::FPrintF(stderr, "Cannot open %s\n", path);
+      return false;
+    }
+    std::string buffer(kBatchSize * sizeof(sandbox2::AuditRecord), '\0');
+    bool ok = true;
+    size_t read;
+    while ((read = fread(&buffer[0], 1, buffer.size(), file)) > 0) {
+      records_.clear();
+      if (!sandbox2::AuditLog::Parse(absl::string_view(buffer.data(), read),
+                                     &records_)) {
+        absl::FPrintF(stderr, "%s is truncated or not an audit log\n", path);
+        ok = false;
+      }
+      ReplayBatch();
+      if (!ok) {
+        break;
+      }
+    }
+    if (ferror(file)) {
+      absl::FPrintF(stderr, "Cannot read %s\n", path);
+      ok = false;
+    }
+    fclose(file);
+    return ok;
+  }
+
+  const Totals& totals() const { return totals_; }
+
+ private:
+  void ReplayBatch() {
+    const size_t count = records_.size();
+    data_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      data_[i] = ToSeccompData(records_[i]);
+    }
+    current_verdicts_.resize(count);
+    candidate_verdicts_.resize(count);
+    current_.EvaluateBatch(data_.data(), count, current_verdicts_.data());
+    candidate_.EvaluateBatch(data_.data(), count, candidate_verdicts_.data());
+
+    for (size_t i = 0; i < count; ++i) {
+      const sandbox2::bpf::Verdict& current = current_verdicts_[i];
+      const sandbox2::bpf::Verdict& candidate = candidate_verdicts_[i];
+      totals_.current_insns += current.insns;
+      totals_.candidate_insns += candidate.insns;
+      totals_.current_max_insns =
+          std::max(totals_.current_max_insns, current.insns);
+      totals_.candidate_max_insns =
+          std::max(totals_.candidate_max_insns, candidate.insns);
+      const bool differs = current.action != candidate.action;
+      if (differs) {
+        ++totals_.differences;
+      }
+      if (per_record_ ||
+          (differs && (max_differences_ < 0 ||
+                       totals_.differences <=
+                           static_cast<uint64_t>(max_differences_)))) {
+        absl::PrintF("%s %s: %#010x (%d insns) -> %#010x (%d insns)\n",
+                     differs ? "DIFF" : "SAME",
+                     sandbox2::AuditLog::ToString(records_[i]), current.action,
+                     current.insns, candidate.action, candidate.insns);
+      }
+    }
+    totals_.records += count;
+  }
+
+  sandbox2::bpf::Evaluator current_;
+  sandbox2::bpf::Evaluator candidate_;
+  const int max_differences_;
+  const bool per_record_;
+
+  // Reused between batches.
+  std::vector<sandbox2::AuditRecord> records_;
+  std::vector<seccomp_data> data_;
+  std::vector<sandbox2::bpf::Verdict> current_verdicts_;
+  std::vector<sandbox2::bpf::Verdict> candidate_verdicts_;
+
+  Totals totals_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc < 4) {
+    absl::FPrintF(stderr,
+                  "Usage: %s [flags] current.bpf candidate.bpf audit.log "
+                  "[audit.log ...]\n",
+                  argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<sock_filter> current;
+  std::vector<sock_filter> candidate;
+  if (!ReadProgram(argv[1], &current) || !ReadProgram(argv[2], &candidate)) {
+    return EXIT_FAILURE;
+  }
+
+  Replay replay(std::move(current), std::move(candidate));
+  int exit_code = EXIT_SUCCESS;
+  for (int i = 3; i < argc; ++i) {
+    if (!replay.ReplayLog(argv[i])) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+
+  const Totals& totals = replay.totals();
+  const double records = std::max<uint64_t>(totals.records, 1);
+  absl::PrintF(
+      "%d records, %d differences\n"
+      "current:   %.2f insns on average, %d at most\n"
+      "candidate: %.2f insns on average, %d at most\n",
+      totals.records, totals.differences, totals.current_insns / records,
+      totals.current_max_insns, totals.candidate_insns / records,
+      totals.candidate_max_insns);
+  if (totals.differences > 0) {
+    exit_code = EXIT_FAILURE;
+  }
+  return exit_code;
+}
@@ -0,0 +1,70 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Turns the syscall traces of sandboxees run with
+// --sandbox2_danger_danger_permit_all_and_log into a PolicyBuilder snippet
+// allowing them, see syscall_trace.h.
+//
+// Usage:
+// policy_synthesizer_bin run1.log [run2.log ...]
+//
+// The traces of all files are added up, so that the snippet covers every run.
+
+#include <cstdlib>
+#include <string>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/strings/str_format.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+#include "sandboxed_api/sandbox2/syscall_trace.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc < 2) {
+    absl::FPrintF(stderr, "Usage: %s trace.log [trace.log ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  sandbox2::SyscallTrace trace;
+  for (int i = 1; i < argc; ++i) {
+    std::string contents;
+    auto status = sandbox2::file::GetContents(argv[i], &contents,
+                                              sandbox2::file::Defaults());
+    if (!status.ok()) {
+      absl::FPrintF(stderr, "Cannot read %s: %s\n", argv[i], status.message());
+      return EXIT_FAILURE;
+    }
+    if (trace.Parse(contents) == 0) {
+      absl::FPrintF(stderr, "%s holds no syscall trace\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const sandbox2::Syscall::CpuArch host_arch =
+      sandbox2::Syscall::GetHostArch();
+  absl::PrintF("%s", trace.ToPolicySnippet(host_arch));
+  // Syscalls of other architectures need policies of their own.
+  for (const auto& entry : trace.entries()) {
+    if (entry.first.first != host_arch) {
+      absl::FPrintF(stderr, "Not covered: %s syscall %s\n",
+                    sandbox2::Syscall::GetArchDescription(entry.first.first),
+                    entry.second.name);
+    }
+  }
+  return EXIT_SUCCESS;
+}
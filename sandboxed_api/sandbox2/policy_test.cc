@@ -14,12 +14,17 @@
 
 #include "sandboxed_api/sandbox2/policy.h"
 
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/resource.h>
 #include <syscall.h>
+#include <unistd.h>
 
 #include <cerrno>
 #include <cstdlib>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -33,16 +38,24 @@
 #include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
 
 using ::testing::Eq;
+using ::testing::Ne;
 
 namespace sandbox2 {
 namespace {
 
-std::unique_ptr<Policy> PolicyTestcasePolicy() {
-  return PolicyBuilder()
-      .DisableNamespaces()
-      .AllowStaticStartup()
+std::unique_ptr<Policy> PolicyTestcasePolicy(
+    bool lightweight_tracing = false) {
+  PolicyBuilder builder;
+  if (lightweight_tracing) {
+    // Needs the PID namespace.
+    builder.UseLightweightTracing();
+  } else {
+    builder.DisableNamespaces();
+  }
+  return builder.AllowStaticStartup()
       .AllowExit()
       .AllowRead()
       .AllowWrite()
@@ -110,6 +123,52 @@ TEST(PolicyTest, PtraceDisallowed) {
   EXPECT_THAT(result.reason_code(), Eq(__NR_ptrace));
 }
 
+// Test that violations are still reported if only the main thread is traced.
+TEST(PolicyTest, PtraceDisallowedWithLightweightTracing) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/policy");
+  std::vector<std::string> args = {path, "3"};
+  auto executor = absl::make_unique<Executor>(path, args);
+
+  auto policy = PolicyTestcasePolicy(/*lightweight_tracing=*/true);
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::VIOLATION));
+  // The violating syscall is not known.
+  EXPECT_THAT(result.reason_code(), Eq(static_cast<uintptr_t>(-1)));
+}
+
+// Test that untraced grandchildren are killed along with the sandboxee.
+TEST(PolicyTest, LightweightTracingKillsGrandchildren) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/policy");
+  std::vector<std::string> args = {path, "7"};
+  auto executor = absl::make_unique<Executor>(path, args);
+  int fds[2];
+  ASSERT_THAT(pipe2(fds, O_CLOEXEC), Eq(0));
+  file_util::fileops::FDCloser out(fds[0]);
+  executor->ipc()->MapFd(fds[1], STDOUT_FILENO);
+
+  auto policy = PolicyBuilder()
+                    .UseLightweightTracing()
+                    .AllowStaticStartup()
+                    .AllowExit()
+                    .AllowFork()
+                    .AllowSleep()
+                    .BuildOrDie();
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+  ASSERT_THAT(result.final_status(), Eq(Result::OK));
+
+  // The pipe is closed once the last process holding it is gone.
+  pollfd pfd = {out.get(), POLLIN, 0};
+  ASSERT_THAT(poll(&pfd, 1, /*timeout=*/10000), Eq(1));
+  char c;
+  EXPECT_THAT(read(out.get(), &c, 1), Eq(0));
+}
+
 // Test that clone(2) with flag CLONE_UNTRACED is disallowed.
 TEST(PolicyTest, CloneUntracedDisallowed) {
   SKIP_SANITIZERS_AND_COVERAGE;
@@ -183,6 +242,54 @@ TEST(MinimalTest, MinimalBinaryWorks) {
   EXPECT_THAT(result.reason_code(), Eq(EXIT_SUCCESS));
 }
 
+// Test that the startup of a static binary is allowed from its ELF headers.
+TEST(MinimalTest, StartupOfStaticBinaryWorks) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+
+  auto policy = PolicyBuilder()
+                    .AllowStartupOfBinary(path)
+                    .AllowExit()
+                    .BlockSyscallWithErrno(__NR_prlimit64, EPERM)
+                    .BlockSyscallWithErrno(__NR_access, ENOENT)
+                    .BuildOrDie();
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::OK));
+  EXPECT_THAT(result.reason_code(), Eq(EXIT_SUCCESS));
+}
+
+// Test that one policy can be shared by several sandboxes.
+TEST(MinimalTest, SharedPolicyWorks) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::shared_ptr<Policy> policy = MinimalTestcasePolicy();
+
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> args = {path};
+    Sandbox2 s2(absl::make_unique<Executor>(path, args), policy);
+    auto result = s2.Run();
+
+    ASSERT_THAT(result.final_status(), Eq(Result::OK));
+    EXPECT_THAT(result.reason_code(), Eq(EXIT_SUCCESS));
+  }
+}
+
+TEST(CompiledPolicyTest, EqualProgramsAreSharedAndSealed) {
+  std::vector<sock_filter> program = {ALLOW};
+  auto compiled = CompiledPolicy::Get(program);
+  EXPECT_THAT(CompiledPolicy::Get(program), Eq(compiled));
+  EXPECT_THAT(CompiledPolicy::Get({KILL}), Ne(compiled));
+
+  ASSERT_THAT(compiled->memfd(), Ne(-1));
+  char byte = 0;
+  EXPECT_THAT(pwrite(compiled->memfd(), &byte, 1, 0), Eq(-1));
+}
+
 // Test that we can sandbox a minimal non-static binary returning 0.
 TEST(MinimalTest, MinimalSharedBinaryWorks) {
   SKIP_SANITIZERS_AND_COVERAGE;
@@ -25,18 +25,32 @@
 #include <linux/futex.h>
 #include <linux/net.h>     // For SYS_CONNECT
 #include <linux/random.h>  // For GRND_NONBLOCK
+#include <linux/userfaultfd.h>
 #include <sys/mman.h>      // For mmap arguments
 #include <sys/socket.h>
 #include <syscall.h>
 
+#include <algorithm>
 #include <csignal>
+#include <cstddef>
 #include <cstdint>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/memory/memory.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/bpfanalyzer.h"
+#include "sandboxed_api/sandbox2/file_broker.h"
 #include "sandboxed_api/sandbox2/namespace.h"
+#include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
 #include "sandboxed_api/sandbox2/util/path.h"
 #include "sandboxed_api/util/canonical_errors.h"
@@ -45,12 +59,184 @@
 namespace sandbox2 {
 namespace {
 
+constexpr size_t kUnboundLabel = ~size_t{0};
+
+// Not in older headers, Linux 6.1.
+constexpr int kMadvCollapse = 25;
+// Not in older headers, Linux 6.4.
+constexpr int kPrSetMemoryMerge = 67;
+
+// Syscalls are searched linearly in ranges of up to this many syscalls.
+constexpr size_t kMaxLinearSearch = 4;
+
+// At most this many frequent syscalls are checked before the search, see
+// PolicyBuilder::OrderSyscallsByFrequency().
+constexpr size_t kMaxFrequentChecks = 8;
+
+// Compiled policies may grow beyond the linear user policy, as the rules of
+// syscalls sharing a rule are copied unless all their rules are the same. They
+// are only used if they fit into this many instructions, which leaves room for
+// the rest of the policy below BPF_MAXINSNS.
+constexpr size_t kMaxCompiledPolicySize = BPF_MAXINSNS - 256;
+
+bool IsSingleReturn(const std::vector<sock_filter>& code) {
+  return code.size() == 1 && BPF_CLASS(code[0].code) == BPF_RET;
+}
+
+// Returns whether 'code' either falls through or returns 'insn'.
+bool ReturnsOnly(const std::vector<sock_filter>& code, const sock_filter& ret) {
+  for (const auto& insn : code) {
+    if (BPF_CLASS(insn.code) == BPF_RET &&
+        (insn.code != ret.code || insn.k != ret.k)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Assembles BPF with jumps to labels bound later on. Jumps to labels are
+// unconditional, so unlike with bpf_labels there is no limit on their number
+// and distance.
+class BpfAssembler {
+ public:
+  using Label = size_t;
+
+  Label NewLabel() {
+    labels_.push_back(kUnboundLabel);
+    return labels_.size() - 1;
+  }
+
+  // Makes 'label' point to the next emitted instruction.
+  void Bind(Label label) { labels_[label] = code_.size(); }
+
+  void Emit(const sock_filter& insn) { code_.push_back(insn); }
+  void Emit(const std::vector<sock_filter>& code) {
+    code_.insert(code_.end(), code.begin(), code.end());
+  }
+
+  void JumpTo(Label label) {
+    jumps_.emplace_back(code_.size(), label);
+    code_.push_back(BPF_STMT(BPF_JMP | BPF_JA, 0));
+  }
+
+  std::vector<sock_filter> Finish() {
+    for (const auto& jump : jumps_) {
+      const size_t target = labels_[jump.second];
+      CHECK(target != kUnboundLabel) << "Unbound BPF label";
+      code_[jump.first].k = target - jump.first - 1;
+    }
+    return std::move(code_);
+  }
+
+ private:
+  std::vector<sock_filter> code_;
+  std::vector<size_t> labels_;
+  // Instruction index and label of each jump.
+  std::vector<std::pair<size_t, Label>> jumps_;
+};
+
+// A range of syscalls [num, last] handled by the search, either they return
+// right away or jump to their shared rules.
+struct SearchLeaf {
+  uint32_t num;
+  uint32_t last;
+  // Number of calls, see PolicyBuilder::OrderSyscallsByFrequency().
+  uint64_t frequency = 0;
+  const sock_filter* ret = nullptr;
+  BpfAssembler::Label label = kUnboundLabel;
+};
+
+// Returns whether the syscalls of 'a' and 'b' end up at the same place.
+bool HaveSameTarget(const SearchLeaf& a, const SearchLeaf& b) {
+  if (a.ret && b.ret) {
+    return a.ret->code == b.ret->code && a.ret->k == b.ret->k;
+  }
+  return !a.ret && !b.ret && a.label == b.label;
+}
+
+// Emits the check of the syscall number in A against 'leaf', which runs its
+// action if it matches and continues with the next instruction otherwise.
+void EmitLeafCheck(const SearchLeaf& leaf, BpfAssembler* as) {
+  if (leaf.num == leaf.last) {
+    // Runs the next instruction if equal, skips it otherwise.
+    as->Emit(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, leaf.num, 0, 1));
+  } else {
+    as->Emit(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, leaf.num, 0, 2));
+    as->Emit(BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, leaf.last, 1, 0));
+  }
+  if (leaf.ret) {
+    as->Emit(*leaf.ret);
+  } else {
+    as->JumpTo(leaf.label);
+  }
+}
+
+// Emits a binary search for the syscall number in A over leaves[lo, hi),
+// which are sorted by syscall number. Syscalls not found continue at
+// 'not_found'.
+void EmitSearch(const std::vector<SearchLeaf>& leaves, size_t lo, size_t hi,
+                BpfAssembler::Label not_found, BpfAssembler* as) {
+  if (hi - lo <= kMaxLinearSearch) {
+    // The syscall ranges are disjoint, so the most frequent ones can go first.
+    std::vector<size_t> order;
+    for (size_t i = lo; i < hi; ++i) {
+      order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&leaves](size_t a, size_t b) {
+      return leaves[a].frequency > leaves[b].frequency;
+    });
+    for (size_t i : order) {
+      EmitLeafCheck(leaves[i], as);
+    }
+    as->JumpTo(not_found);
+    return;
+  }
+  const size_t mid = lo + (hi - lo) / 2;
+  const BpfAssembler::Label upper_half = as->NewLabel();
+  as->Emit(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, leaves[mid].num, 0, 1));
+  as->JumpTo(upper_half);
+  EmitSearch(leaves, lo, mid, not_found, as);
+  as->Bind(upper_half);
+  EmitSearch(leaves, mid, hi, not_found, as);
+}
+
+// Checks the syscalls which make up a large share of the calls before the
+// binary search over 'leaves'. Each check saves a search for its syscall, but
+// costs all other syscalls one more instruction.
+void EmitFrequentChecks(const std::vector<SearchLeaf>& leaves,
+                        BpfAssembler* as) {
+  uint64_t total = 0;
+  std::vector<const SearchLeaf*> frequent;
+  for (const SearchLeaf& leaf : leaves) {
+    total += leaf.frequency;
+    frequent.push_back(&leaf);
+  }
+  std::stable_sort(frequent.begin(), frequent.end(),
+                   [](const SearchLeaf* a, const SearchLeaf* b) {
+                     return a->frequency > b->frequency;
+                   });
+  // Instructions run by the search until the leaf, roughly.
+  uint64_t search_steps = 2 * kMaxLinearSearch;
+  for (size_t n = leaves.size(); n > kMaxLinearSearch; n /= 2) {
+    search_steps += 2;
+  }
+  for (size_t i = 0; i < frequent.size() && i < kMaxFrequentChecks; ++i) {
+    const SearchLeaf& leaf = *frequent[i];
+    if (leaf.frequency == 0 ||
+        leaf.frequency * (search_steps - 2) <= total - leaf.frequency) {
+      break;
+    }
+    EmitLeafCheck(leaf, as);
+  }
+}
+
 }  // namespace
 
+constexpr char PolicyBuilder::kFlatLibraryDir[];
+
 PolicyBuilder& PolicyBuilder::AllowSyscall(unsigned int num) {
   if (handled_syscalls_.insert(num).second) {
-    output_->user_policy_.insert(output_->user_policy_.end(),
-                                 {SYSCALL(num, ALLOW)});
+    AddRule({{num}, {ALLOW}}, {SYSCALL(num, ALLOW)});
   }
   return *this;
 }
@@ -69,11 +255,25 @@ PolicyBuilder& PolicyBuilder::AllowSyscalls(SyscallInitializer nums) {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::AllowSyscallsByName(
+    const std::vector<std::string>& names) {
+  const Syscall::CpuArch arch = Syscall::GetHostArch();
+  for (const auto& name : names) {
+    int num = Syscall::GetSyscallNumber(arch, name);
+    if (num < 0) {
+      SetError(sapi::InvalidArgumentError(
+          absl::StrCat("Unknown syscall: ", name)));
+      continue;
+    }
+    AllowSyscall(num);
+  }
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::BlockSyscallWithErrno(unsigned int num,
                                                     int error) {
   if (handled_syscalls_.insert(num).second) {
-    output_->user_policy_.insert(output_->user_policy_.end(),
-                                 {SYSCALL(num, ERRNO(error))});
+    AddRule({{num}, {ERRNO(error)}}, {SYSCALL(num, ERRNO(error))});
   }
   return *this;
 }
@@ -426,6 +626,57 @@ PolicyBuilder& PolicyBuilder::AllowGetRandom() {
                                             });
 }
 
+PolicyBuilder& PolicyBuilder::AllowSchedYield() {
+  return AllowSyscall(__NR_sched_yield);
+}
+
+PolicyBuilder& PolicyBuilder::AllowHugePageText() {
+  AllowSyscall(__NR_munmap);
+  AddPolicyOnSyscall(__NR_madvise, {
+                                       ARG_32(2),
+                                       JEQ32(MADV_HUGEPAGE, ALLOW),
+                                       JEQ32(kMadvCollapse, ALLOW),
+                                   });
+  AddPolicyOnSyscall(__NR_mprotect, {
+                                        ARG_32(2),
+                                        JEQ32(PROT_READ | PROT_EXEC, ALLOW),
+                                    });
+  AddPolicyOnSyscall(__NR_mremap,
+                     {
+                         ARG_32(3),
+                         JEQ32(MREMAP_MAYMOVE | MREMAP_FIXED, ALLOW),
+                     });
+  return AddPolicyOnMmap([](bpf_labels& labels) -> std::vector<sock_filter> {
+    return {
+        ARG_32(2),  // prot
+        JNE32(PROT_READ | PROT_WRITE, JUMP(&labels, mmap_end)),
+        ARG_32(3),  // flags
+        JEQ32(MAP_ANONYMOUS | MAP_PRIVATE, ALLOW),
+        LABEL(&labels, mmap_end),
+    };
+  });
+}
+
+PolicyBuilder& PolicyBuilder::AllowMemoryMerging() {
+  AddPolicyOnSyscall(__NR_prctl, {
+                                     ARG_32(0),  // option
+                                     JEQ32(kPrSetMemoryMerge, ALLOW),
+                                 });
+  return AddPolicyOnSyscall(__NR_madvise, {
+                                              ARG_32(2),  // advice
+                                              JEQ32(MADV_MERGEABLE, ALLOW),
+                                          });
+}
+
+PolicyBuilder& PolicyBuilder::AllowUserfaultfd() {
+  AllowSyscall(__NR_userfaultfd);
+  return AddPolicyOnSyscall(__NR_ioctl, {
+                                            ARG_32(1),  // request
+                                            JEQ32(UFFDIO_API, ALLOW),
+                                            JEQ32(UFFDIO_REGISTER, ALLOW),
+                                        });
+}
+
 PolicyBuilder& PolicyBuilder::AllowLogForwarding() {
   AllowWrite();
   AllowSystemMalloc();
@@ -435,6 +686,10 @@ PolicyBuilder& PolicyBuilder::AllowLogForwarding() {
                  __NR_clock_gettime,
                  // From comms
                  __NR_gettid, __NR_close});
+  // From the synchronization of the LogSink
+  AllowFutexOp(FUTEX_WAIT);
+  AllowFutexOp(FUTEX_WAIT_BITSET);
+  AllowFutexOp(FUTEX_WAKE);
 
   // For LOG(FATAL)
   return AddPolicyOnSyscall(__NR_kill,
@@ -449,6 +704,25 @@ PolicyBuilder& PolicyBuilder::AllowLogForwarding() {
                             });
 }
 
+PolicyBuilder& PolicyBuilder::AllowProfileOutput(absl::string_view dir) {
+  AllowOpen();
+  AllowRead();
+  AllowWrite();
+  AllowStat();
+  AllowSafeFcntl();
+  AllowSyscalls({
+      __NR_lseek,
+      __NR_ftruncate,
+      __NR_close,
+      __NR_getpid,
+#ifdef __NR_mkdir
+      __NR_mkdir,
+#endif
+      __NR_mkdirat,
+  });
+  return AddDirectory(dir, /*is_ro=*/false);
+}
+
 PolicyBuilder& PolicyBuilder::AllowFutexOp(int op) {
   return AddPolicyOnSyscall(
       __NR_futex, {
@@ -560,36 +834,44 @@ PolicyBuilder& PolicyBuilder::AddPolicyOnSyscall(unsigned int num, BpfFunc f) {
 
 PolicyBuilder& PolicyBuilder::AddPolicyOnSyscalls(
     SyscallInitializer nums, const std::vector<sock_filter>& policy) {
-  auto resolved_policy =
-      ResolveBpfFunc(
-          [nums, policy](bpf_labels& labels) -> std::vector<sock_filter> {
-            std::vector<sock_filter> out;
-            out.reserve(nums.size() + policy.size());
-            for (auto num : nums) {
-              out.insert(out.end(), {SYSCALL(num, JUMP(&labels, do_policy_l))});
-            }
-            out.insert(out.end(), {JUMP(&labels, dont_do_policy_l),
-                                   LABEL(&labels, do_policy_l)});
-            for (const auto& filter : policy) {
-              // Syscall arch is expected as TRACE value
-              if (filter.code == (BPF_RET | BPF_K) &&
-                  (filter.k & SECCOMP_RET_ACTION) == SECCOMP_RET_TRACE &&
-                  (filter.k & SECCOMP_RET_DATA) != Syscall::GetHostArch()) {
-                LOG(WARNING)
-                    << "SANDBOX2_TRACE should be used in policy instead of "
-                       "TRACE(value)";
-                out.push_back(SANDBOX2_TRACE);
-              } else {
-                out.push_back(filter);
-              }
-            }
-            out.push_back(LOAD_SYSCALL_NR);
-            out.insert(out.end(), {LABEL(&labels, dont_do_policy_l)});
-            return out;
-          });
+  std::vector<sock_filter> body;
+  body.reserve(policy.size() + 1);
+  for (const auto& filter : policy) {
+    // Syscall arch is expected as TRACE value
+    if (filter.code == (BPF_RET | BPF_K) &&
+        (filter.k & SECCOMP_RET_ACTION) == SECCOMP_RET_TRACE &&
+        (filter.k & SECCOMP_RET_DATA) != Syscall::GetHostArch()) {
+      LOG(WARNING) << "SANDBOX2_TRACE should be used in policy instead of "
+                      "TRACE(value)";
+      body.push_back(SANDBOX2_TRACE);
+    } else {
+      body.push_back(filter);
+    }
+  }
+  body.push_back(LOAD_SYSCALL_NR);
+  auto resolved_policy = ResolveBpfFunc(
+      [nums, &body](bpf_labels& labels) -> std::vector<sock_filter> {
+        std::vector<sock_filter> out;
+        out.reserve(nums.size() + body.size() + 3);
+        for (auto num : nums) {
+          out.insert(out.end(), {SYSCALL(num, JUMP(&labels, do_policy_l))});
+        }
+        out.insert(out.end(), {JUMP(&labels, dont_do_policy_l),
+                               LABEL(&labels, do_policy_l)});
+        out.insert(out.end(), body.begin(), body.end());
+        out.insert(out.end(), {LABEL(&labels, dont_do_policy_l)});
+        return out;
+      });
   // Pre-/Postcondition: Syscall number loaded into A register
-  output_->user_policy_.insert(output_->user_policy_.end(),
-                               resolved_policy.begin(), resolved_policy.end());
+  if (nums.size() == 0) {
+    // Never runs, there is no rule to compile.
+    output_->user_policy_.insert(output_->user_policy_.end(),
+                                 resolved_policy.begin(),
+                                 resolved_policy.end());
+  } else {
+    AddRule({std::vector<uint32_t>(nums.begin(), nums.end()), std::move(body)},
+            resolved_policy);
+  }
   return *this;
 }
 
@@ -630,10 +912,180 @@ PolicyBuilder& PolicyBuilder::AddPolicyOnMmap(BpfFunc f) {
 }
 
 PolicyBuilder& PolicyBuilder::DangerDefaultAllowAll() {
-  output_->user_policy_.push_back(ALLOW);
+  AddRule({{}, {ALLOW}}, {ALLOW});
   return *this;
 }
 
+void PolicyBuilder::AddRule(Rule rule, const std::vector<sock_filter>& linear) {
+  output_->user_policy_.insert(output_->user_policy_.end(), linear.begin(),
+                               linear.end());
+  rule.linear = linear;
+  rules_.push_back(std::move(rule));
+}
+
+void PolicyBuilder::OrderRulesByFrequency() {
+  // A rule has to stay behind the earlier rules that apply to one of its
+  // syscalls. Rules for all syscalls stay behind every earlier rule and vice
+  // versa.
+  const size_t size = rules_.size();
+  std::vector<std::vector<size_t>> successors(size);
+  std::vector<size_t> predecessors(size);
+  std::vector<uint64_t> frequencies(size);
+  for (size_t i = 0; i < size; ++i) {
+    const std::vector<uint32_t>& nums = rules_[i].nums;
+    for (uint32_t num : nums) {
+      auto frequency = syscall_frequencies_.find(num);
+      if (frequency != syscall_frequencies_.end()) {
+        frequencies[i] += frequency->second;
+      }
+    }
+    for (size_t j = 0; j < i; ++j) {
+      const std::vector<uint32_t>& other = rules_[j].nums;
+      if (nums.empty() || other.empty() ||
+          std::any_of(nums.begin(), nums.end(), [&other](uint32_t num) {
+            return std::find(other.begin(), other.end(), num) != other.end();
+          })) {
+        successors[j].push_back(i);
+        ++predecessors[i];
+      }
+    }
+  }
+
+  // Of the rules whose predecessors are placed, take the most frequent one
+  // next, the earliest one of equally frequent rules.
+  auto later = [&frequencies](size_t a, size_t b) {
+    return frequencies[a] != frequencies[b] ? frequencies[a] < frequencies[b]
+                                            : a > b;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(later)> ready(
+      later);
+  for (size_t i = 0; i < size; ++i) {
+    if (predecessors[i] == 0) {
+      ready.push(i);
+    }
+  }
+  std::vector<Rule> ordered;
+  ordered.reserve(size);
+  while (!ready.empty()) {
+    const size_t i = ready.top();
+    ready.pop();
+    for (size_t j : successors[i]) {
+      if (--predecessors[j] == 0) {
+        ready.push(j);
+      }
+    }
+    ordered.push_back(std::move(rules_[i]));
+  }
+  rules_ = std::move(ordered);
+
+  output_->user_policy_.clear();
+  for (const Rule& rule : rules_) {
+    output_->user_policy_.insert(output_->user_policy_.end(),
+                                 rule.linear.begin(), rule.linear.end());
+  }
+}
+
+std::vector<sock_filter> PolicyBuilder::CompileRules() const {
+  // Syscalls which are not handled before the first rule applying to all
+  // syscalls fall through to it, the rules from there on are kept linear.
+  auto catch_all =
+      std::find_if(rules_.begin(), rules_.end(),
+                   [](const Rule& rule) { return rule.nums.empty(); });
+
+  // The rules of each syscall in order, up to the first one that always
+  // returns.
+  std::map<uint32_t, std::vector<const Rule*>> chains;
+  std::set<uint32_t> returned;
+  for (auto rule = rules_.begin(); rule != catch_all; ++rule) {
+    for (uint32_t num : rule->nums) {
+      auto& chain = chains[num];
+      if (returned.count(num) != 0 ||
+          (!chain.empty() && chain.back() == &*rule)) {
+        continue;
+      }
+      chain.push_back(&*rule);
+      if (IsSingleReturn(rule->code)) {
+        returned.insert(num);
+      }
+    }
+  }
+
+  BpfAssembler as;
+  const BpfAssembler::Label fall_through = as.NewLabel();
+  // Syscalls with the same rules share a single copy of them.
+  std::map<std::vector<const Rule*>, BpfAssembler::Label> shared_chains;
+  std::vector<SearchLeaf> leaves;
+  leaves.reserve(chains.size());
+  for (const auto& chain : chains) {
+    SearchLeaf leaf;
+    leaf.num = chain.first;
+    leaf.last = chain.first;
+    auto frequency = syscall_frequencies_.find(leaf.num);
+    if (frequency != syscall_frequencies_.end()) {
+      leaf.frequency = frequency->second;
+    }
+    // If the rules of a syscall can only end up with the same verdict, like
+    // argument filters which only allow followed by AllowSyscall(), the
+    // arguments need not be looked at. Such syscalls return right away,
+    // which also lets the kernel cache their verdict (see
+    // Policy::GetCacheableSyscalls()).
+    const Rule* last = chain.second.back();
+    if (IsSingleReturn(last->code) &&
+        std::all_of(chain.second.begin(), chain.second.end(),
+                    [last](const Rule* rule) {
+                      return ReturnsOnly(rule->code, last->code[0]);
+                    })) {
+      leaf.ret = &last->code[0];
+    } else {
+      auto shared = shared_chains.find(chain.second);
+      if (shared == shared_chains.end()) {
+        shared = shared_chains.emplace(chain.second, as.NewLabel()).first;
+      }
+      leaf.label = shared->second;
+    }
+    // Consecutive syscalls with the same target are checked as one range.
+    if (!leaves.empty() && leaves.back().last + 1 == leaf.num &&
+        HaveSameTarget(leaves.back(), leaf)) {
+      leaves.back().last = leaf.num;
+      leaves.back().frequency += leaf.frequency;
+      continue;
+    }
+    leaves.push_back(leaf);
+  }
+
+  // Precondition: Syscall number loaded into A register
+  EmitFrequentChecks(leaves, &as);
+  EmitSearch(leaves, 0, leaves.size(), fall_through, &as);
+  for (const auto& shared : shared_chains) {
+    as.Bind(shared.second);
+    for (const Rule* rule : shared.first) {
+      as.Emit(rule->code);
+    }
+    if (!IsSingleReturn(shared.first.back()->code)) {
+      as.JumpTo(fall_through);
+    }
+  }
+
+  as.Bind(fall_through);
+  for (auto rule = catch_all; rule != rules_.end(); ++rule) {
+    if (rule->nums.empty()) {
+      as.Emit(rule->code);
+      continue;
+    }
+    const BpfAssembler::Label do_rule = as.NewLabel();
+    const BpfAssembler::Label dont_do_rule = as.NewLabel();
+    for (uint32_t num : rule->nums) {
+      as.Emit(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, num, 0, 1));
+      as.JumpTo(do_rule);
+    }
+    as.JumpTo(dont_do_rule);
+    as.Bind(do_rule);
+    as.Emit(rule->code);
+    as.Bind(dont_do_rule);
+  }
+  return as.Finish();
+}
+
 sapi::StatusOr<std::string> PolicyBuilder::ValidateAbsolutePath(
     absl::string_view path) {
   if (!file::IsAbsolutePath(path)) {
@@ -678,8 +1130,22 @@ sapi::StatusOr<std::unique_ptr<Policy>> PolicyBuilder::TryBuild() {
       return sapi::FailedPreconditionError(
           "Cannot set hostname without network namespaces.");
     }
-    output_->SetNamespace(absl::make_unique<Namespace>(
-        allow_unrestricted_networking_, std::move(mounts_), hostname_));
+    if (allow_unrestricted_networking_ && use_namespace_template_) {
+      return sapi::FailedPreconditionError(
+          "Cannot use a namespace template without network namespaces.");
+    }
+    auto ns = absl::make_unique<Namespace>(allow_unrestricted_networking_,
+                                           std::move(mounts_), hostname_);
+    if (use_namespace_template_) {
+      ns->EnableNamespaceTemplate();
+    }
+    if (use_network_namespace_pool_) {
+      ns->EnableNetworkNamespacePool();
+    }
+    if (sandboxee_as_init_) {
+      ns->EnableSandboxeeAsInit();
+    }
+    output_->SetNamespace(std::move(ns));
   } else {
     // Not explicitly disabling them here as this is a technical limitation in
     // our stack trace collection functionality.
@@ -691,6 +1157,46 @@ sapi::StatusOr<std::unique_ptr<Policy>> PolicyBuilder::TryBuild() {
   output_->collect_stacktrace_on_violation_ = collect_stacktrace_on_violation_;
   output_->collect_stacktrace_on_timeout_ = collect_stacktrace_on_timeout_;
   output_->collect_stacktrace_on_kill_ = collect_stacktrace_on_kill_;
+  output_->collect_stacktrace_of_all_threads_ =
+      collect_stacktrace_of_all_threads_;
+  output_->stacktrace_sample_fraction_ = stacktrace_sample_fraction_;
+  output_->user_notify_ = user_notify_;
+  output_->user_notify_network_proxy_ = user_notify_network_proxy_;
+  output_->lightweight_tracing_ = lightweight_tracing_;
+  if (!brokered_files_.empty()) {
+    auto broker_or = FileBroker::Create(brokered_files_);
+    if (!broker_or.ok()) {
+      return broker_or.status();
+    }
+    output_->file_broker_ = std::move(broker_or.ValueOrDie());
+  }
+
+  if (use_precompiled_policy_) {
+    if (!output_->user_policy_.empty()) {
+      return sapi::FailedPreconditionError(
+          "Cannot add syscall rules to a precompiled policy.");
+    }
+    output_->user_policy_ = std::move(precompiled_policy_);
+  } else {
+    if (!syscall_frequencies_.empty()) {
+      OrderRulesByFrequency();
+    }
+    std::vector<sock_filter> compiled = CompileRules();
+    if (compiled.size() <= output_->user_policy_.size() ||
+        compiled.size() <= kMaxCompiledPolicySize) {
+      output_->user_policy_ = std::move(compiled);
+    } else {
+      VLOG(1) << "Compiled policy too large (" << compiled.size()
+              << " instructions), using the linear one";
+    }
+  }
+  if (VLOG_IS_ON(1)) {
+    const std::vector<sock_filter> program = output_->GetProgram();
+    VLOG(1) << "Policy cost:\n"
+            << bpf::AnalysisToString(
+                   program, bpf::Analyze(program, Syscall::GetHostAuditArch()),
+                   /*per_syscall=*/VLOG_IS_ON(2));
+  }
 
   auto pb_description = absl::make_unique<PolicyBuilderDescription>();
 
@@ -738,6 +1244,77 @@ PolicyBuilder& PolicyBuilder::AddFileAt(absl::string_view outside,
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::AddBrokeredFile(absl::string_view path) {
+  return AddBrokeredFileAt(path, path);
+}
+
+PolicyBuilder& PolicyBuilder::AddBrokeredFileAt(absl::string_view outside,
+                                                absl::string_view inside) {
+  auto fixed_outside_or = ValidateAbsolutePath(outside);
+  if (!fixed_outside_or.ok()) {
+    SetError(fixed_outside_or.status());
+    return *this;
+  }
+  auto fixed_inside_or = ValidateAbsolutePath(inside);
+  if (!fixed_inside_or.ok()) {
+    SetError(fixed_inside_or.status());
+    return *this;
+  }
+
+  if (brokered_files_.empty()) {
+    UseSeccompUserNotify();
+    // Only read-only opens are brokered.
+#ifdef __NR_open
+    AddPolicyOnSyscall(__NR_open,
+                       {
+                           ARG_32(1),
+                           BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K,
+                                    FileBroker::kUnbrokeredFlags, 1, 0),
+                           TRACE(Syscall::GetHostArch()),
+                       });
+#endif
+    AddPolicyOnSyscall(__NR_openat,
+                       {
+                           ARG_32(2),
+                           BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K,
+                                    FileBroker::kUnbrokeredFlags, 1, 0),
+                           TRACE(Syscall::GetHostArch()),
+                       });
+  }
+  brokered_files_[fixed_inside_or.ValueOrDie()] =
+      std::move(fixed_outside_or.ValueOrDie());
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::AllowStartupOfBinary(
+    absl::string_view path, absl::string_view ld_library_path) {
+  auto fixed_path_or = ValidatePath(path);
+  if (!fixed_path_or.ok()) {
+    SetError(fixed_path_or.status());
+    return *this;
+  }
+  auto fixed_path = std::move(fixed_path_or.ValueOrDie());
+
+  bool is_static = false;
+  auto status =
+      mounts_.AddMappingsForBinary(fixed_path, ld_library_path, &is_static);
+  if (!status.ok()) {
+    SetError(sapi::InternalError(absl::StrCat(
+        "Could not add libraries for ", fixed_path, ": ", status.message())));
+    return *this;
+  }
+  if (!is_static) {
+    // The mounts of the libraries need namespaces.
+    EnableNamespaces();
+    return AllowDynamicStartup();
+  }
+  AllowStaticStartup();
+  return AddPolicyOnSyscall(__NR_mprotect, {
+                                               ARG_32(2),
+                                               JEQ32(PROT_READ, ALLOW),
+                                           });
+}
+
 PolicyBuilder& PolicyBuilder::AddLibrariesForBinary(
     absl::string_view path, absl::string_view ld_library_path) {
   EnableNamespaces();
@@ -796,6 +1373,13 @@ PolicyBuilder& PolicyBuilder::AddDirectoryAt(absl::string_view outside,
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::FlattenLibraries() {
+  EnableNamespaces();
+  mounts_.SetFlatLibraryDir(kFlatLibraryDir);
+
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::AddTmpfs(absl::string_view inside, size_t sz) {
   EnableNamespaces();
 
@@ -808,6 +1392,24 @@ PolicyBuilder& PolicyBuilder::AddTmpfs(absl::string_view inside, size_t sz) {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::UseRootImage(absl::string_view image,
+                                           absl::string_view fs_type) {
+  EnableNamespaces();
+
+  auto fixed_image_or = ValidateAbsolutePath(image);
+  if (!fixed_image_or.ok()) {
+    SetError(fixed_image_or.status());
+    return *this;
+  }
+  auto status = mounts_.SetRootImage(fixed_image_or.ValueOrDie(), fs_type);
+  if (!status.ok()) {
+    SetError(sapi::InternalError(absl::StrCat("Could not use root image ",
+                                              image, ": ", status.message())));
+  }
+
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::AllowUnrestrictedNetworking() {
   EnableNamespaces();
   allow_unrestricted_networking_ = true;
@@ -815,6 +1417,20 @@ PolicyBuilder& PolicyBuilder::AllowUnrestrictedNetworking() {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::UseNamespaceTemplate() {
+  EnableNamespaces();
+  use_namespace_template_ = true;
+
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::UseNetworkNamespacePool() {
+  UseNamespaceTemplate();
+  use_network_namespace_pool_ = true;
+
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::SetHostname(absl::string_view hostname) {
   EnableNamespaces();
   hostname_ = std::string(hostname);
@@ -822,6 +1438,13 @@ PolicyBuilder& PolicyBuilder::SetHostname(absl::string_view hostname) {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::RunSandboxeeAsInit() {
+  EnableNamespaces();
+  sandboxee_as_init_ = true;
+
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::CollectStacktracesOnViolation(bool enable) {
   collect_stacktrace_on_violation_ = enable;
   return *this;
@@ -842,6 +1465,102 @@ PolicyBuilder& PolicyBuilder::CollectStacktracesOnKill(bool enable) {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::CollectStacktracesOfAllThreads(bool enable) {
+  collect_stacktrace_of_all_threads_ = enable;
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::SampleStacktraces(double fraction) {
+  if (!(fraction >= 0.0 && fraction <= 1.0)) {
+    SetError(sapi::InvalidArgumentError(
+        absl::StrCat("Stack trace sample fraction not in [0, 1]: ", fraction)));
+    return *this;
+  }
+  stacktrace_sample_fraction_ = fraction;
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::UseSeccompUserNotify() {
+  user_notify_ = true;
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::UseLightweightTracing() {
+  lightweight_tracing_ = true;
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::OrderSyscallsByFrequency(
+    const std::map<uint32_t, uint64_t>& frequencies) {
+  for (const auto& frequency : frequencies) {
+    syscall_frequencies_[frequency.first] += frequency.second;
+  }
+  return *this;
+}
+
+PolicyBuilder& PolicyBuilder::OrderSyscallsByProfile(
+    const Result::SyscallProfile& profile) {
+  std::map<uint32_t, uint64_t> frequencies;
+  for (const auto& syscall : profile) {
+    frequencies[syscall.first] = syscall.second.count;
+  }
+  return OrderSyscallsByFrequency(frequencies);
+}
+
+PolicyBuilder& PolicyBuilder::OrderSyscallsByLog(absl::string_view path) {
+  std::ifstream log{std::string(path)};
+  if (!log) {
+    return SetError(
+        sapi::NotFoundError(absl::StrCat("Cannot open syscall log: ", path)));
+  }
+  // The lines look like "PID: 1 [X86-64] read [0](0x3, ...) IP: ...", see
+  // Syscall::GetDescription().
+  const std::string host_arch =
+      absl::StrCat(" ", Syscall::GetArchDescription(Syscall::GetHostArch()),
+                   " ");
+  std::map<uint32_t, uint64_t> frequencies;
+  std::string line;
+  while (std::getline(log, line)) {
+    const size_t arch = line.find(host_arch);
+    if (arch == std::string::npos) {
+      continue;
+    }
+    const size_t end = line.find("](", arch);
+    const size_t begin = line.rfind('[', end);
+    uint32_t num;
+    if (end == std::string::npos || begin == std::string::npos ||
+        begin <= arch ||
+        !absl::SimpleAtoi(
+            absl::string_view(line).substr(begin + 1, end - begin - 1),
+            &num)) {
+      continue;
+    }
+    ++frequencies[num];
+  }
+  return OrderSyscallsByFrequency(frequencies);
+}
+
+PolicyBuilder& PolicyBuilder::UsePrecompiledPolicy(const sock_filter* prog,
+                                                   size_t size) {
+  // The program is followed by the final KILL action, so jumps may land one
+  // past its end.
+  for (size_t i = 0; i < size; ++i) {
+    const sock_filter& insn = prog[i];
+    if (BPF_CLASS(insn.code) != BPF_JMP) {
+      continue;
+    }
+    const size_t max_offset =
+        BPF_OP(insn.code) == BPF_JA ? insn.k : std::max(insn.jt, insn.jf);
+    if (max_offset > size - i - 1) {
+      return SetError(sapi::InvalidArgumentError(absl::StrCat(
+          "Precompiled policy jumps out of bounds at instruction ", i)));
+    }
+  }
+  use_precompiled_policy_ = true;
+  precompiled_policy_.assign(prog, prog + size);
+  return *this;
+}
+
 PolicyBuilder& PolicyBuilder::AddNetworkProxyPolicy() {
   AllowFutexOp(FUTEX_WAKE);
   AllowFutexOp(FUTEX_WAIT);
@@ -902,6 +1621,13 @@ PolicyBuilder& PolicyBuilder::AddNetworkProxyHandlerPolicy() {
   return *this;
 }
 
+PolicyBuilder& PolicyBuilder::AddNetworkProxyUserNotifyPolicy() {
+  UseSeccompUserNotify();
+  user_notify_network_proxy_ = true;
+  AddPolicyOnSyscall(__NR_connect, {TRACE(Syscall::GetHostArch())});
+  return *this;
+}
+
 void PolicyBuilder::StoreDescription(PolicyBuilderDescription* pb_description) {
   for (const auto& handled_syscall : handled_syscalls_) {
     pb_description->add_handled_syscalls(handled_syscall);
@@ -18,8 +18,10 @@
 #include <linux/filter.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <initializer_list>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -32,6 +34,7 @@
 #include "absl/strings/string_view.h"
 #include "sandboxed_api/sandbox2/mounts.h"
 #include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/util/statusor.h"
 
 struct bpf_labels;
@@ -106,6 +109,10 @@ class PolicyBuilder final {
   PolicyBuilder& AllowSyscalls(const std::vector<uint32_t>& nums);
   PolicyBuilder& AllowSyscalls(SyscallInitializer nums);
 
+  // Appends code to allow the syscalls 'names' of the host architecture, e.g.
+  // from a config file. Unknown names make Build() fail.
+  PolicyBuilder& AllowSyscallsByName(const std::vector<std::string>& names);
+
   // Appends code to block a specific syscall while setting errno to the error
   // given
   PolicyBuilder& BlockSyscallWithErrno(unsigned int num, int error);
@@ -295,6 +302,41 @@ class PolicyBuilder final {
   // - getrandom (with no flags or GRND_NONBLOCK)
   PolicyBuilder& AllowGetRandom();
 
+  // Appends code to allow yielding the CPU, e.g. by spinlocks in sandboxees
+  // started with Executor::SchedulingPolicy::kBatch or kIdle.
+  // Allows these sycalls:
+  // - sched_yield
+  PolicyBuilder& AllowSchedYield();
+
+  // Appends code to allow ForkingClient::RemapTextOnHugePages() inside the
+  // sandbox. Lets the sandboxee make memory it wrote executable, so prefer
+  // remapping before the sandbox is enabled, e.g. in
+  // ForkingClient::PrepareZygote().
+  // Allows these sycalls:
+  // - mmap (anonymous, read-write and private only)
+  // - munmap
+  // - mprotect (PROT_READ | PROT_EXEC only)
+  // - mremap (MREMAP_MAYMOVE | MREMAP_FIXED only)
+  // - madvise (MADV_HUGEPAGE and MADV_COLLAPSE only)
+  PolicyBuilder& AllowHugePageText();
+
+  // Appends code to allow Client::EnableMemoryMerging() inside the sandbox,
+  // which also needs AllowOpen() and a mounted /proc unless the prctl()
+  // succeeds.
+  // Allows these sycalls:
+  // - prctl (PR_SET_MEMORY_MERGE only)
+  // - madvise (MADV_MERGEABLE only)
+  PolicyBuilder& AllowMemoryMerging();
+
+  // Appends code to allow the sandboxee to register memory with a
+  // userfaultfd, whose faults are then served by the host, see
+  // sapi::v::LazyArray. Resolving the faults needs no syscalls in the
+  // sandboxee.
+  // Allows these sycalls:
+  // - userfaultfd
+  // - ioctl (UFFDIO_API and UFFDIO_REGISTER only)
+  PolicyBuilder& AllowUserfaultfd();
+
   // Enables syscalls required to use the logging support enabled via
   // Client::SendLogsToSupervisor()
   // Allows the following:
@@ -303,12 +345,28 @@ class PolicyBuilder final {
   // - clock_gettime
   // - gettid
   // - close
+  // - futex (FUTEX_WAIT, FUTEX_WAIT_BITSET, FUTEX_WAKE)
+  //
+  // With LogSink::Options::async, the flusher thread is started when the
+  // LogSink is created. If that happens after the sandbox is enabled, the
+  // policy must allow creating threads as well.
   //
   // If you don't use namespaces you should also add this to your policy:
   // - policy->GetFs()->EnableSyscall(__NR_open);
   // - policy->GetFs()->AddRegexpToGreyList("/usr/share/zoneinfo/.*");
   PolicyBuilder& AllowLogForwarding();
 
+  // Allows a binary built for profile-guided optimization (-fprofile-generate
+  // or -fprofile-instr-generate) to write its profile at exit. 'dir' is mapped
+  // read-write at the same path and must be the directory the profile path
+  // was configured with at build time.
+  // Allows the following:
+  // - open, read, write, lseek, ftruncate, close, stat
+  // - mkdir (for the per-object subdirectories of GCC)
+  // - fcntl (file locks)
+  // - getpid (for %p in the profile path)
+  PolicyBuilder& AllowProfileOutput(absl::string_view dir);
+
   // Enables the syscalls necessary to start a statically linked binary
   //
   // NOTE: This will call BlockSyscallWithErrno(__NR_readlink, ENOENT). If you
@@ -336,6 +394,15 @@ class PolicyBuilder final {
   // the mechanism for doing so depends on whether GetFs-checks are used or not.
   PolicyBuilder& AllowDynamicStartup();
 
+  // Allows the startup of the binary 'path', depending on how it is linked.
+  // Static and static-PIE binaries, which have no program interpreter, only
+  // get AllowStaticStartup() and mprotect(PROT_READ) for their RELRO segment:
+  // no libraries are resolved or mounted and the syscalls of the dynamic
+  // loader stay denied. Dynamic binaries get AllowDynamicStartup() and
+  // AddLibrariesForBinary(path, ld_library_path).
+  PolicyBuilder& AllowStartupOfBinary(absl::string_view path,
+                                      absl::string_view ld_library_path = {});
+
   // Appends a policy, which will be run on the specified syscall.
   // This policy must be written without labels. If you need labels, use the
   // next function.
@@ -404,6 +471,20 @@ class PolicyBuilder final {
   PolicyBuilder& AddFileAt(absl::string_view outside, absl::string_view inside,
                            bool is_ro = true);
 
+  // Lets the monitor open a file read-only for the sandboxee, from a file
+  // descriptor opened once when the policy is built (see FileBroker). The file
+  // needs no mount and its opens skip the path walk. Read-only open() and
+  // openat() calls which reach this rule are reported via seccomp user
+  // notifications. Those of other paths are handled like any other traced
+  // syscall, i.e. they are violations unless Notify::EventSyscallTrap()
+  // permits them. Opens with write, create or O_PATH flags fall through to the
+  // rules after it. The path of the sandboxee must match 'inside' literally.
+  // Implies UseSeccompUserNotify(). Needs Linux 5.9, on older kernels the
+  // opens of brokered paths are handled like those of other paths.
+  PolicyBuilder& AddBrokeredFile(absl::string_view path);
+  PolicyBuilder& AddBrokeredFileAt(absl::string_view outside,
+                                   absl::string_view inside);
+
   // Best-effort function that adds the libraries and linker required by a
   // binary.
   //
@@ -423,6 +504,17 @@ class PolicyBuilder final {
   PolicyBuilder& AddLibrariesForBinary(int fd,
                                        absl::string_view ld_library_path = {});
 
+  // Makes the later calls to AddLibrariesForBinary() and
+  // AllowStartupOfBinary() mount all libraries in the single directory
+  // kFlatLibraryDir, which the executor prepends to LD_LIBRARY_PATH of the
+  // sandboxee. This saves ld.so the failing open() and stat() calls of its
+  // search path walk, which is most noticeable for binaries with many
+  // libraries. Binaries with a DT_RPATH still search it first.
+  //
+  // Calling this function will enable use of namespaces.
+  PolicyBuilder& FlattenLibraries();
+  static constexpr char kFlatLibraryDir[] = "/.sandbox2/lib";
+
   // Adds a bind-mount for a directory from outside the namespace to
   // inside.  This will also create parent directories inside the namespace if
   // needed.
@@ -439,6 +531,21 @@ class PolicyBuilder final {
   PolicyBuilder& AddTmpfs(absl::string_view inside,
                           size_t sz = 4 << 20 /* 4MiB */);
 
+  // Mounts the read-only filesystem image 'image' as the root directory, with
+  // a single mount whatever the number of files in it, and the page cache of
+  // the image shared by all sandboxees. 'fs_type' is "erofs" or "squashfs".
+  // The other mounts, e.g. AddTmpfs() for writable directories, are made on
+  // top of it and their mount points, as well as /proc if it is mounted, have
+  // to exist in the image.
+  // Mounting images needs CAP_SYS_ADMIN in the initial user namespace, and a
+  // loop device unless it is an erofs image on Linux 6.12 or newer. Without
+  // these, mount the image once on the host and pass the directory it is
+  // mounted on as 'image', which is then bind mounted.
+  //
+  // Calling this function will enable use of namespaces.
+  PolicyBuilder& UseRootImage(absl::string_view image,
+                              absl::string_view fs_type = "erofs");
+
   // Allows unrestricted access to the network by *not* creating a network
   // namespace. Note that this only disables the network namespace. To actually
   // allow networking, you would also need to allow networking syscalls.
@@ -470,12 +577,48 @@ class PolicyBuilder final {
     return *this;
   }
 
+  // Lets sandboxees join a user and network namespace which the fork server
+  // creates only once, instead of creating new ones for every sandboxee. This
+  // makes starting sandboxees considerably cheaper, but all sandboxees using it
+  // share the loopback interface and abstract unix sockets, so they are not
+  // isolated from each other on the network. Mount, PID, IPC and UTS
+  // namespaces are still created per sandboxee.
+  //
+  // Unless the mount tree contains tmpfs mounts, it is also only built once
+  // and shared by all sandboxees with the same mounts. Their root directory is
+  // read-only then.
+  //
+  // Calling this function will enable use of namespaces.
+  // It is an error to also call AllowUnrestrictedNetworking.
+  PolicyBuilder& UseNamespaceTemplate();
+
+  // Like UseNamespaceTemplate(), but every sandboxee still gets a network
+  // namespace of its own. The fork server creates them ahead of time in the
+  // background and hands one to each new sandboxee, so that the cost of
+  // creating a network namespace is not paid while starting it. Sandboxees are
+  // thus isolated from each other on the network again.
+  //
+  // Calling this function will enable use of namespaces.
+  // It is an error to also call AllowUnrestrictedNetworking.
+  PolicyBuilder& UseNetworkNamespacePool();
+
   // Set hostname in the network namespace instead of default "sandbox2".
   //
   // Calling this function will enable use of namespaces.
   // It is an error to also call AllowUnrestrictedNetworking.
   PolicyBuilder& SetHostname(absl::string_view hostname);
 
+  // Runs the sandboxee itself as PID 1 of its PID namespace, instead of
+  // spawning an init process which then forks the sandboxee. This saves a
+  // fork and a process per sandboxee.
+  //
+  // As PID 1, the sandboxee inherits the orphaned descendants it has to reap,
+  // and signals sent from within the namespace are ignored unless it has a
+  // handler for them. This is meant for sandboxees which do not fork.
+  //
+  // Calling this function will enable use of namespaces.
+  PolicyBuilder& RunSandboxeeAsInit();
+
   // Enables/disables stack trace collection on violations.
   PolicyBuilder& CollectStacktracesOnViolation(bool enable);
 
@@ -490,6 +633,65 @@ class PolicyBuilder final {
   // monitor / the user.
   PolicyBuilder& CollectStacktracesOnKill(bool enable);
 
+  // Whenever a stack trace is collected, also stops the other threads of the
+  // sandboxee and unwinds them, see Result::GetThreadStackTraces(). The threads
+  // are unwound concurrently by the libunwind sandbox. Has no effect with
+  // lightweight tracing, which does not trace the other threads. Defaults to
+  // false.
+  PolicyBuilder& CollectStacktracesOfAllThreads(bool enable);
+
+  // Collects the stack traces enabled above and the memory maps only for this
+  // fraction of the abnormal exits, chosen at random. The others are reported
+  // without either, which saves unwinding the sandboxee when most failures are
+  // discarded anyway. Defaults to 1.
+  PolicyBuilder& SampleStacktraces(double fraction);
+
+  // Handles syscalls that the policy traces (e.g. with SANDBOX2_TRACE) via a
+  // seccomp user notification fd instead of ptrace stops, which is much
+  // cheaper. Needs Linux 5.7 and an Executor that sandboxes before execve(),
+  // ptrace is silently used otherwise.
+  // No registers or stack traces are collected for violations found this way.
+  PolicyBuilder& UseSeccompUserNotify();
+
+  // Only traces the main thread of the sandboxee, as long as the policy has no
+  // trace actions (e.g. SANDBOX2_TRACE) and namespaces are enabled; ignored
+  // otherwise. Creating threads and processes is then free of ptrace overhead.
+  // The whole PID namespace is killed once the main process has exited.
+  // Policy violations kill the whole violating process. Violations of the main
+  // process are reported with an unknown syscall (reason code -1), as the
+  // violating thread is not known. Violations of child processes are not
+  // reported at all.
+  PolicyBuilder& UseLightweightTracing();
+
+  // Checks the most frequently called syscalls first, according to
+  // 'frequencies' (syscall numbers of the host architecture to their number
+  // of calls). Rules for the same syscall, and rules for all syscalls like
+  // DangerDefaultAllowAll(), keep their relative order, so the verdicts of the
+  // policy do not change.
+  PolicyBuilder& OrderSyscallsByFrequency(
+      const std::map<uint32_t, uint64_t>& frequencies);
+
+  // Same as above, with the frequencies measured by
+  // Sandbox2::EnableSyscallProfiling().
+  PolicyBuilder& OrderSyscallsByProfile(const Result::SyscallProfile& profile);
+
+  // Same as above, with the frequencies of a log file written with
+  // --sandbox2_danger_danger_permit_all_and_log.
+  PolicyBuilder& OrderSyscallsByLog(absl::string_view path);
+
+  // Uses 'prog' as the user policy instead of compiling the rules added with
+  // AllowSyscall() and the like, which saves the label resolution and rule
+  // compilation of fixed policies. 'prog' is usually generated at build time
+  // by bpf::ToCArray() from Policy::GetUserPolicy(). It has the same
+  // pre-/postcondition as the rules (syscall number loaded). The default and
+  // final sections of the policy are still added at run time. Building fails
+  // if rules were added as well.
+  PolicyBuilder& UsePrecompiledPolicy(const sock_filter* prog, size_t size);
+  template <size_t N>
+  PolicyBuilder& UsePrecompiledPolicy(const sock_filter (&prog)[N]) {
+    return UsePrecompiledPolicy(prog, N);
+  }
+
   // Appends an unconditional ALLOW action for all syscalls.
   // Do not use in environment with untrusted code and/or data, ask
   // sandbox-team@ first if unsure.
@@ -502,6 +704,15 @@ class PolicyBuilder final {
   // the NetworkProxyHandler
   PolicyBuilder& AddNetworkProxyHandlerPolicy();
 
+  // Makes the monitor connect sockets for the sandboxee instead of the
+  // NetworkProxyHandler: connect() on a stream socket is reported via a
+  // seccomp user notification, the host connects, and the connected socket
+  // replaces the one of the sandboxee. Needs neither a signal handler nor
+  // Client::InstallNetworkProxyHandler(), and works with signals blocked.
+  // Implies UseSeccompUserNotify(). Needs Linux 5.9, connect() fails with
+  // ENOSYS on older kernels.
+  PolicyBuilder& AddNetworkProxyUserNotifyPolicy();
+
  private:
   friend class PolicyBuilderPeer;  // For testing
   friend class StackTracePeer;
@@ -522,20 +733,61 @@ class PolicyBuilder final {
 
   void StoreDescription(PolicyBuilderDescription* pb_description);
 
+  // A rule of the user policy. The rules are matched in order, until one of
+  // them returns.
+  struct Rule {
+    // Syscalls the rule applies to, empty if it applies to all of them.
+    std::vector<uint32_t> nums;
+    // Instructions run for these syscalls with the syscall number loaded, a
+    // single return for AllowSyscall() and the like. Falls through to the next
+    // rule unless it returns, with the syscall number loaded again.
+    std::vector<sock_filter> code;
+    // The rule as it appears in the linear user policy.
+    std::vector<sock_filter> linear;
+  };
+
+  // Appends 'rule' to rules_ and its linear form 'linear' to the user policy.
+  void AddRule(Rule rule, const std::vector<sock_filter>& linear);
+
+  // Moves the rules of frequent syscalls to the front, as far as rules for
+  // the same syscalls allow, and rebuilds the linear user policy from them.
+  void OrderRulesByFrequency();
+
+  // Compiles rules_ into a binary search over the syscall numbers which leads
+  // to the rules of each syscall. Has the same semantics as the linear user
+  // policy, but its cost grows logarithmically with the number of syscalls.
+  std::vector<sock_filter> CompileRules() const;
+
   Mounts mounts_;
   bool use_namespaces_ = true;
   bool requires_namespaces_ = false;
   bool allow_unrestricted_networking_ = false;
+  bool use_namespace_template_ = false;
+  bool use_network_namespace_pool_ = false;
+  bool sandboxee_as_init_ = false;
   std::string hostname_ = kDefaultHostname;
 
   bool collect_stacktrace_on_violation_ = true;
   bool collect_stacktrace_on_signal_ = true;
   bool collect_stacktrace_on_timeout_ = true;
   bool collect_stacktrace_on_kill_ = false;
+  bool collect_stacktrace_of_all_threads_ = false;
+  double stacktrace_sample_fraction_ = 1.0;
+  bool user_notify_ = false;
+  bool user_notify_network_proxy_ = false;
+  bool lightweight_tracing_ = false;
+  // Paths of the sandboxee to paths of the host, see AddBrokeredFileAt().
+  std::map<std::string, std::string> brokered_files_;
 
   // Seccomp fields
   std::unique_ptr<Policy> output_;
   std::set<unsigned int> handled_syscalls_;
+  std::vector<Rule> rules_;
+  // Number of calls per syscall, see OrderSyscallsByFrequency().
+  std::map<uint32_t, uint64_t> syscall_frequencies_;
+  // See UsePrecompiledPolicy().
+  bool use_precompiled_policy_ = false;
+  std::vector<sock_filter> precompiled_policy_;
 
   // Error handling
   sapi::Status last_status_;
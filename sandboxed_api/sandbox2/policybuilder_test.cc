@@ -14,11 +14,20 @@
 
 #include "sandboxed_api/sandbox2/policybuilder.h"
 
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <syscall.h>
 #include <unistd.h>
 
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <set>
 #include <string>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include "gmock/gmock.h"
@@ -27,22 +36,27 @@
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
+#include "sandboxed_api/sandbox2/bpfdisassembler.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/ipc.h"
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/sandbox2.h"
+#include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
 #include "sandboxed_api/util/status_matchers.h"
 #include "sandboxed_api/util/status.h"
 
 using ::testing::AllOf;
 using ::testing::AnyOf;
+using ::testing::Contains;
 using ::testing::Eq;
 using ::testing::Gt;
 using ::testing::HasSubstr;
 using ::testing::Lt;
+using ::testing::Not;
 using ::testing::NotNull;
 using ::testing::StartsWith;
 using ::testing::StrEq;
@@ -70,7 +84,9 @@ namespace {
 
 class PolicyBuilderTest : public testing::Test {
  protected:
-  static std::string Run(std::vector<std::string> args, bool network = false);
+  static std::string Run(std::vector<std::string> args, bool network = false,
+                         bool namespace_template = false,
+                         bool network_namespace_pool = false);
 };
 
 TEST_F(PolicyBuilderTest, Testpolicy_size) {
@@ -157,7 +173,8 @@ TEST_F(PolicyBuilderTest, TestValidateAbsolutePath) {
 }
 
 std::string PolicyBuilderTest::Run(std::vector<std::string> args,
-                                   bool network) {
+                                   bool network, bool namespace_template,
+                                   bool network_namespace_pool) {
   PolicyBuilder builder;
   // Don't restrict the syscalls at all.
   builder.DangerDefaultAllowAll();
@@ -165,6 +182,12 @@ std::string PolicyBuilderTest::Run(std::vector<std::string> args,
   if (network) {
     builder.AllowUnrestrictedNetworking();
   }
+  if (namespace_template) {
+    builder.UseNamespaceTemplate();
+  }
+  if (network_namespace_pool) {
+    builder.UseNetworkNamespacePool();
+  }
 
   auto executor = absl::make_unique<sandbox2::Executor>(args[0], args);
 #if defined(ADDRESS_SANITIZER) || defined(MEMORY_SANITIZER) || \
@@ -192,6 +215,175 @@ std::string PolicyBuilderTest::Run(std::vector<std::string> args,
   return output;
 }
 
+// Returns the action of 'policy' for the syscall 'nr' and the number of
+// instructions run until then. Only supports what the search over the syscall
+// numbers consists of.
+std::pair<uint32_t, int> RunSyscallSearch(const std::string& policy,
+                                          uint32_t nr) {
+  const auto* insns = reinterpret_cast<const sock_filter*>(policy.data());
+  const size_t size = policy.size() / sizeof(sock_filter);
+  int steps = 0;
+  for (size_t pc = 0; pc < size; ++steps) {
+    const sock_filter& insn = insns[pc];
+    switch (insn.code) {
+      case BPF_RET | BPF_K:
+        return {insn.k, steps + 1};
+      case BPF_JMP | BPF_JA:
+        pc += 1 + insn.k;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+        pc += 1 + (nr == insn.k ? insn.jt : insn.jf);
+        break;
+      case BPF_JMP | BPF_JGE | BPF_K:
+        pc += 1 + (nr >= insn.k ? insn.jt : insn.jf);
+        break;
+      case BPF_JMP | BPF_JGT | BPF_K:
+        pc += 1 + (nr > insn.k ? insn.jt : insn.jf);
+        break;
+      default:
+        ADD_FAILURE() << "Unexpected instruction " << insn.code;
+        return {0, steps};
+    }
+  }
+  // Falls through to the default KILL action.
+  return {SECCOMP_RET_KILL, steps};
+}
+
+TEST_F(PolicyBuilderTest, TestPolicyIsCompiledIntoBinarySearch) {
+  PolicyBuilder builder;
+  for (uint32_t nr = 0; nr < 256; nr += 2) {
+    builder.AllowSyscall(nr);
+  }
+  builder.BlockSyscallWithErrno(1, EPERM);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+  PolicyDescription description;
+  policy->GetPolicyDescription(&description);
+
+  for (uint32_t nr = 0; nr < 300; ++nr) {
+    uint32_t action;
+    int steps;
+    std::tie(action, steps) =
+        RunSyscallSearch(description.user_bpf_policy(), nr);
+    if (nr == 1) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ERRNO | EPERM));
+    } else if (nr < 256 && nr % 2 == 0) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ALLOW)) << nr;
+    } else {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_KILL)) << nr;
+    }
+    // A linear policy takes up to two instructions per syscall.
+    EXPECT_THAT(steps, Lt(24)) << nr;
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestConsecutiveSyscallsAreCheckedAsRanges) {
+  PolicyBuilder builder;
+  for (uint32_t nr = 0; nr < 200; ++nr) {
+    if (nr != 100) {
+      builder.AllowSyscall(nr);
+    }
+  }
+  builder.BlockSyscallWithErrno(100, EPERM);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+  PolicyDescription description;
+  policy->GetPolicyDescription(&description);
+
+  for (uint32_t nr = 0; nr < 300; ++nr) {
+    uint32_t action;
+    int steps;
+    std::tie(action, steps) =
+        RunSyscallSearch(description.user_bpf_policy(), nr);
+    if (nr == 100) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ERRNO | EPERM));
+    } else if (nr < 200) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ALLOW)) << nr;
+    } else {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_KILL)) << nr;
+    }
+    // Three ranges are checked without any search.
+    EXPECT_THAT(steps, Lt(10)) << nr;
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestFrequentSyscallsAreCheckedFirst) {
+  const std::string log_path = GetTestTempPath("syscalls.log");
+  {
+    std::ofstream log(log_path);
+    const std::string arch =
+        Syscall::GetArchDescription(Syscall::GetHostArch());
+    for (int i = 0; i < 100; ++i) {
+      log << "PID: 1 " << arch << " foo [200](0x1, 0x2) IP: 0x1, STACK: 0x2\n";
+    }
+    log << "PID: 1 " << arch << " bar [100](0x1) IP: 0x1, STACK: 0x2\n";
+  }
+  PolicyBuilder builder;
+  for (uint32_t nr = 0; nr < 256; nr += 2) {
+    builder.AllowSyscall(nr);
+  }
+  builder.BlockSyscallWithErrno(1, EPERM).OrderSyscallsByLog(log_path);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+  PolicyDescription description;
+  policy->GetPolicyDescription(&description);
+
+  for (uint32_t nr = 0; nr < 300; ++nr) {
+    uint32_t action;
+    int steps;
+    std::tie(action, steps) =
+        RunSyscallSearch(description.user_bpf_policy(), nr);
+    if (nr == 1) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ERRNO | EPERM));
+    } else if (nr < 256 && nr % 2 == 0) {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_ALLOW)) << nr;
+    } else {
+      EXPECT_THAT(action, Eq(SECCOMP_RET_KILL)) << nr;
+    }
+    if (nr == 200) {
+      EXPECT_THAT(steps, Eq(2));
+    }
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestMissingSyscallLogIsAnError) {
+  PolicyBuilder builder;
+  builder.OrderSyscallsByLog("/nonexistent/syscalls.log");
+  EXPECT_THAT(builder.TryBuild().status(),
+              StatusIs(sapi::StatusCode::kNotFound));
+}
+
+TEST_F(PolicyBuilderTest, TestArgumentIndependentAllowsAreCacheable) {
+  PolicyBuilder builder;
+  builder.AllowSyscall(__NR_read)
+      .AddPolicyOnSyscall(__NR_write, {ARG_32(0), JEQ32(1, ALLOW)})
+      // Only allows, so the arguments do not matter.
+      .AddPolicyOnSyscall(__NR_close, {ARG_32(0), JEQ32(2, ALLOW)})
+      .AllowSyscall(__NR_close)
+      // Checked by the default policy.
+      .AllowSyscall(__NR_clone);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+  PolicyDescription description;
+  policy->GetPolicyDescription(&description);
+  EXPECT_THAT(description.cacheable_syscalls(), Contains(__NR_read));
+  EXPECT_THAT(description.cacheable_syscalls(), Contains(__NR_close));
+  EXPECT_THAT(description.cacheable_syscalls(), Not(Contains(__NR_write)));
+  EXPECT_THAT(description.cacheable_syscalls(), Not(Contains(__NR_clone)));
+  EXPECT_THAT(description.cacheable_syscalls(), Not(Contains(__NR_open)));
+}
+
+TEST_F(PolicyBuilderTest, TestAllowSyscallsByName) {
+  PolicyBuilder builder;
+  builder.AllowSyscallsByName({"read", "close"});
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, builder.TryBuild());
+  PolicyDescription description;
+  policy->GetPolicyDescription(&description);
+  EXPECT_THAT(description.cacheable_syscalls(), Contains(__NR_read));
+  EXPECT_THAT(description.cacheable_syscalls(), Contains(__NR_close));
+
+  PolicyBuilder unknown;
+  unknown.AllowSyscallsByName({"read", "no_such_syscall"});
+  EXPECT_THAT(unknown.TryBuild().status(),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
 TEST_F(PolicyBuilderTest, TestCanOnlyBuildOnce) {
   PolicyBuilder b;
   ASSERT_THAT(b.BuildOrDie(), NotNull());
@@ -239,6 +431,124 @@ TEST_F(PolicyBuilderTest, TestGid) {
   EXPECT_THAT(Run({"/usr/bin/id", "-g"}), StrEq("1000\n"));
 }
 
+TEST_F(PolicyBuilderTest, TestNamespaceTemplate) {
+  // The first sandboxee creates the template, the second one reuses it.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_THAT(Run({"/usr/bin/id", "-u"}, false, true), StrEq("1000\n"));
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestNetworkNamespacePool) {
+  // More sandboxees than the pool holds, some of them may have to create their
+  // network namespace themselves.
+  for (int i = 0; i < 12; ++i) {
+    auto lines = absl::StrSplit(
+        Run({"/sbin/ip", "addr", "show", "up"}, false, false, true), '\n');
+    int count = 0;
+    for (auto const& line : lines) {
+      if (!line.empty() && !absl::StartsWith(line, " ")) {
+        count += 1;
+      }
+    }
+    // Only loopback network interface 'lo'.
+    EXPECT_THAT(count, Eq(1));
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestNetworkNamespacePoolGivesEachItsOwn) {
+  // More sandboxees than the pool holds, all running at the same time. Each
+  // one prints its network namespace and waits for its stdin to be closed.
+  constexpr int kNumSandboxees = 12;
+  struct Sandboxee {
+    std::unique_ptr<Sandbox2> s2;
+    int in;
+    int out;
+  };
+  std::vector<Sandboxee> sandboxees(kNumSandboxees);
+  std::set<std::string> namespaces;
+  const std::string host_namespace =
+      file_util::fileops::ReadLink("/proc/self/ns/net");
+  for (Sandboxee& sandboxee : sandboxees) {
+    PolicyBuilder builder;
+    builder.DangerDefaultAllowAll()
+        .AddLibrariesForBinary("/bin/sh")
+        .AddLibrariesForBinary("/bin/readlink")
+        .AddLibrariesForBinary("/bin/cat")
+        .AddDirectory("/proc")
+        .UseNetworkNamespacePool();
+    std::vector<std::string> args = {
+        "/bin/sh", "-c", "/bin/readlink /proc/self/ns/net && exec /bin/cat"};
+    auto executor = absl::make_unique<Executor>(args[0], args);
+    sandboxee.in = executor->ipc()->ReceiveFd(STDIN_FILENO);
+    sandboxee.out = executor->ipc()->ReceiveFd(STDOUT_FILENO);
+    sandboxee.s2 =
+        absl::make_unique<Sandbox2>(std::move(executor), builder.BuildOrDie());
+    ASSERT_TRUE(sandboxee.s2->RunAsync());
+
+    std::string line;
+    char c;
+    while (read(sandboxee.out, &c, 1) == 1 && c != '\n') {
+      line += c;
+    }
+    ASSERT_THAT(line, StartsWith("net:["));
+    EXPECT_THAT(line, Not(StrEq(host_namespace)));
+    // The namespace as seen from outside, while the sandboxee still runs.
+    pid_t pid = sandboxee.s2->GetPid();
+    ASSERT_THAT(pid, Gt(0));
+    EXPECT_THAT(
+        file_util::fileops::ReadLink(absl::StrCat("/proc/", pid, "/ns/net")),
+        StrEq(line));
+    namespaces.insert(line);
+  }
+  EXPECT_THAT(namespaces.size(), Eq(kNumSandboxees));
+
+  for (Sandboxee& sandboxee : sandboxees) {
+    close(sandboxee.in);
+    EXPECT_THAT(sandboxee.s2->AwaitResult().final_status(), Eq(Result::OK));
+    close(sandboxee.out);
+  }
+}
+
+TEST_F(PolicyBuilderTest, TestNamespaceTemplateRequiresNetworkNamespace) {
+  PolicyBuilder builder;
+  builder.AllowUnrestrictedNetworking().UseNamespaceTemplate();
+  EXPECT_FALSE(builder.TryBuild().ok());
+}
+
+TEST_F(PolicyBuilderTest, TestPrecompiledPolicy) {
+  PolicyBuilder builder;
+  builder.AllowSyscalls({__NR_read, __NR_write})
+      .BlockSyscallWithErrno(__NR_open, ENOENT);
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Policy> policy,
+                            builder.TryBuild());
+  const std::vector<sock_filter>& user_policy = policy->GetUserPolicy();
+  EXPECT_THAT(bpf::ToCArray(user_policy, "kPolicy"),
+              StartsWith("constexpr sock_filter kPolicy[] = {\n"));
+
+  PolicyBuilder precompiled_builder;
+  precompiled_builder.UsePrecompiledPolicy(user_policy.data(),
+                                           user_policy.size());
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<Policy> precompiled,
+                            precompiled_builder.TryBuild());
+  EXPECT_THAT(bpf::Disasm(precompiled->GetProgram()),
+              StrEq(bpf::Disasm(policy->GetProgram())));
+}
+
+TEST_F(PolicyBuilderTest, TestPrecompiledPolicyErrors) {
+  const sock_filter kJumpsOut[] = {BPF_STMT(BPF_JMP | BPF_JA, 2), ALLOW};
+  EXPECT_THAT(
+      PolicyBuilder().UsePrecompiledPolicy(kJumpsOut).TryBuild().status(),
+      StatusIs(sapi::StatusCode::kInvalidArgument));
+
+  const sock_filter kAllow[] = {ALLOW};
+  EXPECT_THAT(PolicyBuilder()
+                  .UsePrecompiledPolicy(kAllow)
+                  .AllowSyscall(__NR_read)
+                  .TryBuild()
+                  .status(),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
 TEST_F(PolicyBuilderTest, TestOpenFds) {
   SKIP_SANITIZERS_AND_COVERAGE;
 
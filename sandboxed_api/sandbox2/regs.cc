@@ -21,15 +21,47 @@
 #include <sys/ptrace.h>
 #include <sys/uio.h>  // IWYU pragma: keep // used for iovec
 
+#include <atomic>
 #include <cerrno>
+#include <cstddef>
+#include <cstring>
 
 #include "absl/strings/str_cat.h"
 #include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#define PTRACE_SYSCALL_INFO_SECCOMP 3
+#endif
 
 namespace sandbox2 {
 
+namespace {
+
+// struct ptrace_syscall_info from <linux/ptrace.h>, which clashes with
+// <sys/ptrace.h>. Only the seccomp stop part of the union is needed.
+struct PtraceSyscallInfo {
+  uint8_t op;
+  uint8_t pad[3];
+  uint32_t arch;
+  uint64_t instruction_pointer;
+  uint64_t stack_pointer;
+  struct {
+    uint64_t nr;
+    uint64_t args[6];
+    uint32_t ret_data;
+  } seccomp;
+};
+
+// Set once the kernel rejected PTRACE_GET_SYSCALL_INFO, to not try again.
+std::atomic<bool> syscall_info_unsupported{false};
+
+}  // namespace
+
 sapi::Status Regs::Fetch() {
+  has_all_registers_ = false;
 #if defined(__powerpc64__)
   iovec pt_iov = {&user_regs_, sizeof(user_regs_)};
 
@@ -49,6 +81,37 @@ sapi::Status Regs::Fetch() {
                                             ") failed: ", StrError(errno)));
   }
 #endif
+  has_all_registers_ = true;
+  return sapi::OkStatus();
+}
+
+sapi::Status Regs::FetchSyscall() {
+  if (syscall_info_unsupported.load(std::memory_order_relaxed)) {
+    return Fetch();
+  }
+  PtraceSyscallInfo info;
+  long size =  // NOLINT
+      ptrace(PTRACE_GET_SYSCALL_INFO, pid_, sizeof(info), &info);
+  if (size == -1L) {
+    if (errno != EIO) {
+      return sapi::InternalError(
+          absl::StrCat("ptrace(PTRACE_GET_SYSCALL_INFO, pid=", pid_,
+                       ") failed: ", StrError(errno)));
+    }
+    syscall_info_unsupported.store(true, std::memory_order_relaxed);
+    return Fetch();
+  }
+  if (info.op != PTRACE_SYSCALL_INFO_SECCOMP ||
+      size < static_cast<long>(offsetof(PtraceSyscallInfo, seccomp.ret_data))) {
+    // Not a seccomp stop after all, the registers are all there is.
+    return Fetch();
+  }
+  has_all_registers_ = false;
+  syscall_info_.nr = info.seccomp.nr;
+  std::memcpy(syscall_info_.args.data(), info.seccomp.args,
+              sizeof(info.seccomp.args));
+  syscall_info_.stack_pointer = info.stack_pointer;
+  syscall_info_.instruction_pointer = info.instruction_pointer;
   return sapi::OkStatus();
 }
 
@@ -70,6 +133,9 @@ sapi::Status Regs::Store() {
 }
 
 sapi::Status Regs::SkipSyscallReturnValue(uint64_t value) {
+  if (!has_all_registers_) {
+    SAPI_RETURN_IF_ERROR(Fetch());
+  }
 #if defined(__x86_64__)
   user_regs_.orig_rax = -1;
   user_regs_.rax = value;
@@ -81,6 +147,30 @@ sapi::Status Regs::SkipSyscallReturnValue(uint64_t value) {
 }
 
 Syscall Regs::ToSyscall(Syscall::CpuArch syscall_arch) const {
+  if (!has_all_registers_) {
+    const SyscallInfo& info = syscall_info_;
+#if defined(__x86_64__)
+    if (ABSL_PREDICT_TRUE(syscall_arch == Syscall::kX86_64)) {
+      return Syscall(syscall_arch, info.nr, info.args, pid_, info.stack_pointer,
+                     info.instruction_pointer);
+    }
+    if (syscall_arch == Syscall::kX86_32) {
+      Syscall::Args args = info.args;
+      for (auto& arg : args) {
+        arg &= 0xFFFFFFFF;
+      }
+      return Syscall(syscall_arch, info.nr & 0xFFFFFFFF, args, pid_,
+                     info.stack_pointer & 0xFFFFFFFF,
+                     info.instruction_pointer & 0xFFFFFFFF);
+    }
+#elif defined(__powerpc64__)
+    if (ABSL_PREDICT_TRUE(syscall_arch == Syscall::kPPC_64)) {
+      return Syscall(syscall_arch, info.nr, info.args, pid_, info.stack_pointer,
+                     info.instruction_pointer);
+    }
+#endif
+    return Syscall(pid_);
+  }
 #if defined(__x86_64__)
   if (ABSL_PREDICT_TRUE(syscall_arch == Syscall::kX86_64)) {
     auto syscall = user_regs_.orig_rax;
@@ -42,10 +42,21 @@ class Regs {
   // Copies register values from the process
   sapi::Status Fetch();
 
+  // Copies only the values needed by ToSyscall() from the process, which must
+  // be in a seccomp stop. Uses PTRACE_GET_SYSCALL_INFO (Linux 5.3+), which is
+  // cheaper than fetching all registers, and falls back to Fetch() on older
+  // kernels.
+  sapi::Status FetchSyscall();
+
+  // Whether all register values are available, i.e. Fetch() succeeded. Other
+  // than ToSyscall() and SkipSyscallReturnValue(), the accessors need them.
+  bool HasAllRegisters() const { return has_all_registers_; }
+
   // Copies register values to the process
   sapi::Status Store();
 
-  // Causes the process to skip current syscall and return given value instead
+  // Causes the process to skip current syscall and return given value instead.
+  // Fetches all registers first if necessary.
   sapi::Status SkipSyscallReturnValue(uint64_t value);
 
   // Converts raw register values obtained on syscall entry to syscall info
@@ -116,6 +127,17 @@ class Regs {
 
   // Registers fetched with ptrace(PR_GETREGS/GETREGSET, pid).
   PtraceRegisters user_regs_ = {};
+  bool has_all_registers_ = false;
+
+  // Syscall fetched with ptrace(PTRACE_GET_SYSCALL_INFO, pid), used by
+  // ToSyscall() unless has_all_registers_.
+  struct SyscallInfo {
+    uint64_t nr;
+    Syscall::Args args;
+    uint64_t stack_pointer;
+    uint64_t instruction_pointer;
+  };
+  SyscallInfo syscall_info_ = {};
 };
 
 }  // namespace sandbox2
@@ -16,17 +16,24 @@
 
 #include "sandboxed_api/sandbox2/result.h"
 
+#include <algorithm>
+#include <vector>
+
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
 #include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/util/canonical_errors.h"
 
 namespace sandbox2 {
 
+constexpr size_t Result::kMaxFirstArgBuckets;
+
 Result& Result::operator=(const Result& other) {
   final_status_ = other.final_status_;
   reason_code_ = other.reason_code_;
   stack_trace_ = other.stack_trace_;
+  thread_stack_traces_ = other.thread_stack_traces_;
   if (other.regs_) {
     regs_ = absl::make_unique<Regs>(*other.regs_);
   } else {
@@ -40,6 +47,14 @@ Result& Result::operator=(const Result& other) {
   prog_name_ = other.prog_name_;
   proc_maps_ = other.proc_maps_;
   rusage_monitor_ = other.rusage_monitor_;
+  startup_times_ = other.startup_times_;
+  syscall_profile_ = other.syscall_profile_;
+  stack_samples_ = other.stack_samples_;
+  if (other.cgroup_stats_) {
+    cgroup_stats_ = absl::make_unique<CgroupStats>(*other.cgroup_stats_);
+  } else {
+    cgroup_stats_.reset(nullptr);
+  }
   return *this;
 }
 
@@ -116,6 +131,82 @@ std::string Result::ToString() const {
                     "incompatible with sandboxing.");
   }
 #endif
+  const std::string startup = StartupTimesToString();
+  if (!startup.empty()) {
+    absl::StrAppend(&result, " - Startup: ", startup);
+  }
+  return result;
+}
+
+std::string Result::StartupTimesToString() const {
+  const StartupTimes& times = startup_times_;
+  if (times.fork_request == absl::InfinitePast()) {
+    return "";
+  }
+  const std::pair<const char*, absl::Time> phases[] = {
+      {"clone", times.clone},
+      {"sanitization", times.sanitization},
+      {"namespaces", times.namespaces},
+      {"mounts", times.mounts},
+      {"sandbox_ready", times.sandbox_ready},
+      {"policy_install", times.policy_install},
+      {"execve", times.execve},
+      {"first_syscall", times.first_syscall},
+  };
+  std::string result;
+  for (const auto& phase : phases) {
+    if (phase.second == absl::InfinitePast()) {
+      continue;
+    }
+    absl::StrAppend(&result, result.empty() ? "" : " ", phase.first, "=",
+                    absl::FormatDuration(phase.second - times.fork_request));
+  }
+  return result;
+}
+
+std::string Result::SyscallProfileToString() const {
+  if (syscall_profile_.empty()) {
+    return "";
+  }
+  std::vector<SyscallProfile::const_iterator> entries;
+  absl::Duration total_time;
+  uint64_t total_count = 0;
+  for (auto it = syscall_profile_.begin(); it != syscall_profile_.end(); ++it) {
+    entries.push_back(it);
+    total_time += it->second.total_time;
+    total_count += it->second.count;
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](SyscallProfile::const_iterator a,
+                      SyscallProfile::const_iterator b) {
+                     return a->second.total_time > b->second.total_time;
+                   });
+  std::string result = absl::StrFormat("%6s %12s %12s %12s %10s %s\n",
+                                       "% time", "total usecs", "usecs/call",
+                                       "max usecs", "calls", "syscall");
+  for (const auto& entry : entries) {
+    const SyscallStats& stats = entry->second;
+    const double total_usecs = absl::ToDoubleMicroseconds(stats.total_time);
+    absl::StrAppendFormat(
+        &result, "%6.2f %12.0f %12.1f %12.0f %10d %s\n",
+        total_time == absl::ZeroDuration()
+            ? 0.0
+            : 100.0 * absl::FDivDuration(stats.total_time, total_time),
+        total_usecs, stats.count ? total_usecs / stats.count : 0.0,
+        absl::ToDoubleMicroseconds(stats.max_time), stats.count,
+        Syscall(Syscall::GetHostArch(), entry->first).GetName());
+  }
+  absl::StrAppendFormat(&result, "%6s %12.0f %12s %12s %10d %s\n", "100.00",
+                        absl::ToDoubleMicroseconds(total_time), "", "",
+                        total_count, "total");
+  return result;
+}
+
+std::string Result::StackSamplesToString() const {
+  std::string result;
+  for (const auto& sample : stack_samples_) {
+    absl::StrAppend(&result, sample.first, " ", sample.second, "\n");
+  }
   return result;
 }
 
@@ -169,6 +260,8 @@ std::string Result::ReasonCodeEnumToString(ReasonCodeEnum value) {
       return "FAILED_CWD";
     case sandbox2::Result::FAILED_POLICY:
       return "FAILED_POLICY";
+    case sandbox2::Result::FAILED_ADMISSION:
+      return "FAILED_ADMISSION";
     case sandbox2::Result::FAILED_STORE:
       return "FAILED_STORE";
     case sandbox2::Result::FAILED_FETCH:
@@ -21,12 +21,15 @@
 #include <sys/resource.h>
 #include <sys/types.h>
 
+#include <cstddef>
 #include <cstdint>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 
 #include "absl/memory/memory.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/regs.h"
 #include "sandboxed_api/sandbox2/syscall.h"
 #include "sandboxed_api/util/status.h"
@@ -71,6 +74,7 @@ class Result {
     FAILED_LIMITS,
     FAILED_CWD,
     FAILED_POLICY,
+    FAILED_ADMISSION,
 
     // Codes used by status=`INTERNAL_ERROR`:
     FAILED_STORE,
@@ -87,6 +91,76 @@ class Result {
     VIOLATION_ARCH,
   };
 
+  // Points in time during the start-up of the sandboxee, in the order in which
+  // they are reached. Phases which were not reached or not recorded are
+  // absl::InfinitePast().
+  struct StartupTimes {
+    // The monitor sent the fork request to the fork server.
+    absl::Time fork_request = absl::InfinitePast();
+    // The fork server cloned the sandboxee.
+    absl::Time clone = absl::InfinitePast();
+    // File descriptors and environment of the sandboxee were sanitized.
+    absl::Time sanitization = absl::InfinitePast();
+    // Namespaces were set up, not counting the mount tree.
+    absl::Time namespaces = absl::InfinitePast();
+    // The mount tree was created.
+    absl::Time mounts = absl::InfinitePast();
+    // The sandboxee reported that it is ready to be sandboxed, see
+    // Monitor::WaitForSandboxReady().
+    absl::Time sandbox_ready = absl::InfinitePast();
+    // Limits were applied and the monitor attached, the sandboxee installs its
+    // policy next.
+    absl::Time policy_install = absl::InfinitePast();
+    // The sandboxee called execve(), only when sandboxing before execve().
+    absl::Time execve = absl::InfinitePast();
+    // First syscall of the sandboxee after execve().
+    absl::Time first_syscall = absl::InfinitePast();
+  };
+
+  // Measurements of one syscall, see Sandbox2::EnableSyscallProfiling().
+  struct SyscallStats {
+    // Number of calls.
+    uint64_t count = 0;
+    // Time from the entry to the exit of the calls, including the ptrace
+    // overhead of the measurement itself.
+    absl::Duration total_time;
+    absl::Duration max_time;
+    // Number of calls per value of the first argument, which often is a file
+    // descriptor. Calls with more than kMaxFirstArgBuckets distinct values are
+    // counted in other_first_args.
+    std::map<uint64_t, uint64_t> first_args;
+    uint64_t other_first_args = 0;
+  };
+  static constexpr size_t kMaxFirstArgBuckets = 16;
+
+  // Resource usage of the cgroup of the sandboxee, see
+  // Limits::set_cgroup_parent(). Values the kernel does not provide are zero.
+  struct CgroupStats {
+    // CPU time of all processes of the sandboxee (cpu.stat).
+    absl::Duration cpu_time;
+    absl::Duration user_time;
+    absl::Duration system_time;
+    // Peak memory usage in bytes (memory.peak, Linux 5.19+).
+    uint64_t memory_peak = 0;
+    // Anonymous and page cache memory in bytes at the end (memory.stat).
+    uint64_t memory_anon = 0;
+    uint64_t memory_file = 0;
+    // Time in which some or all of the processes were stalled waiting for the
+    // resource (pressure stall information, *.pressure).
+    absl::Duration cpu_some_stall;
+    absl::Duration memory_some_stall;
+    absl::Duration memory_full_stall;
+    absl::Duration io_some_stall;
+    absl::Duration io_full_stall;
+  };
+  // Syscall number to its measurements.
+  using SyscallProfile = std::map<uint64_t, SyscallStats>;
+  // Folded stack (the frames from the outermost one, separated by ';') to the
+  // number of times it was sampled.
+  using StackSamples = std::map<std::string, uint64_t>;
+  // Thread id to the stack trace of the thread.
+  using ThreadStackTraces = std::map<pid_t, std::string>;
+
   Result() = default;
   Result(const Result& other) { *this = other; }
   Result& operator=(const Result& other);
@@ -131,8 +205,23 @@ class Result {
 
   const std::string& GetStackTrace() const { return stack_trace_; }
 
+  // Stack traces of the other threads of the process, captured together with
+  // GetStackTrace(), see PolicyBuilder::CollectStacktracesOfAllThreads().
+  const ThreadStackTraces& GetThreadStackTraces() const {
+    return thread_stack_traces_;
+  }
+  void SetThreadStackTraces(ThreadStackTraces stack_traces) {
+    thread_stack_traces_ = std::move(stack_traces);
+  }
+
   const Regs* GetRegs() const { return regs_.get(); }
 
+  // Returns nullptr if the sandboxee did not run in a cgroup of its own.
+  const CgroupStats* GetCgroupStats() const { return cgroup_stats_.get(); }
+  void SetCgroupStats(std::unique_ptr<CgroupStats> stats) {
+    cgroup_stats_ = std::move(stats);
+  }
+
   const Syscall* GetSyscall() const { return syscall_.get(); }
 
   const std::string& GetProgName() const { return prog_name_; }
@@ -158,6 +247,27 @@ class Result {
 
   rusage* GetRUsageMonitor() { return &rusage_monitor_; }
 
+  const StartupTimes& GetStartupTimes() const { return startup_times_; }
+  StartupTimes* MutableStartupTimes() { return &startup_times_; }
+
+  // Returns the recorded start-up phases as offsets from the fork request,
+  // empty if the fork request was not sent.
+  std::string StartupTimesToString() const;
+
+  const SyscallProfile& GetSyscallProfile() const { return syscall_profile_; }
+  SyscallProfile* MutableSyscallProfile() { return &syscall_profile_; }
+
+  // Returns the syscall profile as a table sorted by the total time, similar
+  // to 'strace -c'. Empty if there is no profile.
+  std::string SyscallProfileToString() const;
+
+  const StackSamples& GetStackSamples() const { return stack_samples_; }
+  StackSamples* MutableStackSamples() { return &stack_samples_; }
+
+  // Returns the stack samples in the folded format understood by
+  // flamegraph.pl and most profile viewers: one "stack count" line per stack.
+  std::string StackSamplesToString() const;
+
  private:
   // Final execution status - see 'StatusEnum' for details.
   StatusEnum final_status_ = UNSET;
@@ -170,6 +280,8 @@ class Result {
   // Might contain stack-trace of the process, especially if it failed with
   // syscall violation, or was terminated by a signal.
   std::string stack_trace_;
+  // Stack traces of the other threads, if requested by the policy.
+  ThreadStackTraces thread_stack_traces_;
   // Might contain the register values of the process, similar to the stack.
   // trace
   std::unique_ptr<Regs> regs_;
@@ -180,8 +292,17 @@ class Result {
   // /proc/pid/maps of the main process.
   std::string proc_maps_;
   // Final resource usage as defined in <sys/resource.h> (man getrusage), for
-  // the Monitor thread.
+  // the Monitor thread. Not set if the sandboxee was supervised by a
+  // MonitorPool.
   rusage rusage_monitor_;
+  // Start-up phases of the sandboxee.
+  StartupTimes startup_times_;
+  // Allowed syscalls of the sandboxee, if profiled.
+  SyscallProfile syscall_profile_;
+  // Sampled stacks of the sandboxee, if sampled.
+  StackSamples stack_samples_;
+  // Usage of the cgroup of the sandboxee, if any.
+  std::unique_ptr<CgroupStats> cgroup_stats_;
 };
 
 }  // namespace sandbox2
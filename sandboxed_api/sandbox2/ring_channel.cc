@@ -0,0 +1,249 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/ring_channel.h"
+
+#include <linux/futex.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
+
+#include "absl/memory/memory.h"
+#include "absl/time/clock.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sandbox2 {
+
+constexpr size_t RingChannel::kDefaultCapacity;
+constexpr size_t RingChannel::kAlignment;
+constexpr uint32_t RingChannel::kPadding;
+constexpr size_t RingChannel::kDataOffset;
+
+namespace {
+
+bool IsValidCapacity(uint64_t capacity) {
+  // At least room for one header-sized record, and the byte positions must
+  // not overflow the length prefix.
+  return capacity >= 64 && capacity <= (uint64_t{1} << 31) &&
+         (capacity & (capacity - 1)) == 0;
+}
+
+}  // namespace
+
+sapi::StatusOr<std::unique_ptr<RingChannel>> RingChannel::Create(
+    size_t capacity) {
+  if (!IsValidCapacity(capacity)) {
+    return sapi::InvalidArgumentError(
+        "Ring capacity must be a power of two between 64 bytes and 2 GiB");
+  }
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<Buffer> buffer,
+                        Buffer::CreateWithSize(kDataOffset + capacity));
+  // A freshly created buffer is zero-filled, i.e. empty.
+  auto ring = absl::WrapUnique(new RingChannel(std::move(buffer), capacity));
+  ring->header()->capacity = capacity;
+  return ring;
+}
+
+sapi::StatusOr<std::unique_ptr<RingChannel>> RingChannel::CreateFromFd(
+    int fd) {
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<Buffer> buffer,
+                        Buffer::CreateFromFd(fd));
+  if (buffer->size() < kDataOffset) {
+    return sapi::InvalidArgumentError("Ring region too small");
+  }
+  const Header* hdr = reinterpret_cast<const Header*>(buffer->data());
+  const uint64_t capacity = hdr->capacity;
+  if (!IsValidCapacity(capacity) ||
+      buffer->size() < kDataOffset + capacity) {
+    return sapi::InvalidArgumentError("Invalid ring header");
+  }
+  auto ring = absl::WrapUnique(new RingChannel(std::move(buffer), capacity));
+  // Joins the stream where the other side is.
+  ring->reserve_pos_ = hdr->head.pos.load(std::memory_order_acquire);
+  ring->tail_cache_ = hdr->tail.pos.load(std::memory_order_acquire);
+  ring->read_pos_ = ring->tail_cache_;
+  ring->head_cache_ = ring->tail_cache_;
+  return ring;
+}
+
+size_t RingChannel::max_record_size() const {
+  // A record may have to skip the end of the ring, so only one fitting into
+  // half of it is guaranteed to fit eventually.
+  return capacity_ / 2 - sizeof(uint32_t);
+}
+
+uint64_t RingChannel::SpaceNeeded(size_t size) const {
+  const size_t offset = reserve_pos_ & (capacity_ - 1);
+  const size_t space = RecordSpace(size);
+  // A record which does not fit before the end of the ring starts over at
+  // its beginning.
+  return capacity_ - offset < space ? capacity_ - offset + space : space;
+}
+
+uint8_t* RingChannel::Reserve(size_t size) {
+  if (size > max_record_size()) {
+    return nullptr;
+  }
+  const uint64_t needed = SpaceNeeded(size);
+  size_t offset = reserve_pos_ & (capacity_ - 1);
+  const size_t padding = needed - RecordSpace(size);
+  if (reserve_pos_ + needed - tail_cache_ > capacity_) {
+    const uint64_t tail = header()->tail.pos.load(std::memory_order_acquire);
+    // The consumer cannot release more than was published.
+    if (tail > reserve_pos_ || reserve_pos_ + needed - tail > capacity_) {
+      return nullptr;
+    }
+    tail_cache_ = tail;
+  }
+  if (padding != 0) {
+    memcpy(data() + offset, &kPadding, sizeof(kPadding));
+    reserve_pos_ += padding;
+    offset = 0;
+  }
+  const uint32_t length = size;
+  memcpy(data() + offset, &length, sizeof(length));
+  reserve_pos_ += RecordSpace(size);
+  return data() + offset + sizeof(length);
+}
+
+bool RingChannel::Write(const void* data, size_t size) {
+  uint8_t* dst = Reserve(size);
+  if (dst == nullptr) {
+    return false;
+  }
+  memcpy(dst, data, size);
+  return true;
+}
+
+void RingChannel::Publish() { Advance(&header()->head, reserve_pos_); }
+
+bool RingChannel::WaitForSpace(size_t size, absl::Duration timeout) {
+  if (size > max_record_size()) {
+    return false;
+  }
+  const uint64_t needed = SpaceNeeded(size);
+  // Makes sure the consumer is not waiting for records this side holds back.
+  Publish();
+  return Wait(&header()->tail, absl::Now() + timeout, [this, needed] {
+    const uint64_t tail = header()->tail.pos.load(std::memory_order_acquire);
+    return tail <= reserve_pos_ && reserve_pos_ + needed - tail <= capacity_;
+  });
+}
+
+bool RingChannel::Next(absl::Span<const uint8_t>* record) {
+  while (!corrupt_) {
+    if (read_pos_ == head_cache_) {
+      const uint64_t head = header()->head.pos.load(std::memory_order_acquire);
+      if (head == read_pos_) {
+        return false;
+      }
+      // Everything in the region is under control of the other side, the
+      // positions and lengths are validated before they are used.
+      if (head < read_pos_ || head - read_pos_ > capacity_) {
+        corrupt_ = true;
+        return false;
+      }
+      head_cache_ = head;
+    }
+    const size_t offset = read_pos_ & (capacity_ - 1);
+    uint32_t length;
+    memcpy(&length, data() + offset, sizeof(length));
+    if (length == kPadding) {
+      read_pos_ += capacity_ - offset;
+      if (read_pos_ > head_cache_) {
+        corrupt_ = true;
+      }
+      continue;
+    }
+    const size_t space = RecordSpace(length);
+    if (length > max_record_size() || space > capacity_ - offset ||
+        space > head_cache_ - read_pos_) {
+      corrupt_ = true;
+      return false;
+    }
+    *record = absl::Span<const uint8_t>(data() + offset + sizeof(length),
+                                        length);
+    read_pos_ += space;
+    return true;
+  }
+  return false;
+}
+
+void RingChannel::Release() {
+  if (!corrupt_) {
+    Advance(&header()->tail, read_pos_);
+  }
+}
+
+bool RingChannel::WaitForData(absl::Duration timeout) {
+  Release();
+  return Wait(&header()->head, absl::Now() + timeout, [this] {
+    return header()->head.pos.load(std::memory_order_acquire) != read_pos_;
+  });
+}
+
+void RingChannel::Close() {
+  Header* hdr = header();
+  hdr->closed.store(1, std::memory_order_seq_cst);
+  for (Cursor* cursor : {&hdr->head, &hdr->tail}) {
+    cursor->seq.fetch_add(1, std::memory_order_seq_cst);
+    syscall(__NR_futex, &cursor->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+  }
+}
+
+bool RingChannel::closed() const {
+  return header()->closed.load(std::memory_order_acquire) != 0;
+}
+
+void RingChannel::Advance(Cursor* cursor, uint64_t pos) {
+  if (cursor->pos.load(std::memory_order_relaxed) == pos) {
+    return;
+  }
+  cursor->pos.store(pos, std::memory_order_seq_cst);
+  if (cursor->waiters.load(std::memory_order_seq_cst) != 0) {
+    cursor->seq.fetch_add(1, std::memory_order_seq_cst);
+    syscall(__NR_futex, &cursor->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+  }
+}
+
+template <typename Ready>
+bool RingChannel::Wait(Cursor* cursor, absl::Time deadline, Ready ready) {
+  while (!ready()) {
+    if (closed()) {
+      return false;
+    }
+    const absl::Duration remaining = deadline - absl::Now();
+    if (remaining <= absl::ZeroDuration()) {
+      return false;
+    }
+    const timespec timeout = absl::ToTimespec(remaining);
+    cursor->waiters.fetch_add(1, std::memory_order_seq_cst);
+    const uint32_t seq = cursor->seq.load(std::memory_order_seq_cst);
+    if (!ready() && !closed()) {
+      syscall(__NR_futex, &cursor->seq, FUTEX_WAIT, seq, &timeout, nullptr,
+              0);
+    }
+    cursor->waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,178 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::RingChannel class streams variable-sized records from a single
+// producer to a single consumer through a ring in a sandbox2::Buffer, which is
+// mapped by both the executor and the sandboxee.
+//
+// Records are reserved and written in place, and become visible to the
+// consumer in batches with Publish(). The consumer reads them in place and
+// returns their space in batches with Release(). Neither needs a system call,
+// unless the other side is waiting for it (futex, so the policy of a waiting
+// sandboxee has to allow futex()).
+//
+// The ring is created by one side, whose fd() is passed to the other side,
+// e.g. with Comms::SendFD() or a sapi::v::Fd, which opens it with
+// CreateFromFd(). Either side can be the producer.
+
+#ifndef SANDBOXED_API_SANDBOX2_RING_CHANNEL_H_
+#define SANDBOXED_API_SANDBOX2_RING_CHANNEL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sandbox2 {
+
+class RingChannel {
+ public:
+  static constexpr size_t kDefaultCapacity = 1 << 20;
+
+  RingChannel(const RingChannel&) = delete;
+  RingChannel& operator=(const RingChannel&) = delete;
+
+  // Creates a ring holding 'capacity' bytes of records, which must be a power
+  // of two.
+  static sapi::StatusOr<std::unique_ptr<RingChannel>> Create(
+      size_t capacity = kDefaultCapacity);
+
+  // Opens a ring created by the other side. Takes ownership of the file
+  // descriptor.
+  static sapi::StatusOr<std::unique_ptr<RingChannel>> CreateFromFd(int fd);
+
+  // Gets the file descriptor backing the ring.
+  int fd() const { return buffer_->fd(); }
+
+  size_t capacity() const { return capacity_; }
+
+  // Largest record which fits into the ring.
+  size_t max_record_size() const;
+
+  // Producer side, calls must be serialized.
+
+  // Reserves space for a record of 'size' bytes and returns where to write
+  // it, or nullptr if the ring is too full or the record too large. The
+  // record is not visible to the consumer before Publish().
+  uint8_t* Reserve(size_t size);
+
+  // Copies a record into the ring, see Reserve().
+  bool Write(const void* data, size_t size);
+
+  // Makes all records reserved so far visible to the consumer.
+  void Publish();
+
+  // Publishes the reserved records and waits until a record of 'size' bytes
+  // fits, or 'timeout' passed. Returns false on timeout or if the consumer
+  // closed the ring.
+  bool WaitForSpace(size_t size, absl::Duration timeout);
+
+  // Consumer side, calls must be serialized.
+
+  // Gets the next published record. Returns false if there is none, or if the
+  // ring is corrupt, see corrupt(). The record stays valid until Release().
+  // The other side can still modify it, so an untrusted record must be copied
+  // before it is validated.
+  bool Next(absl::Span<const uint8_t>* record);
+
+  // Returns the space of all records returned by Next() to the producer.
+  void Release();
+
+  // Releases the records returned so far and waits until a record is
+  // published, or 'timeout' passed. Returns false on timeout or if the
+  // producer closed the ring.
+  bool WaitForData(absl::Duration timeout);
+
+  // Whether the consumer found invalid positions or record lengths, in which
+  // case Next() does not return any further records.
+  bool corrupt() const { return corrupt_; }
+
+  // Either side: tells the other side that no more records are published or
+  // consumed, which ends its waits.
+  void Close();
+  bool closed() const;
+
+ private:
+  // Cursors of both sides, each in its own cache line.
+  struct alignas(64) Cursor {
+    // Position in the byte stream: published by the producer, or released by
+    // the consumer.
+    std::atomic<uint64_t> pos;
+    // Bumped when 'pos' moves while the other side waits, which sleeps on it.
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> waiters;
+  };
+
+  // Header at the start of the shared region, followed by the records.
+  struct Header {
+    // Written by the creator before the region is passed on.
+    uint64_t capacity;
+    std::atomic<uint32_t> closed;
+    Cursor head;
+    Cursor tail;
+  };
+
+  // Records are prefixed with their length and aligned to this.
+  static constexpr size_t kAlignment = 8;
+  // Length of the space skipped at the end of the ring if a record did not
+  // fit there.
+  static constexpr uint32_t kPadding = UINT32_MAX;
+  static constexpr size_t kDataOffset = (sizeof(Header) + 63) & ~size_t{63};
+
+  RingChannel(std::unique_ptr<Buffer> buffer, size_t capacity)
+      : buffer_(std::move(buffer)), capacity_(capacity) {}
+
+  Header* header() const { return reinterpret_cast<Header*>(buffer_->data()); }
+  uint8_t* data() const { return buffer_->data() + kDataOffset; }
+
+  // Space taken by a record of 'size' bytes.
+  static size_t RecordSpace(size_t size) {
+    return (sizeof(uint32_t) + size + kAlignment - 1) & ~(kAlignment - 1);
+  }
+
+  // Space needed by the producer for the next record of 'size' bytes,
+  // including the end of the ring it may have to skip.
+  uint64_t SpaceNeeded(size_t size) const;
+
+  // Moves 'cursor' to 'pos' and wakes the other side if it waits for it.
+  static void Advance(Cursor* cursor, uint64_t pos);
+
+  // Waits until 'ready' returns true, 'cursor' is moved by the other side or
+  // 'deadline' passed.
+  template <typename Ready>
+  bool Wait(Cursor* cursor, absl::Time deadline, Ready ready);
+
+  std::unique_ptr<Buffer> buffer_;
+  const size_t capacity_;
+
+  // Producer side: end of the reserved records, and the consumer's released
+  // position as last seen.
+  uint64_t reserve_pos_ = 0;
+  uint64_t tail_cache_ = 0;
+
+  // Consumer side: start of the next record, the producer's published
+  // position as last seen, and whether the ring was found corrupt.
+  uint64_t read_pos_ = 0;
+  uint64_t head_cache_ = 0;
+  bool corrupt_ = false;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_RING_CHANNEL_H_
@@ -0,0 +1,183 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/ring_channel.h"
+
+#include <fcntl.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/util/status_matchers.h"
+
+using ::testing::Eq;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
+using ::testing::NotNull;
+
+namespace sandbox2 {
+namespace {
+
+// Opens the other side of 'ring' in the same process.
+std::unique_ptr<RingChannel> OpenOtherSide(const RingChannel& ring) {
+  auto other_or =
+      RingChannel::CreateFromFd(fcntl(ring.fd(), F_DUPFD_CLOEXEC, 0));
+  EXPECT_THAT(other_or.status(), sapi::IsOk());
+  return other_or.ok() ? std::move(other_or).ValueOrDie() : nullptr;
+}
+
+std::string ToString(absl::Span<const uint8_t> record) {
+  return std::string(reinterpret_cast<const char*>(record.data()),
+                     record.size());
+}
+
+TEST(RingChannelTest, RejectsInvalidCapacity) {
+  EXPECT_THAT(RingChannel::Create(1000).status(),
+              sapi::StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(RingChannel::Create(0).status(),
+              sapi::StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
+TEST(RingChannelTest, PublishesInBatches) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<RingChannel> producer,
+                            RingChannel::Create(4096));
+  std::unique_ptr<RingChannel> consumer = OpenOtherSide(*producer);
+  ASSERT_THAT(consumer, NotNull());
+  EXPECT_THAT(consumer->capacity(), Eq(4096));
+
+  ASSERT_THAT(producer->Write("first", 5), IsTrue());
+  uint8_t* record = producer->Reserve(6);
+  ASSERT_THAT(record, NotNull());
+  memcpy(record, "second", 6);
+  ASSERT_THAT(producer->Write("", 0), IsTrue());
+
+  absl::Span<const uint8_t> read;
+  // Nothing is visible before the batch is published.
+  EXPECT_THAT(consumer->Next(&read), IsFalse());
+  producer->Publish();
+  ASSERT_THAT(consumer->Next(&read), IsTrue());
+  EXPECT_THAT(ToString(read), Eq("first"));
+  ASSERT_THAT(consumer->Next(&read), IsTrue());
+  EXPECT_THAT(ToString(read), Eq("second"));
+  ASSERT_THAT(consumer->Next(&read), IsTrue());
+  EXPECT_THAT(read.size(), Eq(0));
+  EXPECT_THAT(consumer->Next(&read), IsFalse());
+  consumer->Release();
+  EXPECT_THAT(consumer->corrupt(), IsFalse());
+}
+
+TEST(RingChannelTest, FillsUpUntilReleased) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<RingChannel> producer,
+                            RingChannel::Create(256));
+  std::unique_ptr<RingChannel> consumer = OpenOtherSide(*producer);
+  ASSERT_THAT(consumer, NotNull());
+
+  EXPECT_THAT(producer->Reserve(producer->max_record_size() + 1),
+              Eq(nullptr));
+  const std::string record(60, 'x');
+  int written = 0;
+  while (producer->Write(record.data(), record.size())) {
+    ++written;
+  }
+  EXPECT_THAT(written, Eq(4));
+  producer->Publish();
+  EXPECT_THAT(producer->WaitForSpace(record.size(), absl::Milliseconds(10)),
+              IsFalse());
+
+  absl::Span<const uint8_t> read;
+  ASSERT_THAT(consumer->Next(&read), IsTrue());
+  // Space is only reused after it was released.
+  EXPECT_THAT(producer->Write(record.data(), record.size()), IsFalse());
+  consumer->Release();
+  EXPECT_THAT(producer->Write(record.data(), record.size()), IsTrue());
+}
+
+TEST(RingChannelTest, StreamsBetweenThreads) {
+  constexpr int kRecords = 100000;
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<RingChannel> producer,
+                            RingChannel::Create(1024));
+  std::unique_ptr<RingChannel> consumer = OpenOtherSide(*producer);
+  ASSERT_THAT(consumer, NotNull());
+
+  std::thread producer_thread([&producer] {
+    for (int i = 0; i < kRecords; ++i) {
+      // Records of varying size, so that some skip the end of the ring.
+      const std::string record = absl::StrCat(i, std::string(i % 100, '.'));
+      while (!producer->Write(record.data(), record.size())) {
+        ASSERT_THAT(producer->WaitForSpace(record.size(), absl::Seconds(10)),
+                    IsTrue());
+      }
+      if (i % 8 == 0) {
+        producer->Publish();
+      }
+    }
+    producer->Publish();
+  });
+  int received = 0;
+  absl::Span<const uint8_t> read;
+  while (received < kRecords) {
+    if (!consumer->Next(&read)) {
+      ASSERT_THAT(consumer->corrupt(), IsFalse());
+      ASSERT_THAT(consumer->WaitForData(absl::Seconds(10)), IsTrue());
+      continue;
+    }
+    ASSERT_THAT(ToString(read),
+                Eq(absl::StrCat(received, std::string(received % 100, '.'))));
+    ++received;
+  }
+  producer_thread.join();
+}
+
+TEST(RingChannelTest, DetectsCorruptRecords) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<RingChannel> producer,
+                            RingChannel::Create(256));
+  std::unique_ptr<RingChannel> consumer = OpenOtherSide(*producer);
+  ASSERT_THAT(consumer, NotNull());
+
+  uint8_t* record = producer->Reserve(4);
+  ASSERT_THAT(record, NotNull());
+  // Overwrites the length prefix with one exceeding the published data.
+  const uint32_t length = 200;
+  memcpy(record - sizeof(length), &length, sizeof(length));
+  producer->Publish();
+
+  absl::Span<const uint8_t> read;
+  EXPECT_THAT(consumer->Next(&read), IsFalse());
+  EXPECT_THAT(consumer->corrupt(), IsTrue());
+}
+
+TEST(RingChannelTest, CloseEndsWaits) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<RingChannel> producer,
+                            RingChannel::Create(256));
+  std::unique_ptr<RingChannel> consumer = OpenOtherSide(*producer);
+  ASSERT_THAT(consumer, NotNull());
+
+  std::thread closer([&producer] {
+    absl::SleepFor(absl::Milliseconds(50));
+    producer->Close();
+  });
+  EXPECT_THAT(consumer->WaitForData(absl::Seconds(10)), IsFalse());
+  EXPECT_THAT(consumer->closed(), IsTrue());
+  closer.join();
+}
+
+}  // namespace
+}  // namespace sandbox2
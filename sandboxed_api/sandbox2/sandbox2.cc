@@ -17,10 +17,13 @@
 #include "sandboxed_api/sandbox2/sandbox2.h"
 
 #include <csignal>
+#include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "absl/memory/memory.h"
+#include "sandboxed_api/sandbox2/cgroup.h"
 #include "sandboxed_api/sandbox2/monitor.h"
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/util/canonical_errors.h"
@@ -31,19 +34,24 @@ Sandbox2::~Sandbox2() {
   if (monitor_thread_ && monitor_thread_->joinable()) {
     monitor_thread_->join();
   }
+  if (monitor_pool_ != nullptr && monitor_ != nullptr) {
+    monitor_->done_notification_.WaitForNotification();
+  }
 }
 
 sapi::StatusOr<Result> Sandbox2::AwaitResultWithTimeout(
     absl::Duration timeout) {
   CHECK(monitor_ != nullptr) << "Sandbox was not launched yet";
-  CHECK(monitor_thread_ != nullptr) << "Sandbox was already waited on";
+  CHECK(!awaited_) << "Sandbox was already waited on";
 
   auto done =
       monitor_->done_notification_.WaitForNotificationWithTimeout(timeout);
   if (!done) {
     return sapi::DeadlineExceededError("Sandbox did not finish within timeout");
   }
-  monitor_thread_->join();
+  if (monitor_thread_ != nullptr) {
+    monitor_thread_->join();
+  }
 
   CHECK(IsTerminated()) << "Monitor did not terminate";
 
@@ -51,6 +59,7 @@ sapi::StatusOr<Result> Sandbox2::AwaitResultWithTimeout(
   // object cannot be used anymore to control behavior of the sandboxee (e.g.
   // via signals).
   monitor_thread_.reset(nullptr);
+  awaited_ = true;
 
   VLOG(1) << "Final execution status: " << monitor_->result_.ToString();
   CHECK(monitor_->result_.final_status() != Result::UNSET);
@@ -61,6 +70,17 @@ Result Sandbox2::AwaitResult() {
   return AwaitResultWithTimeout(absl::InfiniteDuration()).ValueOrDie();
 }
 
+bool Sandbox2::RunAsync(DoneCallback on_done) {
+  done_callback_ = std::move(on_done);
+  return RunAsync();
+}
+
+bool Sandbox2::RunAsync(DoneCallback on_done, CompletionExecutor executor) {
+  return RunAsync([on_done, executor](const Result& result) {
+    executor([on_done, result]() { on_done(result); });
+  });
+}
+
 bool Sandbox2::RunAsync() {
   Launch();
 
@@ -73,8 +93,8 @@ bool Sandbox2::RunAsync() {
 }
 
 void Sandbox2::NotifyMonitor() {
-  if (monitor_thread_ != nullptr) {
-    pthread_kill(monitor_thread_->native_handle(), SIGCHLD);
+  if (monitor_ != nullptr && !awaited_) {
+    monitor_->WakeUp();
   }
 }
 
@@ -98,25 +118,51 @@ bool Sandbox2::IsTerminated() const {
   return monitor_->IsDone();
 }
 
+sapi::StatusOr<util::ResourceUsage> Sandbox2::GetResourceUsage() const {
+  if (monitor_ == nullptr || monitor_->pid_ <= 0) {
+    return sapi::FailedPreconditionError("Sandboxee not started");
+  }
+  if (monitor_->IsDone()) {
+    return sapi::FailedPreconditionError("Sandboxee finished");
+  }
+  if (!monitor_->cgroup_path_.empty()) {
+    return Cgroup::GetResourceUsage(monitor_->cgroup_path_);
+  }
+  return util::GetResourceUsage(util::GetProcessTree(monitor_->pid_));
+}
+
 void Sandbox2::SetWallTimeLimit(time_t limit) const {
+  SetWallTimeLimit(absl::Seconds(limit));
+}
+
+void Sandbox2::SetWallTimeLimit(absl::Duration limit) const {
   CHECK(monitor_ != nullptr) << "Sandbox was not launched yet";
 
-  if (limit == 0) {
+  if (limit == absl::ZeroDuration()) {
     VLOG(1) << "Disarming walltime timer to ";
     monitor_->deadline_millis_.store(0, std::memory_order_relaxed);
   } else {
-    VLOG(1) << "Will set the walltime timer to " << limit << " seconds";
-    auto deadline = absl::Now() + absl::Seconds(limit);
+    VLOG(1) << "Will set the walltime timer to " << limit;
+    auto deadline = absl::Now() + limit;
     monitor_->deadline_millis_.store(absl::ToUnixMillis(deadline),
                                      std::memory_order_relaxed);
   }
+  // Let the monitor sleep until the new deadline.
+  monitor_->WakeUp();
 }
 
 void Sandbox2::Launch() {
   monitor_ =
       absl::make_unique<Monitor>(executor_.get(), policy_.get(), notify_.get());
-  monitor_thread_ =
-      absl::make_unique<std::thread>(&Monitor::Run, monitor_.get());
+  monitor_->profile_syscalls_ = profile_syscalls_;
+  monitor_->stack_sampling_period_ = stack_sampling_period_;
+  monitor_->done_callback_ = std::move(done_callback_);
+  if (monitor_pool_ != nullptr) {
+    monitor_pool_->Add(monitor_.get());
+  } else {
+    monitor_thread_ =
+        absl::make_unique<std::thread>(&Monitor::Run, monitor_.get());
+  }
 
   // Wait for the Monitor to set-up the sandboxee correctly (or fail while
   // doing that). From here on, it is safe to use the IPC object for
@@ -19,6 +19,7 @@
 #define SANDBOXED_API_SANDBOX2_SANDBOX2_H_
 
 #include <ctime>
+#include <functional>
 #include <memory>
 #include <thread>  // NOLINT(build/c++11)
 #include <utility>
@@ -26,23 +27,33 @@
 #include <glog/logging.h>
 #include "absl/base/macros.h"
 #include "absl/memory/memory.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/ipc.h"
 #include "sandboxed_api/sandbox2/monitor.h"
+#include "sandboxed_api/sandbox2/monitor_pool.h"
 #include "sandboxed_api/sandbox2/notify.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/util.h"
 #include "sandboxed_api/util/statusor.h"
 
 namespace sandbox2 {
 
 class Sandbox2 final {
  public:
-  Sandbox2(std::unique_ptr<Executor> executor, std::unique_ptr<Policy> policy)
+  // Called once the sandboxee finished, see RunAsync(DoneCallback).
+  using DoneCallback = std::function<void(const Result&)>;
+  // Runs a closure on some thread, e.g. by scheduling it on a thread pool.
+  using CompletionExecutor = std::function<void(std::function<void()>)>;
+
+  // The policy may be shared by any number of Sandbox2 objects, its BPF
+  // program is then compiled only once. A shared policy must not be modified.
+  Sandbox2(std::unique_ptr<Executor> executor, std::shared_ptr<Policy> policy)
       : Sandbox2(std::move(executor), std::move(policy), /*notify=*/nullptr) {}
 
-  Sandbox2(std::unique_ptr<Executor> executor, std::unique_ptr<Policy> policy,
+  Sandbox2(std::unique_ptr<Executor> executor, std::shared_ptr<Policy> policy,
            std::unique_ptr<Notify> notify)
       : executor_(std::move(executor)),
         policy_(std::move(policy)),
@@ -59,6 +70,27 @@ class Sandbox2 final {
   Sandbox2(const Sandbox2&) = delete;
   Sandbox2& operator=(const Sandbox2&) = delete;
 
+  // Supervises the sandboxee from a thread of 'pool' instead of a thread of
+  // its own. Must be called before RunAsync(), the pool must outlive the
+  // Sandbox2 object. Notify callbacks then run on the pool thread and should
+  // not block.
+  void set_monitor_pool(MonitorPool* pool) { monitor_pool_ = pool; }
+
+  // Counts and times the syscalls allowed by the policy, the measurements are
+  // in Result::GetSyscallProfile(). Every such syscall then stops the
+  // sandboxee twice, so this is meant for analysis rather than for production
+  // use. Must be called before RunAsync().
+  void EnableSyscallProfiling() { profile_syscalls_ = true; }
+
+  // Samples the stacks of all threads of the main sandboxee process every
+  // 'period', the samples are aggregated in Result::GetStackSamples() and
+  // reported to Notify::EventStackSample() as they are taken. Each sample
+  // stops the thread while it is unwound in the libunwind sandbox, so periods
+  // well below a millisecond are not useful. Must be called before RunAsync().
+  void EnableStackSampling(absl::Duration period) {
+    stack_sampling_period_ = period;
+  }
+
   // Runs the sandbox, blocking until there is a result.
   ABSL_MUST_USE_RESULT Result Run() {
     RunAsync();
@@ -70,6 +102,19 @@ class Sandbox2 final {
   // Even if set-up fails AwaitResult can still used to get a more specific
   // failure reason.
   bool RunAsync();
+
+  // Same as above, and calls 'on_done' with the result once the sandboxee
+  // finished, also if the set-up failed, instead of making the caller block
+  // in AwaitResult(). The callback runs on the monitor thread, or on the
+  // MonitorPool thread supervising the sandboxee, before AwaitResult()
+  // returns: it must not block, call AwaitResult() or destroy this object.
+  bool RunAsync(DoneCallback on_done);
+
+  // Same as above, but the monitor hands 'on_done' with a copy of the result
+  // to 'executor' instead of calling it itself. The callback can then block,
+  // and take the result with AwaitResult() or destroy this object.
+  bool RunAsync(DoneCallback on_done, CompletionExecutor executor);
+
   // Waits for sandbox execution to finish and returns the execution result.
   ABSL_MUST_USE_RESULT Result AwaitResult();
 
@@ -96,6 +141,10 @@ class Sandbox2 final {
   // Sandboxed API can be used to implement persistent sandboxes.
   void SetWallTimeLimit(time_t limit) const;
 
+  // Same as above, with millisecond granularity. With a MonitorPool, the limits
+  // of all its sandboxees are kept in a timer wheel per pool thread.
+  void SetWallTimeLimit(absl::Duration limit) const;
+
   // Gets the pid inside the executor.
   pid_t GetPid() {
     if (monitor_ != nullptr) {
@@ -104,6 +153,22 @@ class Sandbox2 final {
     return -1;
   }
 
+  // Returns the start-up times of the sandboxee up to the end of its set-up.
+  // Only valid after RunAsync() succeeded, the later phases are only in the
+  // Result.
+  Result::StartupTimes GetStartupTimes() const {
+    return monitor_ != nullptr ? monitor_->setup_startup_times_
+                               : Result::StartupTimes();
+  }
+
+  // Returns a snapshot of the resources the sandboxee used so far, summed over
+  // its processes, e.g. for decisions on where to place or when to recycle
+  // sandboxes. Read from the cgroup of the sandboxee if it has one (see
+  // Limits::set_cgroup_parent()), otherwise from /proc for the main process
+  // and its descendants. Only valid after RunAsync() succeeded and until the
+  // sandboxee finished, the final usage is in the Result.
+  sapi::StatusOr<util::ResourceUsage> GetResourceUsage() const;
+
   // Gets the comms inside the executor.
   Comms* comms() {
     return executor_ != nullptr ? executor_->ipc()->comms() : nullptr;
@@ -118,8 +183,8 @@ class Sandbox2 final {
   // Executor set by user - owned by Sandbox2.
   std::unique_ptr<Executor> executor_;
 
-  // Seccomp policy set by the user - owned by Sandbox2.
-  std::unique_ptr<Policy> policy_;
+  // Seccomp policy set by the user, possibly shared with other sandboxes.
+  std::shared_ptr<Policy> policy_;
 
   // Notify object - owned by Sandbox2.
   std::unique_ptr<Notify> notify_;
@@ -127,8 +192,22 @@ class Sandbox2 final {
   // Monitor object - owned by Sandbox2.
   std::unique_ptr<Monitor> monitor_;
 
-  // Monitor thread object - owned by Sandbox2.
+  // Monitor thread object - owned by Sandbox2. Not used with a MonitorPool.
   std::unique_ptr<std::thread> monitor_thread_;
+
+  // Pool supervising the sandboxee, not owned. See set_monitor_pool().
+  MonitorPool* monitor_pool_ = nullptr;
+
+  // See EnableSyscallProfiling().
+  bool profile_syscalls_ = false;
+  // See EnableStackSampling().
+  absl::Duration stack_sampling_period_ = absl::ZeroDuration();
+
+  // See RunAsync(DoneCallback).
+  DoneCallback done_callback_;
+
+  // Whether the result has been taken by AwaitResultWithTimeout().
+  bool awaited_ = false;
 };
 
 }  // namespace sandbox2
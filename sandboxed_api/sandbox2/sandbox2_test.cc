@@ -15,9 +15,16 @@
 #include "sandboxed_api/sandbox2/sandbox2.h"
 
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
 #include <syscall.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <csignal>
+#include <cstdio>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -25,20 +32,31 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/monitor_pool.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/policybuilder.h"
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "sandboxed_api/sandbox2/util/file_helpers.h"
+#include "sandboxed_api/sandbox2/util/path.h"
 #include "sandboxed_api/util/status_matchers.h"
 
+using ::sapi::StatusIs;
 using ::testing::Eq;
+using ::testing::Ge;
 using ::testing::HasSubstr;
 using ::testing::IsEmpty;
 using ::testing::IsTrue;
 using ::testing::Lt;
+using ::testing::Ne;
+using ::testing::StartsWith;
 
 namespace sandbox2 {
 namespace {
@@ -113,6 +131,175 @@ TEST(ExecutorTest, ExecutorFdConstructor) {
   ASSERT_EQ(result.final_status(), Result::OK);
 }
 
+TEST(ExecutorTest, AppliesSchedulingSettings) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  // Raising the nice value needs no privileges.
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, 0);
+  ASSERT_THAT(errno, Eq(0));
+  nice = std::min(nice + 5, 19);
+
+  const std::string path = GetTestSourcePath("sandbox2/testcases/scheduling");
+  std::vector<std::string> args = {path, absl::StrCat(SCHED_BATCH),
+                                   absl::StrCat(nice)};
+  auto executor = absl::make_unique<Executor>(path, args);
+  executor->set_scheduling_policy(Executor::SchedulingPolicy::kBatch)
+      .set_nice(nice);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(std::move(executor), std::move(policy));
+  auto result = sandbox.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::OK));
+  EXPECT_THAT(result.reason_code(), Eq(0));
+}
+
+// Tests that the start-up phases are recorded in order.
+TEST(StartupTimesTest, PhasesAreRecorded) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        .DisableNamespaces()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(std::move(executor), std::move(policy));
+  ASSERT_TRUE(sandbox.RunAsync());
+  const Result::StartupTimes setup = sandbox.GetStartupTimes();
+  auto result = sandbox.AwaitResult();
+  ASSERT_EQ(result.final_status(), Result::OK);
+
+  const Result::StartupTimes& times = result.GetStartupTimes();
+  EXPECT_THAT(setup.policy_install, Eq(times.policy_install));
+  EXPECT_THAT(times.fork_request, Ne(absl::InfinitePast()));
+  EXPECT_THAT(times.sanitization, Ge(times.clone));
+  EXPECT_THAT(times.sandbox_ready, Ge(times.sanitization));
+  EXPECT_THAT(times.policy_install, Ge(times.sandbox_ready));
+  EXPECT_THAT(result.ToString(), HasSubstr("Startup: clone="));
+}
+
+// Tests that the allowed syscalls are counted when profiling.
+TEST(SyscallProfileTest, AllowedSyscallsAreCounted) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        .DisableNamespaces()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(std::move(executor), std::move(policy));
+  sandbox.EnableSyscallProfiling();
+  auto result = sandbox.Run();
+  ASSERT_EQ(result.final_status(), Result::OK);
+
+  const Result::SyscallProfile& profile = result.GetSyscallProfile();
+  ASSERT_THAT(profile.count(__NR_exit_group), Eq(1));
+  EXPECT_THAT(profile.at(__NR_exit_group).count, Eq(1));
+  EXPECT_THAT(result.SyscallProfileToString(), HasSubstr("exit_group"));
+}
+
+// Tests that a single pool thread can supervise several sandboxees at once.
+TEST(MonitorPoolTest, SupervisesSandboxeesOnOneThread) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  MonitorPool pool(/*num_threads=*/1);
+
+  const std::string sleep_path = GetTestSourcePath("sandbox2/testcases/sleep");
+  std::vector<std::string> sleep_args = {sleep_path};
+  SAPI_ASSERT_OK_AND_ASSIGN(auto sleep_policy,
+                            PolicyBuilder()
+                                // Don't restrict the syscalls at all.
+                                .DangerDefaultAllowAll()
+                                .TryBuild());
+  Sandbox2 sleeping(absl::make_unique<Executor>(sleep_path, sleep_args),
+                    std::move(sleep_policy));
+  sleeping.set_monitor_pool(&pool);
+  ASSERT_TRUE(sleeping.RunAsync());
+
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::unique_ptr<Sandbox2>> sandboxes;
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> args = {path};
+    SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                          .DisableNamespaces()
+                                          // Don't restrict the syscalls at all.
+                                          .DangerDefaultAllowAll()
+                                          .TryBuild());
+    sandboxes.push_back(absl::make_unique<Sandbox2>(
+        absl::make_unique<Executor>(path, args), std::move(policy)));
+    sandboxes.back()->set_monitor_pool(&pool);
+    ASSERT_TRUE(sandboxes.back()->RunAsync());
+  }
+  for (auto& sandbox : sandboxes) {
+    auto result = sandbox->AwaitResult();
+    EXPECT_THAT(result.final_status(), Eq(Result::OK));
+  }
+
+  sleeping.Kill();
+  auto result = sleeping.AwaitResult();
+  EXPECT_THAT(result.final_status(), Eq(Result::EXTERNAL_KILL));
+}
+
+TEST(RunAsyncTest, CallsDoneCallback) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  MonitorPool pool(/*num_threads=*/1);
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::string> args = {path};
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        .DisableNamespaces()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(absl::make_unique<Executor>(path, args), std::move(policy));
+  sandbox.set_monitor_pool(&pool);
+  Result::StatusEnum final_status = Result::UNSET;
+  absl::Notification done;
+  ASSERT_TRUE(sandbox.RunAsync([&final_status, &done](const Result& result) {
+    final_status = result.final_status();
+    done.Notify();
+  }));
+  done.WaitForNotification();
+  EXPECT_THAT(final_status, Eq(Result::OK));
+  EXPECT_THAT(sandbox.AwaitResult().final_status(), Eq(Result::OK));
+}
+
+TEST(RunAsyncTest, RunsDoneCallbackOnExecutor) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  const std::string path = GetTestSourcePath("sandbox2/testcases/minimal");
+  std::vector<std::string> args = {path};
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        .DisableNamespaces()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  auto sandbox = absl::make_unique<Sandbox2>(
+      absl::make_unique<Executor>(path, args), std::move(policy));
+  absl::Notification scheduled;
+  std::function<void()> closure;
+  Result::StatusEnum final_status = Result::UNSET;
+  ASSERT_TRUE(sandbox->RunAsync(
+      [&final_status](const Result& result) {
+        final_status = result.final_status();
+      },
+      [&scheduled, &closure](std::function<void()> f) {
+        closure = std::move(f);
+        scheduled.Notify();
+      }));
+  scheduled.WaitForNotification();
+  // The closure holds its own copy of the result.
+  sandbox.reset();
+  closure();
+  EXPECT_THAT(final_status, Eq(Result::OK));
+}
+
 // Tests that we return the correct state when the sandboxee was killed by an
 // external signal. Also make sure that we do not have the stack trace.
 TEST(RunAsyncTest, SandboxeeExternalKill) {
@@ -136,6 +323,127 @@ TEST(RunAsyncTest, SandboxeeExternalKill) {
   EXPECT_THAT(result.GetStackTrace(), IsEmpty());
 }
 
+TEST(RunAsyncTest, ReportsResourceUsageWhileRunning) {
+  const std::string path = GetTestSourcePath("sandbox2/testcases/sleep");
+  std::vector<std::string> args = {path};
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(absl::make_unique<Executor>(path, args), std::move(policy));
+  ASSERT_TRUE(sandbox.RunAsync());
+  SAPI_ASSERT_OK_AND_ASSIGN(util::ResourceUsage usage,
+                            sandbox.GetResourceUsage());
+  EXPECT_THAT(usage.num_processes, Ge(1));
+  EXPECT_THAT(usage.num_threads, Ge(1));
+  EXPECT_THAT(usage.rss, Ne(0));
+  sandbox.Kill();
+  auto result = sandbox.AwaitResult();
+  EXPECT_THAT(result.final_status(), Eq(Result::EXTERNAL_KILL));
+  EXPECT_THAT(sandbox.GetResourceUsage(),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
+// Returns the cgroup v2 mount point, or an empty string if there is none.
+std::string GetCgroupMount() {
+  std::string mounts;
+  if (!file::GetContents("/proc/self/mounts", &mounts, file::Defaults())
+           .ok()) {
+    return "";
+  }
+  for (absl::string_view line : absl::StrSplit(mounts, '\n')) {
+    std::vector<absl::string_view> fields = absl::StrSplit(line, ' ');
+    if (fields.size() > 2 && fields[2] == "cgroup2") {
+      return std::string(fields[1]);
+    }
+  }
+  return "";
+}
+
+// Returns the cgroup v2 of 'pid' relative to the mount point, or an empty
+// string.
+std::string GetCgroupOf(pid_t pid) {
+  std::string cgroups;
+  if (!file::GetContents(absl::StrCat("/proc/", pid, "/cgroup"), &cgroups,
+                         file::Defaults())
+           .ok()) {
+    return "";
+  }
+  for (absl::string_view line : absl::StrSplit(cgroups, '\n')) {
+    if (absl::ConsumePrefix(&line, "0::")) {
+      return std::string(line);
+    }
+  }
+  return "";
+}
+
+// Returns the parent of 'pid', or -1.
+pid_t GetParentPid(pid_t pid) {
+  std::string stat;
+  if (!file::GetContents(absl::StrCat("/proc/", pid, "/stat"), &stat,
+                         file::Defaults())
+           .ok()) {
+    return -1;
+  }
+  // The command name may contain spaces, the state and the parent follow it.
+  const size_t end = stat.rfind(')');
+  pid_t ppid = -1;
+  return end != std::string::npos &&
+                 sscanf(stat.c_str() + end + 1, " %*c %d", &ppid) == 1
+             ? ppid
+             : -1;
+}
+
+bool KernelIsAtLeast(int major, int minor) {
+  utsname uts;
+  int kernel_major = 0;
+  int kernel_minor = 0;
+  if (uname(&uts) != 0 ||
+      sscanf(uts.release, "%d.%d", &kernel_major, &kernel_minor) != 2) {
+    return false;
+  }
+  return kernel_major > major ||
+         (kernel_major == major && kernel_minor >= minor);
+}
+
+TEST(RunAsyncTest, StartsSandboxeeInItsCgroup) {
+  const std::string mount = GetCgroupMount();
+  const std::string own_cgroup = GetCgroupOf(getpid());
+  if (mount.empty() || own_cgroup.empty()) {
+    // No cgroup v2 hierarchy.
+    return;
+  }
+  const std::string path = GetTestSourcePath("sandbox2/testcases/sleep");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+  executor->limits()->set_cgroup_parent(file::JoinPath(mount, own_cgroup));
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder()
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .TryBuild());
+  Sandbox2 sandbox(std::move(executor), std::move(policy));
+  ASSERT_TRUE(sandbox.RunAsync());
+  const pid_t pid = sandbox.GetPid();
+  const std::string cgroup = GetCgroupOf(pid);
+  // The init process of the PID namespace.
+  const std::string init_cgroup = GetCgroupOf(GetParentPid(pid));
+  sandbox.Kill();
+  auto result = sandbox.AwaitResult();
+  EXPECT_THAT(result.final_status(), Eq(Result::EXTERNAL_KILL));
+  if (result.GetCgroupStats() == nullptr) {
+    // The cgroup of this process is not delegated to it.
+    return;
+  }
+  EXPECT_THAT(cgroup,
+              StartsWith(file::JoinPath(
+                  own_cgroup, absl::StrCat("sandbox2-", getpid(), "-"))));
+  // Cgroup::AddProcess() only moves the sandboxee, the init process starts in
+  // the cgroup only with CLONE_INTO_CGROUP (Linux 5.7).
+  if (KernelIsAtLeast(5, 7)) {
+    EXPECT_THAT(init_cgroup, Eq(cgroup));
+  }
+}
+
 // Tests that we return the correct state when the sandboxee timed out.
 TEST(RunAsyncTest, SandboxeeTimeoutWithStacktraces) {
   const std::string path = GetTestSourcePath("sandbox2/testcases/sleep");
@@ -28,6 +28,11 @@ namespace sanitizer {
 // Reads a list of open file descriptors in the current process.
 bool GetListOfFDs(std::set<int>* fds);
 
+// Returns whether close_range(2) with CLOSE_RANGE_CLOEXEC is available. The
+// fd functions below then apply it to the gaps between the exceptions
+// instead of listing /proc/self/fd.
+bool HasCloseRange();
+
 // Closes all file descriptors in the current process except the ones in
 // fd_exceptions.
 bool CloseAllFDsExcept(const std::set<int>& fd_exceptions);
@@ -110,6 +110,28 @@ TEST(SanitizerTest, TestMarkFDsAsCOE) {
   ASSERT_THAT(RunTestcase(path, args), Eq(0));
 }
 
+// Test that closing file descriptors keeps the exceptions between the closed
+// ones, with close_range(2) if available.
+TEST(SanitizerTest, TestCloseFDsWithGaps) {
+  pid_t pid = fork();
+  ASSERT_THAT(pid, Ne(-1));
+  if (pid == 0) {
+    int first = open("/dev/null", O_RDONLY);
+    int kept = open("/dev/null", O_RDONLY);
+    int last = open("/dev/null", O_RDONLY);
+    if (first == -1 || kept == -1 || last == -1 ||
+        !sanitizer::CloseAllFDsExcept(
+            {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, kept})) {
+      _exit(1);
+    }
+    _exit(IsFdOpen(kept) && !IsFdOpen(first) && !IsFdOpen(last) ? 0 : 2);
+  }
+  int status;
+  ASSERT_THAT(TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)), Eq(pid));
+  ASSERT_THAT(WIFEXITED(status), IsTrue());
+  EXPECT_THAT(WEXITSTATUS(status), Eq(0));
+}
+
 // Test that default sanitizer leaves only 0/1/2 and 1023 (client comms FD)
 // open but closes the rest.
 TEST(SanitizerTest, TestSandboxedBinary) {
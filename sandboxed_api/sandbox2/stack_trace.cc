@@ -16,9 +16,12 @@
 
 #include "sandboxed_api/sandbox2/stack_trace.h"
 
+#include <linux/futex.h>
+#include <sched.h>
 #include <sys/capability.h>
 #include <sys/resource.h>
 #include <syscall.h>
+#include <cerrno>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -29,6 +32,7 @@
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/strip.h"
+#include "absl/time/time.h"
 #include "libcap/include/sys/capability.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/executor.h"
@@ -61,9 +65,17 @@ class StackTracePeer {
                                            const std::string& exe_path,
                                            const Mounts& mounts);
 
-  static bool LaunchLibunwindSandbox(const Regs* regs, const Mounts& mounts,
-                                     UnwindResult* result,
-                                     const std::string& delim);
+  // Starts the libunwind sandbox of 'collector' for 'pid'.
+  static bool LaunchLibunwindSandbox(StackTraceCollector* collector,
+                                     pid_t pid);
+
+  // Unwinds the stacks described by 'regs' in the libunwind sandbox of
+  // 'collector', starting it if needed. Several threads are unwound
+  // concurrently and their traces returned in result->threads().
+  static bool RunLibunwindSandbox(StackTraceCollector* collector, pid_t pid,
+                                  const std::vector<const Regs*>& regs,
+                                  const std::string& delim,
+                                  UnwindResult* result);
 };
 
 std::unique_ptr<Policy> StackTracePeer::GetPolicy(pid_t target_pid,
@@ -71,6 +83,11 @@ std::unique_ptr<Policy> StackTracePeer::GetPolicy(pid_t target_pid,
                                                   const std::string& app_path,
                                                   const std::string& exe_path,
                                                   const Mounts& mounts) {
+  // The flags pthread_create() passes, any other combination might start a
+  // process or share less than a thread does.
+  constexpr uint32_t kThreadCloneFlags =
+      CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |
+      CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
   PolicyBuilder builder;
   builder
       // Use the mounttree of the original executable as starting point.
@@ -102,6 +119,18 @@ std::unique_ptr<Policy> StackTracePeer::GetPolicy(pid_t target_pid,
       .AllowSyscall(__NR_gettid)
       .AllowSyscall(__NR_madvise)
 
+      // Threads unwinding several stacks at once, see
+      // StackTraceCollector::CollectThreads().
+      .AllowSyscall(__NR_set_robust_list)
+      .AllowSyscall(__NR_sched_yield)
+      .AllowFutexOp(FUTEX_WAIT)
+      .AllowFutexOp(FUTEX_WAKE)
+      .AddPolicyOnSyscall(__NR_clone,
+                          {
+                              ARG_32(0),  // flags
+                              JEQ32(kThreadCloneFlags, ALLOW),
+                          })
+
       // Required for our ptrace replacement.
       .AddPolicyOnSyscall(
           __NR_process_vm_readv,
@@ -139,6 +168,12 @@ std::unique_ptr<Policy> StackTracePeer::GetPolicy(pid_t target_pid,
     }
   }
 
+#ifdef __NR_clone3
+  // The flags of clone3() cannot be inspected, make the C library fall back to
+  // clone().
+  builder.BlockSyscallWithErrno(__NR_clone3, ENOSYS);
+#endif
+
   auto policy_or = builder.TryBuild();
   if (!policy_or.ok()) {
     LOG(ERROR) << "Creating stack unwinder sandbox policy failed";
@@ -154,24 +189,15 @@ std::unique_ptr<Policy> StackTracePeer::GetPolicy(pid_t target_pid,
   return policy;
 }
 
-bool StackTracePeer::LaunchLibunwindSandbox(const Regs* regs,
-                                            const Mounts& mounts,
-                                            sandbox2::UnwindResult* result,
-                                            const std::string& delim) {
-  const pid_t pid = regs->pid();
-
-  // Tell executor to use this special internal mode.
-  std::vector<std::string> argv;
-  std::vector<std::string> envp;
-
+bool StackTracePeer::LaunchLibunwindSandbox(StackTraceCollector* collector,
+                                            pid_t pid) {
   // We're not using absl::make_unique here as we're a friend of this specific
   // constructor and using make_unique won't work.
   auto executor = absl::WrapUnique(new Executor(pid));
 
-  executor->limits()
-      ->set_rlimit_as(RLIM64_INFINITY)
-      .set_rlimit_cpu(10)
-      .set_walltime_limit(absl::Seconds(5));
+  // The wall time limit is armed for each request instead, see
+  // RunLibunwindSandbox().
+  executor->limits()->set_rlimit_as(RLIM64_INFINITY).set_rlimit_cpu(10);
 
   // Temporary directory used to provide files from /proc to the unwind sandbox.
   char unwind_temp_directory_template[] = "/tmp/.sandbox2_unwind_XXXXXX";
@@ -180,20 +206,17 @@ bool StackTracePeer::LaunchLibunwindSandbox(const Regs* regs,
     LOG(WARNING) << "Could not create temporary directory for unwinding";
     return false;
   }
-  struct UnwindTempDirectoryCleanup {
-    ~UnwindTempDirectoryCleanup() {
-      file_util::fileops::DeleteRecursively(capture);
-    }
-    char* capture;
-  } cleanup{unwind_temp_directory};
+  collector->temp_directory_ = unwind_temp_directory;
 
   // Copy over important files from the /proc directory as we can't mount them.
+  // The maps file is written again before each request, so it has to stay
+  // writable.
   const std::string unwind_temp_maps_path =
       file::JoinPath(unwind_temp_directory, "maps");
 
   if (!file_util::fileops::CopyFile(
           file::JoinPath("/proc", absl::StrCat(pid), "maps"),
-          unwind_temp_maps_path, 0400)) {
+          unwind_temp_maps_path, 0600)) {
     LOG(WARNING) << "Could not copy maps file";
     return false;
   }
@@ -230,45 +253,113 @@ bool StackTracePeer::LaunchLibunwindSandbox(const Regs* regs,
   // Add mappings for the binary (as they might not have been added due to the
   // forkserver).
   auto policy = StackTracePeer::GetPolicy(pid, unwind_temp_maps_path, app_path,
-                                          exe_path, mounts);
+                                          exe_path, collector->mounts_);
   if (!policy) {
     return false;
   }
-  auto comms = executor->ipc()->comms();
-  Sandbox2 s2(std::move(executor), std::move(policy));
+  collector->comms_ = executor->ipc()->comms();
+  collector->sandbox_ =
+      absl::make_unique<Sandbox2>(std::move(executor), std::move(policy));
 
   VLOG(1) << "Running libunwind sandbox";
-  s2.RunAsync();
+  collector->sandbox_->RunAsync();
+  collector->pid_ = pid;
+  return true;
+}
+
+bool StackTracePeer::RunLibunwindSandbox(StackTraceCollector* collector,
+                                         pid_t pid,
+                                         const std::vector<const Regs*>& regs,
+                                         const std::string& delim,
+                                         UnwindResult* result) {
+  if (collector->pid_ != pid) {
+    collector->Shutdown();
+    if (!LaunchLibunwindSandbox(collector, pid)) {
+      collector->Shutdown();
+      return false;
+    }
+  } else {
+    // The mappings might have changed since the previous request. The copy is
+    // updated in place, which keeps it visible through the bind mount.
+    if (!file_util::fileops::CopyFile(
+            file::JoinPath("/proc", absl::StrCat(pid), "maps"),
+            file::JoinPath(collector->temp_directory_, "maps"), 0600)) {
+      LOG(WARNING) << "Could not copy maps file";
+      return false;
+    }
+  }
+
   UnwindSetup msg;
   msg.set_pid(pid);
-  msg.set_regs(reinterpret_cast<const char*>(&regs->user_regs_),
-               sizeof(regs->user_regs_));
+  if (regs.size() == 1) {
+    msg.set_regs(reinterpret_cast<const char*>(&regs[0]->user_regs_),
+                 sizeof(regs[0]->user_regs_));
+  } else {
+    for (const Regs* thread_regs : regs) {
+      msg.add_thread_regs(
+          reinterpret_cast<const char*>(&thread_regs->user_regs_),
+          sizeof(thread_regs->user_regs_));
+    }
+  }
   msg.set_default_max_frames(kDefaultMaxFrames);
   msg.set_delim(delim.c_str(), delim.size());
 
+  // Symbolizing a thread mostly hits the symbol tables already parsed for the
+  // others.
+  collector->sandbox_->SetWallTimeLimit(absl::Seconds(5) +
+                                        absl::Milliseconds(100) * regs.size());
   bool success = true;
-  if (!comms->SendProtoBuf(msg)) {
+  if (!collector->comms_->SendProtoBuf(msg)) {
     LOG(ERROR) << "Sending libunwind setup message failed";
     success = false;
   }
 
-  if (success && !comms->RecvProtoBuf(result)) {
+  if (success && !collector->comms_->RecvProtoBuf(result)) {
     LOG(ERROR) << "Receiving libunwind result failed";
     success = false;
   }
+  if (success && regs.size() > 1 && result->threads_size() != regs.size()) {
+    LOG(ERROR) << "Received " << result->threads_size()
+               << " stack traces, expected " << regs.size();
+    success = false;
+  }
 
   if (!success) {
-    s2.Kill();
+    collector->Shutdown();
+    return false;
   }
-  auto s2_result = s2.AwaitResult();
+  collector->sandbox_->SetWallTimeLimit(absl::ZeroDuration());
+  return true;
+}
 
-  LOG(INFO) << "Libunwind execution status: " << s2_result.ToString();
+StackTraceCollector::StackTraceCollector(const Mounts& mounts)
+    : mounts_(mounts) {}
 
-  return success && s2_result.final_status() == Result::OK;
+StackTraceCollector::~StackTraceCollector() { Shutdown(); }
+
+void StackTraceCollector::Shutdown() {
+  if (sandbox_) {
+    // The libunwind sandbox exits once the Comms channel is closed.
+    comms_->Terminate();
+    auto result = sandbox_->AwaitResult();
+    LOG(INFO) << "Libunwind execution status: " << result.ToString();
+    sandbox_.reset();
+    comms_ = nullptr;
+  }
+  if (!temp_directory_.empty()) {
+    file_util::fileops::DeleteRecursively(temp_directory_);
+    temp_directory_.clear();
+  }
+  pid_ = -1;
 }
 
-std::string GetStackTrace(const Regs* regs, const Mounts& mounts,
-                          const std::string& delim) {
+std::string StackTraceCollector::Collect(const Regs* regs,
+                                         const std::string& delim) {
+  return Collect(regs ? regs->pid() : -1, regs, delim);
+}
+
+std::string StackTraceCollector::Collect(pid_t pid, const Regs* regs,
+                                         const std::string& delim) {
   if (absl::GetFlag(FLAGS_sandbox_disable_all_stack_traces)) {
     return "";
   }
@@ -277,6 +368,45 @@ std::string GetStackTrace(const Regs* regs, const Mounts& mounts,
     return "[ERROR (noregs)]";
   }
 
+  if (UseUnsafeUnwinding()) {
+    return UnsafeGetStackTrace(regs->pid(), delim);
+  }
+  UnwindResult res;
+
+  if (!StackTracePeer::RunLibunwindSandbox(this, pid, {regs}, delim, &res)) {
+    return "";
+  }
+  return res.stacktrace();
+}
+
+std::vector<std::string> StackTraceCollector::CollectThreads(
+    pid_t pid, const std::vector<const Regs*>& regs,
+    const std::string& delim) {
+  std::vector<std::string> stack_traces(regs.size());
+  if (absl::GetFlag(FLAGS_sandbox_disable_all_stack_traces) || regs.empty()) {
+    return stack_traces;
+  }
+  if (regs.size() == 1) {
+    stack_traces[0] = Collect(pid, regs[0], delim);
+    return stack_traces;
+  }
+  if (UseUnsafeUnwinding()) {
+    for (size_t i = 0; i < regs.size(); ++i) {
+      stack_traces[i] = UnsafeGetStackTrace(regs[i]->pid(), delim);
+    }
+    return stack_traces;
+  }
+  UnwindResult res;
+  if (!StackTracePeer::RunLibunwindSandbox(this, pid, regs, delim, &res)) {
+    return stack_traces;
+  }
+  for (size_t i = 0; i < regs.size(); ++i) {
+    stack_traces[i] = res.threads(i).stacktrace();
+  }
+  return stack_traces;
+}
+
+bool StackTraceCollector::UseUnsafeUnwinding() {
 #if defined(THREAD_SANITIZER) || defined(ADDRESS_SANITIZER) || \
     defined(MEMORY_SANITIZER)
   constexpr bool kSanitizerEnabled = true;
@@ -295,18 +425,14 @@ std::string GetStackTrace(const Regs* regs, const Mounts& mounts,
         << "Sanitizer build, using non-sandboxed libunwind";
     LOG_IF(WARNING, coverage_enabled)
         << "Coverage build, using non-sandboxed libunwind";
-    return UnsafeGetStackTrace(regs->pid(), delim);
-  }
-
-  if (!absl::GetFlag(FLAGS_sandbox_libunwind_crash_handler)) {
-    return UnsafeGetStackTrace(regs->pid(), delim);
+    return true;
   }
-  UnwindResult res;
+  return !absl::GetFlag(FLAGS_sandbox_libunwind_crash_handler);
+}
 
-  if (!StackTracePeer::LaunchLibunwindSandbox(regs, mounts, &res, delim)) {
-    return "";
-  }
-  return res.stacktrace();
+std::string GetStackTrace(const Regs* regs, const Mounts& mounts,
+                          const std::string& delim) {
+  return StackTraceCollector(mounts).Collect(regs, delim);
 }
 
 std::string UnsafeGetStackTrace(pid_t pid, const std::string& delim) {
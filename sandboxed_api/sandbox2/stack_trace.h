@@ -23,6 +23,7 @@
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "sandboxed_api/sandbox2/mounts.h"
 #include "sandboxed_api/sandbox2/policy.h"
@@ -34,7 +35,61 @@ namespace sandbox2 {
 // Maximum depth of analyzed call stack.
 constexpr size_t kDefaultMaxFrames = 200;
 
+class Comms;
+class Sandbox2;
+
+// Collects stack traces of one process at a time. The libunwind sandbox is
+// started on first use and kept running for later requests regarding the same
+// process, which also keeps the symbol tables it parsed. Not thread-safe.
+class StackTraceCollector final {
+ public:
+  // 'mounts' is the mount tree of the sandboxee, it has to outlive the
+  // collector.
+  explicit StackTraceCollector(const Mounts& mounts);
+
+  StackTraceCollector(const StackTraceCollector&) = delete;
+  StackTraceCollector& operator=(const StackTraceCollector&) = delete;
+
+  // Stops the libunwind sandbox, if running.
+  ~StackTraceCollector();
+
+  // Returns the stack-trace of the PID=regs->pid(), delimited by the delim
+  // argument.
+  std::string Collect(const Regs* regs, const std::string& delim = " ");
+
+  // Same as above, where 'regs' belong to any thread of the process 'pid'. All
+  // threads of a process share the libunwind sandbox.
+  std::string Collect(pid_t pid, const Regs* regs,
+                      const std::string& delim = " ");
+
+  // Returns the stack traces of several threads of the process 'pid', in the
+  // order of 'regs'. They are unwound concurrently in a single request to the
+  // libunwind sandbox. Failed traces are empty.
+  std::vector<std::string> CollectThreads(pid_t pid,
+                                          const std::vector<const Regs*>& regs,
+                                          const std::string& delim = " ");
+
+ private:
+  friend class StackTracePeer;
+
+  // Stops the libunwind sandbox and removes its temporary files.
+  void Shutdown();
+
+  // Returns whether the unwinding has to happen outside of the libunwind
+  // sandbox, as requested by the flags or forced by the build.
+  static bool UseUnsafeUnwinding();
+
+  const Mounts& mounts_;
+  // Process the libunwind sandbox has been started for.
+  pid_t pid_ = -1;
+  std::unique_ptr<Sandbox2> sandbox_;
+  Comms* comms_ = nullptr;
+  // Directory providing files from /proc to the libunwind sandbox.
+  std::string temp_directory_;
+};
+
 // Returns the stack-trace of the PID=pid, delimited by the delim argument.
+// Uses a libunwind sandbox just for this call, see StackTraceCollector.
 std::string GetStackTrace(const Regs* regs, const Mounts& mounts,
                           const std::string& delim = " ");
 
@@ -15,6 +15,7 @@
 #include "sandboxed_api/sandbox2/stack_trace.h"
 
 #include <dirent.h>
+#include <syscall.h>
 
 #include <cstdio>
 #include <utility>
@@ -25,6 +26,7 @@
 #include "absl/memory/memory.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/global_forkclient.h"
 #include "sandboxed_api/sandbox2/policy.h"
@@ -41,7 +43,9 @@ ABSL_DECLARE_FLAG(bool, sandbox_libunwind_crash_handler);
 
 using ::testing::Eq;
 using ::testing::HasSubstr;
+using ::testing::IsEmpty;
 using ::testing::Not;
+using ::testing::SizeIs;
 
 namespace sandbox2 {
 namespace {
@@ -190,5 +194,79 @@ TEST(StackTraceTest, SymbolizationTrustedFilesOnly) {
   ASSERT_THAT(result.GetStackTrace(), Not(HasSubstr("CrashMe")));
 }
 
+// Test that no stack trace is collected for crashes which are not sampled.
+TEST(StackTraceTest, UnsampledCrashHasNoStackTrace) {
+  const std::string path = GetTestSourcePath("sandbox2/testcases/symbolize");
+  std::vector<std::string> args = {path, "1"};
+  auto executor = absl::make_unique<Executor>(path, args);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder{}
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .AddFile(path)
+                                        .AddLibrariesForBinary(path)
+                                        .SampleStacktraces(0)
+                                        .TryBuild());
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::SIGNALED));
+  EXPECT_THAT(result.GetStackTrace(), IsEmpty());
+  EXPECT_THAT(result.GetProcMaps(), IsEmpty());
+}
+
+// Test that the other threads are unwound together with the violating one.
+TEST(StackTraceTest, CollectsStacktracesOfAllThreads) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  TemporaryFlagOverride<bool> temp_override(
+      &FLAGS_sandbox_libunwind_crash_handler, true);
+  const std::string path = GetTestSourcePath("sandbox2/testcases/symbolize");
+  std::vector<std::string> args = {path, "3"};
+  auto executor = absl::make_unique<Executor>(path, args);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder{}
+                                        .AddPolicyOnSyscall(__NR_personality,
+                                                            {SANDBOX2_TRACE})
+                                        .DangerDefaultAllowAll()
+                                        .AddFile(path)
+                                        .AddLibrariesForBinary(path)
+                                        .CollectStacktracesOfAllThreads(true)
+                                        .TryBuild());
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  auto result = s2.Run();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::VIOLATION));
+  EXPECT_THAT(result.GetStackTrace(), HasSubstr("ViolateMe"));
+  ASSERT_THAT(result.GetThreadStackTraces(), SizeIs(2));
+  for (const auto& thread_stack_trace : result.GetThreadStackTraces()) {
+    EXPECT_THAT(thread_stack_trace.second, HasSubstr("WaitInThread"));
+  }
+}
+
+// Test that the stacks of a running sandboxee are sampled.
+TEST(StackTraceTest, StackSamplingWorks) {
+  SKIP_SANITIZERS_AND_COVERAGE;
+  TemporaryFlagOverride<bool> temp_override(
+      &FLAGS_sandbox_libunwind_crash_handler, true);
+  const std::string path = GetTestSourcePath("sandbox2/testcases/sleep");
+  std::vector<std::string> args = {path};
+  auto executor = absl::make_unique<Executor>(path, args);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto policy, PolicyBuilder{}
+                                        // Don't restrict the syscalls at all.
+                                        .DangerDefaultAllowAll()
+                                        .AddFile(path)
+                                        .TryBuild());
+
+  Sandbox2 s2(std::move(executor), std::move(policy));
+  s2.EnableStackSampling(absl::Milliseconds(10));
+  s2.RunAsync();
+  s2.SetWallTimeLimit(absl::Milliseconds(500));
+  auto result = s2.AwaitResult();
+
+  ASSERT_THAT(result.final_status(), Eq(Result::TIMEOUT));
+  ASSERT_THAT(result.GetStackSamples(), Not(IsEmpty()));
+  EXPECT_THAT(result.StackSamplesToString(), HasSubstr("main;"));
+}
+
 }  // namespace
 }  // namespace sandbox2
@@ -0,0 +1,42 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "sandboxed_api/sandbox2/startup_times.h"
+
+#include <time.h>
+
+#include "absl/time/clock.h"
+
+namespace sandbox2 {
+
+SandboxeeStartupTimes* GetSandboxeeStartupTimes() {
+  static SandboxeeStartupTimes times;
+  return &times;
+}
+
+int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return absl::ToInt64Nanoseconds(absl::DurationFromTimespec(ts));
+}
+
+absl::Time MonotonicNanosToTime(int64_t nanos) {
+  if (nanos == 0) {
+    return absl::InfinitePast();
+  }
+  return absl::Now() - absl::Nanoseconds(MonotonicNanos() - nanos);
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,56 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Timestamps taken in the sandboxee while it is being set up, see
+// sandbox2::Result::StartupTimes.
+
+#ifndef SANDBOXED_API_SANDBOX2_STARTUP_TIMES_H_
+#define SANDBOXED_API_SANDBOX2_STARTUP_TIMES_H_
+
+#include <cstdint>
+
+#include "absl/time/time.h"
+
+namespace sandbox2 {
+
+// Times recorded by the fork server in the child process, before the client
+// code takes over. Values are nanoseconds of CLOCK_MONOTONIC, which is shared
+// between the sandboxee and the monitor, or 0 if not recorded. The struct is
+// sent to the monitor as is, together with the ready message.
+struct SandboxeeStartupTimes {
+  // The child was cloned from the fork server.
+  int64_t clone = 0;
+  // File descriptors and environment of the child were sanitized.
+  int64_t sanitization = 0;
+  // Namespaces were set up, not counting the mount tree.
+  int64_t namespaces = 0;
+  // The mount tree was created and the child pivoted into it.
+  int64_t mounts = 0;
+};
+
+// Returns the start-up times of the current process. Not thread-safe, only
+// meant to be used in the single-threaded child of the fork server.
+SandboxeeStartupTimes* GetSandboxeeStartupTimes();
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds.
+int64_t MonotonicNanos();
+
+// Converts a time returned by MonotonicNanos() to absl::Time. Returns
+// absl::InfinitePast() for 0.
+absl::Time MonotonicNanosToTime(int64_t nanos);
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_STARTUP_TIMES_H_
@@ -89,6 +89,10 @@ const SyscallTable GetSyscallTable(Syscall::CpuArch arch) {
 
 }  // namespace
 
+int Syscall::GetSyscallNumber(CpuArch arch, absl::string_view name) {
+  return GetSyscallTable(arch).GetSyscallNumber(name);
+}
+
 std::string Syscall::GetName() const {
   const char* name = GetSyscallTable(arch_).GetEntry(nr_).name;
   if (name == nullptr) {
@@ -97,6 +101,10 @@ std::string Syscall::GetName() const {
   return name;
 }
 
+int Syscall::GetNumArgs() const {
+  return GetSyscallTable(arch_).GetEntry(nr_).GetNumArgs();
+}
+
 std::vector<std::string> Syscall::GetArgumentsDescription() const {
   return GetSyscallTable(arch_).GetEntry(nr_).GetArgumentsDescription(
       args_.data(), pid_);
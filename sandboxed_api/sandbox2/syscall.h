@@ -26,6 +26,8 @@
 #include <string>
 #include <vector>
 
+#include "absl/strings/string_view.h"
+
 namespace sandbox2 {
 
 class Syscall {
@@ -53,6 +55,9 @@ class Syscall {
   // Returns a description of the architecture.
   static std::string GetArchDescription(CpuArch arch);
 
+  // Returns the number of the syscall 'name' of 'arch', or -1 if unknown.
+  static int GetSyscallNumber(CpuArch arch, absl::string_view name);
+
   Syscall() = default;
   Syscall(CpuArch arch, uint64_t nr, Args args = {})
       : arch_(arch), nr_(nr), args_(args) {}
@@ -66,10 +71,14 @@ class Syscall {
 
   std::string GetName() const;
 
+  // Returns the number of arguments the syscall takes, kMaxArgs if unknown.
+  int GetNumArgs() const;
+
   std::vector<std::string> GetArgumentsDescription() const;
   std::string GetDescription() const;
 
  private:
+  friend class Monitor;
   friend class Regs;
 
   Syscall(pid_t pid) : pid_(pid) {}
@@ -1,6 +1,7 @@
 #include "sandboxed_api/sandbox2/syscall_defs.h"
 
 #include <glog/logging.h>
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
@@ -48,6 +49,53 @@ std::vector<std::string> SyscallTable::Entry::GetArgumentsDescription(
   return rv;
 }
 
+namespace {
+
+using NameIndex = absl::flat_hash_map<absl::string_view, int>;
+
+// Maps the names of 'data' to their numbers. The first of duplicate names
+// wins.
+const NameIndex* BuildNameIndex(absl::Span<const SyscallTable::Entry> data) {
+  auto* index = new NameIndex(data.size());
+  for (size_t nr = 0; nr < data.size(); ++nr) {
+    if (data[nr].name != nullptr) {
+      index->emplace(data[nr].name, static_cast<int>(nr));
+    }
+  }
+  return index;
+}
+
+}  // namespace
+
+int SyscallTable::GetSyscallNumber(absl::string_view name) const {
+  const NameIndex* index = nullptr;
+#if defined(__x86_64__)
+  if (data_.data() == kSyscallDataX8664.data()) {
+    static const NameIndex* x86_64_index = BuildNameIndex(kSyscallDataX8664);
+    index = x86_64_index;
+  } else if (data_.data() == kSyscallDataX8632.data()) {
+    static const NameIndex* x86_32_index = BuildNameIndex(kSyscallDataX8632);
+    index = x86_32_index;
+  }
+#elif defined(__powerpc64__)
+  if (data_.data() == kSyscallDataPPC64.data()) {
+    static const NameIndex* ppc64_index = BuildNameIndex(kSyscallDataPPC64);
+    index = ppc64_index;
+  }
+#endif
+  if (index != nullptr) {
+    auto it = index->find(name);
+    return it != index->end() ? it->second : -1;
+  }
+  // Tables of no architecture are not worth an index.
+  for (size_t nr = 0; nr < data_.size(); ++nr) {
+    if (data_[nr].name != nullptr && name == data_[nr].name) {
+      return static_cast<int>(nr);
+    }
+  }
+  return -1;
+}
+
 // TODO(wiktorg): Rewrite it without macros - might be easier after C++17 switch
 #define SYSCALL_HELPER(n, name, arg1, arg2, arg3, arg4, arg5, arg6, ...) \
   {                                                                      \
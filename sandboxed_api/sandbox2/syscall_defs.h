@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 
+#include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 
 namespace sandbox2 {
@@ -71,6 +72,10 @@ class SyscallTable {
     return invalid_entry;
   }
 
+  // Returns the number of the syscall 'name', or -1 if there is none. Names
+  // are looked up in a hash index built on first use.
+  int GetSyscallNumber(absl::string_view name) const;
+
  private:
   const absl::Span<const Entry> data_;
 };
@@ -56,6 +56,19 @@ TEST(SyscallTest, Empty) {
   EXPECT_THAT(syscall.arch(), Eq(Syscall::kUnknown));
   EXPECT_THAT(syscall.GetName(), StartsWith("UNKNOWN"));
   EXPECT_THAT(syscall.GetArgumentsDescription().size(), Eq(Syscall::kMaxArgs));
+  EXPECT_THAT(syscall.GetNumArgs(), Eq(Syscall::kMaxArgs));
+}
+
+TEST(SyscallTest, GetSyscallNumber) {
+  const Syscall::CpuArch arch = Syscall::GetHostArch();
+  EXPECT_THAT(Syscall::GetSyscallNumber(arch, "read"), Eq(__NR_read));
+  EXPECT_THAT(Syscall::GetSyscallNumber(arch, "exit_group"),
+              Eq(__NR_exit_group));
+  EXPECT_THAT(Syscall(arch, __NR_mmap).GetName(), Eq("mmap"));
+  EXPECT_THAT(Syscall(arch, __NR_mmap).GetNumArgs(), Eq(6));
+  EXPECT_THAT(Syscall::GetSyscallNumber(arch, "mmap"), Eq(__NR_mmap));
+  EXPECT_THAT(Syscall::GetSyscallNumber(arch, "no_such_syscall"), Eq(-1));
+  EXPECT_THAT(Syscall::GetSyscallNumber(Syscall::kUnknown, "read"), Eq(-1));
 }
 
 }  // namespace
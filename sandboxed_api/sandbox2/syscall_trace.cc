@@ -0,0 +1,247 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::SyscallTrace class.
+
+#include "sandboxed_api/sandbox2/syscall_trace.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+
+namespace sandbox2 {
+namespace {
+
+constexpr char kTracePrefix[] = "TRACE";
+
+struct ArgClassLetter {
+  SyscallTrace::ArgClass arg_class;
+  char letter;
+};
+
+constexpr ArgClassLetter kArgClassLetters[] = {
+    {SyscallTrace::kZero, 'z'},
+    {SyscallTrace::kSmall, 's'},
+    {SyscallTrace::kNegative, 'n'},
+    {SyscallTrace::kLarge, 'l'},
+};
+
+std::string ArgClassesToString(const SyscallTrace::Entry& entry) {
+  if (entry.num_args == 0) {
+    return "-";
+  }
+  std::vector<std::string> args;
+  for (int i = 0; i < entry.num_args; ++i) {
+    std::string arg;
+    for (const auto& letter : kArgClassLetters) {
+      if (entry.arg_classes[i] & letter.arg_class) {
+        arg += letter.letter;
+      }
+    }
+    args.push_back(arg);
+  }
+  return absl::StrJoin(args, ",");
+}
+
+bool ParseArgClasses(absl::string_view field, SyscallTrace::Entry* entry) {
+  entry->num_args = 0;
+  entry->arg_classes = {};
+  if (field == "-") {
+    return true;
+  }
+  for (absl::string_view arg : absl::StrSplit(field, ',')) {
+    if (entry->num_args == Syscall::kMaxArgs) {
+      return false;
+    }
+    for (char c : arg) {
+      auto letter = std::find_if(
+          std::begin(kArgClassLetters), std::end(kArgClassLetters),
+          [c](const ArgClassLetter& l) { return l.letter == c; });
+      if (letter == std::end(kArgClassLetters)) {
+        return false;
+      }
+      entry->arg_classes[entry->num_args] |= letter->arg_class;
+    }
+    ++entry->num_args;
+  }
+  return true;
+}
+
+bool ParseArch(absl::string_view description, Syscall::CpuArch* arch) {
+  for (Syscall::CpuArch candidate :
+       {Syscall::kX86_64, Syscall::kX86_32, Syscall::kPPC_64}) {
+    if (Syscall::GetArchDescription(candidate) == description) {
+      *arch = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the __NR_ constant of the syscall, or its number if the name is not
+// known.
+std::string SyscallConstant(uint64_t nr, const SyscallTrace::Entry& entry) {
+  if (entry.name.empty() || absl::StartsWith(entry.name, "UNKNOWN")) {
+    return absl::StrCat(nr);
+  }
+  return absl::StrCat("__NR_", entry.name);
+}
+
+}  // namespace
+
+SyscallTrace::ArgClass SyscallTrace::Classify(uint64_t value) {
+  if (value == 0) {
+    return kZero;
+  }
+  if (value <= 0xffff) {
+    return kSmall;
+  }
+  if (static_cast<int64_t>(value) < 0 && static_cast<int64_t>(value) >= -4095) {
+    return kNegative;
+  }
+  return kLarge;
+}
+
+void SyscallTrace::Add(const Syscall& syscall) {
+  Entry& entry = entries_[Key(syscall.arch(), syscall.nr())];
+  if (entry.count == 0) {
+    entry.name = syscall.GetName();
+    entry.num_args = syscall.GetNumArgs();
+  }
+  ++entry.count;
+  for (int i = 0; i < entry.num_args; ++i) {
+    entry.arg_classes[i] |= Classify(syscall.args()[i]);
+  }
+}
+
+void SyscallTrace::Merge(const SyscallTrace& other) {
+  for (const auto& other_entry : other.entries_) {
+    Entry& entry = entries_[other_entry.first];
+    if (entry.count == 0) {
+      entry.name = other_entry.second.name;
+      entry.num_args = other_entry.second.num_args;
+    }
+    entry.count += other_entry.second.count;
+    for (int i = 0; i < entry.num_args; ++i) {
+      entry.arg_classes[i] |= other_entry.second.arg_classes[i];
+    }
+  }
+}
+
+std::string SyscallTrace::ToString() const {
+  std::string out;
+  for (const auto& entry : entries_) {
+    absl::StrAppendFormat(&out, "%s %s %d %s %d %s\n", kTracePrefix,
+                          Syscall::GetArchDescription(entry.first.first),
+                          entry.first.second, entry.second.name,
+                          entry.second.count,
+                          ArgClassesToString(entry.second));
+  }
+  return out;
+}
+
+int SyscallTrace::Parse(absl::string_view contents) {
+  int parsed = 0;
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    if (fields.size() != 6 || fields[0] != kTracePrefix) {
+      continue;
+    }
+    Key key;
+    Entry line_entry;
+    if (!ParseArch(fields[1], &key.first) ||
+        !absl::SimpleAtoi(fields[2], &key.second) ||
+        !absl::SimpleAtoi(fields[4], &line_entry.count) ||
+        !ParseArgClasses(fields[5], &line_entry)) {
+      continue;
+    }
+    line_entry.name = std::string(fields[3]);
+    SyscallTrace line_trace;
+    line_trace.entries_[key] = std::move(line_entry);
+    Merge(line_trace);
+    ++parsed;
+  }
+  return parsed;
+}
+
+std::string SyscallTrace::ToPolicySnippet(Syscall::CpuArch arch) const {
+  // Runs of consecutive syscall numbers, in the order of the numbers.
+  struct Range {
+    std::vector<std::pair<uint64_t, const Entry*>> syscalls;
+    uint64_t count = 0;
+  };
+  std::vector<Range> ranges;
+  uint64_t total = 0;
+  for (const auto& entry : entries_) {
+    if (entry.first.first != arch) {
+      continue;
+    }
+    const uint64_t nr = entry.first.second;
+    if (ranges.empty() || ranges.back().syscalls.back().first + 1 != nr) {
+      ranges.emplace_back();
+    }
+    ranges.back().syscalls.emplace_back(nr, &entry.second);
+    ranges.back().count += entry.second.count;
+    total += entry.second.count;
+  }
+  std::stable_sort(ranges.begin(), ranges.end(),
+                   [](const Range& a, const Range& b) {
+                     return a.count > b.count;
+                   });
+
+  std::vector<std::pair<uint64_t, const Entry*>> by_count;
+  std::string out = absl::StrFormat(
+      "    // Synthesized from %d traced syscalls of %s. Tracing only sees\n"
+      "    // the code paths which ran, review before use.\n"
+      "    .AllowSyscalls({\n",
+      total, Syscall::GetArchDescription(arch));
+  for (const Range& range : ranges) {
+    if (range.syscalls.size() > 1) {
+      absl::StrAppendFormat(&out, "        // %d-%d, %d calls\n",
+                            range.syscalls.front().first,
+                            range.syscalls.back().first, range.count);
+    }
+    for (const auto& syscall : range.syscalls) {
+      absl::StrAppendFormat(&out, "        %s,  // %d calls, args %s\n",
+                            SyscallConstant(syscall.first, *syscall.second),
+                            syscall.second->count,
+                            ArgClassesToString(*syscall.second));
+      by_count.push_back(syscall);
+    }
+  }
+  out += "    })\n";
+
+  std::stable_sort(by_count.begin(), by_count.end(),
+                   [](const std::pair<uint64_t, const Entry*>& a,
+                      const std::pair<uint64_t, const Entry*>& b) {
+                     return a.second->count > b.second->count;
+                   });
+  out += "    .OrderSyscallsByFrequency({\n";
+  for (const auto& syscall : by_count) {
+    absl::StrAppendFormat(&out, "        {%s, %d},\n",
+                          SyscallConstant(syscall.first, *syscall.second),
+                          syscall.second->count);
+  }
+  out += "    })\n";
+  return out;
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,92 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::SyscallTrace class aggregates the syscalls of a sandboxee run
+// with --sandbox2_danger_danger_permit_all_and_log, and turns them into a
+// minimal policy.
+
+#ifndef SANDBOXED_API_SANDBOX2_SYSCALL_TRACE_H_
+#define SANDBOXED_API_SANDBOX2_SYSCALL_TRACE_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+
+namespace sandbox2 {
+
+class SyscallTrace {
+ public:
+  // Classes of argument values, an argument records all classes it was seen
+  // with as a bit mask.
+  enum ArgClass : uint8_t {
+    kZero = 1 << 0,
+    // 1 to 0xffff, like file descriptors, flags and sizes.
+    kSmall = 1 << 1,
+    // -4095 to -1, like AT_FDCWD.
+    kNegative = 1 << 2,
+    // Anything else, mostly pointers.
+    kLarge = 1 << 3,
+  };
+
+  struct Entry {
+    std::string name;
+    uint64_t count = 0;
+    int num_args = 0;
+    std::array<uint8_t, Syscall::kMaxArgs> arg_classes = {};
+  };
+
+  using Key = std::pair<Syscall::CpuArch, uint64_t>;
+
+  // Returns the class of the argument value 'value'.
+  static ArgClass Classify(uint64_t value);
+
+  // Counts 'syscall'.
+  void Add(const Syscall& syscall);
+
+  // Adds up the entries of 'other'.
+  void Merge(const SyscallTrace& other);
+
+  // Returns one line per syscall, like
+  //   "TRACE X86-64 0 read 120 s,l,s"
+  // with the architecture, number, name and count of the syscall, followed by
+  // the classes of each of its arguments ('z', 's', 'n' and 'l' for kZero,
+  // kSmall, kNegative and kLarge), or '-' if it takes no arguments.
+  std::string ToString() const;
+
+  // Adds up the entries of the TRACE lines in 'contents', such as a log file
+  // of --sandbox2_danger_danger_permit_all_and_log. Other lines are ignored.
+  // Returns the number of lines parsed.
+  int Parse(absl::string_view contents);
+
+  // Returns PolicyBuilder calls allowing the syscalls of 'arch', to be pasted
+  // into a policy. Ranges of consecutive syscall numbers, which the compiled
+  // policy checks with a single comparison, are listed together, and the
+  // ranges are ordered by their number of calls.
+  std::string ToPolicySnippet(Syscall::CpuArch arch) const;
+
+  const std::map<Key, Entry>& entries() const { return entries_; }
+  bool empty() const { return entries_.empty(); }
+
+ private:
+  std::map<Key, Entry> entries_;
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_SYSCALL_TRACE_H_
@@ -0,0 +1,85 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/syscall_trace.h"
+
+#include <linux/unistd.h>
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/syscall.h"
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::Lt;
+using ::testing::Ne;
+
+namespace sandbox2 {
+namespace {
+
+TEST(SyscallTraceTest, Classify) {
+  EXPECT_THAT(SyscallTrace::Classify(0), Eq(SyscallTrace::kZero));
+  EXPECT_THAT(SyscallTrace::Classify(3), Eq(SyscallTrace::kSmall));
+  EXPECT_THAT(SyscallTrace::Classify(-100), Eq(SyscallTrace::kNegative));
+  EXPECT_THAT(SyscallTrace::Classify(0x7ffd12345678),
+              Eq(SyscallTrace::kLarge));
+}
+
+TEST(SyscallTraceTest, ToStringAndParse) {
+  const Syscall::CpuArch arch = Syscall::GetHostArch();
+  SyscallTrace trace;
+  trace.Add(Syscall(arch, __NR_read, {3, 0x7ffd12345678, 4096}));
+  trace.Add(Syscall(arch, __NR_read, {0, 0x7ffd12345678, 0x100000}));
+  trace.Add(Syscall(arch, __NR_getpid));
+
+  const std::string lines = trace.ToString();
+  EXPECT_THAT(lines, HasSubstr(" read 2 zs,l,sl\n"));
+  EXPECT_THAT(lines, HasSubstr(" getpid 1 -\n"));
+
+  SyscallTrace parsed;
+  EXPECT_THAT(parsed.Parse("PID: 1 [X86-64] read [0](...)\n" + lines + lines),
+              Eq(4));
+  const SyscallTrace::Entry& read =
+      parsed.entries().at(SyscallTrace::Key(arch, __NR_read));
+  EXPECT_THAT(read.count, Eq(4));
+  EXPECT_THAT(read.num_args, Eq(3));
+  EXPECT_THAT(read.arg_classes[0],
+              Eq(SyscallTrace::kZero | SyscallTrace::kSmall));
+}
+
+TEST(SyscallTraceTest, PolicySnippet) {
+  const Syscall::CpuArch arch = Syscall::GetHostArch();
+  SyscallTrace trace;
+  for (int i = 0; i < 3; ++i) {
+    trace.Add(Syscall(arch, __NR_getpid));
+  }
+  trace.Add(Syscall(arch, __NR_read));
+  trace.Add(Syscall(arch, __NR_write));
+
+  const std::string snippet = trace.ToPolicySnippet(arch);
+  // read and write are consecutive, and checked as one range.
+  EXPECT_THAT(snippet, HasSubstr(absl::StrCat("// ", __NR_read, "-",
+                                              __NR_write, ", 2 calls")));
+  EXPECT_THAT(snippet, HasSubstr("{__NR_getpid, 3},"));
+  EXPECT_THAT(snippet.find("__NR_getpid,"), Ne(std::string::npos));
+  EXPECT_THAT(snippet.find("__NR_getpid,"), Lt(snippet.find("__NR_read,")));
+  EXPECT_THAT(trace.ToPolicySnippet(Syscall::kUnknown),
+              HasSubstr("from 0 traced syscalls"));
+}
+
+}  // namespace
+}  // namespace sandbox2
@@ -0,0 +1,40 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A binary with more than two huge pages of code, which it moves onto huge
+// pages, see forkingclient_test.cc.
+
+#include <cstdlib>
+
+#include "absl/base/attributes.h"
+#include "sandboxed_api/sandbox2/forkingclient.h"
+
+// Placed among the code, so that the executable mapping of the binary spans
+// at least one 2 MiB aligned huge page.
+__attribute__((used, section(".text.huge_page_padding")))
+const char kPadding[6 << 20] = {1};
+
+ABSL_ATTRIBUTE_NOINLINE int Triple(int value) { return 3 * value; }
+
+int main(int argc, char** argv) {
+  if (!sandbox2::ForkingClient::RemapTextOnHugePages().ok()) {
+    return 1;
+  }
+  // The code runs on from the remapped pages, with the same contents.
+  const volatile char* padding = kPadding;
+  if (Triple(padding[0]) != 3 || padding[3 << 20] != 0) {
+    return 2;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A binary that serves jobs with Client::RunJobLoop(), see job_runner_test.cc.
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "sandboxed_api/sandbox2/client.h"
+#include "sandboxed_api/sandbox2/comms.h"
+
+int main(int argc, char** argv) {
+  sandbox2::Comms comms(sandbox2::Comms::kSandbox2ClientCommsFD);
+  sandbox2::Client client(&comms);
+  client.SandboxMeHere();
+
+  // State kept across jobs, unless they are isolated.
+  int32_t count = 0;
+  client.RunJobLoop([&count](const sandbox2::Client::Job& job) -> int32_t {
+    const std::string command(job.data.begin(), job.data.end());
+    if (command == "count") {
+      return ++count;
+    }
+    if (command == "crash") {
+      abort();
+    }
+    if (command == "exit") {
+      // Exits cleanly without returning a result.
+      exit(EXIT_SUCCESS);
+    }
+    // Echoes the command to the fd passed with the job.
+    int32_t written = 0;
+    if (!job.fds.empty()) {
+      written = write(job.fds[0], command.data(), command.size());
+      close(job.fds[0]);
+    }
+    return written;
+  });
+  return EXIT_SUCCESS;
+}
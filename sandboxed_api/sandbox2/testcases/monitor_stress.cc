@@ -0,0 +1,138 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Loads the sandbox monitor: forks processes, each of which starts threads
+// that all call getppid(), which the policy traces, in a loop. Prints the
+// number of syscalls, the sum and the maximum of their latencies and the wall
+// time, in nanoseconds.
+//
+// Usage: monitor_stress processes threads syscalls_per_thread
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+// Shared by all processes of the sandboxee.
+struct Stats {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> total_nanos;
+  std::atomic<uint64_t> max_nanos;
+};
+
+Stats* g_stats;
+int64_t g_syscalls_per_thread;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void* TracedSyscalls(void*) {
+  uint64_t total = 0;
+  uint64_t max = 0;
+  for (int64_t i = 0; i < g_syscalls_per_thread; ++i) {
+    const int64_t start = NowNanos();
+    syscall(__NR_getppid);
+    const uint64_t nanos = NowNanos() - start;
+    total += nanos;
+    if (nanos > max) {
+      max = nanos;
+    }
+  }
+  g_stats->count.fetch_add(g_syscalls_per_thread);
+  g_stats->total_nanos.fetch_add(total);
+  uint64_t old_max = g_stats->max_nanos.load();
+  while (old_max < max &&
+         !g_stats->max_nanos.compare_exchange_weak(old_max, max)) {
+  }
+  return nullptr;
+}
+
+// Runs 'threads' threads of TracedSyscalls() and waits for them.
+bool RunThreads(int threads) {
+  std::vector<pthread_t> tids(threads);
+  for (int i = 0; i < threads; ++i) {
+    if (pthread_create(&tids[i], nullptr, TracedSyscalls, nullptr) != 0) {
+      return false;
+    }
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(tids[i], nullptr);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s processes threads syscalls_per_thread\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int processes = atoi(argv[1]);
+  const int threads = atoi(argv[2]);
+  g_syscalls_per_thread = strtoll(argv[3], nullptr, 10);
+  if (processes < 1 || threads < 1) {
+    return EXIT_FAILURE;
+  }
+  g_stats = static_cast<Stats*>(mmap(nullptr, sizeof(Stats),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  if (g_stats == MAP_FAILED) {
+    return EXIT_FAILURE;
+  }
+
+  const int64_t start = NowNanos();
+  // All children are forked at once, before any of them is done.
+  for (int i = 1; i < processes; ++i) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      _exit(RunThreads(threads) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  bool ok = RunThreads(threads);
+  for (int i = 1; i < processes; ++i) {
+    int status;
+    ok = wait(&status) != -1 && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS && ok;
+  }
+  const long long wall_nanos = NowNanos() - start;  // NOLINT
+
+  // Written without stdio, which would fstat() stdout first.
+  char buf[128];
+  const int len = snprintf(
+      buf, sizeof(buf), "%llu %llu %llu %lld\n",
+      static_cast<unsigned long long>(g_stats->count.load()),        // NOLINT
+      static_cast<unsigned long long>(g_stats->total_nanos.load()),  // NOLINT
+      static_cast<unsigned long long>(g_stats->max_nanos.load()),    // NOLINT
+      wall_nanos);
+  return ok && write(STDOUT_FILENO, buf, len) == len ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+}
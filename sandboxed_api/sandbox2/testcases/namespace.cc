@@ -25,6 +25,9 @@
 // ./binary 3 <uid> <gid>
 //    Make sure getuid()/getgid() returns the provided uid/gid (User namespace).
 //    Returns 0 on OK.
+// ./binary 4
+//    Make sure that we run as PID 1 of a PID namespace (no init process).
+//    Returns 0 on OK.
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -72,6 +75,12 @@ int main(int argc, char* argv[]) {
       }
     } break;
 
+    case 4: {
+      if (getpid() != 1) {
+        return -1;
+      }
+    } break;
+
     default:
       return 1;
   }
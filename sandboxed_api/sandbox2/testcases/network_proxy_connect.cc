@@ -0,0 +1,69 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A binary that connects to ports on the loopback address through the network
+// proxy, see network_proxy_test.cc.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "sandboxed_api/sandbox2/client.h"
+#include "sandboxed_api/sandbox2/comms.h"
+
+int main(int argc, char** argv) {
+  sandbox2::Comms comms(sandbox2::Comms::kSandbox2ClientCommsFD);
+  sandbox2::Client client(&comms);
+
+  // With "handler", the binary sandboxes itself and its connects go through
+  // the network proxy handler. Otherwise it was sandboxed before execve() and
+  // connect() is served through seccomp user notifications.
+  if (argc > 1 && strcmp(argv[1], "handler") == 0) {
+    client.SandboxMeHere();
+    if (!client.InstallNetworkProxyHandler().ok()) {
+      return 1;
+    }
+  }
+
+  // Connects to the ports the host sends until it sends 0, and replies with
+  // the errno of the connection, 0 if "hello" could be sent over it. Negative
+  // ports are connected to with a datagram socket.
+  int32_t port;
+  while (comms.RecvInt32(&port) && port != 0) {
+    int32_t result = 0;
+    int s = socket(AF_INET, port > 0 ? SOCK_STREAM : SOCK_DGRAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port > 0 ? port : -port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s == -1 ||
+        connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        write(s, "hello", 5) != 5) {
+      result = errno;
+    }
+    if (s != -1) {
+      close(s);
+    }
+    if (!comms.SendInt32(result)) {
+      return 2;
+    }
+  }
+  return EXIT_SUCCESS;
+}
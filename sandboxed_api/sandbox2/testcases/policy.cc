@@ -12,7 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// A binary that tries x86_64 compat syscalls, ptrace and clone untraced.
+// A binary that tries x86_64 compat syscalls, ptrace and clone untraced, and
+// one that leaves a grandchild behind.
 
 #include <sched.h>
 #include <sys/ptrace.h>
@@ -77,6 +78,19 @@ void TestBpf() {
   exit(EXIT_FAILURE);
 }
 
+void TestForkGrandchild() {
+  // The grandchild keeps stdout open until it gets killed.
+  if (fork() == 0) {
+    if (fork() == 0) {
+      for (;;) {
+        sleep(1000);
+      }
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  exit(EXIT_SUCCESS);
+}
+
 void TestIsatty() {
   isatty(0);
 
@@ -117,6 +131,9 @@ int main(int argc, char** argv) {
     case 6:
       TestIsatty();
       break;
+    case 7:
+      TestForkGrandchild();
+      break;
     default:
       printf("Unknown test: %d\n", testno);
       return EXIT_FAILURE;
@@ -0,0 +1,39 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A binary that checks the scheduling settings it was started with.
+// Usage: scheduling <policy> <nice>. Exits with 0 if sched_getscheduler()
+// returns <policy> and the nice value is <nice>.
+
+#include <sched.h>
+#include <sys/resource.h>
+
+#include <cerrno>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    return 3;
+  }
+  if (sched_getscheduler(0) != atoi(argv[1])) {
+    return 1;
+  }
+  // -1 is a valid nice value.
+  errno = 0;
+  const int nice = getpriority(PRIO_PROCESS, 0);
+  if (errno != 0 || nice != atoi(argv[2])) {
+    return 2;
+  }
+  return EXIT_SUCCESS;
+}
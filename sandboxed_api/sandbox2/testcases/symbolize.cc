@@ -16,12 +16,16 @@
 // to test the stack tracing symbolizer.
 
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <syscall.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 
 #include "absl/base/attributes.h"
 #include "absl/strings/numbers.h"
@@ -34,6 +38,32 @@ void CrashMe() {
   *null = 0;
 }
 
+ABSL_ATTRIBUTE_NOINLINE
+void WaitInThread(std::atomic<int>* started) {
+  ++*started;
+  for (;;) {
+    pause();
+  }
+}
+
+ABSL_ATTRIBUTE_NOINLINE
+void ViolateMe() {
+  // Traced by the policy of the test, reported as a violation.
+  syscall(__NR_personality, 0xffffffff);
+}
+
+// Violates the policy once two other threads are waiting, whose stacks are
+// unwound together with the violating one.
+void ViolateWithThreads() {
+  std::atomic<int> started(0);
+  std::thread(WaitInThread, &started).detach();
+  std::thread(WaitInThread, &started).detach();
+  while (started < 2) {
+    sched_yield();
+  }
+  ViolateMe();
+}
+
 void RunWritable() {
   int exe_fd = open("/proc/self/exe", O_RDONLY);
   SAPI_RAW_PCHECK(exe_fd >= 0, "Opening /proc/self/exe");
@@ -80,6 +110,9 @@ int main(int argc, char** argv) {
     case 2:
       RunWritable();
       break;
+    case 3:
+      ViolateWithThreads();
+      break;
     default:
       printf("Unknown test: %d\n", testno);
       return EXIT_FAILURE;
@@ -0,0 +1,67 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A custom fork server which prepares a zygote, see forkingclient_test.cc.
+// Each sandboxee checks the state preloaded by the zygote, overwrites it with
+// the value it receives and sends that back.
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/forkingclient.h"
+#include "sandboxed_api/util/raw_logging.h"
+
+constexpr int32_t kPreloadedValue = 42;
+
+// Spans several pages, all of which the sandboxees write.
+static std::vector<int32_t>* preloaded = nullptr;
+
+int main(int argc, char** argv) {
+  sandbox2::Comms comms(sandbox2::Comms::kSandbox2ClientCommsFD);
+  sandbox2::ForkingClient s2client(&comms);
+
+  sandbox2::ForkingClient::ZygoteOptions options;
+  options.preload = [] {
+    preloaded = new std::vector<int32_t>(1 << 16, kPreloadedValue);
+  };
+  options.merge_pages = true;
+  SAPI_RAW_CHECK(s2client.PrepareZygote(options).ok(), "Preparing the zygote");
+
+  for (;;) {
+    pid_t pid = s2client.WaitAndFork();
+    SAPI_RAW_CHECK(pid != -1, "Could not spawn a new sandboxee");
+    if (pid == 0) {
+      break;
+    }
+  }
+  s2client.SandboxMeHere();
+
+  int32_t value;
+  SAPI_RAW_CHECK(comms.RecvInt32(&value), "Receiving an int32_t");
+  // Whatever other sandboxees wrote must not show up here.
+  for (int32_t element : *preloaded) {
+    if (element != kPreloadedValue) {
+      return EXIT_FAILURE;
+    }
+  }
+  for (int32_t& element : *preloaded) {
+    element = value;
+  }
+  SAPI_RAW_CHECK(comms.SendInt32(preloaded->back()), "Sending an int32_t");
+  return EXIT_SUCCESS;
+}
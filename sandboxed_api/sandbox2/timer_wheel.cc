@@ -0,0 +1,156 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sandbox2::TimerWheel class.
+
+#include "sandboxed_api/sandbox2/timer_wheel.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace sandbox2 {
+
+constexpr int TimerWheel::kLevels;
+constexpr int TimerWheel::kSlotBits;
+constexpr uint64_t TimerWheel::kSlots;
+
+TimerWheel::TimerWheel(absl::Duration tick, absl::Time origin)
+    : tick_(tick), origin_(origin) {}
+
+uint64_t TimerWheel::ToTicksRoundedUp(absl::Time time) const {
+  if (time <= origin_) {
+    return 0;
+  }
+  absl::Duration rem;
+  uint64_t ticks = absl::IDivDuration(time - origin_, tick_, &rem);
+  return rem > absl::ZeroDuration() ? ticks + 1 : ticks;
+}
+
+uint64_t TimerWheel::ToTicksRoundedDown(absl::Time time) const {
+  if (time <= origin_) {
+    return 0;
+  }
+  absl::Duration rem;
+  return absl::IDivDuration(time - origin_, tick_, &rem);
+}
+
+absl::Time TimerWheel::FromTicks(uint64_t ticks) const {
+  return origin_ + tick_ * static_cast<int64_t>(ticks);
+}
+
+void TimerWheel::Schedule(uint64_t id, absl::Time deadline) {
+  Cancel(id);
+  if (deadline == absl::InfiniteFuture()) {
+    return;
+  }
+  Timer& timer = timers_[id];
+  timer.expiry = ToTicksRoundedUp(deadline);
+  Place(id, &timer);
+}
+
+void TimerWheel::Cancel(uint64_t id) {
+  auto it = timers_.find(id);
+  if (it == timers_.end()) {
+    return;
+  }
+  slots_[it->second.level][it->second.slot].erase(id);
+  --level_sizes_[it->second.level];
+  timers_.erase(it);
+}
+
+void TimerWheel::Place(uint64_t id, Timer* timer) {
+  // Timers that are due already fire with the next tick.
+  uint64_t expiry = std::max(timer->expiry, now_ + 1);
+  const uint64_t delta = expiry - now_;
+  int level = 0;
+  while (level < kLevels - 1 &&
+         delta >= (uint64_t{1} << (kSlotBits * (level + 1)))) {
+    ++level;
+  }
+  if (delta >= (uint64_t{1} << (kSlotBits * kLevels))) {
+    // Beyond the range of the wheels, park the timer in the farthest slot. It
+    // is placed again once that slot is reached.
+    expiry = now_ + (uint64_t{1} << (kSlotBits * kLevels)) - 1;
+  }
+  timer->level = level;
+  timer->slot = (expiry >> (kSlotBits * level)) & (kSlots - 1);
+  slots_[level][timer->slot].insert(id);
+  ++level_sizes_[level];
+}
+
+void TimerWheel::Tick(std::vector<uint64_t>* expired) {
+  ++now_;
+  // Slots of higher levels are moved down as soon as the rotation of the level
+  // below reaches them. Start with the highest level, so that its timers can
+  // move down more than one level in one go.
+  for (int level = kLevels - 1; level >= 0; --level) {
+    const int shift = kSlotBits * level;
+    if (level > 0 && (now_ & ((uint64_t{1} << shift) - 1)) != 0) {
+      continue;
+    }
+    auto& slot = slots_[level][(now_ >> shift) & (kSlots - 1)];
+    if (slot.empty()) {
+      continue;
+    }
+    level_sizes_[level] -= slot.size();
+    absl::flat_hash_set<uint64_t> ids;
+    ids.swap(slot);
+    for (uint64_t id : ids) {
+      auto it = timers_.find(id);
+      if (it->second.expiry <= now_) {
+        expired->push_back(id);
+        timers_.erase(it);
+      } else {
+        Place(id, &it->second);
+      }
+    }
+  }
+}
+
+std::vector<uint64_t> TimerWheel::Advance(absl::Time now) {
+  std::vector<uint64_t> expired;
+  const uint64_t target = ToTicksRoundedDown(now);
+  while (now_ < target) {
+    if (timers_.empty()) {
+      now_ = target;
+      break;
+    }
+    Tick(&expired);
+  }
+  return expired;
+}
+
+absl::Time TimerWheel::NextWakeUp() const {
+  if (timers_.empty()) {
+    return absl::InfiniteFuture();
+  }
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < kLevels; ++level) {
+    if (level_sizes_[level] == 0) {
+      continue;
+    }
+    // Each slot is processed at its start, the slot of now_ has been already.
+    const int shift = kSlotBits * level;
+    const uint64_t current = now_ >> shift;
+    for (uint64_t i = 1; i <= kSlots; ++i) {
+      if (!slots_[level][(current + i) & (kSlots - 1)].empty()) {
+        next = std::min(next, (current + i) << shift);
+        break;
+      }
+    }
+  }
+  return FromTicks(next);
+}
+
+}  // namespace sandbox2
@@ -0,0 +1,102 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox2::TimerWheel class keeps track of many deadlines at a fixed
+// granularity, see MonitorPool.
+
+#ifndef SANDBOXED_API_SANDBOX2_TIMER_WHEEL_H_
+#define SANDBOXED_API_SANDBOX2_TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/time/time.h"
+
+namespace sandbox2 {
+
+// Hierarchical timer wheel: kLevels wheels of kSlots slots each, where a slot
+// of one level spans a whole rotation of the level below. Scheduling and
+// cancelling a timer take constant time, and timers are moved to lower levels
+// as their deadline approaches. Timers never fire early, but up to one tick
+// late. Not thread-safe.
+//
+// Usage:
+//   TimerWheel wheel(absl::Milliseconds(1), absl::Now());
+//   wheel.Schedule(id, absl::Now() + absl::Milliseconds(50));
+//   ...
+//   for (uint64_t expired : wheel.Advance(absl::Now())) { ... }
+class TimerWheel final {
+ public:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 8;
+  static constexpr uint64_t kSlots = 1 << kSlotBits;
+
+  // Deadlines are rounded up to multiples of 'tick' after 'origin'.
+  TimerWheel(absl::Duration tick, absl::Time origin);
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Arms the timer 'id' for 'deadline', replacing its previous deadline.
+  void Schedule(uint64_t id, absl::Time deadline);
+
+  // Disarms the timer 'id', if armed.
+  void Cancel(uint64_t id);
+
+  // Moves the wheel forward to 'now' and returns the timers that expired on
+  // the way. Expired timers are disarmed.
+  std::vector<uint64_t> Advance(absl::Time now);
+
+  // Returns a time by which Advance() should be called next, no later than the
+  // earliest deadline. absl::InfiniteFuture() if no timer is armed.
+  absl::Time NextWakeUp() const;
+
+  size_t size() const { return timers_.size(); }
+  bool empty() const { return timers_.empty(); }
+
+ private:
+  struct Timer {
+    uint64_t expiry;  // In ticks.
+    int level;
+    uint64_t slot;
+  };
+
+  // Converts between absl::Time and ticks.
+  uint64_t ToTicksRoundedUp(absl::Time time) const;
+  uint64_t ToTicksRoundedDown(absl::Time time) const;
+  absl::Time FromTicks(uint64_t ticks) const;
+
+  // Puts 'id' into the slot matching the distance of its expiry to now_.
+  void Place(uint64_t id, Timer* timer);
+
+  // Advances now_ by one tick, appending expired timers to 'expired'.
+  void Tick(std::vector<uint64_t>* expired);
+
+  absl::Duration tick_;
+  absl::Time origin_;
+  // Current time in ticks, the timers of this tick have fired already.
+  uint64_t now_ = 0;
+
+  absl::flat_hash_map<uint64_t, Timer> timers_;
+  absl::flat_hash_set<uint64_t> slots_[kLevels][kSlots];
+  // Number of timers per level, to skip empty levels.
+  size_t level_sizes_[kLevels] = {};
+};
+
+}  // namespace sandbox2
+
+#endif  // SANDBOXED_API_SANDBOX2_TIMER_WHEEL_H_
@@ -0,0 +1,90 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/sandbox2/timer_wheel.h"
+
+#include <cstdint>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::UnorderedElementsAre;
+
+namespace sandbox2 {
+namespace {
+
+const absl::Time kOrigin = absl::FromUnixSeconds(1000);
+
+absl::Time At(int64_t millis) { return kOrigin + absl::Milliseconds(millis); }
+
+TEST(TimerWheelTest, FiresNeitherEarlyNorLate) {
+  TimerWheel wheel(absl::Milliseconds(1), kOrigin);
+  wheel.Schedule(1, At(50));
+  wheel.Schedule(2, At(50));
+  wheel.Schedule(3, At(51));
+
+  EXPECT_THAT(wheel.Advance(At(49)), IsEmpty());
+  EXPECT_THAT(wheel.NextWakeUp(), Eq(At(50)));
+  EXPECT_THAT(wheel.Advance(At(50)), UnorderedElementsAre(1, 2));
+  EXPECT_THAT(wheel.Advance(At(51)), ElementsAre(3));
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_THAT(wheel.NextWakeUp(), Eq(absl::InfiniteFuture()));
+}
+
+TEST(TimerWheelTest, DeadlinesAreRoundedUpToTicks) {
+  TimerWheel wheel(absl::Milliseconds(1), kOrigin);
+  wheel.Schedule(1, At(10) + absl::Microseconds(1));
+  EXPECT_THAT(wheel.Advance(At(10) + absl::Microseconds(999)), IsEmpty());
+  EXPECT_THAT(wheel.Advance(At(11)), ElementsAre(1));
+}
+
+TEST(TimerWheelTest, CascadesFromHigherLevels) {
+  TimerWheel wheel(absl::Milliseconds(1), kOrigin);
+  // Beyond the first level and beyond the first two levels.
+  wheel.Schedule(1, At(70000));
+  wheel.Schedule(2, At(300));
+
+  EXPECT_THAT(wheel.Advance(At(299)), IsEmpty());
+  EXPECT_THAT(wheel.Advance(At(300)), ElementsAre(2));
+  EXPECT_THAT(wheel.Advance(At(69999)), IsEmpty());
+  EXPECT_THAT(wheel.NextWakeUp(), Eq(At(70000)));
+  EXPECT_THAT(wheel.Advance(At(70000)), ElementsAre(1));
+}
+
+TEST(TimerWheelTest, RescheduleAndCancel) {
+  TimerWheel wheel(absl::Milliseconds(1), kOrigin);
+  wheel.Schedule(1, At(20));
+  wheel.Schedule(2, At(20));
+  wheel.Schedule(1, At(5000));
+  wheel.Cancel(2);
+  EXPECT_THAT(wheel.size(), Eq(1));
+
+  EXPECT_THAT(wheel.Advance(At(4999)), IsEmpty());
+  EXPECT_THAT(wheel.Advance(At(5000)), ElementsAre(1));
+}
+
+TEST(TimerWheelTest, PastDeadlinesFireWithTheNextTick) {
+  TimerWheel wheel(absl::Milliseconds(1), kOrigin);
+  EXPECT_THAT(wheel.Advance(At(100)), IsEmpty());
+  wheel.Schedule(1, At(10));
+  EXPECT_THAT(wheel.NextWakeUp(), Eq(At(101)));
+  EXPECT_THAT(wheel.Advance(At(101)), ElementsAre(1));
+}
+
+}  // namespace
+}  // namespace sandbox2
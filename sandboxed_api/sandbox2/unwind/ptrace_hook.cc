@@ -26,13 +26,11 @@
 constexpr size_t kRegisterBufferSize = 128 * 8;
 // Contains the register values in a ptrace specified format.
 // This format is pretty opaque which is why we just forward
-// the raw bytes (up to a certain limit).
-static unsigned char register_values[kRegisterBufferSize];
-static size_t n_register_values_bytes_used = 0;
+// the raw bytes (up to a certain limit). Per thread, as several threads of the
+// libunwind sandbox may unwind different stacks at the same time.
+static thread_local unsigned char register_values[kRegisterBufferSize];
+static thread_local size_t n_register_values_bytes_used = 0;
 
-// It should not be necessary to put this in a thread local storage as we
-// do not support setting up the forkserver when there is more than one thread.
-// However there might be some edge-cases, so we do this just in case.
 thread_local bool emulate_ptrace = false;
 
 void ArmPtraceEmulation() { emulate_ptrace = true; }
@@ -17,10 +17,11 @@
 
 #include <cstddef>
 
-// Sets the register values that the ptrace emulation will return.
+// Sets the register values that the ptrace emulation will return to the
+// calling thread.
 void InstallUserRegs(const char* ptr, size_t size);
 
-// Enables the ptrace emulation.
+// Enables the ptrace emulation for the calling thread.
 void ArmPtraceEmulation();
 
 #endif  // SANDBOXED_API_SANDBOX2_UNWIND_PTRACE_HOOK_H_
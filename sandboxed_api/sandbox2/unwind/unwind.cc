@@ -15,18 +15,25 @@
 #include "sandboxed_api/sandbox2/unwind/unwind.h"
 
 #include <cxxabi.h>
+#include <sys/uio.h>
 
 #include <cstddef>
 #include <cstdint>
-#include <cstdio>
-#include <map>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "libunwind-ptrace.h"
 #include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox2/unwind/ptrace_hook.h"
 #include "sandboxed_api/sandbox2/unwind/unwind.pb.h"
 #include "sandboxed_api/sandbox2/util/maps_parser.h"
 #include "sandboxed_api/sandbox2/util/minielf.h"
@@ -47,35 +54,312 @@ std::string DemangleSymbol(const std::string& maybe_mangled) {
   return maybe_mangled;
 }
 
-std::string GetSymbolAt(const std::map<uint64_t, std::string>& addr_to_symbol,
-                        uint64_t addr) {
-  auto entry_for_next_symbol = addr_to_symbol.lower_bound(addr);
-  if (entry_for_next_symbol != addr_to_symbol.end() &&
-      entry_for_next_symbol != addr_to_symbol.begin()) {
-    // Matches the addr exactly:
-    if (entry_for_next_symbol->first == addr) {
-      return DemangleSymbol(entry_for_next_symbol->second);
+// Symbols of an ELF file, sorted by address. The names are stored in a single
+// string pool. Indexes are immutable once built and shared by all lookups.
+class SymbolIndex {
+ public:
+  // Returns the index of the file mapped by 'entry', building it on first use.
+  // Files are identified by their path, device and inode.
+  static std::shared_ptr<const SymbolIndex> Get(const MapsEntryView& entry);
+
+  // Looks up the symbol at or before 'addr', an address relative to the load
+  // address for position independent files. Returns false if there is no
+  // such symbol.
+  bool Lookup(uint64_t addr, uint64_t* symbol_addr,
+              absl::string_view* name) const;
+
+  bool position_independent() const { return position_independent_; }
+
+ private:
+  // Arbitrary limit on the number of files kept in the cache.
+  static constexpr size_t kMaxCachedFiles = 128;
+
+  struct Symbol {
+    uint64_t address;
+    size_t name_offset;
+    size_t name_size;
+  };
+
+  static std::shared_ptr<const SymbolIndex> Build(const std::string& path);
+
+  bool position_independent_ = false;
+  std::vector<Symbol> symbols_;
+  std::string names_;
+};
+
+constexpr size_t SymbolIndex::kMaxCachedFiles;
+
+std::shared_ptr<const SymbolIndex> SymbolIndex::Get(
+    const MapsEntryView& entry) {
+  static auto* mutex = new absl::Mutex();
+  static auto* cache = new absl::flat_hash_map<
+      std::string, std::shared_ptr<const SymbolIndex>>();
+  std::string key = absl::StrCat(entry.major, ":", entry.minor, ":",
+                                 entry.inode, ":", entry.path);
+  {
+    absl::MutexLock lock(mutex);
+    auto it = cache->find(key);
+    if (it != cache->end()) {
+      return it->second;
     }
+  }
+  // Files which cannot be parsed get an empty index, so that they are only
+  // parsed once.
+  std::shared_ptr<const SymbolIndex> index = Build(std::string(entry.path));
+  absl::MutexLock lock(mutex);
+  if (cache->size() >= kMaxCachedFiles) {
+    cache->clear();
+  }
+  cache->emplace(std::move(key), index);
+  return index;
+}
 
-    // Might be inside a function, return symbol+offset;
-    const auto entry_for_previous_symbol = --entry_for_next_symbol;
-    if (!entry_for_previous_symbol->second.empty()) {
-      return absl::StrCat(DemangleSymbol(entry_for_previous_symbol->second),
-                          "+0x",
-                          absl::Hex(addr - entry_for_previous_symbol->first));
+std::shared_ptr<const SymbolIndex> SymbolIndex::Build(const std::string& path) {
+  auto index = std::make_shared<SymbolIndex>();
+  auto elf_or = ElfFile::ParseFromFile(path, ElfFile::kLoadSymbols);
+  if (!elf_or.ok()) {
+    SAPI_RAW_LOG(WARNING, "Could not load symbols for %s: %s", path,
+                 elf_or.status().message());
+    return index;
+  }
+  const ElfFile& elf = elf_or.ValueOrDie();
+  index->position_independent_ = elf.position_independent();
+  index->symbols_.reserve(elf.symbols().size());
+  for (const auto& symbol : elf.symbols()) {
+    if (symbol.name.empty()) {
+      continue;
     }
+    index->symbols_.push_back(
+        {symbol.address, index->names_.size(), symbol.name.size()});
+    index->names_.append(symbol.name);
   }
-  return "";
+  // Of several symbols at the same address, the last one in the file wins.
+  std::stable_sort(index->symbols_.begin(), index->symbols_.end(),
+                   [](const Symbol& a, const Symbol& b) {
+                     return a.address < b.address;
+                   });
+  auto last = std::unique(index->symbols_.rbegin(), index->symbols_.rend(),
+                          [](const Symbol& a, const Symbol& b) {
+                            return a.address == b.address;
+                          });
+  index->symbols_.erase(index->symbols_.begin(), last.base());
+  index->symbols_.shrink_to_fit();
+  return index;
 }
 
+bool SymbolIndex::Lookup(uint64_t addr, uint64_t* symbol_addr,
+                         absl::string_view* name) const {
+  auto it = std::upper_bound(symbols_.begin(), symbols_.end(), addr,
+                             [](uint64_t addr, const Symbol& symbol) {
+                               return addr < symbol.address;
+                             });
+  if (it == symbols_.begin()) {
+    return false;
+  }
+  --it;
+  *symbol_addr = it->address;
+  *name = absl::string_view(names_).substr(it->name_offset, it->name_size);
+  return true;
+}
+
+// Returns the symbol containing 'addr' as name+offset, 'addr' has to be in
+// the mapping 'entry'.
+std::string GetSymbolAt(const MapsEntryView& entry, uint64_t addr) {
+  if (entry.path.empty()) {
+    return "";
+  }
+
+  auto format = [addr](absl::string_view name, uint64_t symbol_addr) {
+    if (symbol_addr == addr) {
+      return std::string(name);
+    }
+    return absl::StrCat(name, "+0x", absl::Hex(addr - symbol_addr));
+  };
+  if (entry.path != "[vdso]" && entry.is_executable) {
+    std::shared_ptr<const SymbolIndex> index = SymbolIndex::Get(entry);
+    // Symbols of position independent files are relative to the start of the
+    // mapping.
+    const uint64_t base = index->position_independent() ? entry.start : 0;
+    uint64_t symbol_addr;
+    absl::string_view name;
+    if (index->Lookup(addr - base, &symbol_addr, &name) &&
+        symbol_addr + base >= entry.start) {
+      return format(DemangleSymbol(std::string(name)), symbol_addr + base);
+    }
+  }
+  return format(absl::StrCat("map:", entry.path), entry.start);
+}
+
+// Maximum number of threads unwinding stacks at the same time.
+constexpr size_t kMaxUnwindThreads = 8;
+
+// Reads the memory of the unwound process with process_vm_readv(), a block at
+// a time. libunwind reads stacks and unwind tables word by word, with ptrace
+// that would be one PTRACE_PEEKDATA each. The process is stopped while it is
+// unwound, so blocks stay valid for the whole unwind.
+class RemoteMemoryReader {
+ public:
+  explicit RemoteMemoryReader(pid_t pid) : pid_(pid) {}
+
+  RemoteMemoryReader(const RemoteMemoryReader&) = delete;
+  RemoteMemoryReader& operator=(const RemoteMemoryReader&) = delete;
+
+  // Reads the word at 'addr'. Returns false if it cannot be read.
+  bool ReadWord(unw_word_t addr, unw_word_t* value);
+
+ private:
+  // No larger than a page on any supported architecture, so that a block is
+  // either fully mapped or not at all.
+  static constexpr size_t kBlockSize = 4096;
+  static constexpr size_t kMaxBlocks = 8;
+
+  struct Block {
+    unw_word_t addr;
+    char data[kBlockSize];
+  };
+
+  // Returns the cached block starting at 'addr', reading it on a miss.
+  const Block* GetBlock(unw_word_t addr);
+
+  pid_t pid_;
+  Block blocks_[kMaxBlocks];
+  size_t num_blocks_ = 0;
+  // Block replaced on the next miss once all are in use.
+  size_t next_block_ = 0;
+};
+
+constexpr size_t RemoteMemoryReader::kBlockSize;
+constexpr size_t RemoteMemoryReader::kMaxBlocks;
+
+const RemoteMemoryReader::Block* RemoteMemoryReader::GetBlock(
+    unw_word_t addr) {
+  for (size_t i = 0; i < num_blocks_; ++i) {
+    if (blocks_[i].addr == addr) {
+      return &blocks_[i];
+    }
+  }
+  Block* block;
+  if (num_blocks_ < kMaxBlocks) {
+    block = &blocks_[num_blocks_];
+  } else {
+    block = &blocks_[next_block_];
+    next_block_ = (next_block_ + 1) % kMaxBlocks;
+  }
+  struct iovec local = {block->data, kBlockSize};
+  struct iovec remote = {reinterpret_cast<void*>(addr), kBlockSize};
+  if (process_vm_readv(pid_, &local, 1, &remote, 1, 0) !=
+      static_cast<ssize_t>(kBlockSize)) {
+    return nullptr;
+  }
+  block->addr = addr;
+  if (block == &blocks_[num_blocks_]) {
+    ++num_blocks_;
+  }
+  return block;
+}
+
+bool RemoteMemoryReader::ReadWord(unw_word_t addr, unw_word_t* value) {
+  const unw_word_t offset = addr % kBlockSize;
+  if (offset + sizeof(*value) > kBlockSize) {
+    // Straddles two blocks, rare enough to not be cached.
+    struct iovec local = {value, sizeof(*value)};
+    struct iovec remote = {reinterpret_cast<void*>(addr), sizeof(*value)};
+    return process_vm_readv(pid_, &local, 1, &remote, 1, 0) ==
+           static_cast<ssize_t>(sizeof(*value));
+  }
+  const Block* block = GetBlock(addr - offset);
+  if (block == nullptr) {
+    return false;
+  }
+  memcpy(value, block->data + offset, sizeof(*value));
+  return true;
+}
+
+// Argument of the accessors below, passed to unw_init_remote().
+struct UnwindContext {
+  void* upt_info;
+  RemoteMemoryReader* memory;
+};
+
+// The accessors forward to the ptrace ones, except for reading memory.
+void* UptInfo(void* arg) { return static_cast<UnwindContext*>(arg)->upt_info; }
+
+int FindProcInfo(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t* pi,
+                 int need_unwind_info, void* arg) {
+  return _UPT_find_proc_info(as, ip, pi, need_unwind_info, UptInfo(arg));
+}
+
+void PutUnwindInfo(unw_addr_space_t as, unw_proc_info_t* pi, void* arg) {
+  _UPT_put_unwind_info(as, pi, UptInfo(arg));
+}
+
+int GetDynInfoListAddr(unw_addr_space_t as, unw_word_t* dil_addr, void* arg) {
+  return _UPT_get_dyn_info_list_addr(as, dil_addr, UptInfo(arg));
+}
+
+int AccessMem(unw_addr_space_t as, unw_word_t addr, unw_word_t* value,
+              int write, void* arg) {
+  RemoteMemoryReader* memory = static_cast<UnwindContext*>(arg)->memory;
+  if (!write && memory->ReadWord(addr, value)) {
+    return 0;
+  }
+  // Also covers process_vm_readv() being unavailable.
+  return _UPT_access_mem(as, addr, value, write, UptInfo(arg));
+}
+
+int AccessReg(unw_addr_space_t as, unw_regnum_t reg, unw_word_t* value,
+              int write, void* arg) {
+  return _UPT_access_reg(as, reg, value, write, UptInfo(arg));
+}
+
+int AccessFpreg(unw_addr_space_t as, unw_regnum_t reg, unw_fpreg_t* value,
+                int write, void* arg) {
+  return _UPT_access_fpreg(as, reg, value, write, UptInfo(arg));
+}
+
+int Resume(unw_addr_space_t as, unw_cursor_t* cursor, void* arg) {
+  return _UPT_resume(as, cursor, UptInfo(arg));
+}
+
+int GetProcName(unw_addr_space_t as, unw_word_t addr, char* buf, size_t len,
+                unw_word_t* offset, void* arg) {
+  return _UPT_get_proc_name(as, addr, buf, len, offset, UptInfo(arg));
+}
+
+unw_accessors_t* GetAccessors() {
+  static unw_accessors_t accessors = {
+      FindProcInfo, PutUnwindInfo, GetDynInfoListAddr, AccessMem,
+      AccessReg,    AccessFpreg,   Resume,             GetProcName,
+  };
+  return &accessors;
+}
+
+// libunwind address space of the calling thread. Its caches are not shared
+// with the other unwinding threads.
+class ThreadAddressSpace {
+ public:
+  ThreadAddressSpace()
+      : as_(unw_create_addr_space(GetAccessors(), 0 /* byte order */)) {}
+  ~ThreadAddressSpace() {
+    if (as_ != nullptr) {
+      unw_destroy_addr_space(as_);
+    }
+  }
+
+  unw_addr_space_t get() const { return as_; }
+
+ private:
+  unw_addr_space_t as_;
+};
+
 }  // namespace
 
 void GetIPList(pid_t pid, std::vector<uintptr_t>* ips, int max_frames) {
   ips->clear();
 
   unw_cursor_t cursor;
-  static unw_addr_space_t as =
-      unw_create_addr_space(&_UPT_accessors, 0 /* byte order */);
+  static thread_local ThreadAddressSpace address_space;
+  unw_addr_space_t as = address_space.get();
   if (as == nullptr) {
     SAPI_RAW_LOG(WARNING, "unw_create_addr_space() failed");
     return;
@@ -87,7 +371,9 @@ void GetIPList(pid_t pid, std::vector<uintptr_t>* ips, int max_frames) {
     return;
   }
 
-  int rc = unw_init_remote(&cursor, as, ui);
+  RemoteMemoryReader memory(pid);
+  UnwindContext context = {ui, &memory};
+  int rc = unw_init_remote(&cursor, as, &context);
   if (rc < 0) {
     // Could be UNW_EINVAL (8), UNW_EUNSPEC (1) or UNW_EBADREG (3).
     SAPI_RAW_LOG(WARNING, "unw_init_remote() failed with error %d", rc);
@@ -130,78 +416,80 @@ void RunLibUnwindAndSymbolizer(pid_t pid, Comms* comms, int max_frames,
   comms->SendProtoBuf(msg);
 }
 
+void RunLibUnwindAndSymbolizerForThreads(
+    pid_t pid, Comms* comms, const std::vector<std::string>& thread_regs,
+    int max_frames, const std::string& delim) {
+  std::vector<std::string> stack_traces(thread_regs.size());
+  std::vector<std::vector<uintptr_t>> ips(thread_regs.size());
+  std::atomic<size_t> next{0};
+  auto unwind = [&]() {
+    for (size_t i; (i = next++) < thread_regs.size();) {
+      InstallUserRegs(thread_regs[i].data(), thread_regs[i].size());
+      ArmPtraceEmulation();
+      RunLibUnwindAndSymbolizer(pid, &stack_traces[i], &ips[i], max_frames,
+                                delim);
+    }
+  };
+  // The calling thread unwinds as well.
+  const size_t num_threads =
+      std::min(thread_regs.size(), kMaxUnwindThreads) - 1;
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back(unwind);
+  }
+  unwind();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  UnwindResult msg;
+  for (size_t i = 0; i < thread_regs.size(); ++i) {
+    UnwindResult* thread = msg.add_threads();
+    for (uintptr_t ip : ips[i]) {
+      thread->add_ip(ip);
+    }
+    thread->set_stacktrace(stack_traces[i]);
+  }
+  comms->SendProtoBuf(msg);
+}
+
 void RunLibUnwindAndSymbolizer(pid_t pid, std::string* stack_trace_out,
                                std::vector<uintptr_t>* ips, int max_frames,
                                const std::string& delim) {
   // Run libunwind.
   GetIPList(pid, ips, max_frames);
 
-  // Open /proc/pid/maps.
-  std::string path_maps = absl::StrCat("/proc/", pid, "/maps");
-  std::unique_ptr<FILE, void (*)(FILE*)> f(fopen(path_maps.c_str(), "r"),
-                                           [](FILE* s) {
-                                             if (s) {
-                                               fclose(s);
-                                             }
-                                           });
-  if (!f) {
-    // Could not open maps file.
-    SAPI_RAW_LOG(ERROR, "Could not open %s", path_maps);
-    return;
-  }
-
-  constexpr static size_t kBufferSize = 10 * 1024 * 1024;
-  std::string maps_content(kBufferSize, '\0');
-  size_t bytes_read = fread(&maps_content[0], 1, kBufferSize, f.get());
-  if (bytes_read == 0) {
-    // Could not read the whole maps file.
-    SAPI_RAW_PLOG(ERROR, "Could not read maps file");
+  auto reader_or = ProcMapsReader::OpenForPid(pid);
+  if (!reader_or.ok()) {
+    SAPI_RAW_LOG(ERROR, "Could not open maps file: %s",
+                 reader_or.status().message());
     return;
   }
-  maps_content.resize(bytes_read);
+  std::unique_ptr<ProcMapsReader> reader = std::move(reader_or).ValueOrDie();
 
-  auto maps_or = ParseProcMaps(maps_content);
-  if (!maps_or.ok()) {
-    SAPI_RAW_LOG(ERROR, "Could not parse /proc/%d/maps", pid);
-    return;
-  }
-  auto maps = std::move(maps_or).ValueOrDie();
-
-  // Get symbols for each file entry in the maps entry.
-  // This is not a very efficient way, so we might want to optimize it.
-  std::map<uint64_t, std::string> addr_to_symbol;
-  for (const auto& entry : maps) {
-    if (!entry.path.empty()) {
-      // Store details about start + end of this map.
-      // The maps entries are ordered and thus sorted with increasing adresses.
-      // This means if there is a symbol @ entry.end, it will be overwritten in
-      // the next iteration.
-      addr_to_symbol[entry.start] = absl::StrCat("map:", entry.path);
-      addr_to_symbol[entry.end] = "";
+  // Both the addresses and the mappings are sorted, so that the mappings can
+  // be streamed and only those containing an address are looked at.
+  std::vector<uint64_t> addrs(ips->begin(), ips->end());
+  std::sort(addrs.begin(), addrs.end());
+  addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+  absl::flat_hash_map<uint64_t, std::string> symbols;
+  auto next_addr = addrs.begin();
+  MapsEntryView entry;
+  while (next_addr != addrs.end() && reader->Next(&entry)) {
+    // Addresses before this mapping are not mapped.
+    while (next_addr != addrs.end() && *next_addr < entry.start) {
+      ++next_addr;
     }
-
-    if (!entry.path.empty() && entry.path != "[vdso]" && entry.is_executable) {
-      auto elf_or = ElfFile::ParseFromFile(entry.path, ElfFile::kLoadSymbols);
-      if (!elf_or.ok()) {
-        SAPI_RAW_LOG(WARNING, "Could not load symbols for %s: %s", entry.path,
-                     elf_or.status().message());
-        continue;
-      }
-      auto elf = std::move(elf_or).ValueOrDie();
-
-      for (const auto& symbol : elf.symbols()) {
-        if (elf.position_independent()) {
-          if (symbol.address < entry.end - entry.start) {
-            addr_to_symbol[symbol.address + entry.start] = symbol.name;
-          }
-        } else {
-          if (symbol.address >= entry.start && symbol.address < entry.end) {
-            addr_to_symbol[symbol.address] = symbol.name;
-          }
-        }
-      }
+    for (; next_addr != addrs.end() && *next_addr < entry.end; ++next_addr) {
+      symbols[*next_addr] = GetSymbolAt(entry, *next_addr);
     }
   }
+  if (!reader->status().ok()) {
+    SAPI_RAW_LOG(ERROR, "Could not parse /proc/%d/maps: %s", pid,
+                 reader->status().message());
+    return;
+  }
 
   std::string stack_trace;
   // Symbolize stacktrace.
@@ -209,8 +497,10 @@ void RunLibUnwindAndSymbolizer(pid_t pid, std::string* stack_trace_out,
     if (i != ips->begin()) {
       stack_trace += delim;
     }
-    std::string symbol = GetSymbolAt(addr_to_symbol, static_cast<uint64_t>(*i));
-    absl::StrAppend(&stack_trace, symbol, "(0x", absl::Hex(*i), ")");
+    auto symbol = symbols.find(static_cast<uint64_t>(*i));
+    absl::StrAppend(&stack_trace,
+                    symbol != symbols.end() ? symbol->second : "", "(0x",
+                    absl::Hex(*i), ")");
   }
 
   *stack_trace_out = stack_trace;
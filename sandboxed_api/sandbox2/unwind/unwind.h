@@ -29,6 +29,14 @@ void GetIPList(pid_t pid, std::vector<uintptr_t>* ips, int max_frames);
 void RunLibUnwindAndSymbolizer(pid_t pid, Comms* comms, int max_frames,
                                const std::string& delim);
 
+// Unwinds the stacks of several threads of 'pid' concurrently, each described
+// by the raw register contents in 'thread_regs', and sends their traces as a
+// single UnwindResult. Only usable in the libunwind sandbox, which emulates
+// ptrace() with the registers.
+void RunLibUnwindAndSymbolizerForThreads(
+    pid_t pid, Comms* comms, const std::vector<std::string>& thread_regs,
+    int max_frames, const std::string& delim);
+
 void RunLibUnwindAndSymbolizer(pid_t pid, std::string* stack_trace_out,
                                std::vector<uintptr_t>* ips, int max_frames,
                                const std::string& delim);
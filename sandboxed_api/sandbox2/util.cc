@@ -24,19 +24,26 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <csetjmp>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <utility>
 
 #include "absl/base/attributes.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/strip.h"
 #include "sandboxed_api/sandbox2/util/fileops.h"
@@ -160,12 +167,95 @@ pid_t ForkWithFlags(int flags) {
   return 0;
 }
 
-bool CreateMemFd(int* fd, const char* name) {
+namespace {
+
+// Usually defined in linux/sched.h. Define them here to avoid dependency on
+// UAPI headers.
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+constexpr uint64_t kClonePidFd = 0x00001000;
+constexpr uint64_t kCloneIntoCgroup = 0x200000000ULL;
+
+struct CloneArgs {
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+// Size of the arguments up to 'tls', which is all Linux 5.3 knows about.
+constexpr size_t kCloneArgsSizeVer0 = 64;
+
+}  // namespace
+
+pid_t ForkWithPidFd(int flags, int cgroup_fd, int* pid_fd, bool* in_cgroup) {
+  *pid_fd = -1;
+  *in_cgroup = false;
+  const int unsupported_flags = CLONE_CHILD_CLEARTID | CLONE_CHILD_SETTID |
+                                CLONE_PARENT_SETTID | CLONE_SETTLS | CLONE_VM;
+  if (flags & unsupported_flags) {
+    SAPI_RAW_LOG(ERROR, "ForkWithPidFd used with unsupported flag");
+    return -1;
+  }
+
+  // Without a stack, the child continues on a copy of the caller's, as with
+  // fork().
+  int fd = -1;
+  CloneArgs args{};
+  args.flags = (flags & ~CSIGNAL) | kClonePidFd;
+  args.pidfd = reinterpret_cast<uintptr_t>(&fd);
+  args.exit_signal = flags & CSIGNAL;
+  size_t args_size = kCloneArgsSizeVer0;
+  if (cgroup_fd != -1) {
+    args.flags |= kCloneIntoCgroup;
+    args.cgroup = cgroup_fd;
+    args_size = sizeof(args);
+  }
+  pid_t pid = Syscall(__NR_clone3, reinterpret_cast<uintptr_t>(&args),
+                      args_size);
+  if (pid == -1 && cgroup_fd != -1) {
+    // Older kernels reject the larger arguments, and a cgroup may refuse the
+    // child, e.g. if it is threaded. The caller has to move the child then.
+    SAPI_RAW_VLOG(1, "clone3(CLONE_INTO_CGROUP) failed: %s",
+                  StrError(errno).c_str());
+    args.flags &= ~kCloneIntoCgroup;
+    args.cgroup = 0;
+    pid = Syscall(__NR_clone3, reinterpret_cast<uintptr_t>(&args),
+                  kCloneArgsSizeVer0);
+  }
+  if (pid == -1) {
+    // clone3() needs Linux 5.3, and seccomp policies of container runtimes
+    // often deny it.
+    if (errno == ENOSYS || errno == EPERM || errno == E2BIG) {
+      return ForkWithFlags(flags);
+    }
+    SAPI_RAW_PLOG(ERROR, "clone3()");
+    return -1;
+  }
+
+  // Child.
+  if (pid == 0) {
+    return 0;
+  }
+  *pid_fd = fd;
+  *in_cgroup = args.flags & kCloneIntoCgroup;
+  return pid;
+}
+
+bool CreateMemFd(int* fd, const char* name, uint32_t flags) {
   // Usually defined in linux/memfd.h. Define it here to avoid dependency on
   // UAPI headers.
   constexpr uintptr_t MFD_CLOEXEC = 0x0001U;
   int tmp_fd = Syscall(__NR_memfd_create, reinterpret_cast<uintptr_t>(name),
-                       MFD_CLOEXEC);
+                       MFD_CLOEXEC | flags);
   if (tmp_fd < 0) {
     if (errno == ENOSYS) {
       SAPI_RAW_LOG(ERROR,
@@ -279,44 +369,300 @@ std::string GetRlimitName(int resource) {
 }
 
 sapi::StatusOr<std::string> ReadCPathFromPid(pid_t pid, uintptr_t ptr) {
-  std::string path(PATH_MAX, '\0');
-  iovec local_iov[] = {{&path[0], path.size()}};
-
+  // Most paths are short, start with a small read and only grow it when no
+  // NUL byte was found yet.
+  constexpr size_t kInitialReadSize = 256;
   static const uintptr_t page_size = getpagesize();
   static const uintptr_t page_mask = ~(page_size - 1);
-  // See 'man process_vm_readv' for details on how to read NUL-terminated
-  // strings with this syscall.
-  size_t len1 = ((ptr + page_size) & page_mask) - ptr;
-  len1 = (len1 > path.size()) ? path.size() : len1;
-  size_t len2 = (path.size() <= len1) ? 0UL : path.size() - len1;
-  // Second iov is wrapping around to NULL ptr.
-  if ((ptr + len1) < ptr) {
-    len2 = 0UL;
-  }
-
-  iovec remote_iov[] = {
-      {reinterpret_cast<void*>(ptr), len1},
-      {reinterpret_cast<void*>(ptr + len1), len2},
-  };
-
-  SAPI_RAW_VLOG(4, "ReadCPathFromPid (iovec): len1: %d, len2: %d", len1, len2);
-  ssize_t sz = process_vm_readv(pid, local_iov, ABSL_ARRAYSIZE(local_iov),
-                                remote_iov, ABSL_ARRAYSIZE(remote_iov), 0);
-  if (sz < 0) {
-    return sapi::InternalError(absl::StrFormat(
-        "process_vm_readv() failed for PID: %d at address: %#x: %s", pid,
-        reinterpret_cast<uintptr_t>(ptr), StrError(errno)));
-  }
-
-  // Check for whether there's a NUL byte in the buffer. If not, it's an
-  // incorrect path (or >PATH_MAX).
-  auto pos = path.find('\0');
-  if (pos == std::string::npos) {
-    return sapi::FailedPreconditionError(absl::StrCat(
-        "No NUL-byte inside the C string '", absl::CHexEscape(path), "'"));
-  }
-  path.resize(pos);
-  return path;
+
+  std::string path(PATH_MAX, '\0');
+  size_t read = 0;
+  for (size_t want = kInitialReadSize; read < path.size(); want *= 2) {
+    uintptr_t start = ptr + read;
+    size_t len = std::min(want, path.size()) - read;
+    iovec local_iov[] = {{&path[read], len}};
+
+    // See 'man process_vm_readv' for details on how to read NUL-terminated
+    // strings with this syscall.
+    size_t len1 = ((start + page_size) & page_mask) - start;
+    len1 = (len1 > len) ? len : len1;
+    size_t len2 = (len <= len1) ? 0UL : len - len1;
+    // Second iov is wrapping around to NULL ptr.
+    if ((start + len1) < start) {
+      len2 = 0UL;
+    }
+
+    iovec remote_iov[] = {
+        {reinterpret_cast<void*>(start), len1},
+        {reinterpret_cast<void*>(start + len1), len2},
+    };
+
+    SAPI_RAW_VLOG(4, "ReadCPathFromPid (iovec): len1: %d, len2: %d", len1,
+                  len2);
+    ssize_t sz = process_vm_readv(pid, local_iov, ABSL_ARRAYSIZE(local_iov),
+                                  remote_iov, ABSL_ARRAYSIZE(remote_iov), 0);
+    if (sz < 0) {
+      return sapi::InternalError(absl::StrFormat(
+          "process_vm_readv() failed for PID: %d at address: %#x: %s", pid,
+          reinterpret_cast<uintptr_t>(start), StrError(errno)));
+    }
+
+    size_t got = static_cast<size_t>(sz);
+    auto pos = path.find('\0', read);
+    if (pos < read + got) {
+      path.resize(pos);
+      return path;
+    }
+    read += got;
+    if (got < len1 + len2) {
+      // The rest of the string is not readable.
+      break;
+    }
+  }
+
+  // No NUL byte in the readable part, it's an incorrect path (or >PATH_MAX).
+  path.resize(read);
+  return sapi::FailedPreconditionError(absl::StrCat(
+      "No NUL-byte inside the C string '", absl::CHexEscape(path), "'"));
+}
+
+bool ParseCpuList(absl::string_view list, std::vector<int>* cpus) {
+  cpus->clear();
+  list = absl::StripAsciiWhitespace(list);
+  for (absl::string_view range : absl::StrSplit(list, ',', absl::SkipEmpty())) {
+    std::pair<absl::string_view, absl::string_view> bounds =
+        absl::StrSplit(range, absl::MaxSplits('-', 1));
+    int first;
+    int last;
+    if (!absl::SimpleAtoi(bounds.first, &first)) {
+      return false;
+    }
+    if (bounds.second.empty()) {
+      last = first;
+    } else if (!absl::SimpleAtoi(bounds.second, &last) || last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+  }
+  return true;
+}
+
+std::map<int, std::vector<int>> GetNumaNodes() {
+  constexpr char kNodeDir[] = "/sys/devices/system/node";
+  std::map<int, std::vector<int>> nodes;
+  std::vector<std::string> entries;
+  std::string error;
+  if (!file_util::fileops::ListDirectoryEntries(kNodeDir, &entries, &error)) {
+    return nodes;
+  }
+  for (const auto& entry : entries) {
+    absl::string_view name = entry;
+    int node;
+    if (!absl::ConsumePrefix(&name, "node") || !absl::SimpleAtoi(name, &node)) {
+      continue;
+    }
+    std::ifstream cpulist(file::JoinPath(kNodeDir, entry, "cpulist"));
+    std::string line;
+    std::vector<int> cpus;
+    // Memory-only nodes have no CPUs.
+    if (std::getline(cpulist, line) && ParseCpuList(line, &cpus) &&
+        !cpus.empty()) {
+      nodes[node] = std::move(cpus);
+    }
+  }
+  return nodes;
+}
+
+int GetNumaNodeOfAffinity(pid_t pid) {
+  cpu_set_t cpus;
+  if (sched_getaffinity(pid, sizeof(cpus), &cpus) == -1) {
+    return -1;
+  }
+  const int num_cpus = CPU_COUNT(&cpus);
+  for (const auto& node : GetNumaNodes()) {
+    int on_node = 0;
+    for (int cpu : node.second) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus)) {
+        ++on_node;
+      }
+    }
+    if (on_node > 0) {
+      return on_node == num_cpus ? node.first : -1;
+    }
+  }
+  return -1;
+}
+
+bool ParseMemoryUsage(absl::string_view smaps_rollup, MemoryUsage* usage) {
+  *usage = MemoryUsage();
+  bool has_rss = false;
+  for (absl::string_view line : absl::StrSplit(smaps_rollup, '\n')) {
+    // E.g. "Private_Dirty:       123 kB".
+    std::vector<absl::string_view> words =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    uint64_t kb;
+    if (words.size() != 3 || words[2] != "kB" ||
+        !absl::SimpleAtoi(words[1], &kb)) {
+      continue;
+    }
+    const uint64_t bytes = kb << 10;
+    if (words[0] == "Rss:") {
+      usage->rss = bytes;
+      has_rss = true;
+    } else if (words[0] == "Pss:") {
+      usage->pss = bytes;
+    } else if (words[0] == "Shared_Clean:") {
+      usage->shared_clean = bytes;
+    } else if (words[0] == "Shared_Dirty:") {
+      usage->shared_dirty = bytes;
+    } else if (words[0] == "Private_Clean:") {
+      usage->private_clean = bytes;
+    } else if (words[0] == "Private_Dirty:") {
+      usage->private_dirty = bytes;
+    }
+  }
+  return has_rss;
+}
+
+sapi::StatusOr<MemoryUsage> GetMemoryUsage(pid_t pid) {
+  const std::string proc_dir = absl::StrCat("/proc/", pid);
+  const std::string path = file::JoinPath(proc_dir, "smaps_rollup");
+  std::ifstream smaps_rollup(path);
+  if (!smaps_rollup) {
+    return sapi::UnavailableError(absl::StrCat("Cannot open ", path));
+  }
+  const std::string contents((std::istreambuf_iterator<char>(smaps_rollup)),
+                             std::istreambuf_iterator<char>());
+  MemoryUsage usage;
+  if (!ParseMemoryUsage(contents, &usage)) {
+    return sapi::UnavailableError(absl::StrCat("Cannot parse ", path));
+  }
+  std::ifstream ksm(file::JoinPath(proc_dir, "ksm_merging_pages"));
+  uint64_t pages;
+  if (ksm >> pages) {
+    usage.ksm_merged = pages * sysconf(_SC_PAGESIZE);
+  }
+  return usage;
+}
+
+namespace {
+
+// Reads the file 'path' of /proc, which cannot be stat()ed for its size.
+bool ReadProcFile(const std::string& path, std::string* contents) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  contents->assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Returns the value of the line "<key>: <value>" of 'contents', or 0.
+uint64_t GetProcValue(absl::string_view contents, absl::string_view key) {
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    if (!absl::ConsumePrefix(&line, key) || !absl::ConsumePrefix(&line, ":")) {
+      continue;
+    }
+    uint64_t value;
+    return absl::SimpleAtoi(line, &value) ? value : 0;
+  }
+  return 0;
+}
+
+}  // namespace
+
+bool ParseProcStat(absl::string_view stat, ResourceUsage* usage) {
+  // The command name in the second field may contain spaces and parentheses.
+  const size_t comm_end = stat.rfind(')');
+  if (comm_end == absl::string_view::npos) {
+    return false;
+  }
+  // Starting with the third field, the state.
+  std::vector<absl::string_view> fields =
+      absl::StrSplit(stat.substr(comm_end + 1), ' ', absl::SkipEmpty());
+  uint64_t utime, stime, num_threads, rss_pages;
+  if (fields.size() < 22 || !absl::SimpleAtoi(fields[11], &utime) ||
+      !absl::SimpleAtoi(fields[12], &stime) ||
+      !absl::SimpleAtoi(fields[17], &num_threads) ||
+      !absl::SimpleAtoi(fields[21], &rss_pages)) {
+    return false;
+  }
+  static const int64_t ticks_per_second = sysconf(_SC_CLK_TCK);
+  usage->user_time += absl::Seconds(utime) / ticks_per_second;
+  usage->system_time += absl::Seconds(stime) / ticks_per_second;
+  usage->rss += rss_pages * sysconf(_SC_PAGESIZE);
+  usage->num_threads += num_threads;
+  ++usage->num_processes;
+  return true;
+}
+
+void ParseProcIo(absl::string_view io, ResourceUsage* usage) {
+  usage->read_bytes += GetProcValue(io, "read_bytes");
+  usage->write_bytes += GetProcValue(io, "write_bytes");
+}
+
+void ParseContextSwitches(absl::string_view status, ResourceUsage* usage) {
+  usage->voluntary_context_switches +=
+      GetProcValue(status, "voluntary_ctxt_switches");
+  usage->involuntary_context_switches +=
+      GetProcValue(status, "nonvoluntary_ctxt_switches");
+}
+
+std::vector<pid_t> GetProcessTree(pid_t pid) {
+  std::vector<pid_t> pids = {pid};
+  for (size_t i = 0; i < pids.size(); ++i) {
+    const std::string task_dir = absl::StrCat("/proc/", pids[i], "/task");
+    std::vector<std::string> tids;
+    std::string error;
+    if (!file_util::fileops::ListDirectoryEntries(task_dir, &tids, &error)) {
+      continue;
+    }
+    for (const std::string& tid : tids) {
+      std::string children;
+      if (!ReadProcFile(file::JoinPath(task_dir, tid, "children"),
+                        &children)) {
+        continue;
+      }
+      for (absl::string_view child :
+           absl::StrSplit(children, ' ', absl::SkipEmpty())) {
+        pid_t child_pid;
+        if (absl::SimpleAtoi(child, &child_pid)) {
+          pids.push_back(child_pid);
+        }
+      }
+    }
+  }
+  return pids;
+}
+
+ResourceUsage GetResourceUsage(const std::vector<pid_t>& pids) {
+  ResourceUsage usage;
+  std::string contents;
+  for (pid_t pid : pids) {
+    const std::string proc_dir = absl::StrCat("/proc/", pid);
+    if (!ReadProcFile(file::JoinPath(proc_dir, "stat"), &contents) ||
+        !ParseProcStat(contents, &usage)) {
+      continue;
+    }
+    if (ReadProcFile(file::JoinPath(proc_dir, "io"), &contents)) {
+      ParseProcIo(contents, &usage);
+    }
+    const std::string task_dir = file::JoinPath(proc_dir, "task");
+    std::vector<std::string> tids;
+    std::string error;
+    if (!file_util::fileops::ListDirectoryEntries(task_dir, &tids, &error)) {
+      continue;
+    }
+    for (const std::string& tid : tids) {
+      if (ReadProcFile(file::JoinPath(task_dir, tid, "status"), &contents)) {
+        ParseContextSwitches(contents, &usage);
+      }
+    }
+  }
+  return usage;
 }
 
 }  // namespace util
@@ -21,10 +21,13 @@
 #include <sys/types.h>
 
 #include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "absl/base/macros.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/util/statusor.h"
 
 namespace sandbox2 {
@@ -57,8 +60,18 @@ bool CreateDirRecursive(const std::string& path, mode_t mode);
 // Return values as for 'man 2 fork'.
 pid_t ForkWithFlags(int flags);
 
-// Creates a new memfd.
-bool CreateMemFd(int* fd, const char* name = "buffer_file");
+// Like ForkWithFlags(), but forks with clone3(), which also returns a pidfd
+// of the child in 'pid_fd' (Linux 5.3+) and, unless 'cgroup_fd' is -1, starts
+// the child in that cgroup v2 directory (Linux 5.7+). Falls back to
+// ForkWithFlags() where clone3() is not available, *pid_fd is -1 then.
+// 'in_cgroup' is set to whether the child started in 'cgroup_fd'.
+//
+// Return values as for 'man 2 fork'.
+pid_t ForkWithPidFd(int flags, int cgroup_fd, int* pid_fd, bool* in_cgroup);
+
+// Creates a new memfd. 'flags' are passed to memfd_create() in addition to
+// MFD_CLOEXEC.
+bool CreateMemFd(int* fd, const char* name = "buffer_file", uint32_t flags = 0);
 
 // Executes a the program given by argv and the specified environment and
 // captures any output to stdout/stderr.
@@ -73,9 +86,86 @@ std::string GetSignalName(int signo);
 std::string GetRlimitName(int resource);
 
 // Reads a path string (NUL-terminated, shorter than PATH_MAX) from another
-// process memory
+// process memory. Only reads as much of the remote memory as needed to find
+// the NUL byte, starting with 256 bytes.
 sapi::StatusOr<std::string> ReadCPathFromPid(pid_t pid, uintptr_t ptr);
 
+// Parses a list of CPUs or NUMA nodes in the format of sysfs and cpusets, e.g.
+// "0-3,8,10-11".
+bool ParseCpuList(absl::string_view list, std::vector<int>* cpus);
+
+// Returns the CPUs of each NUMA node, by node number. Empty if the host does
+// not report NUMA nodes in sysfs.
+std::map<int, std::vector<int>> GetNumaNodes();
+
+// Returns the NUMA node which all CPUs that 'pid' may run on belong to, or -1
+// if they span several nodes or the host does not report NUMA nodes.
+int GetNumaNodeOfAffinity(pid_t pid);
+
+// Memory of a process, in bytes.
+struct MemoryUsage {
+  // Resident set size, and its proportional share: pages mapped by several
+  // processes are split between them.
+  uint64_t rss = 0;
+  uint64_t pss = 0;
+  // Resident pages which other processes map as well, e.g. inherited from a
+  // fork server or merged by KSM.
+  uint64_t shared_clean = 0;
+  uint64_t shared_dirty = 0;
+  // Resident pages only this process maps.
+  uint64_t private_clean = 0;
+  uint64_t private_dirty = 0;
+  // Pages merged by KSM, see Client::EnableMemoryMerging(). Zero before Linux
+  // 5.19.
+  uint64_t ksm_merged = 0;
+};
+
+// Parses the contents of /proc/<pid>/smaps_rollup into 'usage'. Returns false
+// if the Rss field is missing.
+bool ParseMemoryUsage(absl::string_view smaps_rollup, MemoryUsage* usage);
+
+// Returns the memory of the process 'pid', from /proc/<pid>/smaps_rollup
+// (Linux 4.14+) and /proc/<pid>/ksm_merging_pages.
+sapi::StatusOr<MemoryUsage> GetMemoryUsage(pid_t pid);
+
+// Resources used so far by a group of processes, e.g. those of a sandboxee,
+// summed over the processes.
+struct ResourceUsage {
+  // CPU time.
+  absl::Duration user_time;
+  absl::Duration system_time;
+  // Resident set size in bytes.
+  uint64_t rss = 0;
+  // Context switches of all threads, because they waited (voluntary) or were
+  // preempted (involuntary).
+  uint64_t voluntary_context_switches = 0;
+  uint64_t involuntary_context_switches = 0;
+  // Bytes read from and written to storage.
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+  int num_processes = 0;
+  int num_threads = 0;
+};
+
+// Adds the CPU time, RSS and threads of the contents of /proc/<pid>/stat to
+// 'usage' and counts the process. Returns false if they cannot be parsed.
+bool ParseProcStat(absl::string_view stat, ResourceUsage* usage);
+
+// Adds the read_bytes and write_bytes fields of /proc/<pid>/io to 'usage'.
+void ParseProcIo(absl::string_view io, ResourceUsage* usage);
+
+// Adds the context switches of /proc/<pid>/task/<tid>/status to 'usage'.
+void ParseContextSwitches(absl::string_view status, ResourceUsage* usage);
+
+// Returns 'pid' and all of its descendants, from the
+// /proc/<pid>/task/<tid>/children files (CONFIG_PROC_CHILDREN).
+std::vector<pid_t> GetProcessTree(pid_t pid);
+
+// Returns the usage of 'pids', from /proc/<pid>/stat, /proc/<pid>/io and the
+// status of every thread. Processes which exited meanwhile are skipped, and
+// like in /proc, the usage of exited threads and children is not included.
+ResourceUsage GetResourceUsage(const std::vector<pid_t>& pids);
+
 }  // namespace util
 }  // namespace sandbox2
 
@@ -15,12 +15,18 @@
 #include "sandboxed_api/sandbox2/util/fileops.h"
 
 #include <dirent.h>    // DIR
+#include <fcntl.h>
 #include <limits.h>    // PATH_MAX
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>  // stat64
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <fstream>
 #include <memory>
+#include <vector>
 
 #include "absl/strings/str_cat.h"
 #include "absl/strings/strip.h"
@@ -268,17 +274,99 @@ bool DeleteRecursively(const std::string& filename) {
   return true;
 }
 
-bool CopyFile(const std::string& old_path, const std::string& new_path,
-              int new_mode) {
-  {
-    std::ifstream input(old_path, std::ios_base::binary);
-    std::ofstream output(new_path,
-                         std::ios_base::trunc | std::ios_base::binary);
-    output << input.rdbuf();
-    if (!input || !output) {
+namespace {
+
+// Usually defined in linux/fs.h. Defined here to avoid a dependency on UAPI
+// headers.
+constexpr unsigned long kFiClone = 0x40049409;  // _IOW(0x94, 9, int)
+
+ssize_t CopyFileRange(int in_fd, off_t* in_offset, int out_fd, size_t size) {
+#ifdef __NR_copy_file_range
+  return syscall(__NR_copy_file_range, in_fd, in_offset, out_fd, nullptr, size,
+                 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Copies the rest of 'in_fd' to 'out_fd', starting at 'offset', through a
+// userspace buffer.
+bool CopyThroughBuffer(int in_fd, off_t offset, int out_fd) {
+  if (offset != 0 && lseek(in_fd, offset, SEEK_SET) == -1) {
+    return false;
+  }
+  std::vector<char> buffer(64 << 10);
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(in_fd, buffer.data(), buffer.size()));
+    if (n <= 0) {
+      return n == 0;
+    }
+    if (!WriteToFD(out_fd, buffer.data(), n)) {
       return false;
     }
   }
+}
+
+// Copies the contents of 'in_fd' to the empty file 'out_fd'. Regular files are
+// cloned where the file system supports it, and otherwise copied within the
+// kernel with copy_file_range() or sendfile(). Whatever is left, e.g. of files
+// without a meaningful size like those in /proc, is copied through a buffer.
+bool CopyFileContents(int in_fd, int out_fd) {
+  struct stat st;
+  if (fstat(in_fd, &st) == -1) {
+    return false;
+  }
+  off_t offset = 0;
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    return CopyThroughBuffer(in_fd, offset, out_fd);
+  }
+  if (ioctl(out_fd, kFiClone, in_fd) == 0) {
+    return true;
+  }
+  bool use_copy_file_range = true;
+  while (offset < st.st_size) {
+    const size_t remaining = st.st_size - offset;
+    ssize_t n;
+    if (use_copy_file_range) {
+      n = CopyFileRange(in_fd, &offset, out_fd, remaining);
+      // Not supported by the kernel or for this pair of file systems.
+      if (n == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                      errno == EOPNOTSUPP)) {
+        use_copy_file_range = false;
+        continue;
+      }
+    } else {
+      n = sendfile(out_fd, in_fd, &offset, remaining);
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Also in case the file shrank or sendfile() is not supported.
+      break;
+    }
+  }
+  return CopyThroughBuffer(in_fd, offset, out_fd);
+}
+
+}  // namespace
+
+bool CopyFile(const std::string& old_path, const std::string& new_path,
+              int new_mode) {
+  FDCloser in_fd(open(old_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (in_fd.get() == -1) {
+    return false;
+  }
+  FDCloser out_fd(open(new_path.c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       S_IRUSR | S_IWUSR));
+  if (out_fd.get() == -1) {
+    return false;
+  }
+  if (!CopyFileContents(in_fd.get(), out_fd.get()) || !out_fd.Close()) {
+    return false;
+  }
   return chmod(new_path.c_str(), new_mode) == 0;
 }
 
@@ -84,7 +84,8 @@ bool DeleteRecursively(const std::string& filename);
 
 // Copies a file from one location to another. The file will be overwritten  if
 // it already exists. If it does not exist, its mode will be new_mode. Returns
-// true on success. On failure, a partial copy of the file may remain.
+// true on success. On failure, a partial copy of the file may remain. The
+// contents are copied within the kernel where possible.
 bool CopyFile(const std::string& old_path, const std::string& new_path,
               int new_mode);
 
@@ -38,6 +38,7 @@
 
 using sapi::IsOk;
 using testing::Eq;
+using testing::HasSubstr;
 using testing::IsEmpty;
 using testing::IsFalse;
 using testing::IsTrue;
@@ -428,6 +429,31 @@ TEST_F(FileOpsTest, CopyFileTest) {
   unlink((absl::StrCat(tmp_dir, "/test2")).c_str());
 }
 
+TEST_F(FileOpsTest, CopyFileKernelPathsTest) {
+  const auto tmp_dir = GetTestTempPath();
+  const std::string large_path = absl::StrCat(tmp_dir, "/large");
+  const std::string copy_path = absl::StrCat(tmp_dir, "/large_copy");
+  std::string contents;
+  for (int i = 0; contents.size() < (3 << 20); ++i) {
+    absl::StrAppend(&contents, i, "\n");
+  }
+  ASSERT_THAT(file::SetContents(large_path, contents, file::Defaults()),
+              IsOk());
+  ASSERT_THAT(fileops::CopyFile(large_path, copy_path, 0644), IsTrue());
+  std::string text;
+  ASSERT_THAT(file::GetContents(copy_path, &text, file::Defaults()), IsOk());
+  EXPECT_THAT(text == contents, IsTrue());
+
+  // Files in /proc report a size of zero, but are not empty.
+  ASSERT_THAT(fileops::CopyFile("/proc/self/status", copy_path, 0644),
+              IsTrue());
+  ASSERT_THAT(file::GetContents(copy_path, &text, file::Defaults()), IsOk());
+  EXPECT_THAT(text, HasSubstr("Pid:"));
+
+  unlink(large_path.c_str());
+  unlink(copy_path.c_str());
+}
+
 }  // namespace
 }  // namespace file_util
 }  // namespace sandbox2
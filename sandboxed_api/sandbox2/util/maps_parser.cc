@@ -13,47 +13,184 @@
 // limitations under the License.
 
 #include "sandboxed_api/sandbox2/util/maps_parser.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
 #include "sandboxed_api/util/canonical_errors.h"
 
 namespace sandbox2 {
 
+namespace {
+
+// Consumes a number from the front of 'line'.
+template <typename T>
+bool ConsumeNumber(absl::string_view* line, int base, T* value) {
+  uint64_t result = 0;
+  size_t i = 0;
+  for (; i < line->size(); ++i) {
+    const char c = (*line)[i];
+    int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      break;
+    }
+    if (result > (UINT64_MAX - digit) / base) {
+      return false;
+    }
+    result = result * base + digit;
+  }
+  if (i == 0) {
+    return false;
+  }
+  line->remove_prefix(i);
+  *value = result;
+  return true;
+}
+
+bool ConsumeChar(absl::string_view* line, char c) {
+  if (line->empty() || line->front() != c) {
+    return false;
+  }
+  line->remove_prefix(1);
+  return true;
+}
+
+// Consumes at least one space.
+bool ConsumeSpaces(absl::string_view* line) {
+  size_t spaces = line->find_first_not_of(' ');
+  if (spaces == 0) {
+    return false;
+  }
+  line->remove_prefix(spaces == absl::string_view::npos ? line->size()
+                                                        : spaces);
+  return true;
+}
+
+}  // namespace
+
+bool ParseProcMapsLine(absl::string_view line, MapsEntryView* entry) {
+  // The format of a line, see show_vma_header_prefix() in
+  // fs/proc/task_mmu.c of the kernel:
+  //   start-end perms offset major:minor inode [path]
+  // Paths may contain spaces, they extend to the end of the line.
+  if (!ConsumeNumber(&line, 16, &entry->start) || !ConsumeChar(&line, '-') ||
+      !ConsumeNumber(&line, 16, &entry->end) || !ConsumeSpaces(&line) ||
+      line.size() < 4) {
+    return false;
+  }
+  entry->is_readable = line[0] == 'r';
+  entry->is_writable = line[1] == 'w';
+  entry->is_executable = line[2] == 'x';
+  entry->is_shared = line[3] == 's';
+  line.remove_prefix(4);
+  if (!ConsumeSpaces(&line) || !ConsumeNumber(&line, 16, &entry->pgoff) ||
+      !ConsumeSpaces(&line) || !ConsumeNumber(&line, 16, &entry->major) ||
+      !ConsumeChar(&line, ':') || !ConsumeNumber(&line, 16, &entry->minor) ||
+      !ConsumeSpaces(&line) || !ConsumeNumber(&line, 10, &entry->inode)) {
+    return false;
+  }
+  // Anonymous mappings have no path, possibly followed by padding.
+  if (!line.empty() && !ConsumeSpaces(&line)) {
+    return false;
+  }
+  entry->path = line;
+  return true;
+}
+
 sapi::StatusOr<std::vector<MapsEntry>> ParseProcMaps(
     const std::string& contents) {
-  // Note: The format string
-  //       https://github.com/torvalds/linux/blob/v4.14/fs/proc/task_mmu.c#L289
-  //       changed to a non-format string implementation
-  //       (show_vma_header_prefix()).
-  static constexpr char kFormatString[] =
-      "%lx-%lx %c%c%c%c %lx %x:%x %lu %1023s";
-  static constexpr size_t kFilepathLength = 1023;
-
-  std::vector<std::string> lines =
-      absl::StrSplit(contents, '\n', absl::SkipEmpty());
   std::vector<MapsEntry> entries;
-  for (const auto& line : lines) {
-    MapsEntry entry{};
-    char r, w, x, s;
-    entry.path.resize(kFilepathLength + 1, '\0');
-    int n_matches = sscanf(
-        line.c_str(), kFormatString, &entry.start, &entry.end, &r, &w, &x, &s,
-        &entry.pgoff, &entry.major, &entry.minor, &entry.inode, &entry.path[0]);
-
-    // Some lines do not have a filename.
-    if (n_matches == 10) {
-      entry.path.clear();
-    } else if (n_matches == 11) {
-      entry.path.resize(strlen(entry.path.c_str()));
-    } else {
+  for (absl::string_view line :
+       absl::StrSplit(contents, '\n', absl::SkipEmpty())) {
+    MapsEntryView view;
+    if (!ParseProcMapsLine(line, &view)) {
       return sapi::FailedPreconditionError("Invalid format");
     }
-    entry.is_readable = r == 'r';
-    entry.is_writable = w == 'w';
-    entry.is_executable = x == 'x';
-    entry.is_shared = s == 's';
-    entries.push_back(entry);
+    entries.push_back({view.start, view.end, view.is_readable,
+                       view.is_writable, view.is_executable, view.is_shared,
+                       view.pgoff, view.major, view.minor, view.inode,
+                       std::string(view.path)});
   }
   return entries;
 }
 
+ProcMapsReader::ProcMapsReader(int fd) : fd_(fd), buffer_(64 << 10, '\0') {}
+
+ProcMapsReader::~ProcMapsReader() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+sapi::StatusOr<std::unique_ptr<ProcMapsReader>> ProcMapsReader::OpenForPid(
+    pid_t pid) {
+  const std::string path = absl::StrCat("/proc/", pid, "/maps");
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return sapi::UnknownError(
+        absl::StrCat("open(", path, "): ", StrError(errno)));
+  }
+  return absl::make_unique<ProcMapsReader>(fd);
+}
+
+bool ProcMapsReader::Next(MapsEntryView* entry) {
+  while (status_.ok()) {
+    const char* begin = &buffer_[begin_];
+    const char* newline =
+        static_cast<const char*>(memchr(begin, '\n', end_ - begin_));
+    if (newline == nullptr && !eof_) {
+      Fill();
+      continue;
+    }
+    // The last line may not be terminated.
+    const size_t length = newline != nullptr ? newline - begin : end_ - begin_;
+    if (length == 0 && newline == nullptr) {
+      return false;
+    }
+    begin_ += newline != nullptr ? length + 1 : length;
+    if (length == 0) {
+      continue;
+    }
+    if (!ParseProcMapsLine(absl::string_view(begin, length), entry)) {
+      status_ = sapi::FailedPreconditionError("Invalid format");
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+void ProcMapsReader::Fill() {
+  if (begin_ != 0) {
+    memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  // The buffer holds a single line which does not fit.
+  if (end_ == buffer_.size()) {
+    buffer_.resize(buffer_.size() * 2);
+  }
+  ssize_t n = TEMP_FAILURE_RETRY(
+      read(fd_, &buffer_[end_], buffer_.size() - end_));
+  if (n == -1) {
+    status_ = sapi::UnknownError(absl::StrCat("read(): ", StrError(errno)));
+    return;
+  }
+  if (n == 0) {
+    eof_ = true;
+  }
+  end_ += n;
+}
+
 }  // namespace sandbox2
@@ -15,10 +15,14 @@
 #ifndef SANDBOXED_API_SANDBOX2_UTIL_MAPS_PARSER_H_
 #define SANDBOXED_API_SANDBOX2_UTIL_MAPS_PARSER_H_
 
+#include <sys/types.h>
+
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "absl/strings/string_view.h"
 #include "sandboxed_api/util/status.h"
 #include "sandboxed_api/util/statusor.h"
 
@@ -38,9 +42,72 @@ struct MapsEntry {
   std::string path;
 };
 
+// Like MapsEntry, but the path refers to the line it was parsed from.
+struct MapsEntryView {
+  uint64_t start;
+  uint64_t end;
+  bool is_readable;
+  bool is_writable;
+  bool is_executable;
+  bool is_shared;
+  uint64_t pgoff;
+  int major;
+  int minor;
+  uint64_t inode;
+  // Empty for anonymous mappings.
+  absl::string_view path;
+};
+
 sapi::StatusOr<std::vector<MapsEntry>> ParseProcMaps(
     const std::string& contents);
 
+// Parses a single line of a maps file, without the trailing newline. Returns
+// false if it is malformed.
+bool ParseProcMapsLine(absl::string_view line, MapsEntryView* entry);
+
+// Reads the entries of a maps file one by one through a buffer which is
+// reused, so that processes with many mappings can be inspected without
+// allocating per entry. Reading can stop at any entry.
+//
+// Example:
+//   SAPI_ASSIGN_OR_RETURN(auto reader, ProcMapsReader::OpenForPid(pid));
+//   MapsEntryView entry;
+//   while (reader->Next(&entry)) {
+//     ...
+//   }
+//   SAPI_RETURN_IF_ERROR(reader->status());
+class ProcMapsReader {
+ public:
+  // Takes ownership of 'fd', which is read from its current position.
+  explicit ProcMapsReader(int fd);
+  ~ProcMapsReader();
+
+  ProcMapsReader(const ProcMapsReader&) = delete;
+  ProcMapsReader& operator=(const ProcMapsReader&) = delete;
+
+  // Opens /proc/<pid>/maps.
+  static sapi::StatusOr<std::unique_ptr<ProcMapsReader>> OpenForPid(pid_t pid);
+
+  // Parses the next entry. Returns false at the end of the file, or if it
+  // could not be read or parsed, see status(). The entry's path is only valid
+  // until the next call.
+  bool Next(MapsEntryView* entry);
+
+  sapi::Status status() const { return status_; }
+
+ private:
+  // Reads more data into the buffer, growing it if it is full.
+  void Fill();
+
+  int fd_;
+  std::string buffer_;
+  // Unparsed part of the buffer.
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  bool eof_ = false;
+  sapi::Status status_;
+};
+
 }  // namespace sandbox2
 
 #endif  // SANDBOXED_API_SANDBOX2_UTIL_MAPS_PARSER_H_
@@ -14,8 +14,18 @@
 
 #include "sandboxed_api/sandbox2/util/maps_parser.h"
 
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/util/fileops.h"
 #include "sandboxed_api/util/status_matchers.h"
 
 namespace sandbox2 {
@@ -23,9 +33,24 @@ namespace {
 
 using ::sapi::IsOk;
 using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
 using ::testing::Not;
+using ::testing::StrEq;
 using ::testing::Test;
 
+// Returns a reader for 'contents'.
+std::unique_ptr<ProcMapsReader> ReaderFor(const std::string& contents) {
+  int fd = syscall(__NR_memfd_create, "maps", 0);
+  EXPECT_THAT(fd, Not(Eq(-1)));
+  EXPECT_THAT(file_util::fileops::WriteToFD(fd, contents.data(),
+                                            contents.size()),
+              IsTrue());
+  EXPECT_THAT(lseek(fd, 0, SEEK_SET), Eq(0));
+  return absl::make_unique<ProcMapsReader>(fd);
+}
+
 TEST(MapsParserTest, ParsesValidFileCorrectly) {
   static constexpr char kValidMapsFile[] = R"ValidMapsFile(
 555555554000-55555555c000 r-xp 00000000 fd:01 3277961                    /bin/cat
@@ -85,5 +110,67 @@ TEST(MapsParserTest, FailsOnInvalidFile) {
   ASSERT_THAT(status_or.status(), Not(IsOk()));
 }
 
+TEST(MapsParserTest, ParsesPathsWithSpaces) {
+  MapsEntryView entry;
+  ASSERT_THAT(ParseProcMapsLine("7ffff7dd5000-7ffff7dd9000 rw-s 00001000 "
+                                "fd:01 42    /tmp/a file (deleted)",
+                                &entry),
+              IsTrue());
+  EXPECT_THAT(entry.pgoff, Eq(0x1000));
+  EXPECT_THAT(entry.major, Eq(0xfd));
+  EXPECT_THAT(entry.minor, Eq(1));
+  EXPECT_THAT(entry.inode, Eq(42));
+  EXPECT_THAT(entry.is_shared, IsTrue());
+  EXPECT_THAT(std::string(entry.path), StrEq("/tmp/a file (deleted)"));
+
+  ASSERT_THAT(ParseProcMapsLine("7ffff7dd5000-7ffff7dd9000 rw-p 00000000 "
+                                "00:00 0 ",
+                                &entry),
+              IsTrue());
+  EXPECT_THAT(entry.path, IsEmpty());
+  EXPECT_THAT(ParseProcMapsLine("7ffff7dd5000-7ffff7dd9000 rw-p 00000000 "
+                                "00:00 0x",
+                                &entry),
+              IsFalse());
+}
+
+TEST(MapsParserTest, ReaderStreamsEntries) {
+  // Paths longer than the initial buffer make it grow.
+  const std::string long_path = "/" + std::string(100000, 'x');
+  std::unique_ptr<ProcMapsReader> reader = ReaderFor(absl::StrCat(
+      "555555554000-55555555c000 r-xp 00000000 fd:01 3277961 /bin/cat\n",
+      "55555575d000-55555577e000 rw-p 00000000 00:00 0 ", long_path, "\n\n",
+      "7ffffffde000-7ffffffff000 rw-p 00000000 00:00 0 [stack]"));
+  MapsEntryView entry;
+  ASSERT_THAT(reader->Next(&entry), IsTrue());
+  EXPECT_THAT(std::string(entry.path), StrEq("/bin/cat"));
+  ASSERT_THAT(reader->Next(&entry), IsTrue());
+  EXPECT_THAT(std::string(entry.path), StrEq(long_path));
+  // The last line has no newline.
+  ASSERT_THAT(reader->Next(&entry), IsTrue());
+  EXPECT_THAT(entry.start, Eq(0x7ffffffde000));
+  EXPECT_THAT(std::string(entry.path), StrEq("[stack]"));
+  EXPECT_THAT(reader->Next(&entry), IsFalse());
+  EXPECT_THAT(reader->status(), IsOk());
+
+  reader = ReaderFor("555555554000+55555555c000 r-xp 00000000 fd:01 1\n");
+  EXPECT_THAT(reader->Next(&entry), IsFalse());
+  EXPECT_THAT(reader->status(), Not(IsOk()));
+}
+
+TEST(MapsParserTest, ReadsOwnMaps) {
+  SAPI_ASSERT_OK_AND_ASSIGN(std::unique_ptr<ProcMapsReader> reader,
+                            ProcMapsReader::OpenForPid(getpid()));
+  const uint64_t code = reinterpret_cast<uintptr_t>(&ParseProcMapsLine);
+  MapsEntryView entry;
+  bool found = false;
+  while (!found && reader->Next(&entry)) {
+    found = entry.start <= code && code < entry.end;
+  }
+  ASSERT_THAT(found, IsTrue());
+  EXPECT_THAT(entry.is_executable, IsTrue());
+  EXPECT_THAT(reader->status(), IsOk());
+}
+
 }  // namespace
 }  // namespace sandbox2
@@ -15,6 +15,10 @@
 #include "sandboxed_api/sandbox2/util/minielf.h"
 
 #include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cstddef>
 #include <memory>
@@ -50,27 +54,6 @@ constexpr int kEvCurrent = 1;  // ELF version
 
 namespace {
 
-// NOLINTNEXTLINE
-sapi::Status CheckedFSeek(FILE* f, long offset, int whence) {
-  if (fseek(f, offset, whence)) {
-    return sapi::FailedPreconditionError(
-        absl::StrCat("Fseek on ELF failed: ", StrError(errno)));
-  }
-  return sapi::OkStatus();
-}
-
-sapi::Status CheckedFRead(void* dst, size_t size, size_t nmemb, FILE* f) {
-  if (fread(dst, size, nmemb, f) == nmemb) {
-    return sapi::OkStatus();
-  }
-  return sapi::FailedPreconditionError(
-      absl::StrCat("Reading ELF data failed: ", StrError(errno)));
-}
-
-sapi::Status CheckedRead(std::string* s, FILE* f) {
-  return CheckedFRead(&(*s)[0], 1, s->size(), f);
-}
-
 absl::string_view ReadName(uint32_t offset, absl::string_view strtab) {
   auto name = strtab.substr(offset);
   return name.substr(0, name.find('\0'));
@@ -96,7 +79,9 @@ class ElfParser {
   static constexpr size_t kMaxInterpreterSize = 1000;
 
   ElfParser() = default;
-  sapi::StatusOr<ElfFile> Parse(FILE* elf, uint32_t features);
+  // Parses the ELF file mapped at 'elf'. Only the parts needed for 'features'
+  // are accessed.
+  sapi::StatusOr<ElfFile> Parse(absl::string_view elf, uint32_t features);
 
  private:
   // Endianess support functions
@@ -129,8 +114,10 @@ class ElfParser {
   void Load(int32_t* dst, const void* src) { *dst = Load32(src); }
   void Load(int64_t* dst, const void* src) { *dst = Load64(src); }
 
-  // Reads elf file size.
-  sapi::Status ReadFileSize();
+  // Returns 'size' bytes of the file at 'offset', fails if they are not within
+  // the file.
+  sapi::StatusOr<absl::string_view> GetFileData(uint64_t offset, uint64_t size,
+                                                absl::string_view what);
   // Reads elf header.
   sapi::Status ReadFileHeader();
   // Reads a single elf program header.
@@ -141,17 +128,18 @@ class ElfParser {
   sapi::StatusOr<Elf64_Shdr> ReadSectionHeader(absl::string_view src);
   // Reads all elf section headers.
   sapi::Status ReadSectionHeaders();
-  // Reads contents of an elf section.
-  sapi::StatusOr<std::string> ReadSectionContents(int idx);
-  sapi::StatusOr<std::string> ReadSectionContents(
-      const Elf64_Shdr& section_header);
+  // Returns the contents of an elf section, without copying them.
+  sapi::StatusOr<absl::string_view> ReadSectionContents(
+      int idx, size_t max_size = kMaxSectionSize);
+  sapi::StatusOr<absl::string_view> ReadSectionContents(
+      const Elf64_Shdr& section_header, size_t max_size = kMaxSectionSize);
   // Reads all symbols from symtab section.
   sapi::Status ReadSymbolsFromSymtab(const Elf64_Shdr& symtab);
   // Reads all imported libraries from dynamic section.
   sapi::Status ReadImportedLibrariesFromDynamic(const Elf64_Shdr& dynamic);
 
   ElfFile result_;
-  FILE* elf_ = nullptr;
+  absl::string_view elf_;
   size_t file_size_ = 0;
   bool elf_little_ = false;
   Elf64_Ehdr file_header_;
@@ -171,21 +159,18 @@ constexpr int ElfParser::kMaxSymbolEntries;
 constexpr int ElfParser::kMaxDynamicEntries;
 constexpr size_t ElfParser::kMaxInterpreterSize;
 
-sapi::Status ElfParser::ReadFileSize() {
-  fseek(elf_, 0, SEEK_END);
-  file_size_ = ftell(elf_);
-  if (file_size_ < kElfHeaderSize) {
-    return sapi::FailedPreconditionError(
-        absl::StrCat("file too small: ", file_size_, " bytes, at least ",
-                     kElfHeaderSize, " bytes expected"));
+sapi::StatusOr<absl::string_view> ElfParser::GetFileData(
+    uint64_t offset, uint64_t size, absl::string_view what) {
+  if (offset > file_size_ || size > file_size_ - offset) {
+    return sapi::FailedPreconditionError(absl::StrCat(
+        "invalid ", what, ": ", size, " bytes at offset ", offset,
+        " exceed the file size of ", file_size_, " bytes"));
   }
-  return sapi::OkStatus();
+  return elf_.substr(offset, size);
 }
 
 sapi::Status ElfParser::ReadFileHeader() {
-  std::string header(kElfHeaderSize, '\0');
-  SAPI_RETURN_IF_ERROR(CheckedFSeek(elf_, 0, SEEK_SET));
-  SAPI_RETURN_IF_ERROR(CheckedRead(&header, elf_));
+  absl::string_view header = elf_.substr(0, kElfHeaderSize);
 
   if (!absl::StartsWith(header, kElfMagic)) {
     return sapi::FailedPreconditionError("magic not found, not an ELF");
@@ -256,11 +241,12 @@ sapi::Status ElfParser::ReadSectionHeaders() {
         absl::StrCat("too many section header entries: ", file_header_.e_shnum,
                      " limit: ", kMaxSectionHeaderEntries));
   }
-  std::string headers(file_header_.e_shentsize * file_header_.e_shnum, '\0');
-  SAPI_RETURN_IF_ERROR(CheckedFSeek(elf_, file_header_.e_shoff, SEEK_SET));
-  SAPI_RETURN_IF_ERROR(CheckedRead(&headers, elf_));
+  SAPI_ASSIGN_OR_RETURN(
+      absl::string_view src,
+      GetFileData(file_header_.e_shoff,
+                  file_header_.e_shentsize * file_header_.e_shnum,
+                  "section headers"));
   section_headers_.resize(file_header_.e_shnum);
-  absl::string_view src = headers;
   for (int i = 0; i < file_header_.e_shnum; ++i) {
     SAPI_ASSIGN_OR_RETURN(section_headers_[i], ReadSectionHeader(src));
     src = src.substr(file_header_.e_shentsize);
@@ -268,30 +254,23 @@ sapi::Status ElfParser::ReadSectionHeaders() {
   return sapi::OkStatus();
 }
 
-sapi::StatusOr<std::string> ElfParser::ReadSectionContents(int idx) {
+sapi::StatusOr<absl::string_view> ElfParser::ReadSectionContents(
+    int idx, size_t max_size) {
   if (idx < 0 || idx >= section_headers_.size()) {
     return sapi::FailedPreconditionError(
         absl::StrCat("invalid section header index: ", idx));
   }
-  return ReadSectionContents(section_headers_.at(idx));
+  return ReadSectionContents(section_headers_.at(idx), max_size);
 }
 
-sapi::StatusOr<std::string> ElfParser::ReadSectionContents(
-    const Elf64_Shdr& section_header) {
-  auto offset = section_header.sh_offset;
-  if (offset > file_size_) {
-    return sapi::FailedPreconditionError(
-        absl::StrCat("invalid section offset: ", offset));
-  }
+sapi::StatusOr<absl::string_view> ElfParser::ReadSectionContents(
+    const Elf64_Shdr& section_header, size_t max_size) {
   auto size = section_header.sh_size;
-  if (size > kMaxSectionSize) {
+  if (size > max_size) {
     return sapi::FailedPreconditionError(
-        absl::StrCat("section too big: ", size, " limit: ", kMaxSectionSize));
+        absl::StrCat("section too big: ", size, " limit: ", max_size));
   }
-  std::string rv(size, '\0');
-  SAPI_RETURN_IF_ERROR(CheckedFSeek(elf_, offset, SEEK_SET));
-  SAPI_RETURN_IF_ERROR(CheckedRead(&rv, elf_));
-  return rv;
+  return GetFileData(section_header.sh_offset, size, "section");
 }
 
 sapi::StatusOr<Elf64_Phdr> ElfParser::ReadProgramHeader(
@@ -328,11 +307,12 @@ sapi::Status ElfParser::ReadProgramHeaders() {
         absl::StrCat("too many program header entries: ", file_header_.e_phnum,
                      " limit: ", kMaxProgramHeaderEntries));
   }
-  std::string headers(file_header_.e_phentsize * file_header_.e_phnum, '\0');
-  SAPI_RETURN_IF_ERROR(CheckedFSeek(elf_, file_header_.e_phoff, SEEK_SET));
-  SAPI_RETURN_IF_ERROR(CheckedRead(&headers, elf_));
+  SAPI_ASSIGN_OR_RETURN(
+      absl::string_view src,
+      GetFileData(file_header_.e_phoff,
+                  file_header_.e_phentsize * file_header_.e_phnum,
+                  "program headers"));
   program_headers_.resize(file_header_.e_phnum);
-  absl::string_view src = headers;
   for (int i = 0; i < file_header_.e_phnum; ++i) {
     SAPI_ASSIGN_OR_RETURN(program_headers_[i], ReadProgramHeader(src));
     src = src.substr(file_header_.e_phentsize);
@@ -363,8 +343,9 @@ sapi::Status ElfParser::ReadSymbolsFromSymtab(const Elf64_Shdr& symtab) {
         absl::StrCat("invalid symtab's strtab reference: ", symtab.sh_link));
   }
   SAPI_RAW_VLOG(1, "Symbol table with %d entries found", symbol_entries);
-  SAPI_ASSIGN_OR_RETURN(std::string strtab, ReadSectionContents(symtab.sh_link));
-  SAPI_ASSIGN_OR_RETURN(std::string symbols, ReadSectionContents(symtab));
+  SAPI_ASSIGN_OR_RETURN(absl::string_view strtab,
+                        ReadSectionContents(symtab.sh_link, kMaxStrtabSize));
+  SAPI_ASSIGN_OR_RETURN(absl::string_view symbols, ReadSectionContents(symtab));
   result_.symbols_.reserve(result_.symbols_.size() + symbol_entries);
   for (absl::string_view src = symbols; !src.empty();
        src = src.substr(symtab.sh_entsize)) {
@@ -422,19 +403,10 @@ sapi::Status ElfParser::ReadImportedLibrariesFromDynamic(
   }
   SAPI_RAW_VLOG(1, "Dynamic section with %d entries found", entries);
   // strtab may be shared with symbols and therefore huge
-  const auto& strtab_section = section_headers_.at(dynamic.sh_link);
-  if (strtab_section.sh_offset > file_size_) {
-    return sapi::FailedPreconditionError(absl::StrCat(
-        "invalid symtab's strtab section offset: ", strtab_section.sh_offset));
-  }
-  if (strtab_section.sh_size >= kMaxStrtabSize ||
-      strtab_section.sh_size >= file_size_ ||
-      strtab_section.sh_offset >= file_size_ - strtab_section.sh_size) {
-    return sapi::FailedPreconditionError(
-        absl::StrCat("symtab's strtab too big: ", strtab_section.sh_size));
-  }
-  auto strtab_end = strtab_section.sh_offset + strtab_section.sh_size;
-  SAPI_ASSIGN_OR_RETURN(std::string dynamic_entries, ReadSectionContents(dynamic));
+  SAPI_ASSIGN_OR_RETURN(absl::string_view strtab,
+                        ReadSectionContents(dynamic.sh_link, kMaxStrtabSize));
+  SAPI_ASSIGN_OR_RETURN(absl::string_view dynamic_entries,
+                        ReadSectionContents(dynamic));
   for (absl::string_view src = dynamic_entries; !src.empty();
        src = src.substr(dynamic.sh_entsize)) {
     Elf64_Dyn dyn;
@@ -443,27 +415,30 @@ sapi::Status ElfParser::ReadImportedLibrariesFromDynamic(
     if (dyn.d_tag != DT_NEEDED) {
       continue;
     }
-    if (dyn.d_un.d_val >= strtab_section.sh_size) {
+    if (dyn.d_un.d_val >= strtab.size()) {
       return sapi::FailedPreconditionError(
           absl::StrCat("invalid name reference"));
     }
-    auto offset = strtab_section.sh_offset + dyn.d_un.d_val;
-    SAPI_RETURN_IF_ERROR(CheckedFSeek(elf_, offset, SEEK_SET));
-    std::string path(std::min(kMaxLibPathSize, strtab_end - offset), '\0');
-    size_t size = fread(&path[0], 1, path.size(), elf_);
-    path.resize(size);
-    result_.imported_libraries_.push_back(path.substr(0, path.find('\0')));
+    absl::string_view path = strtab.substr(dyn.d_un.d_val, kMaxLibPathSize);
+    result_.imported_libraries_.emplace_back(path.substr(0, path.find('\0')));
   }
   return sapi::OkStatus();
 }
 
-sapi::StatusOr<ElfFile> ElfParser::Parse(FILE* elf, uint32_t features) {
+sapi::StatusOr<ElfFile> ElfParser::Parse(absl::string_view elf,
+                                          uint32_t features) {
   elf_ = elf;
+  file_size_ = elf.size();
+  result_.file_size_ = file_size_;
   // Basic sanity check.
   if (features & ~(ElfFile::kAll)) {
     return sapi::InvalidArgumentError("Unknown feature flags specified");
   }
-  SAPI_RETURN_IF_ERROR(ReadFileSize());
+  if (file_size_ < kElfHeaderSize) {
+    return sapi::FailedPreconditionError(
+        absl::StrCat("file too small: ", file_size_, " bytes, at least ",
+                     kElfHeaderSize, " bytes expected"));
+  }
   SAPI_RETURN_IF_ERROR(ReadFileHeader());
   switch (file_header_.e_type) {
     case ET_EXEC:
@@ -477,7 +452,7 @@ sapi::StatusOr<ElfFile> ElfParser::Parse(FILE* elf, uint32_t features) {
   }
   if (features & ElfFile::kGetInterpreter) {
     SAPI_RETURN_IF_ERROR(ReadProgramHeaders());
-    std::string interpreter;
+    absl::string_view interpreter;
     auto it = std::find_if(
         program_headers_.begin(), program_headers_.end(),
         [](const Elf64_Phdr& hdr) { return hdr.p_type == PT_INTERP; });
@@ -487,15 +462,12 @@ sapi::StatusOr<ElfFile> ElfParser::Parse(FILE* elf, uint32_t features) {
         return sapi::FailedPreconditionError(
             absl::StrCat("program interpeter path too long: ", it->p_filesz));
       }
-      SAPI_RETURN_IF_ERROR(CheckedFSeek(elf, it->p_offset, SEEK_SET));
-      interpreter.resize(it->p_filesz, '\0');
-      SAPI_RETURN_IF_ERROR(CheckedRead(&interpreter, elf));
-      auto first_nul = interpreter.find_first_of('\0');
-      if (first_nul != std::string::npos) {
-        interpreter.erase(first_nul);
-      }
+      SAPI_ASSIGN_OR_RETURN(
+          interpreter,
+          GetFileData(it->p_offset, it->p_filesz, "program interpreter"));
+      interpreter = interpreter.substr(0, interpreter.find('\0'));
     }
-    result_.interpreter_ = std::move(interpreter);
+    result_.interpreter_ = std::string(interpreter);
   }
 
   if (features & (ElfFile::kLoadSymbols | ElfFile::kLoadImportedLibraries)) {
@@ -516,14 +488,40 @@ sapi::StatusOr<ElfFile> ElfParser::Parse(FILE* elf, uint32_t features) {
 
 sapi::StatusOr<ElfFile> ElfFile::ParseFromFile(const std::string& filename,
                                                  uint32_t features) {
-  std::unique_ptr<FILE, void (*)(FILE*)> elf{fopen(filename.c_str(), "r"),
-                                             [](FILE* f) { fclose(f); }};
-  if (!elf) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     return sapi::UnknownError(
         absl::StrCat("cannot open file: ", filename, ": ", StrError(errno)));
   }
-
-  return ElfParser().Parse(elf.get(), features);
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    return sapi::UnknownError(
+        absl::StrCat("cannot stat file: ", filename, ": ",
+                     StrError(saved_errno)));
+  }
+  // Map the whole file, so that only the pages touched by the requested
+  // features are read. The parser copies everything it returns.
+  size_t size = sb.st_size;
+  void* addr = nullptr;
+  if (size > 0) {
+    addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  int saved_errno = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return sapi::UnknownError(
+        absl::StrCat("cannot map file: ", filename, ": ",
+                     StrError(saved_errno)));
+  }
+  auto result = ElfParser().Parse(
+      absl::string_view(static_cast<const char*>(addr), addr ? size : 0),
+      features);
+  if (addr) {
+    munmap(addr, size);
+  }
+  return result;
 }
 
 }  // namespace sandbox2
@@ -14,17 +14,35 @@
 
 #include "sandboxed_api/sandbox2/util.h"
 
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/sandbox2/testing.h"
 #include "sandboxed_api/sandbox2/util/path.h"
+#include "sandboxed_api/util/status_matchers.h"
 
+using testing::ElementsAre;
+using testing::Eq;
+using testing::Ge;
 using testing::Gt;
+using testing::IsEmpty;
+using testing::IsFalse;
 using testing::IsTrue;
+using testing::Ne;
+using testing::Not;
 
 namespace sandbox2 {
 namespace util {
@@ -49,6 +67,148 @@ TEST(UtilTest, TestCreateMemFd) {
   close(fd);
 }
 
+TEST(UtilTest, TestParseCpuList) {
+  std::vector<int> cpus;
+  ASSERT_THAT(ParseCpuList("0-3,8,10-11\n", &cpus), IsTrue());
+  EXPECT_THAT(cpus, ElementsAre(0, 1, 2, 3, 8, 10, 11));
+  ASSERT_THAT(ParseCpuList("", &cpus), IsTrue());
+  EXPECT_THAT(cpus, ElementsAre());
+  EXPECT_THAT(ParseCpuList("3-1", &cpus), IsFalse());
+  EXPECT_THAT(ParseCpuList("a", &cpus), IsFalse());
+}
+
+TEST(UtilTest, TestGetNumaNodeOfAffinity) {
+  std::map<int, std::vector<int>> nodes = GetNumaNodes();
+  const int node = GetNumaNodeOfAffinity(getpid());
+  if (node != -1) {
+    EXPECT_THAT(nodes.count(node), Eq(1));
+  }
+  if (nodes.size() == 1) {
+    EXPECT_THAT(node, Eq(nodes.begin()->first));
+  }
+}
+
+TEST(UtilTest, TestReadCPathFromPid) {
+  std::string short_path = "/etc/passwd";
+  auto path_or = ReadCPathFromPid(
+      getpid(), reinterpret_cast<uintptr_t>(short_path.c_str()));
+  ASSERT_THAT(path_or.ok(), IsTrue());
+  EXPECT_THAT(path_or.ValueOrDie(), Eq(short_path));
+
+  // Needs several reads.
+  std::string long_path = "/" + std::string(3000, 'a');
+  path_or = ReadCPathFromPid(getpid(),
+                             reinterpret_cast<uintptr_t>(long_path.c_str()));
+  ASSERT_THAT(path_or.ok(), IsTrue());
+  EXPECT_THAT(path_or.ValueOrDie(), Eq(long_path));
+
+  // Not NUL-terminated before the end of the mapping.
+  size_t page_size = getpagesize();
+  char* mem = static_cast<char*>(mmap(nullptr, 2 * page_size,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_THAT(mem, Ne(MAP_FAILED));
+  ASSERT_THAT(munmap(mem + page_size, page_size), Eq(0));
+  memset(mem, 'a', page_size);
+  path_or = ReadCPathFromPid(
+      getpid(), reinterpret_cast<uintptr_t>(mem + page_size - 100));
+  EXPECT_THAT(path_or.ok(), IsFalse());
+  munmap(mem, page_size);
+}
+
+TEST(UtilTest, TestForkWithPidFd) {
+  int pid_fd;
+  bool in_cgroup;
+  pid_t pid = ForkWithPidFd(SIGCHLD, /*cgroup_fd=*/-1, &pid_fd, &in_cgroup);
+  ASSERT_THAT(pid, Ne(-1));
+  if (pid == 0) {
+    _exit(7);
+  }
+  EXPECT_THAT(in_cgroup, IsFalse());
+  if (pid_fd != -1) {
+    // The pidfd becomes readable once the child has exited.
+    struct pollfd pfd = {pid_fd, POLLIN, 0};
+    EXPECT_THAT(poll(&pfd, 1, -1), Eq(1));
+    close(pid_fd);
+  }
+  int status;
+  ASSERT_THAT(waitpid(pid, &status, 0), Eq(pid));
+  ASSERT_THAT(WIFEXITED(status), IsTrue());
+  EXPECT_THAT(WEXITSTATUS(status), Eq(7));
+}
+
+TEST(UtilTest, TestParseMemoryUsage) {
+  MemoryUsage usage;
+  ASSERT_THAT(ParseMemoryUsage("00400000-7ffd2bdf0000 ---p 00000000 00:00 0 "
+                               "         [rollup]\n"
+                               "Rss:                2048 kB\n"
+                               "Pss:                1024 kB\n"
+                               "Shared_Clean:       1536 kB\n"
+                               "Shared_Dirty:          4 kB\n"
+                               "Private_Clean:       256 kB\n"
+                               "Private_Dirty:       252 kB\n"
+                               "Swap:                  0 kB\n",
+                               &usage),
+              IsTrue());
+  EXPECT_THAT(usage.rss, Eq(uint64_t{2048} << 10));
+  EXPECT_THAT(usage.pss, Eq(uint64_t{1024} << 10));
+  EXPECT_THAT(usage.shared_clean, Eq(uint64_t{1536} << 10));
+  EXPECT_THAT(usage.shared_dirty, Eq(uint64_t{4} << 10));
+  EXPECT_THAT(usage.private_clean, Eq(uint64_t{256} << 10));
+  EXPECT_THAT(usage.private_dirty, Eq(uint64_t{252} << 10));
+  EXPECT_THAT(ParseMemoryUsage("", &usage), IsFalse());
+}
+
+TEST(UtilTest, TestGetMemoryUsage) {
+  SAPI_ASSERT_OK_AND_ASSIGN(MemoryUsage usage, GetMemoryUsage(getpid()));
+  EXPECT_THAT(usage.rss, Gt(0));
+  EXPECT_THAT(usage.rss,
+              Eq(usage.shared_clean + usage.shared_dirty +
+                 usage.private_clean + usage.private_dirty));
+}
+
+TEST(UtilTest, TestParseResourceUsage) {
+  ResourceUsage usage;
+  // The command name may contain spaces and parentheses.
+  const std::string stat =
+      absl::StrCat("42 (a) b) S 1 42 42 0 -1 4194560 100 0 0 0 ",
+                   sysconf(_SC_CLK_TCK) * 2, " ", sysconf(_SC_CLK_TCK),
+                   " 0 0 20 0 3 0 1234 12345678 10 18446744073709551615\n");
+  ASSERT_THAT(ParseProcStat(stat, &usage), IsTrue());
+  EXPECT_THAT(usage.user_time, Eq(absl::Seconds(2)));
+  EXPECT_THAT(usage.system_time, Eq(absl::Seconds(1)));
+  EXPECT_THAT(usage.num_threads, Eq(3));
+  EXPECT_THAT(usage.rss,
+              Eq(static_cast<uint64_t>(10 * sysconf(_SC_PAGESIZE))));
+  EXPECT_THAT(usage.num_processes, Eq(1));
+  EXPECT_THAT(ParseProcStat("42 (a) S 1", &usage), IsFalse());
+
+  ParseProcIo("rchar: 10\nwchar: 20\nread_bytes: 4096\nwrite_bytes: 8192\n",
+              &usage);
+  EXPECT_THAT(usage.read_bytes, Eq(uint64_t{4096}));
+  EXPECT_THAT(usage.write_bytes, Eq(uint64_t{8192}));
+
+  ParseContextSwitches("Name:\tsleep\nvoluntary_ctxt_switches:\t5\n"
+                       "nonvoluntary_ctxt_switches:\t2\n",
+                       &usage);
+  ParseContextSwitches("voluntary_ctxt_switches:\t1\n", &usage);
+  EXPECT_THAT(usage.voluntary_context_switches, Eq(uint64_t{6}));
+  EXPECT_THAT(usage.involuntary_context_switches, Eq(uint64_t{2}));
+}
+
+TEST(UtilTest, TestGetResourceUsage) {
+  std::vector<pid_t> pids = GetProcessTree(getpid());
+  ASSERT_THAT(pids, Not(IsEmpty()));
+  EXPECT_THAT(pids[0], Eq(getpid()));
+  ResourceUsage usage = GetResourceUsage(pids);
+  EXPECT_THAT(usage.num_processes, Ge(1));
+  EXPECT_THAT(usage.num_threads, Ge(1));
+  EXPECT_THAT(usage.rss, Gt(0));
+  EXPECT_THAT(usage.voluntary_context_switches +
+                  usage.involuntary_context_switches,
+              Gt(0));
+}
+
 }  // namespace
 }  // namespace util
 }  // namespace sandbox2
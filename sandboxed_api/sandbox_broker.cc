@@ -0,0 +1,190 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of the sapi::SandboxBroker class.
+
+#include "sandboxed_api/sandbox_broker.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sapi {
+
+SandboxBroker::~SandboxBroker() {
+  Stop();
+  // Nothing is added after Stop(), and the threads only touch their own
+  // entries.
+  for (Client& client : clients_) {
+    client.thread.join();
+  }
+}
+
+SandboxPoolOptions SandboxBroker::DefaultPoolOptions() {
+  SandboxPoolOptions options;
+  options.max_uses = 1;
+  return options;
+}
+
+void SandboxBroker::AddPool(const std::string& name, Factory factory,
+                            SandboxPoolOptions options) {
+  pools_[name] = absl::make_unique<Pool>(options, std::move(factory));
+}
+
+void SandboxBroker::SetAllowedUids(const std::vector<uid_t>& uids) {
+  allowed_uids_ = std::set<uid_t>(uids.begin(), uids.end());
+}
+
+sapi::Status SandboxBroker::Serve(const std::string& socket_name) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    PLOG(ERROR) << "socket(AF_UNIX)";
+    return sapi::UnavailableError("Could not create the broker socket");
+  }
+  // An abstract socket address, as used by sandbox2::Comms.
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(&addr.sun_path[1], socket_name.c_str(), sizeof(addr.sun_path) - 2);
+  const socklen_t len =
+      sizeof(addr.sun_family) + 1 + strlen(&addr.sun_path[1]);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == -1 ||
+      listen(fd, SOMAXCONN) == -1) {
+    PLOG(ERROR) << "Cannot listen on " << socket_name;
+    close(fd);
+    return sapi::UnavailableError(
+        absl::StrCat("Could not listen on ", socket_name));
+  }
+  {
+    absl::MutexLock lock(&mutex_);
+    if (stopped_) {
+      close(fd);
+      return sapi::OkStatus();
+    }
+    listen_fd_ = fd;
+  }
+  LOG(INFO) << "Sandbox broker listening on " << socket_name;
+
+  for (;;) {
+    int client_fd = TEMP_FAILURE_RETRY(accept4(fd, nullptr, nullptr,
+                                               SOCK_CLOEXEC));
+    absl::MutexLock lock(&mutex_);
+    if (stopped_) {
+      if (client_fd != -1) {
+        close(client_fd);
+      }
+      break;
+    }
+    if (client_fd == -1) {
+      if (errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+        PLOG(WARNING) << "accept4()";
+        continue;
+      }
+      PLOG(ERROR) << "accept4()";
+      break;
+    }
+    for (auto it = clients_.begin(); it != clients_.end();) {
+      if (it->done) {
+        it->thread.join();
+        it = clients_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    clients_.emplace_back();
+    Client* client = &clients_.back();
+    client->comms = absl::make_unique<sandbox2::Comms>(client_fd);
+    client->thread = std::thread(&SandboxBroker::ServeClient, this, client);
+  }
+
+  absl::MutexLock lock(&mutex_);
+  listen_fd_ = -1;
+  close(fd);
+  return stopped_ ? sapi::OkStatus()
+                  : sapi::UnavailableError("Accepting clients failed");
+}
+
+void SandboxBroker::Stop() {
+  absl::MutexLock lock(&mutex_);
+  stopped_ = true;
+  // Unlike close(), shutdown() wakes up the threads blocked on the sockets.
+  if (listen_fd_ != -1) {
+    shutdown(listen_fd_, SHUT_RDWR);
+  }
+  for (Client& client : clients_) {
+    shutdown(client.comms->GetConnectionFD(), SHUT_RDWR);
+  }
+}
+
+sapi::Status SandboxBroker::HandOutSandbox(
+    sandbox2::Comms* comms, std::unique_ptr<Pool::Lease>* lease) {
+  // Any process of the network namespace can connect to an abstract socket.
+  ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(comms->GetConnectionFD(), SOL_SOCKET, SO_PEERCRED, &cred,
+                 &cred_len) == -1) {
+    PLOG(ERROR) << "getsockopt(SO_PEERCRED)";
+    return sapi::UnavailableError("Could not get the client's credentials");
+  }
+  if (allowed_uids_.count(cred.uid) == 0) {
+    return sapi::PermissionDeniedError(absl::StrCat(
+        "Clients of uid ", cred.uid, " (pid ", cred.pid, ") are not allowed"));
+  }
+  std::string name;
+  if (!comms->RecvString(&name)) {
+    return sapi::UnavailableError("Could not receive the pool name");
+  }
+  auto it = pools_.find(name);
+  if (it == pools_.end()) {
+    return sapi::NotFoundError(absl::StrCat("No sandbox pool ", name));
+  }
+  SAPI_ASSIGN_OR_RETURN(Pool::Lease acquired, it->second->Acquire());
+  *lease = absl::make_unique<Pool::Lease>(std::move(acquired));
+  return sapi::OkStatus();
+}
+
+void SandboxBroker::ServeClient(Client* client) {
+  sandbox2::Comms* comms = client->comms.get();
+  std::unique_ptr<Pool::Lease> lease;
+  sapi::Status status = HandOutSandbox(comms, &lease);
+  if (!status.ok()) {
+    LOG(WARNING) << "Not handing out a sandbox: " << status;
+  }
+  if (comms->SendStatus(status) && lease) {
+    Sandbox* sandbox = lease->get();
+    if (comms->SendInt32(sandbox->GetPid()) &&
+        comms->SendFD(sandbox->comms()->GetConnectionFD())) {
+      VLOG(1) << "Handed out sandboxee " << sandbox->GetPid();
+      // The client sends nothing more, this returns once it disconnects.
+      uint8_t unused;
+      comms->RecvUint8(&unused);
+    }
+  }
+  // Returns the sandbox to its pool, which replaces it unless the pool's
+  // options allow it to be reused.
+  lease.reset();
+  absl::MutexLock lock(&mutex_);
+  client->done = true;
+}
+
+}  // namespace sapi
@@ -0,0 +1,121 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sapi::SandboxBroker class keeps warm sandboxes for other processes.
+
+#ifndef SANDBOXED_API_SANDBOX_BROKER_H_
+#define SANDBOXED_API_SANDBOX_BROKER_H_
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/sandbox.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/sandbox_pool.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sapi {
+
+// Serves initialized sandboxes from named pools to client processes, so that
+// short-lived processes do not pay for starting the forkserver, building the
+// policy and spawning the sandboxee. A client connects to the broker's unix
+// socket with Sandbox::InitFromBroker() and receives the Comms channel of a
+// warm sandboxee. The broker keeps monitoring it, and returns it to its pool
+// once the client closes the connection. Only processes of the uids allowed
+// with SetAllowedUids() are served, the socket itself is reachable from the
+// whole network namespace.
+//
+// Protocol: the client sends the pool name as a string, the broker replies
+// with a status and, if it is OK, the sandboxee's pid as an int32 and its
+// Comms channel as a file descriptor.
+//
+// Example:
+//   sapi::SandboxBroker broker;
+//   broker.AddPool("zlib", [] { return absl::make_unique<ZlibSandbox>(); });
+//   SAPI_RETURN_IF_ERROR(broker.Serve("sandbox-broker"));
+class SandboxBroker {
+ public:
+  using Factory = std::function<std::unique_ptr<Sandbox>()>;
+
+  SandboxBroker() = default;
+  SandboxBroker(const SandboxBroker&) = delete;
+  SandboxBroker& operator=(const SandboxBroker&) = delete;
+
+  // Stops serving and closes all client connections.
+  ~SandboxBroker();
+
+  // Returns pool options handing out every sandbox once, as a client may leave
+  // any state behind in the sandboxee.
+  static SandboxPoolOptions DefaultPoolOptions();
+
+  // Adds a pool of sandboxes created by 'factory', served under 'name'. Must
+  // be called before Serve().
+  void AddPool(const std::string& name, Factory factory,
+               SandboxPoolOptions options = DefaultPoolOptions());
+
+  // Only serves clients running as one of 'uids', checked with SO_PEERCRED.
+  // Defaults to the effective uid of the broker. Must be called before
+  // Serve().
+  void SetAllowedUids(const std::vector<uid_t>& uids);
+
+  // Listens on the abstract unix socket 'socket_name' and serves each client
+  // from a thread of its own, until Stop() is called.
+  sapi::Status Serve(const std::string& socket_name);
+
+  // Makes Serve() return and disconnects all clients. Thread-safe.
+  void Stop();
+
+ private:
+  using Pool = SandboxPool<Sandbox>;
+
+  struct Client {
+    std::unique_ptr<sandbox2::Comms> comms;
+    std::thread thread;
+    // Set once the thread serving the client is about to exit.
+    bool done = false;
+  };
+
+  // Hands a sandbox to 'client' and keeps it leased until the client
+  // disconnects.
+  void ServeClient(Client* client);
+
+  // Hands a sandbox from the pool requested by the client to it, returns the
+  // lease in 'lease'.
+  sapi::Status HandOutSandbox(sandbox2::Comms* comms,
+                              std::unique_ptr<Pool::Lease>* lease);
+
+  std::map<std::string, std::unique_ptr<Pool>> pools_;
+  std::set<uid_t> allowed_uids_ = {geteuid()};
+
+  absl::Mutex mutex_;
+  int listen_fd_ GUARDED_BY(mutex_) = -1;
+  bool stopped_ GUARDED_BY(mutex_) = false;
+  // Entries of finished clients are removed when the next one connects.
+  std::list<Client> clients_ GUARDED_BY(mutex_);
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_SANDBOX_BROKER_H_
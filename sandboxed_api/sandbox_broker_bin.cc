@@ -0,0 +1,94 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A long-running broker keeping warm sandboxes for short-lived client
+// processes, see sandbox_broker.h. Clients attach to them with
+// sapi::Sandbox::InitFromBroker().
+//
+// Usage:
+// sandbox_broker_bin --sandbox_broker_pools=zlib=/path/to/zlib-sapi_bin
+
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "sandboxed_api/util/flag.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_split.h"
+#include "sandboxed_api/sandbox.h"
+#include "sandboxed_api/sandbox_broker.h"
+
+ABSL_FLAG(string, sandbox_broker_socket, "sapi-sandbox-broker",
+          "Name of the abstract unix socket the broker listens on");
+ABSL_FLAG(string, sandbox_broker_pools, "",
+          "Comma-separated name=path pairs. Each path is a sandboxee binary of "
+          "a SAPI library, served from a pool of its own with the default "
+          "policy");
+ABSL_FLAG(int32_t, sandbox_broker_pool_size, 2,
+          "Number of warm sandboxes kept ready per pool");
+
+namespace {
+
+// Runs the sandboxee binary of a SAPI library with the default policy.
+class LibrarySandbox : public sapi::Sandbox {
+ public:
+  explicit LibrarySandbox(std::string lib_path)
+      : sapi::Sandbox(nullptr), lib_path_(std::move(lib_path)) {}
+
+ private:
+  std::string GetLibPath() const override { return lib_path_; }
+
+  std::string lib_path_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  sapi::SandboxPoolOptions options = sapi::SandboxBroker::DefaultPoolOptions();
+  options.size = absl::GetFlag(FLAGS_sandbox_broker_pool_size);
+  sapi::SandboxBroker broker;
+  int num_pools = 0;
+  for (absl::string_view pool : absl::StrSplit(
+           absl::GetFlag(FLAGS_sandbox_broker_pools), ',', absl::SkipEmpty())) {
+    std::vector<std::string> parts =
+        absl::StrSplit(pool, absl::MaxSplits('=', 1));
+    if (parts.size() != 2 || parts[0].empty() || parts[1].empty()) {
+      LOG(ERROR) << "Invalid pool '" << pool << "', expected name=path";
+      return EXIT_FAILURE;
+    }
+    const std::string lib_path = parts[1];
+    broker.AddPool(
+        parts[0],
+        [lib_path] { return absl::make_unique<LibrarySandbox>(lib_path); },
+        options);
+    ++num_pools;
+  }
+  if (num_pools == 0) {
+    LOG(ERROR) << "No pools given with --sandbox_broker_pools";
+    return EXIT_FAILURE;
+  }
+
+  sapi::Status status =
+      broker.Serve(absl::GetFlag(FLAGS_sandbox_broker_socket));
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,800 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_SANDBOX_POOL_H_
+#define SANDBOXED_API_SANDBOX_POOL_H_
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/sandbox2/metrics.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+
+// Resident memory which the sandboxes started by SandboxPools may use
+// together. Shared by the pools of a process, it keeps all of them within what
+// the host can spare. See SandboxPoolOptions::memory_budget.
+class PoolMemoryBudget {
+ public:
+  // The resident memory of one sandbox, released when it is destroyed.
+  class Charge {
+   public:
+    Charge() = default;
+    Charge(Charge&& other) { *this = std::move(other); }
+    Charge& operator=(Charge&& other) {
+      if (this != &other) {
+        Release();
+        budget_ = other.budget_;
+        bytes_ = other.bytes_;
+        other.budget_ = nullptr;
+      }
+      return *this;
+    }
+    ~Charge() { Release(); }
+
+   private:
+    friend class PoolMemoryBudget;
+
+    Charge(PoolMemoryBudget* budget, uint64_t bytes)
+        : budget_(budget), bytes_(bytes) {}
+
+    void Release() {
+      if (budget_) {
+        budget_->used_.fetch_sub(bytes_, std::memory_order_relaxed);
+        sandbox2::metrics::UpdateGauge(sandbox2::metrics::kPoolBudgetedMemory,
+                                       -static_cast<int64_t>(bytes_));
+        budget_ = nullptr;
+      }
+    }
+
+    PoolMemoryBudget* budget_ = nullptr;
+    uint64_t bytes_ = 0;
+  };
+
+  explicit PoolMemoryBudget(uint64_t limit) : limit_(limit) {}
+
+  PoolMemoryBudget(const PoolMemoryBudget&) = delete;
+  PoolMemoryBudget& operator=(const PoolMemoryBudget&) = delete;
+
+  uint64_t limit() const { return limit_; }
+  uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+
+  // Returns whether another 'bytes' still fit.
+  bool Fits(uint64_t bytes) const { return used() + bytes <= limit_; }
+
+  // Charges 'bytes' to the budget, whether they fit or not.
+  Charge Add(uint64_t bytes) {
+    used_.fetch_add(bytes, std::memory_order_relaxed);
+    sandbox2::metrics::UpdateGauge(sandbox2::metrics::kPoolBudgetedMemory,
+                                   bytes);
+    return Charge(this, bytes);
+  }
+
+ private:
+  const uint64_t limit_;
+  std::atomic<uint64_t> used_{0};
+};
+
+// Reuse policy of a SandboxPool.
+struct SandboxPoolOptions {
+  // Number of initialized sandboxes kept ready.
+  size_t size = 2;
+  // Number of times a sandbox is handed out before it is replaced by a fresh
+  // one. 1 gives every request a fresh sandbox, 0 reuses sandboxes without
+  // limit.
+  int max_uses = 0;
+  // Whether sandboxes are replaced after a request marked them as failed.
+  bool discard_on_error = true;
+  // Resident memory of a sandboxee in bytes from which on it is replaced, e.g.
+  // somewhat below its RLIMIT_AS, so that sandboxees which leak or fragment
+  // memory are recycled before their allocations fail mid-request. Checked
+  // when a sandbox is returned and every health_check_interval while it waits
+  // in the pool. 0 disables the check.
+  uint64_t max_resident_memory = 0;
+  // Factor by which the mean call latency of a sandbox may grow over the one
+  // measured during its first SandboxPool::kLatencyWindow calls before it is
+  // replaced.
+  // Needs T::CollectStats(), 0 disables the check.
+  double max_latency_drift = 0;
+  absl::Duration health_check_interval = absl::Seconds(10);
+  // Largest number of sandboxes kept ready. If larger than 'size', the pool
+  // scales between the two: it keeps ready as many sandboxes as it expects to
+  // be requested while one starts, going by the recent rate of Acquire() calls
+  // and the measured start-up time, and terminates those above that number
+  // which were idle for idle_ttl.
+  size_t max_size = 0;
+  absl::Duration idle_ttl = absl::Minutes(1);
+  // Time over which the rate of Acquire() calls is averaged.
+  absl::Duration demand_window = absl::Seconds(10);
+  // If set, sandboxes are only started ahead of demand while their resident
+  // memory fits into the budget, which may be shared with other pools.
+  // Acquire() still starts a sandbox when none is ready. Not owned.
+  PoolMemoryBudget* memory_budget = nullptr;
+  // Whether every lease is served by a fork of the sandboxee, discarded when
+  // the lease is returned, so that no state carries over from one request to
+  // the next without replacing the sandbox, see Sandbox::BeginRequest().
+  // Failed requests only discard their fork then. T has to return true from
+  // UseRequestCheckpoints().
+  bool isolate_requests = false;
+};
+
+// A pool of initialized sandboxes of type T, so that requests do not have to
+// wait for the sandboxee to start. A background thread replaces sandboxes
+// which are handed out or discarded. If no sandbox is ready, Acquire() starts
+// one itself instead of waiting.
+//
+// Example:
+//   sapi::SandboxPool<ZlibSandbox> pool;
+//   ...
+//   SAPI_ASSIGN_OR_RETURN(auto lease, pool.Acquire());
+//   ZlibApi api(lease.get());
+//   sapi::Status status = DoWork(&api);
+//   if (!status.ok()) {
+//     lease.MarkFailed();
+//   }
+//
+// Read-only data needed by every sandboxee, e.g. a model, can be loaded once
+// and shared by all of them, see AddSharedData(). Requests which benefit from
+// state the library keeps between calls, e.g. per-tenant caches, can ask for
+// the sandbox which served their key before, see Acquire(key).
+//
+// The checkout wait, the start-up time and the size of the pool are reported
+// as sandbox2::metrics "sapi/pool/...".
+template <typename T>
+class SandboxPool {
+ private:
+  // A sandbox and what the pool knows about its health.
+  struct Entry {
+    std::unique_ptr<T> sandbox;
+    // Identifies the sandbox to Acquire(key), unique within the pool.
+    uint64_t id = 0;
+    // Number of times the sandbox was handed out.
+    int uses = 0;
+    // Mean latency of the first kLatencyWindow calls, zero until they ran.
+    absl::Duration baseline_latency;
+    // Calls and their total latency up to the start of the current window.
+    uint64_t window_start_calls = 0;
+    absl::Duration window_start_latency;
+    // Addresses of the shared data in the sandboxee, by their index in
+    // shared_data_, and the sandboxee they were mapped into.
+    std::vector<void*> shared_data;
+    pid_t shared_data_pid = -1;
+    // When the sandbox was last put into the pool.
+    absl::Time idle_since;
+    // Resident memory of the sandboxee, see SandboxPoolOptions::memory_budget.
+    PoolMemoryBudget::Charge charge;
+  };
+
+  struct SharedData {
+    std::shared_ptr<sandbox2::Buffer> buffer;
+    std::string symbol;
+  };
+
+ public:
+  // A sandbox handed out by the pool. It is returned to the pool when the
+  // lease goes out of scope.
+  class Lease {
+   public:
+    Lease(Lease&& other) { *this = std::move(other); }
+    Lease& operator=(Lease&& other) {
+      Release();
+      pool_ = other.pool_;
+      entry_ = std::move(other.entry_);
+      failed_ = other.failed_;
+      return *this;
+    }
+    ~Lease() { Release(); }
+
+    T* get() const { return entry_.sandbox.get(); }
+    T* operator->() const { return entry_.sandbox.get(); }
+
+    // Marks the request as failed, see SandboxPoolOptions::discard_on_error.
+    void MarkFailed() { failed_ = true; }
+
+    // Returns the address of 'buffer' in the sandboxee, to be passed to the
+    // library as a remote pointer, see SandboxPool::AddSharedData(). Nullptr
+    // if the buffer was not added to the pool, or if the sandboxee was
+    // restarted other than by Restart().
+    void* GetSharedData(const sandbox2::Buffer* buffer) const {
+      if (entry_.sandbox->GetPid() != entry_.shared_data_pid) {
+        return nullptr;
+      }
+      const size_t index = pool_->FindSharedData(buffer);
+      return index < entry_.shared_data.size() ? entry_.shared_data[index]
+                                               : nullptr;
+    }
+
+    // Restarts the sandbox, see Sandbox::Restart(), and maps the shared data
+    // of the pool into the new sandboxee.
+    sapi::Status Restart(bool attempt_graceful_exit) {
+      SAPI_RETURN_IF_ERROR(entry_.sandbox->Restart(attempt_graceful_exit));
+      return pool_->MapSharedData(&entry_);
+    }
+
+   private:
+    friend class SandboxPool;
+
+    Lease(SandboxPool* pool, Entry entry)
+        : pool_(pool), entry_(std::move(entry)) {
+      ++entry_.uses;
+    }
+
+    void Release() {
+      if (entry_.sandbox) {
+        pool_->Return(std::move(entry_), failed_);
+      }
+    }
+
+    SandboxPool* pool_ = nullptr;
+    Entry entry_;
+    bool failed_ = false;
+  };
+
+  explicit SandboxPool(
+      SandboxPoolOptions options = SandboxPoolOptions(),
+      std::function<std::unique_ptr<T>()> factory =
+          [] { return absl::make_unique<T>(); })
+      : options_(options),
+        factory_(std::move(factory)),
+        target_size_(options.size) {
+    replenisher_ = std::thread([this] { Replenish(); });
+  }
+
+  SandboxPool(const SandboxPool&) = delete;
+  SandboxPool& operator=(const SandboxPool&) = delete;
+
+  // All leases have to be returned before the pool is destroyed.
+  ~SandboxPool() {
+    {
+      absl::MutexLock lock(&mutex_);
+      shutdown_ = true;
+    }
+    replenisher_.join();
+    std::deque<Entry> ready;
+    {
+      absl::MutexLock lock(&mutex_);
+      ready.swap(ready_);
+      ReportGauges();
+    }
+  }
+
+  // Hands out an initialized sandbox.
+  sapi::StatusOr<Lease> Acquire() { return Checkout(false, ""); }
+
+  // Hands out the sandbox which 'key' maps to, so that the requests for a key
+  // find the state the library kept from the previous ones, e.g. its caches.
+  // Keys are mapped by consistent hashing, so that sandboxes which are added
+  // or removed only move the keys mapped to them. If the sandbox of the key
+  // is leased, the one the key maps to among the ready sandboxes is handed out
+  // instead, see GetNumAffinityMisses().
+  sapi::StatusOr<Lease> Acquire(absl::string_view key) {
+    return Checkout(true, key);
+  }
+
+  // Maps 'buffer' read-only into the sandboxee of every sandbox of the pool,
+  // those waiting in it and those started later, before they are handed out.
+  // The data is thus in memory once, however many sandboxes there are, and
+  // is neither copied nor loaded by the sandboxees. Create the buffer with
+  // sandbox2::Buffer::CreateReadOnly(), so that sandboxees cannot change the
+  // data under each other. The sandboxes need Sandbox::UseSharedBuffers().
+  // If 'symbol' is not empty, the address of the data
+  // in the sandboxee is stored in that global variable of the library, a
+  // 'const void*', for library code to find it; it is also returned by
+  // Lease::GetSharedData(). The data stays mapped for the lifetime of the
+  // sandboxees, and is mapped again into sandboxes restarted while leased,
+  // see Lease::Restart().
+  sapi::Status AddSharedData(std::shared_ptr<sandbox2::Buffer> buffer,
+                             const std::string& symbol = "") {
+    if (buffer->windowed()) {
+      return sapi::InvalidArgumentError("Windowed buffers cannot be shared");
+    }
+    absl::MutexLock lock(&mutex_);
+    shared_data_.push_back({std::move(buffer), symbol});
+    return sapi::OkStatus();
+  }
+
+  // Returns the number of sandboxes ready to be handed out.
+  size_t GetNumReady() const {
+    absl::MutexLock lock(&mutex_);
+    return ready_.size();
+  }
+
+  // Returns the number of sandboxes the pool currently keeps ready, see
+  // SandboxPoolOptions::max_size.
+  size_t GetTargetSize() const {
+    absl::MutexLock lock(&mutex_);
+    return target_size_;
+  }
+
+  // Returns the number of sandboxes replaced because they exceeded
+  // SandboxPoolOptions::max_resident_memory or max_latency_drift.
+  size_t GetNumRecycled() const {
+    absl::MutexLock lock(&mutex_);
+    return recycled_;
+  }
+
+  // Returns the number of Acquire(key) calls which were not served by the
+  // sandbox the key maps to, because it was leased or no sandbox was ready.
+  size_t GetNumAffinityMisses() const {
+    absl::MutexLock lock(&mutex_);
+    return affinity_misses_;
+  }
+
+  // Number of calls over which the mean call latency of a sandbox is taken,
+  // see SandboxPoolOptions::max_latency_drift.
+  static constexpr uint64_t kLatencyWindow = 100;
+
+ private:
+  // Delay before retrying after a sandbox failed to start.
+  static constexpr absl::Duration kRetryDelay = absl::Milliseconds(100);
+  // How often an autoscaling pool, or one with a memory budget, reconsiders
+  // its size while nothing else happens.
+  static constexpr absl::Duration kScalingInterval = absl::Seconds(1);
+
+  bool Autoscales() const { return options_.max_size > options_.size; }
+
+  // Body of both Acquire() overloads, 'key' is only used if 'keyed'.
+  sapi::StatusOr<Lease> Checkout(bool keyed, absl::string_view key) {
+    const absl::Time start = absl::Now();
+    {
+      absl::MutexLock lock(&mutex_);
+      NoteArrival(start);
+    }
+    while (true) {
+      Entry entry;
+      bool preferred = true;
+      {
+        absl::MutexLock lock(&mutex_);
+        if (ready_.empty()) {
+          break;
+        }
+        // The one the key maps to, otherwise the most recently used one, so
+        // that the others can idle out.
+        const size_t index =
+            keyed ? FindForKey(key, &preferred) : ready_.size() - 1;
+        entry = std::move(ready_[index]);
+        ready_.erase(ready_.begin() + index);
+        ReportGauges();
+      }
+      // Skip sandboxes which died while waiting in the pool, and those the
+      // shared data could not be mapped into or which could not fork for the
+      // request.
+      if (!entry.sandbox->IsActive()) {
+        continue;
+      }
+      sapi::Status status = MapSharedData(&entry);
+      if (status.ok() && options_.isolate_requests) {
+        status = entry.sandbox->BeginRequest();
+      }
+      if (!status.ok()) {
+        LOG(WARNING) << "Discarding a sandbox of the pool: " << status;
+        continue;
+      }
+      return HandOut(std::move(entry), start, keyed && !preferred);
+    }
+    VLOG(1) << "No sandbox ready, starting one";
+    sandbox2::metrics::IncrementCounter(sandbox2::metrics::kPoolMisses);
+    Entry entry;
+    SAPI_RETURN_IF_ERROR(StartSandbox(&entry));
+    if (options_.isolate_requests) {
+      SAPI_RETURN_IF_ERROR(entry.sandbox->BeginRequest());
+    }
+    return HandOut(std::move(entry), start, keyed);
+  }
+
+  // Returns the index in ready_ of the sandbox to hand out for 'key', and
+  // whether it is the one the key maps to among all sandboxes of the pool.
+  // Rendezvous hashing: a key maps to the sandbox with the highest hash of the
+  // key and the sandbox id, so a new sandbox only takes over the keys it wins
+  // and a removed one only hands its own keys on, to their next highest.
+  size_t FindForKey(absl::string_view key, bool* preferred) const
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    auto weight = [key](uint64_t id) {
+      return absl::Hash<std::pair<absl::string_view, uint64_t>>()(
+          std::make_pair(key, id));
+    };
+    size_t index = 0;
+    size_t best = 0;
+    for (size_t i = 0; i < ready_.size(); ++i) {
+      const size_t w = weight(ready_[i].id);
+      if (i == 0 || w > best) {
+        index = i;
+        best = w;
+      }
+    }
+    *preferred = true;
+    for (uint64_t id : leased_ids_) {
+      if (weight(id) > best) {
+        *preferred = false;
+        break;
+      }
+    }
+    return index;
+  }
+
+  // Turns 'entry' into a lease, taken out of the pool at 'start'. With
+  // isolate_requests, its request has to have begun already.
+  Lease HandOut(Entry entry, absl::Time start, bool affinity_miss) {
+    {
+      absl::MutexLock lock(&mutex_);
+      leased_ids_.insert(entry.id);
+      if (affinity_miss) {
+        ++affinity_misses_;
+      }
+    }
+    if (affinity_miss) {
+      sandbox2::metrics::IncrementCounter(
+          sandbox2::metrics::kPoolAffinityMisses);
+    }
+    sandbox2::metrics::RecordDuration(sandbox2::metrics::kPoolCheckoutWait,
+                                      absl::Now() - start);
+    return Lease(this, std::move(entry));
+  }
+
+  // Starts a sandbox for 'entry' and measures how long that took.
+  sapi::Status StartSandbox(Entry* entry) LOCKS_EXCLUDED(mutex_) {
+    const absl::Time start = absl::Now();
+    entry->sandbox = factory_();
+    SAPI_RETURN_IF_ERROR(entry->sandbox->Init());
+    SAPI_RETURN_IF_ERROR(MapSharedData(entry));
+    const absl::Duration latency = absl::Now() - start;
+    sandbox2::metrics::RecordDuration(sandbox2::metrics::kPoolSpawnLatency,
+                                      latency);
+    uint64_t memory = 0;
+    if (options_.memory_budget) {
+      sapi::StatusOr<uint64_t> resident = entry->sandbox->GetResidentMemory();
+      if (resident.ok()) {
+        memory = resident.ValueOrDie();
+      }
+      entry->charge = options_.memory_budget->Add(memory);
+    }
+    absl::MutexLock lock(&mutex_);
+    entry->id = ++last_id_;
+    spawn_latency_ = spawn_latency_ == absl::ZeroDuration()
+                         ? latency
+                         : (spawn_latency_ * 7 + latency) / 8;
+    if (memory > 0) {
+      sandbox_memory_ = memory;
+    }
+    return sapi::OkStatus();
+  }
+
+  // Updates the rate of Acquire() calls with one at 'now'.
+  void NoteArrival(absl::Time now) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    if (!Autoscales()) {
+      return;
+    }
+    if (last_arrival_ != absl::InfinitePast()) {
+      // Exponentially weighted, so that the rate converges to the inverse of
+      // the interval between calls.
+      const double interval =
+          std::max(absl::ToDoubleSeconds(now - last_arrival_), 1e-6);
+      const double window = absl::ToDoubleSeconds(options_.demand_window);
+      const double weight = 1 - std::exp(-interval / window);
+      arrival_rate_ += weight * (1 / interval - arrival_rate_);
+    }
+    last_arrival_ = now;
+    Rescale(now);
+  }
+
+  // Sets target_size_ from the demand expected at 'now'.
+  void Rescale(absl::Time now) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    double rate = arrival_rate_;
+    // Without calls for longer than their usual interval, the rate is at most
+    // one per that time.
+    const double quiet = absl::ToDoubleSeconds(now - last_arrival_);
+    if (quiet > 0 && rate * quiet > 1) {
+      rate = 1 / quiet;
+    }
+    // Twice the calls expected while a sandbox starts, to absorb bursts.
+    const double expected = 2 * rate * absl::ToDoubleSeconds(spawn_latency_);
+    target_size_ = std::min(
+        options_.max_size,
+        std::max(options_.size, static_cast<size_t>(std::ceil(expected))));
+    ReportGauges();
+  }
+
+  // Removes the sandboxes above target_size_ which idled for too long.
+  void RemoveIdle(absl::Time now, std::vector<Entry>* idle)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    // The front of ready_ is used last and idles the longest.
+    while (ready_.size() > target_size_ &&
+           now - ready_.front().idle_since >= options_.idle_ttl) {
+      idle->push_back(std::move(ready_.front()));
+      ready_.pop_front();
+      sandbox2::metrics::IncrementCounter(
+          sandbox2::metrics::kPoolIdleTerminations);
+    }
+    ReportGauges();
+  }
+
+  // Reports the changes of the size of the pool to the metrics.
+  void ReportGauges() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    const int64_t ready = ready_.size();
+    const int64_t target = shutdown_ ? 0 : target_size_;
+    if (ready != reported_ready_) {
+      sandbox2::metrics::UpdateGauge(sandbox2::metrics::kPoolReady,
+                                     ready - reported_ready_);
+      reported_ready_ = ready;
+    }
+    if (target != reported_target_) {
+      sandbox2::metrics::UpdateGauge(sandbox2::metrics::kPoolTargetSize,
+                                     target - reported_target_);
+      reported_target_ = target;
+    }
+  }
+
+  // Returns the index of 'buffer' in shared_data_, its size if it is not
+  // there.
+  size_t FindSharedData(const sandbox2::Buffer* buffer) const {
+    absl::MutexLock lock(&mutex_);
+    for (size_t i = 0; i < shared_data_.size(); ++i) {
+      if (shared_data_[i].buffer.get() == buffer) {
+        return i;
+      }
+    }
+    return shared_data_.size();
+  }
+
+  // Maps the shared data which is not yet mapped into the sandboxee.
+  sapi::Status MapSharedData(Entry* entry) {
+    std::vector<SharedData> shared_data;
+    {
+      absl::MutexLock lock(&mutex_);
+      shared_data = shared_data_;
+    }
+    T* sandbox = entry->sandbox.get();
+    if (sandbox->GetPid() != entry->shared_data_pid) {
+      // A new sandboxee, or one restarted by the caller.
+      entry->shared_data.clear();
+      entry->shared_data_pid = sandbox->GetPid();
+    }
+    for (size_t i = entry->shared_data.size(); i < shared_data.size(); ++i) {
+      void* addr;
+      SAPI_RETURN_IF_ERROR(
+          sandbox->MapBuffer(shared_data[i].buffer.get(), PROT_READ, &addr));
+      if (!shared_data[i].symbol.empty()) {
+        void* symbol_addr;
+        SAPI_RETURN_IF_ERROR(
+            sandbox->Symbol(shared_data[i].symbol.c_str(), &symbol_addr));
+        v::GenericPtr ptr(addr);
+        ptr.SetRemote(symbol_addr);
+        SAPI_RETURN_IF_ERROR(sandbox->TransferToSandboxee(&ptr));
+      }
+      entry->shared_data.push_back(addr);
+    }
+    return sapi::OkStatus();
+  }
+
+  // Returns whether the sandboxee uses too much memory.
+  bool ExceedsMemory(const Entry& entry) const {
+    if (options_.max_resident_memory == 0) {
+      return false;
+    }
+    sapi::StatusOr<uint64_t> resident = entry.sandbox->GetResidentMemory();
+    if (!resident.ok() ||
+        resident.ValueOrDie() < options_.max_resident_memory) {
+      return false;
+    }
+    VLOG(1) << "Recycling sandbox with " << resident.ValueOrDie()
+            << " bytes of resident memory";
+    return true;
+  }
+
+  // Returns whether the recent calls of the sandbox drifted too far from its
+  // baseline latency, establishing the baseline first.
+  bool ExceedsLatencyDrift(Entry* entry) const {
+    if (options_.max_latency_drift <= 0) {
+      return false;
+    }
+    uint64_t calls = 0;
+    absl::Duration latency;
+    for (const auto& func : entry->sandbox->GetStats()) {
+      calls += func.second.ipc.count();
+      latency += func.second.ipc.total() + func.second.execution.total();
+    }
+    if (calls < entry->window_start_calls + kLatencyWindow) {
+      return false;
+    }
+    const absl::Duration mean = (latency - entry->window_start_latency) /
+                                (calls - entry->window_start_calls);
+    entry->window_start_calls = calls;
+    entry->window_start_latency = latency;
+    if (entry->baseline_latency == absl::ZeroDuration()) {
+      entry->baseline_latency = mean;
+      return false;
+    }
+    if (mean <= entry->baseline_latency * options_.max_latency_drift) {
+      return false;
+    }
+    VLOG(1) << "Recycling sandbox with a mean call latency of " << mean
+            << ", up from " << entry->baseline_latency;
+    return true;
+  }
+
+  void Return(Entry entry, bool failed) {
+    // Discards the state of the request, and the sandbox if that fails.
+    const bool rolled_back =
+        !options_.isolate_requests || entry.sandbox->EndRequest().ok();
+    bool reuse = rolled_back && entry.sandbox->IsActive() &&
+                 !(failed && options_.discard_on_error &&
+                   !options_.isolate_requests) &&
+                 (options_.max_uses == 0 || entry.uses < options_.max_uses);
+    bool recycle = false;
+    if (reuse && (ExceedsMemory(entry) || ExceedsLatencyDrift(&entry))) {
+      reuse = false;
+      recycle = true;
+    }
+    {
+      absl::MutexLock lock(&mutex_);
+      leased_ids_.erase(entry.id);
+      if (recycle) {
+        ++recycled_;
+      }
+      // Autoscaling pools keep returned sandboxes until they idle out.
+      if (reuse && !shutdown_ &&
+          ready_.size() <
+              (Autoscales() ? options_.max_size : target_size_)) {
+        entry.idle_since = absl::Now();
+        ready_.push_back(std::move(entry));
+        ReportGauges();
+        return;
+      }
+    }
+    // Terminates the sandboxee, outside of the lock.
+    entry.sandbox.reset();
+  }
+
+  bool NeedsSandbox() const EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return shutdown_ ||
+           (ready_.size() < target_size_ &&
+            (!options_.memory_budget ||
+             options_.memory_budget->Fits(sandbox_memory_)));
+  }
+
+  // Removes the sandboxes waiting in the pool whose memory grew too much.
+  std::vector<Entry> RemoveUnhealthy() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    std::vector<Entry> unhealthy;
+    std::deque<Entry> healthy;
+    for (Entry& entry : ready_) {
+      if (ExceedsMemory(entry)) {
+        unhealthy.push_back(std::move(entry));
+      } else {
+        healthy.push_back(std::move(entry));
+      }
+    }
+    ready_.swap(healthy);
+    recycled_ += unhealthy.size();
+    ReportGauges();
+    return unhealthy;
+  }
+
+  // Body of the background thread, keeps the pool filled, healthy and scaled
+  // to the demand.
+  void Replenish() {
+    absl::MutexLock lock(&mutex_);
+    const bool health_checks = options_.max_resident_memory != 0;
+    const bool periodic = Autoscales() || options_.memory_budget;
+    absl::Time next_check = absl::Now() + options_.health_check_interval;
+    while (true) {
+      absl::Time deadline =
+          health_checks ? next_check : absl::InfiniteFuture();
+      if (periodic) {
+        deadline = std::min(deadline, absl::Now() + kScalingInterval);
+      }
+      if (!mutex_.AwaitWithDeadline(
+              absl::Condition(this, &SandboxPool::NeedsSandbox), deadline)) {
+        const absl::Time now = absl::Now();
+        std::vector<Entry> removed;
+        if (health_checks && now >= next_check) {
+          next_check = now + options_.health_check_interval;
+          removed = RemoveUnhealthy();
+        }
+        if (Autoscales()) {
+          Rescale(now);
+          RemoveIdle(now, &removed);
+        }
+        mutex_.Unlock();
+        removed.clear();
+        mutex_.Lock();
+        continue;
+      }
+      if (shutdown_) {
+        ReportGauges();
+        return;
+      }
+      mutex_.Unlock();
+      Entry entry;
+      sapi::Status status = StartSandbox(&entry);
+      mutex_.Lock();
+      if (!status.ok()) {
+        LOG(WARNING) << "Could not start a sandbox for the pool: " << status;
+        mutex_.AwaitWithTimeout(absl::Condition(&shutdown_), kRetryDelay);
+        continue;
+      }
+      entry.idle_since = absl::Now();
+      ready_.push_back(std::move(entry));
+      ReportGauges();
+    }
+  }
+
+  const SandboxPoolOptions options_;
+  const std::function<std::unique_ptr<T>()> factory_;
+
+  mutable absl::Mutex mutex_;
+  // Ordered by the time the sandboxes were put into the pool.
+  std::deque<Entry> ready_ GUARDED_BY(mutex_);
+  // Number of sandboxes to keep ready, see SandboxPoolOptions::max_size.
+  size_t target_size_ GUARDED_BY(mutex_);
+  // Acquire() calls per second and the time of the last one.
+  double arrival_rate_ GUARDED_BY(mutex_) = 0;
+  absl::Time last_arrival_ GUARDED_BY(mutex_) = absl::InfinitePast();
+  // Moving average of the time it takes to start a sandbox.
+  absl::Duration spawn_latency_ GUARDED_BY(mutex_);
+  // Resident memory of the last sandboxee started, see
+  // SandboxPoolOptions::memory_budget.
+  uint64_t sandbox_memory_ GUARDED_BY(mutex_) = 0;
+  // Values last reported to the pool gauges.
+  int64_t reported_ready_ GUARDED_BY(mutex_) = 0;
+  int64_t reported_target_ GUARDED_BY(mutex_) = 0;
+  bool shutdown_ GUARDED_BY(mutex_) = false;
+  size_t recycled_ GUARDED_BY(mutex_) = 0;
+  // Id of the last sandbox started, and those of the sandboxes handed out.
+  uint64_t last_id_ GUARDED_BY(mutex_) = 0;
+  absl::flat_hash_set<uint64_t> leased_ids_ GUARDED_BY(mutex_);
+  // See GetNumAffinityMisses().
+  size_t affinity_misses_ GUARDED_BY(mutex_) = 0;
+  // See AddSharedData().
+  std::vector<SharedData> shared_data_ GUARDED_BY(mutex_);
+
+  std::thread replenisher_;
+};
+
+template <typename T>
+constexpr absl::Duration SandboxPool<T>::kRetryDelay;
+template <typename T>
+constexpr absl::Duration SandboxPool<T>::kScalingInterval;
+template <typename T>
+constexpr uint64_t SandboxPool<T>::kLatencyWindow;
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_SANDBOX_POOL_H_
@@ -13,25 +13,66 @@
 // limitations under the License.
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>  // NOLINT(build/c++11)
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <tuple>
+#include <vector>
 
 #include "benchmark/benchmark.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "google/protobuf/arena.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "sandboxed_api/examples/stringop/lib/sandbox.h"
 #include "sandboxed_api/examples/stringop/lib/stringop-sapi.sapi.h"
 #include "sandboxed_api/examples/stringop/lib/stringop_params.pb.h"
 #include "sandboxed_api/examples/sum/lib/sandbox.h"
 #include "sandboxed_api/examples/sum/lib/sum-sapi.sapi.h"
 #include "sandboxed_api/examples/sum/lib/sum-sapi_embed.h"
+#include "sandboxed_api/perf_counters.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/sandbox2/buffer_pool.h"
+#include "sandboxed_api/sandbox_broker.h"
+#include "sandboxed_api/sandbox_pool.h"
+#include "sandboxed_api/tracing.h"
 #include "sandboxed_api/transaction.h"
+#include "sandboxed_api/transaction_executor.h"
 #include "sandboxed_api/util/status_matchers.h"
 #include "sandboxed_api/util/status.h"
 
 using ::sapi::IsOk;
 using ::sapi::StatusIs;
 using ::testing::Eq;
+using ::testing::Ge;
+using ::testing::Gt;
 using ::testing::HasSubstr;
+using ::testing::Lt;
+using ::testing::Ne;
+using ::testing::Not;
+using ::testing::NotNull;
+using ::testing::StrEq;
 
 namespace sapi {
 namespace {
@@ -174,6 +215,21 @@ TEST(SandboxTest, RestartSandboxFD) {
   EXPECT_THAT(st.Run(test_body), IsOk());
 }
 
+// Make sure that several FDs can be transferred at once, and that already
+// transferred ones are refused.
+TEST(SandboxTest, TransferFds) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  v::Fd fd1(open("/dev/null", O_RDONLY | O_CLOEXEC));
+  v::Fd fd2(open("/dev/null", O_RDONLY | O_CLOEXEC));
+  ASSERT_THAT(sandbox.TransferToSandboxee({&fd1, &fd2}), IsOk());
+  EXPECT_THAT(fd1.GetRemoteFd(), Ge(0));
+  EXPECT_THAT(fd2.GetRemoteFd(), Ge(0));
+  EXPECT_THAT(fd1.GetRemoteFd(), Ne(fd2.GetRemoteFd()));
+  EXPECT_THAT(sandbox.TransferToSandboxee(std::vector<v::Fd*>{&fd1}),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+}
+
 TEST(SandboxTest, RestartTransactionSandboxFD) {
   sapi::BasicTransaction st{absl::make_unique<SumSandbox>()};
 
@@ -222,6 +278,29 @@ TEST(SandboxTest, RestartSandboxAfterCrash) {
   EXPECT_THAT(st.Run(test_body), IsOk());
 }
 
+TEST(SandboxTest, TransactionSwapsInStandbySandbox) {
+  sapi::BasicTransaction st{absl::make_unique<SumSandbox>()};
+  st.EnableStandbySandbox([] { return absl::make_unique<SumSandbox>(); });
+
+  int tries = 0;
+  const sapi::Sandbox* crashed = nullptr;
+  auto test_body = [&tries, &crashed](sapi::Sandbox* sandbox) -> sapi::Status {
+    SumApi sumapi(sandbox);
+    if (tries++ == 0) {
+      crashed = sandbox;
+      return sumapi.crash();
+    }
+    // The retry runs in the standby sandbox.
+    EXPECT_THAT(sandbox, Ne(crashed));
+    SAPI_ASSIGN_OR_RETURN(int result, sumapi.sum(1, 2));
+    EXPECT_THAT(result, Eq(3));
+    return sapi::OkStatus();
+  };
+
+  EXPECT_THAT(st.Run(test_body), IsOk());
+  EXPECT_THAT(tries, Eq(2));
+}
+
 TEST(SandboxTest, RestartSandboxAfterViolation) {
   sapi::BasicTransaction st{absl::make_unique<SumSandbox>()};
 
@@ -246,6 +325,2217 @@ TEST(SandboxTest, RestartSandboxAfterViolation) {
   EXPECT_THAT(st.Run(test_body), IsOk());
 }
 
+TEST(SandboxTest, CallScalar) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  static constexpr CallSignature kSum =
+      MakeCallSignature<int, int, int>("sum");
+  SAPI_ASSERT_OK_AND_ASSIGN(int result,
+                            (sandbox.CallScalar<int, int, int>(kSum, 1, 2)));
+  EXPECT_THAT(result, Eq(3));
+  // The second call uses the cached handle.
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            (sandbox.CallScalar<int, int, int>(kSum, 3, 4)));
+  EXPECT_THAT(result, Eq(7));
+
+  static constexpr CallSignature kMissing =
+      MakeCallSignature<void>("no_such_function");
+  EXPECT_THAT(sandbox.CallScalar<void>(kMissing),
+              StatusIs(sapi::StatusCode::kUnavailable));
+}
+
+TEST(SandboxTest, CallScalarAsyncAndBatch) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  static constexpr CallSignature kSum =
+      MakeCallSignature<int, int, int>("sum");
+  auto first = sandbox.CallScalarAsync<int, int, int>(kSum, 1, 2);
+  auto second = sandbox.CallScalarAsync<int, int, int>(kSum, 3, 4);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, second.get());
+  EXPECT_THAT(result, Eq(7));
+  SAPI_ASSERT_OK_AND_ASSIGN(result, first.get());
+  EXPECT_THAT(result, Eq(3));
+
+  std::vector<std::tuple<int, int>> args;
+  std::vector<int> expected;
+  for (int i = 0; i < 1000; ++i) {
+    args.emplace_back(i, 2 * i);
+    expected.push_back(3 * i);
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::vector<int> sums,
+      (sandbox.CallScalarBatch<int, int, int>(kSum, args)));
+  EXPECT_THAT(sums, Eq(expected));
+}
+
+TEST(SandboxTest, ManyOutstandingAsyncCalls) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  static constexpr CallSignature kSum =
+      MakeCallSignature<int, int, int>("sum");
+  static constexpr CallSignature kMissing =
+      MakeCallSignature<int>("no_such_function");
+  constexpr int kNumCalls = 50;
+  std::vector<std::future<sapi::StatusOr<int>>> sums;
+  std::vector<std::future<sapi::StatusOr<int>>> failures;
+  for (int i = 0; i < kNumCalls; ++i) {
+    sums.push_back(sandbox.CallScalarAsync<int, int, int>(kSum, i, 1));
+    // Failed calls are told apart by their request id as well.
+    if (i % 10 == 0) {
+      failures.push_back(sandbox.CallScalarAsync<int>(kMissing));
+    }
+  }
+  // Receives the replies still in flight, and keeps them.
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+
+  for (int i = kNumCalls - 1; i >= 0; --i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(result, sums[i].get());
+    EXPECT_THAT(result, Eq(i + 1));
+  }
+  for (auto& failure : failures) {
+    EXPECT_THAT(failure.get(), StatusIs(sapi::StatusCode::kUnavailable));
+  }
+
+  // Only calls can be asynchronous, other replies carry no request id.
+  FuncCall call{};
+  EXPECT_THAT(sandbox.GetRpcChannel()
+                  ->CallAsync(call, comms::kMsgCallBatch, v::Type::kInt)
+                  .get(),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
+TEST(SandboxTest, CallScalarWithCallback) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  static constexpr CallSignature kSum =
+      MakeCallSignature<int, int, int>("sum");
+  std::vector<int> results;
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_THAT((sandbox.CallScalarWithCallback<int, int, int>(
+                    kSum,
+                    [&results](sapi::StatusOr<int> result) {
+                      ASSERT_THAT(result.status(), IsOk());
+                      results.push_back(result.ValueOrDie());
+                    },
+                    i, 1)),
+                IsOk());
+  }
+  pollfd pfd = {sandbox.GetReadinessFd(), POLLIN, 0};
+  while (results.size() < 10) {
+    ASSERT_THAT(poll(&pfd, 1, /*timeout=*/10000), Eq(1));
+    ASSERT_THAT(sandbox.ProcessReplies(), IsOk());
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_THAT(results[i], Eq(i + 1));
+  }
+}
+
+TEST(SandboxTest, CallByIndex) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  static constexpr const char* kNames[] = {"sumarr", "no_such_function"};
+  static constexpr FunctionTable kTable = {kNames, ABSL_ARRAYSIZE(kNames)};
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  v::ULong size(ABSL_ARRAYSIZE(data));
+  v::Int result;
+  ASSERT_THAT(sandbox.Call(kTable, 0, &result, arr.PtrBefore(), &size),
+              IsOk());
+  EXPECT_THAT(result.GetValue(), Eq(10));
+  EXPECT_THAT(sandbox.Call(kTable, 1, &result), Not(IsOk()));
+  EXPECT_THAT(sandbox.Call(kTable, 2, &result),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+
+  // The handles are looked up again in the restarted sandboxee.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  ASSERT_THAT(sandbox.Call(kTable, 0, &result, arr.PtrBefore(), &size),
+              IsOk());
+  EXPECT_THAT(result.GetValue(), Eq(10));
+}
+
+class PreloadedSymbolsSumSandbox : public SumSandbox {
+ protected:
+  std::vector<std::string> GetPreloadedSymbols() const override {
+    return {"sum", "no_such_symbol"};
+  }
+};
+
+TEST(SandboxTest, PreloadedSymbols) {
+  PreloadedSymbolsSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  void* sum_addr = nullptr;
+  ASSERT_THAT(sandbox.Symbol("sum", &sum_addr), IsOk());
+  EXPECT_THAT(sum_addr, Ne(nullptr));
+  void* missing_addr = &sum_addr;
+  ASSERT_THAT(sandbox.Symbol("no_such_symbol", &missing_addr), IsOk());
+  EXPECT_THAT(missing_addr, Eq(nullptr));
+
+  // Cached addresses are dropped with the sandboxee.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  void* new_sum_addr = nullptr;
+  ASSERT_THAT(sandbox.Symbol("sum", &new_sum_addr), IsOk());
+  EXPECT_THAT(new_sum_addr, Ne(nullptr));
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+// Returns a call of sum(a, b).
+FuncCall MakeSumCall(int a, int b) {
+  FuncCall call{};
+  strncpy(call.func, "sum", FuncCall::kFuncNameMax - 1);
+  call.ret_type = v::Type::kInt;
+  call.ret_size = sizeof(int);
+  call.argc = 2;
+  const int args[] = {a, b};
+  for (int i = 0; i < 2; ++i) {
+    call.arg_type[i] = v::Type::kInt;
+    call.arg_size[i] = sizeof(int);
+    call.args[i].arg_int = args[i];
+  }
+  return call;
+}
+
+TEST(SandboxTest, EventLoopCalls) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+
+  constexpr int kNumCalls = 10;
+  std::vector<int> results;
+  for (int i = 0; i < kNumCalls; ++i) {
+    ASSERT_THAT(channel->CallAsync(MakeSumCall(i, 1), comms::kMsgCall,
+                                   v::Type::kInt,
+                                   [&results](sapi::StatusOr<FuncRet> ret) {
+                                     ASSERT_THAT(ret.status(), IsOk());
+                                     results.push_back(
+                                         ret.ValueOrDie().int_val);
+                                   }),
+                IsOk());
+  }
+  pollfd pfd = {channel->GetReadinessFd(), POLLIN, 0};
+  while (results.size() < static_cast<size_t>(kNumCalls)) {
+    ASSERT_THAT(poll(&pfd, 1, /*timeout=*/10000), Eq(1));
+    ASSERT_THAT(channel->ProcessReplies(), IsOk());
+  }
+  for (int i = 0; i < kNumCalls; ++i) {
+    EXPECT_THAT(results[i], Eq(i + 1));
+  }
+
+  // Synchronous calls still work afterwards.
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+TEST(SandboxTest, CallBatch) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  v::Int a(1);
+  v::Int b(2);
+  v::Int c(3);
+  v::Int sum_result;
+  v::Int sub_result;
+  EXPECT_THAT(sandbox.CallBatch({{"sum", &sum_result, {&a, &b}},
+                                 {"sub", &sub_result, {&c, &a}}}),
+              IsOk());
+  EXPECT_THAT(sum_result.GetValue(), Eq(3));
+  EXPECT_THAT(sub_result.GetValue(), Eq(2));
+
+  // The batch stops at the first failing call.
+  EXPECT_THAT(sandbox.CallBatch({{"sum", &sum_result, {&b, &c}},
+                                 {"no_such_function", &sub_result, {}}}),
+              StatusIs(sapi::StatusCode::kUnavailable));
+  EXPECT_THAT(sandbox.IsActive(), Eq(true));
+}
+
+TEST(SandboxTest, CallBatchSynchronizesCallsBeforeAFailure) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  v::Struct<sum_params> params;
+  params.mutable_data()->a = 1;
+  params.mutable_data()->b = 2;
+  v::Void sums_result;
+  v::Int missing_result;
+  EXPECT_THAT(sandbox.CallBatch(
+                  {{"sums", &sums_result, {params.PtrBoth()}},
+                   {"function_that_does_not_exist", &missing_result, {}}}),
+              Not(IsOk()));
+  // The first call ran, its output still comes back.
+  EXPECT_THAT(params.data().ret, Eq(3));
+  EXPECT_THAT(sandbox.IsActive(), Eq(true));
+}
+
+TEST(SandboxTest, RunPlan) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  // (1 + 2) * 4 - 1, each result feeding the next call.
+  v::Int a(1);
+  v::Int b(2);
+  v::Int c(4);
+  v::Int placeholder;
+  v::Int sum_result;
+  v::Int mul_result;
+  v::Int sub_result;
+  CallPlan plan;
+  const size_t sum = plan.AddCall("sum", &sum_result, {&a, &b});
+  const size_t mul = plan.AddCall("mul", &mul_result, {&placeholder, &c});
+  plan.UseResult(mul, 0, sum);
+  const size_t sub = plan.AddCall("sub", &sub_result, {&placeholder, &a});
+  plan.UseResult(sub, 0, mul);
+  SAPI_ASSERT_OK_AND_ASSIGN(size_t num_run, sandbox.RunPlan(plan));
+  EXPECT_THAT(num_run, Eq(3));
+  EXPECT_THAT(sum_result.GetValue(), Eq(3));
+  EXPECT_THAT(mul_result.GetValue(), Eq(12));
+  EXPECT_THAT(sub_result.GetValue(), Eq(11));
+
+  // The plan stops once a call returns its stop value.
+  plan.StopIfEquals(mul, 12);
+  sub_result.SetValue(0);
+  SAPI_ASSERT_OK_AND_ASSIGN(num_run, sandbox.RunPlan(plan));
+  EXPECT_THAT(num_run, Eq(2));
+  EXPECT_THAT(sub_result.GetValue(), Eq(0));
+
+  // Results can only flow forward.
+  CallPlan backwards;
+  backwards.AddCall("sum", &sum_result, {&placeholder, &b});
+  backwards.UseResult(0, 0, 0);
+  EXPECT_THAT(sandbox.RunPlan(backwards),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
+TEST(SandboxTest, RunPlanSynchronizesCallsBeforeAFailure) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  v::Struct<sum_params> params;
+  params.mutable_data()->a = 1;
+  params.mutable_data()->b = 2;
+  v::Void sums_result;
+  v::Int missing_result;
+  CallPlan plan;
+  plan.AddCall("sums", &sums_result, {params.PtrBoth()});
+  plan.AddCall("function_that_does_not_exist", &missing_result, {});
+  EXPECT_THAT(sandbox.RunPlan(plan), Not(IsOk()));
+  // The first call ran, its output still comes back.
+  EXPECT_THAT(params.data().ret, Eq(3));
+  EXPECT_THAT(sandbox.IsActive(), Eq(true));
+}
+
+class CachingSumSandbox : public SumSandbox {
+ protected:
+  std::vector<std::string> GetCachedFunctions() const override {
+    return {"sum", "sumarr"};
+  }
+  size_t GetCallCacheSize() const override { return 2; }
+};
+
+TEST(SandboxTest, CachesPureFunctions) {
+  CachingSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  EXPECT_THAT(sandbox.call_cache().hits(), Eq(1));
+
+  // Pointed-to contents are part of the key.
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(10));
+  data[0] = 5;
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(14));
+  EXPECT_THAT(sandbox.call_cache().hits(), Eq(1));
+
+  // The least recently used result, sum(1, 2), was evicted.
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  EXPECT_THAT(sandbox.call_cache().hits(), Eq(1));
+
+  // Pointers synchronized after the call are never cached.
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            api.sumarr(arr.PtrBoth(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(sandbox.call_cache().hits(), Eq(1));
+  EXPECT_THAT(sandbox.call_cache().misses(), Eq(4));
+
+  // Neither are pointers to more than the key holds.
+  std::vector<int> large(CallCache::kMaxPointedBytes / sizeof(int) + 1, 1);
+  v::Array<int> large_arr(large.data(), large.size());
+  for (int i = 0; i < 2; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        result, api.sumarr(large_arr.PtrBefore(), large.size()));
+    EXPECT_THAT(result, Eq(static_cast<int>(large.size())));
+  }
+  EXPECT_THAT(sandbox.call_cache().hits(), Eq(1));
+  EXPECT_THAT(sandbox.call_cache().misses(), Eq(4));
+}
+
+TEST(SandboxTest, LenValTransfers) {
+  StringopSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  StringopApi api(&sandbox);
+
+  // The sandboxee grows and replaces the data.
+  v::LenVal param("abc", 3);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.duplicate_string(param.PtrBoth()));
+  EXPECT_THAT(result, Eq(1));
+  EXPECT_THAT(std::string(reinterpret_cast<const char*>(param.GetData()),
+                          param.GetDataSize()),
+              Eq("abcabc"));
+
+  // The data is unchanged, read back in place.
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&param), IsOk());
+  EXPECT_THAT(std::string(reinterpret_cast<const char*>(param.GetData()),
+                          param.GetDataSize()),
+              Eq("abcabc"));
+  EXPECT_THAT(param.GetRemoteCapacity(), Eq(6));
+
+  // With enough capacity, the sandboxee grows the data in place. Since it
+  // left the capacity alone, only the new size is known to fit.
+  ASSERT_THAT(param.ReserveData(sandbox.GetRpcChannel(), 16), IsOk());
+  EXPECT_THAT(param.GetDataSize(), Eq(6));
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.duplicate_string(param.PtrBoth()));
+  EXPECT_THAT(result, Eq(1));
+  EXPECT_THAT(std::string(reinterpret_cast<const char*>(param.GetData()),
+                          param.GetDataSize()),
+              Eq("abcabcabcabc"));
+  EXPECT_THAT(param.GetRemoteCapacity(), Eq(12));
+
+  // realloc() may shrink the buffer in place, which leaves the capacity field
+  // unchanged.
+  ASSERT_THAT(param.ReserveData(sandbox.GetRpcChannel(), 32), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.truncate_string(param.PtrBoth(), 3));
+  EXPECT_THAT(result, Eq(1));
+  EXPECT_THAT(std::string(reinterpret_cast<const char*>(param.GetData()),
+                          param.GetDataSize()),
+              Eq("abc"));
+  EXPECT_THAT(param.GetRemoteCapacity(), Eq(3));
+  // So growing the data again reallocates the buffer.
+  ASSERT_THAT(param.ResizeData(sandbox.GetRpcChannel(), 20), IsOk());
+  EXPECT_THAT(param.GetRemoteCapacity(), Ge(20));
+}
+
+TEST(SandboxTest, ResizesWithinCapacity) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+
+  v::Array<int> arr(10);
+  ASSERT_THAT(sandbox.Allocate(&arr, /*automatic_free=*/true), IsOk());
+  EXPECT_THAT(arr.GetRemoteCapacity(), Eq(10 * sizeof(int)));
+
+  // Growing at least doubles the remote buffer.
+  ASSERT_THAT(arr.Resize(channel, 11), IsOk());
+  EXPECT_THAT(arr.GetRemoteCapacity(), Eq(20 * sizeof(int)));
+  void* const remote = arr.GetRemote();
+
+  // Resizing within the capacity leaves the remote buffer alone.
+  ASSERT_THAT(arr.Resize(channel, 5), IsOk());
+  ASSERT_THAT(arr.Resize(channel, 20), IsOk());
+  EXPECT_THAT(arr.GetRemote(), Eq(remote));
+  EXPECT_THAT(arr.GetNElem(), Eq(20));
+
+  ASSERT_THAT(arr.Reserve(channel, 100), IsOk());
+  EXPECT_THAT(arr.GetRemoteCapacity(), Eq(100 * sizeof(int)));
+  EXPECT_THAT(arr.GetNElem(), Eq(20));
+  for (int i = 0; i < 20; ++i) {
+    arr[i] = i;
+  }
+  ASSERT_THAT(sandbox.TransferToSandboxee(&arr), IsOk());
+  ASSERT_THAT(arr.ClearRemote(channel), IsOk());
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&arr), IsOk());
+  EXPECT_THAT(arr[19], Eq(0));
+}
+
+TEST(SandboxTest, AdoptsBuffers) {
+  std::vector<int> data = {1, 2, 3};
+  const int* elements = data.data();
+  v::Array<int> arr(std::move(data));
+  EXPECT_THAT(arr.GetData(), Eq(elements));
+  EXPECT_THAT(arr.GetNElem(), Eq(3));
+  std::vector<int> released = arr.ReleaseVector();
+  EXPECT_THAT(released.data(), Eq(elements));
+  EXPECT_THAT(arr.GetNElem(), Eq(0));
+
+  StringopSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  StringopApi api(&sandbox);
+
+  // The sandboxee grows the data, which is copied out of the std::string.
+  v::LenVal param(std::string("abc"));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.duplicate_string(param.PtrBoth()));
+  EXPECT_THAT(result, Eq(1));
+  EXPECT_THAT(param.ReleaseString(), Eq("abcabc"));
+  EXPECT_THAT(param.GetDataSize(), Eq(0));
+}
+
+TEST(SandboxTest, ReportsResultToDoneCallback) {
+  SumSandbox sandbox;
+  absl::Mutex mutex;
+  int calls = 0;
+  sandbox2::Result::StatusEnum final_status = sandbox2::Result::UNSET;
+  sandbox.SetDoneCallback(
+      [&mutex, &calls, &final_status](const sandbox2::Result& result) {
+        absl::MutexLock lock(&mutex);
+        ++calls;
+        final_status = result.final_status();
+      });
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  sandbox.Terminate();
+  absl::MutexLock lock(&mutex);
+  EXPECT_THAT(calls, Eq(1));
+  EXPECT_THAT(final_status, Eq(sandbox.result().final_status()));
+}
+
+TEST(SandboxTest, RemoteMemoryOperations) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+
+  v::Array<int> arr(1000);
+  v::Array<int> other(1000);
+  ASSERT_THAT(sandbox.Allocate(&arr, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.Allocate(&other, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(arr.FillRemote(channel, 0x12345678), IsOk());
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&arr), IsOk());
+  EXPECT_THAT(arr[0], Eq(0x12345678));
+  EXPECT_THAT(arr[999], Eq(0x12345678));
+
+  ASSERT_THAT(other.ClearRemote(channel), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(bool equal, arr.RemoteEquals(channel, other));
+  EXPECT_THAT(equal, Eq(false));
+  ASSERT_THAT(other.CopyRemoteFrom(channel, arr), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(equal, arr.RemoteEquals(channel, other));
+  EXPECT_THAT(equal, Eq(true));
+
+  EXPECT_THAT(channel->Fill(arr.GetRemote(), 0, 3, 10),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+}
+
+TEST(SandboxTest, ReusesProtos) {
+  StringopSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  StringopApi api(&sandbox);
+
+  stringop::StringReverse proto;
+  v::Proto<stringop::StringReverse> pp(proto);
+  ASSERT_THAT(sandbox.Allocate(&pp, /*automatic_free=*/true), IsOk());
+  stringop::StringReverse result;
+  for (const std::string& input : {"Hello", "Hi", "A longer input"}) {
+    proto.set_input(input);
+    ASSERT_THAT(pp.SetMessage(proto), IsOk());
+    SAPI_ASSERT_OK_AND_ASSIGN(int return_code,
+                              api.pb_reverse_string(pp.PtrBoth()));
+    EXPECT_THAT(return_code, Ne(0));
+    ASSERT_THAT(pp.GetMessage(&result), IsOk());
+    EXPECT_THAT(result.output(),
+                Eq(std::string(input.rbegin(), input.rend())));
+  }
+
+  google::protobuf::Arena arena;
+  SAPI_ASSERT_OK_AND_ASSIGN(stringop::StringReverse * on_arena,
+                            pp.GetMessageOnArena(&arena));
+  EXPECT_THAT(on_arena->output(), Eq("tupni regnol A"));
+}
+
+// Records the attributes of all spans.
+class RecordingTracer : public Tracer {
+ public:
+  struct Span {
+    std::string name;
+    std::map<std::string, std::string> strings;
+    std::map<std::string, int64_t> ints;
+  };
+
+  std::unique_ptr<TraceSpan> StartSpan(absl::string_view name) override {
+    absl::MutexLock lock(&mutex_);
+    spans_.emplace_back();
+    spans_.back().name = std::string(name);
+    return absl::make_unique<RecordingSpan>(this, spans_.size() - 1);
+  }
+
+  std::vector<Span> spans() {
+    absl::MutexLock lock(&mutex_);
+    return spans_;
+  }
+
+ private:
+  class RecordingSpan : public TraceSpan {
+   public:
+    RecordingSpan(RecordingTracer* tracer, size_t index)
+        : tracer_(tracer), index_(index) {}
+
+    void SetAttribute(absl::string_view key,
+                      absl::string_view value) override {
+      absl::MutexLock lock(&tracer_->mutex_);
+      tracer_->spans_[index_].strings[std::string(key)] = std::string(value);
+    }
+    void SetAttribute(absl::string_view key, int64_t value) override {
+      absl::MutexLock lock(&tracer_->mutex_);
+      tracer_->spans_[index_].ints[std::string(key)] = value;
+    }
+
+   private:
+    RecordingTracer* tracer_;
+    size_t index_;
+  };
+
+  absl::Mutex mutex_;
+  std::vector<Span> spans_ GUARDED_BY(mutex_);
+};
+
+TEST(SandboxTest, TracesCalls) {
+  StringopSandbox sandbox;
+  RecordingTracer tracer;
+  SetTracer(&tracer);
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  StringopApi api(&sandbox);
+  v::LenVal param("abc", 3);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.duplicate_string(param.PtrBoth()));
+  EXPECT_THAT(result, Eq(1));
+  SetTracer(nullptr);
+
+  std::vector<RecordingTracer::Span> spans = tracer.spans();
+  ASSERT_THAT(spans.size(), Eq(2));
+  EXPECT_THAT(spans[0].name, Eq("sapi.Init"));
+  EXPECT_THAT(spans[0].ints[kTracePid], Eq(sandbox.GetPid()));
+  EXPECT_THAT(spans[1].name, Eq("sapi.Call"));
+  EXPECT_THAT(spans[1].strings[kTraceFunction], Eq("duplicate_string"));
+  EXPECT_THAT(spans[1].strings[kTraceSandbox],
+              Eq(spans[0].strings[kTraceSandbox]));
+  EXPECT_THAT(spans[1].ints[kTracePid], Eq(sandbox.GetPid()));
+  EXPECT_THAT(spans[1].ints[kTraceBytesToSandboxee], Gt(0));
+  EXPECT_THAT(spans[1].ints[kTraceBytesFromSandboxee], Gt(0));
+}
+
+// Frees of variables going out of scope are sent along with the next request.
+template <typename T>
+void TestDeferredFrees(T* sandbox) {
+  SumApi api(sandbox);
+  for (int i = 0; i < 1000; ++i) {
+    v::Int var(i);
+    ASSERT_THAT(sandbox->Allocate(&var, /*automatic_free=*/true), IsOk());
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  {
+    v::Int var(0);
+    ASSERT_THAT(sandbox->Allocate(&var, /*automatic_free=*/true), IsOk());
+  }
+  EXPECT_THAT(sandbox->FlushFrees(), IsOk());
+  EXPECT_THAT(sandbox->FlushFrees(), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sum(3, 4));
+  EXPECT_THAT(result, Eq(7));
+}
+
+TEST(SandboxTest, DeferredFrees) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  TestDeferredFrees(&sandbox);
+}
+
+class WarmUpSumSandbox : public SumSandbox {
+ public:
+  int warm_up_calls() const { return warm_up_calls_; }
+
+ protected:
+  bool PrefaultLibraryPages() const override { return true; }
+  bool BindSymbolsAtStartup() const override { return true; }
+  bool CollectStats() const override { return true; }
+  sapi::Status WarmUp() override {
+    ++warm_up_calls_;
+    SumApi api(this);
+    return api.sum(1, 2).status();
+  }
+
+ private:
+  int warm_up_calls_ = 0;
+};
+
+TEST(SandboxTest, WarmUp) {
+  WarmUpSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  EXPECT_THAT(sandbox.warm_up_calls(), Eq(1));
+  // Warm-up calls are not counted.
+  EXPECT_THAT(sandbox.GetStats().empty(), Eq(true));
+
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(3, 4));
+  EXPECT_THAT(result, Eq(7));
+  EXPECT_THAT(sandbox.GetStats()["sum"].calls, Eq(1));
+
+  ASSERT_THAT(sandbox.Restart(/*attempt_graceful_exit=*/true), IsOk());
+  EXPECT_THAT(sandbox.warm_up_calls(), Eq(2));
+}
+
+class SharedMemorySumSandbox : public SumSandbox {
+ protected:
+  bool UseSharedMemoryTransport() const override { return true; }
+};
+
+TEST(SandboxTest, SharedMemoryTransport) {
+  SharedMemorySumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+
+  // Memory transfers and fd passing still work alongside the transport.
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(10));
+  EXPECT_THAT(leak_file_descriptor(&sandbox, "/proc/self/exe"), Gt(0));
+}
+
+// The sandboxee cannot allocate an arena this large.
+class HugeArenaSumSandbox : public SharedMemorySumSandbox {
+ protected:
+  size_t GetArenaSize() const override { return size_t{1} << 62; }
+};
+
+TEST(SandboxTest, FailedSetUpTerminatesTheSandboxee) {
+  HugeArenaSumSandbox sandbox;
+  EXPECT_THAT(sandbox.Init(), Not(IsOk()));
+  EXPECT_THAT(sandbox.IsActive(), Eq(false));
+}
+
+class CommsTransferSumSandbox : public SumSandbox {
+ protected:
+  bool TransferMemoryOverComms() const override { return true; }
+};
+
+TEST(SandboxTest, TransferMemoryOverComms) {
+  CommsTransferSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  // Both the batched transfers before and after the call and the transfers of
+  // single variables go over the RPC channel.
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result,
+                            api.sumarr(arr.PtrBoth(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(10));
+  data[0] = 5;
+  ASSERT_THAT(sandbox.TransferToSandboxee(&arr), IsOk());
+  data[0] = 0;
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&arr), IsOk());
+  EXPECT_THAT(data[0], Eq(5));
+}
+
+TEST(SandboxTest, InitFromBroker) {
+  SandboxBroker broker;
+  SandboxPoolOptions options = SandboxBroker::DefaultPoolOptions();
+  options.size = 1;
+  broker.AddPool("sum", [] { return absl::make_unique<SumSandbox>(); },
+                 options);
+  const std::string socket_name =
+      absl::StrCat("sapi-test-broker-", getpid());
+  std::thread server([&broker, &socket_name] {
+    EXPECT_THAT(broker.Serve(socket_name), IsOk());
+  });
+
+  SumSandbox sandbox;
+  // The broker may not listen yet.
+  sapi::Status status;
+  for (int i = 0; i < 100; ++i) {
+    status = sandbox.InitFromBroker(socket_name, "sum");
+    if (status.ok()) {
+      break;
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  ASSERT_THAT(status, IsOk());
+  SumApi api(&sandbox);
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result,
+                            api.sumarr(arr.PtrBoth(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(10));
+  sandbox.Terminate();
+  EXPECT_THAT(sandbox.IsActive(), Eq(false));
+
+  SumSandbox other;
+  EXPECT_THAT(other.InitFromBroker(socket_name, "no_such_pool"),
+              StatusIs(sapi::StatusCode::kNotFound));
+
+  broker.Stop();
+  server.join();
+}
+
+TEST(SandboxTest, BrokerRejectsForeignUids) {
+  SandboxBroker broker;
+  SandboxPoolOptions options = SandboxBroker::DefaultPoolOptions();
+  options.size = 1;
+  broker.AddPool("sum", [] { return absl::make_unique<SumSandbox>(); },
+                 options);
+  // This process runs as a uid other than the allowed one.
+  broker.SetAllowedUids({geteuid() + 1});
+  const std::string socket_name =
+      absl::StrCat("sapi-test-foreign-broker-", getpid());
+  std::thread server([&broker, &socket_name] {
+    EXPECT_THAT(broker.Serve(socket_name), IsOk());
+  });
+
+  SumSandbox sandbox;
+  // The broker may not listen yet.
+  sapi::Status status;
+  for (int i = 0; i < 100; ++i) {
+    status = sandbox.InitFromBroker(socket_name, "sum");
+    if (!IsUnavailable(status)) {
+      break;
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_THAT(status, StatusIs(sapi::StatusCode::kPermissionDenied));
+  EXPECT_THAT(sandbox.IsActive(), Eq(false));
+
+  broker.Stop();
+  server.join();
+}
+
+class SpinningSumSandbox : public SharedMemorySumSandbox {
+ protected:
+  absl::Duration GetSharedMemorySpinDuration() const override {
+    return absl::Microseconds(50);
+  }
+};
+
+TEST(SandboxTest, SharedMemoryTransportSpin) {
+  SpinningSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  for (int i = 0; i < 100; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(i, 1));
+    EXPECT_THAT(result, Eq(i + 1));
+  }
+  // Calls which outlast the spin, so that both sides go to sleep.
+  ASSERT_THAT(api.sleep_for_sec(1), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+TEST(SandboxTest, DeferredFreesSharedMemoryTransport) {
+  SharedMemorySumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  TestDeferredFrees(&sandbox);
+}
+
+class SharedBuffersSumSandbox : public SumSandbox {
+ protected:
+  bool UseSharedBuffers() const override { return true; }
+};
+
+TEST(SandboxTest, SharedArray) {
+  SharedBuffersSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto arr, v::SharedArray<int>::Create(4));
+  for (int i = 0; i < 4; ++i) {
+    (*arr)[i] = i + 1;
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr->PtrBoth(), 4));
+  EXPECT_THAT(result, Eq(10));
+
+  // Changes are visible to the sandboxee without any synchronization.
+  (*arr)[0] = 11;
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumarr(arr->PtrNone(), 4));
+  EXPECT_THAT(result, Eq(20));
+}
+
+class LazyPagingSumSandbox : public SumSandbox {
+ protected:
+  bool UseLazyPaging() const override { return true; }
+};
+
+TEST(SandboxTest, LazyArrayCopiesOnlyTouchedPages) {
+  LazyPagingSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  // 64 MiB, of which the sandboxee only reads the first elements.
+  std::vector<int> data(16 << 20, 1);
+  data[0] = 10;
+  v::LazyArray<int> arr(data.data(), data.size(), /*read_ahead_pages=*/4);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrBefore(), 4));
+  EXPECT_THAT(result, Eq(13));
+  EXPECT_THAT(arr.GetPagesCopied(), Eq(4));
+
+  // The tail of the data is copied without the pages beyond it.
+  data.back() = 5;
+  v::LazyArray<int> tail(data.data() + data.size() - 4, 4);
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumarr(tail.PtrBefore(), 4));
+  EXPECT_THAT(result, Eq(8));
+  EXPECT_THAT(tail.GetPagesCopied(), Eq(1));
+}
+
+TEST(SandboxTest, RecordArrayStagesPointeesAndColumns) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  std::vector<int> ints = {1, 2, 3, 4};
+  v::RecordArray<int> arr(ints);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrBefore(), 4));
+  EXPECT_THAT(result, Eq(10));
+
+  struct Record {
+    int value;
+    const char* name;
+  };
+  std::vector<Record> records = {{1, "one"}, {2, nullptr}, {3, "three"}};
+  v::RecordArray<Record> aos(
+      records, {{offsetof(Record, name), [](const Record& r) -> size_t {
+                   return strlen(r.name) + 1;
+                 }}});
+  ASSERT_THAT(sandbox.Allocate(&aos, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&aos), IsOk());
+  // The names follow the records and are pointed to by remote addresses.
+  const auto* staged = static_cast<const Record*>(aos.GetLocal());
+  const uintptr_t base = reinterpret_cast<uintptr_t>(aos.GetRemote());
+  EXPECT_THAT(staged[1].name, Eq(nullptr));
+  for (int i : {0, 2}) {
+    const uintptr_t offset = reinterpret_cast<uintptr_t>(staged[i].name) - base;
+    ASSERT_THAT(offset, Lt(aos.GetSize()));
+    EXPECT_THAT(static_cast<const char*>(aos.GetLocal()) + offset,
+                StrEq(records[i].name));
+  }
+
+  // The header of the struct of arrays points to the column of values.
+  v::RecordArray<Record> soa(records, {{offsetof(Record, value), sizeof(int)}});
+  ASSERT_THAT(sandbox.Allocate(&soa, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&soa), IsOk());
+  void* column;
+  memcpy(&column, soa.GetLocal(), sizeof(column));
+  v::RemotePtr values(column);
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumarr(&values, records.size()));
+  EXPECT_THAT(result, Eq(6));
+}
+
+TEST(SandboxTest, GiftSharedArray) {
+  SharedBuffersSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto arr, v::SharedArray<int>::Create(4));
+  for (int i = 0; i < 4; ++i) {
+    (*arr)[i] = i + 1;
+  }
+  ASSERT_THAT(arr->GiftToSandboxee(sandbox.GetRpcChannel()), IsOk());
+  EXPECT_THAT(arr->GetData(), Eq(nullptr));
+  EXPECT_THAT(arr->GiftToSandboxee(sandbox.GetRpcChannel()),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+
+  // The sandboxee still sees the contents, the host does not hold them
+  // anymore.
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr->PtrNone(), 4));
+  EXPECT_THAT(result, Eq(10));
+  EXPECT_THAT(sandbox.GetRpcChannel()->Free(arr->GetRemote()), IsOk());
+}
+
+TEST(SandboxTest, MapBuffer) {
+  SharedBuffersSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(auto buffer,
+                            sandbox2::Buffer::CreateWithSize(4 * sizeof(int)));
+  void* addr;
+  ASSERT_THAT(sandbox.MapBuffer(buffer.get(), PROT_READ, &addr), IsOk());
+  int* table = reinterpret_cast<int*>(buffer->data());
+  for (int i = 0; i < 4; ++i) {
+    table[i] = i + 1;
+  }
+  // Backed by the mapping, so PtrBoth() transfers nothing.
+  v::Array<int> arr(table, 4);
+  arr.SetRemote(addr);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrBoth(), 4));
+  EXPECT_THAT(result, Eq(10));
+
+  table[3] = 14;
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumarr(arr.PtrNone(), 4));
+  EXPECT_THAT(result, Eq(20));
+
+  ASSERT_THAT(sandbox.UnmapBuffer(buffer.get()), IsOk());
+  EXPECT_THAT(sandbox.UnmapBuffer(buffer.get()),
+              StatusIs(sapi::StatusCode::kNotFound));
+}
+
+TEST(SandboxTest, RemoteView) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  constexpr size_t kSize = 1 << 20;
+  std::vector<uint8_t> data(kSize);
+  for (size_t i = 0; i < kSize; ++i) {
+    data[i] = i % 251;
+  }
+  v::Array<uint8_t> arr(data.data(), kSize);
+  ASSERT_THAT(sandbox.Allocate(&arr, true), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&arr), IsOk());
+
+  v::RemoteView view(sandbox.GetPid(), arr);
+  SAPI_ASSERT_OK_AND_ASSIGN(absl::Span<const uint8_t> head, view.Read(0, 16));
+  EXPECT_THAT(head[15], Eq(15));
+  SAPI_ASSERT_OK_AND_ASSIGN(absl::Span<const uint8_t> tail,
+                            view.Read(kSize - 100, 100));
+  EXPECT_THAT(tail[99], Eq((kSize - 1) % 251));
+  // Only the pages read were copied.
+  EXPECT_THAT(view.bytes_fetched(), testing::Le(size_t{4} * getpagesize()));
+  EXPECT_THAT(view.Read(kSize - 100, 101).status(),
+              StatusIs(sapi::StatusCode::kOutOfRange));
+
+  v::RemoteView sequential(sandbox.GetPid(), arr);
+  sequential.set_advice(v::RemoteView::Advice::kSequential);
+  for (size_t offset = 0; offset < kSize; offset += 1000) {
+    const size_t length = std::min<size_t>(1000, kSize - offset);
+    SAPI_ASSERT_OK_AND_ASSIGN(absl::Span<const uint8_t> chunk,
+                              sequential.Read(offset, length));
+    ASSERT_THAT(chunk[0], Eq(offset % 251));
+  }
+  EXPECT_THAT(sequential.bytes_fetched(), Eq(kSize));
+}
+
+TEST(SandboxTest, HostCallback) {
+  SumSandbox sandbox;
+  sandbox.RegisterHostCallback(
+      1, [](absl::Span<const uint8_t> request,
+            std::vector<uint8_t>* response) -> sapi::Status {
+        int args[2];
+        if (request.size() != sizeof(args)) {
+          return sapi::InvalidArgumentError("Expected two ints");
+        }
+        memcpy(args, request.data(), sizeof(args));
+        const int sum = args[0] + args[1];
+        response->resize(sizeof(sum));
+        memcpy(response->data(), &sum, sizeof(sum));
+        return sapi::OkStatus();
+      });
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumhost(2, 3));
+  EXPECT_THAT(result, Eq(5));
+  // Survives a restart.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumhost(40, 2));
+  EXPECT_THAT(result, Eq(42));
+}
+
+TEST(SandboxTest, HostCallbackTerminatesTheSandbox) {
+  SumSandbox sandbox;
+  sandbox.RegisterHostCallback(
+      1, [&sandbox](absl::Span<const uint8_t> request,
+                    std::vector<uint8_t>* response) {
+        sandbox.Terminate();
+        return sapi::CancelledError("Terminated");
+      });
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  // The call made the callback returns instead of waiting forever. It fails,
+  // unless the reply to the callback got through before the kill did.
+  sapi::StatusOr<int> result = api.sumhost(2, 3);
+  EXPECT_TRUE(!result.ok() || result.ValueOrDie() == -1);
+  EXPECT_THAT(sandbox.AwaitResult().final_status(),
+              Eq(sandbox2::Result::EXTERNAL_KILL));
+  EXPECT_FALSE(sandbox.IsActive());
+  // The sandbox can be used again.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(int sum, api.sum(1, 2));
+  EXPECT_THAT(sum, Eq(3));
+}
+
+TEST(SandboxTest, PooledSharedArray) {
+  SharedBuffersSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  sandbox2::BufferPool pool;
+  ASSERT_THAT(pool.Reserve(4 * sizeof(int), 2), IsOk());
+  ASSERT_THAT(sandbox.GetRpcChannel()->ShareBuffers(pool.GetIdleBuffers()),
+              IsOk());
+  for (int round = 0; round < 4; ++round) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto arr,
+                              v::SharedArray<int>::Create(&pool, 4));
+    // Returned buffers are scrubbed.
+    EXPECT_THAT((*arr)[0], Eq(0));
+    for (int i = 0; i < 4; ++i) {
+      (*arr)[i] = i + round;
+    }
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr->PtrNone(), 4));
+    EXPECT_THAT(result, Eq(6 + 4 * round));
+  }
+  EXPECT_THAT(pool.GetIdleBuffers(), testing::SizeIs(2));
+}
+
+class DirtyPagesSumSandbox : public SumSandbox {
+ protected:
+  bool TrackDirtyPages() const override { return true; }
+};
+
+TEST(SandboxTest, Stream) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(auto stream, v::Stream::Create());
+
+  // More than fits into the pipe buffer, so the call only completes if the
+  // output is consumed while it is running.
+  constexpr int kCount = 1 << 18;
+  std::string output;
+  sapi::Status read_status;
+  std::thread consumer([&stream, &output, &read_status] {
+    read_status = stream->ReadAll(&output);
+  });
+  v::Int ret;
+  v::Int count(kCount);
+  EXPECT_THAT(sandbox.Call("write_ints", &ret, stream.get(), &count), IsOk());
+  EXPECT_THAT(stream->CloseRemoteFd(sandbox.GetRpcChannel()), IsOk());
+  consumer.join();
+
+  EXPECT_THAT(ret.GetValue(), Eq(kCount));
+  ASSERT_THAT(read_status, IsOk());
+  ASSERT_THAT(output.size(), Eq(kCount * sizeof(int)));
+  const int* values = reinterpret_cast<const int*>(output.data());
+  for (int i = 0; i < kCount; ++i) {
+    ASSERT_THAT(values[i], Eq(i));
+  }
+}
+
+TEST(SandboxTest, DirtyPageTracking) {
+  DirtyPagesSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  v::Struct<sum_params> params;
+  params.mutable_data()->a = 1;
+  params.mutable_data()->b = 2;
+  params.mutable_data()->ret = 0;
+  ASSERT_THAT(api.sums(params.PtrBoth()), IsOk());
+  EXPECT_THAT(params.data().ret, Eq(3));
+
+  // The sandboxee only reads the array, its contents must be preserved.
+  std::vector<int> data(1 << 16, 1);
+  v::Array<int> arr(data.data(), data.size());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrBoth(), data.size()));
+  EXPECT_THAT(result, Eq(1 << 16));
+  EXPECT_THAT(data[0], Eq(1));
+}
+
+// Returns whether the kernel tracks soft-dirty pages, which needs
+// CONFIG_MEM_SOFT_DIRTY.
+bool KernelTracksSoftDirtyPages() {
+  const size_t page_size = getpagesize();
+  void* page = mmap(nullptr, page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    return false;
+  }
+  const int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  const auto is_dirty = [page, page_size, pagemap]() {
+    uint64_t entry = 0;
+    const off_t offset =
+        reinterpret_cast<uintptr_t>(page) / page_size * sizeof(entry);
+    return pread(pagemap, &entry, sizeof(entry), offset) == sizeof(entry) &&
+           (entry & (1ULL << 55)) != 0;
+  };
+  static_cast<volatile char*>(page)[0] = 1;
+  const int clear_refs = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  bool tracks = write(clear_refs, "4", 1) == 1 && !is_dirty();
+  static_cast<volatile char*>(page)[0] = 2;
+  tracks = tracks && is_dirty();
+  close(clear_refs);
+  close(pagemap);
+  munmap(page, page_size);
+  return tracks;
+}
+
+TEST(SandboxTest, DirtyPageTrackingCopiesOnlyModifiedPages) {
+  if (!KernelTracksSoftDirtyPages()) {
+    // Without soft-dirty bits all pages are copied back.
+    return;
+  }
+  DirtyPagesSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  // Large enough to be mapped on its own, not from a huge page of the heap.
+  const size_t page_size = getpagesize();
+  const size_t size = 64 * page_size;
+  v::Array<uint8_t> arr(size);
+  ASSERT_THAT(sandbox.Allocate(&arr, /*automatic_free=*/true), IsOk());
+  uint8_t* local = arr.GetData();
+  memset(local, 0x11, size);
+  ASSERT_THAT(sandbox.TransferToSandboxee(&arr), IsOk());
+
+  // The array is only copied back, the sandboxee keeps the old contents. It
+  // only writes sum_params::ret, so only the page holding it comes back.
+  memset(local, 0x22, size);
+  ASSERT_THAT(api.sums(arr.PtrAfter()), IsOk());
+  int ret;
+  memcpy(&ret, local + offsetof(sum_params, ret), sizeof(ret));
+  EXPECT_THAT(ret, Eq(0x11111111 + 0x11111111));
+
+  const uintptr_t remote = reinterpret_cast<uintptr_t>(arr.GetRemote());
+  const size_t first_page_end = page_size - remote % page_size;
+  for (size_t i = 0; i < size; ++i) {
+    if (i >= offsetof(sum_params, ret) &&
+        i < offsetof(sum_params, ret) + sizeof(int)) {
+      continue;
+    }
+    ASSERT_THAT(local[i], Eq(i < first_page_end ? 0x11 : 0x22))
+        << "Byte " << i << " of " << size;
+  }
+}
+
+TEST(SandboxTest, PartialStructSync) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  v::Struct<sum_params> params;
+  params.mutable_data()->a = 1;
+  params.mutable_data()->b = 2;
+  ASSERT_THAT(
+      params.SyncFields(
+          {SAPI_STRUCT_FIELD(sum_params, a), SAPI_STRUCT_FIELD(sum_params, b)},
+          {SAPI_STRUCT_FIELD(sum_params, ret)}),
+      IsOk());
+  ASSERT_THAT(api.sums(params.PtrBoth()), IsOk());
+  EXPECT_THAT(params.data().ret, Eq(3));
+
+  // Only 'b' is sent, the sandboxee keeps the previous value of 'a'.
+  params.mutable_data()->a = 10;
+  params.mutable_data()->b = 5;
+  ASSERT_THAT(params.SyncFields({SAPI_STRUCT_FIELD(sum_params, b)},
+                                {SAPI_STRUCT_FIELD(sum_params, ret)}),
+              IsOk());
+  ASSERT_THAT(api.sums(params.PtrBoth()), IsOk());
+  EXPECT_THAT(params.data().ret, Eq(6));
+  EXPECT_THAT(params.data().a, Eq(10));
+
+  // Ranges outside of the struct, also by overflowing, are rejected and leave
+  // the previous ones in place.
+  EXPECT_THAT(params.SyncFields({{sizeof(sum_params) - 1, 2}}, {}),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(params.SyncFields({}, {{sizeof(sum_params) + 1, 0}}),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_THAT(params.SyncFields({{1, SIZE_MAX}}, {}),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  params.mutable_data()->b = 7;
+  ASSERT_THAT(api.sums(params.PtrBoth()), IsOk());
+  EXPECT_THAT(params.data().ret, Eq(8));
+  params.mutable_data()->b = 5;
+
+  params.SyncWholeStruct();
+  ASSERT_THAT(api.sums(params.PtrBoth()), IsOk());
+  EXPECT_THAT(params.data().ret, Eq(15));
+}
+
+class TemplateSumSandbox : public SumSandbox {
+ protected:
+  std::string GetTemplateInitFunction() const override {
+    return "sum_template_init";
+  }
+};
+
+// Returns the value of sum_template_value in the sandboxee.
+int GetTemplateValue(Sandbox* sandbox) {
+  void* addr;
+  EXPECT_THAT(sandbox->Symbol("sum_template_value", &addr), IsOk());
+  v::Int value;
+  value.SetRemote(addr);
+  EXPECT_THAT(sandbox->TransferFromSandboxee(&value), IsOk());
+  return value.GetValue();
+}
+
+TEST(SandboxTest, WarmTemplate) {
+  TemplateSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  EXPECT_THAT(GetTemplateValue(&sandbox), Eq(42));
+
+  // Restarted sandboxees are forked from the same initialized forkserver.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  EXPECT_THAT(GetTemplateValue(&sandbox), Eq(42));
+
+  SumSandbox plain;
+  ASSERT_THAT(plain.Init(), IsOk());
+  EXPECT_THAT(GetTemplateValue(&plain), Eq(0));
+}
+
+class ArenaSumSandbox : public SumSandbox {
+ protected:
+  size_t GetArenaSize() const override { return 1 << 20; }
+};
+
+TEST(SandboxTest, Arena) {
+  ArenaSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  int data[] = {1, 2, 3, 4};
+  int other[] = {10, 20};
+  for (int i = 0; i < 2; ++i) {
+    v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+    v::Array<int> other_arr(other, ABSL_ARRAYSIZE(other));
+    SAPI_ASSERT_OK_AND_ASSIGN(int result,
+                              api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+    EXPECT_THAT(result, Eq(10));
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        result, api.sumarr(other_arr.PtrBefore(), ABSL_ARRAYSIZE(other)));
+    EXPECT_THAT(result, Eq(30));
+    sandbox.ResetArena();
+  }
+
+  // Allocations larger than the arena are served by the sandboxee.
+  std::vector<uint8_t> large(2 << 20, 1);
+  v::Array<uint8_t> large_arr(large.data(), large.size());
+  EXPECT_THAT(sandbox.Allocate(&large_arr, /*automatic_free=*/true), IsOk());
+}
+
+TEST(SandboxTest, ReallocatesArenaMemory) {
+  ArenaSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+
+  v::Array<int> first(4);
+  v::Array<int> last(4);
+  for (int i = 0; i < 4; ++i) {
+    first[i] = i + 1;
+    last[i] = i + 10;
+  }
+  ASSERT_THAT(sandbox.Allocate(&first, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.Allocate(&last, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&first), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&last), IsOk());
+
+  // The most recent allocation grows in place.
+  void* const last_addr = last.GetRemote();
+  ASSERT_THAT(last.Reserve(channel, 64), IsOk());
+  EXPECT_THAT(last.GetRemote(), Eq(last_addr));
+
+  // Any other one is copied out of the arena.
+  void* const first_addr = first.GetRemote();
+  ASSERT_THAT(first.Reserve(channel, 64), IsOk());
+  EXPECT_THAT(first.GetRemote(), Ne(first_addr));
+  for (int i = 0; i < 4; ++i) {
+    first[i] = 0;
+    last[i] = 0;
+  }
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&first), IsOk());
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&last), IsOk());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_THAT(first[i], Eq(i + 1));
+    EXPECT_THAT(last[i], Eq(i + 10));
+  }
+
+  // The copy is regular heap memory, freed along with 'first'. The arena
+  // itself is never freed.
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(last.PtrNone(), 4));
+  EXPECT_THAT(result, Eq(46));
+}
+
+TEST(SandboxTest, ArenaVarsOutlivingAResetLeaveNewerOnesAlone) {
+  ArenaSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+  SumApi api(&sandbox);
+
+  auto stale_freed = absl::make_unique<v::Array<int>>(4);
+  v::Array<int> stale_grown(4);
+  ASSERT_THAT(sandbox.Allocate(stale_freed.get(), /*automatic_free=*/true),
+              IsOk());
+  ASSERT_THAT(sandbox.Allocate(&stale_grown, /*automatic_free=*/true), IsOk());
+  sandbox.ResetArena();
+
+  // The first allocations after the reset reuse the memory of the stale ones,
+  // the most recent one at the offset of 'stale_grown'.
+  v::Array<int> first(4);
+  v::Array<int> last(4);
+  for (int i = 0; i < 4; ++i) {
+    first[i] = i + 1;
+    last[i] = i + 10;
+  }
+  ASSERT_THAT(sandbox.Allocate(&first, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.Allocate(&last, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(last.GetRemote(), Eq(stale_grown.GetRemote()));
+  ASSERT_THAT(sandbox.TransferToSandboxee(&first), IsOk());
+  ASSERT_THAT(sandbox.TransferToSandboxee(&last), IsOk());
+
+  // Neither grows nor gives back the memory of 'last'.
+  EXPECT_THAT(stale_grown.Reserve(channel, 64), Not(IsOk()));
+  stale_freed.reset();
+  EXPECT_THAT(sandbox.Free(&stale_grown), IsOk());
+
+  v::Array<int> next(4);
+  ASSERT_THAT(sandbox.Allocate(&next, /*automatic_free=*/true), IsOk());
+  EXPECT_THAT(next.GetRemote(), Ne(last.GetRemote()));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(first.PtrNone(), 4));
+  EXPECT_THAT(result, Eq(10));
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sumarr(last.PtrNone(), 4));
+  EXPECT_THAT(result, Eq(46));
+}
+
+TEST(SandboxTest, RequestRegions) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  int data[] = {1, 2, 3, 4};
+  void* first_addr = nullptr;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_THAT(sandbox.BeginRegion(1 << 20), IsOk());
+    EXPECT_THAT(sandbox.BeginRegion(1 << 20), Not(IsOk()));
+    {
+      v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+      SAPI_ASSERT_OK_AND_ASSIGN(
+          int result, api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+      EXPECT_THAT(result, Eq(10));
+      // Each region starts over at the same address.
+      if (i == 0) {
+        first_addr = arr.GetRemote();
+      } else {
+        EXPECT_THAT(arr.GetRemote(), Eq(first_addr));
+      }
+    }
+    ASSERT_THAT(sandbox.EndRegion(), IsOk());
+  }
+  EXPECT_THAT(sandbox.EndRegion(), Not(IsOk()));
+  // The address space is reserved once.
+  EXPECT_THAT(sandbox.BeginRegion(2 << 20), Not(IsOk()));
+
+  // Allocations outside of regions use the sandboxee's heap again.
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result,
+                            api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+  EXPECT_THAT(result, Eq(10));
+  EXPECT_THAT(arr.GetRemote(), Ne(first_addr));
+}
+
+TEST(SandboxTest, RejectsReallocationsOfEndedRegions) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  RPCChannel* channel = sandbox.GetRpcChannel();
+
+  // 'first' keeps 'second' off the start of the region.
+  v::Array<int> first(4);
+  v::Array<int> second(4);
+  ASSERT_THAT(sandbox.BeginRegion(1 << 20), IsOk());
+  ASSERT_THAT(sandbox.Allocate(&first, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.Allocate(&second, /*automatic_free=*/true), IsOk());
+  ASSERT_THAT(sandbox.EndRegion(), IsOk());
+  // No region is active.
+  EXPECT_THAT(second.Reserve(channel, 64), Not(IsOk()));
+
+  // The next region has no allocation at the address of 'second'.
+  ASSERT_THAT(sandbox.BeginRegion(1 << 20), IsOk());
+  v::Array<int> other(4);
+  ASSERT_THAT(sandbox.Allocate(&other, /*automatic_free=*/true), IsOk());
+  EXPECT_THAT(second.Reserve(channel, 64), Not(IsOk()));
+  // Allocations of the active region still grow.
+  EXPECT_THAT(other.Reserve(channel, 64), IsOk());
+  ASSERT_THAT(sandbox.EndRegion(), IsOk());
+}
+
+class ThreadedSumSandbox : public SumSandbox {
+ protected:
+  int GetNumWorkerThreads() const override { return 3; }
+};
+
+TEST(SandboxTest, WorkerThreads) {
+  ThreadedSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+
+  constexpr int kNumThreads = 4;
+  constexpr int kNumCalls = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&sandbox, t] {
+      SumApi api(&sandbox);
+      for (int i = 0; i < kNumCalls; ++i) {
+        int data[] = {t, i, 1};
+        v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+        SAPI_ASSERT_OK_AND_ASSIGN(
+            int result, api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+        EXPECT_THAT(result, Eq(t + i + 1));
+        SAPI_ASSERT_OK_AND_ASSIGN(result, api.sum(t, i));
+        EXPECT_THAT(result, Eq(t + i));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_THAT(sandbox.IsActive(), Eq(true));
+
+  // Worker threads are started again after a restart.
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+class PolicyCountingSumSandbox : public SumSandbox {
+ public:
+  int num_policies() const { return num_policies_; }
+
+ protected:
+  std::unique_ptr<sandbox2::Policy> ModifyPolicy(
+      sandbox2::PolicyBuilder* builder) override {
+    ++num_policies_;
+    return SumSandbox::ModifyPolicy(builder);
+  }
+
+ private:
+  int num_policies_ = 0;
+};
+
+TEST(SandboxTest, Reset) {
+  PolicyCountingSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  const int pid = sandbox.GetPid();
+
+  // The policy is only built once.
+  ASSERT_THAT(sandbox.Reset(false), IsOk());
+  ASSERT_THAT(sandbox.Reset(true), IsOk());
+  EXPECT_THAT(sandbox.num_policies(), Eq(1));
+  EXPECT_THAT(sandbox.GetPid(), Ne(pid));
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  EXPECT_THAT(sandbox.num_policies(), Eq(2));
+}
+
+class CheckpointSumSandbox : public SumSandbox {
+ protected:
+  bool UseRequestCheckpoints() const override { return true; }
+  bool UseSharedBuffers() const override { return true; }
+};
+
+TEST(SandboxTest, RequestCheckpointsDiscardState) {
+  CheckpointSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  void* addr;
+  ASSERT_THAT(sandbox.Symbol("sumsymbol", &addr), IsOk());
+  v::Int value;
+  value.SetRemote(addr);
+  const int pid = sandbox.GetPid();
+
+  ASSERT_THAT(sandbox.BeginRequest(), IsOk());
+  EXPECT_THAT(sandbox.GetPid(), Ne(pid));
+  value.SetValue(42);
+  ASSERT_THAT(sandbox.TransferToSandboxee(&value), IsOk());
+  SumApi api(&sandbox);
+  {
+    int data[] = {1, 2, 3};
+    v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+    SAPI_ASSERT_OK_AND_ASSIGN(
+        int result, api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)));
+    EXPECT_THAT(result, Eq(6));
+  }
+  ASSERT_THAT(sandbox.EndRequest(), IsOk());
+  EXPECT_THAT(sandbox.GetPid(), Eq(pid));
+  ASSERT_THAT(sandbox.TransferFromSandboxee(&value), IsOk());
+  EXPECT_THAT(value.GetValue(), Eq(5));
+
+  // A crash only takes down the fork.
+  ASSERT_THAT(sandbox.BeginRequest(), IsOk());
+  EXPECT_THAT(api.crash(), Not(IsOk()));
+  ASSERT_THAT(sandbox.EndRequest(), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+TEST(SandboxTest, RequestCheckpointsDiscardMappings) {
+  CheckpointSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(auto before,
+                            sandbox2::Buffer::CreateWithSize(4 * sizeof(int)));
+  SAPI_ASSERT_OK_AND_ASSIGN(auto during,
+                            sandbox2::Buffer::CreateWithSize(4 * sizeof(int)));
+  void* before_addr;
+  ASSERT_THAT(sandbox.MapBuffer(before.get(), PROT_READ, &before_addr),
+              IsOk());
+
+  ASSERT_THAT(sandbox.BeginRequest(), IsOk());
+  void* during_addr;
+  ASSERT_THAT(sandbox.MapBuffer(during.get(), PROT_READ, &during_addr),
+              IsOk());
+  ASSERT_THAT(sandbox.UnmapBuffer(before.get()), IsOk());
+  ASSERT_THAT(sandbox.EndRequest(), IsOk());
+
+  // The mapping of the request went with it, and the one unmapped during the
+  // request is unmapped in the sandboxee now.
+  EXPECT_THAT(sandbox.UnmapBuffer(during.get()),
+              StatusIs(sapi::StatusCode::kNotFound));
+  EXPECT_THAT(sandbox.UnmapBuffer(before.get()),
+              StatusIs(sapi::StatusCode::kNotFound));
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  EXPECT_THAT(sandbox.IsActive(), Eq(true));
+
+  // A buffer can be mapped again, even at the address of the request's one.
+  ASSERT_THAT(sandbox.MapBuffer(during.get(), PROT_READ, &during_addr),
+              IsOk());
+  ASSERT_THAT(sandbox.UnmapBuffer(during.get()), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(result, api.sum(3, 4));
+  EXPECT_THAT(result, Eq(7));
+}
+
+// Polls 'done' for up to ten seconds.
+bool Eventually(const std::function<bool()>& done) {
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (!done()) {
+    if (absl::Now() > deadline) {
+      return false;
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  return true;
+}
+
+TEST(SandboxTest, InitMany) {
+  constexpr int kNumSandboxes = 4;
+  std::vector<std::unique_ptr<PolicyCountingSumSandbox>> owned;
+  std::vector<Sandbox*> sandboxes;
+  for (int i = 0; i < kNumSandboxes; ++i) {
+    owned.push_back(absl::make_unique<PolicyCountingSumSandbox>());
+    sandboxes.push_back(owned.back().get());
+  }
+  ASSERT_THAT(Sandbox::InitMany(absl::MakeSpan(sandboxes)), IsOk());
+  EXPECT_THAT(owned[0]->num_policies(), Eq(1));
+  for (int i = 0; i < kNumSandboxes; ++i) {
+    SumApi api(owned[i].get());
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(i, 1));
+    EXPECT_THAT(result, Eq(i + 1));
+    if (i > 0) {
+      EXPECT_THAT(owned[i]->num_policies(), Eq(0));
+    }
+  }
+
+  // The shared forkserver outlives the sandbox which started it.
+  owned[0].reset();
+  ASSERT_THAT(owned[1]->Restart(false), IsOk());
+  SumApi api(owned[1].get());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+// Returns the parent of process 'pid', or 0 if it is gone.
+pid_t GetParentPid(pid_t pid) {
+  std::ifstream stat(absl::StrCat("/proc/", pid, "/stat"));
+  std::string line;
+  if (!std::getline(stat, line)) {
+    return 0;
+  }
+  // The command name may contain spaces, the state and the parent follow it.
+  std::istringstream fields(line.substr(line.rfind(')') + 1));
+  char state;
+  pid_t ppid = 0;
+  fields >> state >> ppid;
+  return state == 'Z' || state == 'X' ? 0 : ppid;
+}
+
+// Returns the library forkserver 'sandbox' was forked from. The sandboxee runs
+// under the init process of its PID namespace, a child of the forkserver.
+pid_t GetForkServerPid(const Sandbox& sandbox) {
+  pid_t init = GetParentPid(sandbox.GetPid());
+  return init != 0 ? GetParentPid(init) : 0;
+}
+
+class BoundSumSandbox : public SumSandbox {
+ protected:
+  bool BindSymbolsAtStartup() const override { return true; }
+};
+
+TEST(SandboxTest, SharesForkServersUntilTheLastSandboxIsGone) {
+  auto first = absl::make_unique<SumSandbox>();
+  auto second = absl::make_unique<SumSandbox>();
+  ASSERT_THAT(first->Init(), IsOk());
+  ASSERT_THAT(second->Init(), IsOk());
+  const pid_t forkserver = GetForkServerPid(*first);
+  ASSERT_THAT(forkserver, Gt(0));
+  EXPECT_THAT(GetForkServerPid(*second), Eq(forkserver));
+
+  // A different environment needs a forkserver of its own.
+  BoundSumSandbox bound;
+  ASSERT_THAT(bound.Init(), IsOk());
+  EXPECT_THAT(GetForkServerPid(bound), Ne(forkserver));
+
+  first.reset();
+  EXPECT_THAT(GetParentPid(forkserver), Gt(0));
+  ASSERT_THAT(second->Restart(false), IsOk());
+  EXPECT_THAT(GetForkServerPid(*second), Eq(forkserver));
+
+  // The forkserver goes away with the last sandbox using it, the next one
+  // starts a new one.
+  second.reset();
+  EXPECT_TRUE(
+      Eventually([forkserver] { return GetParentPid(forkserver) == 0; }));
+  SumSandbox third;
+  ASSERT_THAT(third.Init(), IsOk());
+  EXPECT_THAT(GetForkServerPid(third), Ne(forkserver));
+}
+
+TEST(SandboxTest, InitManyRejectsMismatchedSandboxes) {
+  SumSandbox sum;
+  StringopSandbox stringop;
+  std::vector<Sandbox*> sandboxes = {&sum, &stringop};
+  EXPECT_THAT(Sandbox::InitMany(absl::MakeSpan(sandboxes)),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_FALSE(sum.IsActive());
+  EXPECT_FALSE(stringop.IsActive());
+
+  Sandbox embedded(sum_sapi_embed_create());
+  Sandbox without_library(nullptr);
+  sandboxes = {&embedded, &without_library};
+  EXPECT_THAT(Sandbox::InitMany(absl::MakeSpan(sandboxes)),
+              StatusIs(sapi::StatusCode::kInvalidArgument));
+  EXPECT_FALSE(embedded.IsActive());
+}
+
+class StatsSumSandbox : public SumSandbox {
+ protected:
+  bool CollectStats() const override { return true; }
+};
+
+class CountingExporter : public CallStatsExporter {
+ public:
+  explicit CountingExporter(int* count) : count_(count) {}
+  void Export(const std::string& func, const CallSample& sample) override {
+    ++*count_;
+  }
+
+ private:
+  int* count_;
+};
+
+TEST(SandboxTest, CallStats) {
+  StatsSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  int exported = 0;
+  sandbox.SetStatsExporter(absl::make_unique<CountingExporter>(&exported));
+  SumApi api(&sandbox);
+
+  EXPECT_THAT(api.sum(1, 2), IsOk());
+  EXPECT_THAT(api.sum(3, 4), IsOk());
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  EXPECT_THAT(api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)), IsOk());
+  v::Int result;
+  EXPECT_THAT(sandbox.Call("no_such_function", &result), Not(IsOk()));
+
+  CallStatsMap stats = sandbox.GetStats();
+  EXPECT_THAT(stats["sum"].calls, Eq(2));
+  EXPECT_THAT(stats["sum"].errors, Eq(0));
+  EXPECT_THAT(stats["sum"].execution.count(), Eq(2));
+  EXPECT_THAT(stats["sumarr"].bytes_to_sandboxee, Eq(sizeof(data)));
+  EXPECT_THAT(stats["sumarr"].bytes_from_sandboxee, Eq(0));
+  EXPECT_THAT(stats["sumarr"].bytes_inlined, Eq(sizeof(data)));
+  EXPECT_THAT(stats["no_such_function"].errors, Eq(1));
+  EXPECT_THAT(exported, Eq(4));
+
+  // Plain sandboxes do not collect statistics.
+  SumSandbox plain;
+  ASSERT_THAT(plain.Init(), IsOk());
+  SumApi plain_api(&plain);
+  EXPECT_THAT(plain_api.sum(1, 2), IsOk());
+  EXPECT_THAT(plain.GetStats().empty(), Eq(true));
+}
+
+class PerfCountersSumSandbox : public StatsSumSandbox {
+ protected:
+  bool CollectPerfCounters() const override { return true; }
+};
+
+TEST(SandboxTest, CallStatsPerfCounters) {
+  // Nothing to test where the kernel does not allow perf_event_open().
+  if (!PerfCounters::Open(getpid()).ok()) {
+    return;
+  }
+  PerfCountersSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_THAT(api.sum(i, 1), IsOk());
+  }
+  int data[] = {1, 2, 3, 4};
+  v::Array<int> arr(data, ABSL_ARRAYSIZE(data));
+  EXPECT_THAT(api.sumarr(arr.PtrBefore(), ABSL_ARRAYSIZE(data)), IsOk());
+
+  // The sandboxee waits for each request, so it is switched out around every
+  // call, though the last switch of a call may fall into the next one.
+  CallStatsMap stats = sandbox.GetStats();
+  EXPECT_THAT(stats["sum"].counters.context_switches, Ge(5));
+  EXPECT_THAT(stats["sumarr"].calls, Eq(1));
+
+  // Without CollectPerfCounters(), the counters stay zero.
+  StatsSumSandbox plain;
+  ASSERT_THAT(plain.Init(), IsOk());
+  SumApi plain_api(&plain);
+  EXPECT_THAT(plain_api.sum(1, 2), IsOk());
+  EXPECT_THAT(plain.GetStats()["sum"].counters.context_switches, Eq(0));
+}
+
+class NoInlineSumSandbox : public StatsSumSandbox {
+ protected:
+  size_t GetInlineTransferThreshold() const override { return 0; }
+};
+
+TEST(SandboxTest, SmallVariablesAreSentInline) {
+  StatsSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  int small[] = {1, 2, 3, 4};
+  v::Array<int> small_arr(small, ABSL_ARRAYSIZE(small));
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      int result, api.sumarr(small_arr.PtrBefore(), ABSL_ARRAYSIZE(small)));
+  EXPECT_THAT(result, Eq(10));
+  EXPECT_THAT(sandbox.GetStats()["sumarr"].bytes_inlined, Eq(sizeof(small)));
+
+  // Larger variables are transferred on their own.
+  std::vector<int> large(1024, 1);
+  v::Array<int> large_arr(large.data(), large.size());
+  SAPI_ASSERT_OK_AND_ASSIGN(result,
+                            api.sumarr(large_arr.PtrBefore(), large.size()));
+  EXPECT_THAT(result, Eq(1024));
+  EXPECT_THAT(sandbox.GetStats()["sumarr"].bytes_inlined, Eq(sizeof(small)));
+
+  NoInlineSumSandbox no_inline;
+  ASSERT_THAT(no_inline.Init(), IsOk());
+  SumApi no_inline_api(&no_inline);
+  v::Array<int> other_arr(small, ABSL_ARRAYSIZE(small));
+  SAPI_ASSERT_OK_AND_ASSIGN(result, no_inline_api.sumarr(
+                                        other_arr.PtrBefore(),
+                                        ABSL_ARRAYSIZE(small)));
+  EXPECT_THAT(result, Eq(10));
+  EXPECT_THAT(no_inline.GetStats()["sumarr"].bytes_inlined, Eq(0));
+}
+
+TEST(SandboxPoolTest, HandsOutWorkingSandboxes) {
+  SandboxPool<SumSandbox> pool;
+  for (int i = 0; i < 3; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    SumApi api(lease.get());
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, i));
+    EXPECT_THAT(result, Eq(1 + i));
+  }
+}
+
+TEST(SandboxPoolTest, SharesReadOnlyData) {
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::shared_ptr<sandbox2::Buffer> buffer,
+      sandbox2::Buffer::CreateReadOnly(4 * sizeof(int), [](uint8_t* data) {
+        const int table[] = {1, 2, 3, 4};
+        memcpy(data, table, sizeof(table));
+        return sapi::OkStatus();
+      }));
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.max_uses = 1;
+  SandboxPool<SharedBuffersSumSandbox> pool(options);
+  ASSERT_THAT(pool.AddSharedData(buffer), IsOk());
+  // Fresh sandboxes, and the one which waited in the pool before the data was
+  // added.
+  for (int i = 0; i < 3; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    void* addr = lease.GetSharedData(buffer.get());
+    ASSERT_THAT(addr, NotNull());
+    int unused[4] = {};
+    v::Array<int> arr(unused, 4);
+    arr.SetRemote(addr);
+    SumApi api(lease.get());
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrNone(), 4));
+    EXPECT_THAT(result, Eq(10));
+  }
+}
+
+TEST(SandboxPoolTest, RemapsSharedDataOnRestart) {
+  SAPI_ASSERT_OK_AND_ASSIGN(
+      std::shared_ptr<sandbox2::Buffer> buffer,
+      sandbox2::Buffer::CreateReadOnly(4 * sizeof(int), [](uint8_t* data) {
+        const int table[] = {1, 2, 3, 4};
+        memcpy(data, table, sizeof(table));
+        return sapi::OkStatus();
+      }));
+  SandboxPoolOptions options;
+  options.size = 1;
+  SandboxPool<SharedBuffersSumSandbox> pool(options);
+  ASSERT_THAT(pool.AddSharedData(buffer), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+  const int pid = lease->GetPid();
+  ASSERT_THAT(lease.Restart(/*attempt_graceful_exit=*/false), IsOk());
+  EXPECT_THAT(lease->GetPid(), Ne(pid));
+
+  void* addr = lease.GetSharedData(buffer.get());
+  ASSERT_THAT(addr, NotNull());
+  int unused[4] = {};
+  v::Array<int> arr(unused, 4);
+  arr.SetRemote(addr);
+  SumApi api(lease.get());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sumarr(arr.PtrNone(), 4));
+  EXPECT_THAT(result, Eq(10));
+}
+
+TEST(SandboxPoolTest, ReplacesSandboxes) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.max_uses = 1;
+  SandboxPool<SumSandbox> pool(options);
+
+  int pid;
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    pid = lease->GetPid();
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+  EXPECT_THAT(lease->GetPid(), Ne(pid));
+}
+
+TEST(SandboxPoolTest, DiscardsFailedSandboxes) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  SandboxPool<SumSandbox> pool(options);
+
+  int pid;
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    pid = lease->GetPid();
+    lease.MarkFailed();
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+  EXPECT_THAT(lease->GetPid(), Ne(pid));
+}
+
+TEST(SandboxTest, HeapProfilingNeedsHookedMalloc) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  // The sum library is built without heap profiling.
+  EXPECT_THAT(sandbox.StartHeapProfiling(),
+              StatusIs(sapi::StatusCode::kFailedPrecondition));
+  SAPI_ASSERT_OK_AND_ASSIGN(std::string profile, sandbox.GetHeapProfile());
+  EXPECT_THAT(profile, HasSubstr("heap profile: 0: 0 [0: 0] @ heap_v2/0\n"));
+  EXPECT_THAT(profile, HasSubstr("MAPPED_LIBRARIES:\n"));
+  SumApi api(&sandbox);
+  EXPECT_THAT(api.sum(1, 2), IsOk());
+}
+
+TEST(SandboxTest, ReportsResidentMemory) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SAPI_ASSERT_OK_AND_ASSIGN(uint64_t resident, sandbox.GetResidentMemory());
+  EXPECT_THAT(resident, Gt(0));
+}
+
+class MergingSumSandbox : public SumSandbox {
+ protected:
+  bool MergeIdenticalPages() const override { return true; }
+};
+
+TEST(SandboxTest, MergesIdenticalPages) {
+  // Nothing to test where the kernel is built without KSM.
+  if (access("/sys/kernel/mm/ksm", F_OK) != 0) {
+    return;
+  }
+  MergingSumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+
+  // Either way of enabling merging sets the "mg" flag of the mappings.
+  ASSERT_THAT(sandbox.EnableMemoryMerging(), IsOk());
+  std::ifstream smaps(absl::StrCat("/proc/", sandbox.GetPid(), "/smaps"));
+  ASSERT_TRUE(smaps.is_open());
+  int num_mergeable = 0;
+  for (std::string line; std::getline(smaps, line);) {
+    if (absl::StartsWith(line, "VmFlags:") &&
+        line.find(" mg") != std::string::npos) {
+      ++num_mergeable;
+    }
+  }
+  EXPECT_THAT(num_mergeable, Gt(0));
+  // Whether pages are merged depends on KSM running on the host.
+  SAPI_ASSERT_OK_AND_ASSIGN(sandbox2::util::MemoryUsage usage,
+                            sandbox.GetMemoryUsage());
+  EXPECT_THAT(usage.rss, Gt(0));
+  EXPECT_THAT(usage.rss, Eq(usage.shared_clean + usage.shared_dirty +
+                            usage.private_clean + usage.private_dirty));
+}
+
+TEST(SandboxTest, ReportsResourceUsage) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+  SAPI_ASSERT_OK_AND_ASSIGN(sandbox2::util::ResourceUsage usage,
+                            sandbox.GetResourceUsage());
+  EXPECT_THAT(usage.num_processes, Eq(1));
+  EXPECT_THAT(usage.rss, Gt(0));
+  // Every call is a round-trip over the Comms channel.
+  EXPECT_THAT(usage.voluntary_context_switches, Gt(0));
+}
+
+TEST(SandboxPoolTest, RecyclesSandboxesUsingTooMuchMemory) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  // Every sandboxee uses more than that.
+  options.max_resident_memory = 1;
+  options.health_check_interval = absl::Milliseconds(10);
+  SandboxPool<SumSandbox> pool(options);
+
+  int pid;
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    pid = lease->GetPid();
+  }
+  EXPECT_THAT(pool.GetNumRecycled(), Ge(1));
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+  EXPECT_THAT(lease->GetPid(), Ne(pid));
+}
+
+TEST(SandboxPoolTest, ScalesWithDemand) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.max_size = 4;
+  options.demand_window = absl::Milliseconds(100);
+  options.idle_ttl = absl::Milliseconds(100);
+  SandboxPool<SumSandbox> pool(options);
+  EXPECT_THAT(pool.GetTargetSize(), Eq(1));
+
+  // Far more requests while a sandbox starts than the pool holds.
+  for (int i = 0; i < 200; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    SumApi api(lease.get());
+    ASSERT_THAT(api.sum(1, i), IsOk());
+  }
+  EXPECT_THAT(pool.GetTargetSize(), Eq(4));
+  EXPECT_TRUE(Eventually([&pool] { return pool.GetNumReady() == 4; }));
+  // Idle, it shrinks back.
+  EXPECT_TRUE(Eventually([&pool] {
+    return pool.GetTargetSize() == 1 && pool.GetNumReady() == 1;
+  }));
+}
+
+TEST(SandboxPoolTest, KeepsWithinMemoryBudget) {
+  // Enough for the first sandboxee only.
+  PoolMemoryBudget budget(1);
+  SandboxPoolOptions options;
+  options.size = 2;
+  options.memory_budget = &budget;
+  SandboxPool<SumSandbox> pool(options);
+
+  ASSERT_TRUE(Eventually([&pool] { return pool.GetNumReady() == 1; }));
+  absl::SleepFor(absl::Milliseconds(200));
+  EXPECT_THAT(pool.GetNumReady(), Eq(1));
+  EXPECT_THAT(budget.used(), Gt(1));
+  // Requests are still served.
+  for (int i = 0; i < 2; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    SumApi api(lease.get());
+    ASSERT_THAT(api.sum(1, i), IsOk());
+  }
+}
+
+TEST(SandboxPoolTest, RoutesKeysToTheSameSandbox) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.max_size = 8;
+  // Keeps the pool from scaling and from idling out during the test, so that
+  // the set of sandboxes stays the same.
+  options.demand_window = absl::Hours(1);
+  options.idle_ttl = absl::Hours(1);
+  SandboxPool<SumSandbox> pool(options);
+  {
+    std::vector<SandboxPool<SumSandbox>::Lease> leases;
+    for (int i = 0; i < 3; ++i) {
+      SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+      leases.push_back(std::move(lease));
+    }
+    ASSERT_THAT(pool.GetTargetSize(), Eq(1));
+    ASSERT_TRUE(Eventually([&pool] { return pool.GetNumReady() == 1; }));
+  }
+  ASSERT_THAT(pool.GetNumReady(), Eq(4));
+
+  int pid;
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire("tenant"));
+    pid = lease->GetPid();
+  }
+  for (int i = 0; i < 3; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire("tenant"));
+    EXPECT_THAT(lease->GetPid(), Eq(pid));
+  }
+  EXPECT_THAT(pool.GetNumAffinityMisses(), Eq(0));
+
+  // While its sandbox is leased, the key falls back to another one.
+  {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire("tenant"));
+    SAPI_ASSERT_OK_AND_ASSIGN(auto other, pool.Acquire("tenant"));
+    EXPECT_THAT(other->GetPid(), Ne(pid));
+    EXPECT_THAT(pool.GetNumAffinityMisses(), Eq(1));
+  }
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire("tenant"));
+  EXPECT_THAT(lease->GetPid(), Eq(pid));
+}
+
+TEST(SandboxPoolTest, IsolatesRequests) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.isolate_requests = true;
+  SandboxPool<CheckpointSumSandbox> pool(options);
+
+  for (int i = 0; i < 2; ++i) {
+    SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+    void* addr;
+    ASSERT_THAT(lease->Symbol("sumsymbol", &addr), IsOk());
+    v::Int value;
+    value.SetRemote(addr);
+    ASSERT_THAT(lease->TransferFromSandboxee(&value), IsOk());
+    // Nothing is left from the previous request.
+    EXPECT_THAT(value.GetValue(), Eq(5));
+    value.SetValue(42 + i);
+    ASSERT_THAT(lease->TransferToSandboxee(&value), IsOk());
+  }
+}
+
+// Cannot serve requests from a fork once initialized if 'refuse' is set.
+class RefusingCheckpointSumSandbox : public CheckpointSumSandbox {
+ public:
+  explicit RefusingCheckpointSumSandbox(bool refuse) : refuse_(refuse) {}
+
+ protected:
+  bool UseRequestCheckpoints() const override {
+    return !refuse_ || !initialized_;
+  }
+  sapi::Status WarmUp() override {
+    initialized_ = true;
+    return sapi::OkStatus();
+  }
+
+ private:
+  const bool refuse_;
+  bool initialized_ = false;
+};
+
+TEST(SandboxPoolTest, DiscardsSandboxesWhichCannotBeginARequest) {
+  SandboxPoolOptions options;
+  options.size = 1;
+  options.isolate_requests = true;
+  std::atomic<int> made{0};
+  SandboxPool<RefusingCheckpointSumSandbox> pool(options, [&made] {
+    return absl::make_unique<RefusingCheckpointSumSandbox>(made++ == 0);
+  });
+  ASSERT_TRUE(Eventually([&pool] { return pool.GetNumReady() == 1; }));
+
+  // The pooled sandbox is discarded and a new one serves the request.
+  SAPI_ASSERT_OK_AND_ASSIGN(auto lease, pool.Acquire());
+  EXPECT_THAT(made.load(), Ge(2));
+  SumApi api(lease.get());
+  SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+  EXPECT_THAT(result, Eq(3));
+}
+
+TEST(TransactionExecutorTest, RunsTransactions) {
+  TransactionExecutorOptions options;
+  options.num_workers = 2;
+  TransactionExecutor<SumSandbox> executor(options);
+
+  std::vector<std::future<sapi::Status>> done;
+  std::atomic<int> total{0};
+  for (int i = 0; i < 20; ++i) {
+    done.push_back(executor.Submit([i, &total](SumSandbox* sandbox)
+                                       -> sapi::Status {
+      SumApi api(sandbox);
+      SAPI_ASSIGN_OR_RETURN(int result, api.sum(1, i));
+      total += result;
+      return sapi::OkStatus();
+    }));
+  }
+  for (auto& future : done) {
+    EXPECT_THAT(future.get(), IsOk());
+  }
+  EXPECT_THAT(total.load(), Eq(20 + 19 * 20 / 2));
+}
+
+TEST(TransactionExecutorTest, RetriesAndTimesOut) {
+  TransactionExecutorOptions options;
+  options.num_workers = 1;
+  options.retry_count = 1;
+  TransactionExecutor<SumSandbox> executor(options);
+
+  int tries = 0;
+  auto crashes_once = executor.Submit(
+      [&tries](SumSandbox* sandbox) -> sapi::Status {
+        SumApi api(sandbox);
+        if (tries++ == 0) {
+          return api.crash();
+        }
+        return api.sum(1, 2).status();
+      });
+  EXPECT_THAT(crashes_once.get(), IsOk());
+  EXPECT_THAT(tries, Eq(2));
+
+  auto too_slow = executor.Submit(
+      [](SumSandbox* sandbox) {
+        SumApi api(sandbox);
+        return api.sleep_for_sec(10);
+      },
+      absl::Milliseconds(100));
+  EXPECT_THAT(too_slow.get(), Not(IsOk()));
+}
+
+TEST(SandboxTest, CallDeadline) {
+  SumSandbox sandbox;
+  ASSERT_THAT(sandbox.Init(), IsOk());
+  SumApi api(&sandbox);
+  {
+    ScopedCallDeadline deadline(&sandbox, absl::Seconds(10));
+    SAPI_ASSERT_OK_AND_ASSIGN(int result, api.sum(1, 2));
+    EXPECT_THAT(result, Eq(3));
+  }
+
+  const absl::Time start = absl::Now();
+  {
+    ScopedCallDeadline deadline(&sandbox, absl::Milliseconds(100));
+    EXPECT_THAT(api.sleep_for_sec(10),
+                StatusIs(sapi::StatusCode::kDeadlineExceeded));
+  }
+  EXPECT_THAT(absl::Now() - start, Lt(absl::Seconds(5)));
+
+  ASSERT_THAT(sandbox.Restart(false), IsOk());
+  v::Int a(1);
+  v::Int b(2);
+  v::Int ret;
+  ASSERT_THAT(sandbox.Call(absl::Seconds(10), "sum", &ret, &a, &b), IsOk());
+  EXPECT_THAT(ret.GetValue(), Eq(3));
+}
+
 TEST(SandboxTest, NoRaceInAwaitResult) {
   auto sandbox = absl::make_unique<StringopSandbox>();
   ASSERT_THAT(sandbox->Init(), IsOk());
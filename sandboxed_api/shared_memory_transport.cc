@@ -0,0 +1,216 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/shared_memory_transport.h"
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sapi {
+
+namespace {
+
+// How long the host sleeps on the doorbell before checking whether the
+// sandboxee is still alive.
+constexpr int kPeerCheckIntervalMs = 100;
+
+// Number of spin iterations between two reads of the clock.
+constexpr int kSpinsPerClockCheck = 64;
+
+// Tells the CPU that the calling thread is busy-waiting.
+inline void CpuRelax() {
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Returns true if the peer closed its end of the Comms channel.
+bool PeerHungUp(sandbox2::Comms* comms) {
+  if (comms->IsTerminated()) {
+    return true;
+  }
+  pollfd pfd = {comms->GetConnectionFD(), POLLRDHUP, 0};
+  return TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) == 1 &&
+         (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+}  // namespace
+
+constexpr size_t SharedMemoryTransport::kDefaultSize;
+constexpr absl::Duration SharedMemoryTransport::kMaxSpinDuration;
+
+sapi::StatusOr<std::unique_ptr<SharedMemoryTransport>>
+SharedMemoryTransport::Create(size_t size, absl::Duration spin_duration,
+                              int numa_node) {
+  if (size <= sizeof(Header)) {
+    return sapi::InvalidArgumentError("Shared memory region too small");
+  }
+  spin_duration = std::max(std::min(spin_duration, kMaxSpinDuration),
+                           absl::ZeroDuration());
+  sandbox2::Buffer::Options options;
+  options.numa_node = numa_node;
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Buffer> buffer,
+                        sandbox2::Buffer::CreateWithSize(size, options));
+  // A freshly created buffer is zero-filled, i.e. in state kIdle.
+  auto transport = absl::WrapUnique(
+      new SharedMemoryTransport(std::move(buffer), spin_duration));
+  transport->header()->spin_ns = absl::ToInt64Nanoseconds(spin_duration);
+  return transport;
+}
+
+sapi::StatusOr<std::unique_ptr<SharedMemoryTransport>>
+SharedMemoryTransport::CreateFromFd(int fd) {
+  SAPI_ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Buffer> buffer,
+                        sandbox2::Buffer::CreateFromFd(fd));
+  if (buffer->size() <= sizeof(Header)) {
+    return sapi::InvalidArgumentError("Shared memory region too small");
+  }
+  // Written by the host before the region was passed on, the cap keeps it
+  // from making the sandboxee spin indefinitely.
+  const uint64_t spin_ns =
+      reinterpret_cast<const Header*>(buffer->data())->spin_ns;
+  const uint64_t max_spin_ns = absl::ToInt64Nanoseconds(kMaxSpinDuration);
+  const absl::Duration spin_duration =
+      absl::Nanoseconds(std::min(spin_ns, max_spin_ns));
+  return absl::WrapUnique(
+      new SharedMemoryTransport(std::move(buffer), spin_duration));
+}
+
+bool SharedMemoryTransport::Put(State state, uint32_t tag, uint64_t length,
+                                const uint8_t* bytes) {
+  if (length > GetMaxMsgSize()) {
+    LOG(ERROR) << "Message too large for shared memory region (" << length
+               << " > " << GetMaxMsgSize() << ")";
+    return false;
+  }
+  Header* hdr = header();
+  hdr->tag = tag;
+  hdr->length = length;
+  if (length > 0) {
+    memcpy(payload(), bytes, length);
+  }
+  // Sequentially consistent, so that either the waiter sees the new state
+  // before it goes to sleep, or we see it sleeping.
+  hdr->state.store(state, std::memory_order_seq_cst);
+  if (hdr->sleepers.load(std::memory_order_seq_cst) != 0) {
+    syscall(__NR_futex, &hdr->state, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+  return true;
+}
+
+bool SharedMemoryTransport::Get(uint32_t* tag, std::vector<uint8_t>* value) {
+  Header* hdr = header();
+  // Read the length exactly once, the other side might change it anytime.
+  const uint64_t length = hdr->length;
+  if (length > GetMaxMsgSize()) {
+    LOG(ERROR) << "Invalid message length in shared memory region: " << length;
+    return false;
+  }
+  *tag = hdr->tag;
+  value->resize(length);
+  if (length > 0) {
+    memcpy(value->data(), payload(), length);
+  }
+  return true;
+}
+
+bool SharedMemoryTransport::SpinFor(State state) const {
+  if (spin_duration_ == absl::ZeroDuration()) {
+    return false;
+  }
+  const Header* hdr = header();
+  const absl::Time deadline = absl::Now() + spin_duration_;
+  do {
+    for (int i = 0; i < kSpinsPerClockCheck; ++i) {
+      if (hdr->state.load(std::memory_order_acquire) == state) {
+        return true;
+      }
+      CpuRelax();
+    }
+  } while (absl::Now() < deadline);
+  return false;
+}
+
+bool SharedMemoryTransport::WaitFor(State state, sandbox2::Comms* comms) {
+  if (SpinFor(state)) {
+    return true;
+  }
+  Header* hdr = header();
+  const timespec interval = {0, kPeerCheckIntervalMs * 1000000L};
+  while (true) {
+    hdr->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t current = hdr->state.load(std::memory_order_seq_cst);
+    if (current == state) {
+      hdr->sleepers.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    const bool failed =
+        syscall(__NR_futex, &hdr->state, FUTEX_WAIT, current,
+                comms != nullptr ? &interval : nullptr, nullptr, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT;
+    hdr->sleepers.fetch_sub(1, std::memory_order_relaxed);
+    if (failed) {
+      PLOG(ERROR) << "futex(FUTEX_WAIT)";
+      return false;
+    }
+    if (comms != nullptr &&
+        hdr->state.load(std::memory_order_acquire) != state &&
+        PeerHungUp(comms)) {
+      VLOG(1) << "Peer terminated while waiting on shared memory";
+      return false;
+    }
+  }
+}
+
+bool SharedMemoryTransport::SendRequest(uint32_t tag, uint64_t length,
+                                        const uint8_t* bytes) {
+  return Put(kRequest, tag, length, bytes);
+}
+
+bool SharedMemoryTransport::RecvReply(sandbox2::Comms* comms, uint32_t* tag,
+                                      std::vector<uint8_t>* value) {
+  if (!WaitFor(kReply, comms) || !Get(tag, value)) {
+    return false;
+  }
+  header()->state.store(kIdle, std::memory_order_release);
+  return true;
+}
+
+bool SharedMemoryTransport::RecvRequest(uint32_t* tag,
+                                        std::vector<uint8_t>* value) {
+  // The sandboxee is killed together with its monitor, so it can wait
+  // indefinitely.
+  return WaitFor(kRequest, nullptr) && Get(tag, value);
+}
+
+bool SharedMemoryTransport::SendReply(uint32_t tag, uint64_t length,
+                                      const uint8_t* bytes) {
+  return Put(kReply, tag, length, bytes);
+}
+
+}  // namespace sapi
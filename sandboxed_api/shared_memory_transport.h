@@ -0,0 +1,134 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sapi::SharedMemoryTransport class exchanges TLV messages between the
+// host and the sandboxee through a memory region shared by both processes
+// (backed by a sandbox2::Buffer). A futex in the shared region acts as a
+// doorbell, so a request/reply round-trip needs no socket I/O.
+//
+// Only one message is in the region at any time: the host writes a request and
+// rings the doorbell, the sandboxee replaces it with its reply and rings back.
+// A waiting side can first spin on the shared state for a short while before
+// it goes to sleep on the futex. A message which arrives while spinning is
+// picked up without any system call on either side, as the doorbell is only
+// rung when the other side is actually asleep.
+// File descriptors cannot be passed through shared memory, these are still
+// transferred over the Comms channel.
+
+#ifndef SANDBOXED_API_SHARED_MEMORY_TRANSPORT_H_
+#define SANDBOXED_API_SHARED_MEMORY_TRANSPORT_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/sandbox2/comms.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+
+class SharedMemoryTransport {
+ public:
+  // Default size of the shared region, including the message header.
+  static constexpr size_t kDefaultSize = 64 << 10;
+  // Upper bound of the time spent spinning before each wait.
+  static constexpr absl::Duration kMaxSpinDuration = absl::Milliseconds(10);
+
+  SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+  SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+
+  // Creates a transport backed by a new shared buffer (host side). Both sides
+  // spin for up to 'spin_duration' before sleeping on the doorbell. The region
+  // is allocated on 'numa_node', see sandbox2::Buffer::Options::numa_node.
+  static sapi::StatusOr<std::unique_ptr<SharedMemoryTransport>> Create(
+      size_t size = kDefaultSize,
+      absl::Duration spin_duration = absl::ZeroDuration(),
+      int numa_node = sandbox2::Buffer::kAnyNumaNode);
+
+  // Creates a transport from a buffer received from the host (sandboxee side).
+  // Takes ownership of the file descriptor. The spin duration is the one the
+  // host chose, capped at kMaxSpinDuration.
+  static sapi::StatusOr<std::unique_ptr<SharedMemoryTransport>> CreateFromFd(
+      int fd);
+
+  // Gets the file descriptor backing the shared region.
+  int fd() const { return buffer_->fd(); }
+
+  // Returns the maximum size of a message payload.
+  uint64_t GetMaxMsgSize() const { return buffer_->size() - sizeof(Header); }
+
+  // Host side: sends a request and waits for the reply. 'comms' is only used
+  // to detect that the sandboxee went away while waiting.
+  bool SendRequest(uint32_t tag, uint64_t length, const uint8_t* bytes);
+  bool RecvReply(sandbox2::Comms* comms, uint32_t* tag,
+                 std::vector<uint8_t>* value);
+
+  // Sandboxee side: waits for the next request and answers it.
+  bool RecvRequest(uint32_t* tag, std::vector<uint8_t>* value);
+  bool SendReply(uint32_t tag, uint64_t length, const uint8_t* bytes);
+
+ private:
+  // States of the shared region, stored in Header::state.
+  enum State : uint32_t {
+    kIdle = 0,
+    kRequest,
+    kReply,
+  };
+
+  // Header at the start of the shared region, followed by the payload.
+  struct Header {
+    std::atomic<uint32_t> state;
+    // Number of threads sleeping on 'state'.
+    std::atomic<uint32_t> sleepers;
+    uint32_t tag;
+    uint64_t length;
+    // Spin duration chosen by the host, in nanoseconds.
+    uint64_t spin_ns;
+  };
+
+  SharedMemoryTransport(std::unique_ptr<sandbox2::Buffer> buffer,
+                        absl::Duration spin_duration)
+      : buffer_(std::move(buffer)), spin_duration_(spin_duration) {}
+
+  Header* header() const {
+    return reinterpret_cast<Header*>(buffer_->data());
+  }
+  uint8_t* payload() const { return buffer_->data() + sizeof(Header); }
+
+  // Writes a message into the region and switches it to 'state'.
+  bool Put(State state, uint32_t tag, uint64_t length, const uint8_t* bytes);
+
+  // Copies the message out of the region. The length is validated, as the
+  // region is writable by the other side.
+  bool Get(uint32_t* tag, std::vector<uint8_t>* value);
+
+  // Waits until the region is in 'state'. If 'comms' is not nullptr, gives up
+  // once the peer closed its end of the Comms channel.
+  bool WaitFor(State state, sandbox2::Comms* comms);
+
+  // Spins for up to spin_duration_ until the region is in 'state'. Returns
+  // whether it is.
+  bool SpinFor(State state) const;
+
+  std::unique_ptr<sandbox2::Buffer> buffer_;
+  const absl::Duration spin_duration_;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_SHARED_MEMORY_TRANSPORT_H_
@@ -20,6 +20,7 @@ from __future__ import print_function
 from ctypes import util
 import itertools
 import os
+import re
 from clang import cindex
 
 # pylint: disable=unused-import
@@ -100,6 +101,53 @@ TYPE_MAPPING = {
     cindex.TypeKind.BOOL: '::sapi::v::Bool',
 }
 
+# Annotations of pointer arguments (see sandboxed_api/annotations.h) to the
+# Pointable method picking their synchronization.
+SYNC_ANNOTATIONS = {
+    'sapi_in': 'PtrBefore',
+    'sapi_out': 'PtrAfter',
+    'sapi_inout': 'PtrBoth',
+}
+
+# Pointee kinds of pointer fields which are passed as NUL-terminated strings.
+_CHAR_KINDS = (cindex.TypeKind.CHAR_S, cindex.TypeKind.CHAR_U,
+               cindex.TypeKind.SCHAR, cindex.TypeKind.UCHAR)
+
+
+def _get_annotations(cursor):
+  # type: (cindex.Cursor) -> Set[Text]
+  return {c.spelling for c in cursor.get_children()
+          if c.kind == cindex.CursorKind.ANNOTATE_ATTR}
+
+
+def _get_annotation_value(annotations, name):
+  # type: (Set[Text], Text) -> Optional[Text]
+  """Returns the argument of an annotation like 'name=value', if present."""
+  for annotation in annotations:
+    if annotation.startswith(name + '='):
+      return annotation[len(name) + 1:]
+  return None
+
+
+def _remove_const(spelling):
+  # type: (Text) -> Text
+  return re.sub(r'\bconst\b', '', spelling).strip()
+
+
+def _pointee_size(field):
+  # type: (cindex.Cursor) -> Optional[Text]
+  """Returns the size of the data a pointer field of the record 'r' points to.
+
+  None if the generator cannot tell, i.e. the field is neither a string nor
+  annotated with SAPI_COUNTED_BY.
+  """
+  count = _get_annotation_value(_get_annotations(field), 'sapi_counted_by')
+  if count:
+    return 'r.{} * sizeof(*r.{})'.format(count, field.spelling)
+  if field.type.get_canonical().get_pointee().kind in _CHAR_KINDS:
+    return 'strlen(r.{}) + 1'.format(field.spelling)
+  return None
+
 
 class Type(object):
   """Class representing a type.
@@ -220,6 +268,12 @@ class Type(object):
     # type: () -> bool
     return self._clang_type.kind in TYPE_MAPPING
 
+  def is_scalar(self):
+    # type: () -> bool
+    """Returns true if the type is passed in a register, without a pointer."""
+    kind = self._clang_type.get_canonical().kind
+    return kind in TYPE_MAPPING or kind == cindex.TypeKind.ENUM
+
   def get_pointee(self):
     # type: () -> Type
     return Type(self._tu, self._clang_type.get_pointee())
@@ -384,14 +438,17 @@ class ArgumentType(Type):
   call_argument: type (or it's sapi wrapper) used in function call
   """
 
-  def __init__(self, function, pos, arg_type, name=None):
-    # type: (Function, int, cindex.Type, Text) -> None
+  def __init__(self, function, pos, arg_type, name=None, cursor=None):
+    # type: (Function, int, cindex.Type, Text, cindex.Cursor) -> None
     super(ArgumentType, self).__init__(function.translation_unit(), arg_type)
     self._function = function
 
     self.pos = pos
     self.name = name or 'a{}'.format(pos)
     self.type = arg_type.spelling
+    self._annotations = set()
+    if cursor is not None:
+      self._annotations = _get_annotations(cursor)
 
     template = '{}' if self.is_ptr() else '&{}_'
     self.call_argument = template.format(self.name)
@@ -404,6 +461,128 @@ class ArgumentType(Type):
 
     return '{} {}'.format(self._clang_type.spelling, self.name)
 
+  @property
+  def sync_method(self):
+    # type: () -> Optional[Text]
+    """Returns the Pointable method giving the pointer argument's v::Ptr.
+
+    The direction comes from a SAPI_IN/SAPI_OUT/SAPI_INOUT annotation, pointers
+    to const are only read by the function. None if the direction is unknown.
+    """
+    if not self.is_ptr():
+      return None
+    for annotation, method in SYNC_ANNOTATIONS.items():
+      if annotation in self._annotations:
+        return method
+    if self._clang_type.get_canonical().get_pointee().is_const_qualified():
+      return 'PtrBefore'
+    return None
+
+  @property
+  def pointable_argument(self):
+    # type: () -> Text
+    """Returns the argument of the Pointable overload of the function."""
+    if self.sync_method:
+      return '::sapi::v::Pointable& {}'.format(self.name)
+    return str(self)
+
+  @property
+  def records_layout(self):
+    # type: () -> Optional[Text]
+    """Returns the layout of an array of records passed by the pointer.
+
+    'records' for an array of structs annotated with SAPI_RECORDS, 'columns'
+    for a struct of arrays annotated with SAPI_COLUMNS, None otherwise.
+    """
+    if not self.is_ptr():
+      return None
+    if 'sapi_records' in self._annotations:
+      return 'records'
+    if _get_annotation_value(self._annotations, 'sapi_columns'):
+      return 'columns'
+    return None
+
+  def _get_pointee_type(self):
+    # type: () -> cindex.Type
+    type_ = self._clang_type
+    if type_.kind == cindex.TypeKind.TYPEDEF:
+      type_ = type_.get_canonical()
+    return type_.get_pointee()
+
+  @property
+  def record_type(self):
+    # type: () -> Text
+    """Returns the record type of a SAPI_RECORDS or SAPI_COLUMNS pointer."""
+    if self.records_layout == 'columns':
+      return _get_annotation_value(self._annotations, 'sapi_columns')
+    return _remove_const(self._get_pointee_type().spelling)
+
+  def record_array_arguments(self):
+    # type: () -> Optional[List[Text]]
+    """Returns the arguments of the sapi::v::RecordArray after the records.
+
+    These are the columns of the struct of arrays, named after the fields of
+    the pointed to struct, and the pointer fields to copy with the records.
+    None if the size of the data of a pointer field is unknown.
+    """
+    record = self.record_type
+    size = '[](const {}& r) -> size_t {{{{ return {{}}; }}}}'.format(record)
+    fields = self._get_pointee_type().get_canonical().get_fields()
+    columns = []
+    pointers = []
+    for f in fields:
+      field_type = f.type.get_canonical()
+      if field_type.kind != cindex.TypeKind.POINTER:
+        if self.records_layout == 'columns':
+          return None
+        continue
+      if self.records_layout == 'records':
+        pointee_size = _pointee_size(f)
+        if pointee_size is None:
+          return None
+        pointers.append('{{offsetof({}, {}), {}}}'.format(
+            record, f.spelling, size.format(pointee_size)))
+        continue
+      element = field_type.get_pointee()
+      columns.append('{{offsetof({}, {}), sizeof({})}}'.format(
+          record, f.spelling, _remove_const(element.spelling)))
+      if element.get_canonical().kind == cindex.TypeKind.POINTER:
+        # Only strings can be sized from the record type's name alone.
+        if element.get_canonical().get_pointee().kind not in _CHAR_KINDS:
+          return None
+        pointers.append('{{offsetof({}, {}), {}}}'.format(
+            record, f.spelling,
+            size.format('strlen(r.{}) + 1'.format(f.spelling))))
+    result = ['{{{}}}'.format(', '.join(columns))] if columns else []
+    if pointers:
+      result.append('{{{}}}'.format(', '.join(pointers)))
+    return result
+
+  @property
+  def scalar_type(self):
+    # type: () -> Text
+    """Returns the type as used in a sapi::CallSignature.
+
+    Qualifiers are dropped: they do not change how a value is marshalled, and
+    the type also instantiates containers like std::vector in batch results.
+    """
+    return re.sub(r'\bconst\b', '', self._clang_type.spelling).strip()
+
+  @property
+  def thunk_type(self):
+    # type: () -> Text
+    """Returns the type in the prototype of a native thunk.
+
+    Only builtin types are used, see sandboxed_api/native_call.h: pointers are
+    passed as void*, enums as their underlying type.
+    """
+    type_ = self._clang_type.get_canonical()
+    if type_.kind == cindex.TypeKind.POINTER:
+      return 'void*'
+    if type_.kind == cindex.TypeKind.ENUM:
+      type_ = type_.get_declaration().enum_type.get_canonical()
+    return _remove_const(type_.spelling)
+
   @property
   def wrapped(self):
     # type: () -> Text
@@ -474,6 +653,14 @@ class ReturnType(ArgumentType):
     return_type = 'sapi::Status' if self.is_void() else return_type
     return return_type
 
+  @property
+  def batch_type(self):
+    # type: () -> Text
+    """Returns the result type of Sandbox::CallScalarBatch for the type."""
+    if self.is_void():
+      return 'sapi::Status'
+    return 'sapi::StatusOr<::std::vector<{}>>'.format(self.scalar_type)
+
 
 class Function(object):
   """Class representing SAPI-wrapped function used by the template.
@@ -493,8 +680,8 @@ class Function(object):
                                               self.cursor.displayname)  # type: Text
 
     types = self.cursor.get_arguments()
-    self.argument_types = [ArgumentType(self, i, t.type, t.spelling) for i, t
-                           in enumerate(types)]
+    self.argument_types = [ArgumentType(self, i, t.type, t.spelling, t)
+                           for i, t in enumerate(types)]
 
   def translation_unit(self):
     # type: () -> _TranslationUnit
@@ -508,6 +695,47 @@ class Function(object):
     # type: () -> List[Text]
     return [a.call_argument for a in self.argument_types]
 
+  def is_scalar_call(self):
+    # type: () -> bool
+    """Returns true if the function can be called with CallScalar().
+
+    This is the case if all arguments are scalars and the return value is a
+    scalar, a pointer or void.
+    """
+    return ((self.result.is_void() or self.result.is_ptr() or
+             self.result.is_scalar()) and
+            all(a.is_scalar() for a in self.argument_types))
+
+  def has_native_thunk(self):
+    # type: () -> bool
+    """Returns true if the sandboxee can call the function without libffi.
+
+    This is the case if all arguments and the return value are passed in
+    registers, i.e. are scalars or pointers.
+    """
+    return ((self.result.is_void() or self.result.is_ptr() or
+             self.result.is_scalar()) and
+            all(a.is_scalar() or a.is_ptr() for a in self.argument_types))
+
+  def record_arrays(self):
+    # type: () -> Dict[int, List[Text]]
+    """Returns the record array arguments of the function.
+
+    Maps the positions of SAPI_RECORDS and SAPI_COLUMNS arguments which are
+    followed by the number of records to the arguments of their
+    sapi::v::RecordArray. Empty if there are none, or if one of them cannot be
+    staged.
+    """
+    result = {}
+    for a, count in zip(self.argument_types, self.argument_types[1:]):
+      if not a.records_layout or count.is_ptr() or not count.is_scalar():
+        continue
+      arguments = a.record_array_arguments()
+      if arguments is None:
+        return {}
+      result[a.pos] = arguments
+    return result
+
   def get_absolute_path(self):
     # type: () -> Text
     return self.cursor.location.file.name
@@ -531,6 +759,11 @@ class Function(object):
     result = self.result.get_related_types(processed)
     for a in self.argument_types:
       result.update(a.get_related_types(processed))
+      # The records of a struct of arrays only appear in the annotation.
+      if a.records_layout == 'columns':
+        record = self._tu.find_type(a.record_type)
+        if record is not None:
+          result.update(record.get_related_types(processed))
 
     return result
 
@@ -595,6 +828,20 @@ class _TranslationUnit(object):
       self._process()
     return self.functions
 
+  def find_type(self, spelling):
+    # type: (Text) -> Optional[Type]
+    """Returns the defined struct, union or typedef named 'spelling'."""
+    name = re.sub(r'^(struct|union)\s+', '', spelling)
+    for cursor in self._walk_preorder():
+      if (cursor.kind in (cindex.CursorKind.STRUCT_DECL,
+                          cindex.CursorKind.UNION_DECL,
+                          cindex.CursorKind.TYPEDEF_DECL) and
+          (cursor.is_definition() or
+           cursor.kind == cindex.CursorKind.TYPEDEF_DECL) and
+          cursor.spelling == name):
+        return Type(self, cursor.type)
+    return None
+
   def _walk_preorder(self):
     # type: () -> Gen
     for c in self._tu.cursor.walk_preorder():
@@ -799,12 +1046,52 @@ class Generator(object):
 
     return result
 
-  def _format_function(self, f):
-    # type: (Function) -> Text
+  def generate_thunks(self, function_names):
+    # type: (List[Text]) -> Text
+    """Generates the native dispatch table of the sandboxee.
+
+    Args:
+      function_names: list of function names to export to the interface
+
+    Returns:
+      source file of the sandboxee registering a thunk for each function which
+      can be called without libffi, see sandboxed_api/native_call.h
+    """
+    result = [Generator.AUTO_GENERATED]
+    result.append('#include "sandboxed_api/native_call.h"')
+    result.append('')
+    result.append('namespace {')
+    result.append('')
+    thunks = []
+    for f in self._get_functions(function_names):
+      if not f.has_native_thunk():
+        continue
+      arguments = ', '.join(a.thunk_type for a in f.arguments())
+      thunks.append('    ::sapi::MakeNativeThunk<{}({})>("{}"),'.format(
+          f.result.thunk_type, arguments, f.name))
+    if thunks:
+      result.append('const ::sapi::NativeThunkEntry kNativeThunks[] = {')
+      result.extend(thunks)
+      result.append('};')
+      result.append('')
+      result.append('const ::sapi::NativeThunkRegistration kRegistration(')
+      result.append('    kNativeThunks, sizeof(kNativeThunks) / '
+                    'sizeof(kNativeThunks[0]));')
+    else:
+      result.append('// All functions are called with libffi.')
+    result.append('')
+    result.append('}  // namespace')
+    result.append('')
+    return '\n'.join(result)
+
+  def _format_function(self, f, index):
+    # type: (Function, int) -> Text
     """Renders one function of the Api.
 
     Args:
       f: function object with information necessary to emit full function body
+      index: position of the function in the function table, unused for
+      scalar calls
 
     Returns:
       filled function template
@@ -814,6 +1101,42 @@ class Generator(object):
 
     arguments = ', '.join(str(a) for a in f.arguments())
     result.append('  {} {}({}) {{'.format(f.result, f.name, arguments))
+
+    if f.is_scalar_call():
+      # The signature is known at compile time, arguments are marshalled
+      # straight into the request.
+      types = ', '.join([f.result.scalar_type] +
+                        [a.scalar_type for a in f.arguments()])
+      signature = ('    static constexpr ::sapi::CallSignature kSignature = '
+                   '::sapi::MakeCallSignature<{}>("{}");'.format(types, f.name))
+      result.append(signature)
+      call_arguments = ['kSignature'] + [a.name for a in f.arguments()]
+      result.append('    return sandbox_->CallScalar<{}>({});'.format(
+          types, ', '.join(call_arguments)))
+      result.append('  }')
+
+      # Variant which does not wait for the result.
+      result.append('')
+      result.append('  ::std::future<{}> {}Async({}) {{'.format(
+          f.result, f.name, arguments))
+      result.append(signature)
+      result.append('    return sandbox_->CallScalarAsync<{}>({});'.format(
+          types, ', '.join(call_arguments)))
+      result.append('  }')
+
+      # Variant which pipelines one call per tuple of arguments.
+      if f.arguments():
+        result.append('')
+        result.append(
+            '  {} {}Batch(::absl::Span<const ::std::tuple<{}>> args) {{'.format(
+                f.result.batch_type, f.name,
+                ', '.join(a.scalar_type for a in f.arguments())))
+        result.append(signature)
+        result.append('    return sandbox_->CallScalarBatch<{}>(kSignature, '
+                      'args);'.format(types))
+        result.append('  }')
+      return '\n'.join(result)
+
     result.append('    {} ret;'.format(f.result.mapped_type))
 
     argument_types = []
@@ -829,8 +1152,8 @@ class Generator(object):
       call_arguments.insert(0, '')
     result.append('')
     # For OSS, the macro below will be replaced.
-    result.append('    SAPI_RETURN_IF_ERROR(sandbox_->Call("{}", &ret{}));'
-                  ''.format(f.name, ', '.join(call_arguments)))
+    result.append('    SAPI_RETURN_IF_ERROR(sandbox_->Call(function_table(), '
+                  '{}, &ret{}));'.format(index, ', '.join(call_arguments)))
 
     return_status = 'return sapi::OkStatus();'
     if f.result and not f.result.is_void():
@@ -842,6 +1165,49 @@ class Generator(object):
     result.append('    {}'.format(return_status))
     result.append('  }')
 
+    # Variant taking the variables of pointer arguments with a known direction,
+    # which are only synchronized in that direction.
+    if any(a.sync_method for a in f.argument_types):
+      result.append('')
+      result.append('  {} {}({}) {{'.format(
+          f.result, f.name,
+          ', '.join(a.pointable_argument for a in f.argument_types)))
+      forwarded = [
+          '{}.{}()'.format(a.name, a.sync_method) if a.sync_method else a.name
+          for a in f.argument_types
+      ]
+      result.append('    return {}({});'.format(f.name, ', '.join(forwarded)))
+      result.append('  }')
+
+    # Variant taking the records of SAPI_RECORDS and SAPI_COLUMNS arguments as
+    # an absl::Span instead of the pointer and their number. The records and
+    # the data of their pointer fields are copied in a single transfer.
+    records = f.record_arrays()
+    if records:
+      counts = {pos + 1: pos for pos in records}
+      arguments = []
+      forwarded = []
+      staged = []
+      for a in f.argument_types:
+        if a.pos in records:
+          arguments.append('::absl::Span<const {}> {}'.format(a.record_type,
+                                                             a.name))
+          staged.append('    ::sapi::v::RecordArray<{}> {}_({});'.format(
+              a.record_type, a.name, ', '.join([a.name] + records[a.pos])))
+          forwarded.append('{}_.PtrBefore()'.format(a.name))
+        elif a.pos in counts:
+          forwarded.append('static_cast<{}>({}.size())'.format(
+              a.type, f.argument_types[counts[a.pos]].name))
+        else:
+          arguments.append(str(a))
+          forwarded.append(a.name)
+      result.append('')
+      result.append('  {} {}({}) {{'.format(f.result, f.name,
+                                            ', '.join(arguments)))
+      result.extend(staged)
+      result.append('    return {}({});'.format(f.name, ', '.join(forwarded)))
+      result.append('  }')
+
     return '\n'.join(result)
 
   def format_template(self, name, functions, related_types, namespaces,
@@ -900,12 +1266,26 @@ class Generator(object):
     result.append('  ::sapi::Sandbox* GetSandbox() const { return sandbox(); }')
     result.append('  ::sapi::Sandbox* sandbox() const { return sandbox_; }')
 
+    # Functions which are not scalar calls are identified by their index in
+    # the function table, in the order in which they are emitted.
+    table = [f.name for f in functions if not f.is_scalar_call()]
     for f in functions:
       result.append('')
-      result.append(self._format_function(f))
+      result.append(self._format_function(
+          f, None if f.is_scalar_call() else table.index(f.name)))
 
     result.append('')
     result.append(' private:')
+    if table:
+      result.append('  static const ::sapi::FunctionTable& function_table() {')
+      names = ', '.join('"{}"'.format(n) for n in table)
+      result.append(
+          '    static constexpr const char* kNames[] = {{{}}};'.format(names))
+      result.append('    static constexpr ::sapi::FunctionTable kTable = '
+                    '{{kNames, {}}};'.format(len(table)))
+      result.append('    return kTable;')
+      result.append('  }')
+      result.append('')
     result.append('  ::sapi::Sandbox* sandbox_;')
     result.append('};')
     result.append('')
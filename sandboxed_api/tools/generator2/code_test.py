@@ -126,6 +126,112 @@ class CodeAnalysisTest(parameterized.TestCase):
     result = generator.generate('Test', functions, 'sapi::Tests', None, None)
     self.assertMultiLineEqual(code_test_util.CODE_GOLD, result)
 
+  def testPointerSyncDirection(self):
+    body = """
+      #define SAPI_OUT __attribute__((annotate("sapi_out")))
+      #define SAPI_INOUT __attribute__((annotate("sapi_inout")))
+      extern "C" int copy(const char* in, SAPI_OUT char* out, int* unknown,
+                          SAPI_INOUT int* len);
+      extern "C" void unknown(char* a);
+    """
+    generator = code.Generator([analyze_string(body)])
+    result = generator.generate('Test', ['copy', 'unknown'], 'sapi::Tests',
+                                None, None)
+    self.assertIn(
+        '  sapi::StatusOr<int> copy(::sapi::v::Pointable& in, '
+        '::sapi::v::Pointable& out, ::sapi::v::Ptr* unknown, '
+        '::sapi::v::Pointable& len) {\n'
+        '    return copy(in.PtrBefore(), out.PtrAfter(), unknown, '
+        'len.PtrBoth());\n'
+        '  }\n', result)
+    self.assertNotIn('sapi::Status unknown(::sapi::v::Pointable&', result)
+
+  def testRecordArrays(self):
+    body = """
+      #define SAPI_RECORDS __attribute__((annotate("sapi_records")))
+      #define SAPI_COLUMNS(record) \\
+        __attribute__((annotate("sapi_columns=" #record)))
+      #define SAPI_COUNTED_BY(count) \\
+        __attribute__((annotate("sapi_counted_by=" #count)))
+      struct point {
+        double x;
+        const char* label;
+        SAPI_COUNTED_BY(ntags) const int* tags;
+        int ntags;
+      };
+      struct point_columns { const double* x; const char* const* label; };
+      struct opaque { void* data; };
+      extern "C" int draw(SAPI_RECORDS const struct point* points,
+                          unsigned long npoints, int flags);
+      extern "C" double sum(SAPI_COLUMNS(struct point)
+                                const struct point_columns* columns,
+                            unsigned long npoints);
+      extern "C" int unknown(SAPI_RECORDS const struct opaque* o,
+                             unsigned long n);
+    """
+    generator = code.Generator([analyze_string(body)])
+    result = generator.generate('Test', ['draw', 'sum', 'unknown'],
+                                'sapi::Tests', None, None)
+    self.assertIn(
+        '  sapi::StatusOr<int> draw(::absl::Span<const struct point> points, '
+        'int flags) {\n'
+        '    ::sapi::v::RecordArray<struct point> points_(points, '
+        '{{offsetof(struct point, label), '
+        '[](const struct point& r) -> size_t { return strlen(r.label) + 1; }}, '
+        '{offsetof(struct point, tags), '
+        '[](const struct point& r) -> size_t '
+        '{ return r.ntags * sizeof(*r.tags); }}});\n'
+        '    return draw(points_.PtrBefore(), '
+        'static_cast<unsigned long>(points.size()), flags);\n'
+        '  }\n', result)
+    self.assertIn(
+        '  sapi::StatusOr<double> sum(::absl::Span<const struct point> '
+        'columns) {\n'
+        '    ::sapi::v::RecordArray<struct point> columns_(columns, '
+        '{{offsetof(struct point, x), sizeof(double)}, '
+        '{offsetof(struct point, label), sizeof(char *)}}, '
+        '{{offsetof(struct point, label), '
+        '[](const struct point& r) -> size_t '
+        '{ return strlen(r.label) + 1; }}});\n'
+        '    return sum(columns_.PtrBefore(), '
+        'static_cast<unsigned long>(columns.size()));\n'
+        '  }\n', result)
+    self.assertNotIn('unknown(::absl::Span', result)
+
+  def testNativeThunks(self):
+    body = """
+      enum color : int { RED };
+      struct x { int a; };
+      extern "C" {
+        int add(int a, long b);
+        void fill(char* buf, unsigned long len, enum color c);
+        double scale(float f);
+        int by_value(struct x a);
+      }
+    """
+    generator = code.Generator([analyze_string(body)])
+    result = generator.generate_thunks(['add', 'fill', 'scale', 'by_value'])
+    self.assertMultiLineEqual(
+        '// AUTO-GENERATED by the Sandboxed API generator.\n'
+        '// Edits will be discarded when regenerating this file.\n'
+        '\n'
+        '#include "sandboxed_api/native_call.h"\n'
+        '\n'
+        'namespace {\n'
+        '\n'
+        'const ::sapi::NativeThunkEntry kNativeThunks[] = {\n'
+        '    ::sapi::MakeNativeThunk<int(int, long)>("add"),\n'
+        '    ::sapi::MakeNativeThunk<void(void*, unsigned long, int)>'
+        '("fill"),\n'
+        '    ::sapi::MakeNativeThunk<double(float)>("scale"),\n'
+        '};\n'
+        '\n'
+        'const ::sapi::NativeThunkRegistration kRegistration(\n'
+        '    kNativeThunks, sizeof(kNativeThunks) / '
+        'sizeof(kNativeThunks[0]));\n'
+        '\n'
+        '}  // namespace\n', result)
+
   def testElaboratedArgument(self):
     body = """
       struct x { int a; };
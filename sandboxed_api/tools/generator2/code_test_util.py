@@ -33,82 +33,115 @@ class TestApi {
 
   // int function_a(int, int)
   sapi::StatusOr<int> function_a(int x, int y) {
-    ::sapi::v::Int ret;
-    ::sapi::v::Int x_((x));
-    ::sapi::v::Int y_((y));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, int>("function_a");
+    return sandbox_->CallScalar<int, int, int>(kSignature, x, y);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("function_a", &ret, &x_, &y_));
-    return ret.GetValue();
+  ::std::future<sapi::StatusOr<int>> function_aAsync(int x, int y) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, int>("function_a");
+    return sandbox_->CallScalarAsync<int, int, int>(kSignature, x, y);
+  }
+
+  sapi::StatusOr<::std::vector<int>> function_aBatch(::absl::Span<const ::std::tuple<int, int>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, int>("function_a");
+    return sandbox_->CallScalarBatch<int, int, int>(kSignature, args);
   }
 
   // int types_1(bool, unsigned char, char, unsigned short, short)
   sapi::StatusOr<int> types_1(bool a0, unsigned char a1, char a2, unsigned short a3, short a4) {
-    ::sapi::v::Int ret;
-    ::sapi::v::Bool a0_((a0));
-    ::sapi::v::UChar a1_((a1));
-    ::sapi::v::Char a2_((a2));
-    ::sapi::v::UShort a3_((a3));
-    ::sapi::v::Short a4_((a4));
-
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_1", &ret, &a0_, &a1_, &a2_, &a3_, &a4_));
-    return ret.GetValue();
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, bool, unsigned char, char, unsigned short, short>("types_1");
+    return sandbox_->CallScalar<int, bool, unsigned char, char, unsigned short, short>(kSignature, a0, a1, a2, a3, a4);
+  }
+
+  ::std::future<sapi::StatusOr<int>> types_1Async(bool a0, unsigned char a1, char a2, unsigned short a3, short a4) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, bool, unsigned char, char, unsigned short, short>("types_1");
+    return sandbox_->CallScalarAsync<int, bool, unsigned char, char, unsigned short, short>(kSignature, a0, a1, a2, a3, a4);
+  }
+
+  sapi::StatusOr<::std::vector<int>> types_1Batch(::absl::Span<const ::std::tuple<bool, unsigned char, char, unsigned short, short>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, bool, unsigned char, char, unsigned short, short>("types_1");
+    return sandbox_->CallScalarBatch<int, bool, unsigned char, char, unsigned short, short>(kSignature, args);
   }
 
   // int types_2(int, unsigned int, long, unsigned long)
   sapi::StatusOr<int> types_2(int a0, unsigned int a1, long a2, unsigned long a3) {
-    ::sapi::v::Int ret;
-    ::sapi::v::Int a0_((a0));
-    ::sapi::v::UInt a1_((a1));
-    ::sapi::v::Long a2_((a2));
-    ::sapi::v::ULong a3_((a3));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, unsigned int, long, unsigned long>("types_2");
+    return sandbox_->CallScalar<int, int, unsigned int, long, unsigned long>(kSignature, a0, a1, a2, a3);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_2", &ret, &a0_, &a1_, &a2_, &a3_));
-    return ret.GetValue();
+  ::std::future<sapi::StatusOr<int>> types_2Async(int a0, unsigned int a1, long a2, unsigned long a3) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, unsigned int, long, unsigned long>("types_2");
+    return sandbox_->CallScalarAsync<int, int, unsigned int, long, unsigned long>(kSignature, a0, a1, a2, a3);
+  }
+
+  sapi::StatusOr<::std::vector<int>> types_2Batch(::absl::Span<const ::std::tuple<int, unsigned int, long, unsigned long>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, int, unsigned int, long, unsigned long>("types_2");
+    return sandbox_->CallScalarBatch<int, int, unsigned int, long, unsigned long>(kSignature, args);
   }
 
   // int types_3(long long, unsigned long long, float, double)
   sapi::StatusOr<int> types_3(long long a0, unsigned long long a1, float a2, double a3) {
-    ::sapi::v::Int ret;
-    ::sapi::v::LLong a0_((a0));
-    ::sapi::v::ULLong a1_((a1));
-    ::sapi::v::Reg<float> a2_((a2));
-    ::sapi::v::Reg<double> a3_((a3));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, unsigned long long, float, double>("types_3");
+    return sandbox_->CallScalar<int, long long, unsigned long long, float, double>(kSignature, a0, a1, a2, a3);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_3", &ret, &a0_, &a1_, &a2_, &a3_));
-    return ret.GetValue();
+  ::std::future<sapi::StatusOr<int>> types_3Async(long long a0, unsigned long long a1, float a2, double a3) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, unsigned long long, float, double>("types_3");
+    return sandbox_->CallScalarAsync<int, long long, unsigned long long, float, double>(kSignature, a0, a1, a2, a3);
+  }
+
+  sapi::StatusOr<::std::vector<int>> types_3Batch(::absl::Span<const ::std::tuple<long long, unsigned long long, float, double>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, unsigned long long, float, double>("types_3");
+    return sandbox_->CallScalarBatch<int, long long, unsigned long long, float, double>(kSignature, args);
   }
 
   // int types_4(signed char, short, int, long)
   sapi::StatusOr<int> types_4(signed char a0, short a1, int a2, long a3) {
-    ::sapi::v::Int ret;
-    ::sapi::v::SChar a0_((a0));
-    ::sapi::v::Short a1_((a1));
-    ::sapi::v::Int a2_((a2));
-    ::sapi::v::Long a3_((a3));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, signed char, short, int, long>("types_4");
+    return sandbox_->CallScalar<int, signed char, short, int, long>(kSignature, a0, a1, a2, a3);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_4", &ret, &a0_, &a1_, &a2_, &a3_));
-    return ret.GetValue();
+  ::std::future<sapi::StatusOr<int>> types_4Async(signed char a0, short a1, int a2, long a3) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, signed char, short, int, long>("types_4");
+    return sandbox_->CallScalarAsync<int, signed char, short, int, long>(kSignature, a0, a1, a2, a3);
+  }
+
+  sapi::StatusOr<::std::vector<int>> types_4Batch(::absl::Span<const ::std::tuple<signed char, short, int, long>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, signed char, short, int, long>("types_4");
+    return sandbox_->CallScalarBatch<int, signed char, short, int, long>(kSignature, args);
   }
 
   // int types_5(long long, long double)
   sapi::StatusOr<int> types_5(long long a0, long double a1) {
-    ::sapi::v::Int ret;
-    ::sapi::v::LLong a0_((a0));
-    ::sapi::v::Reg<long double> a1_((a1));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, long double>("types_5");
+    return sandbox_->CallScalar<int, long long, long double>(kSignature, a0, a1);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_5", &ret, &a0_, &a1_));
-    return ret.GetValue();
+  ::std::future<sapi::StatusOr<int>> types_5Async(long long a0, long double a1) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, long double>("types_5");
+    return sandbox_->CallScalarAsync<int, long long, long double>(kSignature, a0, a1);
+  }
+
+  sapi::StatusOr<::std::vector<int>> types_5Batch(::absl::Span<const ::std::tuple<long long, long double>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<int, long long, long double>("types_5");
+    return sandbox_->CallScalarBatch<int, long long, long double>(kSignature, args);
   }
 
   // void types_6(char *)
   sapi::Status types_6(::sapi::v::Ptr* a0) {
     ::sapi::v::Void ret;
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("types_6", &ret, a0));
+    SAPI_RETURN_IF_ERROR(sandbox_->Call(function_table(), 0, &ret, a0));
     return sapi::OkStatus();
   }
 
  private:
+  static const ::sapi::FunctionTable& function_table() {
+    static constexpr const char* kNames[] = {"types_6"};
+    static constexpr ::sapi::FunctionTable kTable = {kNames, 1};
+    return kTable;
+  }
+
   ::sapi::Sandbox* sandbox_;
 };
 
@@ -139,11 +172,17 @@ class TestApi {
   sapi::StatusOr<uint> function(::sapi::v::Ptr* a) {
     ::sapi::v::UInt ret;
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("function", &ret, a));
+    SAPI_RETURN_IF_ERROR(sandbox_->Call(function_table(), 0, &ret, a));
     return ret.GetValue();
   }
 
  private:
+  static const ::sapi::FunctionTable& function_table() {
+    static constexpr const char* kNames[] = {"function"};
+    static constexpr ::sapi::FunctionTable kTable = {kNames, 1};
+    return kTable;
+  }
+
   ::sapi::Sandbox* sandbox_;
 };
 
@@ -174,11 +213,18 @@ class TestApi {
 
   // ProcessStatus ProcessDatapoint(ProcessStatus)
   sapi::StatusOr<ProcessStatus> ProcessDatapoint(ProcessStatus status) {
-    ::sapi::v::IntBase<ProcessStatus> ret;
-    ::sapi::v::IntBase<ProcessStatus> status_((status));
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<ProcessStatus, ProcessStatus>("ProcessDatapoint");
+    return sandbox_->CallScalar<ProcessStatus, ProcessStatus>(kSignature, status);
+  }
+
+  ::std::future<sapi::StatusOr<ProcessStatus>> ProcessDatapointAsync(ProcessStatus status) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<ProcessStatus, ProcessStatus>("ProcessDatapoint");
+    return sandbox_->CallScalarAsync<ProcessStatus, ProcessStatus>(kSignature, status);
+  }
 
-    SAPI_RETURN_IF_ERROR(sandbox_->Call("ProcessDatapoint", &ret, &status_));
-    return static_cast<ProcessStatus>(ret.GetValue());
+  sapi::StatusOr<::std::vector<ProcessStatus>> ProcessDatapointBatch(::absl::Span<const ::std::tuple<ProcessStatus>> args) {
+    static constexpr ::sapi::CallSignature kSignature = ::sapi::MakeCallSignature<ProcessStatus, ProcessStatus>("ProcessDatapoint");
+    return sandbox_->CallScalarBatch<ProcessStatus, ProcessStatus>(kSignature, args);
   }
 
  private:
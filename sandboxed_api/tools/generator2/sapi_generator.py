@@ -28,6 +28,9 @@ FLAGS = flags.FLAGS
 
 flags.DEFINE_string('sapi_name', None, 'library name')
 flags.DEFINE_string('sapi_out', '', 'output header file')
+flags.DEFINE_string('sapi_thunks_out', '',
+                    'output source file with the native thunks of the '
+                    'sandboxee')
 flags.DEFINE_string('sapi_ns', '', 'namespace')
 flags.DEFINE_string('sapi_isystem', '', 'system includes')
 flags.DEFINE_list('sapi_functions', [], 'function list to analyze')
@@ -67,6 +70,10 @@ def main(c_flags):
   else:
     sys.stdout.write(result)
 
+  if FLAGS.sapi_thunks_out:
+    with open(FLAGS.sapi_thunks_out, 'w') as out_file:
+      out_file.write(generator.generate_thunks(FLAGS.sapi_functions))
+
 if __name__ == '__main__':
   flags.mark_flags_as_required(['sapi_name', 'sapi_in'])
   app.run(main)
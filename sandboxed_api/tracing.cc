@@ -0,0 +1,49 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/tracing.h"
+
+#include <atomic>
+#include <utility>
+
+namespace sapi {
+namespace {
+
+std::atomic<Tracer*> g_tracer{nullptr};
+
+std::string& SandboxeeTraceContext() {
+  static thread_local std::string* context = new std::string();
+  return *context;
+}
+
+}  // namespace
+
+void SetTracer(Tracer* tracer) {
+  g_tracer.store(tracer, std::memory_order_release);
+}
+
+Tracer* GetTracer() { return g_tracer.load(std::memory_order_acquire); }
+
+std::unique_ptr<TraceSpan> StartTraceSpan(absl::string_view name) {
+  Tracer* tracer = GetTracer();
+  return tracer ? tracer->StartSpan(name) : nullptr;
+}
+
+std::string GetSandboxeeTraceContext() { return SandboxeeTraceContext(); }
+
+void SetSandboxeeTraceContext(std::string context) {
+  SandboxeeTraceContext() = std::move(context);
+}
+
+}  // namespace sapi
@@ -0,0 +1,85 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Hooks for distributed tracing of the calls into sandboxed libraries, see
+// sapi::Tracer.
+
+#ifndef SANDBOXED_API_TRACING_H_
+#define SANDBOXED_API_TRACING_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace sapi {
+
+// Attributes set on the spans of sapi::Sandbox.
+// Name of the called function.
+constexpr char kTraceFunction[] = "sapi.function";
+// Address of the sapi::Sandbox object, which tells sandboxes apart.
+constexpr char kTraceSandbox[] = "sapi.sandbox";
+// PID of the sandboxee.
+constexpr char kTracePid[] = "sapi.pid";
+// Memory copied to and from the sandboxee.
+constexpr char kTraceBytesToSandboxee[] = "sapi.bytes_to_sandboxee";
+constexpr char kTraceBytesFromSandboxee[] = "sapi.bytes_from_sandboxee";
+
+// A traced operation, ended when the object is destroyed.
+class TraceSpan {
+ public:
+  virtual ~TraceSpan() = default;
+
+  virtual void SetAttribute(absl::string_view key, absl::string_view value) = 0;
+  virtual void SetAttribute(absl::string_view key, int64_t value) = 0;
+
+  // Returns the context which lets the sandboxee join the trace below this
+  // span, e.g. a W3C traceparent, or an empty string to propagate none. See
+  // GetSandboxeeTraceContext().
+  virtual std::string GetContext() const { return ""; }
+};
+
+// Creates the spans of sapi::Sandbox::Init(), Call(), SynchronizePtrBefore()
+// and SynchronizePtrAfter(). Called from any thread, so it must be
+// thread-safe. Spans are nested as the tracer sees fit, typically below the
+// current span of the calling thread.
+class Tracer {
+ public:
+  virtual ~Tracer() = default;
+
+  virtual std::unique_ptr<TraceSpan> StartSpan(absl::string_view name) = 0;
+};
+
+// Traces with 'tracer' from now on, nullptr disables tracing. The tracer is
+// not owned and must outlive all spans and calls using it.
+void SetTracer(Tracer* tracer);
+
+// Returns the current tracer, nullptr if tracing is disabled.
+Tracer* GetTracer();
+
+// Starts a span with the current tracer, returns nullptr without one.
+std::unique_ptr<TraceSpan> StartTraceSpan(absl::string_view name);
+
+// In the sandboxee, returns the trace context of the call the calling thread
+// is serving, see TraceSpan::GetContext(). Empty if there is none. User code
+// and its logs can use it to join the trace.
+std::string GetSandboxeeTraceContext();
+
+// Used by the sandboxee to record the context received for its thread.
+void SetSandboxeeTraceContext(std::string context);
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_TRACING_H_
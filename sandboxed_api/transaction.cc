@@ -55,7 +55,10 @@ sapi::Status TransactionBase::RunTransactionLoop(
     if (status.ok()) {
       return status;
     }
-    GetSandbox()->Terminate();
+    // The last failed sandbox is kept for the error message below.
+    if (i == GetRetryCnt() || !SwapInStandby()) {
+      GetSandbox()->Terminate();
+    }
     SetInited(false);
   }
 
@@ -66,6 +69,45 @@ sapi::Status TransactionBase::RunTransactionLoop(
   return status;
 }
 
+void TransactionBase::EnableStandbySandbox(
+    std::function<std::unique_ptr<Sandbox>()> factory) {
+  standby_factory_ = std::move(factory);
+  StartStandby(nullptr);
+}
+
+bool TransactionBase::SwapInStandby() {
+  if (!standby_.valid()) {
+    return false;
+  }
+  // Usually ready by now, otherwise waiting still beats starting a sandbox.
+  std::unique_ptr<Sandbox> standby = standby_.get();
+  if (standby == nullptr || !standby->IsActive()) {
+    StartStandby(nullptr);
+    return false;
+  }
+  VLOG(1) << "Swapping in the standby sandbox";
+  sandbox_.swap(standby);
+  StartStandby(std::move(standby));
+  return true;
+}
+
+void TransactionBase::StartStandby(std::unique_ptr<Sandbox> retired) {
+  standby_ = std::async(
+      std::launch::async,
+      [](const std::function<std::unique_ptr<Sandbox>()>& factory,
+         std::unique_ptr<Sandbox> retired) -> std::unique_ptr<Sandbox> {
+        retired.reset();
+        std::unique_ptr<Sandbox> sandbox = factory();
+        sapi::Status status = sandbox->Init();
+        if (!status.ok()) {
+          LOG(WARNING) << "Could not start the standby sandbox: " << status;
+          return nullptr;
+        }
+        return sandbox;
+      },
+      standby_factory_, std::move(retired));
+}
+
 TransactionBase::~TransactionBase() {
   if (GetInited()) {
     Finish().IgnoreError();
@@ -15,6 +15,8 @@
 #ifndef SANDBOXED_API_TRANSACTION_H_
 #define SANDBOXED_API_TRANSACTION_H_
 
+#include <functional>
+#include <future>  // NOLINT(build/c++11)
 #include <memory>
 
 #include <glog/logging.h>
@@ -74,7 +76,14 @@ class TransactionBase {
   // Getter for the sandbox_.
   Sandbox* GetSandbox() { return sandbox_.get(); }
 
-  // Restarts the sandbox.
+  // Keeps a standby sandbox, created by 'factory' and initialized in the
+  // background. After a failed try, the transaction continues with the
+  // standby right away instead of restarting the failed sandbox, and starts a
+  // new standby. Init() still runs again on the swapped in sandbox.
+  // WARNING: Swapping invalidates pointers returned by GetSandbox() before.
+  void EnableStandbySandbox(std::function<std::unique_ptr<Sandbox>()> factory);
+
+  // Restarts the sandbox, or swaps in the standby sandbox if there is one.
   // WARNING: This will invalidate any references to the remote process, make
   // sure you don't keep any var's or FD's to the remote process when calling
   // this.
@@ -83,6 +92,9 @@ class TransactionBase {
       Finish().IgnoreError();
       inited_ = false;
     }
+    if (SwapInStandby()) {
+      return sapi::OkStatus();
+    }
     return sandbox_->Restart(true);
   }
 
@@ -108,6 +120,14 @@ class TransactionBase {
   sapi::Status RunTransactionFunctionInSandbox(
       const std::function<sapi::Status()>& f);
 
+  // Replaces the sandbox with the standby sandbox and starts a new standby.
+  // Returns false if there is no standby or it failed to start.
+  bool SwapInStandby();
+
+  // Starts a new standby sandbox in the background, after destroying
+  // 'retired', which terminates its sandboxee.
+  void StartStandby(std::unique_ptr<Sandbox> retired);
+
   // Initialization routine of the sandboxed process that ill be called only
   // once upon sandboxee startup.
   virtual sapi::Status Init() { return sapi::OkStatus(); }
@@ -128,6 +148,11 @@ class TransactionBase {
 
   // The main sapi::Sandbox object.
   std::unique_ptr<Sandbox> sandbox_;
+
+  // Creates standby sandboxes, see EnableStandbySandbox().
+  std::function<std::unique_ptr<Sandbox>()> standby_factory_;
+  // The standby sandbox being started, nullptr if it failed to start.
+  std::future<std::unique_ptr<Sandbox>> standby_;
 };
 
 // Regular style transactions, based on inheriting.
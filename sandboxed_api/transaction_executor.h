@@ -0,0 +1,242 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_TRANSACTION_EXECUTOR_H_
+#define SANDBOXED_API_TRANSACTION_EXECUTOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>  // NOLINT(build/c++11)
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "sandboxed_api/sandbox_pool.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sapi {
+
+struct TransactionExecutorOptions {
+  // Number of worker threads, one per CPU if 0.
+  size_t num_workers = 0;
+  // Number of sandboxes kept ready, as many as workers if 0. Overrides
+  // pool.size, see SandboxPoolOptions for the other fields.
+  size_t num_sandboxes = 0;
+  SandboxPoolOptions pool;
+  // Number of times a failed transaction is retried, in a fresh sandbox.
+  int retry_count = 1;
+  // Wall-time limit for a single try, zero for no limit.
+  absl::Duration time_limit = absl::Seconds(60);
+};
+
+// Runs transactions concurrently on a fixed set of worker threads, each try
+// in a sandbox of type T from a SandboxPool. Transactions are distributed over
+// per-worker queues, idle workers steal from the queues of busy ones.
+//
+// A transaction is a function taking the sandbox, like a BasicTransaction, and
+// may be retried. It must not keep references to the remote process across
+// tries.
+//
+// Example:
+//   sapi::TransactionExecutor<ZlibSandbox> executor;
+//   auto done = executor.Submit([](ZlibSandbox* sandbox) {
+//     ZlibApi api(sandbox);
+//     return DoWork(&api);
+//   });
+//   ...
+//   sapi::Status status = done.get();
+template <typename T>
+class TransactionExecutor {
+ public:
+  using Body = std::function<sapi::Status(T*)>;
+
+  explicit TransactionExecutor(
+      TransactionExecutorOptions options = TransactionExecutorOptions(),
+      std::function<std::unique_ptr<T>()> factory =
+          [] { return absl::make_unique<T>(); })
+      : options_(Resolve(options)),
+        pool_(options_.pool, std::move(factory)) {
+    for (size_t i = 0; i < options_.num_workers; ++i) {
+      workers_.push_back(absl::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < options_.num_workers; ++i) {
+      workers_[i]->thread = std::thread([this, i] { Run(i); });
+    }
+  }
+
+  TransactionExecutor(const TransactionExecutor&) = delete;
+  TransactionExecutor& operator=(const TransactionExecutor&) = delete;
+
+  // Runs all transactions submitted so far before it returns.
+  ~TransactionExecutor() {
+    {
+      absl::MutexLock lock(&mutex_);
+      shutdown_ = true;
+    }
+    for (auto& worker : workers_) {
+      worker->thread.join();
+    }
+  }
+
+  // Queues a transaction. The future becomes ready with the status of its
+  // last try.
+  std::future<sapi::Status> Submit(Body body) {
+    return Submit(std::move(body), options_.time_limit);
+  }
+
+  // Same as above, with a wall-time limit for each try of this transaction.
+  std::future<sapi::Status> Submit(Body body, absl::Duration time_limit) {
+    Task task{std::move(body), time_limit, std::promise<sapi::Status>()};
+    std::future<sapi::Status> done = task.promise.get_future();
+    Worker* worker =
+        workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) %
+                 workers_.size()]
+            .get();
+    {
+      absl::MutexLock lock(&worker->mutex);
+      worker->tasks.push_back(std::move(task));
+    }
+    // Only counted once queued, so that a claimed task is always found.
+    absl::MutexLock lock(&mutex_);
+    ++pending_;
+    return done;
+  }
+
+  // Returns the number of submitted transactions not picked up by a worker
+  // yet.
+  size_t GetNumPending() const {
+    absl::MutexLock lock(&mutex_);
+    return pending_;
+  }
+
+ private:
+  struct Task {
+    Body body;
+    absl::Duration time_limit;
+    std::promise<sapi::Status> promise;
+  };
+
+  struct Worker {
+    absl::Mutex mutex;
+    std::deque<Task> tasks GUARDED_BY(mutex);
+    std::thread thread;
+  };
+
+  static TransactionExecutorOptions Resolve(
+      TransactionExecutorOptions options) {
+    if (options.num_workers == 0) {
+      options.num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    options.pool.size = options.num_sandboxes != 0 ? options.num_sandboxes
+                                                   : options.num_workers;
+    return options;
+  }
+
+  bool HasWork() const EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return pending_ != 0 || shutdown_;
+  }
+
+  // Takes a task from the front of the own queue, or steals one from the back
+  // of another worker's queue.
+  bool TakeTask(size_t self, Task* task) {
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      Worker* worker = workers_[(self + i) % workers_.size()].get();
+      absl::MutexLock lock(&worker->mutex);
+      if (worker->tasks.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        *task = std::move(worker->tasks.front());
+        worker->tasks.pop_front();
+      } else {
+        *task = std::move(worker->tasks.back());
+        worker->tasks.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Body of a worker thread.
+  void Run(size_t self) {
+    while (true) {
+      {
+        absl::MutexLock lock(&mutex_);
+        mutex_.Await(absl::Condition(this, &TransactionExecutor::HasWork));
+        if (pending_ == 0) {
+          return;
+        }
+        // Claims one of the queued tasks.
+        --pending_;
+      }
+      Task task;
+      // Other workers only take tasks they claimed, so this one stays.
+      while (!TakeTask(self, &task)) {
+        std::this_thread::yield();
+      }
+      task.promise.set_value(RunTransaction(task));
+    }
+  }
+
+  // Runs a transaction, retrying it in a fresh sandbox on failure.
+  sapi::Status RunTransaction(const Task& task) {
+    sapi::Status status;
+    for (int i = 0; i <= options_.retry_count; ++i) {
+      auto lease_or = pool_.Acquire();
+      if (!lease_or.ok()) {
+        status = lease_or.status();
+        continue;
+      }
+      auto lease = std::move(lease_or).ValueOrDie();
+      status = lease->SetWallTimeLimit(task.time_limit);
+      if (status.ok()) {
+        status = task.body(lease.get());
+      }
+      if (status.ok() && lease->IsActive()) {
+        status = lease->SetWallTimeLimit(absl::ZeroDuration());
+      }
+      if (status.ok()) {
+        return status;
+      }
+      // Replaced by the pool, see SandboxPoolOptions::discard_on_error.
+      lease.MarkFailed();
+      VLOG(1) << "Transaction try " << i + 1 << " failed: " << status;
+    }
+    return status;
+  }
+
+  const TransactionExecutorOptions options_;
+  SandboxPool<T> pool_;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_{0};
+
+  mutable absl::Mutex mutex_;
+  // Number of queued tasks no worker claimed yet.
+  size_t pending_ GUARDED_BY(mutex_) = 0;
+  bool shutdown_ GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_TRANSACTION_EXECUTOR_H_
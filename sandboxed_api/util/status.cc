@@ -61,26 +61,36 @@ std::string CodeEnumToString(StatusCode code) {
 
 }  // namespace internal
 
-Status::Status() : error_code_{static_cast<int>(StatusCode::kOk)} {}
+constexpr uintptr_t Status::kOkRep;
+constexpr uintptr_t Status::kMovedFromRep;
 
-Status::Status(Status&& other)
-    : error_code_(other.error_code_), message_(std::move(other.message_)) {
-  other.Set(StatusCode::kUnknown, "");
+uintptr_t Status::MakeRep(int code, absl::string_view message) {
+  if (code == 0) {
+    return kOkRep;
+  }
+  // Non-negative codes fit next to the tag bit even in 32-bit words.
+  if (message.empty() && code > 0) {
+    return (static_cast<uintptr_t>(code) << 1) | 1;
+  }
+  Rep* rep = new Rep;
+  rep->ref.store(1, std::memory_order_relaxed);
+  rep->code = code;
+  rep->message = std::string(message);
+  return reinterpret_cast<uintptr_t>(rep);
 }
 
-Status& Status::operator=(Status&& other) {
-  error_code_ = other.error_code_;
-  message_ = std::move(other.message_);
-  other.Set(StatusCode::kUnknown, "");
-  return *this;
+void Status::UnrefSlow(Rep* rep) {
+  // The last reference sees all writes of the others before deleting.
+  if (rep->ref.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete rep;
+  }
 }
 
 std::string Status::ToString() const {
   return ok() ? "OK"
               : absl::StrCat("generic::",
-                             internal::CodeEnumToString(
-                                 static_cast<StatusCode>(error_code_)),
-                             ": ", message_);
+                             internal::CodeEnumToString(code()), ": ",
+                             message());
 }
 
 Status OkStatus() { return Status{}; }
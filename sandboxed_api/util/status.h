@@ -19,6 +19,8 @@
 #ifndef THIRD_PARTY_SAPI_UTIL_STATUS_H_
 #define THIRD_PARTY_SAPI_UTIL_STATUS_H_
 
+#include <atomic>
+#include <cstdint>
 #include <ostream>
 #include <string>
 #include <type_traits>
@@ -57,59 +59,102 @@ std::string CodeEnumToString(StatusCode code);
 
 }  // namespace internal
 
+// A Status is a single word. OK and errors without a message keep their code
+// inline and are copied without allocating or touching shared state. Errors
+// with a message point to a reference-counted representation instead, which
+// is allocated once and shared by all copies.
 class Status {
  public:
-  Status();
+  Status() : rep_(kOkRep) {}
 
   template <typename Enum>
-  Status(Enum code, absl::string_view message) {
-    Set(code, message);
-  }
+  Status(Enum code, absl::string_view message)
+      : rep_(MakeRep(static_cast<int>(code), message)) {}
 
-  Status(const Status&) = default;
-  Status(Status&& other);
+  Status(const Status& other) : rep_(other.rep_) { Ref(rep_); }
+  Status(Status&& other) : rep_(other.rep_) { other.rep_ = kMovedFromRep; }
 
   template <typename StatusT,
             typename E = typename absl::enable_if_t<
                 status_internal::status_type_traits<StatusT>::is_status>>
-  explicit Status(const StatusT& other) {
-    Set(status_internal::status_type_traits<StatusT>::CanonicalCode(other),
-        other.message());
+  explicit Status(const StatusT& other)
+      : rep_(MakeRep(static_cast<int>(status_internal::status_type_traits<
+                         StatusT>::CanonicalCode(other)),
+                     other.message())) {}
+
+  ~Status() { Unref(rep_); }
+
+  Status& operator=(const Status& other) {
+    Ref(other.rep_);
+    Unref(rep_);
+    rep_ = other.rep_;
+    return *this;
+  }
+  Status& operator=(Status&& other) {
+    if (this != &other) {
+      Unref(rep_);
+      rep_ = other.rep_;
+      other.rep_ = kMovedFromRep;
+    }
+    return *this;
   }
-
-  Status& operator=(const Status&) = default;
-  Status& operator=(Status&& other);
 
   template <typename StatusT,
             typename E = typename absl::enable_if_t<
                 status_internal::status_type_traits<StatusT>::is_status>>
   StatusT ToOtherStatus() {
-    return StatusT(status_internal::ErrorCodeHolder(error_code_), message_);
+    return StatusT(status_internal::ErrorCodeHolder(error_code()),
+                   std::string(message()));
   }
 
-  int error_code() const { return error_code_; }
-  absl::string_view error_message() const { return message_; }
-  absl::string_view message() const { return message_; }
-  ABSL_MUST_USE_RESULT bool ok() const { return error_code_ == 0; }
-  StatusCode code() const { return static_cast<StatusCode>(error_code_); }
+  int error_code() const {
+    return IsInlined(rep_) ? static_cast<int>(rep_ >> 1) : GetRep(rep_)->code;
+  }
+  absl::string_view error_message() const { return message(); }
+  absl::string_view message() const {
+    return IsInlined(rep_) ? absl::string_view() : GetRep(rep_)->message;
+  }
+  ABSL_MUST_USE_RESULT bool ok() const { return rep_ == kOkRep; }
+  StatusCode code() const { return static_cast<StatusCode>(error_code()); }
 
   std::string ToString() const;
 
   void IgnoreError() const {}
 
  private:
-  template <typename Enum, typename StringViewT>
-  void Set(Enum code, StringViewT message) {
-    error_code_ = static_cast<int>(code);
-    if (error_code_ != 0) {
-      message_ = std::string(message);
-    } else {
-      message_.clear();
+  // The heap part of a Status with a message.
+  struct Rep {
+    std::atomic<int> ref;
+    int code;
+    std::string message;
+  };
+
+  // rep_ is either an inlined code, (code << 1) | 1, or points to a Rep.
+  static constexpr uintptr_t kOkRep = 1;
+  // A moved-from Status is UNKNOWN, as it used to be.
+  static constexpr uintptr_t kMovedFromRep =
+      (static_cast<uintptr_t>(StatusCode::kUnknown) << 1) | 1;
+
+  static bool IsInlined(uintptr_t rep) { return rep & 1; }
+  static Rep* GetRep(uintptr_t rep) { return reinterpret_cast<Rep*>(rep); }
+
+  // Returns the representation of 'code' and 'message'. The message of an OK
+  // status is dropped.
+  static uintptr_t MakeRep(int code, absl::string_view message);
+
+  static void Ref(uintptr_t rep) {
+    if (!IsInlined(rep)) {
+      GetRep(rep)->ref.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  static void Unref(uintptr_t rep) {
+    if (!IsInlined(rep)) {
+      UnrefSlow(GetRep(rep));
     }
   }
+  static void UnrefSlow(Rep* rep);
 
-  int error_code_;
-  std::string message_;
+  uintptr_t rep_;
 };
 
 Status OkStatus();
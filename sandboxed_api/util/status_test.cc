@@ -186,6 +186,40 @@ TEST(StatusTest, CopyConstructorTestNonOk) {
   EXPECT_THAT(that, StatusIs(StatusCode::kInvalidArgument));
 }
 
+TEST(StatusTest, IsPointerSized) {
+  EXPECT_THAT(sizeof(Status), Eq(sizeof(void*)));
+}
+
+TEST(StatusTest, CodeOnlyStatus) {
+  Status status(StatusCode::kUnavailable, "");
+  EXPECT_THAT(status, StatusIs(StatusCode::kUnavailable, ""));
+  EXPECT_THAT(status, Not(IsOk()));
+  EXPECT_THAT(status == Status(StatusCode::kUnavailable, ""), IsTrue());
+  EXPECT_THAT(status == Status(StatusCode::kUnavailable, "x"), IsFalse());
+}
+
+TEST(StatusTest, OkStatusDropsMessage) {
+  Status status(StatusCode::kOk, kErrorMessage1);
+  EXPECT_THAT(status, IsOk());
+  EXPECT_THAT(status.error_message(), IsEmpty());
+}
+
+TEST(StatusTest, CopiesShareMessage) {
+  Status status(StatusCode::kInternal, kErrorMessage2);
+  Status copy = status;
+  {
+    Status other(StatusCode::kCancelled, kErrorMessage1);
+    other = copy;
+    copy = other;
+  }
+  EXPECT_THAT(copy.error_message().data(),
+              Eq(status.error_message().data()));
+  status = OkStatus();
+  EXPECT_THAT(copy, StatusIs(StatusCode::kInternal, kErrorMessage2));
+  copy = copy;  // NOLINT
+  EXPECT_THAT(copy, StatusIs(StatusCode::kInternal, kErrorMessage2));
+}
+
 StatusProto OkStatusProto() {
   StatusProto proto;
   proto.set_code(static_cast<int>(StatusCode::kOk));
@@ -30,13 +30,15 @@ namespace v {
 
 Var::~Var() {
   if (free_rpc_channel_ && GetRemote()) {
-    this->Free(free_rpc_channel_).IgnoreError();
+    free_rpc_channel_->FreeDeferred(GetRemote(), arena_generation_)
+        .IgnoreError();
   }
 }
 
 sapi::Status Var::Allocate(RPCChannel* rpc_channel, bool automatic_free) {
   void* addr;
-  SAPI_RETURN_IF_ERROR(rpc_channel->Allocate(GetSize(), &addr));
+  SAPI_RETURN_IF_ERROR(
+      rpc_channel->Allocate(GetSize(), &addr, &arena_generation_));
 
   if (!addr) {
     LOG(ERROR) << "Allocate: returned nullptr";
@@ -52,7 +54,7 @@ sapi::Status Var::Allocate(RPCChannel* rpc_channel, bool automatic_free) {
 }
 
 sapi::Status Var::Free(RPCChannel* rpc_channel) {
-  SAPI_RETURN_IF_ERROR(rpc_channel->Free(GetRemote()));
+  SAPI_RETURN_IF_ERROR(rpc_channel->Free(GetRemote(), arena_generation_));
 
   SetRemote(nullptr);
   return sapi::OkStatus();
@@ -77,6 +79,9 @@ sapi::Status Var::TransferToSandboxee(RPCChannel* rpc_channel, pid_t pid) {
       .iov_base = GetRemote(),
       .iov_len = GetSize(),
   };
+  if (pid == kTransferOverComms) {
+    return rpc_channel->WriteMemory(&local, &remote, 1);
+  }
 
   ssize_t ret = process_vm_writev(pid, &local, 1, &remote, 1, 0);
   if (ret == -1) {
@@ -113,6 +118,9 @@ sapi::Status Var::TransferFromSandboxee(RPCChannel* rpc_channel, pid_t pid) {
       .iov_base = GetRemote(),
       .iov_len = GetSize(),
   };
+  if (pid == kTransferOverComms) {
+    return rpc_channel->ReadMemory(&local, &remote, 1);
+  }
 
   ssize_t ret = process_vm_readv(pid, &local, 1, &remote, 1, 0);
   if (ret == -1) {
@@ -130,5 +138,21 @@ sapi::Status Var::TransferFromSandboxee(RPCChannel* rpc_channel, pid_t pid) {
   return sapi::OkStatus();
 }
 
+bool Var::GetRegionsToSandboxee(std::vector<iovec>* local,
+                                std::vector<iovec>* remote) {
+  if (GetLocal() == nullptr || GetRemote() == nullptr) {
+    // Let TransferToSandboxee() report the error.
+    return false;
+  }
+  local->push_back({GetLocal(), GetSize()});
+  remote->push_back({GetRemote(), GetSize()});
+  return true;
+}
+
+bool Var::GetRegionsFromSandboxee(std::vector<iovec>* local,
+                                  std::vector<iovec>* remote) {
+  return GetRegionsToSandboxee(local, remote);
+}
+
 }  // namespace v
 }  // namespace sapi
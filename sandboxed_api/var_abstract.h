@@ -15,9 +15,13 @@
 #ifndef SANDBOXED_API_VAR_ABSTRACT_H_
 #define SANDBOXED_API_VAR_ABSTRACT_H_
 
+#include <sys/uio.h>
+
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "sandboxed_api/var_type.h"
@@ -35,6 +39,11 @@ namespace v {
 
 class Ptr;
 
+// Passed as the 'pid' of the transfer functions if the sandboxee does not run
+// on this host. The memory is then copied over the RPCChannel instead of with
+// process_vm_writev() and process_vm_readv().
+constexpr pid_t kTransferOverComms = -1;
+
 // An abstract class representing variables.
 class Var {
  public:
@@ -65,7 +74,11 @@ class Var {
   virtual ~Var();
 
  protected:
-  Var() : local_(nullptr), remote_(nullptr), free_rpc_channel_(nullptr) {}
+  Var()
+      : local_(nullptr),
+        remote_(nullptr),
+        free_rpc_channel_(nullptr),
+        arena_generation_(0) {}
 
   // Set pointer to local storage class.
   void SetLocal(void* local) { local_ = local; }
@@ -78,6 +91,10 @@ class Var {
   }
   RPCChannel* GetFreeRPCChannel() { return free_rpc_channel_; }
 
+  // Returns the generation of the arena the remote storage was allocated
+  // from, see RPCChannel::Allocate().
+  uint64_t GetArenaGeneration() const { return arena_generation_; }
+
   // Allocates the local variable on the remote side. The 'automatic_free'
   // argument dictates whether the remote memory should be freed upon end of
   // this object's lifetime.
@@ -87,13 +104,24 @@ class Var {
   virtual sapi::Status Free(RPCChannel* rpc_channel);
 
   // Transfers the variable to the sandboxee's address space, has to be
-  // allocated there first.
+  // allocated there first. 'pid' may be kTransferOverComms.
   virtual sapi::Status TransferToSandboxee(RPCChannel* rpc_channel, pid_t pid);
 
   // Transfers the variable from the sandboxee's address space.
   virtual sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
                                              pid_t pid);
 
+  // Appends the memory regions copied by TransferToSandboxee() to 'local' and
+  // 'remote', so that several variables can be transferred with a single
+  // process_vm_writev() call. Returns false if the variable cannot be
+  // transferred this way, TransferToSandboxee() has to be used then.
+  virtual bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                                     std::vector<iovec>* remote);
+
+  // Same as GetRegionsToSandboxee(), for TransferFromSandboxee().
+  virtual bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                                       std::vector<iovec>* remote);
+
  private:
   // Pointer to local storage of the variable.
   void* local_;
@@ -104,7 +132,10 @@ class Var {
   // this process' end of lifetime.
   RPCChannel* free_rpc_channel_;
 
-  // Invokes Allocate()/Free()/Transfer*Sandboxee().
+  // Arena generation of the remote storage, see GetArenaGeneration().
+  uint64_t arena_generation_;
+
+  // Invokes Allocate()/Free()/Transfer*Sandboxee()/GetRegions*Sandboxee().
   friend class ::sapi::Sandbox;
 };
 
@@ -15,8 +15,12 @@
 #ifndef SANDBOXED_API_VAR_ARRAY_H_
 #define SANDBOXED_API_VAR_ARRAY_H_
 
+#include <algorithm>
 #include <cstring>
 #include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "absl/strings/str_cat.h"
@@ -26,6 +30,7 @@
 #include "sandboxed_api/var_ptr.h"
 #include "sandboxed_api/util/canonical_errors.h"
 #include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
 
 namespace sapi {
 namespace v {
@@ -34,12 +39,14 @@ namespace v {
 template <class T>
 class Array : public Var, public Pointable {
  public:
+  using ElementType = typename std::remove_cv<T>::type;
+
   // The array is not owned by this object.
   Array(T* arr, size_t nelem)
       : arr_(arr),
         nelem_(nelem),
         total_size_(nelem_ * sizeof(T)),
-        buffer_owned_(false) {
+        storage_(Storage::kBorrowed) {
     SetLocal(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
   }
   // The array is allocated and owned by this object.
@@ -47,20 +54,67 @@ class Array : public Var, public Pointable {
       : arr_(static_cast<T*>(malloc(sizeof(T) * nelem))),
         nelem_(nelem),
         total_size_(nelem_ * sizeof(T)),
-        buffer_owned_(true) {
+        storage_(Storage::kMalloc) {
     SetLocal(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
   }
-  virtual ~Array() {
-    if (buffer_owned_) {
-      free(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
-    }
+  // The array takes ownership of the elements of 'vec', without copying them.
+  explicit Array(std::vector<ElementType>&& vec)
+      : arr_(vec.data()),
+        nelem_(vec.size()),
+        total_size_(nelem_ * sizeof(T)),
+        storage_(Storage::kVector),
+        vector_(std::move(vec)) {
+    SetLocal(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
+  }
+  // The array takes ownership of the 'nelem' elements of 'arr'.
+  Array(std::unique_ptr<T[]> arr, size_t nelem)
+      : arr_(arr.get()),
+        nelem_(nelem),
+        total_size_(nelem_ * sizeof(T)),
+        storage_(Storage::kUniqueArray),
+        unique_array_(std::move(arr)) {
+    SetLocal(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
   }
+  virtual ~Array() { ReleaseStorage(); }
 
   T& operator[](size_t v) const { return arr_[v]; }
   T* GetData() const { return arr_; }
 
+  // Moves the elements out of the array. They are only copied if the array
+  // does not own a std::vector, e.g. after it was resized. The array is empty
+  // afterwards.
+  std::vector<ElementType> ReleaseVector() {
+    std::vector<ElementType> vec;
+    if (storage_ == Storage::kVector) {
+      vec = std::move(vector_);
+    } else {
+      vec.assign(arr_, arr_ + nelem_);
+    }
+    Clear();
+    return vec;
+  }
+
+  // Same as above for a std::unique_ptr<T[]>, returns the number of elements
+  // in 'nelem'.
+  std::unique_ptr<T[]> ReleaseUniqueArray(size_t* nelem) {
+    *nelem = nelem_;
+    std::unique_ptr<T[]> arr;
+    if (storage_ == Storage::kUniqueArray) {
+      arr = std::move(unique_array_);
+    } else {
+      auto* copy = new ElementType[nelem_];
+      std::copy(arr_, arr_ + nelem_, copy);
+      arr.reset(copy);
+    }
+    Clear();
+    return arr;
+  }
+
   size_t GetNElem() const { return nelem_; }
   size_t GetSize() const final { return total_size_; }
+  // Size of the remote buffer in bytes, at least GetSize(). Only grows beyond
+  // it by Resize() and Reserve().
+  size_t GetRemoteCapacity() const { return remote_capacity_; }
   Type GetType() const final { return Type::kArray; }
   std::string GetTypeString() const final { return "Array"; }
   std::string ToString() const override {
@@ -73,27 +127,128 @@ class Array : public Var, public Pointable {
     return new Ptr(this, type);
   }
 
+  // The remote buffer was replaced, it holds at least the current elements.
+  void SetRemote(void* remote) override {
+    Var::SetRemote(remote);
+    remote_capacity_ = total_size_;
+  }
+
   // Resizes the local and remote buffer using realloc(). Note that this will
   // make all pointers to the current data (inside and outside of the sandbox)
   // invalid.
+  // The remote buffer is only reallocated if it has to grow beyond its
+  // capacity, and then at least doubles, so that growing an array step by
+  // step needs few round-trips. It is never shrunk, the excess is freed along
+  // with the array.
   sapi::Status Resize(RPCChannel* rpc_channel, size_t nelems) {
     size_t absolute_size = sizeof(T) * nelems;
     // Resize local buffer.
     SAPI_RETURN_IF_ERROR(EnsureOwnedLocalBuffer(absolute_size));
 
-    // Resize remote buffer and update local pointer.
-    void* new_addr;
+    if (GetRemote() != nullptr && absolute_size <= remote_capacity_) {
+      return sapi::OkStatus();
+    }
+    return ReallocateRemote(
+        rpc_channel,
+        GetRemote() == nullptr
+            ? absolute_size
+            : std::max(absolute_size, 2 * remote_capacity_));
+  }
 
-    SAPI_RETURN_IF_ERROR(
-        rpc_channel->Reallocate(GetRemote(), absolute_size, &new_addr));
+  // Makes the remote buffer hold at least 'nelems' elements, without changing
+  // the size of the array. Code in the sandboxee can then grow the data in
+  // place. Note that this invalidates remote pointers to the data if the
+  // buffer grows.
+  sapi::Status Reserve(RPCChannel* rpc_channel, size_t nelems) {
+    size_t absolute_size = sizeof(T) * nelems;
+    if (GetRemote() != nullptr && absolute_size <= remote_capacity_) {
+      return sapi::OkStatus();
+    }
+    return ReallocateRemote(rpc_channel,
+                            std::max(absolute_size, total_size_));
+  }
+
+  // Operate on the remote copy of the array in place, in a single round-trip
+  // and without transferring any elements. The local copy is left unchanged.
+  // Sets all bytes of the remote copy to zero.
+  sapi::Status ClearRemote(RPCChannel* rpc_channel) {
+    return rpc_channel->Memset(GetRemote(), 0, total_size_);
+  }
+  // Sets all elements of the remote copy to 'value', which must not be larger
+  // than eight bytes.
+  sapi::Status FillRemote(RPCChannel* rpc_channel, const T& value) {
+    static_assert(sizeof(T) <= sizeof(uint64_t),
+                  "Only elements of up to eight bytes can be filled remotely");
+    uint64_t pattern = 0;
+    memcpy(&pattern, &value, sizeof(T));
+    return rpc_channel->Fill(GetRemote(), pattern, sizeof(T), total_size_);
+  }
+  // Copies the remote elements of 'other' to the remote copy, as many as fit.
+  sapi::Status CopyRemoteFrom(RPCChannel* rpc_channel, const Array& other) {
+    return rpc_channel->Memcpy(GetRemote(), other.GetRemote(),
+                               std::min(total_size_, other.total_size_));
+  }
+  // Returns whether the remote copies of this array and 'other' are equal.
+  sapi::StatusOr<bool> RemoteEquals(RPCChannel* rpc_channel,
+                                    const Array& other) const {
+    if (total_size_ != other.total_size_) {
+      return false;
+    }
+    int result;
+    SAPI_RETURN_IF_ERROR(rpc_channel->Memcmp(GetRemote(), other.GetRemote(),
+                                             total_size_, &result));
+    return result == 0;
+  }
+
+ private:
+  // Where the elements are stored.
+  enum class Storage {
+    // Not owned by this object.
+    kBorrowed,
+    // Not owned by this object, but writable. Used by LenVal for the data
+    // it owns.
+    kWritable,
+    // Allocated with malloc().
+    kMalloc,
+    // Owned, in 'vector_' or 'unique_array_'.
+    kVector,
+    kUniqueArray,
+  };
+
+  // Frees the elements if they are owned.
+  void ReleaseStorage() {
+    if (storage_ == Storage::kMalloc) {
+      free(const_cast<void*>(reinterpret_cast<const void*>(arr_)));
+    }
+    vector_.clear();
+    vector_.shrink_to_fit();
+    unique_array_.reset();
+  }
+
+  // Leaves an empty array behind, after its elements were moved out.
+  void Clear() {
+    ReleaseStorage();
+    arr_ = nullptr;
+    nelem_ = 0;
+    total_size_ = 0;
+    storage_ = Storage::kBorrowed;
+    SetLocal(nullptr);
+  }
+
+  // Reallocates the remote buffer to 'capacity' bytes.
+  sapi::Status ReallocateRemote(RPCChannel* rpc_channel, size_t capacity) {
+    void* new_addr;
+    SAPI_RETURN_IF_ERROR(rpc_channel->Reallocate(GetRemote(), capacity,
+                                                 &new_addr,
+                                                 GetArenaGeneration()));
     if (!new_addr) {
       return sapi::UnavailableError("Reallocate() returned nullptr");
     }
     SetRemote(new_addr);
+    remote_capacity_ = capacity;
     return sapi::OkStatus();
   }
 
- private:
   // Resizes the internal storage.
   sapi::Status EnsureOwnedLocalBuffer(size_t size) {
     if (size % sizeof(T)) {
@@ -101,18 +256,27 @@ class Array : public Var, public Pointable {
           "Array size not a multiple of the item size");
     }
     // Do not (re-)allocate memory if the new size matches our size - except
-    // when we don't own that buffer.
-    if (size == total_size_ && buffer_owned_) {
+    // when we cannot write to that buffer.
+    if (size == total_size_ && storage_ != Storage::kBorrowed) {
       return sapi::OkStatus();
     }
     void* new_addr = nullptr;
-    if (buffer_owned_) {
+    if (storage_ == Storage::kMalloc) {
       new_addr = realloc(arr_, size);
+    } else if (storage_ == Storage::kVector) {
+      // Never fails, the vector grows in place if it has the capacity.
+      vector_.resize(size / sizeof(T));
+      arr_ = vector_.data();
+      total_size_ = size;
+      nelem_ = vector_.size();
+      SetLocal(arr_);
+      return sapi::OkStatus();
     } else {
       new_addr = malloc(size);
       if (new_addr) {
-        memcpy(new_addr, arr_, total_size_);
-        buffer_owned_ = true;
+        memcpy(new_addr, arr_, std::min(size, total_size_));
+        unique_array_.reset();
+        storage_ = Storage::kMalloc;
       }
     }
     if (!new_addr) {
@@ -126,14 +290,19 @@ class Array : public Var, public Pointable {
     return sapi::OkStatus();
   }
 
-  // Pointer to the data, owned by the object if buffer_owned_ is 'true'.
+  // Pointer to the data, owned by the object depending on 'storage_'.
   T* arr_;
   // Number of elements.
   size_t nelem_;
   // Total size in bytes.
   size_t total_size_;
-  // Do we own the buffer?
-  bool buffer_owned_;
+  // Size of the remote buffer in bytes, see GetRemoteCapacity().
+  size_t remote_capacity_ = 0;
+  // Whether and how the buffer is owned.
+  Storage storage_;
+  // Adopted storage, see the constructors.
+  std::vector<ElementType> vector_;
+  std::unique_ptr<T[]> unique_array_;
 
   friend class LenVal;
 };
@@ -50,9 +50,6 @@ void Fd::CloseLocalFd() {
 sapi::Status Fd::TransferToSandboxee(RPCChannel* rpc_channel, pid_t /* pid */) {
   int remote_fd;
 
-  SetFreeRPCChannel(rpc_channel);
-  OwnRemoteFd(true);
-
   if (GetValue() < 0) {
     return sapi::FailedPreconditionError(
         "Cannot transfer FD: Local FD not valid");
@@ -64,11 +61,41 @@ sapi::Status Fd::TransferToSandboxee(RPCChannel* rpc_channel, pid_t /* pid */) {
   }
 
   SAPI_RETURN_IF_ERROR(rpc_channel->SendFD(GetValue(), &remote_fd));
-  SetRemoteFd(remote_fd);
+  SetTransferredToSandboxee(rpc_channel, remote_fd);
 
   return sapi::OkStatus();
 }
 
+sapi::Status Fd::TransferAllToSandboxee(RPCChannel* rpc_channel,
+                                        const std::vector<Fd*>& fds) {
+  std::vector<int> local_fds;
+  local_fds.reserve(fds.size());
+  for (Fd* fd : fds) {
+    if (fd->GetValue() < 0) {
+      return sapi::FailedPreconditionError(
+          "Cannot transfer FD: Local FD not valid");
+    }
+    if (fd->GetRemoteFd() >= 0) {
+      return sapi::FailedPreconditionError(
+          "Cannot transfer FD: Sandboxee already has a valid FD");
+    }
+    local_fds.push_back(fd->GetValue());
+  }
+
+  std::vector<int> remote_fds;
+  SAPI_RETURN_IF_ERROR(rpc_channel->SendFDs(local_fds, &remote_fds));
+  for (size_t i = 0; i < fds.size(); ++i) {
+    fds[i]->SetTransferredToSandboxee(rpc_channel, remote_fds[i]);
+  }
+  return sapi::OkStatus();
+}
+
+void Fd::SetTransferredToSandboxee(RPCChannel* rpc_channel, int remote_fd) {
+  SetFreeRPCChannel(rpc_channel);
+  OwnRemoteFd(true);
+  SetRemoteFd(remote_fd);
+}
+
 sapi::Status Fd::TransferFromSandboxee(RPCChannel* rpc_channel,
                                        pid_t /* pid */) {
   int local_fd;
@@ -16,6 +16,7 @@
 #define SANDBOXED_API_VAR_INT_H_
 
 #include <memory>
+#include <vector>
 
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/var_pointable.h"
@@ -87,6 +88,11 @@ class Fd : public Int {
   // Close local fd.
   void CloseLocalFd();
 
+  // Sends the local fds of all of 'fds' to the sandboxee in a single
+  // round-trip, the same way TransferToSandboxee() does for one of them.
+  static sapi::Status TransferAllToSandboxee(RPCChannel* rpc_channel,
+                                             const std::vector<Fd*>& fds);
+
  protected:
   // Sends local fd to sandboxee, takes ownership of the fd.
   sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
@@ -95,6 +101,20 @@ class Fd : public Int {
   // Retrieves remote file descriptor, does not own fd.
   sapi::Status TransferToSandboxee(RPCChannel* rpc_channel, pid_t pid) override;
 
+  // Records that the local fd was sent to the sandboxee as 'remote_fd'.
+  virtual void SetTransferredToSandboxee(RPCChannel* rpc_channel,
+                                         int remote_fd);
+
+  // File descriptors are transferred over the Comms channel.
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override {
+    return false;
+  }
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return false;
+  }
+
  private:
   int remote_fd_;
   bool own_local_;
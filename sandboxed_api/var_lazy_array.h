@@ -0,0 +1,141 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_VAR_LAZY_ARRAY_H_
+#define SANDBOXED_API_VAR_LAZY_ARRAY_H_
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/lazy_pager.h"
+#include "sandboxed_api/rpcchannel.h"
+#include "sandboxed_api/var_abstract.h"
+#include "sandboxed_api/var_pointable.h"
+#include "sandboxed_api/var_ptr.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+namespace v {
+
+// Read-only input array whose pages are copied into the sandboxee only when
+// the sandboxee first reads them, see sapi::LazyPager. For large inputs of
+// which a call may only look at a small part. The array borrows the host data,
+// which must stay unchanged while the array is allocated in the sandboxee.
+//
+// The sandboxee needs sandbox2::PolicyBuilder::AllowUserfaultfd(), see
+// sapi::Sandbox::UseLazyPaging(). Only accesses from user mode are served, so
+// the mapping must not be passed to system calls, e.g. write(), before its
+// pages were touched.
+template <class T>
+class LazyArray : public Var, public Pointable {
+ public:
+  LazyArray(const T* data, size_t nelem,
+            size_t read_ahead_pages = LazyPager::kDefaultReadAheadPages)
+      : data_(data), nelem_(nelem), read_ahead_pages_(read_ahead_pages) {
+    SetLocal(const_cast<T*>(data));
+  }
+
+  const T* GetData() const { return data_; }
+  size_t GetNElem() const { return nelem_; }
+  size_t GetSize() const final { return nelem_ * sizeof(T); }
+  Type GetType() const final { return Type::kArray; }
+  std::string GetTypeString() const final { return "LazyArray"; }
+  std::string ToString() const override {
+    return absl::StrCat("LazyArray, elem size: ", sizeof(T),
+                        " B., total size: ", GetSize(),
+                        " B., nelems: ", GetNElem());
+  }
+
+  Ptr* CreatePtr(Pointable::SyncType type) override {
+    return new Ptr(this, type);
+  }
+
+  // Number of pages copied into the sandboxee since it was allocated there.
+  uint64_t GetPagesCopied() const {
+    return pager_ ? pager_->pages_copied() : 0;
+  }
+
+ protected:
+  // Maps the range into the sandboxee and starts serving its faults.
+  sapi::Status Allocate(RPCChannel* rpc_channel, bool automatic_free) override {
+    void* addr;
+    int uffd;
+    SAPI_RETURN_IF_ERROR(rpc_channel->MapLazy(GetSize(), &addr, &uffd));
+    sapi::StatusOr<std::unique_ptr<LazyPager>> pager =
+        LazyPager::Create(uffd, reinterpret_cast<uintptr_t>(addr), data_,
+                          GetSize(), read_ahead_pages_);
+    if (!pager.ok()) {
+      rpc_channel->Free(addr).IgnoreError();
+      return pager.status();
+    }
+    pager_ = std::move(pager).ValueOrDie();
+    SetRemote(addr);
+    if (automatic_free) {
+      SetFreeRPCChannel(rpc_channel);
+    }
+    return sapi::OkStatus();
+  }
+
+  sapi::Status Free(RPCChannel* rpc_channel) override {
+    // Unmap first, so that the sandboxee cannot see zero pages once the
+    // userfaultfd is closed.
+    sapi::Status status = Var::Free(rpc_channel);
+    pager_.reset();
+    return status;
+  }
+
+  // The pager provides the data, and the sandboxee cannot write to it.
+  sapi::Status TransferToSandboxee(RPCChannel* rpc_channel,
+                                   pid_t pid) override {
+    return CheckMapped();
+  }
+  sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
+                                     pid_t pid) override {
+    return CheckMapped();
+  }
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override {
+    return GetRemote() != nullptr;
+  }
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return GetRemote() != nullptr;
+  }
+
+ private:
+  sapi::Status CheckMapped() const {
+    if (GetRemote() == nullptr) {
+      return sapi::FailedPreconditionError(
+          "LazyArray is not mapped into the sandboxee");
+    }
+    return sapi::OkStatus();
+  }
+
+  const T* data_;
+  // Number of elements.
+  size_t nelem_;
+  size_t read_ahead_pages_;
+  std::unique_ptr<LazyPager> pager_;
+};
+
+}  // namespace v
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_VAR_LAZY_ARRAY_H_
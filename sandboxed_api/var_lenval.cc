@@ -18,54 +18,202 @@
 
 #include <sys/uio.h>
 
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <glog/logging.h>
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/rpcchannel.h"
+#include "sandboxed_api/util/canonical_errors.h"
 
 namespace sapi {
 namespace v {
 
 sapi::Status LenVal::Allocate(RPCChannel* rpc_channel, bool automatic_free) {
-  SAPI_RETURN_IF_ERROR(struct_.Allocate(rpc_channel, automatic_free));
-  SAPI_RETURN_IF_ERROR(array_.Allocate(rpc_channel, true));
+  // Allocate the structure and the data in a single round-trip. They cannot
+  // share one allocation, as the sandboxee may reallocate or free the data.
+  std::vector<void*> addrs;
+  sapi::Status alloc_status = rpc_channel->AllocateBatch(
+      {struct_.GetSize(), array_.GetSize()}, &addrs);
+  if (!alloc_status.ok()) {
+    for (void* addr : addrs) {
+      if (addr != nullptr) {
+        rpc_channel->Free(addr).IgnoreError();
+      }
+    }
+    return alloc_status;
+  }
 
-  // Set data pointer.
-  struct_.mutable_data()->data = array_.GetRemote();
+  struct_.SetRemote(addrs[0]);
+  if (automatic_free) {
+    struct_.SetFreeRPCChannel(rpc_channel);
+  }
+  SetRemoteData(addrs[1], array_.GetSize());
+  array_.SetFreeRPCChannel(rpc_channel);
   return sapi::OkStatus();
 }
 
+void LenVal::SetRemoteData(void* data, size_t capacity) {
+  array_.SetRemote(data);
+  array_.remote_capacity_ = capacity;
+  remote_size_ = capacity;
+  auto* struct_data = struct_.mutable_data();
+  struct_data->data = data;
+  struct_data->capacity = capacity;
+}
+
 sapi::Status LenVal::Free(RPCChannel* rpc_channel) {
   SAPI_RETURN_IF_ERROR(array_.Free(rpc_channel));
   SAPI_RETURN_IF_ERROR(struct_.Free(rpc_channel));
+  remote_size_ = 0;
   return sapi::OkStatus();
 }
 
 sapi::Status LenVal::TransferToSandboxee(RPCChannel* rpc_channel, pid_t pid) {
+  if (array_.GetRemote() != nullptr && array_.GetSize() > remote_size_) {
+    // Grown by SetDataSize(), at least doubles like Array::Resize().
+    const size_t capacity = std::max(array_.GetSize(), 2 * remote_size_);
+    void* new_addr;
+    SAPI_RETURN_IF_ERROR(
+        rpc_channel->Reallocate(array_.GetRemote(), capacity, &new_addr));
+    if (!new_addr) {
+      return sapi::UnavailableError("Reallocate() returned nullptr");
+    }
+    SetRemoteData(new_addr, capacity);
+  }
   // Sync the structure and the underlying array.
   SAPI_RETURN_IF_ERROR(struct_.TransferToSandboxee(rpc_channel, pid));
   SAPI_RETURN_IF_ERROR(array_.TransferToSandboxee(rpc_channel, pid));
   return sapi::OkStatus();
 }
 
+bool LenVal::GetRegionsToSandboxee(std::vector<iovec>* local,
+                                   std::vector<iovec>* remote) {
+  if (array_.GetSize() > remote_size_) {
+    return false;
+  }
+  const size_t num_regions = local->size();
+  if (!struct_.GetRegionsToSandboxee(local, remote) ||
+      !array_.GetRegionsToSandboxee(local, remote)) {
+    local->resize(num_regions);
+    remote->resize(num_regions);
+    return false;
+  }
+  return true;
+}
+
 sapi::Status LenVal::TransferFromSandboxee(RPCChannel* rpc_channel, pid_t pid) {
-  // Sync the structure back.
-  SAPI_RETURN_IF_ERROR(struct_.TransferFromSandboxee(rpc_channel, pid));
+  // Make sure we own the buffer, this is the only way we can be sure that the
+  // buffer is writable.
+  SAPI_RETURN_IF_ERROR(array_.EnsureOwnedLocalBuffer(array_.GetSize()));
+
+  // Read the structure together with the data at its previous location. In
+  // the common case, the sandboxee did not move or grow the data and this is
+  // the only read needed.
+  void* const old_data = array_.GetRemote();
+  const size_t old_size = array_.GetSize();
+  const size_t old_data_size = struct_.data().size;
+  struct iovec local[] = {
+      {struct_.GetLocal(), struct_.GetSize()},
+      {array_.GetLocal(), old_size},
+  };
+  struct iovec remote[] = {
+      {struct_.GetRemote(), struct_.GetSize()},
+      {old_data, old_size},
+  };
+  ssize_t ret;
+  if (pid == kTransferOverComms) {
+    SAPI_RETURN_IF_ERROR(rpc_channel->ReadMemory(local, remote, 2));
+    ret = struct_.GetSize() + old_size;
+  } else {
+    ret = process_vm_readv(pid, local, 2, remote, 2, 0);
+  }
+  if (ret == -1) {
+    PLOG(WARNING) << "process_vm_readv(pid: " << pid
+                  << " raddr: " << struct_.GetRemote() << ")";
+    return sapi::UnavailableError("process_vm_readv failed");
+  }
+  if (ret < struct_.GetSize()) {
+    LOG(WARNING) << "process_vm_readv(pid: " << pid
+                 << " raddr: " << struct_.GetRemote() << ") transferred "
+                 << ret << " bytes";
+    return sapi::UnavailableError("process_vm_readv: partial success");
+  }
 
-  // Resize the local array if required. Also make sure we own the buffer, this
-  // is the only way we can be sure that the buffer is writable.
-  size_t new_size = struct_.data().size;
+  // Resize the local array if required.
+  const size_t new_size = struct_.data().size;
+  void* const new_data = struct_.data().data;
   SAPI_RETURN_IF_ERROR(array_.EnsureOwnedLocalBuffer(new_size));
+  // Code which changes the data without knowing about the capacity leaves the
+  // one of the old buffer behind. It may have reallocated the buffer, even in
+  // place and to a smaller size, so only the new size is known to fit.
+  size_t capacity = struct_.data().capacity;
+  if (capacity < new_size ||
+      ((new_data != old_data || new_size != old_data_size) &&
+       capacity == remote_size_)) {
+    capacity = new_size;
+  }
+  if (new_data == old_data && new_size <= old_size &&
+      ret == struct_.GetSize() + old_size) {
+    array_.remote_capacity_ = capacity;
+    remote_size_ = capacity;
+    struct_.mutable_data()->capacity = capacity;
+    return sapi::OkStatus();
+  }
 
-  // Remote pointer might have changed, update it.
-  array_.SetRemote(struct_.data().data);
+  // Remote pointer has changed or the data grew, read it again.
+  SetRemoteData(new_data, capacity);
   return array_.TransferFromSandboxee(rpc_channel, pid);
 }
 
+std::vector<uint8_t> LenVal::ReleaseVector() {
+  const size_t size = GetDataSize();
+  std::vector<uint8_t> data = array_.ReleaseVector();
+  data.resize(size);
+  string_.clear();
+  struct_.mutable_data()->size = 0;
+  return data;
+}
+
+std::string LenVal::ReleaseString() {
+  const size_t size = GetDataSize();
+  std::string data;
+  if (array_.storage_ == Array<uint8_t>::Storage::kWritable) {
+    // Still the buffer of 'string_'.
+    data = std::move(string_);
+  } else {
+    data.assign(reinterpret_cast<const char*>(array_.GetData()),
+                array_.GetSize());
+  }
+  array_.Clear();
+  data.resize(size);
+  string_.clear();
+  struct_.mutable_data()->size = 0;
+  return data;
+}
+
 sapi::Status LenVal::ResizeData(RPCChannel* rpc_channel, size_t size) {
+  array_.remote_capacity_ = remote_size_;
   SAPI_RETURN_IF_ERROR(array_.Resize(rpc_channel, size));
-  auto* struct_data = struct_.mutable_data();
-  struct_data->data = array_.GetRemote();
-  struct_data->size = size;
+  SetRemoteData(array_.GetRemote(), array_.GetRemoteCapacity());
+  struct_.mutable_data()->size = size;
+  return sapi::OkStatus();
+}
+
+sapi::Status LenVal::ReserveData(RPCChannel* rpc_channel, size_t capacity) {
+  array_.remote_capacity_ = remote_size_;
+  SAPI_RETURN_IF_ERROR(array_.Reserve(rpc_channel, capacity));
+  SetRemoteData(array_.GetRemote(), array_.GetRemoteCapacity());
+  return sapi::OkStatus();
+}
+
+sapi::Status LenVal::SetDataSize(size_t size) {
+  // Also makes sure that the buffer is writable.
+  SAPI_RETURN_IF_ERROR(
+      array_.EnsureOwnedLocalBuffer(std::max(size, array_.GetSize())));
+  struct_.mutable_data()->size = size;
   return sapi::OkStatus();
 }
 
@@ -18,6 +18,9 @@
 #include <sys/uio.h>
 
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "sandboxed_api/lenval_core.h"
@@ -49,6 +52,16 @@ class LenVal : public Var, public Pointable {
     memcpy(array_.GetData(), data.data(), data.size());
   }
 
+  // Take ownership of 'data', without copying it.
+  explicit LenVal(std::vector<uint8_t>&& data)
+      : array_(std::move(data)), struct_(array_.GetNElem(), nullptr) {}
+  explicit LenVal(std::string&& data)
+      : string_(std::move(data)),
+        array_(reinterpret_cast<uint8_t*>(&string_[0]), string_.size()),
+        struct_(string_.size(), nullptr) {
+    array_.storage_ = Array<uint8_t>::Storage::kWritable;
+  }
+
   explicit LenVal(size_t size) : array_(size), struct_(size, nullptr) {}
 
   Type GetType() const final { return Type::kLenVal; }
@@ -59,9 +72,25 @@ class LenVal : public Var, public Pointable {
     return new Ptr(this, type);
   }
 
+  // Resizes the data, see Array::Resize(). The remote buffer only grows, and
+  // only if it has to.
   sapi::Status ResizeData(RPCChannel* rpc_channel, size_t size);
+  // Makes the remote buffer hold at least 'capacity' bytes without changing
+  // the size of the data, so that the sandboxee can grow it in place.
+  sapi::Status ReserveData(RPCChannel* rpc_channel, size_t capacity);
+  size_t GetRemoteCapacity() const { return remote_size_; }
+
+  // Sets the size of the data without a round-trip, keeping its first 'size'
+  // bytes. The local buffer is only grown, the remote one grows on the next
+  // transfer to the sandboxee if needed.
+  sapi::Status SetDataSize(size_t size);
   size_t GetDataSize() const { return struct_.data().size; }
   uint8_t* GetData() const { return array_.GetData(); }
+
+  // Move the data out. It is only copied if it is not held in the requested
+  // type, e.g. after it was resized. The LenVal is empty afterwards.
+  std::vector<uint8_t> ReleaseVector();
+  std::string ReleaseString();
   void* GetRemote() const final { return struct_.GetRemote(); }
 
  protected:
@@ -71,9 +100,24 @@ class LenVal : public Var, public Pointable {
   sapi::Status TransferToSandboxee(RPCChannel* rpc_channel, pid_t pid) override;
   sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
                                      pid_t pid) override;
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override;
+  // The array might have been resized remotely, the structure has to be
+  // transferred back first.
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return false;
+  }
+  // Sets the remote buffer of the data and its size.
+  void SetRemoteData(void* data, size_t capacity);
 
+  // Holds the data if the LenVal was constructed from a std::string.
+  std::string string_;
   Array<uint8_t> array_;
   Struct<LenValStruct> struct_;
+  // Size of the remote buffer, which the array may have outgrown since, see
+  // SetDataSize(), or which may be larger than the array, see ReserveData().
+  size_t remote_size_ = 0;
 
   template <class T>
   friend class Proto;
@@ -22,6 +22,7 @@
 #include <vector>
 
 #include "absl/base/macros.h"
+#include "google/protobuf/arena.h"
 #include "absl/memory/memory.h"
 #include "sandboxed_api/proto_helper.h"
 #include "sandboxed_api/var_lenval.h"
@@ -40,11 +41,10 @@ class Proto : public Pointable, public Var {
 
   ABSL_DEPRECATED("Use Proto<>::FromMessage() instead")
   explicit Proto(const T& proto)
-      : wrapped_var_(SerializeProto(proto).ValueOrDie()) {}
+      : Proto(proto, GetSerializedProtoSize(proto)) {}
 
   static sapi::StatusOr<Proto<T>> FromMessage(const T& proto) {
-    SAPI_ASSIGN_OR_RETURN(std::vector<uint8_t> len_val, SerializeProto(proto));
-    return Proto(len_val);
+    return Proto(proto, GetSerializedProtoSize(proto));
   }
 
   size_t GetSize() const final { return wrapped_var_.GetSize(); }
@@ -66,6 +66,37 @@ class Proto : public Pointable, public Var {
         wrapped_var_.GetDataSize());
   }
 
+  // Parses the stored protobuf object into 'proto'. Parsing into the same
+  // message in a loop reuses its memory.
+  sapi::Status GetMessage(T* proto) const {
+    return DeserializeProto(
+        reinterpret_cast<const char*>(wrapped_var_.GetData()),
+        wrapped_var_.GetDataSize(), proto);
+  }
+
+  // Parses the stored protobuf object into a new message owned by 'arena'.
+  sapi::StatusOr<T*> GetMessageOnArena(google::protobuf::Arena* arena) const {
+    T* proto = google::protobuf::Arena::CreateMessage<T>(arena);
+    sapi::Status status = GetMessage(proto);
+    if (!status.ok()) {
+      if (arena == nullptr) {
+        delete proto;
+      }
+      return status;
+    }
+    return proto;
+  }
+
+  // Replaces the stored protobuf object with 'proto', to pass it to another
+  // call. The local buffer is reused if it is large enough, and so is the
+  // remote one when the object is synchronized next.
+  sapi::Status SetMessage(const T& proto) {
+    const size_t size = GetSerializedProtoSize(proto);
+    SAPI_RETURN_IF_ERROR(wrapped_var_.SetDataSize(size));
+    SerializeProtoToArray(proto, wrapped_var_.GetData());
+    return sapi::OkStatus();
+  }
+
   ABSL_DEPRECATED("Use GetMessage() instead")
   std::unique_ptr<T> GetProtoCopy() const {
     if (auto result_or = GetMessage(); result_or.ok()) {
@@ -101,8 +132,21 @@ class Proto : public Pointable, public Var {
     return wrapped_var_.TransferFromSandboxee(rpc_channel, pid);
   }
 
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override {
+    return wrapped_var_.GetRegionsToSandboxee(local, remote);
+  }
+
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return wrapped_var_.GetRegionsFromSandboxee(local, remote);
+  }
+
  private:
-  explicit Proto(std::vector<uint8_t> data) : wrapped_var_(data) {}
+  // Serializes the message straight into the buffer of the LenVal.
+  Proto(const T& proto, size_t size) : wrapped_var_(size) {
+    SerializeProtoToArray(proto, wrapped_var_.GetData());
+  }
 
   // The management of reading/writing the data to the sandboxee is handled by
   // the LenVal class.
@@ -0,0 +1,207 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_VAR_RECORD_ARRAY_H_
+#define SANDBOXED_API_VAR_RECORD_ARRAY_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "sandboxed_api/rpcchannel.h"
+#include "sandboxed_api/var_abstract.h"
+#include "sandboxed_api/var_pointable.h"
+#include "sandboxed_api/var_ptr.h"
+#include "sandboxed_api/util/status.h"
+
+namespace sapi {
+namespace v {
+
+// Read-only input array of records (structs) which is copied into the
+// sandboxee with a single transfer, together with the data the pointer fields
+// of the records point to. All of it is staged in one local buffer, and the
+// pointer fields are rewritten to the remote addresses of their data once the
+// array is allocated in the sandboxee, so the sandboxee never sees a host
+// pointer.
+//
+// The records are laid out either as an array of structs, the same as a
+// 'const T*' argument, or as a struct of arrays: a header with one pointer per
+// column, followed by the columns, each holding one field of all records.
+// The header matches a struct with a pointer member per column:
+//
+//   struct point { double x; double y; const char* label; };
+//   struct point_columns { const double* x; const double* y; };
+//
+//   std::vector<point> points = ...;
+//   sapi::v::RecordArray<point> columns(
+//       points, {{offsetof(point, x), sizeof(double)},
+//                {offsetof(point, y), sizeof(double)}});
+//   api.sum_points(columns.PtrBefore(), points.size());
+//
+// The generator emits these for arguments annotated with SAPI_RECORDS and
+// SAPI_COLUMNS, see annotations.h.
+template <class T>
+class RecordArray : public Var, public Pointable {
+ public:
+  // A pointer field of T, at 'offset' in the record, and the size of the data
+  // it points to in a given record. A size of zero passes a null pointer.
+  struct PointerField {
+    size_t offset;
+    std::function<size_t(const T&)> size;
+  };
+
+  // A field of T stored as a column of the struct of arrays layout.
+  struct Column {
+    size_t offset;
+    size_t size;
+  };
+
+  // Array of structs: the records, then the data of their 'pointer_fields'.
+  explicit RecordArray(absl::Span<const T> records,
+                       const std::vector<PointerField>& pointer_fields = {})
+      : nelem_(records.size()) {
+    buffer_.resize(nelem_ * sizeof(T));
+    if (nelem_ > 0) {
+      memcpy(buffer_.data(), records.data(), buffer_.size());
+    }
+    for (const PointerField& field : pointer_fields) {
+      for (size_t i = 0; i < nelem_; ++i) {
+        StagePointee(records[i], field, i * sizeof(T) + field.offset);
+      }
+    }
+    SetLocal(buffer_.data());
+  }
+
+  // Struct of arrays: the column pointers, the 'columns', then the data of the
+  // 'pointer_fields'. Only pointer fields which are stored as a column are
+  // transferred.
+  RecordArray(absl::Span<const T> records, const std::vector<Column>& columns,
+              const std::vector<PointerField>& pointer_fields = {})
+      : nelem_(records.size()) {
+    buffer_.resize(columns.size() * sizeof(uintptr_t));
+    std::vector<size_t> column_offsets;
+    for (size_t c = 0; c < columns.size(); ++c) {
+      const size_t column = Reserve(nelem_ * columns[c].size);
+      AddFixup(c * sizeof(uintptr_t), column);
+      column_offsets.push_back(column);
+      for (size_t i = 0; i < nelem_; ++i) {
+        memcpy(buffer_.data() + column + i * columns[c].size,
+               reinterpret_cast<const uint8_t*>(&records[i]) +
+                   columns[c].offset,
+               columns[c].size);
+      }
+    }
+    for (const PointerField& field : pointer_fields) {
+      for (size_t c = 0; c < columns.size(); ++c) {
+        if (columns[c].offset != field.offset ||
+            columns[c].size != sizeof(uintptr_t)) {
+          continue;
+        }
+        for (size_t i = 0; i < nelem_; ++i) {
+          StagePointee(records[i], field,
+                       column_offsets[c] + i * sizeof(uintptr_t));
+        }
+      }
+    }
+    SetLocal(buffer_.data());
+  }
+
+  size_t GetNElem() const { return nelem_; }
+  size_t GetSize() const final { return buffer_.size(); }
+  Type GetType() const final { return Type::kArray; }
+  std::string GetTypeString() const final { return "RecordArray"; }
+  std::string ToString() const override {
+    return absl::StrCat("RecordArray, record size: ", sizeof(T),
+                        " B., total size: ", GetSize(),
+                        " B., nelems: ", GetNElem());
+  }
+
+  Ptr* CreatePtr(Pointable::SyncType type) override {
+    return new Ptr(this, type);
+  }
+
+  // Rewrites the pointer fields and column pointers for the new address.
+  void SetRemote(void* remote) override {
+    Var::SetRemote(remote);
+    if (remote == nullptr) {
+      return;
+    }
+    const uintptr_t base = reinterpret_cast<uintptr_t>(remote);
+    for (const Fixup& fixup : fixups_) {
+      const uintptr_t address = base + fixup.target;
+      memcpy(&buffer_[fixup.slot], &address, sizeof(address));
+    }
+  }
+
+ protected:
+  // The data is only read by the sandboxee.
+  sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
+                                     pid_t pid) override {
+    return sapi::OkStatus();
+  }
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return true;
+  }
+
+ private:
+  // A pointer at 'slot' in the buffer to the data at 'target'.
+  struct Fixup {
+    size_t slot;
+    size_t target;
+  };
+
+  // Appends 'size' bytes, aligned for any type, and returns their offset.
+  size_t Reserve(size_t size) {
+    const size_t align = alignof(std::max_align_t);
+    const size_t offset = (buffer_.size() + align - 1) & ~(align - 1);
+    buffer_.resize(offset + size);
+    return offset;
+  }
+
+  void AddFixup(size_t slot, size_t target) {
+    fixups_.push_back({slot, target});
+  }
+
+  // Copies what 'field' of 'record' points to, the pointer is at 'slot'.
+  void StagePointee(const T& record, const PointerField& field, size_t slot) {
+    const void* data;
+    memcpy(&data, reinterpret_cast<const uint8_t*>(&record) + field.offset,
+           sizeof(data));
+    const size_t size = data != nullptr ? field.size(record) : 0;
+    if (size == 0) {
+      memset(&buffer_[slot], 0, sizeof(uintptr_t));
+      return;
+    }
+    const size_t target = Reserve(size);
+    memcpy(buffer_.data() + target, data, size);
+    AddFixup(slot, target);
+  }
+
+  // Number of records.
+  size_t nelem_;
+  std::vector<uint8_t> buffer_;
+  std::vector<Fixup> fixups_;
+};
+
+}  // namespace v
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_VAR_RECORD_ARRAY_H_
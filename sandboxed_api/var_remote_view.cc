@@ -0,0 +1,132 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/var_remote_view.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+
+#include <glog/logging.h>
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sapi {
+namespace v {
+
+constexpr size_t RemoteView::kMaxReadahead;
+
+RemoteView::RemoteView(pid_t pid, const void* remote, size_t size)
+    : pid_(pid),
+      remote_(reinterpret_cast<uintptr_t>(remote)),
+      size_(size),
+      page_size_(getpagesize()),
+      page_offset_(remote_ % page_size_),
+      // Not value-initialized, so that the memory is only committed once
+      // chunks are copied into it.
+      data_(new uint8_t[size]),
+      fetched_(size == 0 ? 0 : ChunkOf(size - 1) + 1, false) {}
+
+size_t RemoteView::ChunkBegin(size_t chunk) const {
+  return chunk == 0 ? 0 : chunk * page_size_ - page_offset_;
+}
+
+size_t RemoteView::ChunkEnd(size_t chunk) const {
+  return std::min((chunk + 1) * page_size_ - page_offset_, size_);
+}
+
+sapi::StatusOr<absl::Span<const uint8_t>> RemoteView::Read(size_t offset,
+                                                           size_t length) {
+  if (offset > size_ || length > size_ - offset) {
+    return sapi::OutOfRangeError(
+        absl::StrCat("Read of ", length, " bytes at offset ", offset,
+                     " exceeds the view of ", size_, " bytes"));
+  }
+  if (length == 0) {
+    return absl::Span<const uint8_t>(data_.get() + offset, 0);
+  }
+  const size_t first = ChunkOf(offset);
+  size_t end = ChunkOf(offset + length - 1) + 1;
+  const bool missing = std::find(fetched_.begin() + first,
+                                 fetched_.begin() + end,
+                                 false) != fetched_.begin() + end;
+  if (missing) {
+    if (advice_ == Advice::kSequential && offset == next_offset_) {
+      readahead_ = std::min(std::max<size_t>(2 * readahead_, 1),
+                            kMaxReadahead / page_size_);
+    } else {
+      readahead_ = 0;
+    }
+    end = std::min(end + readahead_, fetched_.size());
+    SAPI_RETURN_IF_ERROR(Fetch(first, end));
+  }
+  next_offset_ = offset + length;
+  return absl::Span<const uint8_t>(data_.get() + offset, length);
+}
+
+sapi::Status RemoteView::Fetch(size_t first, size_t end) {
+  std::vector<iovec> local;
+  std::vector<iovec> remote;
+  std::vector<size_t> runs;
+  // Contiguous chunks not fetched yet are copied as one region.
+  for (size_t chunk = first; chunk < end;) {
+    if (fetched_[chunk]) {
+      ++chunk;
+      continue;
+    }
+    const size_t run_first = chunk;
+    while (chunk < end && !fetched_[chunk]) {
+      ++chunk;
+    }
+    const size_t begin = ChunkBegin(run_first);
+    const size_t len = ChunkEnd(chunk - 1) - begin;
+    local.push_back({data_.get() + begin, len});
+    remote.push_back({reinterpret_cast<void*>(remote_ + begin), len});
+    runs.push_back(run_first);
+    runs.push_back(chunk);
+  }
+
+  for (size_t offset = 0; offset < local.size(); offset += IOV_MAX) {
+    const size_t count = std::min<size_t>(local.size() - offset, IOV_MAX);
+    size_t expected = 0;
+    for (size_t i = offset; i < offset + count; ++i) {
+      expected += local[i].iov_len;
+    }
+    const ssize_t ret = process_vm_readv(pid_, &local[offset], count,
+                                         &remote[offset], count, 0);
+    if (ret == -1) {
+      PLOG(WARNING) << "process_vm_readv(pid: " << pid_
+                    << " regions: " << count << " size: " << expected << ")";
+      return sapi::UnavailableError("process_vm_readv failed");
+    }
+    if (static_cast<size_t>(ret) != expected) {
+      LOG(WARNING) << "process_vm_readv(pid: " << pid_
+                   << " regions: " << count << " size: " << expected << ")"
+                   << " transferred " << ret << " bytes";
+      return sapi::UnavailableError("process_vm_readv succeeded partially");
+    }
+    for (size_t i = offset; i < offset + count; ++i) {
+      std::fill(fetched_.begin() + runs[2 * i],
+                fetched_.begin() + runs[2 * i + 1], true);
+    }
+    bytes_fetched_ += expected;
+  }
+  return sapi::OkStatus();
+}
+
+}  // namespace v
+}  // namespace sapi
@@ -0,0 +1,113 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_VAR_REMOTE_VIEW_H_
+#define SANDBOXED_API_VAR_REMOTE_VIEW_H_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "sandboxed_api/var_abstract.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+namespace v {
+
+// Read-only view of sandboxee memory which copies it on demand, one page at a
+// time, instead of all of it up front like TransferFromSandboxee(). Meant for
+// large outputs of which only parts are inspected, e.g. headers or samples.
+// Pass the variable with PtrNone() or PtrBefore(), so that the call itself
+// does not copy it back.
+//
+// Pages are copied at most once, the view does not notice later changes in
+// the sandboxee. It becomes invalid when the sandboxee is restarted.
+//
+// Example:
+//   v::Array<uint8_t> out(kOutSize);
+//   SAPI_RETURN_IF_ERROR(api.produce(out.PtrNone(), out.GetSize()));
+//   v::RemoteView view(sandbox->GetPid(), out);
+//   SAPI_ASSIGN_OR_RETURN(absl::Span<const uint8_t> header,
+//                         view.Read(0, sizeof(Header)));
+class RemoteView {
+ public:
+  // Expected access pattern, like the advice of madvise().
+  enum class Advice {
+    // Only the pages being read are copied.
+    kRandom,
+    // Reads following on each other copy a growing number of pages ahead, up
+    // to kMaxReadahead bytes.
+    kSequential,
+  };
+
+  static constexpr size_t kMaxReadahead = 1 << 20;
+
+  // Views 'size' bytes at 'remote' in the sandboxee 'pid'.
+  RemoteView(pid_t pid, const void* remote, size_t size);
+  // Views the remote storage of 'var', which has to be allocated.
+  RemoteView(pid_t pid, const Var& var)
+      : RemoteView(pid, var.GetRemote(), var.GetSize()) {}
+
+  RemoteView(const RemoteView&) = delete;
+  RemoteView& operator=(const RemoteView&) = delete;
+
+  size_t size() const { return size_; }
+
+  void set_advice(Advice advice) { advice_ = advice; }
+
+  // Returns 'length' bytes at 'offset', copying the pages not read before.
+  // The returned memory stays valid for the lifetime of the view.
+  sapi::StatusOr<absl::Span<const uint8_t>> Read(size_t offset, size_t length);
+
+  // Number of bytes copied from the sandboxee so far.
+  size_t bytes_fetched() const { return bytes_fetched_; }
+
+ private:
+  // The view is split into chunks at the page boundaries of the sandboxee.
+  size_t ChunkOf(size_t offset) const {
+    return (page_offset_ + offset) / page_size_;
+  }
+  size_t ChunkBegin(size_t chunk) const;
+  size_t ChunkEnd(size_t chunk) const;
+
+  // Copies the chunks in [first, end) which were not copied yet.
+  sapi::Status Fetch(size_t first, size_t end);
+
+  pid_t pid_;
+  uintptr_t remote_;
+  size_t size_;
+  size_t page_size_;
+  // Offset of the view in its first page.
+  size_t page_offset_;
+  // Local copy, only the pages of the fetched chunks are ever touched.
+  std::unique_ptr<uint8_t[]> data_;
+  std::vector<bool> fetched_;
+
+  Advice advice_ = Advice::kRandom;
+  // End of the previous read, to detect sequential reads.
+  size_t next_offset_ = 0;
+  // Current readahead, in chunks.
+  size_t readahead_ = 0;
+  size_t bytes_fetched_ = 0;
+};
+
+}  // namespace v
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_VAR_REMOTE_VIEW_H_
@@ -0,0 +1,210 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_VAR_SHARED_ARRAY_H_
+#define SANDBOXED_API_VAR_SHARED_ARRAY_H_
+
+#include <sys/uio.h>
+
+#include <memory>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/rpcchannel.h"
+#include "sandboxed_api/sandbox2/buffer.h"
+#include "sandboxed_api/sandbox2/buffer_pool.h"
+#include "sandboxed_api/var_abstract.h"
+#include "sandboxed_api/var_pointable.h"
+#include "sandboxed_api/var_ptr.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+namespace v {
+
+// Array backed by a sandbox2::Buffer which is mapped into both the host and
+// the sandboxee. Both sides see the same memory, so synchronizing pointers to
+// a SharedArray is a no-op. Useful for large buffers which would otherwise be
+// copied before and after every call. Shared arrays cannot be resized.
+//
+// Arrays taken from a sandbox2::BufferPool return their buffer there. If the
+// buffer was mapped once by RPCChannel::ShareBuffers(), using the array in a
+// call needs no round-trip at all.
+//
+// The sandbox has to allow shared buffers, see
+// sapi::Sandbox::UseSharedBuffers().
+template <class T>
+class SharedArray : public Var, public Pointable {
+ public:
+  // Creates a zero-initialized array of 'nelem' elements.
+  static sapi::StatusOr<std::unique_ptr<SharedArray<T>>> Create(size_t nelem) {
+    return Create(nelem, sandbox2::Buffer::kAnyNumaNode);
+  }
+
+  // Creates a zero-initialized array of 'nelem' elements whose pages are
+  // allocated on 'numa_node', e.g. sapi::Sandbox::GetNumaNode() of the
+  // sandbox which consumes it.
+  static sapi::StatusOr<std::unique_ptr<SharedArray<T>>> Create(
+      size_t nelem, int numa_node) {
+    if (nelem == 0) {
+      return sapi::InvalidArgumentError("Shared array must not be empty");
+    }
+    sandbox2::Buffer::Options options;
+    options.numa_node = numa_node;
+    SAPI_ASSIGN_OR_RETURN(
+        std::unique_ptr<sandbox2::Buffer> buffer,
+        sandbox2::Buffer::CreateWithSize(nelem * sizeof(T), options));
+    return absl::WrapUnique(new SharedArray<T>(std::move(buffer), nelem));
+  }
+
+  // Creates an array of 'nelem' elements backed by a buffer from 'pool', which
+  // must outlive the array. The array is zero-initialized unless the pool uses
+  // sandbox2::BufferPool::Scrub::kNone.
+  static sapi::StatusOr<std::unique_ptr<SharedArray<T>>> Create(
+      sandbox2::BufferPool* pool, size_t nelem) {
+    if (nelem == 0) {
+      return sapi::InvalidArgumentError("Shared array must not be empty");
+    }
+    SAPI_ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Buffer> buffer,
+                          pool->Acquire(nelem * sizeof(T)));
+    auto array = absl::WrapUnique(new SharedArray<T>(std::move(buffer), nelem));
+    array->pool_ = pool;
+    return array;
+  }
+
+  ~SharedArray() override {
+    if (pool_ != nullptr) {
+      pool_->Release(std::move(buffer_));
+    }
+  }
+
+  T& operator[](size_t v) const { return GetData()[v]; }
+  T* GetData() const {
+    return buffer_ ? reinterpret_cast<T*>(buffer_->data()) : nullptr;
+  }
+
+  size_t GetNElem() const { return nelem_; }
+  size_t GetSize() const final { return nelem_ * sizeof(T); }
+  Type GetType() const final { return Type::kArray; }
+  std::string GetTypeString() const final { return "SharedArray"; }
+  std::string ToString() const override {
+    return absl::StrCat("SharedArray, elem size: ", sizeof(T),
+                        " B., total size: ", GetSize(),
+                        " B., nelems: ", GetNElem());
+  }
+
+  Ptr* CreatePtr(Pointable::SyncType type) override {
+    return new Ptr(this, type);
+  }
+
+  // Hands the pages of the array over to the sandboxee without copying them,
+  // for large one-shot inputs. The buffer is mapped into the sandboxee unless
+  // it is already, then the host unmaps it and closes the memfd. Afterwards
+  // the array has no local storage, only GetRemote() stays valid, and it is up
+  // to the sandboxee or to RPCChannel::Free() to remove the mapping. Not
+  // supported for buffers of a pool.
+  sapi::Status GiftToSandboxee(RPCChannel* rpc_channel) {
+    if (pool_ != nullptr || preshared_) {
+      return sapi::FailedPreconditionError(
+          "Pooled buffers cannot be handed over to the sandboxee");
+    }
+    if (buffer_ == nullptr) {
+      return sapi::FailedPreconditionError("SharedArray was handed over");
+    }
+    if (GetRemote() == nullptr) {
+      SAPI_RETURN_IF_ERROR(Allocate(rpc_channel, /*automatic_free=*/false));
+    }
+    // The sandboxee's mapping keeps the pages of the memfd alive.
+    SetFreeRPCChannel(nullptr);
+    buffer_.reset();
+    SetLocal(nullptr);
+    return sapi::OkStatus();
+  }
+
+ protected:
+  // Maps the buffer into the sandboxee instead of allocating memory there,
+  // unless it is mapped already.
+  sapi::Status Allocate(RPCChannel* rpc_channel, bool automatic_free) override {
+    void* addr = rpc_channel->GetSharedBufferAddress(buffer_->fd());
+    if (addr != nullptr) {
+      // The mapping is owned by the channel, there is nothing to free.
+      SetRemote(addr);
+      preshared_ = true;
+      return sapi::OkStatus();
+    }
+    SAPI_RETURN_IF_ERROR(
+        rpc_channel->MapSharedBuffer(buffer_->fd(), GetSize(), &addr));
+    SetRemote(addr);
+    if (automatic_free) {
+      SetFreeRPCChannel(rpc_channel);
+    }
+    return sapi::OkStatus();
+  }
+
+  sapi::Status Free(RPCChannel* rpc_channel) override {
+    if (preshared_) {
+      SetRemote(nullptr);
+      preshared_ = false;
+      return sapi::OkStatus();
+    }
+    return Var::Free(rpc_channel);
+  }
+
+  // The memory is shared, there is nothing to transfer.
+  sapi::Status TransferToSandboxee(RPCChannel* rpc_channel,
+                                   pid_t pid) override {
+    return CheckMapped();
+  }
+  sapi::Status TransferFromSandboxee(RPCChannel* rpc_channel,
+                                     pid_t pid) override {
+    return CheckMapped();
+  }
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override {
+    return GetRemote() != nullptr;
+  }
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return GetRemote() != nullptr;
+  }
+
+ private:
+  SharedArray(std::unique_ptr<sandbox2::Buffer> buffer, size_t nelem)
+      : buffer_(std::move(buffer)), nelem_(nelem) {
+    SetLocal(buffer_->data());
+  }
+
+  sapi::Status CheckMapped() const {
+    if (GetRemote() == nullptr) {
+      return sapi::FailedPreconditionError(
+          "SharedArray is not mapped into the sandboxee");
+    }
+    return sapi::OkStatus();
+  }
+
+  std::unique_ptr<sandbox2::Buffer> buffer_;
+  // Number of elements.
+  size_t nelem_;
+  // Pool the buffer is returned to, if any.
+  sandbox2::BufferPool* pool_ = nullptr;
+  // Whether the buffer was mapped by RPCChannel::ShareBuffers().
+  bool preshared_ = false;
+};
+
+}  // namespace v
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_VAR_SHARED_ARRAY_H_
@@ -0,0 +1,77 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sandboxed_api/var_stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "sandboxed_api/sandbox2/util/strerror.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status_macros.h"
+
+namespace sapi {
+namespace v {
+
+sapi::StatusOr<std::unique_ptr<Stream>> Stream::Create() {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return sapi::InternalError(
+        absl::StrCat("Could not create stream pipe: ", sandbox2::StrError(errno)));
+  }
+  return absl::WrapUnique(new Stream(fds[0], fds[1]));
+}
+
+Stream::~Stream() {
+  if (close(read_fd_) != 0) {
+    PLOG(WARNING) << "close(" << read_fd_ << ") failed";
+  }
+}
+
+sapi::StatusOr<size_t> Stream::Read(void* buf, size_t size) {
+  ssize_t ret;
+  do {
+    ret = read(read_fd_, buf, size);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    return sapi::InternalError(
+        absl::StrCat("Could not read from stream: ", sandbox2::StrError(errno)));
+  }
+  return static_cast<size_t>(ret);
+}
+
+sapi::Status Stream::ReadAll(std::string* out) {
+  char buf[4096];
+  while (true) {
+    SAPI_ASSIGN_OR_RETURN(size_t n, Read(buf, sizeof(buf)));
+    if (n == 0) {
+      return sapi::OkStatus();
+    }
+    out->append(buf, n);
+  }
+}
+
+void Stream::SetTransferredToSandboxee(RPCChannel* rpc_channel,
+                                       int remote_fd) {
+  Fd::SetTransferredToSandboxee(rpc_channel, remote_fd);
+  CloseLocalFd();
+}
+
+}  // namespace v
+}  // namespace sapi
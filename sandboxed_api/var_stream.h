@@ -0,0 +1,89 @@
+// Copyright 2019 Google LLC. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDBOXED_API_VAR_STREAM_H_
+#define SANDBOXED_API_VAR_STREAM_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "sandboxed_api/var_int.h"
+#include "sandboxed_api/util/status.h"
+#include "sandboxed_api/util/statusor.h"
+
+namespace sapi {
+namespace v {
+
+// Output channel through which a sandboxed function can emit its results
+// while it is running. A Stream is a pipe: it is passed like a v::Fd, so the
+// function receives the write end as an int and write()s chunks to it as they
+// become available. The host reads them with Read(), usually on another
+// thread, while the call is still running. This avoids pre-allocating and
+// transferring back a buffer for the whole output.
+//
+// The host's copy of the write end is closed once it was sent to the
+// sandboxee, so Read() reports the end of the stream as soon as the
+// sandboxee's copy is closed, either by the sandboxed function itself or with
+// CloseRemoteFd(). A stream can only be used in a single sandboxee.
+//
+// Example:
+//   SAPI_ASSIGN_OR_RETURN(auto stream, sapi::v::Stream::Create());
+//   std::thread consumer([&stream] {
+//     char buf[4096];
+//     sapi::StatusOr<size_t> n;
+//     while ((n = stream->Read(buf, sizeof(buf))).ok() && n.ValueOrDie() > 0) {
+//       Consume(buf, n.ValueOrDie());
+//     }
+//   });
+//   sapi::StatusOr<int> ret = api.produce(stream.get());
+//   // Signals the end of the stream, unless produce() closed the fd itself.
+//   stream->CloseRemoteFd(sandbox.GetRpcChannel()).IgnoreError();
+//   consumer.join();
+class Stream : public Fd {
+ public:
+  // Creates a new pipe.
+  static sapi::StatusOr<std::unique_ptr<Stream>> Create();
+
+  ~Stream() override;
+
+  std::string GetTypeString() const override { return "Stream"; }
+
+  // Returns the read end of the pipe, e.g. to poll() it.
+  int read_fd() const { return read_fd_; }
+
+  // Reads up to 'size' bytes written by the sandboxee into 'buf'. Blocks until
+  // data is available. Returns the number of bytes read, 0 at the end of the
+  // stream.
+  sapi::StatusOr<size_t> Read(void* buf, size_t size);
+
+  // Reads all remaining data until the end of the stream and appends it to
+  // 'out'.
+  sapi::Status ReadAll(std::string* out);
+
+ protected:
+  // Closes the host's copy of the write end once the sandboxee has its own.
+  void SetTransferredToSandboxee(RPCChannel* rpc_channel,
+                                 int remote_fd) override;
+
+ private:
+  Stream(int read_fd, int write_fd) : Fd(write_fd), read_fd_(read_fd) {}
+
+  int read_fd_;
+};
+
+}  // namespace v
+}  // namespace sapi
+
+#endif  // SANDBOXED_API_VAR_STREAM_H_
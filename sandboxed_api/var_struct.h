@@ -15,16 +15,33 @@
 #ifndef SANDBOXED_API_VAR_STRUCT_H_
 #define SANDBOXED_API_VAR_STRUCT_H_
 
+#include <sys/uio.h>
+
+#include <cstddef>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "absl/strings/str_cat.h"
+#include "sandboxed_api/util/canonical_errors.h"
+#include "sandboxed_api/util/status.h"
 #include "sandboxed_api/var_pointable.h"
 #include "sandboxed_api/var_ptr.h"
 
+// Returns the v::FieldRange of the member 'field' of the struct 'type'.
+#define SAPI_STRUCT_FIELD(type, field) \
+  ::sapi::v::FieldRange { offsetof(type, field), sizeof(type::field) }
+
 namespace sapi {
 namespace v {
 
+// Bytes of a structure, see Struct::SyncFields().
+struct FieldRange {
+  size_t offset;
+  size_t size;
+};
+
 // Class representing a structure.
 template <class T>
 class Struct : public Var, public Pointable {
@@ -45,14 +62,83 @@ class Struct : public Var, public Pointable {
   const T& data() const { return struct_; }
   T* mutable_data() { return &struct_; }
 
+  // Restricts the synchronization around the following calls to the fields
+  // they use, e.g. for large context structs of which a call reads two fields
+  // and updates one:
+  //   ctx.SyncFields(
+  //       {SAPI_STRUCT_FIELD(ctx_t, in), SAPI_STRUCT_FIELD(ctx_t, len)},
+  //       {SAPI_STRUCT_FIELD(ctx_t, out)});
+  // The ranges of both directions are copied with the other variables of the
+  // call, in the same process_vm_writev()/process_vm_readv(). An empty list
+  // copies nothing in that direction. Fails without changing the ranges if
+  // any of them does not lie within the struct.
+  // Explicit Sandbox::TransferToSandboxee()/TransferFromSandboxee() calls
+  // still copy the whole struct.
+  sapi::Status SyncFields(std::vector<FieldRange> to_sandboxee,
+                          std::vector<FieldRange> from_sandboxee) {
+    for (const auto* fields : {&to_sandboxee, &from_sandboxee}) {
+      for (const FieldRange& field : *fields) {
+        // Written so that it cannot overflow.
+        if (field.offset > sizeof(T) || field.size > sizeof(T) - field.offset) {
+          return sapi::InvalidArgumentError(
+              absl::StrCat("Field range [", field.offset, ", +", field.size,
+                           ") exceeds the struct of size ", sizeof(T)));
+        }
+      }
+    }
+    partial_sync_ = true;
+    to_sandboxee_ = std::move(to_sandboxee);
+    from_sandboxee_ = std::move(from_sandboxee);
+    return sapi::OkStatus();
+  }
+
+  // Synchronizes the whole struct again, the default.
+  void SyncWholeStruct() {
+    partial_sync_ = false;
+    to_sandboxee_.clear();
+    from_sandboxee_.clear();
+  }
+
   Ptr* CreatePtr(Pointable::SyncType type) override {
     return new Ptr(this, type);
   }
 
  protected:
+  bool GetRegionsToSandboxee(std::vector<iovec>* local,
+                             std::vector<iovec>* remote) override {
+    return partial_sync_ ? GetFieldRegions(to_sandboxee_, local, remote)
+                         : Var::GetRegionsToSandboxee(local, remote);
+  }
+
+  bool GetRegionsFromSandboxee(std::vector<iovec>* local,
+                               std::vector<iovec>* remote) override {
+    return partial_sync_ ? GetFieldRegions(from_sandboxee_, local, remote)
+                         : Var::GetRegionsFromSandboxee(local, remote);
+  }
+
   T struct_;
 
   friend class LenVal;
+
+ private:
+  bool GetFieldRegions(const std::vector<FieldRange>& fields,
+                       std::vector<iovec>* local, std::vector<iovec>* remote) {
+    if (GetRemote() == nullptr) {
+      // Let the full transfer report the error.
+      return false;
+    }
+    char* local_base = reinterpret_cast<char*>(&struct_);
+    char* remote_base = reinterpret_cast<char*>(GetRemote());
+    for (const FieldRange& field : fields) {
+      local->push_back({local_base + field.offset, field.size});
+      remote->push_back({remote_base + field.offset, field.size});
+    }
+    return true;
+  }
+
+  bool partial_sync_ = false;
+  std::vector<FieldRange> to_sandboxee_;
+  std::vector<FieldRange> from_sandboxee_;
 };
 
 }  // namespace v
@@ -17,10 +17,15 @@
 
 #include "sandboxed_api/var_array.h"
 #include "sandboxed_api/var_int.h"
+#include "sandboxed_api/var_lazy_array.h"
 #include "sandboxed_api/var_lenval.h"
 #include "sandboxed_api/var_pointable.h"
 #include "sandboxed_api/var_proto.h"
 #include "sandboxed_api/var_ptr.h"
+#include "sandboxed_api/var_record_array.h"
+#include "sandboxed_api/var_remote_view.h"
+#include "sandboxed_api/var_shared_array.h"
+#include "sandboxed_api/var_stream.h"
 #include "sandboxed_api/var_struct.h"
 #include "sandboxed_api/var_void.h"
 